@@ -32,6 +32,9 @@
 #include "config.h"
 #endif
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,20 +42,26 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "cbt-util.h"
 #include "cbt-util-priv.h"
+#include "libvhd.h"
 
 int cbt_util_create(int , char **);
 int cbt_util_set(int , char **);
 int cbt_util_get(int , char **);
 int cbt_util_coalesce(int , char **);
+int cbt_util_extents(int , char **);
 
 struct command commands[] = {
 	{ .name = "create", .func = cbt_util_create},
 	{ .name = "set", .func = cbt_util_set},
 	{ .name = "get", .func = cbt_util_get},
 	{ .name = "coalesce", .func = cbt_util_coalesce},
+	{ .name = "extents", .func = cbt_util_extents},
 };
 
 #define print_commands()					\
@@ -143,6 +152,167 @@ read_cbt_bitmap(FILE *f, struct cbt_log_data *log_data)
 	return err;
 }
 
+/*
+ * Returns the first block in [nr, end) of bitmap chunk @map whose bit
+ * equals @set, or @end. Bits are LSB first within each byte, the layout
+ * block-log writes on little-endian hosts; whole 64-bit words are looked
+ * at a time.
+ */
+static uint64_t
+cbt_bitmap_scan(const unsigned char *map, uint64_t nr, uint64_t end, int set)
+{
+	while (nr < end) {
+		uint64_t base = nr & ~63ULL, word;
+
+		if (base + 64 > end)
+			break;
+
+		memcpy(&word, map + (base >> 3), sizeof(word));
+		word = le64toh(word);
+		if (!set)
+			word = ~word;
+		word &= ~0ULL << (nr - base);
+		if (word)
+			return base + __builtin_ctzll(word);
+
+		nr = base + 64;
+	}
+
+	for (; nr < end; nr++)
+		if (!!(map[nr >> 3] & (1 << (nr & 7))) == !!set)
+			break;
+
+	return nr;
+}
+
+int
+cbt_log_has_fine(FILE *f, uint64_t size)
+{
+	struct stat st;
+	int fd = fileno(f);
+
+	if (fd < 0 || fstat(fd, &st))
+		return 0;
+
+	return (uint64_t)st.st_size >=
+		fine_bitmap_offset(size) + fine_bitmap_size(size);
+}
+
+static int
+cbt_buf_zero(const char *buf, size_t len)
+{
+	return !len || (!buf[0] && !memcmp(buf, buf + 1, len - 1));
+}
+
+/*
+ * Writes the @len byte fine layer in @fbuf, read from @old_off, at
+ * @new_off past a grown coarse bitmap and extends the file to hold
+ * @new_len bytes of it. The stale tail of the old layer is punched out
+ * so all-zero pages can stay holes; where that is not supported every
+ * page is written.
+ */
+static int
+cbt_log_move_fine(char *name, int fd, const char *fbuf, uint64_t len,
+		  uint64_t old_off, uint64_t new_off, uint64_t new_len)
+{
+	uint64_t i, n;
+	int dense = 0;
+
+	if (old_off + len > new_off)
+		dense = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				  new_off, old_off + len - new_off) != 0;
+
+	for (i = 0; i < len; i += n) {
+		n = MIN(len - i, CBT_FINE_BLOCK_SIZE);
+		if (!dense && cbt_buf_zero(fbuf + i, n))
+			continue;
+
+		if (pwrite(fd, fbuf + i, n, new_off + i) != (ssize_t)n) {
+			fprintf(stderr, "Failed to write fine bitmap to file %s\n",
+				name);
+			return -EIO;
+		}
+	}
+
+	if (ftruncate(fd, new_off + new_len)) {
+		fprintf(stderr, "Failed to extend log file %s. %s\n",
+			name, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Folds the fine layer of the parent into that of the child for every
+ * block set in the parent's coarse @pbitmap. Parent blocks without
+ * sub-block detail mark the whole block in the child.
+ */
+static int
+cbt_log_coalesce_fine(char *child, FILE *fparent, uint64_t psize,
+		      FILE *fchild, uint64_t csize, const char *pbitmap)
+{
+	const unsigned char *map = (const unsigned char *)pbitmap;
+	unsigned char *pbuf = NULL, *cbuf;
+	uint64_t blocks, b, e, cur, n, i;
+	int pfine, err = 0;
+
+	blocks = MIN(roundup_div(psize, CBT_BLOCK_SIZE),
+		     roundup_div(csize, CBT_BLOCK_SIZE));
+	pfine  = cbt_log_has_fine(fparent, psize);
+
+	cbuf = malloc(CBT_EXTENT_CHUNK);
+	if (pfine)
+		pbuf = malloc(CBT_EXTENT_CHUNK);
+	if (!cbuf || (pfine && !pbuf)) {
+		fprintf(stderr, "Failed to allocate memory for bitmap buffer\n");
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (b = cbt_bitmap_scan(map, 0, blocks, 1); b < blocks;
+	     b = cbt_bitmap_scan(map, e, blocks, 1)) {
+		e = cbt_bitmap_scan(map, b, blocks, 0);
+
+		for (cur = b; cur < e; cur += n) {
+			off_t coff = fine_bitmap_offset(csize) + cur * 2;
+			off_t poff = fine_bitmap_offset(psize) + cur * 2;
+
+			n = MIN(e - cur, CBT_EXTENT_CHUNK / 2);
+
+			if (pread(fileno(fchild), cbuf, n * 2, coff) != (ssize_t)n * 2 ||
+			    (pfine &&
+			     pread(fileno(fparent), pbuf, n * 2, poff) != (ssize_t)n * 2)) {
+				fprintf(stderr, "Failed to read fine bitmap\n");
+				err = -EIO;
+				goto out;
+			}
+
+			for (i = 0; i < n * 2; i += 2) {
+				if (pfine && (pbuf[i] || pbuf[i + 1])) {
+					cbuf[i]     |= pbuf[i];
+					cbuf[i + 1] |= pbuf[i + 1];
+				} else {
+					cbuf[i]      = 0xff;
+					cbuf[i + 1]  = 0xff;
+				}
+			}
+
+			if (pwrite(fileno(fchild), cbuf, n * 2, coff) != (ssize_t)n * 2) {
+				fprintf(stderr, "Failed to write fine bitmap to log "
+					"file %s\n", child);
+				err = -EIO;
+				goto out;
+			}
+		}
+	}
+
+out:
+	free(pbuf);
+	free(cbuf);
+	return err;
+}
+
 int
 cbt_util_get(int argc, char **argv)
 {
@@ -282,16 +452,20 @@ usage:
 int 
 cbt_util_set(int argc, char **argv)
 {
-	char *name, *parent, *child, *buf;
-	int err, c, consistent, flag = 0, ret; 
+	char *name, *parent, *child, *buf, *fbuf;
+	int err, c, consistent, flag = 0, ret, fine;
 	FILE *f = NULL;
-	uint64_t size, bmsize, old_bmsize;
+	uint64_t size, bmsize, old_bmsize, fine_len;
 
 	err 		= 0;
 	name 		= NULL;
 	parent		= NULL;
 	child		= NULL;
 	buf			= NULL;
+	fbuf		= NULL;
+	fine		= 0;
+	fine_len	= 0;
+	consistent	= 0;
 	size		= 0;
 	bmsize		= 0; 
 	old_bmsize 	= 0;
@@ -389,6 +563,29 @@ cbt_util_set(int argc, char **argv)
 		}
 
 		memset(buf + old_bmsize, 0, bmsize - old_bmsize);
+
+		// The fine layer sits right after the coarse bitmap, read it
+		// before the grown coarse bitmap overwrites its start
+		fine = cbt_log_has_fine(f, log_meta->size);
+		if (fine) {
+			fine_len = fine_bitmap_size(log_meta->size);
+			fbuf = malloc(fine_len);
+			if (!fbuf) {
+				fprintf(stderr, "Failed to allocate memory for fine "
+						"bitmap buffer\n");
+				err = -ENOMEM;
+				goto error;
+			}
+
+			if (pread(fileno(f), fbuf, fine_len,
+				  fine_bitmap_offset(log_meta->size)) != (ssize_t)fine_len) {
+				fprintf(stderr, "Failed to read fine bitmap from file %s\n",
+									name);
+				err = -EIO;
+				goto error;
+			}
+		}
+
 		// Set file pointer to start of bitmap area
 		ret = fseek(f, sizeof(struct cbt_log_metadata), SEEK_SET);
 		if(ret < 0) {
@@ -403,6 +600,16 @@ cbt_util_set(int argc, char **argv)
 			fprintf(stderr, "Failed to write CBT bitmap to file %s\n", name);
 			err = -EIO;
 		}
+
+		if (fine && !err) {
+			fflush(f);
+			err = cbt_log_move_fine(name, fileno(f), fbuf, fine_len,
+						fine_bitmap_offset(log_meta->size),
+						fine_bitmap_offset(size),
+						fine_bitmap_size(size));
+			if (err)
+				goto error;
+		}
                                                                                 
 		log_meta->size = size;
 	}
@@ -425,6 +632,8 @@ cbt_util_set(int argc, char **argv)
 error:
 	if(buf)
 		free(buf);
+	if(fbuf)
+		free(fbuf);
 	if(log_meta)
 		free(log_meta);
 	if(f)
@@ -448,13 +657,14 @@ int
 cbt_util_create(int argc, char **argv)
 {
 	char *name;
-	int err, c, ret;
+	int err, c, ret, fine;
 	FILE *f = NULL; 
 	uint64_t size, bitmap_sz;
 
 	err  = 0;
 	name = NULL;
 	size = 0;
+	fine = 0;
 
 	if (!argc || !argv)
 		goto usage;
@@ -462,7 +672,7 @@ cbt_util_create(int argc, char **argv)
 	/* Make sure we start from the start of the args */
 	optind = 1;
 
-	while ((c = getopt(argc, argv, "n:s:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:s:Fh")) != -1) {
 		switch (c) {
 			case 'n':
 				name = optarg;
@@ -470,6 +680,9 @@ cbt_util_create(int argc, char **argv)
 			case 's':
 				size = strtoull(optarg, NULL, 10);
 				break;
+			case 'F':
+				fine = 1;
+				break;
 			case 'h':
 			default:
 				goto usage;
@@ -526,6 +739,18 @@ cbt_util_create(int argc, char **argv)
 	else {
 		DPRINTF("Bitmap area of %"PRIu64" bytes initialised\n", bitmap_sz);
 	}
+
+	// The fine layer starts out as a hole
+	if (fine) {
+		fflush(f);
+		if (ftruncate(fileno(f), fine_bitmap_offset(size) +
+					 fine_bitmap_size(size))) {
+			fprintf(stderr, "Failed to size log file %s. %s\n",
+											name, strerror(errno));
+			err = -errno;
+			goto error;
+		}
+	}
 	
 
 error:
@@ -543,7 +768,7 @@ error:
 usage:
 	printf("cbt-util create: Create new CBT metadata log with default values\n\n");
 	printf("Options:\n\t-n Log file name\n\t-s Num blocks in bitmap\n"
-			"\t[-h help]\n");
+			"\t[-F Also track 4K sub-blocks]\n\t[-h help]\n");
 
 	return -EINVAL;
 }
@@ -669,6 +894,16 @@ cbt_util_coalesce(int argc, char **argv)
 		goto error;
 	}
 
+	if (cbt_log_has_fine(fchild, child_log->metadata.size)) {
+		fflush(fchild);
+		err = cbt_log_coalesce_fine(child, fparent,
+					    parent_log->metadata.size, fchild,
+					    child_log->metadata.size,
+					    parent_log->bitmap);
+		if (err)
+			goto error;
+	}
+
 error:
 	if (parent_log) {
 		if (parent_log->bitmap)
@@ -698,6 +933,398 @@ usage:
 
 }
 
+static int
+cbt_log_scan_extents(FILE *f, uint64_t size, cbt_extent_fn_t fn, void *arg)
+{
+	uint64_t bmsize, blocks, done, first, bits, b, e;
+	uint64_t run_start, run_end;
+	unsigned char *buf;
+	size_t len;
+	int err, open;
+
+	err       = 0;
+	open      = 0;
+	run_start = 0;
+	run_end   = 0;
+	bmsize    = bitmap_size(size);
+	blocks    = roundup_div(size, CBT_BLOCK_SIZE);
+
+	buf = malloc(CBT_EXTENT_CHUNK);
+	if (!buf) {
+		fprintf(stderr, "Failed to allocate memory for bitmap buffer\n");
+		return -ENOMEM;
+	}
+
+	for (done = 0; done < bmsize; done += len) {
+		len = bmsize - done;
+		if (len > CBT_EXTENT_CHUNK)
+			len = CBT_EXTENT_CHUNK;
+
+		if (fread(buf, len, 1, f) != 1) {
+			fprintf(stderr, "Failed to read bitmap\n");
+			err = -EIO;
+			goto out;
+		}
+
+		first = done << 3;
+		bits  = blocks - first;
+		if (bits > (uint64_t)len << 3)
+			bits = (uint64_t)len << 3;
+
+		for (b = cbt_bitmap_scan(buf, 0, bits, 1); b < bits;
+		     b = cbt_bitmap_scan(buf, e, bits, 1)) {
+			e = cbt_bitmap_scan(buf, b, bits, 0);
+
+			/* runs only ever continue across a chunk boundary */
+			if (open && run_end == first + b) {
+				run_end = first + e;
+				continue;
+			}
+
+			if (open) {
+				err = fn(run_start * CBT_BLOCK_SIZE,
+					 (run_end - run_start) * CBT_BLOCK_SIZE,
+					 arg);
+				if (err)
+					goto out;
+			}
+
+			open      = 1;
+			run_start = first + b;
+			run_end   = first + e;
+		}
+	}
+
+	if (open) {
+		uint64_t end = run_end * CBT_BLOCK_SIZE;
+
+		if (end > size)
+			end = size;
+		err = fn(run_start * CBT_BLOCK_SIZE,
+			 end - run_start * CBT_BLOCK_SIZE, arg);
+	}
+
+out:
+	free(buf);
+	return err;
+}
+
+/*
+ * Splits coarse runs along the sub-blocks set in the fine layer, merging
+ * the pieces again before passing them on.
+ */
+struct cbt_fine_refine {
+	int				fd;
+	uint64_t		size;
+	cbt_extent_fn_t	fn;
+	void			*arg;
+	unsigned char	*buf;
+	uint64_t		start;
+	uint64_t		end;
+	int				open;
+};
+
+static int
+cbt_fine_refine_add(struct cbt_fine_refine *r, uint64_t start, uint64_t end)
+{
+	int err;
+
+	end = MIN(end, r->size);
+	if (start >= end)
+		return 0;
+
+	if (r->open && r->end == start) {
+		r->end = end;
+		return 0;
+	}
+
+	if (r->open) {
+		err = r->fn(r->start, r->end - r->start, r->arg);
+		if (err)
+			return err;
+	}
+
+	r->open  = 1;
+	r->start = start;
+	r->end   = end;
+
+	return 0;
+}
+
+static int
+cbt_fine_refine(uint64_t off, uint64_t len, void *arg)
+{
+	struct cbt_fine_refine *r = arg;
+	uint64_t blk, end, n, i, base;
+	unsigned int mask, b, e;
+	int err;
+
+	blk = off / CBT_BLOCK_SIZE;
+	end = roundup_div(off + len, CBT_BLOCK_SIZE);
+
+	while (blk < end) {
+		n = MIN(end - blk, CBT_EXTENT_CHUNK / 2);
+
+		if (pread(r->fd, r->buf, n * 2, fine_bitmap_offset(r->size) +
+			  blk * 2) != (ssize_t)n * 2) {
+			fprintf(stderr, "Failed to read fine bitmap\n");
+			return -EIO;
+		}
+
+		for (i = 0; i < n; i++, blk++) {
+			base = blk * CBT_BLOCK_SIZE;
+			mask = r->buf[i * 2] | r->buf[i * 2 + 1] << 8;
+
+			/* no detail recorded, the whole block changed */
+			if (!mask) {
+				err = cbt_fine_refine_add(r, base,
+							  base + CBT_BLOCK_SIZE);
+				if (err)
+					return err;
+				continue;
+			}
+
+			while (mask) {
+				b = __builtin_ctz(mask);
+				e = b + __builtin_ctz(~(mask >> b));
+				mask &= ~0U << e;
+
+				err = cbt_fine_refine_add(r,
+						base + b * CBT_FINE_BLOCK_SIZE,
+						base + e * CBT_FINE_BLOCK_SIZE);
+				if (err)
+					return err;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int
+cbt_log_read_extents(FILE *f, uint64_t size, cbt_extent_fn_t fn, void *arg)
+{
+	struct cbt_fine_refine r;
+	int err;
+
+	if (!cbt_log_has_fine(f, size))
+		return cbt_log_scan_extents(f, size, fn, arg);
+
+	memset(&r, 0, sizeof(r));
+	r.fd   = fileno(f);
+	r.size = size;
+	r.fn   = fn;
+	r.arg  = arg;
+	r.buf  = malloc(CBT_EXTENT_CHUNK);
+	if (!r.buf) {
+		fprintf(stderr, "Failed to allocate memory for bitmap buffer\n");
+		return -ENOMEM;
+	}
+
+	err = cbt_log_scan_extents(f, size, cbt_fine_refine, &r);
+	if (!err && r.open)
+		err = fn(r.start, r.end - r.start, arg);
+
+	free(r.buf);
+	return err;
+}
+
+/*
+ * Narrows changed runs down to the CBT blocks that hold data allocated in
+ * a VHD, and merges what is left again before printing it.
+ */
+struct cbt_extent_filter {
+	vhd_context_t	*vhd;
+	uint32_t		bm_block;
+	char			*bitmap;
+	uint64_t		start;
+	uint64_t		end;
+	int				open;
+};
+
+static int
+cbt_extent_print(uint64_t off, uint64_t len, void *arg)
+{
+	printf("%"PRIu64" %"PRIu64"\n", off, len);
+	return 0;
+}
+
+static void
+cbt_extent_filter_add(struct cbt_extent_filter *flt, uint64_t start,
+		      uint64_t end)
+{
+	if (flt->open && start <= flt->end) {
+		if (end > flt->end)
+			flt->end = end;
+		return;
+	}
+
+	if (flt->open)
+		cbt_extent_print(flt->start, flt->end - flt->start, NULL);
+
+	flt->open  = 1;
+	flt->start = start;
+	flt->end   = end;
+}
+
+static int
+cbt_extent_filter_vhd(uint64_t off, uint64_t len, void *arg)
+{
+	struct cbt_extent_filter *flt = arg;
+	vhd_context_t *vhd = flt->vhd;
+	uint64_t cur, end, blk_off, blk_bytes;
+	uint32_t blk, s, e, a, z;
+	int err;
+
+	if (!vhd_type_dynamic(vhd)) {
+		cbt_extent_filter_add(flt, off, off + len);
+		return 0;
+	}
+
+	blk_bytes = vhd_sectors_to_bytes(vhd->spb);
+
+	for (cur = off, end = off + len; cur < end; cur = blk_off + blk_bytes) {
+		blk     = cur / blk_bytes;
+		blk_off = (uint64_t)blk * blk_bytes;
+
+		if (blk >= vhd->bat.entries ||
+		    vhd->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+
+		if (!flt->bitmap || flt->bm_block != blk) {
+			free(flt->bitmap);
+			flt->bitmap = NULL;
+
+			err = vhd_read_bitmap(vhd, blk, &flt->bitmap);
+			if (err) {
+				fprintf(stderr, "Failed to read bitmap of VHD "
+					"block %u: %d\n", blk, err);
+				return err;
+			}
+			flt->bm_block = blk;
+		}
+
+		s = (cur - blk_off) >> VHD_SECTOR_SHIFT;
+		e = (MIN(end, blk_off + blk_bytes) - blk_off + VHD_SECTOR_SIZE - 1)
+			>> VHD_SECTOR_SHIFT;
+
+		for (a = vhd_bitmap_scan(vhd, flt->bitmap, s, e, 1); a < e;
+		     a = vhd_bitmap_scan(vhd, flt->bitmap, z, e, 1)) {
+			uint64_t rs, re;
+
+			z  = vhd_bitmap_scan(vhd, flt->bitmap, a, e, 0);
+
+			/* whole CBT blocks, within the changed run */
+			rs = blk_off + vhd_sectors_to_bytes(a);
+			re = blk_off + vhd_sectors_to_bytes(z);
+			rs = rs / CBT_BLOCK_SIZE * CBT_BLOCK_SIZE;
+			re = roundup_div(re, CBT_BLOCK_SIZE) * CBT_BLOCK_SIZE;
+
+			cbt_extent_filter_add(flt, MAX(rs, cur), MIN(re, end));
+		}
+	}
+
+	return 0;
+}
+
+int
+cbt_util_extents(int argc, char **argv)
+{
+	char *name, *vhd_name;
+	int err, c;
+	FILE *f = NULL;
+	struct cbt_log_metadata *log_meta = NULL;
+	struct cbt_extent_filter flt;
+	vhd_context_t vhd;
+
+	err			= 0;
+	name		= NULL;
+	vhd_name	= NULL;
+	memset(&flt, 0, sizeof(flt));
+
+	if (!argc || !argv)
+		goto usage;
+
+	/* Make sure we start from the start of the args */
+	optind = 1;
+
+	while ((c = getopt(argc, argv, "n:v:h")) != -1) {
+		switch (c) {
+			case 'n':
+				name = optarg;
+				break;
+			case 'v':
+				vhd_name = optarg;
+				break;
+			case 'h':
+			default:
+				goto usage;
+		}
+	}
+
+	if (!name)
+		goto usage;
+
+	log_meta = malloc(sizeof(struct cbt_log_metadata));
+	if (!log_meta) {
+		fprintf(stderr, "Failed to allocate memory for CBT log metadata\n");
+		err = -ENOMEM;
+		goto error;
+	}
+
+	err = file_open(&f, name, "r");
+	if (err)
+		goto error;
+
+	err = read_cbt_metadata(name, f, log_meta);
+	if (err)
+		goto error;
+
+	if (!vhd_name) {
+		err = cbt_log_read_extents(f, log_meta->size,
+					   cbt_extent_print, NULL);
+		goto error;
+	}
+
+	err = vhd_open(&vhd, vhd_name, VHD_OPEN_RDONLY);
+	if (err) {
+		fprintf(stderr, "Failed to open VHD %s: %d\n", vhd_name, err);
+		goto error;
+	}
+
+	flt.vhd = &vhd;
+
+	err = vhd_type_dynamic(&vhd) ? vhd_get_bat(&vhd) : 0;
+	if (err)
+		fprintf(stderr, "Failed to read BAT of %s: %d\n", vhd_name, err);
+	else
+		err = cbt_log_read_extents(f, log_meta->size,
+					   cbt_extent_filter_vhd, &flt);
+
+	if (!err && flt.open)
+		cbt_extent_print(flt.start, flt.end - flt.start, NULL);
+
+	free(flt.bitmap);
+	vhd_close(&vhd);
+
+error:
+	if (log_meta)
+		free(log_meta);
+	if (f)
+		fclose(f);
+	return err;
+
+usage:
+	printf("cbt-util extents: Print changed ranges as \"offset length\" "
+	       "lines, in bytes\n\n");
+	printf("Options:\n");
+	printf(" -n name\tName of log file\n");
+	printf("[-v vhd]\tOnly report ranges allocated in this VHD\n");
+	printf("[-h]\t\thelp\n");
+
+	return -EINVAL;
+}
+
 void
 help(void)
 {
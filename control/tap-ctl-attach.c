@@ -40,6 +40,24 @@
 
 #include "tap-ctl.h"
 
+int
+tap_ctl_attach_response(const int id, tapdisk_message_t *message)
+{
+	int err;
+
+	if (message->type == TAPDISK_MESSAGE_ATTACH_RSP) {
+		err = message->u.response.error;
+		if (err)
+			EPRINTF("attach failed: %d\n", err);
+	} else {
+		EPRINTF("got unexpected result '%s' from %d\n",
+			tapdisk_message_name(message->type), id);
+		err = EINVAL;
+	}
+
+	return err;
+}
+
 int
 tap_ctl_attach(const int id, const int minor)
 {
@@ -54,15 +72,5 @@ tap_ctl_attach(const int id, const int minor)
 	if (err)
 		return err;
 
-	if (message.type == TAPDISK_MESSAGE_ATTACH_RSP) {
-		err = message.u.response.error;
-		if (err)
-			EPRINTF("attach failed: %d\n", err);
-	} else {
-		EPRINTF("got unexpected result '%s' from %d\n",
-			tapdisk_message_name(message.type), id);
-		err = EINVAL;
-	}
-
-	return err;
+	return tap_ctl_attach_response(id, &message);
 }
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "tap-ctl.h"
+
+static int
+__tap_ctl_clone_file(const char *src, const char *dst)
+{
+	struct stat st;
+	int err, in, out;
+
+	in = open(src, O_RDONLY | O_LARGEFILE);
+	if (in == -1)
+		return -errno;
+
+	err = 0;
+	out = -1;
+
+	if (fstat(in, &st) == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	out = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE,
+		   st.st_mode & 0777);
+	if (out == -1) {
+		err = -errno;
+		goto out;
+	}
+
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == -1)
+		err = (errno == ENOTTY || errno == EXDEV || errno == EINVAL ?
+		       -EOPNOTSUPP : -errno);
+#else
+	err = -EOPNOTSUPP;
+#endif
+
+out:
+	if (out != -1) {
+		close(out);
+		if (err)
+			unlink(dst);
+	}
+	close(in);
+	return err;
+}
+
+int
+tap_ctl_clone(pid_t pid, int minor, const char *path)
+{
+	struct list_head list = LIST_HEAD_INIT(list);
+	tap_list_t *entry, *vbd;
+	int err, ret;
+
+	err = tap_ctl_list_pid(pid, &list);
+	if (err)
+		return err;
+
+	vbd = NULL;
+	tap_list_for_each_entry(entry, &list)
+		if (entry->minor == minor && entry->path) {
+			vbd = entry;
+			break;
+		}
+
+	if (!vbd) {
+		EPRINTF("no VBD %d in tapdisk %d\n", minor, pid);
+		err = -ENOENT;
+		goto out;
+	}
+
+	if (!vbd->type || strcmp(vbd->type, "aio")) {
+		EPRINTF("clone of %s:%s not supported, only of aio images\n",
+			vbd->type ? : "", vbd->path);
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+
+	err = tap_ctl_pause(pid, minor, NULL);
+	if (err)
+		goto out;
+
+	err = __tap_ctl_clone_file(vbd->path, path);
+	if (err)
+		EPRINTF("clone of %s to %s failed: %s\n",
+			vbd->path, path, strerror(-err));
+
+	ret = tap_ctl_unpause(pid, minor, NULL, 0, NULL, NULL);
+	if (!err)
+		err = ret;
+
+out:
+	tap_ctl_list_free(&list);
+	return err;
+}
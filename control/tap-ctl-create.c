@@ -36,16 +36,78 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <getopt.h>
 
 #include "tap-ctl.h"
 #include "blktap2.h"
 
+/*
+ * Attaches and opens over a single session, sending both requests before
+ * waiting for either response.
+ *
+ * @returns 0 on success, and in @attached whether the attach succeeded
+ */
+static int
+tap_ctl_create_session(const int id, const int minor, const char *params,
+		       int flags, int parent_minor, char *secondary,
+		       int timeout, int cache_size, const char *logpath,
+		       int *attached)
+{
+	tap_ctl_session_t session;
+	tapdisk_message_t attach, open;
+	int err, err2;
+
+	*attached = 0;
+
+	memset(&attach, 0, sizeof(attach));
+	attach.type = TAPDISK_MESSAGE_ATTACH;
+	attach.cookie = minor;
+
+	err = tap_ctl_open_message(&open, minor, params, flags, parent_minor,
+				   secondary, timeout, cache_size);
+	if (err)
+		return err;
+
+	err = tap_ctl_session_open(id, &session);
+	if (err)
+		return err;
+
+	err = tap_ctl_session_send(&session, &attach, NULL);
+	if (err)
+		goto out;
+
+	/* tapdisk fails the open by itself if the attach failed */
+	err = tap_ctl_session_send_ex(&session, &open, logpath, 0, NULL, NULL);
+	if (err) {
+		tap_ctl_session_receive(&session, &attach, NULL);
+		*attached = !tap_ctl_attach_response(id, &attach);
+		goto out;
+	}
+
+	err = tap_ctl_session_receive(&session, &attach, NULL);
+	if (err)
+		goto out;
+	err = tap_ctl_attach_response(id, &attach);
+	*attached = !err;
+
+	err2 = tap_ctl_session_receive(&session, &open, NULL);
+	if (!err2)
+		err2 = tap_ctl_open_response(id, &open);
+	if (!err)
+		err = err2;
+
+out:
+	tap_ctl_session_close(&session);
+	return err;
+}
+
 int
 tap_ctl_create(const char *params, char **devname, int flags, int parent_minor,
-		char *secondary, int timeout, const char *slice, const char *logpath)
+		char *secondary, int timeout, int cache_size, const char *slice,
+		const char *logpath)
 {
-	int err, id, minor;
+	int err, id, minor, attached;
 
 	err = tap_ctl_allocate(&minor, devname);
 	if (err)
@@ -57,14 +119,24 @@ tap_ctl_create(const char *params, char **devname, int flags, int parent_minor,
 		goto destroy;
 	}
 
-	err = tap_ctl_attach(id, minor);
-	if (err)
-		goto destroy;
+	err = tap_ctl_create_session(id, minor, params, flags, parent_minor,
+				     secondary, timeout, cache_size, logpath,
+				     &attached);
+	if (err == -EOPNOTSUPP) {
+		err = tap_ctl_attach(id, minor);
+		if (err)
+			goto destroy;
+		attached = 1;
 
-	err = tap_ctl_open(id, minor, params, flags, parent_minor, secondary,
-			   timeout, logpath, 0, NULL);
-	if (err)
-		goto detach;
+		err = tap_ctl_open(id, minor, params, flags, parent_minor,
+				   secondary, timeout, cache_size, logpath,
+				   0, NULL);
+	}
+	if (err) {
+		if (attached)
+			goto detach;
+		goto destroy;
+	}
 
 	return 0;
 
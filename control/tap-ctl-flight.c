@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tap-ctl.h"
+
+static void
+tap_ctl_flight_path(pid_t pid, char *path, size_t size)
+{
+	snprintf(path, size, "%s%d", TAPDISK_FLIGHT_PATH, pid);
+}
+
+ssize_t
+tap_ctl_flight_read(pid_t pid, char **lines)
+{
+	const struct tapdisk_flight_hdr *hdr;
+	char path[64], *buf, *ring, *start;
+	size_t len, off, n;
+	struct stat st;
+	uint64_t head;
+	ssize_t err;
+	void *mem;
+	int fd;
+
+	*lines = NULL;
+	mem    = MAP_FAILED;
+	buf    = NULL;
+
+	tap_ctl_flight_path(pid, path, sizeof(path));
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+		goto out;
+	}
+
+	err = -EPROTO;
+	if (st.st_size < sizeof(*hdr))
+		goto out;
+
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED) {
+		err = -errno;
+		goto out;
+	}
+
+	hdr = mem;
+	if (hdr->magic != TAPDISK_FLIGHT_MAGIC ||
+	    hdr->version != TAPDISK_FLIGHT_VERSION ||
+	    !hdr->size || st.st_size < sizeof(*hdr) + (off_t)hdr->size)
+		goto out;
+
+	ring = (char *)mem + sizeof(*hdr);
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	len  = head < hdr->size ? head : hdr->size;
+
+	buf = malloc(len + 1);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* oldest first: from head, once the ring has wrapped */
+	off = head < hdr->size ? 0 : head % hdr->size;
+	n   = hdr->size - off < len ? hdr->size - off : len;
+	memcpy(buf, ring + off, n);
+	memcpy(buf + n, ring, len - n);
+	buf[len] = '\0';
+
+	/* the first line is likely half overwritten */
+	start = buf;
+	if (head > hdr->size) {
+		start = memchr(buf, '\n', len);
+		start = start ? start + 1 : buf + len;
+	}
+
+	/* holes left by writers which never finished */
+	for (n = 0, off = start - buf; off < len; off++)
+		if (buf[off])
+			buf[n++] = buf[off];
+	buf[n] = '\0';
+
+	*lines = buf;
+	buf    = NULL;
+	err    = n;
+
+out:
+	free(buf);
+	if (mem != MAP_FAILED)
+		munmap(mem, st.st_size);
+	close(fd);
+	return err;
+}
+
+int
+tap_ctl_flight_remove(pid_t pid)
+{
+	char path[64];
+
+	tap_ctl_flight_path(pid, path, sizeof(path));
+
+	return unlink(path) ? -errno : 0;
+}
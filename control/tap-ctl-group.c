@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "tap-ctl.h"
+
+/* the VBDs of the group in one tapdisk, with one connection to it */
+struct tap_ctl_group {
+	pid_t                        pid;
+	int                          fd;
+	int                          err;
+	tapdisk_message_t            message;
+};
+
+static int
+tap_ctl_group_build(struct tap_ctl_group *groups, int type,
+		    const pid_t *pids, const int *minors, int n)
+{
+	struct tap_ctl_group *g;
+	int i, j, ng;
+
+	ng = 0;
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < ng; j++)
+			if (groups[j].pid == pids[i])
+				break;
+
+		g = &groups[j];
+		if (j == ng) {
+			memset(g, 0, sizeof(*g));
+			g->pid          = pids[i];
+			g->fd           = -1;
+			g->message.type = type;
+			ng++;
+		}
+
+		if (g->message.u.minors.count == TAPDISK_MESSAGE_MAX_MINORS)
+			return -E2BIG;
+
+		g->message.u.minors.list[g->message.u.minors.count++] =
+			minors[i];
+	}
+
+	return ng;
+}
+
+/*
+ * Sends the message of each group before waiting for any response, so
+ * that the tapdisks work at it in parallel. Sets groups[].err, returns
+ * the first error.
+ */
+static int
+tap_ctl_group_send_and_receive(struct tap_ctl_group *groups, int ng,
+			       int rsp, struct timeval *timeout)
+{
+	struct tap_ctl_group *g;
+	int i, err;
+
+	for (i = 0; i < ng; i++) {
+		g = &groups[i];
+
+		g->err = tap_ctl_connect_id(g->pid, &g->fd);
+		if (g->err)
+			continue;
+
+		g->err = tap_ctl_write_message(g->fd, &g->message, timeout);
+	}
+
+	err = 0;
+	for (i = 0; i < ng; i++) {
+		g = &groups[i];
+
+		if (!g->err) {
+			g->err = tap_ctl_read_message(g->fd, &g->message,
+						      timeout);
+			if (!g->err && g->message.type != rsp)
+				g->err = g->message.type ==
+					TAPDISK_MESSAGE_ERROR ?
+					-g->message.u.response.error : -EINVAL;
+		}
+
+		if (g->fd >= 0) {
+			close(g->fd);
+			g->fd = -1;
+		}
+
+		if (g->err) {
+			EPRINTF("tapdisk %d: %s\n", g->pid, strerror(-g->err));
+			if (!err)
+				err = g->err;
+		}
+	}
+
+	return err;
+}
+
+int
+tap_ctl_pause_group(const pid_t *pids, const int *minors, int n,
+		    struct timeval *timeout)
+{
+	struct tap_ctl_group *groups;
+	int i, ng, err;
+
+	if (n < 1)
+		return -EINVAL;
+
+	groups = calloc(n, sizeof(*groups));
+	if (!groups)
+		return -ENOMEM;
+
+	ng = tap_ctl_group_build(groups, TAPDISK_MESSAGE_PAUSE_GROUP,
+				 pids, minors, n);
+	if (ng < 0) {
+		err = ng;
+		goto out;
+	}
+
+	err = tap_ctl_group_send_and_receive(groups, ng,
+					     TAPDISK_MESSAGE_PAUSE_GROUP_RSP,
+					     timeout);
+	if (!err)
+		goto out;
+
+	/* all or none: those which paused resume */
+	for (i = 0; i < ng; i++) {
+		if (groups[i].err) {
+			groups[i] = groups[--ng];
+			i--;
+			continue;
+		}
+		groups[i].message.type = TAPDISK_MESSAGE_RESUME_GROUP;
+	}
+
+	if (ng)
+		tap_ctl_group_send_and_receive(groups, ng,
+					       TAPDISK_MESSAGE_RESUME_GROUP_RSP,
+					       NULL);
+
+out:
+	if (err)
+		EPRINTF("group pause failed: %s\n", strerror(-err));
+	free(groups);
+	return err;
+}
+
+int
+tap_ctl_resume_group(const pid_t *pids, const int *minors, int n)
+{
+	struct tap_ctl_group *groups;
+	int ng, err;
+
+	if (n < 1)
+		return -EINVAL;
+
+	groups = calloc(n, sizeof(*groups));
+	if (!groups)
+		return -ENOMEM;
+
+	ng = tap_ctl_group_build(groups, TAPDISK_MESSAGE_RESUME_GROUP,
+				 pids, minors, n);
+	if (ng < 0) {
+		err = ng;
+		goto out;
+	}
+
+	err = tap_ctl_group_send_and_receive(groups, ng,
+					     TAPDISK_MESSAGE_RESUME_GROUP_RSP,
+					     NULL);
+
+out:
+	if (err)
+		EPRINTF("group resume failed: %s\n", strerror(-err));
+	free(groups);
+	return err;
+}
@@ -159,20 +159,16 @@ tap_ctl_send_and_receive(int sfd, tapdisk_message_t *message,
 	return 0;
 }
 
-int
-tap_ctl_send_and_receive_ex(int sfd, tapdisk_message_t *message,
-			    const char *logpath, uint8_t key_size,
-			    const uint8_t *encryption_key,
-			    struct timeval *timeout)
+/*
+ * Writes what follows an open message with TAPDISK_MESSAGE_FLAG_ADD_LOG
+ * or TAPDISK_MESSAGE_FLAG_OPEN_ENCRYPTED set.
+ */
+static int
+tap_ctl_write_extras(int sfd, tapdisk_message_t *message,
+		     const char *logpath, uint8_t key_size,
+		     const uint8_t *encryption_key)
 {
-	int err, ret;
-
-	err = tap_ctl_write_message(sfd, message, timeout);
-	if (err) {
-		EPRINTF("failed to send '%s' message\n",
-			tapdisk_message_name(message->type));
-		return err;
-	}
+	int ret;
 
 	if (message->u.params.flags & TAPDISK_MESSAGE_FLAG_ADD_LOG) {
 		char buf[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
@@ -203,6 +199,29 @@ tap_ctl_send_and_receive_ex(int sfd, tapdisk_message_t *message,
 		}
 	}
 
+	return 0;
+}
+
+int
+tap_ctl_send_and_receive_ex(int sfd, tapdisk_message_t *message,
+			    const char *logpath, uint8_t key_size,
+			    const uint8_t *encryption_key,
+			    struct timeval *timeout)
+{
+	int err;
+
+	err = tap_ctl_write_message(sfd, message, timeout);
+	if (err) {
+		EPRINTF("failed to send '%s' message\n",
+			tapdisk_message_name(message->type));
+		return err;
+	}
+
+	err = tap_ctl_write_extras(sfd, message, logpath, key_size,
+				   encryption_key);
+	if (err)
+		return err;
+
 	err = tap_ctl_read_message(sfd, message, timeout);
 	if (err) {
 		EPRINTF("failed to receive '%s' message\n",
@@ -324,3 +343,115 @@ tap_ctl_connect_send_receive_ex(int id, tapdisk_message_t *message,
 	close(sfd);
 	return err;
 }
+
+int
+tap_ctl_session_open(int id, tap_ctl_session_t *session)
+{
+	tapdisk_message_t message;
+	int err;
+
+	session->id      = id;
+	session->pending = 0;
+
+	err = tap_ctl_connect_id(id, &session->fd);
+	if (err)
+		return err;
+
+	memset(&message, 0, sizeof(message));
+	message.type = TAPDISK_MESSAGE_SESSION;
+
+	err = tap_ctl_send_and_receive(session->fd, &message, NULL);
+	if (err)
+		goto fail;
+
+	if (message.type != TAPDISK_MESSAGE_SESSION_RSP) {
+		/* an older tapdisk rejects it and closes the connection */
+		EPRINTF("tapdisk %d does not support sessions\n", id);
+		err = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	close(session->fd);
+	session->fd = -1;
+	return err;
+}
+
+int
+tap_ctl_session_send(tap_ctl_session_t *session, tapdisk_message_t *message,
+		     struct timeval *timeout)
+{
+	return tap_ctl_session_send_ex(session, message, NULL, 0, NULL, timeout);
+}
+
+int
+tap_ctl_session_send_ex(tap_ctl_session_t *session,
+			tapdisk_message_t *message, const char *logpath,
+			uint8_t key_size, const uint8_t *encryption_key,
+			struct timeval *timeout)
+{
+	int err;
+
+	err = tap_ctl_write_message(session->fd, message, timeout);
+	if (err) {
+		EPRINTF("failed to send '%s' message\n",
+			tapdisk_message_name(message->type));
+		return err;
+	}
+
+	if (message->type == TAPDISK_MESSAGE_OPEN) {
+		err = tap_ctl_write_extras(session->fd, message, logpath,
+					   key_size, encryption_key);
+		if (err)
+			return err;
+	}
+
+	session->pending++;
+
+	return 0;
+}
+
+int
+tap_ctl_session_receive(tap_ctl_session_t *session,
+			tapdisk_message_t *message, struct timeval *timeout)
+{
+	int err;
+
+	if (!session->pending)
+		return -EINVAL;
+
+	err = tap_ctl_read_message(session->fd, message, timeout);
+	if (err) {
+		EPRINTF("failed to receive message from %d\n", session->id);
+		return err;
+	}
+
+	session->pending--;
+
+	return 0;
+}
+
+int
+tap_ctl_session_send_and_receive(tap_ctl_session_t *session,
+				 tapdisk_message_t *message,
+				 struct timeval *timeout)
+{
+	int err;
+
+	err = tap_ctl_session_send(session, message, timeout);
+	if (err)
+		return err;
+
+	return tap_ctl_session_receive(session, message, timeout);
+}
+
+void
+tap_ctl_session_close(tap_ctl_session_t *session)
+{
+	if (session->fd >= 0) {
+		close(session->fd);
+		session->fd = -1;
+	}
+}
@@ -38,6 +38,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <glob.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 
 #include "tap-ctl.h"
 #include "blktap2.h"
@@ -119,6 +122,110 @@ tap_ctl_list_free(struct list_head *list)
 		_tap_list_free(tl);
 }
 
+static char *
+_tap_ctl_published_path(pid_t pid)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%d", BLKTAP2_LIST_DIR, pid) == -1)
+		return NULL;
+
+	return path;
+}
+
+/**
+ * Tells whether a running tapdisk published its VBDs, in which case
+ * neither its PID nor its list need to be asked for over its socket.
+ */
+static int
+_tap_ctl_published(pid_t pid)
+{
+	char *path;
+	int err;
+
+	if (kill(pid, 0) && errno != EPERM)
+		return 0;
+
+	path = _tap_ctl_published_path(pid);
+	if (!path)
+		return 0;
+
+	err = access(path, R_OK);
+	free(path);
+
+	return !err;
+}
+
+/**
+ * Reads the VBDs a tapdisk published to BLKTAP2_LIST_DIR, see
+ * tapdisk_control_publish.
+ *
+ * @returns 0 on success, -ENOENT if the tapdisk did not publish them
+ */
+static int
+_tap_ctl_list_published(pid_t pid, struct list_head *list)
+{
+	char *path, *line = NULL;
+	size_t size = 0;
+	tap_list_t *tl;
+	FILE *f;
+	int err;
+
+	INIT_LIST_HEAD(list);
+
+	path = _tap_ctl_published_path(pid);
+	if (!path)
+		return -ENOMEM;
+
+	f = fopen(path, "r");
+	free(path);
+	if (!f)
+		return -errno;
+
+	while (getline(&line, &size, f) != -1) {
+		char *params;
+		int n, pos;
+
+		tl = _tap_list_alloc();
+		if (!tl) {
+			err = -ENOMEM;
+			goto fail;
+		}
+
+		n = sscanf(line, "%d %d %n", &tl->minor, &tl->state, &pos);
+		if (n != 2) {
+			_tap_list_free(tl);
+			err = -EPROTO;
+			goto fail;
+		}
+
+		tl->pid = pid;
+
+		params = line + pos;
+		params[strcspn(params, "\n")] = '\0';
+
+		if (strcmp(params, "-")) {
+			err = _parse_params(params, &tl->type, &tl->path);
+			if (err) {
+				_tap_list_free(tl);
+				goto fail;
+			}
+		}
+
+		list_add_tail(&tl->entry, list);
+	}
+
+	err = 0;
+out:
+	free(line);
+	fclose(f);
+	return err;
+
+fail:
+	tap_ctl_list_free(list);
+	goto out;
+}
+
 /**
  * Returns a list running tapdisks. tapdisks are searched for by looking for
  * their control socket.
@@ -217,7 +324,8 @@ _tap_ctl_find_tapdisks(struct list_head *list)
 		if (n != 1)
 			goto skip;
 
-		tl->pid = tap_ctl_get_pid(tl->pid);
+		if (!_tap_ctl_published(tl->pid))
+			tl->pid = tap_ctl_get_pid(tl->pid);
 		if (tl->pid < 0)
 			goto skip;
 
@@ -313,18 +421,237 @@ fail:
 	goto out;
 }
 
+/*
+ * Moves the VBDs of tapdisk @t to @list, dropping their minors from
+ * @minors. A tapdisk without VBDs is listed on its own.
+ */
+static void
+_tap_ctl_list_merge(tap_list_t *t, struct list_head *vbds,
+		    struct list_head *minors, struct list_head *list)
+{
+	tap_list_t *v, *next_v, *m, *next_m;
+
+	if (list_empty(vbds)) {
+		list_move_tail(&t->entry, list);
+		return;
+	}
+
+	tap_list_for_each_entry_safe(v, next_v, vbds) {
+
+		tap_list_for_each_entry_safe(m, next_m, minors)
+			if (m->minor == v->minor) {
+				_tap_list_free(m);
+				break;
+			}
+
+		list_move_tail(&v->entry, list);
+	}
+
+	_tap_list_free(t);
+}
+
+struct tap_ctl_list_query {
+	tap_list_t                  *tapdisk;
+	int                          fd;
+	size_t                       offset;
+	tapdisk_message_t            message;
+	struct list_head             vbds;
+};
+
+static void
+_tap_ctl_list_query_end(struct tap_ctl_list_query *q, int err)
+{
+	if (err) {
+		EPRINTF("failed to list tapdisk %d: %s\n",
+			q->tapdisk->pid, strerror(-err));
+		tap_ctl_list_free(&q->vbds);
+	}
+
+	close(q->fd);
+	q->fd = -1;
+}
+
+/*
+ * Consumes what tapdisk @q sent, returns 1 once its list is complete.
+ */
+static int
+_tap_ctl_list_query_read(struct tap_ctl_list_query *q)
+{
+	const size_t size = sizeof(q->message);
+	tap_list_t *tl;
+	ssize_t n;
+	int err;
+
+	n = read(q->fd, (char *)&q->message + q->offset, size - q->offset);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n <= 0) {
+		_tap_ctl_list_query_end(q, -EPROTO);
+		return 1;
+	}
+
+	q->offset += n;
+	if (q->offset < size)
+		return 0;
+	q->offset = 0;
+
+	if (q->message.u.list.count == 0) {
+		_tap_ctl_list_query_end(q, 0);
+		return 1;
+	}
+
+	tl = _tap_list_alloc();
+	if (!tl) {
+		_tap_ctl_list_query_end(q, -ENOMEM);
+		return 1;
+	}
+
+	tl->pid   = q->tapdisk->pid;
+	tl->minor = q->message.u.list.minor;
+	tl->state = q->message.u.list.state;
+
+	if (q->message.u.list.path[0] != 0) {
+		err = _parse_params(q->message.u.list.path,
+				    &tl->type, &tl->path);
+		if (err) {
+			_tap_list_free(tl);
+			_tap_ctl_list_query_end(q, err);
+			return 1;
+		}
+	}
+
+	list_add(&tl->entry, &q->vbds);
+
+	return 0;
+}
+
+static long
+_tap_ctl_list_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Asks all the tapdisks in @tapdisks for their VBDs at once, rather than
+ * one after the other, and merges the answers into @list. A tapdisk that
+ * has not answered within @timeout seconds is listed without VBDs, same as
+ * one that failed.
+ */
+static int
+_tap_ctl_list_query(struct list_head *tapdisks, int timeout,
+		    struct list_head *minors, struct list_head *list)
+{
+	struct tap_ctl_list_query *queries;
+	struct pollfd *pfds;
+	tap_list_t *t, *next_t;
+	long deadline;
+	int i, n, pending, err;
+
+	n = 0;
+	tap_list_for_each_entry(t, tapdisks)
+		n++;
+	if (!n)
+		return 0;
+
+	queries = calloc(n, sizeof(*queries));
+	pfds    = calloc(n, sizeof(*pfds));
+	if (!queries || !pfds) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	i = pending = 0;
+	tap_list_for_each_entry(t, tapdisks) {
+		struct tap_ctl_list_query *q = &queries[i++];
+
+		q->tapdisk = t;
+		INIT_LIST_HEAD(&q->vbds);
+
+		err = tap_ctl_connect_id(t->pid, &q->fd);
+		if (err)
+			continue;
+
+		memset(&q->message, 0, sizeof(q->message));
+		q->message.type   = TAPDISK_MESSAGE_LIST;
+		q->message.cookie = -1;
+
+		/* a fresh socket takes a single message without blocking */
+		if (write(q->fd, &q->message, sizeof(q->message)) !=
+		    sizeof(q->message)) {
+			_tap_ctl_list_query_end(q, -EIO);
+			continue;
+		}
+
+		pending++;
+	}
+
+	deadline = _tap_ctl_list_now_ms() + timeout * 1000L;
+
+	while (pending) {
+		long left = deadline - _tap_ctl_list_now_ms();
+		int ret;
+
+		if (left <= 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			/* poll ignores negative descriptors */
+			pfds[i].fd      = queries[i].fd;
+			pfds[i].events  = POLLIN;
+			pfds[i].revents = 0;
+		}
+
+		ret = poll(pfds, n, left);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			EPRINTF("poll failed: %s\n", strerror(-err));
+			break;
+		}
+
+		for (i = 0; i < n; i++)
+			if (pfds[i].revents && queries[i].fd >= 0)
+				pending -= _tap_ctl_list_query_read(&queries[i]);
+	}
+
+	for (i = 0; i < n; i++)
+		if (queries[i].fd >= 0)
+			_tap_ctl_list_query_end(&queries[i], -ETIMEDOUT);
+
+	i = 0;
+	tap_list_for_each_entry_safe(t, next_t, tapdisks)
+		_tap_ctl_list_merge(t, &queries[i++].vbds, minors, list);
+
+	err = 0;
+out:
+	free(queries);
+	free(pfds);
+	return err;
+}
+
 int
-tap_ctl_list(struct list_head *list)
+tap_ctl_list_flags(struct list_head *list, int flags, int timeout)
 {
-	struct list_head minors, tapdisks, vbds;
-	tap_list_t *t, *next_t, *v, *next_v, *m, *next_m;
+	struct list_head minors, tapdisks, live, vbds;
+	tap_list_t *t, *next_t;
 	int err;
 
 	/*
 	 * Find all minors, find all tapdisks, then list all minors
 	 * they attached to. Output is a 3-way outer join.
+	 *
+	 * Tapdisks publish their VBDs to BLKTAP2_LIST_DIR, the others, or all
+	 * of them with TAP_CTL_LIST_LIVE, are asked over their sockets.
 	 */
 
+	INIT_LIST_HEAD(list);
+	INIT_LIST_HEAD(&live);
+	INIT_LIST_HEAD(&tapdisks);
+
 	err = _tap_ctl_find_minors(&minors);
 	if (err < 0)
 		goto fail;
@@ -335,46 +662,41 @@ tap_ctl_list(struct list_head *list)
 		goto fail;
 	}
 
-	INIT_LIST_HEAD(list);
-
 	tap_list_for_each_entry_safe(t, next_t, &tapdisks) {
-
-		err = _tap_ctl_list_tapdisk(t->pid, &vbds);
-
-		if (err || list_empty(&vbds)) {
-			list_move_tail(&t->entry, list);
+		if (!(flags & TAP_CTL_LIST_LIVE) &&
+		    !_tap_ctl_list_published(t->pid, &vbds)) {
+			_tap_ctl_list_merge(t, &vbds, &minors, list);
 			continue;
 		}
 
-		tap_list_for_each_entry_safe(v, next_v, &vbds) {
-
-			tap_list_for_each_entry_safe(m, next_m, &minors)
-				if (m->minor == v->minor) {
-					_tap_list_free(m);
-					break;
-				}
-
-			list_move_tail(&v->entry, list);
-		}
-
-		_tap_list_free(t);
+		list_move_tail(&t->entry, &live);
 	}
 
+	err = _tap_ctl_list_query(&live, timeout, &minors, list);
+	if (err)
+		goto fail;
+
 	/* orphaned minors */
 	list_splice_tail(&minors, list);
 
 	return 0;
 
 fail:
-		tap_ctl_list_free(list);
+	tap_ctl_list_free(list);
 
-	tap_ctl_list_free(&vbds);
+	tap_ctl_list_free(&live);
 	tap_ctl_list_free(&tapdisks);
 	tap_ctl_list_free(&minors);
 
 	return err;
 }
 
+int
+tap_ctl_list(struct list_head *list)
+{
+	return tap_ctl_list_flags(list, 0, TAP_CTL_LIST_TIMEOUT);
+}
+
 int
 tap_ctl_list_pid(pid_t pid, struct list_head *list)
 {
@@ -385,6 +707,13 @@ tap_ctl_list_pid(pid_t pid, struct list_head *list)
 	if (!t)
 		return -ENOMEM;
 
+	if (_tap_ctl_published(pid) &&
+	    !_tap_ctl_list_published(pid, list)) {
+		t->pid = pid;
+		err = 0;
+		goto out;
+	}
+
 	t->pid = tap_ctl_get_pid(pid);
 	if (t->pid < 0) {
 		_tap_list_free(t);
@@ -392,7 +721,7 @@ tap_ctl_list_pid(pid_t pid, struct list_head *list)
 	}
 
 	err = _tap_ctl_list_tapdisk(t->pid, list);
-
+out:
 	if (err || list_empty(list))
 		list_add_tail(&t->entry, list);
 
@@ -42,63 +42,91 @@
 #include "tap-ctl.h"
 
 int
-tap_ctl_open(const int id, const int minor, const char *params, int flags,
-	     const int prt_minor, const char *secondary, int timeout,
-	     const char* logpath, uint8_t key_size, uint8_t *encryption_key)
+tap_ctl_open_message(tapdisk_message_t *message, const int minor,
+		     const char *params, int flags, const int prt_minor,
+		     const char *secondary, int timeout, int cache_size)
 {
 	int err;
-	tapdisk_message_t message;
 
-	memset(&message, 0, sizeof(message));
-	message.type = TAPDISK_MESSAGE_OPEN;
-	message.cookie = minor;
-	message.u.params.devnum = minor;
-	message.u.params.prt_devnum = prt_minor;
-	message.u.params.req_timeout = timeout;
-	message.u.params.flags = flags;
-
-	err = snprintf(message.u.params.path,
-		       sizeof(message.u.params.path) - 1, "%s", params);
-	if (err >= sizeof(message.u.params.path)) {
+	memset(message, 0, sizeof(*message));
+	message->type = TAPDISK_MESSAGE_OPEN;
+	message->cookie = minor;
+	message->u.params.devnum = minor;
+	message->u.params.prt_devnum = prt_minor;
+	message->u.params.req_timeout = timeout;
+	message->u.params.cache_size = cache_size;
+	message->u.params.flags = flags;
+
+	err = snprintf(message->u.params.path,
+		       sizeof(message->u.params.path) - 1, "%s", params);
+	if (err >= sizeof(message->u.params.path)) {
 		EPRINTF("name too long\n");
 		return ENAMETOOLONG;
 	}
 
 	if (secondary) {
-		err = snprintf(message.u.params.secondary,
-			       sizeof(message.u.params.secondary) - 1, "%s",
+		err = snprintf(message->u.params.secondary,
+			       sizeof(message->u.params.secondary) - 1, "%s",
 			       secondary);
-		if (err >= sizeof(message.u.params.secondary)) {
+		if (err >= sizeof(message->u.params.secondary)) {
 			EPRINTF("secondary image name too long\n");
 			return ENAMETOOLONG;
 		}
 	}
-	if (flags & (TAPDISK_MESSAGE_FLAG_ADD_LOG | TAPDISK_MESSAGE_FLAG_OPEN_ENCRYPTED)) {
-		err = tap_ctl_connect_send_receive_ex(
-			id, &message, logpath, key_size, encryption_key, NULL);
-	}
-	else {
-		err = tap_ctl_connect_send_and_receive(id, &message, NULL);
-	}
 
-	if (encryption_key)
-		free(encryption_key);
+	return 0;
+}
 
-	if (err)
-		return err;
+int
+tap_ctl_open_response(const int id, tapdisk_message_t *message)
+{
+	int err = 0;
 
-	switch (message.type) {
+	switch (message->type) {
 	case TAPDISK_MESSAGE_OPEN_RSP:
 		break;
 	case TAPDISK_MESSAGE_ERROR:
-		err = -message.u.response.error;
+		err = -message->u.response.error;
 		EPRINTF("open failed: %s\n", strerror(-err));
 		break;
 	default:
 		EPRINTF("got unexpected result '%s' from %d\n",
-			tapdisk_message_name(message.type), id);
+			tapdisk_message_name(message->type), id);
 		err = EINVAL;
 	}
 
 	return err;
 }
+
+int
+tap_ctl_open(const int id, const int minor, const char *params, int flags,
+	     const int prt_minor, const char *secondary, int timeout,
+	     int cache_size, const char* logpath, uint8_t key_size,
+	     uint8_t *encryption_key)
+{
+	int err;
+	tapdisk_message_t message;
+
+	err = tap_ctl_open_message(&message, minor, params, flags, prt_minor,
+				   secondary, timeout, cache_size);
+	if (err) {
+		free(encryption_key);
+		return err;
+	}
+
+	if (flags & (TAPDISK_MESSAGE_FLAG_ADD_LOG | TAPDISK_MESSAGE_FLAG_OPEN_ENCRYPTED)) {
+		err = tap_ctl_connect_send_receive_ex(
+			id, &message, logpath, key_size, encryption_key, NULL);
+	}
+	else {
+		err = tap_ctl_connect_send_and_receive(id, &message, NULL);
+	}
+
+	if (encryption_key)
+		free(encryption_key);
+
+	if (err)
+		return err;
+
+	return tap_ctl_open_response(id, &message);
+}
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "tap-ctl.h"
+#include "blktap2.h"
+
+/*
+ * The pool is a directory of empty files named after the pids of idle
+ * tapdisks. Spawned tapdisks have already set up logging and their
+ * control socket, and set up their AIO context right after answering
+ * tap-ctl, so claiming one is just an unlink: whoever removes the entry
+ * owns the tapdisk.
+ */
+
+#define TAP_CTL_POOL_SIZE  BLKTAP2_POOL_DIR"/.size"
+#define TAP_CTL_POOL_LOCK  BLKTAP2_POOL_DIR"/.lock"
+#define TAP_CTL_POOL_MAX   256
+
+static int
+tap_ctl_pool_mkdir(void)
+{
+	if (mkdir(BLKTAP2_CONTROL_DIR, 0755) && errno != EEXIST)
+		return -errno;
+
+	if (mkdir(BLKTAP2_POOL_DIR, 0755) && errno != EEXIST)
+		return -errno;
+
+	return 0;
+}
+
+int
+tap_ctl_pool_get_size(void)
+{
+	FILE *f;
+	int size;
+
+	f = fopen(TAP_CTL_POOL_SIZE, "re");
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%d", &size) != 1 || size < 0)
+		size = 0;
+
+	fclose(f);
+
+	return size < TAP_CTL_POOL_MAX ? size : TAP_CTL_POOL_MAX;
+}
+
+int
+tap_ctl_pool_set_size(int size)
+{
+	FILE *f;
+	int err;
+
+	if (size < 0 || size > TAP_CTL_POOL_MAX)
+		return -EINVAL;
+
+	err = tap_ctl_pool_mkdir();
+	if (err)
+		return err;
+
+	f = fopen(TAP_CTL_POOL_SIZE".tmp", "we");
+	if (!f)
+		return -errno;
+
+	fprintf(f, "%d\n", size);
+
+	err = fclose(f) ? -errno : 0;
+	if (!err && rename(TAP_CTL_POOL_SIZE".tmp", TAP_CTL_POOL_SIZE))
+		err = -errno;
+	if (err)
+		unlink(TAP_CTL_POOL_SIZE".tmp");
+
+	return err;
+}
+
+int
+tap_ctl_pool_list(pid_t *pids, int max)
+{
+	DIR *dir;
+	struct dirent *ent;
+	int n;
+
+	dir = opendir(BLKTAP2_POOL_DIR);
+	if (!dir)
+		return errno == ENOENT ? 0 : -errno;
+
+	n = 0;
+	while (n < max && (ent = readdir(dir))) {
+		char *end;
+		long pid;
+
+		if (ent->d_name[0] == '.')
+			continue;
+
+		pid = strtol(ent->d_name, &end, 10);
+		if (*end || pid <= 0)
+			continue;
+
+		pids[n++] = pid;
+	}
+
+	closedir(dir);
+	return n;
+}
+
+static int
+tap_ctl_pool_remove(pid_t pid)
+{
+	char path[FILENAME_MAX];
+
+	snprintf(path, sizeof(path), "%s/%d", BLKTAP2_POOL_DIR, pid);
+
+	return unlink(path) ? -errno : 0;
+}
+
+static int
+tap_ctl_pool_add(pid_t pid)
+{
+	char path[FILENAME_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%d", BLKTAP2_POOL_DIR, pid);
+
+	fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	close(fd);
+	return 0;
+}
+
+int
+tap_ctl_pool_claim(void)
+{
+	pid_t pids[TAP_CTL_POOL_MAX];
+	int i, n, id;
+
+	n = tap_ctl_pool_list(pids, TAP_CTL_POOL_MAX);
+
+	id = -ENOENT;
+	for (i = 0; i < n; i++) {
+		if (tap_ctl_pool_remove(pids[i]))
+			continue;
+
+		/* the entry is ours now; make sure the tapdisk still is */
+		if (tap_ctl_get_pid(pids[i]) != pids[i]) {
+			EPRINTF("pooled tapdisk %d is gone, skipping\n", pids[i]);
+			continue;
+		}
+
+		id = pids[i];
+		break;
+	}
+
+	tap_ctl_pool_refill();
+
+	return id;
+}
+
+/*
+ * Count live entries, dropping those whose tapdisk has died.
+ */
+static int
+tap_ctl_pool_count(void)
+{
+	pid_t pids[TAP_CTL_POOL_MAX];
+	int i, n, live;
+
+	n = tap_ctl_pool_list(pids, TAP_CTL_POOL_MAX);
+	if (n < 0)
+		return n;
+
+	live = 0;
+	for (i = 0; i < n; i++) {
+		if (kill(pids[i], 0) && errno == ESRCH)
+			tap_ctl_pool_remove(pids[i]);
+		else
+			live++;
+	}
+
+	return live;
+}
+
+/*
+ * Retire idle tapdisks beyond the target size after it was lowered.
+ */
+static void
+tap_ctl_pool_trim(int size)
+{
+	pid_t pids[TAP_CTL_POOL_MAX];
+	int i, n;
+
+	n = tap_ctl_pool_list(pids, TAP_CTL_POOL_MAX);
+
+	for (i = size; i < n; i++)
+		if (!tap_ctl_pool_remove(pids[i]))
+			kill(pids[i], SIGTERM);
+}
+
+int
+tap_ctl_pool_fill(void)
+{
+	int err, fd, size, n;
+
+	err = tap_ctl_pool_mkdir();
+	if (err)
+		return err;
+
+	fd = open(TAP_CTL_POOL_LOCK, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	/* somebody else is already filling the pool */
+	if (flock(fd, LOCK_EX|LOCK_NB)) {
+		err = errno == EWOULDBLOCK ? 0 : -errno;
+		goto out;
+	}
+
+	/*
+	 * Claims may race with us; recount until the pool is full
+	 * rather than trusting the initial count.
+	 */
+	for (;;) {
+		size = tap_ctl_pool_get_size();
+
+		n = tap_ctl_pool_count();
+		if (n < 0) {
+			err = n;
+			break;
+		}
+
+		if (n >= size) {
+			tap_ctl_pool_trim(size);
+			break;
+		}
+
+		while (n < size) {
+			int id = tap_ctl_spawn_new(NULL, NULL);
+			if (id < 0) {
+				EPRINTF("pool spawn failed: %d\n", id);
+				err = id;
+				goto out;
+			}
+
+			err = tap_ctl_pool_add(id);
+			if (err) {
+				EPRINTF("failed to pool tapdisk %d: %d\n", id, err);
+				kill(id, SIGTERM);
+				goto out;
+			}
+
+			n++;
+		}
+	}
+
+out:
+	close(fd);
+	return err;
+}
+
+void
+tap_ctl_pool_refill(void)
+{
+	pid_t pid;
+	int fd;
+
+	if (tap_ctl_pool_get_size() <= 0)
+		return;
+
+	pid = fork();
+	if (pid < 0) {
+		EPRINTF("pool refill fork failed: %d\n", errno);
+		return;
+	}
+
+	if (pid) {
+		while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+			;
+		return;
+	}
+
+	/* detach a grandchild so the caller never waits on the refill */
+	if (fork())
+		_exit(0);
+
+	setsid();
+
+	fd = open("/dev/null", O_RDWR);
+	if (fd >= 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+
+	_exit(-tap_ctl_pool_fill());
+}
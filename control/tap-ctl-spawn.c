@@ -44,7 +44,7 @@
 #include "blktap2.h"
 
 static pid_t
-__tap_ctl_spawn(int *readfd)
+__tap_ctl_spawn(int *readfd, const char *cpus)
 {
 	int child, channel[2];
 	char *tapdisk;
@@ -82,17 +82,18 @@ __tap_ctl_spawn(int *readfd)
 	if (!tapdisk)
 		tapdisk = getenv("TAPDISK2");
 
+	/* without a CPU list, the argument list ends right after argv[0] */
 	if (tapdisk) {
-		execlp(tapdisk, tapdisk, NULL);
+		execlp(tapdisk, tapdisk, cpus ? "-a" : NULL, cpus, NULL);
 		exit(errno);
 	}
 
 	execl(TAPDISK_EXECDIR "/" TAPDISK_EXEC, TAPDISK_EXEC,
-	      NULL);
+	      cpus ? "-a" : NULL, cpus, NULL);
 
 	if (errno == ENOENT)
 		execl(TAPDISK_BUILDDIR "/" TAPDISK_EXEC, TAPDISK_EXEC,
-		      NULL);
+		      cpus ? "-a" : NULL, cpus, NULL);
 
 	exit(errno);
 }
@@ -212,8 +213,53 @@ tap_ctl_move_to_cgroup(int pid, const char *controller, const char *slice)
 	return 0;
 }
 
+/* Put the tapdisk in its cgroup slices (best-effort) */
+static void
+tap_ctl_spawn_cgroups(int id, const char *slice)
+{
+	if (tap_ctl_move_to_cgroup(id, "blkio", "vm.slice") < 0)
+		EPRINTF("failed to move tapdisk %d to blkio cgroup slice: %s; ignoring.\n", id, strerror(errno));
+
+	if (!slice) {
+#ifndef TAP_CTL_NO_DEFAULT_CGROUP_SLICE
+		/* No option specified; move it to the default slice */
+		if (tap_ctl_move_to_cgroup(id, "cpu", "/") < 0)
+			EPRINTF("failed to move tapdisk %d to default cpu cgroup slice: %s; ignoring.\n", id, strerror(errno));
+#endif
+	} else {
+		if (tap_ctl_move_to_cgroup(id, "cpu", slice) < 0)
+			EPRINTF("failed to move tapdisk %d to cpu cgroup slice '%s': %s; ignoring.\n", id, slice, strerror(errno));
+	}
+}
+
 int
 tap_ctl_spawn(const char *slice)
+{
+	return tap_ctl_spawn_cpus(slice, NULL);
+}
+
+int
+tap_ctl_spawn_cpus(const char *slice, const char *cpus)
+{
+	int id;
+
+	/*
+	 * A pooled tapdisk was spawned without a CPU list, so it can
+	 * only stand in for a plain spawn.
+	 */
+	if (!cpus) {
+		id = tap_ctl_pool_claim();
+		if (id > 0) {
+			tap_ctl_spawn_cgroups(id, slice);
+			return id;
+		}
+	}
+
+	return tap_ctl_spawn_new(slice, cpus);
+}
+
+int
+tap_ctl_spawn_new(const char *slice, const char *cpus)
 {
 	pid_t child;
 	int err, id, readfd;
@@ -221,7 +267,7 @@ tap_ctl_spawn(const char *slice)
 	readfd = -1;
 
 again:
-	child = __tap_ctl_spawn(&readfd);
+	child = __tap_ctl_spawn(&readfd, cpus);
 	if (child < 0)
 		return child;
 
@@ -238,20 +284,7 @@ again:
 		return id;
 	}
 
-	if (tap_ctl_move_to_cgroup(id, "blkio", "vm.slice") < 0)
-		EPRINTF("failed to move tapdisk %d to blkio cgroup slice: %s; ignoring.\n", id, strerror(errno));
-
-	/* Put the tapdisk in a cgroup slice (best-effort) */
-	if (!slice) {
-#ifndef TAP_CTL_NO_DEFAULT_CGROUP_SLICE
-		/* No option specified; move it to the default slice */
-		if (tap_ctl_move_to_cgroup(id, "cpu", "/") < 0)
-			EPRINTF("failed to move tapdisk %d to default cpu cgroup slice: %s; ignoring.\n", id, strerror(errno));
-#endif
-	} else {
-		if (tap_ctl_move_to_cgroup(id, "cpu", slice) < 0)
-			EPRINTF("failed to move tapdisk %d to cpu cgroup slice '%s': %s; ignoring.\n", id, slice, strerror(errno));
-	}
+	tap_ctl_spawn_cgroups(id, slice);
 
 	return id;
 }
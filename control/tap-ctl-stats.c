@@ -39,8 +39,8 @@
 
 #include "tap-ctl.h"
 
-int
-_tap_ctl_stats_connect_and_send(pid_t pid, int minor)
+static int
+__tap_ctl_stats_connect_and_send(pid_t pid, int minor, int type)
 {
 	struct timeval timeout = { .tv_sec = 10, .tv_usec = 0 };
 	tapdisk_message_t message;
@@ -51,7 +51,7 @@ _tap_ctl_stats_connect_and_send(pid_t pid, int minor)
 		return err;
 
 	memset(&message, 0, sizeof(message));
-	message.type   = TAPDISK_MESSAGE_STATS;
+	message.type   = type;
 	message.cookie = minor;
 
 	err = tap_ctl_write_message(sfd, &message, &timeout);
@@ -63,6 +63,145 @@ _tap_ctl_stats_connect_and_send(pid_t pid, int minor)
 	return sfd;
 }
 
+int
+_tap_ctl_stats_connect_and_send(pid_t pid, int minor)
+{
+	return __tap_ctl_stats_connect_and_send(pid, minor,
+						TAPDISK_MESSAGE_STATS);
+}
+
+/*
+ * Reads the @len bytes following a response into @buf, dropping what
+ * does not fit into @size bytes with -ENOSPC.
+ */
+static int
+__tap_ctl_stats_read_payload(int sfd, size_t len, void *buf, size_t size,
+			     struct timeval *timeout)
+{
+	char discard[512];
+	size_t n, chunk;
+	int err;
+
+	err = tap_ctl_read_raw(sfd, buf, len < size ? len : size, timeout);
+	if (err)
+		return err;
+
+	if (len <= size)
+		return 0;
+
+	for (n = len - size; n; n -= chunk) {
+		chunk = n < sizeof(discard) ? n : sizeof(discard);
+
+		err = tap_ctl_read_raw(sfd, discard, chunk, timeout);
+		if (err)
+			return err;
+	}
+
+	return -ENOSPC;
+}
+
+/*
+ * Reads binary stats (see struct tapdisk_stats_bin_hdr) into @buf, for
+ * one VBD or, with minor -1, all of them. Returns the length read, or
+ * -ENOSPC if they do not fit into @size bytes.
+ */
+ssize_t
+tap_ctl_stats_bin(pid_t pid, int minor, void *buf, size_t size)
+{
+	tapdisk_message_t message;
+	size_t len = 0;
+	int sfd, err;
+
+	sfd = __tap_ctl_stats_connect_and_send(pid, minor,
+					       TAPDISK_MESSAGE_STATS_BIN);
+	if (sfd < 0)
+		return sfd;
+
+	err = tap_ctl_read_message(sfd, &message, NULL);
+	if (err)
+		goto out;
+
+	if (message.type != TAPDISK_MESSAGE_STATS_BIN_RSP) {
+		err = message.type == TAPDISK_MESSAGE_ERROR ?
+			-message.u.response.error : -EINVAL;
+		goto out;
+	}
+
+	len = message.u.info.length;
+	err = __tap_ctl_stats_read_payload(sfd, len, buf, size, NULL);
+
+out:
+	close(sfd);
+	return err ? err : (ssize_t)len;
+}
+
+/*
+ * Subscribes to stats updates every @interval ms (0 for 1s), of VBDs
+ * moving @threshold sectors (0 for any change), see struct
+ * tapdisk_message_subscribe. Returns the connection to pass to
+ * tap_ctl_stats_update, to be closed to unsubscribe.
+ */
+int
+tap_ctl_stats_subscribe(pid_t pid, int minor, unsigned int interval,
+			unsigned int threshold)
+{
+	struct timeval timeout = { .tv_sec = 10, .tv_usec = 0 };
+	tapdisk_message_t message;
+	int sfd, err;
+
+	err = tap_ctl_connect_id(pid, &sfd);
+	if (err)
+		return err;
+
+	memset(&message, 0, sizeof(message));
+	message.type                  = TAPDISK_MESSAGE_STATS_SUBSCRIBE;
+	message.cookie                = minor;
+	message.u.subscribe.interval  = interval;
+	message.u.subscribe.threshold = threshold;
+
+	err = tap_ctl_send_and_receive(sfd, &message, &timeout);
+	if (err)
+		goto fail;
+
+	if (message.type != TAPDISK_MESSAGE_STATS_SUBSCRIBE_RSP) {
+		err = message.type == TAPDISK_MESSAGE_ERROR ?
+			-message.u.response.error : -EOPNOTSUPP;
+		goto fail;
+	}
+
+	return sfd;
+
+fail:
+	close(sfd);
+	return err;
+}
+
+/*
+ * Waits for the next update of a subscription and reads it into @buf,
+ * laid out as tap_ctl_stats_bin has it. Returns its length, -ENOSPC
+ * if it does not fit into @size bytes, which drops it.
+ */
+ssize_t
+tap_ctl_stats_update(int sfd, void *buf, size_t size, struct timeval *timeout)
+{
+	tapdisk_message_t message;
+	size_t len;
+	int err;
+
+	err = tap_ctl_read_message(sfd, &message, timeout);
+	if (err)
+		return err;
+
+	if (message.type != TAPDISK_MESSAGE_STATS_UPDATE)
+		return message.type == TAPDISK_MESSAGE_ERROR ?
+			-message.u.response.error : -EPROTO;
+
+	len = message.u.info.length;
+	err = __tap_ctl_stats_read_payload(sfd, len, buf, size, timeout);
+
+	return err ? err : (ssize_t)len;
+}
+
 ssize_t
 tap_ctl_stats(pid_t pid, int minor, char *buf, size_t size)
 {
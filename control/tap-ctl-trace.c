@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "tap-ctl.h"
+
+static int
+__tap_ctl_trace(pid_t pid, int minor, int cmd, unsigned int size)
+{
+	tapdisk_message_t message;
+	int err;
+
+	memset(&message, 0, sizeof(message));
+	message.type          = TAPDISK_MESSAGE_TRACE;
+	message.cookie        = minor;
+	message.u.trace.cmd   = cmd;
+	message.u.trace.size  = size;
+
+	err = tap_ctl_connect_send_and_receive(pid, &message, NULL);
+	if (err)
+		return err;
+
+	if (message.type == TAPDISK_MESSAGE_TRACE_RSP
+			|| message.type == TAPDISK_MESSAGE_ERROR)
+		err = -message.u.response.error;
+	else {
+		err = -EINVAL;
+		EPRINTF("got unexpected result '%s' from %d\n",
+				tapdisk_message_name(message.type), pid);
+	}
+
+	if (err)
+		EPRINTF("trace failed: %s\n", strerror(-err));
+
+	return err;
+}
+
+int
+tap_ctl_trace_start(pid_t pid, int minor, unsigned int size)
+{
+	return __tap_ctl_trace(pid, minor, TAPDISK_TRACE_START, size);
+}
+
+int
+tap_ctl_trace_stop(pid_t pid, int minor)
+{
+	return __tap_ctl_trace(pid, minor, TAPDISK_TRACE_STOP, 0);
+}
+
+/*
+ * Drains trace records (see struct tapdisk_trace_hdr) into @buf, as
+ * many as fit into @size bytes. Returns the length read.
+ */
+ssize_t
+tap_ctl_trace_read(pid_t pid, int minor, void *buf, size_t size)
+{
+	struct timeval timeout = { .tv_sec = 10, .tv_usec = 0 };
+	tapdisk_message_t message;
+	size_t len = 0;
+	int sfd, err;
+
+	if (size < sizeof(struct tapdisk_trace_hdr) +
+	    sizeof(struct tapdisk_trace_rec))
+		return -EINVAL;
+
+	err = tap_ctl_connect_id(pid, &sfd);
+	if (err)
+		return err;
+
+	memset(&message, 0, sizeof(message));
+	message.type          = TAPDISK_MESSAGE_TRACE_READ;
+	message.cookie        = minor;
+	message.u.trace.size  = (size - sizeof(struct tapdisk_trace_hdr)) /
+		sizeof(struct tapdisk_trace_rec);
+
+	err = tap_ctl_write_message(sfd, &message, &timeout);
+	if (err)
+		goto out;
+
+	err = tap_ctl_read_message(sfd, &message, &timeout);
+	if (err)
+		goto out;
+
+	if (message.type != TAPDISK_MESSAGE_TRACE_READ_RSP) {
+		err = message.type == TAPDISK_MESSAGE_ERROR ?
+			-message.u.response.error : -EINVAL;
+		goto out;
+	}
+
+	len = message.u.info.length;
+	if (len > size) {
+		err = -EPROTO;
+		goto out;
+	}
+
+	err = tap_ctl_read_raw(sfd, buf, len, &timeout);
+
+out:
+	close(sfd);
+	return err ? err : (ssize_t)len;
+}
@@ -49,48 +49,87 @@
 #include "compiler.h"
 
 int
-tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid, int poll_duration,
-		int poll_idle_threshold,
-		const grant_ref_t * grefs, const int order, const evtchn_port_t port,
-		int proto, const char *pool, const int minor)
+tap_ctl_connect_xenblkif_message(tapdisk_message_t *message,
+		const domid_t domid, const int devid, int poll_duration,
+		int poll_idle_threshold, const grant_ref_t * grefs, const int order,
+		const evtchn_port_t port, int proto, const char *pool,
+		const int minor, const int queue)
 {
-    tapdisk_message_t message;
-    int i, err;
+    int i;
 
-	memset(&message, 0, sizeof(message));
-    message.type = TAPDISK_MESSAGE_XENBLKIF_CONNECT;
-    message.cookie = minor;
+	memset(message, 0, sizeof(*message));
+    message->type = TAPDISK_MESSAGE_XENBLKIF_CONNECT;
+    message->cookie = minor;
 
-    message.u.blkif.domid = domid;
-    message.u.blkif.devid = devid;
+    message->u.blkif.domid = domid;
+    message->u.blkif.devid = devid;
     for (i = 0; i < 1 << order; i++)
-        message.u.blkif.gref[i] = grefs[i];
-    message.u.blkif.order = order;
-    message.u.blkif.port = port;
-    message.u.blkif.proto = proto;
-    message.u.blkif.poll_duration = poll_duration;
-    message.u.blkif.poll_idle_threshold = poll_idle_threshold;
+        message->u.blkif.gref[i] = grefs[i];
+    message->u.blkif.order = order;
+    message->u.blkif.port = port;
+    message->u.blkif.proto = proto;
+    message->u.blkif.poll_duration = poll_duration;
+    message->u.blkif.poll_idle_threshold = poll_idle_threshold;
+    message->u.blkif.queue = queue;
     if (pool) {
-        if (unlikely(strlen(pool) > (sizeof(message.u.blkif.pool) - 1))) {
+        if (unlikely(strlen(pool) > (sizeof(message->u.blkif.pool) - 1))) {
             EPRINTF("pool name too long: %s\n", pool);
             return -ENAMETOOLONG;
         }
-        strcpy(message.u.blkif.pool, pool);
+        strcpy(message->u.blkif.pool, pool);
     } else {
-        message.u.blkif.pool[0] = 0;
+        message->u.blkif.pool[0] = 0;
     }
 
-    err = tap_ctl_connect_send_and_receive(pid, &message, NULL);
-    if (err || message.type == TAPDISK_MESSAGE_ERROR) {
-		if (!err)
-			err = -message.u.response.error;
+    return 0;
+}
+
+int
+tap_ctl_connect_xenblkif_response(const pid_t pid, tapdisk_message_t *message)
+{
+    int err = 0;
+
+    if (message->type == TAPDISK_MESSAGE_ERROR) {
+        err = -message->u.response.error;
         if (err == -EALREADY)
             EPRINTF("failed to connect tapdisk[%d] to the ring: %s\n", pid,
                     strerror(-err));
-	}
+    }
     return err;
 }
 
+int
+tap_ctl_connect_xenblkif_queue(const pid_t pid, const domid_t domid,
+		const int devid, int poll_duration, int poll_idle_threshold,
+		const grant_ref_t * grefs, const int order, const evtchn_port_t port,
+		int proto, const char *pool, const int minor, const int queue)
+{
+    tapdisk_message_t message;
+    int err;
+
+    err = tap_ctl_connect_xenblkif_message(&message, domid, devid,
+            poll_duration, poll_idle_threshold, grefs, order, port, proto,
+            pool, minor, queue);
+    if (err)
+        return err;
+
+    err = tap_ctl_connect_send_and_receive(pid, &message, NULL);
+    if (err)
+        return err;
+
+    return tap_ctl_connect_xenblkif_response(pid, &message);
+}
+
+int
+tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid, int poll_duration,
+		int poll_idle_threshold,
+		const grant_ref_t * grefs, const int order, const evtchn_port_t port,
+		int proto, const char *pool, const int minor)
+{
+	return tap_ctl_connect_xenblkif_queue(pid, domid, devid, poll_duration,
+			poll_idle_threshold, grefs, order, port, proto, pool, minor, 0);
+}
+
 int
 tap_ctl_disconnect_xenblkif(const pid_t pid, const domid_t domid,
         const int devid, struct timeval *timeout)
@@ -37,6 +37,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <sys/time.h>
 
@@ -55,10 +56,15 @@ static void
 tap_cli_list_usage(FILE *stream)
 {
 	fprintf(stream,
-		"usage: list [-h] [-p pid] [-m minor] [-t type] [-f file]\n"
+		"usage: list [-h] [-p pid] [-m minor] [-t type] [-f file] "
+		"[-l] [-T timeout]\n"
+		"\n"
+		"-l: ask every tapdisk rather than reading what they published\n"
+		"-T: seconds to wait for each tapdisk asked (default %d)\n"
 		"\n"
 		"Lists tapdisks in the following format:\n"
-		"%8s %4s %4s %10s %s\n", "pid", "minor", "state", "type", "file");
+		"%8s %4s %4s %10s %s\n", TAP_CTL_LIST_TIMEOUT,
+		"pid", "minor", "state", "type", "file");
 }
 
 static void
@@ -114,17 +120,19 @@ int
 tap_cli_list(int argc, char **argv)
 {
 	struct list_head list = LIST_HEAD_INIT(list);
-	int c, minor, tty, err;
+	int c, minor, tty, err, flags, timeout;
 	const char *type, *file;
 	tap_list_t *entry;
 	pid_t pid;
 
-	pid   = -1;
-	minor = -1;
-	type  = NULL;
-	file  = NULL;
+	pid     = -1;
+	minor   = -1;
+	type    = NULL;
+	file    = NULL;
+	flags   = 0;
+	timeout = TAP_CTL_LIST_TIMEOUT;
 
-	while ((c = getopt(argc, argv, "m:p:t:f:h")) != -1) {
+	while ((c = getopt(argc, argv, "m:p:t:f:lT:h")) != -1) {
 		switch (c) {
 		case 'm':
 			minor = atoi(optarg);
@@ -138,6 +146,14 @@ tap_cli_list(int argc, char **argv)
 		case 'f':
 			file = optarg;
 			break;
+		case 'l':
+			flags |= TAP_CTL_LIST_LIVE;
+			break;
+		case 'T':
+			timeout = atoi(optarg);
+			if (timeout <= 0)
+				goto usage;
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -149,7 +165,7 @@ tap_cli_list(int argc, char **argv)
 	if (pid != -1)
 		err = tap_ctl_list_pid(pid, &list);
 	else
-		err = tap_ctl_list(&list);
+		err = tap_ctl_list_flags(&list, flags, timeout);
 	if (err)
 		return -err;
 
@@ -269,10 +285,15 @@ tap_cli_create_usage(FILE *stream)
 {
 	fprintf(stream, "usage: create <-a type:/path/to/file> [-d device name] [-R readonly] "
 		"[-e <minor> stack on existing tapdisk for the parent chain] "
-		"[-r turn on read caching into leaf node] [-2 <path> "
+		"[-r turn on read caching into leaf node] "
+		"[-w turn on write-back caching in local storage] [-2 <path> "
 		"use secondary image (in mirror mode if no -s)] [-s "
 		"fail over to the secondary image on ENOSPC] "
+		"[-M copy the disk to the mirror secondary] "
+		"[-b <MiB> cache shared parents in memory, within MiB] "
 		"[-t request timeout in seconds] [-D no O_DIRECT] "
+		"[-4 4K logical sectors] "
+		"[-V check CRC32C of every 4K read and written] "
 		"[-c <cgroup-slice>] "
 		"[-C <path/to/logfile> insert log layer to track changed blocks]\n");
 }
@@ -280,7 +301,7 @@ tap_cli_create_usage(FILE *stream)
 static int
 tap_cli_create(int argc, char **argv)
 {
-	int c, err, flags, prt_minor, timeout;
+	int c, err, flags, prt_minor, timeout, cache_size;
 	char *args, *devname, *secondary;
 	char *slice = NULL;
 	char d_flag = 0;
@@ -292,9 +313,10 @@ tap_cli_create(int argc, char **argv)
 	prt_minor = -1;
 	flags     = 0;
 	timeout   = 0;
+	cache_size = 0;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:c:RDd:e:r2:st:C:h")) != -1) {
+	while ((c = getopt(argc, argv, "a:c:RDd:e:rw2:sMb:t:C:4Vh")) != -1) {
 		switch (c) {
 		case 'a':
 			args = optarg;
@@ -312,9 +334,18 @@ tap_cli_create(int argc, char **argv)
 		case 'D':
 			flags |= TAPDISK_MESSAGE_FLAG_NO_O_DIRECT;
 			break;
+		case '4':
+			flags |= TAPDISK_MESSAGE_FLAG_4K;
+			break;
+		case 'V':
+			flags |= TAPDISK_MESSAGE_FLAG_CRC;
+			break;
 		case 'r':
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LCACHE;
 			break;
+		case 'w':
+			flags |= TAPDISK_MESSAGE_FLAG_ADD_WBCACHE;
+			break;
 		case 'e':
 			flags |= TAPDISK_MESSAGE_FLAG_REUSE_PRT;
 			prt_minor = atoi(optarg);
@@ -326,6 +357,13 @@ tap_cli_create(int argc, char **argv)
 		case 's':
 			flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
 			break;
+		case 'M':
+			flags |= TAPDISK_MESSAGE_FLAG_MIRROR_COPY;
+			break;
+		case 'b':
+			flags |= TAPDISK_MESSAGE_FLAG_ADD_CACHE;
+			cache_size = atoi(optarg);
+			break;
 		case 't':
 			timeout = atoi(optarg);
 			break;
@@ -345,7 +383,7 @@ tap_cli_create(int argc, char **argv)
 		goto usage;
 
 	err = tap_ctl_create(args, &devname, flags, prt_minor, secondary,
-			timeout, slice, logpath);
+			timeout, cache_size, slice, logpath);
 	if (!err)
 		printf("%s\n", devname);
 
@@ -425,7 +463,7 @@ usage:
 static void
 tap_cli_spawn_usage(FILE *stream)
 {
-	fprintf(stream, "usage: spawn [ -c <cgroup-slice> ]\n");
+	fprintf(stream, "usage: spawn [ -c <cgroup-slice> ] [ -a <cpu-list> ]\n");
 }
 
 static int
@@ -434,13 +472,17 @@ tap_cli_spawn(int argc, char **argv)
 	int c, tty;
 	pid_t pid;
 	char *slice = NULL;
+	char *cpus = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "c:h")) != -1) {
+	while ((c = getopt(argc, argv, "c:a:h")) != -1) {
 		switch (c) {
 		case 'c':
 			slice = optarg;
 			break;
+		case 'a':
+			cpus = optarg;
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -449,7 +491,7 @@ tap_cli_spawn(int argc, char **argv)
 		}
 	}
 
-	pid = tap_ctl_spawn(slice);
+	pid = tap_ctl_spawn_cpus(slice, cpus);
 	if (pid < 0)
 		return pid;
 
@@ -466,6 +508,59 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_pool_usage(FILE *stream)
+{
+	fprintf(stream, "usage: pool [ -s <size> ]\n");
+}
+
+static int
+tap_cli_pool(int argc, char **argv)
+{
+	pid_t pids[256];
+	int c, i, n, err, size;
+
+	size = -1;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "s:h")) != -1) {
+		switch (c) {
+		case 's':
+			size = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_pool_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (size >= 0) {
+		err = tap_ctl_pool_set_size(size);
+		if (err)
+			return err;
+
+		err = tap_ctl_pool_fill();
+		if (err)
+			return err;
+	}
+
+	n = tap_ctl_pool_list(pids, sizeof(pids) / sizeof(pids[0]));
+	if (n < 0)
+		return n;
+
+	printf("size=%d idle=%d\n", tap_ctl_pool_get_size(), n);
+	for (i = 0; i < n; i++)
+		printf("pid=%d\n", pids[i]);
+
+	return 0;
+
+usage:
+	tap_cli_pool_usage(stderr);
+	return EINVAL;
+}
+
 static void
 tap_cli_attach_usage(FILE *stream)
 {
@@ -651,7 +746,7 @@ static void
 tap_cli_unpause_usage(FILE *stream)
 {
 	fprintf(stream, "usage: unpause <-p pid> <-m minor> [-a type:/path/to/file] "
-    "[-2 secondary] "
+    "[-2 secondary] [-M copy the disk to the mirror secondary] "
     "[-c </path/to/logfile> insert log layer to track changed blocks]\n");
 }
 
@@ -670,7 +765,7 @@ tap_cli_unpause(int argc, char **argv)
 	logpath	   = NULL;	
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "p:m:a:2:c:h")) != -1) {
+	while ((c = getopt(argc, argv, "p:m:a:2:Mc:h")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -685,6 +780,9 @@ tap_cli_unpause(int argc, char **argv)
 			flags |= TAPDISK_MESSAGE_FLAG_SECONDARY;
 			secondary = optarg;
 			break;
+		case 'M':
+			flags |= TAPDISK_MESSAGE_FLAG_MIRROR_COPY;
+			break;
 		case 'c':
 			logpath = optarg;
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LOG;
@@ -707,6 +805,75 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_group_usage(FILE *stream, const char *cmd)
+{
+	fprintf(stream, "usage: %s <-v pid:minor>... [-t timeout]\n"
+		"%s the VBDs together, as for a snapshot of all the disks "
+		"of a VM.\n", cmd,
+		strcmp(cmd, "pause-group") ? "Resumes" : "Pauses");
+}
+
+static int
+tap_cli_group(int argc, char **argv)
+{
+	const char *cmd = argv[0];
+	struct timeval *timeout;
+	pid_t *pids;
+	int *minors;
+	int c, n, err;
+
+	pids   = calloc(argc, sizeof(*pids));
+	minors = calloc(argc, sizeof(*minors));
+	if (!pids || !minors) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	n       = 0;
+	timeout = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "v:t:h")) != -1) {
+		switch (c) {
+		case 'v':
+			if (sscanf(optarg, "%d:%d", &pids[n], &minors[n]) != 2)
+				goto usage;
+			n++;
+			break;
+		case 't':
+			timeout = tap_cli_timeout(optarg);
+			if (!timeout)
+				goto usage;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_group_usage(stdout, cmd);
+			err = 0;
+			goto out;
+		}
+	}
+
+	if (!n)
+		goto usage;
+
+	if (!strcmp(cmd, "pause-group"))
+		err = -tap_ctl_pause_group(pids, minors, n, timeout);
+	else
+		err = -tap_ctl_resume_group(pids, minors, n);
+
+out:
+	free(pids);
+	free(minors);
+	return err;
+
+usage:
+	tap_cli_group_usage(stderr, cmd);
+	err = EINVAL;
+	goto out;
+}
+
 static void
 tap_cli_major_usage(FILE *stream)
 {
@@ -760,10 +927,15 @@ tap_cli_open_usage(FILE *stream)
 {
 	fprintf(stream, "usage: open <-p pid> <-m minor> <-a type:/path/to/file> [-R readonly] "
 		"[-e <minor> stack on existing tapdisk for the parent chain] "
-		"[-r turn on read caching into leaf node] [-2 <path> "
+		"[-r turn on read caching into leaf node] "
+		"[-w turn on write-back caching in local storage] [-2 <path> "
 		"use secondary image (in mirror mode if no -s)] [-s "
 		"fail over to the secondary image on ENOSPC] "
+		"[-M copy the disk to the mirror secondary] "
+		"[-b <MiB> cache shared parents in memory, within MiB] "
 		"[-t request timeout in seconds] [-D no O_DIRECT] "
+		"[-4 4K logical sectors] "
+		"[-V check CRC32C of every 4K read and written] "
 		"[-C </path/to/logfile> insert log layer to track changed blocks] "
 		"[-E read encryption key from stdin]\n");
 }
@@ -772,7 +944,7 @@ static int
 tap_cli_open(int argc, char **argv)
 {
 	const char *args, *secondary, *logpath;
-	int c, pid, minor, flags, prt_minor, timeout;
+	int c, pid, minor, flags, prt_minor, timeout, cache_size;
 	uint8_t *encryption_key;
 	ssize_t key_size = 0;
 
@@ -781,13 +953,14 @@ tap_cli_open(int argc, char **argv)
 	minor      = -1;
 	prt_minor  = -1;
 	timeout    = 0;
+	cache_size = 0;
 	args       = NULL;
 	secondary  = NULL;
 	logpath    = NULL;
 	encryption_key = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:RDm:p:e:r2:st:C:Eh")) != -1) {
+	while ((c = getopt(argc, argv, "a:RDm:p:e:rw2:sMb:t:C:4VEh")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -804,9 +977,18 @@ tap_cli_open(int argc, char **argv)
 		case 'D':
 			flags |= TAPDISK_MESSAGE_FLAG_NO_O_DIRECT;
 			break;
+		case '4':
+			flags |= TAPDISK_MESSAGE_FLAG_4K;
+			break;
+		case 'V':
+			flags |= TAPDISK_MESSAGE_FLAG_CRC;
+			break;
 		case 'r':
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LCACHE;
 			break;
+		case 'w':
+			flags |= TAPDISK_MESSAGE_FLAG_ADD_WBCACHE;
+			break;
 		case 'e':
 			flags |= TAPDISK_MESSAGE_FLAG_REUSE_PRT;
 			prt_minor = atoi(optarg);
@@ -818,6 +1000,13 @@ tap_cli_open(int argc, char **argv)
 		case 's':
 			flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
 			break;
+		case 'M':
+			flags |= TAPDISK_MESSAGE_FLAG_MIRROR_COPY;
+			break;
+		case 'b':
+			flags |= TAPDISK_MESSAGE_FLAG_ADD_CACHE;
+			cache_size = atoi(optarg);
+			break;
 		case 't':
 			timeout = atoi(optarg);
 			break;
@@ -859,7 +1048,8 @@ tap_cli_open(int argc, char **argv)
 		goto usage;
 
 	return tap_ctl_open(pid, minor, args, flags, prt_minor, secondary,
-			    timeout, logpath, (uint8_t)key_size, encryption_key);
+			    timeout, cache_size, logpath, (uint8_t)key_size,
+			    encryption_key);
 
 usage:
 	tap_cli_open_usage(stderr);
@@ -873,22 +1063,153 @@ static void
 tap_cli_stats_usage(FILE *stream)
 {
 	fprintf(stream, "usage: stats <-p pid> <-m minor>\n"
+			"       stats <-p pid> [-m minor] -b\n"
+			"       stats <-p pid> [-m minor] <-s interval> "
+			"[-t threshold]\n"
 			"\n"
 			"Prints a Python dictionary with the VBD stats. The images are "
-			"listed in reverse order (leaf to root)\n");
+			"listed in reverse order (leaf to root)\n"
+			"With -b, fetches counters in binary and prints a line "
+			"per VBD, of all VBDs without -m\n"
+			"With -s, subscribes to updates every interval ms and "
+			"prints a line per VBD which moved, by threshold sectors "
+			"if given, with the counters since its last line\n");
+}
+
+static int
+tap_cli_stats_bin_print(void *buf, ssize_t len)
+{
+	struct tapdisk_stats_bin_hdr *hdr;
+	struct tapdisk_stats_bin_vbd *rec;
+	uint32_t i;
+
+	hdr = buf;
+	if (len < sizeof(*hdr) ||
+	    hdr->rec_size < sizeof(*rec) ||
+	    len < sizeof(*hdr) + (size_t)hdr->count * hdr->rec_size)
+		return EPROTO;
+
+	for (i = 0; i < hdr->count; i++) {
+		rec = buf + sizeof(*hdr) + i * hdr->rec_size;
+
+		printf("%u %#x %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64
+		       " %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64
+		       " %"PRIu64" %"PRIu64" %"PRIu64" %u\n",
+		       rec->minor, rec->state, rec->secs_rd, rec->secs_wr,
+		       rec->received, rec->returned, rec->kicked,
+		       rec->secs_pending, rec->retries, rec->errors,
+		       rec->hits_rd, rec->hits_wr, rec->fail_rd, rec->fail_wr,
+		       rec->images);
+	}
+
+	return 0;
+}
+
+#define TAP_CLI_STATS_HEADER \
+	"minor state secs_rd secs_wr received returned kicked" \
+	" secs_pending retries errors hits_rd hits_wr fail_rd fail_wr" \
+	" images\n"
+
+static int
+tap_cli_stats_bin(pid_t pid, int minor)
+{
+	size_t size = 64 << 10;
+	ssize_t len;
+	void *buf;
+	int err;
+
+	for (;;) {
+		buf = malloc(size);
+		if (!buf)
+			return ENOMEM;
+
+		len = tap_ctl_stats_bin(pid, minor, buf, size);
+		if (len != -ENOSPC)
+			break;
+
+		free(buf);
+		size *= 2;
+	}
+
+	if (len < 0) {
+		free(buf);
+		return -len;
+	}
+
+	printf(TAP_CLI_STATS_HEADER);
+	err = tap_cli_stats_bin_print(buf, len);
+
+	free(buf);
+	return err;
+}
+
+/*
+ * Runs until tapdisk goes away. An update too large for the buffer is
+ * lost, the buffer grown for the next.
+ */
+static int
+tap_cli_stats_subscribe(pid_t pid, int minor, unsigned int interval,
+			unsigned int threshold)
+{
+	size_t size = 64 << 10;
+	ssize_t len;
+	void *buf, *tmp;
+	int sfd, err;
+
+	buf = malloc(size);
+	if (!buf)
+		return ENOMEM;
+
+	sfd = tap_ctl_stats_subscribe(pid, minor, interval, threshold);
+	if (sfd < 0) {
+		free(buf);
+		return -sfd;
+	}
+
+	printf(TAP_CLI_STATS_HEADER);
+
+	for (;;) {
+		len = tap_ctl_stats_update(sfd, buf, size, NULL);
+		if (len == -ENOSPC) {
+			tmp = realloc(buf, size * 2);
+			if (!tmp) {
+				err = ENOMEM;
+				break;
+			}
+			buf   = tmp;
+			size *= 2;
+			continue;
+		}
+		if (len < 0) {
+			err = -len;
+			break;
+		}
+
+		err = tap_cli_stats_bin_print(buf, len);
+		if (err)
+			break;
+		fflush(stdout);
+	}
+
+	close(sfd);
+	free(buf);
+	return err;
 }
 
 static int
 tap_cli_stats(int argc, char **argv)
 {
 	pid_t pid;
-	int c, minor, err;
+	int c, minor, bin, interval, threshold, err;
 
 	pid  = -1;
 	minor   = -1;
+	bin  = 0;
+	interval  = -1;
+	threshold = 0;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "p:m:h")) != -1) {
+	while ((c = getopt(argc, argv, "p:m:bs:t:h")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -896,6 +1217,15 @@ tap_cli_stats(int argc, char **argv)
 		case 'm':
 			minor = atoi(optarg);
 			break;
+		case 'b':
+			bin = 1;
+			break;
+		case 's':
+			interval = atoi(optarg);
+			break;
+		case 't':
+			threshold = atoi(optarg);
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -904,6 +1234,12 @@ tap_cli_stats(int argc, char **argv)
 		}
 	}
 
+	if (interval >= 0 && pid != -1 && threshold >= 0)
+		return tap_cli_stats_subscribe(pid, minor, interval, threshold);
+
+	if (bin && pid != -1)
+		return tap_cli_stats_bin(pid, minor);
+
 	if (pid == -1 || minor == -1)
 		goto usage;
 
@@ -920,6 +1256,613 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_trace_usage(FILE *stream)
+{
+	fprintf(stream, "usage: trace <-p pid> <-m minor> <-s records | -x>\n"
+			"       trace <-p pid> <-m minor> [-f file] [-w]\n"
+			"\n"
+			"Starts (-s, 0 for the default ring size) or stops (-x) "
+			"I/O tracing of a VBD\n"
+			"Otherwise drains the trace ring, printing a line per "
+			"event, or appending the binary records to a file (-f), "
+			"and keeps following it with -w\n");
+}
+
+static const char *
+tap_cli_trace_event_name(int event)
+{
+	switch (event) {
+	case TAPDISK_TRACE_QUEUE:
+		return "Q";
+	case TAPDISK_TRACE_SUBMIT:
+		return "S";
+	case TAPDISK_TRACE_COMPLETE:
+		return "C";
+	case TAPDISK_TRACE_DONE:
+		return "D";
+	}
+	return "?";
+}
+
+static int
+tap_cli_trace_dump(pid_t pid, int minor, FILE *out, int follow)
+{
+	static const char ops[] = "RWDZ"; /* TD_OP_* */
+	struct tapdisk_trace_hdr *hdr;
+	struct tapdisk_trace_rec *rec;
+	size_t size = 1 << 20;
+	ssize_t len;
+	void *buf;
+	uint32_t i;
+	int err = 0;
+
+	buf = malloc(size);
+	if (!buf)
+		return ENOMEM;
+
+	do {
+		len = tap_ctl_trace_read(pid, minor, buf, size);
+		if (len < 0) {
+			err = -len;
+			break;
+		}
+
+		hdr = buf;
+		if (len < sizeof(*hdr) ||
+		    hdr->rec_size < sizeof(*rec) ||
+		    len < sizeof(*hdr) + (size_t)hdr->count * hdr->rec_size) {
+			err = EPROTO;
+			break;
+		}
+
+		if (hdr->dropped)
+			fprintf(stderr, "%u records dropped\n", hdr->dropped);
+
+		if (out) {
+			if (fwrite(buf, len, 1, out) != 1) {
+				err = errno;
+				break;
+			}
+			fflush(out);
+		} else {
+			for (i = 0; i < hdr->count; i++) {
+				rec = buf + sizeof(*hdr) + i * hdr->rec_size;
+
+				printf("%"PRIu64".%09"PRIu64" %s %u %c %"PRIu64
+				       " %u %d",
+				       rec->ts / 1000000000, rec->ts % 1000000000,
+				       tap_cli_trace_event_name(rec->event),
+				       rec->seq,
+				       rec->op < sizeof(ops) - 1 ?
+				       ops[rec->op] : '?',
+				       rec->sec, rec->secs, rec->error);
+				if (rec->level != TAPDISK_TRACE_NO_LEVEL)
+					printf(" L%u", rec->level);
+				printf("\n");
+			}
+			fflush(stdout);
+		}
+
+		if (follow && hdr->count < (size - sizeof(*hdr)) / sizeof(*rec))
+			usleep(100000);
+	} while (follow);
+
+	free(buf);
+	return err;
+}
+
+static int
+tap_cli_trace(int argc, char **argv)
+{
+	const char *file;
+	FILE *out;
+	pid_t pid;
+	int c, minor, start, stop, follow, size, err;
+
+	pid    = -1;
+	minor  = -1;
+	start  = 0;
+	stop   = 0;
+	follow = 0;
+	size   = 0;
+	file   = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:s:xf:wh")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 's':
+			start = 1;
+			size  = atoi(optarg);
+			break;
+		case 'x':
+			stop = 1;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'w':
+			follow = 1;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_trace_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || size < 0 || (start && stop))
+		goto usage;
+
+	if (start)
+		return -tap_ctl_trace_start(pid, minor, size);
+
+	if (stop)
+		return -tap_ctl_trace_stop(pid, minor);
+
+	out = NULL;
+	if (file) {
+		out = fopen(file, "a");
+		if (!out) {
+			err = errno;
+			fprintf(stderr, "%s: %s\n", file, strerror(err));
+			return err;
+		}
+	}
+
+	err = tap_cli_trace_dump(pid, minor, out, follow);
+
+	if (out)
+		fclose(out);
+
+	return err;
+
+usage:
+	tap_cli_trace_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_profile_usage(FILE *stream)
+{
+	fprintf(stream, "usage: profile <-p pid> <-m minor> <-s | -x | -r>\n"
+		"Starts (-s) or stops (-x) timing each stage requests go "
+		"through, or clears the timings (-r). See the profile section "
+		"of stats.\n");
+}
+
+static int
+tap_cli_profile(int argc, char **argv)
+{
+	pid_t pid;
+	int c, minor, cmd;
+
+	pid   = -1;
+	minor = -1;
+	cmd   = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:sxrh")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 's':
+		case 'x':
+		case 'r':
+			if (cmd)
+				goto usage;
+			cmd = c;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_profile_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	switch (cmd) {
+	case 's':
+		return -tap_ctl_profile_start(pid, minor);
+	case 'x':
+		return -tap_ctl_profile_stop(pid, minor);
+	case 'r':
+		return -tap_ctl_profile_reset(pid, minor);
+	}
+
+usage:
+	tap_cli_profile_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_coalesce_usage(FILE *stream)
+{
+	fprintf(stream, "usage: coalesce <-p pid> <-m minor> [-r MiB/s] [-x]\n"
+		"Merges the leaf of the VBD into its parent while it runs, "
+		"then drops it from the chain. -x abandons a coalesce in "
+		"progress.\n");
+}
+
+static int
+tap_cli_coalesce(int argc, char **argv)
+{
+	pid_t pid;
+	int c, minor, rate, stop;
+
+	pid   = -1;
+	minor = -1;
+	rate  = 0;
+	stop  = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:r:xh")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'x':
+			stop = 1;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_coalesce_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || rate < 0)
+		goto usage;
+
+	if (stop)
+		return -tap_ctl_coalesce_stop(pid, minor);
+
+	return -tap_ctl_coalesce_start(pid, minor, rate);
+
+usage:
+	tap_cli_coalesce_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_backup_usage(FILE *stream)
+{
+	fprintf(stream, "usage: backup <-p pid> <-m minor> [-x]\n"
+		"Exports the VBD as it is now, read-only over NBD, while it "
+		"runs on. -x ends the export.\n");
+}
+
+static int
+tap_cli_backup(int argc, char **argv)
+{
+	pid_t pid;
+	int c, minor, stop;
+
+	pid   = -1;
+	minor = -1;
+	stop  = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:xh")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'x':
+			stop = 1;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_backup_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	if (stop)
+		return -tap_ctl_backup_stop(pid, minor);
+
+	return -tap_ctl_backup_start(pid, minor);
+
+usage:
+	tap_cli_backup_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_clone_usage(FILE *stream)
+{
+	fprintf(stream, "usage: clone <-p pid> <-m minor> <-N new image>\n"
+		"Clones the aio image of the VBD to a new file as a reflink, "
+		"without a new chain level.\n");
+}
+
+static int
+tap_cli_clone(int argc, char **argv)
+{
+	const char *path;
+	pid_t pid;
+	int c, minor;
+
+	pid   = -1;
+	minor = -1;
+	path  = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:N:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'N':
+			path = optarg;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_clone_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || !path)
+		goto usage;
+
+	return -tap_ctl_clone(pid, minor, path);
+
+usage:
+	tap_cli_clone_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_cgroup_usage(FILE *stream)
+{
+	fprintf(stream, "usage: cgroup <-p pid> <-m minor> <-c cgroup dir>\n"
+		"Charges the I/O of the VBD to the guest's cgroup, "
+		"best before attach.\n");
+}
+
+static int
+tap_cli_cgroup(int argc, char **argv)
+{
+	const char *cgroup;
+	pid_t pid;
+	int c, minor;
+
+	pid    = -1;
+	minor  = -1;
+	cgroup = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:c:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'c':
+			cgroup = optarg;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_cgroup_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || !cgroup)
+		goto usage;
+
+	return -tap_ctl_cgroup(pid, minor, cgroup);
+
+usage:
+	tap_cli_cgroup_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_rotate_usage(FILE *stream)
+{
+	fprintf(stream, "usage: rotate <-p pid> <-m minor> <-l new log>\n"
+		"Continues the VBD's changed block tracking in a new log, "
+		"without a pause.\n");
+}
+
+static int
+tap_cli_rotate(int argc, char **argv)
+{
+	const char *log;
+	uint64_t epoch;
+	pid_t pid;
+	int c, minor, err;
+
+	pid   = -1;
+	minor = -1;
+	log   = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:l:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'l':
+			log = optarg;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_rotate_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || !log)
+		goto usage;
+
+	err = tap_ctl_cbt_rotate(pid, minor, log, &epoch);
+	if (!err && epoch)
+		printf("epoch %"PRIu64"\n", epoch);
+
+	return -err;
+
+usage:
+	tap_cli_rotate_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_flight_usage(FILE *stream)
+{
+	fprintf(stream, "usage: flight <-p pid> [-r]\n"
+		"Prints the last log lines a tapdisk, running or not, kept in "
+		"its flight recorder, then removes the recorder with -r.\n");
+}
+
+static int
+tap_cli_flight(int argc, char **argv)
+{
+	char *lines;
+	ssize_t len;
+	pid_t pid;
+	int c, remove;
+
+	pid    = -1;
+	remove = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:rh")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'r':
+			remove = 1;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_flight_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1)
+		goto usage;
+
+	len = tap_ctl_flight_read(pid, &lines);
+	if (len < 0) {
+		fprintf(stderr, "flight recorder of %d: %s\n",
+			pid, strerror(-len));
+		return -len;
+	}
+
+	fwrite(lines, len, 1, stdout);
+	free(lines);
+
+	if (remove)
+		return -tap_ctl_flight_remove(pid);
+
+	return 0;
+
+usage:
+	tap_cli_flight_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_handoff_usage(FILE *stream)
+{
+	fprintf(stream, "usage: handoff <-p pid> <-m minor> <-P to pid> "
+		"[-M to minor]\n"
+		"Moves the NBD clients of the paused VBD to another tapdisk "
+		"serving the same image, by default at the same minor.\n");
+}
+
+static int
+tap_cli_handoff(int argc, char **argv)
+{
+	pid_t pid, to_pid;
+	int c, minor, to_minor;
+
+	pid      = -1;
+	minor    = -1;
+	to_pid   = -1;
+	to_minor = -1;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:P:M:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'P':
+			to_pid = atoi(optarg);
+			break;
+		case 'M':
+			to_minor = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_handoff_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || to_pid == -1)
+		goto usage;
+
+	if (to_minor == -1)
+		to_minor = minor;
+
+	return -tap_ctl_nbd_handoff(pid, minor, to_pid, to_minor);
+
+usage:
+	tap_cli_handoff_usage(stderr);
+	return EINVAL;
+}
+
 static void
 tap_cli_check_usage(FILE *stream)
 {
@@ -953,13 +1896,25 @@ struct command commands[] = {
 	{ .name = "create",       .func = tap_cli_create        },
 	{ .name = "destroy",      .func = tap_cli_destroy       },
 	{ .name = "spawn",        .func = tap_cli_spawn         },
+	{ .name = "pool",         .func = tap_cli_pool          },
 	{ .name = "attach",       .func = tap_cli_attach        },
 	{ .name = "detach",       .func = tap_cli_detach        },
 	{ .name = "open",         .func = tap_cli_open          },
 	{ .name = "close",        .func = tap_cli_close         },
 	{ .name = "pause",        .func = tap_cli_pause         },
 	{ .name = "unpause",      .func = tap_cli_unpause       },
+	{ .name = "pause-group",  .func = tap_cli_group         },
+	{ .name = "unpause-group", .func = tap_cli_group        },
 	{ .name = "stats",        .func = tap_cli_stats         },
+	{ .name = "trace",        .func = tap_cli_trace         },
+	{ .name = "profile",      .func = tap_cli_profile       },
+	{ .name = "coalesce",     .func = tap_cli_coalesce      },
+	{ .name = "backup",       .func = tap_cli_backup        },
+	{ .name = "clone",        .func = tap_cli_clone         },
+	{ .name = "cgroup",       .func = tap_cli_cgroup        },
+	{ .name = "rotate",       .func = tap_cli_rotate        },
+	{ .name = "flight",       .func = tap_cli_flight        },
+	{ .name = "handoff",      .func = tap_cli_handoff       },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
 };
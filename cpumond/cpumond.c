@@ -38,6 +38,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <getopt.h>
+#include <time.h>
 #include "cpumond.h"
 
 #ifndef DEBUG
@@ -47,6 +49,13 @@
 
 int run;
 
+typedef struct {
+    long long total;
+    long long idle;
+    long long steal;
+    int       seen;
+} cpustat_t;
+
 void sighandler(int signo){
     if (signo == SIGINT)
         run = 0;
@@ -56,7 +65,7 @@ void cpumond_destroy(cpumond_entry_t *cpumond_entry){
     assert(cpumond_entry);
 
     if ((cpumond_entry->mm != NULL) && (cpumond_entry->mm != MAP_FAILED))
-        if (munmap(cpumond_entry->mm, sizeof(cpumond_t)) == -1)
+        if (munmap(cpumond_entry->mm, cpumond_entry->size) == -1)
             perror("munmap");
 
     if (cpumond_entry->fd >= 0)
@@ -74,7 +83,7 @@ void cpumond_destroy(cpumond_entry_t *cpumond_entry){
     return;
 }
 
-cpumond_entry_t *cpumond_create(char *path){
+cpumond_entry_t *cpumond_create(char *path, int nr_cpus, int interval_ms){
     cpumond_entry_t *cpumond_entry;
 
     assert(path);
@@ -85,6 +94,8 @@ cpumond_entry_t *cpumond_create(char *path){
         goto err;
     }
 
+    cpumond_entry->size = CPUMOND_PSI_SIZE(nr_cpus);
+
     cpumond_entry->fd = shm_open(path, O_RDWR|O_CREAT|O_EXCL,
                              S_IRUSR|S_IRGRP|S_IROTH);
     if (cpumond_entry->fd == -1){
@@ -98,18 +109,23 @@ cpumond_entry_t *cpumond_create(char *path){
         goto err;
     }
 
-    if (ftruncate(cpumond_entry->fd, sizeof(cpumond_t)) == -1){
+    if (ftruncate(cpumond_entry->fd, cpumond_entry->size) == -1){
         perror("ftruncate");
         goto err;
     }
 
-    cpumond_entry->mm = mmap(NULL, sizeof(cpumond_t), PROT_READ | PROT_WRITE,
+    cpumond_entry->mm = mmap(NULL, cpumond_entry->size, PROT_READ | PROT_WRITE,
                          MAP_SHARED, cpumond_entry->fd, 0);
     if (cpumond_entry->mm == MAP_FAILED){
         perror("mmap");
         goto err;
     }
 
+    cpumond_entry->mm->nr_cpus     = nr_cpus;
+    cpumond_entry->mm->interval_ms = interval_ms;
+    cpumond_entry->mm->version     = CPUMOND_VERSION;
+    cpumond_entry->mm->flags       = CPUMOND_F_PSI;
+
     return cpumond_entry;
 
 err:
@@ -119,10 +135,36 @@ err:
     return NULL;
 }
 
-inline int statread(int statfd, long long *total, long long *idle){
+static int statparse(const char *line, cpustat_t *stat){
     long long val[10];
-    char      buf[256];
-    int       i, err = 0;
+    int       i;
+
+    if (sscanf(line, "%lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
+               &val[0], &val[1], &val[2], &val[3], &val[4], &val[5], &val[6],
+               &val[7], &val[8], &val[9]) != 10)
+        return -1;
+
+    stat->idle  = val[3];
+    stat->steal = val[7];
+    stat->total = 0;
+    for (i=0; i<10; i++)
+        stat->total += val[i];
+    stat->seen  = 1;
+
+    return 0;
+}
+
+/*
+ * Reads /proc/stat into *buf, growing it as needed, and parses the host-wide
+ * "cpu" line into *all and the "cpuN" lines into cpus[N]. CPUs that are
+ * offline have no line and are left with seen == 0.
+ */
+int statread(int statfd, char **buf, size_t *size, cpustat_t *all,
+             cpustat_t *cpus, int nr_cpus){
+    char     *line, *end;
+    size_t    len = 0;
+    ssize_t   n;
+    int       cpu, err = 0;
 
     if (lseek(statfd, 0, SEEK_SET) == -1){
         err = (errno)?errno:-1;
@@ -130,34 +172,132 @@ inline int statread(int statfd, long long *total, long long *idle){
         goto out;
     }
 
-    memset(buf, 0, sizeof(buf));
-    if (read(statfd, buf, sizeof(buf)-1) <= 0){
-        err = (errno)?errno:-1;
-        perror("read");
-        goto out;
-    }
-    if (sscanf(buf, "cpu %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
-               &val[0], &val[1], &val[2], &val[3], &val[4], &val[5], &val[6],
-               &val[7], &val[8], &val[9]) != 10){
-        err = (errno)?errno:-1;
-        perror("sscanf");
-        goto out;
+    do {
+        if (len + 1 >= *size){
+            char *p = realloc(*buf, *size * 2);
+            if (!p){
+                err = ENOMEM;
+                perror("realloc");
+                goto out;
+            }
+            *buf   = p;
+            *size *= 2;
+        }
+        n = read(statfd, *buf + len, *size - len - 1);
+        if (n < 0){
+            err = (errno)?errno:-1;
+            perror("read");
+            goto out;
+        }
+        len += n;
+    } while (n > 0);
+    (*buf)[len] = '\0';
+
+    memset(all, 0, sizeof(*all));
+    for (cpu=0; cpu<nr_cpus; cpu++)
+        cpus[cpu].seen = 0;
+
+    for (line = *buf; line && !strncmp(line, "cpu", 3); line = end){
+        end = strchr(line, '\n');
+        if (end)
+            *end++ = '\0';
+
+        if (line[3] == ' '){
+            if (statparse(line + 3, all))
+                break;
+            continue;
+        }
+
+        cpu = strtol(line + 3, &line, 10);
+        if (cpu < 0 || cpu >= nr_cpus)
+            continue;
+        if (statparse(line, &cpus[cpu]))
+            break;
     }
 
-    *idle  = val[3];
-    *total = 0;
-    for (i=0; i<10; i++)
-        *total += val[i];
+    if (!all->seen){
+        err = EINVAL;
+        fprintf(stderr, "statread: malformed /proc/stat\n");
+    }
 
 out:
     return err;
 }
 
+static const char *psi_paths[CPUMOND_PSI_NR] = {
+    [CPUMOND_PSI_CPU]    = "/proc/pressure/cpu",
+    [CPUMOND_PSI_IO]     = "/proc/pressure/io",
+    [CPUMOND_PSI_MEMORY] = "/proc/pressure/memory",
+};
+
+/*
+ * Parses a /proc/pressure file into *psi. The cpu file of kernels before
+ * 5.13 has no "full" line, full10 and full60 are then left at zero.
+ */
+static int psiread(int fd, cpumond_psi_t *psi){
+    char     buf[256], *full;
+    ssize_t  n;
+
+    memset(psi, 0, sizeof(*psi));
+
+    n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+
+    if (sscanf(buf, "some avg10=%f avg60=%f", &psi->some10, &psi->some60) != 2)
+        return -1;
+
+    full = strstr(buf, "full ");
+    if (full && sscanf(full, "full avg10=%f avg60=%f",
+                       &psi->full10, &psi->full60) != 2)
+        psi->full10 = psi->full60 = 0;
+
+    psi->valid = 1;
+    return 0;
+}
+
+static inline float percent(long long part, long long total){
+    return 100.0 * part / total;
+}
+
+static uint64_t now_us(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 int cpumond_loop(cpumond_entry_t *cpumond_entry){
-    long long      idle1  = 0, idle2;
-    long long      total1 = 0, total2;
+    cpumond_t     *mm     = cpumond_entry->mm;
+    int            nr_cpus = mm->nr_cpus;
+    cpustat_t      all1   = { 0 }, all2;
+    cpustat_t     *cpus1  = NULL, *cpus2 = NULL;
+    cpumond_psi_t  psi[CPUMOND_PSI_NR];
+    int            psifd[CPUMOND_PSI_NR];
+    char          *buf    = NULL;
+    size_t         size   = 4096;
+    struct timespec interval;
+    uint64_t       seq;
     int            statfd = -1;
     int            err    =  0;
+    int            cpu, i;
+
+    /* without PSI in the kernel, the figures stay invalid */
+    for (i=0; i<CPUMOND_PSI_NR; i++)
+        psifd[i] = open(psi_paths[i], O_RDONLY | O_CLOEXEC);
+
+    interval.tv_sec  = mm->interval_ms / 1000;
+    interval.tv_nsec = (mm->interval_ms % 1000) * 1000000L;
+
+    buf   = malloc(size);
+    cpus1 = calloc(nr_cpus, sizeof(cpustat_t));
+    cpus2 = calloc(nr_cpus, sizeof(cpustat_t));
+    if (!buf || !cpus1 || !cpus2){
+        err = ENOMEM;
+        perror("malloc");
+        goto out;
+    }
 
     statfd = open("/proc/stat", O_RDONLY);
     if (statfd == -1){
@@ -167,41 +307,129 @@ int cpumond_loop(cpumond_entry_t *cpumond_entry){
     }
 
     while(run){
-        if (statread(statfd, &total2, &idle2) != 0)
+        err = statread(statfd, &buf, &size, &all2, cpus2, nr_cpus);
+        if (err)
             goto out;
 
-        cpumond_entry->mm->curr = 100.0 *
-            ((total2-total1)-(idle2-idle1))/(total2-total1);
+        for (i=0; i<CPUMOND_PSI_NR; i++)
+            if (psifd[i] == -1 || psiread(psifd[i], &psi[i]))
+                memset(&psi[i], 0, sizeof(psi[i]));
+
+        seq = mm->seq;
+        __atomic_store_n(&mm->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        /*
+         * With short intervals a counter may not have moved at all. Keep the
+         * last figures and the old sample in that case, the next interval
+         * then covers both.
+         */
+        if (all2.total > all1.total){
+            mm->curr = 100.0 *
+                ((all2.total-all1.total)-(all2.idle-all1.idle))/
+                (all2.total-all1.total);
+
+            mm->idle = 100 - mm->curr;
+            all1 = all2;
+        }
+
+        for (cpu=0; cpu<nr_cpus; cpu++){
+            cpumond_cpu_t *c = &mm->cpus[cpu];
+            long long dt;
 
-        cpumond_entry->mm->idle = 100 - cpumond_entry->mm->curr;
+            c->online = cpus2[cpu].seen;
+            if (!c->online)
+                continue;
+
+            dt = cpus2[cpu].total - cpus1[cpu].total;
+            if (dt <= 0)
+                continue;
+
+            c->idle  = percent(cpus2[cpu].idle - cpus1[cpu].idle, dt);
+            c->steal = percent(cpus2[cpu].steal - cpus1[cpu].steal, dt);
+            cpus1[cpu] = cpus2[cpu];
+        }
+
+        memcpy(CPUMOND_PSI(mm), psi, sizeof(psi));
+
+        mm->time_us = now_us();
+        __atomic_store_n(&mm->seq, seq + 2, __ATOMIC_RELEASE);
 
 #ifdef DEBUG
-        printf("total2: %lld, total1: %lld, idle2: %lld, idle1: %lld, " \
-               "cpumond_entry->mm->idle: %f\n", total2, total1, idle2, idle1,
-                cpumond_entry->mm->idle);
+        printf("total: %lld, idle: %lld, cpumond_entry->mm->idle: %f\n",
+               all1.total, all1.idle, mm->idle);
 #endif
 
-        total1 = total2;
-        idle1  = idle2;
-
-        sleep(1);
+        nanosleep(&interval, NULL);
     }
 
-    memset(cpumond_entry->mm, 0, sizeof(*(cpumond_entry->mm)));
+    seq = mm->seq;
+    __atomic_store_n(&mm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    mm->curr = 0;
+    mm->idle = 0;
+    memset(mm->cpus, 0, nr_cpus * sizeof(cpumond_cpu_t));
+    memset(CPUMOND_PSI(mm), 0, sizeof(psi));
+    __atomic_store_n(&mm->seq, seq + 2, __ATOMIC_RELEASE);
 
 out:
+    for (i=0; i<CPUMOND_PSI_NR; i++)
+        if (psifd[i] != -1)
+            close(psifd[i]);
     if (statfd != -1)
         close(statfd);
+    free(cpus2);
+    free(cpus1);
+    free(buf);
     return err;
 }
 
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [-i|--interval <ms>]\n", prog);
+}
+
 int main(int argc, char **argv){
-    cpumond_entry_t *cpumond_entry;
+    cpumond_entry_t *cpumond_entry = NULL;
+    int interval_ms = CPUMOND_INTERVAL_MS;
+    int nr_cpus;
     int err = EXIT_SUCCESS;
+    const struct option longopts[] = {
+        { "interval", required_argument, NULL, 'i' },
+        { "help",     no_argument,       NULL, 'h' },
+        { 0, 0, 0, 0 }
+    };
+    int c;
+
+    while ((c = getopt_long(argc, argv, "i:h", longopts, NULL)) != -1){
+        switch (c){
+        case 'i':
+            interval_ms = atoi(optarg);
+            if (interval_ms <= 0){
+                fprintf(stderr, "invalid interval %s\n", optarg);
+                err = EXIT_FAILURE;
+                goto out;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            goto out;
+        default:
+            usage(argv[0]);
+            err = EXIT_FAILURE;
+            goto out;
+        }
+    }
+
+    nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (nr_cpus <= 0){
+        perror("sysconf");
+        err = EXIT_FAILURE;
+        goto out;
+    }
 
     signal(SIGINT, sighandler);
 
-    cpumond_entry = cpumond_create(CPUMOND_PATH);
+    cpumond_entry = cpumond_create(CPUMOND_PATH, nr_cpus, interval_ms);
     if (!cpumond_entry){
         err = EXIT_FAILURE;
         goto out;
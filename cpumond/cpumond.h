@@ -28,15 +28,81 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdint.h>
+
 #define CPUMOND_PATH "/cpu_util_monitor"
 
+#define CPUMOND_VERSION 1
+
+/* Default sampling interval, milliseconds. */
+#define CPUMOND_INTERVAL_MS 1000
+
+typedef struct {
+    float idle;     // idle, percent of the interval
+    float steal;    // stolen by the hypervisor, percent of the interval
+    uint32_t online;
+    uint32_t pad;
+} cpumond_cpu_t;
+
+/*
+ * Layout of the shared segment. curr and idle are the host-wide figures and
+ * stay first, so that readers mapping only those two keep working.
+ *
+ * The per-CPU figures are indexed by CPU number, nr_cpus of them. They are
+ * updated under a sequence counter: seq is odd while an update is in
+ * progress, so a reader must retry if seq was odd or changed between before
+ * and after reading the figures. version is 0 if the segment was created by
+ * a cpumond that only published curr and idle.
+ */
 typedef struct {
     float curr;     // total usage
     float idle;     // idle
+    uint32_t version;
+    uint32_t nr_cpus;
+    uint32_t interval_ms;
+    uint32_t flags;
+    uint64_t seq;
+    uint64_t time_us;   // CLOCK_MONOTONIC time of the last update
+    cpumond_cpu_t cpus[];
 } cpumond_t;
 
+#define CPUMOND_SIZE(nr_cpus) \
+    (sizeof(cpumond_t) + (nr_cpus) * sizeof(cpumond_cpu_t))
+
+/*
+ * Pressure stall information of /proc/pressure/{cpu,io,memory}, updated
+ * under seq like the rest. With CPUMOND_F_PSI in flags, it follows the
+ * per-CPU figures; a resource the kernel does not report has valid == 0.
+ * Figures are percent of time, over the last 10 and 60 s, that some task
+ * (some) or all non-idle tasks (full) stalled on the resource.
+ */
+#define CPUMOND_F_PSI 0x1
+
+enum {
+    CPUMOND_PSI_CPU,
+    CPUMOND_PSI_IO,
+    CPUMOND_PSI_MEMORY,
+    CPUMOND_PSI_NR
+};
+
+typedef struct {
+    float some10;
+    float some60;
+    float full10;
+    float full60;
+    uint32_t valid;
+    uint32_t pad;
+} cpumond_psi_t;
+
+#define CPUMOND_PSI(mm) \
+    ((cpumond_psi_t *)&(mm)->cpus[(mm)->nr_cpus])
+
+#define CPUMOND_PSI_SIZE(nr_cpus) \
+    (CPUMOND_SIZE(nr_cpus) + CPUMOND_PSI_NR * sizeof(cpumond_psi_t))
+
 typedef struct {
     int    fd;
     char  *path;
+    size_t size;
     cpumond_t *mm;
 } cpumond_entry_t;
@@ -41,6 +41,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
+#include <linux/stat.h>
 
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
@@ -77,19 +78,12 @@ static int tdaio_get_image_info(int fd, td_disk_info_t *info)
 			(long long unsigned)(info->size << SECTOR_SHIFT),
 			(long long unsigned)info->size);
 
-		/*Get the sector size*/
-#if defined(BLKSSZGET)
-		{
-			info->sector_size = DEFAULT_SECTOR_SIZE;
-			ioctl(fd, BLKSSZGET, &info->sector_size);
-			
-			if (info->sector_size != DEFAULT_SECTOR_SIZE)
-				DPRINTF("Note: sector size is %ld (not %d)\n",
-					info->sector_size, DEFAULT_SECTOR_SIZE);
-		}
-#else
+		/*
+		 * The logical block size of the device is only the alignment
+		 * for O_DIRECT, see tdaio_get_alignment(). What the guest
+		 * sees is up to TD_OPEN_4K.
+		 */
 		info->sector_size = DEFAULT_SECTOR_SIZE;
-#endif
 
 	} else {
 		/*Local file? try fstat instead*/
@@ -110,11 +104,110 @@ static int tdaio_get_image_info(int fd, td_disk_info_t *info)
 	return 0;
 }
 
+static int tdaio_is_bdev(int fd)
+{
+	struct stat stat;
+
+	return !fstat(fd, &stat) && S_ISBLK(stat.st_mode);
+}
+
+/*
+ * O_DIRECT wants offsets, sizes and buffers aligned to the logical block
+ * size of the device, or for files to what the filesystem reports.
+ * Requests which are not get bounced through an aligned buffer.
+ */
+static void tdaio_get_alignment(struct tdaio_state *prv, int o_flags)
+{
+	int ssz;
+
+	if (!(o_flags & O_DIRECT)) {
+		prv->align = prv->mem_align = 0;
+		return;
+	}
+
+	prv->align = prv->mem_align = DEFAULT_SECTOR_SIZE;
+
+	if (prv->bdev) {
+		if (!ioctl(prv->fd, BLKSSZGET, &ssz) && ssz > 0)
+			prv->align = prv->mem_align = ssz;
+	}
+#ifdef STATX_DIOALIGN
+	else {
+		struct statx stx;
+
+		if (!statx(prv->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) &&
+		    (stx.stx_mask & STATX_DIOALIGN) &&
+		    stx.stx_dio_offset_align) {
+			prv->align     = stx.stx_dio_offset_align;
+			prv->mem_align = stx.stx_dio_mem_align;
+		}
+	}
+#endif
+
+	if (prv->align != DEFAULT_SECTOR_SIZE)
+		DPRINTF("O_DIRECT alignment %u, buffers %u\n",
+			prv->align, prv->mem_align);
+}
+
+static void tdaio_free_requests(struct tdaio_state *prv)
+{
+	struct aio_request_slab *slab, *next;
+
+	for (slab = prv->aio_slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+
+	free(prv->aio_free_list);
+
+	prv->aio_slabs      = NULL;
+	prv->aio_free_list  = NULL;
+	prv->aio_free_count = 0;
+	prv->aio_max        = 0;
+}
+
+/* Grow the request pool to @max requests; it never shrinks. */
+static int tdaio_grow_requests(struct tdaio_state *prv, int max)
+{
+	struct aio_request_slab *slab;
+	struct aio_request **list;
+	int i, n;
+
+	n = max - prv->aio_max;
+	if (n <= 0)
+		return 0;
+
+	list = realloc(prv->aio_free_list, max * sizeof(*list));
+	if (!list)
+		return -ENOMEM;
+	prv->aio_free_list = list;
+
+	slab = calloc(1, sizeof(*slab) + n * sizeof(struct aio_request));
+	if (!slab)
+		return -ENOMEM;
+
+	slab->next     = prv->aio_slabs;
+	prv->aio_slabs = slab;
+
+	for (i = 0; i < n; i++)
+		prv->aio_free_list[prv->aio_free_count++] = &slab->reqs[i];
+	prv->aio_max = max;
+
+	return 0;
+}
+
+static int tdaio_set_depth(td_driver_t *driver, int nr)
+{
+	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
+
+	return tdaio_grow_requests(prv, nr);
+}
+
 /* Open the disk file and initialize aio state. */
 int tdaio_open(td_driver_t *driver, const char *name,
 	       struct td_vbd_encryption *encryption, td_flag_t flags)
 {
-	int i, fd, ret, o_flags;
+	int fd, ret, o_flags;
 	struct tdaio_state *prv;
 
 	ret = 0;
@@ -123,10 +216,12 @@ int tdaio_open(td_driver_t *driver, const char *name,
 	DPRINTF("block-aio open('%s')", name);
 
 	memset(prv, 0, sizeof(struct tdaio_state));
+	INIT_LIST_HEAD(&prv->writes);
+	INIT_LIST_HEAD(&prv->deferred);
 
-	prv->aio_free_count = MAX_AIO_REQS;
-	for (i = 0; i < MAX_AIO_REQS; i++)
-		prv->aio_free_list[i] = &prv->aio_requests[i];
+	ret = tdaio_grow_requests(prv, MAX_AIO_REQS);
+	if (ret)
+		goto done;
 
 	/* Open the file */
 	o_flags = O_DIRECT | O_LARGEFILE | 
@@ -155,19 +250,245 @@ int tdaio_open(td_driver_t *driver, const char *name,
 		goto done;
 	}
 
+	if (flags & TD_OPEN_4K) {
+		if (driver->info.size & ((TD_4K_SECTOR_SIZE >> SECTOR_SHIFT) - 1)) {
+			DPRINTF("%s: size not a multiple of 4K\n", name);
+			close(fd);
+			ret = -EINVAL;
+			goto done;
+		}
+		driver->info.sector_size = TD_4K_SECTOR_SIZE;
+	}
+
         prv->fd = fd;
+	prv->bdev = tdaio_is_bdev(fd);
+	prv->driver = driver;
+	tdaio_get_alignment(prv, o_flags);
 
 done:
+	if (ret)
+		tdaio_free_requests(prv);
 	return ret;	
 }
 
+static char *tdaio_bounce_get(struct tdaio_state *prv, size_t size)
+{
+	void *buf;
+
+	if (size <= TDAIO_BOUNCE_SIZE) {
+		if (prv->bounce_count)
+			return prv->bounce_pool[--prv->bounce_count];
+		size = TDAIO_BOUNCE_SIZE;
+	}
+
+	if (posix_memalign(&buf, prv->mem_align > 4096 ? prv->mem_align : 4096, size))
+		return NULL;
+
+	return buf;
+}
+
+static void tdaio_bounce_put(struct tdaio_state *prv, char *buf, size_t size)
+{
+	if (size <= TDAIO_BOUNCE_SIZE && prv->bounce_count < TDAIO_BOUNCE_POOL)
+		prv->bounce_pool[prv->bounce_count++] = buf;
+	else
+		free(buf);
+}
+
+static struct aio_request *
+tdaio_get_request(struct tdaio_state *prv, td_request_t treq)
+{
+	struct aio_request *aio;
+
+	if (prv->aio_free_count == 0)
+		return NULL;
+
+	aio         = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq   = treq;
+	aio->state  = prv;
+	aio->offset = treq.sec  * (uint64_t)SECTOR_SIZE;
+	aio->size   = treq.secs * (size_t)SECTOR_SIZE;
+	aio->stage  = TDAIO_DIRECT;
+	aio->rmw    = 0;
+	aio->bounce = NULL;
+	aio->start  = aio->offset;
+	aio->end    = aio->offset + aio->size;
+	INIT_LIST_HEAD(&aio->entry);
+
+	return aio;
+}
+
+/*
+ * Sets the request up to go through a bounce buffer covering the aligned
+ * span of its sectors, unless it can be done directly.
+ */
+static int tdaio_align_request(struct tdaio_state *prv, struct aio_request *aio)
+{
+	uint64_t mask;
+
+	if (!prv->align)
+		return 0;
+
+	mask = prv->align - 1;
+	if (!((aio->offset | aio->size) & mask) &&
+	    !((uintptr_t)aio->treq.buf & (prv->mem_align - 1)))
+		return 0;
+
+	aio->start  = aio->offset & ~mask;
+	aio->end    = (aio->offset + aio->size + mask) & ~mask;
+	aio->bounce = tdaio_bounce_get(prv, aio->end - aio->start);
+	if (!aio->bounce)
+		return -ENOMEM;
+
+	aio->stage = TDAIO_BOUNCE;
+	aio->rmw   = aio->start != aio->offset ||
+		aio->end != aio->offset + aio->size;
+
+	prv->bounced++;
+
+	return 0;
+}
+
+static void tdaio_put_request(struct tdaio_state *prv, struct aio_request *aio)
+{
+	if (aio->bounce)
+		tdaio_bounce_put(prv, aio->bounce, aio->end - aio->start);
+	aio->bounce = NULL;
+
+	prv->aio_free_list[prv->aio_free_count++] = aio;
+}
+
+/*
+ * A write merged into the blocks around it must not run concurrently with
+ * another write to those blocks, or one would undo the other. Writes wait
+ * for any such write in flight, or queued before them.
+ */
+static int tdaio_write_conflicts(struct tdaio_state *prv,
+				 struct aio_request *aio)
+{
+	struct aio_request *w;
+
+	list_for_each_entry(w, &prv->writes, entry)
+		if ((aio->rmw || w->rmw) &&
+		    aio->start < w->end && w->start < aio->end)
+			return 1;
+
+	list_for_each_entry(w, &prv->deferred, entry) {
+		if (w == aio)
+			break;
+		if ((aio->rmw || w->rmw) &&
+		    aio->start < w->end && w->start < aio->end)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void tdaio_prep_bounce_write(struct aio_request *aio)
+{
+	struct tdaio_state *prv = aio->state;
+
+	memcpy(aio->bounce + (aio->offset - aio->start),
+	       aio->treq.buf, aio->size);
+
+	aio->stage = TDAIO_BOUNCE;
+	td_prep_write(&aio->tiocb, prv->fd, aio->bounce,
+		      aio->end - aio->start, aio->start, tdaio_complete, aio);
+}
+
+static void tdaio_prep_rmw_read(struct aio_request *aio, int stage)
+{
+	struct tdaio_state *prv = aio->state;
+	uint64_t block;
+
+	block = stage == TDAIO_RMW_HEAD ? aio->start : aio->end - prv->align;
+
+	aio->stage = stage;
+	td_prep_read(&aio->tiocb, prv->fd, aio->bounce + (block - aio->start),
+		     prv->align, block, tdaio_complete, aio);
+}
+
+static void tdaio_start_write(struct tdaio_state *prv, struct aio_request *aio)
+{
+	if (prv->align)
+		list_add_tail(&aio->entry, &prv->writes);
+
+	if (aio->stage == TDAIO_DIRECT)
+		td_prep_write(&aio->tiocb, prv->fd, aio->treq.buf,
+			      aio->size, aio->offset, tdaio_complete, aio);
+	else if (aio->start != aio->offset)
+		tdaio_prep_rmw_read(aio, TDAIO_RMW_HEAD);
+	else if (aio->end != aio->offset + aio->size)
+		tdaio_prep_rmw_read(aio, TDAIO_RMW_TAIL);
+	else
+		tdaio_prep_bounce_write(aio);
+
+	td_queue_tiocb(prv->driver, &aio->tiocb);
+}
+
+static void tdaio_kick_deferred(struct tdaio_state *prv)
+{
+	struct aio_request *aio, *next;
+
+	list_for_each_entry_safe(aio, next, &prv->deferred, entry) {
+		if (tdaio_write_conflicts(prv, aio))
+			continue;
+
+		list_del(&aio->entry);
+		tdaio_start_write(prv, aio);
+	}
+}
+
+static void tdaio_extent_drop(struct tdaio_state *prv)
+{
+	prv->ext_start = prv->ext_end = 0;
+}
+
 void tdaio_complete(void *arg, struct tiocb *tiocb, int err)
 {
 	struct aio_request *aio = (struct aio_request *)arg;
 	struct tdaio_state *prv = aio->state;
+	int write;
+
+	if (!err) {
+		switch (aio->stage) {
+		case TDAIO_RMW_HEAD:
+			if (aio->end != aio->offset + aio->size &&
+			    aio->end - aio->start > prv->align)
+				tdaio_prep_rmw_read(aio, TDAIO_RMW_TAIL);
+			else
+				tdaio_prep_bounce_write(aio);
+			td_queue_tiocb(prv->driver, &aio->tiocb);
+			return;
+
+		case TDAIO_RMW_TAIL:
+			tdaio_prep_bounce_write(aio);
+			td_queue_tiocb(prv->driver, &aio->tiocb);
+			return;
+
+		case TDAIO_BOUNCE:
+			if (aio->treq.op != TD_OP_WRITE)
+				memcpy(aio->treq.buf,
+				       aio->bounce + (aio->offset - aio->start),
+				       aio->size);
+			break;
+		}
+	}
+
+	write = !list_empty(&aio->entry);
+	if (write)
+		list_del(&aio->entry);
+
+	if (aio->treq.op == TD_OP_WRITE) {
+		tdaio_extent_drop(prv);
+		prv->dirty = 1;
+	}
 
 	td_complete_request(aio->treq, err);
-	prv->aio_free_list[prv->aio_free_count++] = aio;
+	tdaio_put_request(prv, aio);
+
+	if (write && !list_empty(&prv->deferred))
+		tdaio_kick_deferred(prv);
 }
 
 void tdaio_queue_read(td_driver_t *driver, td_request_t treq)
@@ -181,15 +502,23 @@ void tdaio_queue_read(td_driver_t *driver, td_request_t treq)
 	size   = treq.secs * SECTOR_SIZE;
 	offset = treq.sec  * (uint64_t)SECTOR_SIZE;
 
-	if (prv->aio_free_count == 0)
+	aio = tdaio_get_request(prv, treq);
+	if (!aio)
 		goto fail;
 
-	aio        = prv->aio_free_list[--prv->aio_free_count];
-	aio->treq  = treq;
-	aio->state = prv;
+	if (tdaio_align_request(prv, aio)) {
+		tdaio_put_request(prv, aio);
+		td_complete_request(treq, -ENOMEM);
+		return;
+	}
 
-	td_prep_read(&aio->tiocb, prv->fd, treq.buf,
-		     size, offset, tdaio_complete, aio);
+	if (aio->stage == TDAIO_DIRECT)
+		td_prep_read(&aio->tiocb, prv->fd, treq.buf,
+			     size, offset, tdaio_complete, aio);
+	else
+		td_prep_read(&aio->tiocb, prv->fd, aio->bounce,
+			     aio->end - aio->start, aio->start,
+			     tdaio_complete, aio);
 	td_queue_tiocb(driver, &aio->tiocb);
 
 	return;
@@ -200,25 +529,30 @@ fail:
 
 void tdaio_queue_write(td_driver_t *driver, td_request_t treq)
 {
-	int size;
-	uint64_t offset;
 	struct aio_request *aio;
 	struct tdaio_state *prv;
 
-	prv     = (struct tdaio_state *)driver->data;
-	size    = treq.secs * driver->info.sector_size;
-	offset  = treq.sec  * (uint64_t)driver->info.sector_size;
+	prv = (struct tdaio_state *)driver->data;
 
-	if (prv->aio_free_count == 0)
+	aio = tdaio_get_request(prv, treq);
+	if (!aio)
 		goto fail;
 
-	aio        = prv->aio_free_list[--prv->aio_free_count];
-	aio->treq  = treq;
-	aio->state = prv;
+	if (tdaio_align_request(prv, aio)) {
+		tdaio_put_request(prv, aio);
+		td_complete_request(treq, -ENOMEM);
+		return;
+	}
 
-	td_prep_write(&aio->tiocb, prv->fd, treq.buf,
-		      size, offset, tdaio_complete, aio);
-	td_queue_tiocb(driver, &aio->tiocb);
+	prv->merged += aio->rmw;
+	tdaio_extent_drop(prv);
+
+	if (prv->align && tdaio_write_conflicts(prv, aio)) {
+		list_add_tail(&aio->entry, &prv->deferred);
+		return;
+	}
+
+	tdaio_start_write(prv, aio);
 
 	return;
 
@@ -226,10 +560,192 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
+/*
+ * Releases the space of the discarded sectors: BLKDISCARD on block devices,
+ * a hole punched in files. This does not go through the AIO queue as there
+ * is no asynchronous form of either, and discards are advisory, so the
+ * request still succeeds where the storage does not support them.
+ */
+void tdaio_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	int err;
+	uint64_t range[2];
+	struct tdaio_state *prv;
+
+	prv      = (struct tdaio_state *)driver->data;
+	range[0] = treq.sec  * (uint64_t)SECTOR_SIZE;
+	range[1] = treq.secs * (uint64_t)SECTOR_SIZE;
+
+	if (prv->no_discard) {
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	prv->dirty = 1;
+
+	if (prv->bdev)
+		err = ioctl(prv->fd, BLKDISCARD, range);
+	else
+		err = fallocate(prv->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				range[0], range[1]);
+	tdaio_extent_drop(prv);
+	if (err) {
+		err = -errno;
+		if (err == -EOPNOTSUPP || err == -ENOTTY) {
+			DPRINTF("discard not supported (%d), ignoring discards\n",
+				err);
+			prv->no_discard = 1;
+			err = 0;
+		}
+	}
+
+	td_complete_request(treq, err);
+}
+
+/*
+ * Zeroes sectors with BLKZEROOUT on block devices, which the device may
+ * do without any data transfer, and by having files allocate zeroed
+ * extents. Both are synchronous. Where neither is supported, zeros are
+ * written the usual way.
+ */
+void tdaio_queue_write_zeroes(td_driver_t *driver, td_request_t treq)
+{
+	int err;
+	uint64_t range[2];
+	struct tdaio_state *prv;
+
+	prv      = (struct tdaio_state *)driver->data;
+	range[0] = treq.sec  * (uint64_t)SECTOR_SIZE;
+	range[1] = treq.secs * (uint64_t)SECTOR_SIZE;
+
+	if (prv->no_zeroes) {
+		td_queue_zero_writes(treq.image, treq);
+		return;
+	}
+
+	prv->dirty = 1;
+
+	if (prv->bdev)
+		err = ioctl(prv->fd, BLKZEROOUT, range);
+	else
+		err = fallocate(prv->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+				range[0], range[1]);
+	tdaio_extent_drop(prv);
+	if (err) {
+		err = -errno;
+		if (err == -EOPNOTSUPP || err == -ENOTTY) {
+			DPRINTF("zeroing not supported (%d), writing zeros\n", err);
+			prv->no_zeroes = 1;
+			td_queue_zero_writes(treq.image, treq);
+			return;
+		}
+	}
+
+	td_complete_request(treq, err);
+}
+
+/*
+ * One fdatasync covers every write completed before it is issued, so
+ * back-to-back flushes with no write completing in between complete at
+ * once. Writes mark the image dirty as they complete, not as they are
+ * queued: one still in flight when a sync is issued is not covered by
+ * it, and needs the next flush to sync again.
+ */
+void tdaio_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	struct aio_request *aio;
+	struct tdaio_state *prv;
+
+	prv = (struct tdaio_state *)driver->data;
+
+	if (!prv->dirty) {
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	aio = tdaio_get_request(prv, treq);
+	if (!aio) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	prv->dirty = 0;
+	prv->flushes++;
+
+	td_prep_fdsync(&aio->tiocb, prv->fd, tdaio_complete, aio);
+	td_queue_tiocb(driver, &aio->tiocb);
+}
+
+/*
+ * Raw files tell their holes with SEEK_DATA/SEEK_HOLE. The extent found
+ * is kept, so walking the image in runs costs a lookup per extent rather
+ * than per call; writes, discards and zeroing drop it, writes once more
+ * as they complete. Block devices, and filesystems which cannot tell,
+ * are all data.
+ */
+static int tdaio_sector_present(td_driver_t *driver, td_sector_t sec,
+				td_sector_t *secs)
+{
+	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
+	off_t off, data, hole;
+	td_sector_t end;
+
+	*secs = sec < driver->info.size ? driver->info.size - sec : 1;
+
+	if (prv->bdev || prv->no_seek_data)
+		return 1;
+
+	if (sec >= prv->ext_start && sec < prv->ext_end) {
+		prv->ext_hits++;
+		*secs = prv->ext_end - sec;
+		return prv->ext_data;
+	}
+
+	prv->ext_lookups++;
+	off = sec << SECTOR_SHIFT;
+
+	data = lseek(prv->fd, off, SEEK_DATA);
+	if (data == -1 && errno != ENXIO)
+		goto unsupported;
+
+	if (data == -1 || data > off) {
+		/* a hole up to the data, or to the end of the file */
+		end = data == -1 ? driver->info.size : data >> SECTOR_SHIFT;
+		if (end <= sec)
+			return 1;
+		prv->ext_data = 0;
+	} else {
+		hole = lseek(prv->fd, off, SEEK_HOLE);
+		if (hole == -1)
+			goto unsupported;
+		end = (hole + SECTOR_SIZE - 1) >> SECTOR_SHIFT;
+		if (end <= sec)
+			return 1;
+		prv->ext_data = 1;
+	}
+
+	prv->ext_start = sec;
+	prv->ext_end   = end;
+	*secs          = end - sec;
+
+	return prv->ext_data;
+
+unsupported:
+	DPRINTF("SEEK_DATA not supported (%d), image taken as all data\n",
+		-errno);
+	prv->no_seek_data = 1;
+	return 1;
+}
+
 int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
-	
+
+	while (prv->bounce_count)
+		free(prv->bounce_pool[--prv->bounce_count]);
+
+	tdaio_free_requests(prv);
+
 	close(prv->fd);
 
 	return 0;
@@ -251,12 +767,22 @@ void tdaio_stats(td_driver_t *driver, td_stats_t *st)
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
 	int n_pending;
 
-	n_pending = MAX_AIO_REQS - prv->aio_free_count;
+	n_pending = prv->aio_max - prv->aio_free_count;
 
 	tapdisk_stats_field(st, "reqs", "{");
-	tapdisk_stats_field(st, "max", "lu", MAX_AIO_REQS);
+	tapdisk_stats_field(st, "max", "d", prv->aio_max);
 	tapdisk_stats_field(st, "pending", "d", n_pending);
 	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "align", "u", prv->align);
+	tapdisk_stats_field(st, "bounced", "llu", prv->bounced);
+	tapdisk_stats_field(st, "merged", "llu", prv->merged);
+	tapdisk_stats_field(st, "flushes", "llu", prv->flushes);
+
+	tapdisk_stats_field(st, "extents", "{");
+	tapdisk_stats_field(st, "lookups", "llu", prv->ext_lookups);
+	tapdisk_stats_field(st, "hits", "llu", prv->ext_hits);
+	tapdisk_stats_leave(st, '}');
 }
 
 struct tap_disk tapdisk_aio = {
@@ -267,8 +793,13 @@ struct tap_disk tapdisk_aio = {
 	.td_close           = tdaio_close,
 	.td_queue_read      = tdaio_queue_read,
 	.td_queue_write     = tdaio_queue_write,
+	.td_queue_discard   = tdaio_queue_discard,
+	.td_queue_write_zeroes = tdaio_queue_write_zeroes,
+	.td_queue_flush     = tdaio_queue_flush,
 	.td_get_parent_id   = tdaio_get_parent_id,
 	.td_validate_parent = tdaio_validate_parent,
 	.td_debug           = NULL,
 	.td_stats           = tdaio_stats,
+	.td_set_depth       = tdaio_set_depth,
+	.td_sector_present  = tdaio_sector_present,
 };
@@ -31,27 +31,94 @@
 #ifndef __BLOCK_AIO_H__
 #define __BLOCK_AIO_H__
 
+#include "list.h"
 #include "tapdisk.h"
 #include "tapdisk-queue.h"
 
 
 #define MAX_AIO_REQS         TAPDISK_DATA_REQUESTS
 
+/*
+ * Bounce buffers of up to TDAIO_BOUNCE_SIZE are kept for reuse, at most
+ * TDAIO_BOUNCE_POOL of them; larger ones are allocated per request.
+ */
+#define TDAIO_BOUNCE_SIZE    (128 << 10)
+#define TDAIO_BOUNCE_POOL    16
+
+enum {
+	TDAIO_DIRECT = 0,            /* treq.buf used as is */
+	TDAIO_BOUNCE,                /* copied through aio->bounce */
+	TDAIO_RMW_HEAD,              /* reading the first block to merge */
+	TDAIO_RMW_TAIL,              /* reading the last block to merge */
+};
+
 struct tdaio_state;
 
 struct aio_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdaio_state  *state;
+
+	uint64_t             offset;
+	size_t               size;
+
+	int                  stage;
+	int                  rmw;
+	char                *bounce;
+	uint64_t             start;  /* aligned span covered by bounce */
+	uint64_t             end;
+	struct list_head     entry;  /* in prv->writes or prv->deferred */
+};
+
+/*
+ * Requests come in slabs, which stay put until close: in-flight requests
+ * are never moved as the pool grows.
+ */
+struct aio_request_slab {
+	struct aio_request_slab *next;
+	struct aio_request       reqs[];
 };
 
 struct tdaio_state {
 	int                  fd;
+	int                  bdev;
+	int                  no_discard;
+	int                  no_zeroes;
+	int                  no_seek_data;
+	int                  dirty;  /* a write completed since the last sync */
 	td_driver_t         *driver;
 
+	/*
+	 * O_DIRECT alignment of offsets and sizes, and of buffers. Zero
+	 * when the image is not opened O_DIRECT.
+	 */
+	unsigned int         align;
+	unsigned int         mem_align;
+
+	struct list_head     writes;
+	struct list_head     deferred;
+
+	int                  bounce_count;
+	char                *bounce_pool[TDAIO_BOUNCE_POOL];
+
+	/*
+	 * Last extent found with SEEK_DATA/SEEK_HOLE, sectors [start, end)
+	 * all data or all hole. Empty when start == end.
+	 */
+	td_sector_t          ext_start;
+	td_sector_t          ext_end;
+	int                  ext_data;
+	unsigned long long   ext_lookups;
+	unsigned long long   ext_hits;
+
+	unsigned long long   bounced;
+	unsigned long long   merged;
+	unsigned long long   flushes;
+
+	int                  aio_max;
 	int                  aio_free_count;
-	struct aio_request   aio_requests[MAX_AIO_REQS];
-	struct aio_request  *aio_free_list[MAX_AIO_REQS];
+	struct aio_request_slab *aio_slabs;
+	struct aio_request **aio_free_list;
 };
 
 void tdaio_complete(void *arg, struct tiocb *tiocb, int err);
@@ -36,14 +36,22 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-stats.h"
+#include "tapdisk-readahead.h"
 #include "timeout-math.h"
+#include "td-hash.h"
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -53,6 +61,8 @@
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 
+#define MIN(a, b)       ((a) < (b) ? (a) : (b))
+
 #define RADIX_TREE_PAGE_SHIFT           12 /* 4K pages */
 #define RADIX_TREE_PAGE_SIZE            (1 << RADIX_TREE_PAGE_SHIFT)
 
@@ -62,9 +72,24 @@
 
 #define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
 
-#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
+#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* default budget */
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
-#define BLOCK_CACHE_PAGE_IDLETIME       60
+#define BLOCK_CACHE_PRUNE_INTERVAL      120 /* secs, reaping empty nodes */
+#define BLOCK_CACHE_MAX_HIT             (MAX_SEGMENTS_PER_REQ * BLOCK_CACHE_NODES_PER_PAGE)
+
+#define BLOCK_CACHE_RA_MIN              (16 * BLOCK_CACHE_NODES_PER_PAGE)  /* secs */
+#define BLOCK_CACHE_RA_MAX              (128 * BLOCK_CACHE_NODES_PER_PAGE) /* secs */
+#define BLOCK_CACHE_RA_REQUESTS         4
+
+#define BLOCK_CACHE_STORE_SHIFT         16
+#define BLOCK_CACHE_STORE_BUCKETS       (1 << BLOCK_CACHE_STORE_SHIFT)
+
+#define BLOCK_CACHE_SHARED_DIR          "/dev/shm"
+#define BLOCK_CACHE_SHARED_MAGIC        0x74646263 /* "tdbc" */
+#define BLOCK_CACHE_SHARED_VERSION      1
+#define BLOCK_CACHE_SHARED_HDR_SIZE     4096
+#define BLOCK_CACHE_SHARED_WAYS         4
+#define BLOCK_CACHE_SHARED_MAX_MB       2048
 
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
@@ -74,12 +99,88 @@ typedef struct radix_tree_page          radix_tree_page_t;
 
 typedef struct block_cache              block_cache_t;
 typedef struct block_cache_request      block_cache_request_t;
+typedef struct block_cache_readahead    block_cache_readahead_t;
 typedef struct block_cache_stats        block_cache_stats_t;
+typedef struct block_cache_chunk        block_cache_chunk_t;
+typedef struct block_cache_ghost        block_cache_ghost_t;
+typedef struct block_cache_shared       block_cache_shared_t;
+typedef struct block_cache_shared_hdr   block_cache_shared_hdr_t;
+typedef struct block_cache_shared_slot  block_cache_shared_slot_t;
+
+/*
+ * Full pages read through any block cache of the process are kept once
+ * per content, in a store keyed by their hash: images with identical
+ * blocks, such as clones of one OS install, share the memory caching
+ * them. Each cache keeps its own sector mapping, in its radix tree,
+ * onto the pages of the store.
+ */
+struct block_cache_chunk {
+	uint64_t                        hash;
+	int                             refs;
+	char                           *buf;
+	block_cache_chunk_t            *next;
+};
+
+struct block_cache_store {
+	pthread_mutex_t                 lock;
+	block_cache_chunk_t           **buckets;
+	uint64_t                        chunks;
+	uint64_t                        shared;
+};
+
+static struct block_cache_store store = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * With TAPDISK3_BLOCK_CACHE_SHARED=<MiB>, aligned pages of an image are
+ * also cached in a segment under BLOCK_CACHE_SHARED_DIR, named after the
+ * image's device and inode, which all tapdisks caching that image map:
+ * a golden image booted by many VMs is cached once per host. Such pages
+ * are not kept in the private tree.
+ *
+ * The segment is a set associative index of pages, each slot guarded by
+ * a sequence count which is odd while the slot is written. Lookups take
+ * no lock: they copy a page out, and count a slot which changed
+ * meanwhile as a miss. Writers claim a slot by making its count
+ * odd, and give up if another got there first.
+ */
+struct block_cache_shared_hdr {
+	uint32_t                        magic;
+	uint32_t                        version;
+	uint64_t                        dev;
+	uint64_t                        ino;
+	uint64_t                        size;
+	uint64_t                        mtime;  /* ns */
+	uint32_t                        sets;
+	uint32_t                        ways;
+	uint64_t                        slots_offset;
+	uint64_t                        pages_offset;
+};
+
+struct block_cache_shared_slot {
+	uint32_t                        seq;
+	uint32_t                        pad;
+	uint64_t                        page;   /* page number + 1, 0 if free */
+};
+
+struct block_cache_shared {
+	struct shm                      shm;
+	block_cache_shared_hdr_t       *hdr;
+	block_cache_shared_slot_t      *slots;
+	char                           *pages;
+	uint32_t                        sets;
+	uint32_t                        victim;
+};
 
 struct radix_tree_page {
 	char                           *buf;
 	size_t                          size;
 	uint64_t                        sec;
+	block_cache_chunk_t            *chunk;  /* if buf is in the store */
+	int                             queue;
+	int                             ahead;  /* read ahead, not hit yet */
+	struct list_head                lru;
 	radix_tree_link_t              *owners[BLOCK_CACHE_NODES_PER_PAGE];
 };
 
@@ -89,7 +190,6 @@ struct radix_tree_leaf {
 };
 
 struct radix_tree_link {
-	uint32_t                        time;
 	union {
 		radix_tree_node_t      *next;
 		radix_tree_leaf_t       leaf;
@@ -118,11 +218,48 @@ struct block_cache_request {
 	block_cache_t                  *cache;
 };
 
+/*
+ * Sequential streams are read ahead through the VBD, in whole pages,
+ * with requests of our own which we recognize by their token when they
+ * come down to us: the leaf serves what it has, we read in the rest.
+ */
+struct block_cache_readahead {
+	td_vbd_request_t                vreq;
+	struct td_iovec                 iov;
+	char                           *buf;
+	uint64_t                        size;   /* reserved */
+	block_cache_t                  *cache;
+};
+
 struct block_cache_stats {
 	uint64_t                        reads;
 	uint64_t                        hits;
 	uint64_t                        misses;
 	uint64_t                        prunes;
+	uint64_t                        shared;  /* pages found in the store */
+	uint64_t                        shm_hits;
+	uint64_t                        shm_inserts;
+	uint64_t                        evictions; /* pages */
+	uint64_t                        ghost_hits;
+	uint64_t                        ra_pages;
+	uint64_t                        ra_used;
+};
+
+/*
+ * Pages are replaced 2Q style, within a budget covering pages and tree
+ * nodes alike. Pages read once wait in a FIFO (A1in) of up to a quarter
+ * of the budget, and only pages read again while there, or soon after
+ * leaving it, make it to the LRU list (Am) holding the rest: a scan
+ * passes through A1in without flushing Am. Recently evicted pages are
+ * remembered by sector (A1out), up to half the budget's worth.
+ */
+#define BLOCK_CACHE_A1IN                1
+#define BLOCK_CACHE_AM                  2
+
+struct block_cache_ghost {
+	uint64_t                        sec;
+	struct list_head                fifo;
+	block_cache_ghost_t            *next;
 };
 
 struct block_cache {
@@ -138,10 +275,114 @@ struct block_cache {
 	event_id_t                      timeout_id;
 
 	radix_tree_t                    tree;
+	block_cache_shared_t            shared;
+
+	uint64_t                        budget;
+	uint64_t                        reserved; /* for reads in flight */
+	int                             configured;
+	struct list_head                a1in;
+	struct list_head                am;
+	uint64_t                        a1in_size;
+
+	struct list_head                a1out;
+	block_cache_ghost_t           **ghosts;
+	uint32_t                        ghost_mask;
+	uint32_t                        nr_ghosts;
+	uint32_t                        max_ghosts;
+
+	td_readahead_t                  ra;
+	block_cache_readahead_t         ra_reqs[BLOCK_CACHE_RA_REQUESTS];
+	block_cache_readahead_t        *ra_free[BLOCK_CACHE_RA_REQUESTS];
+	int                             ra_nr_free;
 
 	block_cache_stats_t             stats;
 };
 
+/* matches are confirmed with memcmp(), any td_hash() will do */
+static inline uint64_t
+block_cache_page_hash(const char *buf)
+{
+	return td_hash(buf, RADIX_TREE_PAGE_SIZE);
+}
+
+/*
+ * Returns a reference to the chunk holding the content of @buf, a page.
+ * @buf is taken: either adopted by a new chunk or, if the content was
+ * in the store already, freed. NULL if out of memory, @buf untouched.
+ */
+static block_cache_chunk_t *
+block_cache_store_get(char *buf, int *shared)
+{
+	block_cache_chunk_t *chunk, **bucket;
+	uint64_t hash;
+
+	hash = block_cache_page_hash(buf);
+
+	pthread_mutex_lock(&store.lock);
+
+	if (!store.buckets) {
+		store.buckets = calloc(BLOCK_CACHE_STORE_BUCKETS,
+				       sizeof(block_cache_chunk_t *));
+		if (!store.buckets) {
+			chunk = NULL;
+			goto out;
+		}
+	}
+
+	bucket = &store.buckets[hash & (BLOCK_CACHE_STORE_BUCKETS - 1)];
+
+	for (chunk = *bucket; chunk; chunk = chunk->next)
+		if (chunk->hash == hash &&
+		    !memcmp(chunk->buf, buf, RADIX_TREE_PAGE_SIZE)) {
+			chunk->refs++;
+			store.shared++;
+			*shared = 1;
+			free(buf);
+			goto out;
+		}
+
+	chunk = malloc(sizeof(*chunk));
+	if (!chunk)
+		goto out;
+
+	chunk->hash = hash;
+	chunk->refs = 1;
+	chunk->buf  = buf;
+	chunk->next = *bucket;
+	*bucket     = chunk;
+	store.chunks++;
+	*shared     = 0;
+
+out:
+	pthread_mutex_unlock(&store.lock);
+	return chunk;
+}
+
+static void
+block_cache_store_put(block_cache_chunk_t *chunk)
+{
+	block_cache_chunk_t **link;
+
+	pthread_mutex_lock(&store.lock);
+
+	if (--chunk->refs) {
+		store.shared--;
+		goto out;
+	}
+
+	link = &store.buckets[chunk->hash & (BLOCK_CACHE_STORE_BUCKETS - 1)];
+	while (*link != chunk)
+		link = &(*link)->next;
+	*link = chunk->next;
+	store.chunks--;
+
+	free(chunk->buf);
+	free(chunk);
+
+out:
+	pthread_mutex_unlock(&store.lock);
+}
+
 static inline uint64_t
 radix_tree_calculate_size(int height)
 {
@@ -226,9 +467,148 @@ radix_tree_free_node(radix_tree_t *tree, radix_tree_node_t *node)
 	tree->nodes--;
 }
 
+static block_cache_ghost_t **
+block_cache_ghost_bucket(block_cache_t *cache, uint64_t sec)
+{
+	return &cache->ghosts[(sec * 0x9e3779b97f4a7c15ULL >> 32) &
+			      cache->ghost_mask];
+}
+
+static void
+block_cache_ghost_unlink(block_cache_t *cache, block_cache_ghost_t *ghost)
+{
+	block_cache_ghost_t **link;
+
+	link = block_cache_ghost_bucket(cache, ghost->sec);
+	while (*link != ghost)
+		link = &(*link)->next;
+	*link = ghost->next;
+
+	list_del(&ghost->fifo);
+	cache->nr_ghosts--;
+}
+
+/*
+ * Whether the page at @sec was evicted recently, forgetting it if so.
+ */
+static int
+block_cache_ghost_take(block_cache_t *cache, uint64_t sec)
+{
+	block_cache_ghost_t *ghost;
+
+	if (!cache->ghosts)
+		return 0;
+
+	for (ghost = *block_cache_ghost_bucket(cache, sec); ghost;
+	     ghost = ghost->next)
+		if (ghost->sec == sec) {
+			block_cache_ghost_unlink(cache, ghost);
+			free(ghost);
+			return 1;
+		}
+
+	return 0;
+}
+
+static void
+block_cache_ghost_add(block_cache_t *cache, uint64_t sec)
+{
+	block_cache_ghost_t *ghost, **bucket;
+
+	if (!cache->max_ghosts)
+		return;
+
+	if (cache->nr_ghosts >= cache->max_ghosts) {
+		ghost = list_first_entry(&cache->a1out,
+					 block_cache_ghost_t, fifo);
+		block_cache_ghost_unlink(cache, ghost);
+	} else {
+		ghost = malloc(sizeof(*ghost));
+		if (!ghost)
+			return;
+	}
+
+	bucket       = block_cache_ghost_bucket(cache, sec);
+	ghost->sec   = sec;
+	ghost->next  = *bucket;
+	*bucket      = ghost;
+	list_add_tail(&ghost->fifo, &cache->a1out);
+	cache->nr_ghosts++;
+}
+
+static void
+block_cache_free_ghosts(block_cache_t *cache)
+{
+	block_cache_ghost_t *ghost, *next;
+
+	list_for_each_entry_safe(ghost, next, &cache->a1out, fifo) {
+		list_del(&ghost->fifo);
+		free(ghost);
+	}
+
+	free(cache->ghosts);
+	cache->ghosts     = NULL;
+	cache->ghost_mask = 0;
+	cache->nr_ghosts  = 0;
+	cache->max_ghosts = 0;
+}
+
+static int
+block_cache_set_budget(block_cache_t *cache, uint64_t budget)
+{
+	uint32_t max, buckets;
+
+	block_cache_free_ghosts(cache);
+
+	cache->budget = budget;
+
+	max = budget / RADIX_TREE_PAGE_SIZE / 2;
+	for (buckets = 1; buckets < max; buckets <<= 1)
+		;
+
+	cache->ghosts = calloc(buckets, sizeof(block_cache_ghost_t *));
+	if (!cache->ghosts)
+		return -ENOMEM;
+
+	cache->ghost_mask = buckets - 1;
+	cache->max_ghosts = max;
+
+	return 0;
+}
+
+static void
+block_cache_admit(block_cache_t *cache, radix_tree_page_t *page)
+{
+	if (block_cache_ghost_take(cache, page->sec)) {
+		cache->stats.ghost_hits++;
+		page->queue = BLOCK_CACHE_AM;
+		list_add(&page->lru, &cache->am);
+	} else {
+		page->queue = BLOCK_CACHE_A1IN;
+		list_add(&page->lru, &cache->a1in);
+		cache->a1in_size += page->size;
+	}
+}
+
+static void
+block_cache_forget(block_cache_t *cache, radix_tree_page_t *page)
+{
+	list_del(&page->lru);
+	if (page->queue == BLOCK_CACHE_A1IN)
+		cache->a1in_size -= page->size;
+}
+
+static void
+block_cache_touch(block_cache_t *cache, radix_tree_page_t *page)
+{
+	/* rereads while in A1in are taken as one access */
+	if (page->queue == BLOCK_CACHE_AM)
+		list_move(&page->lru, &cache->am);
+}
+
 static inline radix_tree_page_t *
-radix_tree_allocate_page(radix_tree_t *tree,
-			 char *buf, uint64_t sec, size_t size)
+radix_tree_allocate_page(radix_tree_t *tree, char *buf,
+			 block_cache_chunk_t *chunk, uint64_t sec, size_t size)
 {
 	radix_tree_page_t *page;
 
@@ -237,10 +617,13 @@ radix_tree_allocate_page(radix_tree_t *tree,
 		return NULL;
 
 	page->buf   = buf;
+	page->chunk = chunk;
 	page->sec   = sec;
 	page->size  = size;
 	tree->size += size;
 
+	block_cache_admit(tree->cache, page);
+
 	return page;
 }
 
@@ -253,9 +636,14 @@ radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
 		DBG("%s: ejecting sector 0x%llx\n",
 		    tree->cache->name, page->sec + i);
 
+	block_cache_forget(tree->cache, page);
+
 	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
 	tree->size -= page->size;
-	free(page->buf);
+	if (page->chunk)
+		block_cache_store_put(page->chunk);
+	else
+		free(page->buf);
 	free(page);
 }
 
@@ -299,23 +687,23 @@ radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
 }
 
 static char *
-radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
+radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector,
+		     radix_tree_page_t **page)
 {
 	int idx;
-	struct timeval now;
 	radix_tree_link_t *link;
 	radix_tree_node_t *node;
 
 	node = tree->root;
-	gettimeofday(&now, NULL);
 
 	do {
 		idx        = radix_tree_index(node, sector);
 		link       = node->links + idx;
-		link->time = now.tv_sec;
 
-		if (radix_tree_node_contains_leaves(tree, node))
+		if (radix_tree_node_contains_leaves(tree, node)) {
+			*page = link->u.leaf.page;
 			return link->u.leaf.buf;
+		}
 
 		if (!link->u.next)
 			return NULL;
@@ -329,17 +717,14 @@ radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
 		    radix_tree_page_t *page, off_t off)
 {
 	int idx;
-	struct timeval now;
 	radix_tree_link_t *link;
 	radix_tree_node_t *node;
 
 	node = tree->root;
-	gettimeofday(&now, NULL);
 
 	do {
 		idx        = radix_tree_index(node, sector);
 		link       = node->links + idx;
-		link->time = now.tv_sec;
 
 		if (radix_tree_node_contains_leaves(tree, node)) {
 			radix_tree_remove_page(tree, link->u.leaf.page);
@@ -360,12 +745,13 @@ radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
 
 static int
 radix_tree_add_leaves(radix_tree_t *tree, char *buf,
+		      block_cache_chunk_t *chunk,
 		      uint64_t sector, uint64_t sectors)
 {
 	int i;
 	radix_tree_page_t *page;
 
-	page = radix_tree_allocate_page(tree, buf, sector,
+	page = radix_tree_allocate_page(tree, buf, chunk, sector,
 					sectors << RADIX_TREE_NODE_SHIFT);
 	if (!page)
 		return -ENOMEM;
@@ -378,7 +764,8 @@ radix_tree_add_leaves(radix_tree_t *tree, char *buf,
 	return 0;
 
 fail:
-	page->buf = NULL;
+	page->buf   = NULL;
+	page->chunk = NULL;
 	radix_tree_remove_page(tree, page);
 	return -ENOMEM;
 }
@@ -417,8 +804,7 @@ radix_tree_destroy(radix_tree_t *tree)
  * returns 1 if @node is empty after pruning, 0 otherwise
  */
 static int
-radix_tree_prune_branch(radix_tree_t *tree,
-			radix_tree_node_t *node, uint32_t now)
+radix_tree_prune_branch(radix_tree_t *tree, radix_tree_node_t *node)
 {
 	int i, empty;
 	radix_tree_link_t *link;
@@ -430,26 +816,19 @@ radix_tree_prune_branch(radix_tree_t *tree,
 	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
 		link = node->links + i;
 
-		if (now - link->time < BLOCK_CACHE_PAGE_IDLETIME) {
-			if (radix_tree_node_contains_leaves(tree, node)) {
-				empty = 0;
-				continue;
-			}
-
-			if (radix_tree_prune_branch(tree, link->u.next, now))
-				radix_tree_clear_link(link);
-			else
+		if (radix_tree_node_contains_leaves(tree, node)) {
+			if (link->u.leaf.page)
 				empty = 0;
-
 			continue;
 		}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+		if (!link->u.next)
+			continue;
 
-		radix_tree_clear_link(link);
+		if (radix_tree_prune_branch(tree, link->u.next))
+			radix_tree_clear_link(link);
+		else
+			empty = 0;
 	}
 
 	if (empty && !radix_tree_node_is_root(tree, node))
@@ -459,24 +838,21 @@ radix_tree_prune_branch(radix_tree_t *tree,
 }
 
 /*
- * walk tree and free any node that has been idle for too long
+ * walk tree and free any node left without pages by evictions
  */
 static void
 radix_tree_prune(radix_tree_t *tree)
 {
-	struct timeval now;
-
 	if (!tree->root)
 		return;
 
 	DPRINTF("tree %s has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+		tree->cache->name, radix_tree_size(tree));
 
-	gettimeofday(&now, NULL);
-	radix_tree_prune_branch(tree, tree->root, now.tv_sec);
+	radix_tree_prune_branch(tree, tree->root);
 
 	DPRINTF("tree %s now has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+		tree->cache->name, radix_tree_size(tree));
 }
 
 static inline int
@@ -496,6 +872,366 @@ radix_tree_free(radix_tree_t *tree)
 	radix_tree_destroy(tree);
 }
 
+/*
+ * The configured budget, scaled down under memory pressure.
+ */
+static uint64_t
+block_cache_budget(block_cache_t *cache)
+{
+	return cache->budget * tapdisk_server_mem_budget() / TD_MEM_BUDGET_FULL;
+}
+
+static int
+block_cache_evict(block_cache_t *cache)
+{
+	radix_tree_page_t *victim;
+
+	if (!list_empty(&cache->a1in) &&
+	    (cache->a1in_size > block_cache_budget(cache) / 4 ||
+	     list_empty(&cache->am))) {
+		victim = list_last_entry(&cache->a1in, radix_tree_page_t, lru);
+		block_cache_ghost_add(cache, victim->sec);
+	} else if (!list_empty(&cache->am))
+		victim = list_last_entry(&cache->am, radix_tree_page_t, lru);
+	else
+		return 0;
+
+	radix_tree_remove_page(&cache->tree, victim);
+	cache->stats.evictions++;
+
+	return 1;
+}
+
+/*
+ * Evicts until @size more bytes fit in the budget. 0 if they do not.
+ */
+static int
+block_cache_make_room(block_cache_t *cache, uint64_t size)
+{
+	uint64_t budget = block_cache_budget(cache);
+
+	while (radix_tree_size(&cache->tree) + cache->reserved + size >
+	       budget)
+		if (!block_cache_evict(cache))
+			return 0;
+
+	return 1;
+}
+
+static void
+block_cache_shared_id(const char *name, block_cache_shared_hdr_t *id)
+{
+	struct stat st;
+
+	memset(id, 0, sizeof(*id));
+
+	if (!stat(name, &st)) {
+		if (S_ISBLK(st.st_mode)) {
+			id->dev   = st.st_rdev;
+		} else {
+			id->dev   = st.st_dev;
+			id->ino   = st.st_ino;
+			id->size  = st.st_size;
+			id->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL +
+				st.st_mtim.tv_nsec;
+		}
+	}
+
+	id->magic   = BLOCK_CACHE_SHARED_MAGIC;
+	id->version = BLOCK_CACHE_SHARED_VERSION;
+}
+
+static int
+block_cache_shared_attach(block_cache_shared_t *sh,
+			  block_cache_shared_hdr_t *id)
+{
+	block_cache_shared_hdr_t *hdr;
+	uint64_t need;
+	int err;
+
+	err = shm_attach(&sh->shm);
+	if (err)
+		return -err;
+
+	/* held until close; whoever closes last removes the segment */
+	if (flock(sh->shm.fd, LOCK_SH)) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = -EINVAL;
+	if (sh->shm.size < BLOCK_CACHE_SHARED_HDR_SIZE)
+		goto fail;
+
+	hdr = sh->shm.mem;
+	__sync_synchronize();
+	if (hdr->magic != id->magic || hdr->version != id->version ||
+	    hdr->dev != id->dev || hdr->ino != id->ino ||
+	    hdr->size != id->size || hdr->mtime != id->mtime ||
+	    hdr->ways != BLOCK_CACHE_SHARED_WAYS || !hdr->sets)
+		goto fail;
+
+	need = hdr->pages_offset + (uint64_t)hdr->sets * hdr->ways *
+		RADIX_TREE_PAGE_SIZE;
+	if (hdr->slots_offset + (uint64_t)hdr->sets * hdr->ways *
+	    sizeof(block_cache_shared_slot_t) > hdr->pages_offset ||
+	    need > sh->shm.size)
+		goto fail;
+
+	sh->hdr   = hdr;
+	sh->sets  = hdr->sets;
+	sh->slots = (block_cache_shared_slot_t *)
+		((char *)sh->shm.mem + hdr->slots_offset);
+	sh->pages = (char *)sh->shm.mem + hdr->pages_offset;
+
+	return 0;
+
+fail:
+	munmap(sh->shm.mem, sh->shm.size);
+	close(sh->shm.fd);
+	sh->shm.mem = NULL;
+	sh->shm.fd  = -1;
+	return err;
+}
+
+/*
+ * Creates the segment under a name of its own, and links it into place
+ * only once initialized, unless another tapdisk did so first.
+ */
+static int
+block_cache_shared_create(block_cache_shared_t *sh,
+			  block_cache_shared_hdr_t *id, uint64_t mb)
+{
+	block_cache_shared_hdr_t *hdr;
+	uint64_t sets, slots_size;
+	char *path;
+	int err;
+
+	sets = (mb << 20) / RADIX_TREE_PAGE_SIZE / BLOCK_CACHE_SHARED_WAYS;
+	if (!sets)
+		return -EINVAL;
+
+	slots_size = sets * BLOCK_CACHE_SHARED_WAYS *
+		sizeof(block_cache_shared_slot_t);
+	slots_size = (slots_size + RADIX_TREE_PAGE_SIZE - 1) &
+		~((uint64_t)RADIX_TREE_PAGE_SIZE - 1);
+
+	path = sh->shm.path;
+	if (asprintf(&sh->shm.path, "%s.%d", path, getpid()) == -1) {
+		sh->shm.path = path;
+		return -ENOMEM;
+	}
+
+	sh->shm.size = BLOCK_CACHE_SHARED_HDR_SIZE + slots_size +
+		sets * BLOCK_CACHE_SHARED_WAYS * RADIX_TREE_PAGE_SIZE;
+
+	err = shm_create(&sh->shm);
+	if (err) {
+		err = -err;
+		goto out;
+	}
+
+	hdr  = sh->shm.mem;
+	*hdr = *id;
+	hdr->magic        = 0;
+	hdr->sets         = sets;
+	hdr->ways         = BLOCK_CACHE_SHARED_WAYS;
+	hdr->slots_offset = BLOCK_CACHE_SHARED_HDR_SIZE;
+	hdr->pages_offset = BLOCK_CACHE_SHARED_HDR_SIZE + slots_size;
+	__sync_synchronize();
+	hdr->magic        = id->magic;
+
+	err = link(sh->shm.path, path) ? -errno : 0;
+	shm_destroy(&sh->shm);
+
+out:
+	free(sh->shm.path);
+	sh->shm.path = path;
+	return err;
+}
+
+static void
+block_cache_shared_close(block_cache_shared_t *sh)
+{
+	/* nobody else holds it shared: remove it with the last user */
+	if (sh->shm.fd == -1 || flock(sh->shm.fd, LOCK_EX | LOCK_NB)) {
+		free(sh->shm.path);
+		sh->shm.path = NULL;
+	}
+
+	shm_destroy(&sh->shm);
+	free(sh->shm.path);
+	memset(sh, 0, sizeof(*sh));
+	sh->shm.fd = -1;
+}
+
+static void
+block_cache_shared_open(block_cache_t *cache)
+{
+	block_cache_shared_t *sh = &cache->shared;
+	block_cache_shared_hdr_t id;
+	const char *val;
+	uint64_t mb;
+	int err, retry;
+
+	shm_init(&sh->shm);
+
+	val = getenv("TAPDISK3_BLOCK_CACHE_SHARED");
+	if (!val)
+		return;
+
+	mb = strtoull(val, NULL, 0);
+	if (!mb)
+		return;
+	if (mb > BLOCK_CACHE_SHARED_MAX_MB)
+		mb = BLOCK_CACHE_SHARED_MAX_MB;
+
+	block_cache_shared_id(cache->name, &id);
+
+	if (asprintf(&sh->shm.path, "%s/td-bcache-%"PRIx64"-%"PRIx64,
+		     BLOCK_CACHE_SHARED_DIR, id.dev, id.ino) == -1) {
+		sh->shm.path = NULL;
+		return;
+	}
+
+	for (retry = 0;; retry++) {
+		err = block_cache_shared_attach(sh, &id);
+		if (!err || retry == 2)
+			break;
+
+		if (err == -EINVAL) {
+			/* of an older image, or the wrong geometry */
+			struct shm stale = sh->shm;
+
+			err = shm_attach(&stale);
+			if (err)
+				break;
+			if (!flock(stale.fd, LOCK_EX | LOCK_NB))
+				unlink(stale.path);
+			stale.path = NULL;
+			shm_destroy(&stale);
+		} else if (err != -ENOENT)
+			break;
+
+		err = block_cache_shared_create(sh, &id, mb);
+		if (err && err != -EEXIST)
+			break;
+	}
+
+	if (err) {
+		DPRINTF("%s: not sharing cache: %d\n", cache->name, err);
+		block_cache_shared_close(sh);
+		return;
+	}
+
+	DPRINTF("%s: sharing cache %s, %u pages\n", cache->name,
+		sh->shm.path, sh->sets * BLOCK_CACHE_SHARED_WAYS);
+}
+
+static inline block_cache_shared_slot_t *
+block_cache_shared_set(block_cache_shared_t *sh, uint64_t page)
+{
+	uint64_t set = (page * 0x9e3779b97f4a7c15ULL >> 17) % sh->sets;
+
+	return sh->slots + set * BLOCK_CACHE_SHARED_WAYS;
+}
+
+/*
+ * Copies @secs sectors from @off into page number @page to @buf.
+ * Returns 0 on a miss, which may leave @buf partially written.
+ */
+static int
+block_cache_shared_read(block_cache_shared_t *sh, uint64_t page,
+			int off, int secs, char *buf)
+{
+	block_cache_shared_slot_t *set, *slot;
+	uint32_t seq;
+	int i;
+
+	set = block_cache_shared_set(sh, page);
+
+	for (i = 0; i < BLOCK_CACHE_SHARED_WAYS; i++) {
+		slot = set + i;
+
+		seq = *(volatile uint32_t *)&slot->seq;
+		if (seq & 1)
+			continue;
+		__sync_synchronize();
+
+		if (*(volatile uint64_t *)&slot->page != page + 1)
+			continue;
+
+		memcpy(buf, sh->pages +
+		       ((slot - sh->slots) << RADIX_TREE_PAGE_SHIFT) +
+		       (off << RADIX_TREE_NODE_SHIFT),
+		       secs << RADIX_TREE_NODE_SHIFT);
+		__sync_synchronize();
+
+		return *(volatile uint32_t *)&slot->seq == seq;
+	}
+
+	return 0;
+}
+
+static void
+block_cache_shared_write(block_cache_shared_t *sh, uint64_t page,
+			 const char *buf)
+{
+	block_cache_shared_slot_t *set, *slot;
+	uint32_t seq;
+	int i;
+
+	set  = block_cache_shared_set(sh, page);
+	slot = NULL;
+
+	for (i = 0; i < BLOCK_CACHE_SHARED_WAYS; i++) {
+		if (set[i].page == page + 1)
+			return;
+		if (!slot && !set[i].page)
+			slot = set + i;
+	}
+
+	if (!slot)
+		slot = set + (sh->victim++ % BLOCK_CACHE_SHARED_WAYS);
+
+	seq = *(volatile uint32_t *)&slot->seq;
+	if (seq & 1)
+		return;
+	if (!__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+		return;
+
+	slot->page = page + 1;
+	memcpy(sh->pages + ((slot - sh->slots) << RADIX_TREE_PAGE_SHIFT),
+	       buf, RADIX_TREE_PAGE_SIZE);
+	__sync_synchronize();
+	slot->seq = seq + 2;
+}
+
+static int
+block_cache_shared_hit(block_cache_t *cache, td_request_t treq)
+{
+	uint64_t sec, end, page;
+	int off, secs;
+
+	end = treq.sec + treq.secs;
+
+	for (sec = treq.sec; sec < end; sec += secs) {
+		page = sec / BLOCK_CACHE_NODES_PER_PAGE;
+		off  = sec % BLOCK_CACHE_NODES_PER_PAGE;
+		secs = MIN(BLOCK_CACHE_NODES_PER_PAGE - off, end - sec);
+
+		if (!block_cache_shared_read(&cache->shared, page, off, secs,
+					     treq.buf + ((sec - treq.sec) <<
+							 RADIX_TREE_NODE_SHIFT)))
+			return 0;
+	}
+
+	cache->stats.shm_hits += treq.secs;
+	td_complete_request(treq, 0);
+
+	return 1;
+}
+
 static void
 block_cache_prune_event(event_id_t id, char mode, void *private)
 {
@@ -505,6 +1241,9 @@ block_cache_prune_event(event_id_t id, char mode, void *private)
 	cache = (block_cache_t *)private;
 	tree  = &cache->tree;
 
+	/* give back what the memory budget no longer allows */
+	block_cache_make_room(cache, 0);
+
 	radix_tree_prune(tree);
 }
 
@@ -543,6 +1282,14 @@ block_cache_open(td_driver_t *driver, const char *name,
 	if (err)
 		return -ENOMEM;
 
+	INIT_LIST_HEAD(&cache->a1in);
+	INIT_LIST_HEAD(&cache->am);
+	INIT_LIST_HEAD(&cache->a1out);
+
+	err = block_cache_set_budget(cache, BLOCK_CACHE_MAX_SIZE);
+	if (err)
+		goto fail;
+
 	cache->sectors = driver->info.size;
 
 	tree = &cache->tree;
@@ -555,14 +1302,24 @@ block_cache_open(td_driver_t *driver, const char *name,
 	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
 		cache->request_free_list[i] = cache->requests + i;
 
+	tapdisk_readahead_init(&cache->ra, cache->sectors,
+			       BLOCK_CACHE_RA_MIN, BLOCK_CACHE_RA_MAX);
+	cache->ra_nr_free = BLOCK_CACHE_RA_REQUESTS;
+	for (i = 0; i < BLOCK_CACHE_RA_REQUESTS; i++) {
+		cache->ra_reqs[i].cache = cache;
+		cache->ra_free[i] = cache->ra_reqs + i;
+	}
+
 	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
 							  -1, /* dummy fd */
-							  TV_SECS(BLOCK_CACHE_PAGE_IDLETIME << 1),
+							  TV_SECS(BLOCK_CACHE_PRUNE_INTERVAL),
 							  block_cache_prune_event,
 							  cache);
 	if (cache->timeout_id < 0)
 		goto fail;
 
+	block_cache_shared_open(cache);
+
 	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
 		"tree: %p, height: %d\n",
 		cache->name, cache->sectors, tree, tree->height);
@@ -575,12 +1332,14 @@ block_cache_open(td_driver_t *driver, const char *name,
 fail:
 	free(cache->name);
 	radix_tree_free(&cache->tree);
+	block_cache_free_ghosts(cache);
 	return err;
 }
 
 static int
 block_cache_close(td_driver_t *driver)
 {
+	int i;
 	radix_tree_t *tree;
 	block_cache_t *cache;
 
@@ -590,7 +1349,11 @@ block_cache_close(td_driver_t *driver)
 	DPRINTF("closing cache for %s\n", cache->name);
 
 	tapdisk_server_unregister_event(cache->timeout_id);
+	block_cache_shared_close(&cache->shared);
 	radix_tree_free(tree);
+	block_cache_free_ghosts(cache);
+	for (i = 0; i < BLOCK_CACHE_RA_REQUESTS; i++)
+		free(cache->ra_reqs[i].buf);
 	free(cache->name);
 
 	return 0;
@@ -599,23 +1362,12 @@ block_cache_close(td_driver_t *driver)
 static inline uint64_t
 block_cache_hash(block_cache_t *cache, char *buf)
 {
-	int i, n;
-	uint64_t cksm, *data;
-
-	return 0;
-
-	cksm = 0;
-	data = (uint64_t *)buf;
-	n    = RADIX_TREE_NODE_SIZE / sizeof(uint64_t);
-
-	for (i = 0; i < n; i++)
-		cksm += data[i];
-
-	return ~cksm;
+	return td_hash(buf, RADIX_TREE_NODE_SIZE);
 }
 
 static void
-block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
+block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[],
+		radix_tree_page_t *pages[])
 {
 	int i;
 	off_t off;
@@ -623,6 +1375,14 @@ block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
 	cache->stats.hits += treq.secs;
 
 	for (i = 0; i < treq.secs; i++) {
+		if (!i || pages[i] != pages[i - 1]) {
+			block_cache_touch(cache, pages[i]);
+			if (pages[i]->ahead) {
+				pages[i]->ahead = 0;
+				cache->stats.ra_used++;
+			}
+		}
+
 		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
 		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
 
@@ -633,23 +1393,90 @@ block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
 	td_complete_request(treq, 0);
 }
 
+/*
+ * Adds the aligned pages of a read to the shared cache. Returns 1 if
+ * that covered all of it.
+ */
+static int
+block_cache_populate_shared(block_cache_t *cache, td_request_t treq,
+			    char *buf)
+{
+	uint64_t sec, end;
+	int all;
+
+	all = 1;
+	end = treq.sec + treq.secs;
+
+	for (sec = treq.sec; sec < end; sec++) {
+		if (sec % BLOCK_CACHE_NODES_PER_PAGE ||
+		    sec + BLOCK_CACHE_NODES_PER_PAGE > end) {
+			all = 0;
+			continue;
+		}
+
+		block_cache_shared_write(&cache->shared,
+					 sec / BLOCK_CACHE_NODES_PER_PAGE,
+					 buf + ((sec - treq.sec) <<
+						RADIX_TREE_NODE_SHIFT));
+		cache->stats.shm_inserts++;
+		sec += BLOCK_CACHE_NODES_PER_PAGE - 1;
+	}
+
+	return all;
+}
+
+/*
+ * Adds the page at @buf, taking it, for @secs sectors from @sec.
+ */
+static radix_tree_page_t *
+block_cache_add_page(block_cache_t *cache, char *buf,
+		     uint64_t sec, uint64_t secs)
+{
+	int shared;
+	radix_tree_page_t *page;
+	block_cache_chunk_t *chunk;
+
+	chunk = NULL;
+
+	if (secs == BLOCK_CACHE_NODES_PER_PAGE) {
+		chunk = block_cache_store_get(buf, &shared);
+		if (chunk) {
+			buf = chunk->buf;
+			cache->stats.shared += shared;
+		}
+	}
+
+	if (radix_tree_add_leaves(&cache->tree, buf, chunk, sec, secs)) {
+		if (chunk)
+			block_cache_store_put(chunk);
+		else
+			free(buf);
+		return NULL;
+	}
+
+	if (!radix_tree_find_leaf(&cache->tree, sec, &page))
+		return NULL;
+
+	return page;
+}
+
 static void
 block_cache_populate_cache(td_request_t clone, int err)
 {
 	int i;
-	radix_tree_t *tree;
 	block_cache_t *cache;
 	block_cache_request_t *breq;
 
 	breq        = (block_cache_request_t *)clone.cb_data;
 	cache       = breq->cache;
-	tree        = &cache->tree;
 	breq->secs -= clone.secs;
 	breq->err   = (breq->err ? breq->err : err);
 
 	if (breq->secs)
 		return;
 
+	cache->reserved -= breq->treq.secs << RADIX_TREE_NODE_SHIFT;
+
 	if (breq->err) {
 		free(breq->buf);
 		goto out;
@@ -663,9 +1490,13 @@ block_cache_populate_cache(td_request_t clone, int err)
 		       breq->buf + off, RADIX_TREE_NODE_SIZE);
 	}
 
-	if (radix_tree_add_leaves(tree, breq->buf,
-				  breq->treq.sec, breq->treq.secs))
+	if (cache->shared.hdr &&
+	    block_cache_populate_shared(cache, breq->treq, breq->buf)) {
 		free(breq->buf);
+		goto out;
+	}
+
+	block_cache_add_page(cache, breq->buf, breq->treq.sec, breq->treq.secs);
 
 out:
 	td_complete_request(breq->treq, breq->err);
@@ -678,18 +1509,16 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 	void *buf;
 	size_t size;
 	td_request_t clone;
-	radix_tree_t *tree;
 	block_cache_request_t *breq;
 
 	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
 
 	clone = treq;
-	tree  = &cache->tree;
 	size  = treq.secs << RADIX_TREE_NODE_SHIFT;
 
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
+	if (!block_cache_make_room(cache, size))
 		goto out;
 
 	breq = block_cache_get_request(cache);
@@ -707,6 +1536,8 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 	breq->buf     = buf;
 	breq->cache   = cache;
 
+	cache->reserved += size;
+
 	clone.buf     = buf;
 	clone.cb      = block_cache_populate_cache;
 	clone.cb_data = breq;
@@ -715,29 +1546,278 @@ out:
 	td_forward_request(clone);
 }
 
+/*
+ * Takes the budget of the VBD first reading through the cache, if it
+ * set one (tap-ctl -b).
+ */
+static void
+block_cache_configure(block_cache_t *cache, td_request_t treq)
+{
+	td_vbd_t *vbd;
+
+	cache->configured = 1;
+
+	vbd = treq.vreq ? treq.vreq->vbd : NULL;
+	if (!vbd || !vbd->cache_size)
+		return;
+
+	if (block_cache_set_budget(cache, (uint64_t)vbd->cache_size << 20)) {
+		WARN("%s: failed to set cache budget\n", cache->name);
+		return;
+	}
+
+	DPRINTF("%s: cache budget %u MiB\n", cache->name, vbd->cache_size);
+}
+
+static int
+block_cache_vbd_ready(td_vbd_t *vbd)
+{
+	return !td_flag_test(vbd->state, TD_VBD_DEAD |
+			     TD_VBD_CLOSED |
+			     TD_VBD_QUIESCE_REQUESTED |
+			     TD_VBD_QUIESCED |
+			     TD_VBD_PAUSE_REQUESTED |
+			     TD_VBD_PAUSED |
+			     TD_VBD_SHUTDOWN_REQUESTED);
+}
+
+static int
+block_cache_cached(block_cache_t *cache, uint64_t sec)
+{
+	radix_tree_page_t *page;
+
+	return radix_tree_find_leaf(&cache->tree, sec, &page) &&
+		page->sec == sec && page->size == RADIX_TREE_PAGE_SIZE;
+}
+
+/*
+ * How much may be read ahead: up to an eighth of the budget, out of
+ * what is free or held by pages read once, never of the LRU list.
+ */
+static int
+block_cache_readahead_room(block_cache_t *cache)
+{
+	uint64_t used, room, budget;
+
+	budget = block_cache_budget(cache);
+	room   = budget / 8;
+
+	if (!cache->shared.hdr) {
+		used = radix_tree_size(&cache->tree) + cache->reserved;
+		room = MIN(room, (used < budget ? budget - used : 0) +
+			   cache->a1in_size);
+	}
+
+	return MIN(room >> RADIX_TREE_NODE_SHIFT, BLOCK_CACHE_RA_MAX);
+}
+
+static void
+block_cache_readahead_done(td_vbd_request_t *vreq, int err,
+			   void *token, int final)
+{
+	block_cache_readahead_t *ra;
+	block_cache_t *cache;
+
+	ra    = container_of(vreq, block_cache_readahead_t, vreq);
+	cache = token;
+
+	cache->reserved -= ra->size;
+	cache->ra_free[cache->ra_nr_free++] = ra;
+}
+
+static void
+block_cache_readahead(block_cache_t *cache, td_request_t treq)
+{
+	block_cache_readahead_t *ra;
+	td_vbd_request_t *vreq;
+	uint64_t sec, end;
+	td_vbd_t *vbd;
+	void *buf;
+	int secs;
+
+	vbd = treq.vreq ? treq.vreq->vbd : NULL;
+	if (!vbd || !cache->ra_nr_free || !block_cache_vbd_ready(vbd))
+		return;
+
+	secs = tapdisk_readahead_update(&cache->ra, vbd, treq.sec, treq.secs,
+					block_cache_readahead_room(cache),
+					&sec);
+	if (!secs)
+		return;
+
+	end  = sec + secs;
+	end -= end % BLOCK_CACHE_NODES_PER_PAGE;
+	sec -= sec % BLOCK_CACHE_NODES_PER_PAGE;
+
+	while (sec < end && block_cache_cached(cache, sec))
+		sec += BLOCK_CACHE_NODES_PER_PAGE;
+	if (sec >= end)
+		return;
+
+	secs = end - sec;
+
+	if (!cache->shared.hdr &&
+	    !block_cache_make_room(cache, secs << RADIX_TREE_NODE_SHIFT))
+		return;
+
+	ra = cache->ra_free[--cache->ra_nr_free];
+
+	if (!ra->buf) {
+		if (posix_memalign(&buf, RADIX_TREE_PAGE_SIZE,
+				   (BLOCK_CACHE_RA_MAX +
+				    BLOCK_CACHE_NODES_PER_PAGE) <<
+				   RADIX_TREE_NODE_SHIFT)) {
+			cache->ra_free[cache->ra_nr_free++] = ra;
+			return;
+		}
+		ra->buf = buf;
+	}
+
+	ra->size = cache->shared.hdr ? 0 : secs << RADIX_TREE_NODE_SHIFT;
+	cache->reserved += ra->size;
+
+	ra->iov.base = ra->buf;
+	ra->iov.secs = secs;
+
+	vreq         = &ra->vreq;
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = sec;
+	vreq->iov    = &ra->iov;
+	vreq->iovcnt = 1;
+	vreq->cb     = block_cache_readahead_done;
+	vreq->token  = cache;
+	vreq->name   = "block-cache-readahead";
+
+	DBG("%s: readahead sec 0x%08llx, %d secs\n", cache->name, sec, secs);
+
+	if (tapdisk_vbd_queue_request(vbd, vreq))
+		block_cache_readahead_done(vreq, -EIO, cache, 1);
+}
+
+/*
+ * Our readahead reaching the cache: whatever the leaf did not have.
+ */
+static void
+block_cache_readahead_fill(td_request_t clone, int err)
+{
+	uint64_t sec, end;
+	td_request_t treq;
+	block_cache_t *cache;
+	radix_tree_page_t *page;
+	block_cache_request_t *breq;
+	void *buf;
+	char *src;
+
+	breq        = (block_cache_request_t *)clone.cb_data;
+	cache       = breq->cache;
+	breq->secs -= clone.secs;
+	breq->err   = (breq->err ? breq->err : err);
+
+	if (breq->secs)
+		return;
+
+	treq = breq->treq;
+	end  = treq.sec + treq.secs;
+	sec  = treq.sec + (-treq.sec % BLOCK_CACHE_NODES_PER_PAGE);
+
+	for (; !breq->err && sec + BLOCK_CACHE_NODES_PER_PAGE <= end;
+	     sec += BLOCK_CACHE_NODES_PER_PAGE) {
+		src = treq.buf + ((sec - treq.sec) << RADIX_TREE_NODE_SHIFT);
+
+		if (cache->shared.hdr) {
+			block_cache_shared_write(&cache->shared,
+						 sec / BLOCK_CACHE_NODES_PER_PAGE,
+						 src);
+			cache->stats.shm_inserts++;
+			cache->stats.ra_pages++;
+			continue;
+		}
+
+		if (block_cache_cached(cache, sec))
+			continue;
+
+		if (posix_memalign(&buf, RADIX_TREE_NODE_SIZE,
+				   RADIX_TREE_PAGE_SIZE))
+			break;
+		memcpy(buf, src, RADIX_TREE_PAGE_SIZE);
+
+		page = block_cache_add_page(cache, buf, sec,
+					    BLOCK_CACHE_NODES_PER_PAGE);
+		if (page) {
+			page->ahead = 1;
+			cache->stats.ra_pages++;
+		}
+	}
+
+	td_complete_request(treq, breq->err);
+	block_cache_put_request(cache, breq);
+}
+
+static void
+block_cache_readahead_read(block_cache_t *cache, td_request_t treq)
+{
+	td_request_t clone;
+	block_cache_request_t *breq;
+
+	breq = block_cache_get_request(cache);
+	if (!breq)
+		return td_forward_request(treq);
+
+	breq->treq    = treq;
+	breq->secs    = treq.secs;
+	breq->err     = 0;
+	breq->cache   = cache;
+
+	clone         = treq;
+	clone.cb      = block_cache_readahead_fill;
+	clone.cb_data = breq;
+
+	td_forward_request(clone);
+}
+
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
 	int i;
 	radix_tree_t *tree;
 	block_cache_t *cache;
-	char *iov[BLOCK_CACHE_NODES_PER_PAGE];
+	char *iov[BLOCK_CACHE_MAX_HIT];
+	radix_tree_page_t *pages[BLOCK_CACHE_MAX_HIT];
 
 	cache = (block_cache_t *)driver->data;
 	tree  = &cache->tree;
 
+	if (treq.vreq && treq.vreq->token == cache)
+		return block_cache_readahead_read(cache, treq);
+
+	if (!cache->configured)
+		block_cache_configure(cache, treq);
+
 	cache->stats.reads += treq.secs;
 
-	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
+	block_cache_readahead(cache, treq);
+
+	if (treq.secs > BLOCK_CACHE_MAX_HIT)
 		return td_forward_request(treq);
 
 	for (i = 0; i < treq.secs; i++) {
-		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
+		iov[i] = radix_tree_find_leaf(tree, treq.sec + i, &pages[i]);
 		if (!iov[i])
-			return block_cache_miss(cache, treq);
+			goto miss;
 	}
 
-	return block_cache_hit(cache, treq, iov);
+	return block_cache_hit(cache, treq, iov, pages);
+
+miss:
+	if (cache->shared.hdr && block_cache_shared_hit(cache, treq))
+		return;
+
+	/* misses are cached a page at most */
+	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
+		return td_forward_request(treq);
+
+	return block_cache_miss(cache, treq);
 }
 
 static void
@@ -765,6 +1845,47 @@ block_cache_validate_parent(td_driver_t *driver,
 	return 0;
 }
 
+static double
+block_cache_hit_ratio(block_cache_t *cache)
+{
+	block_cache_stats_t *stats = &cache->stats;
+
+	if (!stats->reads)
+		return 0;
+
+	return (double)(stats->hits + stats->shm_hits) / stats->reads;
+}
+
+static void
+block_cache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	block_cache_t *cache = driver->data;
+	block_cache_stats_t *stats = &cache->stats;
+
+	tapdisk_stats_field(st, "budget", "llu",
+			    (unsigned long long)cache->budget);
+	tapdisk_stats_field(st, "size", "llu",
+			    (unsigned long long)radix_tree_size(&cache->tree));
+	tapdisk_stats_field(st, "reads", "llu",
+			    (unsigned long long)stats->reads);
+	tapdisk_stats_field(st, "hits", "llu",
+			    (unsigned long long)(stats->hits + stats->shm_hits));
+	tapdisk_stats_field(st, "misses", "llu",
+			    (unsigned long long)stats->misses);
+	tapdisk_stats_field(st, "hit_ratio", ".3f",
+			    block_cache_hit_ratio(cache));
+	tapdisk_stats_field(st, "evictions", "llu",
+			    (unsigned long long)stats->evictions);
+	tapdisk_stats_field(st, "ghost_hits", "llu",
+			    (unsigned long long)stats->ghost_hits);
+	tapdisk_stats_field(st, "readahead", "llu",
+			    (unsigned long long)cache->ra.issued);
+	tapdisk_stats_field(st, "readahead_pages", "llu",
+			    (unsigned long long)stats->ra_pages);
+	tapdisk_stats_field(st, "readahead_used", "llu",
+			    (unsigned long long)stats->ra_used);
+}
+
 static void
 block_cache_debug(td_driver_t *driver)
 {
@@ -775,9 +1896,23 @@ block_cache_debug(td_driver_t *driver)
 	stats = &cache->stats;
 
 	WARN("BLOCK CACHE %s\n", cache->name);
-	WARN("reads: %"PRIu64", hits: %"PRIu64", "
-	     "misses: %"PRIu64", prunes: %"PRIu64"\n",
-	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	WARN("reads: %"PRIu64", hits: %"PRIu64" (%.1f%%), "
+	     "misses: %"PRIu64", prunes: %"PRIu64", shared: %"PRIu64"\n",
+	     stats->reads, stats->hits + stats->shm_hits,
+	     block_cache_hit_ratio(cache) * 100,
+	     stats->misses, stats->prunes, stats->shared);
+	WARN("budget: %"PRIu64", size: %"PRIu64", a1in: %"PRIu64", "
+	     "evictions: %"PRIu64", ghost hits: %"PRIu64"\n",
+	     cache->budget, radix_tree_size(&cache->tree), cache->a1in_size,
+	     stats->evictions, stats->ghost_hits);
+	WARN("readahead: %"PRIu64" secs, %"PRIu64" pages, %"PRIu64" used\n",
+	     cache->ra.issued, stats->ra_pages, stats->ra_used);
+	WARN("store: %"PRIu64" pages, %"PRIu64" shared\n",
+	     store.chunks, store.shared);
+	if (cache->shared.hdr)
+		WARN("shm %s: hits: %"PRIu64", inserts: %"PRIu64"\n",
+		     cache->shared.shm.path, stats->shm_hits,
+		     stats->shm_inserts);
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -791,4 +1926,5 @@ struct tap_disk tapdisk_block_cache = {
 	.td_get_parent_id           = block_cache_get_parent_id,
 	.td_validate_parent         = block_cache_validate_parent,
 	.td_debug                   = block_cache_debug,
+	.td_stats                   = block_cache_stats,
 };
@@ -0,0 +1,509 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * End-to-end integrity checking, stacked on top of a VBD's chain: a
+ * CRC32C of every 4K page is kept in a sidecar file, set when the page
+ * is written whole and checked whenever it is read whole. A page read
+ * before any write through this layer is learned from that read, so
+ * corruption of parents and of data written elsewhere surfaces on later
+ * reads. A mismatching read fails with EIO, which the VBD retries: a
+ * transient bad read off a flaky path heals, a bad page on storage
+ * keeps failing. With TAPDISK3_CRC_REPORT set, mismatches are only
+ * logged and counted.
+ *
+ * The sidecar is <leaf>.crc, or <leaf basename>.crc in TAPDISK3_CRC_DIR
+ * for leaves on block devices. It is mapped shared and marked clean only
+ * on close: a sidecar found unclean, after a crash, cannot be trusted to
+ * match the data and is reset to unknown.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "crc32c.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-stats.h"
+
+#define DBG(_level, _f, _a...) tlog_write(_level, _f, ##_a)
+#define ERR(_s, _err, _f, _a...) tlog_drv_error((_s)->driver, _err, _f, ##_a)
+
+#define CRC_MAGIC                "tdcrc32c"
+#define CRC_VERSION              1
+#define CRC_HEADER_SIZE          4096
+#define CRC_PAGE_SHIFT           12
+#define CRC_PAGE_SIZE            (1 << CRC_PAGE_SHIFT)
+#define CRC_PAGE_SECS            (CRC_PAGE_SIZE >> SECTOR_SHIFT)
+
+#define MIN(a, b)                ((a) < (b) ? (a) : (b))
+
+/* no checksum on record; a page checksumming to 0 is kept as 1 */
+#define CRC_UNKNOWN              0
+
+/* mismatches logged in full, then at powers of two */
+#define CRC_LOG_MISMATCHES       64
+
+struct crc_header {
+	char                     magic[8];
+	uint32_t                 version;
+	uint32_t                 page_shift;
+	uint64_t                 pages;
+	uint32_t                 clean;
+	uint32_t                 reserved;
+};
+
+struct crc_state;
+
+struct crc_request {
+	td_request_t             treq;
+	td_sector_t              secs;   /* not completed yet */
+	int                      err;
+	struct crc_state        *s;
+};
+
+struct crc_state {
+	td_driver_t             *driver;
+	char                    *path;
+	int                      fd;
+	void                    *map;
+	size_t                   map_size;
+	struct crc_header       *hdr;
+	uint32_t                *crcs;
+	uint64_t                 pages;
+	int                      report;
+
+	struct crc_request       reqs[TAPDISK_DATA_REQUESTS];
+	struct crc_request      *free[TAPDISK_DATA_REQUESTS];
+	int                      n_free;
+
+	uint64_t                 verified;  /* pages */
+	uint64_t                 learned;
+	uint64_t                 mismatches;
+	uint64_t                 unchecked; /* requests */
+};
+
+static inline uint32_t
+crc_page(const char *buf)
+{
+	uint32_t crc = crc32c(0, buf, CRC_PAGE_SIZE);
+
+	return crc != CRC_UNKNOWN ? crc : 1;
+}
+
+static char *
+crc_sidecar_path(const char *name)
+{
+	const char *dir;
+	char *copy, *path;
+	int err;
+
+	dir = getenv("TAPDISK3_CRC_DIR");
+	if (!dir) {
+		err = asprintf(&path, "%s.crc", name);
+		return err == -1 ? NULL : path;
+	}
+
+	copy = strdup(name);
+	if (!copy)
+		return NULL;
+
+	err = asprintf(&path, "%s/%s.crc", dir, basename(copy));
+	free(copy);
+
+	return err == -1 ? NULL : path;
+}
+
+static int
+crc_sidecar_open(struct crc_state *s)
+{
+	struct crc_header hdr;
+	struct stat st;
+	size_t size;
+	ssize_t ret;
+	int reset;
+
+	s->fd = open(s->path, O_RDWR | O_CREAT, 0644);
+	if (s->fd == -1)
+		return -errno;
+
+	size = CRC_HEADER_SIZE + s->pages * sizeof(uint32_t);
+
+	if (fstat(s->fd, &st))
+		return -errno;
+
+	memset(&hdr, 0, sizeof(hdr));
+	ret = pread(s->fd, &hdr, sizeof(hdr), 0);
+	if (ret == -1)
+		return -errno;
+
+	reset = (ret != sizeof(hdr) || st.st_size != size ||
+		 memcmp(hdr.magic, CRC_MAGIC, sizeof(hdr.magic)) ||
+		 hdr.version != CRC_VERSION ||
+		 hdr.page_shift != CRC_PAGE_SHIFT ||
+		 hdr.pages != s->pages || !hdr.clean);
+
+	if (reset) {
+		if (ret == sizeof(hdr) && st.st_size)
+			DBG(TLOG_WARN, "%s: unclean or stale, resetting\n",
+			    s->path);
+
+		/* sparse zeros: every page unknown */
+		if (ftruncate(s->fd, 0) || ftruncate(s->fd, size))
+			return -errno;
+	}
+
+	s->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      s->fd, 0);
+	if (s->map == MAP_FAILED) {
+		s->map = NULL;
+		return -errno;
+	}
+
+	s->map_size = size;
+	s->hdr      = s->map;
+	s->crcs     = (uint32_t *)((char *)s->map + CRC_HEADER_SIZE);
+
+	if (reset) {
+		memcpy(s->hdr->magic, CRC_MAGIC, sizeof(s->hdr->magic));
+		s->hdr->version    = CRC_VERSION;
+		s->hdr->page_shift = CRC_PAGE_SHIFT;
+		s->hdr->pages      = s->pages;
+	}
+
+	/* in use: a crash from here on leaves it unclean */
+	s->hdr->clean = 0;
+	if (msync(s->map, CRC_HEADER_SIZE, MS_SYNC))
+		return -errno;
+
+	return 0;
+}
+
+static void
+crc_sidecar_close(struct crc_state *s)
+{
+	if (s->map) {
+		if (!msync(s->map, s->map_size, MS_SYNC)) {
+			s->hdr->clean = 1;
+			msync(s->map, CRC_HEADER_SIZE, MS_SYNC);
+		}
+		munmap(s->map, s->map_size);
+		s->map = NULL;
+	}
+
+	if (s->fd != -1) {
+		close(s->fd);
+		s->fd = -1;
+	}
+}
+
+static struct crc_request *
+crc_get_request(struct crc_state *s)
+{
+	if (!s->n_free)
+		return NULL;
+
+	return s->free[--s->n_free];
+}
+
+static void
+crc_put_request(struct crc_state *s, struct crc_request *req)
+{
+	s->free[s->n_free++] = req;
+}
+
+/* pages wholly within the request, [*first, *end) */
+static void
+crc_pages(td_sector_t sec, int secs, uint64_t *first, uint64_t *end)
+{
+	*first = (sec + CRC_PAGE_SECS - 1) / CRC_PAGE_SECS;
+	*end   = (sec + secs) / CRC_PAGE_SECS;
+}
+
+/* every page the request touches, partly or wholly, is unknown */
+static void
+crc_invalidate(struct crc_state *s, td_sector_t sec, int secs)
+{
+	uint64_t page, last;
+
+	if (!secs)
+		return;
+
+	last = MIN((sec + secs - 1) / CRC_PAGE_SECS, s->pages - 1);
+	for (page = sec / CRC_PAGE_SECS; page <= last; page++)
+		if (s->crcs[page] != CRC_UNKNOWN)
+			s->crcs[page] = CRC_UNKNOWN;
+}
+
+static int
+crc_verify(struct crc_state *s, td_request_t treq)
+{
+	uint64_t page, first, end, n;
+	uint32_t crc;
+	char *buf;
+	int bad = 0;
+
+	crc_pages(treq.sec, treq.secs, &first, &end);
+
+	for (page = first; page < end; page++) {
+		buf = treq.buf +
+			((page * CRC_PAGE_SECS - treq.sec) << SECTOR_SHIFT);
+		crc = crc_page(buf);
+
+		if (s->crcs[page] == CRC_UNKNOWN) {
+			s->crcs[page] = crc;
+			s->learned++;
+			continue;
+		}
+
+		if (s->crcs[page] == crc) {
+			s->verified++;
+			continue;
+		}
+
+		n = ++s->mismatches;
+		if (n <= CRC_LOG_MISMATCHES || !(n & (n - 1)))
+			ERR(s, -EIO, "checksum mismatch at sector 0x%08"PRIx64
+			    ": 0x%08x on record, 0x%08x read (%"PRIu64
+			    " so far)", page * CRC_PAGE_SECS,
+			    s->crcs[page], crc, n);
+		bad = 1;
+	}
+
+	return bad && !s->report ? -EIO : 0;
+}
+
+static void
+crc_record(struct crc_state *s, td_request_t treq)
+{
+	uint64_t page, first, end;
+	char *buf;
+
+	crc_pages(treq.sec, treq.secs, &first, &end);
+
+	for (page = first; page < end; page++) {
+		buf = treq.buf +
+			((page * CRC_PAGE_SECS - treq.sec) << SECTOR_SHIFT);
+		s->crcs[page] = crc_page(buf);
+	}
+}
+
+/*
+ * Requests may come back in pieces. The checksums are dealt with once
+ * the whole of it is back.
+ */
+static void
+crc_complete(td_request_t clone, int err)
+{
+	struct crc_request *req = clone.cb_data;
+	struct crc_state *s = req->s;
+	td_request_t treq;
+
+	req->secs -= clone.secs;
+	req->err   = req->err ? : err;
+
+	if (req->secs)
+		return;
+
+	treq = req->treq;
+	err  = req->err;
+
+	if (treq.op == TD_OP_READ) {
+		if (!err)
+			err = crc_verify(s, treq);
+	} else if (!err)
+		crc_record(s, treq);
+
+	crc_put_request(s, req);
+	td_complete_request(treq, err);
+}
+
+static void
+crc_forward(struct crc_state *s, td_request_t treq)
+{
+	struct crc_request *req;
+	td_request_t clone;
+
+	req = crc_get_request(s);
+	if (!req) {
+		s->unchecked++;
+		td_forward_request(treq);
+		return;
+	}
+
+	req->treq = treq;
+	req->secs = treq.secs;
+	req->err  = 0;
+	req->s    = s;
+
+	clone         = treq;
+	clone.cb      = crc_complete;
+	clone.cb_data = req;
+
+	td_forward_request(clone);
+}
+
+/* -- interface -- */
+
+static int
+crc_close(td_driver_t *driver)
+{
+	struct crc_state *s = driver->data;
+
+	crc_sidecar_close(s);
+	free(s->path);
+	s->path = NULL;
+
+	return 0;
+}
+
+static int
+crc_open(td_driver_t *driver, const char *name,
+	 struct td_vbd_encryption *encryption, td_flag_t flags)
+{
+	struct crc_state *s = driver->data;
+	int i, err;
+
+	memset(s, 0, sizeof(*s));
+	s->driver = driver;
+	s->fd     = -1;
+	s->pages  = (driver->info.size + CRC_PAGE_SECS - 1) / CRC_PAGE_SECS;
+	s->report = !!getenv("TAPDISK3_CRC_REPORT");
+
+	if (!s->pages)
+		return -EINVAL;
+
+	s->path = crc_sidecar_path(name);
+	if (!s->path)
+		return -ENOMEM;
+
+	err = crc_sidecar_open(s);
+	if (err) {
+		ERR(s, err, "opening %s", s->path);
+		crc_close(driver);
+		return err;
+	}
+
+	for (i = 0; i < TAPDISK_DATA_REQUESTS; i++)
+		s->free[i] = &s->reqs[i];
+	s->n_free = TAPDISK_DATA_REQUESTS;
+
+	DPRINTF("%s: checksums in %s, %"PRIu64" pages%s\n", name, s->path,
+		s->pages, s->report ? ", report only" : "");
+
+	return 0;
+}
+
+static void
+crc_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	crc_forward(driver->data, treq);
+}
+
+static void
+crc_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	struct crc_state *s = driver->data;
+
+	/* unknown until the write is done, whatever reads meanwhile */
+	crc_invalidate(s, treq.sec, treq.secs);
+	crc_forward(s, treq);
+}
+
+/* neither reads back anything checksummed: learned on the next read */
+static void
+crc_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	crc_invalidate(driver->data, treq.sec, treq.secs);
+	td_forward_request(treq);
+}
+
+static int
+crc_sector_present(td_driver_t *driver, td_sector_t sec, td_sector_t *secs)
+{
+	/* reads all pass through */
+	*secs = driver->info.size - sec;
+	return 0;
+}
+
+static int
+crc_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	return -EINVAL;
+}
+
+static int
+crc_validate_parent(td_driver_t *driver, td_driver_t *parent, td_flag_t flags)
+{
+	return 0;
+}
+
+static void
+crc_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct crc_state *s = driver->data;
+
+	tapdisk_stats_field(st, "sidecar", "s", s->path);
+	tapdisk_stats_field(st, "verified", "llu", s->verified);
+	tapdisk_stats_field(st, "learned", "llu", s->learned);
+	tapdisk_stats_field(st, "mismatches", "llu", s->mismatches);
+	tapdisk_stats_field(st, "unchecked", "llu", s->unchecked);
+	tapdisk_stats_field(st, "report_only", "d", s->report);
+}
+
+struct tap_disk tapdisk_crc = {
+	.disk_type          = "tapdisk_crc",
+	.flags              = 0,
+	.private_data_size  = sizeof(struct crc_state),
+	.td_open            = crc_open,
+	.td_close           = crc_close,
+	.td_queue_read      = crc_queue_read,
+	.td_queue_write     = crc_queue_write,
+	.td_queue_discard   = crc_queue_discard,
+	.td_queue_write_zeroes = crc_queue_discard,
+	.td_get_parent_id   = crc_get_parent_id,
+	.td_validate_parent = crc_validate_parent,
+	.td_stats           = crc_stats,
+	.td_sector_present  = crc_sector_present,
+};
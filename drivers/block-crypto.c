@@ -37,6 +37,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "list.h"
 #include "libvhd.h"
@@ -174,7 +176,7 @@ find_keyfile(char **keyfile, const char *dirs,
 
 static int
 read_keyfile(const char *keydir, const char *basename,
-	     uint8_t *keybuf, size_t keysize)
+	     uint8_t *keybuf, size_t keysize, char **path, struct stat *st)
 {
 	int err, fd = -1;
 	char *keyfile = NULL;
@@ -186,7 +188,7 @@ read_keyfile(const char *keydir, const char *basename,
 	}
 
 	fd = open(keyfile, O_RDONLY);
-	if (fd == -1) {
+	if (fd == -1 || fstat(fd, st)) {
 		err = -errno;
 		goto out;
 	}
@@ -198,9 +200,13 @@ read_keyfile(const char *keydir, const char *basename,
 	}
 
 	DPRINTF("using keyfile %s, keysize %d\n", keyfile, (int)keysize);
-	err = 0;
+	*path   = keyfile;
+	keyfile = NULL;
+	err     = 0;
 
 out:
+	if (err)
+		explicit_bzero(keybuf, keysize / 8);
 	if (fd != -1)
 		close(fd);
 	free(keyfile);
@@ -209,13 +215,15 @@ out:
 
 // try 512bit, 256bit keys
 static int
-read_preferred_keyfile(const char *keydir, const char *basename, uint8_t *keybuf, int *keysize)
+read_preferred_keyfile(const char *keydir, const char *basename, uint8_t *keybuf, int *keysize,
+		       char **path, struct stat *st)
 {
     int err, i;
     *keysize = 0;
     err = -EINVAL;
     for (i = 0; CRYPTO_SUPPORTED_KEYSIZE[i] > 0; ++i) {
-        err = read_keyfile(keydir, basename, keybuf, CRYPTO_SUPPORTED_KEYSIZE[i]);
+        err = read_keyfile(keydir, basename, keybuf, CRYPTO_SUPPORTED_KEYSIZE[i],
+                           path, st);
         if (err == 0) {
             *keysize = CRYPTO_SUPPORTED_KEYSIZE[i];
             return 0;
@@ -255,14 +263,160 @@ out:
     return parent;
 }
 
+/*
+ * Keys resolved by chain_find_keyed_vhd(), by leaf: the file, its uuid
+ * and keyhash. A hit still stats the key file and must find it as it was
+ * read, so a key taken away is not used again; the chain above the leaf
+ * is not walked, nor the key read and hashed. Entries are wiped when
+ * dropped, and all of them when the library goes.
+ */
+#define KEY_CACHE_SIZE 64
+
+struct key_cache_entry {
+	int                          valid;
+	unsigned long                used;
+
+	dev_t                        dev;
+	ino_t                        ino;
+	uuid_t                       uuid;
+	struct vhd_keyhash           leaf;
+
+	char                        *keyfile;
+	struct stat                  keyst;
+
+	struct vhd_keyhash           keyhash;
+	int                          keysize;
+	uint8_t                      key[MAX_AES_XTS_PLAIN_KEYSIZE / 8];
+};
+
+static struct key_cache_entry key_cache[KEY_CACHE_SIZE];
+static unsigned long key_cache_clock;
+static pthread_mutex_t key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+key_cache_drop(struct key_cache_entry *e)
+{
+	free(e->keyfile);
+	explicit_bzero(e, sizeof(*e));
+}
+
+static int
+key_cache_same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+		a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static int
+key_cache_lookup(vhd_context_t *vhd, const struct vhd_keyhash *leaf,
+		 uint8_t *key, int *keysize, struct vhd_keyhash *keyhash)
+{
+	struct key_cache_entry *e;
+	struct stat st, kst;
+	int i, hit = 0;
+
+	if (fstat(vhd->fd, &st))
+		return 0;
+
+	pthread_mutex_lock(&key_cache_lock);
+
+	for (i = 0; i < KEY_CACHE_SIZE; i++) {
+		e = &key_cache[i];
+		if (!e->valid || e->dev != st.st_dev || e->ino != st.st_ino ||
+		    memcmp(e->uuid, vhd->footer.uuid, sizeof(e->uuid)) ||
+		    memcmp(&e->leaf, leaf, sizeof(*leaf)))
+			continue;
+
+		if (stat(e->keyfile, &kst) || !key_cache_same_file(&kst, &e->keyst)) {
+			DPRINTF("keyfile %s changed, dropping cached key\n",
+				e->keyfile);
+			key_cache_drop(e);
+			break;
+		}
+
+		memcpy(key, e->key, e->keysize / 8);
+		*keysize = e->keysize;
+		*keyhash = e->keyhash;
+		e->used  = ++key_cache_clock;
+		hit = 1;
+		break;
+	}
+
+	pthread_mutex_unlock(&key_cache_lock);
+
+	return hit;
+}
+
+static void
+key_cache_insert(vhd_context_t *vhd, const struct vhd_keyhash *leaf,
+		 const uint8_t *key, int keysize,
+		 const struct vhd_keyhash *keyhash,
+		 const char *keyfile, const struct stat *keyst)
+{
+	struct key_cache_entry *e, *lru;
+	struct stat st;
+	int i;
+
+	if (fstat(vhd->fd, &st))
+		return;
+
+	pthread_mutex_lock(&key_cache_lock);
+
+	lru = &key_cache[0];
+	for (i = 0; i < KEY_CACHE_SIZE; i++) {
+		e = &key_cache[i];
+		if (!e->valid) {
+			lru = e;
+			break;
+		}
+		if (e->dev == st.st_dev && e->ino == st.st_ino) {
+			lru = e;
+			break;
+		}
+		if (e->used < lru->used)
+			lru = e;
+	}
+
+	e = lru;
+	key_cache_drop(e);
+
+	e->keyfile = strdup(keyfile);
+	if (e->keyfile) {
+		e->valid   = 1;
+		e->used    = ++key_cache_clock;
+		e->dev     = st.st_dev;
+		e->ino     = st.st_ino;
+		memcpy(e->uuid, vhd->footer.uuid, sizeof(e->uuid));
+		e->leaf    = *leaf;
+		e->keyst   = *keyst;
+		e->keyhash = *keyhash;
+		e->keysize = keysize;
+		memcpy(e->key, key, keysize / 8);
+	}
+
+	pthread_mutex_unlock(&key_cache_lock);
+}
+
+static void __attribute__((destructor))
+key_cache_wipe(void)
+{
+	int i;
+
+	for (i = 0; i < KEY_CACHE_SIZE; i++)
+		key_cache_drop(&key_cache[i]);
+}
+
 /* look up the chain for first parent VHD with encryption key */
 static int
 chain_find_keyed_vhd(vhd_context_t *vhd, uint8_t *key, int *keysize, struct vhd_keyhash *out_keyhash)
 {
     int err;
-    struct vhd_keyhash keyhash;
+    struct vhd_keyhash keyhash, leaf;
     vhd_context_t *p = vhd, *p2;
-    char *basename;
+    char *basename, *keyfile;
+    struct stat keyst;
     const char *keydir;
     int found = 0;
 
@@ -273,6 +427,19 @@ chain_find_keyed_vhd(vhd_context_t *vhd, uint8_t *key, int *keysize, struct vhd_
       keydir = CRYPTO_DEFAULT_KEYDIR;
     }
 
+    if (keydir) {
+        err = vhd_get_keyhash(vhd, &leaf);
+        if (err) {
+            DPRINTF("error getting keyhash: %d\n", err);
+            return err;
+        }
+
+        if (key_cache_lookup(vhd, &leaf, key, keysize, out_keyhash)) {
+            DPRINTF("using cached key for %s\n", vhd->file);
+            return 0;
+        }
+    }
+
     while (p) {
         err = vhd_get_keyhash(p, &keyhash);
         if (err) {
@@ -295,20 +462,28 @@ chain_find_keyed_vhd(vhd_context_t *vhd, uint8_t *key, int *keysize, struct vhd_
                 goto out;
             }
 
-            err = read_preferred_keyfile(keydir, basename, key, keysize);
+            keyfile = NULL;
+            err = read_preferred_keyfile(keydir, basename, key, keysize,
+                                         &keyfile, &keyst);
             free(basename);
             switch (err) {
             case 0: /* a key has been found with the same basename */
                 if (keyhash.cookie == 0) {
                     DPRINTF("key found for %s but no hash set\n", p->file);
+                    free(keyfile);
                     err = -EACCES;
                     goto out;
                 }
                 err = check_key(key, *keysize, &keyhash);
-                if (err)
+                if (err) {
+                    free(keyfile);
                     goto out;
+                }
                 DPRINTF("using key from vhd: %s\n", p->file);
                 *out_keyhash = keyhash;
+                key_cache_insert(vhd, &leaf, key, *keysize, &keyhash,
+                                 keyfile, &keyst);
+                free(keyfile);
                 found = 1;
                 break;
             case -ENOENT: /* no key found, get to the next one if the cookie's not set */
@@ -349,7 +524,7 @@ vhd_open_crypto(vhd_context_t *vhd, const uint8_t *key, size_t key_bytes, const
 	struct vhd_keyhash keyhash;
 	int err;
 #ifdef OPEN_XT
-	uint8_t key[MAX_AES_XTS_PLAIN_KEYSIZE / sizeof(uint8_t)] = { 0 };
+	uint8_t keybuf[MAX_AES_XTS_PLAIN_KEYSIZE / sizeof(uint8_t)] = { 0 };
 	int keysize = 0;
 #endif
 
@@ -357,15 +532,19 @@ vhd_open_crypto(vhd_context_t *vhd, const uint8_t *key, size_t key_bytes, const
 		return 0;
 
 #ifdef OPEN_XT
-	err = chain_find_keyed_vhd(vhd, key, &keysize, &keyhash);
+	err = chain_find_keyed_vhd(vhd, keybuf, &keysize, &keyhash);
 	if (err) {
 	    DPRINTF("error in vhd chain: %d\n", err);
+	    explicit_bzero(keybuf, sizeof(keybuf));
 	    return err;
 	}
 
 	if (keyhash.cookie == 0) {
 		return 0;
 	}
+
+	key       = keybuf;
+	key_bytes = keysize / 8;
 #else
 	memset(&keyhash, 0, sizeof(keyhash));
 	err = vhd_get_keyhash(vhd, &keyhash);
@@ -399,32 +578,58 @@ vhd_open_crypto(vhd_context_t *vhd, const uint8_t *key, size_t key_bytes, const
 	vhd->xts_tfm = xts_aes_setup();
 	if (vhd->xts_tfm == NULL) {
 		err = -EINVAL;
-		return err;
+		goto out;
 	}
 
 	xts_aes_setkey(vhd->xts_tfm, key, key_bytes);
-	return 0;
+	err = 0;
+
+out:
+#ifdef OPEN_XT
+	explicit_bzero(keybuf, sizeof(keybuf));
+#endif
+	return err;
+}
+
+/*
+ * A private copy of the cipher of \a vhd, for use on another thread.
+ */
+struct crypto_blkcipher *
+vhd_crypto_clone(vhd_context_t *vhd)
+{
+	if (!vhd->xts_tfm)
+		return NULL;
+
+	return xts_aes_clone(vhd->xts_tfm);
 }
 
 void
-vhd_crypto_decrypt(vhd_context_t *vhd, td_request_t *t)
+vhd_crypto_free(struct crypto_blkcipher *tfm)
 {
-	int sec, ret;
-
-	for (sec = 0; sec < t->secs; sec++) {
-		ret = xts_aes_plain_decrypt(vhd->xts_tfm, t->sec + sec,
-					    (uint8_t *)t->buf +
-					    sec * VHD_SECTOR_SIZE,
-					    (uint8_t *)t->buf +
-					    sec * VHD_SECTOR_SIZE,
-					    VHD_SECTOR_SIZE);
-		if (ret) {
-			DPRINTF("crypto decrypt failed: %d : TERMINATED\n", ret);
-			exit(1); /* XXX */
-		}
+	xts_aes_free(tfm);
+}
+
+void
+vhd_crypto_decrypt_with(struct crypto_blkcipher *tfm, td_request_t *t)
+{
+	int ret;
+
+	ret = xts_aes_plain_decrypt_sectors(tfm, t->sec,
+					    (uint8_t *)t->buf,
+					    (uint8_t *)t->buf,
+					    t->secs, VHD_SECTOR_SIZE);
+	if (ret) {
+		DPRINTF("crypto decrypt failed: %d : TERMINATED\n", ret);
+		exit(1); /* XXX */
 	}
 }
 
+void
+vhd_crypto_decrypt(vhd_context_t *vhd, td_request_t *t)
+{
+	vhd_crypto_decrypt_with(vhd->xts_tfm, t);
+}
+
 int
 vhd_crypto_encrypt_block(vhd_context_t *vhd, sector_t sector, uint8_t *source,
 			 uint8_t *dst, unsigned int block_size)
@@ -432,21 +637,37 @@ vhd_crypto_encrypt_block(vhd_context_t *vhd, sector_t sector, uint8_t *source,
 	return xts_aes_plain_encrypt(vhd->xts_tfm, sector, dst, source, block_size);
 }
 
+/*
+ * Encrypts \a sectors sectors of \a source starting at \a sector into
+ * \a dst with a cipher from vhd_crypto_clone().
+ */
+int
+vhd_crypto_encrypt_sectors_with(struct crypto_blkcipher *tfm, uint64_t sector,
+				uint8_t *source, uint8_t *dst,
+				unsigned int sectors)
+{
+	return xts_aes_plain_encrypt_sectors(tfm, sector, dst, source,
+					     sectors, VHD_SECTOR_SIZE);
+}
+
 void
-vhd_crypto_encrypt(vhd_context_t *vhd, td_request_t *t, char *orig_buf)
+vhd_crypto_encrypt_with(struct crypto_blkcipher *tfm, td_request_t *t,
+			char *orig_buf)
 {
-	int sec, ret;
-
-	for (sec = 0; sec < t->secs; sec++) {
-		ret = vhd_crypto_encrypt_block(
-			vhd, t->sec + sec,
-			(uint8_t *)orig_buf + sec * VHD_SECTOR_SIZE,
-			(uint8_t *)t->buf + sec * VHD_SECTOR_SIZE,
-			VHD_SECTOR_SIZE);
-		if (ret) {
-			DPRINTF("crypto encrypt failed: %d : TERMINATED\n", ret);
-			exit(1); /* XXX */
-		}
+	int ret;
+
+	ret = xts_aes_plain_encrypt_sectors(tfm, t->sec,
+					    (uint8_t *)t->buf,
+					    (uint8_t *)orig_buf,
+					    t->secs, VHD_SECTOR_SIZE);
+	if (ret) {
+		DPRINTF("crypto encrypt failed: %d : TERMINATED\n", ret);
+		exit(1); /* XXX */
 	}
 }
 
+void
+vhd_crypto_encrypt(vhd_context_t *vhd, td_request_t *t, char *orig_buf)
+{
+	vhd_crypto_encrypt_with(vhd->xts_tfm, t, orig_buf);
+}
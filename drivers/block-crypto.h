@@ -34,3 +34,11 @@
 int vhd_open_crypto(vhd_context_t *vhd, struct td_vbd_encryption *encryption, const char *name);
 void vhd_crypto_encrypt(vhd_context_t *vhd, td_request_t *t, char *orig_buf);
 void vhd_crypto_decrypt(vhd_context_t *vhd, td_request_t *t);
+
+struct crypto_blkcipher;
+struct crypto_blkcipher *vhd_crypto_clone(vhd_context_t *vhd);
+void vhd_crypto_free(struct crypto_blkcipher *tfm);
+void vhd_crypto_encrypt_with(struct crypto_blkcipher *tfm, td_request_t *t, char *orig_buf);
+void vhd_crypto_decrypt_with(struct crypto_blkcipher *tfm, td_request_t *t);
+int vhd_crypto_encrypt_sectors_with(struct crypto_blkcipher *tfm, uint64_t sector,
+				    uint8_t *source, uint8_t *dst, unsigned int sectors);
@@ -35,6 +35,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <limits.h>
@@ -47,6 +48,10 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-readahead.h"
+#include "tapdisk-heat.h"
+#include "timeout-math.h"
 
 #define DEBUG 1
 
@@ -68,9 +73,22 @@
 #define TD_LCACHE_BUFSZ                 (MAX_SEGMENTS_PER_REQ * \
 					 sysconf(_SC_PAGE_SIZE))
 
+#define TD_LCACHE_RA_IOV_SECS           64 /* within TD_LCACHE_BUFSZ */
+#define TD_LCACHE_RA_IOVS               8
+#define TD_LCACHE_RA_REQUESTS           2
+
+#define TD_LCACHE_HEAT_SHIFT            12 /* 2 MiB, a VHD block */
+#define TD_LCACHE_HEAT_TICK             1  /* s */
+#define TD_LCACHE_HEAT_ADMIT            2  /* ticks read in */
+#define TD_LCACHE_HEAT_HALFLIFE         60 /* ticks */
+#define TD_LCACHE_DEMOTE_REQUESTS       4
+#define TD_LCACHE_DEMOTE_SCAN           4096 /* extents per tick */
+
 
 typedef struct lcache                   td_lcache_t;
 typedef struct lcache_request           td_lcache_req_t;
+typedef struct lcache_readahead         td_lcache_ra_t;
+typedef struct lcache_demote            td_lcache_demote_t;
 
 struct lcache_request {
 	char                           *buf;
@@ -78,6 +96,7 @@ struct lcache_request {
 
 	td_request_t                    treq;
 	int                             secs;
+	int                             admit;
 
 	td_vbd_request_t                vreq;
 	struct td_iovec                 iov;
@@ -85,6 +104,28 @@ struct lcache_request {
 	td_lcache_t                    *cache;
 };
 
+/*
+ * Readahead of sequential streams, through the VBD: what the leaf
+ * lacks comes down to us, and is read and stored like any other read.
+ * We recognize our requests by their token, one iovec per buffer.
+ */
+struct lcache_readahead {
+	td_vbd_request_t                vreq;
+	struct td_iovec                 iov[TD_LCACHE_RA_IOVS];
+	char                           *buf;
+	td_lcache_t                    *cache;
+};
+
+/*
+ * Cached extents gone cold are discarded from the leaf, reads of them
+ * come down to us again.
+ */
+struct lcache_demote {
+	td_vbd_request_t                vreq;
+	struct td_iovec                 iov;
+	td_lcache_t                    *cache;
+};
+
 struct lcache {
 	char                           *name;
 
@@ -97,6 +138,26 @@ struct lcache {
 
 	int                             wr_en;
 	struct timeval                  ts;
+
+	td_readahead_t                  ra;
+	td_lcache_ra_t                  rav[TD_LCACHE_RA_REQUESTS];
+	td_lcache_ra_t                 *ra_free[TD_LCACHE_RA_REQUESTS];
+	int                             ra_n_free;
+
+	/* admission by heat, 0 takes every read */
+	int                             admit;
+	td_heat_t                       heat;
+	event_id_t                      heat_event;
+	td_vbd_t                       *vbd;
+
+	int                             demote;
+	td_lcache_demote_t              dmv[TD_LCACHE_DEMOTE_REQUESTS];
+	td_lcache_demote_t             *dm_free[TD_LCACHE_DEMOTE_REQUESTS];
+	int                             dm_n_free;
+
+	uint64_t                        admitted;  /* sectors */
+	uint64_t                        rejected;  /* sectors */
+	uint64_t                        demoted;   /* sectors */
 };
 
 static td_lcache_req_t *
@@ -160,13 +221,156 @@ fail:
 	return err;
 }
 
+/*
+ * Heat: rather than storing every read which missed the leaf, only
+ * extents read in TAPDISK3_LCACHE_ADMIT ticks (TD_LCACHE_HEAT_ADMIT by
+ * default, 0 for every read) are, so one-off sequential reads do not
+ * churn the local SR. Readahead only runs on streams through hot
+ * extents, and is stored as they are.
+ *
+ * With TAPDISK3_LCACHE_DEMOTE=1, cached extents which cooled down to
+ * nothing are discarded from the leaf, making room for the working
+ * set. Only for leaves holding nothing but what we stored there.
+ */
+
+static int
+lcache_vbd_ready(td_vbd_t *vbd)
+{
+	return !td_flag_test(vbd->state, TD_VBD_DEAD |
+			     TD_VBD_CLOSED |
+			     TD_VBD_QUIESCE_REQUESTED |
+			     TD_VBD_QUIESCED |
+			     TD_VBD_PAUSE_REQUESTED |
+			     TD_VBD_PAUSED |
+			     TD_VBD_SHUTDOWN_REQUESTED);
+}
+
+static void
+__lcache_demote_cb(td_vbd_request_t *vreq, int error,
+		   void *token, int final)
+{
+	td_lcache_demote_t *dm = container_of(vreq, td_lcache_demote_t, vreq);
+	td_lcache_t *cache = token;
+
+	if (error == -EOPNOTSUPP) {
+		INFO("%s: leaf cannot discard, demotion off\n", cache->name);
+		cache->demote = 0;
+	} else if (!error)
+		cache->demoted += dm->iov.secs;
+
+	cache->dm_free[cache->dm_n_free++] = dm;
+}
+
+static void
+lcache_demote(td_lcache_t *cache)
+{
+	td_lcache_demote_t *dm;
+	td_vbd_request_t *vreq;
+	td_sector_t sec;
+	int secs, scan = TD_LCACHE_DEMOTE_SCAN;
+
+	if (!cache->vbd || !lcache_vbd_ready(cache->vbd))
+		return;
+
+	while (cache->demote && cache->dm_n_free &&
+	       tapdisk_heat_next_cold(&cache->heat, scan, &sec, &secs)) {
+		dm = cache->dm_free[--cache->dm_n_free];
+
+		dm->iov.base = NULL;
+		dm->iov.secs = secs;
+
+		vreq = &dm->vreq;
+		memset(vreq, 0, sizeof(*vreq));
+		vreq->op     = TD_OP_DISCARD;
+		vreq->sec    = sec;
+		vreq->iov    = &dm->iov;
+		vreq->iovcnt = 1;
+		vreq->prio   = TD_PRIO_BACKGROUND;
+		vreq->cb     = __lcache_demote_cb;
+		vreq->token  = cache;
+		vreq->name   = "lcache-demote";
+
+		if (tapdisk_vbd_queue_request(cache->vbd, vreq))
+			__lcache_demote_cb(vreq, -EIO, cache, 1);
+	}
+}
+
+static void
+lcache_heat_tick(event_id_t id, char mode, void *private)
+{
+	td_lcache_t *cache = private;
+
+	tapdisk_heat_tick(&cache->heat);
+	lcache_demote(cache);
+}
+
+static int
+lcache_heat_init(td_lcache_t *cache, td_sector_t size)
+{
+	int i, err, halflife;
+	const char *val;
+
+	val = getenv("TAPDISK3_LCACHE_ADMIT");
+	cache->admit = val ? atoi(val) : TD_LCACHE_HEAT_ADMIT;
+	if (cache->admit <= 0) {
+		cache->admit = 0;
+		return 0;
+	}
+
+	val = getenv("TAPDISK3_LCACHE_HALFLIFE");
+	halflife = val ? atoi(val) : TD_LCACHE_HEAT_HALFLIFE;
+
+	err = tapdisk_heat_init(&cache->heat, size, TD_LCACHE_HEAT_SHIFT,
+				halflife / TD_LCACHE_HEAT_TICK);
+	if (err)
+		return err;
+
+	val = getenv("TAPDISK3_LCACHE_DEMOTE");
+	cache->demote = val && atoi(val) > 0;
+
+	cache->dm_n_free = TD_LCACHE_DEMOTE_REQUESTS;
+	for (i = 0; i < TD_LCACHE_DEMOTE_REQUESTS; i++) {
+		cache->dmv[i].cache = cache;
+		cache->dm_free[i] = &cache->dmv[i];
+	}
+
+	cache->heat_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+				TV_SECS(TD_LCACHE_HEAT_TICK),
+				lcache_heat_tick, cache);
+	if (cache->heat_event < 0)
+		return cache->heat_event;
+
+	INFO("%s: admitting extents read in %d ticks, halflife %d s, "
+	     "demotion %s\n", cache->name, cache->admit, halflife,
+	     cache->demote ? "on" : "off");
+
+	return 0;
+}
+
 static int
 lcache_close(td_driver_t *driver)
 {
 	td_lcache_t *cache = driver->data;
+	int i;
 
 	lcache_destroy_buffers(cache);
 
+	for (i = 0; i < TD_LCACHE_RA_REQUESTS; i++)
+		free(cache->rav[i].buf);
+
+	if (cache->heat_event >= 0) {
+		tapdisk_server_unregister_event(cache->heat_event);
+		cache->heat_event = -1;
+	}
+
+	if (cache->admit)
+		INFO("%s: admitted %"PRIu64" rejected %"PRIu64
+		     " demoted %"PRIu64" sectors\n", cache->name,
+		     cache->admitted, cache->rejected, cache->demoted);
+
+	tapdisk_heat_free(&cache->heat);
+
 	free(cache->name);
 
 	return 0;
@@ -177,7 +381,9 @@ lcache_open(td_driver_t *driver, const char *name,
 	    struct td_vbd_encryption *encryption, td_flag_t flags)
 {
 	td_lcache_t *cache = driver->data;
-	int err;
+	int i, err;
+
+	cache->heat_event = -1;
 
 	err  = tapdisk_namedup(&cache->name, (char *)name);
 	if (err)
@@ -190,6 +396,19 @@ lcache_open(td_driver_t *driver, const char *name,
 	timerclear(&cache->ts);
 	cache->wr_en = 1;
 
+	tapdisk_readahead_init(&cache->ra, driver->info.size,
+			       TD_LCACHE_RA_IOV_SECS,
+			       TD_LCACHE_RA_IOV_SECS * TD_LCACHE_RA_IOVS);
+	cache->ra_n_free = TD_LCACHE_RA_REQUESTS;
+	for (i = 0; i < TD_LCACHE_RA_REQUESTS; i++) {
+		cache->rav[i].cache = cache;
+		cache->ra_free[i] = &cache->rav[i];
+	}
+
+	err = lcache_heat_init(cache, driver->info.size);
+	if (err)
+		goto fail;
+
 	return 0;
 
 fail:
@@ -281,6 +500,7 @@ lcache_store_read(td_lcache_t *cache, td_lcache_req_t *req)
 	vreq->sec    = req->treq.sec;
 	vreq->iov    = iov;
 	vreq->iovcnt = 1;
+	vreq->prio   = TD_PRIO_BACKGROUND;
 	vreq->cb     = __lcache_write_cb;
 	vreq->token  = cache;
 
@@ -300,11 +520,16 @@ lcache_complete_read(td_lcache_t *cache, td_lcache_req_t *req)
 
 	td_complete_request(req->treq, req->err);
 
-	if (unlikely(req->err) || !lcache_wr_enabled(cache)) {
+	if (unlikely(req->err) || !req->admit ||
+	    !lcache_wr_enabled(cache)) {
 		lcache_free_request(cache, req);
 		return;
 	}
 
+	if (cache->admit)
+		tapdisk_heat_set_cached(&cache->heat, req->treq.sec,
+					req->treq.secs);
+
 	lcache_store_read(cache, req);
 }
 
@@ -322,12 +547,107 @@ __lcache_read_cb(td_request_t treq, int err)
 		lcache_complete_read(cache, req);
 }
 
+static void
+__lcache_readahead_cb(td_vbd_request_t *vreq, int error,
+		      void *token, int final)
+{
+	td_lcache_ra_t *ra = container_of(vreq, td_lcache_ra_t, vreq);
+	td_lcache_t *cache = token;
+
+	cache->ra_free[cache->ra_n_free++] = ra;
+}
+
+/*
+ * Reads ahead of sequential streams, as long as there is room in the
+ * caching SR and requests to spare for the guest.
+ */
+static void
+lcache_readahead(td_lcache_t *cache, td_request_t treq, int admit)
+{
+	td_vbd_request_t *vreq;
+	td_lcache_ra_t *ra;
+	td_sector_t sec;
+	td_vbd_t *vbd;
+	int i, secs, limit;
+
+	vbd = treq.vreq->vbd;
+
+	if (!cache->ra_n_free || !lcache_vbd_ready(vbd))
+		return;
+
+	limit = cache->n_free - TD_LCACHE_MAX_REQ / 2;
+	if (limit <= 0 || !admit || !lcache_wr_enabled(cache))
+		limit = 0;
+	limit = MIN(limit, TD_LCACHE_RA_IOVS) * TD_LCACHE_RA_IOV_SECS;
+
+	secs = tapdisk_readahead_update(&cache->ra, vbd, treq.sec, treq.secs,
+					limit, &sec);
+	if (!secs)
+		return;
+
+	ra = cache->ra_free[--cache->ra_n_free];
+
+	if (!ra->buf) {
+		ra->buf = malloc(TD_LCACHE_RA_IOVS * TD_LCACHE_RA_IOV_SECS
+				 << SECTOR_SHIFT);
+		if (!ra->buf) {
+			cache->ra_free[cache->ra_n_free++] = ra;
+			return;
+		}
+	}
+
+	vreq = &ra->vreq;
+	memset(vreq, 0, sizeof(*vreq));
+
+	for (i = 0; secs > 0; i++) {
+		ra->iov[i].base = ra->buf + (i * TD_LCACHE_RA_IOV_SECS <<
+					     SECTOR_SHIFT);
+		ra->iov[i].secs = MIN(secs, TD_LCACHE_RA_IOV_SECS);
+		secs -= ra->iov[i].secs;
+	}
+
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = sec;
+	vreq->iov    = ra->iov;
+	vreq->iovcnt = i;
+	vreq->prio   = TD_PRIO_BACKGROUND;
+	vreq->cb     = __lcache_readahead_cb;
+	vreq->token  = cache;
+	vreq->name   = "lcache-readahead";
+
+	if (tapdisk_vbd_queue_request(vbd, vreq))
+		__lcache_readahead_cb(vreq, -EIO, cache, 1);
+}
+
 static void
 lcache_queue_read(td_driver_t *driver, td_request_t treq)
 {
 	td_lcache_t *cache = driver->data;
 	td_request_t clone;
 	td_lcache_req_t *req;
+	int admit = 1, guest;
+
+	guest = treq.vreq->token != cache;
+
+	if (cache->admit) {
+		int heat;
+
+		cache->vbd = treq.vreq->vbd;
+
+		heat = guest ?
+			tapdisk_heat_touch(&cache->heat, treq.sec, treq.secs) :
+			tapdisk_heat_peek(&cache->heat, treq.sec, treq.secs);
+		admit = heat >= cache->admit;
+
+		if (admit)
+			cache->admitted += treq.secs;
+		else
+			cache->rejected += treq.secs;
+	}
+
+	/* guest reads only, not our own readahead */
+	if (guest)
+		lcache_readahead(cache, treq, admit);
 
 	req = lcache_alloc_request(cache);
 	if (!req) {
@@ -340,6 +660,7 @@ lcache_queue_read(td_driver_t *driver, td_request_t treq)
 
 	req->secs    = req->treq.secs;
 	req->err     = 0;
+	req->admit   = admit;
 
 	clone         = treq;
 	clone.buf     = req->buf;
@@ -375,3 +696,1169 @@ struct tap_disk tapdisk_lcache = {
 	.td_get_parent_id           = lcache_get_parent_id,
 	.td_validate_parent         = lcache_validate_parent,
 };
+
+/*
+ * LWB: Local write-back cache
+ *      -- Persistent write caching in local storage, in front of the
+ *         leaf.
+ *
+ *    VBD
+ *      \
+ *       +--r/w--> lwb:/shared/leaf  (cache file in TD_WBCACHE_DIR)
+ *        \
+ *         +--r/w--> vhd:/shared/leaf
+ *          \
+ *           +--r/o--> vhd:/shared/parent
+ *
+ * Writes land in a preallocated cache file on local storage and are
+ * acknowledged once its index is synced. They are destaged to the
+ * leaf in the background, through the VBD, so pause and shutdown wait
+ * for them like for any other request.
+ *
+ * The cache is made of 64K slots, each caching one block of the disk
+ * with a per-sector valid mask. The index of slots is mapped from the
+ * head of the file and synced once per scheduler pass for all writes
+ * completing in it. Only dirty entries are trusted when the file is
+ * reopened, after a crash or not: clean slots hold data the leaf has
+ * too, so a slot is only reused once it is known clean on disk.
+ *
+ * Dirty slots are bounded to a share of the cache. Above it, writes
+ * to blocks not in the cache go straight to the leaf, and destaging
+ * runs at full depth until the cache is back below half of it.
+ */
+
+#define TD_WBCACHE_DIR                  "/var/lib/blktap/wbcache"
+#define TD_WBCACHE_SIZE                 4096 /* MiB */
+#define TD_WBCACHE_DIRTY_RATIO          50   /* % */
+
+#define TD_WBCACHE_MAGIC                0x6863616362776474ULL /* tdwbcach */
+#define TD_WBCACHE_VERSION              1
+
+#define TD_WBCACHE_SLOT_SHIFT           7
+#define TD_WBCACHE_SLOT_SECS            (1 << TD_WBCACHE_SLOT_SHIFT)
+#define TD_WBCACHE_SLOT_SIZE            (TD_WBCACHE_SLOT_SECS << SECTOR_SHIFT)
+
+#define TD_WBCACHE_MAX_IO               (TD_LCACHE_MAX_REQ * 4)
+#define TD_WBCACHE_DESTAGE_DEPTH        4
+#define TD_WBCACHE_RETRY_INTERVAL       1 /* s */
+
+typedef struct wbcache                  td_wbcache_t;
+typedef struct wbcache_request          td_wbcache_req_t;
+
+struct wbcache_header {
+	uint64_t                        magic;
+	uint32_t                        version;
+	uint32_t                        slot_secs;
+	uint64_t                        size;        /* sectors */
+	uint64_t                        slots;
+	uint64_t                        data_offset; /* bytes */
+};
+
+struct wbcache_entry {
+	uint64_t                        block;       /* + 1, 0 if unused */
+	uint64_t                        valid[TD_WBCACHE_SLOT_SECS / 64];
+	uint32_t                        dirty;
+	uint32_t                        pad;
+};
+
+struct wbcache_slot {
+	struct wbcache_entry           *entry;
+	uint64_t                        idx;
+	struct wbcache_slot            *hnext;
+
+	int                             readers;
+	int                             writers;
+	int                             destaging;
+	uint64_t                        gen;
+	uint64_t                        clean_at;
+};
+
+struct wbcache_request {
+	td_request_t                    treq;
+	int                             secs;
+	int                             err;
+	int                             cached;
+	td_wbcache_t                   *cache;
+	struct list_head                next;
+};
+
+struct wbcache_io {
+	struct tiocb                    tiocb;
+	td_wbcache_req_t               *req;
+	struct wbcache_slot            *slot;
+	td_sector_t                     sec;
+	int                             secs;
+	char                           *buf;
+	/* what the slot held when a read was issued */
+	struct wbcache_entry            held;
+};
+
+struct wbcache_destage {
+	td_wbcache_t                   *cache;
+	struct wbcache_slot            *slot;
+	uint64_t                        gen;
+	uint64_t                        valid[TD_WBCACHE_SLOT_SECS / 64];
+	int                             off;
+	int                             writing;
+	char                           *buf;
+	struct td_iovec                 iov;
+	td_vbd_request_t                vreq;
+};
+
+struct wbcache {
+	char                           *path;
+	int                             fd;
+	td_driver_t                    *driver;
+	td_vbd_t                       *vbd;
+
+	struct wbcache_header          *hdr;
+	struct wbcache_entry           *index;
+	size_t                          index_size;
+
+	struct wbcache_slot            *slots;
+	struct wbcache_slot           **hash;
+	uint64_t                        hmask;
+	uint64_t                        hand;
+
+	uint64_t                        dirty;
+	uint64_t                        max_dirty;
+
+	td_wbcache_req_t                reqv[TD_LCACHE_MAX_REQ];
+	td_wbcache_req_t               *free[TD_LCACHE_MAX_REQ];
+	int                             n_free;
+
+	struct wbcache_io               iov[TD_WBCACHE_MAX_IO];
+	struct wbcache_io              *free_io[TD_WBCACHE_MAX_IO];
+	int                             n_free_io;
+
+	/* writes waiting for the index to be synced */
+	struct list_head                commit;
+	event_id_t                      commit_event;
+	uint64_t                        seq;
+
+	struct wbcache_destage          destage[TD_WBCACHE_DESTAGE_DEPTH];
+	int                             destaging;
+	uint64_t                        cursor;
+	int                             stalled;
+	event_id_t                      timer;
+
+	struct {
+		unsigned long long      hits;
+		unsigned long long      through;
+		unsigned long long      destaged;
+		unsigned long long      syncs;
+	} st;
+};
+
+static void wbcache_kick(td_wbcache_t *cache);
+
+static inline int
+wbcache_valid(const struct wbcache_entry *e, int i)
+{
+	return !!(e->valid[i >> 6] & (1ULL << (i & 63)));
+}
+
+static struct wbcache_slot *
+wbcache_lookup(td_wbcache_t *cache, uint64_t block)
+{
+	struct wbcache_slot *slot;
+
+	for (slot = cache->hash[block & cache->hmask]; slot; slot = slot->hnext)
+		if (slot->entry->block == block + 1)
+			return slot;
+
+	return NULL;
+}
+
+static void
+wbcache_hash_add(td_wbcache_t *cache, struct wbcache_slot *slot)
+{
+	uint64_t h = (slot->entry->block - 1) & cache->hmask;
+
+	slot->hnext    = cache->hash[h];
+	cache->hash[h] = slot;
+}
+
+static void
+wbcache_hash_del(td_wbcache_t *cache, struct wbcache_slot *slot)
+{
+	struct wbcache_slot **p;
+
+	p = &cache->hash[(slot->entry->block - 1) & cache->hmask];
+	while (*p != slot)
+		p = &(*p)->hnext;
+
+	*p = slot->hnext;
+}
+
+/*
+ * Clock sweep for a slot which is unused, or clean on disk and idle.
+ */
+static struct wbcache_slot *
+wbcache_slot_alloc(td_wbcache_t *cache, uint64_t block)
+{
+	struct wbcache_slot *slot;
+	uint64_t n;
+
+	for (n = 0; n < cache->hdr->slots; n++) {
+		slot = &cache->slots[cache->hand];
+		cache->hand = (cache->hand + 1) % cache->hdr->slots;
+
+		if (!slot->entry->block)
+			goto found;
+
+		if (slot->entry->dirty || slot->readers || slot->writers ||
+		    slot->destaging || slot->clean_at > cache->seq)
+			continue;
+
+		wbcache_hash_del(cache, slot);
+		goto found;
+	}
+
+	return NULL;
+
+found:
+	memset(slot->entry, 0, sizeof(*slot->entry));
+	slot->entry->block = block + 1;
+	slot->gen = 0;
+	wbcache_hash_add(cache, slot);
+	return slot;
+}
+
+static td_wbcache_req_t *
+wbcache_alloc_request(td_wbcache_t *cache)
+{
+	td_wbcache_req_t *req = NULL;
+
+	if (likely(cache->n_free))
+		req = cache->free[--cache->n_free];
+
+	return req;
+}
+
+static void
+wbcache_free_request(td_wbcache_t *cache, td_wbcache_req_t *req)
+{
+	BUG_ON(cache->n_free >= TD_LCACHE_MAX_REQ);
+	cache->free[cache->n_free++] = req;
+}
+
+static struct wbcache_io *
+wbcache_alloc_io(td_wbcache_t *cache)
+{
+	struct wbcache_io *io = NULL;
+
+	if (likely(cache->n_free_io))
+		io = cache->free_io[--cache->n_free_io];
+
+	return io;
+}
+
+static void
+wbcache_free_io(td_wbcache_t *cache, struct wbcache_io *io)
+{
+	BUG_ON(cache->n_free_io >= TD_WBCACHE_MAX_IO);
+	cache->free_io[cache->n_free_io++] = io;
+}
+
+static inline long long
+wbcache_offset(td_wbcache_t *cache, struct wbcache_slot *slot, td_sector_t sec)
+{
+	return cache->hdr->data_offset + slot->idx * TD_WBCACHE_SLOT_SIZE +
+		((sec & (TD_WBCACHE_SLOT_SECS - 1)) << SECTOR_SHIFT);
+}
+
+/* -- commit -- */
+
+/*
+ * Group commit: one sync of the index for all writes which completed
+ * in the last scheduler pass.
+ */
+static void
+wbcache_commit(event_id_t id, char mode, void *private)
+{
+	td_wbcache_t *cache = private;
+	td_wbcache_req_t *req, *next;
+	struct list_head list;
+	int err = 0;
+
+	tapdisk_server_unregister_event(cache->commit_event);
+	cache->commit_event = -1;
+
+	if (msync(cache->hdr, cache->index_size, MS_SYNC)) {
+		err = -errno;
+		WARN("%s: index sync failed: %d", cache->path, err);
+	} else {
+		cache->seq++;
+		cache->st.syncs++;
+	}
+
+	INIT_LIST_HEAD(&list);
+	list_splice(&cache->commit, &list);
+	INIT_LIST_HEAD(&cache->commit);
+
+	list_for_each_entry_safe(req, next, &list, next) {
+		list_del(&req->next);
+		td_complete_request(req->treq, err);
+		wbcache_free_request(cache, req);
+	}
+
+	wbcache_kick(cache);
+}
+
+static void
+wbcache_schedule_commit(td_wbcache_t *cache)
+{
+	if (cache->commit_event >= 0)
+		return;
+
+	cache->commit_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					      -1, TV_ZERO,
+					      wbcache_commit, cache);
+	if (cache->commit_event < 0)
+		wbcache_commit(-1, 0, cache);
+}
+
+static void
+wbcache_request_end(td_wbcache_req_t *req, int secs, int err)
+{
+	td_wbcache_t *cache = req->cache;
+
+	BUG_ON(req->secs < secs);
+	req->secs -= secs;
+	req->err   = req->err ? : err;
+
+	if (req->secs)
+		return;
+
+	if (req->cached && !req->err) {
+		list_add_tail(&req->next, &cache->commit);
+		wbcache_schedule_commit(cache);
+		return;
+	}
+
+	td_complete_request(req->treq, req->err);
+	wbcache_free_request(cache, req);
+}
+
+static void
+__wbcache_forward_cb(td_request_t treq, int err)
+{
+	wbcache_request_end(treq.cb_data, treq.secs, err);
+}
+
+static void
+wbcache_forward(td_wbcache_req_t *req, td_sector_t sec, int secs, char *buf)
+{
+	td_request_t clone;
+
+	if (!secs)
+		return;
+
+	clone         = req->treq;
+	clone.sec     = sec;
+	clone.secs    = secs;
+	clone.buf     = buf;
+	clone.cb      = __wbcache_forward_cb;
+	clone.cb_data = req;
+
+	td_forward_request(clone);
+}
+
+/* -- reads -- */
+
+/*
+ * Forwards the sectors in [first, last) of the segment the slot does not
+ * hold.
+ */
+static void
+wbcache_forward_holes(td_wbcache_req_t *req, const struct wbcache_entry *e,
+		      td_sector_t sec, char *buf, int first, int last)
+{
+	int i, start = -1, off = sec & (TD_WBCACHE_SLOT_SECS - 1);
+
+	for (i = first; i <= last; i++) {
+		if (i < last && !wbcache_valid(e, off + i)) {
+			if (start < 0)
+				start = i;
+			continue;
+		}
+
+		if (start >= 0) {
+			wbcache_forward(req, sec + start, i - start,
+					buf + (start << SECTOR_SHIFT));
+			start = -1;
+		}
+	}
+}
+
+static void
+__wbcache_read_cb(void *arg, struct tiocb *tiocb, int err)
+{
+	struct wbcache_io *io = arg;
+	td_wbcache_req_t *req = io->req;
+	td_wbcache_t *cache = req->cache;
+	int i, valid = 0, off = io->sec & (TD_WBCACHE_SLOT_SECS - 1);
+
+	io->slot->readers--;
+
+	if (!err) {
+		for (i = 0; i < io->secs; i++)
+			valid += wbcache_valid(&io->held, off + i);
+
+		/* holes inside the span were read too, now overwrite them */
+		wbcache_forward_holes(req, &io->held, io->sec, io->buf,
+				      0, io->secs);
+		wbcache_request_end(req, valid, 0);
+	} else
+		wbcache_request_end(req, io->secs, err);
+
+	wbcache_free_io(cache, io);
+}
+
+static void
+wbcache_read_segment(td_wbcache_t *cache, td_wbcache_req_t *req,
+		     td_sector_t sec, int secs, char *buf)
+{
+	struct wbcache_slot *slot;
+	struct wbcache_io *io;
+	int i, first = -1, last = -1, off;
+
+	slot = wbcache_lookup(cache, sec >> TD_WBCACHE_SLOT_SHIFT);
+	if (!slot) {
+		wbcache_forward(req, sec, secs, buf);
+		return;
+	}
+
+	off = sec & (TD_WBCACHE_SLOT_SECS - 1);
+	for (i = 0; i < secs; i++)
+		if (wbcache_valid(slot->entry, off + i)) {
+			if (first < 0)
+				first = i;
+			last = i + 1;
+		}
+
+	if (first < 0) {
+		wbcache_forward(req, sec, secs, buf);
+		return;
+	}
+
+	wbcache_forward(req, sec, first, buf);
+	wbcache_forward(req, sec + last, secs - last,
+			buf + (last << SECTOR_SHIFT));
+
+	io = wbcache_alloc_io(cache);
+	if (!io) {
+		wbcache_request_end(req, last - first, -EBUSY);
+		return;
+	}
+
+	io->req  = req;
+	io->slot = slot;
+	io->sec  = sec + first;
+	io->secs = last - first;
+	io->buf  = buf + (first << SECTOR_SHIFT);
+	io->held = *slot->entry;
+
+	slot->readers++;
+	cache->st.hits++;
+
+	td_prep_read(&io->tiocb, cache->fd, io->buf,
+		     io->secs << SECTOR_SHIFT,
+		     wbcache_offset(cache, slot, io->sec),
+		     __wbcache_read_cb, io);
+	td_queue_tiocb(cache->driver, &io->tiocb);
+}
+
+/* -- writes -- */
+
+static void
+__wbcache_write_cb(void *arg, struct tiocb *tiocb, int err)
+{
+	struct wbcache_io *io = arg;
+	td_wbcache_req_t *req = io->req;
+	td_wbcache_t *cache = req->cache;
+	struct wbcache_slot *slot = io->slot;
+	int i, off = io->sec & (TD_WBCACHE_SLOT_SECS - 1);
+
+	slot->writers--;
+
+	if (!err) {
+		for (i = off; i < off + io->secs; i++)
+			slot->entry->valid[i >> 6] |= 1ULL << (i & 63);
+
+		if (!slot->entry->dirty) {
+			slot->entry->dirty = 1;
+			cache->dirty++;
+		}
+
+		slot->gen++;
+		req->cached = 1;
+	}
+
+	wbcache_request_end(req, io->secs, err);
+	wbcache_free_io(cache, io);
+}
+
+static void
+wbcache_write_segment(td_wbcache_t *cache, td_wbcache_req_t *req,
+		      td_sector_t sec, int secs, char *buf)
+{
+	struct wbcache_slot *slot;
+	struct wbcache_io *io;
+	uint64_t block = sec >> TD_WBCACHE_SLOT_SHIFT;
+
+	slot = wbcache_lookup(cache, block);
+	if (!slot && cache->dirty < cache->max_dirty)
+		slot = wbcache_slot_alloc(cache, block);
+
+	if (!slot) {
+		/* nothing of this block is cached, the leaf is current */
+		cache->st.through++;
+		wbcache_forward(req, sec, secs, buf);
+		return;
+	}
+
+	io = wbcache_alloc_io(cache);
+	if (!io) {
+		wbcache_request_end(req, secs, -EBUSY);
+		return;
+	}
+
+	io->req  = req;
+	io->slot = slot;
+	io->sec  = sec;
+	io->secs = secs;
+	io->buf  = buf;
+
+	slot->writers++;
+
+	td_prep_write(&io->tiocb, cache->fd, buf, secs << SECTOR_SHIFT,
+		      wbcache_offset(cache, slot, sec),
+		      __wbcache_write_cb, io);
+	td_queue_tiocb(cache->driver, &io->tiocb);
+}
+
+static void
+wbcache_queue_request(td_wbcache_t *cache, td_request_t treq,
+		      void (*segment)(td_wbcache_t *, td_wbcache_req_t *,
+				      td_sector_t, int, char *))
+{
+	td_wbcache_req_t *req;
+	td_sector_t sec, end;
+	char *buf;
+	int secs;
+
+	req = wbcache_alloc_request(cache);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	req->treq   = treq;
+	req->cache  = cache;
+	req->secs   = treq.secs;
+	req->err    = 0;
+	req->cached = 0;
+
+	if (!cache->vbd)
+		cache->vbd = treq.vreq->vbd;
+
+	/*
+	 * Segments may complete synchronously, hold the request until
+	 * all are issued.
+	 */
+	req->secs++;
+
+	sec = treq.sec;
+	end = treq.sec + treq.secs;
+	buf = treq.buf;
+
+	while (sec < end) {
+		secs = MIN(end - sec, TD_WBCACHE_SLOT_SECS -
+			   (sec & (TD_WBCACHE_SLOT_SECS - 1)));
+		segment(cache, req, sec, secs, buf);
+		sec += secs;
+		buf += secs << SECTOR_SHIFT;
+	}
+
+	wbcache_request_end(req, 1, 0);
+}
+
+/* -- destage -- */
+
+static int
+wbcache_vbd_ready(td_wbcache_t *cache)
+{
+	return cache->vbd &&
+		!td_flag_test(cache->vbd->state, TD_VBD_DEAD |
+			      TD_VBD_CLOSED |
+			      TD_VBD_QUIESCE_REQUESTED |
+			      TD_VBD_QUIESCED |
+			      TD_VBD_PAUSE_REQUESTED |
+			      TD_VBD_PAUSED |
+			      TD_VBD_SHUTDOWN_REQUESTED);
+}
+
+static void
+wbcache_destage_end(struct wbcache_destage *d, int err)
+{
+	td_wbcache_t *cache = d->cache;
+	struct wbcache_slot *slot = d->slot;
+
+	slot->destaging = 0;
+	d->slot = NULL;
+	cache->destaging--;
+
+	/* the VBD is going away, the slot stays dirty */
+	if (err == -EAGAIN)
+		return;
+
+	if (err) {
+		WARN("%s: destaging block %"PRIu64" failed: %d",
+		     cache->path, slot->entry->block - 1, err);
+		cache->stalled = 1;
+		return;
+	}
+
+	/* rewritten meanwhile, goes again */
+	if (slot->gen == d->gen) {
+		slot->entry->dirty = 0;
+		slot->clean_at = cache->seq + 1;
+		cache->dirty--;
+		cache->st.destaged++;
+		wbcache_schedule_commit(cache);
+	}
+
+	wbcache_kick(cache);
+}
+
+static void wbcache_destage_run(struct wbcache_destage *d);
+
+static void
+__wbcache_destage_cb(td_vbd_request_t *vreq, int err, void *token, int final)
+{
+	struct wbcache_destage *d = container_of(vreq, struct wbcache_destage,
+						 vreq);
+
+	if (err) {
+		wbcache_destage_end(d, err);
+		return;
+	}
+
+	if (!d->writing) {
+		d->writing = 1;
+		vreq->op = TD_OP_WRITE;
+	} else {
+		d->writing = 0;
+		d->off += d->iov.secs;
+		vreq = NULL;
+	}
+
+	if (vreq) {
+		if (!wbcache_vbd_ready(d->cache)) {
+			wbcache_destage_end(d, -EAGAIN);
+			return;
+		}
+
+		err = tapdisk_vbd_queue_request(d->cache->vbd, vreq);
+		if (err)
+			wbcache_destage_end(d, err);
+		return;
+	}
+
+	wbcache_destage_run(d);
+}
+
+/*
+ * Copies the next run of valid sectors: read through the VBD, which
+ * ends up in the cache, then written through the VBD, which the cache
+ * recognizes by the token and forwards to the leaf.
+ */
+static void
+wbcache_destage_run(struct wbcache_destage *d)
+{
+	td_wbcache_t *cache = d->cache;
+	td_vbd_request_t *vreq = &d->vreq;
+	int i, off = d->off;
+	uint64_t block;
+	td_sector_t sec;
+	int err;
+
+#define __valid(_i) (!!(d->valid[(_i) >> 6] & (1ULL << ((_i) & 63))))
+	while (off < TD_WBCACHE_SLOT_SECS && !__valid(off))
+		off++;
+
+	if (off == TD_WBCACHE_SLOT_SECS) {
+		wbcache_destage_end(d, 0);
+		return;
+	}
+
+	if (!wbcache_vbd_ready(cache)) {
+		wbcache_destage_end(d, -EAGAIN);
+		return;
+	}
+
+	for (i = off; i < TD_WBCACHE_SLOT_SECS && __valid(i); i++)
+		;
+#undef __valid
+
+	block = d->slot->entry->block - 1;
+	sec   = (block << TD_WBCACHE_SLOT_SHIFT) + off;
+
+	d->off      = off;
+	d->iov.base = d->buf + (off << SECTOR_SHIFT);
+	d->iov.secs = i - off;
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = sec;
+	vreq->iov    = &d->iov;
+	vreq->iovcnt = 1;
+	vreq->cb     = __wbcache_destage_cb;
+	vreq->token  = cache;
+	vreq->name   = "wbcache-destage";
+
+	err = tapdisk_vbd_queue_request(cache->vbd, vreq);
+	if (err)
+		wbcache_destage_end(d, err);
+}
+
+static void
+wbcache_destage_start(td_wbcache_t *cache, struct wbcache_destage *d,
+		      struct wbcache_slot *slot)
+{
+	d->cache   = cache;
+	d->slot    = slot;
+	d->gen     = slot->gen;
+	d->off     = 0;
+	d->writing = 0;
+	memcpy(d->valid, slot->entry->valid, sizeof(d->valid));
+
+	slot->destaging = 1;
+	cache->destaging++;
+
+	wbcache_destage_run(d);
+}
+
+static struct wbcache_slot *
+wbcache_next_dirty(td_wbcache_t *cache)
+{
+	struct wbcache_slot *slot;
+	uint64_t n;
+
+	for (n = 0; n < cache->hdr->slots; n++) {
+		slot = &cache->slots[cache->cursor];
+		cache->cursor = (cache->cursor + 1) % cache->hdr->slots;
+
+		if (slot->entry->block && slot->entry->dirty &&
+		    !slot->destaging)
+			return slot;
+	}
+
+	return NULL;
+}
+
+static void
+wbcache_kick(td_wbcache_t *cache)
+{
+	struct wbcache_slot *slot;
+	int i, depth;
+
+	if (cache->stalled || !cache->dirty || !wbcache_vbd_ready(cache))
+		return;
+
+	depth = cache->dirty > cache->max_dirty / 2 ?
+		TD_WBCACHE_DESTAGE_DEPTH : 1;
+
+	for (i = 0; i < TD_WBCACHE_DESTAGE_DEPTH; i++) {
+		if (cache->destaging >= depth)
+			break;
+
+		if (cache->destage[i].slot)
+			continue;
+
+		slot = wbcache_next_dirty(cache);
+		if (!slot)
+			break;
+
+		wbcache_destage_start(cache, &cache->destage[i], slot);
+	}
+}
+
+static void
+wbcache_timer(event_id_t id, char mode, void *private)
+{
+	td_wbcache_t *cache = private;
+
+	cache->stalled = 0;
+	wbcache_kick(cache);
+}
+
+/* -- driver -- */
+
+static char *
+wbcache_path(const char *name)
+{
+	const char *dir;
+	char *path, *p;
+
+	dir = getenv("TAPDISK3_WBCACHE_DIR") ? : TD_WBCACHE_DIR;
+
+	if (asprintf(&path, "%s/%s.wbc", dir, name) < 0)
+		return NULL;
+
+	for (p = path + strlen(dir) + 1; *p; p++)
+		if (*p == '/')
+			*p = '_';
+
+	return path;
+}
+
+static unsigned long
+wbcache_env(const char *name, unsigned long def)
+{
+	const char *s = getenv(name);
+
+	return s ? strtoul(s, NULL, 0) : def;
+}
+
+static int
+wbcache_index_init(td_wbcache_t *cache, td_sector_t size, uint64_t slots)
+{
+	struct wbcache_header *hdr = cache->hdr;
+
+	memset(hdr, 0, cache->index_size);
+	hdr->magic       = TD_WBCACHE_MAGIC;
+	hdr->version     = TD_WBCACHE_VERSION;
+	hdr->slot_secs   = TD_WBCACHE_SLOT_SECS;
+	hdr->size        = size;
+	hdr->slots       = slots;
+	hdr->data_offset = cache->index_size;
+
+	if (msync(hdr, cache->index_size, MS_SYNC))
+		return -errno;
+
+	return 0;
+}
+
+static size_t
+wbcache_index_size(uint64_t slots)
+{
+	size_t sz = sizeof(struct wbcache_header) +
+		slots * sizeof(struct wbcache_entry);
+
+	return (sz + 4095) & ~4095UL;
+}
+
+/*
+ * Maps the index of an existing cache file, or sets up a new one. A
+ * file which does not match the disk is only thrown away if it holds
+ * nothing the leaf is missing.
+ */
+static int
+wbcache_map(td_wbcache_t *cache, td_sector_t size)
+{
+	struct wbcache_header hdr;
+	uint64_t i, slots;
+	struct stat st;
+	ssize_t n;
+	int err, reuse;
+
+	slots = ((uint64_t)wbcache_env("TAPDISK3_WBCACHE_SIZE",
+				       TD_WBCACHE_SIZE) << 20) /
+		TD_WBCACHE_SLOT_SIZE;
+	if (!slots)
+		return -EINVAL;
+
+	if (fstat(cache->fd, &st))
+		return -errno;
+
+	reuse = 0;
+	memset(&hdr, 0, sizeof(hdr));
+
+	if (st.st_size >= sizeof(hdr)) {
+		n = pread(cache->fd, &hdr, sizeof(hdr), 0);
+		if (n != sizeof(hdr))
+			return n < 0 ? -errno : -EIO;
+
+		reuse = hdr.magic == TD_WBCACHE_MAGIC &&
+			hdr.version == TD_WBCACHE_VERSION &&
+			hdr.slot_secs == TD_WBCACHE_SLOT_SECS &&
+			hdr.slots &&
+			hdr.data_offset == wbcache_index_size(hdr.slots) &&
+			st.st_size >= hdr.data_offset +
+				hdr.slots * TD_WBCACHE_SLOT_SIZE;
+		if (reuse)
+			slots = hdr.slots;
+	}
+
+	cache->index_size = wbcache_index_size(slots);
+
+	if (!reuse) {
+		if (ftruncate(cache->fd, 0) ||
+		    ftruncate(cache->fd, cache->index_size +
+			      slots * TD_WBCACHE_SLOT_SIZE))
+			return -errno;
+
+		/* so that writing the cache never runs out of space */
+		err = posix_fallocate(cache->fd, 0, cache->index_size +
+				      slots * TD_WBCACHE_SLOT_SIZE);
+		if (err && err != EOPNOTSUPP)
+			return -err;
+	}
+
+	cache->hdr = mmap(NULL, cache->index_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, cache->fd, 0);
+	if (cache->hdr == MAP_FAILED) {
+		cache->hdr = NULL;
+		return -errno;
+	}
+
+	cache->index = (struct wbcache_entry *)(cache->hdr + 1);
+
+	if (reuse && hdr.size != size) {
+		for (i = 0; i < slots; i++)
+			if (cache->index[i].block && cache->index[i].dirty) {
+				WARN("%s: dirty cache for a disk of %"PRIu64
+				     " sectors, not %"PRIu64, cache->path,
+				     hdr.size, size);
+				return -EINVAL;
+			}
+		reuse = 0;
+	}
+
+	if (!reuse)
+		return wbcache_index_init(cache, size, slots);
+
+	return 0;
+}
+
+static int
+wbcache_load(td_wbcache_t *cache)
+{
+	struct wbcache_entry *e;
+	uint64_t i, slots, hsize;
+
+	slots = cache->hdr->slots;
+
+	cache->slots = calloc(slots, sizeof(*cache->slots));
+	if (!cache->slots)
+		return -ENOMEM;
+
+	for (hsize = 1; hsize < slots; hsize <<= 1)
+		;
+
+	cache->hash = calloc(hsize, sizeof(*cache->hash));
+	if (!cache->hash)
+		return -ENOMEM;
+	cache->hmask = hsize - 1;
+
+	for (i = 0; i < slots; i++) {
+		e = &cache->index[i];
+
+		cache->slots[i].entry = e;
+		cache->slots[i].idx   = i;
+
+		/* clean entries are stale by the time we look at them */
+		if (!e->dirty ||
+		    e->block - 1 >= cache->hdr->size >> TD_WBCACHE_SLOT_SHIFT) {
+			memset(e, 0, sizeof(*e));
+			continue;
+		}
+
+		wbcache_hash_add(cache, &cache->slots[i]);
+		cache->dirty++;
+	}
+
+	cache->max_dirty = slots *
+		MIN(wbcache_env("TAPDISK3_WBCACHE_DIRTY_RATIO",
+				TD_WBCACHE_DIRTY_RATIO), 100) / 100;
+	if (!cache->max_dirty)
+		cache->max_dirty = 1;
+
+	INFO("%s: %"PRIu64" slots, %"PRIu64" dirty, at most %"PRIu64,
+	     cache->path, slots, cache->dirty, cache->max_dirty);
+
+	return 0;
+}
+
+static int
+wbcache_close(td_driver_t *driver)
+{
+	td_wbcache_t *cache = driver->data;
+	int i;
+
+	BUG_ON(cache->destaging);
+
+	/* no more destaging */
+	cache->vbd = NULL;
+
+	if (cache->timer >= 0) {
+		tapdisk_server_unregister_event(cache->timer);
+		cache->timer = -1;
+	}
+
+	if (cache->commit_event >= 0)
+		wbcache_commit(cache->commit_event, 0, cache);
+
+	if (cache->hdr) {
+		if (cache->dirty)
+			INFO("%s: closing with %"PRIu64" dirty slots",
+			     cache->path, cache->dirty);
+		msync(cache->hdr, cache->index_size, MS_SYNC);
+		munmap(cache->hdr, cache->index_size);
+		cache->hdr = NULL;
+	}
+
+	if (cache->fd >= 0) {
+		close(cache->fd);
+		cache->fd = -1;
+	}
+
+	for (i = 0; i < TD_WBCACHE_DESTAGE_DEPTH; i++) {
+		free(cache->destage[i].buf);
+		cache->destage[i].buf = NULL;
+	}
+
+	free(cache->hash);
+	cache->hash = NULL;
+	free(cache->slots);
+	cache->slots = NULL;
+	free(cache->path);
+	cache->path = NULL;
+
+	return 0;
+}
+
+static int
+wbcache_open(td_driver_t *driver, const char *name,
+	     struct td_vbd_encryption *encryption, td_flag_t flags)
+{
+	td_wbcache_t *cache = driver->data;
+	int i, err;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->fd           = -1;
+	cache->timer        = -1;
+	cache->commit_event = -1;
+	cache->driver       = driver;
+	INIT_LIST_HEAD(&cache->commit);
+
+	for (i = 0; i < TD_LCACHE_MAX_REQ; i++)
+		wbcache_free_request(cache, &cache->reqv[i]);
+
+	for (i = 0; i < TD_WBCACHE_MAX_IO; i++)
+		wbcache_free_io(cache, &cache->iov[i]);
+
+	cache->path = wbcache_path(name);
+	if (!cache->path) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = tapdisk_mkdir_parents(cache->path);
+	if (err)
+		goto fail;
+
+	cache->fd = open(cache->path,
+			 O_RDWR | O_CREAT | O_DIRECT | O_LARGEFILE, 0600);
+	if (cache->fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = wbcache_map(cache, driver->info.size);
+	if (err)
+		goto fail;
+
+	err = wbcache_load(cache);
+	if (err)
+		goto fail;
+
+	for (i = 0; i < TD_WBCACHE_DESTAGE_DEPTH; i++) {
+		err = posix_memalign((void **)&cache->destage[i].buf, 4096,
+				     TD_WBCACHE_SLOT_SIZE);
+		if (err) {
+			cache->destage[i].buf = NULL;
+			err = -err;
+			goto fail;
+		}
+	}
+
+	cache->timer = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+			-1, TV_SECS(TD_WBCACHE_RETRY_INTERVAL),
+			wbcache_timer, cache);
+	if (cache->timer < 0) {
+		err = cache->timer;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	EPRINTF("%s: cannot open write-back cache: %d",
+		cache->path ? : name, err);
+	wbcache_close(driver);
+	return err;
+}
+
+static void
+wbcache_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	td_wbcache_t *cache = driver->data;
+
+	wbcache_queue_request(cache, treq, wbcache_read_segment);
+}
+
+static void
+wbcache_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	td_wbcache_t *cache = driver->data;
+
+	/* our own destaging */
+	if (treq.vreq->token == cache) {
+		td_forward_request(treq);
+		return;
+	}
+
+	wbcache_queue_request(cache, treq, wbcache_write_segment);
+}
+
+static int
+wbcache_validate_parent(td_driver_t *driver,
+			td_driver_t *pdriver, td_flag_t flags)
+{
+	return 0;
+}
+
+static void
+wbcache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_wbcache_t *cache = driver->data;
+
+	tapdisk_stats_field(st, "slots", "llu",
+			    (unsigned long long)cache->hdr->slots);
+	tapdisk_stats_field(st, "dirty", "llu",
+			    (unsigned long long)cache->dirty);
+	tapdisk_stats_field(st, "max_dirty", "llu",
+			    (unsigned long long)cache->max_dirty);
+	tapdisk_stats_field(st, "hits", "llu", cache->st.hits);
+	tapdisk_stats_field(st, "write_through", "llu", cache->st.through);
+	tapdisk_stats_field(st, "destaged", "llu", cache->st.destaged);
+	tapdisk_stats_field(st, "syncs", "llu", cache->st.syncs);
+}
+
+struct tap_disk tapdisk_wbcache = {
+	.disk_type                  = "tapdisk_wbcache",
+	.flags                      = 0,
+	.private_data_size          = sizeof(td_wbcache_t),
+	.td_open                    = wbcache_open,
+	.td_close                   = wbcache_close,
+	.td_queue_read              = wbcache_queue_read,
+	.td_queue_write             = wbcache_queue_write,
+	.td_get_parent_id           = lcache_get_parent_id,
+	.td_validate_parent         = wbcache_validate_parent,
+	.td_stats                   = wbcache_stats,
+};
@@ -33,12 +33,15 @@
 #endif
 
 #include <errno.h>
+#include <stdlib.h>
 
 #include "tapdisk.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
+#include "tapdisk-server.h"
+#include "timeout-math.h"
 
 #define DBG(_f, _a...)  tlog_syslog(TLOG_DBG, _f, ##_a)
 #define INFO(_f, _a...) tlog_syslog(TLOG_INFO, _f, ##_a)
@@ -66,6 +69,232 @@ void ll_log_switch(int type, int error,
 	     tapdisk_disk_types[shared->type]->name, shared->name);
 }
 
+/*
+ * WC: Write combining for the local cache.
+ *
+ * Small writes to the local cache which follow each other on disk are
+ * collected for as long as the current scheduler pass lasts, then
+ * issued as one. Guests tend to submit sequential runs of small
+ * writes in one batch, and the cache device takes them far better
+ * as one large write than many small ones.
+ *
+ * The combined write completes all of its parts, in the order they
+ * were queued, and with its own status. A write which cannot join
+ * the open buffer closes it first, so nothing is reordered against
+ * it. Reads of a range still being collected flush it before they
+ * go out.
+ */
+#define LL_WC_NR_BUFS       8
+#define LL_WC_MAX_SECS      256
+#define LL_WC_MAX_PARTS     32
+/* only writes up to this size are worth combining */
+#define LL_WC_SMALL_SECS    64
+
+typedef void (*ll_wc_submit_t)(void *arg, td_request_t treq);
+
+struct ll_wc_buf {
+	int                     busy;
+	char                   *buf;
+	td_sector_t             sec;
+	int                     secs;
+	td_request_t            parts[LL_WC_MAX_PARTS];
+	int                     n_parts;
+};
+
+struct ll_wc {
+	struct ll_wc_buf        bufv[LL_WC_NR_BUFS];
+	struct ll_wc_buf       *open;
+	event_id_t              event;
+
+	ll_wc_submit_t          submit;
+	void                   *arg;
+};
+
+static void
+ll_wc_done(td_request_t treq, int error)
+{
+	struct ll_wc_buf *b = treq.cb_data;
+	int i;
+
+	for (i = 0; i < b->n_parts; i++)
+		td_complete_request(b->parts[i], error);
+
+	b->busy = 0;
+}
+
+/*
+ * Parts sitting next to each other in memory need no copy. Those which
+ * do not are gathered into the buffer.
+ */
+static char *
+ll_wc_gather(struct ll_wc_buf *b)
+{
+	char *p = b->parts[0].buf;
+	int i;
+
+	for (i = 1; i < b->n_parts; i++) {
+		p += b->parts[i - 1].secs << SECTOR_SHIFT;
+		if (b->parts[i].buf != p)
+			break;
+	}
+
+	if (i == b->n_parts)
+		return b->parts[0].buf;
+
+	p = b->buf;
+	for (i = 0; i < b->n_parts; i++) {
+		memcpy(p, b->parts[i].buf, b->parts[i].secs << SECTOR_SHIFT);
+		p += b->parts[i].secs << SECTOR_SHIFT;
+	}
+
+	return b->buf;
+}
+
+static void
+ll_wc_flush(struct ll_wc *wc)
+{
+	struct ll_wc_buf *b = wc->open;
+	td_request_t treq;
+
+	if (!b)
+		return;
+
+	wc->open = NULL;
+
+	if (b->n_parts == 1) {
+		b->busy = 0;
+		wc->submit(wc->arg, b->parts[0]);
+		return;
+	}
+
+	treq         = b->parts[0];
+	treq.buf     = ll_wc_gather(b);
+	treq.sec     = b->sec;
+	treq.secs    = b->secs;
+	treq.cb      = ll_wc_done;
+	treq.cb_data = b;
+
+	wc->submit(wc->arg, treq);
+}
+
+static void
+ll_wc_event(event_id_t id, char mode, void *private)
+{
+	struct ll_wc *wc = private;
+
+	tapdisk_server_unregister_event(wc->event);
+	wc->event = -1;
+
+	ll_wc_flush(wc);
+}
+
+static struct ll_wc_buf *
+ll_wc_get_buf(struct ll_wc *wc)
+{
+	int i;
+
+	for (i = 0; i < LL_WC_NR_BUFS; i++)
+		if (!wc->bufv[i].busy)
+			return &wc->bufv[i];
+
+	return NULL;
+}
+
+static void
+ll_wc_write(struct ll_wc *wc, td_request_t treq)
+{
+	struct ll_wc_buf *b = wc->open;
+
+	if (treq.op != TD_OP_WRITE || treq.secs > LL_WC_SMALL_SECS) {
+		ll_wc_flush(wc);
+		wc->submit(wc->arg, treq);
+		return;
+	}
+
+	if (b && (treq.sec != b->sec + b->secs ||
+		  b->secs + treq.secs > LL_WC_MAX_SECS ||
+		  b->n_parts == LL_WC_MAX_PARTS)) {
+		ll_wc_flush(wc);
+		b = NULL;
+	}
+
+	if (!b) {
+		b = ll_wc_get_buf(wc);
+		if (!b) {
+			wc->submit(wc->arg, treq);
+			return;
+		}
+
+		b->busy    = 1;
+		b->sec     = treq.sec;
+		b->secs    = 0;
+		b->n_parts = 0;
+		wc->open   = b;
+	}
+
+	b->parts[b->n_parts++] = treq;
+	b->secs += treq.secs;
+
+	if (wc->event < 0) {
+		wc->event = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+							  -1, TV_ZERO,
+							  ll_wc_event, wc);
+		if (wc->event < 0)
+			ll_wc_flush(wc);
+	}
+}
+
+static void
+ll_wc_read(struct ll_wc *wc, td_request_t treq)
+{
+	struct ll_wc_buf *b = wc->open;
+
+	if (b && treq.sec < b->sec + b->secs && b->sec < treq.sec + treq.secs)
+		ll_wc_flush(wc);
+}
+
+static void
+ll_wc_free(struct ll_wc *wc)
+{
+	int i;
+
+	if (wc->event >= 0) {
+		tapdisk_server_unregister_event(wc->event);
+		wc->event = -1;
+	}
+
+	BUG_ON(wc->open);
+
+	for (i = 0; i < LL_WC_NR_BUFS; i++) {
+		free(wc->bufv[i].buf);
+		wc->bufv[i].buf = NULL;
+	}
+}
+
+static int
+ll_wc_init(struct ll_wc *wc, ll_wc_submit_t submit, void *arg)
+{
+	int i, err;
+
+	wc->open   = NULL;
+	wc->event  = -1;
+	wc->submit = submit;
+	wc->arg    = arg;
+
+	for (i = 0; i < LL_WC_NR_BUFS; i++) {
+		err = posix_memalign((void **)&wc->bufv[i].buf, 4096,
+				     LL_WC_MAX_SECS << SECTOR_SHIFT);
+		if (err) {
+			wc->bufv[i].buf = NULL;
+			ll_wc_free(wc);
+			return -err;
+		}
+		wc->bufv[i].busy = 0;
+	}
+
+	return 0;
+}
+
 /*
  * LLP: Local leaf persistent cache
  *      -- Persistent write caching in local storage.
@@ -141,6 +370,7 @@ struct llpcache_request {
 struct llpcache {
 	td_image_t             *local;
 	int                     mode;
+	struct ll_wc            wc;
 
 	td_llpcache_req_t       reqv[TD_LLPCACHE_MAX_REQ];
 	td_llpcache_req_t      *free[TD_LLPCACHE_MAX_REQ];
@@ -293,7 +523,7 @@ llpcache_forward_write(td_llpcache_t *s, td_request_t treq)
 		td_forward_request(treq);
 		break;
 	case LOCAL:
-		td_queue_write(s->local, treq);
+		ll_wc_write(&s->wc, treq);
 		break;
 	default:
 		BUG();
@@ -318,6 +548,7 @@ llpcache_queue_read(td_driver_t *driver, td_request_t treq)
 
 	switch (s->mode) {
 	case LLP_MIRROR:
+		ll_wc_read(&s->wc, treq);
 		td_queue_read(s->local, treq);
 		break;
 	case LLP_SHARED:
@@ -327,11 +558,21 @@ llpcache_queue_read(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+static void
+llpcache_submit_local(void *arg, td_request_t treq)
+{
+	td_llpcache_t *s = arg;
+
+	td_queue_write(s->local, treq);
+}
+
 static int
 llpcache_close(td_driver_t *driver)
 {
 	td_llpcache_t *s = driver->data;
 
+	ll_wc_free(&s->wc);
+
 	if (s->local) {
 		tapdisk_image_close(s->local);
 		s->local = NULL;
@@ -352,6 +593,10 @@ llpcache_open(td_driver_t *driver, const char *name,
 	for (i = 0; i < TD_LLPCACHE_MAX_REQ; i++)
 		llpcache_free_request(s, &s->reqv[i]);
 
+	err = ll_wc_init(&s->wc, llpcache_submit_local, s);
+	if (err)
+		return err;
+
 	err = tapdisk_image_open(DISK_TYPE_VHD, name, flags, encryption, &s->local);
 	if (err)
 		goto fail;
@@ -456,6 +701,7 @@ struct llecache_request {
 struct llecache {
 	td_image_t             *shared;
 	int                     mode;
+	struct ll_wc            wc;
 
 	td_llecache_req_t       reqv[TD_LLECACHE_MAX_REQ];
 	td_llecache_req_t      *free[TD_LLECACHE_MAX_REQ];
@@ -480,11 +726,19 @@ llecache_free_request(td_llecache_t *s, td_llecache_req_t *req)
 	s->free[s->n_free++] = req;
 }
 
+static void
+llecache_submit_local(void *arg, td_request_t treq)
+{
+	td_forward_request(treq);
+}
+
 static int
 llecache_close(td_driver_t *driver)
 {
 	td_llecache_t *s = driver->data;
 
+	ll_wc_free(&s->wc);
+
 	if (s->shared) {
 		tapdisk_image_close(s->shared);
 		s->shared = NULL;
@@ -505,6 +759,10 @@ llecache_open(td_driver_t *driver, const char *name,
 	for (i = 0; i < TD_LLECACHE_MAX_REQ; i++)
 		llecache_free_request(s, &s->reqv[i]);
 
+	err = ll_wc_init(&s->wc, llecache_submit_local, s);
+	if (err)
+		return err;
+
 	err = tapdisk_image_open(DISK_TYPE_VHD, name, flags, encryption, &s->shared);
 	if (err)
 		goto fail;
@@ -567,7 +825,7 @@ llecache_forward_write(td_llecache_t *s, td_request_t treq)
 	clone.cb        = __llecache_write_cb;
 	clone.cb_data   = req;
 
-	td_forward_request(clone);
+	ll_wc_write(&s->wc, clone);
 }
 
 static void
@@ -592,6 +850,7 @@ llecache_queue_read(td_driver_t *driver, td_request_t treq)
 
 	switch (s->mode) {
 	case LLE_LOCAL:
+		ll_wc_read(&s->wc, treq);
 		td_forward_request(treq);
 		break;
 	case LLE_SHARED:
@@ -30,6 +30,26 @@
 
 /* Driver to sit on top of another disk and log writes, in order
  * to track changed blocks
+ *
+ * The CBT log file is mapped shared and bits are set in place, so the
+ * write path makes no syscalls. Dirty pages are written back with
+ * msync() once TAPDISK3_CBT_FLUSH_WRITES writes have set new bits, or
+ * TAPDISK3_CBT_FLUSH_MS after the first such write, whichever comes
+ * first, and in full on close. Logs created with the fine layer (see
+ * cbt-util.h) also get their 4K sub-block bits set, ahead of the block
+ * bit.
+ *
+ * Crash consistency: bits are in the page cache before the write they
+ * describe is forwarded, so a tapdisk crash loses nothing. A host crash
+ * can lose bits set since the last msync, i.e. at most one flush
+ * interval of writes, so a log left by an unclean host shutdown must
+ * not be trusted for an incremental copy: mark it inconsistent
+ * (cbt-util set -c 0) while attached and consistent again on detach.
+ *
+ * Epochs: tdlog_rotate() swaps in a new log between two writes of the
+ * running VBD, with the old one synced and unmapped first. Every write
+ * the VBD took before is in the old log, every later one in the new, so
+ * incremental backups can cut a change log per epoch without a pause.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -41,7 +61,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
@@ -57,84 +80,251 @@
 #define BITS_PER_LONG (sizeof(unsigned long) * 8)
 #define BITS_TO_LONGS(bits) (((bits)+BITS_PER_LONG-1)/BITS_PER_LONG)
 
-#define BITMAP_ENTRY(_nr, _bmap) ((unsigned long*)(_bmap + sizeof(struct cbt_log_metadata)))[((_nr)/BITS_PER_LONG)]
 #define BITMAP_SHIFT(_nr) ((_nr) % BITS_PER_LONG)
 
-static inline int test_bit(int nr, void* bmap)
+#define TDLOG_FLUSH_WRITES	1024
+#define TDLOG_FLUSH_MS		5000
+
+static inline uint64_t
+get_bit_for_sec(td_sector_t sector)
 {
-	return (BITMAP_ENTRY(nr, bmap) >> BITMAP_SHIFT(nr)) & 1;
+	uint64_t block = (sector * SECTOR_SIZE) / CBT_BLOCK_SIZE;
+	return block;
 }
 
-static inline void set_bit(int nr, void* bmap)
+static inline uint64_t
+get_fine_bit_for_sec(td_sector_t sector)
 {
-	BITMAP_ENTRY(nr, bmap) |= (1UL << BITMAP_SHIFT(nr));
+	return (sector * SECTOR_SIZE) / CBT_FINE_BLOCK_SIZE;
 }
 
-static inline uint64_t
-get_bit_for_sec(td_sector_t sector)
+static inline void
+range_reset(struct tdlog_range *r)
 {
-	uint64_t block = (sector * SECTOR_SIZE) / CBT_BLOCK_SIZE;
-	return block;
+	r->start = SIZE_MAX;
+	r->end   = 0;
 }
 
-static int bitmap_init(struct tdlog_data *data, char *name)
+static unsigned int
+tdlog_env(const char *name, unsigned int def)
 {
-	uint64_t bmsize;
-	int fd;
-	int result = 0;
+	const char *val = getenv(name);
+	char *end;
+	unsigned long v;
+
+	if (!val)
+		return def;
+
+	v = strtoul(val, &end, 10);
+	if (*end || v > UINT_MAX) {
+		EPRINTF("ignoring bad %s=%s\n", name, val);
+		return def;
+	}
+
+	return v;
+}
+
+static int bitmap_init(struct tdlog_data *data, const char *name)
+{
+	uint64_t bmsize, size = data->size * SECTOR_SIZE;
+	struct stat st;
+	void *map;
+	int fd, err;
 
 	/* Open on disk log file and map it into memory */
 	fd = open(name, O_RDWR);
 	if (fd == -1) {
-		EPRINTF("failed to open bitmap log file");
-		result = -1;
+		err = -errno;
+		EPRINTF("failed to open bitmap log file %s: %d", name, err);
+		return err;
 	}
 
-	if (result == 0) {
-		//data->size is in number of sectors, convert it to bytes
-		bmsize = bitmap_size(data->size * SECTOR_SIZE) + sizeof(struct cbt_log_metadata);
-		DPRINTF("CBT: allocating %"PRIu64" bytes (bitmap %"PRIu64" + header %lu) for dirty bitmap",
-								bmsize, bitmap_size(data->size * SECTOR_SIZE),
-											sizeof(struct cbt_log_metadata));
-
-		data->bitmap = mmap(NULL, bmsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-		if (!data->bitmap) {
-			EPRINTF("could not allocate dirty bitmap of size %"PRIu64, bmsize);
-			result = -1;
-		}
+	//data->size is in number of sectors, convert it to bytes
+	bmsize = bitmap_size(size) + sizeof(struct cbt_log_metadata);
 
-		close (fd);
+	if (!fstat(fd, &st) &&
+	    (uint64_t)st.st_size >= fine_bitmap_offset(size) + fine_bitmap_size(size)) {
+		bmsize     = fine_bitmap_offset(size) + fine_bitmap_size(size);
+		data->fine = 1;
 	}
 
-	return result;
+	DPRINTF("CBT: mapping %"PRIu64" bytes (bitmap %"PRIu64" + header %lu%s) for dirty bitmap",
+		bmsize, bitmap_size(size), sizeof(struct cbt_log_metadata),
+		data->fine ? " + 4K layer" : "");
+
+	map = mmap(NULL, bmsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	err = -errno;
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		EPRINTF("could not map dirty bitmap of size %"PRIu64": %d",
+			bmsize, err);
+		return err;
+	}
+
+	data->bitmap       = map;
+	data->map_size     = bmsize;
+	range_reset(&data->dirty);
+	range_reset(&data->fine_dirty);
+	data->flush_writes = tdlog_env("TAPDISK3_CBT_FLUSH_WRITES",
+				       TDLOG_FLUSH_WRITES);
+	data->flush_ms     = tdlog_env("TAPDISK3_CBT_FLUSH_MS",
+				       TDLOG_FLUSH_MS);
+
+	return 0;
+}
+
+static void bitmap_sync(struct tdlog_data *data, struct tdlog_range *r,
+			int flags)
+{
+	size_t page = getpagesize(), start, len;
+
+	if (r->start >= r->end)
+		return;
+
+	start = r->start & ~(page - 1);
+	len   = r->end - start;
+
+	if (msync(data->bitmap + start, len, flags))
+		EPRINTF("CBT: msync of %zu bytes at %zu failed: %d",
+			len, start, errno);
+
+	range_reset(r);
+}
+
+static void bitmap_flush(struct tdlog_data *data, int flags)
+{
+	if (data->flush_event >= 0) {
+		tapdisk_server_unregister_event(data->flush_event);
+		data->flush_event = -1;
+	}
+
+	/* sub-block bits first, a block bit without them covers it all */
+	bitmap_sync(data, &data->fine_dirty, flags);
+	bitmap_sync(data, &data->dirty, flags);
+	data->dirty_writes = 0;
+}
+
+static void bitmap_flush_event(event_id_t id, char mode, void *private)
+{
+	bitmap_flush(private, MS_SYNC);
 }
 
 static int bitmap_free(struct tdlog_data *data)
 {
-	uint64_t bmsize;
 	int rc;
-	bmsize = bitmap_size(data->size * SECTOR_SIZE) + sizeof(struct cbt_log_metadata);
+
 	if (data->bitmap) {
-		rc = munmap(data->bitmap, bmsize);
+		bitmap_flush(data, MS_SYNC);
+
+		rc = munmap(data->bitmap, data->map_size);
 		if (rc != 0) {
 			EPRINTF("Failed to unmap the bitmap block");
 		}
+		data->bitmap = NULL;
 	}
 
 	return 0;
 }
 
-static int bitmap_set(struct tdlog_data* data, uint64_t block, int count)
+/*
+ * Sets @count bits from @nr in the layer at byte @base of the mapping,
+ * touching only words that change so rewrites of already tracked blocks
+ * dirty no pages. Returns whether any bit was new.
+ */
+static int bitmap_set(struct tdlog_data* data, size_t base,
+		      struct tdlog_range *dirty, uint64_t nr, uint64_t count)
 {
-	int i;
+	unsigned long *map, mask, old;
+	uint64_t end, w, last;
+	size_t lo, hi;
+	int changed = 0;
+
+	if (!count)
+		return 0;
+
+	map  = (unsigned long *)((char *)data->bitmap + base);
+	end  = nr + count;
+	last = (end - 1) / BITS_PER_LONG;
+	lo   = SIZE_MAX;
+	hi   = 0;
+
+	for (w = nr / BITS_PER_LONG; w <= last; w++) {
+		mask = ~0UL;
+		if (w == nr / BITS_PER_LONG)
+			mask &= ~0UL << BITMAP_SHIFT(nr);
+		if (w == last && BITMAP_SHIFT(end))
+			mask &= ~0UL >> (BITS_PER_LONG - BITMAP_SHIFT(end));
+
+		old = map[w];
+		if ((old & mask) == mask)
+			continue;
+
+		map[w] = old | mask;
+		if (!changed)
+			lo = (char *)&map[w] - (char *)data->bitmap;
+		hi = (char *)&map[w + 1] - (char *)data->bitmap;
+		changed = 1;
+	}
 
-	for (i = 0; i < count; i++)
-		set_bit(block + i, data->bitmap);
+	if (!changed)
+		return 0;
 
-	return 0;
+	/* the bitmap ends on a byte, not necessarily a word */
+	if (hi > data->map_size)
+		hi = data->map_size;
+	if (lo < dirty->start)
+		dirty->start = lo;
+	if (hi > dirty->end)
+		dirty->end = hi;
+
+	return 1;
+}
+
+static void bitmap_dirtied(struct tdlog_data *data)
+{
+	if (++data->dirty_writes >= data->flush_writes) {
+		bitmap_flush(data, MS_ASYNC);
+		return;
+	}
+
+	if (data->flush_event < 0) {
+		data->flush_event =
+			tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+						      -1,
+						      TV_USECS((uint64_t)data->flush_ms * 1000),
+						      bitmap_flush_event, data);
+		if (data->flush_event < 0)
+			bitmap_flush(data, MS_ASYNC);
+	}
 }
 
 
+int tdlog_rotate(td_driver_t *driver, const char *name, uint64_t *epoch)
+{
+	struct tdlog_data *data = (struct tdlog_data *)driver->data;
+	struct tdlog_data next;
+	int err;
+
+	memset(&next, 0, sizeof(next));
+	next.size        = data->size;
+	next.flush_event = -1;
+
+	err = bitmap_init(&next, name);
+	if (err)
+		return err;
+
+	next.epoch = data->epoch + 1;
+
+	bitmap_free(data);
+	*data = next;
+
+	DPRINTF("CBT: log rotated to %s, epoch %"PRIu64"\n", name, data->epoch);
+	*epoch = data->epoch;
+
+	return 0;
+}
+
 /* -- interface -- */
 
 static int tdlog_close(td_driver_t* driver)
@@ -153,6 +343,7 @@ static int tdlog_open(td_driver_t* driver, const char *name,
 
 	memset(data, 0, sizeof(*data));
 	data->size = driver->info.size;
+	data->flush_event = -1;
 
 	if ((rc = bitmap_init(data, driver->name))) {
 		tdlog_close(driver);
@@ -167,15 +358,37 @@ static void tdlog_queue_read(td_driver_t* driver, td_request_t treq)
 	td_forward_request(treq);
 }
 
+static int tdlog_sector_present(td_driver_t* driver, td_sector_t sec,
+				td_sector_t* secs)
+{
+	/* reads all pass through */
+	*secs = driver->info.size - sec;
+	return 0;
+}
+
 static void tdlog_queue_write(td_driver_t* driver, td_request_t treq)
 {
 	struct tdlog_data* data = (struct tdlog_data*)driver->data;
-	uint64_t start_bit, last_bit;
+	uint64_t start_bit, last_bit, size = data->size * SECTOR_SIZE;
+	int changed = 0;
+
+	if (data->fine) {
+		start_bit = get_fine_bit_for_sec(treq.sec);
+		last_bit = get_fine_bit_for_sec(treq.sec + treq.secs - 1);
+
+		changed |= bitmap_set(data, fine_bitmap_offset(size),
+				      &data->fine_dirty, start_bit,
+				      (last_bit - start_bit) + 1);
+	}
 
 	start_bit = get_bit_for_sec(treq.sec);
 	last_bit = get_bit_for_sec(treq.sec + treq.secs - 1);
 
-	bitmap_set(data, start_bit, (last_bit - start_bit) + 1);
+	changed |= bitmap_set(data, sizeof(struct cbt_log_metadata),
+			      &data->dirty, start_bit,
+			      (last_bit - start_bit) + 1);
+	if (changed)
+		bitmap_dirtied(data);
 	td_forward_request(treq);
 }
 
@@ -198,6 +411,10 @@ struct tap_disk tapdisk_log = {
 	.td_close           = tdlog_close,
 	.td_queue_read      = tdlog_queue_read,
 	.td_queue_write     = tdlog_queue_write,
+	/* discarded sectors change contents too */
+	.td_queue_discard   = tdlog_queue_write,
+	.td_queue_write_zeroes = tdlog_queue_write,
 	.td_get_parent_id   = tdlog_get_parent_id,
 	.td_validate_parent = tdlog_validate_parent,
+	.td_sector_present  = tdlog_sector_present,
 };
@@ -32,10 +32,41 @@
 #define __BLOCK_LOG_H__
 
 #include "cbt-util.h"
+#include "scheduler.h"
+#include "tapdisk.h"
+
+struct tdlog_range {
+	size_t		start;
+	size_t		end;
+};
 
 struct tdlog_data {
 	uint64_t   	size;
 	void*		bitmap;
+	size_t		map_size;
+
+	/* set when the log has the 4K sub-block layer */
+	int		fine;
+
+	/* byte ranges of the mapping dirtied since the last msync */
+	struct tdlog_range	dirty;
+	struct tdlog_range	fine_dirty;
+	unsigned int	dirty_writes;
+
+	unsigned int	flush_writes;
+	unsigned int	flush_ms;
+	event_id_t	flush_event;
+
+	/* logs rotated through since open */
+	uint64_t	epoch;
 };
 
+/*
+ * Continues logging the writes of the running VBD in log file @name,
+ * after syncing the current log in full and letting go of it, and sets
+ * @epoch to the number of rotations since open. Returns the error of
+ * opening @name, with the current log kept.
+ */
+int tdlog_rotate(td_driver_t *, const char *name, uint64_t *epoch);
+
 #endif
@@ -31,9 +31,12 @@
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
@@ -50,6 +53,7 @@
 #include "tapdisk-fdreceiver.h"
 #include "timeout-math.h"
 #include "tapdisk-nbdserver.h"
+#include "tapdisk-nbdtls.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -61,9 +65,23 @@
 #define N_PASSED_FDS 10
 #define TAPDISK_NBDCLIENT_MAX_PATH_LEN 256
 
-#define MAX_NBD_REQS TAPDISK_DATA_REQUESTS
+#define MAX_NBD_REQS (TAPDISK_DATA_REQUESTS << 1)
 #define NBD_TIMEOUT 30
 
+#define TDNBD_MAX_CONNS 16
+#define TDNBD_DEFAULT_CONNS 4
+
+#define TDNBD_MAX_IOVS 64
+
+/* backoff between attempts to get the server back */
+#define TDNBD_RECONNECT_MIN_MS 10
+#define TDNBD_RECONNECT_MAX_MS 2000
+#define TDNBD_RBUF_SIZE (256 << 10)
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
 /*
  * We'll only ever have one nbdclient fd receiver per tapdisk process, so let's 
  * just store it here globally. We'll also keep track of the passed fds here
@@ -83,6 +101,48 @@ struct nbd_queued_io {
 	int                     so_far;
 };
 
+struct tdnbd_conn;
+
+enum {
+	TDNBD_NEG_CONNECT,
+	TDNBD_NEG_MAGIC,         /* "NBDMAGIC" and the style magic */
+	TDNBD_NEG_OLD_EXPORT,    /* oldstyle size and flags */
+	TDNBD_NEG_HFLAGS,        /* newstyle handshake flags */
+	TDNBD_NEG_STARTTLS,      /* reply to NBD_OPT_STARTTLS */
+	TDNBD_NEG_STARTTLS_DATA,
+	TDNBD_NEG_TLS,
+	TDNBD_NEG_EXPORT,        /* size and transmission flags */
+	TDNBD_NEG_PAD,
+	TDNBD_NEG_DONE
+};
+
+/*
+ * Connect and handshake of one connection. Each state names what it waits
+ * for in 'in', after whatever was put in 'out' went to the server; the
+ * socket is non-blocking throughout, and 'mode' is what it waits on.
+ */
+struct tdnbd_neg {
+	int                     state;
+	int                     event_id;
+	char                    mode;
+
+	char                    in[256];
+	size_t                  in_len;
+	size_t                  want;
+
+	char                    out[64];
+	size_t                  out_off;
+	size_t                  out_len;
+
+	int                     tls;
+	struct ssl_st          *ssl;
+	uint32_t                rep_type;
+	int                     padbytes;
+
+	uint64_t                size;
+	uint32_t                flags;
+};
+
 struct td_nbd_request {
 	td_request_t            treq;
 	struct nbd_request      nreq;
@@ -91,24 +151,72 @@ struct td_nbd_request {
 	struct nbd_queued_io    header;
 	struct nbd_queued_io    body;     /* in or out, depending on whether
 					     type is read or write. */
+	struct tdnbd_conn      *conn;
 	struct list_head        queue;
 };
 
-struct tdnbd_data
+/*
+ * One socket to the server. Servers advertising multi-conn get several,
+ * and the requests are spread over them.
+ */
+struct tdnbd_conn
 {
+	struct tdnbd_data      *prv;
+	int                     id;
+	int                     socket;
+	int                     ready;
+	int                     dead;
+
+	struct tdnbd_neg        neg;
+
 	int                     writer_event_id;
 	struct list_head        sent_reqs;
 	struct list_head        pending_reqs;
-	struct list_head        free_reqs;
-	struct td_nbd_request   requests[MAX_NBD_REQS];
-	int                     nr_free_count;
+	int                     nr_inflight;
 
 	int                     reader_event_id;
 	struct nbd_reply        current_reply;
-	struct nbd_queued_io    cur_reply_qio;
 	struct td_nbd_request  *curr_reply_req;
 
-	int                     socket;
+	/*
+	 * Replies are parsed out of rbuf, read payloads which did not
+	 * arrive with their header are received straight into the request.
+	 */
+	char                   *rbuf;
+	size_t                  rbuf_off;
+	size_t                  rbuf_len;
+};
+
+/* requests in flight never move, the pool grows by whole slabs */
+struct tdnbd_request_slab {
+	struct tdnbd_request_slab *next;
+	struct td_nbd_request   reqs[];
+};
+
+struct tdnbd_data
+{
+	struct list_head        free_reqs;
+	struct tdnbd_request_slab *slabs;
+	int                     nr_requests;
+	int                     nr_free_count;
+
+	struct tdnbd_conn       conns[TDNBD_MAX_CONNS];
+	int                     nr_conns;
+	int                     nr_live;
+	int                     nr_pending;
+
+	/* requests held while no connection is ready */
+	struct list_head        wait_reqs;
+
+	/*
+	 * Once the last connection is lost, reconnection is tried for up
+	 * to reconnect_secs, from reconnect_since (ms, monotonic).
+	 */
+	int                     reconnect_secs;
+	int                     reconnect_event;
+	uint64_t                reconnect_delay;
+	uint64_t                reconnect_since;
+
 	/*
 	 * TODO tapdisk can talk to an Internet socket or a UNIX domain socket.
 	 * Try to group struct members accordingly e.g. in a union.
@@ -120,12 +228,14 @@ struct tdnbd_data
 	char                   *name;
 
 	int                     flags;
+	uint64_t                size;
+	uint32_t                nbd_flags; /* transmission flags */
 	int                     closed;
 };
 
 int global_id = 0;
 
-static void disable_write_queue(struct tdnbd_data *prv);
+static void disable_write_queue(struct tdnbd_conn *conn);
 
 
 /* -- fdreceiver bits and pieces -- */
@@ -221,169 +331,359 @@ __cancel_req(int i, struct td_nbd_request *pos, int e)
 		pos->timeout_event = -1;
 	}
 
-	td_complete_request(pos->treq, e);
+	/* a disconnect has no td request behind it */
+	if (ntohl(pos->nreq.type) != TAPDISK_NBD_CMD_DISC)
+		td_complete_request(pos->treq, e);
+}
+
+static void
+tdnbd_conn_stop(struct tdnbd_conn *conn)
+{
+	if (conn->neg.event_id >= 0) {
+		tapdisk_server_unregister_event(conn->neg.event_id);
+		conn->neg.event_id = -1;
+	}
+
+	if (conn->neg.ssl) {
+		tapdisk_nbd_tls_free(conn->neg.ssl);
+		conn->neg.ssl = NULL;
+	}
+
+	if (conn->writer_event_id >= 0) {
+		tapdisk_server_unregister_event(conn->writer_event_id);
+		conn->writer_event_id = -1;
+	}
+
+	if (conn->reader_event_id >= 0) {
+		tapdisk_server_unregister_event(conn->reader_event_id);
+		conn->reader_event_id = -1;
+	}
 }
 
 static void
 tdnbd_disable(struct tdnbd_data *prv, int e)
 {
 	struct td_nbd_request *pos, *q;
-	int i = 0;
+	struct tdnbd_conn *conn;
+	int i = 0, c;
 
 	INFO("NBD client full-disable");
 
-	tapdisk_server_unregister_event(prv->writer_event_id);
-	tapdisk_server_unregister_event(prv->reader_event_id);
+	if (prv->reconnect_event >= 0) {
+		tapdisk_server_unregister_event(prv->reconnect_event);
+		prv->reconnect_event = -1;
+	}
+
+	for (c = 0; c < prv->nr_conns; c++) {
+		conn = &prv->conns[c];
+		if (conn->dead)
+			continue;
 
-	INFO("NBD client cancelling sent reqs");
-	list_for_each_entry_safe(pos, q, &prv->sent_reqs, queue)
-		__cancel_req(i++, pos, e);
+		tdnbd_conn_stop(conn);
+
+		INFO("NBD client cancelling sent reqs");
+		list_for_each_entry_safe(pos, q, &conn->sent_reqs, queue)
+			__cancel_req(i++, pos, e);
+
+		INFO("NBD client cancelling pending reqs");
+		list_for_each_entry_safe(pos, q, &conn->pending_reqs, queue)
+			__cancel_req(i++, pos, e);
+	}
 
-	INFO("NBD client cancelling pending reqs");
-	list_for_each_entry_safe(pos, q, &prv->pending_reqs, queue)
+	INFO("NBD client cancelling waiting reqs");
+	list_for_each_entry_safe(pos, q, &prv->wait_reqs, queue)
 		__cancel_req(i++, pos, e);
 
 	INFO("Setting closed");
 	prv->closed = 3;
 }
 
-/* NBD writer queue */
+/* The least loaded connection ready for requests */
+static struct tdnbd_conn *
+tdnbd_pick_conn(struct tdnbd_data *prv)
+{
+	struct tdnbd_conn *conn, *best = NULL;
+	int c;
 
-/* Return code: how much is left to write, or a negative error code */
-static int
-tdnbd_write_some(int fd, struct nbd_queued_io *data) 
+	for (c = 0; c < prv->nr_conns; c++) {
+		conn = &prv->conns[c];
+		if (!conn->ready)
+			continue;
+
+		if (!best || conn->nr_inflight < best->nr_inflight)
+			best = conn;
+	}
+
+	return best;
+}
+
+static int enable_write_queue(struct tdnbd_conn *conn);
+
+static void
+tdnbd_conn_submit(struct tdnbd_conn *conn, struct td_nbd_request *req)
 {
-	int left = data->len - data->so_far;
-	int rc;
-	char *code;
+	req->conn = conn;
+	list_move_tail(&req->queue, &conn->pending_reqs);
+	conn->nr_inflight++;
 
-	while (left > 0) {
-		rc = send(fd, data->buffer + data->so_far, left, 0);
+	if (conn->writer_event_id < 0)
+		enable_write_queue(conn);
+}
 
-		if (rc == -1) {
-			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-				return left;
+/*
+ * Hand a request to a ready connection, or hold it until one of those
+ * still negotiating comes up.
+ */
+static void
+tdnbd_dispatch(struct tdnbd_data *prv, struct td_nbd_request *req)
+{
+	struct tdnbd_conn *conn = tdnbd_pick_conn(prv);
 
-			code = strerror(errno);
-			ERROR("Bad return code %d from send (%s)", rc, 
-					(code == 0 ? "unknown" : code));
-			return rc;
-		}
+	if (conn) {
+		tdnbd_conn_submit(conn, req);
+		return;
+	}
 
-		if (rc == 0) {
-			ERROR("Server shutdown prematurely in write_some");
-			return -1;
-		}
+	req->conn = NULL;
+	list_move_tail(&req->queue, &prv->wait_reqs);
+}
+
+static void
+tdnbd_release_req(struct tdnbd_data *prv, struct td_nbd_request *req)
+{
+	req->conn->nr_inflight--;
+	req->conn = NULL;
+	list_move(&req->queue, &prv->free_reqs);
+	prv->nr_free_count++;
+}
+
+static void
+tdnbd_conn_close(struct tdnbd_conn *conn)
+{
+	tdnbd_conn_stop(conn);
+	close(conn->socket);
+	conn->socket = -1;
+	conn->ready = 0;
+	conn->dead = 1;
+}
+
+static int tdnbd_reconnect(struct tdnbd_data *prv);
+
+/*
+ * A broken connection takes only itself down: whatever was queued or in
+ * flight on it is sent again over the others, or waits for one still
+ * negotiating. When nothing is left, it waits for a new connection, in
+ * the order it was sent: requests are only completed once the server
+ * replied, so resending reads and writes is safe. Failing that, the
+ * device goes.
+ */
+static void
+tdnbd_conn_fail(struct tdnbd_conn *conn)
+{
+	struct tdnbd_data *prv = conn->prv;
+	struct td_nbd_request *pos, *q;
+	struct list_head *lists[2] = { &conn->sent_reqs, &conn->pending_reqs };
+	int i;
+
+	if (conn->ready && prv->nr_live <= 1 && !prv->nr_pending &&
+	    (!prv->reconnect_secs || prv->name)) {
+		tdnbd_disable(prv, EIO);
+		return;
+	}
+
+	if (conn->ready) {
+		ERROR("Connection %d failed, %d requests move to the other %d",
+		      conn->id, conn->nr_inflight,
+		      prv->nr_live - 1 + prv->nr_pending);
+		prv->nr_live--;
+	} else {
+		ERROR("Connection %d could not be set up", conn->id);
+		prv->nr_pending--;
+	}
+
+	tdnbd_conn_close(conn);
+
+	conn->curr_reply_req = NULL;
+	conn->rbuf_off = conn->rbuf_len = 0;
+
+	for (i = 0; i < 2; i++) {
+		list_for_each_entry_safe(pos, q, lists[i], queue) {
+			if (ntohl(pos->nreq.type) == TAPDISK_NBD_CMD_DISC) {
+				tdnbd_release_req(prv, pos);
+				continue;
+			}
 
-		left -= rc;
-		data->so_far += rc;
+			conn->nr_inflight--;
+			pos->header.so_far = 0;
+			pos->body.so_far = 0;
+			tdnbd_dispatch(prv, pos);
+		}
 	}
 
-	return left;
+	if (!prv->nr_live && !prv->nr_pending && tdnbd_reconnect(prv))
+		tdnbd_disable(prv, EIO);
 }
 
+/* NBD writer queue */
+
 static int
-tdnbd_read_some(int fd, struct nbd_queued_io *data)
+tdnbd_fill_iov(struct td_nbd_request *req, struct iovec *iov)
 {
-	int left = data->len - data->so_far;
-	int rc;
-	char *code;
+	struct nbd_queued_io *io[2] = { &req->header, &req->body };
+	int i, n = 0;
 
-	while (left > 0) {
-		rc = recv(fd, data->buffer + data->so_far, left, 0);
+	for (i = 0; i < 2; i++) {
+		if (io[i]->so_far == io[i]->len)
+			continue;
 
-		if (rc == -1) {
+		iov[n].iov_base = io[i]->buffer + io[i]->so_far;
+		iov[n].iov_len = io[i]->len - io[i]->so_far;
+		n++;
 
-			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-				return left;
+		/* only writes carry a payload */
+		if (ntohl(req->nreq.type) != TAPDISK_NBD_CMD_WRITE)
+			break;
+	}
 
-			code = strerror(errno);
-			ERROR("Bad return code %d from send (%s)", rc,
-					(code == 0 ? "unknown" : code));
-			return rc;
-		}
+	return n;
+}
 
-		if (rc == 0) {
-			ERROR("Server shutdown prematurely in read_some");
-			return -1;
-		}
+/* Return code: how much of the sent bytes are left for the next request */
+static size_t
+tdnbd_advance(struct td_nbd_request *req, size_t n)
+{
+	struct nbd_queued_io *io[2] = { &req->header, &req->body };
+	int i, cnt;
+
+	cnt = ntohl(req->nreq.type) == TAPDISK_NBD_CMD_WRITE ? 2 : 1;
 
-		data->so_far += rc;
-		left -= rc;
+	for (i = 0; i < cnt; i++) {
+		size_t left = io[i]->len - io[i]->so_far;
+
+		left = MIN(left, n);
+		io[i]->so_far += left;
+		n -= left;
 	}
 
-	return left;
+	return n;
+}
+
+static int
+tdnbd_sent(struct td_nbd_request *req)
+{
+	if (req->header.so_far < req->header.len)
+		return 0;
+
+	if (ntohl(req->nreq.type) == TAPDISK_NBD_CMD_WRITE)
+		return req->body.so_far == req->body.len;
+
+	return 1;
 }
 
+/*
+ * Gather the headers and write payloads of as many pending requests as
+ * fit into one iovec, and push them to the socket in a single sendmsg.
+ */
 static void
 tdnbd_writer_cb(event_id_t eb, char mode, void *data)
 {
 	struct td_nbd_request *pos, *q;
-	struct tdnbd_data *prv = data;
+	struct tdnbd_conn *conn = data;
+	struct tdnbd_data *prv = conn->prv;
+	struct iovec iov[TDNBD_MAX_IOVS];
+	struct msghdr msg;
+	ssize_t rc;
+	size_t n;
+	int niov;
+
+	while (!list_empty(&conn->pending_reqs)) {
+		niov = 0;
+		list_for_each_entry(pos, &conn->pending_reqs, queue) {
+			if (niov + 2 > TDNBD_MAX_IOVS)
+				break;
+			niov += tdnbd_fill_iov(pos, iov + niov);
+		}
 
-	list_for_each_entry_safe(pos, q, &prv->pending_reqs, queue) {
-		if (tdnbd_write_some(prv->socket, &pos->header) > 0)
-			return;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = niov;
 
-		if (ntohl(pos->nreq.type) == TAPDISK_NBD_CMD_WRITE) {
-			if (tdnbd_write_some(prv->socket, &pos->body) > 0)
+		rc = sendmsg(conn->socket, &msg, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
 				return;
+
+			ERROR("Bad return code %zd from sendmsg (%s)", rc,
+			      strerror(errno));
+			tdnbd_conn_fail(conn);
+			return;
 		}
 
-		if (ntohl(pos->nreq.type) == TAPDISK_NBD_CMD_DISC) {
-			INFO("sent close request");
-			/*
-			 * We don't expect a response from a DISC, so move the
-			 * request back onto the free list
-			 */
-			list_move(&pos->queue, &prv->free_reqs);
-			prv->nr_free_count++;
-			prv->closed = 2;
-		} else {
-			list_move(&pos->queue, &prv->sent_reqs);
+		n = rc;
+		list_for_each_entry_safe(pos, q, &conn->pending_reqs, queue) {
+			n = tdnbd_advance(pos, n);
+			if (!tdnbd_sent(pos))
+				break;
+
+			if (ntohl(pos->nreq.type) == TAPDISK_NBD_CMD_DISC) {
+				INFO("sent close request");
+				/*
+				 * We don't expect a response from a DISC, so
+				 * move the request back onto the free list
+				 */
+				tdnbd_release_req(prv, pos);
+			} else {
+				/* replies mostly come back in order */
+				list_move_tail(&pos->queue, &conn->sent_reqs);
+			}
 		}
 	}
 
 	/* If we're here, we've written everything */
 
-	disable_write_queue(prv);
-
-	if (prv->closed == 2)
-		tdnbd_disable(prv, EIO);
+	disable_write_queue(conn);
 
 	return;
 }
 
 static int
-enable_write_queue(struct tdnbd_data *prv)
+enable_write_queue(struct tdnbd_conn *conn)
 {
-	if (prv->writer_event_id >= 0) 
+	if (conn->writer_event_id >= 0) 
 		return 0;
 
-	prv->writer_event_id = 
+	conn->writer_event_id = 
 		tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
-				prv->socket,
+				conn->socket,
 				TV_ZERO,
 				tdnbd_writer_cb,
-				prv);
+				conn);
 
-	return prv->writer_event_id;
+	return conn->writer_event_id;
 }
 
 static void
-disable_write_queue(struct tdnbd_data *prv)
+disable_write_queue(struct tdnbd_conn *conn)
 {
-	if (prv->writer_event_id < 0)
+	if (conn->writer_event_id < 0)
 		return;
 
-	tapdisk_server_unregister_event(prv->writer_event_id);
+	tapdisk_server_unregister_event(conn->writer_event_id);
 
-	prv->writer_event_id = -1;
+	conn->writer_event_id = -1;
 }
 
+/*
+ * Requests go to the least loaded connection, unless the caller names
+ * one.
+ */
 static int
-tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
-		char *buffer, uint32_t length, td_request_t treq, int fake)
+tdnbd_queue_request(struct tdnbd_data *prv, struct tdnbd_conn *conn,
+		int type, uint64_t offset, char *buffer, uint32_t length,
+		td_request_t treq, int fake)
 {
 	if (prv->nr_free_count == 0) 
 		return -EBUSY;
@@ -417,11 +717,12 @@ tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
 	req->body.so_far = 0;
 	req->fake = fake;
 
-	list_move_tail(&req->queue, &prv->pending_reqs);
 	prv->nr_free_count--;
 
-	if (prv->writer_event_id < 0)
-		enable_write_queue(prv);
+	if (conn)
+		tdnbd_conn_submit(conn, req);
+	else
+		tdnbd_dispatch(prv, req);
 
 	return 0;
 }
@@ -429,247 +730,549 @@ tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
 /* NBD Reader callback */
 
 static void
-tdnbd_reader_cb(event_id_t eb, char mode, void *data)
+tdnbd_complete_reply(struct tdnbd_data *prv, struct td_nbd_request *req,
+		int err)
 {
-	char handle[9];
-	int do_disable = 0;
+	if (req->timeout_event >= 0) {
+		tapdisk_server_unregister_event(req->timeout_event);
+		req->timeout_event = -1;
+	}
 
-	/* Check to see if we're in the middle of reading a response already */
-	struct tdnbd_data *prv = data;
-	int rc = tdnbd_read_some(prv->socket, &prv->cur_reply_qio);
+	td_complete_request(req->treq, err);
 
-	if (rc < 0) {
-		ERROR("Error reading reply header: %d", rc);
-		tdnbd_disable(prv, EIO);
-		return;
-	}
+	tdnbd_release_req(prv, req);
+}
 
-	if (rc > 0)
-		return; /* need more data */
+/*
+ * Consume one reply header from the receive buffer. Returns 0, or a
+ * negative error after having failed the connection.
+ */
+static int
+tdnbd_parse_reply(struct tdnbd_conn *conn)
+{
+	struct tdnbd_data *prv = conn->prv;
+	struct nbd_reply *reply = &conn->current_reply;
+	struct td_nbd_request *pos, *req = NULL;
+	char handle[9];
 
-	/* Got a header. */
-	if (prv->current_reply.error != 0) {
-		ERROR("Error in reply: %d", prv->current_reply.error);
-		tdnbd_disable(prv, EIO);
-		return;
+	/* the buffer offset carries no alignment */
+	memcpy(reply, conn->rbuf + conn->rbuf_off, sizeof(*reply));
+	conn->rbuf_off += sizeof(*reply);
+
+	if (ntohl(reply->magic) != NBD_REPLY_MAGIC) {
+		ERROR("Bad reply magic: 0x%x", ntohl(reply->magic));
+		goto fail;
 	}
 
-	/* Have we found the request yet? */
-	if (prv->curr_reply_req == NULL) {
-		struct td_nbd_request *pos, *q;
-		list_for_each_entry_safe(pos, q, &prv->sent_reqs, queue) {
-			if (memcmp(pos->nreq.handle, prv->current_reply.handle,
-						8) == 0) {
-				prv->curr_reply_req = pos;
-				break;
-			}
+	list_for_each_entry(pos, &conn->sent_reqs, queue) {
+		if (memcmp(pos->nreq.handle, reply->handle, 8) == 0) {
+			req = pos;
+			break;
 		}
+	}
 
-		if (prv->curr_reply_req == NULL) {
-			memcpy(handle, prv->current_reply.handle, 8);
-			handle[8] = 0;
+	if (!req) {
+		memcpy(handle, reply->handle, 8);
+		handle[8] = 0;
 
-			ERROR("Couldn't find request corresponding to reply "
-					"(reply handle='%s')", handle);
-			tdnbd_disable(prv, EIO);
-			return;
-		}
+		ERROR("Couldn't find request corresponding to reply "
+				"(reply handle='%s')", handle);
+		goto fail;
 	}
 
-	switch(ntohl(prv->curr_reply_req->nreq.type)) {
+	/* an error reply carries no payload, and is about this request only */
+	if (reply->error != 0) {
+		ERROR("Error in reply: %d", ntohl(reply->error));
+		tdnbd_complete_reply(prv, req, -EIO);
+		return 0;
+	}
+
+	switch (ntohl(req->nreq.type)) {
 	case TAPDISK_NBD_CMD_READ:
-		rc = tdnbd_read_some(prv->socket,
-				&prv->curr_reply_req->body);
+		conn->curr_reply_req = req;
+		break;
+	case TAPDISK_NBD_CMD_WRITE:
+	case TAPDISK_NBD_CMD_WRITE_ZEROES:
+		tdnbd_complete_reply(prv, req, 0);
+		break;
+	default:
+		ERROR("Unhandled request response: %d",
+				ntohl(req->nreq.type));
+		goto fail;
+	}
 
-		if (rc < 0) {
-			ERROR("Error reading body of request: %d", rc);
-			tdnbd_disable(prv, EIO);
-			return;
+	return 0;
+
+fail:
+	tdnbd_conn_fail(conn);
+	return -EIO;
+}
+
+/*
+ * Drain the socket: parse as many replies as the buffer holds, and when
+ * a read payload is incomplete scatter the rest of it straight into the
+ * request buffer, with whatever follows landing back in the buffer.
+ */
+static void
+tdnbd_reader_cb(event_id_t eb, char mode, void *data)
+{
+	struct tdnbd_conn *conn = data;
+	struct nbd_queued_io *body;
+	struct iovec iov[2];
+	size_t avail, n;
+	ssize_t rc;
+
+	for (;;) {
+		avail = conn->rbuf_len - conn->rbuf_off;
+
+		if (conn->curr_reply_req) {
+			body = &conn->curr_reply_req->body;
+
+			n = MIN(avail, (size_t)(body->len - body->so_far));
+			memcpy(body->buffer + body->so_far,
+			       conn->rbuf + conn->rbuf_off, n);
+			body->so_far += n;
+			conn->rbuf_off += n;
+
+			if (body->so_far == body->len) {
+				tdnbd_complete_reply(conn->prv,
+						conn->curr_reply_req, 0);
+				conn->curr_reply_req = NULL;
+				continue;
+			}
+
+			/* the buffer is empty by now */
+			conn->rbuf_off = conn->rbuf_len = 0;
+
+			iov[0].iov_base = body->buffer + body->so_far;
+			iov[0].iov_len = body->len - body->so_far;
+			iov[1].iov_base = conn->rbuf;
+			iov[1].iov_len = TDNBD_RBUF_SIZE;
+
+			rc = readv(conn->socket, iov, 2);
+			if (rc <= 0)
+				goto recv_err;
+
+			n = MIN((size_t)rc, iov[0].iov_len);
+			body->so_far += n;
+			conn->rbuf_len = rc - n;
+			continue;
 		}
 
-		if (rc > 0)
-			return; /* need more data */
+		if (avail >= sizeof(struct nbd_reply)) {
+			if (tdnbd_parse_reply(conn))
+				return;
+			continue;
+		}
 
-		td_complete_request(prv->curr_reply_req->treq, 0);
+		if (conn->rbuf_off) {
+			memmove(conn->rbuf, conn->rbuf + conn->rbuf_off, avail);
+			conn->rbuf_off = 0;
+			conn->rbuf_len = avail;
+		}
 
-		break;
-	case TAPDISK_NBD_CMD_WRITE:
-		td_complete_request(prv->curr_reply_req->treq, 0);
+		rc = recv(conn->socket, conn->rbuf + conn->rbuf_len,
+			  TDNBD_RBUF_SIZE - conn->rbuf_len, 0);
+		if (rc <= 0)
+			goto recv_err;
 
-		break;
-	default:
-		ERROR("Unhandled request response: %d",
-				ntohl(prv->curr_reply_req->nreq.type));
-		do_disable = 1;
+		conn->rbuf_len += rc;
+	}
+
+recv_err:
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+		       errno == EINTR))
 		return;
-	} 
 
-	/* remove the state */
-	list_move(&prv->curr_reply_req->queue, &prv->free_reqs);
-	prv->nr_free_count++;
+	if (rc == 0)
+		ERROR("Server shutdown prematurely");
+	else
+		ERROR("Error reading reply: %s", strerror(errno));
 
-	prv->cur_reply_qio.so_far = 0;
-	if (prv->curr_reply_req->timeout_event >= 0) {
-		tapdisk_server_unregister_event(
-				prv->curr_reply_req->timeout_event);
-	}
+	tdnbd_conn_fail(conn);
+}
 
-	prv->curr_reply_req = NULL;
+static void
+tdnbd_neg_expect(struct tdnbd_neg *neg, int state, size_t len)
+{
+	neg->state = state;
+	neg->in_len = 0;
+	neg->want = len;
+}
 
-	/*
-	 * NB: do this here otherwise we cancel the request that has just been 
-	 * moved
-	 */
-	if (do_disable)
-		tdnbd_disable(prv, EIO);
+static void
+tdnbd_neg_send(struct tdnbd_neg *neg, const void *buf, size_t len)
+{
+	memcpy(neg->out + neg->out_len, buf, len);
+	neg->out_len += len;
 }
 
-static int
-tdnbd_wait_read(int fd)
+static void
+tdnbd_neg_send_opt(struct tdnbd_neg *neg, uint32_t option)
 {
-	struct timeval select_tv;
-	fd_set socks;
-	int rc;
+	struct nbd_opt_header opt;
 
-	FD_ZERO(&socks);
-	FD_SET(fd, &socks);
-	select_tv.tv_sec = 10;
-	select_tv.tv_usec = 0;
-	rc = select(fd + 1, &socks, NULL, NULL, &select_tv);
-	return rc;
+	opt.magic  = htonll(NBD_OPTS_MAGIC);
+	opt.option = htonl(option);
+	opt.length = 0;
+
+	tdnbd_neg_send(neg, &opt, sizeof(opt));
 }
 
+/*
+ * Flush what is queued for the server and collect what the current state
+ * waits for. Returns 0 when both are done, -EAGAIN with neg->mode set
+ * when the socket has to become ready first, or another negative error.
+ */
 static int
-tdnbd_nbd_negotiate(struct tdnbd_data *prv, td_driver_t *driver)
+tdnbd_neg_xfer(struct tdnbd_conn *conn)
 {
-#define RECV_BUFFER_SIZE 256
-	int rc;
-	char buffer[RECV_BUFFER_SIZE];
-	uint64_t magic;
-	uint64_t size;
-	uint32_t flags;
-	int padbytes = 124;
-	int sock = prv->socket;
+	struct tdnbd_neg *neg = &conn->neg;
+	ssize_t rc;
+	int err;
 
-	/*
-	 * NBD negotiation protocol: 
-	 *
-	 * Server sends 'NBDMAGIC'
-	 * then it sends 0x00420281861253L
-	 * then it sends a 64 bit bigendian size
-	 * then it sends a 32 bit bigendian flags
-	 * then it sends 124 bytes of nothing
-	 */
+	while (neg->out_off < neg->out_len) {
+		rc = send(conn->socket, neg->out + neg->out_off,
+			  neg->out_len - neg->out_off, MSG_NOSIGNAL);
+		if (rc < 0) {
+			err = errno;
+			if (err == EINTR)
+				continue;
 
-	/*
-	 * We need to limit the time we spend in this function as we're still
-	 * using blocking IO at this point
-	 */
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
-	}
+			if (err == EAGAIN || err == EWOULDBLOCK) {
+				neg->mode = SCHEDULER_POLL_WRITE_FD;
+				return -EAGAIN;
+			}
 
-	rc = recv(sock, buffer, 8, 0);
-	if (rc < 8) {
-		ERROR("Short read in negotiation(1) (%d)\n", rc);
-		close(sock);
-		return -1;
-	}
+			ERROR("Short write in negotiation: %s", strerror(err));
+			return -err;
+		}
 
-	if (memcmp(buffer, "NBDMAGIC", 8) != 0) {
-		buffer[8] = 0;
-		ERROR("Error in NBD negotiation: got '%s'", buffer);
-		close(sock);
-		return -1;
+		neg->out_off += rc;
 	}
 
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
-	}
+	neg->out_off = neg->out_len = 0;
 
-	rc = recv(sock, &magic, sizeof(magic), 0);
-	if (rc < 8) {
-		ERROR("Short read in negotiation(2) (%d)\n", rc);
+	while (neg->in_len < neg->want) {
+		rc = recv(conn->socket, neg->in + neg->in_len,
+			  neg->want - neg->in_len, 0);
+		if (rc < 0) {
+			err = errno;
+			if (err == EINTR)
+				continue;
 
-		return -1;
-	}
+			if (err == EAGAIN || err == EWOULDBLOCK) {
+				neg->mode = SCHEDULER_POLL_READ_FD;
+				return -EAGAIN;
+			}
 
-	if (ntohll(magic) != NBD_NEGOTIATION_MAGIC) {
-		ERROR("Not enough magic in negotiation(2) (%"PRIu64")\n",
-				ntohll(magic));
-		close(sock);
-		return -1;
-	}
+			ERROR("Short read in negotiation(%d): %s",
+			      neg->state, strerror(err));
+			return -err;
+		}
 
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
-	}
+		if (rc == 0) {
+			ERROR("Short read in negotiation(%d): closed",
+			      neg->state);
+			return -ECONNRESET;
+		}
 
-	rc = recv(sock, &size, sizeof(size), 0);
-	if (rc < sizeof(size)) {
-		ERROR("Short read in negotiation(3) (%d)\n", rc);
-		close(sock);
-		return -1;
+		neg->in_len += rc;
 	}
 
-	INFO("Got size: %"PRIu64"", ntohll(size));
+	return 0;
+}
 
-	driver->info.size = ntohll(size) >> SECTOR_SHIFT;
-	driver->info.sector_size = DEFAULT_SECTOR_SIZE;
-	driver->info.info = 0;
+/*
+ * NBD negotiation protocol:
+ *
+ * Server sends 'NBDMAGIC'
+ * then it sends 0x00420281861253L
+ * then it sends a 64 bit bigendian size
+ * then it sends a 32 bit bigendian flags
+ * then it sends 124 bytes of nothing
+ *
+ * or, for newstyle servers, 'IHAVEOPT' instead of the magic number and 16
+ * bits of handshake flags. We answer with ours, upgrade to TLS if
+ * configured, and ask for the default export with NBD_OPT_EXPORT_NAME. The
+ * server replies with the 64 bit size, 16 bits of transmission flags and,
+ * unless we agreed on NO_ZEROES, the 124 bytes of nothing.
+ *
+ * Runs as far as the socket lets it. Returns 0 once the export is ready,
+ * -EAGAIN when it has to wait for neg->mode, or another negative error.
+ */
+static int
+tdnbd_neg_step(struct tdnbd_conn *conn)
+{
+	struct tdnbd_neg *neg = &conn->neg;
+	struct nbd_opt_reply reply;
+	uint64_t magic;
+	uint32_t cflags, oflags;
+	uint16_t hflags, tflags;
+	socklen_t len;
+	int err;
+
+	for (;;) {
+		switch (neg->state) {
+		case TDNBD_NEG_CONNECT:
+			len = sizeof(err);
+			if (getsockopt(conn->socket, SOL_SOCKET, SO_ERROR,
+				       &err, &len) < 0)
+				err = errno;
+			if (err) {
+				ERROR("Could not connect to peer: %s",
+				      strerror(err));
+				return -err;
+			}
 
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
-	}
+			tdnbd_neg_expect(neg, TDNBD_NEG_MAGIC, 16);
+			continue;
 
-	rc = recv(sock, &flags, sizeof(flags), 0);
-	if (rc < sizeof(flags)) {
-		ERROR("Short read in negotiation(4) (%d)\n", rc);
-		close(sock);
-		return -1;
+		case TDNBD_NEG_TLS:
+			err = tapdisk_nbd_tls_step(neg->ssl);
+			if (err > 0) {
+				neg->mode = err == TAPDISK_NBD_TLS_WANT_READ ?
+					SCHEDULER_POLL_READ_FD :
+					SCHEDULER_POLL_WRITE_FD;
+				return -EAGAIN;
+			}
+			if (err)
+				return err;
+
+			tapdisk_nbd_tls_free(neg->ssl);
+			neg->ssl = NULL;
+
+			tdnbd_neg_send_opt(neg, TAPDISK_NBD_OPT_EXPORT_NAME);
+			tdnbd_neg_expect(neg, TDNBD_NEG_EXPORT, 10);
+			continue;
+		}
+
+		err = tdnbd_neg_xfer(conn);
+		if (err)
+			return err;
+
+		switch (neg->state) {
+		case TDNBD_NEG_MAGIC:
+			if (memcmp(neg->in, "NBDMAGIC", 8) != 0) {
+				neg->in[8] = 0;
+				ERROR("Error in NBD negotiation: got '%s'",
+				      neg->in);
+				return -EPROTO;
+			}
+
+			memcpy(&magic, neg->in + 8, sizeof(magic));
+
+			switch (ntohll(magic)) {
+			case NBD_NEGOTIATION_MAGIC:
+				if (neg->tls) {
+					ERROR("Oldstyle server cannot do TLS");
+					return -EPROTO;
+				}
+				tdnbd_neg_expect(neg, TDNBD_NEG_OLD_EXPORT, 12);
+				break;
+
+			case NBD_OPTS_MAGIC:
+				tdnbd_neg_expect(neg, TDNBD_NEG_HFLAGS, 2);
+				break;
+
+			default:
+				ERROR("Not enough magic in negotiation(2) "
+				      "(%"PRIu64")", ntohll(magic));
+				return -EPROTO;
+			}
+			break;
+
+		case TDNBD_NEG_OLD_EXPORT:
+			memcpy(&neg->size, neg->in, 8);
+			memcpy(&oflags, neg->in + 8, 4);
+			neg->size  = ntohll(neg->size);
+			neg->flags = ntohl(oflags);
+
+			tdnbd_neg_expect(neg, TDNBD_NEG_PAD, neg->padbytes);
+			break;
+
+		case TDNBD_NEG_HFLAGS:
+			memcpy(&hflags, neg->in, 2);
+			hflags = ntohs(hflags);
+
+			/* options can only be refused by fixed newstyle servers */
+			if (neg->tls &&
+			    !(hflags & TAPDISK_NBD_FLAG_FIXED_NEWSTYLE)) {
+				ERROR("Server cannot do TLS");
+				return -EPROTO;
+			}
+
+			cflags = hflags & (TAPDISK_NBD_FLAG_FIXED_NEWSTYLE |
+					   TAPDISK_NBD_FLAG_NO_ZEROES);
+			if (cflags & TAPDISK_NBD_FLAG_NO_ZEROES)
+				neg->padbytes = 0;
+			cflags = htonl(cflags);
+			tdnbd_neg_send(neg, &cflags, sizeof(cflags));
+
+			if (neg->tls) {
+				tdnbd_neg_send_opt(neg,
+						   TAPDISK_NBD_OPT_STARTTLS);
+				tdnbd_neg_expect(neg, TDNBD_NEG_STARTTLS,
+						 sizeof(reply));
+			} else {
+				tdnbd_neg_send_opt(neg,
+						   TAPDISK_NBD_OPT_EXPORT_NAME);
+				tdnbd_neg_expect(neg, TDNBD_NEG_EXPORT, 10);
+			}
+			break;
+
+		case TDNBD_NEG_STARTTLS:
+			memcpy(&reply, neg->in, sizeof(reply));
+			if (ntohll(reply.magic) != NBD_OPT_REPLY_MAGIC ||
+			    ntohl(reply.option) != TAPDISK_NBD_OPT_STARTTLS ||
+			    ntohl(reply.length) > sizeof(neg->in)) {
+				ERROR("Bad reply to STARTTLS");
+				return -EPROTO;
+			}
+
+			neg->rep_type = ntohl(reply.type);
+			tdnbd_neg_expect(neg, TDNBD_NEG_STARTTLS_DATA,
+					 ntohl(reply.length));
+			break;
+
+		case TDNBD_NEG_STARTTLS_DATA:
+			if (neg->rep_type != TAPDISK_NBD_REP_ACK) {
+				ERROR("Server refused TLS (0x%x)",
+				      neg->rep_type);
+				return -EPROTO;
+			}
+
+			err = tapdisk_nbd_tls_start(conn->socket,
+						    TAPDISK_NBD_TLS_CLIENT,
+						    conn->prv->peer_ip,
+						    &neg->ssl);
+			if (err)
+				return err;
+
+			tdnbd_neg_expect(neg, TDNBD_NEG_TLS, 0);
+			break;
+
+		case TDNBD_NEG_EXPORT:
+			memcpy(&neg->size, neg->in, 8);
+			memcpy(&tflags, neg->in + 8, 2);
+			neg->size  = ntohll(neg->size);
+			neg->flags = ntohs(tflags);
+
+			tdnbd_neg_expect(neg, TDNBD_NEG_PAD, neg->padbytes);
+			break;
+
+		case TDNBD_NEG_PAD:
+			tdnbd_neg_expect(neg, TDNBD_NEG_DONE, 0);
+			return 0;
+
+		default:
+			return -EINVAL;
+		}
 	}
+}
+
+/*
+ * The first connection has to tell the size before td_open returns, so
+ * open waits for it here; it is bounded the same way as on the scheduler.
+ */
+static int
+tdnbd_neg_run(struct tdnbd_conn *conn)
+{
+	struct pollfd pfd;
+	int err, rc;
+
+	pfd.fd = conn->socket;
 
-	INFO("Got flags: %"PRIu32"", ntohl(flags));
+	for (;;) {
+		pfd.events = conn->neg.mode == SCHEDULER_POLL_READ_FD ?
+			POLLIN : POLLOUT;
 
-	while (padbytes > 0) {
-		if (tdnbd_wait_read(sock) <= 0) {
+		rc = poll(&pfd, 1, NBD_TIMEOUT * 1000);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return -errno;
+		if (rc == 0) {
 			ERROR("Timeout in nbd_negotiate");
-			close(sock);
-			return -1;
+			return -ETIMEDOUT;
 		}
 
-		rc = recv(sock, buffer, padbytes, 0);
-		if (rc < 0) {
-			ERROR("Bad read in negotiation(5) (%d)\n", rc);
-			close(sock);
-			return -1;
-		}
-		padbytes -= rc;
+		err = tdnbd_neg_step(conn);
+		if (err != -EAGAIN)
+			return err;
 	}
+}
 
-	INFO("Successfully connected to NBD server");
+static int tdnbd_conn_ready(struct tdnbd_conn *conn);
+static void tdnbd_neg_cb(event_id_t id, char mode, void *data);
 
-	fcntl(sock, F_SETFL, O_NONBLOCK);
+static int
+tdnbd_neg_wait(struct tdnbd_conn *conn)
+{
+	struct tdnbd_neg *neg = &conn->neg;
 
-	return 0;
+	if (neg->event_id >= 0)
+		tapdisk_server_unregister_event(neg->event_id);
+
+	neg->event_id =
+		tapdisk_server_register_event(neg->mode |
+				SCHEDULER_POLL_TIMEOUT,
+				conn->socket, TV_SECS(NBD_TIMEOUT),
+				tdnbd_neg_cb, conn);
+
+	return neg->event_id;
 }
 
+/*
+ * Further connections negotiate on the scheduler. A quiet server times
+ * them out after NBD_TIMEOUT seconds without progress.
+ */
+static void
+tdnbd_neg_cb(event_id_t id, char mode, void *data)
+{
+	struct tdnbd_conn *conn = data;
+	char wait = conn->neg.mode;
+	int err;
+
+	if (!(mode & wait)) {
+		ERROR("Timeout negotiating connection %d", conn->id);
+		err = -ETIMEDOUT;
+	} else
+		err = tdnbd_neg_step(conn);
+
+	if (err == -EAGAIN) {
+		if (conn->neg.mode == wait)
+			return;
+
+		err = tdnbd_neg_wait(conn);
+		if (err >= 0)
+			return;
+	}
+
+	if (conn->neg.event_id >= 0) {
+		tapdisk_server_unregister_event(conn->neg.event_id);
+		conn->neg.event_id = -1;
+	}
+
+	if (!err)
+		err = tdnbd_conn_ready(conn);
+
+	if (err)
+		tdnbd_conn_fail(conn);
+}
+
+/*
+ * Sockets are non-blocking from the start, a connect in progress is
+ * finished by the negotiation.
+ */
 static int
-tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
+tdnbd_connect_tcp(struct tdnbd_data *prv)
 {
 	int sock;
 	int opt = 1;
 	int rc;
 
-	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
 	if (sock < 0) {
 		ERROR("Could not create socket: %s\n", strerror(errno));
 		return -1;
@@ -679,60 +1282,385 @@ tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
 			sizeof(opt));
 	if (rc < 0) {
 		ERROR("Could not set TCP_NODELAY: %s\n", strerror(errno));
+		close(sock);
 		return -1;
 	}
 
-	prv->remote = (struct sockaddr_in *)malloc(
-			sizeof(struct sockaddr_in));
 	if (!prv->remote) {
-		ERROR("struct sockaddr_in malloc failure\n");
+		prv->remote = (struct sockaddr_in *)malloc(
+				sizeof(struct sockaddr_in));
+		if (!prv->remote) {
+			ERROR("struct sockaddr_in malloc failure\n");
+			close(sock);
+			return -1;
+		}
+		prv->remote->sin_family = AF_INET;
+		rc = inet_pton(AF_INET, prv->peer_ip,
+				&(prv->remote->sin_addr.s_addr));
+		if (rc < 0) {
+			ERROR("Could not create inaddr: %s\n", strerror(errno));
+			free(prv->remote);
+			prv->remote = NULL;
+			close(sock);
+			return -1;
+		}
+		else if (rc == 0) {
+			ERROR("inet_pton parse error\n");
+			free(prv->remote);
+			prv->remote = NULL;
+			close(sock);
+			return -1;
+		}
+		prv->remote->sin_port = htons(prv->port);
+	}
+
+	if (connect(sock, (struct sockaddr *)prv->remote,
+				sizeof(struct sockaddr)) < 0 &&
+	    errno != EINPROGRESS) {
+		ERROR("Could not connect to peer: %s\n", strerror(errno));
 		close(sock);
 		return -1;
 	}
-	prv->remote->sin_family = AF_INET;
-	rc = inet_pton(AF_INET, prv->peer_ip, &(prv->remote->sin_addr.s_addr));
-	if (rc < 0) {
-		ERROR("Could not create inaddr: %s\n", strerror(errno));
-		free(prv->remote);
-		prv->remote = NULL;
-		close(sock);
+
+	return sock;
+}
+
+static int
+tdnbd_connect_unix(struct tdnbd_data *prv)
+{
+	int sock, len;
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+		ERROR("failed to create UNIX domain socket: %s\n",
+				strerror(errno));
 		return -1;
 	}
-	else if (rc == 0) {
-		ERROR("inet_pton parse error\n");
-		free(prv->remote);
-		prv->remote = NULL;
+
+	len = strlen(prv->remote_un.sun_path)
+		+ sizeof(prv->remote_un.sun_family);
+	if (connect(sock, (struct sockaddr*)&prv->remote_un, len) == -1 &&
+	    errno != EINPROGRESS) {
+		ERROR("failed to connect to %s: %s\n",
+		      prv->remote_un.sun_path, strerror(errno));
 		close(sock);
 		return -1;
 	}
-	prv->remote->sin_port = htons(prv->port);
 
-	if (connect(sock, (struct sockaddr *)prv->remote,
-				sizeof(struct sockaddr)) < 0) {
-		ERROR("Could not connect to peer: %s\n", strerror(errno));
+	return sock;
+}
+
+/*
+ * Takes a slot for a connection about to negotiate, starting in state
+ * (a passed fd is connected already).
+ */
+static struct tdnbd_conn *
+tdnbd_conn_init(struct tdnbd_data *prv, int sock, int state)
+{
+	struct tdnbd_conn *conn;
+	char *rbuf;
+	int c;
+
+	/* the slot of a lost connection, else a new one */
+	for (c = 0; c < prv->nr_conns; c++)
+		if (prv->conns[c].dead)
+			break;
+	if (c == TDNBD_MAX_CONNS)
+		return NULL;
+
+	conn = &prv->conns[c];
+	rbuf = c < prv->nr_conns ? conn->rbuf : NULL;
+
+	memset(conn, 0, sizeof(*conn));
+	conn->prv = prv;
+	conn->id = c;
+	conn->socket = sock;
+	conn->writer_event_id = -1;
+	conn->reader_event_id = -1;
+	INIT_LIST_HEAD(&conn->sent_reqs);
+	INIT_LIST_HEAD(&conn->pending_reqs);
+
+	conn->rbuf = rbuf ? : malloc(TDNBD_RBUF_SIZE);
+	if (!conn->rbuf) {
+		ERROR("Failed to allocate a receive buffer");
+		conn->dead = 1;
+		return NULL;
+	}
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	conn->neg.event_id = -1;
+	conn->neg.tls = tapdisk_nbd_tls_enabled(TAPDISK_NBD_TLS_CLIENT);
+	conn->neg.padbytes = 124;
+	tdnbd_neg_expect(&conn->neg, state,
+			 state == TDNBD_NEG_MAGIC ? 16 : 0);
+	conn->neg.mode = state == TDNBD_NEG_CONNECT ?
+		SCHEDULER_POLL_WRITE_FD : SCHEDULER_POLL_READ_FD;
+
+	if (c == prv->nr_conns)
+		prv->nr_conns++;
+	prv->nr_pending++;
+
+	return conn;
+}
+
+static uint64_t
+tdnbd_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+tdnbd_count_waiting(struct tdnbd_data *prv)
+{
+	struct td_nbd_request *pos;
+	int n = 0;
+
+	list_for_each_entry(pos, &prv->wait_reqs, queue)
+		n++;
+
+	return n;
+}
+
+static void
+tdnbd_reconnect_cb(event_id_t id, char mode, void *data)
+{
+	struct tdnbd_data *prv = data;
+	struct tdnbd_conn *conn;
+	int sock;
+
+	tapdisk_server_unregister_event(prv->reconnect_event);
+	prv->reconnect_event = -1;
+
+	sock = prv->peer_ip ? tdnbd_connect_tcp(prv) :
+		tdnbd_connect_unix(prv);
+	if (sock < 0)
+		goto again;
+
+	conn = tdnbd_conn_init(prv, sock, TDNBD_NEG_CONNECT);
+	if (!conn) {
 		close(sock);
-		return -1;
+		goto again;
+	}
+
+	/* from here, a failure comes back through tdnbd_conn_fail */
+	if (tdnbd_neg_wait(conn) < 0)
+		tdnbd_conn_fail(conn);
+
+	return;
+
+again:
+	if (tdnbd_reconnect(prv))
+		tdnbd_disable(prv, EIO);
+}
+
+/*
+ * With no connection left, try for a new one after a delay doubling
+ * from TDNBD_RECONNECT_MIN_MS to TDNBD_RECONNECT_MAX_MS, for up to
+ * TAPDISK3_NBD_RECONNECT seconds (NBD_TIMEOUT by default, 0 not to).
+ * A passed fd cannot be had again. The new connection negotiates the
+ * export again, and must find it as it was.
+ */
+static int
+tdnbd_reconnect(struct tdnbd_data *prv)
+{
+	uint64_t now = tdnbd_now_ms(), delay;
+
+	if (!prv->reconnect_secs || prv->name || prv->closed)
+		return -ENOTCONN;
+
+	if (!prv->reconnect_delay) {
+		ERROR("Lost the server, reconnecting for up to %d s",
+		      prv->reconnect_secs);
+		prv->reconnect_since = now;
+		delay = TDNBD_RECONNECT_MIN_MS;
+	} else {
+		if (now - prv->reconnect_since >=
+		    prv->reconnect_secs * 1000ULL) {
+			ERROR("Could not reconnect in %d s, giving up",
+			      prv->reconnect_secs);
+			return -ETIMEDOUT;
+		}
+		delay = MIN(prv->reconnect_delay << 1, TDNBD_RECONNECT_MAX_MS);
+	}
+
+	prv->reconnect_delay = delay;
+	prv->reconnect_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+				TV_USECS(delay * 1000),
+				tdnbd_reconnect_cb, prv);
+
+	return prv->reconnect_event < 0 ? prv->reconnect_event : 0;
+}
+
+/*
+ * A negotiated connection starts taking requests, beginning with those
+ * which waited for one.
+ */
+static int
+tdnbd_conn_ready(struct tdnbd_conn *conn)
+{
+	struct tdnbd_data *prv = conn->prv;
+	struct td_nbd_request *pos, *q;
+
+	if (conn->neg.size != prv->size || conn->neg.flags != prv->nbd_flags) {
+		ERROR("Connection %d disagrees on the export "
+		      "(size %"PRIu64", flags 0x%x)",
+		      conn->id, conn->neg.size, conn->neg.flags);
+		return -EINVAL;
+	}
+
+	conn->reader_event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+				conn->socket, TV_ZERO,
+				tdnbd_reader_cb,
+				(void *)conn);
+	if (conn->reader_event_id < 0)
+		return conn->reader_event_id;
+
+	conn->ready = 1;
+	prv->nr_pending--;
+	prv->nr_live++;
+
+	INFO("Connection %d is up, %d in use", conn->id, prv->nr_live);
+
+	if (prv->reconnect_delay) {
+		INFO("Reconnected after %"PRIu64" ms, resending %d requests",
+		     tdnbd_now_ms() - prv->reconnect_since,
+		     tdnbd_count_waiting(prv));
+		prv->reconnect_delay = 0;
 	}
 
-	prv->socket = sock;
+	list_for_each_entry_safe(pos, q, &prv->wait_reqs, queue)
+		tdnbd_dispatch(prv, pos);
 
-	return tdnbd_nbd_negotiate(prv, driver);
+	return 0;
+}
+
+/*
+ * A server advertising multi-conn keeps what it acknowledged on one
+ * connection visible on all the others, so we may open a few more to the
+ * same export and spread the requests over more than one TCP flow. They
+ * negotiate in the background and join as they come up; any of them
+ * failing just leaves us with fewer.
+ */
+static void
+tdnbd_open_conns(struct tdnbd_data *prv)
+{
+	struct tdnbd_conn *conn;
+	const char *val;
+	int n, sock;
+
+	val = getenv("TAPDISK3_NBD_CONNECTIONS");
+	n = val ? atoi(val) : TDNBD_DEFAULT_CONNS;
+	n = MIN(n, TDNBD_MAX_CONNS);
+
+	while (prv->nr_conns < n) {
+		sock = prv->peer_ip ? tdnbd_connect_tcp(prv) :
+			tdnbd_connect_unix(prv);
+		if (sock < 0)
+			break;
+
+		conn = tdnbd_conn_init(prv, sock, TDNBD_NEG_CONNECT);
+		if (!conn) {
+			close(sock);
+			break;
+		}
+
+		if (tdnbd_neg_wait(conn) < 0) {
+			tdnbd_conn_fail(conn);
+			break;
+		}
+	}
+
+	INFO("Opening %d more connections", prv->nr_pending);
 }
 
 /* -- interface -- */
 
 static int tdnbd_close(td_driver_t*);
 
+static int
+tdnbd_grow_requests(struct tdnbd_data *prv, int nr)
+{
+	struct tdnbd_request_slab *slab;
+	int i, n;
+
+	n = nr - prv->nr_requests;
+	if (n <= 0)
+		return 0;
+
+	slab = calloc(1, sizeof(*slab) + n * sizeof(struct td_nbd_request));
+	if (!slab)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		INIT_LIST_HEAD(&slab->reqs[i].queue);
+		slab->reqs[i].timeout_event = -1;
+		list_add(&slab->reqs[i].queue, &prv->free_reqs);
+	}
+
+	slab->next = prv->slabs;
+	prv->slabs = slab;
+	prv->nr_free_count += n;
+	prv->nr_requests = nr;
+
+	return 0;
+}
+
+/*
+ * Requests are pipelined to the server, so keep twice the data segments
+ * the rings may have in flight, as with MAX_NBD_REQS.
+ */
+static int
+tdnbd_set_depth(td_driver_t *driver, int nr)
+{
+	struct tdnbd_data *prv = (struct tdnbd_data *)driver->data;
+
+	if (getenv("TAPDISK3_NBD_CLIENT_REQUESTS"))
+		return 0;
+
+	return tdnbd_grow_requests(prv, nr << 1);
+}
+
+static void
+tdnbd_free(struct tdnbd_data *prv)
+{
+	struct tdnbd_request_slab *slab, *next;
+	int c;
+
+	for (c = 0; c < prv->nr_conns; c++) {
+		free(prv->conns[c].rbuf);
+		prv->conns[c].rbuf = NULL;
+	}
+	prv->nr_conns = 0;
+
+	for (slab = prv->slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+	prv->slabs = NULL;
+	prv->nr_requests = 0;
+	free(prv->remote);
+	prv->remote = NULL;
+}
+
 static int
 tdnbd_open(td_driver_t* driver, const char* name,
 	   struct td_vbd_encryption *encryption, td_flag_t flags)
 {
 	struct tdnbd_data *prv;
+	struct tdnbd_conn *conn;
 	char peer_ip[256];
 	int port;
 	int rc;
 	int i;
+	int sock;
+	int state = TDNBD_NEG_CONNECT;
 	struct stat buf;
+	const char *val;
 
 	driver->info.sector_size = 512;
 	driver->info.info = 0;
@@ -742,80 +1670,95 @@ tdnbd_open(td_driver_t* driver, const char* name,
 
 	INFO("Opening nbd export to %s (flags=%x)\n", name, flags);
 
-	prv->writer_event_id = -1;
-	INIT_LIST_HEAD(&prv->sent_reqs);
-	INIT_LIST_HEAD(&prv->pending_reqs);
 	INIT_LIST_HEAD(&prv->free_reqs);
-	for (i = 0; i < MAX_NBD_REQS; i++) {
-		INIT_LIST_HEAD(&prv->requests[i].queue);
-		prv->requests[i].timeout_event = -1;
-		list_add(&prv->requests[i].queue, &prv->free_reqs);
+	INIT_LIST_HEAD(&prv->wait_reqs);
+	prv->reconnect_event = -1;
+
+	val = getenv("TAPDISK3_NBD_RECONNECT");
+	prv->reconnect_secs = val ? atoi(val) : NBD_TIMEOUT;
+	if (prv->reconnect_secs < 0)
+		prv->reconnect_secs = 0;
+
+	val = getenv("TAPDISK3_NBD_CLIENT_REQUESTS");
+	i = val ? atoi(val) : 0;
+	if (i <= 0)
+		i = MAX_NBD_REQS;
+
+	rc = tdnbd_grow_requests(prv, i);
+	if (rc) {
+		ERROR("Failed to allocate the request pool");
+		return rc;
 	}
-	prv->nr_free_count = MAX_NBD_REQS;
-	prv->cur_reply_qio.buffer = (char *)&prv->current_reply;
-	prv->cur_reply_qio.len = sizeof(struct nbd_reply);
 
 	bzero(&buf, sizeof(buf));
 	rc = stat(name, &buf);
 	if (!rc && S_ISSOCK(buf.st_mode)) {
-		int len = 0;
-		if ((prv->socket = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-			ERROR("failed to create UNIX domain socket: %s\n",
-					strerror(errno));
-			return -1;
-		}
 		prv->remote_un.sun_family = AF_UNIX;
 		strcpy(prv->remote_un.sun_path, name);
-		len = strlen(prv->remote_un.sun_path)
-			+ sizeof(prv->remote_un.sun_family);
-		if ((rc = connect(prv->socket, (struct sockaddr*)&prv->remote_un, len)
-					== -1)) {
-			ERROR("failed to connect to %s: %s\n", name, strerror(errno));
-			return -1;
-		}
-		rc = tdnbd_nbd_negotiate(prv, driver);
-		if (rc) {
-			ERROR("failed to negotiate with the NBD server\n");
-			return -1;
-		}
+		sock = tdnbd_connect_unix(prv);
+		if (sock < 0)
+			goto fail;
 	} else {
 		rc = sscanf(name, "%255[^:]:%d", peer_ip, &port);
 		if (rc == 2) {
 			prv->peer_ip = malloc(strlen(peer_ip) + 1);
 			if (!prv->peer_ip) {
 				ERROR("Failure to malloc for NBD destination");
-				return -1;
+				goto fail;
 			}
 			strcpy(prv->peer_ip, peer_ip);
 			prv->port = port;
 			prv->name = NULL;
 			INFO("Export peer=%s port=%d\n", prv->peer_ip, prv->port);
-			if (tdnbd_connect_import_session(prv, driver) < 0)
-				return -1;
+			sock = tdnbd_connect_tcp(prv);
+			if (sock < 0)
+				goto fail;
 
 		} else {
-			prv->socket = tdnbd_retrieve_passed_fd(name);
-			if (prv->socket < 0) {
+			sock = tdnbd_retrieve_passed_fd(name);
+			if (sock < 0) {
 				ERROR("Couldn't find fd named: %s", name);
-				return -1;
+				goto fail;
 			}
 			INFO("Found passed fd. Connecting...");
+			state = TDNBD_NEG_MAGIC;
 			prv->remote = NULL;
 			prv->peer_ip = NULL;
 			prv->name = strdup(name);
 			prv->port = -1;
-			if (tdnbd_nbd_negotiate(prv, driver) < 0) {
-				ERROR("Failed to negotiate");
-				return -1;
-			}
 		}
 	}
 
-	prv->reader_event_id =
-		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-				prv->socket, TV_ZERO,
-				tdnbd_reader_cb,
-				(void *)prv);
+	conn = tdnbd_conn_init(prv, sock, state);
+	if (!conn) {
+		close(sock);
+		goto fail;
+	}
+
+	if (tdnbd_neg_run(conn)) {
+		ERROR("failed to negotiate with the NBD server\n");
+		goto fail;
+	}
+
+	prv->size = conn->neg.size;
+	prv->nbd_flags = conn->neg.flags;
+	INFO("Got size: %"PRIu64"", prv->size);
+	INFO("Got flags: %"PRIu32"", prv->nbd_flags);
+
+	if (tdnbd_conn_ready(conn))
+		goto fail;
+
+	INFO("Successfully connected to NBD server");
+
+	driver->info.size = prv->size >> SECTOR_SHIFT;
+	driver->info.sector_size = DEFAULT_SECTOR_SIZE;
+	driver->info.info = 0;
+
+	/* a passed fd is all we get */
+	if (!prv->name &&
+	    (prv->nbd_flags & TAPDISK_NBD_FLAG_HAS_FLAGS) &&
+	    (prv->nbd_flags & TAPDISK_NBD_FLAG_CAN_MULTI_CONN))
+		tdnbd_open_conns(prv);
 
 	prv->flags = flags;
 	prv->closed = 0;
@@ -826,51 +1769,93 @@ tdnbd_open(td_driver_t* driver, const char* name,
 
 	return 0;
 
+fail:
+	for (i = 0; i < prv->nr_conns; i++)
+		if (!prv->conns[i].dead)
+			tdnbd_conn_close(&prv->conns[i]);
+	free(prv->peer_ip);
+	prv->peer_ip = NULL;
+	free(prv->name);
+	prv->name = NULL;
+	tdnbd_free(prv);
+	return -1;
 }
 
 static int
 tdnbd_close(td_driver_t* driver)
 {
 	struct tdnbd_data *prv = (struct tdnbd_data *)driver->data;
+	struct tdnbd_conn *conn;
 	td_request_t treq;
+	int c;
 
 	bzero(&treq, sizeof(treq));
 
 	if (prv->closed == 3) {
 		INFO("NBD close: already decided that the connection is dead.");
-		if (prv->socket >= 0)
-			close(prv->socket);
-		prv->socket = -1;
+		for (c = 0; c < prv->nr_conns; c++) {
+			conn = &prv->conns[c];
+			if (conn->socket >= 0)
+				close(conn->socket);
+			conn->socket = -1;
+		}
+		tdnbd_free(prv);
 		return 0;
 	}
 
 	/* Send a close packet */
 
-	INFO("Sending disconnect request");
-	tdnbd_queue_request(prv, TAPDISK_NBD_CMD_DISC, 0, 0, 0, treq, 0);
+	for (c = 0; c < prv->nr_conns; c++) {
+		conn = &prv->conns[c];
+		if (conn->dead)
+			continue;
+
+		/* still negotiating, there is nothing to say yet */
+		if (!conn->ready) {
+			tdnbd_conn_close(conn);
+			prv->nr_pending--;
+			continue;
+		}
 
-	INFO("Switching socket to blocking IO mode");
-	fcntl(prv->socket, F_SETFL, fcntl(prv->socket, F_GETFL) & ~O_NONBLOCK);
+		INFO("Sending disconnect request on connection %d", c);
+		tdnbd_queue_request(prv, conn, TAPDISK_NBD_CMD_DISC,
+				    0, 0, 0, treq, 0);
 
-	INFO("Writing disconnection request");
-	tdnbd_writer_cb(0, 0, prv);
+		INFO("Switching socket to blocking IO mode");
+		fcntl(conn->socket, F_SETFL,
+		      fcntl(conn->socket, F_GETFL) & ~O_NONBLOCK);
+
+		INFO("Writing disconnection request");
+		tdnbd_writer_cb(0, 0, conn);
+	}
 
 	INFO("Written");
 
+	if (prv->closed != 3)
+		tdnbd_disable(prv, EIO);
+
 	if (prv->peer_ip) {
 		free(prv->peer_ip);
 		prv->peer_ip = NULL;
 	}
 
-	if (prv->name) {
-		tdnbd_stash_passed_fd(prv->socket, prv->name, 0);
-		free(prv->name);
-	} else {
-		if (prv->socket >= 0)
-			close(prv->socket);
-		prv->socket = -1;
+	for (c = 0; c < prv->nr_conns; c++) {
+		conn = &prv->conns[c];
+		if (conn->socket < 0)
+			continue;
+
+		if (prv->name)
+			tdnbd_stash_passed_fd(conn->socket, prv->name, 0);
+		else
+			close(conn->socket);
+		conn->socket = -1;
 	}
 
+	free(prv->name);
+	prv->name = NULL;
+
+	tdnbd_free(prv);
+
 	return 0;
 }
 
@@ -883,9 +1868,9 @@ tdnbd_queue_read(td_driver_t* driver, td_request_t treq)
 
 	if (prv->flags & TD_OPEN_SECONDARY)
 		td_forward_request(treq);
-	else
-		tdnbd_queue_request(prv, TAPDISK_NBD_CMD_READ, offset, treq.buf, size,
-				treq, 0);
+	else if (tdnbd_queue_request(prv, NULL, TAPDISK_NBD_CMD_READ, offset,
+				treq.buf, size, treq, 0) == -EBUSY)
+		td_complete_request(treq, -EBUSY);
 }
 
 static void
@@ -895,8 +1880,34 @@ tdnbd_queue_write(td_driver_t* driver, td_request_t treq)
 	int      size    = treq.secs * driver->info.sector_size;
 	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
 
-	tdnbd_queue_request(prv, TAPDISK_NBD_CMD_WRITE,
-			offset, treq.buf, size, treq, 0);
+	/* the zero writes of write-zeroes come in bursts, they may not fit */
+	if (tdnbd_queue_request(prv, NULL, TAPDISK_NBD_CMD_WRITE,
+			offset, treq.buf, size, treq, 0) == -EBUSY)
+		td_complete_request(treq, -EBUSY);
+}
+
+/*
+ * Servers which say so zero sectors without us sending the zeros.
+ */
+static void
+tdnbd_queue_write_zeroes(td_driver_t* driver, td_request_t treq)
+{
+	struct tdnbd_data *prv = (struct tdnbd_data *)driver->data;
+	uint64_t size    = treq.secs * (uint64_t)driver->info.sector_size;
+	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
+	int err;
+
+	if (!(prv->nbd_flags & TAPDISK_NBD_FLAG_HAS_FLAGS) ||
+	    !(prv->nbd_flags & TAPDISK_NBD_FLAG_SEND_WRITE_ZEROES) ||
+	    size > UINT32_MAX) {
+		td_queue_zero_writes(treq.image, treq);
+		return;
+	}
+
+	err = tdnbd_queue_request(prv, NULL, TAPDISK_NBD_CMD_WRITE_ZEROES,
+			offset, NULL, size, treq, 0);
+	if (err == -EBUSY)
+		td_complete_request(treq, err);
 }
 
 static int
@@ -920,6 +1931,8 @@ struct tap_disk tapdisk_nbd = {
 	.td_close           = tdnbd_close,
 	.td_queue_read      = tdnbd_queue_read,
 	.td_queue_write     = tdnbd_queue_write,
+	.td_queue_write_zeroes = tdnbd_queue_write_zeroes,
 	.td_get_parent_id   = tdnbd_get_parent_id,
 	.td_validate_parent = tdnbd_validate_parent,
+	.td_set_depth       = tdnbd_set_depth,
 };
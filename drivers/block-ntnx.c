@@ -31,6 +31,7 @@
 #undef NDEBUG
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <uuid/uuid.h>
@@ -55,20 +56,54 @@
 #define INITIATOR_PREFIX           "iqn.2016-06.com.nutanix:tapdisk-"
 #define NTNX_ISCSI_PORTAL          "127.0.0.1:3260"
 #define QUEUE_DEPTH TAPDISK_DATA_REQUESTS
+#define NTNX_MAX_SESSIONS          8
+
+struct tdntnx_session {
+    struct iscsi_session *session;
+    int inflight;
+};
 
 struct tdntnx_request {
     td_request_t treq;
     td_driver_t *driver;
+    struct tdntnx_session *sess;
     struct tdntnx_request *next;
 };
 
+/*
+ * Requests go round-robin over up to TAPDISK3_NTNX_SESSIONS sessions to
+ * the target, each taking at most its share of the queue depth, which is
+ * TAPDISK3_NTNX_QUEUE_DEPTH, or one ring's worth of requests.
+ */
 struct tdntnx_data {
-    struct iscsi_session *session;
+    struct tdntnx_session sessions[NTNX_MAX_SESSIONS];
+    int nr_sessions;
+    int next_session;
+    int session_depth;
+    int nr_slots;
     struct tdntnx_request *freelist;
-    struct tdntnx_request slots[QUEUE_DEPTH];
+    struct tdntnx_request *slots;
 };
 static const struct frodo_iscsi_interface *frodo;
 
+static int
+ntnx_env_int(const char *name, int def, int max)
+{
+    const char *val = getenv(name);
+    int n = val ? atoi(val) : 0;
+
+    if (n <= 0) {
+        n = def;
+    }
+    return n < max ? n : max;
+}
+
+static int
+ntnx_queue_depth(void)
+{
+    return ntnx_env_int("TAPDISK3_NTNX_QUEUE_DEPTH", QUEUE_DEPTH, 1 << 16);
+}
+
 static void
 event_callback(event_id_t event_id, char mode, void *data)
 {
@@ -101,7 +136,7 @@ block_ntnx_init(void)
     uuid_generate_random(initiator_uuid);
     uuid_unparse(initiator_uuid, initiator_name + strlen(initiator_name));
 
-    fd = frodo->init(initiator_name, QUEUE_DEPTH);
+    fd = frodo->init(initiator_name, ntnx_queue_depth());
     if (fd < 0) {
         EPRINTF("Failed to initialize libfrodoiscsi\n");
         goto err;
@@ -141,6 +176,25 @@ free_slot(struct tdntnx_data *prv, struct tdntnx_request *req)
     prv->freelist = req;
 }
 
+/* the next session with room for another command, if any */
+static struct tdntnx_session *
+next_session(struct tdntnx_data *prv)
+{
+    struct tdntnx_session *sess;
+    int i;
+
+    for (i = 0; i < prv->nr_sessions; i++) {
+        sess = &prv->sessions[prv->next_session];
+        prv->next_session = (prv->next_session + 1) % prv->nr_sessions;
+
+        if (sess->inflight < prv->session_depth) {
+            return sess;
+        }
+    }
+
+    return NULL;
+}
+
 static int
 iscsi_read_capacity_sync(struct iscsi_session *session, td_driver_t *driver)
 {
@@ -199,6 +253,7 @@ async_command_cb(void *ctx, int status, const uint8_t *sense, size_t sense_len)
         status = -EIO;
     }
 
+    req->sess->inflight--;
     td_complete_request(req->treq, status);
     free_slot(prv, req);
 }
@@ -226,12 +281,16 @@ queue_io(td_driver_t* driver, const td_request_t *treq, int write)
 
     if (req) {
         req->treq = *treq;
-
-        status = frodo->async_command(prv->session, 0, cdb,
-                                      req->treq.buf, bytes, write,
-                                      async_command_cb, req);
-        if (status == 0) {
-            return;
+        req->sess = next_session(prv);
+
+        if (req->sess) {
+            status = frodo->async_command(req->sess->session, 0, cdb,
+                                          req->treq.buf, bytes, write,
+                                          async_command_cb, req);
+            if (status == 0) {
+                req->sess->inflight++;
+                return;
+            }
         }
         free_slot(prv, req);
     }
@@ -247,7 +306,7 @@ tdntnx_open(td_driver_t* driver, const char* name,
 {
     struct tdntnx_data *prv = driver->data;
     static int initialized = 0;
-    int i;
+    int i, n, err;
 
     if (initialized == 0) {
         if (block_ntnx_init() < 0) {
@@ -257,34 +316,77 @@ tdntnx_open(td_driver_t* driver, const char* name,
     }
 
     DPRINTF("Creating iscsi session: %s %s\n", NTNX_ISCSI_PORTAL, name);
-    prv->session = frodo->session_create(NTNX_ISCSI_PORTAL, name);
-    if (!prv->session) {
+    prv->sessions[0].session = frodo->session_create(NTNX_ISCSI_PORTAL, name);
+    if (!prv->sessions[0].session) {
         return -ENOENT;
     }
-    if (iscsi_read_capacity_sync(prv->session, driver) != 0) {
+    prv->nr_sessions = 1;
+
+    if (iscsi_read_capacity_sync(prv->sessions[0].session, driver) != 0) {
         EPRINTF("Read capacity failed on target %s, closing session.\n", name);
-        frodo->session_destroy(prv->session);
-        return -ENOENT;
+        err = -ENOENT;
+        goto fail;
     }
 
     DPRINTF("Target %s has %ld sectors of %ld bytes\n",
             name, driver->info.size, driver->info.sector_size);
 
+    /* more sessions are optional, any failing leaves us with fewer */
+    n = ntnx_env_int("TAPDISK3_NTNX_SESSIONS", 1, NTNX_MAX_SESSIONS);
+    while (prv->nr_sessions < n) {
+        struct iscsi_session *session;
+
+        session = frodo->session_create(NTNX_ISCSI_PORTAL, name);
+        if (!session) {
+            EPRINTF("Target %s: session %d failed, using %d\n",
+                    name, prv->nr_sessions, prv->nr_sessions);
+            break;
+        }
+        prv->sessions[prv->nr_sessions++].session = session;
+    }
+
+    prv->nr_slots = ntnx_queue_depth();
+    prv->session_depth =
+        (prv->nr_slots + prv->nr_sessions - 1) / prv->nr_sessions;
+
+    prv->slots = calloc(prv->nr_slots, sizeof(*prv->slots));
+    if (!prv->slots) {
+        err = -ENOMEM;
+        goto fail;
+    }
+
     prv->freelist = NULL;
-    for (i = 0; i < QUEUE_DEPTH; i++) {
+    for (i = 0; i < prv->nr_slots; i++) {
         prv->slots[i].driver = driver;
         free_slot(prv, &prv->slots[i]);
     }
 
+    DPRINTF("Target %s: %d sessions, queue depth %d\n",
+            name, prv->nr_sessions, prv->nr_slots);
+
     return 0;
+
+ fail:
+    for (i = 0; i < prv->nr_sessions; i++) {
+        frodo->session_destroy(prv->sessions[i].session);
+    }
+    prv->nr_sessions = 0;
+    return err;
 }
 
 static int
 tdntnx_close(td_driver_t* driver)
 {
     struct tdntnx_data *prv = driver->data;
+    int i;
+
+    for (i = 0; i < prv->nr_sessions; i++) {
+        frodo->session_destroy(prv->sessions[i].session);
+    }
+    prv->nr_sessions = 0;
 
-    frodo->session_destroy(prv->session);
+    free(prv->slots);
+    prv->slots = NULL;
 
     return 0;
 }
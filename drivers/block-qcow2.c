@@ -0,0 +1,1426 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * qcow2 images, for disks VHD serves badly: clusters of 512 bytes to
+ * 2 MiB, no 2 TiB limit, and data kept apart from metadata rather than
+ * interleaved with per-block bitmaps.
+ *
+ * Guest data is read and written through the tapdisk queue. Metadata
+ * (L2 tables and refcount blocks) is cached and updated synchronously,
+ * ordered such that a crash can leak clusters but never point at one
+ * whose data or refcount is not yet on disk:
+ *
+ *   data -> refcount of the new cluster -> L2 entry -> L1 entry
+ *
+ * New clusters are only ever appended; freed ones are not reused.
+ * Images with internal snapshots, dirty or corrupt images and anything
+ * needing compression, encryption or an external data file are opened
+ * read-only or not at all.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <libgen.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include "list.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-stats.h"
+
+#define DBG(_level, _f, _a...) tlog_write(_level, _f, ##_a)
+#define ERR(_s, _err, _f, _a...) tlog_drv_error((_s)->driver, _err, _f, ##_a)
+
+#define MIN(a, b)                ((a) < (b) ? (a) : (b))
+#define MAX(a, b)                ((a) > (b) ? (a) : (b))
+#define DIV_ROUND_UP(n, d)       (((n) + (d) - 1) / (d))
+
+#define QCOW2_MAGIC              0x514649fb /* 'Q', 'F', 'I', 0xfb */
+#define QCOW2_MIN_CLUSTER_BITS   9
+#define QCOW2_MAX_CLUSTER_BITS   21
+#define QCOW2_HEADER_V2_LENGTH   72
+#define QCOW2_BACKING_NAME_MAX   1023
+
+#define QCOW2_INCOMPAT_DIRTY     (1ULL << 0)
+#define QCOW2_INCOMPAT_CORRUPT   (1ULL << 1)
+#define QCOW2_INCOMPAT_DATA_FILE (1ULL << 2)
+#define QCOW2_INCOMPAT_COMPRESS  (1ULL << 3)
+#define QCOW2_INCOMPAT_EXT_L2    (1ULL << 4)
+#define QCOW2_INCOMPAT_SUPPORTED QCOW2_INCOMPAT_COMPRESS
+
+#define QCOW2_EXT_END            0x00000000
+#define QCOW2_EXT_BACKING_FORMAT 0xe2792aca
+
+#define QCOW2_COPIED             (1ULL << 63)
+#define QCOW2_COMPRESSED         (1ULL << 62)
+#define QCOW2_ZERO               (1ULL << 0)
+#define QCOW2_OFFSET_MASK        0x00fffffffffffe00ULL
+#define QCOW2_REFT_OFFSET_MASK   0xfffffffffffffe00ULL
+
+/* refcount blocks are only updated at the qemu default width */
+#define QCOW2_REFCOUNT_ORDER     4
+
+/* metadata is rewritten in chunks of this, or a cluster if smaller */
+#define QCOW2_META_CHUNK         4096
+
+#define QCOW2_TABLES_BYTES       (4 << 20)
+#define QCOW2_TABLES_MIN         4
+#define QCOW2_TABLES_MAX         64
+
+#define QCOW2_MAX_REQS           TAPDISK_DATA_REQUESTS
+
+struct qcow2_header {
+	uint32_t                 magic;
+	uint32_t                 version;
+	uint64_t                 backing_file_offset;
+	uint32_t                 backing_file_size;
+	uint32_t                 cluster_bits;
+	uint64_t                 size;
+	uint32_t                 crypt_method;
+	uint32_t                 l1_size;
+	uint64_t                 l1_table_offset;
+	uint64_t                 refcount_table_offset;
+	uint32_t                 refcount_table_clusters;
+	uint32_t                 nb_snapshots;
+	uint64_t                 snapshots_offset;
+
+	/* version 3 */
+	uint64_t                 incompatible_features;
+	uint64_t                 compatible_features;
+	uint64_t                 autoclear_features;
+	uint32_t                 refcount_order;
+	uint32_t                 header_length;
+} __attribute__((packed));
+
+enum {
+	QCOW2_IO,
+	QCOW2_COW_READ,
+	QCOW2_COW_WRITE,
+};
+
+struct qcow2_state;
+
+struct qcow2_request {
+	td_request_t             treq;  /* guest sectors, within one cluster */
+	struct tiocb             tiocb;
+	struct qcow2_state      *state;
+
+	int                      stage;
+	int                      err;
+	int                      secs;  /* parent sectors still to come */
+
+	uint64_t                 vcluster;
+	uint64_t                 host;  /* cluster being allocated */
+	uint64_t                 old;   /* L2 entry it replaces */
+	char                    *buf;   /* whole cluster, for partial writes */
+
+	struct list_head         entry; /* in state->allocating, or waiting */
+	struct list_head         waiters;
+};
+
+struct qcow2_table {
+	uint64_t                 offset;
+	uint64_t                 used;
+	uint64_t                *buf;
+};
+
+struct qcow2_state {
+	td_driver_t             *driver;
+	char                    *name;
+	int                      fd;
+	int                      rdonly;
+	int                      dirty;       /* write completed since last sync */
+
+	uint32_t                 version;
+	uint32_t                 cluster_bits;
+	uint64_t                 cluster_size;
+	uint32_t                 l2_bits;     /* log2 entries per L2 table */
+	uint32_t                 rb_bits;     /* log2 entries per refblock */
+	uint32_t                 chunk;
+	uint64_t                 size;
+
+	struct qcow2_header     *header;      /* the first cluster */
+
+	uint64_t                *l1;          /* big-endian, as on disk */
+	uint32_t                 l1_size;
+	uint64_t                 l1_offset;
+	uint64_t                 l1_bytes;
+
+	uint64_t                *rt;          /* big-endian, as on disk */
+	uint64_t                 rt_entries;
+	uint64_t                 rt_offset;
+	uint32_t                 rt_clusters;
+
+	uint64_t                 free_offset; /* where the next cluster goes */
+
+	char                    *backing;
+	int                      backing_type;
+
+	struct qcow2_table      *tables;
+	int                      n_tables;
+	uint64_t                 tick;
+
+	struct qcow2_request     reqs[QCOW2_MAX_REQS];
+	struct qcow2_request    *reqs_free[QCOW2_MAX_REQS];
+	int                      n_free;
+
+	struct list_head         allocating;
+
+	unsigned long long       reads;
+	unsigned long long       writes;
+	unsigned long long       forwarded;
+	unsigned long long       allocated;
+	unsigned long long       cow;
+	unsigned long long       flushes;
+	unsigned long long       table_hits;
+	unsigned long long       table_misses;
+};
+
+static void qcow2_write_cluster(struct qcow2_state *, struct qcow2_request *);
+static void qcow2_complete(void *, struct tiocb *, int);
+
+static inline uint64_t
+qcow2_spc(struct qcow2_state *s)
+{
+	return s->cluster_size >> SECTOR_SHIFT;
+}
+
+static inline uint64_t
+qcow2_vcluster(struct qcow2_state *s, td_sector_t sec)
+{
+	return sec >> (s->cluster_bits - SECTOR_SHIFT);
+}
+
+static inline size_t
+qcow2_intra(struct qcow2_state *s, td_sector_t sec)
+{
+	return (sec & (qcow2_spc(s) - 1)) << SECTOR_SHIFT;
+}
+
+static int
+qcow2_pread(struct qcow2_state *s, void *buf, size_t size, uint64_t offset)
+{
+	ssize_t n;
+
+	n = pread(s->fd, buf, size, offset);
+	if (n == size)
+		return 0;
+
+	return n < 0 ? -errno : -EIO;
+}
+
+static int
+qcow2_pwrite(struct qcow2_state *s, void *buf, size_t size, uint64_t offset)
+{
+	ssize_t n;
+
+	n = pwrite(s->fd, buf, size, offset);
+	if (n == size)
+		return 0;
+
+	return n < 0 ? -errno : -ENOSPC;
+}
+
+static void *
+qcow2_alloc_buffer(size_t size)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, QCOW2_META_CHUNK, size))
+		return NULL;
+
+	memset(buf, 0, size);
+	return buf;
+}
+
+/*
+ * Writes back the chunk of a table holding byte @byte. Tables are whole
+ * clusters both on disk and in memory, so a chunk never spills over.
+ */
+static int
+qcow2_write_chunk(struct qcow2_state *s, uint64_t offset,
+		  void *table, size_t byte)
+{
+	size_t start = byte & ~((size_t)s->chunk - 1);
+
+	return qcow2_pwrite(s, (char *)table + start, s->chunk, offset + start);
+}
+
+static int
+qcow2_table_get(struct qcow2_state *s, uint64_t offset, int load,
+		uint64_t **_buf)
+{
+	struct qcow2_table *t, *victim;
+	int i, err;
+
+	victim = NULL;
+
+	for (i = 0; i < s->n_tables; i++) {
+		t = &s->tables[i];
+
+		if (t->buf && t->offset == offset) {
+			s->table_hits++;
+			t->used = ++s->tick;
+			*_buf   = t->buf;
+			return 0;
+		}
+
+		if (!victim || t->used < victim->used)
+			victim = t;
+	}
+
+	s->table_misses++;
+
+	if (!victim->buf) {
+		victim->buf = qcow2_alloc_buffer(s->cluster_size);
+		if (!victim->buf)
+			return -ENOMEM;
+	}
+
+	/* the header cluster is never a table, so 0 marks an empty slot */
+	victim->offset = 0;
+	victim->used   = 0;
+
+	if (load) {
+		err = qcow2_pread(s, victim->buf, s->cluster_size, offset);
+		if (err)
+			return err;
+	} else
+		memset(victim->buf, 0, s->cluster_size);
+
+	victim->offset = offset;
+	victim->used   = ++s->tick;
+	*_buf          = victim->buf;
+
+	return 0;
+}
+
+static uint64_t
+qcow2_alloc_cluster(struct qcow2_state *s)
+{
+	uint64_t offset = s->free_offset;
+
+	s->free_offset += s->cluster_size;
+	s->allocated++;
+
+	return offset;
+}
+
+static int qcow2_set_refcount(struct qcow2_state *, uint64_t, uint16_t);
+
+/*
+ * The new refcount block covers itself if it lands in its own range,
+ * else its own refcount goes into another block, once it is on disk and
+ * reachable from the table.
+ */
+static int
+qcow2_alloc_refblock(struct qcow2_state *s, uint64_t rti)
+{
+	uint64_t offset, *rb;
+	int err, self;
+
+	offset = qcow2_alloc_cluster(s);
+	self   = (offset >> s->cluster_bits >> s->rb_bits) == rti;
+
+	err = qcow2_table_get(s, offset, 0, &rb);
+	if (err)
+		return err;
+
+	if (self)
+		((uint16_t *)rb)[(offset >> s->cluster_bits) &
+				 ((1ULL << s->rb_bits) - 1)] = htobe16(1);
+
+	err = qcow2_pwrite(s, rb, s->cluster_size, offset);
+	if (err)
+		return err;
+
+	s->rt[rti] = htobe64(offset);
+	err = qcow2_write_chunk(s, s->rt_offset, s->rt, rti * sizeof(uint64_t));
+	if (err)
+		return err;
+
+	return self ? 0 : qcow2_set_refcount(s, offset, 1);
+}
+
+static int
+qcow2_set_refcount(struct qcow2_state *s, uint64_t offset, uint16_t ref)
+{
+	uint64_t cluster, rti, idx, rbo, *rb;
+	int err;
+
+	cluster = offset >> s->cluster_bits;
+	rti     = cluster >> s->rb_bits;
+	idx     = cluster & ((1ULL << s->rb_bits) - 1);
+
+	if (rti >= s->rt_entries)
+		return -ENOSPC;
+
+	rbo = be64toh(s->rt[rti]) & QCOW2_REFT_OFFSET_MASK;
+	if (!rbo) {
+		err = qcow2_alloc_refblock(s, rti);
+		if (err)
+			return err;
+
+		rbo = be64toh(s->rt[rti]) & QCOW2_REFT_OFFSET_MASK;
+	}
+
+	err = qcow2_table_get(s, rbo, 1, &rb);
+	if (err)
+		return err;
+
+	((uint16_t *)rb)[idx] = htobe16(ref);
+
+	return qcow2_write_chunk(s, rbo, rb, idx * sizeof(uint16_t));
+}
+
+/*
+ * Finds the L2 table of guest cluster @vc. Without @alloc, *_l2 is NULL
+ * if there is none; with it, an empty one is put in place.
+ */
+static int
+qcow2_get_l2(struct qcow2_state *s, uint64_t vc, int alloc,
+	     uint64_t **_l2, uint64_t *_offset)
+{
+	uint64_t l1i, offset, *l2;
+	int err;
+
+	*_l2 = NULL;
+	l1i  = vc >> s->l2_bits;
+
+	if (l1i >= s->l1_size)
+		return -EINVAL;
+
+	offset = be64toh(s->l1[l1i]) & QCOW2_OFFSET_MASK;
+	if (!offset) {
+		if (!alloc)
+			return 0;
+
+		offset = qcow2_alloc_cluster(s);
+
+		err = qcow2_table_get(s, offset, 0, &l2);
+		if (err)
+			return err;
+
+		err = qcow2_pwrite(s, l2, s->cluster_size, offset);
+		if (err)
+			return err;
+
+		err = qcow2_set_refcount(s, offset, 1);
+		if (err)
+			return err;
+
+		s->l1[l1i] = htobe64(offset | QCOW2_COPIED);
+		err = qcow2_write_chunk(s, s->l1_offset, s->l1,
+					l1i * sizeof(uint64_t));
+		if (err)
+			return err;
+	}
+
+	if (_offset)
+		*_offset = offset;
+
+	return qcow2_table_get(s, offset, 1, _l2);
+}
+
+static int
+qcow2_get_entry(struct qcow2_state *s, uint64_t vc, uint64_t *entry)
+{
+	uint64_t *l2;
+	int err;
+
+	err = qcow2_get_l2(s, vc, 0, &l2, NULL);
+	if (err)
+		return err;
+
+	*entry = l2 ? be64toh(l2[vc & ((1ULL << s->l2_bits) - 1)]) : 0;
+	if (s->version < 3)
+		*entry &= ~QCOW2_ZERO;
+
+	return 0;
+}
+
+static int
+qcow2_link_cluster(struct qcow2_state *s, struct qcow2_request *req)
+{
+	uint64_t idx, offset, old, *l2;
+	int err;
+
+	err = qcow2_set_refcount(s, req->host, 1);
+	if (err)
+		return err;
+
+	err = qcow2_get_l2(s, req->vcluster, 1, &l2, &offset);
+	if (err)
+		return err;
+
+	idx = req->vcluster & ((1ULL << s->l2_bits) - 1);
+	l2[idx] = htobe64(req->host | QCOW2_COPIED);
+
+	err = qcow2_write_chunk(s, offset, l2, idx * sizeof(uint64_t));
+	if (err)
+		return err;
+
+	/* a preallocated zero cluster we no longer point at */
+	old = req->old & QCOW2_OFFSET_MASK;
+	if (old && (req->old & QCOW2_COPIED))
+		qcow2_set_refcount(s, old, 0);
+
+	return 0;
+}
+
+static struct qcow2_request *
+qcow2_get_request(struct qcow2_state *s, td_request_t treq)
+{
+	struct qcow2_request *req;
+
+	if (!s->n_free)
+		return NULL;
+
+	req = s->reqs_free[--s->n_free];
+	memset(req, 0, sizeof(*req));
+
+	req->treq     = treq;
+	req->state    = s;
+	req->vcluster = qcow2_vcluster(s, treq.sec);
+	INIT_LIST_HEAD(&req->entry);
+	INIT_LIST_HEAD(&req->waiters);
+
+	return req;
+}
+
+static void
+qcow2_put_request(struct qcow2_state *s, struct qcow2_request *req)
+{
+	free(req->buf);
+	req->buf = NULL;
+	req->treq.secs = 0;
+	s->reqs_free[s->n_free++] = req;
+}
+
+static void
+qcow2_finish_alloc(struct qcow2_state *s, struct qcow2_request *req, int err)
+{
+	struct qcow2_request *w, *tmp;
+	struct list_head waiters;
+
+	if (!err)
+		err = qcow2_link_cluster(s, req);
+	if (err)
+		ERR(s, err, "allocating cluster %"PRIu64, req->vcluster);
+
+	INIT_LIST_HEAD(&waiters);
+	list_splice(&req->waiters, &waiters);
+	list_del_init(&req->entry);
+
+	s->dirty = 1;
+	td_complete_request(req->treq, err);
+	qcow2_put_request(s, req);
+
+	list_for_each_entry_safe(w, tmp, &waiters, entry) {
+		list_del_init(&w->entry);
+		qcow2_write_cluster(s, w);
+	}
+}
+
+static void
+qcow2_write_cow(struct qcow2_state *s, struct qcow2_request *req)
+{
+	memcpy(req->buf + qcow2_intra(s, req->treq.sec), req->treq.buf,
+	       req->treq.secs << SECTOR_SHIFT);
+
+	req->stage = QCOW2_COW_WRITE;
+	td_prep_write(&req->tiocb, s->fd, req->buf, s->cluster_size,
+		      req->host, qcow2_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
+}
+
+static void
+qcow2_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct qcow2_request *req = arg;
+	struct qcow2_state *s = req->state;
+
+	switch (req->stage) {
+	case QCOW2_IO:
+		if (req->treq.op == TD_OP_WRITE)
+			s->dirty = 1;
+		td_complete_request(req->treq, err);
+		qcow2_put_request(s, req);
+		break;
+
+	case QCOW2_COW_READ:
+		if (err)
+			qcow2_finish_alloc(s, req, err);
+		else
+			qcow2_write_cow(s, req);
+		break;
+
+	case QCOW2_COW_WRITE:
+		qcow2_finish_alloc(s, req, err);
+		break;
+	}
+}
+
+static void
+qcow2_cow_read_cb(td_request_t clone, int err)
+{
+	struct qcow2_request *req = clone.cb_data;
+	struct qcow2_state *s = req->state;
+
+	req->secs -= clone.secs;
+	req->err   = req->err ? : err;
+
+	if (req->secs)
+		return;
+
+	if (req->err)
+		qcow2_finish_alloc(s, req, req->err);
+	else
+		qcow2_write_cow(s, req);
+}
+
+/*
+ * Fills the rest of a partially written new cluster with what the guest
+ * saw there before: the parent's data, zeros, or the old cluster's.
+ */
+static void
+qcow2_fill_cluster(struct qcow2_state *s, struct qcow2_request *req)
+{
+	uint64_t old = req->old & QCOW2_OFFSET_MASK;
+	td_request_t clone;
+	td_sector_t sec;
+
+	req->buf = qcow2_alloc_buffer(s->cluster_size);
+	if (!req->buf) {
+		qcow2_finish_alloc(s, req, -ENOMEM);
+		return;
+	}
+
+	s->cow++;
+
+	if (req->old & QCOW2_ZERO) {
+		qcow2_write_cow(s, req);
+		return;
+	}
+
+	if (old) {
+		req->stage = QCOW2_COW_READ;
+		td_prep_read(&req->tiocb, s->fd, req->buf, s->cluster_size,
+			     old, qcow2_complete, req);
+		td_queue_tiocb(s->driver, &req->tiocb);
+		return;
+	}
+
+	sec = req->vcluster * qcow2_spc(s);
+
+	clone         = req->treq;
+	clone.op      = TD_OP_READ;
+	clone.sec     = sec;
+	clone.secs    = MIN(qcow2_spc(s), s->driver->info.size - sec);
+	clone.buf     = req->buf;
+	clone.cb      = qcow2_cow_read_cb;
+	clone.cb_data = req;
+
+	req->stage = QCOW2_COW_READ;
+	req->secs  = clone.secs;
+
+	s->forwarded++;
+	td_forward_request(clone);
+}
+
+static void
+qcow2_write_cluster(struct qcow2_state *s, struct qcow2_request *req)
+{
+	struct qcow2_request *a;
+	uint64_t entry, offset;
+	int err;
+
+	list_for_each_entry(a, &s->allocating, entry)
+		if (a->vcluster == req->vcluster) {
+			list_add_tail(&req->entry, &a->waiters);
+			return;
+		}
+
+	err = qcow2_get_entry(s, req->vcluster, &entry);
+	if (err)
+		goto fail;
+
+	if (entry & QCOW2_COMPRESSED) {
+		err = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	offset = entry & QCOW2_OFFSET_MASK;
+
+	if (offset && (entry & QCOW2_COPIED) && !(entry & QCOW2_ZERO)) {
+		req->stage = QCOW2_IO;
+		td_prep_write(&req->tiocb, s->fd, req->treq.buf,
+			      req->treq.secs << SECTOR_SHIFT,
+			      offset + qcow2_intra(s, req->treq.sec),
+			      qcow2_complete, req);
+		td_queue_tiocb(s->driver, &req->tiocb);
+		return;
+	}
+
+	req->old  = entry;
+	req->host = qcow2_alloc_cluster(s);
+	list_add_tail(&req->entry, &s->allocating);
+
+	if (req->treq.secs == qcow2_spc(s)) {
+		req->stage = QCOW2_COW_WRITE;
+		td_prep_write(&req->tiocb, s->fd, req->treq.buf,
+			      s->cluster_size, req->host, qcow2_complete, req);
+		td_queue_tiocb(s->driver, &req->tiocb);
+		return;
+	}
+
+	qcow2_fill_cluster(s, req);
+	return;
+
+fail:
+	td_complete_request(req->treq, err);
+	qcow2_put_request(s, req);
+}
+
+static void
+qcow2_read_cluster(struct qcow2_state *s, td_request_t treq)
+{
+	struct qcow2_request *req;
+	uint64_t entry, offset;
+	int err;
+
+	err = qcow2_get_entry(s, qcow2_vcluster(s, treq.sec), &entry);
+	if (err)
+		goto fail;
+
+	if (entry & QCOW2_COMPRESSED) {
+		err = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	if (entry & QCOW2_ZERO) {
+		memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	offset = entry & QCOW2_OFFSET_MASK;
+	if (!offset) {
+		s->forwarded++;
+		td_forward_request(treq);
+		return;
+	}
+
+	req = qcow2_get_request(s, treq);
+	if (!req) {
+		err = -EBUSY;
+		goto fail;
+	}
+
+	req->stage = QCOW2_IO;
+	td_prep_read(&req->tiocb, s->fd, treq.buf, treq.secs << SECTOR_SHIFT,
+		     offset + qcow2_intra(s, treq.sec), qcow2_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+/*
+ * Requests are split at cluster boundaries, the pieces of adjacent
+ * clusters merged again by the queue where they are adjacent on disk.
+ */
+static void
+qcow2_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	struct qcow2_state *s = driver->data;
+	td_request_t clone;
+
+	s->reads++;
+
+	while (treq.secs) {
+		clone      = treq;
+		clone.secs = MIN(treq.secs, qcow2_spc(s) -
+				 (treq.sec & (qcow2_spc(s) - 1)));
+
+		qcow2_read_cluster(s, clone);
+
+		treq.sec  += clone.secs;
+		treq.buf  += clone.secs << SECTOR_SHIFT;
+		treq.secs -= clone.secs;
+	}
+}
+
+static void
+qcow2_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	struct qcow2_state *s = driver->data;
+	struct qcow2_request *req;
+	td_request_t clone;
+
+	s->writes++;
+
+	while (treq.secs) {
+		clone      = treq;
+		clone.secs = MIN(treq.secs, qcow2_spc(s) -
+				 (treq.sec & (qcow2_spc(s) - 1)));
+
+		if (s->rdonly)
+			td_complete_request(clone, -EPERM);
+		else if (!(req = qcow2_get_request(s, clone)))
+			td_complete_request(clone, -EBUSY);
+		else
+			qcow2_write_cluster(s, req);
+
+		treq.sec  += clone.secs;
+		treq.buf  += clone.secs << SECTOR_SHIFT;
+		treq.secs -= clone.secs;
+	}
+}
+
+/*
+ * Metadata is written synchronously, and linked only once the data it
+ * points at is written, so one fdatasync of the image makes all of the
+ * writes completed so far stable. Writes mark the image dirty as they
+ * complete, as those still in flight are not covered by a sync issued
+ * before they are done.
+ */
+static void
+qcow2_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	struct qcow2_state *s = driver->data;
+	struct qcow2_request *req;
+
+	if (!s->dirty) {
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	req = qcow2_get_request(s, treq);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	s->dirty = 0;
+	s->flushes++;
+
+	req->stage = QCOW2_IO;
+	td_prep_fdsync(&req->tiocb, s->fd, qcow2_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
+}
+
+static int
+qcow2_sector_present(td_driver_t *driver, td_sector_t sec, td_sector_t *secs)
+{
+	struct qcow2_state *s = driver->data;
+	uint64_t entry;
+
+	*secs = qcow2_spc(s) - (sec & (qcow2_spc(s) - 1));
+
+	if (qcow2_get_entry(s, qcow2_vcluster(s, sec), &entry))
+		return 1;
+
+	/* reads of unallocated clusters go to the parent */
+	return !!entry;
+}
+
+static int
+qcow2_read_header(struct qcow2_state *s)
+{
+	struct qcow2_header *h;
+	uint32_t bits;
+	ssize_t n;
+	void *buf;
+
+	buf = qcow2_alloc_buffer(QCOW2_META_CHUNK);
+	if (!buf)
+		return -ENOMEM;
+
+	n = pread(s->fd, buf, QCOW2_META_CHUNK, 0);
+	if (n < (ssize_t)sizeof(*h)) {
+		free(buf);
+		return n < 0 ? -errno : -EINVAL;
+	}
+
+	h    = buf;
+	bits = be32toh(h->cluster_bits);
+
+	if (be32toh(h->magic) != QCOW2_MAGIC ||
+	    bits < QCOW2_MIN_CLUSTER_BITS || bits > QCOW2_MAX_CLUSTER_BITS) {
+		free(buf);
+		return -EINVAL;
+	}
+
+	s->cluster_bits = bits;
+	s->cluster_size = 1ULL << bits;
+	free(buf);
+
+	/* the header, its extensions and the backing name fill cluster 0 */
+	s->header = qcow2_alloc_buffer(s->cluster_size);
+	if (!s->header)
+		return -ENOMEM;
+
+	n = pread(s->fd, s->header, s->cluster_size, 0);
+	if (n < (ssize_t)sizeof(*h))
+		return n < 0 ? -errno : -EINVAL;
+
+	return 0;
+}
+
+static int
+qcow2_read_extensions(struct qcow2_state *s, uint32_t offset,
+		      char *format, size_t size)
+{
+	char *hdr = (char *)s->header;
+	uint32_t type, len;
+
+	while (offset + 2 * sizeof(uint32_t) <= s->cluster_size) {
+		memcpy(&type, hdr + offset, sizeof(type));
+		memcpy(&len, hdr + offset + sizeof(type), sizeof(len));
+		type    = be32toh(type);
+		len     = be32toh(len);
+		offset += 2 * sizeof(uint32_t);
+
+		if (type == QCOW2_EXT_END)
+			return 0;
+
+		if (len > s->cluster_size - offset)
+			return -EINVAL;
+
+		if (type == QCOW2_EXT_BACKING_FORMAT && len < size) {
+			memcpy(format, hdr + offset, len);
+			format[len] = '\0';
+		}
+
+		offset += (len + 7) & ~7;
+	}
+
+	return 0;
+}
+
+/*
+ * Relative backing names are relative to the image, and the format is
+ * probed where the image does not record it.
+ */
+static int
+qcow2_read_backing(struct qcow2_state *s, const char *format)
+{
+	struct qcow2_header *h = s->header;
+	uint64_t offset;
+	uint32_t size, magic;
+	char *name, *dir, *path;
+	int fd;
+
+	offset = be64toh(h->backing_file_offset);
+	size   = be32toh(h->backing_file_size);
+
+	if (!offset)
+		return 0;
+
+	if (!size || size > QCOW2_BACKING_NAME_MAX ||
+	    offset + size > s->cluster_size)
+		return -EINVAL;
+
+	name = strndup((char *)s->header + offset, size);
+	if (!name)
+		return -ENOMEM;
+
+	if (name[0] != '/') {
+		dir = strdup(s->name);
+		if (!dir || asprintf(&path, "%s/%s", dirname(dir), name) < 0) {
+			free(dir);
+			free(name);
+			return -ENOMEM;
+		}
+		free(dir);
+		free(name);
+		name = path;
+	}
+
+	s->backing = name;
+
+	if (*format) {
+		if (!strcmp(format, "raw"))
+			s->backing_type = DISK_TYPE_AIO;
+		else if (!strcmp(format, "qcow2"))
+			s->backing_type = DISK_TYPE_QCOW2;
+		else
+			return -EOPNOTSUPP;
+		return 0;
+	}
+
+	s->backing_type = DISK_TYPE_AIO;
+
+	fd = open(name, O_RDONLY);
+	if (fd == -1)
+		return 0;
+
+	if (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+	    be32toh(magic) == QCOW2_MAGIC)
+		s->backing_type = DISK_TYPE_QCOW2;
+
+	close(fd);
+	return 0;
+}
+
+static int
+qcow2_read_table(struct qcow2_state *s, uint64_t offset, uint64_t bytes,
+		 uint64_t **_table)
+{
+	uint64_t *table;
+	int err;
+
+	if (!offset || offset & (s->cluster_size - 1))
+		return -EINVAL;
+
+	table = qcow2_alloc_buffer(bytes);
+	if (!table)
+		return -ENOMEM;
+
+	err = qcow2_pread(s, table, bytes, offset);
+	if (err) {
+		free(table);
+		return err;
+	}
+
+	*_table = table;
+	return 0;
+}
+
+static int
+qcow2_write_header(struct qcow2_state *s)
+{
+	int err;
+
+	err = qcow2_pwrite(s, s->header, s->chunk, 0);
+	if (err)
+		return err;
+
+	return fdatasync(s->fd) ? -errno : 0;
+}
+
+/*
+ * Allocations never grow the refcount table: before the first write it
+ * is made large enough for a fully allocated image, moving it to the end
+ * of the file if need be.
+ */
+static int
+qcow2_reserve_reftable(struct qcow2_state *s)
+{
+	uint64_t epb, clusters, total, entries, offset, old_offset, bytes;
+	uint32_t i, n, old_clusters;
+	uint64_t *rt, *old;
+	int err;
+
+	epb      = 1ULL << s->rb_bits;
+	clusters = (s->free_offset >> s->cluster_bits) +
+		DIV_ROUND_UP(s->size, s->cluster_size) + s->l1_size + 1;
+
+	total = clusters;
+	for (i = 0; i < 3; i++) {
+		entries = DIV_ROUND_UP(total, epb);
+		total   = clusters + entries +
+			DIV_ROUND_UP(entries * sizeof(uint64_t),
+				     s->cluster_size);
+	}
+	entries = DIV_ROUND_UP(total, epb);
+
+	if (entries <= s->rt_entries)
+		return 0;
+
+	n     = DIV_ROUND_UP(entries * sizeof(uint64_t), s->cluster_size);
+	bytes = (uint64_t)n << s->cluster_bits;
+
+	rt = qcow2_alloc_buffer(bytes);
+	if (!rt)
+		return -ENOMEM;
+
+	memcpy(rt, s->rt, (uint64_t)s->rt_clusters << s->cluster_bits);
+
+	old          = s->rt;
+	old_offset   = s->rt_offset;
+	old_clusters = s->rt_clusters;
+
+	offset          = s->free_offset;
+	s->free_offset += bytes;
+
+	s->rt          = rt;
+	s->rt_offset   = offset;
+	s->rt_clusters = n;
+	s->rt_entries  = bytes / sizeof(uint64_t);
+
+	for (i = 0; i < n; i++) {
+		err = qcow2_set_refcount(s, offset +
+					 ((uint64_t)i << s->cluster_bits), 1);
+		if (err)
+			goto out;
+	}
+
+	err = qcow2_pwrite(s, rt, bytes, offset);
+	if (!err)
+		err = fdatasync(s->fd) ? -errno : 0;
+	if (err)
+		goto out;
+
+	s->header->refcount_table_offset   = htobe64(offset);
+	s->header->refcount_table_clusters = htobe32(n);
+
+	err = qcow2_write_header(s);
+	if (err)
+		goto out;
+
+	for (i = 0; i < old_clusters; i++)
+		qcow2_set_refcount(s, old_offset +
+				   ((uint64_t)i << s->cluster_bits), 0);
+
+	DBG(TLOG_INFO, "%s: refcount table moved to 0x%"PRIx64", %u clusters\n",
+	    s->name, offset, n);
+
+out:
+	free(old);
+	return err;
+}
+
+static int
+qcow2_open_rw(struct qcow2_state *s)
+{
+	struct qcow2_header *h = s->header;
+	off_t end;
+	int err;
+
+	if (h->nb_snapshots) {
+		DBG(TLOG_WARN, "%s: internal snapshots, read-only\n", s->name);
+		return -EROFS;
+	}
+
+	if (s->version >= 3 &&
+	    be32toh(h->refcount_order) != QCOW2_REFCOUNT_ORDER) {
+		DBG(TLOG_WARN, "%s: refcount order %u, read-only\n",
+		    s->name, be32toh(h->refcount_order));
+		return -EROFS;
+	}
+
+	end = lseek(s->fd, 0, SEEK_END);
+	if (end == (off_t)-1)
+		return -errno;
+
+	s->free_offset = ((uint64_t)end + s->cluster_size - 1) &
+		~(s->cluster_size - 1);
+
+	err = qcow2_reserve_reftable(s);
+	if (err)
+		return err;
+
+	/* tell qemu what it kept in autoclear extensions is stale now */
+	if (s->version >= 3 && h->autoclear_features) {
+		h->autoclear_features = 0;
+		err = qcow2_write_header(s);
+	}
+
+	return err;
+}
+
+static int
+qcow2_parse_header(struct qcow2_state *s, td_flag_t flags)
+{
+	struct qcow2_header *h = s->header;
+	uint64_t incompat, l2_span;
+	uint32_t hlen;
+	char format[32];
+	int err;
+
+	s->version = be32toh(h->version);
+	if (s->version != 2 && s->version != 3)
+		return -EINVAL;
+
+	incompat = 0;
+	hlen     = QCOW2_HEADER_V2_LENGTH;
+
+	if (s->version >= 3) {
+		incompat = be64toh(h->incompatible_features);
+		hlen     = be32toh(h->header_length);
+		if (hlen < sizeof(*h) || hlen > s->cluster_size)
+			return -EINVAL;
+	}
+
+	if (incompat & ~QCOW2_INCOMPAT_SUPPORTED) {
+		DBG(TLOG_WARN, "%s: incompatible features 0x%"PRIx64"\n",
+		    s->name, incompat);
+		return -EOPNOTSUPP;
+	}
+
+	if (h->crypt_method)
+		return -EOPNOTSUPP;
+
+	s->size     = be64toh(h->size);
+	s->l2_bits  = s->cluster_bits - 3;
+	s->rb_bits  = s->cluster_bits + 3 -
+		(s->version >= 3 ? be32toh(h->refcount_order) :
+		 QCOW2_REFCOUNT_ORDER);
+	s->chunk    = MIN(QCOW2_META_CHUNK, s->cluster_size);
+
+	l2_span     = s->cluster_size << s->l2_bits;
+	s->l1_size  = be32toh(h->l1_size);
+	s->l1_offset = be64toh(h->l1_table_offset);
+
+	if (s->l1_size < DIV_ROUND_UP(s->size, l2_span))
+		return -EINVAL;
+
+	if (flags & TD_OPEN_4K && s->size & (TD_4K_SECTOR_SIZE - 1))
+		return -EINVAL;
+
+	s->l1_bytes = ((uint64_t)s->l1_size * sizeof(uint64_t) +
+		       s->cluster_size - 1) & ~(s->cluster_size - 1);
+	if (s->l1_bytes) {
+		err = qcow2_read_table(s, s->l1_offset, s->l1_bytes, &s->l1);
+		if (err)
+			return err;
+	}
+
+	s->rt_offset   = be64toh(h->refcount_table_offset);
+	s->rt_clusters = be32toh(h->refcount_table_clusters);
+	s->rt_entries  = ((uint64_t)s->rt_clusters << s->cluster_bits) /
+		sizeof(uint64_t);
+
+	err = qcow2_read_table(s, s->rt_offset,
+			       (uint64_t)s->rt_clusters << s->cluster_bits,
+			       &s->rt);
+	if (err)
+		return err;
+
+	*format = '\0';
+	err = qcow2_read_extensions(s, hlen, format, sizeof(format));
+	if (err)
+		return err;
+
+	return qcow2_read_backing(s, format);
+}
+
+static int
+qcow2_close(td_driver_t *driver)
+{
+	struct qcow2_state *s = driver->data;
+	int i;
+
+	if (s->tables)
+		for (i = 0; i < s->n_tables; i++)
+			free(s->tables[i].buf);
+
+	free(s->tables);
+	free(s->l1);
+	free(s->rt);
+	free(s->header);
+	free(s->backing);
+	free(s->name);
+
+	if (s->fd != -1)
+		close(s->fd);
+
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+
+	return 0;
+}
+
+static int
+qcow2_open(td_driver_t *driver, const char *name,
+	   struct td_vbd_encryption *encryption, td_flag_t flags)
+{
+	struct qcow2_state *s = driver->data;
+	int i, err, o_flags;
+
+	memset(s, 0, sizeof(*s));
+	s->driver = driver;
+	s->fd     = -1;
+	s->rdonly = !!(flags & TD_OPEN_RDONLY);
+	INIT_LIST_HEAD(&s->allocating);
+
+	s->name = strdup(name);
+	if (!s->name) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	o_flags = O_LARGEFILE | (s->rdonly ? O_RDONLY : O_RDWR);
+	if (!(flags & TD_OPEN_NO_O_DIRECT))
+		o_flags |= O_DIRECT;
+
+	s->fd = open(name, o_flags);
+	if (s->fd == -1 && (o_flags & O_DIRECT) && errno == EINVAL)
+		s->fd = open(name, o_flags & ~O_DIRECT);
+	if (s->fd == -1) {
+		err = -errno;
+		DBG(TLOG_WARN, "failed to open %s: %d\n", name, err);
+		goto fail;
+	}
+
+	err = qcow2_read_header(s);
+	if (!err)
+		err = qcow2_parse_header(s, flags);
+	if (err) {
+		DBG(TLOG_WARN, "%s: not a usable qcow2 image: %d\n", name, err);
+		goto fail;
+	}
+
+	s->n_tables = QCOW2_TABLES_BYTES >> s->cluster_bits;
+	s->n_tables = MAX(QCOW2_TABLES_MIN, MIN(QCOW2_TABLES_MAX, s->n_tables));
+	s->tables   = calloc(s->n_tables, sizeof(struct qcow2_table));
+	if (!s->tables) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	if (!s->rdonly) {
+		err = qcow2_open_rw(s);
+		if (err)
+			goto fail;
+	}
+
+	for (i = 0; i < QCOW2_MAX_REQS; i++)
+		s->reqs_free[i] = &s->reqs[i];
+	s->n_free = QCOW2_MAX_REQS;
+
+	driver->info.size        = s->size >> SECTOR_SHIFT;
+	driver->info.sector_size = flags & TD_OPEN_4K ?
+		TD_4K_SECTOR_SIZE : SECTOR_SIZE;
+	driver->info.info        = 0;
+
+	DBG(TLOG_INFO, "%s: qcow2 v%u, %"PRIu64" bytes, %"PRIu64" byte "
+	    "clusters%s%s\n", name, s->version, s->size, s->cluster_size,
+	    s->backing ? ", backing " : "", s->backing ? : "");
+
+	return 0;
+
+fail:
+	qcow2_close(driver);
+	return err;
+}
+
+static int
+qcow2_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	struct qcow2_state *s = driver->data;
+	int flags;
+
+	flags = id->flags;
+	memset(id, 0, sizeof(td_disk_id_t));
+
+	if (!s->backing)
+		return TD_NO_PARENT;
+
+	id->name = strdup(s->backing);
+	if (!id->name)
+		return -ENOMEM;
+
+	id->type  = s->backing_type;
+	id->flags = flags|TD_OPEN_SHAREABLE|TD_OPEN_RDONLY;
+
+	return 0;
+}
+
+static int
+qcow2_validate_parent(td_driver_t *child_driver,
+		      td_driver_t *parent_driver, td_flag_t flags)
+{
+	struct qcow2_state *child = child_driver->data;
+
+	if (!child->backing)
+		return -EINVAL;
+
+	if (parent_driver->type != child->backing_type)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void
+qcow2_debug(td_driver_t *driver)
+{
+	struct qcow2_state *s = driver->data;
+	struct qcow2_request *req;
+
+	DBG(TLOG_WARN, "%s: reads: %llu, writes: %llu, forwarded: %llu, "
+	    "allocated: %llu, cow: %llu, free reqs: %d\n", s->name, s->reads,
+	    s->writes, s->forwarded, s->allocated, s->cow, s->n_free);
+
+	list_for_each_entry(req, &s->allocating, entry)
+		DBG(TLOG_WARN, "allocating cluster %"PRIu64" at 0x%"PRIx64
+		    ", stage %d\n", req->vcluster, req->host, req->stage);
+}
+
+static void
+qcow2_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct qcow2_state *s = driver->data;
+
+	tapdisk_stats_field(st, "cluster_size", "llu",
+			    (unsigned long long)s->cluster_size);
+	tapdisk_stats_field(st, "allocated", "llu", s->allocated);
+	tapdisk_stats_field(st, "cow", "llu", s->cow);
+	tapdisk_stats_field(st, "forwarded", "llu", s->forwarded);
+	tapdisk_stats_field(st, "flushes", "llu", s->flushes);
+	tapdisk_stats_field(st, "tables", "{");
+	tapdisk_stats_field(st, "size", "d", s->n_tables);
+	tapdisk_stats_field(st, "hits", "llu", s->table_hits);
+	tapdisk_stats_field(st, "misses", "llu", s->table_misses);
+	tapdisk_stats_leave(st, '}');
+}
+
+struct tap_disk tapdisk_qcow2 = {
+	.disk_type          = "tapdisk_qcow2",
+	.flags              = 0,
+	.private_data_size  = sizeof(struct qcow2_state),
+	.td_open            = qcow2_open,
+	.td_close           = qcow2_close,
+	.td_queue_read      = qcow2_queue_read,
+	.td_queue_write     = qcow2_queue_write,
+	.td_queue_flush     = qcow2_queue_flush,
+	.td_get_parent_id   = qcow2_get_parent_id,
+	.td_validate_parent = qcow2_validate_parent,
+	.td_debug           = qcow2_debug,
+	.td_stats           = qcow2_stats,
+	.td_sector_present  = qcow2_sector_present,
+};
@@ -28,6 +28,18 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/*
+ * RAM disk. The image is kept in extents of TDRAM_EXTENT_SIZE, one huge
+ * page each, allocated when first written to; extents never written to
+ * read as zeros. Memory is first touched by the thread serving the VBD, so
+ * it comes from that thread's NUMA node.
+ *
+ * Images are shared by name between the VBDs of a tapdisk. Opening
+ * "<name>=<source>" creates <name> as a copy-on-write clone of the open
+ * image <source>: extents are shared until either side writes to them.
+ * Pause the source VBD while cloning it, to get a consistent copy.
+ */
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -37,26 +49,174 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/statvfs.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include <string.h>
 
+#include "list.h"
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-log.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#define TDRAM_EXTENT_SHIFT  21
+#define TDRAM_EXTENT_SIZE   (1ULL << TDRAM_EXTENT_SHIFT)
+
+struct tdram_extent {
+	int                   refs;
+	int                   huge;
+	char                 *data;
+};
 
-void *img;
-long int   disksector_size;
-long int   disksize;
-long int   diskinfo;
-static int connections = 0;
+struct tdram_image {
+	char                 *name;
+	int                   refs;
+	td_disk_info_t        info;
+	uint64_t              nr_extents;
+	struct tdram_extent **extents;
+	struct list_head      entry;
+};
 
 struct tdram_state {
-        int fd;
+	struct tdram_image   *img;
 };
 
+static struct list_head tdram_images = LIST_HEAD_INIT(tdram_images);
+static pthread_mutex_t tdram_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct tdram_extent *
+tdram_extent_alloc(void)
+{
+	struct tdram_extent *ext;
+
+	ext = malloc(sizeof(*ext));
+	if (!ext)
+		return NULL;
+
+	ext->refs = 1;
+	ext->huge = 1;
+	ext->data = mmap(NULL, TDRAM_EXTENT_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (ext->data == MAP_FAILED) {
+		/* no huge pages reserved, let THP collapse it if it can */
+		ext->huge = 0;
+		ext->data = mmap(NULL, TDRAM_EXTENT_SIZE,
+				 PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ext->data == MAP_FAILED) {
+			free(ext);
+			return NULL;
+		}
+		madvise(ext->data, TDRAM_EXTENT_SIZE, MADV_HUGEPAGE);
+	}
+
+	return ext;
+}
+
+static void
+tdram_extent_put(struct tdram_extent *ext)
+{
+	if (__sync_sub_and_fetch(&ext->refs, 1))
+		return;
+
+	munmap(ext->data, TDRAM_EXTENT_SIZE);
+	free(ext);
+}
+
+/*
+ * Returns extent @i ready to be written to, allocating it or copying it
+ * away from the images it is shared with.
+ */
+static struct tdram_extent *
+tdram_extent_writable(struct tdram_image *img, uint64_t i)
+{
+	struct tdram_extent *ext, *copy;
+
+	ext = img->extents[i];
+	if (ext && __atomic_load_n(&ext->refs, __ATOMIC_ACQUIRE) == 1)
+		return ext;
+
+	copy = tdram_extent_alloc();
+	if (!copy)
+		return NULL;
+
+	if (ext) {
+		memcpy(copy->data, ext->data, TDRAM_EXTENT_SIZE);
+		tdram_extent_put(ext);
+	}
+
+	img->extents[i] = copy;
+	return copy;
+}
+
+static int
+tdram_image_alloc(const char *name, size_t len, const td_disk_info_t *info,
+		  struct tdram_image **_img)
+{
+	struct tdram_image *img;
+	uint64_t bytes;
+
+	img = calloc(1, sizeof(*img));
+	if (!img)
+		return -ENOMEM;
+
+	img->name = strndup(name, len);
+	if (!img->name)
+		goto fail;
+
+	bytes           = info->size << SECTOR_SHIFT;
+	img->info       = *info;
+	img->refs       = 1;
+	img->nr_extents = (bytes + TDRAM_EXTENT_SIZE - 1) >> TDRAM_EXTENT_SHIFT;
+	img->extents    = calloc(img->nr_extents, sizeof(*img->extents));
+	if (!img->extents)
+		goto fail;
+
+	INIT_LIST_HEAD(&img->entry);
+
+	*_img = img;
+	return 0;
+
+fail:
+	free(img->name);
+	free(img);
+	return -ENOMEM;
+}
+
+static void
+tdram_image_free(struct tdram_image *img)
+{
+	uint64_t i;
+
+	for (i = 0; i < img->nr_extents; i++)
+		if (img->extents[i])
+			tdram_extent_put(img->extents[i]);
+
+	list_del(&img->entry);
+	free(img->extents);
+	free(img->name);
+	free(img);
+}
+
+static struct tdram_image *
+tdram_image_find(const char *name, size_t len)
+{
+	struct tdram_image *img;
+
+	list_for_each_entry(img, &tdram_images, entry)
+		if (strlen(img->name) == len && !strncmp(img->name, name, len))
+			return img;
+
+	return NULL;
+}
+
 /*Get Image size, secsize*/
 static int get_image_info(int fd, td_disk_info_t *info)
 {
@@ -82,19 +242,7 @@ static int get_image_info(int fd, td_disk_info_t *info)
 			(long long unsigned)(info->size << SECTOR_SHIFT),
 			(long long unsigned)info->size);
 
-		/*Get the sector size*/
-#if defined(BLKSSZGET)
-		{
-			info->sector_size = DEFAULT_SECTOR_SIZE;
-			ioctl(fd, BLKSSZGET, &info->sector_size);
-			
-			if (info->sector_size != DEFAULT_SECTOR_SIZE)
-				DPRINTF("Note: sector size is %ld (not %d)\n",
-					info->sector_size, DEFAULT_SECTOR_SIZE);
-		}
-#else
 		info->sector_size = DEFAULT_SECTOR_SIZE;
-#endif
 
 	} else {
 		/*Local file? try fstat instead*/
@@ -112,133 +260,281 @@ static int get_image_info(int fd, td_disk_info_t *info)
 	}
 	info->info = 0;
 
-        /*Store variables locally*/
-	disksector_size = info->sector_size;
-	disksize        = info->size;
-	diskinfo        = info->info;
 	DPRINTF("Image sector_size: \n\t[%lu]\n",
 		info->sector_size);
 
 	return 0;
 }
 
-/* Open the disk file and initialize ram state. */
-int tdram_open (td_driver_t *driver, const char *name,
-		struct td_vbd_encryption *encryption, td_flag_t flags)
+static int
+tdram_zero(const char *buf, size_t size)
 {
-	char *p;
-	uint64_t size;
-	int i, fd, ret = 0, count = 0, o_flags;
-	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	const uint64_t *p = (const uint64_t *)buf;
+	size_t i;
 
-	connections++;
+	for (i = 0; i < size / sizeof(*p); i++)
+		if (p[i])
+			return 0;
 
-	if (connections > 1) {
-		driver->info.sector_size = disksector_size;
-		driver->info.size        = disksize;
-		driver->info.info        = diskinfo; 
-		DPRINTF("Image already open, returning parameters:\n");
-		DPRINTF("Image size: \n\tpre sector_shift  [%llu]\n\tpost "
-			"sector_shift [%llu]\n",
-			(long long unsigned)(driver->info.size << SECTOR_SHIFT),
-			(long long unsigned)driver->info.size);
-		DPRINTF("Image sector_size: \n\t[%lu]\n",
-			driver->info.sector_size);
+	return 1;
+}
 
-		prv->fd = -1;
-		goto done;
+/*
+ * Loads an image file, keeping only the extents which are not all zeros.
+ */
+static int
+tdram_image_load(const char *name, struct tdram_image **_img)
+{
+	struct tdram_image *img = NULL;
+	td_disk_info_t info;
+	uint64_t i, bytes, count = 0;
+	char *buf = NULL;
+	int fd, err;
+
+	fd = open(name, O_RDONLY | O_LARGEFILE);
+	if (fd == -1) {
+		err = -errno;
+		DPRINTF("Unable to open [%s]!\n", name);
+		return err;
 	}
 
-	/* Open the file */
-	o_flags = O_DIRECT | O_LARGEFILE | 
-		((flags == TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
-        fd = open(name, o_flags);
+	err = get_image_info(fd, &info);
+	if (err)
+		goto out;
 
-        if ((fd == -1) && (errno == EINVAL)) {
+	err = tdram_image_alloc(name, strlen(name), &info, &img);
+	if (err)
+		goto out;
 
-                /* Maybe O_DIRECT isn't supported. */
-		o_flags &= ~O_DIRECT;
-                fd = open(name, o_flags);
-                if (fd != -1) DPRINTF("WARNING: Accessing image without"
-                                     "O_DIRECT! (%s)\n", name);
+	buf = malloc(TDRAM_EXTENT_SIZE);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out;
+	}
 
-        } else if (fd != -1) DPRINTF("open(%s) with O_DIRECT\n", name);
-	
-        if (fd == -1) {
-		DPRINTF("Unable to open [%s]!\n",name);
-        	ret = 0 - errno;
-        	goto done;
-        }
+	bytes = info.size << SECTOR_SHIFT;
+	DPRINTF("Reading %llu bytes.......", (unsigned long long)bytes);
 
-        prv->fd = fd;
+	for (i = 0; i < img->nr_extents; i++) {
+		uint64_t off = i << TDRAM_EXTENT_SHIFT;
+		size_t size = MIN(TDRAM_EXTENT_SIZE, bytes - off);
+		ssize_t n;
 
-	ret = get_image_info(fd, &driver->info);
-	size = MAX_RAMDISK_SIZE;
+		n = pread(fd, buf, size, off);
+		if (n < 0) {
+			err = -errno;
+			DPRINTF("read at %llu failed: %d\n",
+				(unsigned long long)off, err);
+			goto out;
+		}
 
-	if (driver->info.size > size) {
-		DPRINTF("Disk exceeds limit, must be less than [%d]MB",
-			(MAX_RAMDISK_SIZE<<SECTOR_SHIFT)>>20);
-		return -ENOMEM;
-	}
+		/* past the end of a short or empty file reads as zeros */
+		memset(buf + n, 0, TDRAM_EXTENT_SIZE - n);
+		if (tdram_zero(buf, TDRAM_EXTENT_SIZE))
+			continue;
 
-	/*Read the image into memory*/
-	if (posix_memalign(&img, DEFAULT_SECTOR_SIZE,
-			   driver->info.size << SECTOR_SHIFT)) {
-		DPRINTF("Mem malloc failed\n");
-		return -errno;
+		img->extents[i] = tdram_extent_alloc();
+		if (!img->extents[i]) {
+			err = -ENOMEM;
+			goto out;
+		}
+		memcpy(img->extents[i]->data, buf, TDRAM_EXTENT_SIZE);
+		count++;
 	}
-	p = img;
-	DPRINTF("Reading %llu bytes.......",
-		(long long unsigned)driver->info.size << SECTOR_SHIFT);
-
-	for (i = 0; i < driver->info.size; i++) {
-		ret = read(prv->fd, p, driver->info.sector_size);
-		if (ret != driver->info.sector_size) {
-			DPRINTF("ret = %d, errno = %d\n", ret, errno);
-			ret = 0 - errno;
-			break;
-		} else {
-			count += ret;
-			p = img + count;
+
+	DPRINTF("[%llu extents]\n", (unsigned long long)count);
+
+	*_img = img;
+	img = NULL;
+	err = 0;
+
+out:
+	if (img)
+		tdram_image_free(img);
+	free(buf);
+	close(fd);
+	return err;
+}
+
+static int
+tdram_image_clone(const char *name, size_t len, struct tdram_image *src,
+		  struct tdram_image **_img)
+{
+	struct tdram_image *img;
+	uint64_t i;
+	int err;
+
+	err = tdram_image_alloc(name, len, &src->info, &img);
+	if (err)
+		return err;
+
+	for (i = 0; i < src->nr_extents; i++) {
+		struct tdram_extent *ext = src->extents[i];
+
+		if (ext) {
+			__sync_add_and_fetch(&ext->refs, 1);
+			img->extents[i] = ext;
 		}
 	}
-	DPRINTF("[%d]\n",count);
-	if (count != driver->info.size << SECTOR_SHIFT) {
-		ret = -1;
-	} else {
-		ret = 0;
+
+	*_img = img;
+	return 0;
+}
+
+/* Open the disk file and initialize ram state. */
+int tdram_open (td_driver_t *driver, const char *name,
+		struct td_vbd_encryption *encryption, td_flag_t flags)
+{
+	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	struct tdram_image *img, *src;
+	const char *source;
+	size_t len;
+	int err = 0;
+
+	source = strchr(name, '=');
+	len    = source ? (size_t)(source - name) : strlen(name);
+
+	pthread_mutex_lock(&tdram_lock);
+
+	img = tdram_image_find(name, len);
+	if (img) {
+		/* We assume that write access is controlled
+		 * at a higher level for multiple disks */
+		DPRINTF("Image already open, sharing it\n");
+		img->refs++;
+	} else if (source) {
+		src = tdram_image_find(source + 1, strlen(source + 1));
+		if (!src) {
+			DPRINTF("no image %s to clone\n", source + 1);
+			err = -ENOENT;
+		} else
+			err = tdram_image_clone(name, len, src, &img);
+	} else
+		err = tdram_image_load(name, &img);
+
+	if (!err && img->refs == 1)
+		list_add_tail(&img->entry, &tdram_images);
+
+	pthread_mutex_unlock(&tdram_lock);
+
+	if (err)
+		return err;
+
+	prv->img     = img;
+	driver->info = img->info;
+
+	if (flags & TD_OPEN_4K) {
+		if (img->info.size & ((TD_4K_SECTOR_SIZE >> SECTOR_SHIFT) - 1)) {
+			DPRINTF("%s: size not a multiple of 4K\n", img->name);
+			pthread_mutex_lock(&tdram_lock);
+			if (!--img->refs)
+				tdram_image_free(img);
+			pthread_mutex_unlock(&tdram_lock);
+			prv->img = NULL;
+			return -EINVAL;
+		}
+		driver->info.sector_size = TD_4K_SECTOR_SIZE;
 	}
 
-done:
-	return ret;
+	return 0;
 }
 
 void tdram_queue_read(td_driver_t *driver, td_request_t treq)
 {
-	int      size    = treq.secs * driver->info.sector_size;
-	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
-
-	memcpy(treq.buf, img + offset, size);
+	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	struct tdram_image *img = prv->img;
+	uint64_t offset = treq.sec * (uint64_t)SECTOR_SIZE;
+	uint64_t size   = treq.secs * (uint64_t)SECTOR_SIZE;
+	char *buf       = treq.buf;
+
+	while (size) {
+		uint64_t i   = offset >> TDRAM_EXTENT_SHIFT;
+		uint64_t off = offset & (TDRAM_EXTENT_SIZE - 1);
+		uint64_t n   = MIN(size, TDRAM_EXTENT_SIZE - off);
+
+		if (img->extents[i])
+			memcpy(buf, img->extents[i]->data + off, n);
+		else
+			memset(buf, 0, n);
+
+		buf    += n;
+		offset += n;
+		size   -= n;
+	}
 
 	td_complete_request(treq, 0);
 }
 
 void tdram_queue_write(td_driver_t *driver, td_request_t treq)
 {
-	int      size    = treq.secs * driver->info.sector_size;
-	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
-	
-	/* We assume that write access is controlled
-	 * at a higher level for multiple disks */
-	memcpy(img + offset, treq.buf, size);
+	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	struct tdram_image *img = prv->img;
+	uint64_t offset = treq.sec * (uint64_t)SECTOR_SIZE;
+	uint64_t size   = treq.secs * (uint64_t)SECTOR_SIZE;
+	char *buf       = treq.buf;
+
+	while (size) {
+		uint64_t i   = offset >> TDRAM_EXTENT_SHIFT;
+		uint64_t off = offset & (TDRAM_EXTENT_SIZE - 1);
+		uint64_t n   = MIN(size, TDRAM_EXTENT_SIZE - off);
+		struct tdram_extent *ext;
+
+		ext = tdram_extent_writable(img, i);
+		if (!ext) {
+			td_complete_request(treq, -ENOMEM);
+			return;
+		}
+
+		memcpy(ext->data + off, buf, n);
+
+		buf    += n;
+		offset += n;
+		size   -= n;
+	}
 
 	td_complete_request(treq, 0);
 }
 
+/*
+ * Extents never written to are holes, read as zeros. The run reaches
+ * over the following extents in the same state.
+ */
+static int tdram_sector_present(td_driver_t *driver, td_sector_t sec,
+				td_sector_t *secs)
+{
+	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	struct tdram_image *img = prv->img;
+	uint64_t i, n, end;
+	int present;
+
+	i = (sec << SECTOR_SHIFT) >> TDRAM_EXTENT_SHIFT;
+	if (i >= img->nr_extents) {
+		*secs = 1;
+		return 1;
+	}
+
+	present = !!img->extents[i];
+	for (n = i + 1; n < img->nr_extents; n++)
+		if (!!img->extents[n] != present)
+			break;
+
+	end   = (n << TDRAM_EXTENT_SHIFT) >> SECTOR_SHIFT;
+	*secs = MIN(end, driver->info.size) - sec;
+
+	return present;
+}
+
 int tdram_close(td_driver_t *driver)
 {
-	connections--;
-	
+	struct tdram_state *prv = (struct tdram_state *)driver->data;
+
+	pthread_mutex_lock(&tdram_lock);
+	if (!--prv->img->refs)
+		tdram_image_free(prv->img);
+	pthread_mutex_unlock(&tdram_lock);
+
+	prv->img = NULL;
+
 	return 0;
 }
 
@@ -253,6 +549,30 @@ int tdram_validate_parent(td_driver_t *driver,
 	return -EINVAL;
 }
 
+static void tdram_debug(td_driver_t *driver)
+{
+	struct tdram_state *prv = (struct tdram_state *)driver->data;
+	struct tdram_image *img = prv->img;
+	uint64_t i, used = 0, huge = 0, shared = 0;
+
+	for (i = 0; i < img->nr_extents; i++) {
+		struct tdram_extent *ext = img->extents[i];
+
+		if (!ext)
+			continue;
+		used++;
+		huge   += ext->huge;
+		shared += __atomic_load_n(&ext->refs, __ATOMIC_RELAXED) > 1;
+	}
+
+	tlog_write(TLOG_WARN, "%s: extents %llu of %llu, huge %llu, "
+		   "shared %llu, refs %d\n", img->name,
+		   (unsigned long long)used,
+		   (unsigned long long)img->nr_extents,
+		   (unsigned long long)huge,
+		   (unsigned long long)shared, img->refs);
+}
+
 struct tap_disk tapdisk_ram = {
 	.disk_type          = "tapdisk_ram",
 	.flags              = 0,
@@ -263,5 +583,6 @@ struct tap_disk tapdisk_ram = {
 	.td_queue_write     = tdram_queue_write,
 	.td_get_parent_id   = tdram_get_parent_id,
 	.td_validate_parent = tdram_validate_parent,
-	.td_debug           = NULL,
+	.td_debug           = tdram_debug,
+	.td_sector_present  = tdram_sector_present,
 };
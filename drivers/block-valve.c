@@ -37,6 +37,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
@@ -55,6 +56,8 @@ typedef struct td_valve_request td_valve_request_t;
 struct td_valve_request {
 	td_request_t            treq;
 	int                     secs;
+	int                     metered;
+	unsigned long long      start;  /* us, if sampling latency */
 
 	struct list_head        entry;
 	td_valve_t             *valve;
@@ -63,6 +66,21 @@ struct td_valve_request {
 struct td_valve_stats {
 	unsigned long long      stor;
 	unsigned long long      forw;
+	unsigned long long      throttled;
+};
+
+/*
+ * In-process limits: token buckets of requests and bytes per second,
+ * holding up to a burst's worth of credit. Tokens are counted in
+ * millionths, refilled per elapsed microsecond. A request is let
+ * through as long as no bucket is in debt, and takes its cost even if
+ * that runs one into debt, so requests larger than the burst still
+ * pass, at the average rate.
+ */
+struct td_valve_bucket {
+	unsigned long long      rate;   /* per second, 0 if unlimited */
+	long long               tokens;
+	long long               cap;
 };
 
 struct td_valve {
@@ -78,6 +96,18 @@ struct td_valve {
 	unsigned int            cred;
 	unsigned int            need;
 	unsigned int            done;
+	unsigned long           lease;
+	unsigned long           cls;
+	unsigned long           queued; /* bytes stored */
+
+	struct td_valve_bucket  iops;
+	struct td_valve_bucket  bps;
+	unsigned long           burst;  /* ms */
+
+	unsigned long           lat[TD_VALVE_LAT_BUCKETS];
+	unsigned long           n_lat;  /* samples to report */
+	unsigned long long      last;   /* us */
+	event_id_t              wait_id;
 
 	struct list_head        stor;
 	struct list_head        forw;
@@ -96,14 +126,23 @@ struct td_valve {
 	list_for_each_entry_safe(_req, _next, &(_valve)->forw, entry)
 
 #define TD_VALVE_CONNECT_INTERVAL 2 /* s */
+#define TD_VALVE_BURST            1000 /* ms */
+#define TD_VALVE_MAX_IDLE         60   /* s, bounds refills */
+#define TD_VALVE_TOKEN            1000000LL
 
 #define TD_VALVE_RDLIMIT  (1<<0)
 #define TD_VALVE_WRLIMIT  (1<<1)
+#define TD_VALVE_LOCAL    (1<<2)
+#define TD_VALVE_CLASSED  (1<<3)
+#define TD_VALVE_FEEDBACK (1<<4)
 #define TD_VALVE_KILLED   (1<<31)
 
 static void valve_schedule_retry(td_valve_t *);
 static void valve_conn_receive(td_valve_t *);
 static void valve_conn_request(td_valve_t *, unsigned long);
+static void valve_conn_lease(td_valve_t *);
+static void valve_conn_report(td_valve_t *);
+static int valve_sock_send(td_valve_t *, const void *, size_t);
 static void valve_forward_stored_requests(td_valve_t *);
 static void valve_kill(td_valve_t *);
 
@@ -139,6 +178,9 @@ static void valve_kill(td_valve_t *);
 
 #define TREQ_SIZE(_treq) ((unsigned int)(_treq.secs) << 9)
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
 static td_valve_request_t *
 valve_alloc_request(td_valve_t *valve)
 {
@@ -179,7 +221,8 @@ static void
 valve_clear_done_pending(td_valve_t *valve)
 {
 	WARN_ON(valve->done != 0);
-	tapdisk_server_mask_event(valve->sched_id, 1);
+	if (!valve->n_lat)
+		tapdisk_server_mask_event(valve->sched_id, 1);
 }
 
 static void
@@ -190,6 +233,9 @@ __valve_sched_event(event_id_t id, char mode, void *private)
 	if (likely(valve->done > 0))
 		/* flush valve->done */
 		valve_conn_request(valve, 0);
+
+	if (valve->n_lat && valve->sock >= 0)
+		valve_conn_report(valve);
 }
 
 static void
@@ -273,6 +319,16 @@ valve_sock_open(td_valve_t *valve)
 
 	valve_clear_done_pending(valve);
 
+	if (valve->flags & TD_VALVE_CLASSED) {
+		struct td_valve_req req = { TD_VALVE_CLASS, valve->cls };
+
+		err = valve_sock_send(valve, &req, sizeof(req));
+		if (err)
+			goto fail;
+	}
+
+	valve_conn_lease(valve);
+
 	return 0;
 
 fail:
@@ -350,18 +406,14 @@ valve_conn_open(td_valve_t *valve)
 static void
 valve_conn_close(td_valve_t *valve, int reset)
 {
-	td_valve_request_t *req, *next;
-
 	valve_sock_close(valve);
 
+	/* only in-process limits hold them back now */
 	if (reset)
-		td_valve_for_each_stored_request(req, next, valve) {
-			td_forward_request(req->treq);
-			valve->stats.forw++;
-			valve_free_request(valve, req);
-		}
+		valve_forward_stored_requests(valve);
 
-	WARN_ON(!list_empty(&valve->stor));
+	if (!(valve->flags & TD_VALVE_LOCAL))
+		WARN_ON(!list_empty(&valve->stor));
 }
 
 static void
@@ -440,23 +492,198 @@ valve_conn_request(td_valve_t *valve, unsigned long size)
 	valve_conn_reset(valve);
 }
 
+/*
+ * Reports latencies sampled since the last report, as a histogram.
+ */
+static void
+valve_conn_report(td_valve_t *valve)
+{
+	struct td_valve_req msg[TD_VALVE_LAT_BUCKETS];
+	int b, n, err;
+
+	for (b = 0, n = 0; b < TD_VALVE_LAT_BUCKETS; b++) {
+		if (!valve->lat[b])
+			continue;
+
+		msg[n].need = TD_VALVE_LATENCY(b);
+		msg[n].done = valve->lat[b];
+		n++;
+
+		valve->lat[b] = 0;
+	}
+
+	valve->n_lat = 0;
+	if (!valve->done)
+		valve_clear_done_pending(valve);
+
+	err = valve_sock_send(valve, msg, n * sizeof(msg[0]));
+	if (!err)
+		return;
+
+	VERR(err, "resetting connection");
+	valve_conn_reset(valve);
+}
+
+/*
+ * Asks the bridge for what stored requests need and we have not asked
+ * for yet. With a lease, asks in chunks of it, half a lease ahead,
+ * so that most requests find credit at hand.
+ */
+static void
+valve_conn_lease(td_valve_t *valve)
+{
+	unsigned long have, want;
+
+	if (valve->sock < 0 || valve->flags & TD_VALVE_KILLED)
+		return;
+
+	have = valve->cred + valve->need;
+	want = valve->queued + valve->lease / 2;
+
+	if (have >= want)
+		return;
+
+	valve_conn_request(valve, MIN(MAX(want - have, valve->lease),
+				      TD_RLB_REQUEST_MAX / 2));
+}
+
+static unsigned long long
+valve_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void
+valve_bucket_init(struct td_valve_bucket *b,
+		  unsigned long long rate, unsigned long burst)
+{
+	b->rate   = rate;
+	b->cap    = rate * burst * (TD_VALVE_TOKEN / 1000);
+	b->tokens = b->cap;
+}
+
+static void
+valve_bucket_fill(struct td_valve_bucket *b, unsigned long long us)
+{
+	if (b->rate)
+		b->tokens = MIN(b->cap, b->tokens + (long long)(us * b->rate));
+}
+
+static void
+valve_bucket_take(struct td_valve_bucket *b, unsigned long long n)
+{
+	if (b->rate)
+		b->tokens -= n * TD_VALVE_TOKEN;
+}
+
+/* until out of debt */
+static unsigned long long
+valve_bucket_wait_us(const struct td_valve_bucket *b)
+{
+	if (b->tokens >= 0)
+		return 0;
+
+	return (-b->tokens + b->rate - 1) / b->rate;
+}
+
+static void
+__valve_wait_timeout(event_id_t id, char mode, void *private)
+{
+	td_valve_t *valve = private;
+
+	tapdisk_server_unregister_event(valve->wait_id);
+	valve->wait_id = -1;
+
+	valve_forward_stored_requests(valve);
+}
+
+static void
+valve_local_wait(td_valve_t *valve)
+{
+	unsigned long long us;
+	int id;
+
+	if (valve->wait_id >= 0)
+		return;
+
+	us = MAX(valve_bucket_wait_us(&valve->iops),
+		 valve_bucket_wait_us(&valve->bps));
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					   -1, TV_USECS(MAX(us, 1)),
+					   __valve_wait_timeout,
+					   valve);
+	BUG_ON(id < 0);
+
+	valve->wait_id = id;
+}
+
+static int
+valve_local_expend(td_valve_t *valve, const td_request_t treq)
+{
+	unsigned long long now, us;
+
+	now = valve_now_us();
+	us  = MIN(now - valve->last, TD_VALVE_MAX_IDLE * 1000000ULL);
+
+	valve->last = now;
+
+	valve_bucket_fill(&valve->iops, us);
+	valve_bucket_fill(&valve->bps, us);
+
+	if (valve->iops.tokens < 0 || valve->bps.tokens < 0) {
+		valve->stats.throttled++;
+		valve_local_wait(valve);
+		return -EAGAIN;
+	}
+
+	valve_bucket_take(&valve->iops, 1);
+	valve_bucket_take(&valve->bps, TREQ_SIZE(treq));
+
+	return 0;
+}
+
 static int
 valve_expend_request(td_valve_t *valve, const td_request_t treq)
 {
-	if (valve->flags & TD_VALVE_KILLED)
-		return 0;
+	int remote, err;
 
-	if (valve->sock < 0)
-		return 0;
+	/* the bridge meters writes only */
+	remote = !(valve->flags & TD_VALVE_KILLED) && valve->sock >= 0 &&
+		treq.op == TD_OP_WRITE;
 
-	if (valve->cred < TREQ_SIZE(treq))
+	if (remote && valve->cred < TREQ_SIZE(treq))
 		return -EAGAIN;
 
-	valve->cred -= TREQ_SIZE(treq);
+	if (valve->flags & TD_VALVE_LOCAL) {
+		err = valve_local_expend(valve, treq);
+		if (err)
+			return err;
+	}
+
+	if (remote)
+		valve->cred -= TREQ_SIZE(treq);
 
 	return 0;
 }
 
+/*
+ * With feedback, the bridge learns how long the backend took for
+ * requests, from forwarding to completion.
+ */
+static void
+valve_sample_latency(td_valve_t *valve, unsigned long long us)
+{
+	valve->lat[td_valve_lat_bucket(us)]++;
+
+	if (!valve->n_lat++)
+		tapdisk_server_mask_event(valve->sched_id, 0);
+}
+
 static void
 __valve_complete_treq(td_request_t treq, int error)
 {
@@ -466,20 +693,44 @@ __valve_complete_treq(td_request_t treq, int error)
 	BUG_ON(req->secs < treq.secs);
 	req->secs -= treq.secs;
 
-	valve->done += TREQ_SIZE(treq);
-	valve_set_done_pending(valve);
+	if (req->metered) {
+		valve->done += TREQ_SIZE(treq);
+		valve_set_done_pending(valve);
+	}
 
 	if (!req->secs) {
+		if (req->start && valve->sock >= 0)
+			valve_sample_latency(valve, valve_now_us() - req->start);
+
 		td_complete_request(req->treq, error);
 		valve_free_request(valve, req);
 	}
 }
 
+static void
+valve_forward_request(td_valve_t *valve, td_valve_request_t *req)
+{
+	td_request_t clone;
+
+	clone         = req->treq;
+	clone.cb      = __valve_complete_treq;
+	clone.cb_data = req;
+
+	if (valve->flags & TD_VALVE_FEEDBACK)
+		req->start = valve_now_us();
+
+	list_move(&req->entry, &valve->forw);
+	/* 'list_move' must be run before td_forward_request.
+	 * 'req' may already be freed when td_forward_request returned.
+	 */
+	td_forward_request(clone);
+	valve->stats.forw++;
+}
+
 static void
 valve_forward_stored_requests(td_valve_t *valve)
 {
 	td_valve_request_t *req, *next;
-	td_request_t clone;
 	int err;
 
 	td_valve_for_each_stored_request(req, next, valve) {
@@ -488,17 +739,13 @@ valve_forward_stored_requests(td_valve_t *valve)
 		if (err)
 			break;
 
-		clone         = req->treq;
-		clone.cb      = __valve_complete_treq;
-		clone.cb_data = req;
+		valve->queued -= TREQ_SIZE(req->treq);
 
-		list_move(&req->entry, &valve->forw);
-		/* 'list_move' must be run before td_forward_request.
-		 * 'req' may already be freed when td_forward_request returned.
-		 */
-		td_forward_request(clone);
-		valve->stats.forw++;
+		valve_forward_request(valve, req);
 	}
+
+	/* top up the lease, if any */
+	valve_conn_lease(valve);
 }
 
 static int
@@ -510,14 +757,17 @@ valve_store_request(td_valve_t *valve, td_request_t treq)
 	if (!req)
 		return -EBUSY;
 
-	valve_conn_request(valve, TREQ_SIZE(treq));
-
-	req->treq = treq;
-	req->secs = treq.secs;
+	req->treq    = treq;
+	req->secs    = treq.secs;
+	req->metered = 1;
+	req->start   = 0;
 
 	list_add_tail(&req->entry, &valve->stor);
 	valve->stats.stor++;
 
+	valve->queued += TREQ_SIZE(treq);
+	valve_conn_lease(valve);
+
 	return 0;
 }
 
@@ -543,6 +793,7 @@ valve_init(td_valve_t *valve, unsigned long flags)
 
 	valve->retry_id = -1;
 	valve->sched_id = -1;
+	valve->wait_id  = -1;
 
 	valve->flags    = flags;
 
@@ -566,6 +817,11 @@ td_valve_close(td_driver_t *driver)
 
 	valve_conn_close(valve, 0);
 
+	if (valve->wait_id >= 0) {
+		tapdisk_server_unregister_event(valve->wait_id);
+		valve->wait_id = -1;
+	}
+
 	if (valve->brname) {
 		free(valve->brname);
 		valve->brname = NULL;
@@ -574,6 +830,116 @@ td_valve_close(td_driver_t *driver)
 	return 0;
 }
 
+static int
+valve_strtoull(const char *s, unsigned long long *val)
+{
+	char *end;
+
+	*val = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'G': case 'g':
+		*val <<= 10;
+	case 'M': case 'm':
+		*val <<= 10;
+	case 'K': case 'k':
+		*val <<= 10;
+		end++;
+	}
+
+	return *end || end == s ? -EINVAL : 0;
+}
+
+/*
+ * [<bridge>][,iops=<n>][,bps=<n>[KMG]][,burst=<ms>][,lease=<n>[KMG]]
+ *  [,class=<n>][,feedback=1]
+ *
+ * The bridge is a td-rated socket, named or by path, metering writes.
+ * iops and bps limit reads and writes in-process, with credit for
+ * bursts of up to a second by default. lease has credit asked from
+ * the bridge in chunks of that many bytes, not request by request.
+ * class joins a class of a fair bridge. With feedback, backend
+ * latencies are reported to the bridge, for a latency valve to act on.
+ */
+static int
+valve_parse(td_valve_t *valve, const char *name)
+{
+	unsigned long long iops, bps, val;
+	char *s, *tok, *arg, *save;
+	int err;
+
+	iops  = 0;
+	bps   = 0;
+	err   = 0;
+
+	valve->burst = TD_VALVE_BURST;
+
+	s = strdup(name);
+	if (!s)
+		return -errno;
+
+	for (tok = strtok_r(s, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+
+		arg = strchr(tok, '=');
+		if (!arg) {
+			if (valve->brname) {
+				err = -EINVAL;
+				break;
+			}
+
+			valve->brname = strdup(tok);
+			if (!valve->brname) {
+				err = -errno;
+				break;
+			}
+
+			continue;
+		}
+
+		*arg++ = 0;
+
+		err = valve_strtoull(arg, &val);
+		if (err)
+			break;
+
+		if (!strcmp(tok, "iops"))
+			iops = val;
+		else if (!strcmp(tok, "bps"))
+			bps = val;
+		else if (!strcmp(tok, "burst"))
+			valve->burst = val;
+		else if (!strcmp(tok, "lease"))
+			valve->lease = MIN(val, TD_RLB_REQUEST_MAX / 2);
+		else if (!strcmp(tok, "class")) {
+			valve->cls    = val;
+			valve->flags |= TD_VALVE_CLASSED;
+		} else if (!strcmp(tok, "feedback")) {
+			if (val)
+				valve->flags |= TD_VALVE_FEEDBACK;
+		} else {
+			err = -EINVAL;
+			break;
+		}
+	}
+
+	free(s);
+
+	if (err) {
+		ERR("bad valve parameters: %s", name);
+		return err;
+	}
+
+	if (iops || bps) {
+		valve->flags |= TD_VALVE_LOCAL | TD_VALVE_RDLIMIT;
+		valve_bucket_init(&valve->iops, iops, valve->burst);
+		valve_bucket_init(&valve->bps, bps, valve->burst);
+		valve->last = valve_now_us();
+	}
+
+	return 0;
+}
+
 static int
 td_valve_open(td_driver_t *driver, const char *name,
 	      struct td_vbd_encryption *encryption, td_flag_t flags)
@@ -583,13 +949,12 @@ td_valve_open(td_driver_t *driver, const char *name,
 
 	valve_init(valve, TD_VALVE_WRLIMIT);
 
-	valve->brname = strdup(name);
-	if (!valve->brname) {
-		err = -errno;
+	err = valve_parse(valve, name);
+	if (err)
 		goto fail;
-	}
 
-	valve_conn_open(valve);
+	if (valve->brname)
+		valve_conn_open(valve);
 
 	return 0;
 
@@ -622,9 +987,12 @@ td_valve_queue_request(td_driver_t *driver, td_request_t treq)
 		BUG();
 	}
 
-	err = valve_expend_request(valve, treq);
-	if (!err)
-		goto forward;
+	/* in order, behind those already waiting */
+	if (list_empty(&valve->stor)) {
+		err = valve_expend_request(valve, treq);
+		if (!err)
+			goto forward;
+	}
 
 	err = valve_store_request(valve, treq);
 	if (err)
@@ -633,8 +1001,26 @@ td_valve_queue_request(td_driver_t *driver, td_request_t treq)
 	return;
 
 forward:
+	if (valve->flags & TD_VALVE_FEEDBACK && valve->sock >= 0) {
+		td_valve_request_t *req = valve_alloc_request(valve);
+
+		if (req) {
+			req->treq    = treq;
+			req->secs    = treq.secs;
+			req->metered = 0;
+
+			INIT_LIST_HEAD(&req->entry);
+			valve_forward_request(valve, req);
+			goto out;
+		}
+	}
+
 	td_forward_request(treq);
 	valve->stats.forw++;
+out:
+
+	if (valve->lease)
+		valve_conn_lease(valve);
 }
 
 static int
@@ -657,12 +1043,23 @@ td_valve_stats(td_driver_t *driver, td_stats_t *st)
 	td_valve_request_t *req, *next;
 	int n_reqs;
 
-	tapdisk_stats_field(st, "bridge", "d", valve->brname);
+	if (valve->brname)
+		tapdisk_stats_field(st, "bridge", "s", valve->brname);
 	tapdisk_stats_field(st, "flags", "#x", valve->flags);
 
 	tapdisk_stats_field(st, "cred", "d", valve->cred);
 	tapdisk_stats_field(st, "need", "d", valve->need);
 	tapdisk_stats_field(st, "done", "d", valve->done);
+	tapdisk_stats_field(st, "lease", "lu", valve->lease);
+	if (valve->flags & TD_VALVE_CLASSED)
+		tapdisk_stats_field(st, "class", "lu", valve->cls);
+
+	if (valve->flags & TD_VALVE_LOCAL) {
+		tapdisk_stats_field(st, "iops", "llu", valve->iops.rate);
+		tapdisk_stats_field(st, "bps", "llu", valve->bps.rate);
+		tapdisk_stats_field(st, "throttled", "llu",
+				    valve->stats.throttled);
+	}
 
 	/*
 	 * stored is [ waiting, total-waits ]
@@ -691,6 +1088,15 @@ td_valve_stats(td_driver_t *driver, td_stats_t *st)
 	tapdisk_stats_leave(st, ']');
 }
 
+static int
+td_valve_sector_present(td_driver_t *driver, td_sector_t sec,
+			td_sector_t *secs)
+{
+	/* reads all pass through */
+	*secs = driver->info.size - sec;
+	return 0;
+}
+
 struct tap_disk tapdisk_valve = {
 	.disk_type                  = "tapdisk_valve",
 	.flags                      = 0,
@@ -702,4 +1108,5 @@ struct tap_disk tapdisk_valve = {
 	.td_get_parent_id           = td_valve_get_parent_id,
 	.td_validate_parent         = td_valve_validate_parent,
 	.td_stats                   = td_valve_stats,
+	.td_sector_present          = td_valve_sector_present,
 };
@@ -35,6 +35,46 @@
 #define TD_RLB_CONN_MAX           1024
 #define TD_RLB_REQUEST_MAX        (8 << 20)
 
+/* need == TD_VALVE_CLASS: done is the class the connection joins */
+#define TD_VALVE_CLASS            (~0UL)
+
+/*
+ * need == TD_VALVE_LATENCY(b): done requests completed with latencies
+ * in bucket b. Buckets are quarter octaves of microseconds, single
+ * ones below 4us, the last one open-ended, from about 30s.
+ */
+#define TD_VALVE_LAT_BUCKETS      96
+#define TD_VALVE_LATENCY(_b)      (TD_VALVE_CLASS - 1 - (_b))
+#define TD_VALVE_LATENCY_BUCKET(_need) \
+	((int)(TD_VALVE_CLASS - 1 - (_need)))
+#define TD_VALVE_IS_LATENCY(_need) \
+	((_need) < TD_VALVE_CLASS && \
+	 (_need) >= TD_VALVE_LATENCY(TD_VALVE_LAT_BUCKETS - 1))
+
+static inline int
+td_valve_lat_bucket(unsigned long long us)
+{
+	int msb, b;
+
+	if (us < 4)
+		return us;
+
+	msb = 63 - __builtin_clzll(us);
+	b   = (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+
+	return b < TD_VALVE_LAT_BUCKETS ? b : TD_VALVE_LAT_BUCKETS - 1;
+}
+
+/* lowest latency in bucket b */
+static inline unsigned long long
+td_valve_lat_usec(int b)
+{
+	if (b < 4)
+		return b;
+
+	return (4ULL + b % 4) << (b / 4 - 1);
+}
+
 struct td_valve_req {
 	unsigned long need;
 	unsigned long done;
@@ -60,6 +60,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
 #include <uuid/uuid.h> /* For whatever reason, Linux packages this in */
                        /* e2fsprogs-devel.                            */
 #include <string.h>    /* for memset.                                 */
@@ -67,15 +68,24 @@
 #include <sys/mman.h>
 #include <limits.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "debug.h"
 #include "libvhd.h"
+#include "zimg.h"
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-storage.h"
+#include "tapdisk-offload.h"
+#include "tapdisk-probe.h"
+#include "tapdisk-utils.h"
+#include "tapdisk-server.h"
 #include "block-crypto.h"
+#include "crc32c.h"
+#include "timeout-math.h"
 
 unsigned int SPB;
 
@@ -86,14 +96,26 @@ unsigned int SPB;
 
 #define VHD_BATMAP_MAX_RETRIES 10
 
+#define VHD_SHARED_BAT_DIR           "/dev/shm"
+#define VHD_SHARED_BAT_MAGIC         0x74646261 /* "tdba" */
+#define VHD_SHARED_BAT_VERSION       1
+#define VHD_SHARED_BAT_HDR_SIZE      4096
+
+#define VHD_MDLOG_MAGIC              0x676f6c646d646876ULL /* vhdmdlog */
+#define VHD_MDLOG_VERSION            2
+#define VHD_MDLOG_ALIGN              4096
+#define VHD_MDLOG_REC_HDR            VHD_SECTOR_SIZE
+#define VHD_MDLOG_SIZE_KB            4096
+#define VHD_MDLOG_MIN_KB             64
+
 #define __TRACE(s)							\
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%u, BBLK: 0x%04x\n",				\
+		    "%u, ALLOCS: 0x%04x\n",				\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
-		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->vreq_max - s->vreq_free_count,			\
+		    s->bat.allocs);					\
 	} while(0)
 
 #if (DEBUGGING == 1)
@@ -111,7 +133,20 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               32 /* bitmaps, minimum and first slab */
+#define VHD_CACHE_BUDGET_KB          4096
+
+#define VHD_RA_BLOCKS                4  /* default bitmap readahead */
+#define VHD_RA_BLOCKS_MAX            (VHD_CACHE_SIZE / 4)
+#define VHD_RA_SEQ_MIN               2  /* sequential reads before it starts */
+
+#define VHD_EXTENT_BLOCKS            8  /* blocks claimed at a time */
+#define VHD_EXTENT_BLOCKS_MAX        256
+
+#define VHD_ZERO_CLEAR_MIN           128 /* secs; less is cheaper written */
+
+#define VHD_CRYPTO_BUF_SECS          (MAX_SEGMENTS_PER_REQ * 8)
+#define VHD_CRYPTO_BUFS              64 /* kept for reuse */
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
@@ -124,6 +159,9 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
 #define VHD_OP_REDUNDANT_BM_WRITE    6
+#define VHD_OP_DATA_DISCARD          7
+#define VHD_OP_DATA_WRITE_ZEROES     8
+#define VHD_OP_FLUSH                 9
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -140,9 +178,29 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_PREALLOCATE    32
 #define VHD_FLAG_OPEN_NO_O_DIRECT    64
 #define VHD_FLAG_OPEN_LOCAL_CACHE    128
+#define VHD_FLAG_OPEN_SHAREABLE      256
+#define VHD_FLAG_OPEN_4K             512
+
+/*
+ * BATs larger than VHD_BAT_LAZY_KB of read-only images are loaded a page
+ * of entries at a time, see vhd_initialize_lazy_bat.
+ */
+#define VHD_BAT_LAZY_KB              1024
+#define VHD_BAT_PAGE_SHIFT           10
+#define VHD_BAT_PAGE_ENTRIES         (1U << VHD_BAT_PAGE_SHIFT)
+#define VHD_BAT_PAGE_BYTES           (VHD_BAT_PAGE_ENTRIES * sizeof(uint32_t))
+#define VHD_BAT_FILL_PAGES           64 /* read at a time in the background */
+
+#define VHD_BAT_PAGE_UNLOADED        0
+#define VHD_BAT_PAGE_LOADING         1
+#define VHD_BAT_PAGE_LOADED          2
 
-#define VHD_FLAG_BAT_LOCKED          1
-#define VHD_FLAG_BAT_WRITE_STARTED   2
+#define VHD_BAT_ALLOC_MAX            16 /* block allocations in flight */
+#define VHD_BAT_ALLOC_ALL            ((1U << VHD_BAT_ALLOC_MAX) - 1)
+
+#define VHD_FLAG_ALLOC_ZEROED        1
+#define VHD_FLAG_ALLOC_WRITE_STARTED 2
+#define VHD_FLAG_ALLOC_WRITTEN       4
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
@@ -153,6 +211,7 @@ unsigned int SPB;
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
 #define VHD_FLAG_REQ_QUEUED          4
 #define VHD_FLAG_REQ_FINISHED        8
+#define VHD_FLAG_REQ_ZERO            16 /* clears bits, no data written */
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
@@ -186,24 +245,181 @@ struct vhd_request {
 	struct vhd_state         *state;
 	struct vhd_request       *next;
 	struct vhd_transaction   *tx;
+	uint64_t                  offset;      /* of a write, in bytes */
+	uint32_t                  mdlog_gen;   /* a bitmap read was issued in */
+	td_offload_work_t         crypto;      /* while on the crypto pool */
+};
+
+/*
+ * A block being allocated. Its bitmap area is zeroed first, then its BAT
+ * entry is written. The BAT entry only ever points at a zeroed bitmap.
+ */
+struct vhd_bat_alloc {
+	uint32_t                  blk;
+	uint64_t                  start;       /* first sector reserved */
+	uint64_t                  offset;      /* sector of the new bitmap */
+	vhd_flag_t                status;
+	int                       error;
+	struct vhd_request        zero_req;    /* for initializing the bitmap */
+	struct vhd_transaction   *tx;          /* bitmap tx waiting for the bat
+						* write */
+};
+
+/*
+ * A BAT sector write, covering all allocations in that sector whose bitmap
+ * was zeroed by the time it was issued. Only one write per BAT sector is in
+ * flight at a time, so that they reach the disk in order.
+ */
+struct vhd_bat_write {
+	uint32_t                  sector;      /* BAT sector, blk / 128 */
+	uint32_t                  allocs;      /* mask of allocations */
+	char                     *buf;
+	struct vhd_request        req;
 };
 
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
-	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
-	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
+	uint32_t                  allocs;      /* mask of allocations in use */
+	uint32_t                  writes;      /* mask of bat writes in flight */
+	struct vhd_bat_alloc      alloc[VHD_BAT_ALLOC_MAX];
+	struct vhd_bat_write      write[VHD_BAT_ALLOC_MAX];
 	char                     *bat_buf;
+
+	/* bat and batmap mapped from a shared cache file, if not NULL */
+	void                     *shared;
+	size_t                    shared_size;
+	int                       shared_fd;
+	char                     *shared_path;
+
+	/*
+	 * Page states (VHD_BAT_PAGE_*) of a BAT loaded lazily, NULL if it
+	 * was read whole. Pages are claimed by compare-and-swap, by the
+	 * fill thread or by whoever needs them first.
+	 */
+	uint8_t                  *pages;
+	uint32_t                  nr_pages;
+	uint64_t                  page_loads;  /* loaded on demand */
+	int                       fill_running;
+	int                       fill_stop;
+	int                       fill_publish; /* shared bat, once loaded */
+	pthread_t                 fill_thread;
+
+	/*
+	 * Read-only images: blocks whose bitmaps were read and found full,
+	 * as the batmap would have them if the image had one that is up to
+	 * date. NULL in writable images.
+	 */
+	char                     *full;
+	uint32_t                  full_blocks;
+
+	/*
+	 * Allocated blocks, counted once the whole BAT is loaded and kept
+	 * up to date as allocations reach the BAT.
+	 */
+	uint32_t                  allocated;
+	int                       allocated_valid;
+};
+
+/*
+ * Header of a shared BAT cache file. Read-only images opened shareable
+ * (the parents of a chain) publish their BAT and batmap in a file under
+ * TAPDISK3_VHD_SHARED_BAT_DIR, named after the image's device and inode,
+ * which every later opener maps instead of reading and keeping its own
+ * copy. The image identity is checked again against the header before
+ * the mapping is used.
+ */
+struct vhd_shared_bat {
+	uint32_t                  magic;
+	uint32_t                  version;
+	uint64_t                  dev;
+	uint64_t                  ino;
+	uint64_t                  size;
+	uint64_t                  mtime;       /* ns */
+	uuid_t                    uuid;
+	uint32_t                  timestamp;
+	uint32_t                  entries;
+	uint32_t                  spb;
+	uint32_t                  has_batmap;
+	uint64_t                  bat_offset;
+	uint64_t                  map_offset;
+	uint64_t                  map_size;
+	vhd_batmap_header_t       batmap_header;
+};
+
+/*
+ * Metadata log. A record is a header sector followed by the data written
+ * at offset in the image, padded to VHD_MDLOG_ALIGN. Records of the
+ * current generation follow the log header back to back, numbered from
+ * 0; those of an older one, or which do not check out, are not replayed.
+ */
+struct vhd_mdlog_header {
+	uint64_t                  magic;
+	uint32_t                  version;
+	uint32_t                  gen;
+	uuid_t                    uuid;        /* of the image */
+	uint32_t                  checksum;
+};
+
+struct vhd_mdlog_record {
+	uint64_t                  magic;
+	uint32_t                  gen;
+	uint32_t                  secs;
+	uint64_t                  seq;
+	uint64_t                  offset;      /* in the image, bytes */
+	uint32_t                  checksum;    /* of record and data */
+};
+
+/* the latest record for an offset in the image, since the checkpoint */
+struct vhd_mdlog_entry {
+	uint64_t                  offset;
+	uint64_t                  rec;         /* in the log, bytes */
+	uint32_t                  secs;
+	uint32_t                  next;        /* in the hash chain, +1 */
+};
+
+struct vhd_mdlog {
+	int                       fd;
+	char                     *path;
+	char                     *buf;         /* the log, as written */
+	uint64_t                  size;
+	uint64_t                  head;        /* of the next record */
+	uint32_t                  gen;
+	uint64_t                  seq;
+
+	struct vhd_mdlog_entry   *entries;
+	uint32_t                  nr_entries;
+	uint32_t                 *hash;
+	uint32_t                  hash_mask;
+
+	/* writes waiting for the log to be checkpointed */
+	int                       inflight;
+	struct vhd_request       *wait_head;
+	struct vhd_request       *wait_tail;
+
+	/* a checkpoint in flight: its writes, then the sync, then the header */
+	struct tiocb             *ckpt;
+	struct tiocb              ckpt_sync;
+	int                       ckpt_pending;
+	int                       ckpt_error;
+
+	/* a checkpoint failed, waiting writes fail with it */
+	int                       error;
+	event_id_t                fail_event;
+
+	uint64_t                  records;
+	uint64_t                  checkpoints;
 };
 
 struct vhd_bitmap {
 	uint32_t                  blk;
-	uint64_t                  seqno;       /* lru sequence number */
 	vhd_flag_t                status;
 
+	struct vhd_bitmap        *hash_next;   /* hash chain if cached, free
+						* list otherwise */
+	struct vhd_bitmap        *lru_prev;    /* lru list, least recently */
+	struct vhd_bitmap        *lru_next;    /* used first */
+
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
 	char                     *shadow;      /* in-memory bitmap changes are 
@@ -221,11 +437,25 @@ struct vhd_bitmap {
 	struct vhd_request        req;
 };
 
+struct vhd_bitmap_slab {
+	struct vhd_bitmap_slab   *next;
+	struct vhd_bitmap        *bitmaps;
+	char                     *buf;         /* maps and shadows */
+};
+
+/* data requests stay put as the pool grows */
+struct vhd_request_slab {
+	struct vhd_request_slab  *next;
+	int                       nr;
+	struct vhd_request        reqs[];
+};
+
 struct vhd_state {
 	vhd_flag_t                flags;
 
         /* VHD stuff */
 	vhd_context_t             vhd;
+	struct tapdisk_storage_profile profile;
 	uint32_t                  spp;         /* sectors per page */
 	uint32_t                  spb;         /* sectors per block */
 	uint64_t                  first_db;    /* pointer to datablock 0 */
@@ -238,17 +468,29 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	uint64_t                  bm_lru;      /* lru sequence number */
 	uint32_t                  bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
 
-	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	/*
+	 * Bitmap cache. Bitmaps are allocated in slabs as the cache fills, up
+	 * to bm_max as permitted by the memory budget, and only then are the
+	 * least recently used ones evicted.
+	 */
+	struct vhd_bitmap       **bm_hash;     /* cached bitmaps, by block */
+	uint32_t                  bm_hash_mask;
+	struct vhd_bitmap        *bm_lru_head;
+	struct vhd_bitmap        *bm_lru_tail;
+	struct vhd_bitmap        *bm_free;
+	struct vhd_bitmap_slab   *bm_slabs;
+	int                       bm_count;    /* bitmaps allocated */
+	int                       bm_max;
+	uint64_t                  bm_hits;
+	uint64_t                  bm_misses;
+	uint64_t                  bm_evictions;
 
 	int                       vreq_free_count;
-	struct vhd_request       *vreq_free[VHD_REQS_DATA];
-	struct vhd_request        vreq_list[VHD_REQS_DATA];
+	int                       vreq_max;
+	struct vhd_request      **vreq_free;
+	struct vhd_request_slab  *vreq_slabs;
 
 	/* for redundant bitmap writes */
 	int                       padbm_size;
@@ -256,6 +498,68 @@ struct vhd_state {
 	long int                  debug_skipped_redundant_writes;
 	long int                  debug_done_redundant_writes;
 
+	/* bitmap readahead for sequential reads */
+	int                       ra_blocks;   /* blocks ahead, 0 if disabled */
+	int                       ra_seq;      /* sequential reads so far */
+	uint64_t                  ra_next_sec; /* sector a sequential read
+						* would start at */
+	uint32_t                  ra_blk;      /* block readahead last ran for */
+	uint64_t                  ra_reads;    /* bitmap reads it issued */
+
+	/*
+	 * Without preallocation, space past next_db is claimed an extent of
+	 * extent_blocks blocks at a time: the file grows once per extent
+	 * rather than with every new block. The footer is only put back at
+	 * the end on close.
+	 */
+	int                       extent_blocks; /* 0 if disabled */
+	uint64_t                  extent_end;  /* end of claimed space, secs */
+	uint64_t                  extents;     /* extents claimed */
+
+	/*
+	 * Claimed file space from zeroed_from up to extent_end was a hole
+	 * never written, or 0 if there is none. Blocks allocated there
+	 * need not have their bitmaps zeroed before the BAT points at them.
+	 */
+	uint64_t                  zeroed_from;
+	uint64_t                  zero_bm_skipped;
+
+	/* strict opens: footer to be killed before the first new block */
+	int                       footer_kill;
+
+	/* all-zero writes to dynamic disks elided, if enabled */
+	int                       zero_detect;
+	uint64_t                  zero_secs;   /* sectors not written */
+
+	/* discards, with whole blocks punched out of files if enabled */
+	int                       discard_punch;
+	uint64_t                  discard_secs; /* sectors released */
+	uint64_t                  punched_secs; /* sectors punched out */
+	int                       no_zero_range; /* zeroing files failed */
+
+	/* BAT and bitmap writes go here, if enabled */
+	struct vhd_mdlog         *mdlog;
+
+	/* a write completed since the last flush was issued */
+	int                       dirty;
+	uint64_t                  flushes;
+
+	/*
+	 * Encryption offloaded to the crypto pool, each thread of which
+	 * has its own copy of the cipher. NULL if done inline.
+	 */
+	td_offload_t             *crypto_chan;
+	struct crypto_blkcipher  *crypto_tfm[TD_OFFLOAD_MAX_THREADS];
+	int                       crypto_threads;
+
+	/*
+	 * Ciphertext buffers of writes, of VHD_CRYPTO_BUF_SECS each. Those
+	 * freed are kept for reuse, up to VHD_CRYPTO_BUFS of them. Larger
+	 * writes get a buffer of their own.
+	 */
+	char                     *crypto_bufs[VHD_CRYPTO_BUFS];
+	int                       crypto_nr_bufs;
+
 	td_driver_t              *driver;
 
 	uint64_t                  queued;
@@ -276,8 +580,17 @@ struct crypto_interface
 	void (*vhd_crypto_encrypt)(
 		vhd_context_t *, td_request_t *, char *);
 	void (*vhd_crypto_decrypt)(vhd_context_t *, td_request_t *);
+
+	/* optional, for the crypto pool */
+	struct crypto_blkcipher *(*vhd_crypto_clone)(vhd_context_t *);
+	void (*vhd_crypto_free)(struct crypto_blkcipher *);
+	void (*vhd_crypto_encrypt_with)(
+		struct crypto_blkcipher *, td_request_t *, char *);
+	void (*vhd_crypto_decrypt_with)(
+		struct crypto_blkcipher *, td_request_t *);
 };
 
+/* the library's, once loaded, see __load_crypto */
 static struct crypto_interface *crypto_interface = NULL;
 static void *crypto_handle;
 
@@ -285,10 +598,26 @@ static void *crypto_handle;
 #define set_vhd_flag(word, flag)   ((word) |= (flag))
 #define clear_vhd_flag(word, flag) ((word) &= ~(flag))
 
-#define bat_entry(s, blk)          ((s)->bat.bat.bat[(blk)])
+#define bat_entry(s, blk)          (*vhd_bat_slot((s), (blk)))
 
 static void vhd_complete(void *, struct tiocb *, int);
+static void vhd_load_bat_page(struct vhd_state *, uint32_t);
+static void finish_data_write(struct vhd_request *);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static void vhd_mdlog_kick(struct vhd_state *);
+
+static inline uint32_t *
+vhd_bat_slot(struct vhd_state *s, uint32_t blk)
+{
+	uint32_t page = blk >> VHD_BAT_PAGE_SHIFT;
+
+	if (unlikely(s->bat.pages != NULL) && blk < s->bat.bat.entries &&
+	    __atomic_load_n(&s->bat.pages[page], __ATOMIC_ACQUIRE) !=
+	    VHD_BAT_PAGE_LOADED)
+		vhd_load_bat_page(s, page);
+
+	return &s->bat.bat.bat[blk];
+}
 
 static struct vhd_state  *_vhd_master;
 static unsigned long      _vhd_zsize;
@@ -303,7 +632,9 @@ vhd_initialize(struct vhd_state *s)
 	if (_vhd_zeros)
 		return 0;
 
-	_vhd_zsize = 2 * getpagesize();
+	/* room for the largest bitmap and its padding */
+	_vhd_zsize = 2 * getpagesize() +
+		((1ULL << VHD_BLOCK_SHIFT_MAX) >> (VHD_SECTOR_SHIFT + 3));
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
 		_vhd_zsize += VHD_BLOCK_SIZE;
 
@@ -388,6 +719,26 @@ test_batmap(struct vhd_state *s, uint32_t blk)
 	return vhd_batmap_test(&s->vhd, &s->bat.batmap, blk);
 }
 
+/*
+ * Reads of full blocks go straight to data, without a bitmap.
+ */
+static inline int
+test_block_full(struct vhd_state *s, uint32_t blk)
+{
+	if (s->bat.full && test_bit(s->bat.full, blk))
+		return 1;
+	return test_batmap(s, blk);
+}
+
+static inline void
+set_block_full(struct vhd_state *s, uint32_t blk)
+{
+	if (!test_bit(s->bat.full, blk)) {
+		set_bit(s->bat.full, blk);
+		s->bat.full_blocks++;
+	}
+}
+
 static int
 vhd_kill_footer(struct vhd_state *s)
 {
@@ -452,210 +803,1674 @@ find_next_free_block(struct vhd_state *s)
 }
 
 static void
-vhd_free_bat(struct vhd_state *s)
+vhd_shared_bat_init(struct vhd_state *s, struct vhd_shared_bat *sb)
 {
-	free(s->bat.bat.bat);
-	free(s->bat.batmap.map);
-	free(s->bat.bat_buf);
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	struct stat st;
+
+	memset(sb, 0, sizeof(*sb));
+
+	if (!fstat(s->vhd.fd, &st)) {
+		if (S_ISBLK(st.st_mode)) {
+			sb->dev   = st.st_rdev;
+		} else {
+			sb->dev   = st.st_dev;
+			sb->ino   = st.st_ino;
+			sb->size  = st.st_size;
+			sb->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL +
+				st.st_mtim.tv_nsec;
+		}
+	}
+
+	sb->magic     = VHD_SHARED_BAT_MAGIC;
+	sb->version   = VHD_SHARED_BAT_VERSION;
+	sb->timestamp = s->vhd.footer.timestamp;
+	sb->entries   = s->vhd.header.max_bat_size;
+	uuid_copy(sb->uuid, s->vhd.footer.uuid);
 }
 
 static int
-vhd_initialize_bat(struct vhd_state *s)
+vhd_shared_bat_path(struct vhd_state *s, struct vhd_shared_bat *sb,
+		    char **path)
 {
-	int err, batmap_required, i;
-	void *buf;
+	const char *dir;
 
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	dir = getenv("TAPDISK3_VHD_SHARED_BAT_DIR");
+	if (!dir)
+		dir = VHD_SHARED_BAT_DIR;
+	if (!*dir)
+		return -ENOENT;
 
-	err = vhd_read_bat(&s->vhd, &s->bat.bat);
-	if (err) {
-		EPRINTF("%s: reading bat: %d\n", s->vhd.file, err);
+	if (asprintf(path, "%s/td-vhd-bat-%"PRIx64"-%"PRIx64,
+		     dir, sb->dev, sb->ino) == -1)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Maps an existing shared BAT cache file for this image, in place of
+ * reading the BAT and batmap.
+ */
+static int
+vhd_attach_shared_bat(struct vhd_state *s)
+{
+	int fd, err;
+	char *path;
+	void *map;
+	struct stat st;
+	struct vhd_shared_bat id, *sb;
+
+	vhd_shared_bat_init(s, &id);
+
+	err = vhd_shared_bat_path(s, &id, &path);
+	if (err)
 		return err;
+
+	map = MAP_FAILED;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		err = -errno;
+		goto fail;
 	}
 
-	batmap_required = 1;
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY)) {
-		batmap_required = 0;
-	} else {
-		err = find_next_free_block(s);
-		if (err)
-			goto fail;
+	/* held until close; whoever closes last removes the file */
+	if (flock(fd, LOCK_SH) || fstat(fd, &st)) {
+		err = -errno;
+		goto fail;
 	}
 
-	if (vhd_has_batmap(&s->vhd)) {
-		for (i = 0; i < VHD_BATMAP_MAX_RETRIES; i++) {
-			err = vhd_read_batmap(&s->vhd, &s->bat.batmap);
-			if (err) {
-				EPRINTF("%s: reading batmap: %d\n",
-						s->vhd.file, err);
-				if (batmap_required)
-					goto fail;
-			} else {
-				break;
-			}
-		}
-		if (err)
-			EPRINTF("%s: ignoring non-critical batmap error\n",
-					s->vhd.file);
+	err = -EINVAL;
+	if (st.st_size < VHD_SHARED_BAT_HDR_SIZE)
+		goto fail;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		err = -errno;
+		goto fail;
 	}
 
-	err = posix_memalign(&buf, VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
-	if (err)
+	sb = map;
+	if (sb->magic != id.magic || sb->version != id.version ||
+	    sb->dev != id.dev || sb->ino != id.ino ||
+	    sb->size != id.size || sb->mtime != id.mtime ||
+	    sb->timestamp != id.timestamp || sb->entries != id.entries ||
+	    uuid_compare(sb->uuid, id.uuid) ||
+	    sb->bat_offset + (uint64_t)sb->entries * sizeof(uint32_t) >
+	    (uint64_t)st.st_size ||
+	    sb->map_offset + sb->map_size > (uint64_t)st.st_size)
 		goto fail;
 
-	s->bat.bat_buf = buf;
+	s->bat.bat.spb     = sb->spb;
+	s->bat.bat.entries = sb->entries;
+	s->bat.bat.bat     = (uint32_t *)((char *)map + sb->bat_offset);
+
+	memset(&s->bat.batmap, 0, sizeof(s->bat.batmap));
+	if (sb->has_batmap) {
+		s->bat.batmap.header = sb->batmap_header;
+		s->bat.batmap.map    = (char *)map + sb->map_offset;
+	}
 
+	s->bat.shared      = map;
+	s->bat.shared_size = st.st_size;
+	s->bat.shared_fd   = fd;
+	s->bat.shared_path = path;
+
+	DPRINTF("%s: using shared bat %s\n", s->vhd.file, path);
 	return 0;
 
 fail:
-	vhd_free_bat(s);
+	if (map != MAP_FAILED)
+		munmap(map, st.st_size);
+	if (fd != -1)
+		close(fd);
+	free(path);
 	return err;
 }
 
-static void
-vhd_free_bitmap_cache(struct vhd_state *s)
+/*
+ * Writes the BAT and batmap just read to a new shared BAT cache file,
+ * replacing any stale one.
+ */
+static int
+vhd_publish_shared_bat(struct vhd_state *s)
 {
-	int i;
-	struct vhd_bitmap *bm;
+	int fd, err;
+	char *path, *tmp;
+	size_t bat_size;
+	struct vhd_shared_bat *sb;
+	void *buf;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
-	}
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE, VHD_SHARED_BAT_HDR_SIZE);
+	if (err)
+		return -err;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
-}
+	memset(buf, 0, VHD_SHARED_BAT_HDR_SIZE);
+	sb   = buf;
+	path = tmp = NULL;
+	fd   = -1;
 
-static int
-vhd_initialize_bitmap_cache(struct vhd_state *s)
-{
-	int i, err, map_size;
-	struct vhd_bitmap *bm;
-	void *map, *shadow;
+	vhd_shared_bat_init(s, sb);
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	bat_size        = s->bat.bat.entries * sizeof(uint32_t);
+	sb->entries     = s->bat.bat.entries;
+	sb->spb         = s->bat.bat.spb;
+	sb->bat_offset  = VHD_SHARED_BAT_HDR_SIZE;
+	sb->map_offset  = sb->bat_offset +
+		((bat_size + VHD_SHARED_BAT_HDR_SIZE - 1) &
+		 ~((size_t)VHD_SHARED_BAT_HDR_SIZE - 1));
+
+	if (s->bat.batmap.map) {
+		sb->has_batmap    = 1;
+		sb->batmap_header = s->bat.batmap.header;
+		sb->map_size      =
+			vhd_sectors_to_bytes(s->bat.batmap.header.batmap_size);
+	}
 
-	s->bm_lru        = 0;
-	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	err = vhd_shared_bat_path(s, sb, &path);
+	if (err)
+		goto out;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
+	if (asprintf(&tmp, "%s.XXXXXX", path) == -1) {
+		tmp = NULL;
+		err = -ENOMEM;
+		goto out;
+	}
 
-		err = posix_memalign(&map, 512, map_size);
-		if (err)
-			goto fail;
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		err = -errno;
+		goto out;
+	}
 
-		bm->map = map;
+	err = -EIO;
+	if (pwrite(fd, sb, VHD_SHARED_BAT_HDR_SIZE, 0) !=
+	    VHD_SHARED_BAT_HDR_SIZE)
+		goto out;
 
-		err = posix_memalign(&shadow, 512, map_size);
-		if (err)
-			goto fail;
+	if (pwrite(fd, s->bat.bat.bat, bat_size, sb->bat_offset) !=
+	    (ssize_t)bat_size)
+		goto out;
 
-		bm->shadow = shadow;
+	if (sb->map_size &&
+	    pwrite(fd, s->bat.batmap.map, sb->map_size, sb->map_offset) !=
+	    (ssize_t)sb->map_size)
+		goto out;
 
-		memset(bm->map, 0, map_size);
-		memset(bm->shadow, 0, map_size);
-		s->bitmap_free[i] = bm;
+	if (rename(tmp, path)) {
+		err = -errno;
+		goto out;
 	}
 
-	return 0;
+	err = 0;
 
-fail:
-	vhd_free_bitmap_cache(s);
+out:
+	if (fd != -1)
+		close(fd);
+	if (err && tmp && fd != -1)
+		unlink(tmp);
+	free(tmp);
+	free(path);
+	free(buf);
 	return err;
 }
 
-static int
-vhd_initialize_dynamic_disk(struct vhd_state *s)
+static void
+vhd_detach_shared_bat(struct vhd_state *s)
 {
-	uint32_t bm_size;
-	void *buf;
-	int err;
-
-	err = vhd_get_header(&s->vhd);
-	if (err) {
-		if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
-			EPRINTF("Error reading VHD DD header.\n");
-		return err;
-	}
-
-	if (s->vhd.header.hdr_ver != 0x00010000) {
-		EPRINTF("unsupported header version! (0x%x)\n",
-			s->vhd.header.hdr_ver);
-		return -EINVAL;
-	}
+	/* nobody else holds it shared: remove it with the last user */
+	if (!flock(s->bat.shared_fd, LOCK_EX | LOCK_NB))
+		unlink(s->bat.shared_path);
 
-	s->spp     = getpagesize() >> VHD_SECTOR_SHIFT;
-	s->spb     = s->vhd.header.block_size >> VHD_SECTOR_SHIFT;
-	s->bm_secs = secs_round_up_no_zero(s->spb >> 3);
+	munmap(s->bat.shared, s->bat.shared_size);
+	close(s->bat.shared_fd);
+	free(s->bat.shared_path);
+}
 
-	s->padbm_size = (s->bm_secs / getpagesize()) * getpagesize();
-	if (s->bm_secs % getpagesize())
-		s->padbm_size += getpagesize();
+/*
+ * Metadata log. With TAPDISK3_VHD_MDLOG_DIR set, BAT and bitmap writes of
+ * writable images are logged to a file there, meant to be on fast local
+ * storage, rather than written in place: an allocation commits with one
+ * small sequential O_DSYNC write instead of a round trip to the SR.
+ * Bitmaps read back from the image are patched up from the log.
+ *
+ * The log takes TAPDISK3_VHD_MDLOG_KB, and is checkpointed into the
+ * image once full and on close, pause included. A checkpoint writes the
+ * latest copy of each logged range in place, syncs the image, and moves
+ * the log on to the next generation; once full, through the queue, so
+ * that the SR is not waited on from the event loop. Records of the
+ * current generation found at open are what a crash left behind, and
+ * are checkpointed before the BAT is read.
+ *
+ * The file is named after the image's uuid, and the image is marked
+ * (vhd_set_mdlog_pending) for as long as the log may hold anything: a
+ * writable open of a marked image fails without its log, rather than
+ * serve the stale metadata in place. The mark is cleared, and the file
+ * removed, after a clean close.
+ */
 
-	err = posix_memalign(&buf, 512, s->padbm_size);
-	if (err)
-		return -err;
+static uint64_t
+vhd_mdlog_rec_size(uint32_t secs)
+{
+	uint64_t size = VHD_MDLOG_REC_HDR + vhd_sectors_to_bytes(secs);
 
-	s->padbm_buf = buf;
-	bm_size = s->bm_secs << VHD_SECTOR_SHIFT;
-	memset(s->padbm_buf, 0, s->padbm_size - bm_size);
-	memset(s->padbm_buf + (s->padbm_size - bm_size), ~0, bm_size);
-	s->debug_skipped_redundant_writes = 0;
-	s->debug_done_redundant_writes = 0;
+	return (size + VHD_MDLOG_ALIGN - 1) & ~(uint64_t)(VHD_MDLOG_ALIGN - 1);
+}
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_NO_CACHE))
-		return 0;
+static uint32_t
+vhd_mdlog_hdr_checksum(const struct vhd_mdlog_header *hdr)
+{
+	struct vhd_mdlog_header tmp = *hdr;
 
-	err = vhd_initialize_bat(s);
-	if (err)
-		return err;
+	tmp.checksum = 0;
+	return crc32c(0, &tmp, sizeof(tmp));
+}
 
-	err = vhd_initialize_bitmap_cache(s);
-	if (err) {
-		vhd_free_bat(s);
-		return err;
-	}
+static uint32_t
+vhd_mdlog_rec_checksum(const char *rec)
+{
+	struct vhd_mdlog_record tmp = *(const struct vhd_mdlog_record *)rec;
+	uint32_t crc;
 
-	return 0;
+	tmp.checksum = 0;
+	crc = crc32c(0, &tmp, sizeof(tmp));
+	return crc32c(crc, rec + VHD_MDLOG_REC_HDR,
+		      vhd_sectors_to_bytes(tmp.secs));
 }
 
-static int
-vhd_check_version(struct vhd_state *s)
+static struct vhd_mdlog_entry *
+vhd_mdlog_lookup(struct vhd_mdlog *l, uint64_t offset)
 {
-	if (strncmp(s->vhd.footer.crtr_app, "tap", 3))
-		return 0;
+	struct vhd_mdlog_entry *e;
+	uint32_t i;
 
-	if (s->vhd.footer.crtr_ver > VHD_CURRENT_VERSION) {
-		if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
-			EPRINTF("WARNING: %s vhd creator version 0x%08x, "
-				"but only versions up to 0x%08x are "
-				"supported for IO\n", s->vhd.file,
-				s->vhd.footer.crtr_ver, VHD_CURRENT_VERSION);
+	i = l->hash[(uint32_t)(offset >> VHD_SECTOR_SHIFT) * 2654435761U &
+		    l->hash_mask];
 
-		return -EINVAL;
+	for (; i; i = e->next) {
+		e = &l->entries[i - 1];
+		if (e->offset == offset)
+			return e;
 	}
 
-	return 0;
+	return NULL;
 }
 
 static void
-vhd_log_open(struct vhd_state *s)
+vhd_mdlog_index(struct vhd_mdlog *l, uint64_t offset, uint32_t secs,
+		uint64_t rec)
 {
-	char buf[5];
-	uint32_t i, allocated, full;
+	struct vhd_mdlog_entry *e;
+	uint32_t *head;
+
+	e = vhd_mdlog_lookup(l, offset);
+	if (!e) {
+		head = &l->hash[(uint32_t)(offset >> VHD_SECTOR_SHIFT) *
+				2654435761U & l->hash_mask];
+
+		e         = &l->entries[l->nr_entries++];
+		e->offset = offset;
+		e->next   = *head;
+		*head     = l->nr_entries;
+	}
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
-		return;
+	e->rec  = rec;
+	e->secs = secs;
+}
 
-	snprintf(buf, sizeof(buf), "%s", s->vhd.footer.crtr_app);
-	if (!vhd_type_dynamic(&s->vhd)) {
-		DPRINTF("%s version: %s 0x%08x\n",
-			s->vhd.file, buf, s->vhd.footer.crtr_ver);
+static void
+vhd_mdlog_prep_header(struct vhd_state *s, struct vhd_mdlog *l)
+{
+	struct vhd_mdlog_header *hdr = (struct vhd_mdlog_header *)l->buf;
+
+	memset(l->buf, 0, VHD_MDLOG_ALIGN);
+	hdr->magic    = VHD_MDLOG_MAGIC;
+	hdr->version  = VHD_MDLOG_VERSION;
+	hdr->gen      = l->gen;
+	uuid_copy(hdr->uuid, s->vhd.footer.uuid);
+	hdr->checksum = vhd_mdlog_hdr_checksum(hdr);
+}
+
+static int
+vhd_mdlog_write_header(struct vhd_state *s, struct vhd_mdlog *l)
+{
+	vhd_mdlog_prep_header(s, l);
+
+	if (pwrite(l->fd, l->buf, VHD_MDLOG_ALIGN, 0) != VHD_MDLOG_ALIGN)
+		return errno ? -errno : -EIO;
+
+	return 0;
+}
+
+/* everything logged is in place: on to the next generation */
+static void
+vhd_mdlog_advance(struct vhd_mdlog *l)
+{
+	l->gen++;
+	l->seq        = 0;
+	l->head       = VHD_MDLOG_ALIGN;
+	l->nr_entries = 0;
+	memset(l->hash, 0, (l->hash_mask + 1) * sizeof(uint32_t));
+	l->checkpoints++;
+}
+
+/*
+ * Writes what was logged in place, and starts the next generation,
+ * synchronously: at open and close only. Not with log writes or a
+ * checkpoint in flight.
+ */
+static int
+vhd_mdlog_checkpoint(struct vhd_state *s)
+{
+	struct vhd_mdlog *l = s->mdlog;
+	struct vhd_mdlog_entry *e;
+	uint32_t i;
+	ssize_t size;
+
+	ASSERT(!l->inflight && !l->ckpt_pending);
+
+	if (l->head == VHD_MDLOG_ALIGN)
+		return 0;
+
+	for (i = 0; i < l->nr_entries; i++) {
+		e    = &l->entries[i];
+		size = vhd_sectors_to_bytes(e->secs);
+
+		if (pwrite(s->vhd.fd, l->buf + e->rec + VHD_MDLOG_REC_HDR,
+			   size, e->offset) != size) {
+			ERR(s, -EIO, "%s: checkpointing 0x%"PRIx64"\n",
+			    s->vhd.file, e->offset);
+			return -EIO;
+		}
+	}
+
+	if (fdatasync(s->vhd.fd)) {
+		int err = -errno;
+		ERR(s, err, "%s: checkpoint sync\n", s->vhd.file);
+		return err;
+	}
+
+	vhd_mdlog_advance(l);
+
+	return vhd_mdlog_write_header(s, l);
+}
+
+static void
+vhd_mdlog_ckpt_done(struct vhd_state *s, int err)
+{
+	struct vhd_mdlog *l = s->mdlog;
+
+	if (err) {
+		EPRINTF("%s: metadata log checkpoint failed: %d\n",
+			s->vhd.file, err);
+		l->error = err;
+	}
+
+	vhd_mdlog_kick(s);
+}
+
+static void
+vhd_mdlog_ckpt_header(void *arg, struct tiocb *tiocb, int err)
+{
+	struct vhd_state *s = arg;
+
+	s->mdlog->ckpt_pending = 0;
+	vhd_mdlog_ckpt_done(s, err);
+}
+
+static void
+vhd_mdlog_ckpt_synced(void *arg, struct tiocb *tiocb, int err)
+{
+	struct vhd_state *s = arg;
+	struct vhd_mdlog *l = s->mdlog;
+
+	if (err) {
+		l->ckpt_pending = 0;
+		vhd_mdlog_ckpt_done(s, err);
+		return;
+	}
+
+	/*
+	 * Records go in again only once the header of their generation is
+	 * down, lest a crash leave them behind an older one.
+	 */
+	vhd_mdlog_advance(l);
+	vhd_mdlog_prep_header(s, l);
+
+	td_prep_write(&l->ckpt_sync, l->fd, l->buf, VHD_MDLOG_ALIGN, 0,
+		      vhd_mdlog_ckpt_header, s);
+	td_queue_tiocb(s->driver, &l->ckpt_sync);
+}
+
+static void
+vhd_mdlog_ckpt_written(void *arg, struct tiocb *tiocb, int err)
+{
+	struct vhd_state *s = arg;
+	struct vhd_mdlog *l = s->mdlog;
+
+	if (err && !l->ckpt_error)
+		l->ckpt_error = err;
+
+	if (--l->ckpt_pending)
+		return;
+
+	if (l->ckpt_error) {
+		ERR(s, l->ckpt_error, "%s: checkpointing\n", s->vhd.file);
+		vhd_mdlog_ckpt_done(s, l->ckpt_error);
+		return;
+	}
+
+	l->ckpt_pending = 1;
+	td_prep_fdsync(&l->ckpt_sync, s->vhd.fd, vhd_mdlog_ckpt_synced, s);
+	td_queue_tiocb(s->driver, &l->ckpt_sync);
+}
+
+/*
+ * Like vhd_mdlog_checkpoint, through the queue: the latest copy of each
+ * range goes in place, then the image is synced, then the next
+ * generation's header is written. Writes wait for it on the log.
+ */
+static void
+vhd_mdlog_ckpt_start(struct vhd_state *s)
+{
+	struct vhd_mdlog *l = s->mdlog;
+	struct vhd_mdlog_entry *e;
+	uint32_t i;
+
+	ASSERT(!l->inflight && !l->ckpt_pending && l->nr_entries);
+
+	l->ckpt_error   = 0;
+	l->ckpt_pending = l->nr_entries;
+
+	for (i = 0; i < l->nr_entries; i++) {
+		e = &l->entries[i];
+
+		td_prep_write(&l->ckpt[i], s->vhd.fd,
+			      l->buf + e->rec + VHD_MDLOG_REC_HDR,
+			      vhd_sectors_to_bytes(e->secs), e->offset,
+			      vhd_mdlog_ckpt_written, s);
+		td_queue_tiocb(s->driver, &l->ckpt[i]);
+	}
+}
+
+static void
+vhd_mdlog_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct vhd_request *req = arg;
+	struct vhd_state *s = req->state;
+
+	s->mdlog->inflight--;
+	vhd_complete(arg, tiocb, err);
+	vhd_mdlog_kick(s);
+}
+
+static void
+vhd_mdlog_submit(struct vhd_state *s, struct vhd_request *req)
+{
+	struct vhd_mdlog *l = s->mdlog;
+	struct vhd_mdlog_record *r;
+	uint64_t size, data;
+	char *rec;
+
+	size = vhd_mdlog_rec_size(req->treq.secs);
+	data = vhd_sectors_to_bytes(req->treq.secs);
+	rec  = l->buf + l->head;
+
+	memset(rec, 0, size);
+	r         = (struct vhd_mdlog_record *)rec;
+	r->magic  = VHD_MDLOG_MAGIC;
+	r->gen    = l->gen;
+	r->secs   = req->treq.secs;
+	r->seq    = l->seq++;
+	r->offset = req->offset;
+	memcpy(rec + VHD_MDLOG_REC_HDR, req->treq.buf, data);
+	r->checksum = vhd_mdlog_rec_checksum(rec);
+
+	vhd_mdlog_index(l, req->offset, req->treq.secs, l->head);
+
+	td_prep_write(&req->tiocb, l->fd, rec, size, l->head,
+		      vhd_mdlog_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
+
+	l->head += size;
+	l->inflight++;
+	l->records++;
+
+	s->queued++;
+	s->writes++;
+	s->write_size += req->treq.secs;
+	TRACE(s);
+}
+
+static void
+vhd_mdlog_fail(event_id_t id, char mode, void *private)
+{
+	struct vhd_state *s = private;
+	struct vhd_mdlog *l = s->mdlog;
+	struct vhd_request *req, *next;
+
+	tapdisk_server_unregister_event(l->fail_event);
+	l->fail_event = -1;
+
+	req = l->wait_head;
+	l->wait_head = l->wait_tail = NULL;
+
+	for (; req; req = next) {
+		next      = req->next;
+		req->next = NULL;
+		vhd_complete(req, &req->tiocb, l->error);
+	}
+}
+
+/*
+ * Checkpoints a full log, once its writes are done, and sends those
+ * waiting for it. After a failed checkpoint nothing goes in place, lest
+ * the log still holding older copies be replayed over it: the writes
+ * fail, from the scheduler rather than from under their callers.
+ */
+static void
+vhd_mdlog_kick(struct vhd_state *s)
+{
+	struct vhd_mdlog *l = s->mdlog;
+	struct vhd_request *req;
+
+	if (!l->wait_head || l->inflight || l->ckpt_pending)
+		return;
+
+	if (!l->error && l->head + vhd_mdlog_rec_size(l->wait_head->treq.secs) >
+	    l->size) {
+		if (l->nr_entries) {
+			vhd_mdlog_ckpt_start(s);
+			return;
+		}
+
+		EPRINTF("%s: %u sectors do not fit the metadata log\n",
+			s->vhd.file, l->wait_head->treq.secs);
+		l->error = -ENOSPC;
+	}
+
+	if (l->error) {
+		if (l->fail_event < 0)
+			l->fail_event =
+				tapdisk_server_register_event(
+					SCHEDULER_POLL_TIMEOUT, -1, TV_ZERO,
+					vhd_mdlog_fail, s);
+		return;
+	}
+
+	while ((req = l->wait_head)) {
+		if (l->head + vhd_mdlog_rec_size(req->treq.secs) > l->size)
+			break;
+
+		l->wait_head = req->next;
+		if (!l->wait_head)
+			l->wait_tail = NULL;
+		req->next = NULL;
+
+		vhd_mdlog_submit(s, req);
+	}
+}
+
+/*
+ * Logs a metadata write of req, for offset in the image, in its place.
+ */
+static void
+vhd_mdlog_write(struct vhd_state *s, struct vhd_request *req,
+		uint64_t offset)
+{
+	struct vhd_mdlog *l = s->mdlog;
+
+	req->offset = offset;
+
+	if (!l->wait_head && !l->error && !l->ckpt_pending &&
+	    l->head + vhd_mdlog_rec_size(req->treq.secs) <= l->size) {
+		vhd_mdlog_submit(s, req);
+		return;
+	}
+
+	req->next = NULL;
+	if (l->wait_tail)
+		l->wait_tail->next = req;
+	else
+		l->wait_head = req;
+	l->wait_tail = req;
+
+	vhd_mdlog_kick(s);
+}
+
+/*
+ * The latest copy of secs sectors at offset in the image, if logged, over
+ * what a read issued in generation gen returned. A read issued before the
+ * last checkpoint completed may have missed what it put in place, and
+ * the log no longer has it: -EAGAIN, read again.
+ */
+static int
+vhd_mdlog_overlay(struct vhd_state *s, uint32_t gen, uint64_t offset,
+		  char *buf, uint32_t secs)
+{
+	struct vhd_mdlog *l = s->mdlog;
+	struct vhd_mdlog_entry *e;
+
+	if (gen != l->gen)
+		return -EAGAIN;
+
+	e = vhd_mdlog_lookup(l, offset);
+	if (e && e->secs == secs)
+		memcpy(buf, l->buf + e->rec + VHD_MDLOG_REC_HDR,
+		       vhd_sectors_to_bytes(secs));
+
+	return 0;
+}
+
+/*
+ * Reads the log back, indexing the records of its generation, if the
+ * image is marked as having one pending. It must then be this image's.
+ */
+static int
+vhd_mdlog_read(struct vhd_state *s, struct vhd_mdlog *l, char pending)
+{
+	struct vhd_mdlog_header *hdr;
+	struct vhd_mdlog_record *r;
+	uint64_t pos, size;
+	ssize_t n;
+
+	l->gen  = 1;
+	l->head = VHD_MDLOG_ALIGN;
+
+	n = pread(l->fd, l->buf, l->size, 0);
+	if (n < 0)
+		return -errno;
+
+	hdr = (struct vhd_mdlog_header *)l->buf;
+	if (n < VHD_MDLOG_ALIGN || hdr->magic != VHD_MDLOG_MAGIC ||
+	    hdr->version != VHD_MDLOG_VERSION ||
+	    hdr->checksum != vhd_mdlog_hdr_checksum(hdr) ||
+	    uuid_compare(hdr->uuid, s->vhd.footer.uuid)) {
+		if (pending)
+			goto lost;
+		goto reset;
+	}
+
+	l->gen = hdr->gen;
+
+	if (!pending) {
+		/* checkpointed for good when last closed */
+		l->gen++;
+		goto reset;
+	}
+
+	/*
+	 * Records are written concurrently: one torn by a crash may be
+	 * followed by others which completed, so all slots are looked at.
+	 */
+	for (pos = VHD_MDLOG_ALIGN; pos + VHD_MDLOG_REC_HDR <= (uint64_t)n;
+	     pos += size) {
+		r    = (struct vhd_mdlog_record *)(l->buf + pos);
+		size = VHD_MDLOG_ALIGN;
+
+		if (r->magic != VHD_MDLOG_MAGIC || r->gen != l->gen ||
+		    r->seq < l->seq || !r->secs ||
+		    r->secs > (l->size >> VHD_SECTOR_SHIFT) ||
+		    pos + vhd_mdlog_rec_size(r->secs) > (uint64_t)n ||
+		    r->checksum != vhd_mdlog_rec_checksum((char *)r))
+			continue;
+
+		size = vhd_mdlog_rec_size(r->secs);
+		vhd_mdlog_index(l, r->offset, r->secs, pos);
+		l->head = pos + size;
+		l->seq  = r->seq + 1;
+		l->records++;
+	}
+
+	return 0;
+
+reset:
+	/* not ours, or never written: nothing in it counts */
+	if (ftruncate(l->fd, 0))
+		return -errno;
+
+	return 0;
+
+lost:
+	EPRINTF("%s: metadata log %s is not this image's, or damaged\n",
+		s->vhd.file, l->path);
+	return -EINVAL;
+}
+
+static void
+vhd_mdlog_free(struct vhd_state *s)
+{
+	struct vhd_mdlog *l = s->mdlog;
+
+	if (!l)
+		return;
+
+	if (l->fail_event >= 0)
+		tapdisk_server_unregister_event(l->fail_event);
+	if (l->fd != -1)
+		close(l->fd);
+	free(l->path);
+	free(l->buf);
+	free(l->ckpt);
+	free(l->entries);
+	free(l->hash);
+	free(l);
+
+	s->mdlog = NULL;
+}
+
+static int
+vhd_mdlog_open(struct vhd_state *s)
+{
+	struct vhd_mdlog *l;
+	const char *dir, *val;
+	char uuid[37], pending;
+	uint32_t max;
+	uint64_t kb;
+	int err, flags;
+
+	dir = getenv("TAPDISK3_VHD_MDLOG_DIR");
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY)) {
+		if (!vhd_mdlog_pending(&s->vhd, &pending) && pending)
+			EPRINTF("%s: metadata log not replayed, "
+				"opened read-only\n", s->vhd.file);
+		return 0;
+	}
+
+	err = vhd_mdlog_pending(&s->vhd, &pending);
+	if (err)
+		return err;
+
+	if (!dir || !*dir) {
+		if (!pending)
+			return 0;
+
+		EPRINTF("%s: metadata log pending, but "
+			"TAPDISK3_VHD_MDLOG_DIR is not set\n", s->vhd.file);
+		return -ENOENT;
+	}
+
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return -ENOMEM;
+
+	l->fd         = -1;
+	l->fail_event = -1;
+	s->mdlog      = l;
+
+	uuid_unparse(s->vhd.footer.uuid, uuid);
+	if (asprintf(&l->path, "%s/td-vhd-mdlog-%s", dir, uuid) == -1) {
+		l->path = NULL;
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	val = getenv("TAPDISK3_VHD_MDLOG_KB");
+	kb  = val ? strtoull(val, NULL, 0) : VHD_MDLOG_SIZE_KB;
+	kb  = MAX(kb, VHD_MDLOG_MIN_KB);
+
+	l->size      = (kb << 10) & ~(uint64_t)(VHD_MDLOG_ALIGN - 1);
+	max          = l->size / VHD_MDLOG_ALIGN;
+	l->hash_mask = 1;
+	while (l->hash_mask < max)
+		l->hash_mask <<= 1;
+	l->hash_mask--;
+
+	err = posix_memalign((void **)&l->buf, VHD_MDLOG_ALIGN, l->size);
+	if (err) {
+		l->buf = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	l->entries = calloc(max, sizeof(*l->entries));
+	l->hash    = calloc(l->hash_mask + 1, sizeof(*l->hash));
+	l->ckpt    = calloc(max, sizeof(*l->ckpt));
+	if (!l->entries || !l->hash || !l->ckpt) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	/* a pending log is not made up anew */
+	flags = O_RDWR | O_DSYNC | (pending ? 0 : O_CREAT);
+
+	l->fd = open(l->path, flags | O_DIRECT, 0600);
+	if (l->fd == -1 && errno == EINVAL)
+		l->fd = open(l->path, flags, 0600);
+	if (l->fd == -1) {
+		err = -errno;
+		if (pending)
+			EPRINTF("%s: metadata log pending, but %s cannot "
+				"be opened\n", s->vhd.file, l->path);
+		goto fail;
+	}
+
+	err = vhd_mdlog_read(s, l, pending);
+	if (err)
+		goto fail;
+
+	if (l->records)
+		DPRINTF("%s: replaying %"PRIu64" metadata log records "
+			"from %s\n", s->vhd.file, l->records, l->path);
+	l->records = 0;
+
+	err = vhd_mdlog_checkpoint(s);
+	if (err)
+		goto fail;
+
+	err = vhd_mdlog_write_header(s, l);
+	if (err)
+		goto fail;
+
+	if (ftruncate(l->fd, l->size)) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (!pending) {
+		err = vhd_set_mdlog_pending(&s->vhd, 1);
+		if (!err && fsync(s->vhd.fd))
+			err = -errno;
+		if (err) {
+			/* no batmap, and no xattrs either */
+			EPRINTF("%s: cannot be marked, not logging "
+				"metadata: %d\n", s->vhd.file, err);
+			unlink(l->path);
+			vhd_mdlog_free(s);
+			return 0;
+		}
+	}
+
+	DPRINTF("%s: metadata log %s, %"PRIu64" KiB\n",
+		s->vhd.file, l->path, l->size >> 10);
+	return 0;
+
+fail:
+	EPRINTF("%s: metadata log %s: %d\n",
+		s->vhd.file, l->path ? : dir, err);
+	vhd_mdlog_free(s);
+	return err;
+}
+
+/*
+ * Checkpoints the log into the image for good, and clears the mark. A
+ * log which could not be checkpointed is left to be replayed.
+ */
+static void
+vhd_mdlog_close(struct vhd_state *s)
+{
+	struct vhd_mdlog *l = s->mdlog;
+	int err;
+
+	if (!l)
+		return;
+
+	DPRINTF("%s: metadata log records: %"PRIu64", checkpoints: "
+		"%"PRIu64"\n", s->vhd.file, l->records, l->checkpoints);
+
+	ASSERT(!l->ckpt_pending);
+
+	err = l->error ? : vhd_mdlog_checkpoint(s);
+	if (!err) {
+		err = vhd_set_mdlog_pending(&s->vhd, 0);
+		if (!err && fsync(s->vhd.fd))
+			err = -errno;
+	}
+
+	if (err)
+		EPRINTF("%s: metadata log %s kept for replay: %d\n",
+			s->vhd.file, l->path, err);
+	else {
+		/* lest the batmap written on close mark it again */
+		s->bat.batmap.header.mdlog = 0;
+		unlink(l->path);
+	}
+
+	vhd_mdlog_free(s);
+}
+
+/*
+ * Reads @n BAT pages from @page on, straight into the table.
+ */
+static int
+vhd_read_bat_pages(struct vhd_state *s, uint32_t page, uint32_t n)
+{
+	uint32_t i, first, count;
+	ssize_t size;
+	off64_t off;
+
+	first = page << VHD_BAT_PAGE_SHIFT;
+	count = MIN(n << VHD_BAT_PAGE_SHIFT, s->bat.bat.entries - first);
+	size  = vhd_bytes_padded(count * sizeof(uint32_t));
+	off   = s->vhd.header.table_offset + (off64_t)first * sizeof(uint32_t);
+
+	if (pread(s->vhd.fd, s->bat.bat.bat + first, size, off) != size)
+		return (errno ? -errno : -EIO);
+
+	for (i = first; i < first + count; i++)
+		BE32_IN(&s->bat.bat.bat[i]);
+
+	return 0;
+}
+
+/*
+ * Loads a BAT page some request needs now, unless the fill thread is
+ * already at it, in which case we wait. There is no sensible way on
+ * from a BAT we cannot read.
+ */
+static void
+vhd_load_bat_page(struct vhd_state *s, uint32_t page)
+{
+	uint8_t state;
+	int i, err;
+
+	for (;;) {
+		state = VHD_BAT_PAGE_UNLOADED;
+		if (__atomic_compare_exchange_n(&s->bat.pages[page], &state,
+						VHD_BAT_PAGE_LOADING, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			break;
+
+		if (state == VHD_BAT_PAGE_LOADED)
+			return;
+
+		usleep(50);
+	}
+
+	err = 0;
+	for (i = 0; i < VHD_BATMAP_MAX_RETRIES; i++) {
+		err = vhd_read_bat_pages(s, page, 1);
+		if (!err)
+			break;
+	}
+
+	if (err) {
+		EPRINTF("%s: reading bat page %u: %d\n",
+			s->vhd.file, page, err);
+		td_panic();
+	}
+
+	__atomic_store_n(&s->bat.pages[page], VHD_BAT_PAGE_LOADED,
+			 __ATOMIC_RELEASE);
+	s->bat.page_loads++;
+}
+
+static int
+vhd_bat_loaded(struct vhd_state *s)
+{
+	uint32_t i;
+
+	if (!s->bat.pages)
+		return 1;
+
+	for (i = 0; i < s->bat.nr_pages; i++)
+		if (__atomic_load_n(&s->bat.pages[i], __ATOMIC_ACQUIRE) !=
+		    VHD_BAT_PAGE_LOADED)
+			return 0;
+
+	return 1;
+}
+
+static int vhd_publish_shared_bat(struct vhd_state *);
+
+/*
+ * Loads the rest of a lazy BAT in the background, VHD_BAT_FILL_PAGES at
+ * a time. Pages it fails to read are left to be loaded on demand.
+ */
+static void *
+vhd_bat_fill_thread(void *arg)
+{
+	struct vhd_state *s = arg;
+	uint32_t page, i, n;
+	uint8_t state;
+	int err;
+
+	page = 0;
+
+	while (page < s->bat.nr_pages &&
+	       !__atomic_load_n(&s->bat.fill_stop, __ATOMIC_RELAXED)) {
+		for (n = 0; n < VHD_BAT_FILL_PAGES &&
+			     page + n < s->bat.nr_pages; n++) {
+			state = VHD_BAT_PAGE_UNLOADED;
+			if (!__atomic_compare_exchange_n(&s->bat.pages[page + n],
+							 &state,
+							 VHD_BAT_PAGE_LOADING,
+							 0, __ATOMIC_ACQ_REL,
+							 __ATOMIC_ACQUIRE))
+				break;
+		}
+
+		if (!n) {
+			page++;
+			continue;
+		}
+
+		err = vhd_read_bat_pages(s, page, n);
+
+		for (i = 0; i < n; i++)
+			__atomic_store_n(&s->bat.pages[page + i],
+					 err ? VHD_BAT_PAGE_UNLOADED :
+					 VHD_BAT_PAGE_LOADED,
+					 __ATOMIC_RELEASE);
+
+		if (err) {
+			EPRINTF("%s: background bat fill: %d\n",
+				s->vhd.file, err);
+			return NULL;
+		}
+
+		page += n;
+	}
+
+	if (s->bat.fill_publish && vhd_bat_loaded(s))
+		vhd_publish_shared_bat(s);
+
+	return NULL;
+}
+
+static void
+vhd_start_bat_fill(struct vhd_state *s)
+{
+	sigset_t set, old;
+	int err;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	err = pthread_create(&s->bat.fill_thread, NULL,
+			     vhd_bat_fill_thread, s);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err) {
+		EPRINTF("%s: bat fill thread: %d, loading on demand only\n",
+			s->vhd.file, -err);
+		return;
+	}
+
+	s->bat.fill_running = 1;
+}
+
+static void
+vhd_stop_bat_fill(struct vhd_state *s)
+{
+	if (!s->bat.fill_running)
+		return;
+
+	__atomic_store_n(&s->bat.fill_stop, 1, __ATOMIC_RELAXED);
+	pthread_join(s->bat.fill_thread, NULL);
+	s->bat.fill_running = 0;
+}
+
+/*
+ * TAPDISK3_VHD_LAZY_BAT_KB sets the BAT size of read-only images above
+ * which only the table is allocated at open, and the entries are read a
+ * page at a time, by a background thread or when first needed, so that
+ * opening large parents takes no longer than small ones. 0 disables it.
+ * Writable images need the whole BAT to find free space, and have it
+ * read at open.
+ */
+static int
+vhd_initialize_lazy_bat(struct vhd_state *s)
+{
+	uint32_t entries, nr_pages;
+	const char *val;
+	long kb;
+	void *bat;
+	int err;
+
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY) ||
+	    !vhd_type_dynamic(&s->vhd))
+		return -ENOTSUP;
+
+	kb  = VHD_BAT_LAZY_KB;
+	val = getenv("TAPDISK3_VHD_LAZY_BAT_KB");
+	if (val)
+		kb = atol(val);
+	if (kb <= 0)
+		return -ENOTSUP;
+
+	/* as many entries as vhd_read_bat would read */
+	entries = (s->vhd.footer.curr_size +
+		   ((1ULL << vhd_block_shift(&s->vhd)) - 1)) >>
+		vhd_block_shift(&s->vhd);
+	if (entries > s->vhd.header.max_bat_size ||
+	    (uint64_t)entries * sizeof(uint32_t) <= (uint64_t)kb * 1024)
+		return -ENOTSUP;
+
+	nr_pages = (entries + VHD_BAT_PAGE_ENTRIES - 1) >> VHD_BAT_PAGE_SHIFT;
+
+	err = posix_memalign(&bat, VHD_BAT_PAGE_BYTES,
+			     (size_t)nr_pages * VHD_BAT_PAGE_BYTES);
+	if (err)
+		return -err;
+
+	s->bat.pages = calloc(nr_pages, sizeof(uint8_t));
+	if (!s->bat.pages) {
+		free(bat);
+		return -ENOMEM;
+	}
+
+	s->bat.nr_pages    = nr_pages;
+	s->bat.bat.spb     = s->vhd.header.block_size >> VHD_SECTOR_SHIFT;
+	s->bat.bat.entries = entries;
+	s->bat.bat.bat     = bat;
+
+	DPRINTF("%s: loading %u bat pages lazily\n", s->vhd.file, nr_pages);
+	return 0;
+}
+
+static void
+vhd_free_bat(struct vhd_state *s)
+{
+	vhd_stop_bat_fill(s);
+
+	if (s->bat.shared) {
+		vhd_detach_shared_bat(s);
+	} else {
+		free(s->bat.bat.bat);
+		free(s->bat.batmap.map);
+	}
+	free(s->bat.pages);
+	free(s->bat.bat_buf);
+	free(s->bat.full);
+	memset(&s->bat, 0, sizeof(struct vhd_bat_state));
+}
+
+static int
+vhd_initialize_bat(struct vhd_state *s)
+{
+	int err, batmap_required, shared, i;
+	uint32_t *bat;
+	char *map;
+	void *buf;
+
+	memset(&s->bat, 0, sizeof(struct vhd_bat));
+
+	shared = (test_vhd_flag(s->flags, VHD_FLAG_OPEN_SHAREABLE) &&
+		  test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY));
+	if (shared && !vhd_attach_shared_bat(s))
+		goto out;
+
+	err = vhd_initialize_lazy_bat(s);
+	if (err == -ENOTSUP)
+		err = vhd_read_bat(&s->vhd, &s->bat.bat);
+	if (err) {
+		EPRINTF("%s: reading bat: %d\n", s->vhd.file, err);
+		return err;
+	}
+
+	batmap_required = 1;
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY)) {
+		batmap_required = 0;
+	} else {
+		err = find_next_free_block(s);
+		if (err)
+			goto fail;
+	}
+
+	if (vhd_has_batmap(&s->vhd)) {
+		for (i = 0; i < VHD_BATMAP_MAX_RETRIES; i++) {
+			err = vhd_read_batmap(&s->vhd, &s->bat.batmap);
+			if (err) {
+				EPRINTF("%s: reading batmap: %d\n",
+						s->vhd.file, err);
+				if (batmap_required)
+					goto fail;
+			} else {
+				break;
+			}
+		}
+		if (err)
+			EPRINTF("%s: ignoring non-critical batmap error\n",
+					s->vhd.file);
+	}
+
+	/* a lazy bat is published by the fill thread, once all read */
+	if (shared && s->bat.pages)
+		s->bat.fill_publish = 1;
+
+	/* switch to the shared copy if we manage to publish one */
+	if (shared && !s->bat.pages && !vhd_publish_shared_bat(s)) {
+		bat = s->bat.bat.bat;
+		map = s->bat.batmap.map;
+		if (!vhd_attach_shared_bat(s)) {
+			free(bat);
+			free(map);
+		}
+	}
+
+out:
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE,
+			     VHD_BAT_ALLOC_MAX * VHD_SECTOR_SIZE);
+	if (err)
+		goto fail;
+
+	s->bat.bat_buf = buf;
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++)
+		s->bat.write[i].buf = s->bat.bat_buf + i * VHD_SECTOR_SIZE;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY)) {
+		s->bat.full = calloc(1, (s->vhd.header.max_bat_size + 7) >> 3);
+		if (!s->bat.full) {
+			err = -ENOMEM;
+			goto fail;
+		}
+	}
+
+	if (s->bat.pages)
+		vhd_start_bat_fill(s);
+
+	return 0;
+
+fail:
+	vhd_free_bat(s);
+	return err;
+}
+
+static void
+vhd_free_requests(struct vhd_state *s)
+{
+	struct vhd_request_slab *slab, *next;
+
+	for (slab = s->vreq_slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+
+	free(s->vreq_free);
+
+	s->vreq_slabs      = NULL;
+	s->vreq_free       = NULL;
+	s->vreq_free_count = 0;
+	s->vreq_max        = 0;
+}
+
+/*
+ * grows the data request pool to max requests; requests in flight keep
+ * their place, the pool is only given back on close
+ */
+static int
+vhd_grow_requests(struct vhd_state *s, int max)
+{
+	struct vhd_request_slab *slab;
+	struct vhd_request **list;
+	int i, n;
+
+	n = max - s->vreq_max;
+	if (n <= 0)
+		return 0;
+
+	list = realloc(s->vreq_free, max * sizeof(*list));
+	if (!list)
+		return -ENOMEM;
+	s->vreq_free = list;
+
+	slab = calloc(1, sizeof(*slab) + n * sizeof(struct vhd_request));
+	if (!slab)
+		return -ENOMEM;
+
+	slab->nr      = n;
+	slab->next    = s->vreq_slabs;
+	s->vreq_slabs = slab;
+
+	for (i = 0; i < n; i++)
+		s->vreq_free[s->vreq_free_count++] = slab->reqs + i;
+	s->vreq_max = max;
+
+	return 0;
+}
+
+static int
+vhd_set_depth(td_driver_t *driver, int nr)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	return vhd_grow_requests(s, nr);
+}
+
+static void
+vhd_free_bitmap_cache(struct vhd_state *s)
+{
+	struct vhd_bitmap_slab *slab, *next;
+
+	for (slab = s->bm_slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab->buf);
+		free(slab->bitmaps);
+		free(slab);
+	}
+
+	free(s->bm_hash);
+
+	s->bm_slabs     = NULL;
+	s->bm_hash      = NULL;
+	s->bm_free      = NULL;
+	s->bm_lru_head  = NULL;
+	s->bm_lru_tail  = NULL;
+	s->bm_count     = 0;
+}
+
+static int
+vhd_grow_bitmap_cache(struct vhd_state *s)
+{
+	int i, n, err, max;
+	size_t map_size;
+	struct vhd_bitmap_slab *slab;
+	struct vhd_bitmap *bm;
+	void *buf;
+
+	/*
+	 * double the cache each time, within the budget, scaled down under
+	 * memory pressure; slabs are not given back, the cache stops growing
+	 */
+	max = (int64_t)s->bm_max * tapdisk_server_mem_budget() /
+		TD_MEM_BUDGET_FULL;
+	max = MAX(max, VHD_CACHE_SIZE);
+
+	n = (s->bm_count ? s->bm_count : VHD_CACHE_SIZE);
+	n = MIN(n, max - s->bm_count);
+	if (n <= 0)
+		return -ENOSPC;
+
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
+
+	slab = calloc(1, sizeof(*slab));
+	if (!slab)
+		return -ENOMEM;
+
+	slab->bitmaps = calloc(n, sizeof(struct vhd_bitmap));
+	if (!slab->bitmaps) {
+		free(slab);
+		return -ENOMEM;
+	}
+
+	err = posix_memalign(&buf, 512, 2 * n * map_size);
+	if (err) {
+		free(slab->bitmaps);
+		free(slab);
+		return -err;
+	}
+
+	slab->buf = buf;
+	memset(slab->buf, 0, 2 * n * map_size);
+
+	for (i = 0; i < n; i++) {
+		bm            = slab->bitmaps + i;
+		bm->map       = slab->buf + 2 * i * map_size;
+		bm->shadow    = bm->map + map_size;
+		bm->hash_next = s->bm_free;
+		s->bm_free    = bm;
+	}
+
+	slab->next   = s->bm_slabs;
+	s->bm_slabs  = slab;
+	s->bm_count += n;
+
+	DBG(TLOG_INFO, "%s: bitmap cache: %d of %d\n",
+	    s->vhd.file, s->bm_count, s->bm_max);
+
+	return 0;
+}
+
+/*
+ * TAPDISK3_VHD_BITMAP_CACHE_KB sets the memory each image may spend on
+ * cached bitmaps. The cache never holds fewer than VHD_CACHE_SIZE bitmaps,
+ * nor more than there are blocks.
+ */
+static int
+vhd_initialize_bitmap_cache(struct vhd_state *s)
+{
+	int err;
+	long budget;
+	size_t per_bm;
+	uint32_t buckets;
+	const char *val;
+
+	budget = VHD_CACHE_BUDGET_KB;
+	val = getenv("TAPDISK3_VHD_BITMAP_CACHE_KB");
+	if (val && atol(val) > 0)
+		budget = atol(val);
+
+	per_bm = sizeof(struct vhd_bitmap) + sizeof(struct vhd_bitmap *) +
+		2 * vhd_sectors_to_bytes(s->bm_secs);
+
+	s->bm_max = MIN((uint64_t)budget * 1024 / per_bm,
+			(uint64_t)s->vhd.header.max_bat_size);
+	s->bm_max = MAX(s->bm_max, VHD_CACHE_SIZE);
+
+	for (buckets = 1; buckets < (uint32_t)s->bm_max; buckets <<= 1)
+		;
+
+	s->bm_hash = calloc(buckets, sizeof(struct vhd_bitmap *));
+	if (!s->bm_hash)
+		return -ENOMEM;
+
+	s->bm_hash_mask  = buckets - 1;
+	s->bm_hits       = 0;
+	s->bm_misses     = 0;
+	s->bm_evictions  = 0;
+
+	err = vhd_grow_bitmap_cache(s);
+	if (err) {
+		vhd_free_bitmap_cache(s);
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * TAPDISK3_VHD_READAHEAD sets how many blocks ahead of a sequential reader
+ * bitmaps are fetched, 0 turns readahead off. Otherwise the default
+ * scales with the readahead the SR's device has, against the kernel's
+ * own default of 128K.
+ */
+static void
+vhd_initialize_readahead(struct vhd_state *s)
+{
+	const char *val;
+
+	s->ra_blocks   = VHD_RA_BLOCKS;
+	s->ra_seq      = 0;
+	s->ra_next_sec = 0;
+	s->ra_blk      = UINT32_MAX;
+	s->ra_reads    = 0;
+
+	if (s->profile.read_ahead_kb)
+		s->ra_blocks = VHD_RA_BLOCKS * s->profile.read_ahead_kb / 128 ? : 1;
+
+	val = getenv("TAPDISK3_VHD_READAHEAD");
+	if (val)
+		s->ra_blocks = atoi(val);
+
+	if (s->ra_blocks < 0)
+		s->ra_blocks = 0;
+	if (s->ra_blocks > VHD_RA_BLOCKS_MAX)
+		s->ra_blocks = VHD_RA_BLOCKS_MAX;
+}
+
+static void
+vhd_initialize_extents(struct vhd_state *s)
+{
+	const char *val;
+
+	s->extent_blocks = 0;
+	s->extent_end    = s->next_db;
+	s->extents       = 0;
+	s->zeroed_from   = 0;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY) ||
+	    test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
+		return;
+
+	s->extent_blocks = VHD_EXTENT_BLOCKS;
+
+	val = getenv("TAPDISK3_VHD_EXTENT_BLOCKS");
+	if (val) {
+		s->extent_blocks = atoi(val);
+		if (s->extent_blocks > VHD_EXTENT_BLOCKS_MAX)
+			s->extent_blocks = VHD_EXTENT_BLOCKS_MAX;
+	}
+
+	/* a single block extent is what we'd do without them */
+	if (s->extent_blocks <= 1)
+		s->extent_blocks = 0;
+}
+
+/*
+ * A dynamic disk reads unallocated blocks and clear bitmap bits as zeros,
+ * so zeros written there need not go to disk. Differencing disks would
+ * expose their parent's data instead.
+ */
+static void
+vhd_initialize_zero_detect(struct vhd_state *s)
+{
+	const char *val;
+
+	s->zero_detect = 0;
+	s->zero_secs   = 0;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY) ||
+	    s->vhd.footer.type != HD_TYPE_DYNAMIC)
+		return;
+
+	val = getenv("TAPDISK3_VHD_ZERO_DETECT");
+	if (val)
+		s->zero_detect = !!atoi(val);
+}
+
+/*
+ * Discards clear the bitmap bits of dynamic disks, which keeps the space.
+ * The data of blocks discarded whole, and of fixed disks, may also be
+ * punched out of files, see vhd_punch.
+ */
+static void
+vhd_initialize_discard(struct vhd_state *s)
+{
+	struct stat st;
+	const char *val;
+
+	s->discard_punch = 0;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
+		return;
+
+	val = getenv("TAPDISK3_VHD_DISCARD_PUNCH");
+	if (!val || !atoi(val))
+		return;
+
+	if (fstat(s->vhd.fd, &st) || !S_ISREG(st.st_mode))
+		return;
+
+	s->discard_punch = 1;
+}
+
+static int
+vhd_initialize_dynamic_disk(struct vhd_state *s)
+{
+	uint32_t bm_size;
+	void *buf;
+	int err;
+
+	err = vhd_get_header(&s->vhd);
+	if (err) {
+		if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
+			EPRINTF("Error reading VHD DD header.\n");
+		return err;
+	}
+
+	if (s->vhd.header.hdr_ver != 0x00010000) {
+		EPRINTF("unsupported header version! (0x%x)\n",
+			s->vhd.header.hdr_ver);
+		return -EINVAL;
+	}
+
+	s->spp     = getpagesize() >> VHD_SECTOR_SHIFT;
+	s->spb     = s->vhd.header.block_size >> VHD_SECTOR_SHIFT;
+	s->bm_secs = secs_round_up_no_zero(s->spb >> 3);
+
+	bm_size = s->bm_secs << VHD_SECTOR_SHIFT;
+	s->padbm_size = (bm_size + getpagesize() - 1) &
+		~((size_t)getpagesize() - 1);
+
+	err = posix_memalign(&buf, 512, s->padbm_size);
+	if (err)
+		return -err;
+
+	s->padbm_buf = buf;
+	memset(s->padbm_buf, 0, s->padbm_size - bm_size);
+	memset(s->padbm_buf + (s->padbm_size - bm_size), ~0, bm_size);
+	s->debug_skipped_redundant_writes = 0;
+	s->debug_done_redundant_writes = 0;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_NO_CACHE))
+		return 0;
+
+	/* anything logged goes in place before the BAT is read */
+	err = vhd_mdlog_open(s);
+	if (err)
+		return err;
+
+	err = vhd_initialize_bat(s);
+	if (err)
+		return err;
+
+	err = vhd_initialize_bitmap_cache(s);
+	if (err) {
+		vhd_free_bat(s);
+		return err;
+	}
+
+	vhd_initialize_readahead(s);
+	vhd_initialize_extents(s);
+	vhd_initialize_zero_detect(s);
+
+	return 0;
+}
+
+static int
+vhd_check_version(struct vhd_state *s)
+{
+	if (strncmp(s->vhd.footer.crtr_app, "tap", 3))
+		return 0;
+
+	if (s->vhd.footer.crtr_ver > VHD_CURRENT_VERSION) {
+		if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
+			EPRINTF("WARNING: %s vhd creator version 0x%08x, "
+				"but only versions up to 0x%08x are "
+				"supported for IO\n", s->vhd.file,
+				s->vhd.footer.crtr_ver, VHD_CURRENT_VERSION);
+
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void
+vhd_log_open(struct vhd_state *s)
+{
+	char buf[5];
+	uint32_t i, allocated, full;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
+		return;
+
+	snprintf(buf, sizeof(buf), "%s", s->vhd.footer.crtr_app);
+	if (!vhd_type_dynamic(&s->vhd)) {
+		DPRINTF("%s version: %s 0x%08x\n",
+			s->vhd.file, buf, s->vhd.footer.crtr_ver);
+		return;
+	}
+
+	/* not worth reading the whole lazy bat for */
+	if (!vhd_bat_loaded(s)) {
+		DPRINTF("%s version: %s 0x%08x, b: %u, n: %"PRIu64"\n",
+			s->vhd.file, buf, s->vhd.footer.crtr_ver,
+			s->bat.bat.entries, s->next_db);
 		return;
 	}
 
@@ -686,62 +2501,90 @@ static int dummy_open_crypto(
 	return 0;
 }
 
+/*
+ * The library is loaded once per process, by the first open with a key,
+ * and stays: the VBDs of every worker share it. A failed load is tried
+ * again by the next open.
+ */
 static int
-__load_crypto(struct td_vbd_encryption *encryption)
+__load_crypto(void)
 {
-	crypto_interface = malloc(sizeof(struct crypto_interface));
-	if (!crypto_interface) {
-		EPRINTF("Failed to allocate memory\n");
-		return -ENOMEM;
-	}
+	static struct crypto_interface lib;
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int err = 0;
 
-	if (encryption->encryption_key == NULL) {
-		crypto_interface->vhd_open_crypto = dummy_open_crypto;
-		crypto_interface->vhd_crypto_encrypt = NULL;
-		crypto_interface->vhd_crypto_decrypt = NULL;
-	} else {
+	pthread_mutex_lock(&lock);
+
+	if (crypto_interface)
+		goto out;
+
+	if (!crypto_handle) {
 		dlerror();
 		crypto_handle = dlopen(LIBBLOCKCRYPTO_NAME, RTLD_LAZY);
 		if (crypto_handle == NULL) {
 			EPRINTF("Failed to load crypto library. %s\n",
 				dlerror());
-			return -EINVAL;
+			err = -EINVAL;
+			goto out;
 		}
+	}
 
-		dlerror();
-		crypto_interface->vhd_open_crypto =
-			(int (*)(vhd_context_t *, const uint8_t *, size_t,
-				 const char *))
-			dlsym (crypto_handle, "vhd_open_crypto");
-		crypto_interface->vhd_crypto_encrypt =
-			(void (*)(vhd_context_t *, td_request_t *,
-				  char *))
-			dlsym(crypto_handle, "vhd_crypto_encrypt");
-		crypto_interface->vhd_crypto_decrypt =
-			(void (*)(vhd_context_t *, td_request_t *))
-			dlsym(crypto_handle, "vhd_crypto_decrypt");
-
-		if (!crypto_interface->vhd_open_crypto ||
-		    !crypto_interface->vhd_crypto_encrypt ||
-		    !crypto_interface->vhd_crypto_decrypt) {
-			EPRINTF("Failed to load crypto routines from dynamic library. %s\n",
-				dlerror());
-			return -EINVAL;
-		}
-		DPRINTF("Loaded cryptography library\n");
+	dlerror();
+	lib.vhd_open_crypto =
+		(int (*)(vhd_context_t *, const uint8_t *, size_t,
+			 const char *))
+		dlsym (crypto_handle, "vhd_open_crypto");
+	lib.vhd_crypto_encrypt =
+		(void (*)(vhd_context_t *, td_request_t *,
+			  char *))
+		dlsym(crypto_handle, "vhd_crypto_encrypt");
+	lib.vhd_crypto_decrypt =
+		(void (*)(vhd_context_t *, td_request_t *))
+		dlsym(crypto_handle, "vhd_crypto_decrypt");
+
+	if (!lib.vhd_open_crypto ||
+	    !lib.vhd_crypto_encrypt ||
+	    !lib.vhd_crypto_decrypt) {
+		EPRINTF("Failed to load crypto routines from dynamic library. %s\n",
+			dlerror());
+		err = -EINVAL;
+		goto out;
 	}
 
-	return 0;
+	lib.vhd_crypto_clone =
+		(struct crypto_blkcipher *(*)(vhd_context_t *))
+		dlsym(crypto_handle, "vhd_crypto_clone");
+	lib.vhd_crypto_free =
+		(void (*)(struct crypto_blkcipher *))
+		dlsym(crypto_handle, "vhd_crypto_free");
+	lib.vhd_crypto_encrypt_with =
+		(void (*)(struct crypto_blkcipher *, td_request_t *,
+			  char *))
+		dlsym(crypto_handle, "vhd_crypto_encrypt_with");
+	lib.vhd_crypto_decrypt_with =
+		(void (*)(struct crypto_blkcipher *, td_request_t *))
+		dlsym(crypto_handle, "vhd_crypto_decrypt_with");
+
+	__atomic_store_n(&crypto_interface, &lib, __ATOMIC_RELEASE);
+	DPRINTF("Loaded cryptography library\n");
+
+out:
+	pthread_mutex_unlock(&lock);
+	return err;
 }
 
 static int
 __load_and_open_crypto(vhd_context_t *vhd, struct td_vbd_encryption *encryption,
 		       const char *name)
 {
-	int ret = 0;
+	int ret;
 
-	if (!crypto_interface) {
-		ret = __load_crypto(encryption);
+	/* without a key, the library still turns away encrypted VHDs */
+	if (!__atomic_load_n(&crypto_interface, __ATOMIC_ACQUIRE)) {
+		if (encryption->encryption_key == NULL)
+			return dummy_open_crypto(vhd, NULL, 0, name);
+
+		ret = __load_crypto();
 		if (ret)
 			return ret;
 	}
@@ -750,11 +2593,70 @@ __load_and_open_crypto(vhd_context_t *vhd, struct td_vbd_encryption *encryption,
 		vhd, encryption->encryption_key, encryption->key_size, name);
 }
 
+static void
+vhd_close_crypto_offload(struct vhd_state *s)
+{
+	int i;
+
+	tapdisk_offload_close(s->crypto_chan);
+	s->crypto_chan = NULL;
+
+	for (i = 0; i < s->crypto_threads; i++)
+		crypto_interface->vhd_crypto_free(s->crypto_tfm[i]);
+	s->crypto_threads = 0;
+}
+
+static void
+vhd_free_crypto_bufs(struct vhd_state *s)
+{
+	while (s->crypto_nr_bufs)
+		free(s->crypto_bufs[--s->crypto_nr_bufs]);
+}
+
+/*
+ * Hand encryption to the crypto pool, if there is one and the library
+ * supports it. Failing that, it is done inline, as it always was.
+ */
+static void
+vhd_open_crypto_offload(struct vhd_state *s)
+{
+	int i, n;
+
+	if (!crypto_interface->vhd_crypto_clone ||
+	    !crypto_interface->vhd_crypto_free ||
+	    !crypto_interface->vhd_crypto_encrypt_with ||
+	    !crypto_interface->vhd_crypto_decrypt_with)
+		return;
+
+	n = tapdisk_offload_threads();
+	if (!n)
+		return;
+
+	for (i = 0; i < n; i++) {
+		s->crypto_tfm[i] = crypto_interface->vhd_crypto_clone(&s->vhd);
+		if (!s->crypto_tfm[i])
+			goto fail;
+		s->crypto_threads++;
+	}
+
+	s->crypto_chan = tapdisk_offload_open();
+	if (!s->crypto_chan)
+		goto fail;
+
+	DPRINTF("%s: encrypting on %d threads\n", s->vhd.file, n);
+	return;
+
+fail:
+	EPRINTF("%s: failed to set up crypto offload, encrypting inline\n",
+		s->vhd.file);
+	vhd_close_crypto_offload(s);
+}
+
 static int
 __vhd_open(td_driver_t *driver, const char *name,
 	   struct td_vbd_encryption *encryption, vhd_flag_t flags)
 {
-        int i, o_flags, err;
+        int o_flags, err;
 	struct vhd_state *s;
 
         DBG(TLOG_INFO, "vhd_open: %s\n", name);
@@ -767,6 +2669,9 @@ __vhd_open(td_driver_t *driver, const char *name,
 	s->flags  = flags;
 	s->driver = driver;
 
+	s->profile.rotational = -1;
+	tapdisk_storage_profile(name, &s->profile);
+
 	err = vhd_initialize(s);
 	if (err)
 		return err;
@@ -791,6 +2696,8 @@ __vhd_open(td_driver_t *driver, const char *name,
 		}
 	}
 
+	tapdisk_server_tune_fd(s->vhd.fd, &s->profile);
+
 	err = vhd_check_version(s);
 	if (err)
 		goto fail;
@@ -803,18 +2710,32 @@ __vhd_open(td_driver_t *driver, const char *name,
 			goto fail;
 	}
 
+	vhd_initialize_discard(s);
 	vhd_log_open(s);
 
 	SPB = s->spb;
 
-	s->vreq_free_count = VHD_REQS_DATA;
-	for (i = 0; i < VHD_REQS_DATA; i++)
-		s->vreq_free[i] = s->vreq_list + i;
+	err = vhd_grow_requests(s, VHD_REQS_DATA);
+	if (err)
+		goto fail;
 
 	driver->info.size        = s->vhd.footer.curr_size >> VHD_SECTOR_SHIFT;
 	driver->info.sector_size = VHD_SECTOR_SIZE;
 	driver->info.info        = 0;
 
+	/*
+	 * The VHD bitmaps stay at 512 byte granularity, as the format has
+	 * it; on a 4K VBD every request just covers whole bytes of them.
+	 */
+	if (test_vhd_flag(flags, VHD_FLAG_OPEN_4K)) {
+		if (s->vhd.footer.curr_size & (TD_4K_SECTOR_SIZE - 1)) {
+			EPRINTF("%s: size not a multiple of 4K\n", name);
+			err = -EINVAL;
+			goto fail;
+		}
+		driver->info.sector_size = TD_4K_SECTOR_SIZE;
+	}
+
         DBG(TLOG_INFO, "vhd_open: done (sz:%"PRIu64", sct:%lu, inf:%u)\n",
 	    driver->info.size, driver->info.sector_size, driver->info.info);
 
@@ -825,20 +2746,20 @@ __vhd_open(td_driver_t *driver, const char *name,
 	}
 
 	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT) && 
-	    !test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY)) {
-		err = vhd_kill_footer(s);
-		if (err) {
-			DPRINTF("ERROR killing footer: %d\n", err);
-			goto fail;
-		}
-		s->writes++;
-	}
+	    !test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY))
+		s->footer_kill = 1;
+
+	if (s->vhd.xts_tfm)
+		vhd_open_crypto_offload(s);
 
         return 0;
 
  fail:
+	vhd_mdlog_free(s);
+	tapdisk_server_untune_fd(s->vhd.fd);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
+	vhd_free_requests(s);
 	vhd_close(&s->vhd);
 	vhd_free(s);
 	return err;
@@ -848,6 +2769,7 @@ static int
 _vhd_open(td_driver_t *driver, const char *name,
 	  struct td_vbd_encryption *encryption, td_flag_t flags)
 {
+	struct tapdisk_storage_profile profile;
 	vhd_flag_t vhd_flags = 0;
 
 	if (flags & TD_OPEN_RDONLY)
@@ -858,16 +2780,40 @@ _vhd_open(td_driver_t *driver, const char *name,
 		vhd_flags |= VHD_FLAG_OPEN_QUIET;
 	if (flags & TD_OPEN_STRICT)
 		vhd_flags |= VHD_FLAG_OPEN_STRICT;
+	if (flags & TD_OPEN_SHAREABLE)
+		vhd_flags |= VHD_FLAG_OPEN_SHAREABLE;
 	if (flags & TD_OPEN_QUERY)
 		vhd_flags |= (VHD_FLAG_OPEN_QUERY  |
 			      VHD_FLAG_OPEN_QUIET  |
 			      VHD_FLAG_OPEN_RDONLY |
 			      VHD_FLAG_OPEN_NO_CACHE);
+	if (flags & TD_OPEN_4K)
+		vhd_flags |= VHD_FLAG_OPEN_4K;
     if (flags & TD_OPEN_LOCAL_CACHE)
         vhd_flags |= VHD_FLAG_OPEN_LOCAL_CACHE;
 
+	driver->storage = tapdisk_storage_profile(name, &profile) ? :
+		profile.type;
+
+	/*
+	 * Direct 512 byte I/O is refused by a device with larger logical
+	 * blocks. Where tapdisk may cache, it does; a writable image has
+	 * to be opened 4K.
+	 */
+	if (driver->storage > 0 &&
+	    profile.logical_block_size > VHD_SECTOR_SIZE &&
+	    !(flags & TD_OPEN_4K)) {
+		if (flags & (TD_OPEN_RDONLY | TD_OPEN_LOCAL_CACHE)) {
+			DPRINTF("%s: %u byte logical blocks, not using "
+				"O_DIRECT\n", name, profile.logical_block_size);
+			vhd_flags |= VHD_FLAG_OPEN_NO_O_DIRECT;
+		} else
+			EPRINTF("%s: %u byte logical blocks, direct 512 byte "
+				"I/O will fail\n", name,
+				profile.logical_block_size);
+	}
+
 	/* pre-allocate for all but NFS and LVM storage */
-	driver->storage = tapdisk_storage_type(name);
 
 	if (driver->storage != TAPDISK_STORAGE_TYPE_NFS &&
 	    driver->storage != TAPDISK_STORAGE_TYPE_LVM)
@@ -884,6 +2830,16 @@ vhd_log_close(struct vhd_state *s)
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
 		return;
 
+	if (s->bat.pages)
+		DPRINTF("%s: bat pages loaded on demand: %"PRIu64"\n",
+			s->vhd.file, s->bat.page_loads);
+
+	if (!vhd_bat_loaded(s)) {
+		DPRINTF("%s: b: %u, n: %"PRIu64"\n",
+			s->vhd.file, s->bat.bat.entries, s->next_db);
+		return;
+	}
+
 	allocated = 0;
 	full      = 0;
 
@@ -910,17 +2866,29 @@ _vhd_close(td_driver_t *driver)
 	DPRINTF("gaps written/skipped: %ld/%ld\n", 
 			s->debug_done_redundant_writes,
 			s->debug_skipped_redundant_writes);
+	if (s->ra_blocks)
+		DPRINTF("bitmap readahead reads: %"PRIu64"\n", s->ra_reads);
+	if (s->extent_blocks)
+		DPRINTF("extents claimed: %"PRIu64" (%d blocks), zero "
+			"bitmap writes skipped: %"PRIu64"\n", s->extents,
+			s->extent_blocks, s->zero_bm_skipped);
+	if (s->zero_detect || s->zero_secs)
+		DPRINTF("zero sectors not written: %"PRIu64"\n", s->zero_secs);
+	if (s->discard_secs || s->punched_secs)
+		DPRINTF("sectors discarded/punched: %"PRIu64"/%"PRIu64"\n",
+			s->discard_secs, s->punched_secs);
+
+	vhd_mdlog_close(s);
 
 	/* don't write footer if tapdisk is read-only */
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
 		goto free;
 	
 	/* 
-	 * write footer if:
-	 *   - we killed it on open (opened with strict) 
-	 *   - we've written data since opening
+	 * write footer if we've written data since opening, which includes
+	 * killing it (opened with strict) before the first new block
 	 */
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_STRICT) || s->writes) {
+	if (s->writes) {
 		memcpy(&s->vhd.bat, &s->bat.bat, sizeof(vhd_bat_t));
 		err = vhd_write_footer(&s->vhd, &s->vhd.footer);
 		memset(&s->vhd.bat, 0, sizeof(vhd_bat_t));
@@ -937,9 +2905,14 @@ _vhd_close(td_driver_t *driver)
 	}
 
  free:
+	vhd_close_crypto_offload(s);
+	vhd_free_crypto_bufs(s);
+	vhd_stop_bat_fill(s);
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
+	vhd_free_requests(s);
+	tapdisk_server_untune_fd(s->vhd.fd);
 	vhd_close(&s->vhd);
 	vhd_free(s);
 
@@ -1019,7 +2992,9 @@ vhd_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
 		return err;
 
 	id->name   = parent;
-	id->type   = vhd_parent_raw(&s->vhd) ? DISK_TYPE_AIO : DISK_TYPE_VHD;
+	id->type   = DISK_TYPE_VHD;
+	if (vhd_parent_raw(&s->vhd))
+		id->type = zimg_probe(parent) ? DISK_TYPE_ZIMG : DISK_TYPE_AIO;
 	id->flags  = flags|TD_OPEN_SHAREABLE|TD_OPEN_RDONLY;
 
 	return 0;
@@ -1103,40 +3078,28 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
+static inline struct vhd_bat_alloc *
+get_bat_alloc(struct vhd_state *s, uint32_t blk)
 {
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
-}
+	int i;
 
-static inline void
-lock_bat(struct vhd_state *s)
-{
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++)
+		if ((s->bat.allocs & (1U << i)) && s->bat.alloc[i].blk == blk)
+			return &s->bat.alloc[i];
 
-static inline void
-unlock_bat(struct vhd_state *s)
-{
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	return NULL;
 }
 
 static inline int
-bat_locked(struct vhd_state *s)
+bat_full(struct vhd_state *s)
 {
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	return s->bat.allocs == VHD_BAT_ALLOC_ALL;
 }
 
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
 	bm->status = 0;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
@@ -1149,14 +3112,11 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	for (bm = s->bm_hash[block & s->bm_hash_mask]; bm; bm = bm->hash_next)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
@@ -1208,28 +3168,73 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 	return 1;
 }
 
+static inline void
+__lru_unlink(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	if (bm->lru_prev)
+		bm->lru_prev->lru_next = bm->lru_next;
+	else
+		s->bm_lru_head = bm->lru_next;
+
+	if (bm->lru_next)
+		bm->lru_next->lru_prev = bm->lru_prev;
+	else
+		s->bm_lru_tail = bm->lru_prev;
+
+	bm->lru_prev = bm->lru_next = NULL;
+}
+
+static inline void
+__lru_append(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	bm->lru_next = NULL;
+	bm->lru_prev = s->bm_lru_tail;
+
+	if (s->bm_lru_tail)
+		s->bm_lru_tail->lru_next = bm;
+	else
+		s->bm_lru_head = bm;
+
+	s->bm_lru_tail = bm;
+}
+
+/* removes a bitmap from the hash and lru list */
+static void
+uncache_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pp;
+
+	for (pp = &s->bm_hash[bm->blk & s->bm_hash_mask]; *pp;
+	     pp = &(*pp)->hash_next)
+		if (*pp == bm)
+			break;
+
+	ASSERT(*pp == bm);
+	*pp = bm->hash_next;
+	bm->hash_next = NULL;
+
+	__lru_unlink(s, bm);
+}
+
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	uint64_t seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *lru;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
-	}
+	/* the most recently used bitmap is never evicted */
+	for (lru = s->bm_lru_head; lru && lru != s->bm_lru_tail;
+	     lru = lru->lru_next)
+		if (!bitmap_locked(lru))
+			break;
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
-	}
+	if (!lru || lru == s->bm_lru_tail)
+		return NULL;
+
+	ASSERT(!bitmap_in_use(lru));
+	uncache_bitmap(s, lru);
+	s->bm_evictions++;
 
-	return  lru;
+	return lru;
 }
 
 static int
@@ -1239,8 +3244,12 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	
 	*bitmap = NULL;
 
-	if (s->bm_free_count > 0) {
-		bm = s->bitmap_free[--s->bm_free_count];
+	if (!s->bm_free)
+		vhd_grow_bitmap_cache(s);
+
+	if (s->bm_free) {
+		bm = s->bm_free;
+		s->bm_free = bm->hash_next;
 	} else {
 		bm = remove_lru_bitmap(s);
 		if (!bm)
@@ -1248,69 +3257,47 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	}
 
 	init_vhd_bitmap(s, bm);
-	bm->blk = blk;
+	bm->blk       = blk;
+	bm->hash_next = NULL;
 	*bitmap = bm;
 
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	if (s->bm_lru_tail == bm)
+		return;
+
+	__lru_unlink(s, bm);
+	__lru_append(s, bm);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	struct vhd_bitmap **head;
+
+	ASSERT(!get_bitmap(s, bm->blk));
 
-	ASSERT(0);
+	head          = &s->bm_hash[bm->blk & s->bm_hash_mask];
+	bm->hash_next = *head;
+	*head         = bm;
+
+	__lru_append(s, bm);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
 
-	s->bitmap[i] = NULL;
-	s->bitmap_free[s->bm_free_count++] = bm;
+	uncache_bitmap(s, bm);
+
+	bm->hash_next = s->bm_free;
+	s->bm_free    = bm;
 }
 
 static int
@@ -1337,20 +3324,24 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
 		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		    bat_full(s) && !get_bat_alloc(s, blk))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
 	}
 
-	if (test_batmap(s, blk)) {
-		DBG(TLOG_DBG, "batmap set for 0x%04x\n", blk);
+	if (test_block_full(s, blk)) {
+		DBG(TLOG_DBG, "block 0x%04x full\n", blk);
 		return VHD_BM_BIT_SET;
 	}
 
 	bm = get_bitmap(s, blk);
-	if (!bm)
+	if (!bm) {
+		s->bm_misses++;
 		return VHD_BM_NOT_CACHED;
+	}
+
+	s->bm_hits++;
 
 	/* bump lru count */
 	touch_bitmap(s, bm);
@@ -1377,18 +3368,60 @@ read_bitmap_cache_span(struct vhd_state *s,
 	sec = sector % s->spb;
 	blk = sector / s->spb;
 
-	if (test_batmap(s, blk))
+	if (test_block_full(s, blk))
 		return MIN(nr_secs, s->spb - sec);
 
 	bm  = get_bitmap(s, blk);
 	
 	ASSERT(bm && bitmap_valid(bm));
 
-	for (ret = 0; sec < s->spb && ret < nr_secs; sec++, ret++)
-		if (vhd_bitmap_test(&s->vhd, bm->map, sec) != value)
+	ret = vhd_bitmap_scan(&s->vhd, bm->map, sec,
+			      MIN(s->spb, sec + nr_secs), !value);
+
+	return ret - sec;
+}
+
+/*
+ * Length of the run of sectors missing from this image from @sector on,
+ * which the caller found missing. The run continues through unallocated
+ * blocks and cached bitmaps with the bits clear, so that a read of a
+ * sparse range goes to the parent as one request, not one per block.
+ */
+static int
+read_bitmap_cache_absent(struct vhd_state *s, uint64_t sector, int nr_secs)
+{
+	int span = 0;
+
+	while (span < nr_secs) {
+		uint64_t sec;
+		uint32_t blk;
+		struct vhd_bitmap *bm;
+		int n;
+
+		sec = sector + span;
+		blk = sec / s->spb;
+		n   = MIN(nr_secs - span, s->spb - (sec % s->spb));
+
+		if (blk >= s->vhd.header.max_bat_size)
+			break;
+
+		if (bat_entry(s, blk) != DD_BLK_UNUSED) {
+			if (test_block_full(s, blk))
+				break;
+
+			bm = get_bitmap(s, blk);
+			if (!bm || !bitmap_valid(bm))
+				break;
+
+			n = read_bitmap_cache_span(s, sec, n, 0);
+		}
+
+		span += n;
+		if ((sector + span) % s->spb)
 			break;
+	}
 
-	return ret;
+	return span;
 }
 
 static inline struct vhd_request *
@@ -1413,6 +3446,33 @@ free_vhd_request(struct vhd_state *s, struct vhd_request *req)
 	s->vreq_free[s->vreq_free_count++] = req;
 }
 
+static char *
+vhd_get_crypto_buf(struct vhd_state *s, uint32_t secs)
+{
+	char *buf;
+
+	if (secs <= VHD_CRYPTO_BUF_SECS) {
+		if (s->crypto_nr_bufs)
+			return s->crypto_bufs[--s->crypto_nr_bufs];
+		secs = VHD_CRYPTO_BUF_SECS;
+	}
+
+	if (posix_memalign((void **)&buf, VHD_SECTOR_SIZE,
+			   vhd_sectors_to_bytes(secs)))
+		return NULL;
+
+	return buf;
+}
+
+static void
+vhd_put_crypto_buf(struct vhd_state *s, char *buf, uint32_t secs)
+{
+	if (secs <= VHD_CRYPTO_BUF_SECS && s->crypto_nr_bufs < VHD_CRYPTO_BUFS)
+		s->crypto_bufs[s->crypto_nr_bufs++] = buf;
+	else
+		free(buf);
+}
+
 static inline void
 aio_read(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 {
@@ -1446,89 +3506,226 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 }
 
 /**
- * Reserves a new extent.
+ * Claims space up to at least end, and up to extent_blocks more blocks
+ * where the storage allows. A file is grown by extending it, without
+ * moving its footer: the backup footer at the start of the file stands in
+ * until close writes the footer back at the end of the data. On a block
+ * device the footer stays at the end of the device, which bounds the
+ * extent.
+ */
+static int
+vhd_claim_extent(struct vhd_state *s, uint64_t end)
+{
+	off64_t eof;
+	uint64_t stride, limit, new_end;
+
+	stride  = s->spb + s->bm_secs;
+	if (stride % s->spp)
+		stride += s->spp - (stride % s->spp);
+	new_end = end + (uint64_t)(s->extent_blocks - 1) * stride;
+
+	if (s->vhd.is_block) {
+		eof = lseek64(s->vhd.fd, 0, SEEK_END);
+		if (eof == (off64_t)-1)
+			return -errno;
+
+		limit = (eof - sizeof(vhd_footer_t)) >> VHD_SECTOR_SHIFT;
+		if (end > limit) {
+			ERR(s, -ENOSPC, "%s: block at 0x%"PRIx64" past end of "
+			    "device (0x%"PRIx64")\n", s->vhd.file, end, limit);
+			return -ENOSPC;
+		}
+
+		s->extent_end = MIN(new_end, limit);
+		goto out;
+	}
+
+	/* all past the current end, including the footer left there */
+	eof = lseek64(s->vhd.fd, 0, SEEK_END);
+	if (eof == (off64_t)-1)
+		return -errno;
+
+	if (vhd_sectors_to_bytes(new_end) > eof &&
+	    ftruncate(s->vhd.fd, vhd_sectors_to_bytes(new_end)))
+		return -errno;
+
+	s->zeroed_from = secs_round_up(eof);
+	s->extent_end = new_end;
+
+out:
+	s->extents++;
+	DBG(TLOG_DBG, "%s: extent end: 0x%08"PRIx64"\n",
+	    s->vhd.file, s->extent_end);
+	return 0;
+}
+
+/**
+ * Reserves space for blk at the end of the file.
  *
- * @returns a 64-bit unsigned integer where the error code is stored in the
- * upper 32 bits and the reserved block number is stored in the lower 32 bits.
- * If an error is returned (the upper 32 bits are not zero), the lower 32 bits
- * are undefined.
+ * @returns 0 and the reservation in *alloc, -EBUSY if VHD_BAT_ALLOC_MAX
+ * allocations are already in flight, or -ENOSPC.
  */
-static inline uint64_t
-reserve_new_block(struct vhd_state *s, uint32_t blk)
+static int
+reserve_new_block(struct vhd_state *s, uint32_t blk,
+		  struct vhd_bat_alloc **alloc)
 {
-	int gap = 0;
+	int i, err, gap = 0;
+	uint64_t end;
+	struct vhd_bat_alloc *a;
+
+	if (bat_full(s))
+		return -EBUSY;
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	if (s->footer_kill) {
+		err = vhd_kill_footer(s);
+		if (err) {
+			ERR(s, err, "%s: killing footer\n", s->vhd.file);
+			return err;
+		}
+		s->footer_kill = 0;
+		s->writes++;
+	}
 
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
 	if (s->next_db + gap > UINT_MAX)
-		return (uint64_t)ENOSPC << 32;
+		return -ENOSPC;
+
+	end = s->next_db + gap + s->bm_secs + s->spb;
+	if (s->extent_blocks && end > s->extent_end) {
+		err = vhd_claim_extent(s, end);
+		if (err)
+			return err;
+	}
+
+	for (i = 0; s->bat.allocs & (1U << i); i++)
+		;
+
+	a         = &s->bat.alloc[i];
+	a->blk    = blk;
+	a->start  = s->next_db;
+	a->offset = s->next_db + gap;
+	a->status = 0;
+	a->error  = 0;
+	a->tx     = NULL;
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	s->bat.allocs |= (1U << i);
+	s->next_db     = a->offset + s->bm_secs + s->spb;
 
-	return s->next_db;
+	DBG(TLOG_DBG, "blk: 0x%04x, offset: 0x%08"PRIx64"\n", blk, a->offset);
+
+	*alloc = a;
+	return 0;
 }
 
-static int
-schedule_bat_write(struct vhd_state *s)
+static void
+release_bat_alloc(struct vhd_state *s, struct vhd_bat_alloc *a)
+{
+	DBG(TLOG_DBG, "blk: 0x%04x, err: %d\n", a->blk, a->error);
+
+	/* a failed allocation gives its space back if it was the last one */
+	if (a->error && s->next_db == a->offset + s->bm_secs + s->spb) {
+		s->next_db = a->start;
+
+		/* but its bitmap may have been written to */
+		if (s->zeroed_from && s->zeroed_from <= a->start)
+			s->zeroed_from = a->offset + s->bm_secs + s->spb;
+	}
+
+	s->bat.allocs &= ~(1U << (a - s->bat.alloc));
+}
+
+static void
+schedule_bat_write(struct vhd_state *s, uint32_t sector)
 {
 	int i;
-	uint32_t blk;
-	char *buf;
+	uint32_t *buf, allocs, first;
 	uint64_t offset;
+	struct vhd_bat_alloc *a;
+	struct vhd_bat_write *bw;
 	struct vhd_request *req;
 
-	ASSERT(bat_locked(s));
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++)
+		if ((s->bat.writes & (1U << i)) &&
+		    s->bat.write[i].sector == sector)
+			return; /* rescheduled when that one completes */
+
+	allocs = 0;
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++) {
+		a = &s->bat.alloc[i];
+		if ((s->bat.allocs & (1U << i)) && a->blk / 128 == sector &&
+		    test_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROED) &&
+		    !test_vhd_flag(a->status, VHD_FLAG_ALLOC_WRITE_STARTED) &&
+		    !a->error)
+			allocs |= (1U << i);
+	}
+
+	if (!allocs)
+		return;
+
+	/* every write carries at least one allocation, one is always free */
+	for (i = 0; s->bat.writes & (1U << i); i++)
+		;
 
-	req = &s->bat.req;
-	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+	bw  = &s->bat.write[i];
+	req = &bw->req;
+	buf = (uint32_t *)bw->buf;
+
+	bw->sector = sector;
+	bw->allocs = allocs;
+	first      = sector * 128;
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(buf, &bat_entry(s, first), 512);
+
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++) {
+		if (!(allocs & (1U << i)))
+			continue;
 
-	((uint32_t *)buf)[blk % 128] = s->bat.pbw_offset;
+		a = &s->bat.alloc[i];
+		buf[a->blk % 128] = a->offset;
+		set_vhd_flag(a->status, VHD_FLAG_ALLOC_WRITE_STARTED);
+	}
 
 	for (i = 0; i < 128; i++)
-		BE32_OUT(&((uint32_t *)buf)[i]);
+		BE32_OUT(&buf[i]);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
+	offset         = s->vhd.header.table_offset + first * 4;
 	req->treq.secs = 1;
-	req->treq.buf  = buf;
+	req->treq.buf  = bw->buf;
 	req->op        = VHD_OP_BAT_WRITE;
 	req->next      = NULL;
 
-	aio_write(s, req, offset);
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
-
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	s->bat.writes |= (1U << (bw - s->bat.write));
+	if (s->mdlog)
+		vhd_mdlog_write(s, req, offset);
+	else
+		aio_write(s, req, offset);
 
-	return 0;
+	DBG(TLOG_DBG, "sector: %u, allocs: 0x%04x, "
+	    "table_offset: 0x%08"PRIx64"\n", sector, allocs, offset);
 }
 
 static void
 schedule_zero_bm_write(struct vhd_state *s,
-		       struct vhd_bitmap *bm, uint64_t lb_end)
+		       struct vhd_bitmap *bm, struct vhd_bat_alloc *a)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &a->zero_req;
 
 	init_vhd_request(s, req);
 
-	offset         = vhd_sectors_to_bytes(lb_end);
+	offset         = vhd_sectors_to_bytes(a->start);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = a->blk * s->spb;
+	req->treq.secs = (a->offset - a->start) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    a->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
@@ -1588,15 +3785,14 @@ static int
 update_bat(struct vhd_state *s, uint32_t blk)
 {
 	int err;
-	uint64_t lb_end;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		return 0;
-	}
+
+	a = get_bat_alloc(s, blk);
+	if (a)
+		return a->error ? -EBUSY : 0;
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
@@ -1610,13 +3806,26 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
-	if (lb_end >> 32) {
-		unlock_bat(s);
-		return -(lb_end >> 32);
+	err = reserve_new_block(s, blk, &a);
+	if (err)
+		return err;
+
+	/*
+	 * In a hole, the bitmap reads as zeros already: the BAT can be
+	 * written right away, together with those of neighbouring blocks
+	 * allocated alongside, as for preallocated blocks.
+	 */
+	if (s->zeroed_from && a->start >= s->zeroed_from &&
+	    a->offset + s->bm_secs <= s->extent_end) {
+		s->zero_bm_skipped++;
+		lock_bitmap(bm);
+		set_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROED);
+		set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+		schedule_bat_write(s, blk / 128);
+		return 0;
 	}
-	schedule_zero_bm_write(s, bm, lb_end);
+
+	schedule_zero_bm_write(s, bm, a);
 	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 
 	return 0;
@@ -1625,55 +3834,17 @@ update_bat(struct vhd_state *s, uint32_t blk)
 static int
 allocate_block(struct vhd_state *s, uint32_t blk)
 {
-	int err, gap;
-	uint64_t offset, size;
+	int err;
+	uint64_t offset, size, done;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
 	ssize_t count;
-	uint64_t next_db;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
-		return 0;
-	}
-
-	gap     = 0;
-	offset  = vhd_sectors_to_bytes(s->next_db);
-	next_db = s->next_db;
-
-	/* data region of segment should begin on page boundary */
-	if ((next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((next_db + s->bm_secs) % s->spp));
-		next_db += gap;
-	}
-
-	if (next_db > UINT_MAX)
-		return -ENOSPC;
-
-	s->next_db = next_db;
-
-	s->bat.pbw_blk = blk;
-	s->bat.pbw_offset = s->next_db;
-
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
-
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(s, -errno, "lseek failed\n");
-		return -errno;
-	}
-
-	size  = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	count = write(s->vhd.fd, vhd_zeros(size), size);
-	if (count != size) {
-		err = count < 0 ? -errno : -ENOSPC;
-		ERR(s, -errno,
-		    "write failed (%zd, offset %"PRIu64")\n", count, offset);
-		return err;
-	}
+	a = get_bat_alloc(s, blk);
+	if (a)
+		return a->error ? -EBUSY : 0;
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
@@ -1687,12 +3858,45 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
+	err = reserve_new_block(s, blk, &a);
+	if (err)
+		return err;
+
+	offset = vhd_sectors_to_bytes(a->start);
+	size   = vhd_sectors_to_bytes(s->next_db - a->start);
+
+	/* large blocks are better zeroed by the filesystem */
+	if (fallocate(s->vhd.fd, FALLOC_FL_ZERO_RANGE, offset, size)) {
+		if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
+			err = -errno;
+			ERR(s, err, "lseek failed\n");
+			goto fail;
+		}
+
+		for (done = 0; done < size; done += count) {
+			uint64_t n = MIN(size - done, _vhd_zsize);
+
+			count = write(s->vhd.fd, vhd_zeros(n), n);
+			if (count != n) {
+				err = count < 0 ? -errno : -ENOSPC;
+				ERR(s, err, "write failed (%zd, offset %"PRIu64")\n",
+				    count, offset + done);
+				goto fail;
+			}
+		}
+	}
+
 	lock_bitmap(bm);
-	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
+	set_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROED);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+	schedule_bat_write(s, blk / 128);
 
 	return 0;
+
+fail:
+	a->error = err;
+	release_bat_alloc(s, a);
+	return err;
 }
 
 static int 
@@ -1708,41 +3912,156 @@ schedule_data_read(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		goto make_request;
 	}
 
-	blk    = treq.sec / s->spb;
-	sec    = treq.sec % s->spb;
-	bm     = get_bitmap(s, blk);
-	offset = bat_entry(s, blk);
+	blk    = treq.sec / s->spb;
+	sec    = treq.sec % s->spb;
+	bm     = get_bitmap(s, blk);
+	offset = bat_entry(s, blk);
+
+	ASSERT(offset != DD_BLK_UNUSED);
+	ASSERT(test_batmap(s, blk) || (bm && bitmap_valid(bm)));
+
+	offset += s->bm_secs + sec;
+	offset  = vhd_sectors_to_bytes(offset);
+
+ make_request:
+	req = alloc_vhd_request(s);
+	if (!req) 
+		return -EBUSY;
+
+	req->treq  = treq;
+	req->flags = flags;
+	req->op    = VHD_OP_DATA_READ;
+	req->next  = NULL;
+
+	aio_read(s, req, offset);
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
+	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64", flags: 0x%08x, buf: %p\n",
+	    s->vhd.file, treq.sec, blk, sec, treq.secs, offset, req->flags,
+	    treq.buf);
+
+	return 0;
+}
+
+static bool
+vhd_is_encrypted(struct vhd_state *s)
+{
+	return s->vhd.xts_tfm != NULL;
+}
+
+static void
+vhd_encrypt_work(td_offload_work_t *work, int thread)
+{
+	struct vhd_request *req = container_of(work, struct vhd_request, crypto);
+	struct vhd_state *s = req->state;
+
+	crypto_interface->vhd_crypto_encrypt_with(s->crypto_tfm[thread],
+						  &req->treq, req->orig_buf);
+}
+
+static void
+vhd_encrypt_done(td_offload_work_t *work)
+{
+	struct vhd_request *req = container_of(work, struct vhd_request, crypto);
+
+	aio_write(req->state, req, req->offset);
+}
+
+/*
+ * The write is issued once encrypted. The request already counts
+ * against its bitmap transaction, which thus waits for it.
+ */
+static void
+vhd_queue_encrypt(struct vhd_state *s, struct vhd_request *req,
+		  uint64_t offset)
+{
+	req->offset       = offset;
+	req->crypto.fn    = vhd_encrypt_work;
+	req->crypto.done  = vhd_encrypt_done;
+	tapdisk_offload_queue(s->crypto_chan, &req->crypto);
+}
+
+static void
+vhd_decrypt_work(td_offload_work_t *work, int thread)
+{
+	struct vhd_request *req = container_of(work, struct vhd_request, crypto);
+	struct vhd_state *s = req->state;
+
+	crypto_interface->vhd_crypto_decrypt_with(s->crypto_tfm[thread],
+						  &req->treq);
+}
+
+static void
+vhd_decrypt_done(td_offload_work_t *work)
+{
+	struct vhd_request *req = container_of(work, struct vhd_request, crypto);
+	struct vhd_state *s = req->state;
+
+	td_complete_request(req->treq, 0);
+	free_vhd_request(s, req);
 
-	ASSERT(offset != DD_BLK_UNUSED);
-	ASSERT(test_batmap(s, blk) || (bm && bitmap_valid(bm)));
+	s->returned++;
+	TRACE(s);
+}
 
-	offset += s->bm_secs + sec;
-	offset  = vhd_sectors_to_bytes(offset);
+static void
+vhd_queue_decrypt(struct vhd_state *s, struct vhd_request *req)
+{
+	req->crypto.fn    = vhd_decrypt_work;
+	req->crypto.done  = vhd_decrypt_done;
+	tapdisk_offload_queue(s->crypto_chan, &req->crypto);
+}
+
+/*
+ * Writes zeros over allocated sectors of a dynamic disk by clearing their
+ * bitmap bits in a transaction of their own, without any data I/O.
+ */
+static int
+schedule_zero_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
+{
+	struct vhd_bitmap *bm;
+	struct vhd_request *req;
 
- make_request:
 	req = alloc_vhd_request(s);
-	if (!req) 
+	if (!req)
 		return -EBUSY;
 
 	req->treq  = treq;
 	req->flags = flags;
-	req->op    = VHD_OP_DATA_READ;
+	req->op    = VHD_OP_DATA_WRITE;
 	req->next  = NULL;
 
-	aio_read(s, req, offset);
+	bm = get_bitmap(s, treq.sec / s->spb);
+	ASSERT(bm && bitmap_valid(bm));
+	lock_bitmap(bm);
 
-	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
-	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64", flags: 0x%08x, buf: %p\n",
-	    s->vhd.file, treq.sec, blk, sec, treq.secs, offset, req->flags,
-	    treq.buf);
+	if (bm->tx.closed) {
+		add_to_tail(&bm->queue, req);
+		set_vhd_flag(req->flags, VHD_FLAG_REQ_QUEUED);
+	} else
+		add_to_transaction(&bm->tx, req);
 
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", nr_secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	finish_data_write(req);
 	return 0;
 }
 
-static bool
-vhd_is_encrypted(struct vhd_state *s)
+/*
+ * Completes all-zero writes which would leave the disk reading zeros
+ * anyway, see vhd_initialize_zero_detect.
+ */
+static int
+vhd_elide_zero_write(struct vhd_state *s, td_request_t treq)
 {
-	return s->vhd.xts_tfm != NULL;
+	if (!s->zero_detect ||
+	    !tapdisk_buf_is_zero(treq.buf, vhd_sectors_to_bytes(treq.secs)))
+		return 0;
+
+	s->zero_secs += treq.secs;
+	td_complete_request(treq, 0);
+	return 1;
 }
 
 static int
@@ -1774,7 +4093,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		offset = get_bat_alloc(s, blk)->offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1785,15 +4104,14 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 
  make_request:
 	if (vhd_is_encrypted(s)) {
-		err = posix_memalign((void **)&crypto_buf, VHD_SECTOR_SIZE,
-				     treq.secs * VHD_SECTOR_SIZE);
-		if (err)
+		crypto_buf = vhd_get_crypto_buf(s, treq.secs);
+		if (!crypto_buf)
 			return -EBUSY;
 	}
 	req = alloc_vhd_request(s);
 	if (!req) {
 		if (vhd_is_encrypted(s))
-			free(crypto_buf);
+			vhd_put_crypto_buf(s, crypto_buf, treq.secs);
 		return -EBUSY;
 	}
 
@@ -1805,8 +4123,9 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	if (vhd_is_encrypted(s)) {
 		req->orig_buf = req->treq.buf;
 		req->treq.buf = crypto_buf;
-		crypto_interface->vhd_crypto_encrypt(
-			&s->vhd, &req->treq, req->orig_buf);
+		if (!s->crypto_chan)
+			crypto_interface->vhd_crypto_encrypt(
+				&s->vhd, &req->treq, req->orig_buf);
 	}
 
 	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BITMAP)) {
@@ -1825,7 +4144,10 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		   test_batmap(s, blk))
 		schedule_redundant_bm_write(s, blk);
 
-	aio_write(s, req, offset);
+	if (vhd_is_encrypted(s) && s->crypto_chan)
+		vhd_queue_encrypt(s, req, offset);
+	else
+		aio_write(s, req, offset);
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
 	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64", flags: 0x%08x\n",
@@ -1864,6 +4186,8 @@ schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 	req->treq.cb   = NULL;
 	req->op        = VHD_OP_BITMAP_READ;
 	req->next      = NULL;
+	if (s->mdlog)
+		req->mdlog_gen = s->mdlog->gen;
 
 	aio_read(s, req, offset);
 	lock_bitmap(bm);
@@ -1892,119 +4216,406 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		struct vhd_bat_alloc *a = get_bat_alloc(s, blk);
+		ASSERT(a);
+		offset = a->offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
 
-	req = &bm->req;
-	init_vhd_request(s, req);
+	req = &bm->req;
+	init_vhd_request(s, req);
+
+	req->treq.sec  = blk * s->spb;
+	req->treq.secs = s->bm_secs;
+	req->treq.buf  = bm->shadow;
+	req->treq.cb   = NULL;
+	req->op        = VHD_OP_BITMAP_WRITE;
+	req->next      = NULL;
+
+	lock_bitmap(bm);
+	touch_bitmap(s, bm);     /* bump lru count */
+	set_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING);
+
+	if (s->mdlog)
+		vhd_mdlog_write(s, req, offset);
+	else
+		aio_write(s, req, offset);
+
+	DBG(TLOG_DBG, "%s: blk: 0x%04x, sec: 0x%08"PRIx64", nr_secs: 0x%04x, "
+	    "offset: 0x%"PRIx64"\n", s->vhd.file, blk, req->treq.sec,
+	    req->treq.secs, offset);
+}
+
+/* 
+ * queued requests will be submitted once the bitmap
+ * describing them is read and the requests are validated. 
+ */
+static int
+__vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
+{
+	uint32_t blk;
+	struct vhd_bitmap  *bm;
+	struct vhd_request *req;
+
+	ASSERT(vhd_type_dynamic(&s->vhd));
+
+	blk = treq.sec / s->spb;
+	bm  = get_bitmap(s, blk);
+
+	ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING));
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq = treq;
+	req->op   = op;
+	req->next = NULL;
+
+	add_to_tail(&bm->waiting, req);
+	lock_bitmap(bm);
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x nr_secs: 0x%04x, "
+	    "op: %u\n", s->vhd.file, treq.sec, blk, treq.secs, op);
+
+	TRACE(s);
+	return 0;
+}
+
+/*
+ * Once reads have been sequential for VHD_RA_SEQ_MIN requests, fetch the
+ * bitmaps of the next ra_blocks allocated blocks, so that the data reads
+ * find them cached, or at least in flight, when they get there. The BAT is
+ * always in memory, only the bitmaps need reading. There are no waiters on
+ * a readahead bitmap, finish_bitmap_read merely unlocks it. Readahead stops
+ * at the first bitmap it cannot allocate without evicting one in use.
+ */
+static void
+vhd_readahead(struct vhd_state *s, td_request_t treq)
+{
+	uint64_t blk, last;
+
+	if (treq.sec != s->ra_next_sec)
+		s->ra_seq = 0;
+	else if (s->ra_seq < VHD_RA_SEQ_MIN)
+		s->ra_seq++;
+	s->ra_next_sec = treq.sec + treq.secs;
+
+	if (s->ra_seq < VHD_RA_SEQ_MIN)
+		return;
+
+	/* run once per block, from the one this read ends in */
+	blk = (s->ra_next_sec - 1) / s->spb;
+	if (blk == s->ra_blk)
+		return;
+	s->ra_blk = blk;
+
+	last = MIN(blk + s->ra_blocks, (uint64_t)s->vhd.header.max_bat_size - 1);
+
+	for (blk++; blk <= last; blk++) {
+		if (bat_entry(s, blk) == DD_BLK_UNUSED ||
+		    test_block_full(s, blk) || get_bitmap(s, blk))
+			continue;
+
+		if (schedule_bitmap_read(s, blk))
+			break;
+
+		s->ra_reads++;
+		DBG(TLOG_DBG, "%s: readahead blk: 0x%04"PRIx64"\n",
+		    s->vhd.file, blk);
+	}
+}
+
+static void
+vhd_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
+	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
+
+	while (treq.secs) {
+		int err;
+		td_request_t clone;
+
+		err   = 0;
+		clone = treq;
+
+		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DATA_READ)) {
+		case -EINVAL:
+			err = -EINVAL;
+			goto fail;
+
+		case VHD_BM_BAT_CLEAR:
+		case VHD_BM_BIT_CLEAR:
+			clone.secs = read_bitmap_cache_absent(s, clone.sec, clone.secs);
+			td_forward_request(clone);
+			break;
+
+		case VHD_BM_BIT_SET:
+			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 1);
+			err = schedule_data_read(s, clone, 0);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_NOT_CACHED:
+			err = schedule_bitmap_read(s, clone.sec / s->spb);
+			if (err)
+				goto fail;
+
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			err = __vhd_queue_request(s, VHD_OP_DATA_READ, clone);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_READ_PENDING:
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			err = __vhd_queue_request(s, VHD_OP_DATA_READ, clone);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_BAT_LOCKED:
+		default:
+			ASSERT(0);
+			break;
+		}
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		treq.buf  += vhd_sectors_to_bytes(clone.secs);
+		continue;
+
+	fail:
+		clone.secs = treq.secs;
+		td_complete_request(clone, err);
+		break;
+	}
+}
+
+/*
+ * Entry point for reads from the VBD. finish_bitmap_read() replays waiting
+ * reads through vhd_queue_read() directly, so that they are not taken for a
+ * new access pattern.
+ */
+static void
+_vhd_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	vhd_queue_read(driver, treq);
+
+	if (s->ra_blocks)
+		vhd_readahead(s, treq);
+}
+
+static void
+vhd_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x, (seg: %d)\n",
+	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
+
+	while (treq.secs) {
+		int err;
+		uint8_t flags;
+		td_request_t clone;
+
+		err   = 0;
+		flags = 0;
+		clone = treq;
+
+		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DATA_WRITE)) {
+		case -EINVAL:
+			err = -EINVAL;
+			goto fail;
+
+		case VHD_BM_BAT_LOCKED:
+			err = -EBUSY;
+			goto fail;
+
+		case VHD_BM_BAT_CLEAR:
+			flags      = (VHD_FLAG_REQ_UPDATE_BAT |
+				      VHD_FLAG_REQ_UPDATE_BITMAP);
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			if (vhd_elide_zero_write(s, clone))
+				break;
+			err        = schedule_data_write(s, clone, flags);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_BIT_CLEAR:
+			flags      = VHD_FLAG_REQ_UPDATE_BITMAP;
+			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
+			if (vhd_elide_zero_write(s, clone))
+				break;
+			err        = schedule_data_write(s, clone, flags);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_BIT_SET:
+			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 1);
+			/* the batmap is only written on close, leave full blocks */
+			if (s->zero_detect && clone.secs >= VHD_ZERO_CLEAR_MIN &&
+			    !test_batmap(s, clone.sec / s->spb) &&
+			    tapdisk_buf_is_zero(clone.buf,
+						vhd_sectors_to_bytes(clone.secs))) {
+				flags = (VHD_FLAG_REQ_UPDATE_BITMAP |
+					 VHD_FLAG_REQ_ZERO);
+				err   = schedule_zero_write(s, clone, flags);
+				if (!err)
+					s->zero_secs += clone.secs;
+			} else
+				err   = schedule_data_write(s, clone, 0);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_NOT_CACHED:
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			err = schedule_bitmap_read(s, clone.sec / s->spb);
+			if (err)
+				goto fail;
+
+			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE, clone);
+			if (err)
+				goto fail;
+			break;
 
-	req->treq.sec  = blk * s->spb;
-	req->treq.secs = s->bm_secs;
-	req->treq.buf  = bm->shadow;
-	req->treq.cb   = NULL;
-	req->op        = VHD_OP_BITMAP_WRITE;
-	req->next      = NULL;
+		case VHD_BM_READ_PENDING:
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE, clone);
+			if (err)
+				goto fail;
+			break;
 
-	aio_write(s, req, offset);
-	lock_bitmap(bm);
-	touch_bitmap(s, bm);     /* bump lru count */
-	set_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING);
+		default:
+			ASSERT(0);
+			break;
+		}
 
-	DBG(TLOG_DBG, "%s: blk: 0x%04x, sec: 0x%08"PRIx64", nr_secs: 0x%04x, "
-	    "offset: 0x%"PRIx64"\n", s->vhd.file, blk, req->treq.sec,
-	    req->treq.secs, offset);
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		treq.buf  += vhd_sectors_to_bytes(clone.secs);
+		continue;
+
+	fail:
+		clone.secs = treq.secs;
+		td_complete_request(clone, err);
+		break;
+	}
 }
 
-/* 
- * queued requests will be submitted once the bitmap
- * describing them is read and the requests are validated. 
+/*
+ * Gives the data of secs sectors from file sector off back to the file
+ * system. Reads of a plain file's holes return zeros, those of an
+ * encrypted disk would not decrypt to anything sensible, leave them.
  */
-static int
-__vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
+static void
+vhd_punch(struct vhd_state *s, uint64_t off, uint64_t secs)
 {
-	uint32_t blk;
-	struct vhd_bitmap  *bm;
-	struct vhd_request *req;
-
-	ASSERT(vhd_type_dynamic(&s->vhd));
-
-	blk = treq.sec / s->spb;
-	bm  = get_bitmap(s, blk);
-
-	ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING));
-
-	req = alloc_vhd_request(s);
-	if (!req)
-		return -EBUSY;
-
-	req->treq = treq;
-	req->op   = op;
-	req->next = NULL;
+	int err;
 
-	add_to_tail(&bm->waiting, req);
-	lock_bitmap(bm);
+	if (!s->discard_punch || vhd_is_encrypted(s))
+		return;
 
-	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x nr_secs: 0x%04x, "
-	    "op: %u\n", s->vhd.file, treq.sec, blk, treq.secs, op);
+	err = fallocate(s->vhd.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			vhd_sectors_to_bytes(off), vhd_sectors_to_bytes(secs));
+	if (err) {
+		err = -errno;
+		EPRINTF("%s: punching 0x%"PRIx64" secs at 0x%"PRIx64": %d, "
+			"giving up punching\n", s->vhd.file, secs, off, err);
+		s->discard_punch = 0;
+		return;
+	}
 
-	TRACE(s);
-	return 0;
+	s->punched_secs += secs;
 }
 
+/*
+ * Discarded sectors of dynamic disks have their bitmap bits cleared, in a
+ * transaction without data I/O like all-zero writes, so that they read
+ * from the parent, or as zeros, again. Blocks full in the batmap keep
+ * their bits, as the batmap is only written on close, so do sectors which
+ * are not allocated in the first place. Discards never fail for want of
+ * support: the sectors they leave in place still read as they did.
+ */
 static void
-vhd_queue_read(td_driver_t *driver, td_request_t treq)
+vhd_queue_discard(td_driver_t *driver, td_request_t treq)
 {
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
-	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
-	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	s->dirty = 1;
+
+	if (!vhd_type_dynamic(&s->vhd)) {
+		vhd_punch(s, treq.sec, treq.secs);
+		td_complete_request(treq, 0);
+		return;
+	}
 
 	while (treq.secs) {
 		int err;
+		uint32_t blk;
 		td_request_t clone;
 
 		err   = 0;
 		clone = treq;
+		blk   = clone.sec / s->spb;
 
-		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DATA_READ)) {
+		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DATA_DISCARD)) {
 		case -EINVAL:
 			err = -EINVAL;
 			goto fail;
 
 		case VHD_BM_BAT_CLEAR:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			td_forward_request(clone);
+			td_complete_request(clone, 0);
 			break;
 
 		case VHD_BM_BIT_CLEAR:
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
-			td_forward_request(clone);
+			td_complete_request(clone, 0);
 			break;
 
 		case VHD_BM_BIT_SET:
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 1);
-			err = schedule_data_read(s, clone, 0);
+			if (clone.sec % s->spb == 0 && clone.secs == s->spb)
+				vhd_punch(s, bat_entry(s, blk) + s->bm_secs, s->spb);
+			if (test_batmap(s, blk)) {
+				td_complete_request(clone, 0);
+				break;
+			}
+			err = schedule_zero_write(s, clone,
+						  VHD_FLAG_REQ_UPDATE_BITMAP |
+						  VHD_FLAG_REQ_ZERO);
 			if (err)
 				goto fail;
+			s->discard_secs += clone.secs;
 			break;
 
 		case VHD_BM_NOT_CACHED:
-			err = schedule_bitmap_read(s, clone.sec / s->spb);
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			err = schedule_bitmap_read(s, blk);
 			if (err)
 				goto fail;
 
-			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			err = __vhd_queue_request(s, VHD_OP_DATA_READ, clone);
+			err = __vhd_queue_request(s, VHD_OP_DATA_DISCARD, clone);
 			if (err)
 				goto fail;
 			break;
 
 		case VHD_BM_READ_PENDING:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			err = __vhd_queue_request(s, VHD_OP_DATA_READ, clone);
+			err = __vhd_queue_request(s, VHD_OP_DATA_DISCARD, clone);
 			if (err)
 				goto fail;
 			break;
@@ -2017,7 +4628,6 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 
 		treq.sec  += clone.secs;
 		treq.secs -= clone.secs;
-		treq.buf  += vhd_sectors_to_bytes(clone.secs);
 		continue;
 
 	fail:
@@ -2027,74 +4637,135 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+/*
+ * Has the file system zero secs sectors from file sector off, which it
+ * may do by marking extents unwritten. The zeros of an encrypted disk
+ * have to be written.
+ */
+static int
+vhd_zero_range(struct vhd_state *s, uint64_t off, uint64_t secs)
+{
+	int err;
+
+	if (s->no_zero_range || vhd_is_encrypted(s))
+		return -EOPNOTSUPP;
+
+	err = fallocate(s->vhd.fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+			vhd_sectors_to_bytes(off), vhd_sectors_to_bytes(secs));
+	if (err) {
+		err = -errno;
+		if (err == -EOPNOTSUPP) {
+			DPRINTF("%s: no zeroing support, writing zeros\n",
+				s->vhd.file);
+			s->no_zero_range = 1;
+		} else
+			EPRINTF("%s: zeroing 0x%"PRIx64" secs at 0x%"PRIx64
+				": %d\n", s->vhd.file, secs, off, err);
+		return err;
+	}
+
+	s->zero_secs += secs;
+	return 0;
+}
+
+/*
+ * Makes sectors read as zeros with as little data I/O as possible. On a
+ * dynamic disk without a parent, sectors with clear bits already do, and
+ * allocated ones have their bits cleared like all-zero writes. Elsewhere,
+ * allocated sectors are zeroed in place by the file system, while
+ * unallocated sectors of differencing disks get zeros written, which
+ * allocates their blocks.
+ */
 static void
-vhd_queue_write(td_driver_t *driver, td_request_t treq)
+vhd_queue_write_zeroes(td_driver_t *driver, td_request_t treq)
 {
 	struct vhd_state *s = (struct vhd_state *)driver->data;
+	int parent;
 
-	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x, (seg: %d)\n",
-	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	s->dirty = 1;
+
+	if (!vhd_type_dynamic(&s->vhd)) {
+		if (vhd_zero_range(s, treq.sec, treq.secs))
+			td_queue_zero_writes(treq.image, treq);
+		else
+			td_complete_request(treq, 0);
+		return;
+	}
+
+	parent = s->vhd.footer.type == HD_TYPE_DIFF;
 
 	while (treq.secs) {
 		int err;
-		uint8_t flags;
+		uint32_t blk;
 		td_request_t clone;
 
 		err   = 0;
-		flags = 0;
 		clone = treq;
+		blk   = clone.sec / s->spb;
 
-		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DATA_WRITE)) {
+		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DATA_WRITE_ZEROES)) {
 		case -EINVAL:
 			err = -EINVAL;
 			goto fail;
 
-		case VHD_BM_BAT_LOCKED:
-			err = -EBUSY;
-			goto fail;
-
 		case VHD_BM_BAT_CLEAR:
-			flags      = (VHD_FLAG_REQ_UPDATE_BAT |
-				      VHD_FLAG_REQ_UPDATE_BITMAP);
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			err        = schedule_data_write(s, clone, flags);
-			if (err)
-				goto fail;
+			if (parent)
+				td_queue_zero_writes(treq.image, clone);
+			else {
+				s->zero_secs += clone.secs;
+				td_complete_request(clone, 0);
+			}
 			break;
 
 		case VHD_BM_BIT_CLEAR:
-			flags      = VHD_FLAG_REQ_UPDATE_BITMAP;
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
-			err        = schedule_data_write(s, clone, flags);
-			if (err)
-				goto fail;
+			if (parent)
+				td_queue_zero_writes(treq.image, clone);
+			else {
+				s->zero_secs += clone.secs;
+				td_complete_request(clone, 0);
+			}
 			break;
 
 		case VHD_BM_BIT_SET:
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 1);
-			err = schedule_data_write(s, clone, 0);
-			if (err)
-				goto fail;
+			if (!parent && !test_batmap(s, blk)) {
+				err = schedule_zero_write(s, clone,
+							  VHD_FLAG_REQ_UPDATE_BITMAP |
+							  VHD_FLAG_REQ_ZERO);
+				if (err)
+					goto fail;
+				s->zero_secs += clone.secs;
+			} else if (!vhd_zero_range(s, bat_entry(s, blk) + s->bm_secs +
+						    clone.sec % s->spb, clone.secs))
+				td_complete_request(clone, 0);
+			else
+				td_queue_zero_writes(treq.image, clone);
 			break;
 
 		case VHD_BM_NOT_CACHED:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			err = schedule_bitmap_read(s, clone.sec / s->spb);
+			err = schedule_bitmap_read(s, blk);
 			if (err)
 				goto fail;
 
-			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE, clone);
+			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE_ZEROES, clone);
 			if (err)
 				goto fail;
 			break;
 
 		case VHD_BM_READ_PENDING:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE, clone);
+			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE_ZEROES, clone);
 			if (err)
 				goto fail;
 			break;
 
+		case VHD_BM_BAT_LOCKED:
 		default:
 			ASSERT(0);
 			break;
@@ -2102,7 +4773,6 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 
 		treq.sec  += clone.secs;
 		treq.secs -= clone.secs;
-		treq.buf  += vhd_sectors_to_bytes(clone.secs);
 		continue;
 
 	fail:
@@ -2112,6 +4782,44 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+/*
+ * Writes complete only once their bitmap and BAT updates are done, so one
+ * fdatasync makes the data and metadata of all of them stable. It does not
+ * cover writes still in flight when it is issued, so the image is marked
+ * dirty as writes complete, and a flush only does nothing if none did
+ * since the last one was issued. Discards and zeroing done in place are
+ * synchronous and mark the image as they are queued.
+ */
+static void
+vhd_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	struct vhd_request *req;
+
+	if (!s->dirty) {
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	req = alloc_vhd_request(s);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	req->treq = treq;
+	req->op   = VHD_OP_FLUSH;
+
+	s->dirty = 0;
+	s->flushes++;
+
+	td_prep_fdsync(&req->tiocb, s->vhd.fd, vhd_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
+
+	s->queued++;
+	TRACE(s);
+}
+
 static inline void
 signal_completion(struct vhd_request *list, int error)
 {
@@ -2129,14 +4837,25 @@ signal_completion(struct vhd_request *list, int error)
 
 		err  = (error ? error : r->error);
 		next = r->next;
+		if (r->op == VHD_OP_DATA_WRITE ||
+		    r->op == VHD_OP_DATA_DISCARD ||
+		    r->op == VHD_OP_DATA_WRITE_ZEROES)
+			s->dirty = 1;
 		if (vhd_is_encrypted(s)) {
 			switch (r->op) {
 			case VHD_OP_DATA_READ:
+				if (s->crypto_chan && !err) {
+					/* completes once decrypted */
+					vhd_queue_decrypt(s, r);
+					r = next;
+					continue;
+				}
 				crypto_interface->vhd_crypto_decrypt(
 					&s->vhd, &r->treq);
 				break;
 			case VHD_OP_DATA_WRITE:
-				free(r->treq.buf);
+				vhd_put_crypto_buf(s, r->treq.buf,
+						   r->treq.secs);
 				r->treq.buf = r->orig_buf;
 				break;
 			}
@@ -2182,8 +4901,15 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 			if (!r->error) {
 				uint32_t sec = r->treq.sec % s->spb;
 				for (i = 0; i < r->treq.secs; i++)
-					vhd_bitmap_set(&s->vhd,
-						       bm->shadow, sec + i);
+					if (test_vhd_flag(r->flags,
+							  VHD_FLAG_REQ_ZERO))
+						vhd_bitmap_clear(&s->vhd,
+								 bm->shadow,
+								 sec + i);
+					else
+						vhd_bitmap_set(&s->vhd,
+							       bm->shadow,
+							       sec + i);
 			}
 		}
 		r = next;
@@ -2198,15 +4924,17 @@ static void
 finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	struct vhd_transaction *tx = &bm->tx;
+	struct vhd_bat_alloc *a;
 
-	if (!bat_locked(s))
-		return;
-
-	if (s->bat.pbw_blk != bm->blk)
+	a = get_bat_alloc(s, bm->blk);
+	if (!a)
 		return;
 
-	if (!s->bat.req.error)
+	if (!a->error) {
+		if (!test_vhd_flag(a->status, VHD_FLAG_ALLOC_WRITTEN))
+			return;
 		goto release;
+	}
 
 	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
 		goto release;
@@ -2216,8 +4944,7 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 
  release:
 	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
+	release_bat_alloc(s, a);
 }
 
 static void
@@ -2231,15 +4958,12 @@ finish_bitmap_transaction(struct vhd_state *s,
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
-			return;
-		}
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
+		/* still waiting for bat write */
+		struct vhd_bat_alloc *a = get_bat_alloc(s, bm->blk);
+		ASSERT(a && test_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROED));
+		a->tx = tx;
+		return;
 	}
 
 	if (tx->error) {
@@ -2281,42 +5005,67 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 static void
 finish_bat_write(struct vhd_request *req)
 {
+	int i;
+	uint32_t allocs, sector;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
+	struct vhd_bat_write *bw;
 	struct vhd_transaction *tx;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	bw     = container_of(req, struct vhd_bat_write, req);
+	allocs = bw->allocs;
+	sector = bw->sector;
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	/* completions below may schedule new bat writes */
+	s->bat.writes &= ~(1U << (bw - s->bat.write));
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+	DBG(TLOG_DBG, "sector: %u, allocs: 0x%04x, err %d\n",
+	    sector, allocs, req->error);
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++) {
+		if (!(allocs & (1U << i)))
+			continue;
+
+		a  = &s->bat.alloc[i];
+		bm = get_bitmap(s, a->blk);
+
+		ASSERT((s->bat.allocs & (1U << i)) &&
+		       test_vhd_flag(a->status, VHD_FLAG_ALLOC_WRITE_STARTED));
+		ASSERT(bm && bitmap_valid(bm));
+
+		tx = &bm->tx;
+
+		if (!req->error) {
+			bat_entry(s, a->blk) = a->offset;
+			set_vhd_flag(a->status, VHD_FLAG_ALLOC_WRITTEN);
+			if (s->bat.allocated_valid)
+				s->bat.allocated++;
+		} else {
+			a->error  = req->error;
+			tx->error = req->error;
+		}
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
+
+		/*
+		 * Finish the bitmap transaction if it was waiting for us, or if
+		 * it never had a request (preallocated block whose data write
+		 * could not be queued).
+		 */
+		if (a->tx || !test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE)) {
+			a->tx = NULL;
 			finish_bitmap_transaction(s, bm, req->error);
+		}
+
+		finish_bat_transaction(s, bm);
 	}
 
-	finish_bat_transaction(s, bm);
+	/* allocations in the same sector that were zeroed in the meantime */
+	schedule_bat_write(s, sector);
 }
 
 static void
@@ -2324,6 +5073,7 @@ finish_zero_bm_write(struct vhd_request *req)
 {
 	uint32_t blk;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = req->state;
 
@@ -2332,22 +5082,23 @@ finish_zero_bm_write(struct vhd_request *req)
 
 	blk = req->treq.sec / s->spb;
 	bm  = get_bitmap(s, blk);
+	a   = get_bat_alloc(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
+	ASSERT(a && &a->zero_req == req);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
+		a->error  = req->error;
 		tx->error = req->error;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-	} else
-		schedule_bat_write(s);
+	} else {
+		set_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROED);
+		schedule_bat_write(s, blk / 128);
+	}
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
@@ -2390,6 +5141,15 @@ finish_bitmap_read(struct vhd_request *req)
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
 	ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING));
 
+	if (!req->error && s->mdlog &&
+	    vhd_mdlog_overlay(s, req->mdlog_gen,
+			      vhd_sectors_to_bytes(bat_entry(s, blk)),
+			      bm->map, s->bm_secs) == -EAGAIN) {
+		req->mdlog_gen = s->mdlog->gen;
+		aio_read(s, req, vhd_sectors_to_bytes(bat_entry(s, blk)));
+		return;
+	}
+
 	r = bm->waiting.head;
 	clear_req_list(&bm->waiting);
 	clear_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
@@ -2397,6 +5157,9 @@ finish_bitmap_read(struct vhd_request *req)
 	if (!req->error) {
 		memcpy(bm->shadow, bm->map, vhd_sectors_to_bytes(s->bm_secs));
 
+		if (s->bat.full && bitmap_full(s, bm))
+			set_block_full(s, blk);
+
 		while (r) {
 			struct vhd_request tmp;
 
@@ -2405,12 +5168,18 @@ finish_bitmap_read(struct vhd_request *req)
 			free_vhd_request(s, r);
 
 			ASSERT(tmp.op == VHD_OP_DATA_READ || 
-			       tmp.op == VHD_OP_DATA_WRITE);
+			       tmp.op == VHD_OP_DATA_WRITE ||
+			       tmp.op == VHD_OP_DATA_DISCARD ||
+			       tmp.op == VHD_OP_DATA_WRITE_ZEROES);
 
 			if (tmp.op == VHD_OP_DATA_READ)
 				vhd_queue_read(s->driver, tmp.treq);
 			else if (tmp.op == VHD_OP_DATA_WRITE)
 				vhd_queue_write(s->driver, tmp.treq);
+			else if (tmp.op == VHD_OP_DATA_DISCARD)
+				vhd_queue_discard(s->driver, tmp.treq);
+			else if (tmp.op == VHD_OP_DATA_WRITE_ZEROES)
+				vhd_queue_write_zeroes(s->driver, tmp.treq);
 
 			r = next;
 		}
@@ -2421,8 +5190,13 @@ finish_bitmap_read(struct vhd_request *req)
 		return signal_completion(r, err);
 	}
 
-	if (!bitmap_in_use(bm))
+	if (!bitmap_in_use(bm)) {
 		unlock_bitmap(bm);
+
+		/* not consulted again, leave the room to partial blocks */
+		if (s->bat.full && test_bit(s->bat.full, blk))
+			free_vhd_bitmap(s, bm);
+	}
 }
 
 static void
@@ -2486,7 +5260,10 @@ finish_data_write(struct vhd_request *req)
 		    "tx->started: %d, tx->finished: %d\n", req->treq.sec,
 		    req->treq.sec / s->spb, tx->started, tx->finished);
 
-		if (!req->error)
+		if (!req->error && test_vhd_flag(req->flags, VHD_FLAG_REQ_ZERO))
+			for (i = 0; i < req->treq.secs; i++)
+				vhd_bitmap_clear(&s->vhd, bm->shadow, sec + i);
+		else if (!req->error)
 			for (i = 0; i < req->treq.secs; i++)
 				vhd_bitmap_set(&s->vhd, bm->shadow,  sec + i);
 
@@ -2511,6 +5288,8 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 	s->completed++;
 	TRACE(s);
 
+	TD_PROBE4(vhd_complete, req, req->op, req->treq.sec, err);
+
 	req->error = err;
 
 	if (req->error)
@@ -2549,6 +5328,10 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bat_write(req);
 		break;
 
+	case VHD_OP_FLUSH:
+		signal_completion(req, 0);
+		break;
+
 	default:
 		ASSERT(0);
 		break;
@@ -2559,6 +5342,8 @@ void
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
+	struct vhd_request_slab *slab;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2569,28 +5354,33 @@ vhd_debug(td_driver_t *driver)
 	DBG(TLOG_WARN, "READS: 0x%08"PRIx64", AVG_READ_SIZE: %f\n",
 	    s->reads, (s->reads ? ((float)s->read_size / s->reads) : 0.0));
 
-	DBG(TLOG_WARN, "ALLOCATED REQUESTS: (%u total)\n", VHD_REQS_DATA);
-	for (i = 0; i < VHD_REQS_DATA; i++) {
-		struct vhd_request *r = &s->vreq_list[i];
-		td_request_t *t       = &r->treq;
-		const char *vname     = t->vreq ? t->vreq->name: NULL;
-		if (t->secs)
-			DBG(TLOG_WARN, "%d: vreq: %s.%d, err: %d, op: %d,"
-			    " lsec: 0x%08"PRIx64", flags: %d, this: %p, "
-			    "next: %p, tx: %p\n", i, vname, t->sidx, r->error, r->op,
-			    t->sec, r->flags, r, r->next, r->tx);
+	DBG(TLOG_WARN, "ALLOCATED REQUESTS: (%d total)\n", s->vreq_max);
+	i = 0;
+	for (slab = s->vreq_slabs; slab; slab = slab->next) {
+		int j;
+
+		for (j = 0; j < slab->nr; j++, i++) {
+			struct vhd_request *r = &slab->reqs[j];
+			td_request_t *t       = &r->treq;
+			const char *vname     = t->vreq ? t->vreq->name: NULL;
+			if (t->secs)
+				DBG(TLOG_WARN, "%d: vreq: %s.%d, err: %d, "
+				    "op: %d, lsec: 0x%08"PRIx64", flags: %d, "
+				    "this: %p, next: %p, tx: %p\n", i, vname,
+				    t->sidx, r->error, r->op, t->sec, r->flags,
+				    r, r->next, r->tx);
+		}
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: %d of %d, hits: %"PRIu64", misses: "
+	    "%"PRIu64", evictions: %"PRIu64"\n", s->bm_count, s->bm_max,
+	    s->bm_hits, s->bm_misses, s->bm_evictions);
+	i = 0;
+	for (bm = s->bm_lru_head; bm; bm = bm->lru_next, i++) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
-			continue;
-
 		tx = &bm->tx;
 		r = bm->queue.head;
 		while (r) {
@@ -2618,9 +5408,19 @@ vhd_debug(td_driver_t *driver)
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: allocs: 0x%04x, writes: 0x%04x, next_db: "
+	    "0x%08"PRIx64", extent_end: 0x%08"PRIx64"\n", s->bat.allocs,
+	    s->bat.writes, s->next_db, s->extent_end);
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++) {
+		struct vhd_bat_alloc *a = &s->bat.alloc[i];
+
+		if (!(s->bat.allocs & (1U << i)))
+			continue;
+
+		DBG(TLOG_WARN, "%d: blk: 0x%04x, offset: 0x%08"PRIx64", "
+		    "status: 0x%02x, error: %d, tx: %p\n", i, a->blk,
+		    a->offset, a->status, a->error, a->tx);
+	}
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2628,15 +5428,106 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+static int
+vhd_sector_present(td_driver_t *driver, td_sector_t sec, td_sector_t *secs)
+{
+	uint32_t blk, bit;
+	struct vhd_bitmap *bm;
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	int present;
+
+	*secs = s->spb - (sec % s->spb);
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED || !s->bat.bat.bat)
+		return 1;
+
+	blk = sec / s->spb;
+	if (blk >= s->bat.bat.entries)
+		return 1;
+
+	/* reads of unallocated blocks go to the parent, see vhd_queue_read */
+	if (bat_entry(s, blk) == DD_BLK_UNUSED)
+		return !!get_bat_alloc(s, blk);
+
+	if (test_block_full(s, blk))
+		return 1;
+
+	/*
+	 * So do reads of sectors clear in the bitmap. Only a cached bitmap
+	 * with no updates under way narrows the block down, no I/O is done.
+	 */
+	bm = get_bitmap(s, blk);
+	if (!bm || bitmap_in_use(bm))
+		return 1;
+
+	bit     = sec % s->spb;
+	present = !!vhd_bitmap_test(&s->vhd, bm->map, bit);
+	*secs   = vhd_bitmap_scan(&s->vhd, bm->map, bit, s->spb, !present) - bit;
+
+	return present;
+}
+
+static void
+vhd_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	tapdisk_stats_field(st, "flushes", "llu",
+			    (unsigned long long)s->flushes);
+
+	if (!vhd_type_dynamic(&s->vhd))
+		return;
+
+	tapdisk_stats_field(st, "bitmap_cache", "{");
+	tapdisk_stats_field(st, "size", "d", s->bm_count);
+	tapdisk_stats_field(st, "max", "d", s->bm_max);
+	tapdisk_stats_field(st, "hits", "llu",
+			    (unsigned long long)s->bm_hits);
+	tapdisk_stats_field(st, "misses", "llu",
+			    (unsigned long long)s->bm_misses);
+	tapdisk_stats_field(st, "evictions", "llu",
+			    (unsigned long long)s->bm_evictions);
+	tapdisk_stats_field(st, "readahead", "llu",
+			    (unsigned long long)s->ra_reads);
+	if (s->bat.full)
+		tapdisk_stats_field(st, "full_blocks", "u",
+				    s->bat.full_blocks);
+	tapdisk_stats_leave(st, '}');
+
+	if (!s->bat.allocated_valid && vhd_bat_loaded(s)) {
+		uint32_t i;
+
+		for (i = 0; i < s->bat.bat.entries; i++)
+			if (bat_entry(s, i) != DD_BLK_UNUSED)
+				s->bat.allocated++;
+		s->bat.allocated_valid = 1;
+	}
+
+	if (s->bat.allocated_valid) {
+		tapdisk_stats_field(st, "allocated", "{");
+		tapdisk_stats_field(st, "blocks", "u", s->bat.allocated);
+		tapdisk_stats_field(st, "bytes", "llu",
+				    (unsigned long long)s->bat.allocated <<
+				    vhd_block_shift(&s->vhd));
+		tapdisk_stats_leave(st, '}');
+	}
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
 	.private_data_size  = sizeof(struct vhd_state),
 	.td_open            = _vhd_open,
 	.td_close           = _vhd_close,
-	.td_queue_read      = vhd_queue_read,
+	.td_queue_read      = _vhd_queue_read,
 	.td_queue_write     = vhd_queue_write,
+	.td_queue_discard   = vhd_queue_discard,
+	.td_queue_write_zeroes = vhd_queue_write_zeroes,
+	.td_queue_flush     = vhd_queue_flush,
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
+	.td_sector_present  = vhd_sector_present,
+	.td_set_depth       = vhd_set_depth,
 };
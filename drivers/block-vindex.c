@@ -36,6 +36,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "debug.h"
 #include "tapdisk.h"
@@ -51,21 +53,15 @@
 #define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
 #define WARN(_f, _a...)              tlog_write(TLOG_WARN, _f, ##_a)
 
-#define VHD_INDEX_FILE_POOL_SIZE     12
-#define VHD_INDEX_CACHE_SIZE         4
-#define VHD_INDEX_REQUESTS           (TAPDISK_DATA_REQUESTS + VHD_INDEX_CACHE_SIZE)
-
-#define VHD_INDEX_BLOCK_READ_PENDING 0x0001
-#define VHD_INDEX_BLOCK_VALID        0x0002
+#define VHD_INDEX_OPEN_FILES         256
+#define VHD_INDEX_REQUESTS           TAPDISK_DATA_REQUESTS
+#define VHD_INDEX_PREFETCH_MAX       (64ULL << 20) /* bytes of index */
 
 #define VHD_INDEX_BAT_CLEAR          0
 #define VHD_INDEX_BIT_CLEAR          1
 #define VHD_INDEX_BIT_SET            2
-#define VHD_INDEX_CACHE_MISS         3
-#define VHD_INDEX_META_READ_PENDING  4
 
 typedef struct vhd_index             vhd_index_t;
-typedef struct vhd_index_block       vhd_index_block_t;
 typedef struct vhd_index_request     vhd_index_request_t;
 typedef struct vhd_index_file_ref    vhd_index_file_ref_t;
 
@@ -74,27 +70,28 @@ struct vhd_index_request {
 	td_request_t                 treq;
 	vhd_index_t                 *index;
 	struct tiocb                 tiocb;
-	struct list_head             next;
 	vhd_index_file_ref_t        *file;
 };
 
-struct vhd_index_block {
-	uint64_t                     blk;
-	uint32_t                     seqno;
-	td_flag_t                    state;
-	vhdi_block_t                 vhdi_block;
-	int                          table_size;
-	struct list_head             queue;
-	vhd_index_request_t          req;
-};
-
 struct vhd_index_file_ref {
 	int                          fd;
 	vhdi_file_id_t               fid;
-	uint32_t                     seqno;
+	const char                  *path;
 	uint32_t                     refcnt;
+	struct list_head             lru;    /* open, unreferenced */
+	vhd_index_file_ref_t        *next;   /* hash chain */
 };
 
+/*
+ * The index file is mapped read-only: the entries of a VHD block are
+ * at the sector its BAT entry points to, one big-endian vhdi_entry_t
+ * per sector, so a lookup is an array access. Small indexes are
+ * prefetched whole, larger ones fault in as they are used.
+ *
+ * Referenced files are found by id in a hash of the file table. Up to
+ * VHD_INDEX_OPEN_FILES are kept open, closing the least recently used
+ * of those no request holds to open more.
+ */
 struct vhd_index {
 	char                        *name;
 
@@ -102,13 +99,14 @@ struct vhd_index {
 	vhdi_context_t               vhdi;
 	vhdi_file_table_t            files;
 
-	vhd_index_file_ref_t         fds[VHD_INDEX_FILE_POOL_SIZE];
+	char                        *map;
+	size_t                       map_size;
 
-	vhd_index_block_t           *cache[VHD_INDEX_CACHE_SIZE];
-
-	int                          cache_free_cnt;
-	vhd_index_block_t           *cache_free_list[VHD_INDEX_CACHE_SIZE];
-	vhd_index_block_t            cache_list[VHD_INDEX_CACHE_SIZE];
+	vhd_index_file_ref_t        *refs;
+	vhd_index_file_ref_t       **hash;
+	uint32_t                     hash_mask;
+	int                          open_files;
+	struct list_head             lru;
 
 	int                          requests_free_cnt;
 	vhd_index_request_t         *requests_free_list[VHD_INDEX_REQUESTS];
@@ -117,27 +115,12 @@ struct vhd_index {
 	td_driver_t                 *driver;
 };
 
-static void vhd_index_complete_meta_read(void *, struct tiocb *, int);
 static void vhd_index_complete_data_read(void *, struct tiocb *, int);
 
-#define vhd_index_block_for_each_request(_block, _req, _tmp)		\
-	list_for_each_entry_safe((_req), (_tmp), &(_block)->queue, next)
-
 static inline void
 vhd_index_initialize_request(vhd_index_request_t *req)
 {
 	memset(req, 0, sizeof(vhd_index_request_t));
-	INIT_LIST_HEAD(&req->next);
-}
-
-static inline void
-vhd_index_initialize_block(vhd_index_block_t *block)
-{
-	block->blk   = 0;
-	block->state = 0;
-	INIT_LIST_HEAD(&block->queue);
-	vhd_index_initialize_request(&block->req);
-	memset(block->vhdi_block.table, 0, block->table_size);
 }
 
 static void
@@ -146,52 +129,86 @@ vhd_index_init(vhd_index_t *index)
 	int i;
 
 	memset(index, 0, sizeof(vhd_index_t));
-
-	index->cache_free_cnt = VHD_INDEX_CACHE_SIZE;
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		index->cache_free_list[i] = index->cache_list + i;
-		vhd_index_initialize_block(index->cache_free_list[i]);
-	}
+	INIT_LIST_HEAD(&index->lru);
 
 	index->requests_free_cnt = VHD_INDEX_REQUESTS;
 	for (i = 0; i < VHD_INDEX_REQUESTS; i++) {
 		index->requests_free_list[i] = index->requests_list + i;
 		vhd_index_initialize_request(index->requests_free_list[i]);
 	}
+}
 
-	for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-		index->fds[i].fd = -1;
+static inline vhd_index_file_ref_t *
+vhd_index_find_file(vhd_index_t *index, vhdi_file_id_t id)
+{
+	vhd_index_file_ref_t *ref;
+
+	for (ref = index->hash[id & index->hash_mask]; ref; ref = ref->next)
+		if (ref->fid == id)
+			return ref;
+
+	return NULL;
 }
 
 static int
-vhd_index_allocate_cache(vhd_index_t *index)
+vhd_index_hash_files(vhd_index_t *index)
 {
-	void *buf;
-	int i, err;
-	size_t size;
+	int i, n;
+	uint32_t buckets;
+	vhd_index_file_ref_t *ref, **bucket;
 
-	size = vhd_bytes_padded(index->vhdi.spb * sizeof(vhdi_entry_t));
+	n = index->files.entries;
 
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		err = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
-		if (err)
-			goto fail;
+	for (buckets = 1; buckets < n; buckets <<= 1)
+		;
 
-		memset(buf, 0, size);
-		index->cache_list[i].vhdi_block.table   = (vhdi_entry_t *)buf;
-		index->cache_list[i].vhdi_block.entries = index->vhdi.spb;
-		index->cache_list[i].table_size         = size;
+	index->refs = calloc(n ? : 1, sizeof(vhd_index_file_ref_t));
+	index->hash = calloc(buckets, sizeof(vhd_index_file_ref_t *));
+	if (!index->refs || !index->hash)
+		return -ENOMEM;
+
+	index->hash_mask = buckets - 1;
+
+	for (i = 0; i < n; i++) {
+		ref       = index->refs + i;
+		ref->fd   = -1;
+		ref->fid  = index->files.table[i].file_id;
+		ref->path = index->files.table[i].path;
+		INIT_LIST_HEAD(&ref->lru);
+
+		bucket    = &index->hash[ref->fid & index->hash_mask];
+		ref->next = *bucket;
+		*bucket   = ref;
 	}
 
 	return 0;
+}
 
-fail:
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		free(index->cache_list[i].vhdi_block.table);
-		index->cache_list[i].vhdi_block.table = NULL;
+static int
+vhd_index_map(vhd_index_t *index)
+{
+	struct stat st;
+
+	if (fstat(index->vhdi.fd, &st))
+		return -errno;
+
+	if (!st.st_size)
+		return -EINVAL;
+
+	index->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+			  index->vhdi.fd, 0);
+	if (index->map == MAP_FAILED) {
+		index->map = NULL;
+		return -errno;
 	}
 
-	return -ENOMEM;
+	index->map_size = st.st_size;
+
+	madvise(index->map, index->map_size, MADV_RANDOM);
+	if (index->map_size <= VHD_INDEX_PREFETCH_MAX)
+		madvise(index->map, index->map_size, MADV_WILLNEED);
+
+	return 0;
 }
 
 static void
@@ -199,13 +216,16 @@ vhd_index_free(vhd_index_t *index)
 {
 	int i;
 
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++)
-		free(index->cache_list[i].vhdi_block.table);
+	if (index->refs)
+		for (i = 0; i < index->files.entries; i++)
+			if (index->refs[i].fd != -1)
+				close(index->refs[i].fd);
 
-	for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-		if (index->fds[i].fd != -1)
-			close(index->fds[i].fd);
+	if (index->map)
+		munmap(index->map, index->map_size);
 
+	free(index->hash);
+	free(index->refs);
 	vhdi_file_table_free(&index->files);
 	free(index->bat.table);
 	free(index->name);
@@ -222,7 +242,7 @@ vhd_index_load(vhd_index_t *index)
 
 	err = vhdi_open(&index->vhdi,
 			index->bat.index_path,
-			O_RDONLY | O_DIRECT | O_LARGEFILE);
+			O_RDONLY | O_LARGEFILE);
 	if (err)
 		goto fail;
 
@@ -263,11 +283,13 @@ vhd_index_open(td_driver_t *driver, const char *name,
 		return err;
 	}
 
-	err = vhd_index_allocate_cache(index);
-	if (err) {
-		vhd_index_free(index);
-		return err;
-	}
+	err = vhd_index_map(index);
+	if (err)
+		goto fail;
+
+	err = vhd_index_hash_files(index);
+	if (err)
+		goto fail;
 
 	driver->info.size = index->bat.vhd_blocks * index->bat.vhd_block_size;
 	driver->info.sector_size = VHD_SECTOR_SIZE;
@@ -278,6 +300,11 @@ vhd_index_open(td_driver_t *driver, const char *name,
 	DPRINTF("opened vhd index %s\n", name);
 
 	return 0;
+
+fail:
+	vhdi_close(&index->vhdi);
+	vhd_index_free(index);
+	return err;
 }
 
 static int
@@ -295,117 +322,63 @@ vhd_index_close(td_driver_t *driver)
 	return 0;
 }
 
-static inline void
-vhd_index_touch_file_ref(vhd_index_t *index, vhd_index_file_ref_t *ref)
-{
-	int i;
-
-	if (++ref->seqno == 0xFFFFFFFF)
-		for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-			index->fds[i].seqno >>= 1;
-}
-
 static inline void
 vhd_index_get_file_ref(vhd_index_file_ref_t *ref)
 {
-	++ref->refcnt;
+	if (!ref->refcnt++)
+		list_del_init(&ref->lru);
 }
 
 static inline void
-vhd_index_put_file_ref(vhd_index_file_ref_t *ref)
+vhd_index_put_file_ref(vhd_index_t *index, vhd_index_file_ref_t *ref)
 {
-	--ref->refcnt;
+	if (!--ref->refcnt)
+		list_add_tail(&ref->lru, &index->lru);
 }
 
-static inline vhd_index_file_ref_t *
-vhd_index_find_lru_file_ref(vhd_index_t *index)
+static void
+vhd_index_close_file(vhd_index_t *index, vhd_index_file_ref_t *ref)
 {
-	int i;
-	uint32_t min;
-	vhd_index_file_ref_t *lru;
-
-	lru = NULL;
-	min = (uint32_t)-1;
-
-	for (i = 1; i < VHD_INDEX_FILE_POOL_SIZE; i++) {
-		if (index->fds[i].refcnt)
-			continue;
-
-		if (!lru || index->fds[i].seqno < min) {
-			min = index->fds[i].seqno;
-			lru = index->fds + i;
-		}
-	}
-
-	return lru;
-}
-
-static inline int
-vhd_index_open_file(vhd_index_t *index,
-		    vhdi_file_id_t id, vhd_index_file_ref_t *ref)
-{
-	int i;
-	char *path;
-
-	path = NULL;
-
-	for (i = 0; i < index->files.entries; i++)
-		if (index->files.table[i].file_id == id) {
-			path = index->files.table[i].path;
-			break;
-		}
-
-	if (!path)
-		return -ENOENT;
-
-	ref->fd = open(path, O_RDONLY | O_DIRECT | O_LARGEFILE);
-	if (ref->fd == -1)
-		return -errno;
-
-	ref->fid    = id;
-	ref->refcnt = 0;
-
-	return 0;
+	list_del_init(&ref->lru);
+	close(ref->fd);
+	ref->fd = -1;
+	index->open_files--;
 }
 
 static int
 vhd_index_get_file(vhd_index_t *index,
 		   vhdi_file_id_t id, vhd_index_file_ref_t **ref)
 {
-	int i, err;
-	vhd_index_file_ref_t *lru;
+	vhd_index_file_ref_t *file;
 
 	*ref = NULL;
 
-	for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-		if (id == index->fds[i].fid) {
-			*ref = index->fds + i;
-			vhd_index_touch_file_ref(index, *ref);
-			vhd_index_get_file_ref(*ref);
-			return 0;
+	file = vhd_index_find_file(index, id);
+	if (!file)
+		return -ENOENT;
+
+	if (file->fd == -1) {
+		if (index->open_files >= VHD_INDEX_OPEN_FILES) {
+			if (list_empty(&index->lru))
+				return -EBUSY;
+
+			vhd_index_close_file(index,
+					     list_first_entry(&index->lru,
+							      vhd_index_file_ref_t,
+							      lru));
 		}
 
-	lru = vhd_index_find_lru_file_ref(index);
-	if (!lru)
-		return -EBUSY;
+		file->fd = open(file->path, O_RDONLY | O_DIRECT | O_LARGEFILE);
+		if (file->fd == -1)
+			return -errno;
 
-	if (lru->fd != -1)
-		close(lru->fd);
+		index->open_files++;
+	}
 
-	err = vhd_index_open_file(index, id, lru);
-	if (err)
-		goto fail;
+	vhd_index_get_file_ref(file);
+	*ref = file;
 
-	vhd_index_touch_file_ref(index, lru);
-	vhd_index_get_file_ref(lru);
-	*ref = lru;
 	return 0;
-
-fail:
-	lru->fd     = -1;
-	lru->fid    = 0;
-	lru->refcnt = 0;
-	return err;
 }
 
 static inline vhd_index_request_t *
@@ -425,133 +398,32 @@ vhd_index_allocate_request(vhd_index_t *index)
 static inline void
 vhd_index_free_request(vhd_index_t *index, vhd_index_request_t *req)
 {
-	list_del(&req->next);
 	vhd_index_initialize_request(req);
 	index->requests_free_list[index->requests_free_cnt++] = req;
 }
 
-static inline int
-vhd_index_block_valid(vhd_index_block_t *block)
-{
-	return (!td_flag_test(block->state, VHD_INDEX_BLOCK_READ_PENDING) &&
-		td_flag_test(block->state, VHD_INDEX_BLOCK_VALID));
-}
-
-static inline void
-vhd_index_touch_block(vhd_index_t *index, vhd_index_block_t *block)
-{
-	int i;
-
-	if (++block->seqno == 0xFFFFFFFF)
-		for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++)
-			index->cache_list[i].seqno >>= 1;
-}
-
-static inline vhd_index_block_t *
-vhd_index_get_lru_block(vhd_index_t *index)
-{
-	int i, idx;
-	uint32_t min;
-	vhd_index_block_t *block, *lru;
-
-	lru = NULL;
-	min = (uint32_t)-1;
-	idx = 0;
-
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		block = index->cache[i];
-
-		if (!block)
-			continue;
-
-		if (td_flag_test(block->state, VHD_INDEX_BLOCK_READ_PENDING))
-			continue;
-
-		if (!lru || block->seqno < min) {
-			lru = block;
-			min = block->seqno;
-			idx = i;
-		}
-	}
-
-	if (lru)
-		index->cache[idx] = NULL;
-
-	return lru;
-}
-
-static inline int
-vhd_index_allocate_block(vhd_index_t *index, vhd_index_block_t **block)
+/*
+ * The mapped entries of @blk, which must be allocated.
+ */
+static inline vhdi_entry_t *
+vhd_index_block_table(vhd_index_t *index, uint64_t blk)
 {
-	vhd_index_block_t *b;
+	uint64_t off, size;
 
-	*block = NULL;
-
-	if (index->cache_free_cnt > 0)
-		b = index->cache_free_list[--index->cache_free_cnt];
-	else {
-		b = vhd_index_get_lru_block(index);
-		if (!b)
-			return -EBUSY;
-	}
+	off  = vhd_sectors_to_bytes(index->bat.table[blk]);
+	size = index->vhdi.spb * sizeof(vhdi_entry_t);
 
-	vhd_index_initialize_block(b);
-	vhd_index_touch_block(index, b);
-	*block = b;
+	if (off + size > index->map_size)
+		return NULL;
 
-	return 0;
+	return (vhdi_entry_t *)(index->map + off);
 }
 
 static int
-vhd_index_install_block(vhd_index_t *index,
-			vhd_index_block_t **block, uint32_t blk)
-{
-	int i, err;
-	vhd_index_block_t *b;
-
-	*block = NULL;
-
-	err = vhd_index_allocate_block(index, &b);
-	if (err)
-		return err;
-
-	b->blk = blk;
-
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++)
-		if (!index->cache[i]) {
-			index->cache[i] = b;
-			break;
-		}
-
-	ASSERT(i < VHD_INDEX_CACHE_SIZE);
-	*block = b;
-
-	return 0;
-}
-
-static inline vhd_index_block_t *
-vhd_index_get_block(vhd_index_t *index, uint32_t blk)
+vhd_index_read_entry(vhd_index_t *index, uint64_t sector,
+		     vhdi_entry_t **table)
 {
-	int i;
-	vhd_index_block_t *block;
-
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		block = index->cache[i];
-		if (!block)
-			continue;
-
-		if (block->blk == blk)
-			return block;
-	}
-
-	return NULL;
-}
-
-static int
-vhd_index_read_cache(vhd_index_t *index, uint64_t sector)
-{
-	uint32_t blk, sec;
-	vhd_index_block_t *block;
+	uint64_t blk;
 
 	blk = sector / index->vhdi.spb;
 
@@ -561,114 +433,60 @@ vhd_index_read_cache(vhd_index_t *index, uint64_t sector)
 	if (index->bat.table[blk] == DD_BLK_UNUSED)
 		return VHD_INDEX_BAT_CLEAR;
 
-	block = vhd_index_get_block(index, blk);
-	if (!block)
-		return VHD_INDEX_CACHE_MISS;
-
-	vhd_index_touch_block(index, block);
+	*table = vhd_index_block_table(index, blk);
+	if (!*table)
+		return -EIO;
 
-	if (td_flag_test(block->state, VHD_INDEX_BLOCK_READ_PENDING))
-		return VHD_INDEX_META_READ_PENDING;
-
-	sec = sector % index->vhdi.spb;
-	if (block->vhdi_block.table[sec].offset == DD_BLK_UNUSED)
+	/* all ones, in either byte order */
+	if ((*table)[sector % index->vhdi.spb].offset == DD_BLK_UNUSED)
 		return VHD_INDEX_BIT_CLEAR;
 
 	return VHD_INDEX_BIT_SET;
 }
 
 static int
-vhd_index_read_cache_span(vhd_index_t *index,
-			  uint64_t sector, int secs, int value)
+vhd_index_read_span(vhd_index_t *index, vhdi_entry_t *table,
+		    uint64_t sector, int secs, int value)
 {
 	int i;
-	uint32_t blk, sec;
-	vhd_index_block_t *block;
+	uint32_t sec;
 
-	blk = sector / index->vhdi.spb;
 	sec = sector % index->vhdi.spb;
 
-	ASSERT(blk < index->bat.vhd_blocks);
-
-	block = vhd_index_get_block(index, blk);
-	ASSERT(block && vhd_index_block_valid(block));
-
 	for (i = 0; i < secs && i + sec < index->vhdi.spb; i++)
-		if (value ^
-		    (block->vhdi_block.table[sec + i].offset != DD_BLK_UNUSED))
+		if (value ^ (table[sec + i].offset != DD_BLK_UNUSED))
 			break;
 
 	return i;
 }
 
 static int
-vhd_index_schedule_meta_read(vhd_index_t *index, uint32_t blk)
+vhd_index_schedule_data_read(vhd_index_t *index, vhdi_entry_t *table,
+			     td_request_t treq)
 {
 	int err;
-	off64_t offset;
-	vhd_index_block_t *block;
-	vhd_index_request_t *req;
-
-	ASSERT(index->bat.table[blk] != DD_BLK_UNUSED);
-
-	block = vhd_index_get_block(index, blk);
-	if (!block) {
-		err = vhd_index_install_block(index, &block, blk);
-		if (err)
-			return err;
-	}
-
-	offset         = vhd_sectors_to_bytes(index->bat.table[blk]);
-
-	req            = &block->req;
-	req->index     = index;
-	req->treq.sec  = blk * index->vhdi.spb;
-	req->treq.secs = block->table_size >> VHD_SECTOR_SHIFT;
-
-	td_prep_read(&req->tiocb, index->vhdi.fd,
-		     (char *)block->vhdi_block.table, block->table_size,
-		     offset, vhd_index_complete_meta_read, req);
-	td_queue_tiocb(index->driver, &req->tiocb);
-
-	td_flag_set(block->state, VHD_INDEX_BLOCK_READ_PENDING);
-
-	return 0;
-}
-
-static int
-vhd_index_schedule_data_read(vhd_index_t *index, td_request_t treq)
-{
-	int i, err;
 	size_t size;
 	off64_t offset;
-	uint32_t blk, sec;
-	vhd_index_block_t *block;
+	vhdi_entry_t entry;
 	vhd_index_request_t *req;
 	vhd_index_file_ref_t *file;
 
-	blk   = treq.sec / index->vhdi.spb;
-	sec   = treq.sec % index->vhdi.spb;
-	block = vhd_index_get_block(index, blk);
-
-	ASSERT(block && vhd_index_block_valid(block));
-	for (i = 0; i < treq.secs; i++) {
-		ASSERT(block->vhdi_block.table[sec + i].file_id != 0);
-		ASSERT(block->vhdi_block.table[sec + i].offset != DD_BLK_UNUSED);
-	}
+	entry = table[treq.sec % index->vhdi.spb];
+	vhdi_entry_in(&entry);
+	ASSERT(entry.file_id != 0);
 
 	req = vhd_index_allocate_request(index);
 	if (!req)
 		return -EBUSY;
 
-	err = vhd_index_get_file(index,
-				 block->vhdi_block.table[sec].file_id, &file);
+	err = vhd_index_get_file(index, entry.file_id, &file);
 	if (err) {
 		vhd_index_free_request(index, req);
 		return err;
 	}
 
 	size       = vhd_sectors_to_bytes(treq.secs);
-	offset     = vhd_sectors_to_bytes(block->vhdi_block.table[sec].offset);
+	offset     = vhd_sectors_to_bytes(entry.offset);
 
 	req->file  = file;
 	req->treq  = treq;
@@ -682,25 +500,6 @@ vhd_index_schedule_data_read(vhd_index_t *index, td_request_t treq)
 	return 0;
 }
 
-static int
-vhd_index_queue_request(vhd_index_t *index, td_request_t treq)
-{
-	vhd_index_block_t *block;
-	vhd_index_request_t *req;
-
-	req = vhd_index_allocate_request(index);
-	if (!req)
-		return -EBUSY;
-
-	req->treq = treq;
-
-	block = vhd_index_get_block(index, treq.sec / index->vhdi.spb);
-	ASSERT(block && td_flag_test(block->state, VHD_INDEX_BLOCK_READ_PENDING));
-
-	list_add_tail(&req->next, &block->queue);
-	return 0;
-}
-
 static void
 vhd_index_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -711,47 +510,31 @@ vhd_index_queue_read(td_driver_t *driver, td_request_t treq)
 	while (treq.secs) {
 		int err;
 		td_request_t clone;
+		vhdi_entry_t *table;
 
-		err   = 0;
 		clone = treq;
 
-		switch (vhd_index_read_cache(index, clone.sec)) {
-		case -EINVAL:
-			err = -EINVAL;
-			goto fail;
-
+		err = vhd_index_read_entry(index, clone.sec, &table);
+		switch (err) {
 		case VHD_INDEX_BAT_CLEAR:
 			clone.secs = MIN(clone.secs, index->vhdi.spb - (clone.sec % index->vhdi.spb));
 			td_forward_request(clone);
 			break;
 
 		case VHD_INDEX_BIT_CLEAR:
-			clone.secs = vhd_index_read_cache_span(index, clone.sec, clone.secs, 0);
+			clone.secs = vhd_index_read_span(index, table, clone.sec, clone.secs, 0);
 			td_forward_request(clone);
 			break;
 
 		case VHD_INDEX_BIT_SET:
-			clone.secs = vhd_index_read_cache_span(index, clone.sec, clone.secs, 1);
-			err = vhd_index_schedule_data_read(index, clone);
+			clone.secs = vhd_index_read_span(index, table, clone.sec, clone.secs, 1);
+			err = vhd_index_schedule_data_read(index, table, clone);
 			if (err)
 				goto fail;
 			break;
 
-		case VHD_INDEX_CACHE_MISS:
-			err = vhd_index_schedule_meta_read(index, clone.sec / index->vhdi.spb);
-			if (err)
-				goto fail;
-
-			clone.secs = MIN(clone.secs, index->vhdi.spb - (clone.sec % index->vhdi.spb));
-			vhd_index_queue_request(index, clone);
-			break;
-
-		case VHD_INDEX_META_READ_PENDING:
-			clone.secs = MIN(clone.secs, index->vhdi.spb - (clone.sec % index->vhdi.spb));
-			err = vhd_index_queue_request(index, clone);
-			if (err)
-				goto fail;
-			break;
+		default:
+			goto fail;
 		}
 
 		treq.sec  += clone.secs;
@@ -777,57 +560,52 @@ vhd_index_signal_completion(vhd_index_t *index,
 			    vhd_index_request_t *req, int err)
 {
 	td_complete_request(req->treq, err);
-	vhd_index_put_file_ref(req->file);
+	vhd_index_put_file_ref(index, req->file);
 	vhd_index_free_request(index, req);
 }
 
 static void
-vhd_index_complete_meta_read(void *arg, struct tiocb *tiocb, int err)
+vhd_index_complete_data_read(void *arg, struct tiocb *tiocb, int err)
 {
-	int i;
-	uint32_t blk;
-	td_request_t treq;
 	vhd_index_t *index;
-	vhd_index_block_t *block;
-	vhd_index_request_t *req, *r, *tmp;
+	vhd_index_request_t *req;
 
 	req   = (vhd_index_request_t *)arg;
 	index = req->index;
 
-	blk   = req->treq.sec / index->vhdi.spb;
-	block = vhd_index_get_block(index, blk);
-	ASSERT(block && td_flag_test(block->state, VHD_INDEX_BLOCK_READ_PENDING));
-	td_flag_clear(block->state, VHD_INDEX_BLOCK_READ_PENDING);
-
-	if (err) {
-		memset(block->vhdi_block.table, 0, block->table_size);
-		vhd_index_block_for_each_request(block, r, tmp)
-			vhd_index_signal_completion(index, r, err);
-		return;
-	}
-
-	for (i = 0; i < block->vhdi_block.entries; i++)
-		vhdi_entry_in(block->vhdi_block.table + i);
-
-	td_flag_set(block->state, VHD_INDEX_BLOCK_VALID);
-
-	vhd_index_block_for_each_request(block, r, tmp) {
-		treq = r->treq;
-		vhd_index_free_request(index, r);
-		vhd_index_queue_read(index->driver, treq);
-	}
+	vhd_index_signal_completion(index, req, err);
 }
 
-static void
-vhd_index_complete_data_read(void *arg, struct tiocb *tiocb, int err)
+/*
+ * Sectors with an entry are in the index, the others are read from the
+ * parent, as in vhd_index_queue_read.
+ */
+static int
+vhd_index_sector_present(td_driver_t *driver, td_sector_t sec,
+			 td_sector_t *secs)
 {
 	vhd_index_t *index;
-	vhd_index_request_t *req;
+	vhdi_entry_t *table;
+	int err;
 
-	req   = (vhd_index_request_t *)arg;
-	index = req->index;
+	index = (vhd_index_t *)driver->data;
+	*secs = index->vhdi.spb - (sec % index->vhdi.spb);
 
-	vhd_index_signal_completion(index, req, err);
+	err = vhd_index_read_entry(index, sec, &table);
+	switch (err) {
+	case VHD_INDEX_BAT_CLEAR:
+		return 0;
+
+	case VHD_INDEX_BIT_CLEAR:
+		*secs = vhd_index_read_span(index, table, sec, *secs, 0);
+		return 0;
+
+	case VHD_INDEX_BIT_SET:
+		*secs = vhd_index_read_span(index, table, sec, *secs, 1);
+		return 1;
+	}
+
+	return err;
 }
 
 static int
@@ -852,23 +630,16 @@ vhd_index_debug(td_driver_t *driver)
 	index = (vhd_index_t *)driver->data;
 
 	WARN("VHD INDEX %s\n", index->name);
-	WARN("FILES:\n");
+	WARN("MAP: %p, size: 0x%zx\n", index->map, index->map_size);
+	WARN("FILES: %d, open: %d\n", index->files.entries, index->open_files);
 	for (i = 0; i < index->files.entries; i++) {
-		int j, fd, refcnt;
-
-		fd     = -1;
-		refcnt = 0;
+		vhd_index_file_ref_t *ref = index->refs + i;
 
-		for (j = 0; j < VHD_INDEX_FILE_POOL_SIZE; j++)
-			if (index->fds[j].fid == index->files.table[i].file_id) {
-				fd     = index->fds[j].fd;
-				refcnt = index->fds[j].refcnt;
-			}
+		if (ref->fd == -1)
+			continue;
 
 		WARN("%s %u %d %d\n",
-		     index->files.table[i].path,
-		     index->files.table[i].file_id,
-		     fd, refcnt);
+		     ref->path, ref->fid, ref->fd, ref->refcnt);
 	}
 
 	WARN("REQUESTS:\n");
@@ -884,25 +655,6 @@ vhd_index_debug(td_driver_t *driver)
 		     "fid: %u, off: 0x%016"PRIx64"\n", i, req->treq.buf,
 		     req->treq.sec, req->treq.secs, req->file->fid, req->off);
 	}
-
-	WARN("BLOCKS:\n");
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		int queued;
-		vhd_index_block_t *block;
-		vhd_index_request_t *req, *tmp;
-
-		queued = 0;
-		block  = index->cache[i];
-
-		if (!block)
-			continue;
-
-		vhd_index_block_for_each_request(block, req, tmp)
-			++queued;
-
-		WARN("%d: blk: 0x%08"PRIx64", state: 0x%08x, queued: %d\n",
-		     i, block->blk, block->state, queued);
-	}
 }
 
 struct tap_disk tapdisk_vhd_index = {
@@ -916,4 +668,5 @@ struct tap_disk tapdisk_vhd_index = {
 	.td_get_parent_id         = vhd_index_get_parent_id,
 	.td_validate_parent       = vhd_index_validate_parent,
 	.td_debug                 = vhd_index_debug,
+	.td_sector_present        = vhd_index_sector_present,
 };
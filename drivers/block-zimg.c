@@ -0,0 +1,760 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compressed read-only images (see zimg.h), for base images and old
+ * snapshot parents: fewer bytes to read off storage for a boot storm or
+ * a cold read, for some CPU.
+ *
+ * A block is read whole and inflated, then kept in a cache of
+ * decompressed blocks, least recently used out first once the budget
+ * (TAPDISK3_ZIMG_CACHE_MB) is spent. Requests for a block already being
+ * fetched wait on that fetch rather than issue their own.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "list.h"
+#include "zimg.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-stats.h"
+
+#define DBG(_level, _f, _a...) tlog_write(_level, _f, ##_a)
+#define ERR(_s, _err, _f, _a...) tlog_drv_error((_s)->driver, _err, _f, ##_a)
+
+#define MIN(a, b)                ((a) < (b) ? (a) : (b))
+
+#define ZIMG_ALIGN               4096
+#define ZIMG_MAX_FETCHES         32
+#define ZIMG_MAX_WAITERS         (2 * TAPDISK_DATA_REQUESTS)
+#define ZIMG_CACHE_MB            64
+
+struct zimg_state;
+
+struct zimg_block {
+	uint64_t                 idx;
+	char                    *buf;
+	struct list_head         lru;
+	struct zimg_block       *hnext;
+};
+
+struct zimg_waiter {
+	td_request_t             treq;
+	struct list_head         entry;
+};
+
+struct zimg_fetch {
+	struct tiocb             tiocb;
+	struct zimg_state       *state;
+	uint64_t                 idx;
+	char                    *buf;   /* aligned, around the compressed block */
+	size_t                   skip;  /* where the block starts in buf */
+	size_t                   len;   /* compressed length */
+	struct list_head         waiters;
+	struct list_head         entry;
+};
+
+struct zimg_state {
+	td_driver_t             *driver;
+	char                    *name;
+	int                      fd;
+	size_t                   align;
+
+	uint32_t                 block_size;
+	uint32_t                 spb;         /* sectors per block */
+	uint64_t                 size;
+	uint64_t                 n_blocks;
+	uint64_t                *index;
+
+	z_stream                 zs;
+	int                      zs_init;
+	char                    *scratch;     /* for blocks not cached */
+
+	struct zimg_fetch        fetches[ZIMG_MAX_FETCHES];
+	struct zimg_fetch       *fetches_free[ZIMG_MAX_FETCHES];
+	int                      n_fetches_free;
+	struct list_head         fetching;
+
+	struct zimg_waiter       waiters[ZIMG_MAX_WAITERS];
+	struct zimg_waiter      *waiters_free[ZIMG_MAX_WAITERS];
+	int                      n_waiters_free;
+
+	uint64_t                 cache_budget;
+	uint64_t                 cache_bytes;
+	unsigned int             n_buckets;
+	struct zimg_block      **buckets;
+	struct list_head         lru;
+
+	unsigned long long       reads;
+	unsigned long long       zero;
+	unsigned long long       hits;
+	unsigned long long       misses;
+	unsigned long long       joined;
+	unsigned long long       busy;
+	unsigned long long       evictions;
+	unsigned long long       fetched;     /* compressed bytes */
+	unsigned long long       inflated;
+};
+
+static inline uint64_t
+zimg_block_len(struct zimg_state *s, uint64_t idx)
+{
+	return s->index[idx + 1] - s->index[idx];
+}
+
+static struct zimg_block **
+zimg_cache_bucket(struct zimg_state *s, uint64_t idx)
+{
+	return &s->buckets[(idx * 0x9e3779b97f4a7c15ULL >> 32) % s->n_buckets];
+}
+
+static struct zimg_block *
+zimg_cache_find(struct zimg_state *s, uint64_t idx)
+{
+	struct zimg_block *b;
+
+	if (!s->n_buckets)
+		return NULL;
+
+	for (b = *zimg_cache_bucket(s, idx); b; b = b->hnext)
+		if (b->idx == idx)
+			return b;
+
+	return NULL;
+}
+
+static void
+zimg_cache_evict(struct zimg_state *s, struct zimg_block *b)
+{
+	struct zimg_block **pp;
+
+	for (pp = zimg_cache_bucket(s, b->idx); *pp != b; pp = &(*pp)->hnext)
+		;
+	*pp = b->hnext;
+
+	list_del(&b->lru);
+	s->cache_bytes -= s->block_size;
+	free(b->buf);
+	free(b);
+}
+
+/*
+ * Room for one more block, recycling the least recently used one's
+ * buffer when the budget is spent. NULL with no cache.
+ */
+static struct zimg_block *
+zimg_cache_get(struct zimg_state *s, uint64_t idx)
+{
+	struct zimg_block *b, **pp;
+
+	if (s->cache_budget < s->block_size)
+		return NULL;
+
+	if (s->cache_bytes + s->block_size > s->cache_budget) {
+		b = list_entry(s->lru.prev, struct zimg_block, lru);
+
+		for (pp = zimg_cache_bucket(s, b->idx); *pp != b;
+		     pp = &(*pp)->hnext)
+			;
+		*pp = b->hnext;
+		list_del(&b->lru);
+		s->evictions++;
+	} else {
+		b = calloc(1, sizeof(*b));
+		if (!b)
+			return NULL;
+
+		b->buf = malloc(s->block_size);
+		if (!b->buf) {
+			free(b);
+			return NULL;
+		}
+
+		s->cache_bytes += s->block_size;
+	}
+
+	b->idx   = idx;
+	pp       = zimg_cache_bucket(s, idx);
+	b->hnext = *pp;
+	*pp      = b;
+	list_add(&b->lru, &s->lru);
+
+	return b;
+}
+
+static void
+zimg_cache_init(struct zimg_state *s)
+{
+	const char *val;
+	uint64_t mb = ZIMG_CACHE_MB;
+
+	INIT_LIST_HEAD(&s->lru);
+
+	val = getenv("TAPDISK3_ZIMG_CACHE_MB");
+	if (val)
+		mb = strtoull(val, NULL, 0);
+
+	s->cache_budget = mb << 20;
+	if (s->cache_budget < s->block_size)
+		return;
+
+	s->n_buckets = s->cache_budget / s->block_size;
+	s->buckets   = calloc(s->n_buckets, sizeof(*s->buckets));
+	if (!s->buckets) {
+		s->n_buckets    = 0;
+		s->cache_budget = 0;
+	}
+}
+
+static void
+zimg_cache_free(struct zimg_state *s)
+{
+	struct zimg_block *b, *tmp;
+
+	if (s->buckets)
+		list_for_each_entry_safe(b, tmp, &s->lru, lru)
+			zimg_cache_evict(s, b);
+
+	free(s->buckets);
+	s->buckets   = NULL;
+	s->n_buckets = 0;
+}
+
+static int
+zimg_inflate(struct zimg_state *s, struct zimg_fetch *f, char *out)
+{
+	char *in = f->buf + f->skip;
+	int err;
+
+	if (f->len == s->block_size) {
+		memcpy(out, in, s->block_size);
+		return 0;
+	}
+
+	err = inflateReset(&s->zs);
+	if (err != Z_OK)
+		return -EIO;
+
+	s->zs.next_in   = (Bytef *)in;
+	s->zs.avail_in  = f->len;
+	s->zs.next_out  = (Bytef *)out;
+	s->zs.avail_out = s->block_size;
+
+	err = inflate(&s->zs, Z_FINISH);
+	if (err != Z_STREAM_END || s->zs.avail_out)
+		return -EIO;
+
+	s->inflated += s->block_size;
+	return 0;
+}
+
+static void
+zimg_copy(struct zimg_state *s, td_request_t treq, const char *block)
+{
+	size_t off = (treq.sec % s->spb) << SECTOR_SHIFT;
+
+	memcpy(treq.buf, block + off, treq.secs << SECTOR_SHIFT);
+}
+
+static void
+zimg_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct zimg_fetch *f = arg;
+	struct zimg_state *s = f->state;
+	struct zimg_waiter *w, *tmp;
+	struct zimg_block *b = NULL;
+	char *out = s->scratch;
+
+	if (!err) {
+		b = zimg_cache_get(s, f->idx);
+		if (b)
+			out = b->buf;
+
+		err = zimg_inflate(s, f, out);
+		if (err) {
+			ERR(s, err, "corrupt block %"PRIu64, f->idx);
+			if (b)
+				zimg_cache_evict(s, b);
+		}
+	}
+
+	list_for_each_entry_safe(w, tmp, &f->waiters, entry) {
+		if (!err)
+			zimg_copy(s, w->treq, out);
+		td_complete_request(w->treq, err);
+
+		list_del(&w->entry);
+		s->waiters_free[s->n_waiters_free++] = w;
+	}
+
+	list_del(&f->entry);
+	s->fetches_free[s->n_fetches_free++] = f;
+}
+
+static struct zimg_waiter *
+zimg_get_waiter(struct zimg_state *s, td_request_t treq)
+{
+	struct zimg_waiter *w;
+
+	if (!s->n_waiters_free)
+		return NULL;
+
+	w = s->waiters_free[--s->n_waiters_free];
+	w->treq = treq;
+	INIT_LIST_HEAD(&w->entry);
+
+	return w;
+}
+
+static int
+zimg_fetch(struct zimg_state *s, uint64_t idx, struct zimg_waiter *w)
+{
+	struct zimg_fetch *f;
+	uint64_t start, end;
+
+	list_for_each_entry(f, &s->fetching, entry)
+		if (f->idx == idx) {
+			list_add_tail(&w->entry, &f->waiters);
+			s->joined++;
+			return 0;
+		}
+
+	if (!s->n_fetches_free)
+		return -EBUSY;
+
+	f = s->fetches_free[s->n_fetches_free - 1];
+	if (!f->buf &&
+	    posix_memalign((void **)&f->buf, ZIMG_ALIGN,
+			   s->block_size + 2 * ZIMG_ALIGN))
+		return -ENOMEM;
+
+	s->n_fetches_free--;
+
+	start = s->index[idx] & ~((uint64_t)s->align - 1);
+	end   = s->index[idx + 1] + s->align - 1;
+	end  &= ~((uint64_t)s->align - 1);
+
+	f->state = s;
+	f->idx   = idx;
+	f->skip  = s->index[idx] - start;
+	f->len   = zimg_block_len(s, idx);
+	INIT_LIST_HEAD(&f->waiters);
+	list_add_tail(&w->entry, &f->waiters);
+	list_add_tail(&f->entry, &s->fetching);
+
+	s->misses++;
+	s->fetched += f->len;
+
+	td_prep_read(&f->tiocb, s->fd, f->buf, end - start, start,
+		     zimg_complete, f);
+	td_queue_tiocb(s->driver, &f->tiocb);
+
+	return 0;
+}
+
+static void
+zimg_read_block(struct zimg_state *s, td_request_t treq)
+{
+	uint64_t idx = treq.sec / s->spb;
+	struct zimg_waiter *w;
+	struct zimg_block *b;
+	int err;
+
+	if (!zimg_block_len(s, idx)) {
+		s->zero++;
+		memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	b = zimg_cache_find(s, idx);
+	if (b) {
+		s->hits++;
+		list_move(&b->lru, &s->lru);
+		zimg_copy(s, treq, b->buf);
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	w = zimg_get_waiter(s, treq);
+	if (!w) {
+		err = -EBUSY;
+		goto fail;
+	}
+
+	err = zimg_fetch(s, idx, w);
+	if (err) {
+		s->waiters_free[s->n_waiters_free++] = w;
+		goto fail;
+	}
+
+	return;
+
+fail:
+	s->busy++;
+	td_complete_request(treq, err);
+}
+
+static void
+zimg_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	struct zimg_state *s = driver->data;
+	td_request_t clone;
+
+	s->reads++;
+
+	while (treq.secs) {
+		clone      = treq;
+		clone.secs = MIN(treq.secs, s->spb - (treq.sec % s->spb));
+
+		zimg_read_block(s, clone);
+
+		treq.sec  += clone.secs;
+		treq.buf  += clone.secs << SECTOR_SHIFT;
+		treq.secs -= clone.secs;
+	}
+}
+
+static void
+zimg_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	td_complete_request(treq, -EPERM);
+}
+
+static int
+zimg_sector_present(td_driver_t *driver, td_sector_t sec, td_sector_t *secs)
+{
+	struct zimg_state *s = driver->data;
+
+	*secs = s->spb - (sec % s->spb);
+
+	return !!zimg_block_len(s, sec / s->spb);
+}
+
+static int
+zimg_read_index(struct zimg_state *s)
+{
+	struct zimg_header *h;
+	uint64_t i, off, bytes;
+	ssize_t n;
+	void *buf;
+	int err;
+
+	if (posix_memalign(&buf, ZIMG_ALIGN, ZIMG_HEADER_SIZE))
+		return -ENOMEM;
+
+	n = pread(s->fd, buf, ZIMG_HEADER_SIZE, 0);
+	if (n != ZIMG_HEADER_SIZE) {
+		err = n < 0 ? -errno : -EINVAL;
+		goto out;
+	}
+
+	h   = buf;
+	err = -EINVAL;
+
+	if (memcmp(h->magic, ZIMG_MAGIC, sizeof(h->magic)) ||
+	    le32toh(h->version) != ZIMG_VERSION ||
+	    le32toh(h->compression) != ZIMG_DEFLATE)
+		goto out;
+
+	s->block_size = le32toh(h->block_size);
+	s->size       = le64toh(h->size);
+	s->n_blocks   = le64toh(h->n_blocks);
+	off           = le64toh(h->index_offset);
+
+	if (s->block_size < ZIMG_BLOCK_MIN || s->block_size > ZIMG_BLOCK_MAX ||
+	    (s->block_size & (s->block_size - 1)) ||
+	    s->size & (SECTOR_SIZE - 1) ||
+	    s->n_blocks != (s->size + s->block_size - 1) / s->block_size)
+		goto out;
+
+	s->spb = s->block_size >> SECTOR_SHIFT;
+
+	free(buf);
+	buf = NULL;
+
+	bytes = (s->n_blocks + 1) * sizeof(uint64_t);
+	if (posix_memalign(&buf, ZIMG_ALIGN, bytes + 2 * ZIMG_ALIGN))
+		return -ENOMEM;
+
+	/* the index sits right after the last block, anywhere */
+	i = off & ~((uint64_t)s->align - 1);
+	n = pread(s->fd, buf, (off + bytes - i + s->align - 1) &
+		  ~((uint64_t)s->align - 1), i);
+	if (n < (ssize_t)(off + bytes - i)) {
+		err = n < 0 ? -errno : -EINVAL;
+		goto out;
+	}
+
+	s->index = malloc(bytes);
+	if (!s->index) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	memcpy(s->index, (char *)buf + (off - i), bytes);
+
+	for (i = 0; i <= s->n_blocks; i++) {
+		s->index[i] = le64toh(s->index[i]);
+
+		if (s->index[i] < ZIMG_HEADER_SIZE || s->index[i] > off ||
+		    (i && (s->index[i] < s->index[i - 1] ||
+			   zimg_block_len(s, i - 1) > s->block_size))) {
+			DBG(TLOG_WARN, "%s: bad index entry %"PRIu64"\n",
+			    s->name, i);
+			goto out;
+		}
+	}
+
+	err = 0;
+
+out:
+	free(buf);
+	return err;
+}
+
+static int
+zimg_close(td_driver_t *driver)
+{
+	struct zimg_state *s = driver->data;
+	int i;
+
+	zimg_cache_free(s);
+
+	for (i = 0; i < ZIMG_MAX_FETCHES; i++)
+		free(s->fetches[i].buf);
+
+	if (s->zs_init)
+		inflateEnd(&s->zs);
+
+	free(s->scratch);
+	free(s->index);
+	free(s->name);
+
+	if (s->fd != -1)
+		close(s->fd);
+
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+
+	return 0;
+}
+
+static int
+zimg_open(td_driver_t *driver, const char *name,
+	  struct td_vbd_encryption *encryption, td_flag_t flags)
+{
+	struct zimg_state *s = driver->data;
+	struct stat st;
+	int i, err, o_flags;
+
+	memset(s, 0, sizeof(*s));
+	s->driver = driver;
+	s->fd     = -1;
+	INIT_LIST_HEAD(&s->fetching);
+	INIT_LIST_HEAD(&s->lru);
+
+	if (!(flags & TD_OPEN_RDONLY)) {
+		DBG(TLOG_WARN, "%s: zimg images are read-only\n", name);
+		return -EROFS;
+	}
+
+	s->name = strdup(name);
+	if (!s->name) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	/*
+	 * O_DIRECT reads of whole aligned extents, which the file must be
+	 * padded for; older or copied files are read through the page
+	 * cache instead.
+	 */
+	o_flags = O_RDONLY | O_LARGEFILE;
+	if (!(flags & TD_OPEN_NO_O_DIRECT))
+		o_flags |= O_DIRECT;
+
+	s->fd = open(name, o_flags);
+	if (s->fd == -1 && (o_flags & O_DIRECT) && errno == EINVAL) {
+		o_flags &= ~O_DIRECT;
+		s->fd = open(name, o_flags);
+	}
+	if (s->fd == -1) {
+		err = -errno;
+		DBG(TLOG_WARN, "failed to open %s: %d\n", name, err);
+		goto fail;
+	}
+
+	if (fstat(s->fd, &st)) {
+		err = -errno;
+		goto fail;
+	}
+
+	if ((o_flags & O_DIRECT) && (st.st_size & (ZIMG_ALIGN - 1))) {
+		close(s->fd);
+		o_flags &= ~O_DIRECT;
+		s->fd = open(name, o_flags);
+		if (s->fd == -1) {
+			err = -errno;
+			goto fail;
+		}
+	}
+
+	s->align = o_flags & O_DIRECT ? ZIMG_ALIGN : 1;
+
+	err = zimg_read_index(s);
+	if (err) {
+		DBG(TLOG_WARN, "%s: not a usable zimg image: %d\n", name, err);
+		goto fail;
+	}
+
+	if (inflateInit(&s->zs) != Z_OK) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	s->zs_init = 1;
+
+	s->scratch = malloc(s->block_size);
+	if (!s->scratch) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	zimg_cache_init(s);
+
+	for (i = 0; i < ZIMG_MAX_FETCHES; i++)
+		s->fetches_free[i] = &s->fetches[i];
+	s->n_fetches_free = ZIMG_MAX_FETCHES;
+
+	for (i = 0; i < ZIMG_MAX_WAITERS; i++)
+		s->waiters_free[i] = &s->waiters[i];
+	s->n_waiters_free = ZIMG_MAX_WAITERS;
+
+	driver->info.size        = s->size >> SECTOR_SHIFT;
+	driver->info.sector_size = flags & TD_OPEN_4K ?
+		TD_4K_SECTOR_SIZE : SECTOR_SIZE;
+	driver->info.info        = 0;
+
+	DBG(TLOG_INFO, "%s: zimg, %"PRIu64" bytes in %"PRIu64" blocks of %u, "
+	    "%"PRIu64" stored, %"PRIu64" MiB cache\n", name, s->size,
+	    s->n_blocks, s->block_size,
+	    s->index[s->n_blocks] - s->index[0], s->cache_budget >> 20);
+
+	return 0;
+
+fail:
+	zimg_close(driver);
+	return err;
+}
+
+static int
+zimg_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	return TD_NO_PARENT;
+}
+
+static int
+zimg_validate_parent(td_driver_t *child_driver,
+		     td_driver_t *parent_driver, td_flag_t flags)
+{
+	return -EINVAL;
+}
+
+static void
+zimg_debug(td_driver_t *driver)
+{
+	struct zimg_state *s = driver->data;
+	struct zimg_fetch *f;
+
+	DBG(TLOG_WARN, "%s: reads: %llu, hits: %llu, misses: %llu, "
+	    "busy: %llu, free fetches: %d, free waiters: %d\n", s->name,
+	    s->reads, s->hits, s->misses, s->busy, s->n_fetches_free,
+	    s->n_waiters_free);
+
+	list_for_each_entry(f, &s->fetching, entry)
+		DBG(TLOG_WARN, "fetching block %"PRIu64", %zu bytes\n",
+		    f->idx, f->len);
+}
+
+static void
+zimg_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct zimg_state *s = driver->data;
+
+	tapdisk_stats_field(st, "block_size", "u", s->block_size);
+	tapdisk_stats_field(st, "stored", "llu",
+			    (unsigned long long)(s->index[s->n_blocks] -
+						 s->index[0]));
+	tapdisk_stats_field(st, "zero", "llu", s->zero);
+	tapdisk_stats_field(st, "fetched", "llu", s->fetched);
+	tapdisk_stats_field(st, "inflated", "llu", s->inflated);
+	tapdisk_stats_field(st, "busy", "llu", s->busy);
+	tapdisk_stats_field(st, "cache", "{");
+	tapdisk_stats_field(st, "budget", "llu",
+			    (unsigned long long)s->cache_budget);
+	tapdisk_stats_field(st, "bytes", "llu",
+			    (unsigned long long)s->cache_bytes);
+	tapdisk_stats_field(st, "hits", "llu", s->hits);
+	tapdisk_stats_field(st, "misses", "llu", s->misses);
+	tapdisk_stats_field(st, "joined", "llu", s->joined);
+	tapdisk_stats_field(st, "evictions", "llu", s->evictions);
+	tapdisk_stats_leave(st, '}');
+}
+
+struct tap_disk tapdisk_zimg = {
+	.disk_type          = "tapdisk_zimg",
+	.flags              = 0,
+	.private_data_size  = sizeof(struct zimg_state),
+	.td_open            = zimg_open,
+	.td_close           = zimg_close,
+	.td_queue_read      = zimg_queue_read,
+	.td_queue_write     = zimg_queue_write,
+	.td_get_parent_id   = zimg_get_parent_id,
+	.td_validate_parent = zimg_validate_parent,
+	.td_debug           = zimg_debug,
+	.td_stats           = zimg_stats,
+	.td_sector_present  = zimg_sector_present,
+};
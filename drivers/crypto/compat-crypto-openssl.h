@@ -5,12 +5,24 @@
 #ifndef COMPAT_CRYPTO_OPENSSL_H
 #define COMPAT_CRYPTO_OPENSSL_H
 
+#include <stdint.h>
 #include <openssl/evp.h>
 
 struct crypto_blkcipher
 {
 	EVP_CIPHER_CTX de_ctx;
 	EVP_CIPHER_CTX en_ctx;
+
+	/*
+	 * AES-ECB on the two halves of the XTS key, for runs of sectors: the
+	 * second half encrypts the sector tweaks, the first the data.
+	 */
+	EVP_CIPHER_CTX tweak_ctx;
+	EVP_CIPHER_CTX ecb_en_ctx;
+	EVP_CIPHER_CTX ecb_de_ctx;
+
+	/* XTS_AES_BATCH bytes of tweaks, one per AES block */
+	uint8_t *tweaks;
 };
 
 #endif
@@ -34,10 +34,14 @@
 #include <err.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "compat-crypto-openssl.h"
 #include "xts_aes.h"
 
+/* at most this many sectors per pass, for the tweaks on the stack */
+#define XTS_AES_BATCH_SECTORS (XTS_AES_BATCH / 512)
+
 struct crypto_blkcipher * xts_aes_setup(void)
 {
 	struct crypto_blkcipher *ret;
@@ -45,20 +49,26 @@ struct crypto_blkcipher * xts_aes_setup(void)
 	ret = calloc(1, sizeof(struct crypto_blkcipher));
 	if (!ret)
 		return NULL;
+	ret->tweaks = malloc(XTS_AES_BATCH);
+	if (!ret->tweaks) {
+		free(ret);
+		return NULL;
+	}
 	return ret;
 }
 
 int xts_aes_setkey(struct crypto_blkcipher *cipher, const uint8_t *key, unsigned int keysize)
 {
-	const EVP_CIPHER *type;
+	const EVP_CIPHER *type, *ecb;
+	unsigned int half = keysize / 2;
 
 	switch (keysize) {
-	case 64: type = EVP_aes_256_xts(); break;
-	case 32: type = EVP_aes_128_xts(); break;
+	case 64: type = EVP_aes_256_xts(); ecb = EVP_aes_256_ecb(); break;
+	case 32: type = EVP_aes_128_xts(); ecb = EVP_aes_128_ecb(); break;
 	default: return -21; break;
 	}
 
-	if (!type)
+	if (!type || !ecb)
 		return -20;
 
 	EVP_CIPHER_CTX_init(&cipher->en_ctx);
@@ -78,5 +88,163 @@ int xts_aes_setkey(struct crypto_blkcipher *cipher, const uint8_t *key, unsigned
 		return -5;
 	if (!EVP_CipherInit_ex(&cipher->de_ctx, NULL, NULL, key, NULL, 0))
 		return -6;
+
+	EVP_CIPHER_CTX_init(&cipher->tweak_ctx);
+	EVP_CIPHER_CTX_init(&cipher->ecb_en_ctx);
+	EVP_CIPHER_CTX_init(&cipher->ecb_de_ctx);
+
+	if (!EVP_CipherInit_ex(&cipher->tweak_ctx, ecb, NULL, key + half, NULL, 1))
+		return -7;
+	if (!EVP_CipherInit_ex(&cipher->ecb_en_ctx, ecb, NULL, key, NULL, 1))
+		return -8;
+	if (!EVP_CipherInit_ex(&cipher->ecb_de_ctx, ecb, NULL, key, NULL, 0))
+		return -9;
+	EVP_CIPHER_CTX_set_padding(&cipher->tweak_ctx, 0);
+	EVP_CIPHER_CTX_set_padding(&cipher->ecb_en_ctx, 0);
+	EVP_CIPHER_CTX_set_padding(&cipher->ecb_de_ctx, 0);
 	return 0;
 }
+
+/*
+ * EVP contexts carry per-operation state, so each thread encrypting
+ * concurrently needs its own copy of the keyed cipher.
+ */
+struct crypto_blkcipher * xts_aes_clone(struct crypto_blkcipher *cipher)
+{
+	struct crypto_blkcipher *ret;
+
+	ret = xts_aes_setup();
+	if (!ret)
+		return NULL;
+
+	EVP_CIPHER_CTX_init(&ret->en_ctx);
+	EVP_CIPHER_CTX_init(&ret->de_ctx);
+	EVP_CIPHER_CTX_init(&ret->tweak_ctx);
+	EVP_CIPHER_CTX_init(&ret->ecb_en_ctx);
+	EVP_CIPHER_CTX_init(&ret->ecb_de_ctx);
+
+	if (!EVP_CIPHER_CTX_copy(&ret->en_ctx, &cipher->en_ctx) ||
+	    !EVP_CIPHER_CTX_copy(&ret->de_ctx, &cipher->de_ctx) ||
+	    !EVP_CIPHER_CTX_copy(&ret->tweak_ctx, &cipher->tweak_ctx) ||
+	    !EVP_CIPHER_CTX_copy(&ret->ecb_en_ctx, &cipher->ecb_en_ctx) ||
+	    !EVP_CIPHER_CTX_copy(&ret->ecb_de_ctx, &cipher->ecb_de_ctx)) {
+		xts_aes_free(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+void xts_aes_free(struct crypto_blkcipher *cipher)
+{
+	EVP_CIPHER_CTX_cleanup(&cipher->en_ctx);
+	EVP_CIPHER_CTX_cleanup(&cipher->de_ctx);
+	EVP_CIPHER_CTX_cleanup(&cipher->tweak_ctx);
+	EVP_CIPHER_CTX_cleanup(&cipher->ecb_en_ctx);
+	EVP_CIPHER_CTX_cleanup(&cipher->ecb_de_ctx);
+	free(cipher->tweaks);
+	free(cipher);
+}
+
+static void
+xts_aes_xor(uint8_t *dst, const uint8_t *src, const uint64_t *tweaks,
+	    unsigned int nbytes)
+{
+	uint64_t a[2];
+	unsigned int i;
+
+	for (i = 0; i < nbytes; i += 16, tweaks += 2) {
+		memcpy(a, src + i, 16);
+		a[0] ^= tweaks[0];
+		a[1] ^= tweaks[1];
+		memcpy(dst + i, a, 16);
+	}
+}
+
+/*
+ * XTS spelled out over ECB: C = E1(P ^ T) ^ T, where the tweak T of the
+ * first block of a sector is E2(sector number) and each next block's is
+ * the previous one times alpha. Encrypting all tweaks and all data of a
+ * pass with one call each lets AES-NI pipeline across sectors, where the
+ * XTS cipher has to be re-initialised for every sector.
+ */
+static int
+xts_aes_plain_crypt_sectors(struct crypto_blkcipher *xts_tfm,
+			    EVP_CIPHER_CTX *ctx, sector_t sector,
+			    uint8_t *dst_buf, uint8_t *src_buf,
+			    unsigned int nr_sectors, unsigned int sector_size)
+{
+	uint64_t t[XTS_AES_BATCH_SECTORS][2], carry, *tw;
+	unsigned int per_pass, n, i, off, bytes;
+	int dstlen;
+
+	if (!sector_size || sector_size % 16 || sector_size > XTS_AES_BATCH)
+		return -3;
+
+	per_pass = XTS_AES_BATCH / sector_size;
+	if (per_pass > XTS_AES_BATCH_SECTORS)
+		per_pass = XTS_AES_BATCH_SECTORS;
+
+	while (nr_sectors) {
+		n = nr_sectors < per_pass ? nr_sectors : per_pass;
+		bytes = n * sector_size;
+
+		/* the tweaks of the first blocks of the sectors */
+		memset(t, 0, n * sizeof(t[0]));
+		for (i = 0; i < n; i++)
+			t[i][0] = (sector + i) & 0xffffffff; /* LITTLE ENDIAN */
+
+		if (!EVP_EncryptUpdate(&xts_tfm->tweak_ctx, (uint8_t *)t, &dstlen,
+				       (uint8_t *)t, n * sizeof(t[0])))
+			return -1;
+
+		/*
+		 * Those of the blocks after them, sectors in the inner loop
+		 * as they do not depend on each other.
+		 */
+		for (off = 0; off < sector_size; off += 16) {
+			tw = (uint64_t *)(xts_tfm->tweaks + off);
+			for (i = 0; i < n; i++, tw += sector_size / 8) {
+				tw[0] = t[i][0];
+				tw[1] = t[i][1];
+				carry = t[i][1] >> 63;
+				t[i][1] = (t[i][1] << 1) | (t[i][0] >> 63);
+				t[i][0] = (t[i][0] << 1) ^ (0x87 & -carry);
+			}
+		}
+
+		xts_aes_xor(dst_buf, src_buf, (uint64_t *)xts_tfm->tweaks, bytes);
+		if (!EVP_CipherUpdate(ctx, dst_buf, &dstlen, dst_buf, bytes))
+			return -2;
+		xts_aes_xor(dst_buf, dst_buf, (uint64_t *)xts_tfm->tweaks, bytes);
+
+		sector  += n;
+		dst_buf += bytes;
+		src_buf += bytes;
+		nr_sectors -= n;
+	}
+
+	return 0;
+}
+
+int
+xts_aes_plain_encrypt_sectors(struct crypto_blkcipher *xts_tfm,
+			      sector_t sector,
+			      uint8_t *dst_buf, uint8_t *src_buf,
+			      unsigned int nr_sectors, unsigned int sector_size)
+{
+	return xts_aes_plain_crypt_sectors(xts_tfm, &xts_tfm->ecb_en_ctx,
+					   sector, dst_buf, src_buf,
+					   nr_sectors, sector_size);
+}
+
+int
+xts_aes_plain_decrypt_sectors(struct crypto_blkcipher *xts_tfm,
+			      sector_t sector,
+			      uint8_t *dst_buf, uint8_t *src_buf,
+			      unsigned int nr_sectors, unsigned int sector_size)
+{
+	return xts_aes_plain_crypt_sectors(xts_tfm, &xts_tfm->ecb_de_ctx,
+					   sector, dst_buf, src_buf,
+					   nr_sectors, sector_size);
+}
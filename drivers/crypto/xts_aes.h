@@ -35,6 +35,10 @@ extern struct crypto_blkcipher *xts_aes_setup(void);
 
 int xts_aes_setkey(struct crypto_blkcipher *cipher, const uint8_t *key, unsigned int keysize);
 
+struct crypto_blkcipher *xts_aes_clone(struct crypto_blkcipher *cipher);
+
+void xts_aes_free(struct crypto_blkcipher *cipher);
+
 typedef uint64_t sector_t;
 
 static inline void
@@ -75,3 +79,28 @@ xts_aes_plain_decrypt(struct crypto_blkcipher *xts_tfm, sector_t sector,
 	/* no need to finalize with XTS when multiple of blocksize */
 	return 0;
 }
+
+/*
+ * Bytes of a run of sectors processed per pass, few enough for the data and
+ * its tweaks to stay in cache between the passes over them.
+ */
+#define XTS_AES_BATCH (16 << 10)
+
+/*
+ * Runs of sectors at once. Each sector is still its own XTS data unit with
+ * its own tweak, as the on-disk format has it, but rather than going
+ * through the XTS cipher once per sector, the tweaks of up to
+ * XTS_AES_BATCH bytes of sectors are encrypted in one ECB call and the data
+ * in another. @sector_size must be a multiple of 16, up to XTS_AES_BATCH.
+ */
+int xts_aes_plain_encrypt_sectors(struct crypto_blkcipher *xts_tfm,
+				  sector_t sector,
+				  uint8_t *dst_buf, uint8_t *src_buf,
+				  unsigned int nr_sectors,
+				  unsigned int sector_size);
+
+int xts_aes_plain_decrypt_sectors(struct crypto_blkcipher *xts_tfm,
+				  sector_t sector,
+				  uint8_t *dst_buf, uint8_t *src_buf,
+				  unsigned int nr_sectors,
+				  unsigned int sector_size);
@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Feeds batches of iocbs through io_sort(), io_merge() and io_split(),
+ * as tapdisk-queue does at submit and completion, and reports how well
+ * they merged and what that cost:
+ *
+ *   io-optimize-bench -i 352 -n 10000 -r 1
+ *   io-optimize-bench -f trace.bin -w 32 -l 524288
+ *
+ * Batches are synthetic, or replayed from a tap-ctl trace -f file,
+ * where the segments submitted to each image (TAPDISK_TRACE_SUBMIT)
+ * are cut into batches of -i iocbs, one fd per chain level. Buffers
+ * follow each other in batch order, so sector-contiguous iocbs merge
+ * in place, unless -c scatters them and forces vectored merges. They
+ * are never dereferenced, and so never allocated.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "tapdisk.h"
+#include "tapdisk-message.h"
+#include "io-optimize.h"
+
+#define BUF_BASE                         (1ULL << 40)
+#define BUF_GAP                          4096
+
+struct bench {
+	int                              num_iocbs;
+	int                              window;
+	int                              scatter;
+
+	struct opioctx                   ctx;
+	struct iocb                     *iocb_list;
+	struct iocb                    **iocbs;
+	struct io_event                 *events;
+	char                            *seen;
+	uint64_t                         buf;
+
+	uint64_t                         batches;
+	uint64_t                         in;
+	uint64_t                         out;
+	uint64_t                         vectored;
+	uint64_t                         bytes;
+	uint64_t                         merge_ns;
+	uint64_t                         split_ns;
+};
+
+static void
+usage(const char *app, int err)
+{
+	fprintf(err ? stderr : stdout,
+		"usage: %s [-f trace] [-n runs] [-i iocbs] [-s secs] "
+		"[-r seed] [-w window] [-l max_bytes] [-c] [-h]\n", app);
+	exit(err);
+}
+
+static inline uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+bench_reset_batch(struct bench *b)
+{
+	memset(b->iocb_list, 0, b->num_iocbs * sizeof(struct iocb));
+	b->buf = BUF_BASE;
+}
+
+static void
+bench_prep_iocb(struct bench *b, int idx, int fd, short opcode,
+		long long offset, unsigned long nbytes, int sparse)
+{
+	struct iocb *io = &b->iocb_list[idx];
+
+	if (b->scatter || sparse)
+		b->buf += BUF_GAP;
+
+	io->aio_fildes     = fd;
+	io->aio_lio_opcode = opcode;
+	io->u.c.offset     = offset;
+	io->u.c.nbytes     = nbytes;
+	io->u.c.buf        = (void *)(uintptr_t)b->buf;
+	io->data           = (void *)(uintptr_t)idx;
+
+	b->buf            += nbytes;
+	b->iocbs[idx]      = io;
+}
+
+static unsigned long
+merged_nbytes(struct iocb *io)
+{
+	struct iovec *vec;
+	unsigned long nbytes;
+	int i;
+
+	if (io->aio_lio_opcode != IO_CMD_PREADV &&
+	    io->aio_lio_opcode != IO_CMD_PWRITEV)
+		return io->u.c.nbytes;
+
+	vec    = io->u.c.buf;
+	nbytes = 0;
+	for (i = 0; i < io->u.c.nbytes; i++)
+		nbytes += vec[i].iov_len;
+
+	return nbytes;
+}
+
+/*
+ * Merges a batch, completes every iocb in full and splits the events
+ * again, checking each original iocb comes back once, as it went in.
+ */
+static int
+bench_run_batch(struct bench *b, int num)
+{
+	struct iocb *io;
+	uint64_t t0, t1, t2;
+	int i, idx, merged, split;
+
+	if (!num)
+		return 0;
+
+	t0 = now_ns();
+	io_sort(b->iocbs, num, b->window);
+	merged = io_merge(&b->ctx, b->iocbs, num);
+	t1 = now_ns();
+
+	for (i = 0; i < merged; i++) {
+		io = b->iocbs[i];
+		b->events[i].obj = io;
+		b->events[i].res = merged_nbytes(io);
+		b->bytes += b->events[i].res;
+		if (io->aio_lio_opcode == IO_CMD_PREADV ||
+		    io->aio_lio_opcode == IO_CMD_PWRITEV)
+			b->vectored++;
+	}
+
+	t2 = now_ns();
+	split = io_split(&b->ctx, b->events, merged);
+	b->split_ns += now_ns() - t2;
+	b->merge_ns += t1 - t0;
+
+	if (split != num) {
+		fprintf(stderr, "split %d iocbs of %d\n", split, num);
+		return -EINVAL;
+	}
+
+	memset(b->seen, 0, num);
+	for (i = 0; i < split; i++) {
+		io  = b->events[i].obj;
+		idx = (int)(uintptr_t)io->data;
+		if (io != &b->iocb_list[idx] || b->seen[idx] ||
+		    b->events[i].res != io->u.c.nbytes) {
+			fprintf(stderr, "corrupt event %d, iocb %d\n", i, idx);
+			return -EINVAL;
+		}
+		b->seen[idx] = 1;
+	}
+
+	b->batches++;
+	b->in  += num;
+	b->out += merged;
+
+	return 0;
+}
+
+/*
+ * Runs of 1-10 contiguous iocbs, 20% of them with buffers apart, as
+ * the io-optimize test used to generate.
+ */
+static int
+bench_random_batch(struct bench *b, uint64_t num_secs)
+{
+	int i, j, segs, sparse;
+	long long offset;
+	unsigned long nbytes;
+	short opcode;
+
+	bench_reset_batch(b);
+
+	for (i = 0; i < b->num_iocbs; i += segs) {
+		opcode = random() % 10 < 5 ? IO_CMD_PREAD : IO_CMD_PWRITE;
+		offset = (random() % num_secs) << SECTOR_SHIFT;
+
+		if (random() % 10 < 4) {
+			segs   = 1;
+			nbytes = ((random() % 7) + 1) << SECTOR_SHIFT;
+		} else {
+			segs   = (random() % 10) + 1;
+			nbytes = 4096;
+		}
+
+		if (i + segs > b->num_iocbs)
+			segs = b->num_iocbs - i;
+
+		sparse = random() % 10 < 2;
+
+		for (j = 0; j < segs; j++) {
+			bench_prep_iocb(b, i + j, 0, opcode, offset, nbytes,
+					sparse && j);
+			offset += nbytes;
+		}
+	}
+
+	return bench_run_batch(b, b->num_iocbs);
+}
+
+static int
+bench_trace_opcode(const struct tapdisk_trace_rec *rec)
+{
+	if (rec->event != TAPDISK_TRACE_SUBMIT)
+		return -1;
+
+	switch (rec->op) {
+	case TD_OP_READ:
+		return IO_CMD_PREAD;
+	case TD_OP_WRITE:
+		return IO_CMD_PWRITE;
+	case TD_OP_FLUSH:
+		return IO_CMD_FSYNC;
+	}
+
+	return -1;
+}
+
+static int
+bench_replay_trace(struct bench *b, FILE *f)
+{
+	struct tapdisk_trace_hdr hdr;
+	struct tapdisk_trace_rec rec;
+	char pad[256];
+	uint32_t i;
+	int n, opcode, err;
+
+	n = 0;
+	bench_reset_batch(b);
+
+	while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+		if (hdr.version != TAPDISK_TRACE_VERSION ||
+		    hdr.rec_size < sizeof(rec) ||
+		    hdr.rec_size - sizeof(rec) > sizeof(pad))
+			return -EPROTO;
+
+		for (i = 0; i < hdr.count; i++) {
+			if (fread(&rec, sizeof(rec), 1, f) != 1 ||
+			    (hdr.rec_size > sizeof(rec) &&
+			     fread(pad, hdr.rec_size - sizeof(rec), 1, f) != 1))
+				return -EPROTO;
+
+			opcode = bench_trace_opcode(&rec);
+			if (opcode < 0)
+				continue;
+
+			bench_prep_iocb(b, n++, rec.level, opcode,
+					rec.sec << SECTOR_SHIFT,
+					opcode == IO_CMD_FSYNC ? 0 :
+					rec.secs << SECTOR_SHIFT, 0);
+
+			if (n == b->num_iocbs) {
+				err = bench_run_batch(b, n);
+				if (err)
+					return err;
+				n = 0;
+				bench_reset_batch(b);
+			}
+		}
+	}
+
+	if (ferror(f))
+		return -errno;
+
+	return bench_run_batch(b, n);
+}
+
+static void
+bench_report(struct bench *b)
+{
+	if (!b->in) {
+		printf("no iocbs\n");
+		return;
+	}
+
+	printf("batches:        %"PRIu64"\n", b->batches);
+	printf("iocbs:          %"PRIu64" in, %"PRIu64" out, "
+	       "%"PRIu64" vectored\n", b->in, b->out, b->vectored);
+	printf("merge ratio:    %.3f\n", (double)b->in / b->out);
+	printf("merged size:    %.1f KiB\n", (double)b->bytes / b->out / 1024);
+	printf("ns per iocb:    %.1f merge, %.1f split, %.1f total\n",
+	       (double)b->merge_ns / b->in, (double)b->split_ns / b->in,
+	       (double)(b->merge_ns + b->split_ns) / b->in);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench bench;
+	uint64_t num_secs;
+	unsigned long max_bytes;
+	const char *trace;
+	int i, c, err, num_runs, seed;
+	FILE *f;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.num_iocbs = TAPDISK_DATA_REQUESTS;
+	num_runs  = 1;
+	num_secs  = (4ULL << 30) >> SECTOR_SHIFT;
+	seed      = time(NULL);
+	max_bytes = 0;
+	trace     = NULL;
+
+	while ((c = getopt(argc, argv, "f:n:i:s:r:w:l:ch")) != -1) {
+		switch (c) {
+		case 'f':
+			trace = optarg;
+			break;
+		case 'n':
+			num_runs = atoi(optarg);
+			break;
+		case 'i':
+			bench.num_iocbs = atoi(optarg);
+			break;
+		case 's':
+			num_secs = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			seed = atoi(optarg);
+			break;
+		case 'w':
+			bench.window = atoi(optarg);
+			break;
+		case 'l':
+			max_bytes = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			bench.scatter = 1;
+			break;
+		case 'h':
+			usage(argv[0], 0);
+		default:
+			usage(argv[0], EINVAL);
+		}
+	}
+
+	if (bench.num_iocbs <= 0 || num_runs <= 0 || !num_secs)
+		usage(argv[0], EINVAL);
+
+	bench.iocb_list = calloc(bench.num_iocbs, sizeof(struct iocb));
+	bench.iocbs     = calloc(bench.num_iocbs, sizeof(struct iocb *));
+	bench.events    = calloc(bench.num_iocbs, sizeof(struct io_event));
+	bench.seen      = calloc(bench.num_iocbs, 1);
+
+	if (!bench.iocb_list || !bench.iocbs || !bench.events || !bench.seen ||
+	    opio_init(&bench.ctx, bench.num_iocbs)) {
+		fprintf(stderr, "initialization failed\n");
+		return ENOMEM;
+	}
+
+	if (max_bytes)
+		for (i = 0; i <= TAPDISK_TRACE_NO_LEVEL; i++) {
+			err = opio_set_merge_limit(&bench.ctx, i, max_bytes);
+			if (err)
+				goto out;
+		}
+
+	if (trace) {
+		f = fopen(trace, "r");
+		if (!f) {
+			err = -errno;
+			fprintf(stderr, "%s: %s\n", trace, strerror(errno));
+			goto out;
+		}
+
+		for (i = 0; i < num_runs; i++) {
+			rewind(f);
+			err = bench_replay_trace(&bench, f);
+			if (err) {
+				fprintf(stderr, "%s: %s\n",
+					trace, strerror(-err));
+				break;
+			}
+		}
+
+		fclose(f);
+	} else {
+		printf("%d runs of %d iocbs on %"PRIu64" sectors, seed %d\n",
+		       num_runs, bench.num_iocbs, num_secs, seed);
+
+		srandom(seed);
+
+		for (err = 0, i = 0; !err && i < num_runs; i++)
+			err = bench_random_batch(&bench, num_secs);
+	}
+
+	if (!err)
+		bench_report(&bench);
+
+out:
+	opio_free(&bench.ctx);
+	free(bench.seen);
+	free(bench.events);
+	free(bench.iocbs);
+	free(bench.iocb_list);
+
+	return err ? -err : 0;
+}
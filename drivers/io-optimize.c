@@ -42,10 +42,8 @@
 #include "io-optimize.h"
 #include "tapdisk-log.h"
 
-#if (!defined(TEST) && defined(DEBUG))
+#if defined(DEBUG)
 #define DBG(ctx, f, a...) tlog_write(TLOG_DBG, f, ##a)
-#elif defined(TEST)
-#define DBG(ctx, f, a...) printf(f, ##a)
 #else
 #define DBG(ctx, f, a...) ((void)0)
 #endif
@@ -59,11 +57,56 @@ opio_free(struct opioctx *ctx)
 	free(ctx->free_opios);
 	ctx->free_opios = NULL;
 
+	free(ctx->iovs);
+	ctx->iovs = NULL;
+
+	free(ctx->free_iovs);
+	ctx->free_iovs = NULL;
+
 	free(ctx->iocb_queue);
 	ctx->iocb_queue = NULL;
 
 	free(ctx->event_queue);
 	ctx->event_queue = NULL;
+
+	free(ctx->limits);
+	ctx->limits     = NULL;
+	ctx->num_limits = 0;
+}
+
+/*
+ * A zero max_bytes drops the limit. Few fds are limited, one per
+ * image on the queue, so a flat array does.
+ */
+int
+opio_set_merge_limit(struct opioctx *ctx, int fd, unsigned long max_bytes)
+{
+	struct opio_limit *limits;
+	int i;
+
+	for (i = 0; i < ctx->num_limits; i++)
+		if (ctx->limits[i].fd == fd)
+			break;
+
+	if (!max_bytes) {
+		if (i < ctx->num_limits)
+			ctx->limits[i] = ctx->limits[--ctx->num_limits];
+		return 0;
+	}
+
+	if (i == ctx->num_limits) {
+		limits = realloc(ctx->limits, (i + 1) * sizeof(*limits));
+		if (!limits)
+			return -ENOMEM;
+
+		ctx->limits = limits;
+		ctx->num_limits++;
+	}
+
+	ctx->limits[i].fd        = fd;
+	ctx->limits[i].max_bytes = max_bytes;
+
+	return 0;
 }
 
 int
@@ -80,13 +123,23 @@ opio_init(struct opioctx *ctx, int num_iocbs)
 	ctx->iocb_queue    = calloc(1, sizeof(struct iocb *) * num_iocbs);
 	ctx->event_queue   = calloc(1, sizeof(struct io_event) * num_iocbs);
 
+	/* a vectored iocb gathers at least two requests */
+	ctx->num_iovs      = num_iocbs / 2 ? : 1;
+	ctx->free_iov_cnt  = ctx->num_iovs;
+	ctx->iovs          = calloc(ctx->num_iovs, sizeof(struct opio_iov));
+	ctx->free_iovs     = calloc(ctx->num_iovs, sizeof(struct opio_iov *));
+
 	if (!ctx->opios || !ctx->free_opios ||
-	    !ctx->iocb_queue || !ctx->event_queue)
+	    !ctx->iocb_queue || !ctx->event_queue ||
+	    !ctx->iovs || !ctx->free_iovs)
 		goto fail;
 
 	for (i = 0; i < num_iocbs; i++)
 		ctx->free_opios[i] = &ctx->opios[i];
 
+	for (i = 0; i < ctx->num_iovs; i++)
+		ctx->free_iovs[i] = &ctx->iovs[i];
+
 	return 0;
 
  fail:
@@ -102,9 +155,19 @@ alloc_opio(struct opioctx *ctx)
 	return ctx->free_opios[--ctx->free_opio_cnt];
 }
 
+static inline struct opio_iov *
+alloc_opio_iov(struct opioctx *ctx)
+{
+	if (ctx->free_iov_cnt <= 0)
+		return NULL;
+	return ctx->free_iovs[--ctx->free_iov_cnt];
+}
+
 static inline void
 free_opio(struct opioctx *ctx, struct opio *op)
 {
+	if (op->iov)
+		ctx->free_iovs[ctx->free_iov_cnt++] = op->iov;
 	memset(op, 0, sizeof(struct opio));
 	ctx->free_opios[ctx->free_opio_cnt++] = op;
 }
@@ -114,9 +177,10 @@ restore_iocb(struct opio *op)
 {
 	struct iocb *io = op->iocb;
 
-	io->data        = op->data;
-	io->u.c.buf     = op->buf;
-	io->u.c.nbytes  = op->nbytes;
+	io->data           = op->data;
+	io->aio_lio_opcode = op->opcode;
+	io->u.c.buf        = op->buf;
+	io->u.c.nbytes     = op->nbytes;
 }
 
 static inline int
@@ -129,24 +193,47 @@ iocb_optimized(struct opioctx *ctx, struct iocb *io)
 	return (iop >= start && iop < end);
 }
 
-static inline int
-contiguous_sectors(struct iocb *l, struct iocb *r)
+static inline struct opio_iov *
+iocb_vector(struct opioctx *ctx, struct iocb *io)
+{
+	if (!iocb_optimized(ctx, io))
+		return NULL;
+	return ((struct opio *)io->data)->iov;
+}
+
+static inline short
+iocb_opcode(struct opioctx *ctx, struct iocb *io)
 {
-	return (l->u.c.offset + l->u.c.nbytes == r->u.c.offset);
+	if (!iocb_optimized(ctx, io))
+		return io->aio_lio_opcode;
+	return ((struct opio *)io->data)->opcode;
+}
+
+static inline unsigned long
+iocb_nbytes(struct opioctx *ctx, struct iocb *io)
+{
+	struct opio_iov *iov = iocb_vector(ctx, io);
+
+	return (iov ? iov->nbytes : io->u.c.nbytes);
 }
 
 static inline int
-contiguous_buffers(struct iocb *l, struct iocb *r)
+contiguous_sectors(struct opioctx *ctx, struct iocb *l, struct iocb *r)
 {
-	return (l->u.c.buf + l->u.c.nbytes == r->u.c.buf);
+	return (l->u.c.offset + iocb_nbytes(ctx, l) == r->u.c.offset);
 }
 
 static inline int
-contiguous_iocbs(struct iocb *l, struct iocb *r)
+contiguous_buffers(struct opioctx *ctx, struct iocb *l, struct iocb *r)
 {
-	return ((l->aio_fildes == r->aio_fildes) &&
-		contiguous_sectors(l, r) &&
-		contiguous_buffers(l, r));
+	struct opio_iov *iov = iocb_vector(ctx, l);
+	const struct iovec *vec;
+
+	if (!iov)
+		return (l->u.c.buf + l->u.c.nbytes == r->u.c.buf);
+
+	vec = &iov->vec[iov->nr - 1];
+	return ((char *)vec->iov_base + vec->iov_len == r->u.c.buf);
 }
 
 static inline void
@@ -167,6 +254,7 @@ opio_iocb_init(struct opioctx *ctx, struct iocb *io)
 	op->buf    = io->u.c.buf;
 	op->nbytes = io->u.c.nbytes;
 	op->offset = io->u.c.offset;
+	op->opcode = io->aio_lio_opcode;
 	op->data   = io->data;
 	op->iocb   = io;
 	io->data   = op;
@@ -199,25 +287,115 @@ merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 		return -ENOMEM;
 
 	opio->head        = ophead;
-	head->u.c.nbytes += io->u.c.nbytes;
 	ophead->list.tail = ophead->list.tail->next = opio;
+
+	if (ophead->iov) {
+		ophead->iov->vec[ophead->iov->nr - 1].iov_len += io->u.c.nbytes;
+		ophead->iov->nbytes += io->u.c.nbytes;
+	} else
+		head->u.c.nbytes += io->u.c.nbytes;
 	
 	return 0;
 }
 
+/*
+ * gather a sector-contiguous request with a discontiguous buffer,
+ * turning the head into an IO_CMD_PREADV/PWRITEV over an opio_iov.
+ */
+static int
+merge_vector(struct opioctx *ctx, struct iocb *head, struct iocb *io)
+{
+	struct opio *ophead, *opio;
+	struct opio_iov *iov;
+	struct iovec *vec;
+
+	if (io->aio_lio_opcode != IO_CMD_PREAD &&
+	    io->aio_lio_opcode != IO_CMD_PWRITE)
+		return -EINVAL;
+
+	ophead = opio_get(ctx, head);
+	if (!ophead)
+		return -ENOMEM;
+
+	iov = ophead->iov;
+	if (iov && iov->nr >= OPIO_MAX_IOVS)
+		return -EINVAL;
+
+	if (!iov) {
+		iov = alloc_opio_iov(ctx);
+		if (!iov)
+			return -ENOMEM;
+
+		iov->vec[0].iov_base = head->u.c.buf;
+		iov->vec[0].iov_len  = head->u.c.nbytes;
+		iov->nbytes          = head->u.c.nbytes;
+		iov->nr              = 1;
+		ophead->iov          = iov;
+
+		head->aio_lio_opcode = (head->aio_lio_opcode == IO_CMD_PWRITE ?
+					IO_CMD_PWRITEV : IO_CMD_PREADV);
+		head->u.c.buf        = iov->vec;
+		head->u.c.nbytes     = iov->nr;
+	}
+
+	opio = opio_get(ctx, io);
+	if (!opio)
+		return -ENOMEM;
+
+	vec           = &iov->vec[iov->nr++];
+	vec->iov_base = io->u.c.buf;
+	vec->iov_len  = io->u.c.nbytes;
+	iov->nbytes  += io->u.c.nbytes;
+
+	/* as io_prep_preadv(): buf is the iovec array, nbytes its length */
+	head->u.c.nbytes = iov->nr;
+
+	opio->head        = ophead;
+	ophead->list.tail = ophead->list.tail->next = opio;
+
+	return 0;
+}
+
+static inline int
+merge_limited(struct opioctx *ctx, struct iocb *head, struct iocb *io)
+{
+	int i;
+
+	for (i = 0; i < ctx->num_limits; i++)
+		if (ctx->limits[i].fd == head->aio_fildes)
+			return (iocb_nbytes(ctx, head) + io->u.c.nbytes >
+				ctx->limits[i].max_bytes);
+
+	return 0;
+}
+
 static int
 merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
-	if (head->aio_lio_opcode != io->aio_lio_opcode)
+	if (iocb_opcode(ctx, head) != io->aio_lio_opcode)
 		return -EINVAL;
 
-	if (!contiguous_iocbs(head, io))
+	/* syncs carry no data and are never contiguous with anything */
+	if (io->aio_lio_opcode == IO_CMD_FSYNC ||
+	    io->aio_lio_opcode == IO_CMD_FDSYNC)
 		return -EINVAL;
 
-	return merge_tail(ctx, head, io);		
+	if (head->aio_fildes != io->aio_fildes ||
+	    !contiguous_sectors(ctx, head, io))
+		return -EINVAL;
+
+	if (merge_limited(ctx, head, io))
+		return -EINVAL;
+
+	if (contiguous_buffers(ctx, head, io))
+		return merge_tail(ctx, head, io);
+
+	return merge_vector(ctx, head, io);
 }
 
-#if (defined(TEST) || defined(DEBUG))
+#if defined(DEBUG)
+static inline void __print_iocb(struct opioctx *, struct iocb *, char *);
+
 static void
 print_optimized_iocbs(struct opioctx *ctx, struct opio *op, int *cnt)
 {
@@ -255,6 +433,54 @@ print_merged_iocbs(struct opioctx *ctx, struct iocb **iocbs, int num_iocbs)
 #define print_merged_iocbs(...)
 #endif
 
+static inline int
+sortable_iocb(struct iocb *io)
+{
+	return (io->aio_lio_opcode == IO_CMD_PREAD ||
+		io->aio_lio_opcode == IO_CMD_PWRITE);
+}
+
+static int
+iocb_cmp(const void *_l, const void *_r)
+{
+	const struct iocb *l = *(struct iocb * const *)_l;
+	const struct iocb *r = *(struct iocb * const *)_r;
+
+	if (l->aio_fildes != r->aio_fildes)
+		return (l->aio_fildes < r->aio_fildes ? -1 : 1);
+
+	if (l->u.c.offset != r->u.c.offset)
+		return (l->u.c.offset < r->u.c.offset ? -1 : 1);
+
+	return 0;
+}
+
+/*
+ * order reads and writes by (fd, offset) in runs of at most window
+ * iocbs, so interleaved streams become neighbours for io_merge.
+ * other commands are never moved and bound the runs.
+ */
+void
+io_sort(struct iocb **queue, int num, int window)
+{
+	int i, n;
+
+	if (window < 2)
+		return;
+
+	for (i = 0; i < num; i += n) {
+		for (n = 0; i + n < num && n < window; n++)
+			if (!sortable_iocb(queue[i + n]))
+				break;
+
+		if (n > 1)
+			qsort(queue + i, n, sizeof(struct iocb *), iocb_cmp);
+
+		if (!n)
+			n = 1;
+	}
+}
+
 int
 io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 {
@@ -335,7 +561,7 @@ expand_event(struct opioctx *ctx,
 	ophead = (struct opio *)io->data;
 	op     = ophead;
 
-	if (event->res == io->u.c.nbytes)
+	if (event->res == iocb_nbytes(ctx, io))
 		err = 0;
 	else if ((int)event->res < 0)
 		err = (int)event->res;
@@ -387,8 +613,8 @@ static inline void
 __print_iocb(struct opioctx *ctx, struct iocb *io, char *prefix)
 {
 	DBG(ctx, "%soff: %08llx, nbytes: %04lx, buf: %p, type: %s, data: %08lx,"
-	    " optimized: %d\n", prefix, io->u.c.offset, io->u.c.nbytes, 
-	    io->u.c.buf, (io->aio_lio_opcode == IO_CMD_PREAD ? "read" : "write"),
+	    " optimized: %d\n", prefix, io->u.c.offset, iocb_nbytes(ctx, io),
+	    io->u.c.buf, (iocb_opcode(ctx, io) == IO_CMD_PREAD ? "read" : "write"),
 	    (unsigned long)io->data, iocb_optimized(ctx, io));
 }
 
@@ -397,276 +623,3 @@ __print_iocb(struct opioctx *ctx, struct iocb *io, char *prefix)
 /******************************************************************************
 end debug print functions
 ******************************************************************************/
-
-#if defined(TEST)
-
-#define hmask 0x80000000UL
-#define smask 0x40000000UL
-#define make_data(idx, is_head, sparse) \
-         (void *)((idx) | ((is_head) ? hmask : 0) | ((sparse) ? smask : 0))
-#define data_idx(data)          (int)((unsigned long)(data) & (0x0fffffff))
-#define data_is_head(data)      (((unsigned long)(data) & hmask) ? 1 : 0)
-#define data_is_sparse(data)    (((unsigned long)(data) & smask) ? 1 : 0)
-
-static void
-usage(void)
-{
-	fprintf(stderr, "usage: io_optimize [-n num_runs] "
-		"[-i num_iocbs] [-s num_secs] [-r random_seed]\n");
-	exit(-1);
-}
-
-static int xalloc_cnt, xfree_cnt;
-static inline char *
-xalloc(int size)
-{
-	char *buf = malloc(size);
-	if (!buf) {
-		fprintf(stderr, "xalloc failed\n");
-		exit(ENOMEM);
-	}
-	xalloc_cnt++;
-	return buf;
-}
-
-static inline void
-xfree(void *buf)
-{
-	free(buf);
-	xfree_cnt++;
-}
-
-static void
-randomize_iocbs(struct iocb **iocbs, int num_iocbs, int num_secs)
-{
-	int i, j;
-
-	i = 0;
-	while (i < num_iocbs) {
-		char *buf;
-		short type;
-		int segs, sparse_mem;
-		uint64_t offset, nbytes;
-		
-		type   = (random() % 10 < 5 ? IO_CMD_PREAD : IO_CMD_PWRITE);
-		offset = ((random() % num_secs) << 9);
-
-		if (random() % 10 < 4) {
-			segs   = 1;
-			nbytes = (((random() % 7) + 1) << 9);
-		} else {
-			segs   = (random() % 10) + 1;
-			nbytes = 4096;
-		}
-
-		if (i + segs > num_iocbs)
-			segs = (num_iocbs - i);
-
-		sparse_mem = (random() % 10 < 2 ? 1 : 0);
-
-		if (sparse_mem)
-			buf = xalloc(nbytes);
-		else
-			buf = xalloc(segs * nbytes);
-
-		for (j = 0; j < segs; j++) {
-			struct iocb *io    = iocbs[i + j];
-			io->aio_lio_opcode = type;
-			io->u.c.nbytes     = nbytes;
-			io->u.c.offset     = offset;
-			io->u.c.buf        = buf;
-			offset            += nbytes;
-
-			io->data = make_data(i + j, (j == 0), sparse_mem);
-
-			if (j + 1 < segs && sparse_mem)
-				buf  = xalloc(nbytes);
-			else
-				buf += nbytes;
-		}
-
-		i += segs;
-	}
-}
-
-static int
-simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
-{
-	int i, done;
-	struct iocb *io;
-	struct io_event *ep;
-
-	if (num_iocbs > 1)
-		done = (random() % (num_iocbs - 1)) + 1;
-	else
-		done = num_iocbs;
-
-	for (i = 0; i < done; i++) {
-		io      = iocbs[i];
-		ep      = &events[i];
-		ep->obj = io;
-		ep->res = (random() % 10 < 8 ? io->u.c.nbytes : 0);
-	}
-
-	return done;
-}
-
-static inline void
-process_events(struct opioctx *ctx, 
-	       struct iocb *iocb_list, struct io_event *events, int num)
-{
-	int i;
-	struct iocb *io;
-
-	for (i = 0; i < num; i++) {
-		io = events[i].obj;
-		print_iocb(ctx, io);
-		if (data_idx(io->data) != (io - iocb_list)) {
-			printf("corrupt data! data_idx = %d, io = %d\n",
-			       data_idx(io->data), (io - iocb_list));
-			exit(-1);
-		}
-		if (data_is_head(io->data) || data_is_sparse(io->data))
-			xfree(io->u.c.buf);
-		memset(io, 0, sizeof(struct iocb));
-	}
-}
-
-static inline void
-init_optest(struct iocb *iocb_list, 
-	    struct iocb **iocbs, struct io_event *events, int num)
-{
-	int i;
-
-	memset(iocb_list, 0, num * sizeof(struct iocb));
-	memset(events, 0, num * sizeof(struct io_event));
-
-	for (i = 0; i < num; i++)
-		iocbs[i]  = &iocb_list[i];
-}
-
-static void
-print_iocbs(struct opioctx *ctx, struct iocb **iocbs, int num_iocbs)
-{
-	int i;
-	char pref[10];
-	struct iocb *io;
-
-	DBG(ctx, "iocbs:\n");
-	for (i = 0; i < num_iocbs; i++) {
-		io = iocbs[i];
-		snprintf(pref, 10, "%d: ", i);
-		__print_iocb(ctx, io, pref);
-	}
-}
-
-static void
-print_events(struct opioctx *ctx, struct io_event *events, int num_events)
-{
-	int i;
-	struct iocb *io;
-
-	for (i = 0; i < num_events; i++) {
-		io = events[i].obj;
-		print_iocb(ctx, io);
-	}
-}
-
-int
-main(int argc, char **argv)
-{
-	uint64_t num_secs;
-	struct opioctx ctx;
-	struct io_event *events;
-	int i, c, num_runs, num_iocbs, seed;
-	struct iocb *iocb_list, **iocbs, **ioqueue;
-
-	num_runs  = 1;
-	num_iocbs = 300;
-	seed      = time(NULL);
-	num_secs  = ((4ULL << 20) >> 9); /* 4GB disk */
-
-	while ((c = getopt(argc, argv, "n:i:s:r:h")) != -1) {
-		switch (c) {
-		case 'n':
-			num_runs  = atoi(optarg);
-			break;
-		case 'i':
-			num_iocbs = atoi(optarg);
-			break;
-		case 's':
-			num_secs  = strtoull(optarg, NULL, 10);
-			break;
-		case 'r':
-			seed      = atoi(optarg);
-			break;
-		case 'h':
-			usage();
-		case '?':
-			fprintf(stderr, "Unrecognized option: -%c\n", optopt);
-			usage();
-		}
-	}
-
-	printf("Running %d tests with %d iocbs on %llu sectors, seed = %d\n",
-	       num_runs, num_iocbs, num_secs, seed);
-
-	srand(seed);
-
-	iocb_list = malloc(num_iocbs * sizeof(struct iocb));
-	iocbs     = malloc(num_iocbs * sizeof(struct iocb *));
-	events    = malloc(num_iocbs * sizeof(struct io_event));
-	
-	if (!iocb_list || !iocbs || !events || opio_init(&ctx, num_iocbs)) {
-		fprintf(stderr, "initialization failed\n");
-		exit(ENOMEM);
-	}
-
-	for (i = 0; i < num_runs; i++) {
-		int op_rem, op_done, num_split, num_events, num_done;
-
-		ioqueue = iocbs;
-		init_optest(iocb_list, ioqueue, events, num_iocbs);
-		randomize_iocbs(ioqueue, num_iocbs, num_secs);
-		print_iocbs(&ctx, ioqueue, num_iocbs);
-
-		op_done  = 0;
-		num_done = 0;
-		op_rem   = io_merge(&ctx, ioqueue, num_iocbs);
-		print_iocbs(&ctx, ioqueue, op_rem);
-		print_merged_iocbs(&ctx, ioqueue, op_rem);
-		
-		while (num_done < num_iocbs) {
-			DBG(&ctx, "optimized remaining: %d\n", op_rem);
-
-			DBG(&ctx, "simulating\n");
-			num_events = simulate_io(ioqueue + op_done, events, op_rem);
-			print_events(&ctx, events, num_events);
-
-			DBG(&ctx, "splitting %d\n", num_events);
-			num_split = io_split(&ctx, events, num_events);
-			print_events(&ctx, events, num_split);
-
-			DBG(&ctx, "processing %d\n", num_split);
-			process_events(&ctx, iocb_list, events, num_split);
-
-			op_rem   -= num_events;
-			op_done  += num_events;
-			num_done += num_split;
-		}
-
-		DBG(&ctx, "run %d: processed: %d, xallocs: %d, xfrees: %d\n", 
-		    i, num_done, xalloc_cnt, xfree_cnt);
-		if (xalloc_cnt != xfree_cnt)
-			exit(-1);
-		xalloc_cnt = xfree_cnt = 0;
-	}
-
-	free(iocbs);
-	free(events);
-	free(iocb_list);
-	opio_free(&ctx);
-
-	return 0;
-}
-#endif
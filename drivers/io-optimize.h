@@ -32,9 +32,21 @@
 #define __IO_OPTIMIZE_H__
 
 #include <libaio.h>
+#include <sys/uio.h>
+
+/*
+ * Upper bound on the segments gathered into a single vectored iocb.
+ */
+#define OPIO_MAX_IOVS      32
 
 struct opio;
 
+struct opio_iov {
+	int                 nr;
+	unsigned long       nbytes;
+	struct iovec        vec[OPIO_MAX_IOVS];
+};
+
 struct opio_list {
 	struct opio        *head;
 	struct opio        *tail;
@@ -45,6 +57,8 @@ struct opio {
 	unsigned long       nbytes;
 	long long           offset;
 	void               *data;
+	short               opcode;
+	struct opio_iov    *iov;
 	struct iocb        *iocb;
 	struct io_event     event;
 	struct opio        *head;
@@ -52,17 +66,35 @@ struct opio {
 	struct opio_list    list;
 };
 
+/*
+ * Merging stops at max_bytes for requests to fd, so that tapdisk
+ * doesn't build what the device would only split again.
+ */
+struct opio_limit {
+	int                 fd;
+	unsigned long       max_bytes;
+};
+
 struct opioctx {
 	int                 num_opios;
 	int                 free_opio_cnt;
 	struct opio        *opios;
 	struct opio       **free_opios;
+	int                 num_iovs;
+	int                 free_iov_cnt;
+	struct opio_iov    *iovs;
+	struct opio_iov   **free_iovs;
 	struct iocb       **iocb_queue;
 	struct io_event    *event_queue;
+	int                 num_limits;
+	struct opio_limit  *limits;
 };
 
 int opio_init(struct opioctx *ctx, int num_iocbs);
 void opio_free(struct opioctx *ctx);
+int opio_set_merge_limit(struct opioctx *ctx, int fd,
+			 unsigned long max_bytes);
+void io_sort(struct iocb **queue, int num, int window);
 int io_merge(struct opioctx *ctx, struct iocb **queue, int num);
 int io_split(struct opioctx *ctx, struct io_event *events, int num);
 int io_expand_iocbs(struct opioctx *ctx, struct iocb **queue, int idx, int num);
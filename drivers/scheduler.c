@@ -36,7 +36,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "debug.h"
 #include "tapdisk.h"
@@ -52,6 +55,14 @@
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
 
+#define SCHEDULER_EPOLL_READ        (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)
+#define SCHEDULER_EPOLL_WRITE       (EPOLLOUT | EPOLLHUP | EPOLLERR)
+#define SCHEDULER_EPOLL_EXCEPT      (EPOLLPRI)
+
+/* queued states of a scheduler_work */
+#define SCHEDULER_WORK_DEFERRED     1
+#define SCHEDULER_WORK_POSTED       2
+
 #define MIN(a, b)                   ((a) <= (b) ? (a) : (b))
 #define MAX(a, b)                   ((a) >= (b) ? (a) : (b))
 
@@ -64,6 +75,9 @@
 #define scheduler_for_each_event_safe(s, event, tmp)	\
 	list_for_each_entry_safe(event, tmp, &(s)->events, next)
 
+#define scheduler_event_bucket(s, id)		\
+	(&(s)->hash[(unsigned int)(id) & (SCHEDULER_EVENT_HASH_SIZE - 1)])
+
 typedef struct event {
 	char                         mode;
 	char                         dead;
@@ -93,23 +107,209 @@ typedef struct event {
 	void                        *private;
 
 	struct list_head             next;
+
+	/**
+	 * Linkage into scheduler.pending, scheduler.hash and, for fd events
+	 * under the epoll backends, scheduler_fd.events.
+	 */
+	struct list_head             pending_next;
+	struct list_head             hash_next;
+	struct list_head             fd_next;
+
+	/**
+	 * Position in scheduler.timers, or -1 if the timeout is not armed.
+	 */
+	int                          heap_idx;
 } event_t;
 
+/**
+ * Interest state of a file descriptor under the epoll backends. Several
+ * events may share a file descriptor, so the epoll registration covers the
+ * union of what the live, unmasked events on it are waiting for.
+ */
+struct scheduler_fd {
+	int                          fd;
+	uint32_t                     interest;
+	int                          always_ready;
+	struct list_head             events;
+	struct list_head             next;
+};
+
+static inline int
+scheduler_uses_epoll(scheduler_t *s)
+{
+	return s->backend != SCHEDULER_BACKEND_SELECT;
+}
+
+static event_t *
+scheduler_find_event(scheduler_t *s, event_id_t id)
+{
+	event_t *event;
+
+	list_for_each_entry(event, scheduler_event_bucket(s, id), hash_next)
+		if (event->id == id)
+			return event;
+
+	return NULL;
+}
+
+static void
+scheduler_event_set_pending(scheduler_t *s, event_t *event, char mode)
+{
+	event->pending |= mode;
+	if (list_empty(&event->pending_next))
+		list_add_tail(&event->pending_next, &s->pending);
+}
+
+static inline int
+scheduler_timer_before(scheduler_t *s, int a, int b)
+{
+	return TV_BEFORE(s->timers[a]->deadline, s->timers[b]->deadline);
+}
+
+static inline void
+scheduler_timer_swap(scheduler_t *s, int a, int b)
+{
+	event_t *tmp = s->timers[a];
+
+	s->timers[a] = s->timers[b];
+	s->timers[b] = tmp;
+
+	s->timers[a]->heap_idx = a;
+	s->timers[b]->heap_idx = b;
+}
+
+static void
+scheduler_timer_sift_up(scheduler_t *s, int idx)
+{
+	while (idx > 0) {
+		int parent = (idx - 1) / 2;
+
+		if (!scheduler_timer_before(s, idx, parent))
+			break;
+
+		scheduler_timer_swap(s, idx, parent);
+		idx = parent;
+	}
+}
+
 static void
-scheduler_prepare_events(scheduler_t *s)
+scheduler_timer_sift_down(scheduler_t *s, int idx)
+{
+	for (;;) {
+		int left = 2 * idx + 1, right = left + 1, min = idx;
+
+		if (left < s->n_timers && scheduler_timer_before(s, left, min))
+			min = left;
+		if (right < s->n_timers && scheduler_timer_before(s, right, min))
+			min = right;
+		if (min == idx)
+			break;
+
+		scheduler_timer_swap(s, idx, min);
+		idx = min;
+	}
+}
+
+static void
+scheduler_timer_del(scheduler_t *s, event_t *event)
+{
+	int idx = event->heap_idx;
+
+	if (idx < 0)
+		return;
+
+	event->heap_idx = -1;
+
+	if (--s->n_timers == idx)
+		return;
+
+	s->timers[idx] = s->timers[s->n_timers];
+	s->timers[idx]->heap_idx = idx;
+
+	scheduler_timer_sift_down(s, idx);
+	scheduler_timer_sift_up(s, idx);
+}
+
+/**
+ * (Re-)arms the timeout of @event according to its current deadline. Events
+ * without a finite timeout, as well as masked or dead ones, are kept out of
+ * the heap.
+ */
+static int
+scheduler_timer_arm(scheduler_t *s, event_t *event)
+{
+	int idx;
+
+	if (!(event->mode & SCHEDULER_POLL_TIMEOUT) ||
+	    TV_IS_INF(event->timeout) || event->masked || event->dead) {
+		scheduler_timer_del(s, event);
+		return 0;
+	}
+
+	idx = event->heap_idx;
+	if (idx >= 0) {
+		scheduler_timer_sift_down(s, idx);
+		scheduler_timer_sift_up(s, idx);
+		return 0;
+	}
+
+	if (s->n_timers == s->max_timers) {
+		event_t **timers;
+		int max_timers;
+
+		max_timers = MAX(s->max_timers * 2, 64);
+		timers = realloc(s->timers, max_timers * sizeof(*timers));
+		if (!timers)
+			return -ENOMEM;
+
+		s->timers     = timers;
+		s->max_timers = max_timers;
+	}
+
+	idx = s->n_timers++;
+	s->timers[idx]  = event;
+	event->heap_idx = idx;
+
+	scheduler_timer_sift_up(s, idx);
+
+	return 0;
+}
+
+static void
+scheduler_prepare_timeout(scheduler_t *s)
 {
 	struct timeval diff;
 	struct timeval now;
+
+	s->timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
+
+	if (s->n_timers) {
+		gettimeofday(&now, NULL);
+
+		TV_SUB(s->timers[0]->deadline, now, diff);
+		if (TV_AFTER(diff, TV_ZERO))
+			s->timeout = TV_MIN(s->timeout, diff);
+		else
+			s->timeout = TV_ZERO;
+	}
+
+	s->timeout = TV_MIN(s->timeout, s->max_timeout);
+
+	if (!list_empty(&s->deferred))
+		s->timeout = TV_ZERO;
+}
+
+static void
+scheduler_prepare_fd_sets(scheduler_t *s)
+{
 	event_t *event;
 
 	FD_ZERO(&s->read_fds);
 	FD_ZERO(&s->write_fds);
 	FD_ZERO(&s->except_fds);
 
-	s->max_fd  = -1;
-	s->timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
-
-	gettimeofday(&now, NULL);
+	s->max_fd = -1;
 
 	scheduler_for_each_event(s, event) {
 		if (event->masked || event->dead)
@@ -129,18 +329,7 @@ scheduler_prepare_events(scheduler_t *s)
 			FD_SET(event->fd, &s->except_fds);
 			s->max_fd = MAX(event->fd, s->max_fd);
 		}
-
-		if (event->mode & SCHEDULER_POLL_TIMEOUT
-				&& !TV_IS_INF(event->timeout)) {
-			TV_SUB(event->deadline, now, diff);
-			if (TV_AFTER(diff, TV_ZERO))
-				s->timeout = TV_MIN(s->timeout, diff);
-			else
-				s->timeout = TV_ZERO;
-		}
 	}
-
-	s->timeout = TV_MIN(s->timeout, s->max_timeout);
 }
 
 static int
@@ -149,6 +338,8 @@ scheduler_check_fd_events(scheduler_t *s, int nfds)
 	event_t *event;
 
 	scheduler_for_each_event(s, event) {
+		char mode = 0;
+
 		if (!nfds)
 			break;
 
@@ -158,81 +349,327 @@ scheduler_check_fd_events(scheduler_t *s, int nfds)
 		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
 		    FD_ISSET(event->fd, &s->read_fds)) {
 			FD_CLR(event->fd, &s->read_fds);
-			event->pending |= SCHEDULER_POLL_READ_FD;
+			mode |= SCHEDULER_POLL_READ_FD;
 			--nfds;
 		}
 
 		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
 		    FD_ISSET(event->fd, &s->write_fds)) {
 			FD_CLR(event->fd, &s->write_fds);
-			event->pending |= SCHEDULER_POLL_WRITE_FD;
+			mode |= SCHEDULER_POLL_WRITE_FD;
 			--nfds;
 		}
 
 		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
 		    FD_ISSET(event->fd, &s->except_fds)) {
 			FD_CLR(event->fd, &s->except_fds);
-			event->pending |= SCHEDULER_POLL_EXCEPT_FD;
+			mode |= SCHEDULER_POLL_EXCEPT_FD;
 			--nfds;
 		}
+
+		if (mode)
+			scheduler_event_set_pending(s, event, mode);
 	}
 
 	return nfds;
 }
 
-/**
- * Checks all scheduler events whose mode is set to SCHEDULER_POLL_TIMEOUT
- * whether their time out has elapsed, and if so it makes them runnable.
- */
+static int
+scheduler_poll_select(scheduler_t *s)
+{
+	struct timeval tv;
+	int ret;
+
+	scheduler_prepare_fd_sets(s);
+
+	tv = s->timeout;
+
+	do {
+		ret = select(s->max_fd + 1, &s->read_fds, &s->write_fds,
+			     &s->except_fds, &tv);
+		if (ret < 0) {
+			ret = -errno;
+			ASSERT(ret);
+		}
+	} while (ret == -EINTR);
+
+	if (ret < 0) {
+		EPRINTF("select failed: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	if (ret)
+		ret = scheduler_check_fd_events(s, ret);
+	BUG_ON(ret);
+
+	return 0;
+}
+
+static struct scheduler_fd *
+scheduler_fd_lookup(scheduler_t *s, int fd)
+{
+	if (fd < 0 || fd >= s->n_fds)
+		return NULL;
+
+	return s->fds[fd];
+}
+
+static struct scheduler_fd *
+scheduler_fd_get(scheduler_t *s, int fd)
+{
+	struct scheduler_fd *sfd;
+
+	if (fd < 0)
+		return NULL;
+
+	if (fd >= s->n_fds) {
+		struct scheduler_fd **fds;
+		int n_fds;
+
+		n_fds = MAX(fd + 1, s->n_fds * 2);
+		n_fds = MAX(n_fds, 64);
+
+		fds = realloc(s->fds, n_fds * sizeof(*fds));
+		if (!fds)
+			return NULL;
+
+		memset(fds + s->n_fds, 0, (n_fds - s->n_fds) * sizeof(*fds));
+		s->fds   = fds;
+		s->n_fds = n_fds;
+	}
+
+	sfd = s->fds[fd];
+	if (!sfd) {
+		sfd = calloc(1, sizeof(*sfd));
+		if (!sfd)
+			return NULL;
+
+		sfd->fd = fd;
+		INIT_LIST_HEAD(&sfd->events);
+		INIT_LIST_HEAD(&sfd->next);
+		s->fds[fd] = sfd;
+	}
+
+	return sfd;
+}
+
 static void
-scheduler_check_timeouts(scheduler_t *s)
+scheduler_fd_put(scheduler_t *s, struct scheduler_fd *sfd)
 {
-	struct timeval now;
-	event_t *event;
+	if (!list_empty(&sfd->events))
+		return;
 
-	gettimeofday(&now, NULL);
+	list_del(&sfd->next);
+	s->fds[sfd->fd] = NULL;
+	free(sfd);
+}
 
-	scheduler_for_each_event(s, event) {
-		BUG_ON(event->pending && event->masked);
+static uint32_t
+scheduler_fd_interest(struct scheduler_fd *sfd)
+{
+	uint32_t interest = 0;
+	event_t *event;
 
-		if (event->dead)
+	list_for_each_entry(event, &sfd->events, fd_next) {
+		if (event->masked || event->dead)
 			continue;
 
-		if (event->pending)
-			continue;
+		if (event->mode & SCHEDULER_POLL_READ_FD)
+			interest |= EPOLLIN | EPOLLRDHUP;
+		if (event->mode & SCHEDULER_POLL_WRITE_FD)
+			interest |= EPOLLOUT;
+		if (event->mode & SCHEDULER_POLL_EXCEPT_FD)
+			interest |= EPOLLPRI;
+	}
 
-		if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
-			continue;
+	return interest;
+}
 
-		if (TV_IS_INF(event->timeout))
-			continue;
+/**
+ * Brings the epoll registration of @sfd in line with its events. @force
+ * re-issues the registration even if the interest set did not change, which
+ * is needed when a new event is registered: the descriptor may have been
+ * closed and reused since, silently dropping it from the epoll set.
+ */
+static int
+scheduler_fd_update(scheduler_t *s, struct scheduler_fd *sfd, int force)
+{
+	struct epoll_event ev;
+	uint32_t interest;
+	int op, err;
 
-		if (TV_BEFORE(now, event->deadline))
+	interest = scheduler_fd_interest(sfd);
+
+	if (sfd->always_ready) {
+		if (!force) {
+			sfd->interest = interest;
+			return 0;
+		}
+
+		list_del_init(&sfd->next);
+		sfd->always_ready = 0;
+		sfd->interest     = 0;
+	}
+
+	if (interest == sfd->interest && !(force && interest))
+		return 0;
+
+	if (!interest)
+		op = EPOLL_CTL_DEL;
+	else if (!sfd->interest)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events  = interest;
+	ev.data.fd = sfd->fd;
+	if (s->backend == SCHEDULER_BACKEND_EPOLL_ET)
+		ev.events |= EPOLLET;
+
+	err = epoll_ctl(s->epoll_fd, op, sfd->fd, &ev);
+	if (err && errno == ENOENT && op == EPOLL_CTL_MOD) {
+		op  = EPOLL_CTL_ADD;
+		err = epoll_ctl(s->epoll_fd, op, sfd->fd, &ev);
+	} else if (err && errno == EEXIST && op == EPOLL_CTL_ADD) {
+		op  = EPOLL_CTL_MOD;
+		err = epoll_ctl(s->epoll_fd, op, sfd->fd, &ev);
+	}
+
+	if (err) {
+		err = -errno;
+
+		if (op == EPOLL_CTL_DEL) {
+			/* closed before being unregistered */
+			sfd->interest = 0;
+			return 0;
+		}
+
+		if (err == -EPERM) {
+			/* regular files are always ready, as select(2) says */
+			sfd->always_ready = 1;
+			sfd->interest     = interest;
+			list_add_tail(&sfd->next, &s->always_ready);
+			return 0;
+		}
+
+		EPRINTF("epoll_ctl fd %d failed: %s\n", sfd->fd, strerror(-err));
+		return err;
+	}
+
+	sfd->interest = interest;
+
+	return 0;
+}
+
+static void
+scheduler_fd_ready(scheduler_t *s, struct scheduler_fd *sfd, uint32_t revents)
+{
+	event_t *event;
+
+	list_for_each_entry(event, &sfd->events, fd_next) {
+		char mode = 0;
+
+		if (event->masked || event->dead)
 			continue;
 
-		event->pending = SCHEDULER_POLL_TIMEOUT;
+		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
+		    (revents & SCHEDULER_EPOLL_READ))
+			mode |= SCHEDULER_POLL_READ_FD;
+
+		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
+		    (revents & SCHEDULER_EPOLL_WRITE))
+			mode |= SCHEDULER_POLL_WRITE_FD;
+
+		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
+		    (revents & SCHEDULER_EPOLL_EXCEPT))
+			mode |= SCHEDULER_POLL_EXCEPT_FD;
+
+		if (mode)
+			scheduler_event_set_pending(s, event, mode);
 	}
 }
 
 static int
-scheduler_check_events(scheduler_t *s, int nfds)
+scheduler_poll_epoll(scheduler_t *s)
 {
-	if (nfds)
-		nfds = scheduler_check_fd_events(s, nfds);
+	struct scheduler_fd *sfd;
+	int i, n, timeout;
 
-	scheduler_check_timeouts(s);
+	timeout  = s->timeout.tv_sec * 1000;
+	timeout += (s->timeout.tv_usec + 999) / 1000;
 
-	return nfds;
+	list_for_each_entry(sfd, &s->always_ready, next)
+		if (sfd->interest) {
+			timeout = 0;
+			break;
+		}
+
+	do {
+		n = epoll_wait(s->epoll_fd, s->epoll_events,
+			       SCHEDULER_EPOLL_MAX_EVENTS, timeout);
+		if (n < 0) {
+			n = -errno;
+			ASSERT(n);
+		}
+	} while (n == -EINTR);
+
+	if (n < 0) {
+		EPRINTF("epoll_wait failed: %s\n", strerror(-n));
+		return n;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct epoll_event *ev = &s->epoll_events[i];
+
+		sfd = scheduler_fd_lookup(s, ev->data.fd);
+		if (sfd)
+			scheduler_fd_ready(s, sfd, ev->events);
+	}
+
+	list_for_each_entry(sfd, &s->always_ready, next)
+		scheduler_fd_ready(s, sfd, EPOLLIN | EPOLLOUT);
+
+	return 0;
+}
+
+/**
+ * Makes runnable all armed timeout events whose deadline has elapsed. They
+ * leave the heap until their callback re-arms them.
+ */
+static void
+scheduler_check_timeouts(scheduler_t *s)
+{
+	struct timeval now;
+	event_t *event;
+
+	gettimeofday(&now, NULL);
+
+	while (s->n_timers) {
+		event = s->timers[0];
+
+		BUG_ON(event->pending && event->masked);
+
+		if (TV_BEFORE(now, event->deadline))
+			break;
+
+		scheduler_timer_del(s, event);
+
+		if (!event->pending)
+			scheduler_event_set_pending(s, event,
+						    SCHEDULER_POLL_TIMEOUT);
+	}
 }
 
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
 {
 	if (event->mode & SCHEDULER_POLL_TIMEOUT
 			&& !TV_IS_INF(event->timeout)) {
 		struct timeval now;
 		gettimeofday(&now, NULL);
 		TV_ADD(now, event->timeout, event->deadline);
+		scheduler_timer_arm(s, event);
 	}
 
 	if (!event->masked)
@@ -245,9 +682,12 @@ scheduler_run_events(scheduler_t *s)
 	event_t *event;
 	int n_dispatched = 0;
 
-	scheduler_for_each_event(s, event) {
+	while (!list_empty(&s->pending)) {
 		char pending;
 
+		event = list_first_entry(&s->pending, event_t, pending_next);
+		list_del_init(&event->pending_next);
+
 		if (event->dead)
 			continue;
 
@@ -255,7 +695,7 @@ scheduler_run_events(scheduler_t *s)
 		if (pending) {
 			event->pending = 0;
 			/* NB. must clear before cb */
-			scheduler_event_callback(event, pending);
+			scheduler_event_callback(s, event, pending);
 			n_dispatched++;
 		}
 	}
@@ -263,11 +703,121 @@ scheduler_run_events(scheduler_t *s)
 	return n_dispatched;
 }
 
+void
+scheduler_defer(scheduler_t *s, scheduler_work_t *work)
+{
+	if (work->queued)
+		return;
+
+	work->queued = SCHEDULER_WORK_DEFERRED;
+	list_add_tail(&work->next, &s->deferred);
+}
+
+void
+scheduler_wakeup(scheduler_t *s)
+{
+	uint64_t one = 1;
+
+	if (write(s->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		EPRINTF("failed to wake event loop: %d\n", errno);
+}
+
+void
+scheduler_post(scheduler_t *s, scheduler_work_t *work)
+{
+	int wake = 0;
+
+	pthread_mutex_lock(&s->post_lock);
+	if (!work->queued) {
+		wake = list_empty(&s->posted);
+		work->queued = SCHEDULER_WORK_POSTED;
+		list_add_tail(&work->next, &s->posted);
+	}
+	pthread_mutex_unlock(&s->post_lock);
+
+	if (wake)
+		scheduler_wakeup(s);
+}
+
+void
+scheduler_cancel(scheduler_t *s, scheduler_work_t *work)
+{
+	/* posted work turns deferred on the loop only */
+	if (work->queued == SCHEDULER_WORK_POSTED) {
+		pthread_mutex_lock(&s->post_lock);
+		if (work->queued == SCHEDULER_WORK_POSTED) {
+			list_del_init(&work->next);
+			work->queued = 0;
+		}
+		pthread_mutex_unlock(&s->post_lock);
+	}
+
+	if (work->queued) {
+		list_del_init(&work->next);
+		work->queued = 0;
+	}
+}
+
+static void
+scheduler_wake_event(event_id_t id __attribute__((unused)),
+		     char mode __attribute__((unused)), void *private)
+{
+	scheduler_t *s = private;
+	uint64_t val;
+
+	if (read(s->wake_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		EPRINTF("failed to read wakeup: %d\n", errno);
+}
+
+static void
+scheduler_open_wakeup(scheduler_t *s)
+{
+	event_id_t id;
+
+	if (s->wake_fd < 0 || s->wake_evid >= 0)
+		return;
+
+	id = scheduler_register_event(s, SCHEDULER_POLL_READ_FD, s->wake_fd,
+				      TV_ZERO, scheduler_wake_event, s);
+	if (id < 0)
+		EPRINTF("failed to register wakeup: %d\n", id);
+	else
+		s->wake_evid = id;
+}
+
+/*
+ * Runs the work queued so far, once: what it defers in turn waits for
+ * the next iteration.
+ */
+static void
+scheduler_run_deferred(scheduler_t *s)
+{
+	struct list_head run = LIST_HEAD_INIT(run);
+	scheduler_work_t *work;
+
+	pthread_mutex_lock(&s->post_lock);
+	list_for_each_entry(work, &s->posted, next)
+		work->queued = SCHEDULER_WORK_DEFERRED;
+	list_splice_tail(&s->posted, &s->deferred);
+	INIT_LIST_HEAD(&s->posted);
+	pthread_mutex_unlock(&s->post_lock);
+
+	list_splice(&s->deferred, &run);
+	INIT_LIST_HEAD(&s->deferred);
+
+	/* queued while on run, so that a cancel takes them off it */
+	while (!list_empty(&run)) {
+		work = list_first_entry(&run, scheduler_work_t, next);
+		list_del_init(&work->next);
+		work->queued = 0;
+		work->fn(work);
+	}
+}
+
 int
 scheduler_get_event_uuid(scheduler_t *s) {
 
 	int uuid_found;
-	event_t *event;
 
         if(unlikely(s->uuid < 0)) {
 		EPRINTF("scheduler uuid overflow detected");
@@ -278,22 +828,36 @@ scheduler_get_event_uuid(scheduler_t *s) {
         if(unlikely(s->uuid_overflow == 1)) {
                 do {
                         uuid_found = 1;
-                        scheduler_for_each_event(s, event) {
-                                if(event->id == s->uuid) {
-                                        uuid_found = 0;
-                                        s->uuid++;
-					if(s->uuid < 0)
-						s->uuid = 1;
-                                        break;
-                                }
+                        if (scheduler_find_event(s, s->uuid)) {
+                                uuid_found = 0;
+                                s->uuid++;
+                                if(s->uuid < 0)
+                                        s->uuid = 1;
                         }
-
                 } while(!uuid_found);
         }
 	
 	return s->uuid++;
 }
 
+static void
+scheduler_event_fd_changed(scheduler_t *s, event_t *event)
+{
+	struct scheduler_fd *sfd;
+
+	if (!scheduler_uses_epoll(s) || list_empty(&event->fd_next))
+		return;
+
+	sfd = scheduler_fd_lookup(s, event->fd);
+	ASSERT(sfd);
+
+	if (event->dead)
+		list_del_init(&event->fd_next);
+
+	scheduler_fd_update(s, sfd, 0);
+	scheduler_fd_put(s, sfd);
+}
+
 int
 scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 struct timeval timeout, event_cb_t cb, void *private)
@@ -314,7 +878,11 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	gettimeofday(&now, NULL);
 
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->pending_next);
+	INIT_LIST_HEAD(&event->hash_next);
+	INIT_LIST_HEAD(&event->fd_next);
 
+	event->heap_idx = -1;
 	event->mode     = mode;
 	event->fd       = fd;
 	event->timeout  = timeout;
@@ -325,10 +893,42 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 		TV_ADD(now, timeout, event->deadline);
 	event->cb       = cb;
 	event->private  = private;
-	event->id       = scheduler_get_event_uuid(s);
 	event->masked   = 0;
 
+	if (scheduler_uses_epoll(s) && (mode & SCHEDULER_POLL_FD)) {
+		struct scheduler_fd *sfd;
+		int err;
+
+		sfd = scheduler_fd_get(s, fd);
+		if (!sfd) {
+			free(event);
+			return fd < 0 ? -EBADF : -ENOMEM;
+		}
+
+		list_add_tail(&event->fd_next, &sfd->events);
+
+		err = scheduler_fd_update(s, sfd, 1);
+		if (err) {
+			list_del(&event->fd_next);
+			scheduler_fd_put(s, sfd);
+			free(event);
+			return err;
+		}
+	}
+
+	if (scheduler_timer_arm(s, event)) {
+		if (!list_empty(&event->fd_next)) {
+			event->dead = 1;
+			scheduler_event_fd_changed(s, event);
+		}
+		free(event);
+		return -ENOMEM;
+	}
+
+	event->id       = scheduler_get_event_uuid(s);
+
 	list_add_tail(&event->next, &s->events);
+	list_add_tail(&event->hash_next, scheduler_event_bucket(s, event->id));
 
 	return event->id;
 }
@@ -341,11 +941,18 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event)
-		if (event->id == id) {
-			event->dead = 1;
-			break;
-		}
+	event = scheduler_find_event(s, id);
+	if (!event)
+		return;
+
+	event->dead = 1;
+
+	list_del_init(&event->hash_next);
+	list_del_init(&event->pending_next);
+	list_move_tail(&event->next, &s->dead);
+
+	scheduler_timer_del(s, event);
+	scheduler_event_fd_changed(s, event);
 }
 
 void
@@ -356,11 +963,21 @@ scheduler_mask_event(scheduler_t *s, event_id_t id, int masked)
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event)
-		if (event->id == id) {
-			event->masked = !!masked;
-			break;
-		}
+	event = scheduler_find_event(s, id);
+	if (!event)
+		return;
+
+	if (event->masked == !!masked)
+		return;
+
+	event->masked = !!masked;
+
+	/*
+	 * The deadline is kept as it was: one that passed while masked
+	 * fires on the next iteration.
+	 */
+	scheduler_timer_arm(s, event);
+	scheduler_event_fd_changed(s, event);
 }
 
 static void
@@ -368,11 +985,10 @@ scheduler_gc_events(scheduler_t *s)
 {
 	event_t *event, *next;
 
-	scheduler_for_each_event_safe(s, event, next)
-		if (event->dead) {
-			list_del(&event->next);
-			free(event);
-		}
+	list_for_each_entry_safe(event, next, &s->dead, next) {
+		list_del(&event->next);
+		free(event);
+	}
 }
 
 void
@@ -386,45 +1002,37 @@ int
 scheduler_wait_for_events(scheduler_t *s)
 {
 	int ret;
-	struct timeval tv;
 
 	s->depth++;
 	ret = 0;
 
+	scheduler_open_wakeup(s);
+
 	if (s->depth > 1 && scheduler_run_events(s))
 		/* NB. recursive invocations continue with the pending
 		 * event set. We return as soon as we made some
 		 * progress. */
 		goto out;
 
-	scheduler_prepare_events(s);
-
-	tv = s->timeout;
+	scheduler_prepare_timeout(s);
 
 	DBG("timeout: %ld.%ld, max_timeout: %ld.%ld\n",
 	    s->timeout.tv_sec, s->timeout.tv_usec, s->max_timeout.tv_sec, s->max_timeout.tv_usec);
 
-    do {
-    	ret = select(s->max_fd + 1, &s->read_fds, &s->write_fds,
-                &s->except_fds, &tv);
-        if (ret < 0) {
-            ret = -errno;
-            ASSERT(ret);
-        }
-    } while (ret == -EINTR);
-
-    if (ret < 0) {
-        EPRINTF("select failed: %s\n", strerror(-ret));
-        goto out;
-    }
+	if (scheduler_uses_epoll(s))
+		ret = scheduler_poll_epoll(s);
+	else
+		ret = scheduler_poll_select(s);
+	if (ret < 0)
+		goto out;
 
-	ret = scheduler_check_events(s, ret);
-	BUG_ON(ret);
+	scheduler_check_timeouts(s);
 
 	s->timeout     = TV_SECS(SCHEDULER_MAX_TIMEOUT);
 	s->max_timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
 
 	scheduler_run_events(s);
+	scheduler_run_deferred(s);
 
 	if (s->depth == 1)
 		scheduler_gc_events(s);
@@ -435,9 +1043,66 @@ out:
 	return ret;
 }
 
+int
+scheduler_set_backend(scheduler_t *s, enum scheduler_backend backend)
+{
+	if (backend == s->backend)
+		return 0;
+
+	if (!list_empty(&s->events))
+		return -EBUSY;
+
+	switch (backend) {
+	case SCHEDULER_BACKEND_SELECT:
+		if (s->epoll_fd >= 0) {
+			close(s->epoll_fd);
+			s->epoll_fd = -1;
+		}
+		break;
+
+	case SCHEDULER_BACKEND_EPOLL:
+	case SCHEDULER_BACKEND_EPOLL_ET:
+		if (s->epoll_fd < 0) {
+			s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+			if (s->epoll_fd < 0)
+				return -errno;
+		}
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	s->backend = backend;
+
+	return 0;
+}
+
+static enum scheduler_backend
+scheduler_default_backend(void)
+{
+	const char *name;
+
+	name = getenv("TAPDISK3_SCHEDULER");
+	if (!name || !strcmp(name, "epoll"))
+		return SCHEDULER_BACKEND_EPOLL;
+
+	if (!strcmp(name, "epoll-et"))
+		return SCHEDULER_BACKEND_EPOLL_ET;
+
+	if (!strcmp(name, "select"))
+		return SCHEDULER_BACKEND_SELECT;
+
+	EPRINTF("unknown scheduler backend '%s', using epoll\n", name);
+
+	return SCHEDULER_BACKEND_EPOLL;
+}
+
 void
 scheduler_initialize(scheduler_t *s)
 {
+	int i, err;
+
 	memset(s, 0, sizeof(scheduler_t));
 
 	s->uuid  = 1;
@@ -448,7 +1113,65 @@ scheduler_initialize(scheduler_t *s)
 	FD_ZERO(&s->write_fds);
 	FD_ZERO(&s->except_fds);
 
+	s->backend  = SCHEDULER_BACKEND_SELECT;
+	s->epoll_fd = -1;
+
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->pending);
+	INIT_LIST_HEAD(&s->dead);
+	INIT_LIST_HEAD(&s->always_ready);
+	INIT_LIST_HEAD(&s->deferred);
+	INIT_LIST_HEAD(&s->posted);
+
+	pthread_mutex_init(&s->post_lock, NULL);
+
+	s->wake_evid = -1;
+	s->wake_fd   = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->wake_fd < 0)
+		EPRINTF("failed to create wakeup eventfd: %d\n", errno);
+
+	for (i = 0; i < SCHEDULER_EVENT_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&s->hash[i]);
+
+	err = scheduler_set_backend(s, scheduler_default_backend());
+	if (err)
+		EPRINTF("failed to set up epoll, falling back to select: %s\n",
+			strerror(-err));
+}
+
+void
+scheduler_uninitialize(scheduler_t *s)
+{
+	int i;
+
+	if (s->wake_evid >= 0) {
+		scheduler_unregister_event(s, s->wake_evid);
+		s->wake_evid = -1;
+	}
+
+	for (i = 0; i < s->n_fds; i++)
+		free(s->fds[i]);
+
+	free(s->fds);
+	s->fds   = NULL;
+	s->n_fds = 0;
+
+	free(s->timers);
+	s->timers     = NULL;
+	s->n_timers   = 0;
+	s->max_timers = 0;
+
+	if (s->epoll_fd >= 0) {
+		close(s->epoll_fd);
+		s->epoll_fd = -1;
+	}
+
+	if (s->wake_fd >= 0) {
+		close(s->wake_fd);
+		s->wake_fd = -1;
+	}
+
+	pthread_mutex_destroy(&s->post_lock);
 }
 
 int
@@ -461,22 +1184,21 @@ scheduler_event_set_timeout(scheduler_t *sched, event_id_t event_id, struct time
 	if (!event_id)
 		return -EINVAL;
 
-	scheduler_for_each_event(sched, event) {
-		if (event->id == event_id) {
-			if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
-				return -EINVAL;
-			event->timeout = timeo;
-			if (TV_IS_INF(event->timeout))
-				event->deadline = TV_INF;
-			else {
-				struct timeval now;
-				gettimeofday(&now, NULL);
-				TV_ADD(now, event->timeout, event->deadline);
-			}
-			return 0;
-		}
+	event = scheduler_find_event(sched, event_id);
+	if (!event)
+		return -ENOENT;
+
+	if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
+		return -EINVAL;
+
+	event->timeout = timeo;
+	if (TV_IS_INF(event->timeout))
+		event->deadline = TV_INF;
+	else {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		TV_ADD(now, event->timeout, event->deadline);
 	}
 
-	return -ENOENT;
+	return scheduler_timer_arm(sched, event);
 }
-
@@ -31,7 +31,9 @@
 #ifndef _SCHEDULER_H_
 #define _SCHEDULER_H_
 
+#include <pthread.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 
 #include "list.h"
 
@@ -40,15 +42,82 @@
 #define SCHEDULER_POLL_EXCEPT_FD     0x4
 #define SCHEDULER_POLL_TIMEOUT       0x8
 
+/*
+ * Event dispatch backends. The select backend rebuilds its fd sets on every
+ * iteration; the epoll backends keep the interest set in the kernel and only
+ * update it when an event is registered, masked or unregistered.
+ *
+ * Edge-triggered epoll requires every callback to drain its file descriptor,
+ * so it is only selected on request (TAPDISK3_SCHEDULER=epoll-et).
+ */
+enum scheduler_backend {
+	SCHEDULER_BACKEND_SELECT     = 0,
+	SCHEDULER_BACKEND_EPOLL      = 1,
+	SCHEDULER_BACKEND_EPOLL_ET   = 2,
+};
+
+#define SCHEDULER_EVENT_HASH_SIZE    256
+#define SCHEDULER_EPOLL_MAX_EVENTS   128
+
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct scheduler_fd;
+
+typedef struct scheduler_work        scheduler_work_t;
+typedef void (*scheduler_work_fn_t) (scheduler_work_t *);
+
+/*
+ * Work the event loop runs once, after the events of its next
+ * iteration, which then does not wait. It is either deferred from the
+ * loop itself or posted to it from another thread, not both.
+ */
+struct scheduler_work {
+	scheduler_work_fn_t          fn;
+	struct list_head             next;
+	int                          queued;
+};
+
+static inline void
+scheduler_work_init(scheduler_work_t *work, scheduler_work_fn_t fn)
+{
+	work->fn     = fn;
+	work->queued = 0;
+	INIT_LIST_HEAD(&work->next);
+}
+
 typedef struct scheduler {
 	fd_set                       read_fds;
 	fd_set                       write_fds;
 	fd_set                       except_fds;
 
+	enum scheduler_backend       backend;
+	int                          epoll_fd;
+	struct epoll_event           epoll_events[SCHEDULER_EPOLL_MAX_EVENTS];
+
+	/*
+	 * Per-fd interest state for the epoll backends, indexed by fd.
+	 */
+	struct scheduler_fd        **fds;
+	int                          n_fds;
+
+	/*
+	 * File descriptors epoll refuses to watch (e.g. regular files),
+	 * which select(2) would always report ready.
+	 */
+	struct list_head             always_ready;
+
 	struct list_head             events;
+	struct list_head             pending;
+	struct list_head             dead;
+	struct list_head             hash[SCHEDULER_EVENT_HASH_SIZE];
+
+	/*
+	 * Binary min-heap of the armed timeout events, ordered by deadline.
+	 */
+	struct event               **timers;
+	int                          n_timers;
+	int                          max_timers;
 
 	int                          uuid;
 	int                          uuid_overflow;
@@ -56,11 +125,35 @@ typedef struct scheduler {
 	struct timeval               timeout;
 	struct timeval               max_timeout;
 	int                          depth;
+
+	struct list_head             deferred;
+
+	/*
+	 * Work posted by other threads, who wake the loop through
+	 * wake_fd. The event is registered by the first wait.
+	 */
+	pthread_mutex_t              post_lock;
+	struct list_head             posted;
+	int                          wake_fd;
+	event_id_t                   wake_evid;
 } scheduler_t;
 
 
 void scheduler_initialize(scheduler_t *);
 
+/**
+ * Releases the backend resources (e.g. the epoll file descriptor) acquired
+ * by scheduler_initialize.
+ */
+void scheduler_uninitialize(scheduler_t *);
+
+/**
+ * Switches the event dispatch backend. Must be called before any event is
+ * registered. Returns 0 on success or a negative error code, in which case
+ * the scheduler keeps its current backend.
+ */
+int scheduler_set_backend(scheduler_t *, enum scheduler_backend);
+
 /**
  * Registers an event.
  *
@@ -77,4 +170,25 @@ void scheduler_set_max_timeout(scheduler_t *, struct timeval);
 int scheduler_wait_for_events(scheduler_t *);
 int scheduler_event_set_timeout(scheduler_t *sched, event_id_t event_id,
 		struct timeval timeo);
+
+/**
+ * Runs @work on the next iteration of the event loop. Called on the
+ * loop, no-op if the work is queued already.
+ */
+void scheduler_defer(scheduler_t *, scheduler_work_t *);
+
+/**
+ * Likewise, from any thread, waking the loop.
+ */
+void scheduler_post(scheduler_t *, scheduler_work_t *);
+
+/**
+ * Takes deferred or posted work back before it runs. Called on the loop.
+ */
+void scheduler_cancel(scheduler_t *, scheduler_work_t *);
+
+/**
+ * Makes the loop return from its wait, from any thread.
+ */
+void scheduler_wakeup(scheduler_t *);
 #endif
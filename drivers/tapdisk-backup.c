@@ -0,0 +1,639 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-log.h"
+#include "tapdisk-nbdserver.h"
+#include "tapdisk-backup.h"
+
+#define INFO(_f, _a...)            tlog_syslog(TLOG_INFO, "backup: " _f, ##_a)
+#define ERR(_f, _a...)             tlog_syslog(TLOG_WARN, "backup: " _f, ##_a)
+
+#define BUG_ON(_cond)              if (unlikely(_cond)) { td_panic(); }
+#define MIN(a, b)                  ((a) < (b) ? (a) : (b))
+
+#define TD_BACKUP_BLOCK_SHIFT      7
+#define TD_BACKUP_BLOCK_SECS       (1 << TD_BACKUP_BLOCK_SHIFT)
+#define TD_BACKUP_BLOCK_SIZE       (TD_BACKUP_BLOCK_SECS << SECTOR_SHIFT)
+
+/* a block being read from the VBD, to be copied aside */
+struct td_backup_copy {
+	td_backup_t                *b;
+	uint64_t                    block;
+	char                       *buf;
+	struct td_iovec             iov;
+	td_vbd_request_t            vreq;
+};
+
+/* a read of the export, done once all of its parts are */
+struct td_backup_req {
+	td_vbd_request_t           *parent;
+	int                         pending;
+	int                         error;
+};
+
+/* the part of an export read which goes to the VBD */
+struct td_backup_read {
+	td_backup_t                *b;
+	struct td_backup_req       *req;
+	struct td_iovec             iov;
+	td_vbd_request_t            vreq;
+	struct list_head            entry;
+};
+
+struct td_backup {
+	td_vbd_t                   *vbd;
+	td_nbdserver_t             *server;
+	int                         fd;
+
+	td_sector_t                 size;
+	uint64_t                    blocks;
+	unsigned char              *copied;
+	unsigned char              *copying;
+
+	/* guest requests waiting for copies, or for the reads below */
+	struct list_head            held;
+	/* export reads from the VBD in flight */
+	struct list_head            reads;
+
+	/* copies and reads queued or in flight */
+	int                         inflight;
+	int                         failed;
+
+	uint64_t                    n_copied;
+	uint64_t                    n_holds;
+	uint64_t                    n_reads;
+};
+
+static inline int
+tapdisk_backup_test(unsigned char *map, uint64_t block)
+{
+	return !!(map[block >> 3] & (1 << (block & 7)));
+}
+
+static inline void
+tapdisk_backup_set(unsigned char *map, uint64_t block)
+{
+	map[block >> 3] |= 1 << (block & 7);
+}
+
+static inline void
+tapdisk_backup_clear(unsigned char *map, uint64_t block)
+{
+	map[block >> 3] &= ~(1 << (block & 7));
+}
+
+static void
+tapdisk_backup_free(td_backup_t *b)
+{
+	if (b->server)
+		tapdisk_nbdserver_free(b->server);
+
+	if (b->fd >= 0)
+		close(b->fd);
+
+	free(b->copied);
+	free(b->copying);
+	free(b);
+}
+
+/*
+ * The file is unlinked right away: nothing outlives the tapdisk, and
+ * blocks never copied take no space.
+ */
+static int
+tapdisk_backup_open_store(td_backup_t *b)
+{
+	const char *dir;
+	char *path;
+	int err;
+
+	dir = getenv("TAPDISK3_BACKUP_DIR") ? : TD_BACKUP_DIR;
+
+	if (asprintf(&path, "%s/tapdisk-backup-XXXXXX", dir) < 0)
+		return -ENOMEM;
+
+	b->fd = mkstemp(path);
+	if (b->fd < 0) {
+		err = -errno;
+		ERR("%s: cannot create %s: %d", b->vbd->name, path, err);
+		free(path);
+		return err;
+	}
+
+	unlink(path);
+	free(path);
+
+	if (ftruncate(b->fd, b->size << SECTOR_SHIFT))
+		return -errno;
+
+	return 0;
+}
+
+static int
+tapdisk_backup_pwrite(td_backup_t *b, const char *buf, td_sector_t sec,
+		      td_sector_t secs)
+{
+	size_t len = secs << SECTOR_SHIFT;
+	off_t off = sec << SECTOR_SHIFT;
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(b->fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += n;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_backup_pread(td_backup_t *b, char *buf, td_sector_t sec,
+		     td_sector_t secs)
+{
+	size_t len = secs << SECTOR_SHIFT;
+	off_t off = sec << SECTOR_SHIFT;
+	ssize_t n;
+
+	while (len) {
+		n = pread(b->fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!n)
+			return -EIO;
+		buf += n;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Held requests go back to the queue, to be looked at again. */
+static void
+tapdisk_backup_release(td_backup_t *b)
+{
+	if (list_empty(&b->held))
+		return;
+
+	list_splice(&b->held, &b->vbd->new_requests);
+	INIT_LIST_HEAD(&b->held);
+}
+
+static void
+tapdisk_backup_fail(td_backup_t *b, uint64_t block, int err)
+{
+	if (!b->failed)
+		ERR("%s: copying block %"PRIu64" failed: %d, failing the "
+		    "export", b->vbd->name, block, err);
+
+	b->failed = 1;
+	tapdisk_backup_release(b);
+}
+
+/* -- copy-before-write -- */
+
+static void
+tapdisk_backup_copy_done(td_vbd_request_t *vreq, int err, void *token,
+			 int final)
+{
+	struct td_backup_copy *cp = token;
+	td_backup_t *b = cp->b;
+
+	if (!err)
+		err = tapdisk_backup_pwrite(b, cp->buf, vreq->sec,
+					    cp->iov.secs);
+
+	tapdisk_backup_clear(b->copying, cp->block);
+	b->inflight--;
+
+	if (err)
+		tapdisk_backup_fail(b, cp->block, err);
+	else {
+		tapdisk_backup_set(b->copied, cp->block);
+		b->n_copied++;
+	}
+
+	free(cp->buf);
+	free(cp);
+
+	tapdisk_backup_release(b);
+}
+
+/*
+ * The copy is read through the VBD like a guest read. It goes out with
+ * the guest's priority, since a guest write is waiting for it.
+ */
+static int
+tapdisk_backup_copy(td_backup_t *b, uint64_t block)
+{
+	struct td_backup_copy *cp;
+	td_vbd_request_t *vreq;
+	td_sector_t sec;
+	int err;
+
+	cp = calloc(1, sizeof(*cp));
+	if (!cp)
+		return -ENOMEM;
+
+	err = posix_memalign((void **)&cp->buf, 4096, TD_BACKUP_BLOCK_SIZE);
+	if (err) {
+		free(cp);
+		return -err;
+	}
+
+	sec = block << TD_BACKUP_BLOCK_SHIFT;
+
+	cp->b        = b;
+	cp->block    = block;
+	cp->iov.base = cp->buf;
+	cp->iov.secs = MIN(TD_BACKUP_BLOCK_SECS, b->size - sec);
+
+	vreq = &cp->vreq;
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = sec;
+	vreq->iov    = &cp->iov;
+	vreq->iovcnt = 1;
+	vreq->prio   = TD_PRIO_FOREGROUND;
+	vreq->cb     = tapdisk_backup_copy_done;
+	vreq->token  = cp;
+	vreq->name   = "backup-copy";
+
+	err = tapdisk_vbd_queue_request(b->vbd, vreq);
+	if (err) {
+		free(cp->buf);
+		free(cp);
+		return err;
+	}
+
+	tapdisk_backup_set(b->copying, block);
+	b->inflight++;
+
+	return 0;
+}
+
+/*
+ * An export read from the VBD must be done before the blocks it reads
+ * change, even if they were copied aside meanwhile.
+ */
+static int
+tapdisk_backup_reading(td_backup_t *b, td_sector_t sec, td_sector_t secs)
+{
+	struct td_backup_read *r;
+
+	list_for_each_entry(r, &b->reads, entry)
+		if (r->vreq.sec < sec + secs && sec < r->vreq.sec + r->iov.secs)
+			return 1;
+
+	return 0;
+}
+
+/* -- export reads -- */
+
+static void
+tapdisk_backup_req_put(struct td_backup_req *req)
+{
+	td_vbd_request_t *parent = req->parent;
+
+	if (--req->pending)
+		return;
+
+	parent->cb(parent, req->error, parent->token, 1);
+	free(req);
+}
+
+static void
+tapdisk_backup_read_done(td_vbd_request_t *vreq, int err, void *token,
+			 int final)
+{
+	struct td_backup_read *r = token;
+	td_backup_t *b = r->b;
+
+	list_del(&r->entry);
+	b->inflight--;
+
+	if (err && !r->req->error)
+		r->req->error = err;
+	tapdisk_backup_req_put(r->req);
+	free(r);
+
+	tapdisk_backup_release(b);
+}
+
+static int
+tapdisk_backup_read_vbd(td_backup_t *b, struct td_backup_req *req,
+			char *buf, td_sector_t sec, td_sector_t secs)
+{
+	struct td_backup_read *r;
+	td_vbd_request_t *vreq;
+	int err;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+
+	r->b        = b;
+	r->req      = req;
+	r->iov.base = buf;
+	r->iov.secs = secs;
+
+	vreq = &r->vreq;
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = sec;
+	vreq->iov    = &r->iov;
+	vreq->iovcnt = 1;
+	vreq->prio   = req->parent->prio;
+	vreq->cb     = tapdisk_backup_read_done;
+	vreq->token  = r;
+	vreq->name   = "backup-read";
+
+	err = tapdisk_vbd_queue_request(b->vbd, vreq);
+	if (err) {
+		free(r);
+		return err;
+	}
+
+	list_add_tail(&r->entry, &b->reads);
+	req->pending++;
+	b->inflight++;
+
+	return 0;
+}
+
+/*
+ * Splits the read into runs of blocks either copied aside or not: the
+ * former are read from the file right away, the latter through the VBD.
+ */
+int
+tapdisk_backup_queue_read(td_backup_t *b, td_vbd_request_t *vreq)
+{
+	struct td_backup_req *req;
+	td_sector_t sec, end, run;
+	char *buf;
+	int copied, err;
+
+	if (vreq->op != TD_OP_READ || vreq->iovcnt != 1)
+		return -EINVAL;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return -ENOMEM;
+
+	gettimeofday(&vreq->ts, NULL);
+	req->parent  = vreq;
+	req->pending = 1;
+	b->n_reads++;
+
+	if (b->failed) {
+		req->error = -EIO;
+		goto out;
+	}
+
+	sec = vreq->sec;
+	end = MIN(sec + vreq->iov[0].secs, b->size);
+	buf = vreq->iov[0].base;
+
+	while (sec < end) {
+		copied = tapdisk_backup_test(b->copied,
+					     sec >> TD_BACKUP_BLOCK_SHIFT);
+
+		run = MIN(end, ((sec >> TD_BACKUP_BLOCK_SHIFT) + 1) <<
+			  TD_BACKUP_BLOCK_SHIFT) - sec;
+		while (sec + run < end &&
+		       tapdisk_backup_test(b->copied, (sec + run) >>
+					   TD_BACKUP_BLOCK_SHIFT) == copied)
+			run = MIN(end, sec + run + TD_BACKUP_BLOCK_SECS) - sec;
+
+		if (copied)
+			err = tapdisk_backup_pread(b, buf, sec, run);
+		else
+			err = tapdisk_backup_read_vbd(b, req, buf, sec, run);
+		if (err) {
+			req->error = err;
+			break;
+		}
+
+		buf += run << SECTOR_SHIFT;
+		sec += run;
+	}
+
+out:
+	tapdisk_backup_req_put(req);
+	return 0;
+}
+
+int
+tapdisk_backup_copied(td_backup_t *b, td_sector_t sec, td_sector_t secs)
+{
+	uint64_t block, last;
+
+	if (!secs || sec >= b->size)
+		return 0;
+
+	last = MIN(sec + secs - 1, b->size - 1) >> TD_BACKUP_BLOCK_SHIFT;
+	for (block = sec >> TD_BACKUP_BLOCK_SHIFT; block <= last; block++)
+		if (tapdisk_backup_test(b->copied, block))
+			return 1;
+
+	return 0;
+}
+
+/* -- interface -- */
+
+int
+tapdisk_backup_start(td_vbd_t *vbd)
+{
+	td_disk_info_t info;
+	td_backup_t *b;
+	int err;
+
+	if (vbd->backup)
+		return -EALREADY;
+
+	err = tapdisk_vbd_get_disk_info(vbd, &info);
+	if (err)
+		return err;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+
+	b->vbd    = vbd;
+	b->fd     = -1;
+	b->size   = info.size;
+	b->blocks = (b->size + TD_BACKUP_BLOCK_SECS - 1) >>
+		TD_BACKUP_BLOCK_SHIFT;
+	INIT_LIST_HEAD(&b->held);
+	INIT_LIST_HEAD(&b->reads);
+
+	b->copied  = calloc((b->blocks + 7) >> 3, 1);
+	b->copying = calloc((b->blocks + 7) >> 3, 1);
+	if (!b->copied || !b->copying) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = tapdisk_backup_open_store(b);
+	if (err)
+		goto fail;
+
+	b->server = tapdisk_nbdserver_alloc_backup(vbd, info, b);
+	if (!b->server) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = tapdisk_nbdserver_listen_unix(b->server);
+	if (err)
+		goto fail;
+
+	INFO("%s: exporting the disk as of now, %"PRIu64" blocks",
+	     vbd->name, b->blocks);
+
+	vbd->backup = b;
+	return 0;
+
+fail:
+	tapdisk_backup_free(b);
+	return err;
+}
+
+void
+tapdisk_backup_stop(td_vbd_t *vbd)
+{
+	td_backup_t *b = vbd->backup;
+
+	if (!b)
+		return;
+
+	BUG_ON(b->inflight);
+
+	INFO("%s: export stopped, %"PRIu64" of %"PRIu64" blocks copied",
+	     vbd->name, b->n_copied, b->blocks);
+
+	vbd->backup = NULL;
+	tapdisk_backup_free(b);
+}
+
+int
+tapdisk_backup_hold(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	td_backup_t *b = vbd->backup;
+	uint64_t block, last;
+	td_sector_t secs = 0;
+	int i, hold, err;
+
+	if (!b || b->failed ||
+	    vreq->op == TD_OP_READ || vreq->op == TD_OP_FLUSH)
+		return 0;
+
+	for (i = 0; i < vreq->iovcnt; i++)
+		secs += vreq->iov[i].secs;
+
+	if (!secs || vreq->sec >= b->size)
+		return 0;
+
+	hold = 0;
+	last = MIN(vreq->sec + secs - 1, b->size - 1) >> TD_BACKUP_BLOCK_SHIFT;
+
+	for (block = vreq->sec >> TD_BACKUP_BLOCK_SHIFT; block <= last;
+	     block++) {
+		if (tapdisk_backup_test(b->copied, block))
+			continue;
+
+		hold = 1;
+		if (tapdisk_backup_test(b->copying, block))
+			continue;
+
+		err = tapdisk_backup_copy(b, block);
+		if (err) {
+			tapdisk_backup_fail(b, block, err);
+			return 0;
+		}
+	}
+
+	if (!hold && !tapdisk_backup_reading(b, vreq->sec, secs))
+		return 0;
+
+	list_move_tail(&vreq->next, &b->held);
+	b->n_holds++;
+
+	return 1;
+}
+
+int
+tapdisk_backup_busy(td_vbd_t *vbd)
+{
+	return vbd->backup && vbd->backup->inflight;
+}
+
+void
+tapdisk_backup_stats(td_vbd_t *vbd, td_stats_t *st)
+{
+	td_backup_t *b = vbd->backup;
+
+	if (!b)
+		return;
+
+	tapdisk_stats_field(st, "backup", "{");
+	tapdisk_stats_field(st, "socket", "s", b->server->sockpath);
+	tapdisk_stats_field(st, "blocks", "llu", (unsigned long long)b->blocks);
+	tapdisk_stats_field(st, "copied", "llu",
+			    (unsigned long long)b->n_copied);
+	tapdisk_stats_field(st, "holds", "llu",
+			    (unsigned long long)b->n_holds);
+	tapdisk_stats_field(st, "reads", "llu",
+			    (unsigned long long)b->n_reads);
+	tapdisk_stats_field(st, "inflight", "d", b->inflight);
+	tapdisk_stats_field(st, "failed", "d", b->failed);
+	tapdisk_stats_leave(st, '}');
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_BACKUP_H_
+#define _TAPDISK_BACKUP_H_
+
+#include "tapdisk.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Point-in-time export of a live VBD, for backups. From the moment it
+ * starts, the first guest write to each block is held back until the old
+ * contents of the block are copied aside (copy-before-write), into an
+ * unlinked sparse file under TAPDISK3_BACKUP_DIR (TD_BACKUP_DIR by
+ * default) at the block's own offset. A read-only NBD server, listening
+ * on TAPDISK_NBDSERVER_BACKUP_SOCK_PATH<pid>.<uuid>, serves the disk as
+ * it was: copied blocks from the file, the others from the VBD. Backups
+ * need no snapshot of the chain, no pause and no coalesce after.
+ *
+ * Writes in flight when the export starts may or may not be part of it,
+ * as after a crash. Once a block fails to be copied, all reads of the
+ * export fail: a backup with a hole in it is worse than none.
+ */
+
+#define TD_BACKUP_DIR               "/var/tmp"
+
+typedef struct td_backup td_backup_t;
+
+int tapdisk_backup_start(td_vbd_t *vbd);
+
+/*
+ * Ends the export, its clients and the copied blocks go. Nothing in
+ * flight, see busy.
+ */
+void tapdisk_backup_stop(td_vbd_t *vbd);
+
+/*
+ * A new request about to be issued. Returns non-zero if it was taken off
+ * the queue, it goes back once the blocks it changes are copied aside.
+ */
+int tapdisk_backup_hold(td_vbd_t *vbd, td_vbd_request_t *vreq);
+
+/* Non-zero while requests of the export are queued or in flight. */
+int tapdisk_backup_busy(td_vbd_t *vbd);
+
+void tapdisk_backup_stats(td_vbd_t *vbd, td_stats_t *st);
+
+/*
+ * Reads for the NBD server: @vreq is read as the disk was, and completed
+ * through its callback, maybe before this returns.
+ */
+int tapdisk_backup_queue_read(td_backup_t *b, td_vbd_request_t *vreq);
+
+/* Non-zero if any block in the range was copied aside. */
+int tapdisk_backup_copied(td_backup_t *b, td_sector_t sec, td_sector_t secs);
+
+#endif /* _TAPDISK_BACKUP_H_ */
@@ -0,0 +1,728 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Drives one VDI through tapdisk_vbd_queue_request() with a synthetic
+ * workload and reports throughput and completion latency, so changes to
+ * the request path can be measured over any driver stack:
+ *
+ *   tapdisk-bench -n ram:/path -b 4 -d 32 -R -t 10
+ *   tapdisk-bench -n vhd:/path/leaf.vhd -b 64 -m 70 -w -c 100000
+ *
+ * Writes are only issued with -w, as they overwrite the image.
+ *
+ * With -H, it measures the content hashes of td-hash.h instead, over
+ * blocks of -b KiB:
+ *
+ *   tapdisk-bench -H all -b 4 -t 2
+ *
+ * With -S, it spawns the tapdisk binary given the way tap-ctl does, -c
+ * times, and reports the time until each printed its control socket:
+ *
+ *   tapdisk-bench -S /usr/bin/tapdisk -c 50
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "scheduler.h"
+#include "blktap2.h"
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "td-hash.h"
+
+#define MIN(a, b)                        ((a) < (b) ? (a) : (b))
+#define MAX(a, b)                        ((a) > (b) ? (a) : (b))
+#define BUG_ON(_cond)                    if (unlikely(_cond)) { td_panic(); }
+
+#define TD_BENCH_MAX_DEPTH               1024
+#define TD_BENCH_MAX_BLOCK_SIZE          (16 << 20)
+#define TD_BENCH_HASH_BLOCKS             64
+#define TD_BENCH_SPAWNS                  20
+
+/*
+ * Latencies are kept in a log-linear histogram: 2^TD_BENCH_SUB_SHIFT
+ * buckets per power of two nanoseconds, for a relative error under
+ * 1/2^TD_BENCH_SUB_SHIFT whatever the scale.
+ */
+#define TD_BENCH_SUB_SHIFT               4
+#define TD_BENCH_SUB_BUCKETS             (1 << TD_BENCH_SUB_SHIFT)
+#define TD_BENCH_BUCKETS                 (64 * TD_BENCH_SUB_BUCKETS)
+
+typedef struct tapdisk_bench_request td_bench_req_t;
+typedef struct tapdisk_bench td_bench_t;
+
+struct tapdisk_bench_request {
+	void                            *buf;
+	struct td_iovec                  iov;
+	td_vbd_request_t                 vreq;
+	uint64_t                         start;
+};
+
+struct tapdisk_bench {
+	const char                      *name;
+	td_vbd_t                        *vbd;
+
+	/* workload */
+	td_sector_t                      size;
+	unsigned int                     secs;
+	int                              depth;
+	int                              random;
+	int                              read_pct;
+	uint64_t                         count;
+	uint64_t                         duration;
+	uint64_t                         rng;
+
+	/* state */
+	int                              err;
+	int                              inflight;
+	td_sector_t                      next;
+	uint64_t                         issued;
+	uint64_t                         t_start;
+	uint64_t                         t_end;
+	td_bench_req_t                  *reqs;
+
+	/* results */
+	uint64_t                         reads;
+	uint64_t                         writes;
+	uint64_t                         lat_max;
+	uint64_t                         lat_hist[TD_BENCH_BUCKETS];
+};
+
+static char *program;
+static td_bench_t bench;
+
+static void tapdisk_bench_issue(td_bench_t *, td_bench_req_t *);
+
+static void
+usage(FILE *stream)
+{
+	fprintf(stream, "usage: %s <-n type:/path/to/image> "
+		"[-b block size in KiB (default 4)] "
+		"[-d queue depth (default 1, max %d)] "
+		"[-R random offsets] [-m read percentage (default 100)] "
+		"[-w allow writes] [-c request count] "
+		"[-t seconds (default 10)] [-s seed]\n"
+		"       %s <-H hash name|all> [-b block size in KiB] "
+		"[-c block count] [-t seconds]\n"
+		"       %s <-S /path/to/tapdisk> [-c spawn count (default %d)]\n",
+		program, TD_BENCH_MAX_DEPTH, program, program,
+		TD_BENCH_SPAWNS);
+}
+
+static inline uint64_t
+tapdisk_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t
+tapdisk_bench_rand(td_bench_t *b)
+{
+	/* xorshift64*, reproducible for a given -s */
+	b->rng ^= b->rng >> 12;
+	b->rng ^= b->rng << 25;
+	b->rng ^= b->rng >> 27;
+	return b->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static int
+tapdisk_bench_bucket(uint64_t ns)
+{
+	int msb;
+
+	if (ns < TD_BENCH_SUB_BUCKETS)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - TD_BENCH_SUB_SHIFT + 1) << TD_BENCH_SUB_SHIFT) +
+		((ns >> (msb - TD_BENCH_SUB_SHIFT)) & (TD_BENCH_SUB_BUCKETS - 1));
+}
+
+/* upper bound of the latencies counted in a bucket */
+static uint64_t
+tapdisk_bench_bucket_max(int bucket)
+{
+	int exp, sub;
+
+	if (bucket < TD_BENCH_SUB_BUCKETS)
+		return bucket;
+
+	exp = (bucket >> TD_BENCH_SUB_SHIFT) + TD_BENCH_SUB_SHIFT - 1;
+	sub = bucket & (TD_BENCH_SUB_BUCKETS - 1);
+
+	return ((uint64_t)(TD_BENCH_SUB_BUCKETS + sub + 1) <<
+		(exp - TD_BENCH_SUB_SHIFT)) - 1;
+}
+
+static uint64_t
+tapdisk_bench_percentile(td_bench_t *b, double pct)
+{
+	uint64_t total, want, seen;
+	int i;
+
+	total = b->reads + b->writes;
+	if (!total)
+		return 0;
+
+	want = (uint64_t)(total * pct / 100.0);
+	if (want >= total)
+		want = total - 1;
+
+	for (seen = 0, i = 0; i < TD_BENCH_BUCKETS; i++) {
+		seen += b->lat_hist[i];
+		if (seen > want)
+			return MIN(tapdisk_bench_bucket_max(i), b->lat_max);
+	}
+
+	return b->lat_max;
+}
+
+static int
+tapdisk_bench_done(td_bench_t *b)
+{
+	if (b->err)
+		return 1;
+
+	if (b->count)
+		return b->issued >= b->count;
+
+	return tapdisk_bench_now() - b->t_start >= b->duration;
+}
+
+static void
+tapdisk_bench_close_image(td_bench_t *b)
+{
+	td_vbd_t *vbd = b->vbd;
+
+	if (!vbd)
+		return;
+
+	tapdisk_vbd_close_vdi(vbd);
+	tapdisk_server_remove_vbd(vbd);
+	free(vbd->name);
+	free(vbd);
+	b->vbd = NULL;
+}
+
+static void
+__tapdisk_bench_request_cb(td_vbd_request_t *vreq, int error,
+			   void *token, int final)
+{
+	td_bench_req_t *req = token;
+	td_bench_t *b = &bench;
+	uint64_t lat;
+
+	BUG_ON(b->inflight <= 0);
+	b->inflight--;
+
+	if (error) {
+		fprintf(stderr, "error %d at sector %"PRIu64"\n",
+			error, vreq->sec);
+		b->err = EIO;
+	} else {
+		lat = tapdisk_bench_now() - req->start;
+
+		if (vreq->op == TD_OP_READ)
+			b->reads++;
+		else
+			b->writes++;
+
+		b->lat_hist[tapdisk_bench_bucket(lat)]++;
+		b->lat_max = MAX(b->lat_max, lat);
+	}
+
+	if (!tapdisk_bench_done(b)) {
+		tapdisk_bench_issue(b, req);
+		return;
+	}
+
+	if (!b->inflight) {
+		b->t_end = tapdisk_bench_now();
+		tapdisk_bench_close_image(b);
+	}
+}
+
+static void
+tapdisk_bench_issue(td_bench_t *b, td_bench_req_t *req)
+{
+	td_vbd_request_t *vreq = &req->vreq;
+	td_sector_t blocks = b->size / b->secs;
+	int err;
+
+	memset(vreq, 0, sizeof(*vreq));
+
+	if (b->random)
+		vreq->sec = (tapdisk_bench_rand(b) % blocks) * b->secs;
+	else {
+		vreq->sec = b->next;
+		b->next  += b->secs;
+		if (b->next + b->secs > b->size)
+			b->next = 0;
+	}
+
+	vreq->op = TD_OP_READ;
+	if (b->read_pct < 100 &&
+	    tapdisk_bench_rand(b) % 100 >= (uint64_t)b->read_pct)
+		vreq->op = TD_OP_WRITE;
+
+	req->iov.base = req->buf;
+	req->iov.secs = b->secs;
+
+	vreq->iov    = &req->iov;
+	vreq->iovcnt = 1;
+	vreq->token  = req;
+	vreq->cb     = __tapdisk_bench_request_cb;
+
+	b->issued++;
+	b->inflight++;
+	req->start = tapdisk_bench_now();
+
+	err = tapdisk_vbd_queue_request(b->vbd, vreq);
+	if (err)
+		__tapdisk_bench_request_cb(vreq, err, req, 1);
+}
+
+static int
+tapdisk_bench_open(td_bench_t *b)
+{
+	td_disk_info_t info;
+	size_t len;
+	int i, err;
+
+	err = tapdisk_server_initialize(NULL, NULL);
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_initialize(-1, -1, 0);
+	if (err)
+		goto out;
+
+	b->vbd = tapdisk_server_get_vbd(0);
+	if (!b->vbd) {
+		err = ENODEV;
+		goto out;
+	}
+
+	err = tapdisk_vbd_open_vdi(b->vbd, b->name,
+				   b->read_pct < 100 ? 0 : TD_OPEN_RDONLY, -1);
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_get_disk_info(b->vbd, &info);
+	if (err)
+		goto out;
+
+	b->size = info.size;
+	if (b->size < b->secs) {
+		fprintf(stderr, "image smaller than one block\n");
+		err = EINVAL;
+		goto out;
+	}
+
+	b->reqs = calloc(b->depth, sizeof(*b->reqs));
+	if (!b->reqs) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	len = (size_t)b->secs << SECTOR_SHIFT;
+	for (i = 0; i < b->depth; i++) {
+		b->reqs[i].buf = mmap(NULL, len, PROT_READ|PROT_WRITE,
+				      MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+		if (b->reqs[i].buf == MAP_FAILED) {
+			b->reqs[i].buf = NULL;
+			err = errno;
+			goto out;
+		}
+		/* what gets written, and touches the pages up front */
+		memset(b->reqs[i].buf, 0xa5 ^ i, len);
+	}
+
+out:
+	if (err)
+		fprintf(stderr, "failed to open %s: %d\n", b->name, err);
+	return err;
+}
+
+static void
+tapdisk_bench_close(td_bench_t *b)
+{
+	size_t len = (size_t)b->secs << SECTOR_SHIFT;
+	int i;
+
+	tapdisk_bench_close_image(b);
+
+	if (b->reqs)
+		for (i = 0; i < b->depth; i++)
+			if (b->reqs[i].buf)
+				munmap(b->reqs[i].buf, len);
+	free(b->reqs);
+	b->reqs = NULL;
+}
+
+static void
+tapdisk_bench_report(td_bench_t *b)
+{
+	uint64_t ops = b->reads + b->writes;
+	double secs = (b->t_end - b->t_start) / 1e9;
+
+	if (secs <= 0)
+		secs = 1e-9;
+
+	printf("%s: %u KiB %s, %d%% reads, depth %d\n", b->name,
+	       b->secs >> 1, b->random ? "random" : "sequential",
+	       b->read_pct, b->depth);
+	printf("  ops %"PRIu64" (%"PRIu64" reads, %"PRIu64" writes) "
+	       "in %.3f s\n", ops, b->reads, b->writes, secs);
+	printf("  %.0f IOPS, %.2f MB/s\n", ops / secs,
+	       ops * ((double)b->secs * 512) / secs / 1e6);
+	printf("  latency us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f "
+	       "max %.1f\n",
+	       tapdisk_bench_percentile(b, 50) / 1e3,
+	       tapdisk_bench_percentile(b, 90) / 1e3,
+	       tapdisk_bench_percentile(b, 99) / 1e3,
+	       tapdisk_bench_percentile(b, 99.9) / 1e3,
+	       b->lat_max / 1e3);
+}
+
+/*
+ * Hashes TD_BENCH_HASH_BLOCKS random blocks round-robin, so a block is
+ * not always hot in L1, until -c blocks or -t is up.
+ */
+static int
+tapdisk_bench_hash(td_bench_t *b, const char *which)
+{
+	const td_hash_ops_t *ops;
+	size_t len = (size_t)b->secs << SECTOR_SHIFT;
+	uint64_t *buf, n, sink, t, i;
+	double secs;
+	int a, found;
+
+	buf = malloc(len * TD_BENCH_HASH_BLOCKS);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < len * TD_BENCH_HASH_BLOCKS / sizeof(*buf); i++)
+		buf[i] = tapdisk_bench_rand(b);
+
+	found = 0;
+	sink  = 0;
+	for (a = 0; (ops = td_hash_algorithms[a]); a++) {
+		if (strcmp(which, "all") && strcmp(which, ops->name))
+			continue;
+		found = 1;
+
+		b->t_start = tapdisk_bench_now();
+		for (n = 0;; n++) {
+			if (b->count && n >= b->count)
+				break;
+			if (!(n & 1023) && n) {
+				t = tapdisk_bench_now();
+				if (!b->count && t - b->t_start >= b->duration)
+					break;
+			}
+			sink ^= ops->hash((char *)buf +
+					  (n % TD_BENCH_HASH_BLOCKS) * len, len);
+		}
+		b->t_end = tapdisk_bench_now();
+
+		secs = (b->t_end - b->t_start) / 1e9;
+		if (secs <= 0)
+			secs = 1e-9;
+
+		printf("%-8s %s %u KiB: %.1f ns/block, %.2f GB/s\n",
+		       ops->name, ops->strong ? "strong" : "fast  ",
+		       b->secs >> 1, secs * 1e9 / (n ? : 1),
+		       n * (double)len / secs / 1e9);
+	}
+
+	free(buf);
+
+	if (!found) {
+		fprintf(stderr, "no hash %s\n", which);
+		return -EINVAL;
+	}
+
+	/* keeps the hashing from being optimized away */
+	return sink == 0x5a5a5a5a5a5a5a5aULL;
+}
+
+/*
+ * Forks and execs one tapdisk with stdout on a pipe, as tap-ctl spawn
+ * does, and returns the pid of the daemon once it printed its control
+ * socket.
+ */
+static pid_t
+tapdisk_bench_spawn_one(const char *path)
+{
+	char line[256];
+	int channel[2], status, pid;
+	pid_t child;
+	FILE *f;
+
+	if (pipe(channel))
+		return -errno;
+
+	child = fork();
+	if (child == -1) {
+		close(channel[0]);
+		close(channel[1]);
+		return -errno;
+	}
+
+	if (!child) {
+		close(channel[0]);
+		if (dup2(channel[1], STDOUT_FILENO) == -1)
+			_exit(1);
+		close(channel[1]);
+		execl(path, path, NULL);
+		_exit(1);
+	}
+
+	close(channel[1]);
+
+	pid = -EIO;
+	f = fdopen(channel[0], "r");
+	if (!f) {
+		pid = -errno;
+		close(channel[0]);
+	} else {
+		if (fgets(line, sizeof(line), f) &&
+		    sscanf(line, BLKTAP2_CONTROL_DIR"/"
+			   BLKTAP2_CONTROL_SOCKET"%d", &pid) != 1)
+			pid = -EIO;
+		fclose(f);
+	}
+
+	waitpid(child, &status, 0);
+
+	return pid;
+}
+
+/*
+ * Lets the daemon clean up after itself before the next one starts. We
+ * are its subreaper, so it is waited for here rather than left to init.
+ */
+static void
+tapdisk_bench_reap(pid_t pid)
+{
+	int i, status;
+
+	kill(pid, SIGINT);
+
+	for (i = 0; i < 5000; i++) {
+		if (waitpid(pid, &status, WNOHANG))
+			return;
+		usleep(1000);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+}
+
+/*
+ * Spawn-to-ready latency of tapdisk: from fork until the control socket
+ * is printed, which is when tap-ctl goes on to attach a VBD.
+ */
+static int
+tapdisk_bench_spawn(td_bench_t *b, const char *path)
+{
+	uint64_t n, t, lat;
+	pid_t pid;
+
+	if (!b->count)
+		b->count = TD_BENCH_SPAWNS;
+
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1))
+		return -errno;
+
+	for (n = 0; n < b->count; n++) {
+		t   = tapdisk_bench_now();
+		pid = tapdisk_bench_spawn_one(path);
+		lat = tapdisk_bench_now() - t;
+
+		if (pid < 0) {
+			fprintf(stderr, "failed to spawn %s: %s\n",
+				path, strerror(-pid));
+			return pid;
+		}
+
+		tapdisk_bench_reap(pid);
+
+		b->reads++;
+		b->lat_hist[tapdisk_bench_bucket(lat)]++;
+		b->lat_max = MAX(b->lat_max, lat);
+	}
+
+	printf("%s: %"PRIu64" spawns\n", path, b->reads);
+	printf("  spawn to ready us: p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+	       tapdisk_bench_percentile(b, 50) / 1e3,
+	       tapdisk_bench_percentile(b, 90) / 1e3,
+	       tapdisk_bench_percentile(b, 99) / 1e3,
+	       b->lat_max / 1e3);
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	td_bench_t *b = &bench;
+	unsigned long kib;
+	const char *hash, *spawn;
+	int c, i, err, writes;
+
+	program = basename(argv[0]);
+
+	memset(b, 0, sizeof(*b));
+	b->secs     = 4096 >> SECTOR_SHIFT;
+	b->depth    = 1;
+	b->read_pct = 100;
+	b->duration = 10;
+	b->rng      = 0x9e3779b97f4a7c15ULL;
+	writes      = 0;
+	hash        = NULL;
+	spawn       = NULL;
+
+	while ((c = getopt(argc, argv, "n:b:d:Rm:wc:t:s:H:S:h")) != -1) {
+		switch (c) {
+		case 'n':
+			b->name = optarg;
+			break;
+		case 'b':
+			kib = strtoul(optarg, NULL, 10);
+			if (!kib || (kib << 10) > TD_BENCH_MAX_BLOCK_SIZE)
+				goto fail_usage;
+			b->secs = kib << (10 - SECTOR_SHIFT);
+			break;
+		case 'd':
+			b->depth = atoi(optarg);
+			if (b->depth < 1 || b->depth > TD_BENCH_MAX_DEPTH)
+				goto fail_usage;
+			break;
+		case 'R':
+			b->random = 1;
+			break;
+		case 'm':
+			b->read_pct = atoi(optarg);
+			if (b->read_pct < 0 || b->read_pct > 100)
+				goto fail_usage;
+			break;
+		case 'w':
+			writes = 1;
+			break;
+		case 'c':
+			b->count = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			b->duration = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			b->rng = strtoull(optarg, NULL, 0) ? : b->rng;
+			break;
+		case 'H':
+			hash = optarg;
+			break;
+		case 'S':
+			spawn = optarg;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			goto fail_usage;
+		}
+	}
+
+	if (spawn)
+		return tapdisk_bench_spawn(b, spawn) ? 1 : 0;
+
+	if (hash) {
+		b->duration *= 1000000000ULL;
+		return tapdisk_bench_hash(b, hash) ? 1 : 0;
+	}
+
+	if (!b->name)
+		goto fail_usage;
+
+	if (b->read_pct < 100 && !writes) {
+		fprintf(stderr, "-m below 100 writes to the image, "
+			"confirm with -w\n");
+		goto fail_usage;
+	}
+
+	b->duration *= 1000000000ULL;
+
+	tapdisk_start_logging("tapdisk-bench", "daemon");
+
+	err = tapdisk_bench_open(b);
+	if (err)
+		goto out;
+
+	b->t_start = tapdisk_bench_now();
+	for (i = 0; i < b->depth && !tapdisk_bench_done(b); i++)
+		tapdisk_bench_issue(b, &b->reqs[i]);
+
+	if (b->vbd && b->inflight)
+		tapdisk_server_run();
+	if (!b->t_end)
+		b->t_end = tapdisk_bench_now();
+
+	err = b->err;
+	if (!err)
+		tapdisk_bench_report(b);
+
+out:
+	tapdisk_bench_close(b);
+	tapdisk_stop_logging();
+	return err;
+
+fail_usage:
+	usage(stderr);
+	return 1;
+}
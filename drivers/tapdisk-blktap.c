@@ -177,17 +177,25 @@ tapdisk_blktap_error_status(td_blktap_t *tap, int error)
 	return status;
 }
 
+/*
+ * Responses are only made visible to the kernel, with a single kick, by
+ * tapdisk_blktap_flush_responses() once per server loop iteration.
+ */
 static void
-__tapdisk_blktap_push_response(td_blktap_t *tap, int final)
+__tapdisk_blktap_push_response(td_blktap_t *tap)
 {
 	tap->rsp_prod_pvt++;
+	tap->stats.reqs.out++;
+}
 
-	if (final) {
-		tap->sring->rsp_prod = tap->rsp_prod_pvt;
-		tapdisk_blktap_kick(tap);
-	}
+void
+tapdisk_blktap_flush_responses(td_blktap_t *tap)
+{
+	if (!tap->vma || tap->sring->rsp_prod == tap->rsp_prod_pvt)
+		return;
 
-	tap->stats.reqs.out++;
+	tap->sring->rsp_prod = tap->rsp_prod_pvt;
+	tapdisk_blktap_kick(tap);
 }
 
 static void
@@ -204,12 +212,12 @@ tapdisk_blktap_fail_request(td_blktap_t *tap,
 	rsp->operation = msg->operation;
 	rsp->status    = tapdisk_blktap_error_status(tap, error);
 
-	__tapdisk_blktap_push_response(tap, 1);
+	__tapdisk_blktap_push_response(tap);
 }
 
 static void
 tapdisk_blktap_put_response(td_blktap_t *tap,
-			    td_blktap_req_t *req, int error, int final)
+			    td_blktap_req_t *req, int error)
 {
 	blktap_ring_rsp_t *rsp;
 	int op = 0;
@@ -244,16 +252,15 @@ tapdisk_blktap_put_response(td_blktap_t *tap,
 	rsp->operation = op;
 	rsp->status    = tapdisk_blktap_error_status(tap, error);
 
-	__tapdisk_blktap_push_response(tap, final);
+	__tapdisk_blktap_push_response(tap);
 }
 
 static void
 tapdisk_blktap_complete_request(td_blktap_t *tap,
-				td_blktap_req_t *req, int error,
-				int final)
+				td_blktap_req_t *req, int error)
 {
 	if (likely(tap->vma))
-		tapdisk_blktap_put_response(tap, req, error, final);
+		tapdisk_blktap_put_response(tap, req, error);
 
 	tapdisk_blktap_free_request(tap, req);
 }
@@ -265,7 +272,7 @@ __tapdisk_blktap_request_cb(td_vbd_request_t *vreq, int error,
 	td_blktap_req_t *req = container_of(vreq, td_blktap_req_t, vreq);
 	td_blktap_t *tap = token;
 
-	tapdisk_blktap_complete_request(tap, req, error, final);
+	tapdisk_blktap_complete_request(tap, req, error);
 }
 
 static void
@@ -365,36 +372,42 @@ fail:
 	return err;
 }
 
+/*
+ * Take in everything the kernel queued, including what it adds while we
+ * parse, so that one event harvests the whole batch.
+ */
 static void
 tapdisk_blktap_get_requests(td_blktap_t *tap)
 {
 	unsigned int rp, rc;
 	int err;
 
-	rp = tap->sring->req_prod;
+	rc = tap->req_cons;
 
-	for (rc = tap->req_cons; rc != rp; rc++) {
-		blktap_ring_req_t *msg = BLKTAP_GET_REQUEST(tap, rc);
-		td_blktap_req_t *req;
+	while (rc != (rp = tap->sring->req_prod)) {
+		for (; rc != rp; rc++) {
+			blktap_ring_req_t *msg = BLKTAP_GET_REQUEST(tap, rc);
+			td_blktap_req_t *req;
 
-		tap->stats.reqs.in++;
+			tap->stats.reqs.in++;
 
-		req = tapdisk_blktap_alloc_request(tap);
-		if (!req) {
-			err = -EFAULT;
-			goto fail_ring;
-		}
+			req = tapdisk_blktap_alloc_request(tap);
+			if (!req) {
+				err = -EFAULT;
+				goto fail_ring;
+			}
 
-		err = tapdisk_blktap_parse_request(tap, msg, req);
-		if (err) {
-			tapdisk_blktap_fail_request(tap, msg, err);
-			tapdisk_blktap_free_request(tap, req);
-			goto fail_ring;
-		}
+			err = tapdisk_blktap_parse_request(tap, msg, req);
+			if (err) {
+				tapdisk_blktap_fail_request(tap, msg, err);
+				tapdisk_blktap_free_request(tap, req);
+				goto fail_ring;
+			}
 
-		err = tapdisk_vbd_queue_request(tap->vbd, &req->vreq);
-		if (err)
-			tapdisk_blktap_complete_request(tap, req, err, 1);
+			err = tapdisk_vbd_queue_request(tap->vbd, &req->vreq);
+			if (err)
+				tapdisk_blktap_complete_request(tap, req, err);
+		}
 	}
 
 	tap->req_cons = rc;
@@ -542,6 +555,9 @@ __tapdisk_blktap_close(td_blktap_t *tap)
 	 * gone, so we'll drain, then idle until close().
 	 */
         int err;
+
+	tapdisk_blktap_flush_responses(tap);
+
 	if (tap->event_id >= 0) {
 		tapdisk_server_unregister_event(tap->event_id);
 		tap->event_id = -1;
@@ -85,5 +85,6 @@ int tapdisk_blktap_create_device(td_blktap_t *, const td_disk_info_t *, int ro);
 int tapdisk_blktap_remove_device(td_blktap_t *);
 
 void tapdisk_blktap_stats(td_blktap_t *, td_stats_t *);
+void tapdisk_blktap_flush_responses(td_blktap_t *);
 
 #endif /* _TAPDISK_BLKTAP_H_ */
@@ -0,0 +1,612 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <inttypes.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-log.h"
+#include "tapdisk-bootprof.h"
+#include "timeout-math.h"
+
+#define INFO(_f, _a...)            tlog_syslog(TLOG_INFO, "bootprof: " _f, ##_a)
+#define ERR(_f, _a...)             tlog_syslog(TLOG_WARN, "bootprof: " _f, ##_a)
+
+#define MIN(a, b)                  ((a) < (b) ? (a) : (b))
+
+#define TD_BOOTPROF_DEFAULT_MB     512
+#define TD_BOOTPROF_MAX_EXTENTS    (1 << 20)
+
+/* prefetch requests in flight, and sectors each */
+#define TD_BOOTPROF_DEPTH          4
+#define TD_BOOTPROF_CHUNK_SECS     2048
+
+struct td_bootprof_read {
+	td_bootprof_t              *bp;
+	int                         busy;
+	char                       *buf;
+	struct td_iovec             iov;
+	td_vbd_request_t            vreq;
+};
+
+struct td_bootprof {
+	td_vbd_t                   *vbd;
+	char                       *path;
+	int                         recording;
+
+	struct td_bootprof_extent  *extents;
+	unsigned int                count;
+	unsigned int                max;
+
+	/* recording */
+	uint64_t                    limit;      /* sectors */
+	uint64_t                    recorded;
+	event_id_t                  timer;
+
+	/* replay */
+	unsigned int                next;
+	uint64_t                    offset;     /* into the next extent */
+	int                         inflight;
+	int                         failed;
+	uint64_t                    total;
+	uint64_t                    prefetched;
+	struct td_bootprof_read     reads[TD_BOOTPROF_DEPTH];
+};
+
+static char *
+tapdisk_bootprof_path(td_vbd_t *vbd)
+{
+	const char *dir, *path;
+	char *copy, *name;
+	int err;
+
+	err = tapdisk_disktype_parse_params(vbd->name, &path);
+	if (err < 0)
+		return NULL;
+
+	dir = getenv("TAPDISK3_BOOTPROF_DIR");
+	if (!dir) {
+		err = asprintf(&name, "%s.bootprof", path);
+		return err == -1 ? NULL : name;
+	}
+
+	copy = strdup(path);
+	if (!copy)
+		return NULL;
+
+	err = asprintf(&name, "%s/%s.bootprof", dir, basename(copy));
+	free(copy);
+
+	return err == -1 ? NULL : name;
+}
+
+static void
+tapdisk_bootprof_free(td_bootprof_t *bp)
+{
+	int i;
+
+	if (bp->timer >= 0)
+		tapdisk_server_unregister_event(bp->timer);
+
+	for (i = 0; i < TD_BOOTPROF_DEPTH; i++)
+		free(bp->reads[i].buf);
+
+	free(bp->extents);
+	free(bp->path);
+	free(bp);
+}
+
+static void
+tapdisk_bootprof_done(td_bootprof_t *bp)
+{
+	td_vbd_t *vbd = bp->vbd;
+
+	if (vbd->bootprof == bp)
+		vbd->bootprof = NULL;
+
+	tapdisk_bootprof_free(bp);
+}
+
+/* -- recording -- */
+
+static int
+tapdisk_bootprof_extent_cmp(const void *a, const void *b)
+{
+	const struct td_bootprof_extent *x = a, *y = b;
+
+	if (x->sec != y->sec)
+		return x->sec < y->sec ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sorts the extents, and merges those which overlap or touch.
+ */
+static void
+tapdisk_bootprof_merge(td_bootprof_t *bp)
+{
+	struct td_bootprof_extent *e, *last;
+	unsigned int i, n;
+	uint64_t end;
+
+	if (!bp->count)
+		return;
+
+	qsort(bp->extents, bp->count, sizeof(*bp->extents),
+	      tapdisk_bootprof_extent_cmp);
+
+	for (i = 1, n = 0; i < bp->count; i++) {
+		last = &bp->extents[n];
+		e    = &bp->extents[i];
+		end  = last->sec + last->secs;
+
+		if (e->sec <= end &&
+		    e->sec + e->secs - last->sec <= UINT32_MAX) {
+			if (e->sec + e->secs > end)
+				last->secs = e->sec + e->secs - last->sec;
+			continue;
+		}
+
+		bp->extents[++n] = *e;
+	}
+
+	bp->count = n + 1;
+}
+
+static int
+tapdisk_bootprof_save(td_bootprof_t *bp)
+{
+	struct td_bootprof_header hdr;
+	char *tmp;
+	size_t size;
+	ssize_t ret;
+	int fd, err;
+
+	tapdisk_bootprof_merge(bp);
+
+	if (asprintf(&tmp, "%s.tmp", bp->path) == -1)
+		return -ENOMEM;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TD_BOOTPROF_MAGIC, sizeof(hdr.magic));
+	hdr.version = TD_BOOTPROF_VERSION;
+	hdr.count   = bp->count;
+	hdr.size    = bp->vbd->disk_info.size;
+
+	err = 0;
+	ret = write(fd, &hdr, sizeof(hdr));
+	if (ret != sizeof(hdr))
+		err = ret == -1 ? -errno : -EIO;
+
+	size = bp->count * sizeof(*bp->extents);
+	if (!err) {
+		ret = write(fd, bp->extents, size);
+		if (ret != size)
+			err = ret == -1 ? -errno : -EIO;
+	}
+
+	if (!err && fsync(fd))
+		err = -errno;
+
+	close(fd);
+
+	if (!err && rename(tmp, bp->path))
+		err = -errno;
+
+	if (err)
+		unlink(tmp);
+
+out:
+	free(tmp);
+	return err;
+}
+
+static void
+tapdisk_bootprof_finish_recording(td_bootprof_t *bp)
+{
+	int err;
+
+	if (!bp->recording)
+		return;
+
+	bp->recording = 0;
+
+	if (!bp->count)
+		return;
+
+	err = tapdisk_bootprof_save(bp);
+	if (err)
+		ERR("%s: saving %s failed: %d", bp->vbd->name, bp->path, err);
+	else
+		INFO("%s: recorded %"PRIu64" sectors read in %u extents "
+		     "to %s", bp->vbd->name, bp->recorded, bp->count,
+		     bp->path);
+}
+
+static void
+tapdisk_bootprof_timer(event_id_t id, char mode, void *private)
+{
+	td_bootprof_t *bp = private;
+
+	tapdisk_bootprof_finish_recording(bp);
+	tapdisk_bootprof_done(bp);
+}
+
+static void
+tapdisk_bootprof_record(td_bootprof_t *bp, td_sector_t sec, td_sector_t secs)
+{
+	struct td_bootprof_extent *e;
+	unsigned int max;
+
+	if (bp->recorded + secs > bp->limit) {
+		INFO("%s: %"PRIu64" sectors recorded, the limit",
+		     bp->vbd->name, bp->recorded);
+		tapdisk_bootprof_finish_recording(bp);
+		tapdisk_bootprof_done(bp);
+		return;
+	}
+
+	/* a stream reading on only grows the last extent */
+	if (bp->count) {
+		e = &bp->extents[bp->count - 1];
+		if (e->sec + e->secs == sec && e->secs + secs <= UINT32_MAX) {
+			e->secs += secs;
+			bp->recorded += secs;
+			return;
+		}
+	}
+
+	if (bp->count == bp->max) {
+		if (bp->max == TD_BOOTPROF_MAX_EXTENTS) {
+			tapdisk_bootprof_merge(bp);
+			if (bp->count == bp->max)
+				return;
+		} else {
+			max = bp->max ? bp->max * 2 : 1024;
+			e   = realloc(bp->extents, max * sizeof(*e));
+			if (!e)
+				return;
+			bp->extents = e;
+			bp->max     = max;
+		}
+	}
+
+	e = &bp->extents[bp->count++];
+	e->sec      = sec;
+	e->secs     = secs;
+	e->reserved = 0;
+
+	bp->recorded += secs;
+}
+
+/* -- replay -- */
+
+static int
+tapdisk_bootprof_load(td_bootprof_t *bp, int fd)
+{
+	struct td_bootprof_header hdr;
+	struct td_bootprof_extent *e;
+	td_sector_t size;
+	unsigned int i, n;
+	ssize_t ret;
+	size_t len;
+
+	ret = read(fd, &hdr, sizeof(hdr));
+	if (ret != sizeof(hdr))
+		return ret == -1 ? -errno : -EINVAL;
+
+	if (memcmp(hdr.magic, TD_BOOTPROF_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != TD_BOOTPROF_VERSION ||
+	    hdr.count > TD_BOOTPROF_MAX_EXTENTS)
+		return -EINVAL;
+
+	size = bp->vbd->disk_info.size;
+	if (hdr.size != size)
+		return -EINVAL;
+
+	if (!hdr.count)
+		return 0;
+
+	len = hdr.count * sizeof(*bp->extents);
+	bp->extents = malloc(len);
+	if (!bp->extents)
+		return -ENOMEM;
+
+	ret = read(fd, bp->extents, len);
+	if (ret != len)
+		return ret == -1 ? -errno : -EINVAL;
+
+	for (i = 0, n = 0; i < hdr.count; i++) {
+		e = &bp->extents[i];
+		if (!e->secs || e->sec >= size)
+			continue;
+
+		e->secs = MIN(e->secs, size - e->sec);
+		bp->total += e->secs;
+		bp->extents[n++] = *e;
+	}
+
+	bp->count = n;
+	bp->max   = n;
+
+	return 0;
+}
+
+static int
+tapdisk_bootprof_ready(td_bootprof_t *bp)
+{
+	return !td_flag_test(bp->vbd->state, TD_VBD_DEAD |
+			     TD_VBD_CLOSED |
+			     TD_VBD_PAUSE_REQUESTED |
+			     TD_VBD_PAUSED |
+			     TD_VBD_SHUTDOWN_REQUESTED);
+}
+
+static void tapdisk_bootprof_kick(td_bootprof_t *bp);
+
+static void
+tapdisk_bootprof_read_done(td_vbd_request_t *vreq, int err, void *token,
+			   int final)
+{
+	struct td_bootprof_read *rd = token;
+	td_bootprof_t *bp = rd->bp;
+
+	rd->busy = 0;
+	bp->inflight--;
+
+	if (err)
+		bp->failed = 1;
+	else
+		bp->prefetched += rd->iov.secs;
+
+	tapdisk_bootprof_kick(bp);
+}
+
+static int
+tapdisk_bootprof_issue(td_bootprof_t *bp, struct td_bootprof_read *rd)
+{
+	struct td_bootprof_extent *e = &bp->extents[bp->next];
+	td_vbd_request_t *vreq = &rd->vreq;
+	int err, secs;
+
+	if (!rd->buf) {
+		err = posix_memalign((void **)&rd->buf, 4096,
+				     TD_BOOTPROF_CHUNK_SECS << SECTOR_SHIFT);
+		if (err) {
+			rd->buf = NULL;
+			return -err;
+		}
+	}
+
+	secs = MIN(e->secs - bp->offset, TD_BOOTPROF_CHUNK_SECS);
+
+	rd->bp       = bp;
+	rd->iov.base = rd->buf;
+	rd->iov.secs = secs;
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = e->sec + bp->offset;
+	vreq->iov    = &rd->iov;
+	vreq->iovcnt = 1;
+	vreq->cb     = tapdisk_bootprof_read_done;
+	vreq->token  = rd;
+	vreq->name   = "bootprof";
+
+	err = tapdisk_vbd_queue_request(bp->vbd, vreq);
+	if (err)
+		return err;
+
+	rd->busy = 1;
+	bp->inflight++;
+
+	bp->offset += secs;
+	if (bp->offset == e->secs) {
+		bp->next++;
+		bp->offset = 0;
+	}
+
+	return 0;
+}
+
+static void
+tapdisk_bootprof_kick(td_bootprof_t *bp)
+{
+	int i;
+
+	if (!bp->failed && tapdisk_bootprof_ready(bp))
+		for (i = 0; i < TD_BOOTPROF_DEPTH && bp->next < bp->count;
+		     i++) {
+			if (bp->reads[i].busy)
+				continue;
+
+			if (tapdisk_bootprof_issue(bp, &bp->reads[i])) {
+				bp->failed = 1;
+				break;
+			}
+		}
+
+	if (bp->inflight)
+		return;
+
+	/* done, failed, or the VBD going away: all the same to a cache */
+	INFO("%s: prefetched %"PRIu64" of %"PRIu64" sectors from %s",
+	     bp->vbd->name, bp->prefetched, bp->total, bp->path);
+
+	tapdisk_bootprof_done(bp);
+}
+
+/* -- interface -- */
+
+int
+tapdisk_bootprof_start(td_vbd_t *vbd)
+{
+	const char *s;
+	td_bootprof_t *bp;
+	unsigned long secs;
+	uint64_t mb;
+	int err, fd;
+
+	s = getenv("TAPDISK3_BOOTPROF");
+	secs = s ? strtoul(s, NULL, 0) : 0;
+	if (!secs || vbd->bootprof)
+		return 0;
+
+	s  = getenv("TAPDISK3_BOOTPROF_MB");
+	mb = s ? strtoull(s, NULL, 0) : TD_BOOTPROF_DEFAULT_MB;
+
+	bp = calloc(1, sizeof(*bp));
+	if (!bp)
+		return -ENOMEM;
+
+	bp->vbd   = vbd;
+	bp->timer = -1;
+	bp->limit = mb << (20 - SECTOR_SHIFT);
+
+	bp->path = tapdisk_bootprof_path(vbd);
+	if (!bp->path) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	fd = open(bp->path, O_RDONLY);
+	if (fd >= 0) {
+		err = tapdisk_bootprof_load(bp, fd);
+		close(fd);
+		if (err) {
+			ERR("%s: bad profile %s: %d", vbd->name, bp->path, err);
+			goto fail;
+		}
+
+		INFO("%s: prefetching %"PRIu64" sectors in %u extents "
+		     "from %s", vbd->name, bp->total, bp->count, bp->path);
+
+		vbd->bootprof = bp;
+		tapdisk_bootprof_kick(bp);
+		return 0;
+	}
+
+	if (errno != ENOENT) {
+		err = -errno;
+		goto fail;
+	}
+
+	bp->timer = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+			-1, TV_SECS(secs), tapdisk_bootprof_timer, bp);
+	if (bp->timer < 0) {
+		err = bp->timer;
+		goto fail;
+	}
+
+	INFO("%s: recording reads for %lus to %s", vbd->name, secs, bp->path);
+
+	bp->recording = 1;
+	vbd->bootprof = bp;
+
+	return 0;
+
+fail:
+	tapdisk_bootprof_free(bp);
+	return err;
+}
+
+void
+tapdisk_bootprof_stop(td_vbd_t *vbd)
+{
+	td_bootprof_t *bp = vbd->bootprof;
+	int i;
+
+	if (!bp)
+		return;
+
+	tapdisk_bootprof_finish_recording(bp);
+
+	for (i = 0; i < TD_BOOTPROF_DEPTH; i++)
+		if (bp->reads[i].busy)
+			list_del(&bp->reads[i].vreq.next);
+
+	tapdisk_bootprof_done(bp);
+}
+
+void
+tapdisk_bootprof_queue(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	td_bootprof_t *bp = vbd->bootprof;
+	td_sector_t secs = 0;
+	int i;
+
+	if (!bp->recording || vreq->op != TD_OP_READ)
+		return;
+
+	for (i = 0; i < vreq->iovcnt; i++)
+		secs += vreq->iov[i].secs;
+
+	if (secs)
+		tapdisk_bootprof_record(bp, vreq->sec, secs);
+}
+
+void
+tapdisk_bootprof_stats(td_vbd_t *vbd, td_stats_t *st)
+{
+	td_bootprof_t *bp = vbd->bootprof;
+
+	if (!bp)
+		return;
+
+	tapdisk_stats_field(st, "bootprof", "{");
+	tapdisk_stats_field(st, "path", "s", bp->path);
+	tapdisk_stats_field(st, "recording", "d", bp->recording);
+	tapdisk_stats_field(st, "extents", "u", bp->count);
+	tapdisk_stats_field(st, "recorded", "llu",
+			    (unsigned long long)bp->recorded);
+	tapdisk_stats_field(st, "total", "llu", (unsigned long long)bp->total);
+	tapdisk_stats_field(st, "prefetched", "llu",
+			    (unsigned long long)bp->prefetched);
+	tapdisk_stats_leave(st, '}');
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_BOOTPROF_H_
+#define _TAPDISK_BOOTPROF_H_
+
+#include "tapdisk.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Boot profiles. A guest boots reading much the same extents each time.
+ * With TAPDISK3_BOOTPROF set to some seconds, what a VDI is read at for
+ * that long after it is opened is recorded, up to TAPDISK3_BOOTPROF_MB
+ * MiB, and saved merged and sorted beside the leaf, as <leaf>.bootprof,
+ * or in TAPDISK3_BOOTPROF_DIR if set. The next time the VDI is opened,
+ * the profile is read back through the VBD in sector order, a few
+ * requests at a time, warming block-cache, lcache or the page cache
+ * ahead of the guest. A profile is not recorded again while one is on
+ * hand: remove it to record a new one.
+ */
+
+#define TD_BOOTPROF_MAGIC           "tdbtprof"
+#define TD_BOOTPROF_VERSION         1
+
+struct td_bootprof_header {
+	char                        magic[8];
+	uint32_t                    version;
+	uint32_t                    count;
+	uint64_t                    size;       /* of the VDI, sectors */
+};
+
+struct td_bootprof_extent {
+	uint64_t                    sec;
+	uint32_t                    secs;
+	uint32_t                    reserved;
+};
+
+typedef struct td_bootprof td_bootprof_t;
+
+/* Records or replays, as TAPDISK3_BOOTPROF and the profile on hand say. */
+int tapdisk_bootprof_start(td_vbd_t *vbd);
+
+/*
+ * Saves what was recorded so far, and drops prefetch requests the VBD
+ * has not issued yet. On shutdown, with nothing pending.
+ */
+void tapdisk_bootprof_stop(td_vbd_t *vbd);
+
+/* A request queued to the VBD. */
+void tapdisk_bootprof_queue(td_vbd_t *vbd, td_vbd_request_t *vreq);
+
+void tapdisk_bootprof_stats(td_vbd_t *vbd, td_stats_t *st);
+
+#endif /* _TAPDISK_BOOTPROF_H_ */
@@ -0,0 +1,673 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-image.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-log.h"
+#include "tapdisk-coalesce.h"
+#include "timeout-math.h"
+
+#define INFO(_f, _a...)            tlog_syslog(TLOG_INFO, "coalesce: " _f, ##_a)
+#define ERR(_f, _a...)             tlog_syslog(TLOG_WARN, "coalesce: " _f, ##_a)
+
+#define BUG_ON(_cond)              if (unlikely(_cond)) { td_panic(); }
+#define MIN(a, b)                  ((a) < (b) ? (a) : (b))
+#define MAX(a, b)                  ((a) > (b) ? (a) : (b))
+
+/* a VHD block */
+#define TD_COALESCE_BLOCK_SHIFT    12
+#define TD_COALESCE_BLOCK_SECS     (1 << TD_COALESCE_BLOCK_SHIFT)
+#define TD_COALESCE_BLOCK_SIZE     (TD_COALESCE_BLOCK_SECS << SECTOR_SHIFT)
+
+/* blocks copied at once */
+#define TD_COALESCE_COPY_DEPTH     4
+
+/* the copy rate is metered out in ticks of this many usecs */
+#define TD_COALESCE_TICK           100000
+
+/* how often a stalled copy is retried, in ticks */
+#define TD_COALESCE_RETRY_TICKS    10
+
+struct td_coalesce_copy {
+	td_coalesce_t              *c;
+	int                         busy;
+	int                         redirty;
+	uint64_t                    block;
+	char                       *buf;
+	struct td_iovec             iov;
+	td_vbd_request_t            vreq;
+};
+
+struct td_coalesce {
+	td_vbd_t                   *vbd;
+	td_image_t                 *leaf;
+	td_image_t                 *target;    /* the parent, writable */
+
+	/* blocks the leaf holds which the parent does not have yet */
+	unsigned char              *bitmap;
+	td_sector_t                 size;
+	uint64_t                    blocks;
+	uint64_t                    dirty;
+	uint64_t                    total;
+	uint64_t                    copied;
+	uint64_t                    cursor;
+
+	int                         inflight;
+	int                         stalled;
+	int                         quiescing;
+	event_id_t                  timer;
+
+	/* bytes per second, 0 for no limit */
+	uint64_t                    rate;
+	uint64_t                    budget;
+	int                         ticks;
+	struct td_coalesce_copy     copies[TD_COALESCE_COPY_DEPTH];
+};
+
+static void tapdisk_coalesce_kick(td_coalesce_t *c);
+
+static inline int
+tapdisk_coalesce_test(td_coalesce_t *c, uint64_t block)
+{
+	return c->bitmap[block >> 3] & (1 << (block & 7));
+}
+
+static void
+tapdisk_coalesce_set(td_coalesce_t *c, uint64_t block)
+{
+	if (tapdisk_coalesce_test(c, block))
+		return;
+
+	c->bitmap[block >> 3] |= 1 << (block & 7);
+	c->dirty++;
+}
+
+static void
+tapdisk_coalesce_clear(td_coalesce_t *c, uint64_t block)
+{
+	if (!tapdisk_coalesce_test(c, block))
+		return;
+
+	c->bitmap[block >> 3] &= ~(1 << (block & 7));
+	c->dirty--;
+}
+
+static void
+tapdisk_coalesce_set_range(td_coalesce_t *c, td_sector_t sec, td_sector_t secs)
+{
+	uint64_t block, last;
+
+	if (!secs || sec >= c->size)
+		return;
+
+	last = MIN(sec + secs - 1, c->size - 1) >> TD_COALESCE_BLOCK_SHIFT;
+	for (block = sec >> TD_COALESCE_BLOCK_SHIFT; block <= last; block++)
+		tapdisk_coalesce_set(c, block);
+}
+
+static void
+tapdisk_coalesce_free(td_coalesce_t *c)
+{
+	int i;
+
+	if (c->timer >= 0)
+		tapdisk_server_unregister_event(c->timer);
+
+	if (c->target)
+		tapdisk_image_close(c->target);
+
+	for (i = 0; i < TD_COALESCE_COPY_DEPTH; i++)
+		free(c->copies[i].buf);
+
+	free(c->bitmap);
+	free(c);
+}
+
+static int
+tapdisk_coalesce_ready(td_coalesce_t *c)
+{
+	return !td_flag_test(c->vbd->state, TD_VBD_DEAD |
+			     TD_VBD_CLOSED |
+			     TD_VBD_QUIESCE_REQUESTED |
+			     TD_VBD_QUIESCED |
+			     TD_VBD_PAUSE_REQUESTED |
+			     TD_VBD_PAUSED |
+			     TD_VBD_SHUTDOWN_REQUESTED);
+}
+
+/*
+ * Guest requests which change what the leaf holds. A block is not copied
+ * while one of those is in flight to it, lest the copy read the old data
+ * and land after the new.
+ */
+static int
+tapdisk_coalesce_overlaps(td_vbd_request_t *vreq, td_sector_t sec,
+			  td_sector_t secs)
+{
+	td_sector_t len = 0;
+	int i;
+
+	if (vreq->op == TD_OP_READ)
+		return 0;
+
+	for (i = 0; i < vreq->iovcnt; i++)
+		len += vreq->iov[i].secs;
+
+	return vreq->sec < sec + secs && sec < vreq->sec + len;
+}
+
+static int
+tapdisk_coalesce_block_busy(td_coalesce_t *c, td_sector_t sec,
+			    td_sector_t secs)
+{
+	td_vbd_t *vbd = c->vbd;
+	td_vbd_request_t *vreq, *tmp;
+
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->pending_requests)
+		if (tapdisk_coalesce_overlaps(vreq, sec, secs))
+			return 1;
+
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->failed_requests)
+		if (tapdisk_coalesce_overlaps(vreq, sec, secs))
+			return 1;
+
+	return 0;
+}
+
+static int
+tapdisk_coalesce_next(td_coalesce_t *c, uint64_t *block)
+{
+	uint64_t n, b;
+
+	for (n = 0; n < c->blocks; n++) {
+		b = (c->cursor + n) % c->blocks;
+
+		/* skip clean bytes at once */
+		if (!(b & 7) && b + 8 <= c->blocks && !c->bitmap[b >> 3]) {
+			n += 7;
+			continue;
+		}
+
+		if (tapdisk_coalesce_test(c, b)) {
+			*block = b;
+			c->cursor = b + 1;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Everything is copied: quiesce the queue, and once the guest I/O in
+ * flight is done, swap the chain. See tapdisk_coalesce_timer.
+ */
+static void
+tapdisk_coalesce_drain(td_coalesce_t *c)
+{
+	INFO("%s: %"PRIu64" blocks copied, dropping the leaf",
+	     c->vbd->name, c->copied);
+
+	c->quiescing = 1;
+	tapdisk_vbd_quiesce_queue(c->vbd);
+}
+
+static void
+tapdisk_coalesce_copy_end(struct td_coalesce_copy *cp, int err)
+{
+	td_coalesce_t *c = cp->c;
+
+	cp->busy = 0;
+	c->inflight--;
+
+	if (err || cp->redirty)
+		tapdisk_coalesce_set(c, cp->block);
+	else
+		c->copied++;
+
+	if (err) {
+		ERR("%s: copying block %"PRIu64" failed: %d, pausing",
+		    c->vbd->name, cp->block, err);
+		c->stalled = 1;
+		return;
+	}
+
+	if (!c->dirty && !c->inflight) {
+		tapdisk_coalesce_drain(c);
+		return;
+	}
+
+	tapdisk_coalesce_kick(c);
+}
+
+static void
+tapdisk_coalesce_write_done(td_request_t treq, int res)
+{
+	tapdisk_coalesce_copy_end(treq.cb_data, res);
+}
+
+/*
+ * The block as the VBD reads it goes to the parent whole: the sectors
+ * the leaf does not hold are what the parent, or its own parents, hold
+ * for them already.
+ */
+static void
+tapdisk_coalesce_read_done(td_vbd_request_t *vreq, int err, void *token,
+			   int final)
+{
+	struct td_coalesce_copy *cp = token;
+	td_coalesce_t *c = cp->c;
+	td_request_t treq;
+
+	if (err || cp->redirty) {
+		tapdisk_coalesce_copy_end(cp, err);
+		return;
+	}
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op      = TD_OP_WRITE;
+	treq.buf     = cp->iov.base;
+	treq.sec     = vreq->sec;
+	treq.secs    = cp->iov.secs;
+	treq.prio    = TD_PRIO_BACKGROUND;
+	treq.image   = c->target;
+	treq.cb      = tapdisk_coalesce_write_done;
+	treq.cb_data = cp;
+	treq.vreq    = vreq;
+
+	td_queue_write(c->target, treq);
+}
+
+static int
+tapdisk_coalesce_copy(td_coalesce_t *c, struct td_coalesce_copy *cp,
+		      uint64_t block)
+{
+	td_vbd_request_t *vreq = &cp->vreq;
+	td_sector_t sec;
+	int err;
+
+	if (!cp->buf) {
+		err = posix_memalign((void **)&cp->buf, 4096,
+				     TD_COALESCE_BLOCK_SIZE);
+		if (err) {
+			cp->buf = NULL;
+			return -err;
+		}
+	}
+
+	sec = (td_sector_t)block << TD_COALESCE_BLOCK_SHIFT;
+
+	cp->c        = c;
+	cp->block    = block;
+	cp->redirty  = 0;
+	cp->iov.base = cp->buf;
+	cp->iov.secs = MIN(TD_COALESCE_BLOCK_SECS, c->size - sec);
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = sec;
+	vreq->iov    = &cp->iov;
+	vreq->iovcnt = 1;
+	vreq->prio   = TD_PRIO_BACKGROUND;
+	vreq->cb     = tapdisk_coalesce_read_done;
+	vreq->token  = cp;
+	vreq->name   = "coalesce";
+
+	err = tapdisk_vbd_queue_request(c->vbd, vreq);
+	if (err)
+		return err;
+
+	tapdisk_coalesce_clear(c, block);
+	cp->busy = 1;
+	c->inflight++;
+
+	return 0;
+}
+
+static void
+tapdisk_coalesce_kick(td_coalesce_t *c)
+{
+	struct td_coalesce_copy *cp;
+	uint64_t block, tries;
+	int i;
+
+	if (c->quiescing || c->stalled || !tapdisk_coalesce_ready(c))
+		return;
+
+	tries = c->dirty;
+
+	for (i = 0; i < TD_COALESCE_COPY_DEPTH && tries; i++) {
+		cp = &c->copies[i];
+		if (cp->busy)
+			continue;
+
+		if (c->rate && c->budget < TD_COALESCE_BLOCK_SIZE)
+			return;
+
+		while (tries && tapdisk_coalesce_next(c, &block)) {
+			tries--;
+
+			if (tapdisk_coalesce_block_busy(c,
+				(td_sector_t)block << TD_COALESCE_BLOCK_SHIFT,
+				TD_COALESCE_BLOCK_SECS))
+				continue;
+
+			if (tapdisk_coalesce_copy(c, cp, block)) {
+				c->stalled = 1;
+				return;
+			}
+			if (c->rate)
+				c->budget -= TD_COALESCE_BLOCK_SIZE;
+			break;
+		}
+	}
+}
+
+/*
+ * With the queue quiesced and nothing in flight, the parent has all the
+ * leaf has: it takes the leaf's place, and the guest goes on.
+ */
+static void
+tapdisk_coalesce_finish(td_coalesce_t *c)
+{
+	td_vbd_t *vbd = c->vbd;
+	int err;
+
+	err = tapdisk_vbd_replace_leaf(vbd, c->target);
+	if (err) {
+		ERR("%s: dropping the leaf failed: %d", vbd->name, err);
+		goto out;
+	}
+
+	INFO("%s: coalesce complete", vbd->name);
+	c->target = NULL;
+
+out:
+	vbd->coalesce = NULL;
+	tapdisk_coalesce_free(c);
+
+	tapdisk_vbd_start_queue(vbd);
+	tapdisk_vbd_issue_requests(vbd);
+}
+
+static void
+tapdisk_coalesce_timer(event_id_t id, char mode, void *private)
+{
+	td_coalesce_t *c = private;
+	td_vbd_t *vbd = c->vbd;
+	uint64_t quota;
+
+	if (c->quiescing) {
+		/* a pause or shutdown takes over, and stops us */
+		if (td_flag_test(vbd->state, TD_VBD_DEAD |
+				 TD_VBD_CLOSED |
+				 TD_VBD_PAUSE_REQUESTED |
+				 TD_VBD_PAUSED |
+				 TD_VBD_SHUTDOWN_REQUESTED))
+			return;
+
+		if (!td_flag_test(vbd->state, TD_VBD_QUIESCED))
+			return;
+
+		if (!c->dirty) {
+			tapdisk_coalesce_finish(c);
+			return;
+		}
+
+		/* cannot happen, writes are not issued while quiescing */
+		c->quiescing = 0;
+		tapdisk_vbd_start_queue(vbd);
+		tapdisk_vbd_issue_requests(vbd);
+	}
+
+	if (c->rate) {
+		/* no bursts beyond one tick's worth, or one block */
+		quota = c->rate / (1000000 / TD_COALESCE_TICK);
+		c->budget = MIN(c->budget + quota,
+				quota > TD_COALESCE_BLOCK_SIZE ?
+				quota : TD_COALESCE_BLOCK_SIZE);
+	}
+
+	if (++c->ticks >= TD_COALESCE_RETRY_TICKS) {
+		c->ticks = 0;
+		c->stalled = 0;
+	}
+
+	if (!c->dirty && !c->inflight && tapdisk_coalesce_ready(c)) {
+		tapdisk_coalesce_drain(c);
+		return;
+	}
+
+	tapdisk_coalesce_kick(c);
+}
+
+/*
+ * Marks the blocks the leaf holds, which are all the leaf can tell.
+ */
+static int
+tapdisk_coalesce_seed(td_coalesce_t *c)
+{
+	td_sector_t sec, run;
+	int err;
+
+	for (sec = 0; sec < c->size; sec += run) {
+		run = 0;
+		err = td_sector_present(c->leaf, sec, &run);
+		if (err < 0)
+			return err;
+
+		run = MIN(MAX(run, 1), c->size - sec);
+		if (err)
+			tapdisk_coalesce_set_range(c, sec, run);
+	}
+
+	c->total = c->dirty;
+	return 0;
+}
+
+static uint64_t
+tapdisk_coalesce_rate(unsigned int rate)
+{
+	const char *s = getenv("TAPDISK3_COALESCE_RATE");
+
+	/* MiB/s */
+	if (rate)
+		return (uint64_t)rate << 20;
+	return s ? strtoull(s, NULL, 0) << 20 : 0;
+}
+
+/* -- interface -- */
+
+int
+tapdisk_coalesce_start(td_vbd_t *vbd, unsigned int rate)
+{
+	td_image_t *leaf, *parent;
+	td_coalesce_t *c;
+	int err;
+
+	if (vbd->coalesce)
+		return -EALREADY;
+
+	if (vbd->secondary || vbd->mirror || vbd->retired)
+		return -EBUSY;
+
+	if (list_empty(&vbd->images))
+		return -EINVAL;
+
+	leaf = list_entry(vbd->images.next, td_image_t, next);
+	if (list_is_last(&leaf->next, &vbd->images))
+		return -EINVAL;
+
+	if (td_flag_test(leaf->flags, TD_OPEN_RDONLY))
+		return -EROFS;
+
+	if (leaf->type != DISK_TYPE_VHD)
+		return -EOPNOTSUPP;
+
+	parent = list_entry(leaf->next.next, td_image_t, next);
+
+	/* other VBDs reading the parent would not see it change */
+	if (parent->driver->refcnt > 1)
+		return -EBUSY;
+
+	if (parent->info.size != leaf->info.size)
+		return -EINVAL;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	c->vbd    = vbd;
+	c->leaf   = leaf;
+	c->timer  = -1;
+	c->size   = leaf->info.size;
+	c->blocks = (c->size + TD_COALESCE_BLOCK_SECS - 1) >>
+		TD_COALESCE_BLOCK_SHIFT;
+	c->rate   = tapdisk_coalesce_rate(rate);
+
+	c->bitmap = calloc((c->blocks + 7) >> 3, 1);
+	if (!c->bitmap) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = tapdisk_coalesce_seed(c);
+	if (err)
+		goto fail;
+
+	err = tapdisk_image_open(parent->type, parent->name,
+				 parent->flags &
+				 ~(TD_OPEN_RDONLY | TD_OPEN_SHAREABLE),
+				 &vbd->encryption, &c->target);
+	if (err) {
+		ERR("%s: opening %s writable: %d", vbd->name, parent->name,
+		    err);
+		goto fail;
+	}
+
+	c->timer = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+			-1, TV_USECS(TD_COALESCE_TICK),
+			tapdisk_coalesce_timer, c);
+	if (c->timer < 0) {
+		err = c->timer;
+		goto fail;
+	}
+
+	INFO("%s: coalescing %"PRIu64" of %"PRIu64" blocks into %s",
+	     vbd->name, c->dirty, c->blocks, parent->name);
+
+	vbd->coalesce = c;
+	tapdisk_coalesce_kick(c);
+
+	return 0;
+
+fail:
+	tapdisk_coalesce_free(c);
+	return err;
+}
+
+void
+tapdisk_coalesce_stop(td_vbd_t *vbd)
+{
+	td_coalesce_t *c = vbd->coalesce;
+
+	if (!c)
+		return;
+
+	BUG_ON(c->inflight);
+
+	INFO("%s: coalesce stopped, %"PRIu64" of %"PRIu64" blocks left",
+	     vbd->name, c->dirty, c->total);
+
+	vbd->coalesce = NULL;
+	tapdisk_coalesce_free(c);
+}
+
+void
+tapdisk_coalesce_write(td_vbd_t *vbd, td_sector_t sec, td_sector_t secs)
+{
+	td_coalesce_t *c = vbd->coalesce;
+	struct td_coalesce_copy *cp;
+	uint64_t first, last;
+	int i;
+
+	if (!c || !secs)
+		return;
+
+	tapdisk_coalesce_set_range(c, sec, secs);
+
+	first = sec >> TD_COALESCE_BLOCK_SHIFT;
+	last  = (sec + secs - 1) >> TD_COALESCE_BLOCK_SHIFT;
+
+	for (i = 0; i < TD_COALESCE_COPY_DEPTH; i++) {
+		cp = &c->copies[i];
+		if (cp->busy && cp->block >= first && cp->block <= last)
+			cp->redirty = 1;
+	}
+}
+
+int
+tapdisk_coalesce_busy(td_vbd_t *vbd)
+{
+	return vbd->coalesce && vbd->coalesce->inflight;
+}
+
+void
+tapdisk_coalesce_stats(td_vbd_t *vbd, td_stats_t *st)
+{
+	td_coalesce_t *c = vbd->coalesce;
+
+	if (!c)
+		return;
+
+	tapdisk_stats_field(st, "coalesce", "{");
+	tapdisk_stats_field(st, "target", "s", c->target->name);
+	tapdisk_stats_field(st, "total", "llu", (unsigned long long)c->total);
+	tapdisk_stats_field(st, "dirty", "llu", (unsigned long long)c->dirty);
+	tapdisk_stats_field(st, "copied", "llu",
+			    (unsigned long long)c->copied);
+	tapdisk_stats_field(st, "rate", "llu", (unsigned long long)c->rate);
+	tapdisk_stats_field(st, "quiescing", "d", c->quiescing);
+	tapdisk_stats_leave(st, '}');
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_COALESCE_H_
+#define _TAPDISK_COALESCE_H_
+
+#include "tapdisk.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Live coalesce of the leaf of a VBD into its parent. The parent is
+ * opened a second time, writable, and every block the leaf holds is read
+ * through the VBD and written to it, next to guest I/O; blocks written
+ * again by the guest are copied again. Once all is copied, the queue is
+ * quiesced for as long as it takes to drop the leaf from the chain, and
+ * the writable parent takes its place. The leaf file is left for the
+ * toolstack to remove.
+ */
+
+typedef struct td_coalesce td_coalesce_t;
+
+/*
+ * Starts coalescing, limited to @rate MiB/s if non-zero, or else to
+ * TAPDISK3_COALESCE_RATE MiB/s if set.
+ */
+int tapdisk_coalesce_start(td_vbd_t *vbd, unsigned int rate);
+
+/* Abandons a coalesce in progress. Nothing in flight, see busy. */
+void tapdisk_coalesce_stop(td_vbd_t *vbd);
+
+/* A guest write, or anything else changing what the leaf holds. */
+void tapdisk_coalesce_write(td_vbd_t *vbd, td_sector_t sec, td_sector_t secs);
+
+/* Non-zero while copies the VBD does not track are in flight. */
+int tapdisk_coalesce_busy(td_vbd_t *vbd);
+
+void tapdisk_coalesce_stats(td_vbd_t *vbd, td_stats_t *st);
+
+#endif /* _TAPDISK_COALESCE_H_ */
@@ -57,10 +57,16 @@
 #include "tapdisk-message.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-stats.h"
+#include "tapdisk-trace.h"
+#include "tapdisk-coalesce.h"
+#include "tapdisk-backup.h"
+#include "tapdisk-bootprof.h"
 #include "tapdisk-control.h"
 #include "tapdisk-nbdserver.h"
+#include "tapdisk-vhostblk.h"
 #include "td-blkif.h"
 #include "timeout-math.h"
+#include "block-log.h"
 
 #define TD_CTL_MAX_CONNECTIONS  10
 #define TD_CTL_SOCK_BACKLOG     32
@@ -109,6 +115,26 @@ struct tapdisk_ctl_conn {
 
 	struct tapdisk_control_info *info;
 
+	/**
+	 * The connection carries one request after the other, see
+	 * tapdisk_control_session, rather than being closed after the first.
+	 */
+	int                          session;
+
+	/**
+	 * stats updates pushed, see tapdisk_control_stats_subscribe
+	 */
+	struct {
+		int                      event_id;
+		td_uuid_t                uuid;
+		uint32_t                 threshold;
+		int                      size;  /* records room of each */
+		int                      count; /* in last */
+		struct tapdisk_stats_bin_vbd *cur;
+		struct tapdisk_stats_bin_vbd *last; /* as last reported */
+		struct tapdisk_stats_bin_vbd *next;
+	} sub;
+
 	/**
 	 * for linked lists
 	 */
@@ -120,6 +146,7 @@ struct tapdisk_ctl_conn {
 
 #define TAPDISK_MSG_REENTER    (1<<0) /* non-blocking, idempotent */
 #define TAPDISK_MSG_VERBOSE    (1<<1) /* tell syslog about it */
+#define TAPDISK_MSG_VBD        (1<<2) /* runs on the event loop of the VBD */
 
 struct tapdisk_control_info {
 	int (*handler)(struct tapdisk_ctl_conn *, tapdisk_message_t *,
@@ -129,6 +156,7 @@ struct tapdisk_control_info {
 
 struct tapdisk_control {
 	char              *path;
+	char              *list_path;
 	int                uuid;
 	int                socket;
 	int                event_id;
@@ -172,6 +200,7 @@ tapdisk_ctl_conn_init(struct tapdisk_ctl_conn *conn, size_t bufsz)
 	conn->out.event_id = -1;
 	conn->in.event_id  = -1;
 	conn->event_id     =  0;
+	conn->sub.event_id = -1;
 
 	conn->out.buf = malloc(bufsz);
 	if (!conn->out.buf) {
@@ -211,9 +240,13 @@ tapdisk_ctl_conn_free(struct tapdisk_ctl_conn *conn)
 	} while (next != conn);
 }
 
+static void tapdisk_control_stats_unsubscribe(struct tapdisk_ctl_conn *);
+
 static void
 tapdisk_ctl_conn_close(struct tapdisk_ctl_conn *conn)
 {
+	tapdisk_control_stats_unsubscribe(conn);
+
 	if (conn->out.event_id >= 0) {
 		tapdisk_server_unregister_event(conn->out.event_id);
 		conn->out.event_id = -1;
@@ -261,6 +294,8 @@ tapdisk_ctl_conn_send_buf(struct tapdisk_ctl_conn *conn)
 	return size;
 }
 
+static void tapdisk_control_session_resume(struct tapdisk_ctl_conn *);
+
 static void
 tapdisk_ctl_conn_send_event(event_id_t id, char mode, void *private)
 {
@@ -282,8 +317,11 @@ tapdisk_ctl_conn_send_event(event_id_t id, char mode, void *private)
 
 	if (rv || conn->out.done || mode & SCHEDULER_POLL_TIMEOUT)
 		tapdisk_ctl_conn_close(conn);
-	else
+	else {
 		tapdisk_ctl_conn_mask_out(conn);
+		if (conn->session)
+			tapdisk_control_session_resume(conn);
+	}
 }
 
 /*
@@ -350,6 +388,7 @@ tapdisk_ctl_conn_open(int fd)
 	conn->out.prod = conn->out.buf;
 	conn->out.cons = conn->out.buf;
 	conn->out.done = 0;
+	conn->session  = 0;
 
 	tapdisk_ctl_conn_mask_out(conn);
 
@@ -438,6 +477,12 @@ tapdisk_control_close(void)
 		td_control.path = NULL;
 	}
 
+	if (td_control.list_path) {
+		unlink(td_control.list_path);
+		free(td_control.list_path);
+		td_control.list_path = NULL;
+	}
+
 	if (td_control.socket != -1) {
 		close(td_control.socket);
 		td_control.socket = -1;
@@ -467,6 +512,50 @@ tapdisk_control_close_connection(struct tapdisk_ctl_conn *conn)
 	tapdisk_ctl_conn_close(conn);
 }
 
+static void tapdisk_control_handle_request(event_id_t, char, void *);
+
+/*
+ * Looks at the next request of a session once the previous response has
+ * been sent: the handlers expect an empty output buffer.
+ */
+static void
+tapdisk_control_session_resume(struct tapdisk_ctl_conn *conn)
+{
+	int err;
+
+	if (conn->in.busy || conn->out.prod != conn->out.cons)
+		return;
+
+	conn->out.prod = conn->out.buf;
+	conn->out.cons = conn->out.buf;
+
+	if (conn->in.event_id > 0) {
+		tapdisk_server_mask_event(conn->in.event_id, 0);
+		return;
+	}
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    conn->fd, TV_INF,
+					    tapdisk_control_handle_request,
+					    conn);
+	if (err < 0) {
+		ERR(err, "failed to register session event\n");
+		tapdisk_control_close_connection(conn);
+		return;
+	}
+
+	conn->in.event_id = err;
+}
+
+static void
+tapdisk_control_session_next(struct tapdisk_ctl_conn *conn)
+{
+	if (conn->in.event_id > 0)
+		tapdisk_server_mask_event(conn->in.event_id, 1);
+
+	tapdisk_control_session_resume(conn);
+}
+
 
 static int
 tapdisk_control_read_message(int fd, tapdisk_message_t *message, int timeout)
@@ -540,36 +629,77 @@ tapdisk_control_validate_request(tapdisk_message_t *request)
 	return 0;
 }
 
+struct tapdisk_control_list {
+	tapdisk_message_t           *msgs;
+	int                          count;
+	int                          size;
+};
+
+/*
+ * Collects the VBDs of the calling event loop, so that the connection is
+ * only ever written to from the main thread.
+ */
+static int
+__tapdisk_control_list(void *private)
+{
+	struct tapdisk_control_list *list = private;
+	struct list_head *head;
+	tapdisk_message_t *msg;
+	td_vbd_t *vbd;
+
+	head = tapdisk_server_get_all_vbds();
+
+	list_for_each_entry(vbd, head, next) {
+		if (list->count == list->size) {
+			int size = list->size ? list->size * 2 : 16;
+
+			msg = realloc(list->msgs, size * sizeof(*msg));
+			if (!msg)
+				return -ENOMEM;
+
+			list->msgs = msg;
+			list->size = size;
+		}
+
+		msg = &list->msgs[list->count++];
+		memset(msg, 0, sizeof(*msg));
+		msg->u.list.minor = vbd->tap ? vbd->tap->minor : -1;
+		msg->u.list.state = vbd->state;
+
+		if (vbd->name)
+			strncpy(msg->u.list.path, vbd->name,
+				sizeof(msg->u.list.path));
+	}
+
+	return 0;
+}
+
 static int
 tapdisk_control_list(struct tapdisk_ctl_conn *conn,
 		tapdisk_message_t *request, tapdisk_message_t * const response)
 {
-	td_vbd_t *vbd;
-	struct list_head *head;
-	int count;
+	struct tapdisk_control_list list = { NULL, 0, 0 };
+	int i, count, err;
 
     ASSERT(conn);
     ASSERT(request);
     ASSERT(response);
 
+	err = tapdisk_server_call_all(__tapdisk_control_list, &list);
+	if (err)
+		goto out;
+
 	response->type = TAPDISK_MESSAGE_LIST_RSP;
 	response->cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
-
-	count = 0;
-	list_for_each_entry(vbd, head, next)
-		count++;
+	count = list.count;
 
-	list_for_each_entry(vbd, head, next) {
+	for (i = 0; i < list.count; i++) {
 		response->u.list.count   = count--;
-		response->u.list.minor   = vbd->tap ? vbd->tap->minor : -1;
-		response->u.list.state   = vbd->state;
-		response->u.list.path[0] = 0;
-
-		if (vbd->name)
-			strncpy(response->u.list.path, vbd->name,
-				sizeof(response->u.list.path));
+		response->u.list.minor   = list.msgs[i].u.list.minor;
+		response->u.list.state   = list.msgs[i].u.list.state;
+		memcpy(response->u.list.path, list.msgs[i].u.list.path,
+		       sizeof(response->u.list.path));
 
 		tapdisk_control_write_message(conn, response);
 	}
@@ -578,6 +708,98 @@ tapdisk_control_list(struct tapdisk_ctl_conn *conn,
 	response->u.list.minor   = -1;
 	response->u.list.path[0] = 0;
 
+out:
+	free(list.msgs);
+	return err;
+}
+
+/*
+ * Publishes what tapdisk_control_list would return to
+ * BLKTAP2_LIST_DIR/<pid>, one "minor state type:path" line per VBD, so that
+ * tap-ctl list can read it instead of asking every tapdisk. Rewritten
+ * after each message that may change it, renamed into place so that
+ * readers never see a partial file.
+ */
+static void
+tapdisk_control_publish(void)
+{
+	struct tapdisk_control_list list = { NULL, 0, 0 };
+	char *tmp = NULL;
+	FILE *f = NULL;
+	int i, err;
+
+	if (!td_control.list_path)
+		return;
+
+	err = tapdisk_server_call_all(__tapdisk_control_list, &list);
+	if (err)
+		goto out;
+
+	err = asprintf(&tmp, "%s.tmp", td_control.list_path);
+	if (err == -1) {
+		tmp = NULL;
+		err = -ENOMEM;
+		goto out;
+	}
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		err = -errno;
+		goto out;
+	}
+
+	for (i = 0; i < list.count; i++) {
+		tapdisk_message_t *msg = &list.msgs[i];
+
+		fprintf(f, "%d %d %.*s\n", msg->u.list.minor, msg->u.list.state,
+			(int)sizeof(msg->u.list.path),
+			msg->u.list.path[0] ? msg->u.list.path : "-");
+	}
+
+	err = fclose(f) ? -errno : 0;
+	f = NULL;
+	if (err)
+		goto out;
+
+	err = rename(tmp, td_control.list_path) ? -errno : 0;
+
+out:
+	if (f)
+		fclose(f);
+	if (err) {
+		EPRINTF("failed to publish %s: %s\n",
+			td_control.list_path, strerror(-err));
+		if (tmp)
+			unlink(tmp);
+		/* a stale list is worse than none, readers fall back */
+		unlink(td_control.list_path);
+	}
+	free(tmp);
+	free(list.msgs);
+}
+
+/*
+ * Keeps the connection open after the response, for further requests.
+ * Clients may send several requests without waiting, they are handled
+ * and answered in order, each response carrying the cookie of its
+ * request. The session ends when the client closes the connection.
+ */
+static int
+tapdisk_control_session(struct tapdisk_ctl_conn *conn,
+			tapdisk_message_t *request,
+			tapdisk_message_t * const response)
+{
+	ASSERT(conn);
+
+	conn->session = 1;
+
+	/* sessions may idle, the receive timeout is for single requests */
+	if (conn->in.event_id > 0)
+		tapdisk_server_event_set_timeout(conn->in.event_id, TV_INF);
+
+	response->type = TAPDISK_MESSAGE_SESSION_RSP;
+	response->cookie = request->cookie;
+
 	return 0;
 }
 
@@ -622,6 +844,10 @@ tapdisk_control_attach_vbd(struct tapdisk_ctl_conn *conn,
 		goto out;
 	}
 
+	err = tapdisk_server_prepare();
+	if (err)
+		goto out;
+
 	vbd = tapdisk_vbd_create(minor);
 	if (!vbd) {
 		err = -ENOMEM;
@@ -733,8 +959,10 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 		flags |= TD_OPEN_NO_O_DIRECT;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_SHARED)
 		flags |= TD_OPEN_SHAREABLE;
-	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ADD_CACHE)
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ADD_CACHE) {
 		flags |= TD_OPEN_ADD_CACHE;
+		vbd->cache_size = request->u.params.cache_size;
+	}
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_VHD_INDEX)
 		flags |= TD_OPEN_VHD_INDEX;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ADD_LOG) {
@@ -750,10 +978,18 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 	}
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ADD_LCACHE)
 		flags |= TD_OPEN_LOCAL_CACHE;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ADD_WBCACHE)
+		flags |= TD_OPEN_WB_CACHE;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_CRC)
+		flags |= TD_OPEN_CRC;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_REUSE_PRT)
 		flags |= TD_OPEN_REUSE_PARENT;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_STANDBY)
 		flags |= TD_OPEN_STANDBY;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_MIRROR_COPY)
+		flags |= TD_OPEN_MIRROR_COPY;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_4K)
+		flags |= TD_OPEN_4K;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_SECONDARY) {
 		char *name = strdup(request->u.params.secondary);
 		if (!name) {
@@ -827,6 +1063,19 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 		goto fail_close;
 	}
 
+	err = tapdisk_vbd_start_vhostblk(vbd);
+	if (err) {
+		EPRINTF("failed to start vhost-user-blk back-end: %d\n", err);
+		tapdisk_nbdserver_free(vbd->nbdserver);
+		vbd->nbdserver = NULL;
+		goto fail_close;
+	}
+
+	/* a cache warmup, no reason to fail the open */
+	err = tapdisk_bootprof_start(vbd);
+	if (err)
+		EPRINTF("failed to start boot profile: %d\n", err);
+
 	err = 0;
 
 out:
@@ -878,6 +1127,9 @@ tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
 		tapdisk_nbdserver_pause(vbd->nbdserver, true);
 	}
 
+	if (vbd->vhostblk)
+		tapdisk_vhostblk_pause(vbd->vhostblk);
+
     err = 0;
     list_for_each_entry_safe(blkif, _blkif, &vbd->rings, entry) {
 
@@ -943,6 +1195,11 @@ tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
 		vbd->nbdserver = NULL;
 	}
 
+	if (vbd->vhostblk) {
+		tapdisk_vhostblk_free(vbd->vhostblk);
+		vbd->vhostblk = NULL;
+	}
+
 	tapdisk_vbd_close_vdi(vbd);
 
 	/*
@@ -965,26 +1222,16 @@ out:
 	return err;
 }
 
+/*
+ * Pauses @vbd, running its event loop until the requests in flight are
+ * done, or the connection goes.
+ */
 static int
-tapdisk_control_pause_vbd(struct tapdisk_ctl_conn *conn,
-			  tapdisk_message_t *request, tapdisk_message_t * const response)
+tapdisk_control_wait_pause(struct tapdisk_ctl_conn *conn, td_vbd_t *vbd)
 {
 	struct timeval now, next = { 0, 0 }, interval = { 0, 10000 };
 	int err = 0;
-	td_vbd_t *vbd;
-
-	ASSERT(conn);
-	ASSERT(request);
-	ASSERT(response);
-
-	vbd = tapdisk_server_get_vbd(request->cookie);
-	if (!vbd) {
-		/* TODO log error */
-		err = -ENODEV;
-		goto out;
-	}
 
-	INFO("pause requested\n");
 	do {
 		gettimeofday(&now, NULL);
 		if (TV_AFTER(now, next)) {
@@ -1006,6 +1253,30 @@ tapdisk_control_pause_vbd(struct tapdisk_ctl_conn *conn,
 	} while (conn->fd >= 0);
 	tapdisk_vbd_squash_pause_logging(false);
 
+	return err;
+}
+
+static int
+tapdisk_control_pause_vbd(struct tapdisk_ctl_conn *conn,
+			  tapdisk_message_t *request, tapdisk_message_t * const response)
+{
+	int err = 0;
+	td_vbd_t *vbd;
+
+	ASSERT(conn);
+	ASSERT(request);
+	ASSERT(response);
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		/* TODO log error */
+		err = -ENODEV;
+		goto out;
+	}
+
+	INFO("pause requested\n");
+	err = tapdisk_control_wait_pause(conn, vbd);
+
 out:
 	response->cookie = request->cookie;
 	if (!err)
@@ -1050,6 +1321,9 @@ tapdisk_control_resume_vbd(struct tapdisk_ctl_conn *conn,
 		/* TODO If an error occurs below we're not undoing this. */
 	}
 
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_MIRROR_COPY)
+		vbd->flags |= TD_OPEN_MIRROR_COPY;
+
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ADD_LOG) {
 		char *logpath = malloc(TAPDISK_MESSAGE_MAX_PATH_LENGTH);
 		ret = read(conn->fd, logpath, TAPDISK_MESSAGE_MAX_PATH_LENGTH);
@@ -1079,12 +1353,46 @@ out:
     return err;
 }
 
+struct tapdisk_control_stats {
+	td_uuid_t                    uuid;
+	td_stats_t                  *st;
+};
+
+static int
+__tapdisk_control_stats_vbd(void *private)
+{
+	struct tapdisk_control_stats *stats = private;
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(stats->uuid);
+	if (!vbd)
+		return -ENODEV;
+
+	tapdisk_vbd_stats(vbd, stats->st);
+
+	return 0;
+}
+
+static int
+__tapdisk_control_stats_all(void *private)
+{
+	struct tapdisk_control_stats *stats = private;
+	struct list_head *list = tapdisk_server_get_all_vbds();
+	td_vbd_t *vbd;
+
+	list_for_each_entry(vbd, list, next)
+		tapdisk_vbd_stats(vbd, stats->st);
+
+	return 0;
+}
+
 static int
 tapdisk_control_stats(struct tapdisk_ctl_conn *conn,
 		      tapdisk_message_t *request, tapdisk_message_t * const response)
 {
 	td_stats_t _st, *st = &_st;
-	td_vbd_t *vbd;
+	struct tapdisk_control_stats stats = { request->cookie, st };
+	int err;
 	size_t rv;
 	void *buf;
 	int new_size;
@@ -1103,21 +1411,17 @@ tapdisk_control_stats(struct tapdisk_ctl_conn *conn,
 
 	if (request->cookie != (uint16_t)-1) {
 
-		vbd = tapdisk_server_get_vbd(request->cookie);
-		if (!vbd) {
-			rv = -ENODEV;
+		err = tapdisk_server_call_vbd(request->cookie,
+					      __tapdisk_control_stats_vbd, &stats);
+		if (err) {
+			rv = err;
 			goto out;
 		}
 
-		tapdisk_vbd_stats(vbd, st);
-
 	} else {
-		struct list_head *list = tapdisk_server_get_all_vbds();
-
 		tapdisk_stats_enter(st, '[');
 
-		list_for_each_entry(vbd, list, next)
-			tapdisk_vbd_stats(vbd, st);
+		tapdisk_server_call_all(__tapdisk_control_stats_all, &stats);
 
 		tapdisk_stats_leave(st, ']');
 	}
@@ -1153,59 +1457,984 @@ out:
 		return rv;
 }
 
-/**
- * Message handler executed for TAPDISK_MESSAGE_XENBLKIF_CONNECT.
- *
- * This is the entry point for connecting the tapdisk to the shared ring. It
- * also sets up the necessary structures/descriptors (TODO explain).
- */
-static int
-tapdisk_control_xenblkif_connect(
-        struct tapdisk_ctl_conn *conn __attribute__((unused)),
-        tapdisk_message_t *request, tapdisk_message_t * const response)
+struct tapdisk_control_stats_bin {
+	td_uuid_t                     uuid;
+	struct tapdisk_stats_bin_vbd *recs;
+	int                           size;  /* records room */
+	int                           count; /* records wanted */
+};
+
+static void
+__tapdisk_control_stats_bin_add(struct tapdisk_control_stats_bin *stats,
+				td_vbd_t *vbd)
 {
-    /*
-     * Get the block interface parameters (domain ID, device ID, etc.).
-     */
-    tapdisk_message_blkif_t *blkif;
+	if (stats->count < stats->size)
+		tapdisk_vbd_stats_bin(vbd, &stats->recs[stats->count]);
 
-    td_vbd_t *vbd = NULL;
-    const char *pool;
-    size_t len;
-    int err;
-	int minor = -1;
+	stats->count++;
+}
 
-    ASSERT(conn);
-    ASSERT(request);
-    ASSERT(response);
+static int
+__tapdisk_control_stats_bin_vbd(void *private)
+{
+	struct tapdisk_control_stats_bin *stats = private;
+	td_vbd_t *vbd;
 
-	minor = request->cookie;
+	vbd = tapdisk_server_get_vbd(stats->uuid);
+	if (!vbd)
+		return -ENODEV;
 
-    vbd = tapdisk_server_get_vbd(minor);
-    if (!vbd) {
-        err = -ENODEV;
-		goto out;
-    }
+	__tapdisk_control_stats_bin_add(stats, vbd);
 
-    blkif = &request->u.blkif;
-    len = strnlen(blkif->pool, sizeof(blkif->pool));
-    if (!len)
-        pool = NULL;
-    else if (len >= sizeof(blkif->pool)) {
-        err = -EINVAL;
-		goto out;
-    } else
-        pool = blkif->pool;
+	return 0;
+}
 
-    DPRINTF("connecting VBD %d domid=%d, devid=%d, pool %s, evt %d, poll duration %d, poll idle threshold %d\n",
-            vbd->uuid, blkif->domid, blkif->devid, pool, blkif->port, blkif->poll_duration, blkif->poll_idle_threshold);
+static int
+__tapdisk_control_stats_bin_all(void *private)
+{
+	struct tapdisk_control_stats_bin *stats = private;
+	struct list_head *list = tapdisk_server_get_all_vbds();
+	td_vbd_t *vbd;
 
-    err = tapdisk_xenblkif_connect(blkif->domid, blkif->devid, blkif->gref,
-            blkif->order, blkif->port, blkif->proto, blkif->poll_duration, blkif->poll_idle_threshold, pool, vbd);
+	list_for_each_entry(vbd, list, next)
+		__tapdisk_control_stats_bin_add(stats, vbd);
 
-out:
-	response->cookie = request->cookie;
-    if (!err)
+	return 0;
+}
+
+/*
+ * Records go straight into the connection's send buffer, which is
+ * only grown if the VBDs do not fit, and kept for later connections.
+ */
+static int
+tapdisk_control_stats_bin(struct tapdisk_ctl_conn *conn,
+			  tapdisk_message_t *request,
+			  tapdisk_message_t * const response)
+{
+	struct tapdisk_control_stats_bin stats;
+	struct tapdisk_stats_bin_hdr *hdr;
+	size_t off, len;
+	void *buf;
+	int err;
+
+	ASSERT(conn->out.prod == conn->out.buf);
+	ASSERT(conn->out.cons == conn->out.buf);
+
+	off = sizeof(*response) + sizeof(*hdr);
+
+	memset(&stats, 0, sizeof(stats));
+	stats.uuid = request->cookie;
+
+	do {
+		if (conn->out.bufsz < off)
+			stats.size = 0;
+		else
+			stats.size = (conn->out.bufsz - off) /
+				sizeof(struct tapdisk_stats_bin_vbd);
+
+		stats.recs  = conn->out.buf + off;
+		stats.count = 0;
+
+		if (request->cookie != (uint16_t)-1)
+			err = tapdisk_server_call_vbd(request->cookie,
+						      __tapdisk_control_stats_bin_vbd,
+						      &stats);
+		else
+			err = tapdisk_server_call_all(__tapdisk_control_stats_bin_all,
+						      &stats);
+		if (err)
+			return err;
+
+		if (stats.count <= stats.size)
+			break;
+
+		len = off + stats.count * sizeof(struct tapdisk_stats_bin_vbd);
+
+		buf = realloc(conn->out.buf, len);
+		if (!buf)
+			return -ENOMEM;
+
+		conn->out.buf   = buf;
+		conn->out.bufsz = len;
+		conn->out.prod  = buf;
+		conn->out.cons  = buf;
+	} while (1);
+
+	hdr = conn->out.buf + sizeof(*response);
+	hdr->version  = TAPDISK_STATS_BIN_VERSION;
+	hdr->rec_size = sizeof(struct tapdisk_stats_bin_vbd);
+	hdr->count    = stats.count;
+	hdr->reserved = 0;
+
+	len = sizeof(*hdr) + stats.count * sizeof(struct tapdisk_stats_bin_vbd);
+
+	response->type          = TAPDISK_MESSAGE_STATS_BIN_RSP;
+	response->u.info.length = len;
+	tapdisk_control_write_message(conn, response);
+	conn->out.prod += len;
+
+	return 0;
+}
+
+/*
+ * Subscriptions. Each tick takes the binary stats into sub.cur and
+ * reports the VBDs which moved enough against sub.last; those not
+ * reported keep their old baseline in sub.next, which becomes
+ * sub.last. A tick finding the previous update still unsent, or a
+ * request in progress, is skipped, its changes go with the next one.
+ */
+#define TD_CTL_SUB_MIN_INTERVAL 100 /* ms */
+
+static void
+tapdisk_control_stats_unsubscribe(struct tapdisk_ctl_conn *conn)
+{
+	if (conn->sub.event_id >= 0) {
+		tapdisk_server_unregister_event(conn->sub.event_id);
+		conn->sub.event_id = -1;
+	}
+
+	free(conn->sub.cur);
+	free(conn->sub.last);
+	free(conn->sub.next);
+	memset(&conn->sub, 0, sizeof(conn->sub));
+	conn->sub.event_id = -1;
+}
+
+static int
+tapdisk_control_stats_sub_grow(struct tapdisk_ctl_conn *conn, int size)
+{
+	struct tapdisk_stats_bin_vbd **bufs[] = {
+		&conn->sub.cur, &conn->sub.last, &conn->sub.next
+	};
+	void *buf;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		buf = realloc(*bufs[i], size * sizeof(**bufs[i]));
+		if (!buf)
+			return -ENOMEM;
+		*bufs[i] = buf;
+	}
+
+	conn->sub.size = size;
+
+	return 0;
+}
+
+static int
+tapdisk_control_stats_sub_moved(struct tapdisk_ctl_conn *conn,
+				const struct tapdisk_stats_bin_vbd *c,
+				const struct tapdisk_stats_bin_vbd *p)
+{
+	uint64_t secs;
+
+	if (!p)
+		return 1;
+
+	if (c->state != p->state || c->images != p->images ||
+	    c->errors != p->errors)
+		return 1;
+
+	secs = (c->secs_rd - p->secs_rd) + (c->secs_wr - p->secs_wr);
+	if (conn->sub.threshold)
+		return secs >= conn->sub.threshold;
+
+	return (secs ||
+		c->received != p->received || c->returned != p->returned ||
+		c->kicked   != p->kicked   || c->retries  != p->retries  ||
+		c->hits_rd  != p->hits_rd  || c->hits_wr  != p->hits_wr  ||
+		c->fail_rd  != p->fail_rd  || c->fail_wr  != p->fail_wr);
+}
+
+static void
+tapdisk_control_stats_sub_delta(struct tapdisk_stats_bin_vbd *d,
+				const struct tapdisk_stats_bin_vbd *c,
+				const struct tapdisk_stats_bin_vbd *p)
+{
+	*d = *c;
+	if (!p)
+		return;
+
+	d->secs_rd  -= p->secs_rd;
+	d->secs_wr  -= p->secs_wr;
+	d->received -= p->received;
+	d->returned -= p->returned;
+	d->kicked   -= p->kicked;
+	d->retries  -= p->retries;
+	d->errors   -= p->errors;
+	d->hits_rd  -= p->hits_rd;
+	d->hits_wr  -= p->hits_wr;
+	d->fail_rd  -= p->fail_rd;
+	d->fail_wr  -= p->fail_wr;
+}
+
+static void
+tapdisk_control_stats_push(event_id_t id, char mode, void *private)
+{
+	struct tapdisk_ctl_conn *conn = private;
+	struct tapdisk_control_stats_bin stats;
+	struct tapdisk_stats_bin_vbd *recs, *p, *tmp;
+	struct tapdisk_stats_bin_hdr *hdr;
+	tapdisk_message_t message;
+	size_t off, len;
+	int i, j, k, n, err;
+	void *buf;
+
+	if (conn->in.busy || conn->out.prod != conn->out.cons)
+		return;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.uuid = conn->sub.uuid;
+
+	do {
+		stats.recs  = conn->sub.cur;
+		stats.size  = conn->sub.size;
+		stats.count = 0;
+
+		if (stats.uuid != (uint16_t)-1)
+			err = tapdisk_server_call_vbd(stats.uuid,
+						      __tapdisk_control_stats_bin_vbd,
+						      &stats);
+		else
+			err = tapdisk_server_call_all(__tapdisk_control_stats_bin_all,
+						      &stats);
+		if (err == -ENODEV)
+			stats.count = err = 0;
+		if (err)
+			goto fail;
+
+		if (stats.count <= stats.size)
+			break;
+
+		err = tapdisk_control_stats_sub_grow(conn, stats.count);
+		if (err)
+			goto fail;
+	} while (1);
+
+	/* at worst, every VBD moved and every old one is gone */
+	off = sizeof(message) + sizeof(*hdr);
+	len = off + (stats.count + conn->sub.count) * sizeof(*recs);
+	if (conn->out.bufsz < len) {
+		buf = realloc(conn->out.buf, len);
+		if (!buf) {
+			err = -ENOMEM;
+			goto fail;
+		}
+		conn->out.buf   = buf;
+		conn->out.bufsz = len;
+	}
+
+	conn->out.prod = conn->out.buf;
+	conn->out.cons = conn->out.buf;
+
+	recs = conn->out.buf + off;
+	n    = 0;
+
+	/* VBDs come in the same order tick by tick, so j mostly hits */
+	for (i = 0, j = 0; i < stats.count; i++) {
+		p = NULL;
+		for (k = 0; k < conn->sub.count; k++) {
+			if (j >= conn->sub.count)
+				j = 0;
+			if (conn->sub.last[j].minor == conn->sub.cur[i].minor) {
+				/* marks it seen, cleared below */
+				p = &conn->sub.last[j++];
+				p->reserved = 1;
+				break;
+			}
+			j++;
+		}
+
+		if (tapdisk_control_stats_sub_moved(conn, &conn->sub.cur[i], p)) {
+			tapdisk_control_stats_sub_delta(&recs[n++],
+							&conn->sub.cur[i], p);
+			conn->sub.next[i] = conn->sub.cur[i];
+		} else
+			conn->sub.next[i] = *p;
+	}
+
+	for (k = 0; k < conn->sub.count; k++) {
+		p = &conn->sub.last[k];
+		if (p->reserved)
+			continue;
+
+		memset(&recs[n], 0, sizeof(recs[n]));
+		recs[n].minor = p->minor;
+		recs[n].state = TAPDISK_STATS_UPDATE_GONE;
+		n++;
+	}
+
+	for (i = 0; i < stats.count; i++)
+		conn->sub.next[i].reserved = 0;
+
+	tmp             = conn->sub.last;
+	conn->sub.last  = conn->sub.next;
+	conn->sub.next  = tmp;
+	conn->sub.count = stats.count;
+
+	if (!n)
+		return;
+
+	hdr = conn->out.buf + sizeof(message);
+	hdr->version  = TAPDISK_STATS_BIN_VERSION;
+	hdr->rec_size = sizeof(*recs);
+	hdr->count    = n;
+	hdr->reserved = 0;
+
+	len = sizeof(*hdr) + n * sizeof(*recs);
+
+	memset(&message, 0, sizeof(message));
+	message.type          = TAPDISK_MESSAGE_STATS_UPDATE;
+	message.cookie        = conn->sub.uuid;
+	message.u.info.length = len;
+	tapdisk_ctl_conn_write(conn, &message, sizeof(message));
+	conn->out.prod += len;
+
+	/* requests wait for the update to go, see session_resume */
+	if (conn->in.event_id > 0)
+		tapdisk_server_mask_event(conn->in.event_id, 1);
+
+	return;
+
+fail:
+	ERR(err, "stats update for %d failed, unsubscribing\n",
+	    conn->sub.uuid);
+	tapdisk_control_stats_unsubscribe(conn);
+}
+
+/*
+ * Turns the connection into a session receiving stats updates, see
+ * struct tapdisk_message_subscribe. Subscribing again changes the
+ * interval and threshold, keeping what was reported.
+ */
+static int
+tapdisk_control_stats_subscribe(struct tapdisk_ctl_conn *conn,
+				tapdisk_message_t *request,
+				tapdisk_message_t * const response)
+{
+	uint32_t interval;
+	int err;
+
+	interval = request->u.subscribe.interval ? : 1000;
+	if (interval < TD_CTL_SUB_MIN_INTERVAL)
+		return -EINVAL;
+
+	if (conn->sub.event_id >= 0 && conn->sub.uuid != request->cookie)
+		tapdisk_control_stats_unsubscribe(conn);
+
+	if (conn->sub.event_id >= 0) {
+		err = tapdisk_server_event_set_timeout(conn->sub.event_id,
+						       TV_USECS(interval * 1000));
+		if (err)
+			return err;
+	} else {
+		err = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+						    TV_USECS(interval * 1000),
+						    tapdisk_control_stats_push,
+						    conn);
+		if (err < 0)
+			return err;
+		conn->sub.event_id = err;
+	}
+
+	conn->sub.uuid      = request->cookie;
+	conn->sub.threshold = request->u.subscribe.threshold;
+
+	conn->session = 1;
+	if (conn->in.event_id > 0)
+		tapdisk_server_event_set_timeout(conn->in.event_id, TV_INF);
+
+	response->type   = TAPDISK_MESSAGE_STATS_SUBSCRIBE_RSP;
+	response->cookie = request->cookie;
+
+	return 0;
+}
+
+static int
+tapdisk_control_trace(struct tapdisk_ctl_conn *conn,
+		      tapdisk_message_t *request,
+		      tapdisk_message_t * const response)
+{
+	td_vbd_t *vbd;
+	unsigned int size;
+	int err;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd)
+		return -ENODEV;
+
+	switch (request->u.trace.cmd) {
+	case TAPDISK_TRACE_START:
+		size = request->u.trace.size ? : TD_TRACE_DEFAULT_SIZE;
+		if (size > TD_TRACE_MAX_SIZE)
+			return -EINVAL;
+
+		err = tapdisk_vbd_trace_start(vbd, size);
+		if (err)
+			return err;
+		break;
+
+	case TAPDISK_TRACE_STOP:
+		tapdisk_vbd_trace_stop(vbd);
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	response->type = TAPDISK_MESSAGE_TRACE_RSP;
+	response->u.response.error = 0;
+
+	return 0;
+}
+
+static int
+tapdisk_control_profile(struct tapdisk_ctl_conn *conn,
+			tapdisk_message_t *request,
+			tapdisk_message_t * const response)
+{
+	td_vbd_t *vbd;
+	int err;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd)
+		return -ENODEV;
+
+	err = tapdisk_vbd_profile(vbd, request->u.profile.cmd);
+	if (err)
+		return err;
+
+	response->type = TAPDISK_MESSAGE_PROFILE_RSP;
+	response->u.response.error = 0;
+
+	return 0;
+}
+
+static int
+tapdisk_control_coalesce(struct tapdisk_ctl_conn *conn,
+			 tapdisk_message_t *request,
+			 tapdisk_message_t * const response)
+{
+	td_vbd_t *vbd;
+	int err;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd)
+		return -ENODEV;
+
+	switch (request->u.coalesce.cmd) {
+	case TAPDISK_COALESCE_START:
+		err = tapdisk_coalesce_start(vbd, request->u.coalesce.rate);
+		if (err)
+			return err;
+		break;
+
+	case TAPDISK_COALESCE_STOP:
+		if (!vbd->coalesce)
+			return -ENOENT;
+		if (tapdisk_coalesce_busy(vbd))
+			return -EAGAIN;
+		tapdisk_coalesce_stop(vbd);
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	response->type = TAPDISK_MESSAGE_COALESCE_RSP;
+	response->u.response.error = 0;
+
+	return 0;
+}
+
+static int
+tapdisk_control_backup(struct tapdisk_ctl_conn *conn,
+		       tapdisk_message_t *request,
+		       tapdisk_message_t * const response)
+{
+	td_vbd_t *vbd;
+	int err;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd)
+		return -ENODEV;
+
+	switch (request->u.backup.cmd) {
+	case TAPDISK_BACKUP_START:
+		err = tapdisk_backup_start(vbd);
+		if (err)
+			return err;
+		break;
+
+	case TAPDISK_BACKUP_STOP:
+		if (!vbd->backup)
+			return -ENOENT;
+		if (tapdisk_backup_busy(vbd))
+			return -EAGAIN;
+		tapdisk_backup_stop(vbd);
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	response->type = TAPDISK_MESSAGE_BACKUP_RSP;
+	response->u.response.error = 0;
+
+	return 0;
+}
+
+/*
+ * Runs on the main thread, which owns the worker placement. May come
+ * before the VBD is attached, to give it a worker of its own.
+ */
+static int
+tapdisk_control_cgroup(struct tapdisk_ctl_conn *conn,
+		       tapdisk_message_t *request,
+		       tapdisk_message_t * const response)
+{
+	char *cgroup = request->u.string.text;
+	int err;
+
+	cgroup[sizeof(request->u.string.text) - 1] = '\0';
+
+	err = tapdisk_server_set_cgroup(request->cookie, cgroup);
+	if (err)
+		return err;
+
+	response->type = TAPDISK_MESSAGE_CGROUP_RSP;
+	response->u.response.error = 0;
+
+	return 0;
+}
+
+/*
+ * Swaps the CBT log of a running VBD, between two of its writes. A paused
+ * VBD just opens the new log on unpause.
+ */
+static int
+tapdisk_control_cbt_rotate(struct tapdisk_ctl_conn *conn,
+			   tapdisk_message_t *request,
+			   tapdisk_message_t * const response)
+{
+	char *path = request->u.string.text;
+	uint64_t epoch;
+	td_image_t *image, *tmp, *log;
+	td_vbd_t *vbd;
+	char *logpath;
+	int err;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd)
+		return -ENODEV;
+
+	if (!td_flag_test(vbd->flags, TD_OPEN_ADD_LOG))
+		return -ENOENT;
+
+	path[sizeof(request->u.string.text) - 1] = '\0';
+
+	logpath = strdup(path);
+	if (!logpath)
+		return -ENOMEM;
+
+	log = NULL;
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		if (image->type == DISK_TYPE_LOG) {
+			log = image;
+			break;
+		}
+
+	if (log) {
+		err = tdlog_rotate(log->driver, path, &epoch);
+		if (err) {
+			free(logpath);
+			return err;
+		}
+	} else if (!td_flag_test(vbd->state, TD_VBD_PAUSED)) {
+		free(logpath);
+		return -ENOENT;
+	}
+
+	free(vbd->logpath);
+	vbd->logpath = logpath;
+
+	response->type = TAPDISK_MESSAGE_CBT_ROTATE_RSP;
+	response->u.response.error = 0;
+	if (log)
+		snprintf(response->u.response.message,
+			 sizeof(response->u.response.message),
+			 "epoch %"PRIu64, epoch);
+
+	return 0;
+}
+
+struct tapdisk_control_group {
+	struct tapdisk_ctl_conn     *conn;
+	td_uuid_t                    uuid;
+};
+
+static int
+__tapdisk_control_group_check(void *private)
+{
+	struct tapdisk_control_group *g = private;
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(g->uuid);
+	if (!vbd)
+		return -ENODEV;
+
+	if (td_flag_test(vbd->state, TD_VBD_PAUSED) ||
+	    td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED))
+		return -EBUSY;
+
+	return 0;
+}
+
+/* stops it taking requests, those in flight drain meanwhile */
+static int
+__tapdisk_control_group_quiesce(void *private)
+{
+	struct tapdisk_control_group *g = private;
+	td_vbd_t *vbd;
+	int err;
+
+	vbd = tapdisk_server_get_vbd(g->uuid);
+	if (!vbd)
+		return -ENODEV;
+
+	err = tapdisk_vbd_pause(vbd);
+
+	return err == -EAGAIN ? 0 : err;
+}
+
+static int
+__tapdisk_control_group_wait(void *private)
+{
+	struct tapdisk_control_group *g = private;
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(g->uuid);
+	if (!vbd)
+		return -ENODEV;
+
+	if (td_flag_test(vbd->state, TD_VBD_PAUSED))
+		return 0;
+
+	return tapdisk_control_wait_pause(g->conn, vbd);
+}
+
+static int
+__tapdisk_control_group_resume(void *private)
+{
+	struct tapdisk_control_group *g = private;
+	td_vbd_t *vbd;
+	int err;
+
+	vbd = tapdisk_server_get_vbd(g->uuid);
+	if (!vbd)
+		return -ENODEV;
+
+	if (td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED)) {
+		err = tapdisk_vbd_pause(vbd);
+		if (err) {
+			EPRINTF("VBD %d still pausing, left so\n", g->uuid);
+			return err;
+		}
+	}
+
+	return tapdisk_vbd_resume(vbd, NULL);
+}
+
+/*
+ * Pauses the VBDs of u.minors together: all stop taking requests before
+ * any is waited for, so they drain in parallel, and the pause windows
+ * overlap. Either they all end up paused, or none of them.
+ */
+static int
+tapdisk_control_pause_group(struct tapdisk_ctl_conn *conn,
+			    tapdisk_message_t *request,
+			    tapdisk_message_t * const response)
+{
+	struct tapdisk_message_minors *m = &request->u.minors;
+	struct tapdisk_control_group g = { .conn = conn };
+	int i, n, err, ret;
+
+	if (m->count < 1 || m->count > TAPDISK_MESSAGE_MAX_MINORS)
+		return -EINVAL;
+
+	for (i = 0; i < m->count; i++) {
+		g.uuid = m->list[i];
+		err = tapdisk_server_call_vbd(g.uuid,
+					      __tapdisk_control_group_check, &g);
+		if (err) {
+			ERR(err, "VBD %d cannot join the group pause\n",
+			    g.uuid);
+			return err;
+		}
+	}
+
+	INFO("pausing %d VBDs\n", m->count);
+
+	err = 0;
+	for (n = 0; n < m->count && !err; n++) {
+		g.uuid = m->list[n];
+		err = tapdisk_server_call_vbd(g.uuid,
+					      __tapdisk_control_group_quiesce,
+					      &g);
+	}
+
+	for (i = 0; i < n; i++) {
+		g.uuid = m->list[i];
+		ret = tapdisk_server_call_vbd(g.uuid,
+					      __tapdisk_control_group_wait, &g);
+		if (ret && !err)
+			err = ret;
+	}
+
+	if (err) {
+		ERR(err, "group pause failed, resuming\n");
+		for (i = 0; i < n; i++) {
+			g.uuid = m->list[i];
+			tapdisk_server_call_vbd(g.uuid,
+						__tapdisk_control_group_resume,
+						&g);
+		}
+		return err;
+	}
+
+	response->type = TAPDISK_MESSAGE_PAUSE_GROUP_RSP;
+	return 0;
+}
+
+/*
+ * Resumes each VBD of u.minors on the images it had, logs included.
+ * All are tried, the first failure is returned.
+ */
+static int
+tapdisk_control_resume_group(struct tapdisk_ctl_conn *conn,
+			     tapdisk_message_t *request,
+			     tapdisk_message_t * const response)
+{
+	struct tapdisk_message_minors *m = &request->u.minors;
+	struct tapdisk_control_group g = { .conn = conn };
+	int i, err, ret;
+
+	if (m->count < 1 || m->count > TAPDISK_MESSAGE_MAX_MINORS)
+		return -EINVAL;
+
+	INFO("resuming %d VBDs\n", m->count);
+
+	err = 0;
+	for (i = 0; i < m->count; i++) {
+		g.uuid = m->list[i];
+		ret = tapdisk_server_call_vbd(g.uuid,
+					      __tapdisk_control_group_resume,
+					      &g);
+		if (ret) {
+			ERR(ret, "VBD %d failed to resume\n", g.uuid);
+			if (!err)
+				err = ret;
+		}
+	}
+
+	if (!err)
+		response->type = TAPDISK_MESSAGE_RESUME_GROUP_RSP;
+	return err;
+}
+
+static int
+tapdisk_control_nbd_handoff(struct tapdisk_ctl_conn *conn,
+			    tapdisk_message_t *request,
+			    tapdisk_message_t * const response)
+{
+	td_vbd_t *vbd;
+	int n;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd)
+		return -ENODEV;
+
+	if (!vbd->nbdserver)
+		return -ENOENT;
+
+	n = tapdisk_nbdserver_handoff(vbd->nbdserver,
+			request->u.handoff.pid, request->u.handoff.minor);
+	if (n < 0)
+		return n;
+
+	response->type = TAPDISK_MESSAGE_NBD_HANDOFF_RSP;
+	response->u.response.error = 0;
+	snprintf(response->u.response.message,
+		 sizeof(response->u.response.message),
+		 "handed over %d NBD clients", n);
+
+	return 0;
+}
+
+struct tapdisk_control_trace_read {
+	td_uuid_t                     uuid;
+	struct tapdisk_trace_rec     *recs;
+	unsigned int                  size;    /* records room */
+	unsigned int                  max;     /* records wanted, at most */
+	unsigned int                  count;   /* records read, or wanted */
+	uint32_t                      dropped;
+};
+
+static int
+__tapdisk_control_trace_read(void *private)
+{
+	struct tapdisk_control_trace_read *read = private;
+	td_vbd_t *vbd;
+	uint64_t pending;
+
+	vbd = tapdisk_server_get_vbd(read->uuid);
+	if (!vbd)
+		return -ENODEV;
+
+	if (!vbd->trace)
+		return -ENOENT;
+
+	pending = tapdisk_trace_pending(vbd->trace);
+	if (pending > read->max)
+		pending = read->max;
+
+	if (pending > read->size) {
+		read->count = pending;
+		return 0;
+	}
+
+	read->count = tapdisk_trace_read(vbd->trace, read->recs, read->size,
+					 &read->dropped);
+
+	return 0;
+}
+
+/*
+ * Drains the trace ring into the connection's send buffer, which is
+ * only grown if the pending records do not fit.
+ */
+static int
+tapdisk_control_trace_read(struct tapdisk_ctl_conn *conn,
+			   tapdisk_message_t *request,
+			   tapdisk_message_t * const response)
+{
+	struct tapdisk_control_trace_read read;
+	struct tapdisk_trace_hdr *hdr;
+	size_t off, len;
+	void *buf;
+	int err;
+
+	ASSERT(conn->out.prod == conn->out.buf);
+	ASSERT(conn->out.cons == conn->out.buf);
+
+	off = sizeof(*response) + sizeof(*hdr);
+
+	memset(&read, 0, sizeof(read));
+	read.uuid = request->cookie;
+	read.max  = request->u.trace.size ? : TD_TRACE_MAX_SIZE;
+
+	do {
+		if (conn->out.bufsz < off)
+			read.size = 0;
+		else
+			read.size = (conn->out.bufsz - off) /
+				sizeof(struct tapdisk_trace_rec);
+		if (read.size > read.max)
+			read.size = read.max;
+
+		read.recs  = conn->out.buf + off;
+		read.count = 0;
+
+		err = tapdisk_server_call_vbd(request->cookie,
+					      __tapdisk_control_trace_read,
+					      &read);
+		if (err)
+			return err;
+
+		if (read.count <= read.size)
+			break;
+
+		len = off + read.count * sizeof(struct tapdisk_trace_rec);
+
+		buf = realloc(conn->out.buf, len);
+		if (!buf)
+			return -ENOMEM;
+
+		conn->out.buf   = buf;
+		conn->out.bufsz = len;
+		conn->out.prod  = buf;
+		conn->out.cons  = buf;
+	} while (1);
+
+	hdr = conn->out.buf + sizeof(*response);
+	hdr->version  = TAPDISK_TRACE_VERSION;
+	hdr->rec_size = sizeof(struct tapdisk_trace_rec);
+	hdr->count    = read.count;
+	hdr->dropped  = read.dropped;
+
+	len = sizeof(*hdr) + read.count * sizeof(struct tapdisk_trace_rec);
+
+	response->type          = TAPDISK_MESSAGE_TRACE_READ_RSP;
+	response->u.info.length = len;
+	tapdisk_control_write_message(conn, response);
+	conn->out.prod += len;
+
+	return 0;
+}
+
+/**
+ * Message handler executed for TAPDISK_MESSAGE_XENBLKIF_CONNECT.
+ *
+ * This is the entry point for connecting the tapdisk to the shared ring. It
+ * also sets up the necessary structures/descriptors (TODO explain).
+ */
+static int
+tapdisk_control_xenblkif_connect(
+        struct tapdisk_ctl_conn *conn __attribute__((unused)),
+        tapdisk_message_t *request, tapdisk_message_t * const response)
+{
+    /*
+     * Get the block interface parameters (domain ID, device ID, etc.).
+     */
+    tapdisk_message_blkif_t *blkif;
+
+    td_vbd_t *vbd = NULL;
+    const char *pool;
+    size_t len;
+    int err;
+	int minor = -1;
+
+    ASSERT(conn);
+    ASSERT(request);
+    ASSERT(response);
+
+	minor = request->cookie;
+
+    vbd = tapdisk_server_get_vbd(minor);
+    if (!vbd) {
+        err = -ENODEV;
+		goto out;
+    }
+
+    blkif = &request->u.blkif;
+    len = strnlen(blkif->pool, sizeof(blkif->pool));
+    if (!len)
+        pool = NULL;
+    else if (len >= sizeof(blkif->pool)) {
+        err = -EINVAL;
+		goto out;
+    } else
+        pool = blkif->pool;
+
+    DPRINTF("connecting VBD %d domid=%d, devid=%d, queue %u, pool %s, evt %d, poll duration %d, poll idle threshold %d\n",
+            vbd->uuid, blkif->domid, blkif->devid, blkif->queue, pool, blkif->port, blkif->poll_duration, blkif->poll_idle_threshold);
+
+    err = tapdisk_xenblkif_connect(blkif->domid, blkif->devid, blkif->gref,
+            blkif->order, blkif->port, blkif->proto, blkif->poll_duration, blkif->poll_idle_threshold, pool, blkif->queue, vbd);
+
+out:
+	response->cookie = request->cookie;
+    if (!err)
         response->type = TAPDISK_MESSAGE_XENBLKIF_CONNECT_RSP;
     else
 		EPRINTF("VBD %d failed to connect to the shared ring: %s\n",
@@ -1214,6 +2443,14 @@ out:
     return err;
 }
 
+static int
+__tapdisk_control_xenblkif_disconnect(void *private)
+{
+	tapdisk_message_blkif_t *blkif_msg = private;
+
+	return tapdisk_xenblkif_disconnect(blkif_msg->domid, blkif_msg->devid);
+}
+
 static int
 tapdisk_control_xenblkif_disconnect(
         struct tapdisk_ctl_conn *conn __attribute__((unused)),
@@ -1232,7 +2469,8 @@ tapdisk_control_xenblkif_disconnect(
     DPRINTF("disconnecting domid=%d, devid=%d\n", blkif_msg->domid,
             blkif_msg->devid);
 
-    err = tapdisk_xenblkif_disconnect(blkif_msg->domid, blkif_msg->devid);
+    err = tapdisk_server_call_any(__tapdisk_control_xenblkif_disconnect,
+            blkif_msg);
     if (!err)
         response->type = TAPDISK_MESSAGE_XENBLKIF_DISCONNECT_RSP;
 	else
@@ -1286,17 +2524,21 @@ struct tapdisk_control_info message_infos[] = {
 		.handler = tapdisk_control_list,
 		.flags   = TAPDISK_MSG_REENTER,
 	},
+	[TAPDISK_MESSAGE_SESSION] = {
+		.handler = tapdisk_control_session,
+		.flags   = TAPDISK_MSG_REENTER,
+	},
 	[TAPDISK_MESSAGE_ATTACH] = {
 		.handler = tapdisk_control_attach_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_DETACH] = {
 		.handler = tapdisk_control_detach_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
     [TAPDISK_MESSAGE_XENBLKIF_CONNECT] = {
 		.handler = tapdisk_control_xenblkif_connect,
-		.flags = TAPDISK_MSG_VERBOSE
+		.flags = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD
 	},
     [TAPDISK_MESSAGE_XENBLKIF_DISCONNECT] = {
         .handler = tapdisk_control_xenblkif_disconnect,
@@ -1304,32 +2546,80 @@ struct tapdisk_control_info message_infos[] = {
     },
     [TAPDISK_MESSAGE_DISK_INFO] = {
         .handler = tapdisk_control_disk_info,
-        .flags = TAPDISK_MSG_VERBOSE
+        .flags = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD
     },
 	[TAPDISK_MESSAGE_OPEN] = {
 		.handler = tapdisk_control_open_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_PAUSE] = {
 		.handler = tapdisk_control_pause_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_RESUME] = {
 		.handler = tapdisk_control_resume_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_CLOSE] = {
 		.handler = tapdisk_control_close_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_FORCE_SHUTDOWN] = {
 		.handler = tapdisk_control_close_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_STATS] = {
 		.handler = tapdisk_control_stats,
 		.flags   = TAPDISK_MSG_REENTER,
 	},
+	[TAPDISK_MESSAGE_STATS_BIN] = {
+		.handler = tapdisk_control_stats_bin,
+		.flags   = TAPDISK_MSG_REENTER,
+	},
+	[TAPDISK_MESSAGE_STATS_SUBSCRIBE] = {
+		.handler = tapdisk_control_stats_subscribe,
+		.flags   = TAPDISK_MSG_REENTER,
+	},
+	[TAPDISK_MESSAGE_TRACE] = {
+		.handler = tapdisk_control_trace,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_TRACE_READ] = {
+		.handler = tapdisk_control_trace_read,
+		.flags   = TAPDISK_MSG_REENTER,
+	},
+	[TAPDISK_MESSAGE_PROFILE] = {
+		.handler = tapdisk_control_profile,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_COALESCE] = {
+		.handler = tapdisk_control_coalesce,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_NBD_HANDOFF] = {
+		.handler = tapdisk_control_nbd_handoff,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_BACKUP] = {
+		.handler = tapdisk_control_backup,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_CGROUP] = {
+		.handler = tapdisk_control_cgroup,
+		.flags   = TAPDISK_MSG_VERBOSE,
+	},
+	[TAPDISK_MESSAGE_CBT_ROTATE] = {
+		.handler = tapdisk_control_cbt_rotate,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_PAUSE_GROUP] = {
+		.handler = tapdisk_control_pause_group,
+		.flags   = TAPDISK_MSG_VERBOSE,
+	},
+	[TAPDISK_MESSAGE_RESUME_GROUP] = {
+		.handler = tapdisk_control_resume_group,
+		.flags   = TAPDISK_MSG_VERBOSE,
+	},
 };
 
 static int
@@ -1347,7 +2637,7 @@ tapdisk_control_receive_request(struct tapdisk_ctl_conn *conn)
 	if (err)
 		goto invalid;
 
-	if (conn->request.type > TAPDISK_MESSAGE_EXIT)
+	if (conn->request.type > TAPDISK_MESSAGE_MAX)
 		goto invalid;
 
 	conn->info = &message_infos[conn->request.type];
@@ -1387,6 +2677,14 @@ invalid:
 	goto error;
 }
 
+static int
+tapdisk_control_call_handler(void *private)
+{
+	struct tapdisk_ctl_conn *conn = private;
+
+	return conn->info->handler(conn, &conn->request, &conn->response);
+}
+
 static void
 tapdisk_control_process_request(event_id_t event_id,
 			char mode __attribute__((unused)), void *private)
@@ -1409,16 +2707,24 @@ tapdisk_control_process_request(event_id_t event_id,
 	memset(&conn->response, 0, sizeof(conn->response));
 	conn->response.cookie = conn->request.cookie;
 
-    err = conn->info->handler(conn, &conn->request, &conn->response);
+	if (conn->info->flags & TAPDISK_MSG_VBD)
+		err = tapdisk_server_call_vbd(conn->request.cookie,
+					      tapdisk_control_call_handler, conn);
+	else
+		err = conn->info->handler(conn, &conn->request, &conn->response);
     if (err) {
         conn->response.type = TAPDISK_MESSAGE_ERROR;
         conn->response.u.response.error = -err;
     }
-	if (err || conn->response.type != TAPDISK_MESSAGE_STATS_RSP)
+	if (err || (conn->response.type != TAPDISK_MESSAGE_STATS_RSP &&
+		    conn->response.type != TAPDISK_MESSAGE_STATS_BIN_RSP &&
+		    conn->response.type != TAPDISK_MESSAGE_TRACE_READ_RSP))
 	    tapdisk_control_write_message(conn, &conn->response);
 
 	conn->in.busy = 0;
 	if (excl) {
+		tapdisk_control_publish();
+
 		if (!list_empty(&td_control.pending)) {
 			struct tapdisk_ctl_conn *cur = list_first_entry(
 					&td_control.pending, struct tapdisk_ctl_conn, entry);
@@ -1430,7 +2736,10 @@ tapdisk_control_process_request(event_id_t event_id,
 		td_control.busy = 0;
 	}
 
-	tapdisk_control_release_connection(conn);
+	if (conn->session)
+		tapdisk_control_session_next(conn);
+	else
+		tapdisk_control_release_connection(conn);
 }
 
 
@@ -1625,6 +2934,13 @@ tapdisk_control_create_socket(char **socket_path)
 	td_control.event_id = err;
 	*socket_path = td_control.path;
 
+	if (!tapdisk_control_mkdir(BLKTAP2_LIST_DIR)) {
+		if (asprintf(&td_control.list_path, "%s/%d",
+			     BLKTAP2_LIST_DIR, getpid()) == -1)
+			td_control.list_path = NULL;
+		tapdisk_control_publish();
+	}
+
 	return 0;
 
 fail:
@@ -124,6 +124,30 @@ static const disk_info_t llecache_disk = {
 	0,
 };
 
+static const disk_info_t wbcache_disk = {
+	"lwb",
+	"local write-back cache (lwb)",
+	DISK_TYPE_FILTER,
+};
+
+static const disk_info_t qcow2_disk = {
+	"qcow2",
+	"qemu copy-on-write image, version 2 and 3 (qcow2)",
+	0,
+};
+
+static const disk_info_t zimg_disk = {
+	"zimg",
+	"compressed read-only image (zimg)",
+	0,
+};
+
+static const disk_info_t crc_disk = {
+	"crc",
+	"CRC32C integrity check (crc)",
+	DISK_TYPE_FILTER,
+};
+
 static const disk_info_t valve_disk = {
        "valve",
        "group rate limiting (valve)",
@@ -160,6 +184,10 @@ const disk_info_t *tapdisk_disk_types[] = {
 	[DISK_TYPE_LLECACHE]    = &llecache_disk,
 	[DISK_TYPE_NBD]         = &nbd_disk,
 	[DISK_TYPE_NTNX]        = &ntnx_disk,
+	[DISK_TYPE_WBCACHE]     = &wbcache_disk,
+	[DISK_TYPE_QCOW2]       = &qcow2_disk,
+	[DISK_TYPE_ZIMG]        = &zimg_disk,
+	[DISK_TYPE_CRC]         = &crc_disk,
 	0,
 };
 
@@ -183,6 +211,10 @@ extern struct tap_disk tapdisk_llecache;
 extern struct tap_disk tapdisk_valve;
 extern struct tap_disk tapdisk_nbd;
 extern struct tap_disk tapdisk_ntnx;
+extern struct tap_disk tapdisk_wbcache;
+extern struct tap_disk tapdisk_qcow2;
+extern struct tap_disk tapdisk_zimg;
+extern struct tap_disk tapdisk_crc;
 
 const struct tap_disk *tapdisk_disk_drivers[] = {
 	[DISK_TYPE_AIO]         = &tapdisk_aio,
@@ -205,6 +237,10 @@ const struct tap_disk *tapdisk_disk_drivers[] = {
 	[DISK_TYPE_VALVE]       = &tapdisk_valve,
 	[DISK_TYPE_NBD]         = &tapdisk_nbd,
 	[DISK_TYPE_NTNX]        = &tapdisk_ntnx,
+	[DISK_TYPE_WBCACHE]     = &tapdisk_wbcache,
+	[DISK_TYPE_QCOW2]       = &tapdisk_qcow2,
+	[DISK_TYPE_ZIMG]        = &tapdisk_zimg,
+	[DISK_TYPE_CRC]         = &tapdisk_crc,
 	0,
 };
 
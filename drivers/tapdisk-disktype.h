@@ -48,6 +48,10 @@
 #define DISK_TYPE_VALVE       14
 #define DISK_TYPE_NBD         15
 #define DISK_TYPE_NTNX        16
+#define DISK_TYPE_WBCACHE     17
+#define DISK_TYPE_QCOW2       18
+#define DISK_TYPE_ZIMG        19
+#define DISK_TYPE_CRC         20
 
 #define DISK_TYPE_NAME_MAX    32
 
@@ -276,3 +276,74 @@ error:
 
 	return NULL;
 }
+
+/*
+ * The sending side, for handing a descriptor to another tapdisk. The
+ * receiver takes one connection at a time and closes it once the fd is
+ * delivered, so wait for that before returning: a second connection
+ * arriving early would be dropped, and the fd in flight with it.
+ */
+int
+td_fdreceiver_send_fd(const char *path, int fd, const char *msg)
+{
+	struct sockaddr_un remote;
+	char buf[CMSG_SPACE(sizeof(fd))];
+	struct msghdr mh;
+	struct iovec vec;
+	struct cmsghdr *cmsg;
+	struct timeval tv;
+	char c;
+	int s, err;
+
+	memset(&remote, 0, sizeof(remote));
+	remote.sun_family = AF_UNIX;
+	err = snprintf(remote.sun_path, sizeof(remote.sun_path), "%s", path);
+	if (err < 0 || err >= sizeof(remote.sun_path))
+		return -ENAMETOOLONG;
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0)
+		return -errno;
+
+	if (connect(s, (struct sockaddr *)&remote, sizeof(remote)) < 0) {
+		err = -errno;
+		ERROR("td_fdreceiver_send_fd: error connecting (path=%s): %s",
+				path, strerror(-err));
+		goto out;
+	}
+
+	memset(&mh, 0, sizeof(mh));
+	vec.iov_base = (void *)msg;
+	vec.iov_len = strlen(msg) + 1;
+	mh.msg_iov = &vec;
+	mh.msg_iovlen = 1;
+	mh.msg_control = buf;
+	mh.msg_controllen = sizeof(buf);
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+	if (sendmsg(s, &mh, 0) < 0) {
+		err = -errno;
+		ERROR("td_fdreceiver_send_fd: error sending (path=%s): %s",
+				path, strerror(-err));
+		goto out;
+	}
+
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	/* the receiver never writes, EOF means it took the fd */
+	err = recv(s, &c, 1, 0) < 0 ? -errno : 0;
+	if (err)
+		ERROR("td_fdreceiver_send_fd: no ack (path=%s): %s",
+				path, strerror(-err));
+
+out:
+	close(s);
+	return err;
+}
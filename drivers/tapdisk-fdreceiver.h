@@ -34,6 +34,12 @@ typedef void (*fd_cb_t) (int fd, char *msg, void *data);
 struct td_fdreceiver *td_fdreceiver_start(char *path, fd_cb_t, void *data);
 void td_fdreceiver_stop(struct td_fdreceiver *);
 
+/**
+ * Passes @fd, with @msg, to the fd receiver listening on @path. Returns
+ * once the receiver has it.
+ */
+int td_fdreceiver_send_fd(const char *path, int fd, const char *msg);
+
 struct td_fdreceiver {
 	char *path;
 
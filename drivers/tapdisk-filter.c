@@ -32,12 +32,15 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <libaio.h>
 #include <syslog.h>
 #include <sys/time.h>
 
+#include "crc32c.h"
 #include "tapdisk-log.h"
 #include "tapdisk-filter.h"
 
@@ -92,79 +95,203 @@ recover_fault(struct tfilter *filter, struct iocb *io)
 	filter->flist[filter->ffree++] = fio;
 }
 
+static inline unsigned long
+io_nbytes(struct iocb *io)
+{
+	const struct iovec *iov;
+	unsigned long bytes = 0;
+	int i;
+
+	if (io->aio_lio_opcode != IO_CMD_PREADV &&
+	    io->aio_lio_opcode != IO_CMD_PWRITEV)
+		return io->u.c.nbytes;
+
+	iov = io->u.c.buf;
+	for (i = 0; i < io->u.c.nbytes; i++)
+		bytes += iov[i].iov_len;
+
+	return bytes;
+}
+
+static inline uint32_t
+chksum(const char *buf)
+{
+	return crc32c(0, buf, 512);
+}
+
 static inline uint64_t
-chksum(char *buf)
+sector_slot(struct tfilter *filter, int fd, uint64_t sec)
+{
+	uint64_t key = sec ^ ((uint64_t)fd << 48);
+
+	key *= 0x9e3779b97f4a7c15ULL;
+	return (key ^ (key >> 29)) & (filter->size - 1);
+}
+
+static struct tsector *
+find_sector(struct tfilter *filter, int fd, uint64_t sec)
+{
+	struct tsector *s;
+	uint64_t i;
+
+	if (!filter->size)
+		return NULL;
+
+	i = sector_slot(filter, fd, sec);
+	for (;;) {
+		s = filter->sectors + i;
+		if (!s->fd)
+			return s;
+		if (s->fd == (uint32_t)fd + 1 && s->sec == sec)
+			return s;
+		i = (i + 1) & (filter->size - 1);
+	}
+}
+
+static int
+grow_sectors(struct tfilter *filter)
 {
-	int i, num   = 512 >> 3;
-	uint64_t *p  = (uint64_t *)buf;
-	uint64_t sum = 0;
+	struct tsector *old, *s;
+	uint64_t i, size;
 
-	for (i = 0; i < num; i++)
-		sum += p[i];
+	size = filter->size ? filter->size << 1 : 1024;
+	old  = filter->sectors;
 
-	return sum;
+	filter->sectors = calloc(size, sizeof(struct tsector));
+	if (!filter->sectors) {
+		filter->sectors = old;
+		return -ENOMEM;
+	}
+
+	filter->size = size;
+
+	for (i = 0; i < (size >> 1) && old; i++) {
+		if (!old[i].fd)
+			continue;
+		s  = find_sector(filter, old[i].fd - 1, old[i].sec);
+		*s = old[i];
+	}
+
+	free(old);
+	return 0;
 }
 
 static inline void
-check_hash(struct tfilter *filter, uint64_t sec, char *buf, char *type)
+check_hash(struct tfilter *filter, int fd, uint64_t sec,
+	   const char *buf, const char *type)
 {
-	uint64_t sum;
-	struct dhash *hash;
+	struct tsector *s;
+	uint32_t sum;
 
-	hash = filter->dhash + sec;
-	if (!hash->time.tv_sec)
+	s = find_sector(filter, fd, sec);
+	if (!s || !s->fd)
 		return;
 
 	sum = chksum(buf);
-	if (hash->hash != chksum(buf)) {
+	if (s->crc != sum) {
 		struct timeval now;
 		gettimeofday(&now, NULL);
-		DBG("%s: hash table: 0x%020" PRIx64 " at %012lu.%06lu, "
-		    "from disk: 0x%020" PRIx64 " at %012lu.%06lu\n",
-		    type, hash->hash, hash->time.tv_sec,
-		    hash->time.tv_usec, sum, now.tv_sec, now.tv_usec);
+		filter->failures++;
+		DBG("%s: fd %d sector %"PRIu64": hash table: 0x%08x "
+		    "at %012u.%06u, from disk: 0x%08x at %012lu.%06lu\n",
+		    type, fd, sec, s->crc, s->tv_sec, s->tv_usec,
+		    sum, now.tv_sec, now.tv_usec);
 	}
 }
 
 static inline void
-insert_hash(struct tfilter *filter, uint64_t sec, char *buf)
+insert_hash(struct tfilter *filter, int fd, uint64_t sec,
+	    const char *buf, const struct timeval *now)
 {
-	struct dhash *hash;
+	struct tsector *s;
+
+	s = find_sector(filter, fd, sec);
+	if (!s || !s->fd) {
+		if (filter->used >= filter->secs) {
+			if (!filter->untracked++)
+				syslog(LOG_WARNING, "WARNING: integrity filter "
+				       "full at %"PRIu64" sectors, not "
+				       "tracking new ones\n", filter->used);
+			return;
+		}
 
-	hash = filter->dhash + sec;
-	hash->hash = chksum(buf);
-	gettimeofday(&hash->time, NULL);
+		if ((filter->used + 1) * 2 > filter->size) {
+			if (grow_sectors(filter))
+				return;
+			s = find_sector(filter, fd, sec);
+		}
+
+		s->fd  = (uint32_t)fd + 1;
+		s->sec = sec;
+		filter->used++;
+	}
+
+	s->crc     = chksum(buf);
+	s->tv_sec  = now->tv_sec;
+	s->tv_usec = now->tv_usec;
 }
 
 static void
-check_sector(struct tfilter *filter, int type, int rw, uint64_t sec, char *buf)
+check_sector(struct tfilter *filter, int type, int rw, int fd,
+	     uint64_t sec, const char *buf, const struct timeval *now)
 {
-	if (sec >= filter->secs)
-		return;
-
 	if (rw) {
 		if (type == PRE_CHECK)
-			insert_hash(filter, sec, buf);
+			insert_hash(filter, fd, sec, buf, now);
 		else
-			check_hash(filter, sec, buf, WRITE_INTEGRITY);
+			check_hash(filter, fd, sec, buf, WRITE_INTEGRITY);
 	} else if (type == POST_CHECK) {
-		check_hash(filter, sec, buf, READ_INTEGRITY);
-		insert_hash(filter, sec, buf);
+		check_hash(filter, fd, sec, buf, READ_INTEGRITY);
+		insert_hash(filter, fd, sec, buf, now);
 	}
 }
 
+static void
+check_buf(struct tfilter *filter, int type, int rw, int fd,
+	  uint64_t sec, const char *buf, size_t bytes,
+	  const struct timeval *now)
+{
+	size_t i;
+
+	for (i = 0; i + 512 <= bytes; i += 512, sec++)
+		check_sector(filter, type, rw, fd, sec, buf + i, now);
+}
+
 static void
 check_data(struct tfilter *filter, int type, struct iocb *io)
 {
-	int rw;
-	uint64_t i;
+	const struct iovec *iov;
+	struct timeval now;
+	uint64_t sec;
+	int i, rw;
 
-	rw = (io->aio_lio_opcode == IO_CMD_PWRITE);
+	/* unaligned requests cannot be hashed by sector */
+	if (io->u.c.offset & 511)
+		return;
 
-	for (i = 0; i < io->u.c.nbytes; i += 512) {
-		char *buf    = io->u.c.buf + i;
-		uint64_t sec = (io->u.c.offset + i) >> 9;
-		check_sector(filter, type, rw, sec, buf);
+	sec = io->u.c.offset >> 9;
+	gettimeofday(&now, NULL);
+
+	switch (io->aio_lio_opcode) {
+	case IO_CMD_PREAD:
+	case IO_CMD_PWRITE:
+		rw = (io->aio_lio_opcode == IO_CMD_PWRITE);
+		check_buf(filter, type, rw, io->aio_fildes, sec,
+			  io->u.c.buf, io->u.c.nbytes, &now);
+		break;
+
+	case IO_CMD_PREADV:
+	case IO_CMD_PWRITEV:
+		rw  = (io->aio_lio_opcode == IO_CMD_PWRITEV);
+		iov = io->u.c.buf;
+		for (i = 0; i < io->u.c.nbytes; i++) {
+			if (iov[i].iov_len & 511)
+				return;
+			check_buf(filter, type, rw, io->aio_fildes, sec,
+				  iov[i].iov_base, iov[i].iov_len, &now);
+			sec += iov[i].iov_len >> 9;
+		}
+		break;
 	}
 }
 
@@ -182,7 +309,7 @@ tapdisk_init_tfilter(int mode, int iocbs, uint64_t secs)
 		goto fail;
 
 	filter->mode  = mode;
-	filter->secs  = secs;
+	filter->secs  = secs ? : TD_FILTER_SECTORS;
 	filter->iocbs = iocbs;
 
 	if (filter->mode & TD_INJECT_FAULTS) {
@@ -198,9 +325,12 @@ tapdisk_init_tfilter(int mode, int iocbs, uint64_t secs)
 		}
 	}
 
+	/*
+	 * sectors are tracked sparsely, as they are first written or
+	 * read, so @secs only caps the table rather than sizing it
+	 */
 	if (filter->mode & TD_CHECK_INTEGRITY) {
-		filter->dhash = calloc(secs, sizeof(struct dhash));
-		if (!filter->dhash)
+		if (grow_sectors(filter))
 			filter->mode &= ~TD_CHECK_INTEGRITY;
 	}
 
@@ -220,7 +350,12 @@ tapdisk_free_tfilter(struct tfilter *filter)
 	if (!filter)
 		return;
 
-	free(filter->dhash);
+	if (filter->mode & TD_CHECK_INTEGRITY)
+		syslog(LOG_WARNING, "integrity filter: %"PRIu64" sectors "
+		       "tracked, %"PRIu64" untracked, %"PRIu64" failures\n",
+		       filter->used, filter->untracked, filter->failures);
+
+	free(filter->sectors);
 	free(filter->flist);
 	free(filter->fiocbs);
 	free(filter);
@@ -267,7 +402,8 @@ tapdisk_filter_events(struct tfilter *filter, struct io_event *events, int num)
 			}
 		}
 
-		if (filter->mode & TD_CHECK_INTEGRITY)
+		if (filter->mode & TD_CHECK_INTEGRITY &&
+		    events[i].res == io_nbytes(io))
 			check_data(filter, POST_CHECK, io);
 	}
 }
@@ -40,9 +40,19 @@
 
 #define TD_FAULT_RATE        5
 
-struct dhash {
-	uint64_t             hash;
-	struct timeval       time;
+/* default cap on sectors tracked by TD_CHECK_INTEGRITY */
+#define TD_FILTER_SECTORS    (1ULL << 20)
+
+/*
+ * one tracked sector: ~24 bytes, and only for sectors actually
+ * touched, instead of a slot for every sector on the disk
+ */
+struct tsector {
+	uint64_t             sec;
+	uint32_t             fd;      /* fd + 1, 0 marks a free slot */
+	uint32_t             crc;
+	uint32_t             tv_sec;
+	uint32_t             tv_usec;
 };
 
 struct fiocb {
@@ -55,7 +65,11 @@ struct tfilter {
 	uint64_t             secs;
 	int                  iocbs;
 
-	struct dhash        *dhash;
+	struct tsector      *sectors;
+	uint64_t             size;
+	uint64_t             used;
+	uint64_t             untracked;
+	uint64_t             failures;
 
 	int                  ffree;
 	struct fiocb        *fiocbs;
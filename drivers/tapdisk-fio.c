@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * fio external ioengine running the tapdisk driver stack in-process: the
+ * job opens a VDI through tapdisk_vbd_open_vdi(), as tapdisk does for a
+ * VBD, queues its I/O to the VBD and runs the tapdisk event loop in
+ * place of waiting on a kernel queue, so that fio workloads exercise
+ * block-vhd, block-cache, the crypto and tqueue code as shipped:
+ *
+ *   fio --ioengine=external:/usr/lib/blktap/tapdisk-fio.so \
+ *       --vdi=vhd:/path/leaf.vhd --size=10g --rw=randread --bs=4k \
+ *       --iodepth=32 --name=leaf
+ *
+ * The tapdisk server is per process, so jobs must run as processes (the
+ * default), one VBD each. Sizes must be given with size=, as fio may ask
+ * for them before the job opens the VDI; the job fails if the VDI is
+ * smaller. Offsets and lengths are in 512-byte sectors.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* from the fio source tree, see --with-fio */
+#include "fio.h"
+#include "optgroup.h"
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+
+struct tapdisk_fio_options {
+	void                            *pad;
+	char                            *vdi;
+};
+
+struct tapdisk_fio_request {
+	td_vbd_request_t                 vreq;
+	struct td_iovec                  iov;
+	struct io_u                     *io_u;
+};
+
+struct tapdisk_fio {
+	td_vbd_t                        *vbd;
+	td_sector_t                      size;
+
+	/* queued to the VBD since the event loop last ran */
+	int                              queued;
+
+	/* completed, the first handed of them returned to fio already */
+	struct io_u                    **events;
+	int                              nr_events;
+	int                              handed;
+};
+
+static int tapdisk_fio_jobs;
+
+static struct fio_option options[] = {
+	{
+		.name     = "vdi",
+		.lname    = "tapdisk VDI",
+		.type     = FIO_OPT_STR_STORE,
+		.off1     = offsetof(struct tapdisk_fio_options, vdi),
+		.help     = "type:/path of the VDI to open, as tap-ctl takes it",
+		.category = FIO_OPT_C_ENGINE,
+		.group    = FIO_OPT_G_INVALID,
+	},
+	{
+		.name     = NULL,
+	},
+};
+
+static void
+tapdisk_fio_request_cb(td_vbd_request_t *vreq, int error,
+		       void *token, int final)
+{
+	struct tapdisk_fio *tf = token;
+	struct tapdisk_fio_request *req;
+
+	req = container_of(vreq, struct tapdisk_fio_request, vreq);
+	req->io_u->error = error < 0 ? -error : error;
+
+	tf->events[tf->nr_events++] = req->io_u;
+}
+
+static enum fio_q_status
+tapdisk_fio_queue(struct thread_data *td, struct io_u *io_u)
+{
+	struct tapdisk_fio *tf = td->io_ops_data;
+	struct tapdisk_fio_request *req = io_u->engine_data;
+	td_vbd_request_t *vreq = &req->vreq;
+	int err;
+
+	fio_ro_check(td, io_u);
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->name  = "fio";
+	vreq->cb    = tapdisk_fio_request_cb;
+	vreq->token = tf;
+
+	switch (io_u->ddir) {
+	case DDIR_READ:
+		vreq->op = TD_OP_READ;
+		break;
+	case DDIR_WRITE:
+		vreq->op = TD_OP_WRITE;
+		break;
+	case DDIR_TRIM:
+		vreq->op = TD_OP_DISCARD;
+		break;
+	case DDIR_SYNC:
+	case DDIR_DATASYNC:
+		vreq->op = TD_OP_FLUSH;
+		break;
+	default:
+		err = EINVAL;
+		goto fail;
+	}
+
+	if (vreq->op == TD_OP_FLUSH) {
+		req->iov.base = NULL;
+		req->iov.secs = 1;
+	} else {
+		if ((io_u->offset | io_u->xfer_buflen) & (SECTOR_SIZE - 1) ||
+		    !io_u->xfer_buflen) {
+			err = EINVAL;
+			goto fail;
+		}
+
+		vreq->sec     = io_u->offset >> SECTOR_SHIFT;
+		req->iov.base = vreq->op == TD_OP_DISCARD ?
+			NULL : io_u->xfer_buf;
+		req->iov.secs = io_u->xfer_buflen >> SECTOR_SHIFT;
+	}
+
+	vreq->iov    = &req->iov;
+	vreq->iovcnt = 1;
+
+	err = tapdisk_vbd_queue_request(tf->vbd, vreq);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+
+	tf->queued++;
+	return FIO_Q_QUEUED;
+
+fail:
+	io_u->error = err;
+	return FIO_Q_COMPLETED;
+}
+
+/*
+ * Runs the event loop until at least min requests completed. The loop
+ * does not sleep while requests wait to be issued. The fio timeout is
+ * not honoured, a request only ever completes through the VBD.
+ */
+static int
+tapdisk_fio_getevents(struct thread_data *td, unsigned int min,
+		      unsigned int max, const struct timespec *t)
+{
+	struct tapdisk_fio *tf = td->io_ops_data;
+
+	tf->nr_events -= tf->handed;
+	memmove(tf->events, tf->events + tf->handed,
+		tf->nr_events * sizeof(*tf->events));
+	tf->handed = 0;
+
+	do {
+		if (tf->queued || !min) {
+			tapdisk_server_set_max_timeout(0);
+			tf->queued = 0;
+		}
+
+		tapdisk_server_iterate();
+	} while ((unsigned int)tf->nr_events < min);
+
+	tf->handed = (unsigned int)tf->nr_events < max ? tf->nr_events : max;
+
+	return tf->handed;
+}
+
+static struct io_u *
+tapdisk_fio_event(struct thread_data *td, int event)
+{
+	struct tapdisk_fio *tf = td->io_ops_data;
+
+	return tf->events[event];
+}
+
+static void
+tapdisk_fio_cleanup(struct thread_data *td)
+{
+	struct tapdisk_fio *tf = td->io_ops_data;
+	td_vbd_t *vbd;
+
+	if (!tf)
+		return;
+
+	vbd = tf->vbd;
+	if (vbd) {
+		tapdisk_vbd_close_vdi(vbd);
+		tapdisk_server_remove_vbd(vbd);
+		free(vbd->name);
+		free(vbd);
+	}
+
+	free(tf->events);
+	free(tf);
+	td->io_ops_data = NULL;
+
+	tapdisk_stop_logging();
+	tapdisk_fio_jobs--;
+}
+
+static int
+tapdisk_fio_init(struct thread_data *td)
+{
+	struct tapdisk_fio_options *o = td->eo;
+	struct tapdisk_fio *tf;
+	td_disk_info_t info;
+	td_flag_t flags;
+	int err;
+
+	if (!o->vdi) {
+		log_err("tapdisk: vdi= is required\n");
+		return 1;
+	}
+
+	if (tapdisk_fio_jobs) {
+		log_err("tapdisk: one job per process, do not set thread\n");
+		return 1;
+	}
+
+	tf = calloc(1, sizeof(*tf));
+	if (!tf)
+		return 1;
+
+	tf->events = calloc(td->o.iodepth, sizeof(*tf->events));
+	if (!tf->events) {
+		free(tf);
+		return 1;
+	}
+
+	td->io_ops_data = tf;
+	tapdisk_fio_jobs++;
+
+	tapdisk_start_logging("tapdisk-fio", "daemon");
+
+	err = tapdisk_server_initialize(NULL, NULL);
+	if (err)
+		goto fail;
+
+	err = tapdisk_vbd_initialize(-1, -1, 0);
+	if (err)
+		goto fail;
+
+	tf->vbd = tapdisk_server_get_vbd(0);
+	if (!tf->vbd) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	flags = td_write(td) || td_trim(td) ? 0 : TD_OPEN_RDONLY;
+
+	err = tapdisk_vbd_open_vdi(tf->vbd, o->vdi, flags, -1);
+	if (err)
+		goto fail;
+
+	err = tapdisk_vbd_get_disk_info(tf->vbd, &info);
+	if (err)
+		goto fail;
+
+	tf->size = info.size;
+
+	return 0;
+
+fail:
+	err = err < 0 ? -err : err;
+	td_verror(td, err, "tapdisk open");
+	tapdisk_fio_cleanup(td);
+	return 1;
+}
+
+static int
+tapdisk_fio_io_u_init(struct thread_data *td, struct io_u *io_u)
+{
+	struct tapdisk_fio_request *req;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return 1;
+
+	req->io_u = io_u;
+	io_u->engine_data = req;
+
+	return 0;
+}
+
+static void
+tapdisk_fio_io_u_free(struct thread_data *td, struct io_u *io_u)
+{
+	free(io_u->engine_data);
+	io_u->engine_data = NULL;
+}
+
+static int
+tapdisk_fio_open_file(struct thread_data *td, struct fio_file *f)
+{
+	struct tapdisk_fio *tf = td->io_ops_data;
+
+	if (tf && f->file_offset + f->io_size > tf->size << SECTOR_SHIFT) {
+		log_err("tapdisk: %s is smaller than the job\n", f->file_name);
+		td_verror(td, EINVAL, "tapdisk size");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_fio_close_file(struct thread_data *td, struct fio_file *f)
+{
+	return 0;
+}
+
+static int
+tapdisk_fio_get_file_size(struct thread_data *td, struct fio_file *f)
+{
+	if (fio_file_size_known(f))
+		return 0;
+
+	if (!td->o.size) {
+		log_err("tapdisk: size= is required\n");
+		return 1;
+	}
+
+	f->real_file_size = td->o.size;
+	fio_file_set_size_known(f);
+
+	return 0;
+}
+
+struct ioengine_ops ioengine = {
+	.name               = "tapdisk",
+	.version            = FIO_IOOPS_VERSION,
+	.flags              = FIO_DISKLESSIO | FIO_NOEXTEND | FIO_NODISKUTIL |
+			      FIO_MEMALIGN,
+	.init               = tapdisk_fio_init,
+	.queue              = tapdisk_fio_queue,
+	.getevents          = tapdisk_fio_getevents,
+	.event              = tapdisk_fio_event,
+	.cleanup            = tapdisk_fio_cleanup,
+	.open_file          = tapdisk_fio_open_file,
+	.close_file         = tapdisk_fio_close_file,
+	.get_file_size      = tapdisk_fio_get_file_size,
+	.io_u_init          = tapdisk_fio_io_u_init,
+	.io_u_free          = tapdisk_fio_io_u_free,
+	.options            = options,
+	.option_struct_size = sizeof(struct tapdisk_fio_options),
+};
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "tapdisk-message.h"
+#include "tapdisk-flight.h"
+#include "tapdisk-log.h"
+#include "tapdisk-utils.h"
+
+#define TD_FLIGHT_DEFAULT_KB    1024
+#define TD_FLIGHT_MAX_KB        (1 << 20)
+#define TD_FLIGHT_LINE_MAX      1024
+
+struct td_flight {
+	char                       path[64];
+	struct tapdisk_flight_hdr *hdr;
+	char                      *ring;
+	size_t                     len;
+	int                        level;
+};
+
+static struct td_flight flight = { .level = -1 };
+
+int
+tapdisk_flight_level(void)
+{
+	return flight.level;
+}
+
+int
+tapdisk_flight_open(void)
+{
+	struct tapdisk_flight_hdr *hdr;
+	unsigned long kb;
+	const char *val;
+	void *mem;
+	int fd, err, level;
+
+	if (flight.hdr)
+		return 0;
+
+	kb  = TD_FLIGHT_DEFAULT_KB;
+	val = getenv("TAPDISK3_FLIGHT_KB");
+	if (val) {
+		kb = strtoul(val, NULL, 10);
+		if (!kb)
+			return 0;
+		if (kb > TD_FLIGHT_MAX_KB)
+			kb = TD_FLIGHT_MAX_KB;
+	}
+
+	level = TLOG_DBG;
+	val   = getenv("TAPDISK3_FLIGHT_LEVEL");
+	if (val)
+		level = atoi(val);
+
+	snprintf(flight.path, sizeof(flight.path), "%s%d",
+		 TAPDISK_FLIGHT_PATH, getpid());
+	flight.len = sizeof(*hdr) + (kb << 10);
+
+	fd = open(flight.path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd == -1) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (ftruncate(fd, flight.len)) {
+		err = -errno;
+		close(fd);
+		goto fail_unlink;
+	}
+
+	mem = mmap(NULL, flight.len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	err = -errno;
+	close(fd);
+	if (mem == MAP_FAILED)
+		goto fail_unlink;
+
+	hdr          = mem;
+	hdr->version = TAPDISK_FLIGHT_VERSION;
+	hdr->size    = kb << 10;
+	hdr->pid     = getpid();
+	hdr->head    = 0;
+	hdr->started = time(NULL);
+	__atomic_store_n(&hdr->magic, TAPDISK_FLIGHT_MAGIC, __ATOMIC_RELEASE);
+
+	flight.ring  = (char *)mem + sizeof(*hdr);
+	flight.hdr   = hdr;
+	__atomic_store_n(&flight.level, level, __ATOMIC_RELEASE);
+
+	return 0;
+
+fail_unlink:
+	unlink(flight.path);
+fail:
+	EPRINTF("flight recorder %s: %s\n", flight.path, strerror(-err));
+	return err;
+}
+
+void
+tapdisk_flight_close(int keep)
+{
+	if (!flight.hdr)
+		return;
+
+	__atomic_store_n(&flight.level, -1, __ATOMIC_RELEASE);
+
+	munmap(flight.hdr, flight.len);
+	flight.hdr  = NULL;
+	flight.ring = NULL;
+
+	if (!keep)
+		unlink(flight.path);
+}
+
+/*
+ * A writer reserves its bytes with one atomic add to head, then copies
+ * them in: no lock, so threads and a dying process leave at worst the
+ * one line they were writing.
+ */
+void
+tapdisk_flight_vprintf(const char *fmt, va_list ap)
+{
+	struct tapdisk_flight_hdr *hdr = flight.hdr;
+	char buf[TD_FLIGHT_LINE_MAX];
+	struct timeval tv;
+	size_t size, len, off, n;
+	uint64_t pos;
+
+	if (__atomic_load_n(&flight.level, __ATOMIC_ACQUIRE) < 0 || !hdr)
+		return;
+
+	gettimeofday(&tv, NULL);
+
+	size = sizeof(buf);
+	len  = tapdisk_syslog_strftime(buf, size, &tv);
+	len += snprintf(buf + len, size - len, ": ");
+	len += tapdisk_syslog_strftv(buf + len, size - len, &tv);
+	len += snprintf(buf + len, size - len, " ");
+	len += vsnprintf(buf + len, size - len, fmt, ap);
+
+	if (len > size - 2)
+		len = size - 2;
+	if (buf[len - 1] != '\n')
+		buf[len++] = '\n';
+
+	pos = __atomic_fetch_add(&hdr->head, len, __ATOMIC_RELAXED);
+	off = pos % hdr->size;
+	n   = len;
+	if (n > hdr->size - off)
+		n = hdr->size - off;
+
+	memcpy(flight.ring + off, buf, n);
+	memcpy(flight.ring, buf + n, len - n);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TAPDISK_FLIGHT_H__
+#define __TAPDISK_FLIGHT_H__
+
+#include <stdarg.h>
+
+/*
+ * The flight recorder, see struct tapdisk_flight_hdr: tlog lines up to
+ * TAPDISK3_FLIGHT_LEVEL (TLOG_DBG by default) go to a shared memory
+ * ring of TAPDISK3_FLIGHT_KB (1024 by default, 0 for none), whatever
+ * the log level, so that they can be had with tap-ctl flight after the
+ * process is killed. Any thread may record.
+ */
+
+int  tapdisk_flight_open(void);
+
+/* the ring is removed, unless @keep */
+void tapdisk_flight_close(int keep);
+
+/* a tlog level, or -1 when not recording */
+int  tapdisk_flight_level(void);
+
+void tapdisk_flight_vprintf(const char *fmt, va_list ap);
+
+#endif /* __TAPDISK_FLIGHT_H__ */
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tapdisk-heat.h"
+
+#define MIN(a, b)                  ((a) < (b) ? (a) : (b))
+
+int
+tapdisk_heat_init(td_heat_t *h, td_sector_t size, int shift, int halflife)
+{
+	memset(h, 0, sizeof(*h));
+
+	h->size     = size;
+	h->shift    = shift;
+	h->halflife = halflife > 0 ? halflife : 1;
+	h->extents  = (size + (1ULL << shift) - 1) >> shift;
+
+	h->heat   = calloc(h->extents, 1);
+	h->stamp  = calloc(h->extents, 1);
+	h->cached = calloc((h->extents + 63) / 64, sizeof(uint64_t));
+	if (!h->heat || !h->stamp || !h->cached) {
+		tapdisk_heat_free(h);
+		return -ENOMEM;
+	}
+
+	/* nothing was warmed at tick 0 */
+	memset(h->stamp, 0xff, h->extents);
+
+	return 0;
+}
+
+void
+tapdisk_heat_free(td_heat_t *h)
+{
+	free(h->heat);
+	free(h->stamp);
+	free(h->cached);
+	h->heat   = NULL;
+	h->stamp  = NULL;
+	h->cached = NULL;
+}
+
+static void
+tapdisk_heat_range(td_heat_t *h, td_sector_t sec, int secs,
+		   uint64_t *first, uint64_t *last)
+{
+	*first = sec >> h->shift;
+	*last  = (sec + (secs ? secs - 1 : 0)) >> h->shift;
+	*last  = MIN(*last, h->extents - 1);
+}
+
+int
+tapdisk_heat_touch(td_heat_t *h, td_sector_t sec, int secs)
+{
+	uint8_t tick = h->tick;
+	uint64_t e, first, last;
+	int max = 0;
+
+	if (sec >= h->size)
+		return 0;
+
+	tapdisk_heat_range(h, sec, secs, &first, &last);
+
+	for (e = first; e <= last; e++) {
+		if (h->stamp[e] != tick && h->heat[e] < TD_HEAT_MAX) {
+			h->heat[e]++;
+			h->stamp[e] = tick;
+		}
+		if (h->heat[e] > max)
+			max = h->heat[e];
+	}
+
+	return max;
+}
+
+int
+tapdisk_heat_peek(td_heat_t *h, td_sector_t sec, int secs)
+{
+	uint64_t e, first, last;
+	int max = 0;
+
+	if (sec >= h->size)
+		return 0;
+
+	tapdisk_heat_range(h, sec, secs, &first, &last);
+
+	for (e = first; e <= last; e++)
+		if (h->heat[e] > max)
+			max = h->heat[e];
+
+	return max;
+}
+
+void
+tapdisk_heat_set_cached(td_heat_t *h, td_sector_t sec, int secs)
+{
+	uint64_t e, first, last;
+
+	if (sec >= h->size)
+		return;
+
+	tapdisk_heat_range(h, sec, secs, &first, &last);
+
+	for (e = first; e <= last; e++)
+		h->cached[e >> 6] |= 1ULL << (e & 63);
+}
+
+void
+tapdisk_heat_tick(td_heat_t *h)
+{
+	uint64_t e;
+
+	h->tick++;
+
+	if (h->tick % h->halflife)
+		return;
+
+	for (e = 0; e < h->extents; e++)
+		h->heat[e] >>= 1;
+}
+
+int
+tapdisk_heat_next_cold(td_heat_t *h, int max, td_sector_t *sec, int *secs)
+{
+	uint64_t e, end;
+
+	while (max > 0) {
+		e = h->cursor;
+
+		/* skip over words with nothing cached */
+		if (!(e & 63) && !h->cached[e >> 6]) {
+			max -= 64;
+			h->cursor = e + 64 < h->extents ? e + 64 : 0;
+			continue;
+		}
+
+		max--;
+		h->cursor = e + 1 < h->extents ? e + 1 : 0;
+
+		if (!(h->cached[e >> 6] & (1ULL << (e & 63))) || h->heat[e])
+			continue;
+
+		h->cached[e >> 6] &= ~(1ULL << (e & 63));
+
+		end   = MIN((e + 1) << h->shift, h->size);
+		*sec  = e << h->shift;
+		*secs = end - *sec;
+		return 1;
+	}
+
+	return 0;
+}
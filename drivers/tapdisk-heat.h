@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_HEAT_H_
+#define _TAPDISK_HEAT_H_
+
+#include <stdint.h>
+
+#include "tapdisk.h"
+
+/*
+ * Access frequency, for caches deciding what is worth keeping. The
+ * disk is cut into extents of 1 << shift sectors, each with a byte of
+ * heat. An extent warms by one per tick in which it is read, however
+ * often, so a sequential pass leaves it lukewarm while coming back to
+ * it heats it up. All heat halves every halflife ticks.
+ *
+ * Extents the cache stored something into are marked, so those which
+ * cooled down to nothing can be handed back for demotion.
+ */
+
+#define TD_HEAT_MAX                 255
+
+typedef struct td_heat              td_heat_t;
+
+struct td_heat {
+	uint8_t                    *heat;
+	uint8_t                    *stamp;  /* tick of the last warming */
+	uint64_t                   *cached; /* bitmap */
+
+	td_sector_t                 size;
+	uint64_t                    extents;
+	int                         shift;
+
+	unsigned int                tick;
+	int                         halflife;
+	uint64_t                    cursor; /* of the demotion scan */
+};
+
+int tapdisk_heat_init(td_heat_t *, td_sector_t size, int shift,
+		      int halflife);
+void tapdisk_heat_free(td_heat_t *);
+
+/*
+ * Warms the extents under a read, returns the heat of the hottest.
+ */
+int tapdisk_heat_touch(td_heat_t *, td_sector_t sec, int secs);
+
+/*
+ * The heat of the hottest extent under a range, leaving it as it is.
+ */
+int tapdisk_heat_peek(td_heat_t *, td_sector_t sec, int secs);
+
+void tapdisk_heat_set_cached(td_heat_t *, td_sector_t sec, int secs);
+
+/*
+ * Next tick, every halflife of them everything cools down.
+ */
+void tapdisk_heat_tick(td_heat_t *);
+
+/*
+ * Looks through up to max extents for a cached one gone cold. Returns
+ * 1 with its range, no longer marked cached, or 0.
+ */
+int tapdisk_heat_next_cold(td_heat_t *, int max,
+			   td_sector_t *sec, int *secs);
+
+#endif /* _TAPDISK_HEAT_H_ */
@@ -38,7 +38,10 @@
 #include <stdio.h>
 #include <limits.h>
 #include <regex.h>
+#include <pthread.h>
+#include <signal.h>
 
+#include "libvhd.h"
 #include "tapdisk-image.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
@@ -107,10 +110,13 @@ tapdisk_image_check_td_request(td_image_t *image, td_request_t treq)
 	info   = &image->info;
 	rdonly = td_flag_test(image->flags, TD_OPEN_RDONLY);
 
-	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE)
+	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE &&
+	    treq.op != TD_OP_DISCARD && treq.op != TD_OP_WRITE_ZEROES &&
+	    treq.op != TD_OP_FLUSH)
 		goto fail;
 
-	if (treq.op == TD_OP_WRITE && rdonly) {
+	/* flushes pass read-only parents on their way down the chain */
+	if (treq.op != TD_OP_READ && treq.op != TD_OP_FLUSH && rdonly) {
 		err = -EPERM;
 		goto fail;
 	}
@@ -154,6 +160,8 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 
 	switch (vreq->op) {
 	case TD_OP_WRITE:
+	case TD_OP_DISCARD:
+	case TD_OP_WRITE_ZEROES:
 		if (rdonly) {
 			err = -EPERM;
 			goto fail;
@@ -164,6 +172,13 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 			err = -EINVAL;
 			goto fail;
 		}
+		if (info->sector_size > SECTOR_SIZE &&
+		    ((vreq->sec | secs) & ((info->sector_size >> SECTOR_SHIFT) - 1))) {
+			err = -EINVAL;
+			goto fail;
+		}
+		break;
+	case TD_OP_FLUSH:
 		break;
 	default:
 		err = -EOPNOTSUPP;
@@ -187,9 +202,10 @@ tapdisk_image_close(td_image_t *image)
 	tapdisk_image_free(image);
 }
 
-int
-tapdisk_image_open(int type, const char *name, int flags,
-		   struct td_vbd_encryption *encryption, td_image_t **_image)
+static int
+__tapdisk_image_open(int type, const char *name, int flags,
+		     struct td_vbd_encryption *encryption, td_image_t **_image,
+		     int load)
 {
 	td_image_t *image;
 	int err;
@@ -200,9 +216,11 @@ tapdisk_image_open(int type, const char *name, int flags,
 		goto fail;
 	}
 
-	err = td_load(image);
-	if (!err)
-		goto done;
+	if (load) {
+		err = td_load(image);
+		if (!err)
+			goto done;
+	}
 
 	image->driver = tapdisk_driver_allocate(image->type,
 						image->name,
@@ -226,9 +244,88 @@ fail:
 	return err;
 }
 
+int
+tapdisk_image_open(int type, const char *name, int flags,
+		   struct td_vbd_encryption *encryption, td_image_t **_image)
+{
+	return __tapdisk_image_open(type, name, flags, encryption, _image, 1);
+}
+
+/*
+ * Parents opened read-only can be kept open across a pause, with their
+ * metadata caches, if the file is still the same on resume: the next
+ * open of the chain takes them instead of opening them again. Only
+ * regular files are kept, as block devices do not tell whether they
+ * were written to in the meantime, e.g. by a coalesce.
+ */
+static int
+tapdisk_image_stat(td_image_t *image, struct stat *st)
+{
+	int err;
+
+	err = stat(image->name, st);
+	if (err)
+		return -errno;
+
+	if (!S_ISREG(st->st_mode))
+		return -ENOTSUP;
+
+	return 0;
+}
+
+void
+tapdisk_image_retain_chain(struct list_head *list, struct list_head *retained)
+{
+	td_image_t *image, *next;
+
+	tapdisk_for_each_image_safe(image, next, list) {
+		if (image->next.prev == list)
+			continue; /* the leaf */
+
+		if (!td_flag_test(image->flags, TD_OPEN_RDONLY))
+			continue;
+
+		if (tapdisk_image_stat(image, &image->st))
+			continue;
+
+		list_move_tail(&image->next, retained);
+	}
+}
+
+static td_image_t *
+tapdisk_image_reuse(struct list_head *reuse, td_disk_id_t *id)
+{
+	td_image_t *image, *next;
+	struct stat st;
+
+	tapdisk_for_each_image_safe(image, next, reuse) {
+		if (image->type != id->type || image->flags != id->flags ||
+		    strcmp(image->name, id->name))
+			continue;
+
+		list_del_init(&image->next);
+
+		if (tapdisk_image_stat(image, &st) ||
+		    st.st_dev != image->st.st_dev ||
+		    st.st_ino != image->st.st_ino ||
+		    st.st_size != image->st.st_size ||
+		    st.st_mtim.tv_sec != image->st.st_mtim.tv_sec ||
+		    st.st_mtim.tv_nsec != image->st.st_mtim.tv_nsec) {
+			INFO("%s changed, reopening\n", image->name);
+			tapdisk_image_close(image);
+			return NULL;
+		}
+
+		DBG("reusing %s\n", image->name);
+		return image;
+	}
+
+	return NULL;
+}
+
 static int
 tapdisk_image_open_parent(td_image_t *image, struct td_vbd_encryption *encryption,
-			  td_image_t **_parent)
+			  struct list_head *reuse, td_image_t **_parent)
 {
 	td_image_t *parent = NULL;
 	td_disk_id_t id;
@@ -248,6 +345,13 @@ tapdisk_image_open_parent(td_image_t *image, struct td_vbd_encryption *encryptio
 	if (((id.flags & TD_OPEN_NO_O_DIRECT) == TD_OPEN_NO_O_DIRECT) &&
             ((id.flags & TD_OPEN_LOCAL_CACHE) == TD_OPEN_LOCAL_CACHE))
 		id.flags &= ~TD_OPEN_NO_O_DIRECT;
+
+	if (reuse) {
+		parent = tapdisk_image_reuse(reuse, &id);
+		if (parent)
+			goto out;
+	}
+
 	err = tapdisk_image_open(id.type, id.name, id.flags, encryption, &parent);
 	if (err)
 		return err;
@@ -257,14 +361,269 @@ out:
 	return 0;
 }
 
+/*
+ * Deep VHD chains open in parallel: the chain is discovered first,
+ * reading only footers, headers and parent locators with libvhd, then
+ * TAPDISK3_CHAIN_OPEN_THREADS threads open the parents, BAT and all,
+ * at the same time. This is a win where every read is a round trip,
+ * such as on NFS. Sharing images with other VBDs, reusing retained
+ * ones and anything but VHD stay on the calling thread, and so do
+ * encrypted chains: their drivers hook into the event loop on open.
+ */
+#define TD_CHAIN_OPEN_THREADS        8
+#define TD_CHAIN_OPEN_MIN            2 /* parents */
+
+struct tapdisk_chain_open {
+	td_disk_id_t                *ids;
+	td_image_t                 **images;
+	int                         *errs;
+	int                          n;
+	int                          next;
+	struct td_vbd_encryption    *encryption;
+};
+
+static int
+tapdisk_image_chain_threads(void)
+{
+	const char *val;
+
+	val = getenv("TAPDISK3_CHAIN_OPEN_THREADS");
+	if (val)
+		return atoi(val);
+
+	return TD_CHAIN_OPEN_THREADS;
+}
+
+/*
+ * The parent of a VHD, as vhd_get_parent_id would see it once open.
+ */
 static int
-tapdisk_image_open_parents(td_image_t *image, struct td_vbd_encryption *encryption)
+tapdisk_image_discover_parent(td_disk_id_t *child, td_disk_id_t *id)
+{
+	vhd_context_t vhd;
+	int err;
+
+	memset(id, 0, sizeof(*id));
+
+	err = vhd_open(&vhd, child->name, VHD_OPEN_RDONLY);
+	if (err)
+		return err;
+
+	if (vhd.footer.type != HD_TYPE_DIFF) {
+		err = TD_NO_PARENT;
+		goto out;
+	}
+
+	err = vhd_parent_locator_get(&vhd, &id->name);
+	if (err)
+		goto out;
+
+	id->type  = vhd_parent_raw(&vhd) ? DISK_TYPE_AIO : DISK_TYPE_VHD;
+	id->flags = child->flags|TD_OPEN_SHAREABLE|TD_OPEN_RDONLY;
+
+out:
+	vhd_close(&vhd);
+	return err;
+}
+
+static void *
+tapdisk_image_open_chain_thread(void *arg)
+{
+	struct tapdisk_chain_open *open = arg;
+	td_disk_id_t *id;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&open->next, 1)) < open->n) {
+		if (open->images[i])
+			continue;
+
+		id = &open->ids[i];
+		open->errs[i] = __tapdisk_image_open(id->type, id->name,
+						     id->flags,
+						     open->encryption,
+						     &open->images[i], 0);
+	}
+
+	return NULL;
+}
+
+static void
+tapdisk_image_open_chain_run(struct tapdisk_chain_open *open, int nr_threads)
+{
+	pthread_t threads[TD_CHAIN_OPEN_THREADS * 4];
+	sigset_t set, old;
+	int i, n, err;
+
+	if (nr_threads > ARRAY_SIZE(threads))
+		nr_threads = ARRAY_SIZE(threads);
+	if (nr_threads > open->n)
+		nr_threads = open->n;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (n = 0; n < nr_threads; n++) {
+		err = pthread_create(&threads[n], NULL,
+				     tapdisk_image_open_chain_thread, open);
+		if (err)
+			break;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	/* whatever is left, if threads could not be had */
+	tapdisk_image_open_chain_thread(open);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+ * Opens the VHD parents of @image in parallel, where worth it. Leaves
+ * @image at the last parent opened, for the rest to be opened as
+ * usual. Returns -ENOTSUP if the chain should be opened serially.
+ */
+static int
+tapdisk_image_open_parents_parallel(td_image_t **_image,
+				    struct td_vbd_encryption *encryption,
+				    struct list_head *reuse)
+{
+	struct tapdisk_chain_open open;
+	td_image_t *image = *_image, *shared;
+	td_disk_id_t id;
+	int i, n, size, nr_threads, err;
+
+	nr_threads = tapdisk_image_chain_threads();
+	if (nr_threads <= 1)
+		return -ENOTSUP;
+
+	if (image->type != DISK_TYPE_VHD ||
+	    (encryption && encryption->encryption_key))
+		return -ENOTSUP;
+
+	memset(&open, 0, sizeof(open));
+	open.encryption = encryption;
+	size = 0;
+	n = 0;
+
+	memset(&id, 0, sizeof(id));
+	id.flags = image->flags;
+
+	err = td_get_parent_id(image, &id);
+
+	while (!err && id.type == DISK_TYPE_VHD) {
+		if (n == size) {
+			td_disk_id_t *ids;
+
+			size = size ? size * 2 : 16;
+			ids  = realloc(open.ids, size * sizeof(*ids));
+			if (!ids) {
+				err = -ENOMEM;
+				break;
+			}
+			open.ids = ids;
+		}
+
+		if (((id.flags & TD_OPEN_NO_O_DIRECT) == TD_OPEN_NO_O_DIRECT) &&
+		    ((id.flags & TD_OPEN_LOCAL_CACHE) == TD_OPEN_LOCAL_CACHE))
+			id.flags &= ~TD_OPEN_NO_O_DIRECT;
+
+		open.ids[n++] = id;
+
+		err = tapdisk_image_discover_parent(&open.ids[n - 1], &id);
+	}
+
+	if (err == TD_NO_PARENT)
+		err = 0;
+	else if (!err)
+		free(id.name); /* not VHD, opened serially later */
+	else if (err != -ENOMEM)
+		err = -ENOTSUP; /* for the serial open to tell */
+
+	if (!err && n < TD_CHAIN_OPEN_MIN)
+		err = -ENOTSUP;
+	if (err)
+		goto out;
+
+	open.images = calloc(n, sizeof(*open.images));
+	open.errs   = calloc(n, sizeof(*open.errs));
+	if (!open.images || !open.errs) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* no I/O in these, and they look at the event loop's VBDs */
+	for (i = 0; i < n; i++) {
+		if (reuse) {
+			open.images[i] = tapdisk_image_reuse(reuse, &open.ids[i]);
+			if (open.images[i])
+				continue;
+		}
+
+		if (!td_flag_test(open.ids[i].flags, TD_OPEN_SHAREABLE))
+			continue;
+
+		shared = tapdisk_image_allocate(open.ids[i].name,
+						open.ids[i].type,
+						open.ids[i].flags);
+		if (!shared) {
+			err = -ENOMEM;
+			goto fail;
+		}
+
+		if (td_load(shared))
+			tapdisk_image_free(shared);
+		else
+			open.images[i] = shared;
+	}
+
+	open.n = n;
+	tapdisk_image_open_chain_run(&open, nr_threads);
+
+	for (i = 0; i < n; i++) {
+		if (open.errs[i]) {
+			err = open.errs[i];
+			goto fail;
+		}
+
+		list_add(&open.images[i]->next, &image->next);
+		image = open.images[i];
+	}
+
+	DBG("opened %d parents of %s on %d threads\n",
+	    n, (*_image)->name, nr_threads);
+
+	*_image = image;
+
+out:
+	for (i = 0; i < n; i++)
+		free(open.ids[i].name);
+	free(open.images);
+	free(open.errs);
+	free(open.ids);
+	return err;
+
+fail:
+	for (i = 0; i < n; i++)
+		if (open.images[i] && list_empty(&open.images[i]->next))
+			tapdisk_image_close(open.images[i]);
+	goto out;
+}
+
+static int
+tapdisk_image_open_parents(td_image_t *image, struct td_vbd_encryption *encryption,
+			   struct list_head *reuse)
 {
 	td_image_t *parent;
 	int err;
 
+	err = tapdisk_image_open_parents_parallel(&image, encryption, reuse);
+	if (err && err != -ENOTSUP)
+		return err;
+
 	do {
-		err = tapdisk_image_open_parent(image, encryption, &parent);
+		err = tapdisk_image_open_parent(image, encryption, reuse,
+						&parent);
 		if (err)
 			break;
 
@@ -299,7 +658,7 @@ tapdisk_image_close_chain(struct list_head *list)
 static int
 __tapdisk_image_open_chain(int type, const char *name, int flags,
 			   struct td_vbd_encryption *encryption, struct list_head *_head,
-			   int prt_devnum)
+			   int prt_devnum, struct list_head *reuse)
 {
 	struct list_head head = LIST_HEAD_INIT(head);
 	td_image_t *image;
@@ -324,7 +683,7 @@ __tapdisk_image_open_chain(int type, const char *name, int flags,
 		goto done;
 	}
 
-	err = tapdisk_image_open_parents(image, encryption);
+	err = tapdisk_image_open_parents(image, encryption, reuse);
 	if (err)
 		goto fail;
 
@@ -376,7 +735,7 @@ fail:
 
 static int
 tapdisk_image_open_x_chain(const char *path, struct td_vbd_encryption *encryption,
-			   struct list_head *_head)
+			   struct list_head *_head, struct list_head *reuse)
 {
 	struct list_head head = LIST_HEAD_INIT(head);
 	td_image_t *image = NULL, *next;
@@ -459,7 +818,7 @@ tapdisk_image_open_x_chain(const char *path, struct td_vbd_encryption *encryptio
 		goto fail;
 	}
 
-	err = tapdisk_image_open_parents(image, encryption);
+	err = tapdisk_image_open_parents(image, encryption, reuse);
 	if (err)
 		goto fail;
 
@@ -481,9 +840,14 @@ fail:
 	goto out;
 }
 
+/**
+ * Opens a chain, taking parents from @reuse, if given, where they
+ * match (see tapdisk_image_retain_chain).
+ */
 int
 tapdisk_image_open_chain(const char *desc, int flags, int prt_devnum,
-			 struct td_vbd_encryption *encryption, struct list_head *head)
+			 struct td_vbd_encryption *encryption, struct list_head *head,
+			 struct list_head *reuse)
 {
 	const char *name;
 	int type, err;
@@ -491,7 +855,7 @@ tapdisk_image_open_chain(const char *desc, int flags, int prt_devnum,
 	type = tapdisk_disktype_parse_params(desc, &name);
 	if (type >= 0)
 		return __tapdisk_image_open_chain(type, name, flags, encryption,
-						  head, prt_devnum);
+						  head, prt_devnum, reuse);
 
 	err = type;
 
@@ -499,7 +863,8 @@ tapdisk_image_open_chain(const char *desc, int flags, int prt_devnum,
 		switch (desc[2]) {
 		case 'c':
 			if (!strncmp(desc, "x-chain", strlen("x-chain")))
-				err = tapdisk_image_open_x_chain(name, encryption, head);
+				err = tapdisk_image_open_x_chain(name, encryption,
+								 head, reuse);
 			break;
 		}
 	}
@@ -544,6 +909,27 @@ tapdisk_image_validate_chain(struct list_head *head)
 	return 0;
 }
 
+/*
+ * Latency histograms, as [bound, count] pairs of the buckets used.
+ */
+static void
+tapdisk_image_stats_lat(td_stats_t *st, const char *key, const uint64_t *lat)
+{
+	int b;
+
+	tapdisk_stats_field(st, key, "[");
+	for (b = 0; b < TD_IMAGE_LAT_BUCKETS; b++) {
+		if (!lat[b])
+			continue;
+
+		tapdisk_stats_enter(st, '[');
+		tapdisk_stats_val(st, "llu", 1ULL << b);
+		tapdisk_stats_val(st, "llu", (unsigned long long)lat[b]);
+		tapdisk_stats_leave(st, ']');
+	}
+	tapdisk_stats_leave(st, ']');
+}
+
 void
 tapdisk_image_stats(td_image_t *image, td_stats_t *st)
 {
@@ -560,6 +946,19 @@ tapdisk_image_stats(td_image_t *image, td_stats_t *st)
 	tapdisk_stats_val(st, "llu", image->stats.fail.wr);
 	tapdisk_stats_leave(st, ']');
 
+	tapdisk_stats_field(st, "reqs", "[");
+	tapdisk_stats_val(st, "llu", image->stats.reqs.rd);
+	tapdisk_stats_val(st, "llu", image->stats.reqs.wr);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "fwd", "[");
+	tapdisk_stats_val(st, "llu", image->stats.fwd.rd);
+	tapdisk_stats_val(st, "llu", image->stats.fwd.wr);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_image_stats_lat(st, "lat_rd", image->stats.lat.rd);
+	tapdisk_image_stats_lat(st, "lat_wr", image->stats.lat.wr);
+
 	tapdisk_stats_field(st, "driver", "{");
 	tapdisk_driver_stats(image->driver, st);
 	tapdisk_stats_leave(st, '}');
@@ -31,8 +31,13 @@
 #ifndef _TAPDISK_IMAGE_H_
 #define _TAPDISK_IMAGE_H_
 
+#include <sys/stat.h>
+
 #include "tapdisk.h"
 
+/* bucket b counts latencies below 2^b us, above the previous one */
+#define TD_IMAGE_LAT_BUCKETS         24
+
 struct td_image_handle {
 	int                          type;
 	char                        *name;
@@ -44,14 +49,21 @@ struct td_image_handle {
 
 	struct list_head             next;
 
+	/* the file, while kept open across a pause */
+	struct stat                  st;
+
 	/*
-	 * Basic datapath statistics, in sectors read/written.
+	 * Basic datapath statistics, read/written.
 	 *
-	 * hits:  requests completed by this image.
-	 * fail:  requests completed with failure by this image.
+	 * hits:  sectors completed by this image.
+	 * fail:  sectors completed with failure by this image.
+	 * reqs:  requests completed by this image.
+	 * fwd:   requests forwarded to the parent, once per pass down
+	 *        the chain: restarts after -EBUSY count again.
+	 * lat:   completion latency of requests completed by this
+	 *        image, since the VBD request was issued, log2 us.
 	 *
-	 * Not that we do not count e.g.
-	 * miss:  requests forwarded.
+	 * Note that we do not count
 	 * total: requests processed by this image.
 	 *
 	 * This is because we'd have to compensate for restarts due to
@@ -61,9 +73,28 @@ struct td_image_handle {
 	struct {
 		td_sector_count_t    hits;
 		td_sector_count_t    fail;
+		td_sector_count_t    reqs;
+		td_sector_count_t    fwd;
+		struct {
+			uint64_t     rd[TD_IMAGE_LAT_BUCKETS];
+			uint64_t     wr[TD_IMAGE_LAT_BUCKETS];
+		} lat;
 	} stats;
 };
 
+static inline int
+tapdisk_image_lat_bucket(long long us)
+{
+	int b;
+
+	if (us <= 0)
+		return 0;
+
+	b = 64 - __builtin_clzll(us);
+
+	return b < TD_IMAGE_LAT_BUCKETS ? b : TD_IMAGE_LAT_BUCKETS - 1;
+}
+
 #define tapdisk_for_each_image(_image, _head)			\
 	list_for_each_entry(_image, _head, next)
 
@@ -79,8 +110,9 @@ struct td_image_handle {
 int tapdisk_image_open(int, const char *, int, struct td_vbd_encryption *, td_image_t **);
 void tapdisk_image_close(td_image_t *);
 
-int tapdisk_image_open_chain(const char *, int, int, struct td_vbd_encryption *, struct list_head *);
+int tapdisk_image_open_chain(const char *, int, int, struct td_vbd_encryption *, struct list_head *, struct list_head *reuse);
 void tapdisk_image_close_chain(struct list_head *);
+void tapdisk_image_retain_chain(struct list_head *, struct list_head *retained);
 int tapdisk_image_validate_chain(struct list_head *);
 
 td_image_t *tapdisk_image_allocate(const char *, int, td_flag_t);
@@ -33,6 +33,8 @@
 #endif
 
 #include <signal.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -43,6 +45,41 @@
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-log.h"
+#include "tapdisk-profile.h"
+
+/*
+ * Source of the writes zeroing sectors for drivers which cannot do it
+ * without data. It is never written to, its pages are the zero page.
+ */
+#define TD_ZERO_BUF_SECS             2048
+
+#define MIN(a, b)                    ((a) < (b) ? (a) : (b))
+
+static char td_zero_buf[TD_ZERO_BUF_SECS << SECTOR_SHIFT]
+	__attribute__((aligned(4096)));
+
+/*
+ * Completions raised while another one runs on this event loop. A
+ * completion often forwards or reissues the request, whose completion
+ * would otherwise recurse through every image of the chain, and every
+ * mirror; queued, they run one after the other, on a flat stack.
+ */
+#define TD_COMPLETIONS_MIN           64
+
+struct td_completion {
+	td_request_t                 treq;
+	int                          res;
+};
+
+struct td_completion_queue {
+	struct td_completion        *ring;
+	unsigned int                 size;
+	unsigned int                 head;
+	unsigned int                 tail;
+	int                          draining;
+};
+
+static __thread struct td_completion_queue td_completions;
 
 int
 td_load(td_image_t *image)
@@ -166,6 +203,67 @@ td_validate_parent(td_image_t *image, td_image_t *parent)
 	return driver->ops->td_validate_parent(driver, pdriver, 0);
 }
 
+int
+td_sector_present(td_image_t *image, td_sector_t sec, td_sector_t *secs)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver)
+		return -ENODEV;
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return -EBADF;
+
+	if (!driver->ops->td_sector_present)
+		return -EOPNOTSUPP;
+
+	return driver->ops->td_sector_present(driver, sec, secs);
+}
+
+int
+td_set_depth(td_image_t *image, int nr)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver)
+		return -ENODEV;
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return -EBADF;
+
+	if (!driver->ops->td_set_depth)
+		return 0;
+
+	return driver->ops->td_set_depth(driver, nr);
+}
+
+/*
+ * Hands @treq to the driver, so that the tiocbs it queues meanwhile inherit
+ * the request's priority and profile.
+ */
+static void
+td_queue_driver(td_driver_t *driver, td_request_t treq,
+		void (*queue)(td_driver_t *, td_request_t))
+{
+	td_vbd_request_t *vreq = treq.vreq;
+	td_profile_t *profile, *prev;
+	uint64_t start;
+	int prio;
+
+	profile = vreq && vreq->vbd ? vreq->vbd->profile : NULL;
+	start   = tapdisk_profile_now(profile);
+
+	prio = tapdisk_server_set_prio(treq.prio);
+	prev = tapdisk_server_set_profile(start ? profile : NULL);
+	queue(driver, treq);
+	tapdisk_server_set_profile(prev);
+	tapdisk_server_set_prio(prio);
+
+	tapdisk_profile_add(profile, TD_PROF_QUEUE, start);
+}
+
 void
 td_queue_write(td_image_t *image, td_request_t treq)
 {
@@ -192,7 +290,7 @@ td_queue_write(td_image_t *image, td_request_t treq)
 	if (err)
 		goto fail;
 
-	driver->ops->td_queue_write(driver, treq);
+	td_queue_driver(driver, treq, driver->ops->td_queue_write);
 
 	return;
 
@@ -226,7 +324,118 @@ td_queue_read(td_image_t *image, td_request_t treq)
 	if (err)
 		goto fail;
 
-	driver->ops->td_queue_read(driver, treq);
+	td_queue_driver(driver, treq, driver->ops->td_queue_read);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+/*
+ * Discards are advisory: drivers which cannot release space complete them
+ * successfully, leaving the data in place.
+ */
+void
+td_queue_discard(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	if (!driver->ops->td_queue_discard) {
+		err = 0;
+		goto fail;
+	}
+
+	driver->ops->td_queue_discard(driver, treq);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+void
+td_queue_write_zeroes(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	if (!driver->ops->td_queue_write_zeroes) {
+		td_queue_zero_writes(image, treq);
+		return;
+	}
+
+	td_queue_driver(driver, treq, driver->ops->td_queue_write_zeroes);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+/*
+ * Only writable images have anything to sync. Images without a flush of
+ * their own, like filters and read-only parents, pass the request on; it
+ * completes at the end of the chain.
+ */
+void
+td_queue_flush(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	if (!driver->ops->td_queue_flush) {
+		td_forward_request(treq);
+		return;
+	}
+
+	driver->ops->td_queue_flush(driver, treq);
 
 	return;
 
@@ -234,16 +443,87 @@ fail:
 	td_complete_request(treq, err);
 }
 
+/*
+ * Zeroes the sectors of a write-zeroes request with plain writes, for
+ * drivers, or storage, which know no better.
+ */
+void
+td_queue_zero_writes(td_image_t *image, td_request_t treq)
+{
+	while (treq.secs) {
+		td_request_t clone = treq;
+
+		clone.op   = TD_OP_WRITE;
+		clone.buf  = td_zero_buf;
+		clone.secs = MIN(treq.secs, TD_ZERO_BUF_SECS);
+		td_queue_write(image, clone);
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+	}
+}
+
 void
 td_forward_request(td_request_t treq)
 {
 	tapdisk_vbd_forward_request(treq);
 }
 
+static int
+td_completion_grow(struct td_completion_queue *q)
+{
+	struct td_completion *ring;
+	unsigned int i, n, size;
+
+	size = q->size ? q->size << 1 : TD_COMPLETIONS_MIN;
+
+	ring = malloc(size * sizeof(*ring));
+	if (!ring)
+		return -ENOMEM;
+
+	n = q->tail - q->head;
+	for (i = 0; i < n; i++)
+		ring[i] = q->ring[(q->head + i) & (q->size - 1)];
+
+	free(q->ring);
+	q->ring = ring;
+	q->size = size;
+	q->head = 0;
+	q->tail = n;
+
+	return 0;
+}
+
 void
 td_complete_request(td_request_t treq, int res)
 {
+	struct td_completion_queue *q = &td_completions;
+	struct td_completion c;
+
+	if (q->draining) {
+		if (q->tail - q->head < q->size || !td_completion_grow(q)) {
+			c.treq = treq;
+			c.res  = res;
+			q->ring[q->tail++ & (q->size - 1)] = c;
+			return;
+		}
+
+		/* out of memory, recurse as we used to */
+		treq.cb(treq, res);
+		return;
+	}
+
+	q->draining = 1;
+
 	treq.cb(treq, res);
+
+	while (q->head != q->tail) {
+		/* by value, the callback may grow the ring */
+		c = q->ring[q->head++ & (q->size - 1)];
+		c.treq.cb(c.treq, c.res);
+	}
+
+	q->draining = 0;
 }
 
 void
@@ -266,6 +546,12 @@ td_prep_write(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	tapdisk_prep_tiocb(tiocb, fd, 1, buf, bytes, offset, cb, arg);
 }
 
+void
+td_prep_fdsync(struct tiocb *tiocb, int fd, td_queue_callback_t cb, void *arg)
+{
+	tapdisk_prep_fdsync_tiocb(tiocb, fd, cb, arg);
+}
+
 void
 td_debug(td_image_t *image)
 {
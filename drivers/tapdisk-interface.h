@@ -42,9 +42,15 @@ int td_load(td_image_t *);
 int td_close(td_image_t *);
 int td_get_parent_id(td_image_t *, td_disk_id_t *);
 int td_validate_parent(td_image_t *, td_image_t *);
+int td_sector_present(td_image_t *, td_sector_t, td_sector_t *);
+int td_set_depth(td_image_t *, int);
 
 void td_queue_write(td_image_t *, td_request_t);
 void td_queue_read(td_image_t *, td_request_t);
+void td_queue_discard(td_image_t *, td_request_t);
+void td_queue_write_zeroes(td_image_t *, td_request_t);
+void td_queue_flush(td_image_t *, td_request_t);
+void td_queue_zero_writes(td_image_t *, td_request_t);
 void td_forward_request(td_request_t);
 void td_complete_request(td_request_t, int);
 
@@ -55,6 +61,7 @@ void td_prep_read(struct tiocb *, int, char *, size_t,
 		  long long, td_queue_callback_t, void *);
 void td_prep_write(struct tiocb *, int, char *, size_t,
 		   long long, td_queue_callback_t, void *);
+void td_prep_fdsync(struct tiocb *, int, td_queue_callback_t, void *);
 void td_panic(void) __noreturn;
 
 #endif
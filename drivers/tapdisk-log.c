@@ -41,15 +41,19 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include "tapdisk-log.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-logfile.h"
 #include "tapdisk-syslog.h"
+#include "tapdisk-logring.h"
 #include "tapdisk-server.h"
+#include "tapdisk-flight.h"
 
 #define TLOG_LOGFILE_BUFSZ (16<<10)
 #define TLOG_SYSLOG_BUFSZ   (8<<10)
+#define TLOG_RING_SIZE    (256<<10)
 
 #define MAX_ENTRY_LEN      512
 
@@ -63,6 +67,9 @@ struct tlog {
 	td_syslog_t    syslog;
 	unsigned long  errors;
 	int            facility;
+
+	td_logring_t   ring;
+	pthread_t      producer;
 };
 
 static struct tlog tapdisk_log;
@@ -163,10 +170,86 @@ tlog_syslog_open(const char *ident, int facility)
 	return err;
 }
 
+static void
+tlog_ring_write(int dest, int prio, const struct timeval *tv,
+		const char *msg, void *private)
+{
+	switch (dest) {
+	case TD_LOGRING_LOGFILE:
+		tapdisk_logfile_write(&tapdisk_log.logfile, tv, msg);
+		break;
+	case TD_LOGRING_SYSLOG:
+		tapdisk_syslog_write(&tapdisk_log.syslog, prio, tv, msg);
+		break;
+	case TD_LOGRING_FLUSH:
+		tapdisk_logfile_flush(&tapdisk_log.logfile);
+		break;
+	}
+}
+
+/*
+ * Log I/O goes to a writer thread, unless TAPDISK3_LOG_THREAD is 0,
+ * or the thread cannot be had: then the event loop does it.
+ */
+static void
+tlog_ring_start(void)
+{
+	const char *val;
+	int err;
+
+	val = getenv("TAPDISK3_LOG_THREAD");
+	if (val && !atoi(val))
+		return;
+
+	tapdisk_log.producer = pthread_self();
+
+	err = tapdisk_logring_start(&tapdisk_log.ring, TLOG_RING_SIZE,
+				    tlog_ring_write, NULL);
+	if (err)
+		tlog_info("no log writer thread: %d", err);
+}
+
+static void
+tlog_ring_stop(void)
+{
+	tapdisk_logring_stop(&tapdisk_log.ring);
+}
+
+/*
+ * The ring has a single producer, the thread which opened the log:
+ * workers and helper threads log around it.
+ */
+static inline int
+tlog_ring_usable(void)
+{
+	return tapdisk_logring_running(&tapdisk_log.ring) &&
+		pthread_equal(pthread_self(), tapdisk_log.producer);
+}
+
 void
 tlog_vsyslog(int prio, const char *fmt, va_list ap)
 {
 	td_syslog_t *syslog = &tapdisk_log.syslog;
+	va_list aq;
+
+	if (tapdisk_flight_level() >= 0) {
+		va_copy(aq, ap);
+		tapdisk_flight_vprintf(fmt, aq);
+		va_end(aq);
+	}
+
+	if (tlog_ring_usable()) {
+		tapdisk_logring_vprintf(&tapdisk_log.ring, TD_LOGRING_SYSLOG,
+					prio, fmt, ap);
+		return;
+	}
+
+	/* the syslog buffer is flushed from the main event loop */
+	if (tapdisk_server_in_worker() ||
+	    tapdisk_logring_running(&tapdisk_log.ring)) {
+		vsyslog(prio, fmt, ap);
+		return;
+	}
 
 	tapdisk_vsyslog(syslog, prio, fmt, ap);
 }
@@ -209,6 +292,10 @@ tlog_open(const char *name, int facility, int level)
 	if (err)
 		goto fail;
 
+	tlog_ring_start();
+
+	tapdisk_flight_open();
+
 	return 0;
 
 fail:
@@ -222,13 +309,21 @@ tlog_reopen(void)
 {
 	int err;
 
+	tlog_ring_stop();
+
 	tlog_logfile_close(true);
 	err = tlog_logfile_open(tapdisk_log.name, tapdisk_log.level);
 	if (err)
 		return err;
 
 	tlog_syslog_close();
-	return tlog_syslog_open(tapdisk_log.ident, tapdisk_log.facility);
+	err = tlog_syslog_open(tapdisk_log.ident, tapdisk_log.facility);
+	if (err)
+		return err;
+
+	tlog_ring_start();
+
+	return 0;
 }
 
 void
@@ -237,6 +332,10 @@ tlog_close(void)
 	DPRINTF("tapdisk-log: closing after %lu errors\n",
 		tapdisk_log.errors);
 
+	tlog_ring_stop();
+
+	tapdisk_flight_close(tapdisk_log.precious || tapdisk_log.errors);
+
 	tlog_logfile_close(false);
 	tlog_syslog_close();
 
@@ -247,8 +346,12 @@ tlog_close(void)
 void
 tlog_precious(int force_flush)
 {
-	if (!tapdisk_log.precious || force_flush)
-		tapdisk_logfile_flush(&tapdisk_log.logfile);
+	if (!tapdisk_log.precious || force_flush) {
+		if (tlog_ring_usable())
+			tapdisk_logring_flush(&tapdisk_log.ring);
+		else
+			tapdisk_logfile_flush(&tapdisk_log.logfile);
+	}
 
 	tapdisk_log.precious = 1;
 }
@@ -258,9 +361,20 @@ __tlog_write(int level, const char *fmt, ...)
 {
 	va_list ap;
 
+	if (level <= tapdisk_flight_level()) {
+		va_start(ap, fmt);
+		tapdisk_flight_vprintf(fmt, ap);
+		va_end(ap);
+	}
+
 	if (level <= tapdisk_log.level) {
 		va_start(ap, fmt);
-		tlog_logfile_vprint(fmt, ap);
+		if (tlog_ring_usable())
+			tapdisk_logring_vprintf(&tapdisk_log.ring,
+						TD_LOGRING_LOGFILE, level,
+						fmt, ap);
+		else
+			tlog_logfile_vprint(fmt, ap);
 		va_end(ap);
 	}
 }
@@ -274,7 +388,7 @@ __tlog_error(const char *fmt, ...)
 	tlog_vsyslog(LOG_ERR, fmt, ap);
 	va_end(ap);
 
-	tapdisk_log.errors++;
+	__sync_fetch_and_add(&tapdisk_log.errors, 1);
 }
 
 void
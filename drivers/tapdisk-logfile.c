@@ -166,25 +166,23 @@ tapdisk_logfile_setvbuf(td_logfile_t *log, int mode)
 	return err;
 }
 
-ssize_t
-tapdisk_logfile_vprintf(td_logfile_t *log, const char *fmt, va_list ap)
+static ssize_t
+__tapdisk_logfile_vprintf(td_logfile_t *log, const struct timeval *tv,
+			  const char *fmt, va_list ap)
 {
 	char buf[1024];
 	size_t size, n;
 	ssize_t len;
-	struct timeval tv;
 
 	if (!log->file)
 		return -EBADF;
 
-	gettimeofday(&tv, NULL);
-
 	size = sizeof(buf);
 	len  = 0;
 
-	len += tapdisk_syslog_strftime(buf, size, &tv);
+	len += tapdisk_syslog_strftime(buf, size, tv);
 	len += snprintf(buf + len, size - len, ": ");
-	len += tapdisk_syslog_strftv(buf + len, size - len, &tv);
+	len += tapdisk_syslog_strftv(buf + len, size - len, tv);
 	len += snprintf(buf + len, size - len, " ");
 	len += vsnprintf(buf + len, size - len, fmt, ap);
 
@@ -198,6 +196,37 @@ tapdisk_logfile_vprintf(td_logfile_t *log, const char *fmt, va_list ap)
 	return len;
 }
 
+ssize_t
+tapdisk_logfile_vprintf(td_logfile_t *log, const char *fmt, va_list ap)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return __tapdisk_logfile_vprintf(log, &tv, fmt, ap);
+}
+
+static ssize_t
+__tapdisk_logfile_printf(td_logfile_t *log, const struct timeval *tv,
+			 const char *fmt, ...)
+{
+	va_list ap;
+	ssize_t rv;
+
+	va_start(ap, fmt);
+	rv = __tapdisk_logfile_vprintf(log, tv, fmt, ap);
+	va_end(ap);
+
+	return rv;
+}
+
+ssize_t
+tapdisk_logfile_write(td_logfile_t *log, const struct timeval *tv,
+		      const char *msg)
+{
+	return __tapdisk_logfile_printf(log, tv, "%s", msg);
+}
+
 ssize_t
 tapdisk_logfile_printf(td_logfile_t *log, const char *fmt, ...)
 {
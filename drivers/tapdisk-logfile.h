@@ -32,6 +32,7 @@
 #define __TAPDISK_LOGFILE_H__
 
 #include <stdio.h>
+#include <sys/time.h>
 
 typedef struct _td_logfile td_logfile_t;
 
@@ -49,6 +50,9 @@ int tapdisk_logfile_open(td_logfile_t *, const char *dir, const char *ident,
 
 ssize_t tapdisk_logfile_printf(td_logfile_t *, const char *fmt, ...);
 ssize_t tapdisk_logfile_vprintf(td_logfile_t *, const char *fmt, va_list ap);
+/* a message stamped at @tv, as by the log writer thread */
+ssize_t tapdisk_logfile_write(td_logfile_t *, const struct timeval *tv,
+			      const char *msg);
 
 void tapdisk_logfile_close(td_logfile_t *);
 int tapdisk_logfile_unlink(td_logfile_t *);
@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "tapdisk-logring.h"
+
+#define TD_LOGRING_ALIGN(_n)        (((_n) + 7) & ~(size_t)7)
+
+struct td_logrec {
+	uint32_t                    size;   /* of the record, aligned */
+	uint8_t                     dest;
+	uint8_t                     prio;
+	uint16_t                    len;    /* of msg, without the NUL */
+	struct timeval              tv;
+	/* char msg[len + 1]; */
+};
+
+/*
+ * NB. Offsets wrap on size_t range, the ring size is a power of two.
+ * Records may wrap around the end of the ring.
+ */
+
+static void
+tapdisk_logring_put(td_logring_t *ring, size_t off, const void *src, size_t n)
+{
+	size_t idx = off & (ring->size - 1), part;
+
+	part = ring->size - idx;
+	if (part > n)
+		part = n;
+
+	memcpy(ring->ring + idx, src, part);
+	memcpy(ring->ring, (const char *)src + part, n - part);
+}
+
+static void
+tapdisk_logring_get(td_logring_t *ring, size_t off, void *dst, size_t n)
+{
+	size_t idx = off & (ring->size - 1), part;
+
+	part = ring->size - idx;
+	if (part > n)
+		part = n;
+
+	memcpy(dst, ring->ring + idx, part);
+	memcpy((char *)dst + part, ring->ring, n - part);
+}
+
+static void
+tapdisk_logring_kick(td_logring_t *ring)
+{
+	uint64_t val = 1;
+
+	/* pairs with the writer setting sleeping, then looking at prod */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED))
+		if (write(ring->efd, &val, sizeof(val)) < 0) {
+			/* nothing to be done */
+		}
+}
+
+static int
+tapdisk_logring_queue(td_logring_t *ring, int dest, int prio,
+		      const struct timeval *tv, const char *msg, size_t len)
+{
+	struct td_logrec rec;
+	size_t cons, size;
+
+	size = TD_LOGRING_ALIGN(sizeof(rec) + len + 1);
+	cons = __atomic_load_n(&ring->cons, __ATOMIC_ACQUIRE);
+
+	if (ring->size - (ring->prod - cons) < size) {
+		__atomic_add_fetch(&ring->drops, 1, __ATOMIC_RELAXED);
+		return -ENOBUFS;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.size = size;
+	rec.dest = dest;
+	rec.prio = prio;
+	rec.len  = len;
+	rec.tv   = *tv;
+
+	tapdisk_logring_put(ring, ring->prod, &rec, sizeof(rec));
+	tapdisk_logring_put(ring, ring->prod + sizeof(rec), msg, len + 1);
+
+	__atomic_store_n(&ring->prod, ring->prod + size, __ATOMIC_RELEASE);
+
+	tapdisk_logring_kick(ring);
+
+	return 0;
+}
+
+int
+tapdisk_logring_vprintf(td_logring_t *ring, int dest, int prio,
+			const char *fmt, va_list ap)
+{
+	char msg[TD_LOGRING_MSG_MAX];
+	struct timeval tv;
+	int len;
+
+	gettimeofday(&tv, NULL);
+
+	len = vsnprintf(msg, sizeof(msg), fmt, ap);
+	if (len < 0)
+		return -EINVAL;
+	if (len >= sizeof(msg))
+		len = sizeof(msg) - 1;
+
+	return tapdisk_logring_queue(ring, dest, prio, &tv, msg, len);
+}
+
+int
+tapdisk_logring_flush(td_logring_t *ring)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tapdisk_logring_queue(ring, TD_LOGRING_FLUSH, 0, &tv, "", 0);
+}
+
+static void
+tapdisk_logring_report_drops(td_logring_t *ring)
+{
+	char msg[64];
+	unsigned long drops;
+	struct timeval tv;
+
+	drops = __atomic_load_n(&ring->drops, __ATOMIC_RELAXED);
+	if (drops == ring->reported)
+		return;
+
+	gettimeofday(&tv, NULL);
+	snprintf(msg, sizeof(msg), "tapdisk-logring: %lu messages dropped",
+		 drops - ring->reported);
+	ring->reported = drops;
+
+	ring->write(TD_LOGRING_SYSLOG, LOG_WARNING, &tv, msg, ring->private);
+}
+
+static void
+tapdisk_logring_wait(td_logring_t *ring)
+{
+	uint64_t val;
+
+	__atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ring->prod, __ATOMIC_SEQ_CST) == ring->cons &&
+	    !__atomic_load_n(&ring->stop, __ATOMIC_SEQ_CST))
+		if (read(ring->efd, &val, sizeof(val)) < 0) {
+			/* retried by the caller */
+		}
+
+	__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void *
+tapdisk_logring_thread(void *arg)
+{
+	td_logring_t *ring = arg;
+	char msg[TD_LOGRING_MSG_MAX];
+	struct td_logrec rec;
+	size_t prod;
+
+	for (;;) {
+		prod = __atomic_load_n(&ring->prod, __ATOMIC_ACQUIRE);
+
+		if (prod == ring->cons) {
+			tapdisk_logring_report_drops(ring);
+
+			if (__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE) &&
+			    __atomic_load_n(&ring->prod, __ATOMIC_ACQUIRE) ==
+			    ring->cons)
+				break;
+
+			tapdisk_logring_wait(ring);
+			continue;
+		}
+
+		while (ring->cons != prod) {
+			tapdisk_logring_get(ring, ring->cons, &rec, sizeof(rec));
+			tapdisk_logring_get(ring, ring->cons + sizeof(rec),
+					    msg, rec.len + 1);
+
+			ring->write(rec.dest, rec.prio, &rec.tv, msg,
+				    ring->private);
+
+			__atomic_store_n(&ring->cons, ring->cons + rec.size,
+					 __ATOMIC_RELEASE);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+tapdisk_logring_free(td_logring_t *ring)
+{
+	if (ring->ring)
+		munmap(ring->ring, ring->size);
+
+	if (ring->efd >= 0)
+		close(ring->efd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->efd = -1;
+}
+
+int
+tapdisk_logring_start(td_logring_t *ring, size_t size,
+		      td_logring_write_t write, void *private)
+{
+	sigset_t set, old;
+	size_t n;
+	int err;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->efd = -1;
+
+	for (n = 4096; n < size; n <<= 1)
+		;
+
+	ring->ring = mmap(NULL, n, PROT_READ|PROT_WRITE,
+			  MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+	if (ring->ring == MAP_FAILED) {
+		ring->ring = NULL;
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	ring->size = n;
+
+	/* no page faults for the producer */
+	err = mlock(ring->ring, ring->size);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	ring->efd = eventfd(0, EFD_CLOEXEC);
+	if (ring->efd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	ring->write   = write;
+	ring->private = private;
+
+	/* signals are for the event loops */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	err = -pthread_create(&ring->thread, NULL,
+			      tapdisk_logring_thread, ring);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err)
+		goto fail;
+
+	ring->running = 1;
+
+	return 0;
+
+fail:
+	tapdisk_logring_free(ring);
+	return err;
+}
+
+void
+tapdisk_logring_stop(td_logring_t *ring)
+{
+	uint64_t val = 1;
+
+	if (!ring->running)
+		return;
+
+	__atomic_store_n(&ring->stop, 1, __ATOMIC_SEQ_CST);
+	if (write(ring->efd, &val, sizeof(val)) < 0) {
+		/* the writer looks at stop before sleeping */
+	}
+
+	pthread_join(ring->thread, NULL);
+
+	tapdisk_logring_free(ring);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_LOGRING_H_
+#define _TAPDISK_LOGRING_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/*
+ * Log records go from the event loop into a lock-free single-producer
+ * ring, and a writer thread takes them out and does the formatting of
+ * timestamps and headers and all the file and socket I/O, which may
+ * block. The producer only prints the message text, copies it into
+ * the ring and, if the writer sleeps, kicks an eventfd. It never
+ * waits: when the ring is full, records are dropped and counted, and
+ * the writer reports the count to syslog.
+ *
+ * A single producer: worker threads have to log around the ring.
+ */
+
+#define TD_LOGRING_MSG_MAX          1024
+
+#define TD_LOGRING_LOGFILE          0
+#define TD_LOGRING_SYSLOG           1
+#define TD_LOGRING_FLUSH            2 /* the logfile, no message */
+
+typedef struct td_logring           td_logring_t;
+
+/* on the writer thread, @msg is NUL terminated */
+typedef void (*td_logring_write_t)(int dest, int prio,
+				   const struct timeval *tv,
+				   const char *msg, void *private);
+
+struct td_logring {
+	char                       *ring;
+	size_t                      size;
+
+	size_t                      prod;    /* by the producer */
+	unsigned long               drops;
+	size_t                      cons;    /* by the writer */
+	unsigned long               reported;
+
+	int                         efd;
+	int                         sleeping;
+	int                         stop;
+	int                         running;
+	pthread_t                   thread;
+
+	td_logring_write_t          write;
+	void                       *private;
+};
+
+int tapdisk_logring_start(td_logring_t *, size_t size,
+			  td_logring_write_t write, void *private);
+/* writes out what is queued, then stops the writer */
+void tapdisk_logring_stop(td_logring_t *);
+
+int tapdisk_logring_vprintf(td_logring_t *, int dest, int prio,
+			    const char *fmt, va_list ap);
+int tapdisk_logring_flush(td_logring_t *);
+
+static inline int
+tapdisk_logring_running(td_logring_t *ring)
+{
+	return ring->running;
+}
+
+#endif /* _TAPDISK_LOGRING_H_ */
@@ -52,4 +52,54 @@ struct stats {
     uint64_t flags;
 };
 
+/**
+ * Consistent copy of the counters above, published by tapdisk at most every
+ * TAPDISK3_METRICS_PUBLISH_MS (100 ms by default) while they change. It
+ * lives at TD_METRICS_SNAPSHOT_OFFSET in every metrics file, so that
+ * readers of the live counters in the first page are not affected.
+ *
+ * seq is odd while tapdisk updates the snapshot. Readers copy it out with:
+ *
+ *	do {
+ *		seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+ *		if (seq & 1)
+ *			continue;
+ *		memcpy(&copy, snap, sizeof(copy));
+ *		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *	} while (seq != __atomic_load_n(&snap->seq, __ATOMIC_RELAXED));
+ *
+ * The payload is the struct stats, followed for vbd-* files by a struct
+ * blkback_latency (blktap3.h) on the next cache line.
+ *
+ * td-exporter serves the snapshots of all tapdisks on a host as
+ * OpenMetrics.
+ */
+#define TD_METRICS_SNAPSHOT_VERSION 0x00000001
+#define TD_METRICS_SNAPSHOT_OFFSET  4096
+#define TD_METRICS_CACHE_LINE       64
+
+struct stats_snapshot {
+    uint64_t seq;
+    uint32_t version;
+
+    /**
+     * Bytes of payload, from stats to the end of ext.
+     */
+    uint32_t length;
+
+    /**
+     * CLOCK_MONOTONIC time of the publication, in us.
+     */
+    uint64_t time_us;
+
+    /**
+     * Number of snapshots published so far.
+     */
+    uint64_t published;
+
+    struct stats stats __attribute__ ((aligned (TD_METRICS_CACHE_LINE)));
+
+    uint8_t ext[] __attribute__ ((aligned (TD_METRICS_CACHE_LINE)));
+} __attribute__ ((aligned (TD_METRICS_CACHE_LINE)));
+
 #endif /* TAPDISK_METRICS_STATS_H */
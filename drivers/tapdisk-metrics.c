@@ -37,7 +37,9 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
 
+#include "blktap3.h"
 #include "tapdisk-metrics.h"
 #include "tapdisk-log.h"
 #include "debug.h"
@@ -46,9 +48,79 @@
 
 #define VBD_STATS_VERSION 0x00000001
 
+#define TD_METRICS_PUBLISH_MS 100
+
 /* make a static metrics struct, so it only exists in the context of this file */
 static td_metrics_t td_metrics;
 
+static uint64_t td_metrics_interval_us = TD_METRICS_PUBLISH_MS * 1000;
+
+/* The live counters take the first page, the snapshot follows */
+static size_t
+td_metrics_shm_size(size_t ext_len)
+{
+    size_t size;
+
+    size = TD_METRICS_SNAPSHOT_OFFSET + sizeof(struct stats_snapshot) +
+        ext_len;
+
+    return (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+static void
+td_metrics_snapshot_init(stats_t *stats, size_t ext_len)
+{
+    stats->snap = stats->shm.mem + TD_METRICS_SNAPSHOT_OFFSET;
+    stats->snap->version = TD_METRICS_SNAPSHOT_VERSION;
+    stats->snap->length = offsetof(struct stats_snapshot, ext) -
+        offsetof(struct stats_snapshot, stats) + ext_len;
+    stats->ext = NULL;
+    stats->ext_len = ext_len;
+    stats->published_us = 0;
+}
+
+uint64_t
+td_metrics_publish_interval(void)
+{
+    return td_metrics_interval_us;
+}
+
+int
+td_metrics_publish(stats_t *stats, uint64_t now_us)
+{
+    struct stats_snapshot *snap = stats->snap;
+    uint64_t seq;
+
+    if (!snap || !stats->stats)
+        return 0;
+
+    /*
+     * Every completion moves the counters, so there is no need to look at
+     * ext to tell whether anything changed.
+     */
+    if (!memcmp(&snap->stats, stats->stats, sizeof(snap->stats)))
+        return 0;
+
+    if (snap->published && now_us - stats->published_us < td_metrics_interval_us)
+        return 1;
+
+    seq = snap->seq;
+    __atomic_store_n(&snap->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    snap->stats = *stats->stats;
+    if (stats->ext)
+        memcpy(snap->ext, stats->ext, stats->ext_len);
+    snap->time_us = now_us;
+    snap->published++;
+
+    __atomic_store_n(&snap->seq, seq + 2, __ATOMIC_RELEASE);
+
+    stats->published_us = now_us;
+
+    return 0;
+}
+
 /* Returns 0 in case there were no problems while emptying the folder */
 static int
 empty_folder(char *path)
@@ -101,6 +173,11 @@ int
 td_metrics_start()
 {
     int err = 0;
+    const char *val;
+
+    val = getenv("TAPDISK3_METRICS_PUBLISH_MS");
+    if (val && atoi(val) >= 0)
+        td_metrics_interval_us = (uint64_t)atoi(val) * 1000;
 
     err = asprintf(&td_metrics.path, TAPDISK_METRICS_PATHF, getpid());
     if (unlikely(err == -1)) {
@@ -169,7 +246,7 @@ td_metrics_vdi_start(int minor, stats_t *vdi_stats)
         goto out;
     }
 
-    vdi_stats->shm.size = PAGE_SIZE;
+    vdi_stats->shm.size = td_metrics_shm_size(0);
 
     err = shm_create(&vdi_stats->shm);
     if (unlikely(err)) {
@@ -179,6 +256,7 @@ td_metrics_vdi_start(int minor, stats_t *vdi_stats)
    }
 
     vdi_stats->stats = vdi_stats->shm.mem;
+    td_metrics_snapshot_init(vdi_stats, 0);
 
 out:
     return err;
@@ -200,6 +278,7 @@ td_metrics_vdi_stop(stats_t *vdi_stats)
 
     free(vdi_stats->shm.path);
     vdi_stats->shm.path = NULL;
+    vdi_stats->snap = NULL;
 
 end:
     return err;
@@ -224,7 +303,7 @@ td_metrics_vbd_start(int domain, int id, stats_t *vbd_stats)
         goto out;
     }
 
-    vbd_stats->shm.size = PAGE_SIZE;
+    vbd_stats->shm.size = td_metrics_shm_size(sizeof(struct blkback_latency));
 
     err = shm_create(&vbd_stats->shm);
     if (unlikely(err)) {
@@ -233,6 +312,7 @@ td_metrics_vbd_start(int domain, int id, stats_t *vbd_stats)
         goto out;
    }
     vbd_stats->stats = vbd_stats->shm.mem;
+    td_metrics_snapshot_init(vbd_stats, sizeof(struct blkback_latency));
     vbd_stats->stats->version = VBD_STATS_VERSION;
 out:
     return err;
@@ -255,6 +335,7 @@ td_metrics_vbd_stop(stats_t *vbd_stats)
 
     free(vbd_stats->shm.path);
     vbd_stats->shm.path = NULL;
+    vbd_stats->snap = NULL;
 
 end:
     return err;
@@ -279,7 +360,7 @@ td_metrics_blktap_start(int minor, stats_t *blktap_stats)
         goto out;
     }
 
-    blktap_stats->shm.size = PAGE_SIZE;
+    blktap_stats->shm.size = td_metrics_shm_size(0);
 
     err = shm_create(&blktap_stats->shm);
     if (unlikely(err)) {
@@ -288,6 +369,7 @@ td_metrics_blktap_start(int minor, stats_t *blktap_stats)
         goto out;
     }
     blktap_stats->stats = blktap_stats->shm.mem;
+    td_metrics_snapshot_init(blktap_stats, 0);
 out:
     return err;
 }
@@ -308,6 +390,7 @@ td_metrics_blktap_stop(stats_t *blktap_stats)
 
     free(blktap_stats->shm.path);
     blktap_stats->shm.path = NULL;
+    blktap_stats->snap = NULL;
 
 end:
     return err;
@@ -332,7 +415,7 @@ td_metrics_nbd_start(stats_t *nbd_stats, int minor)
         goto out;
     }
 
-    nbd_stats->shm.size = PAGE_SIZE;
+    nbd_stats->shm.size = td_metrics_shm_size(0);
 
     err = shm_create(&nbd_stats->shm);
     if (unlikely(err)) {
@@ -341,6 +424,7 @@ td_metrics_nbd_start(stats_t *nbd_stats, int minor)
         goto out;
    }
     nbd_stats->stats = nbd_stats->shm.mem;
+    td_metrics_snapshot_init(nbd_stats, 0);
 out:
     return err;
 }
@@ -360,6 +444,7 @@ td_metrics_nbd_stop(stats_t *nbd_stats)
 
     free(nbd_stats->shm.path);
     nbd_stats->shm.path = NULL;
+    nbd_stats->snap = NULL;
 
 end:
     return err;
@@ -46,6 +46,15 @@
 typedef struct {
     struct shm shm;
     struct stats *stats;
+
+    /**
+     * Published copy of stats, and of ext_len bytes at ext (may be NULL)
+     * after it.
+     */
+    struct stats_snapshot *snap;
+    const void *ext;
+    size_t ext_len;
+    uint64_t published_us;
 } stats_t;
 
 typedef struct {
@@ -78,4 +87,14 @@ int td_metrics_blktap_stop(stats_t *blktap_stats);
 int td_metrics_nbd_start(stats_t *nbd_server, int minor);
 
 int td_metrics_nbd_stop(stats_t *nbd_server);
+
+/*
+ * Publishes a snapshot of the counters if they changed since the last one
+ * and that one is old enough. Must be called by the thread updating them.
+ * Returns 1 if a change is left to publish, 0 otherwise.
+ */
+int td_metrics_publish(stats_t *stats, uint64_t now_us);
+
+/* The minimum time between two snapshots, in us */
+uint64_t td_metrics_publish_interval(void);
 #endif /* TAPDISK_METRICS_H */
@@ -0,0 +1,947 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-log.h"
+#include "tapdisk-utils.h"
+#include "tapdisk-mirror.h"
+#include "timeout-math.h"
+#include "cbt-util.h"
+
+#define INFO(_f, _a...)            tlog_syslog(TLOG_INFO, "mirror: " _f, ##_a)
+#define ERR(_f, _a...)             tlog_syslog(TLOG_WARN, "mirror: " _f, ##_a)
+
+#define BUG_ON(_cond)              if (unlikely(_cond)) { td_panic(); }
+#define MIN(a, b)                  ((a) < (b) ? (a) : (b))
+
+#define TD_MIRROR_BLOCK_SECS       (CBT_BLOCK_SIZE >> SECTOR_SHIFT)
+
+/* blocks copied at once */
+#define TD_MIRROR_COPY_DEPTH       4
+
+/* the copy rate is metered out in ticks of this many usecs */
+#define TD_MIRROR_TICK             100000
+
+/* how often a stalled or postponed resync is retried, in ticks */
+#define TD_MIRROR_RETRY_TICKS      10
+
+/* default bounds of an asynchronous mirror, in MiB and msecs */
+#define TD_MIRROR_ASYNC_LAG        64
+#define TD_MIRROR_ASYNC_LAG_MS     1000
+
+struct td_mirror_copy {
+	td_mirror_t                *m;
+	int                         busy;
+	int                         redirty;
+	uint64_t                    block;
+	char                       *buf;
+	struct td_iovec             iov;
+	td_vbd_request_t            vreq;
+};
+
+/* an asynchronous copy of a guest write, owning its data */
+struct td_mirror_write {
+	td_mirror_t                *m;
+	td_sector_t                 sec;
+	int                         secs;
+	char                       *buf;
+	struct timeval              issued;
+	struct list_head            entry;
+};
+
+struct td_mirror {
+	td_vbd_t                   *vbd;
+	char                       *path;
+
+	/*
+	 * The mapped log file: metadata, then one bit per CBT_BLOCK_SIZE
+	 * block of the disk.
+	 */
+	struct cbt_log_metadata    *meta;
+	unsigned char              *bitmap;
+	size_t                      map_size;
+
+	td_sector_t                 size;
+	uint64_t                    blocks;
+	uint64_t                    dirty;
+
+	uint64_t                    cursor;
+	int                         resyncing;
+	int                         stalled;
+	event_id_t                  timer;
+	int                         inflight;
+	uint64_t                    copied;
+
+	/* bulk copy of the allocated disk, when asked for */
+	int                         copying;
+	uint64_t                    total;
+
+	/* bytes per second, 0 for no limit */
+	uint64_t                    rate;
+	uint64_t                    budget;
+	int                         ticks;
+	struct td_mirror_copy       copies[TD_MIRROR_COPY_DEPTH];
+
+	/*
+	 * Asynchronous mode: guest writes complete on the primary, their
+	 * copies trail behind, oldest first on the list. Beyond max_lag
+	 * bytes or max_age, writes go to the dirty log instead.
+	 */
+	int                         async;
+	uint64_t                    max_lag;
+	struct timeval              max_age;
+	struct list_head            writes;
+	int                         writing;
+	uint64_t                    lag;
+	uint64_t                    overflows;
+};
+
+static void tapdisk_mirror_kick(td_mirror_t *m);
+
+static inline int
+tapdisk_mirror_test(td_mirror_t *m, uint64_t block)
+{
+	return m->bitmap[block >> 3] & (1 << (block & 7));
+}
+
+static void
+tapdisk_mirror_set(td_mirror_t *m, uint64_t block)
+{
+	if (tapdisk_mirror_test(m, block))
+		return;
+
+	m->bitmap[block >> 3] |= 1 << (block & 7);
+	m->dirty++;
+}
+
+static void
+tapdisk_mirror_clear(td_mirror_t *m, uint64_t block)
+{
+	if (!tapdisk_mirror_test(m, block))
+		return;
+
+	m->bitmap[block >> 3] &= ~(1 << (block & 7));
+	m->dirty--;
+}
+
+static void
+tapdisk_mirror_set_range(td_mirror_t *m, td_sector_t sec, td_sector_t secs)
+{
+	uint64_t block, last;
+
+	if (!secs)
+		return;
+
+	last = (sec + secs - 1) / TD_MIRROR_BLOCK_SECS;
+	for (block = sec / TD_MIRROR_BLOCK_SECS; block <= last; block++)
+		tapdisk_mirror_set(m, block);
+}
+
+static uint64_t
+tapdisk_mirror_count(td_mirror_t *m)
+{
+	uint64_t i, n = 0;
+
+	for (i = 0; i < bitmap_size(m->size << SECTOR_SHIFT); i++)
+		n += __builtin_popcount(m->bitmap[i]);
+
+	return n;
+}
+
+/*
+ * One file per VBD, named after its type:path with the slashes replaced.
+ */
+static char *
+tapdisk_mirror_path(td_vbd_t *vbd)
+{
+	const char *dir;
+	char *path, *p;
+	size_t len;
+
+	dir = getenv("TAPDISK3_MIRROR_LOG_DIR") ? : TD_MIRROR_LOG_DIR;
+
+	if (asprintf(&path, "%s/%s.cbt", dir, vbd->name) < 0)
+		return NULL;
+
+	len = strlen(dir) + 1;
+	for (p = path + len; *p; p++)
+		if (*p == '/')
+			*p = '_';
+
+	return path;
+}
+
+/*
+ * Maps the log, reusing one left behind by an earlier tapdisk when its
+ * size matches. A log which was not closed cleanly may miss writes, so
+ * all of the disk counts as dirty then.
+ */
+static int
+tapdisk_mirror_map(td_mirror_t *m)
+{
+	struct stat st;
+	int fd, err, reuse;
+
+	err = tapdisk_mkdir_parents(m->path);
+	if (err)
+		return err;
+
+	fd = open(m->path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+		goto out;
+	}
+
+	reuse = st.st_size == m->map_size;
+	if (!reuse && (ftruncate(fd, 0) || ftruncate(fd, m->map_size))) {
+		err = -errno;
+		goto out;
+	}
+
+	m->meta = mmap(NULL, m->map_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, fd, 0);
+	if (m->meta == MAP_FAILED) {
+		m->meta = NULL;
+		err = -errno;
+		goto out;
+	}
+
+	m->bitmap = (unsigned char *)(m->meta + 1);
+
+	if (reuse && m->meta->size != (m->size << SECTOR_SHIFT))
+		reuse = 0;
+
+	if (!reuse) {
+		memset(m->meta, 0, m->map_size);
+		m->meta->size = m->size << SECTOR_SHIFT;
+		m->meta->consistent = 1;
+	}
+
+	if (!m->meta->consistent) {
+		ERR("%s was not closed cleanly, resyncing all of the disk",
+		    m->path);
+		memset(m->bitmap, 0xff, m->map_size - sizeof(*m->meta));
+		if (m->blocks & 7)
+			m->bitmap[m->blocks >> 3] = (1 << (m->blocks & 7)) - 1;
+	}
+
+	m->dirty = tapdisk_mirror_count(m);
+	m->meta->consistent = 0;
+
+	INFO("%s: %"PRIu64" of %"PRIu64" blocks dirty", m->path, m->dirty,
+	     m->blocks);
+	err = 0;
+
+out:
+	close(fd);
+	return err;
+}
+
+static void
+tapdisk_mirror_free(td_mirror_t *m)
+{
+	int i;
+
+	if (m->timer >= 0)
+		tapdisk_server_unregister_event(m->timer);
+
+	if (m->meta)
+		munmap(m->meta, m->map_size);
+
+	for (i = 0; i < TD_MIRROR_COPY_DEPTH; i++)
+		free(m->copies[i].buf);
+
+	free(m->path);
+	free(m);
+}
+
+/* -- resync -- */
+
+static int
+tapdisk_mirror_ready(td_mirror_t *m)
+{
+	td_vbd_t *vbd = m->vbd;
+
+	return vbd->secondary &&
+		vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR &&
+		!td_flag_test(vbd->state, TD_VBD_DEAD |
+			      TD_VBD_CLOSED |
+			      TD_VBD_QUIESCE_REQUESTED |
+			      TD_VBD_QUIESCED |
+			      TD_VBD_PAUSE_REQUESTED |
+			      TD_VBD_PAUSED |
+			      TD_VBD_SHUTDOWN_REQUESTED);
+}
+
+static int
+tapdisk_mirror_overlaps(td_vbd_request_t *vreq, td_sector_t sec,
+			td_sector_t secs)
+{
+	td_sector_t len = 0;
+	int i;
+
+	if (vreq->op != TD_OP_WRITE && vreq->op != TD_OP_WRITE_ZEROES)
+		return 0;
+
+	for (i = 0; i < vreq->iovcnt; i++)
+		len += vreq->iov[i].secs;
+
+	return vreq->sec < sec + secs && sec < vreq->sec + len;
+}
+
+/*
+ * A block may only be copied while no guest write to it is in flight,
+ * otherwise the copy could read the old data and land after the new.
+ * Writes issued while the copy runs mark it for another pass instead.
+ * The same goes for asynchronous copies, which may carry older data.
+ */
+static int
+tapdisk_mirror_block_busy(td_mirror_t *m, td_sector_t sec, td_sector_t secs)
+{
+	td_vbd_t *vbd = m->vbd;
+	td_vbd_request_t *vreq, *tmp;
+	struct td_mirror_write *w;
+
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->pending_requests)
+		if (tapdisk_mirror_overlaps(vreq, sec, secs))
+			return 1;
+
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->failed_requests)
+		if (tapdisk_mirror_overlaps(vreq, sec, secs))
+			return 1;
+
+	list_for_each_entry(w, &m->writes, entry)
+		if (w->sec < sec + secs && sec < w->sec + w->secs)
+			return 1;
+
+	return 0;
+}
+
+static int
+tapdisk_mirror_next(td_mirror_t *m, uint64_t *block)
+{
+	uint64_t n, b;
+
+	for (n = 0; n < m->blocks; n++) {
+		b = (m->cursor + n) % m->blocks;
+
+		/* skip clean bytes at once */
+		if (!(b & 7) && b + 8 <= m->blocks && !m->bitmap[b >> 3]) {
+			n += 7;
+			continue;
+		}
+
+		if (tapdisk_mirror_test(m, b)) {
+			*block = b;
+			m->cursor = b + 1;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+tapdisk_mirror_done(td_mirror_t *m)
+{
+	INFO("%s: %s complete, %"PRIu64" blocks copied", m->path,
+	     m->copying ? "copy" : "resync", m->copied);
+
+	m->resyncing = 0;
+	m->copying = 0;
+
+	if (m->timer >= 0) {
+		tapdisk_server_unregister_event(m->timer);
+		m->timer = -1;
+	}
+}
+
+static void
+tapdisk_mirror_copy_end(struct td_mirror_copy *c, int err)
+{
+	td_mirror_t *m = c->m;
+
+	c->busy = 0;
+	m->inflight--;
+
+	if (err || c->redirty)
+		tapdisk_mirror_set(m, c->block);
+	else
+		m->copied++;
+
+	if (err) {
+		ERR("%s: copying block %"PRIu64" failed: %d, pausing resync",
+		    m->path, c->block, err);
+		m->stalled = 1;
+		return;
+	}
+
+	if (m->resyncing && !m->dirty && !m->inflight) {
+		tapdisk_mirror_done(m);
+		return;
+	}
+
+	tapdisk_mirror_kick(m);
+}
+
+static void
+tapdisk_mirror_write_done(td_request_t treq, int res)
+{
+	tapdisk_mirror_copy_end(treq.cb_data, res);
+}
+
+/*
+ * Allocated is not the same as written: raw images and preallocated
+ * blocks read back zeroes, which need not cross the wire as data.
+ */
+static int
+tapdisk_mirror_zero(struct td_mirror_copy *c)
+{
+	size_t i, len = c->iov.secs << SECTOR_SHIFT;
+	const uint64_t *p = (const uint64_t *)c->buf;
+
+	for (i = 0; i < len / sizeof(*p); i++)
+		if (p[i])
+			return 0;
+
+	return 1;
+}
+
+static void
+tapdisk_mirror_read_done(td_vbd_request_t *vreq, int err, void *token,
+			 int final)
+{
+	struct td_mirror_copy *c = token;
+	td_mirror_t *m = c->m;
+	td_vbd_t *vbd = m->vbd;
+	td_request_t treq;
+
+	if (!err && (!vbd->secondary ||
+		     vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR))
+		err = -ENODEV;
+
+	if (err) {
+		tapdisk_mirror_copy_end(c, err);
+		return;
+	}
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op      = tapdisk_mirror_zero(c) ? TD_OP_WRITE_ZEROES : TD_OP_WRITE;
+	treq.buf     = c->iov.base;
+	treq.sec     = vreq->sec;
+	treq.secs    = c->iov.secs;
+	treq.prio    = TD_PRIO_BACKGROUND;
+	treq.image   = vbd->secondary;
+	treq.cb      = tapdisk_mirror_write_done;
+	treq.cb_data = c;
+	treq.vreq    = vreq;
+
+	if (treq.op == TD_OP_WRITE_ZEROES)
+		td_queue_write_zeroes(vbd->secondary, treq);
+	else
+		td_queue_write(vbd->secondary, treq);
+}
+
+/*
+ * Block data is read through the VBD like any guest read, and written
+ * straight to the secondary: going through the VBD again would also
+ * rewrite the primary.
+ */
+static int
+tapdisk_mirror_copy(td_mirror_t *m, struct td_mirror_copy *c, uint64_t block)
+{
+	td_vbd_request_t *vreq = &c->vreq;
+	td_sector_t sec;
+	int err;
+
+	if (!c->buf) {
+		err = posix_memalign((void **)&c->buf, 4096, CBT_BLOCK_SIZE);
+		if (err) {
+			c->buf = NULL;
+			return -err;
+		}
+	}
+
+	sec = block * TD_MIRROR_BLOCK_SECS;
+
+	c->m       = m;
+	c->block   = block;
+	c->redirty = 0;
+	c->iov.base = c->buf;
+	c->iov.secs = MIN(TD_MIRROR_BLOCK_SECS, m->size - sec);
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = sec;
+	vreq->iov    = &c->iov;
+	vreq->iovcnt = 1;
+	vreq->prio   = TD_PRIO_BACKGROUND;
+	vreq->cb     = tapdisk_mirror_read_done;
+	vreq->token  = c;
+	vreq->name   = "mirror-resync";
+
+	err = tapdisk_vbd_queue_request(m->vbd, vreq);
+	if (err)
+		return err;
+
+	tapdisk_mirror_clear(m, block);
+	c->busy = 1;
+	m->inflight++;
+
+	return 0;
+}
+
+static void
+tapdisk_mirror_kick(td_mirror_t *m)
+{
+	struct td_mirror_copy *c;
+	uint64_t block, tries;
+	int i;
+
+	if (!m->resyncing || m->stalled || !tapdisk_mirror_ready(m))
+		return;
+
+	tries = m->dirty;
+
+	for (i = 0; i < TD_MIRROR_COPY_DEPTH && tries; i++) {
+		c = &m->copies[i];
+		if (c->busy)
+			continue;
+
+		if (m->rate && m->budget < CBT_BLOCK_SIZE)
+			return;
+
+		while (tries && tapdisk_mirror_next(m, &block)) {
+			tries--;
+
+			if (tapdisk_mirror_block_busy(m,
+					block * TD_MIRROR_BLOCK_SECS,
+					TD_MIRROR_BLOCK_SECS))
+				continue;
+
+			if (tapdisk_mirror_copy(m, c, block)) {
+				m->stalled = 1;
+				return;
+			}
+			if (m->rate)
+				m->budget -= CBT_BLOCK_SIZE;
+			break;
+		}
+	}
+}
+
+static void
+tapdisk_mirror_timer(event_id_t id, char mode, void *private)
+{
+	td_mirror_t *m = private;
+	uint64_t quota;
+
+	if (m->rate) {
+		/* no bursts beyond one tick's worth, or one block */
+		quota = m->rate / (1000000 / TD_MIRROR_TICK);
+		m->budget = MIN(m->budget + quota,
+				quota > CBT_BLOCK_SIZE ? quota : CBT_BLOCK_SIZE);
+	}
+
+	if (++m->ticks >= TD_MIRROR_RETRY_TICKS) {
+		m->ticks = 0;
+		m->stalled = 0;
+	}
+
+	tapdisk_mirror_kick(m);
+}
+
+/*
+ * Marks everything the primary chain holds data for as dirty, so that the
+ * resync turns into a full copy of the disk which skips unallocated
+ * ranges. Must run before the secondary joins the chain, as it would
+ * read as allocated all over.
+ */
+static void
+tapdisk_mirror_seed(td_mirror_t *m)
+{
+	td_sector_t sec, run;
+
+	for (sec = 0; sec < m->size; sec += run) {
+		run = m->size - sec;
+		if (tapdisk_vbd_sector_status(m->vbd, sec, &run))
+			tapdisk_mirror_set_range(m, sec, run);
+	}
+
+	m->copying = 1;
+	m->total = m->dirty;
+	m->copied = 0;
+
+	INFO("%s: copying %"PRIu64" of %"PRIu64" blocks", m->path,
+	     m->dirty, m->blocks);
+}
+
+static uint64_t
+tapdisk_mirror_rate(void)
+{
+	const char *s = getenv("TAPDISK3_MIRROR_COPY_RATE");
+
+	/* MiB/s */
+	return s ? strtoull(s, NULL, 0) << 20 : 0;
+}
+
+static void
+tapdisk_mirror_async_init(td_mirror_t *m)
+{
+	const char *s;
+	unsigned long ms;
+
+	s = getenv("TAPDISK3_MIRROR_ASYNC");
+	m->async = s && atoi(s);
+	if (!m->async)
+		return;
+
+	s = getenv("TAPDISK3_MIRROR_ASYNC_LAG");
+	m->max_lag = (s ? strtoull(s, NULL, 0) : TD_MIRROR_ASYNC_LAG) << 20;
+
+	s = getenv("TAPDISK3_MIRROR_ASYNC_LAG_MS");
+	ms = s ? strtoul(s, NULL, 0) : TD_MIRROR_ASYNC_LAG_MS;
+	m->max_age = TV_USECS(ms * 1000);
+
+	INFO("%s: asynchronous, lagging by at most %"PRIu64" MiB or %lu ms",
+	     m->path, m->max_lag >> 20, ms);
+}
+
+static int
+tapdisk_mirror_start(td_mirror_t *m)
+{
+	if (m->resyncing || !m->dirty)
+		return 0;
+
+	if (m->timer < 0) {
+		m->timer = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+				-1, TV_USECS(TD_MIRROR_TICK),
+				tapdisk_mirror_timer, m);
+		if (m->timer < 0)
+			return m->timer;
+	}
+
+	INFO("%s: resyncing %"PRIu64" blocks", m->path, m->dirty);
+
+	m->resyncing = 1;
+	m->stalled = 0;
+	m->ticks = 0;
+	m->budget = 0;
+
+	/* the VBD is still paused, the timer gets things going */
+	return 0;
+}
+
+/* -- interface -- */
+
+int
+tapdisk_mirror_open(td_vbd_t *vbd, int copy)
+{
+	td_mirror_t *m = vbd->mirror;
+	int err;
+
+	if (m) {
+		if (copy && !m->inflight)
+			tapdisk_mirror_seed(m);
+		return tapdisk_mirror_start(m);
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return -ENOMEM;
+
+	m->vbd      = vbd;
+	m->timer    = -1;
+	INIT_LIST_HEAD(&m->writes);
+	/* the same as the leaf's */
+	m->size     = vbd->secondary->info.size;
+	m->blocks   = roundup_div(m->size << SECTOR_SHIFT, CBT_BLOCK_SIZE);
+	m->map_size = sizeof(struct cbt_log_metadata) +
+		bitmap_size(m->size << SECTOR_SHIFT);
+
+	m->path = tapdisk_mirror_path(vbd);
+	if (!m->path) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = tapdisk_mirror_map(m);
+	if (err) {
+		ERR("%s: cannot set up the dirty log: %d", m->path, err);
+		goto fail;
+	}
+
+	m->rate = tapdisk_mirror_rate();
+	tapdisk_mirror_async_init(m);
+	if (copy)
+		tapdisk_mirror_seed(m);
+
+	vbd->mirror = m;
+
+	return tapdisk_mirror_start(m);
+
+fail:
+	tapdisk_mirror_free(m);
+	return err;
+}
+
+void
+tapdisk_mirror_close(td_vbd_t *vbd, int drop)
+{
+	td_mirror_t *m = vbd->mirror;
+
+	if (!m)
+		return;
+
+	BUG_ON(m->inflight || m->writing);
+
+	m->meta->consistent = 1;
+
+	if (drop || !m->dirty)
+		unlink(m->path);
+	else
+		INFO("%s: keeping %"PRIu64" dirty blocks", m->path, m->dirty);
+
+	tapdisk_mirror_free(m);
+	vbd->mirror = NULL;
+}
+
+void
+tapdisk_mirror_write(td_vbd_t *vbd, td_sector_t sec, td_sector_t secs)
+{
+	td_mirror_t *m = vbd->mirror;
+	struct td_mirror_copy *c;
+	uint64_t first, last;
+	int i;
+
+	if (!m)
+		return;
+
+	if (!vbd->secondary || vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR) {
+		tapdisk_mirror_set_range(m, sec, secs);
+		return;
+	}
+
+	if (!m->inflight)
+		return;
+
+	first = sec / TD_MIRROR_BLOCK_SECS;
+	last  = (sec + secs - 1) / TD_MIRROR_BLOCK_SECS;
+
+	for (i = 0; i < TD_MIRROR_COPY_DEPTH; i++) {
+		c = &m->copies[i];
+		if (c->busy && c->block >= first && c->block <= last)
+			c->redirty = 1;
+	}
+}
+
+void
+tapdisk_mirror_mark(td_vbd_t *vbd, td_sector_t sec, td_sector_t secs)
+{
+	if (vbd->mirror)
+		tapdisk_mirror_set_range(vbd->mirror, sec, secs);
+}
+
+/* -- asynchronous mode -- */
+
+int
+tapdisk_mirror_async(td_vbd_t *vbd)
+{
+	return vbd->mirror && vbd->mirror->async;
+}
+
+/*
+ * Too far behind, or a copy of the same sectors still in flight: the
+ * two could land on the secondary in either order.
+ */
+static int
+tapdisk_mirror_lagging(td_mirror_t *m, td_sector_t sec, td_sector_t secs)
+{
+	struct td_mirror_write *w;
+	struct timeval now, age;
+
+	if (list_empty(&m->writes))
+		return 0;
+
+	if (m->lag + (secs << SECTOR_SHIFT) > m->max_lag)
+		return 1;
+
+	w = list_first_entry(&m->writes, struct td_mirror_write, entry);
+	gettimeofday(&now, NULL);
+	TV_SUB(now, w->issued, age);
+	if (TV_AFTER(age, m->max_age))
+		return 1;
+
+	list_for_each_entry(w, &m->writes, entry)
+		if (w->sec < sec + secs && sec < w->sec + w->secs)
+			return 1;
+
+	return 0;
+}
+
+static void
+tapdisk_mirror_async_done(td_request_t treq, int res)
+{
+	struct td_mirror_write *w = treq.cb_data;
+	td_mirror_t *m = w->m;
+	td_vbd_t *vbd = m->vbd;
+
+	list_del(&w->entry);
+	m->writing--;
+	m->lag -= (uint64_t)w->secs << SECTOR_SHIFT;
+
+	if (res) {
+		ERR("%s: write of %d sectors at %"PRIu64" failed on the "
+		    "secondary: %d", m->path, w->secs, w->sec, res);
+		tapdisk_mirror_set_range(m, w->sec, w->secs);
+
+		/* as with synchronous writes, a failing NBD server is lost */
+		if (treq.image == vbd->secondary &&
+		    treq.image->type == DISK_TYPE_NBD)
+			tapdisk_vbd_retire_secondary(vbd, treq.image);
+		else
+			tapdisk_mirror_start(m);
+	}
+
+	free(w->buf);
+	free(w);
+}
+
+void
+tapdisk_mirror_queue(td_vbd_t *vbd, td_request_t treq)
+{
+	td_mirror_t *m = vbd->mirror;
+	struct td_mirror_write *w;
+	size_t len = treq.secs << SECTOR_SHIFT;
+
+	if (tapdisk_mirror_lagging(m, treq.sec, treq.secs))
+		goto dirty;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		goto dirty;
+
+	if (treq.op == TD_OP_WRITE) {
+		if (posix_memalign((void **)&w->buf, 4096, len)) {
+			free(w);
+			goto dirty;
+		}
+		memcpy(w->buf, treq.buf, len);
+	}
+
+	w->m    = m;
+	w->sec  = treq.sec;
+	w->secs = treq.secs;
+	gettimeofday(&w->issued, NULL);
+
+	/* before queueing, the request may complete right away */
+	list_add_tail(&w->entry, &m->writes);
+	m->writing++;
+	m->lag += len;
+
+	treq.buf     = w->buf;
+	treq.sidx    = 0;
+	treq.image   = vbd->secondary;
+	treq.cb      = tapdisk_mirror_async_done;
+	treq.cb_data = w;
+	treq.vreq    = NULL;
+
+	if (treq.op == TD_OP_WRITE_ZEROES)
+		td_queue_write_zeroes(vbd->secondary, treq);
+	else
+		td_queue_write(vbd->secondary, treq);
+	return;
+
+dirty:
+	m->overflows++;
+	tapdisk_mirror_set_range(m, treq.sec, treq.secs);
+	tapdisk_mirror_start(m);
+}
+
+int
+tapdisk_mirror_busy(td_vbd_t *vbd)
+{
+	return vbd->mirror && (vbd->mirror->inflight || vbd->mirror->writing);
+}
+
+void
+tapdisk_mirror_stats(td_vbd_t *vbd, td_stats_t *st)
+{
+	td_mirror_t *m = vbd->mirror;
+
+	if (!m)
+		return;
+
+	tapdisk_stats_field(st, "mirror", "{");
+	tapdisk_stats_field(st, "dirty", "llu", (unsigned long long)m->dirty);
+	tapdisk_stats_field(st, "blocks", "llu", (unsigned long long)m->blocks);
+	tapdisk_stats_field(st, "resyncing", "d", m->resyncing);
+	tapdisk_stats_field(st, "copied", "llu", (unsigned long long)m->copied);
+	if (m->total) {
+		tapdisk_stats_field(st, "copy", "{");
+		tapdisk_stats_field(st, "total", "llu",
+				    (unsigned long long)m->total);
+		tapdisk_stats_field(st, "done", "d", !m->copying);
+		tapdisk_stats_field(st, "rate", "llu",
+				    (unsigned long long)m->rate);
+		tapdisk_stats_leave(st, '}');
+	}
+	if (m->async) {
+		tapdisk_stats_field(st, "async", "{");
+		tapdisk_stats_field(st, "inflight", "d", m->writing);
+		tapdisk_stats_field(st, "lag", "llu",
+				    (unsigned long long)m->lag);
+		tapdisk_stats_field(st, "overflows", "llu",
+				    (unsigned long long)m->overflows);
+		tapdisk_stats_leave(st, '}');
+	}
+	tapdisk_stats_leave(st, '}');
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_MIRROR_H_
+#define _TAPDISK_MIRROR_H_
+
+#include "tapdisk.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Dirty log of a mirror secondary. While the secondary is lost, writes it
+ * missed are recorded in a CBT format bitmap (see cbt-util.h), kept in a
+ * file under TD_MIRROR_LOG_DIR so that it outlives the tapdisk. Once the
+ * secondary is back, a resync copies only the dirty blocks to it, in the
+ * background and next to guest I/O.
+ *
+ * With TAPDISK3_MIRROR_ASYNC=1, guest writes complete once the primary
+ * has them and their copies to the secondary follow in the background.
+ * The copies may lag by TAPDISK3_MIRROR_ASYNC_LAG MiB and
+ * TAPDISK3_MIRROR_ASYNC_LAG_MS msecs at most, writes beyond that are
+ * recorded in the log and resynced instead.
+ */
+
+#define TD_MIRROR_LOG_DIR           "/var/run/blktap/mirror"
+
+typedef struct td_mirror td_mirror_t;
+
+/*
+ * Called when a secondary is added in mirror mode. Sets up the log on
+ * first use and starts a resync if anything is dirty. With copy set, all
+ * allocated blocks of the chain are marked dirty first, which makes the
+ * resync a bulk copy of the disk, limited to TAPDISK3_MIRROR_COPY_RATE
+ * MiB/s if set.
+ */
+int tapdisk_mirror_open(td_vbd_t *vbd, int copy);
+
+/*
+ * Releases the log. With drop set the file goes too, otherwise it is
+ * kept, marked consistent, for as long as it has dirty blocks.
+ */
+void tapdisk_mirror_close(td_vbd_t *vbd, int drop);
+
+/*
+ * A guest write is being issued: recorded if the secondary is not
+ * mirroring, and it invalidates any copy of the same blocks in flight.
+ */
+void tapdisk_mirror_write(td_vbd_t *vbd, td_sector_t sec, td_sector_t secs);
+
+/* A mirrored write which failed on the secondary. */
+void tapdisk_mirror_mark(td_vbd_t *vbd, td_sector_t sec, td_sector_t secs);
+
+/* Non-zero if guest writes go to the secondary through tapdisk_mirror_queue. */
+int tapdisk_mirror_async(td_vbd_t *vbd);
+
+/*
+ * Copies a guest write to the secondary without holding up its
+ * completion, or records it as dirty when lagging too far behind.
+ */
+void tapdisk_mirror_queue(td_vbd_t *vbd, td_request_t treq);
+
+/* Non-zero while mirror I/O the VBD does not track is in flight. */
+int tapdisk_mirror_busy(td_vbd_t *vbd);
+
+void tapdisk_mirror_stats(td_vbd_t *vbd, td_stats_t *st);
+
+#endif /* _TAPDISK_MIRROR_H_ */
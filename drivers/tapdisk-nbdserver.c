@@ -35,6 +35,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -49,7 +50,9 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-nbdserver.h"
+#include "tapdisk-nbdtls.h"
 #include "tapdisk-fdreceiver.h"
+#include "tapdisk-backup.h"
 
 #include "timeout-math.h"
 
@@ -58,6 +61,18 @@
 #endif
 
 #define NBD_SERVER_NUM_REQS TAPDISK_DATA_REQUESTS
+#define TAPDISK_NBD_NEGOTIATION_TIMEOUT 10 /* seconds */
+#define TAPDISK_NBD_MAX_OPT_LEN 4096
+#define TAPDISK_NBD_MAX_PAYLOAD (32 << 20)
+#define TAPDISK_NBD_MAX_EXTENTS 128
+#define TAPDISK_NBD_MAX_INFLIGHT (64 << 20)
+#define TAPDISK_NBD_RBUF_SIZE (64 << 10)
+#define TAPDISK_NBD_RX_BUDGET 64
+#define TAPDISK_NBD_CACHE_PAGE_SHIFT 12
+#define TAPDISK_NBD_CACHE_PAGE_SIZE (1 << TAPDISK_NBD_CACHE_PAGE_SHIFT)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 /*
  * Server
@@ -79,30 +94,88 @@ struct td_nbdserver_req {
 	td_vbd_request_t        vreq;
 	char                    id[16];
 	struct td_iovec         iov;
+
+	/* on the server's writes or flushes list */
+	struct list_head        next;
+	uint64_t                seq;
+
+	/* size of the data buffer, counted in server->inflight_bytes */
+	uint32_t                bytes;
 };
 
 td_nbdserver_req_t *
 tapdisk_nbdserver_alloc_request(td_nbdserver_client_t *client)
 {
+	td_nbdserver_t *server;
 	td_nbdserver_req_t *req = NULL;
 
 	ASSERT(client);
+	server = client->server;
 
-	if (likely(client->n_reqs_free))
-		req = client->reqs_free[--client->n_reqs_free];
+	if (likely(server->n_reqs_free)) {
+		req = server->reqs_free[--server->n_reqs_free];
+		client->n_reqs_pending++;
+		memset(req, 0, sizeof(*req));
+	}
 
 	return req;
 }
 
+static bool
+tapdisk_nbdserver_full(td_nbdserver_t *server)
+{
+	return !server->n_reqs_free ||
+		server->inflight_bytes >= server->max_inflight_bytes;
+}
+
+static int tapdisk_nbdserver_enable_client(td_nbdserver_client_t *client);
+
+/*
+ * Clients that stopped reading because the server was full pick up again,
+ * starting with what they already buffered.
+ */
+static void
+tapdisk_nbdserver_unthrottle(td_nbdserver_t *server)
+{
+	struct td_nbdserver_client *pos, *q;
+
+	list_for_each_entry_safe(pos, q, &server->clients, clientlist) {
+		if (!pos->throttled)
+			continue;
+
+		pos->throttled = false;
+		server->n_throttled--;
+
+		if (tapdisk_nbdserver_enable_client(pos) < 0) {
+			ERR("Failed to resume client");
+			continue;
+		}
+
+		tapdisk_server_mask_event(pos->sched_event_id, 0);
+	}
+}
+
 static void
 tapdisk_nbdserver_set_free_request(td_nbdserver_client_t *client,
 		td_nbdserver_req_t *req)
 {
+	td_nbdserver_t *server;
+
 	ASSERT(client);
 	ASSERT(req);
-	BUG_ON(client->n_reqs_free >= client->n_reqs);
+	server = client->server;
+	BUG_ON(server->n_reqs_free >= server->n_reqs);
+	BUG_ON(client->n_reqs_pending <= 0);
+
+	free(req->iov.base);
+	req->iov.base = NULL;
+	server->inflight_bytes -= req->bytes;
 
-	client->reqs_free[client->n_reqs_free++] = req;
+	server->reqs_free[server->n_reqs_free++] = req;
+	client->n_reqs_pending--;
+
+	if (unlikely(server->n_throttled && !tapdisk_nbdserver_full(server)))
+		tapdisk_nbdserver_unthrottle(server);
 }
 
 void
@@ -115,67 +188,312 @@ tapdisk_nbdserver_free_request(td_nbdserver_client_t *client,
 }
 
 static void
-tapdisk_nbdserver_reqs_free(td_nbdserver_client_t *client)
+tapdisk_nbdserver_reqs_free(td_nbdserver_t *server)
 {
-	if (client->reqs) {
-		free(client->reqs);
-		client->reqs = NULL;
+	if (server->reqs) {
+		free(server->reqs);
+		server->reqs = NULL;
 	}
 
-	if (client->iovecs) {
-		free(client->iovecs);
-		client->iovecs = NULL;
+	if (server->iovecs) {
+		free(server->iovecs);
+		server->iovecs = NULL;
 	}
 
-	if (client->reqs_free) {
-		free(client->reqs_free);
-		client->reqs_free = NULL;
+	if (server->reqs_free) {
+		free(server->reqs_free);
+		server->reqs_free = NULL;
 	}
 }
 
 int
-tapdisk_nbdserver_reqs_init(td_nbdserver_client_t *client, int n_reqs)
+tapdisk_nbdserver_reqs_init(td_nbdserver_t *server, int n_reqs)
 {
+	const char *val;
 	int i, err;
 
-	ASSERT(client);
+	ASSERT(server);
 	ASSERT(n_reqs > 0);
 
 	INFO("Reqs init");
 
-	client->reqs = malloc(n_reqs * sizeof(td_nbdserver_req_t));
-	if (!client->reqs) {
+	server->reqs = malloc(n_reqs * sizeof(td_nbdserver_req_t));
+	if (!server->reqs) {
 		err = -errno;
 		goto fail;
 	}
 
-	client->iovecs = malloc(n_reqs * sizeof(struct td_iovec));
-	if (!client->iovecs) {
+	server->iovecs = malloc(n_reqs * sizeof(struct td_iovec));
+	if (!server->iovecs) {
 		err = - errno;
 		goto fail;
 	}
 
-	client->reqs_free = malloc(n_reqs * sizeof(td_nbdserver_req_t*));
-	if (!client->reqs_free) {
+	server->reqs_free = malloc(n_reqs * sizeof(td_nbdserver_req_t*));
+	if (!server->reqs_free) {
 		err = -errno;
 		goto fail;
 	}
 
-	client->n_reqs      = n_reqs;
-	client->n_reqs_free = 0;
+	server->n_reqs      = n_reqs;
+	server->n_reqs_free = 0;
 
 	for (i = 0; i < n_reqs; i++) {
-		client->reqs[i].vreq.iov = &client->iovecs[i];
-		tapdisk_nbdserver_set_free_request(client, &client->reqs[i]);
+		server->reqs[i].vreq.iov = &server->iovecs[i];
+		server->reqs_free[server->n_reqs_free++] = &server->reqs[i];
 	}
 
+	INIT_LIST_HEAD(&server->writes);
+	INIT_LIST_HEAD(&server->flushes);
+
+	val = getenv("TAPDISK3_NBD_MAX_INFLIGHT");
+	server->max_inflight_bytes = val ? strtoull(val, NULL, 0) : 0;
+	if (!server->max_inflight_bytes)
+		server->max_inflight_bytes = TAPDISK_NBD_MAX_INFLIGHT;
+
 	return 0;
 
 fail:
-	tapdisk_nbdserver_reqs_free(client);
+	tapdisk_nbdserver_reqs_free(server);
 	return err;
 }
 
+/*
+ * The pool is shared by all the connections, so that a client opening
+ * several of them gets the same queue depth spread over its streams.
+ */
+static int
+tapdisk_nbdserver_pool_size(void)
+{
+	const char *val;
+	int n;
+
+	val = getenv("TAPDISK3_NBD_REQUESTS");
+	n = val ? atoi(val) : 0;
+
+	return n > 0 ? n : NBD_SERVER_NUM_REQS;
+}
+
+static void tapdisk_nbdserver_client_sched_cb(event_id_t, char, void *);
+
+static void
+tapdisk_nbdserver_cache_init(td_nbdserver_t *server)
+{
+	struct td_nbdserver_cache *cache = &server->cache;
+	const char *val;
+	uint64_t pages;
+
+	INIT_LIST_HEAD(&cache->lru);
+
+	val = getenv("TAPDISK3_NBD_READ_CACHE_KB");
+	cache->budget = val ? strtoull(val, NULL, 0) << 10 : 0;
+
+	pages = cache->budget >> TAPDISK_NBD_CACHE_PAGE_SHIFT;
+	if (!pages)
+		return;
+
+	for (cache->n_buckets = 64; cache->n_buckets < pages; )
+		cache->n_buckets <<= 1;
+
+	cache->buckets = calloc(cache->n_buckets, sizeof(*cache->buckets));
+	if (!cache->buckets) {
+		ERR("No memory for a %"PRIu64"KB read cache", cache->budget >> 10);
+		cache->n_buckets = 0;
+		return;
+	}
+
+	INFO("Read cache of %"PRIu64"KB for read-only exports",
+			cache->budget >> 10);
+}
+
+/*
+ * Only read-only images are cached: nothing can change them until the
+ * VBD pauses, e.g. to be reopened, and the cache is cleared then. Nor can
+ * anything change a backup export.
+ */
+static bool
+tapdisk_nbdserver_cache_enabled(td_nbdserver_t *server)
+{
+	td_image_t *leaf;
+
+	if (!server->cache.buckets)
+		return false;
+
+	if (server->backup)
+		return true;
+
+	if (list_empty(&server->vbd->images))
+		return false;
+
+	leaf = list_entry(server->vbd->images.next, td_image_t, next);
+	return td_flag_test(leaf->flags, TD_OPEN_RDONLY);
+}
+
+static td_nbdserver_cpage_t **
+tapdisk_nbdserver_cache_bucket(struct td_nbdserver_cache *cache, uint64_t idx)
+{
+	return &cache->buckets[(idx * 0x9e3779b97f4a7c15ULL >> 32) &
+		(cache->n_buckets - 1)];
+}
+
+static td_nbdserver_cpage_t *
+tapdisk_nbdserver_cache_find(struct td_nbdserver_cache *cache, uint64_t idx)
+{
+	td_nbdserver_cpage_t *page;
+
+	page = *tapdisk_nbdserver_cache_bucket(cache, idx);
+	while (page && page->idx != idx)
+		page = page->hnext;
+
+	return page;
+}
+
+static void
+tapdisk_nbdserver_cache_evict(struct td_nbdserver_cache *cache,
+		td_nbdserver_cpage_t *page)
+{
+	td_nbdserver_cpage_t **pp;
+
+	pp = tapdisk_nbdserver_cache_bucket(cache, page->idx);
+	while (*pp != page)
+		pp = &(*pp)->hnext;
+	*pp = page->hnext;
+
+	list_del(&page->lru);
+	cache->bytes -= TAPDISK_NBD_CACHE_PAGE_SIZE;
+
+	free(page->buf);
+	free(page);
+}
+
+static void
+tapdisk_nbdserver_cache_clear(td_nbdserver_t *server)
+{
+	struct td_nbdserver_cache *cache = &server->cache;
+	td_nbdserver_cpage_t *page, *next;
+
+	list_for_each_entry_safe(page, next, &cache->lru, lru)
+		tapdisk_nbdserver_cache_evict(cache, page);
+}
+
+/*
+ * Copies [from, from + len) out of the cache if all the pages it spans
+ * are there, and tells whether it did.
+ */
+static bool
+tapdisk_nbdserver_cache_read(td_nbdserver_t *server, uint64_t from,
+		uint32_t len, char *buf)
+{
+	struct td_nbdserver_cache *cache = &server->cache;
+	td_nbdserver_cpage_t *page;
+	uint64_t idx, first, last;
+	uint32_t off, n;
+
+	if (!len || !tapdisk_nbdserver_cache_enabled(server))
+		return false;
+
+	first = from >> TAPDISK_NBD_CACHE_PAGE_SHIFT;
+	last  = (from + len - 1) >> TAPDISK_NBD_CACHE_PAGE_SHIFT;
+
+	for (idx = first; idx <= last; idx++)
+		if (!tapdisk_nbdserver_cache_find(cache, idx)) {
+			cache->misses++;
+			return false;
+		}
+
+	for (idx = first; idx <= last; idx++) {
+		page = tapdisk_nbdserver_cache_find(cache, idx);
+		list_move(&page->lru, &cache->lru);
+
+		off = from & (TAPDISK_NBD_CACHE_PAGE_SIZE - 1);
+		n   = MIN(len, TAPDISK_NBD_CACHE_PAGE_SIZE - off);
+		memcpy(buf, page->buf + off, n);
+
+		buf  += n;
+		from += n;
+		len  -= n;
+	}
+
+	cache->hits++;
+	return true;
+}
+
+/* keeps the full pages of a completed read */
+static void
+tapdisk_nbdserver_cache_add(td_nbdserver_t *server, uint64_t from,
+		uint32_t len, const char *buf)
+{
+	struct td_nbdserver_cache *cache = &server->cache;
+	td_nbdserver_cpage_t *page, **bucket;
+	uint64_t idx, end, off;
+
+	if (!tapdisk_nbdserver_cache_enabled(server))
+		return;
+
+	end = from + len;
+	off = (from + TAPDISK_NBD_CACHE_PAGE_SIZE - 1) &
+		~((uint64_t)TAPDISK_NBD_CACHE_PAGE_SIZE - 1);
+
+	for (; off + TAPDISK_NBD_CACHE_PAGE_SIZE <= end;
+	     off += TAPDISK_NBD_CACHE_PAGE_SIZE) {
+		idx = off >> TAPDISK_NBD_CACHE_PAGE_SHIFT;
+
+		page = tapdisk_nbdserver_cache_find(cache, idx);
+		if (page) {
+			list_move(&page->lru, &cache->lru);
+			continue;
+		}
+
+		while (cache->bytes + TAPDISK_NBD_CACHE_PAGE_SIZE > cache->budget) {
+			tapdisk_nbdserver_cache_evict(cache,
+					list_last_entry(&cache->lru,
+						td_nbdserver_cpage_t, lru));
+			cache->evictions++;
+		}
+
+		page = malloc(sizeof(*page));
+		if (!page)
+			return;
+
+		page->buf = malloc(TAPDISK_NBD_CACHE_PAGE_SIZE);
+		if (!page->buf) {
+			free(page);
+			return;
+		}
+
+		memcpy(page->buf, buf + (off - from), TAPDISK_NBD_CACHE_PAGE_SIZE);
+		page->idx = idx;
+
+		bucket      = tapdisk_nbdserver_cache_bucket(cache, idx);
+		page->hnext = *bucket;
+		*bucket     = page;
+		list_add(&page->lru, &cache->lru);
+
+		cache->bytes += TAPDISK_NBD_CACHE_PAGE_SIZE;
+		cache->inserts++;
+	}
+}
+
+void
+tapdisk_nbdserver_stats(td_nbdserver_t *server, td_stats_t *st)
+{
+	struct td_nbdserver_cache *cache = &server->cache;
+
+	if (!cache->buckets)
+		return;
+
+	tapdisk_stats_field(st, "read_cache", "{");
+	tapdisk_stats_field(st, "budget", "llu",
+			(unsigned long long)cache->budget);
+	tapdisk_stats_field(st, "bytes", "llu",
+			(unsigned long long)cache->bytes);
+	tapdisk_stats_field(st, "hits", "llu", cache->hits);
+	tapdisk_stats_field(st, "misses", "llu", cache->misses);
+	tapdisk_stats_field(st, "inserts", "llu", cache->inserts);
+	tapdisk_stats_field(st, "evictions", "llu", cache->evictions);
+	tapdisk_stats_leave(st, '}');
+}
+
 static int
 tapdisk_nbdserver_enable_client(td_nbdserver_client_t *client)
 {
@@ -197,6 +515,24 @@ tapdisk_nbdserver_enable_client(td_nbdserver_client_t *client)
 		return client->client_event_id;
 	}
 
+	/* runs the parser on buffered requests, masked while there are none */
+	if (client->sched_event_id < 0) {
+		client->sched_event_id = tapdisk_server_register_event(
+				SCHEDULER_POLL_TIMEOUT, -1, TV_ZERO,
+				tapdisk_nbdserver_client_sched_cb,
+				client);
+		if (client->sched_event_id < 0) {
+			int err = client->sched_event_id;
+
+			ERR("Error registering events on client: %d", err);
+			tapdisk_server_unregister_event(client->client_event_id);
+			client->client_event_id = -1;
+			return err;
+		}
+
+		tapdisk_server_mask_event(client->sched_event_id, 1);
+	}
+
 	return client->client_event_id;
 }
 
@@ -229,14 +565,24 @@ tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
 		goto fail;
 	}
 
-	err = tapdisk_nbdserver_reqs_init(client, NBD_SERVER_NUM_REQS);
-	if (err < 0) {
-		ERR("Couldn't allocate client reqs: %d", err);
+	client->rbuf = malloc(TAPDISK_NBD_RBUF_SIZE);
+	if (!client->rbuf) {
+		ERR("Couldn't allocate client buffer: %s", strerror(errno));
 		goto fail;
 	}
 
+	if (!server->reqs) {
+		err = tapdisk_nbdserver_reqs_init(server,
+				tapdisk_nbdserver_pool_size());
+		if (err < 0) {
+			ERR("Couldn't allocate server reqs: %d", err);
+			goto fail;
+		}
+	}
+
 	client->client_fd = -1;
 	client->client_event_id = -1;
+	client->sched_event_id = -1;
 	client->server = server;
 	INIT_LIST_HEAD(&client->clientlist);
 	list_add(&client->clientlist, &server->clients);
@@ -247,8 +593,10 @@ tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
 	return client;
 
 fail:
-	if (client)
+	if (client) {
+		free(client->rbuf);
 		free(client);
+	}
 
 	return NULL;
 }
@@ -263,9 +611,19 @@ tapdisk_nbdserver_free_client(td_nbdserver_client_t *client)
 	if (client->client_event_id >= 0)
 		tapdisk_nbdserver_disable_client(client);
 
+	if (client->sched_event_id >= 0) {
+		tapdisk_server_unregister_event(client->sched_event_id);
+		client->sched_event_id = -1;
+	}
+
+	if (client->throttled) {
+		client->throttled = false;
+		client->server->n_throttled--;
+	}
+
 	if (likely(!tapdisk_nbdserver_reqs_pending(client))) {
 		list_del(&client->clientlist);
-		tapdisk_nbdserver_reqs_free(client);
+		free(client->rbuf);
 		free(client);
 	} else
 		client->dead = true;
@@ -280,6 +638,352 @@ static void
 	return &(((struct sockaddr_in6*)ss)->sin6_addr);
 }
 
+/*
+ * Replies go out with a single sendmsg: header and payload together, so a
+ * read costs one syscall and one copy into the socket.
+ */
+static int
+tapdisk_nbdserver_sendv(int fd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t sent;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = iovcnt;
+
+	while (msg.msg_iovlen) {
+		sent = sendmsg(fd, &msg, 0);
+		if (sent <= 0)
+			return sent < 0 ? -errno : -EPIPE;
+
+		while (msg.msg_iovlen && sent >= msg.msg_iov->iov_len) {
+			sent -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+
+		if (sent) {
+			msg.msg_iov->iov_base += sent;
+			msg.msg_iov->iov_len  -= sent;
+		}
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_send(int fd, const void *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	return tapdisk_nbdserver_sendv(fd, &iov, 1);
+}
+
+static int
+tapdisk_nbdserver_recv(int fd, void *buf, size_t len)
+{
+	char *ptr = buf;
+	ssize_t rcvd;
+
+	while (len > 0) {
+		rcvd = recv(fd, ptr, len, 0);
+		if (rcvd <= 0)
+			return rcvd < 0 ? -errno : -ECONNRESET;
+
+		ptr += rcvd;
+		len -= rcvd;
+	}
+
+	return 0;
+}
+
+/*
+ * NBD only defines a handful of errno values on the wire.
+ */
+static uint32_t
+tapdisk_nbdserver_errno(int error)
+{
+	switch (-error) {
+	case 0:
+		return 0;
+	case EPERM:
+	case EROFS:
+		return EPERM;
+	case ENOMEM:
+	case EINVAL:
+	case ENOSPC:
+	case EOVERFLOW:
+	case ESHUTDOWN:
+		return -error;
+	case EOPNOTSUPP:
+		return EOPNOTSUPP;
+	default:
+		return EIO;
+	}
+}
+
+static int
+tapdisk_nbdserver_send_reply(td_nbdserver_client_t *client,
+		const char *handle, int error, void *data, size_t len)
+{
+	struct nbd_reply reply;
+	struct iovec iov[2];
+
+	reply.magic = htonl(NBD_REPLY_MAGIC);
+	reply.error = htonl(tapdisk_nbdserver_errno(error));
+	memcpy(reply.handle, handle, sizeof(reply.handle));
+
+	iov[0].iov_base = &reply;
+	iov[0].iov_len  = sizeof(reply);
+	iov[1].iov_base = data;
+	iov[1].iov_len  = len;
+
+	return tapdisk_nbdserver_sendv(client->client_fd, iov, len ? 2 : 1);
+}
+
+#define TAPDISK_NBD_MAX_CHUNK_IOVS 3
+
+/*
+ * Send a structured reply chunk, which is always the last one: payload is
+ * up to TAPDISK_NBD_MAX_CHUNK_IOVS pieces.
+ */
+static int
+tapdisk_nbdserver_send_chunk(td_nbdserver_client_t *client,
+		const char *handle, uint16_t type,
+		const struct iovec *payload, int n)
+{
+	struct nbd_structured_reply reply;
+	struct iovec iov[1 + TAPDISK_NBD_MAX_CHUNK_IOVS];
+	uint32_t length;
+	int i;
+
+	ASSERT(n <= TAPDISK_NBD_MAX_CHUNK_IOVS);
+
+	length = 0;
+	for (i = 0; i < n; i++) {
+		iov[i + 1] = payload[i];
+		length += payload[i].iov_len;
+	}
+
+	reply.magic  = htonl(NBD_STRUCTURED_REPLY_MAGIC);
+	reply.flags  = htons(TAPDISK_NBD_REPLY_FLAG_DONE);
+	reply.type   = htons(type);
+	reply.length = htonl(length);
+	memcpy(reply.handle, handle, sizeof(reply.handle));
+
+	iov[0].iov_base = &reply;
+	iov[0].iov_len  = sizeof(reply);
+
+	return tapdisk_nbdserver_sendv(client->client_fd, iov, n + 1);
+}
+
+static int
+tapdisk_nbdserver_send_error_chunk(td_nbdserver_client_t *client,
+		const char *handle, int error)
+{
+	struct {
+		uint32_t error;
+		uint16_t msglen;
+	} __attribute__ ((packed)) chunk;
+	struct iovec iov = { .iov_base = &chunk, .iov_len = sizeof(chunk) };
+
+	chunk.error  = htonl(tapdisk_nbdserver_errno(error));
+	chunk.msglen = 0;
+
+	return tapdisk_nbdserver_send_chunk(client, handle,
+			TAPDISK_NBD_REPLY_TYPE_ERROR, &iov, 1);
+}
+
+/*
+ * Reads are answered with a single chunk, so NBD_CMD_FLAG_DF always
+ * holds.
+ */
+static int
+tapdisk_nbdserver_send_read_chunk(td_nbdserver_client_t *client,
+		td_vbd_request_t *vreq, int error)
+{
+	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
+	struct iovec iov[2];
+	uint64_t offset;
+
+	if (error)
+		return tapdisk_nbdserver_send_error_chunk(client, req->id, error);
+
+	offset = htonll(vreq->sec << SECTOR_SHIFT);
+
+	iov[0].iov_base = &offset;
+	iov[0].iov_len  = sizeof(offset);
+	iov[1].iov_base = vreq->iov->base;
+	iov[1].iov_len  = vreq->iov->secs << SECTOR_SHIFT;
+
+	return tapdisk_nbdserver_send_chunk(client, req->id,
+			TAPDISK_NBD_REPLY_TYPE_OFFSET_DATA, iov, 2);
+}
+
+/*
+ * Tells whether [sec, sec + secs) is unallocated through the whole chain.
+ * For a backup export, blocks copied aside are not holes, whatever the
+ * chain holds now.
+ */
+static bool
+tapdisk_nbdserver_is_hole(td_nbdserver_t *server, td_sector_t sec,
+		td_sector_t secs)
+{
+	td_sector_t run;
+
+	if (server->backup && tapdisk_backup_copied(server->backup, sec, secs))
+		return false;
+
+	while (secs) {
+		run = secs;
+		if (tapdisk_vbd_sector_status(server->vbd, sec, &run))
+			return false;
+
+		run   = MIN(run, secs);
+		sec  += run;
+		secs -= run;
+	}
+
+	return true;
+}
+
+static int
+tapdisk_nbdserver_send_hole(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req, uint64_t from, uint32_t len)
+{
+	struct {
+		uint64_t offset;
+		uint32_t length;
+	} __attribute__ ((packed)) chunk;
+	struct iovec iov = { .iov_base = &chunk, .iov_len = sizeof(chunk) };
+
+	chunk.offset = htonll(from);
+	chunk.length = htonl(len);
+
+	return tapdisk_nbdserver_send_chunk(client, req->id,
+			TAPDISK_NBD_REPLY_TYPE_OFFSET_HOLE, &iov, 1);
+}
+
+/*
+ * NBD_CMD_BLOCK_STATUS for base:allocation, answered from the allocation
+ * info of the images (e.g. the VHD BATs) without doing any I/O.
+ */
+static int
+tapdisk_nbdserver_block_status(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req, uint64_t from, uint32_t len,
+		uint16_t flags)
+{
+	td_nbdserver_t *server = client->server;
+	struct nbd_block_descriptor desc[TAPDISK_NBD_MAX_EXTENTS];
+	struct iovec iov[2];
+	td_sector_t sec, end, run;
+	uint32_t id, state;
+	int i, n, err;
+
+	if (!client->meta_allocation || !len ||
+	    ((from | len) & 0x1ff) ||
+	    (from >> SECTOR_SHIFT) + (len >> SECTOR_SHIFT) > server->info.size)
+		return tapdisk_nbdserver_send_error_chunk(client, req->id,
+				-EINVAL);
+
+	sec = from >> SECTOR_SHIFT;
+	end = sec + (len >> SECTOR_SHIFT);
+	n   = 0;
+
+	while (sec < end) {
+		run = end - sec;
+		err = tapdisk_vbd_sector_status(server->vbd, sec, &run);
+		run = MIN(run, end - sec);
+
+		if (server->backup &&
+		    tapdisk_backup_copied(server->backup, sec, run))
+			err = 1;
+
+		state = err ? 0 : TAPDISK_NBD_STATE_HOLE | TAPDISK_NBD_STATE_ZERO;
+
+		if (n && desc[n - 1].flags == state)
+			desc[n - 1].length += run << SECTOR_SHIFT;
+		else {
+			if (n == TAPDISK_NBD_MAX_EXTENTS ||
+			    (n && (flags & TAPDISK_NBD_CMD_FLAG_REQ_ONE)))
+				break;
+
+			desc[n].length = run << SECTOR_SHIFT;
+			desc[n].flags  = state;
+			n++;
+		}
+
+		sec += run;
+	}
+
+	for (i = 0; i < n; i++) {
+		desc[i].length = htonl(desc[i].length);
+		desc[i].flags  = htonl(desc[i].flags);
+	}
+
+	id = htonl(TAPDISK_NBD_META_BASE_ALLOCATION_ID);
+
+	iov[0].iov_base = &id;
+	iov[0].iov_len  = sizeof(id);
+	iov[1].iov_base = desc;
+	iov[1].iov_len  = n * sizeof(desc[0]);
+
+	return tapdisk_nbdserver_send_chunk(client, req->id,
+			TAPDISK_NBD_REPLY_TYPE_BLOCK_STATUS, iov, 2);
+}
+
+/*
+ * td requests complete once the data is on the images, so a flush only has
+ * to wait for the writes already in flight. These are tracked for the whole
+ * server: with several connections, a flush on one of them also covers the
+ * writes sent on the others, as NBD_FLAG_CAN_MULTI_CONN promises.
+ */
+static void
+tapdisk_nbdserver_complete_flushes(td_nbdserver_t *server)
+{
+	td_nbdserver_req_t *req, *tmp;
+	td_nbdserver_client_t *client;
+	uint64_t oldest;
+	int err;
+
+	oldest = UINT64_MAX;
+	if (!list_empty(&server->writes))
+		oldest = list_first_entry(&server->writes,
+				td_nbdserver_req_t, next)->seq;
+
+	list_for_each_entry_safe(req, tmp, &server->flushes, next) {
+		if (req->seq > oldest)
+			break;
+
+		list_del(&req->next);
+		client = req->vreq.token;
+
+		if (client->client_fd >= 0) {
+			err = tapdisk_nbdserver_send_reply(client, req->id, 0,
+					NULL, 0);
+			if (err)
+				ERR("Failed to complete flush: %s",
+						strerror(-err));
+		}
+
+		tapdisk_nbdserver_free_request(client, req);
+	}
+}
+
+static void
+tapdisk_nbdserver_queue_flush(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
+{
+	td_nbdserver_t *server = client->server;
+
+	req->vreq.token = client;
+	req->seq = server->write_seq;
+	list_add_tail(&req->next, &server->flushes);
+
+	tapdisk_nbdserver_complete_flushes(server);
+}
+
 static void
 __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 		void *token, int final)
@@ -289,14 +993,7 @@ __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
 	unsigned long long interval;
 	struct timeval now;
-	struct nbd_reply reply;
-	int tosend = 0;
-	int sent = 0;
-	int len = 0;
-
-	reply.magic = htonl(NBD_REPLY_MAGIC);
-	reply.error = htonl(error);
-	memcpy(reply.handle, req->id, sizeof(reply.handle));
+	int err;
 
 	gettimeofday(&now, NULL);
 	interval = timeval_to_us(&now) - timeval_to_us(&vreq->ts);
@@ -310,236 +1007,923 @@ __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 		goto finish;
 	}
 
-	tosend = len = sizeof(reply);
-	while (tosend > 0) {
-		sent = send(client->client_fd,
-			    ((char *)&reply) + (len - tosend),
-			    tosend, 0);
-		if (sent <= 0) {
-			sent = errno;
-			ERR("Short send/error in callback: %s", strerror(sent));
-			goto finish;
-		}	
-		tosend -= sent;
-	}
-
 	switch(vreq->op) {
 	case TD_OP_READ:
-		tosend = len = vreq->iov->secs << SECTOR_SHIFT;
 		server->nbd_stats.stats->read_reqs_completed++;
 		server->nbd_stats.stats->read_sectors += vreq->iov->secs;
 		server->nbd_stats.stats->read_total_ticks += interval;
-		while (tosend > 0) {
-			sent = send(client->client_fd,
-					vreq->iov->base + (len - tosend),
-					tosend, 0);
-			if (sent <= 0) {
-				sent = errno;
-				ERR("Short send/error in callback: %s", strerror(sent));
-				goto finish;
-			}
 
-			tosend -= sent;
-		}
+		if (!error)
+			tapdisk_nbdserver_cache_add(server,
+					vreq->sec << SECTOR_SHIFT,
+					vreq->iov->secs << SECTOR_SHIFT,
+					vreq->iov->base);
+
+		/* once negotiated, reads must get structured replies */
+		if (client->structured)
+			err = tapdisk_nbdserver_send_read_chunk(client, vreq,
+					error);
+		else
+			err = tapdisk_nbdserver_send_reply(client, req->id,
+					error, vreq->iov->base,
+					vreq->iov->secs << SECTOR_SHIFT);
 		break;
 	case TD_OP_WRITE:
+	case TD_OP_WRITE_ZEROES:
 		server->nbd_stats.stats->write_reqs_completed++;
 		server->nbd_stats.stats->write_sectors += vreq->iov->secs;
 		server->nbd_stats.stats->write_total_ticks += interval;
 	default:
+		err = tapdisk_nbdserver_send_reply(client, req->id, error,
+				NULL, 0);
 		break;
 	}
 
-	if (error)
-		server->nbd_stats.stats->io_errors++;
+	if (err)
+		ERR("Short send/error in callback: %s", strerror(-err));
+
+	if (error)
+		server->nbd_stats.stats->io_errors++;
+
+finish:
+	if (vreq->op != TD_OP_READ) {
+		list_del(&req->next);
+		tapdisk_nbdserver_free_request(client, req);
+		tapdisk_nbdserver_complete_flushes(server);
+	} else
+		tapdisk_nbdserver_free_request(client, req);
+}
+
+static uint16_t
+tapdisk_nbdserver_transmission_flags(td_nbdserver_client_t *client)
+{
+	uint16_t flags;
+
+	flags = TAPDISK_NBD_FLAG_HAS_FLAGS | TAPDISK_NBD_FLAG_SEND_FLUSH |
+		TAPDISK_NBD_FLAG_SEND_WRITE_ZEROES |
+		TAPDISK_NBD_FLAG_CAN_MULTI_CONN;
+	if (client->structured)
+		flags |= TAPDISK_NBD_FLAG_SEND_DF;
+	if (client->server->backup)
+		flags |= TAPDISK_NBD_FLAG_READ_ONLY;
+
+	return flags;
+}
+
+static int
+tapdisk_nbdserver_negotiate_oldstyle(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	char buffer[152];
+	uint64_t tmp64;
+	uint32_t tmp32;
+
+	memcpy(buffer, "NBDMAGIC", 8);
+	tmp64 = htonll(NBD_NEGOTIATION_MAGIC);
+	memcpy(buffer + 8, &tmp64, sizeof(tmp64));
+	tmp64 = htonll(server->info.size << SECTOR_SHIFT);
+	INFO("Sending size %"PRIu64"", ntohll(tmp64));
+	memcpy(buffer + 16, &tmp64, sizeof(tmp64));
+	tmp32 = htonl(tapdisk_nbdserver_transmission_flags(client));
+	memcpy(buffer + 24, &tmp32, sizeof(tmp32));
+	bzero(buffer + 28, 124);
+
+	return tapdisk_nbdserver_send(client->client_fd, buffer, sizeof(buffer));
+}
+
+static int
+tapdisk_nbdserver_opt_reply(td_nbdserver_client_t *client, uint32_t option,
+		uint32_t type, const void *data, uint32_t len)
+{
+	struct nbd_opt_reply reply;
+	int err;
+
+	reply.magic  = htonll(NBD_OPT_REPLY_MAGIC);
+	reply.option = htonl(option);
+	reply.type   = htonl(type);
+	reply.length = htonl(len);
+
+	err = tapdisk_nbdserver_send(client->client_fd, &reply, sizeof(reply));
+	if (err || !len)
+		return err;
+
+	return tapdisk_nbdserver_send(client->client_fd, data, len);
+}
+
+/*
+ * Reply to NBD_OPT_EXPORT_NAME, which also ends the negotiation. There is
+ * only one export, so the name is not checked.
+ */
+static int
+tapdisk_nbdserver_opt_export_name(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	char buffer[8 + 2 + 124];
+	uint64_t tmp64;
+	uint16_t tmp16;
+	size_t len;
+
+	tmp64 = htonll(server->info.size << SECTOR_SHIFT);
+	memcpy(buffer, &tmp64, sizeof(tmp64));
+	tmp16 = htons(tapdisk_nbdserver_transmission_flags(client));
+	memcpy(buffer + 8, &tmp16, sizeof(tmp16));
+	bzero(buffer + 10, 124);
+
+	len = client->no_zeroes ? 10 : sizeof(buffer);
+
+	return tapdisk_nbdserver_send(client->client_fd, buffer, len);
+}
+
+/*
+ * NBD_OPT_INFO and NBD_OPT_GO: a 32 bit name length, the name, a 16 bit
+ * count of the information requests and the requests themselves. Returns
+ * 1 if the option was refused.
+ */
+static int
+tapdisk_nbdserver_opt_info(td_nbdserver_client_t *client, uint32_t option,
+		const char *data, uint32_t len)
+{
+	td_nbdserver_t *server = client->server;
+	char info[2 + 4 + 4 + 4];
+	uint32_t namelen, tmp32;
+	uint64_t tmp64;
+	uint16_t nreqs, tmp16;
+	bool block_size;
+	int i, err;
+
+	if (len < 4 + 2)
+		goto invalid;
+
+	memcpy(&namelen, data, 4);
+	namelen = ntohl(namelen);
+	if (namelen > len - 4 - 2)
+		goto invalid;
+
+	memcpy(&nreqs, data + 4 + namelen, 2);
+	nreqs = ntohs(nreqs);
+	if (len != 4 + namelen + 2 + 2 * nreqs)
+		goto invalid;
+
+	block_size = false;
+	for (i = 0; i < nreqs; i++) {
+		memcpy(&tmp16, data + 4 + namelen + 2 + 2 * i, 2);
+		if (ntohs(tmp16) == TAPDISK_NBD_INFO_BLOCK_SIZE)
+			block_size = true;
+	}
+
+	tmp16 = htons(TAPDISK_NBD_INFO_EXPORT);
+	memcpy(info, &tmp16, 2);
+	tmp64 = htonll(server->info.size << SECTOR_SHIFT);
+	memcpy(info + 2, &tmp64, 8);
+	tmp16 = htons(tapdisk_nbdserver_transmission_flags(client));
+	memcpy(info + 10, &tmp16, 2);
+
+	err = tapdisk_nbdserver_opt_reply(client, option,
+			TAPDISK_NBD_REP_INFO, info, 12);
+	if (err)
+		return err;
+
+	if (block_size) {
+		tmp16 = htons(TAPDISK_NBD_INFO_BLOCK_SIZE);
+		memcpy(info, &tmp16, 2);
+		tmp32 = htonl(server->info.sector_size);
+		memcpy(info + 2, &tmp32, 4);
+		tmp32 = htonl(MAX(server->info.sector_size, 4096));
+		memcpy(info + 6, &tmp32, 4);
+		tmp32 = htonl(TAPDISK_NBD_MAX_PAYLOAD);
+		memcpy(info + 10, &tmp32, 4);
+
+		err = tapdisk_nbdserver_opt_reply(client, option,
+				TAPDISK_NBD_REP_INFO, info, 14);
+		if (err)
+			return err;
+	}
+
+	return tapdisk_nbdserver_opt_reply(client, option,
+			TAPDISK_NBD_REP_ACK, NULL, 0);
+
+invalid:
+	err = tapdisk_nbdserver_opt_reply(client, option,
+			TAPDISK_NBD_REP_ERR_INVALID, NULL, 0);
+	return err ? : 1;
+}
+
+/*
+ * NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT: a 32 bit export
+ * name length, the name, a 32 bit count of queries and the queries, each
+ * a 32 bit length and a context name. base:allocation is the only
+ * context we know.
+ */
+static int
+tapdisk_nbdserver_opt_meta_context(td_nbdserver_client_t *client,
+		uint32_t option, const char *data, uint32_t len)
+{
+	const char *ctx = TAPDISK_NBD_META_BASE_ALLOCATION;
+	char reply[4 + sizeof(TAPDISK_NBD_META_BASE_ALLOCATION)];
+	uint32_t namelen, nqueries, qlen, off, tmp32;
+	bool set, match;
+	int i, err;
+
+	set = option == TAPDISK_NBD_OPT_SET_META_CONTEXT;
+	if (set && !client->structured)
+		goto invalid;
+
+	if (len < 4 + 4)
+		goto invalid;
+
+	memcpy(&namelen, data, 4);
+	namelen = ntohl(namelen);
+	if (namelen > len - 4 - 4)
+		goto invalid;
+
+	off = 4 + namelen;
+	memcpy(&nqueries, data + off, 4);
+	nqueries = ntohl(nqueries);
+	off += 4;
+
+	/* an empty list asks for every context, but only when listing */
+	match = !set && !nqueries;
+
+	for (i = 0; i < nqueries; i++) {
+		if (len - off < 4)
+			goto invalid;
+
+		memcpy(&qlen, data + off, 4);
+		qlen = ntohl(qlen);
+		off += 4;
+
+		if (qlen > len - off)
+			goto invalid;
+
+		if ((qlen == strlen(ctx) && !memcmp(data + off, ctx, qlen)) ||
+		    (!set && qlen == 5 && !memcmp(data + off, "base:", 5)))
+			match = true;
+
+		off += qlen;
+	}
+
+	if (off != len)
+		goto invalid;
+
+	if (set)
+		client->meta_allocation = match;
+
+	if (match) {
+		tmp32 = htonl(TAPDISK_NBD_META_BASE_ALLOCATION_ID);
+		memcpy(reply, &tmp32, 4);
+		memcpy(reply + 4, ctx, strlen(ctx));
+
+		err = tapdisk_nbdserver_opt_reply(client, option,
+				TAPDISK_NBD_REP_META_CONTEXT, reply,
+				4 + strlen(ctx));
+		if (err)
+			return err;
+	}
+
+	return tapdisk_nbdserver_opt_reply(client, option,
+			TAPDISK_NBD_REP_ACK, NULL, 0);
+
+invalid:
+	return tapdisk_nbdserver_opt_reply(client, option,
+			TAPDISK_NBD_REP_ERR_INVALID, NULL, 0);
+}
+
+/*
+ * NBD_OPT_STARTTLS: acknowledged in the clear, then the handshake runs
+ * and the negotiation carries on over TLS.
+ */
+static int
+tapdisk_nbdserver_opt_starttls(td_nbdserver_client_t *client, uint32_t len)
+{
+	int err;
+
+	if (len || client->tls)
+		return tapdisk_nbdserver_opt_reply(client,
+				TAPDISK_NBD_OPT_STARTTLS,
+				TAPDISK_NBD_REP_ERR_INVALID, NULL, 0);
+
+	if (!tapdisk_nbd_tls_enabled(TAPDISK_NBD_TLS_SERVER))
+		return tapdisk_nbdserver_opt_reply(client,
+				TAPDISK_NBD_OPT_STARTTLS,
+				TAPDISK_NBD_REP_ERR_POLICY, NULL, 0);
+
+	err = tapdisk_nbdserver_opt_reply(client, TAPDISK_NBD_OPT_STARTTLS,
+			TAPDISK_NBD_REP_ACK, NULL, 0);
+	if (err)
+		return err;
+
+	err = tapdisk_nbd_tls_handshake(client->client_fd,
+			TAPDISK_NBD_TLS_SERVER, NULL);
+	if (err)
+		return err;
+
+	client->tls = true;
+	return 0;
+}
+
+/*
+ * Fixed newstyle negotiation: after the magic we send our handshake
+ * flags, the client answers with its own and then haggles over options
+ * until it asks for NBD_OPT_EXPORT_NAME or NBD_OPT_GO. A server with a
+ * certificate insists on TLS first.
+ */
+static int
+tapdisk_nbdserver_negotiate_newstyle(td_nbdserver_client_t *client)
+{
+	int fd = client->client_fd;
+	struct nbd_opt_header opt;
+	char data[TAPDISK_NBD_MAX_OPT_LEN];
+	char buffer[8 + 8 + 2];
+	uint32_t option, len, flags;
+	uint64_t tmp64;
+	uint16_t tmp16;
+	bool tls_reqd;
+	int err;
+
+	tls_reqd = tapdisk_nbd_tls_enabled(TAPDISK_NBD_TLS_SERVER);
+
+	memcpy(buffer, "NBDMAGIC", 8);
+	tmp64 = htonll(NBD_OPTS_MAGIC);
+	memcpy(buffer + 8, &tmp64, sizeof(tmp64));
+	tmp16 = htons(TAPDISK_NBD_FLAG_FIXED_NEWSTYLE |
+		      TAPDISK_NBD_FLAG_NO_ZEROES);
+	memcpy(buffer + 16, &tmp16, sizeof(tmp16));
+
+	err = tapdisk_nbdserver_send(fd, buffer, sizeof(buffer));
+	if (err)
+		return err;
+
+	err = tapdisk_nbdserver_recv(fd, &flags, sizeof(flags));
+	if (err)
+		return err;
+
+	flags = ntohl(flags);
+	if (flags & ~(TAPDISK_NBD_FLAG_FIXED_NEWSTYLE |
+		      TAPDISK_NBD_FLAG_NO_ZEROES)) {
+		ERR("Unknown client flags 0x%x", flags);
+		return -EINVAL;
+	}
+
+	client->newstyle  = true;
+	client->no_zeroes = !!(flags & TAPDISK_NBD_FLAG_NO_ZEROES);
+
+	for (;;) {
+		err = tapdisk_nbdserver_recv(fd, &opt, sizeof(opt));
+		if (err)
+			return err;
+
+		if (ntohll(opt.magic) != NBD_OPTS_MAGIC) {
+			ERR("Not enough magic in option");
+			return -EINVAL;
+		}
+
+		option = ntohl(opt.option);
+		len    = ntohl(opt.length);
+
+		if (len > sizeof(data)) {
+			ERR("Option %u too long (%u bytes)", option, len);
+			return -EINVAL;
+		}
+
+		err = tapdisk_nbdserver_recv(fd, data, len);
+		if (err)
+			return err;
+
+		if (tls_reqd && !client->tls &&
+		    option != TAPDISK_NBD_OPT_STARTTLS &&
+		    option != TAPDISK_NBD_OPT_ABORT) {
+			/* there is no error reply to NBD_OPT_EXPORT_NAME */
+			if (option == TAPDISK_NBD_OPT_EXPORT_NAME) {
+				ERR("Client asked for the export without TLS");
+				return -EACCES;
+			}
+
+			err = tapdisk_nbdserver_opt_reply(client, option,
+					TAPDISK_NBD_REP_ERR_TLS_REQD, NULL, 0);
+			if (err)
+				return err;
+			continue;
+		}
+
+		switch (option) {
+		case TAPDISK_NBD_OPT_EXPORT_NAME:
+			return tapdisk_nbdserver_opt_export_name(client);
+
+		case TAPDISK_NBD_OPT_ABORT:
+			tapdisk_nbdserver_opt_reply(client, option,
+					TAPDISK_NBD_REP_ACK, NULL, 0);
+			return -ECONNABORTED;
+
+		case TAPDISK_NBD_OPT_LIST:
+			if (len) {
+				err = tapdisk_nbdserver_opt_reply(client, option,
+						TAPDISK_NBD_REP_ERR_INVALID,
+						NULL, 0);
+				break;
+			}
+
+			/* the one export has an empty name */
+			tmp64 = 0;
+			err = tapdisk_nbdserver_opt_reply(client, option,
+					TAPDISK_NBD_REP_SERVER, &tmp64, 4);
+			if (!err)
+				err = tapdisk_nbdserver_opt_reply(client,
+						option, TAPDISK_NBD_REP_ACK,
+						NULL, 0);
+			break;
+
+		case TAPDISK_NBD_OPT_INFO:
+		case TAPDISK_NBD_OPT_GO:
+			err = tapdisk_nbdserver_opt_info(client, option,
+					data, len);
+			if (!err && option == TAPDISK_NBD_OPT_GO)
+				return 0;
+			if (err > 0)
+				err = 0;
+			break;
+
+		case TAPDISK_NBD_OPT_STARTTLS:
+			err = tapdisk_nbdserver_opt_starttls(client, len);
+			break;
+
+		case TAPDISK_NBD_OPT_STRUCTURED_REPLY:
+			if (len || client->structured) {
+				err = tapdisk_nbdserver_opt_reply(client, option,
+						TAPDISK_NBD_REP_ERR_INVALID,
+						NULL, 0);
+				break;
+			}
+
+			client->structured = true;
+			err = tapdisk_nbdserver_opt_reply(client, option,
+					TAPDISK_NBD_REP_ACK, NULL, 0);
+			break;
+
+		case TAPDISK_NBD_OPT_LIST_META_CONTEXT:
+		case TAPDISK_NBD_OPT_SET_META_CONTEXT:
+			err = tapdisk_nbdserver_opt_meta_context(client, option,
+					data, len);
+			break;
+
+		default:
+			err = tapdisk_nbdserver_opt_reply(client, option,
+					TAPDISK_NBD_REP_ERR_UNSUP, NULL, 0);
+			break;
+		}
+
+		if (err)
+			return err;
+	}
+}
+
+static void
+tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd)
+{
+	td_nbdserver_client_t *client;
+	struct timeval tv;
+	int err;
+
+	ASSERT(server);
+	ASSERT(new_fd >= 0);
+
+	INFO("Got a new client!");
+
+	INFO("About to alloc client");
+	client = tapdisk_nbdserver_alloc_client(server);
+	if (client == NULL) {
+		ERR("Error allocating client");
+		close(new_fd);
+		return;
+	}
+
+	INFO("Got an allocated client at %p", client);
+	client->client_fd = new_fd;
+
+	/*
+	 * The negotiation blocks the event loop, don't let a silent client
+	 * hold it forever.
+	 */
+	tv.tv_sec  = TAPDISK_NBD_NEGOTIATION_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(new_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (server->oldstyle)
+		err = tapdisk_nbdserver_negotiate_oldstyle(client);
+	else
+		err = tapdisk_nbdserver_negotiate_newstyle(client);
+	if (err) {
+		INFO("Negotiation failed: %s", strerror(-err));
+		goto fail;
+	}
+
+	tv.tv_sec = 0;
+	setsockopt(new_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	INFO("About to enable client on fd %d", client->client_fd);
+	if (tapdisk_nbdserver_enable_client(client) < 0) {
+		ERR("Error enabling client");
+		goto fail;
+	}
+
+	return;
 
-finish:
-	free(vreq->iov->base);
-	tapdisk_nbdserver_free_request(client, req);
+fail:
+	tapdisk_nbdserver_free_client(client);
+	close(new_fd);
 }
 
+/*
+ * A client another tapdisk handed over with tapdisk_nbdserver_handoff:
+ * the handshake is long done, take the options it negotiated and go
+ * straight to transmission.
+ */
 static void
-tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd)
+tapdisk_nbdserver_adopt_client(td_nbdserver_t *server, int fd,
+		const char *opts)
 {
 	td_nbdserver_client_t *client;
-	char buffer[256];
-	int rc;
-	uint64_t tmp64;
-	uint32_t tmp32;
-
-	ASSERT(server);
-	ASSERT(new_fd >= 0);
-
-	INFO("Got a new client!");
-
-	/* Spit out the NBD connection stuff */
-
-	memcpy(buffer, "NBDMAGIC", 8);
-	tmp64 = htonll(NBD_NEGOTIATION_MAGIC);
-	memcpy(buffer + 8, &tmp64, sizeof(tmp64));
-	tmp64 = htonll(server->info.size * server->info.sector_size);
-	INFO("Sending size %"PRIu64"", ntohll(tmp64));
-	memcpy(buffer + 16, &tmp64, sizeof(tmp64));
-	tmp32 = htonl(0);
-	memcpy(buffer + 24, &tmp32, sizeof(tmp32));
-	bzero(buffer + 28, 124);
-
-	rc = send(new_fd, buffer, 152, 0);
-
-	if (rc != 152) {
-		int err = errno;
-		close(new_fd);
-		if (rc == -1)
-			INFO("Short write in negotiation: %s", strerror(err));
-		else
-			INFO("Short write in negotiation: wrote %d bytes instead of 152\n",
-					rc);
+	int newstyle, no_zeroes, structured, meta_allocation, tls;
+
+	if (sscanf(opts, " newstyle=%d no_zeroes=%d structured=%d "
+				"meta_allocation=%d tls=%d", &newstyle,
+				&no_zeroes, &structured, &meta_allocation,
+				&tls) != 5) {
+		ERR("Bad handoff options '%s'", opts);
+		close(fd);
 		return;
 	}
 
-	INFO("About to alloc client");
 	client = tapdisk_nbdserver_alloc_client(server);
-	if (client == NULL) {
+	if (!client) {
 		ERR("Error allocating client");
-		close(new_fd);
+		close(fd);
 		return;
 	}
 
-	INFO("Got an allocated client at %p", client);
-	client->client_fd = new_fd;
+	client->client_fd       = fd;
+	client->newstyle        = newstyle;
+	client->no_zeroes       = no_zeroes;
+	client->structured      = structured;
+	client->meta_allocation = meta_allocation;
+	client->tls             = tls;
 
-	INFO("About to enable client on fd %d", client->client_fd);
 	if (tapdisk_nbdserver_enable_client(client) < 0) {
-		ERR("Error enabling client");
+		ERR("Error enabling handed over client");
 		tapdisk_nbdserver_free_client(client);
-		close(new_fd);
+		close(fd);
+		return;
 	}
+
+	INFO("Adopted client on fd %d", fd);
 }
 
-void
-tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
+static int
+tapdisk_nbdserver_submit(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
 {
-	td_nbdserver_client_t *client = data;
 	td_nbdserver_t *server = client->server;
+	td_vbd_request_t *vreq = &req->vreq;
 	int rc;
-	int len;
-	int hdrlen;
-	int n;
-	int fd = client->client_fd;
-	char *ptr;
+
+	if (server->backup)
+		rc = tapdisk_backup_queue_read(server->backup, vreq);
+	else
+		rc = tapdisk_vbd_queue_request(server->vbd, vreq);
+	if (rc) {
+		ERR("tapdisk_vbd_queue_request failed: %d", rc);
+		tapdisk_nbdserver_set_free_request(client, req);
+		return rc;
+	}
+
+	if (vreq->op != TD_OP_READ) {
+		req->seq = server->write_seq++;
+		list_add_tail(&req->next, &server->writes);
+	}
+
+	return 0;
+}
+
+/*
+ * Handles a request header. Writes wait in client->rx_req for their
+ * payload, everything else goes to the VBD (or is answered) right away.
+ * Returns 1 if the client went away.
+ */
+static int
+tapdisk_nbdserver_rx_request(td_nbdserver_client_t *client,
+		struct nbd_request *request)
+{
+	td_nbdserver_t *server = client->server;
 	td_vbd_request_t *vreq;
-	struct nbd_request request;
 	td_nbdserver_req_t *req;
+	uint16_t flags;
+	int fd = client->client_fd;
+	int rc, len;
 
-	req = tapdisk_nbdserver_alloc_request(client);
-	if (!req) {
-		ERR("Couldn't allocate request in clientcb - killing client");
-		tapdisk_nbdserver_free_client(client);
-		return;
+	if (request->magic != htonl(NBD_REQUEST_MAGIC)) {
+		ERR("Not enough magic");
+		return -EINVAL;
 	}
 
+	req = tapdisk_nbdserver_alloc_request(client);
+	ASSERT(req);
 	vreq = &req->vreq;
 
-	memset(req, 0, sizeof(td_nbdserver_req_t));
-	/* Read the request the client has sent */
+	request->from = ntohll(request->from);
+	request->type = ntohl(request->type);
+	flags = request->type >> TAPDISK_NBD_CMD_FLAG_SHIFT;
+	request->type &= TAPDISK_NBD_CMD_MASK_COMMAND;
+	len = ntohl(request->len);
+	if (((len & 0x1ff) != 0) || ((request->from & 0x1ff) != 0)) {
+		ERR("Non sector-aligned request (%"PRIu64", %d)",
+				request->from, len);
+	}
 
-	hdrlen = sizeof(struct nbd_request);
+	memcpy(req->id, request->handle, sizeof(request->handle));
 
-	n = 0;
-	ptr = (char *) &request;
-	while (n < hdrlen) {
-		// FIXME: need to select() on fd with a sensible timeout
-		rc = recv(fd, ptr + n, hdrlen - n, 0);
-		if (rc == 0) {
-			INFO("Client closed connection");
+	if (request->type == TAPDISK_NBD_CMD_BLOCK_STATUS) {
+		if (!client->structured) {
+			ERR("Block status without structured replies");
+			rc = -EINVAL;
 			goto fail;
 		}
-		if (rc < 0) {
-			rc = errno;
-			ERR("failed to receive from client: %s. Closing connection",
-					strerror(rc));
+
+		rc = tapdisk_nbdserver_block_status(client, req, request->from,
+				len, flags);
+		if (rc) {
+			ERR("Failed to send block status: %s", strerror(-rc));
 			goto fail;
 		}
-		n += rc;
+
+		tapdisk_nbdserver_free_request(client, req);
+		return 0;
 	}
 
-	if (request.magic != htonl(NBD_REQUEST_MAGIC)) {
-		ERR("Not enough magic");
-		goto fail;
+	/* holes through the whole chain need no I/O to read */
+	if (request->type == TAPDISK_NBD_CMD_READ && client->structured &&
+	    len && tapdisk_nbdserver_is_hole(server,
+				request->from >> SECTOR_SHIFT,
+				len >> SECTOR_SHIFT)) {
+		server->nbd_stats.stats->read_reqs_submitted++;
+		server->nbd_stats.stats->read_reqs_completed++;
+		server->nbd_stats.stats->read_sectors += len >> SECTOR_SHIFT;
+
+		rc = tapdisk_nbdserver_send_hole(client, req, request->from,
+				len);
+		if (rc) {
+			ERR("Failed to send hole: %s", strerror(-rc));
+			goto fail;
+		}
+
+		tapdisk_nbdserver_free_request(client, req);
+		return 0;
 	}
 
-	request.from = ntohll(request.from);
-	request.type = ntohl(request.type);
-	len = ntohl(request.len);
-	if (((len & 0x1ff) != 0) || ((request.from & 0x1ff) != 0)) {
-		ERR("Non sector-aligned request (%"PRIu64", %d)",
-				request.from, len);
+	if (server->backup && (request->type == TAPDISK_NBD_CMD_WRITE ||
+			       request->type == TAPDISK_NBD_CMD_WRITE_ZEROES)) {
+		ERR("Write to a read-only export");
+		rc = -EROFS;
+		goto fail;
 	}
 
-	bzero(req->id, sizeof(req->id));
-	memcpy(req->id, request.handle, sizeof(request.handle));
+	switch (request->type) {
+	case TAPDISK_NBD_CMD_FLUSH:
+		tapdisk_nbdserver_queue_flush(client, req);
+		return 0;
+
+	case TAPDISK_NBD_CMD_DISC:
+		if (client->newstyle) {
+			INFO("Received close message");
+			rc = -ECONNRESET;
+			goto fail;
+		}
+
+		INFO("Received close message. Sending reconnect "
+				"header");
+		tapdisk_nbdserver_set_free_request(client, req);
+		tapdisk_nbdserver_free_client(client);
+		INFO("About to send initial connection message");
+		tapdisk_nbdserver_newclient_fd(server, fd);
+		INFO("Sent initial connection message");
+		return 1;
+
+	case TAPDISK_NBD_CMD_READ:
+	case TAPDISK_NBD_CMD_WRITE:
+		rc = posix_memalign(&req->iov.base, 512, len);
+		if (rc) {
+			ERR("posix_memalign failed (%d)", rc);
+			req->iov.base = NULL;
+			rc = -rc;
+			goto fail;
+		}
+
+		req->bytes = len;
+		server->inflight_bytes += len;
+		break;
+
+	/* write-zeroes carry no data */
+	case TAPDISK_NBD_CMD_WRITE_ZEROES:
+		break;
 
-	rc = posix_memalign(&req->iov.base, 512, len);
-	if (rc < 0) {
-		ERR("posix_memalign failed (%d)", rc);
+	default:
+		ERR("Unsupported operation: 0x%x", request->type);
+		rc = -EOPNOTSUPP;
 		goto fail;
 	}
 
-	vreq->sec = request.from >> SECTOR_SHIFT;
+	vreq->sec = request->from >> SECTOR_SHIFT;
 	vreq->iovcnt = 1;
 	vreq->iov = &req->iov;
 	vreq->iov->secs = len >> SECTOR_SHIFT;
+	vreq->prio = TD_PRIO_FOREGROUND;
 	vreq->token = client;
 	vreq->cb = __tapdisk_nbdserver_request_cb;
 	vreq->name = req->id;
 	vreq->vbd = server->vbd;
 
-	switch(request.type) {
+	switch (request->type) {
 	case TAPDISK_NBD_CMD_READ:
 		vreq->op = TD_OP_READ;
-                server->nbd_stats.stats->read_reqs_submitted++;
+		server->nbd_stats.stats->read_reqs_submitted++;
 		break;
 	case TAPDISK_NBD_CMD_WRITE:
 		vreq->op = TD_OP_WRITE;
 		server->nbd_stats.stats->write_reqs_submitted++;
-		n = 0;
-		while (n < len) {
-			rc = recv(fd, vreq->iov->base + n, (len - n), 0);
-			if (rc <= 0) {
-				ERR("Short send or error in "
-						"callback: %d", rc);
+		client->rx_req  = req;
+		client->rx_done = 0;
+		return 0;
+	case TAPDISK_NBD_CMD_WRITE_ZEROES:
+		vreq->op = TD_OP_WRITE_ZEROES;
+		server->nbd_stats.stats->write_reqs_submitted++;
+		break;
+	}
+
+	if (vreq->op == TD_OP_READ &&
+	    tapdisk_nbdserver_cache_read(server, request->from, len,
+				    req->iov.base)) {
+		gettimeofday(&vreq->ts, NULL);
+		__tapdisk_nbdserver_request_cb(vreq, 0, client, 1);
+		return 0;
+	}
+
+	return tapdisk_nbdserver_submit(client, req);
+
+fail:
+	tapdisk_nbdserver_set_free_request(client, req);
+	return rc;
+}
+
+/*
+ * Receives the rest of the payload of client->rx_req, from the buffer
+ * first and then straight from the socket into the request.
+ */
+static int
+tapdisk_nbdserver_rx_payload(td_nbdserver_client_t *client)
+{
+	td_nbdserver_req_t *req = client->rx_req;
+	size_t n;
+	int rc;
+
+	n = MIN(client->rbuf_len, req->bytes - client->rx_done);
+	memcpy(req->iov.base + client->rx_done,
+	       client->rbuf + client->rbuf_off, n);
+	client->rbuf_off += n;
+	client->rbuf_len -= n;
+	client->rx_done  += n;
+
+	while (client->rx_done < req->bytes) {
+		rc = recv(client->client_fd, req->iov.base + client->rx_done,
+			  req->bytes - client->rx_done, MSG_DONTWAIT);
+		if (rc == 0)
+			return -ECONNRESET;
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		client->rx_done += rc;
+	}
+
+	client->rx_req = NULL;
+	return tapdisk_nbdserver_submit(client, req);
+}
+
+static void
+tapdisk_nbdserver_kill_client(td_nbdserver_client_t *client)
+{
+	if (client->rx_req) {
+		tapdisk_nbdserver_set_free_request(client, client->rx_req);
+		client->rx_req = NULL;
+	}
+
+	if (client->client_fd >= 0) {
+		close(client->client_fd);
+		client->client_fd = -1;
+	}
+
+	tapdisk_nbdserver_free_client(client);
+}
+
+/*
+ * Parses as many requests as the socket has for us, up to
+ * TAPDISK_NBD_RX_BUDGET, and sends each one to the VBD as soon as it is
+ * complete. Replies go out in completion order. When the server has too
+ * many bytes in flight the client stops reading until some complete.
+ */
+static void
+tapdisk_nbdserver_rx(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	struct nbd_request request;
+	int budget, rc;
+
+	for (budget = TAPDISK_NBD_RX_BUDGET; budget > 0; ) {
+		if (client->rx_req) {
+			rc = tapdisk_nbdserver_rx_payload(client);
+			if (rc == -EAGAIN || rc == -EWOULDBLOCK)
+				return;
+			if (rc)
 				goto fail;
+			continue;
+		}
+
+		if (client->rbuf_len >= sizeof(request)) {
+			if (tapdisk_nbdserver_full(server)) {
+				/* resumed by tapdisk_nbdserver_unthrottle */
+				tapdisk_nbdserver_disable_client(client);
+				client->throttled = true;
+				server->n_throttled++;
+				return;
 			}
 
-			n += rc;
-		};
+			memcpy(&request, client->rbuf + client->rbuf_off,
+			       sizeof(request));
+			client->rbuf_off += sizeof(request);
+			client->rbuf_len -= sizeof(request);
 
-		break;
-	case TAPDISK_NBD_CMD_DISC:
-		INFO("Received close message. Sending reconnect "
-				"header");
-		tapdisk_nbdserver_free_client(client);
-		INFO("About to send initial connection message");
-		tapdisk_nbdserver_newclient_fd(server, fd);
-		INFO("Sent initial connection message");
-		return;
+			rc = tapdisk_nbdserver_rx_request(client, &request);
+			if (rc > 0)
+				return;
+			if (rc)
+				goto fail;
 
-	default:
-		ERR("Unsupported operation: 0x%x", request.type);
-		goto fail;
-	}
+			budget--;
+			continue;
+		}
 
-	rc = tapdisk_vbd_queue_request(server->vbd, vreq);
-	if (rc) {
-		ERR("tapdisk_vbd_queue_request failed: %d", rc);
-		goto fail;
+		if (client->rbuf_off) {
+			memmove(client->rbuf, client->rbuf + client->rbuf_off,
+				client->rbuf_len);
+			client->rbuf_off = 0;
+		}
+
+		rc = recv(client->client_fd, client->rbuf + client->rbuf_len,
+			  TAPDISK_NBD_RBUF_SIZE - client->rbuf_len,
+			  MSG_DONTWAIT);
+		if (rc == 0) {
+			INFO("Client closed connection");
+			goto fail;
+		}
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			ERR("failed to receive from client: %s. Closing "
+					"connection", strerror(errno));
+			goto fail;
+		}
+
+		client->rbuf_len += rc;
 	}
 
+	/* out of budget, pick up from here on the next round */
+	tapdisk_server_mask_event(client->sched_event_id, 0);
 	return;
 
 fail:
-	tapdisk_nbdserver_free_client(client);
-	return;
+	tapdisk_nbdserver_kill_client(client);
+}
+
+void
+tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_client_t *client = data;
+
+	tapdisk_nbdserver_rx(client);
+}
+
+static void
+tapdisk_nbdserver_client_sched_cb(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_client_t *client = data;
+
+	tapdisk_server_mask_event(client->sched_event_id, 1);
+
+	if (client->paused || client->throttled || client->dead)
+		return;
+
+	tapdisk_nbdserver_rx(client);
 }
 
 static void
@@ -553,7 +1937,12 @@ tapdisk_nbdserver_fdreceiver_cb(int fd, char *msg, void *data)
 
 	INFO("Received fd %d with msg: %s", fd, msg);
 
-	tapdisk_nbdserver_newclient_fd(server, fd);
+	if (!strncmp(msg, TAPDISK_NBD_HANDOFF_MSG,
+				strlen(TAPDISK_NBD_HANDOFF_MSG)))
+		tapdisk_nbdserver_adopt_client(server, fd,
+				msg + strlen(TAPDISK_NBD_HANDOFF_MSG));
+	else
+		tapdisk_nbdserver_newclient_fd(server, fd);
 }
 
 static void
@@ -611,17 +2000,17 @@ tapdisk_nbdserver_newclient_unix(event_id_t id, char mode, void *data)
 	tapdisk_nbdserver_newclient_fd(server, new_fd);
 }
 
-td_nbdserver_t *
-tapdisk_nbdserver_alloc(td_vbd_t *vbd, td_disk_info_t info)
+static td_nbdserver_t *
+__tapdisk_nbdserver_alloc(td_vbd_t *vbd, td_disk_info_t info)
 {
 	td_nbdserver_t *server;
-	char fdreceiver_path[TAPDISK_NBDSERVER_MAX_PATH_LEN];
+	const char *val;
 
 	server = calloc(1, sizeof(*server));
 	if (!server) {
 		ERR("Failed to allocate memory for nbdserver: %s",
 				strerror(errno));
-		goto fail;
+		return NULL;
 	}
 
 	server->vbd = vbd;
@@ -631,6 +2020,29 @@ tapdisk_nbdserver_alloc(td_vbd_t *vbd, td_disk_info_t info)
 	server->unix_listening_fd = -1;
 	server->unix_listening_event_id = -1;
 	INIT_LIST_HEAD(&server->clients);
+	tapdisk_nbdserver_cache_init(server);
+
+	val = getenv("TAPDISK3_NBD_OLDSTYLE");
+	server->oldstyle = val && atoi(val);
+
+	/* the oldstyle handshake has no room for STARTTLS */
+	if (server->oldstyle && tapdisk_nbd_tls_enabled(TAPDISK_NBD_TLS_SERVER)) {
+		ERR("TLS is configured, ignoring TAPDISK3_NBD_OLDSTYLE");
+		server->oldstyle = false;
+	}
+
+	return server;
+}
+
+td_nbdserver_t *
+tapdisk_nbdserver_alloc(td_vbd_t *vbd, td_disk_info_t info)
+{
+	td_nbdserver_t *server;
+	char fdreceiver_path[TAPDISK_NBDSERVER_MAX_PATH_LEN];
+
+	server = __tapdisk_nbdserver_alloc(vbd, info);
+	if (!server)
+		goto fail;
 
 	if (td_metrics_nbd_start(&server->nbd_stats, server->vbd->tap->minor)) {
 		ERR("failed to create metrics file for nbdserver");
@@ -664,12 +2076,38 @@ fail:
 	if (server) {
 		if (server->fdreceiver)
 			td_fdreceiver_stop(server->fdreceiver);
+		free(server->cache.buckets);
 		free(server);
 	}
 
 	return NULL;
 }
 
+td_nbdserver_t *
+tapdisk_nbdserver_alloc_backup(td_vbd_t *vbd, td_disk_info_t info,
+		struct td_backup *backup)
+{
+	td_nbdserver_t *server;
+
+	server = __tapdisk_nbdserver_alloc(vbd, info);
+	if (!server)
+		return NULL;
+
+	server->backup = backup;
+	server->nbd_stats.stats = &server->backup_stats;
+
+	if (snprintf(server->sockpath, TAPDISK_NBDSERVER_MAX_PATH_LEN,
+			"%s%d.%d", TAPDISK_NBDSERVER_BACKUP_SOCK_PATH, getpid(),
+			vbd->uuid) < 0) {
+		ERR("Failed to snprintf sockpath");
+		free(server->cache.buckets);
+		free(server);
+		return NULL;
+	}
+
+	return server;
+}
+
 void
 tapdisk_nbdserver_pause(td_nbdserver_t *server, bool log)
 {
@@ -679,11 +2117,20 @@ tapdisk_nbdserver_pause(td_nbdserver_t *server, bool log)
 		INFO("NBD server pause(%p)", server);
 	}
 
+	tapdisk_nbdserver_cache_clear(server);
+
 	list_for_each_entry_safe(pos, q, &server->clients, clientlist){
 		if (pos->paused != 1 && pos->client_event_id >= 0) {
 			tapdisk_nbdserver_disable_client(pos);
 			pos->paused = 1;
+		} else if (pos->throttled) {
+			pos->throttled = false;
+			server->n_throttled--;
+			pos->paused = 1;
 		}
+
+		if (pos->sched_event_id >= 0)
+			tapdisk_server_mask_event(pos->sched_event_id, 1);
 	}
 
 	if (server->fdrecv_listening_event_id >= 0) {
@@ -912,8 +2359,10 @@ tapdisk_nbdserver_unpause(td_nbdserver_t *server)
 
 	list_for_each_entry_safe(pos, q, &server->clients, clientlist){
 		if (pos->paused == 1) {
-			tapdisk_nbdserver_enable_client(pos);
 			pos->paused = 0;
+			if (tapdisk_nbdserver_enable_client(pos) >= 0)
+				tapdisk_server_mask_event(pos->sched_event_id,
+						0);
 		}
 	}
 
@@ -971,6 +2420,9 @@ tapdisk_nbdserver_free(td_nbdserver_t *server)
 	if (err)
 		ERR("failed to delete NBD metrics: %s\n", strerror(errno));
 
+	tapdisk_nbdserver_reqs_free(server);
+	tapdisk_nbdserver_cache_clear(server);
+	free(server->cache.buckets);
 	free(server);
 }
 
@@ -979,7 +2431,7 @@ tapdisk_nbdserver_reqs_pending(td_nbdserver_client_t *client)
 {
 	ASSERT(client);
 
-	return client->n_reqs - client->n_reqs_free;
+	return client->n_reqs_pending;
 }
 
 bool
@@ -995,3 +2447,58 @@ tapdisk_nbdserver_contains_client(td_nbdserver_t *server,
 			return true;
 	return false;
 }
+
+int
+tapdisk_nbdserver_handoff(td_nbdserver_t *server, pid_t pid, int minor)
+{
+	struct td_nbdserver_client *pos, *q;
+	char path[TAPDISK_NBDSERVER_MAX_PATH_LEN];
+	char msg[128];
+	int err, n = 0;
+
+	ASSERT(server);
+
+	if (!td_flag_test(server->vbd->state, TD_VBD_PAUSED))
+		return -EBUSY;
+
+	if (snprintf(path, sizeof(path), "%s%d.%d",
+				TAPDISK_NBDSERVER_LISTEN_SOCK_PATH, pid, minor)
+			>= sizeof(path))
+		return -ENAMETOOLONG;
+
+	list_for_each_entry_safe(pos, q, &server->clients, clientlist) {
+		if (pos->dead || pos->client_fd < 0)
+			continue;
+
+		/*
+		 * Paused, so nothing is in flight; only bytes already read
+		 * off the socket would be lost.
+		 */
+		if (pos->rx_req || pos->rbuf_len ||
+				tapdisk_nbdserver_reqs_pending(pos)) {
+			INFO("Client on fd %d is mid-request, keeping it",
+					pos->client_fd);
+			continue;
+		}
+
+		snprintf(msg, sizeof(msg), TAPDISK_NBD_HANDOFF_MSG
+				" newstyle=%d no_zeroes=%d structured=%d "
+				"meta_allocation=%d tls=%d",
+				pos->newstyle, pos->no_zeroes, pos->structured,
+				pos->meta_allocation, pos->tls);
+
+		err = td_fdreceiver_send_fd(path, pos->client_fd, msg);
+		if (err) {
+			ERR("Handoff to %s failed: %s", path, strerror(-err));
+			return n ? n : err;
+		}
+
+		INFO("Handed client on fd %d over to %s", pos->client_fd, path);
+
+		/* the other tapdisk has its own reference to the socket */
+		tapdisk_nbdserver_kill_client(pos);
+		n++;
+	}
+
+	return n;
+}
@@ -42,15 +42,94 @@ typedef struct td_nbdserver_client td_nbdserver_client_t;
 #include <stdbool.h>
 
 #define NBD_NEGOTIATION_MAGIC 0x00420281861253LL
+#define NBD_OPTS_MAGIC 0x49484156454F5054LL /* "IHAVEOPT" */
+#define NBD_OPT_REPLY_MAGIC 0x3e889045565a9LL
 #define NBD_REQUEST_MAGIC 0x25609513
 #define NBD_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
 
 enum {
 	TAPDISK_NBD_CMD_READ = 0,
 	TAPDISK_NBD_CMD_WRITE = 1,
-	TAPDISK_NBD_CMD_DISC = 2
+	TAPDISK_NBD_CMD_DISC = 2,
+	TAPDISK_NBD_CMD_FLUSH = 3,
+	TAPDISK_NBD_CMD_WRITE_ZEROES = 6,
+	TAPDISK_NBD_CMD_BLOCK_STATUS = 7
 };
 
+/* the command flags are in the upper half of the type */
+#define TAPDISK_NBD_CMD_MASK_COMMAND 0x0000ffff
+#define TAPDISK_NBD_CMD_FLAG_SHIFT   16
+#define TAPDISK_NBD_CMD_FLAG_DF      (1 << 2)
+#define TAPDISK_NBD_CMD_FLAG_REQ_ONE (1 << 3)
+
+/* handshake flags, sent by a newstyle server and echoed by the client */
+#define TAPDISK_NBD_FLAG_FIXED_NEWSTYLE     (1 << 0)
+#define TAPDISK_NBD_FLAG_NO_ZEROES          (1 << 1)
+
+/* transmission flags, sent in the negotiation */
+#define TAPDISK_NBD_FLAG_HAS_FLAGS          (1 << 0)
+#define TAPDISK_NBD_FLAG_READ_ONLY          (1 << 1)
+#define TAPDISK_NBD_FLAG_SEND_FLUSH         (1 << 2)
+#define TAPDISK_NBD_FLAG_SEND_WRITE_ZEROES  (1 << 6)
+#define TAPDISK_NBD_FLAG_SEND_DF            (1 << 7)
+#define TAPDISK_NBD_FLAG_CAN_MULTI_CONN     (1 << 8)
+
+enum {
+	TAPDISK_NBD_OPT_EXPORT_NAME = 1,
+	TAPDISK_NBD_OPT_ABORT = 2,
+	TAPDISK_NBD_OPT_LIST = 3,
+	TAPDISK_NBD_OPT_STARTTLS = 5,
+	TAPDISK_NBD_OPT_INFO = 6,
+	TAPDISK_NBD_OPT_GO = 7,
+	TAPDISK_NBD_OPT_STRUCTURED_REPLY = 8,
+	TAPDISK_NBD_OPT_LIST_META_CONTEXT = 9,
+	TAPDISK_NBD_OPT_SET_META_CONTEXT = 10
+};
+
+#define TAPDISK_NBD_REP_ACK           1
+#define TAPDISK_NBD_REP_SERVER        2
+#define TAPDISK_NBD_REP_INFO          3
+#define TAPDISK_NBD_REP_META_CONTEXT  4
+#define TAPDISK_NBD_REP_ERR_UNSUP     ((1U << 31) | 1)
+#define TAPDISK_NBD_REP_ERR_POLICY    ((1U << 31) | 2)
+#define TAPDISK_NBD_REP_ERR_INVALID   ((1U << 31) | 3)
+#define TAPDISK_NBD_REP_ERR_TLS_REQD  ((1U << 31) | 5)
+#define TAPDISK_NBD_REP_ERR_TOO_BIG   ((1U << 31) | 9)
+
+#define TAPDISK_NBD_INFO_EXPORT       0
+#define TAPDISK_NBD_INFO_BLOCK_SIZE   3
+
+#define TAPDISK_NBD_REPLY_FLAG_DONE   (1 << 0)
+
+enum {
+	TAPDISK_NBD_REPLY_TYPE_NONE = 0,
+	TAPDISK_NBD_REPLY_TYPE_OFFSET_DATA = 1,
+	TAPDISK_NBD_REPLY_TYPE_OFFSET_HOLE = 2,
+	TAPDISK_NBD_REPLY_TYPE_BLOCK_STATUS = 5,
+	TAPDISK_NBD_REPLY_TYPE_ERROR = (1 << 15) | 1
+};
+
+/* base:allocation block status flags */
+#define TAPDISK_NBD_STATE_HOLE        (1 << 0)
+#define TAPDISK_NBD_STATE_ZERO        (1 << 1)
+
+#define TAPDISK_NBD_META_BASE_ALLOCATION    "base:allocation"
+#define TAPDISK_NBD_META_BASE_ALLOCATION_ID 1
+
+struct nbd_opt_header {
+	uint64_t magic;
+	uint32_t option;
+	uint32_t length;
+} __attribute__ ((packed));
+
+struct nbd_opt_reply {
+	uint64_t magic;
+	uint32_t option;
+	uint32_t type;
+	uint32_t length;
+} __attribute__ ((packed));
+
 struct nbd_request {
 	uint32_t magic;
 	uint32_t type;	
@@ -65,11 +144,59 @@ struct nbd_reply {
 	char handle[8];		
 };
 
+struct nbd_structured_reply {
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	char handle[8];
+	uint32_t length;
+} __attribute__ ((packed));
+
+struct nbd_block_descriptor {
+	uint32_t length;
+	uint32_t flags;
+} __attribute__ ((packed));
+
 
 #define TAPDISK_NBDSERVER_MAX_PATH_LEN 256
 #define TAPDISK_NBDCLIENT_LISTEN_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbdclient"
 #define TAPDISK_NBDSERVER_LISTEN_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbdserver"
 #define TAPDISK_NBDSERVER_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbd"
+#define TAPDISK_NBDSERVER_BACKUP_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbd-backup"
+
+/**
+ * Prefix of the fd receiver message that hands over an already negotiated
+ * client, followed by its negotiated options.
+ */
+#define TAPDISK_NBD_HANDOFF_MSG "handoff"
+
+/**
+ * Read cache, for exports of read-only images such as snapshots being
+ * backed up: full pages of completed reads, by page index, evicted least
+ * recently used first once their size reaches the budget
+ * (TAPDISK3_NBD_READ_CACHE_KB). Cleared when the VBD pauses.
+ */
+typedef struct td_nbdserver_cpage td_nbdserver_cpage_t;
+
+struct td_nbdserver_cpage {
+	uint64_t                idx;
+	char                   *buf;
+	struct list_head        lru;
+	td_nbdserver_cpage_t   *hnext;
+};
+
+struct td_nbdserver_cache {
+	uint64_t                budget;
+	uint64_t                bytes;
+	unsigned int            n_buckets;
+	td_nbdserver_cpage_t  **buckets;
+	struct list_head        lru;
+
+	unsigned long long      hits;
+	unsigned long long      misses;
+	unsigned long long      inserts;
+	unsigned long long      evictions;
+};
 
 struct td_nbdserver {
 	td_vbd_t               *vbd;
@@ -109,18 +236,63 @@ struct td_nbdserver {
 
 	struct list_head        clients;
 
-	stats_t                 nbd_stats;
-};
-
-struct td_nbdserver_client {
+	/**
+	 * Request pool shared by all the clients.
+	 */
 	int                     n_reqs;
 	td_nbdserver_req_t     *reqs;
 	struct td_iovec        *iovecs;
 	int                     n_reqs_free;
 	td_nbdserver_req_t    **reqs_free;
 
+	/**
+	 * Writes in flight, oldest first, and the flushes waiting for them.
+	 */
+	struct list_head        writes;
+	struct list_head        flushes;
+	uint64_t                write_seq;
+
+	/**
+	 * Data buffers held by requests, capped at max_inflight_bytes
+	 * (TAPDISK3_NBD_MAX_INFLIGHT) before clients stop reading.
+	 */
+	uint64_t                inflight_bytes;
+	uint64_t                max_inflight_bytes;
+	int                     n_throttled;
+
+	stats_t                 nbd_stats;
+
+	struct td_nbdserver_cache cache;
+
+	/**
+	 * Greet clients with the oldstyle handshake (TAPDISK3_NBD_OLDSTYLE).
+	 */
+	bool                    oldstyle;
+
+	/**
+	 * Read-only export of the VBD as it was when a backup started, see
+	 * tapdisk-backup.h. Its counters are kept here, not published.
+	 */
+	struct td_backup       *backup;
+	struct stats            backup_stats;
+};
+
+struct td_nbdserver_client {
+	int                     n_reqs_pending;
+
 	int                     client_fd;
 	int                     client_event_id;
+	int                     sched_event_id;
+
+	/**
+	 * Receive buffer, holding rbuf_len bytes from rbuf_off on, and the
+	 * write whose payload is still being received.
+	 */
+	char                   *rbuf;
+	size_t                  rbuf_off;
+	size_t                  rbuf_len;
+	td_nbdserver_req_t     *rx_req;
+	uint32_t                rx_done;
 
 	td_nbdserver_t         *server;
 	struct list_head        clientlist;
@@ -128,10 +300,35 @@ struct td_nbdserver_client {
 	int                     paused;
 
 	bool                    dead;
+
+	/**
+	 * Stopped reading because the server is full.
+	 */
+	bool                    throttled;
+
+	/**
+	 * Negotiated with the fixed newstyle handshake.
+	 */
+	bool                    newstyle;
+	bool                    no_zeroes;
+	bool                    structured;
+	bool                    meta_allocation;
+
+	/**
+	 * Upgraded with NBD_OPT_STARTTLS, the socket is kernel TLS.
+	 */
+	bool                    tls;
 };
 
 td_nbdserver_t *tapdisk_nbdserver_alloc(td_vbd_t *, td_disk_info_t);
 
+/**
+ * Allocates the server of a backup export, on its own socket and without
+ * fd receiver.
+ */
+td_nbdserver_t *tapdisk_nbdserver_alloc_backup(td_vbd_t *, td_disk_info_t,
+		struct td_backup *);
+
 /**
  * Listen for connections on a TCP socket at the specified port.
  */
@@ -143,16 +340,25 @@ int tapdisk_nbdserver_listen_inet(td_nbdserver_t *server, const int port);
 int tapdisk_nbdserver_listen_unix(td_nbdserver_t *server);
 
 void tapdisk_nbdserver_free(td_nbdserver_t *);
+void tapdisk_nbdserver_stats(td_nbdserver_t *, td_stats_t *);
 void tapdisk_nbdserver_pause(td_nbdserver_t *, bool log);
 int tapdisk_nbdserver_unpause(td_nbdserver_t *);
 
+/**
+ * Hands the connected clients over to the NBD server of tapdisk @pid,
+ * minor @minor, through its fd receiver, so they carry on without
+ * reconnecting. The VBD must be paused. Clients with a partly received
+ * request stay here. Returns the number handed over.
+ */
+int tapdisk_nbdserver_handoff(td_nbdserver_t *, pid_t pid, int minor);
+
 /**
  * Callback to be executed when the client socket becomes ready. It is the core
  * NBD server function that deals with NBD client requests (e.g. I/O read,
  * I/O write, disconnect, etc.).
  */
 void tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data);
-int tapdisk_nbdserver_reqs_init(td_nbdserver_client_t *client, int n_reqs);
+int tapdisk_nbdserver_reqs_init(td_nbdserver_t *server, int n_reqs);
 
 /**
  * Deallocates the NBD client. If the client has pending requests, the client
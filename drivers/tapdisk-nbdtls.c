@@ -0,0 +1,278 @@
+/* 
+ * Unix domain socket fd receiver
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "tapdisk.h"
+#include "tapdisk-log.h"
+#include "tapdisk-nbdtls.h"
+
+#define INFO(_f, _a...)            tlog_syslog(TLOG_INFO, "nbd-tls: " _f, ##_a)
+#define ERR(_f, _a...)             tlog_syslog(TLOG_WARN, "nbd-tls: " _f, ##_a)
+
+#define TAPDISK_NBD_TLS_TIMEOUT 10
+
+/* the offloadable suites */
+#define TAPDISK_NBD_TLS_CIPHERS "ECDHE+AESGCM:ECDHE+CHACHA20"
+
+static SSL_CTX *tls_ctx[2];
+
+static const char *
+tapdisk_nbd_tls_cert(void)
+{
+	return getenv("TAPDISK3_NBD_TLS_CERT");
+}
+
+static const char *
+tapdisk_nbd_tls_key(void)
+{
+	return getenv("TAPDISK3_NBD_TLS_KEY");
+}
+
+static const char *
+tapdisk_nbd_tls_ca(void)
+{
+	return getenv("TAPDISK3_NBD_TLS_CA");
+}
+
+int
+tapdisk_nbd_tls_enabled(int role)
+{
+	if (role == TAPDISK_NBD_TLS_SERVER)
+		return tapdisk_nbd_tls_cert() && tapdisk_nbd_tls_key();
+
+	return !!tapdisk_nbd_tls_ca();
+}
+
+static void
+tapdisk_nbd_tls_log_errors(const char *what)
+{
+	unsigned long e;
+	char buf[256];
+
+	while ((e = ERR_get_error())) {
+		ERR_error_string_n(e, buf, sizeof(buf));
+		ERR("%s: %s", what, buf);
+	}
+}
+
+/*
+ * Pinned to TLS 1.2 without tickets or renegotiation: the kernel hands
+ * any record which is not application data back as an error, and the
+ * OpenSSL we build against only offloads the receive side of 1.2.
+ */
+static SSL_CTX *
+tapdisk_nbd_tls_ctx(int role)
+{
+	const char *cert, *key, *ca;
+	SSL_CTX *ctx;
+
+	if (tls_ctx[role])
+		return tls_ctx[role];
+
+	ctx = SSL_CTX_new(role == TAPDISK_NBD_TLS_SERVER ?
+			  TLS_server_method() : TLS_client_method());
+	if (!ctx)
+		goto fail;
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_TICKET |
+			    SSL_OP_NO_RENEGOTIATION);
+
+	if (!SSL_CTX_set_cipher_list(ctx, TAPDISK_NBD_TLS_CIPHERS))
+		goto fail;
+
+	cert = tapdisk_nbd_tls_cert();
+	key  = tapdisk_nbd_tls_key();
+	ca   = tapdisk_nbd_tls_ca();
+
+	if (cert && key) {
+		if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+		    SSL_CTX_use_PrivateKey_file(ctx, key,
+						SSL_FILETYPE_PEM) != 1 ||
+		    SSL_CTX_check_private_key(ctx) != 1)
+			goto fail;
+	}
+
+	if (ca) {
+		if (SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1)
+			goto fail;
+
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER |
+				   SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+	}
+
+	tls_ctx[role] = ctx;
+	return ctx;
+
+fail:
+	tapdisk_nbd_tls_log_errors("setting up the context");
+	SSL_CTX_free(ctx);
+	return NULL;
+}
+
+static int
+tapdisk_nbd_tls_verify_peer(SSL *ssl, const char *peer)
+{
+	X509_VERIFY_PARAM *param = SSL_get0_param(ssl);
+	struct in6_addr addr;
+	int ok;
+
+	if (inet_pton(AF_INET, peer, &addr) == 1 ||
+	    inet_pton(AF_INET6, peer, &addr) == 1)
+		ok = X509_VERIFY_PARAM_set1_ip_asc(param, peer);
+	else
+		ok = X509_VERIFY_PARAM_set1_host(param, peer, 0);
+
+	return ok == 1 ? 0 : -EINVAL;
+}
+
+int
+tapdisk_nbd_tls_start(int fd, int role, const char *peer, SSL **pssl)
+{
+	SSL_CTX *ctx;
+	SSL *ssl;
+
+	ctx = tapdisk_nbd_tls_ctx(role);
+	if (!ctx)
+		return -EINVAL;
+
+	ssl = SSL_new(ctx);
+	if (!ssl)
+		return -ENOMEM;
+
+	if (SSL_set_fd(ssl, fd) != 1)
+		goto fail;
+
+	if (role == TAPDISK_NBD_TLS_SERVER)
+		SSL_set_accept_state(ssl);
+	else
+		SSL_set_connect_state(ssl);
+
+	if (peer && role == TAPDISK_NBD_TLS_CLIENT &&
+	    tapdisk_nbd_tls_verify_peer(ssl, peer))
+		goto fail;
+
+	*pssl = ssl;
+	return 0;
+
+fail:
+	SSL_free(ssl);
+	return -EINVAL;
+}
+
+int
+tapdisk_nbd_tls_step(SSL *ssl)
+{
+	int rc;
+
+	rc = SSL_do_handshake(ssl);
+	if (rc != 1) {
+		switch (SSL_get_error(ssl, rc)) {
+		case SSL_ERROR_WANT_READ:
+			return TAPDISK_NBD_TLS_WANT_READ;
+		case SSL_ERROR_WANT_WRITE:
+			return TAPDISK_NBD_TLS_WANT_WRITE;
+		}
+
+		ERR("Handshake failed (%d)", SSL_get_error(ssl, rc));
+		tapdisk_nbd_tls_log_errors("handshake");
+		return -ECONNREFUSED;
+	}
+
+	/*
+	 * Without both halves in the kernel the data path would have to go
+	 * through SSL_read and SSL_write, which it does not.
+	 */
+	if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+	    !BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+		ERR("Kernel TLS is not available for %s",
+		    SSL_get_cipher_name(ssl));
+		return -EOPNOTSUPP;
+	}
+
+	INFO("Established %s over kernel TLS", SSL_get_cipher_name(ssl));
+	return 0;
+}
+
+void
+tapdisk_nbd_tls_free(SSL *ssl)
+{
+	/* the socket BIO does not close the fd, and the keys stay in it */
+	SSL_free(ssl);
+}
+
+int
+tapdisk_nbd_tls_handshake(int fd, int role, const char *peer)
+{
+	struct timeval tv, rcv_tv, snd_tv;
+	socklen_t len;
+	SSL *ssl;
+	int err;
+
+	/* nothing bounds a stalled handshake otherwise */
+	len = sizeof(rcv_tv);
+	getsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rcv_tv, &len);
+	len = sizeof(snd_tv);
+	getsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &snd_tv, &len);
+
+	tv.tv_sec  = TAPDISK_NBD_TLS_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	err = tapdisk_nbd_tls_start(fd, role, peer, &ssl);
+	if (err)
+		goto out;
+
+	/* a blocking socket only wants more when it timed out */
+	err = tapdisk_nbd_tls_step(ssl);
+	if (err > 0) {
+		ERR("Handshake timed out");
+		err = -ETIMEDOUT;
+	}
+
+	tapdisk_nbd_tls_free(ssl);
+
+out:
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rcv_tv, sizeof(rcv_tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &snd_tv, sizeof(snd_tv));
+	return err;
+}
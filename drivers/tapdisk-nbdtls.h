@@ -0,0 +1,77 @@
+/* 
+ * Unix domain socket fd receiver
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_NBDTLS_H_
+#define _TAPDISK_NBDTLS_H_
+
+/*
+ * TLS for NBD connections, started by NBD_OPT_STARTTLS during the
+ * negotiation. Only the handshake happens in user space: once it is done
+ * the keys are handed to the kernel, and the socket carries plain send and
+ * recv calls from then on.
+ *
+ * The server side is enabled by TAPDISK3_NBD_TLS_CERT and
+ * TAPDISK3_NBD_TLS_KEY, the client side by TAPDISK3_NBD_TLS_CA.
+ * A server with a CA also asks clients for a certificate, a client with a
+ * certificate and key presents them.
+ */
+
+#define TAPDISK_NBD_TLS_CLIENT 0
+#define TAPDISK_NBD_TLS_SERVER 1
+
+#define TAPDISK_NBD_TLS_WANT_READ  1
+#define TAPDISK_NBD_TLS_WANT_WRITE 2
+
+struct ssl_st;
+
+int tapdisk_nbd_tls_enabled(int role);
+
+/*
+ * Runs the handshake on a blocking socket. When peer is given the server
+ * certificate must match that host name or address. Returns 0 once both
+ * directions of the socket are offloaded, or a negative error; the
+ * connection is unusable after a failure.
+ */
+int tapdisk_nbd_tls_handshake(int fd, int role, const char *peer);
+
+/*
+ * The same handshake on a non-blocking socket, one step per readiness
+ * notification. tapdisk_nbd_tls_step returns 0 once the socket is
+ * offloaded, TAPDISK_NBD_TLS_WANT_READ or TAPDISK_NBD_TLS_WANT_WRITE when
+ * it has to be called again after the socket became ready, or a negative
+ * error. The session is released with tapdisk_nbd_tls_free either way.
+ */
+int tapdisk_nbd_tls_start(int fd, int role, const char *peer,
+			  struct ssl_st **pssl);
+int tapdisk_nbd_tls_step(struct ssl_st *ssl);
+void tapdisk_nbd_tls_free(struct ssl_st *ssl);
+
+#endif /* _TAPDISK_NBDTLS_H_ */
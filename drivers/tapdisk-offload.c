@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "tapdisk.h"
+#include "tapdisk-server.h"
+#include "tapdisk-log.h"
+#include "tapdisk-offload.h"
+#include "scheduler.h"
+#include "timeout-math.h"
+
+#define INFO(_f, _a...)            tlog_syslog(TLOG_INFO, "offload: " _f, ##_a)
+#define ERR(_f, _a...)             tlog_syslog(TLOG_WARN, "offload: " _f, ##_a)
+
+#define BUG_ON(_cond)              if (unlikely(_cond)) { td_panic(); }
+
+struct td_offload {
+	int                         fd;
+	event_id_t                  id;
+
+	pthread_mutex_t             lock;
+	struct list_head            done;
+	int                         pending;
+};
+
+struct td_offload_pool {
+	pthread_once_t              once;
+	pthread_mutex_t             lock;
+	pthread_cond_t              cond;
+	struct list_head            queue;
+
+	int                         nr_threads;
+	pthread_t                   threads[TD_OFFLOAD_MAX_THREADS];
+};
+
+static struct td_offload_pool pool = {
+	.once  = PTHREAD_ONCE_INIT,
+	.lock  = PTHREAD_MUTEX_INITIALIZER,
+	.cond  = PTHREAD_COND_INITIALIZER,
+	.queue = LIST_HEAD_INIT(pool.queue),
+};
+
+static void
+tapdisk_offload_post(td_offload_work_t *work)
+{
+	td_offload_t *chan = work->channel;
+	uint64_t val = 1;
+	int empty;
+
+	pthread_mutex_lock(&chan->lock);
+	empty = list_empty(&chan->done);
+	list_add_tail(&work->entry, &chan->done);
+	pthread_mutex_unlock(&chan->lock);
+
+	if (empty && write(chan->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		ERR("failed to wake event loop: %d\n", errno);
+}
+
+static void *
+tapdisk_offload_thread(void *arg)
+{
+	int idx = (int)(intptr_t)arg;
+	td_offload_work_t *work;
+
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+		while (list_empty(&pool.queue))
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		work = list_entry(pool.queue.next, td_offload_work_t, entry);
+		list_del(&work->entry);
+		pthread_mutex_unlock(&pool.lock);
+
+		work->fn(work, idx);
+		tapdisk_offload_post(work);
+	}
+
+	return NULL;
+}
+
+static void
+tapdisk_offload_start(void)
+{
+	const char *val;
+	sigset_t set, old;
+	long cpus;
+	int i, n, err;
+
+	val = getenv("TAPDISK3_OFFLOAD_THREADS");
+	if (val)
+		n = atoi(val);
+	else {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = cpus > 0 ? cpus : 1;
+	}
+
+	if (n <= 0)
+		return;
+	if (n > TD_OFFLOAD_MAX_THREADS)
+		n = TD_OFFLOAD_MAX_THREADS;
+
+	/* signals are for the event loops */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < n; i++) {
+		err = pthread_create(&pool.threads[i], NULL,
+				     tapdisk_offload_thread, (void *)(intptr_t)i);
+		if (err) {
+			ERR("failed to start thread %d: %d\n", i, err);
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	/*
+	 * Users size per-thread state by the thread count, so it is set
+	 * once, before anyone gets to see it.
+	 */
+	pool.nr_threads = i;
+	if (i)
+		INFO("started %d threads\n", i);
+}
+
+int
+tapdisk_offload_threads(void)
+{
+	pthread_once(&pool.once, tapdisk_offload_start);
+	return pool.nr_threads;
+}
+
+static void
+tapdisk_offload_event(event_id_t id __attribute__((unused)),
+		      char mode __attribute__((unused)), void *private)
+{
+	td_offload_t *chan = private;
+	td_offload_work_t *work, *next;
+	struct list_head done;
+	uint64_t val;
+
+	if (read(chan->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		ERR("failed to read wakeup: %d\n", errno);
+
+	INIT_LIST_HEAD(&done);
+
+	pthread_mutex_lock(&chan->lock);
+	list_splice(&chan->done, &done);
+	INIT_LIST_HEAD(&chan->done);
+	pthread_mutex_unlock(&chan->lock);
+
+	list_for_each_entry_safe(work, next, &done, entry) {
+		list_del(&work->entry);
+		chan->pending--;
+		work->done(work);
+	}
+}
+
+td_offload_t *
+tapdisk_offload_open(void)
+{
+	td_offload_t *chan;
+	int err;
+
+	if (!tapdisk_offload_threads())
+		return NULL;
+
+	chan = calloc(1, sizeof(*chan));
+	if (!chan)
+		return NULL;
+
+	INIT_LIST_HEAD(&chan->done);
+	pthread_mutex_init(&chan->lock, NULL);
+
+	chan->fd = eventfd(0, 0);
+	if (chan->fd == -1)
+		goto fail;
+
+	if (fcntl(chan->fd, F_SETFL, O_NONBLOCK) == -1)
+		goto fail;
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD, chan->fd,
+					    TV_ZERO, tapdisk_offload_event, chan);
+	if (err < 0)
+		goto fail;
+	chan->id = err;
+
+	return chan;
+
+fail:
+	ERR("failed to open channel: %d\n", errno);
+	if (chan->fd >= 0)
+		close(chan->fd);
+	pthread_mutex_destroy(&chan->lock);
+	free(chan);
+	return NULL;
+}
+
+void
+tapdisk_offload_close(td_offload_t *chan)
+{
+	if (!chan)
+		return;
+
+	BUG_ON(chan->pending);
+
+	tapdisk_server_unregister_event(chan->id);
+	close(chan->fd);
+	pthread_mutex_destroy(&chan->lock);
+	free(chan);
+}
+
+void
+tapdisk_offload_queue(td_offload_t *chan, td_offload_work_t *work)
+{
+	BUG_ON(!pool.nr_threads);
+
+	work->channel = chan;
+	chan->pending++;
+
+	pthread_mutex_lock(&pool.lock);
+	list_add_tail(&work->entry, &pool.queue);
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
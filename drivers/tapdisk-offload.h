@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_OFFLOAD_H_
+#define _TAPDISK_OFFLOAD_H_
+
+#include "list.h"
+
+/*
+ * A pool of threads for CPU bound work which should not hold up the
+ * event loops, such as encryption. Work is queued from an event loop
+ * through a channel, which the loop opened beforehand: it runs on a
+ * pool thread, then its done callback runs back on that loop, which
+ * the pool wakes through an eventfd.
+ *
+ * The pool is shared by all event loops of the process and started on
+ * first use, with TAPDISK3_OFFLOAD_THREADS threads (by default one per
+ * CPU, up to TD_OFFLOAD_MAX_THREADS). Zero disables it.
+ */
+
+#define TD_OFFLOAD_MAX_THREADS      8
+
+typedef struct td_offload           td_offload_t;
+typedef struct td_offload_work      td_offload_work_t;
+
+struct td_offload_work {
+	/* on a pool thread, numbered from 0 */
+	void                      (*fn)(td_offload_work_t *, int thread);
+	/* back on the event loop */
+	void                      (*done)(td_offload_work_t *);
+
+	td_offload_t               *channel;
+	struct list_head            entry;
+};
+
+/*
+ * Number of pool threads, starting the pool if need be. 0 if there is
+ * no pool, and work has to be done inline.
+ */
+int tapdisk_offload_threads(void);
+
+/*
+ * A completion channel on the calling event loop. Closed only once all
+ * work queued through it is done.
+ */
+td_offload_t *tapdisk_offload_open(void);
+void tapdisk_offload_close(td_offload_t *);
+
+void tapdisk_offload_queue(td_offload_t *, td_offload_work_t *);
+
+#endif /* _TAPDISK_OFFLOAD_H_ */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_PROBE_H_
+#define _TAPDISK_PROBE_H_
+
+/*
+ * Static probe points (USDT) on the request path, provider "tapdisk",
+ * for bpftrace, BCC or perf to attach to on a running tapdisk:
+ *
+ *   xenblkif_queue    (domid, devid, id, op)   request taken off the ring
+ *   guest_copy        (domid, devid, segs, wr) before the grant copy
+ *   guest_copy_done   (domid, devid, segs, err)
+ *   vbd_issue         (uuid, vreq, op, sec)    VBD request issued
+ *   vbd_complete      (uuid, vreq, error)      all its segments done
+ *   lio_submit        (queued, merged, submitted)
+ *   uring_submit      (queued, merged, submitted)
+ *   vhd_complete      (req, op, sec, err)      VHD data or metadata I/O
+ *
+ * A probe is a nop in place until a tracer attaches. Without
+ * <sys/sdt.h>, probes compile to nothing.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define TD_PROBE0(name)                                         \
+	DTRACE_PROBE(tapdisk, name)
+#define TD_PROBE1(name, a1)                                     \
+	DTRACE_PROBE1(tapdisk, name, a1)
+#define TD_PROBE2(name, a1, a2)                                 \
+	DTRACE_PROBE2(tapdisk, name, a1, a2)
+#define TD_PROBE3(name, a1, a2, a3)                             \
+	DTRACE_PROBE3(tapdisk, name, a1, a2, a3)
+#define TD_PROBE4(name, a1, a2, a3, a4)                         \
+	DTRACE_PROBE4(tapdisk, name, a1, a2, a3, a4)
+#else
+#define TD_PROBE0(name)                                 do { } while (0)
+#define TD_PROBE1(name, a1)                             do { } while (0)
+#define TD_PROBE2(name, a1, a2)                         do { } while (0)
+#define TD_PROBE3(name, a1, a2, a3)                     do { } while (0)
+#define TD_PROBE4(name, a1, a2, a3, a4)                 do { } while (0)
+#endif
+
+#endif /* _TAPDISK_PROBE_H_ */
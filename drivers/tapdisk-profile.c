@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "util.h"
+#include "tapdisk-profile.h"
+
+static const char * const td_profile_stages[TD_PROF_STAGES] = {
+	[TD_PROF_RING]     = "ring",
+	[TD_PROF_GRANT]    = "grant",
+	[TD_PROF_ISSUE]    = "issue",
+	[TD_PROF_QUEUE]    = "queue",
+	[TD_PROF_SUBMIT]   = "submit",
+	[TD_PROF_COMPLETE] = "complete",
+	[TD_PROF_RESPONSE] = "response",
+};
+
+int
+tapdisk_profile_create(td_profile_t **_prof)
+{
+	td_profile_t *prof;
+
+	prof = calloc(1, sizeof(*prof));
+	if (!prof)
+		return -ENOMEM;
+
+	*_prof = prof;
+	return 0;
+}
+
+void
+tapdisk_profile_destroy(td_profile_t *prof)
+{
+	free(prof);
+}
+
+void
+tapdisk_profile_reset(td_profile_t *prof)
+{
+	memset(prof->count, 0, sizeof(prof->count));
+	memset(prof->total, 0, sizeof(prof->total));
+	memset(prof->hist, 0, sizeof(prof->hist));
+}
+
+static int
+tapdisk_profile_bucket(uint64_t ns)
+{
+	int e;
+
+	if (ns < TD_PROF_SUB_BUCKETS)
+		return ns;
+
+	e = 63 - __builtin_clzll(ns);
+	if (e >= TD_PROF_MAX_BITS)
+		return TD_PROF_BUCKETS - 1;
+
+	return TD_PROF_SUB_BUCKETS + (e - TD_PROF_SUB_BITS) * TD_PROF_SUB_BUCKETS
+		+ ((ns >> (e - TD_PROF_SUB_BITS)) & (TD_PROF_SUB_BUCKETS - 1));
+}
+
+/*
+ * Highest duration that falls into the bucket.
+ */
+static uint64_t
+tapdisk_profile_bucket_max(int i)
+{
+	int k, e;
+
+	if (i < TD_PROF_SUB_BUCKETS - 1)
+		return i;
+
+	k = i + 1 - TD_PROF_SUB_BUCKETS;
+	e = k / TD_PROF_SUB_BUCKETS + TD_PROF_SUB_BITS;
+
+	return ((uint64_t)(TD_PROF_SUB_BUCKETS + k % TD_PROF_SUB_BUCKETS)
+		<< (e - TD_PROF_SUB_BITS)) - 1;
+}
+
+void
+__tapdisk_profile_add(td_profile_t *prof, int stage, uint64_t ns)
+{
+	prof->count[stage]++;
+	prof->total[stage] += ns;
+	prof->hist[stage][tapdisk_profile_bucket(ns)]++;
+}
+
+/*
+ * Prints, for each stage seen, the count, the total and the 50th, 99th
+ * and 99.9th percentiles, in ns.
+ */
+void
+tapdisk_profile_stats(td_profile_t *prof, td_stats_t *st)
+{
+	static const int permille[] = { 500, 990, 999 };
+	static const char * const keys[] = { "p50", "p99", "p999" };
+	unsigned int p;
+	int stage, i;
+
+	tapdisk_stats_field(st, "profile", "{");
+	tapdisk_stats_field(st, "enabled", "d", prof->enabled);
+
+	for (stage = 0; stage < TD_PROF_STAGES; stage++) {
+		uint64_t count = prof->count[stage], sum = 0;
+
+		if (!count)
+			continue;
+
+		tapdisk_stats_field(st, td_profile_stages[stage], "{");
+		tapdisk_stats_field(st, "count", "llu",
+				    (unsigned long long)count);
+		tapdisk_stats_field(st, "total_ns", "llu",
+				    (unsigned long long)prof->total[stage]);
+
+		for (i = 0, p = 0; i < TD_PROF_BUCKETS &&
+			     p < ARRAY_SIZE(permille); i++) {
+			sum += prof->hist[stage][i];
+			while (p < ARRAY_SIZE(permille) &&
+			       sum * 1000 >= count * permille[p]) {
+				tapdisk_stats_field(st, keys[p], "llu",
+					(unsigned long long)
+					tapdisk_profile_bucket_max(i));
+				p++;
+			}
+		}
+
+		tapdisk_stats_leave(st, '}');
+	}
+
+	tapdisk_stats_leave(st, '}');
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_PROFILE_H_
+#define _TAPDISK_PROFILE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Per-stage request profile of a VBD. While enabled, each stage a request
+ * goes through adds its duration, in ns of CLOCK_MONOTONIC, to a histogram
+ * of its own, which the VBD stats report as count, total and percentiles.
+ * Started and stopped with tap-ctl profile, or from creation on with
+ * TAPDISK3_PROFILE set. Off, a stage costs a pointer test; on, two clock
+ * reads. Stopping keeps the histograms around for reading.
+ *
+ * Histograms are log-linear like struct blkback_latency, below
+ * TD_PROF_SUB_BUCKETS ns each value has a bucket of its own, above that
+ * each power of two is split into TD_PROF_SUB_BUCKETS buckets.
+ */
+
+enum {
+	TD_PROF_RING,               /* parsing a request off the ring */
+	TD_PROF_GRANT,              /* grant-copying a batch of requests */
+	TD_PROF_ISSUE,              /* issuing a request to the image chain */
+	TD_PROF_QUEUE,              /* a driver queueing a request */
+	TD_PROF_SUBMIT,             /* a tiocb, from queued to submitted */
+	TD_PROF_COMPLETE,           /* a request, from issued to completed */
+	TD_PROF_RESPONSE,           /* pushing a response onto the ring */
+	TD_PROF_STAGES
+};
+
+#define TD_PROF_SUB_BITS            2
+#define TD_PROF_SUB_BUCKETS         (1 << TD_PROF_SUB_BITS)
+#define TD_PROF_MAX_BITS            36 /* about a minute */
+#define TD_PROF_BUCKETS \
+	(TD_PROF_SUB_BUCKETS * (TD_PROF_MAX_BITS - TD_PROF_SUB_BITS + 1))
+
+typedef struct td_profile           td_profile_t;
+
+struct td_profile {
+	int                         enabled;
+
+	uint64_t                    count[TD_PROF_STAGES];
+	uint64_t                    total[TD_PROF_STAGES];
+	uint64_t                    hist[TD_PROF_STAGES][TD_PROF_BUCKETS];
+};
+
+int tapdisk_profile_create(td_profile_t **);
+void tapdisk_profile_destroy(td_profile_t *);
+void tapdisk_profile_reset(td_profile_t *);
+
+void __tapdisk_profile_add(td_profile_t *, int stage, uint64_t ns);
+
+void tapdisk_profile_stats(td_profile_t *, td_stats_t *);
+
+/*
+ * Start of a stage, or 0 while @prof is not enabled.
+ */
+static inline uint64_t
+tapdisk_profile_now(const td_profile_t *prof)
+{
+	struct timespec ts;
+
+	if (likely(!prof || !prof->enabled))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Accounts the stage which started at @start, if it was profiled.
+ */
+static inline void
+tapdisk_profile_add(td_profile_t *prof, int stage, uint64_t start)
+{
+	uint64_t now;
+
+	if (likely(!start))
+		return;
+
+	now = tapdisk_profile_now(prof);
+	if (now)
+		__tapdisk_profile_add(prof, stage, now - start);
+}
+
+#endif /* _TAPDISK_PROFILE_H_ */
@@ -33,18 +33,30 @@
 #endif
 
 #include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <libaio.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
+#include "debug.h"
 #include "tapdisk.h"
 #include "tapdisk-log.h"
 #include "tapdisk-queue.h"
 #include "tapdisk-filter.h"
+#include "tapdisk-probe.h"
 #include "tapdisk-server.h"
+#include "tapdisk-profile.h"
 #include "tapdisk-utils.h"
 #include "timeout-math.h"
 
@@ -62,11 +74,163 @@
  */
 #define REQUEST_ASYNC_FD ((io_context_t)1)
 
+/*
+ * fair dispatch
+ */
+
+#define TQUEUE_FLOW_HASH_SIZE 64
+
+struct tflow {
+	int                   fd;
+	int                   inflight;
+	int                   deficit;
+	int                   depth;
+	struct tlist          deferred;
+	struct list_head      active;
+	struct tflow         *hash_next;
+};
+
+#define tapdisk_queue_fair(q) ((q)->fair_quantum > 0)
+
+/* a tuned flow may run shallower than the queue's fair depth */
+static inline int
+tapdisk_flow_depth(struct tqueue *queue, struct tflow *flow)
+{
+	if (flow->depth > 0 && flow->depth < queue->fair_depth)
+		return flow->depth;
+	return queue->fair_depth;
+}
+
+static struct tflow *
+tapdisk_queue_find_flow(struct tqueue *queue, int fd)
+{
+	struct tflow *flow;
+
+	flow = queue->flows[fd % TQUEUE_FLOW_HASH_SIZE];
+	while (flow && flow->fd != fd)
+		flow = flow->hash_next;
+
+	return flow;
+}
+
+static struct tflow *
+tapdisk_queue_get_flow(struct tqueue *queue, int fd)
+{
+	struct tflow *flow, **bucket;
+
+	flow = tapdisk_queue_find_flow(queue, fd);
+	if (flow)
+		return flow;
+
+	flow = calloc(1, sizeof(*flow));
+	if (!flow)
+		return NULL;
+
+	flow->fd = fd;
+	INIT_LIST_HEAD(&flow->active);
+
+	bucket          = &queue->flows[fd % TQUEUE_FLOW_HASH_SIZE];
+	flow->hash_next = *bucket;
+	*bucket         = flow;
+
+	return flow;
+}
+
+static int
+tapdisk_queue_init_fair(struct tqueue *queue)
+{
+	const char *val;
+	int quantum, share;
+
+	INIT_LIST_HEAD(&queue->flows_active);
+
+	val     = getenv("TAPDISK3_IO_FAIR_QUANTUM");
+	quantum = val ? atoi(val) : 0;
+	if (quantum <= 0)
+		return 0;
+
+	share = 100;
+	val   = getenv("TAPDISK3_IO_FAIR_SHARE");
+	if (val)
+		share = atoi(val);
+	if (share <= 0 || share > 100)
+		share = 100;
+
+	queue->flows = calloc(TQUEUE_FLOW_HASH_SIZE, sizeof(struct tflow *));
+	if (!queue->flows)
+		return -ENOMEM;
+
+	queue->fair_quantum = quantum;
+	queue->fair_depth   = queue->size * share / 100 ? : 1;
+
+	DPRINTF("fair dispatch: quantum %d bytes, depth %d of %d per fd\n",
+		queue->fair_quantum, queue->fair_depth, queue->size);
+
+	return 0;
+}
+
+static void
+tapdisk_queue_free_fair(struct tqueue *queue)
+{
+	struct tflow *flow, *next;
+	int i;
+
+	if (!queue->flows)
+		return;
+
+	for (i = 0; i < TQUEUE_FLOW_HASH_SIZE; i++)
+		for (flow = queue->flows[i]; flow; flow = next) {
+			next = flow->hash_next;
+			free(flow);
+		}
+
+	free(queue->flows);
+	queue->flows = NULL;
+}
+
+static inline void
+tlist_add(struct tlist *list, struct tiocb *tiocb)
+{
+	if (!list->head)
+		list->head = list->tail = tiocb;
+	else
+		list->tail = list->tail->next = tiocb;
+}
+
+static inline struct tiocb *
+tlist_pop(struct tlist *list)
+{
+	struct tiocb *tiocb = list->head;
+
+	if (tiocb) {
+		list->head = tiocb->next;
+		if (!list->head)
+			list->tail = NULL;
+		tiocb->next = NULL;
+	}
+
+	return tiocb;
+}
+
 static inline void
 queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
 	struct iocb *iocb = &tiocb->iocb;
 
+	if (tiocb->prio == TD_PRIO_BACKGROUND)
+		queue->bg_inflight++;
+
+	if (unlikely(tiocb->prof_ts))
+		queue->profiled++;
+
+	if (tapdisk_queue_fair(queue)) {
+		struct tflow *flow;
+
+		flow = tapdisk_queue_find_flow(queue, iocb->aio_fildes);
+		if (flow)
+			flow->inflight++;
+	}
+
 	if (queue->queued) {
 		struct tiocb *prev = (struct tiocb *)
 			queue->iocbs[queue->queued - 1]->data;
@@ -76,21 +240,55 @@ queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 	queue->iocbs[queue->queued++] = iocb;
 }
 
+/*
+ * a tiocb waits behind earlier deferrals of its fd,
+ * and behind the fd's own share of the queue
+ */
 static inline int
-deferred_tiocbs(struct tqueue *queue)
+tapdisk_queue_throttled(struct tqueue *queue, struct tiocb *tiocb)
+{
+	struct tflow *flow;
+
+	if (!tapdisk_queue_fair(queue))
+		return 0;
+
+	flow = tapdisk_queue_get_flow(queue, tiocb->iocb.aio_fildes);
+	if (!flow)
+		return 0;
+
+	return (flow->deferred.head ||
+		flow->inflight >= tapdisk_flow_depth(queue, flow));
+}
+
+static inline void
+tapdisk_queue_complete_flow(struct tqueue *queue, struct tiocb *tiocb)
 {
-	return (queue->deferred.head != NULL);
+	struct tflow *flow;
+
+	if (!tapdisk_queue_fair(queue))
+		return;
+
+	flow = tapdisk_queue_find_flow(queue, tiocb->iocb.aio_fildes);
+	if (flow && flow->inflight > 0)
+		flow->inflight--;
 }
 
 static inline void
 defer_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
-	struct tlist *list = &queue->deferred;
+	struct tflow *flow = NULL;
 
-	if (!list->head)
-		list->head = list->tail = tiocb;
-	else
-		list->tail = list->tail->next = tiocb;
+	if (tapdisk_queue_fair(queue))
+		flow = tapdisk_queue_get_flow(queue, tiocb->iocb.aio_fildes);
+
+	if (flow) {
+		tlist_add(&flow->deferred, tiocb);
+		if (list_empty(&flow->active)) {
+			list_add_tail(&flow->active, &queue->flows_active);
+			queue->flows_nr_active++;
+		}
+	} else
+		tlist_add(&queue->deferred, tiocb);
 
 	queue->tiocbs_deferred++;
 	queue->deferrals++;
@@ -99,25 +297,145 @@ defer_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 static inline void
 queue_deferred_tiocb(struct tqueue *queue)
 {
-	struct tlist *list = &queue->deferred;
+	struct tiocb *tiocb = tlist_pop(&queue->deferred);
+
+	if (tiocb) {
+		queue_tiocb(queue, tiocb);
+		queue->tiocbs_deferred--;
+	}
+}
+
+/*
+ * deficit round robin over fds with deferred tiocbs: each visit
+ * credits a flow with fair_quantum bytes, and a flow at its depth
+ * limit is skipped until its own completions make room.
+ */
+static void
+queue_fair_tiocbs(struct tqueue *queue)
+{
+	struct tflow *flow;
+	struct tiocb *tiocb;
+	int skipped = 0;
 
-	if (list->head) {
-		struct tiocb *tiocb = list->head;
+	while (!tapdisk_queue_full(queue) &&
+	       !list_empty(&queue->flows_active) &&
+	       skipped < queue->flows_nr_active) {
 
-		list->head = tiocb->next;
-		if (!list->head)
-			list->tail = NULL;
+		flow = list_first_entry(&queue->flows_active,
+					struct tflow, active);
+
+		if (flow->inflight >= tapdisk_flow_depth(queue, flow)) {
+			list_move_tail(&flow->active, &queue->flows_active);
+			skipped++;
+			continue;
+		}
+
+		skipped        = 0;
+		flow->deficit += queue->fair_quantum;
+
+		while ((tiocb = flow->deferred.head) &&
+		       tiocb->iocb.u.c.nbytes <= flow->deficit &&
+		       flow->inflight < tapdisk_flow_depth(queue, flow) &&
+		       !tapdisk_queue_full(queue)) {
+			flow->deficit -= tiocb->iocb.u.c.nbytes;
+			queue_tiocb(queue, tlist_pop(&flow->deferred));
+			queue->tiocbs_deferred--;
+		}
+
+		if (!flow->deferred.head) {
+			flow->deficit = 0;
+			list_del_init(&flow->active);
+			queue->flows_nr_active--;
+		} else
+			list_move_tail(&flow->active, &queue->flows_active);
+	}
+}
+
+/*
+ * background dispatch
+ */
+
+static int
+tapdisk_queue_init_background(struct tqueue *queue)
+{
+	const char *val;
+	int share;
+
+	share = 25;
+	val   = getenv("TAPDISK3_IO_BG_SHARE");
+	if (val)
+		share = atoi(val);
+	if (share < 0 || share > 100)
+		share = 25;
+
+	queue->bg_depth = queue->size * share / 100;
+	if (share && !queue->bg_depth)
+		queue->bg_depth = 1;
+
+	if (share != 25)
+		DPRINTF("background I/O: %s%d of %d slots\n",
+			share ? "" : "while idle, ", queue->bg_depth,
+			queue->size);
+
+	return 0;
+}
+
+/*
+ * background tiocbs go when no foreground one waits, and within
+ * their share of the queue
+ */
+static inline int
+tapdisk_queue_bg_busy(struct tqueue *queue)
+{
+	int inflight;
+
+	if (queue->tiocbs_deferred > queue->bg_deferred)
+		return 1;
 
+	if (queue->bg_depth)
+		return queue->bg_inflight >= queue->bg_depth;
+
+	inflight = queue->tiocbs_pending + queue->queued;
+	return inflight > queue->bg_inflight;
+}
+
+static inline void
+__tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
+{
+	if (!tapdisk_queue_full(queue) &&
+	    !tapdisk_queue_throttled(queue, tiocb))
 		queue_tiocb(queue, tiocb);
+	else
+		defer_tiocb(queue, tiocb);
+}
+
+static inline void
+queue_background_tiocbs(struct tqueue *queue)
+{
+	struct tiocb *tiocb;
+
+	while (queue->background.head &&
+	       !tapdisk_queue_full(queue) &&
+	       !tapdisk_queue_bg_busy(queue)) {
+		tiocb = tlist_pop(&queue->background);
+		queue->bg_deferred--;
 		queue->tiocbs_deferred--;
+
+		__tapdisk_queue_tiocb(queue, tiocb);
 	}
 }
 
 static inline void
 queue_deferred_tiocbs(struct tqueue *queue)
 {
-	while (!tapdisk_queue_full(queue) && deferred_tiocbs(queue))
+	/* in fair mode, only tiocbs we failed to track a flow for */
+	while (!tapdisk_queue_full(queue) && queue->deferred.head)
 		queue_deferred_tiocb(queue);
+
+	if (tapdisk_queue_fair(queue))
+		queue_fair_tiocbs(queue);
+
+	queue_background_tiocbs(queue);
 }
 
 /*
@@ -129,6 +447,11 @@ complete_tiocb(struct tqueue *queue, struct tiocb *tiocb, unsigned long res)
 	int err;
 	struct iocb *iocb = &tiocb->iocb;
 
+	tapdisk_queue_complete_flow(queue, tiocb);
+
+	if (tiocb->prio == TD_PRIO_BACKGROUND)
+		queue->bg_inflight--;
+
 	if (res == iocb->u.c.nbytes)
 		err = 0;
 	else if ((int)res < 0)
@@ -179,35 +502,67 @@ fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 }
 
 /*
- * rwio
+ * sort the batch before filtering, while iocb->data still
+ * points at the tiocb, and relink it for cancel_tiocbs
  */
-
-struct rwio {
-	struct io_event *aio_events;
-};
-
 static void
-tapdisk_rwio_destroy(struct tqueue *queue)
+sort_tiocbs(struct tqueue *queue)
 {
-	struct rwio *rwio = queue->tio_data;
+	int i;
+	struct tiocb *tiocb;
 
-	if (rwio->aio_events) {
-		free(rwio->aio_events);
-		rwio->aio_events = NULL;
+	if (queue->sort_window < 2 || queue->queued < 2)
+		return;
+
+	io_sort(queue->iocbs, queue->queued, queue->sort_window);
+
+	for (i = 0; i < queue->queued; i++) {
+		tiocb = queue->iocbs[i]->data;
+		tiocb->next = (i + 1 < queue->queued ?
+			       queue->iocbs[i + 1]->data : NULL);
 	}
 }
 
-static int
-tapdisk_rwio_setup(struct tqueue *queue, int size)
-{
-	struct rwio *rwio = queue->tio_data;
+/*
+ * rwio
+ *
+ * Plain pread/pwrite, for files libaio can't serve. Merged iocbs are
+ * run by a pool of TAPDISK3_RWIO_THREADS threads (RWIO_DEFAULT_THREADS
+ * by default) owned by the queue, which posts their completion to the
+ * event loop, so a slow file holds up neither the loop nor the other
+ * iocbs. Zero threads runs each iocb inline, in
+ * the event loop, as a last resort.
+ */
 
-	rwio->aio_events = calloc(size, sizeof(struct io_event));
-	if (!rwio->aio_events)
-		return -errno;
+#define RWIO_DEFAULT_THREADS    8
+#define RWIO_MAX_THREADS        64
 
-	return 0;
-}
+struct rwio_work {
+	struct iocb      *iocb;
+	long              res;
+	struct list_head  entry;
+};
+
+struct rwio {
+	struct io_event  *aio_events;
+
+	int               nr_threads;
+	pthread_t         threads[RWIO_MAX_THREADS];
+	int               stopping;
+
+	/* protects the lists and stopping */
+	pthread_mutex_t   lock;
+	pthread_cond_t    cond;
+	struct list_head  queued;
+	struct list_head  done;
+
+	struct rwio_work *works;
+	struct list_head  free;
+
+	struct tqueue    *queue;
+	scheduler_t      *sched;
+	scheduler_work_t  reap;
+};
 
 static inline ssize_t
 tapdisk_rwio_rw(const struct iocb *iocb)
@@ -228,70 +583,421 @@ tapdisk_rwio_rw(const struct iocb *iocb)
 	return size;
 }
 
-static int
-tapdisk_rwio_submit(struct tqueue *queue)
+/*
+ * vectored iocbs built by io_merge cover consecutive sectors,
+ * so a single seek serves all segments.
+ */
+static inline ssize_t
+tapdisk_rwio_rwv(const struct iocb *iocb)
 {
-	struct rwio *rwio = queue->tio_data;
-	int i, merged, split;
-	struct iocb *iocb;
-	struct tiocb *tiocb;
-	struct io_event *ep;
+	int i, fd     = iocb->aio_fildes;
+	long long off = iocb->u.c.offset;
+	const struct iovec *vec = iocb->u.c.buf;
+	ssize_t size  = 0;
+	ssize_t (*func)(int, void *, size_t) = 
+		(iocb->aio_lio_opcode == IO_CMD_PWRITEV ? vwrite : read);
 
-	if (!queue->queued)
-		return 0;
+	if (lseek64(fd, off, SEEK_SET) == (off64_t)-1)
+		return -errno;
 
-	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
-	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+	for (i = 0; i < iocb->u.c.nbytes; i++) {
+		if (atomicio(func, fd, vec[i].iov_base,
+			     vec[i].iov_len) != vec[i].iov_len)
+			return -errno;
+		size += vec[i].iov_len;
+	}
 
-	queue->queued = 0;
+	return size;
+}
 
-	for (i = 0; i < merged; i++) {
-		ep      = rwio->aio_events + i;
-		iocb    = queue->iocbs[i];
-		ep->obj = iocb;
-		ep->res = tapdisk_rwio_rw(iocb);
-	}
+/*
+ * pool threads share fds, so they position with pread/pwrite
+ * rather than lseek
+ */
+static ssize_t
+tapdisk_rwio_prw(const struct iocb *iocb)
+{
+	int fd        = iocb->aio_fildes;
+	char *buf     = iocb->u.c.buf;
+	long long off = iocb->u.c.offset;
+	size_t size   = iocb->u.c.nbytes;
+	size_t done   = 0;
+	ssize_t n;
+
+	while (done < size) {
+		if (iocb->aio_lio_opcode == IO_CMD_PWRITE)
+			n = pwrite(fd, buf + done, size - done, off + done);
+		else
+			n = pread(fd, buf + done, size - done, off + done);
+
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -errno;
+		}
 
-	split = io_split(&queue->opioctx, rwio->aio_events, merged);
-	tapdisk_filter_events(queue->filter, rwio->aio_events, split);
+		if (!n)
+			return -EIO;
 
-	for (i = split, ep = rwio->aio_events; i-- > 0; ep++) {
-		iocb  = ep->obj;
-		tiocb = iocb->data;
-		complete_tiocb(queue, tiocb, ep->res);
+		done += n;
 	}
 
-	queue_deferred_tiocbs(queue);
-
-	return split;
+	return size;
 }
 
-static const struct tio td_tio_rwio = {
-	.name        = "rwio",
-	.data_size   = 0,
-	.tio_setup   = tapdisk_rwio_setup,
-	.tio_destroy = tapdisk_rwio_destroy,
-	.tio_submit  = tapdisk_rwio_submit
-};
+static ssize_t
+tapdisk_rwio_prwv(const struct iocb *iocb)
+{
+	const struct iovec *vec = iocb->u.c.buf;
+	struct iocb io = *iocb;
+	ssize_t size = 0, n;
+	int i;
 
-/*
- * libaio
- */
+	io.aio_lio_opcode = (iocb->aio_lio_opcode == IO_CMD_PWRITEV ?
+			     IO_CMD_PWRITE : IO_CMD_PREAD);
 
-struct lio {
-	io_context_t     aio_ctx;
-	struct io_event *aio_events;
+	for (i = 0; i < iocb->u.c.nbytes; i++) {
+		io.u.c.buf    = vec[i].iov_base;
+		io.u.c.nbytes = vec[i].iov_len;
+		io.u.c.offset = iocb->u.c.offset + size;
 
-	int              event_fd;
-	int              event_id;
+		n = tapdisk_rwio_prw(&io);
+		if (n < 0)
+			return n;
 
-	int              flags;
-};
+		size += n;
+	}
 
-#define LIO_FLAG_EVENTFD        (1<<0)
+	return size;
+}
 
-static int
-tapdisk_lio_check_resfd(void)
+static long
+tapdisk_rwio_exec(const struct iocb *iocb, int pooled)
+{
+	switch (iocb->aio_lio_opcode) {
+	case IO_CMD_FDSYNC:
+		return fdatasync(iocb->aio_fildes) ? -errno : 0;
+	case IO_CMD_PREADV:
+	case IO_CMD_PWRITEV:
+		return pooled ? tapdisk_rwio_prwv(iocb) :
+			tapdisk_rwio_rwv(iocb);
+	default:
+		return pooled ? tapdisk_rwio_prw(iocb) :
+			tapdisk_rwio_rw(iocb);
+	}
+}
+
+static void *
+tapdisk_rwio_thread(void *arg)
+{
+	struct rwio *rwio = arg;
+	struct rwio_work *work;
+	int empty;
+
+	pthread_mutex_lock(&rwio->lock);
+
+	for (;;) {
+		while (list_empty(&rwio->queued) && !rwio->stopping)
+			pthread_cond_wait(&rwio->cond, &rwio->lock);
+
+		if (rwio->stopping)
+			break;
+
+		work = list_entry(rwio->queued.next, struct rwio_work, entry);
+		list_del(&work->entry);
+		pthread_mutex_unlock(&rwio->lock);
+
+		work->res = tapdisk_rwio_exec(work->iocb, 1);
+
+		pthread_mutex_lock(&rwio->lock);
+		empty = list_empty(&rwio->done);
+		list_add_tail(&work->entry, &rwio->done);
+
+		if (empty)
+			scheduler_post(rwio->sched, &rwio->reap);
+	}
+
+	pthread_mutex_unlock(&rwio->lock);
+
+	return NULL;
+}
+
+static void
+tapdisk_rwio_reap(scheduler_work_t *reap)
+{
+	struct rwio *rwio = container_of(reap, struct rwio, reap);
+	struct tqueue *queue = rwio->queue;
+	struct rwio_work *work, *next;
+	struct list_head done = LIST_HEAD_INIT(done);
+	int i, n, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+
+	pthread_mutex_lock(&rwio->lock);
+	list_splice(&rwio->done, &done);
+	INIT_LIST_HEAD(&rwio->done);
+	pthread_mutex_unlock(&rwio->lock);
+
+	n = 0;
+	list_for_each_entry_safe(work, next, &done, entry) {
+		ep      = rwio->aio_events + n++;
+		ep->obj = work->iocb;
+		ep->res = work->res;
+		list_move_tail(&work->entry, &rwio->free);
+	}
+
+	split = io_split(&queue->opioctx, rwio->aio_events, n);
+	tapdisk_filter_events(queue->filter, rwio->aio_events, split);
+
+	queue->iocbs_pending  -= n;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = rwio->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static void
+tapdisk_rwio_destroy(struct tqueue *queue)
+{
+	struct rwio *rwio = queue->tio_data;
+	int i;
+
+	if (!rwio)
+		return;
+
+	if (rwio->nr_threads) {
+		pthread_mutex_lock(&rwio->lock);
+		rwio->stopping = 1;
+		pthread_cond_broadcast(&rwio->cond);
+		pthread_mutex_unlock(&rwio->lock);
+
+		for (i = 0; i < rwio->nr_threads; i++)
+			pthread_join(rwio->threads[i], NULL);
+
+		rwio->nr_threads = 0;
+	}
+
+	if (rwio->sched)
+		scheduler_cancel(rwio->sched, &rwio->reap);
+
+	pthread_cond_destroy(&rwio->cond);
+	pthread_mutex_destroy(&rwio->lock);
+
+	free(rwio->works);
+	rwio->works = NULL;
+
+	if (rwio->aio_events) {
+		free(rwio->aio_events);
+		rwio->aio_events = NULL;
+	}
+}
+
+static int
+tapdisk_rwio_setup_pool(struct tqueue *queue, int size)
+{
+	struct rwio *rwio = queue->tio_data;
+	const char *val;
+	sigset_t set, old;
+	int i, n, err;
+
+	n   = RWIO_DEFAULT_THREADS;
+	val = getenv("TAPDISK3_RWIO_THREADS");
+	if (val)
+		n = atoi(val);
+	if (n <= 0)
+		return 0;
+	if (n > RWIO_MAX_THREADS)
+		n = RWIO_MAX_THREADS;
+	if (n > size)
+		n = size;
+
+	rwio->works = calloc(size, sizeof(struct rwio_work));
+	if (!rwio->works)
+		return -errno;
+
+	for (i = 0; i < size; i++)
+		list_add_tail(&rwio->works[i].entry, &rwio->free);
+
+	/* signals are for the event loops */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < n; i++) {
+		err = pthread_create(&rwio->threads[i], NULL,
+				     tapdisk_rwio_thread, rwio);
+		if (err)
+			break;
+		rwio->nr_threads++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (!rwio->nr_threads)
+		return -err;
+
+	DPRINTF("rwio: %d threads\n", rwio->nr_threads);
+
+	return 0;
+}
+
+static int
+tapdisk_rwio_setup(struct tqueue *queue, int size)
+{
+	struct rwio *rwio = queue->tio_data;
+
+	rwio->queue = queue;
+	rwio->sched = tapdisk_server_get_scheduler();
+	scheduler_work_init(&rwio->reap, tapdisk_rwio_reap);
+
+	pthread_mutex_init(&rwio->lock, NULL);
+	pthread_cond_init(&rwio->cond, NULL);
+	INIT_LIST_HEAD(&rwio->queued);
+	INIT_LIST_HEAD(&rwio->done);
+	INIT_LIST_HEAD(&rwio->free);
+
+	rwio->aio_events = calloc(size, sizeof(struct io_event));
+	if (!rwio->aio_events)
+		return -errno;
+
+	/* on failure, tapdisk_queue_free_io cleans up */
+	return tapdisk_rwio_setup_pool(queue, size);
+}
+
+static int
+tapdisk_rwio_submit_pool(struct tqueue *queue, int merged)
+{
+	struct rwio *rwio = queue->tio_data;
+	struct rwio_work *work;
+	int i;
+
+	pthread_mutex_lock(&rwio->lock);
+
+	for (i = 0; i < merged; i++) {
+		/* at most one per tiocb in flight, see tapdisk_queue_full */
+		work = list_first_entry(&rwio->free, struct rwio_work, entry);
+		work->iocb = queue->iocbs[i];
+		list_move_tail(&work->entry, &rwio->queued);
+	}
+
+	if (merged > 1)
+		pthread_cond_broadcast(&rwio->cond);
+	else
+		pthread_cond_signal(&rwio->cond);
+
+	pthread_mutex_unlock(&rwio->lock);
+
+	queue->iocbs_pending  += merged;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	return merged;
+}
+
+static int
+tapdisk_rwio_submit(struct tqueue *queue)
+{
+	struct rwio *rwio = queue->tio_data;
+	int i, merged, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+
+	if (!queue->queued)
+		return 0;
+
+	sort_tiocbs(queue);
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	if (rwio->nr_threads)
+		return tapdisk_rwio_submit_pool(queue, merged);
+
+	queue->queued = 0;
+
+	for (i = 0; i < merged; i++) {
+		ep      = rwio->aio_events + i;
+		iocb    = queue->iocbs[i];
+		ep->obj = iocb;
+		ep->res = tapdisk_rwio_exec(iocb, 0);
+	}
+
+	split = io_split(&queue->opioctx, rwio->aio_events, merged);
+	tapdisk_filter_events(queue->filter, rwio->aio_events, split);
+
+	for (i = split, ep = rwio->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+
+	return split;
+}
+
+static const struct tio td_tio_rwio = {
+	.name        = "rwio",
+	.data_size   = sizeof(struct rwio),
+	.tio_setup   = tapdisk_rwio_setup,
+	.tio_destroy = tapdisk_rwio_destroy,
+	.tio_submit  = tapdisk_rwio_submit
+};
+
+/*
+ * libaio
+ */
+
+struct lio {
+	io_context_t     aio_ctx;
+	struct io_event *aio_events;
+
+	int              event_fd;
+	int              event_id;
+
+	int              flags;
+
+	/*
+	 * Adaptive completion polling: after a completion wakeup, keep
+	 * harvesting for up to poll_duration microseconds without going
+	 * back to the eventfd, as long as the host has idle CPU to spare.
+	 */
+	int              poll_duration; /* microseconds; 0 means no polling */
+	int              poll_idle_threshold;
+	int              in_polling;
+	event_id_t       chkevt_event;
+	event_id_t       stoppolling_event;
+};
+
+#define LIO_FLAG_EVENTFD        (1<<0)
+
+#define LIO_POLL_IDLE_THRESHOLD 50
+
+/*
+ * Layout of the completion ring libaio maps into user space; io_context_t
+ * points at it. Peeking at head/tail spares an io_getevents() syscall per
+ * empty poll.
+ */
+struct lio_aio_ring {
+	unsigned int     id;
+	unsigned int     nr;
+	unsigned int     head;
+	unsigned int     tail;
+	unsigned int     magic;
+	unsigned int     compat_features;
+	unsigned int     incompat_features;
+	unsigned int     header_length;
+};
+
+#define LIO_AIO_RING_MAGIC      0xa10a10a1
+
+static int
+tapdisk_lio_check_resfd(void)
 {
 	return tapdisk_linux_version() >= KERNEL_VERSION(2, 6, 22);
 }
@@ -370,194 +1076,766 @@ tapdisk_lio_setup_aio(struct tqueue *queue, int qlen)
 	struct lio *lio = queue->tio_data;
 	int err, old_err = 0;
 
-	lio->aio_ctx  =  0;
-	lio->event_fd = -1;
+	lio->aio_ctx  =  0;
+	lio->event_fd = -1;
+
+	/*
+	 * prefer the mainline eventfd(2) api, if available.
+	 * if not, fall back to the poll fd patch.
+	 */
+
+	err = !tapdisk_lio_check_resfd();
+	if (!err)
+		err = old_err = __lio_setup_aio_eventfd(queue, qlen);
+	if (err)
+		err = __lio_setup_aio_poll(queue, qlen);
+
+	/* __lio_setup_aio_poll seems to always fail with EINVAL on newer systems,
+	 * probably because it initializes the output parameter of io_setup to a
+	 * non-zero value and the kernel patch that understands this is missing */
+	if (err == -EAGAIN || (err && old_err == -EAGAIN))
+		goto fail_rsv;
+fail:
+	return err;
+
+fail_rsv:
+	EPRINTF("Couldn't setup AIO context. If you are trying to "
+		"concurrently use a large number of blktap-based disks, you may "
+		"need to increase the system-wide aio request limit. "
+		"(e.g. 'echo 1048576 > /proc/sys/fs/aio-max-nr')\n");
+	goto fail;
+}
+
+
+static void
+tapdisk_lio_destroy(struct tqueue *queue)
+{
+	struct lio *lio = queue->tio_data;
+
+	if (!lio)
+		return;
+
+	if (lio->event_id >= 0) {
+		tapdisk_server_unregister_event(lio->event_id);
+		lio->event_id = -1;
+	}
+
+	if (lio->chkevt_event >= 0) {
+		tapdisk_server_unregister_event(lio->chkevt_event);
+		lio->chkevt_event = -1;
+	}
+
+	if (lio->stoppolling_event >= 0) {
+		tapdisk_server_unregister_event(lio->stoppolling_event);
+		lio->stoppolling_event = -1;
+	}
+
+	tapdisk_lio_destroy_aio(queue);
+
+	if (lio->aio_events) {
+		free(lio->aio_events);
+		lio->aio_events = NULL;
+	}
+}
+
+static void
+tapdisk_lio_set_eventfd(struct tqueue *queue, int n, struct iocb **iocbs)
+{
+	struct lio *lio = queue->tio_data;
+	int i;
+
+	if (lio->flags & LIO_FLAG_EVENTFD)
+		for (i = 0; i < n; ++i)
+			__io_set_eventfd(iocbs[i], lio->event_fd);
+}
+
+static void
+tapdisk_lio_ack_event(struct tqueue *queue)
+{
+	struct lio *lio = queue->tio_data;
+	uint64_t val;
+
+	if (lio->flags & LIO_FLAG_EVENTFD) {
+		int gcc = read(lio->event_fd, &val, sizeof(val));
+		if (gcc) {};
+	}
+}
+
+/*
+ * Returns true if the kernel completion ring is known to be empty.
+ */
+static inline int
+tapdisk_lio_ring_empty(struct lio *lio)
+{
+	struct lio_aio_ring *ring = (struct lio_aio_ring *)lio->aio_ctx;
+
+	if (!ring || ring->magic != LIO_AIO_RING_MAGIC)
+		return 0;
+
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+		__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static int
+tapdisk_lio_reap(struct tqueue *queue)
+{
+	struct lio *lio;
+	int i, ret, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+
+	lio   = queue->tio_data;
+	/* io_getevents() invoked via the libaio wrapper does not set errno but
+	 * instead returns -errno on error */
+	while ((ret = io_getevents(lio->aio_ctx, 0, queue->size, lio->aio_events, NULL)) < 0) {
+		/* Permit some errors to retry */
+		if (ret == -EINTR) continue;
+		ERR(ret, "io_getevents() non-retryable error");
+		return ret;
+	}
+	split = io_split(&queue->opioctx, lio->aio_events, ret);
+	tapdisk_filter_events(queue->filter, lio->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = lio->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+
+	return ret;
+}
+
+static void
+tapdisk_lio_set_polling(struct tqueue *queue, int on)
+{
+	struct lio *lio = queue->tio_data;
+	int err;
+
+	lio->in_polling = on;
+
+	/* while polling, completions are harvested without the eventfd */
+	tapdisk_server_mask_event(lio->event_id, on);
+
+	err = tapdisk_server_event_set_timeout(lio->chkevt_event,
+					       on ? TV_ZERO : TV_INF);
+	ASSERT(!err);
+
+	err = tapdisk_server_event_set_timeout(lio->stoppolling_event,
+					       on ? TV_USECS(lio->poll_duration)
+					       : TV_INF);
+	ASSERT(!err);
+}
+
+static void
+tapdisk_lio_start_polling(struct tqueue *queue)
+{
+	struct lio *lio = queue->tio_data;
+
+	/* Only enter polling if the CPU we run on is not too busy */
+	if (tapdisk_server_local_idle_cpu() > (float)lio->poll_idle_threshold &&
+	    !tapdisk_server_cpu_contended())
+		tapdisk_lio_set_polling(queue, 1);
+}
+
+static void
+tapdisk_lio_cb_chkevt(event_id_t id __attribute__((unused)),
+		      char mode __attribute__((unused)), void *private)
+{
+	struct tqueue *queue = private;
+	struct lio *lio = queue->tio_data;
+	int err;
+
+	if (!queue->iocbs_pending) {
+		/* nothing in flight, nothing to wait for */
+		tapdisk_lio_set_polling(queue, 0);
+		return;
+	}
+
+	if (tapdisk_lio_ring_empty(lio))
+		return;
+
+	if (tapdisk_lio_reap(queue) > 0) {
+		/* We found completions, so keep polling some more */
+		err = tapdisk_server_event_set_timeout(lio->stoppolling_event,
+					TV_USECS(lio->poll_duration));
+		ASSERT(!err);
+	}
+}
+
+static void
+tapdisk_lio_cb_stoppolling(event_id_t id __attribute__((unused)),
+			   char mode __attribute__((unused)), void *private)
+{
+	struct tqueue *queue = private;
+
+	/* anything completing from now on is signalled by the eventfd */
+	tapdisk_lio_set_polling(queue, 0);
+	tapdisk_lio_reap(queue);
+}
+
+static void
+tapdisk_lio_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct lio *lio = queue->tio_data;
+	int ret;
+
+	tapdisk_lio_ack_event(queue);
+
+	ret = tapdisk_lio_reap(queue);
+
+	if (ret > 0 && lio->poll_duration && !lio->in_polling &&
+	    queue->iocbs_pending)
+		tapdisk_lio_start_polling(queue);
+}
+
+static int
+tapdisk_lio_setup_polling(struct tqueue *queue)
+{
+	struct lio *lio = queue->tio_data;
+	const char *val;
+
+	lio->poll_duration       = 0;
+	lio->poll_idle_threshold = LIO_POLL_IDLE_THRESHOLD;
+
+	val = getenv("TAPDISK3_AIO_POLL_US");
+	if (val)
+		lio->poll_duration = atoi(val);
+	if (lio->poll_duration <= 0) {
+		lio->poll_duration = 0;
+		return 0;
+	}
+
+	val = getenv("TAPDISK3_AIO_POLL_IDLE");
+	if (val)
+		lio->poll_idle_threshold = atoi(val);
+
+	lio->chkevt_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+					      TV_INF, tapdisk_lio_cb_chkevt,
+					      queue);
+	if (lio->chkevt_event < 0)
+		return lio->chkevt_event;
+
+	lio->stoppolling_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+					      TV_INF, tapdisk_lio_cb_stoppolling,
+					      queue);
+	if (lio->stoppolling_event < 0)
+		return lio->stoppolling_event;
+
+	DPRINTF("aio completion polling: %dus, idle threshold %d%%\n",
+		lio->poll_duration, lio->poll_idle_threshold);
+
+	return 0;
+}
+
+static int
+tapdisk_lio_setup(struct tqueue *queue, int qlen)
+{
+	struct lio *lio = queue->tio_data;
+	int err;
+
+	lio->event_id          = -1;
+	lio->chkevt_event      = -1;
+	lio->stoppolling_event = -1;
+
+	err = tapdisk_lio_setup_aio(queue, qlen);
+	if (err)
+		goto fail;
+
+	lio->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      lio->event_fd, TV_ZERO,
+					      tapdisk_lio_event,
+					      queue);
+	err = lio->event_id;
+	if (err < 0)
+		goto fail;
+
+	lio->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!lio->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = tapdisk_lio_setup_polling(queue);
+	if (err)
+		goto fail;
+
+	return 0;
+
+fail:
+	tapdisk_lio_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_lio_submit(struct tqueue *queue)
+{
+	struct lio *lio = queue->tio_data;
+	int merged, submitted, err = 0;
+
+	if (!queue->queued)
+		return 0;
+
+	sort_tiocbs(queue);
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged    = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+	tapdisk_lio_set_eventfd(queue, merged, queue->iocbs);
+	submitted = io_submit(lio->aio_ctx, merged, queue->iocbs);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+	TD_PROBE3(lio_submit, queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = submitted;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -= 
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static const struct tio td_tio_lio = {
+	.name        = "lio",
+	.data_size   = sizeof(struct lio),
+	.tio_setup   = tapdisk_lio_setup,
+	.tio_destroy = tapdisk_lio_destroy,
+	.tio_submit  = tapdisk_lio_submit,
+};
+
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * io_uring
+ *
+ * Merged iocbs are translated to SQEs, so filtering, merging and splitting
+ * work exactly as for libaio. Completions are signalled through an eventfd
+ * registered with the ring.
+ */
+
+struct uring {
+	int                  ring_fd;
+	int                  event_fd;
+	event_id_t           event_id;
+	int                  flags;
+
+	unsigned int         sq_entries;
+	unsigned int        *sq_head;
+	unsigned int        *sq_tail;
+	unsigned int        *sq_mask;
+	unsigned int        *sq_flags;
+	unsigned int        *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned int        *cq_head;
+	unsigned int        *cq_tail;
+	unsigned int        *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void                *sq_ring;
+	size_t               sq_ring_size;
+	void                *cq_ring;
+	size_t               cq_ring_size;
+	size_t               sqes_size;
+
+	struct io_event     *aio_events;
+};
 
-	/*
-	 * prefer the mainline eventfd(2) api, if available.
-	 * if not, fall back to the poll fd patch.
-	 */
+#define URING_FLAG_SQPOLL       (1<<0)
 
-	err = !tapdisk_lio_check_resfd();
-	if (!err)
-		err = old_err = __lio_setup_aio_eventfd(queue, qlen);
-	if (err)
-		err = __lio_setup_aio_poll(queue, qlen);
+#define URING_SQPOLL_IDLE_MS    2000
 
-	/* __lio_setup_aio_poll seems to always fail with EINVAL on newer systems,
-	 * probably because it initializes the output parameter of io_setup to a
-	 * non-zero value and the kernel patch that understands this is missing */
-	if (err == -EAGAIN || (err && old_err == -EAGAIN))
-		goto fail_rsv;
-fail:
-	return err;
+static inline int
+__uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
 
-fail_rsv:
-	EPRINTF("Couldn't setup AIO context. If you are trying to "
-		"concurrently use a large number of blktap-based disks, you may "
-		"need to increase the system-wide aio request limit. "
-		"(e.g. 'echo 1048576 > /proc/sys/fs/aio-max-nr')\n");
-	goto fail;
+static inline int
+__uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+	      unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
 }
 
+static inline int
+__uring_register(int fd, unsigned int opcode, void *arg,
+		 unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
 
 static void
-tapdisk_lio_destroy(struct tqueue *queue)
+tapdisk_uring_destroy(struct tqueue *queue)
 {
-	struct lio *lio = queue->tio_data;
+	struct uring *uring = queue->tio_data;
 
-	if (!lio)
+	if (!uring)
 		return;
 
-	if (lio->event_id >= 0) {
-		tapdisk_server_unregister_event(lio->event_id);
-		lio->event_id = -1;
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
 	}
 
-	tapdisk_lio_destroy_aio(queue);
+	if (uring->sqes) {
+		munmap(uring->sqes, uring->sqes_size);
+		uring->sqes = NULL;
+	}
 
-	if (lio->aio_events) {
-		free(lio->aio_events);
-		lio->aio_events = NULL;
+	if (uring->cq_ring) {
+		munmap(uring->cq_ring, uring->cq_ring_size);
+		uring->cq_ring = NULL;
 	}
-}
 
-static void
-tapdisk_lio_set_eventfd(struct tqueue *queue, int n, struct iocb **iocbs)
-{
-	struct lio *lio = queue->tio_data;
-	int i;
+	if (uring->sq_ring) {
+		munmap(uring->sq_ring, uring->sq_ring_size);
+		uring->sq_ring = NULL;
+	}
 
-	if (lio->flags & LIO_FLAG_EVENTFD)
-		for (i = 0; i < n; ++i)
-			__io_set_eventfd(iocbs[i], lio->event_fd);
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+		uring->ring_fd = -1;
+	}
+
+	if (uring->event_fd >= 0) {
+		close(uring->event_fd);
+		uring->event_fd = -1;
+	}
+
+	free(uring->aio_events);
+	uring->aio_events = NULL;
 }
 
-static void
-tapdisk_lio_ack_event(struct tqueue *queue)
+static int
+tapdisk_uring_setup_ring(struct tqueue *queue, int qlen)
 {
-	struct lio *lio = queue->tio_data;
-	uint64_t val;
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params p;
+	const char *sqpoll;
+	void *ptr;
+	int err;
 
-	if (lio->flags & LIO_FLAG_EVENTFD) {
-		int gcc = read(lio->event_fd, &val, sizeof(val));
-		if (gcc) {};
+	memset(&p, 0, sizeof(p));
+
+	sqpoll = getenv("TAPDISK3_URING_SQPOLL");
+	if (sqpoll && strcmp(sqpoll, "0")) {
+		p.flags          |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle  = URING_SQPOLL_IDLE_MS;
+	}
+
+	uring->ring_fd = __uring_setup(qlen, &p);
+	if (uring->ring_fd < 0 && (p.flags & IORING_SETUP_SQPOLL)) {
+		DPRINTF("io_uring SQPOLL unavailable (%s), "
+			"falling back to syscall submission\n",
+			strerror(errno));
+		memset(&p, 0, sizeof(p));
+		uring->ring_fd = __uring_setup(qlen, &p);
 	}
+	if (uring->ring_fd < 0)
+		return -errno;
+
+	if (p.flags & IORING_SETUP_SQPOLL)
+		uring->flags |= URING_FLAG_SQPOLL;
+
+	uring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	uring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	uring->sqes_size    = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ptr = mmap(NULL, uring->sq_ring_size, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	uring->sq_ring = ptr;
+
+	ptr = mmap(NULL, uring->cq_ring_size, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, uring->ring_fd, IORING_OFF_CQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	uring->cq_ring = ptr;
+
+	ptr = mmap(NULL, uring->sqes_size, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	uring->sqes = ptr;
+
+	uring->sq_entries = p.sq_entries;
+	uring->sq_head    = uring->sq_ring + p.sq_off.head;
+	uring->sq_tail    = uring->sq_ring + p.sq_off.tail;
+	uring->sq_mask    = uring->sq_ring + p.sq_off.ring_mask;
+	uring->sq_flags   = uring->sq_ring + p.sq_off.flags;
+	uring->sq_array   = uring->sq_ring + p.sq_off.array;
+
+	uring->cq_head    = uring->cq_ring + p.cq_off.head;
+	uring->cq_tail    = uring->cq_ring + p.cq_off.tail;
+	uring->cq_mask    = uring->cq_ring + p.cq_off.ring_mask;
+	uring->cqes       = uring->cq_ring + p.cq_off.cqes;
+
+	return 0;
+
+fail:
+	err = -errno;
+	return err;
 }
 
 static void
-tapdisk_lio_event(event_id_t id, char mode, void *private)
+tapdisk_uring_event(event_id_t id, char mode, void *private)
 {
 	struct tqueue *queue = private;
-	struct lio *lio;
-	int i, ret, split;
+	struct uring *uring = queue->tio_data;
+	unsigned int head, tail, mask;
+	int i, n, split;
 	struct iocb *iocb;
 	struct tiocb *tiocb;
 	struct io_event *ep;
+	uint64_t val;
 
-	tapdisk_lio_ack_event(queue);
+	n = read(uring->event_fd, &val, sizeof(val));
+	if (n) {};
 
-	lio   = queue->tio_data;
-	/* io_getevents() invoked via the libaio wrapper does not set errno but
-	 * instead returns -errno on error */
-	while ((ret = io_getevents(lio->aio_ctx, 0, queue->size, lio->aio_events, NULL)) < 0) {
-		/* Permit some errors to retry */
-		if (ret == -EINTR) continue;
-		ERR(ret, "io_getevents() non-retryable error");
-		return;
-	}
-	split = io_split(&queue->opioctx, lio->aio_events, ret);
-	tapdisk_filter_events(queue->filter, lio->aio_events, split);
+	mask = *uring->cq_mask;
 
-	DBG("events: %d, tiocbs: %d\n", ret, split);
+	do {
+		head = *uring->cq_head;
+		tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
 
-	queue->iocbs_pending  -= ret;
-	queue->tiocbs_pending -= split;
+		for (n = 0; head != tail && n < queue->size; head++, n++) {
+			struct io_uring_cqe *cqe = &uring->cqes[head & mask];
 
-	for (i = split, ep = lio->aio_events; i-- > 0; ep++) {
-		iocb  = ep->obj;
-		tiocb = iocb->data;
-		complete_tiocb(queue, tiocb, ep->res);
-	}
+			ep       = uring->aio_events + n;
+			ep->obj  = (struct iocb *)(uintptr_t)cqe->user_data;
+			ep->res  = (long)cqe->res;
+			ep->res2 = 0;
+		}
+
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (!n)
+			break;
+
+		split = io_split(&queue->opioctx, uring->aio_events, n);
+		tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+		DBG("events: %d, tiocbs: %d\n", n, split);
+
+		queue->iocbs_pending  -= n;
+		queue->tiocbs_pending -= split;
+
+		for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+			iocb  = ep->obj;
+			tiocb = iocb->data;
+			complete_tiocb(queue, tiocb, ep->res);
+		}
+	} while (head != tail);
 
 	queue_deferred_tiocbs(queue);
 }
 
 static int
-tapdisk_lio_setup(struct tqueue *queue, int qlen)
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
 {
-	struct lio *lio = queue->tio_data;
+	struct uring *uring = queue->tio_data;
 	int err;
 
-	lio->event_id = -1;
+	uring->ring_fd  = -1;
+	uring->event_fd = -1;
+	uring->event_id = -1;
 
-	err = tapdisk_lio_setup_aio(queue, qlen);
+	err = tapdisk_uring_setup_ring(queue, qlen);
 	if (err)
 		goto fail;
 
-	lio->event_id =
+	uring->event_fd = tapdisk_sys_eventfd(0);
+	if (uring->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = __uring_register(uring->ring_fd, IORING_REGISTER_EVENTFD,
+			       &uring->event_fd, 1);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	uring->event_id =
 		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-					      lio->event_fd, TV_ZERO,
-					      tapdisk_lio_event,
+					      uring->event_fd, TV_ZERO,
+					      tapdisk_uring_event,
 					      queue);
-	err = lio->event_id;
+	err = uring->event_id;
 	if (err < 0)
 		goto fail;
 
-	lio->aio_events = calloc(qlen, sizeof(struct io_event));
-	if (!lio->aio_events) {
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->aio_events) {
 		err = -errno;
 		goto fail;
 	}
 
+	DPRINTF("io_uring: %u entries%s\n", uring->sq_entries,
+		uring->flags & URING_FLAG_SQPOLL ? ", sqpoll" : "");
+
 	return 0;
 
 fail:
-	tapdisk_lio_destroy(queue);
+	tapdisk_uring_destroy(queue);
 	return err;
 }
 
+static void
+tapdisk_uring_prep_sqe(struct io_uring_sqe *sqe, struct iocb *iocb)
+{
+	memset(sqe, 0, sizeof(*sqe));
+
+	sqe->fd        = iocb->aio_fildes;
+	sqe->user_data = (uintptr_t)iocb;
+
+	switch (iocb->aio_lio_opcode) {
+	case IO_CMD_PWRITE:
+		sqe->opcode = IORING_OP_WRITE;
+		break;
+	case IO_CMD_FSYNC:
+		sqe->opcode = IORING_OP_FSYNC;
+		return;
+	case IO_CMD_FDSYNC:
+		sqe->opcode      = IORING_OP_FSYNC;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		return;
+	case IO_CMD_PREADV:
+	case IO_CMD_PWRITEV:
+		sqe->opcode = (iocb->aio_lio_opcode == IO_CMD_PWRITEV ?
+			       IORING_OP_WRITEV : IORING_OP_READV);
+		sqe->addr   = (uintptr_t)iocb->u.c.buf;
+		sqe->len    = iocb->u.c.nbytes;
+		sqe->off    = iocb->u.c.offset;
+		return;
+	default:
+		sqe->opcode = IORING_OP_READ;
+		break;
+	}
+
+	sqe->addr = (uintptr_t)iocb->u.c.buf;
+	sqe->len  = iocb->u.c.nbytes;
+	sqe->off  = iocb->u.c.offset;
+}
+
+/*
+ * The SQ had no room for the rest of the batch, which happens mostly
+ * under SQPOLL while the kernel thread catches up: split what was left
+ * back into the queue, in order, for the next pass.
+ */
 static int
-tapdisk_lio_submit(struct tqueue *queue)
+tapdisk_uring_requeue(struct tqueue *queue, int submitted, int merged)
 {
-	struct lio *lio = queue->tio_data;
-	int merged, submitted, err = 0;
+	struct tiocb *tiocb;
+	int i;
+
+	queue->queued = io_expand_iocbs(&queue->opioctx,
+					queue->iocbs, submitted, merged);
+
+	for (i = 0; i < queue->queued; i++) {
+		tiocb = queue->iocbs[i]->data;
+		tiocb->next = (i + 1 < queue->queued ?
+			       queue->iocbs[i + 1]->data : NULL);
+	}
+
+	return queue->queued;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	unsigned int head, tail, mask, space;
+	int i, n, merged, submitted, err = 0;
 
 	if (!queue->queued)
 		return 0;
 
+	sort_tiocbs(queue);
 	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
-	merged    = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
-	tapdisk_lio_set_eventfd(queue, merged, queue->iocbs);
-	submitted = io_submit(lio->aio_ctx, merged, queue->iocbs);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	mask  = *uring->sq_mask;
+	tail  = *uring->sq_tail;
+	head  = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	space = uring->sq_entries - (tail - head);
+
+	n = merged < space ? merged : space;
+
+	for (i = 0; i < n; i++, tail++) {
+		unsigned int idx = tail & mask;
+
+		tapdisk_uring_prep_sqe(&uring->sqes[idx], queue->iocbs[i]);
+		uring->sq_array[idx] = idx;
+	}
+
+	__atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	if (uring->flags & URING_FLAG_SQPOLL) {
+		submitted = n;
+		if (__atomic_load_n(uring->sq_flags, __ATOMIC_ACQUIRE) &
+		    IORING_SQ_NEED_WAKEUP)
+			__uring_enter(uring->ring_fd, 0, 0,
+				      IORING_ENTER_SQ_WAKEUP);
+	} else {
+		submitted = __uring_enter(uring->ring_fd, n, 0, 0);
+		if (submitted < 0) {
+			err = -errno;
+			submitted = 0;
+		}
+
+		/* take back whatever the kernel did not consume */
+		*uring->sq_tail = tail - (n - submitted);
+	}
 
 	DBG("queued: %d, merged: %d, submitted: %d\n",
 	    queue->queued, merged, submitted);
-
-	if (submitted < 0) {
-		err = submitted;
-		submitted = 0;
-	} else if (submitted < merged)
-		err = -EIO;
+	TD_PROBE3(uring_submit, queue->queued, merged, submitted);
 
 	queue->iocbs_pending  += submitted;
 	queue->tiocbs_pending += queue->queued;
 	queue->queued          = 0;
 
 	if (err)
-		queue->tiocbs_pending -= 
+		queue->tiocbs_pending -=
 			fail_tiocbs(queue, submitted, merged, err);
+	else if (submitted < merged)
+		queue->tiocbs_pending -=
+			tapdisk_uring_requeue(queue, submitted, merged);
 
 	return submitted;
 }
 
-static const struct tio td_tio_lio = {
-	.name        = "lio",
-	.data_size   = sizeof(struct lio),
-	.tio_setup   = tapdisk_lio_setup,
-	.tio_destroy = tapdisk_lio_destroy,
-	.tio_submit  = tapdisk_lio_submit,
+static const struct tio td_tio_uring = {
+	.name        = "uring",
+	.data_size   = sizeof(struct uring),
+	.tio_setup   = tapdisk_uring_setup,
+	.tio_destroy = tapdisk_uring_destroy,
+	.tio_submit  = tapdisk_uring_submit,
 };
+#endif /* HAVE_LINUX_IO_URING_H */
 
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
@@ -587,6 +1865,11 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef HAVE_LINUX_IO_URING_H
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -620,6 +1903,7 @@ int
 tapdisk_init_queue(struct tqueue *queue, int size,
 		   int drv, struct tfilter *filter)
 {
+	const char *val;
 	int err;
 
 	memset(queue, 0, sizeof(struct tqueue));
@@ -644,6 +1928,23 @@ tapdisk_init_queue(struct tqueue *queue, int size,
 	if (err)
 		goto fail;
 
+	val = getenv("TAPDISK3_IO_SORT_WINDOW");
+	if (val)
+		queue->sort_window = atoi(val);
+	if (queue->sort_window < 2)
+		queue->sort_window = 0;
+	else
+		DPRINTF("sorting submissions in windows of %d iocbs\n",
+			queue->sort_window);
+
+	err = tapdisk_queue_init_fair(queue);
+	if (err)
+		goto fail;
+
+	err = tapdisk_queue_init_background(queue);
+	if (err)
+		goto fail;
+
 	return 0;
 
  fail:
@@ -660,6 +1961,8 @@ tapdisk_free_queue(struct tqueue *queue)
 	queue->iocbs = NULL;
 
 	opio_free(&queue->opioctx);
+
+	tapdisk_queue_free_fair(queue);
 }
 
 void 
@@ -672,17 +1975,29 @@ tapdisk_debug_queue(struct tqueue *queue)
 	     "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %"PRIx64"\n",
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
 	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
+	WARN("background: inflight: %d, deferred: %d, depth: %d\n",
+	     queue->bg_inflight, queue->bg_deferred, queue->bg_depth);
 
 	if (tiocb) {
 		WARN("deferred:\n");
 		for (; tiocb != NULL; tiocb = tiocb->next) {
 			struct iocb *io = &tiocb->iocb;
 			WARN("%s of %lu bytes at %lld\n",
-			     (io->aio_lio_opcode == IO_CMD_PWRITE ?
-			      "write" : "read"),
+			     (io->aio_lio_opcode == IO_CMD_PWRITE ? "write" :
+			      io->aio_lio_opcode == IO_CMD_FDSYNC ? "fdsync" :
+			      "read"),
 			     io->u.c.nbytes, io->u.c.offset);
 		}
 	}
+
+	if (tapdisk_queue_fair(queue)) {
+		struct tflow *flow;
+
+		list_for_each_entry(flow, &queue->flows_active, active)
+			WARN("fd %d: inflight: %d, deficit: %d, deferred: %s\n",
+			     flow->fd, flow->inflight, flow->deficit,
+			     flow->deferred.head ? "yes" : "no");
+	}
 }
 
 void
@@ -702,33 +2017,110 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 	tiocb->next = NULL;
 }
 
+/*
+ * Syncs the data written to fd so far. Completes with no bytes
+ * transferred, which is success.
+ */
+void
+tapdisk_prep_fdsync_tiocb(struct tiocb *tiocb, int fd,
+			  td_queue_callback_t cb, void *arg)
+{
+	struct iocb *iocb = &tiocb->iocb;
+
+	io_prep_fdsync(iocb, fd);
+
+	iocb->data  = tiocb;
+	tiocb->cb   = cb;
+	tiocb->arg  = arg;
+	tiocb->next = NULL;
+}
+
+/*
+ * Caps what the queue merges for fd at max_bytes and, under fair
+ * dispatch, the fd's inflight tiocbs at depth. Zero lifts a limit;
+ * both are lifted before fd is closed, as fds are reused.
+ */
+int
+tapdisk_queue_tune_fd(struct tqueue *queue, int fd,
+		      unsigned long max_bytes, int depth)
+{
+	struct tflow *flow;
+	int err;
+
+	err = opio_set_merge_limit(&queue->opioctx, fd, max_bytes);
+	if (err)
+		return err;
+
+	if (!tapdisk_queue_fair(queue))
+		return 0;
+
+	flow = depth ? tapdisk_queue_get_flow(queue, fd) :
+		tapdisk_queue_find_flow(queue, fd);
+	if (flow)
+		flow->depth = depth;
+	else if (depth)
+		return -ENOMEM;
+
+	return 0;
+}
+
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
-	if (!tapdisk_queue_full(queue))
-		queue_tiocb(queue, tiocb);
-	else
-		defer_tiocb(queue, tiocb);
+	if (tiocb->prio == TD_PRIO_BACKGROUND &&
+	    (queue->background.head || tapdisk_queue_bg_busy(queue))) {
+		tlist_add(&queue->background, tiocb);
+		queue->bg_deferred++;
+		queue->tiocbs_deferred++;
+		queue->deferrals++;
+		return;
+	}
+
+	__tapdisk_queue_tiocb(queue, tiocb);
 }
 
 
+/*
+ * Accounts the wait of the queued tiocbs, before merging loses track of
+ * them.
+ */
+static void
+tapdisk_queue_profile_submit(struct tqueue *queue)
+{
+	struct tiocb *tiocb;
+	int i;
+
+	for (i = 0; i < queue->queued; i++) {
+		tiocb = queue->iocbs[i]->data;
+		tapdisk_profile_add(tiocb->profile, TD_PROF_SUBMIT,
+				    tiocb->prof_ts);
+	}
+
+	queue->profiled = 0;
+}
+
 /*
  * fail_tiocbs may queue more tiocbs
  */
 int
 tapdisk_submit_tiocbs(struct tqueue *queue)
 {
+	if (unlikely(queue->profiled))
+		tapdisk_queue_profile_submit(queue);
+
 	return queue->tio->tio_submit(queue);
 }
 
 int
 tapdisk_submit_all_tiocbs(struct tqueue *queue)
 {
-	int submitted = 0;
+	int submitted = 0, n;
 
+	/* what the engine had no room for waits for the next pass */
 	do {
-		submitted += tapdisk_submit_tiocbs(queue);
-	} while (!tapdisk_queue_empty(queue));
+		n = tapdisk_submit_tiocbs(queue);
+		submitted += n;
+	} while (n && !tapdisk_queue_empty(queue));
 
 	return submitted;
 }
@@ -35,8 +35,10 @@
 
 #include "io-optimize.h"
 #include "scheduler.h"
+#include "list.h"
 
 struct tiocb;
+struct tflow;
 struct tfilter;
 
 typedef void (*td_queue_callback_t)(void *arg, struct tiocb *, int err);
@@ -45,6 +47,10 @@ typedef void (*td_queue_callback_t)(void *arg, struct tiocb *, int err);
 struct tiocb {
 	td_queue_callback_t   cb;
 	void                 *arg;
+	int                   prio;  /* TD_PRIO_* */
+
+	struct td_profile    *profile;
+	uint64_t              prof_ts; /* queued, while profiling */
 
 	struct iocb           iocb;
 	struct tiocb         *next;
@@ -83,6 +89,29 @@ struct tqueue {
 	/* optional tapdisk filter */
 	struct tfilter       *filter;
 
+	/* iocbs sorted by (fd, offset) per submission, 0 to disable */
+	int                   sort_window;
+
+	/* optional fair dispatch: with a non-zero quantum, tiocbs are
+	 * deferred per fd and requeued in deficit-round-robin order,
+	 * and no fd may occupy more than fair_depth slots. */
+	int                   fair_quantum;
+	int                   fair_depth;
+	struct tflow        **flows;
+	struct list_head      flows_active;
+	int                   flows_nr_active;
+
+	/* background tiocbs wait in their own list behind deferred
+	 * foreground ones, and may occupy at most bg_depth slots; with
+	 * a bg_depth of 0, only while no foreground tiocb is in flight */
+	int                   bg_depth;
+	int                   bg_inflight;
+	int                   bg_deferred;
+	struct tlist          background;
+
+	/* queued tiocbs which account their submission to a profile */
+	int                   profiled;
+
 	uint64_t              deferrals;
 };
 
@@ -98,6 +127,7 @@ struct tio {
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3,
 };
 
 /*
@@ -117,11 +147,15 @@ int tapdisk_init_queue(struct tqueue *, int size, int drv, struct tfilter *);
 void tapdisk_free_queue(struct tqueue *);
 void tapdisk_debug_queue(struct tqueue *);
 void tapdisk_queue_tiocb(struct tqueue *, struct tiocb *);
+int tapdisk_queue_tune_fd(struct tqueue *, int fd,
+			  unsigned long max_bytes, int depth);
 int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
 int tapdisk_cancel_tiocbs(struct tqueue *);
 int tapdisk_cancel_all_tiocbs(struct tqueue *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
+void tapdisk_prep_fdsync_tiocb(struct tiocb *, int,
+			       td_queue_callback_t, void *);
 
 #endif
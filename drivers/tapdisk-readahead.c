@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <limits.h>
+#include <string.h>
+
+#include "tapdisk-readahead.h"
+
+#define MIN(a, b)                  ((a) < (b) ? (a) : (b))
+#define MAX(a, b)                  ((a) > (b) ? (a) : (b))
+
+void
+tapdisk_readahead_init(td_readahead_t *ra, td_sector_t size, int min, int max)
+{
+	memset(ra, 0, sizeof(*ra));
+	ra->size = size;
+	ra->min  = min;
+	ra->max  = max;
+}
+
+static td_readahead_stream_t *
+tapdisk_readahead_find(td_readahead_t *ra, td_vbd_t *vbd, td_sector_t sec)
+{
+	td_readahead_stream_t *s, *lru;
+	int i;
+
+	lru = NULL;
+
+	for (i = 0; i < TD_READAHEAD_STREAMS; i++) {
+		s = &ra->streams[i];
+
+		/* reads may skip a little into what was read ahead */
+		if (s->vbd == vbd &&
+		    sec >= s->next && sec <= MAX(s->next, s->ahead))
+			return s;
+
+		if (!lru || s->used < lru->used)
+			lru = s;
+	}
+
+	lru->vbd    = vbd;
+	lru->next   = sec;
+	lru->ahead  = sec;
+	lru->window = ra->min;
+	lru->seq    = 0;
+
+	return lru;
+}
+
+int
+tapdisk_readahead_update(td_readahead_t *ra, td_vbd_t *vbd,
+			 td_sector_t sec, int secs, int limit,
+			 td_sector_t *ra_sec)
+{
+	td_readahead_stream_t *s;
+	int n;
+
+	s = tapdisk_readahead_find(ra, vbd, sec);
+
+	s->used  = ++ra->clock;
+	s->next  = sec + secs;
+	s->ahead = MAX(s->ahead, s->next);
+
+	if (++s->seq <= TD_READAHEAD_TRIGGER)
+		return 0;
+
+	if (s->ahead - s->next > s->window / 2)
+		return 0;
+
+	limit = MIN(limit, MIN(ra->size - s->ahead, INT_MAX));
+	if (limit < s->window) {
+		s->window = MAX(ra->min, s->window / 2);
+		if (limit < ra->min)
+			return 0;
+	}
+
+	n = MIN(s->window, limit);
+
+	*ra_sec    = s->ahead;
+	s->ahead  += n;
+	s->window  = MIN(s->window * 2, ra->max);
+	ra->issued += n;
+
+	return n;
+}
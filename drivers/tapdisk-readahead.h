@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_READAHEAD_H_
+#define _TAPDISK_READAHEAD_H_
+
+#include "tapdisk.h"
+
+/*
+ * Sequential stream detection, for caches reading ahead of the guest.
+ * A few streams are tracked per cache, each by VBD and the sector it
+ * should continue at. Once a stream has been seen reading on
+ * sequentially, readahead is issued half a window ahead of it, and the
+ * window doubles each time, from min up to max sectors. The caller
+ * passes how much it can take at the moment: the window shrinks back
+ * when that is less, so readahead backs off under cache pressure.
+ */
+
+#define TD_READAHEAD_STREAMS        8
+#define TD_READAHEAD_TRIGGER        2 /* sequential reads */
+
+typedef struct td_readahead         td_readahead_t;
+typedef struct td_readahead_stream  td_readahead_stream_t;
+
+struct td_readahead_stream {
+	td_vbd_t                   *vbd;
+	td_sector_t                 next;   /* where the stream goes on */
+	td_sector_t                 ahead;  /* end of the readahead issued */
+	int                         window; /* sectors */
+	int                         seq;
+	unsigned int                used;
+};
+
+struct td_readahead {
+	td_readahead_stream_t       streams[TD_READAHEAD_STREAMS];
+	td_sector_t                 size;
+	int                         min;
+	int                         max;
+	unsigned int                clock;
+
+	uint64_t                    issued; /* sectors */
+};
+
+void tapdisk_readahead_init(td_readahead_t *, td_sector_t size,
+			    int min, int max);
+
+/*
+ * Feeds a guest read to the detector. Returns how many sectors to read
+ * ahead from *sec, no more than limit, or 0.
+ */
+int tapdisk_readahead_update(td_readahead_t *, td_vbd_t *,
+			     td_sector_t sec, int secs, int limit,
+			     td_sector_t *ra_sec);
+
+#endif /* _TAPDISK_READAHEAD_H_ */
@@ -0,0 +1,1047 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Emulates a blkfront in-process, so that the ring handling of td-ctx and
+ * td-req can be measured without a guest:
+ *
+ *   tapdisk-ringbench -n ram:/path -b 4 -d 32 -R -t 10
+ *   tapdisk-ringbench -n vhd:/path/leaf.vhd -b 44 -d 64 -r 20000 -p 100
+ *
+ * The program is linked with --wrap for the grant table, event channel and
+ * ioctl entry points the backend uses (see Makefile.am). Guest memory is a
+ * memfd: grant reference N is its page N, grant mappings map those pages
+ * and IOCTL_GNTDEV_GRANT_COPY copies from or to them. The ring is connected
+ * with the real tapdisk_xenblkif_connect(), kicks reach
+ * tapdisk_xenio_ctx_process_ring() through an eventfd and backend
+ * notifications raise a second eventfd the frontend reaps responses on.
+ * Everything between the two is the code that runs against a real guest.
+ *
+ * Writes are only issued with -w, as they overwrite the image. With -P,
+ * the L1 data and last level cache read misses of the run are counted in
+ * user space, which is where ring and request handling happen, and
+ * reported per request.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#ifdef __linux__
+#include <linux/version.h>
+#endif
+
+#include "debug.h"
+#include "scheduler.h"
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "timeout-math.h"
+#include "td-blkif.h"
+#include "td-ctx.h"
+#include "td-req.h"
+
+#define BUG_ON(_cond)                    if (unlikely(_cond)) { td_panic(); }
+
+#define TD_RINGBENCH_POOL                "td-ringbench"
+#define TD_RINGBENCH_PORT                1
+#define TD_RINGBENCH_MAX_ORDER           3
+#define TD_RINGBENCH_TICK_US             1000
+#define TD_RINGBENCH_PERF_EVENTS         2
+
+typedef struct tapdisk_ringbench td_ringbench_t;
+
+struct tapdisk_ringbench {
+	const char                      *name;
+	td_vbd_t                        *vbd;
+	int                              devid;
+
+	/* workload */
+	td_sector_t                      size;
+	int                              nr_segs;
+	int                              order;
+	int                              depth;
+	int                              random;
+	int                              read_pct;
+	uint64_t                         rate;
+	uint64_t                         count;
+	uint64_t                         duration;
+	int                              poll_duration;
+	uint64_t                         rng;
+
+	/* guest side */
+	int                              mem_fd;
+	void                            *mem;
+	size_t                           mem_pages;
+	blkif_front_ring_t               front;
+	int                              ring_size;
+	uint64_t                        *start;
+	int                             *free_ids;
+	int                              n_free;
+	int                              kick_fd;
+	int                              irq_fd;
+	event_id_t                       irq_event;
+	event_id_t                       tick_event;
+
+	/* backend side */
+	struct td_xenio_ctx             *ctx;
+	struct td_xenblkif              *blkif;
+
+	/* state */
+	int                              err;
+	int                              inflight;
+	td_sector_t                      next;
+	uint64_t                         issued;
+	uint64_t                         t_start;
+	uint64_t                         t_end;
+
+	/* results */
+	uint64_t                         reads;
+	uint64_t                         writes;
+	uint64_t                         lat_sum;
+	uint64_t                         lat_max;
+	uint64_t                         kicks;
+	uint64_t                         process_ring;
+	uint64_t                         notifies;
+	uint64_t                         irqs;
+	uint64_t                         gcopies;
+	uint64_t                         gcopy_segs;
+	uint64_t                         maps;
+
+	/* cache misses, with -P */
+	int                              perf;
+	int                              perf_fd[TD_RINGBENCH_PERF_EVENTS];
+	uint64_t                         perf_val[TD_RINGBENCH_PERF_EVENTS];
+};
+
+static char *program;
+static td_ringbench_t ringbench;
+
+static void
+usage(FILE *stream)
+{
+	fprintf(stream, "usage: %s <-n type:/path/to/image> "
+		"[-b block size in KiB, multiple of 4 (default 4, max %d)] "
+		"[-d queue depth (default 32, max ring size)] "
+		"[-o ring order (default 0, max %d)] "
+		"[-r requests per second (default unlimited)] "
+		"[-R random offsets] [-m read percentage (default 100)] "
+		"[-w allow writes] [-c request count] "
+		"[-t seconds (default 10)] [-p poll duration in us (default 0)] "
+		"[-s seed] [-P count cache misses]\n",
+		program, BLKIF_MAX_SEGMENTS_PER_REQUEST * 4,
+		TD_RINGBENCH_MAX_ORDER);
+}
+
+static inline uint64_t
+tapdisk_ringbench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t
+tapdisk_ringbench_rand(td_ringbench_t *rb)
+{
+	/* xorshift64*, reproducible for a given -s */
+	rb->rng ^= rb->rng >> 12;
+	rb->rng ^= rb->rng << 25;
+	rb->rng ^= rb->rng >> 27;
+	return rb->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static inline void *
+tapdisk_ringbench_page(td_ringbench_t *rb, grant_ref_t gref)
+{
+	return (char *)rb->mem + ((size_t)gref << XC_PAGE_SHIFT);
+}
+
+/*
+ * The data pages of ring slot @id, right after the ring pages.
+ */
+static inline grant_ref_t
+tapdisk_ringbench_gref(td_ringbench_t *rb, int id, int seg)
+{
+	return (1 << rb->order) + id * rb->nr_segs + seg;
+}
+
+/*
+ * Backend side: what the program is linked against instead of libxenctrl
+ * and the gntdev ioctl.
+ */
+
+extern int __real_ioctl(int fd, unsigned long request, ...);
+
+void *
+__wrap_xc_gnttab_map_domain_grant_refs(xc_gnttab *xcg, uint32_t count,
+				       uint32_t domid, uint32_t *refs,
+				       int prot)
+{
+	td_ringbench_t *rb = &ringbench;
+	size_t len = (size_t)count << XC_PAGE_SHIFT;
+	char *vma;
+	uint32_t i;
+
+	for (i = 0; i < count; i++)
+		if (refs[i] >= rb->mem_pages) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+	vma = mmap(NULL, len, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (vma == MAP_FAILED)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		void *page = mmap(vma + ((size_t)i << XC_PAGE_SHIFT),
+				  XC_PAGE_SIZE, prot, MAP_SHARED|MAP_FIXED,
+				  rb->mem_fd, (off_t)refs[i] << XC_PAGE_SHIFT);
+		if (page == MAP_FAILED) {
+			int err = errno;
+			munmap(vma, len);
+			errno = err;
+			return NULL;
+		}
+	}
+
+	rb->maps++;
+
+	return vma;
+}
+
+int
+__wrap_xc_gnttab_munmap(xc_gnttab *xcg, void *start_address, uint32_t count)
+{
+	return munmap(start_address, (size_t)count << XC_PAGE_SHIFT);
+}
+
+evtchn_port_or_error_t
+__wrap_xc_evtchn_bind_interdomain(xc_evtchn *xce, int domid,
+				  evtchn_port_t remote_port)
+{
+	return TD_RINGBENCH_PORT;
+}
+
+int
+__wrap_xc_evtchn_unbind(xc_evtchn *xce, evtchn_port_t port)
+{
+	return 0;
+}
+
+int
+__wrap_xc_evtchn_notify(xc_evtchn *xce, evtchn_port_t port)
+{
+	td_ringbench_t *rb = &ringbench;
+
+	rb->notifies++;
+
+	return eventfd_write(rb->irq_fd, 1);
+}
+
+static int
+tapdisk_ringbench_grant_copy(td_ringbench_t *rb,
+			     struct ioctl_gntdev_grant_copy *gcopy)
+{
+	unsigned int i;
+
+	rb->gcopies++;
+	rb->gcopy_segs += gcopy->count;
+
+	for (i = 0; i < gcopy->count; i++) {
+		struct gntdev_grant_copy_segment *seg = &gcopy->segments[i];
+		grant_ref_t ref;
+		unsigned int offset, len;
+		void *local;
+		int to_guest;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+		to_guest = !!(seg->flags & GNTCOPY_dest_gref);
+		if (to_guest) {
+			ref    = seg->dest.foreign.ref;
+			offset = seg->dest.foreign.offset;
+			local  = seg->source.virt;
+		} else {
+			ref    = seg->source.foreign.ref;
+			offset = seg->source.foreign.offset;
+			local  = seg->dest.virt;
+		}
+		len = seg->len;
+#else
+		to_guest = !gcopy->dir;
+		ref      = seg->ref;
+		offset   = seg->offset;
+		local    = seg->iov.iov_base;
+		len      = seg->iov.iov_len;
+#endif
+
+		if (ref >= rb->mem_pages) {
+			seg->status = GNTST_bad_gntref;
+			continue;
+		}
+
+		if (offset + len > XC_PAGE_SIZE) {
+			seg->status = GNTST_general_error;
+			continue;
+		}
+
+		if (to_guest)
+			memcpy(tapdisk_ringbench_page(rb, ref) + offset,
+			       local, len);
+		else
+			memcpy(local, tapdisk_ringbench_page(rb, ref) + offset,
+			       len);
+
+		seg->status = GNTST_okay;
+	}
+
+	return 0;
+}
+
+int
+__wrap_ioctl(int fd, unsigned long request, ...)
+{
+	td_ringbench_t *rb = &ringbench;
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (rb->ctx && fd == rb->ctx->gntdev_fd &&
+	    request == IOCTL_GNTDEV_GRANT_COPY)
+		return tapdisk_ringbench_grant_copy(rb, arg);
+
+	return __real_ioctl(fd, request, arg);
+}
+
+/*
+ * Stands in for the event channel handler of td-ctx: a kick from the
+ * frontend processes the ring.
+ */
+static void
+tapdisk_ringbench_kick_cb(event_id_t id, char mode, void *private)
+{
+	td_ringbench_t *rb = private;
+	eventfd_t val;
+
+	if (eventfd_read(rb->kick_fd, &val))
+		return;
+
+	if (!rb->blkif)
+		return;
+
+	rb->blkif->stats.kicks.in++;
+	rb->process_ring++;
+
+	tapdisk_xenio_ctx_process_ring(rb->blkif, rb->ctx, 0);
+}
+
+/*
+ * A context of our own, found by tapdisk_xenblkif_connect() through its
+ * pool name, instead of the one tapdisk_xenio_ctx_get() would open on
+ * /dev/xen.
+ */
+static int
+tapdisk_ringbench_ctx_open(td_ringbench_t *rb)
+{
+	struct td_xenio_ctx *ctx;
+	int err;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return ENOMEM;
+
+	ctx->pool = TD_RINGBENCH_POOL;
+	ctx->ring_event = -1;
+	ctx->bufs_expire_event = -1;
+	INIT_LIST_HEAD(&ctx->blkifs);
+	INIT_LIST_HEAD(&ctx->bufchunks);
+
+	/* only there to tell our ioctls apart */
+	ctx->gntdev_fd = open("/dev/null", O_RDONLY);
+	if (ctx->gntdev_fd == -1) {
+		free(ctx);
+		return errno;
+	}
+
+	ctx->ring_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      rb->kick_fd, TV_ZERO,
+					      tapdisk_ringbench_kick_cb, rb);
+	if (ctx->ring_event < 0) {
+		err = -ctx->ring_event;
+		close(ctx->gntdev_fd);
+		free(ctx);
+		return err;
+	}
+
+	list_add(&ctx->entry, tapdisk_xenio_ctxs());
+	rb->ctx = ctx;
+
+	return 0;
+}
+
+/*
+ * Guest side.
+ */
+
+static int
+tapdisk_ringbench_done(td_ringbench_t *rb)
+{
+	if (rb->err)
+		return 1;
+
+	if (rb->count)
+		return rb->issued >= rb->count;
+
+	return tapdisk_ringbench_now() - rb->t_start >= rb->duration;
+}
+
+static void
+tapdisk_ringbench_close_image(td_ringbench_t *rb)
+{
+	td_vbd_t *vbd = rb->vbd;
+
+	if (rb->tick_event >= 0) {
+		tapdisk_server_unregister_event(rb->tick_event);
+		rb->tick_event = -1;
+	}
+
+	if (rb->irq_event >= 0) {
+		tapdisk_server_unregister_event(rb->irq_event);
+		rb->irq_event = -1;
+	}
+
+	if (rb->blkif) {
+		/* frees the context along with the last ring */
+		tapdisk_xenblkif_disconnect(0, rb->devid);
+		rb->blkif = NULL;
+		rb->ctx = NULL;
+	}
+
+	if (!vbd)
+		return;
+
+	tapdisk_vbd_close_vdi(vbd);
+	tapdisk_server_remove_vbd(vbd);
+	free(vbd->name);
+	free(vbd);
+	rb->vbd = NULL;
+}
+
+static void
+tapdisk_ringbench_submit(td_ringbench_t *rb)
+{
+	uint64_t budget = UINT64_MAX;
+	blkif_sector_t blocks;
+	int i, notify;
+
+	if (rb->rate)
+		budget = (tapdisk_ringbench_now() - rb->t_start) *
+			rb->rate / 1000000000ULL + 1;
+
+	blocks = rb->size / (rb->nr_segs << (XC_PAGE_SHIFT - SECTOR_SHIFT));
+
+	while (rb->inflight < rb->depth && rb->issued < budget &&
+	       !tapdisk_ringbench_done(rb)) {
+		blkif_request_t *req;
+		int id;
+
+		BUG_ON(!rb->n_free);
+		id = rb->free_ids[--rb->n_free];
+
+		req = RING_GET_REQUEST(&rb->front, rb->front.req_prod_pvt);
+
+		req->operation = BLKIF_OP_READ;
+		if (rb->read_pct < 100 &&
+		    tapdisk_ringbench_rand(rb) % 100 >= (uint64_t)rb->read_pct)
+			req->operation = BLKIF_OP_WRITE;
+
+		req->nr_segments = rb->nr_segs;
+		req->handle      = rb->devid;
+		req->id          = id;
+
+		if (rb->random)
+			req->sector_number = (tapdisk_ringbench_rand(rb) %
+					      blocks) * rb->nr_segs *
+				(XC_PAGE_SIZE >> SECTOR_SHIFT);
+		else {
+			req->sector_number = rb->next;
+			rb->next += rb->nr_segs * (XC_PAGE_SIZE >> SECTOR_SHIFT);
+			if (rb->next / (rb->nr_segs *
+					(XC_PAGE_SIZE >> SECTOR_SHIFT)) >= blocks)
+				rb->next = 0;
+		}
+
+		for (i = 0; i < rb->nr_segs; i++) {
+			req->seg[i].gref       = tapdisk_ringbench_gref(rb, id, i);
+			req->seg[i].first_sect = 0;
+			req->seg[i].last_sect  =
+				(XC_PAGE_SIZE >> SECTOR_SHIFT) - 1;
+		}
+
+		rb->front.req_prod_pvt++;
+		rb->start[id] = tapdisk_ringbench_now();
+		rb->issued++;
+		rb->inflight++;
+	}
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&rb->front, notify);
+	if (notify) {
+		rb->kicks++;
+		eventfd_write(rb->kick_fd, 1);
+	}
+}
+
+static void
+tapdisk_ringbench_reap(td_ringbench_t *rb)
+{
+	RING_IDX i, rp;
+	int more;
+
+	do {
+		rp = rb->front.sring->rsp_prod;
+		xen_rmb();
+
+		for (i = rb->front.rsp_cons; i != rp; i++) {
+			blkif_response_t *rsp = RING_GET_RESPONSE(&rb->front, i);
+			uint64_t lat;
+
+			BUG_ON(rsp->id >= (uint64_t)rb->ring_size);
+			BUG_ON(rb->inflight <= 0);
+
+			lat = tapdisk_ringbench_now() - rb->start[rsp->id];
+			rb->free_ids[rb->n_free++] = rsp->id;
+			rb->inflight--;
+
+			if (rsp->status != BLKIF_RSP_OKAY) {
+				fprintf(stderr, "request %"PRIu64" failed: %d\n",
+					(uint64_t)rsp->id, rsp->status);
+				rb->err = EIO;
+				continue;
+			}
+
+			if (rsp->operation == BLKIF_OP_READ)
+				rb->reads++;
+			else
+				rb->writes++;
+
+			rb->lat_sum += lat;
+			if (lat > rb->lat_max)
+				rb->lat_max = lat;
+		}
+
+		rb->front.rsp_cons = rp;
+		RING_FINAL_CHECK_FOR_RESPONSES(&rb->front, more);
+	} while (more);
+}
+
+#ifdef __linux__
+static const struct {
+	const char *name;
+	uint64_t    config;
+} tapdisk_ringbench_perf_events[TD_RINGBENCH_PERF_EVENTS] = {
+	{ "L1d",
+	  PERF_COUNT_HW_CACHE_L1D |
+	  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ "LLC",
+	  PERF_COUNT_HW_CACHE_LL |
+	  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+static int
+tapdisk_ringbench_perf_open(td_ringbench_t *rb)
+{
+	struct perf_event_attr attr;
+	int i;
+
+	for (i = 0; i < TD_RINGBENCH_PERF_EVENTS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size           = sizeof(attr);
+		attr.type           = PERF_TYPE_HW_CACHE;
+		attr.config         = tapdisk_ringbench_perf_events[i].config;
+		attr.disabled       = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv     = 1;
+
+		rb->perf_fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (rb->perf_fd[i] == -1) {
+			int err = -errno;
+			fprintf(stderr, "cannot count %s misses: %s\n",
+				tapdisk_ringbench_perf_events[i].name,
+				strerror(-err));
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static void
+tapdisk_ringbench_perf_start(td_ringbench_t *rb)
+{
+	int i;
+
+	for (i = 0; i < TD_RINGBENCH_PERF_EVENTS; i++)
+		if (rb->perf_fd[i] != -1) {
+			ioctl(rb->perf_fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(rb->perf_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+}
+
+static void
+tapdisk_ringbench_perf_stop(td_ringbench_t *rb)
+{
+	int i;
+
+	for (i = 0; i < TD_RINGBENCH_PERF_EVENTS; i++) {
+		if (rb->perf_fd[i] == -1)
+			continue;
+
+		ioctl(rb->perf_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(rb->perf_fd[i], &rb->perf_val[i],
+			 sizeof(rb->perf_val[i])) != sizeof(rb->perf_val[i]))
+			rb->perf_val[i] = 0;
+		close(rb->perf_fd[i]);
+		rb->perf_fd[i] = -1;
+	}
+}
+#else
+static int
+tapdisk_ringbench_perf_open(td_ringbench_t *rb)
+{
+	return -ENOSYS;
+}
+
+static void
+tapdisk_ringbench_perf_start(td_ringbench_t *rb)
+{
+}
+
+static void
+tapdisk_ringbench_perf_stop(td_ringbench_t *rb)
+{
+}
+#endif
+
+static void
+tapdisk_ringbench_run(td_ringbench_t *rb)
+{
+	tapdisk_ringbench_reap(rb);
+
+	if (!tapdisk_ringbench_done(rb)) {
+		tapdisk_ringbench_submit(rb);
+		return;
+	}
+
+	if (!rb->inflight && rb->vbd) {
+		rb->t_end = tapdisk_ringbench_now();
+		tapdisk_ringbench_perf_stop(rb);
+		tapdisk_ringbench_close_image(rb);
+	}
+}
+
+static void
+tapdisk_ringbench_irq_cb(event_id_t id, char mode, void *private)
+{
+	td_ringbench_t *rb = private;
+	eventfd_t val;
+
+	if (eventfd_read(rb->irq_fd, &val))
+		return;
+
+	rb->irqs++;
+	tapdisk_ringbench_run(rb);
+}
+
+/*
+ * Paces -r, and picks up responses the backend pushed without notifying.
+ */
+static void
+tapdisk_ringbench_tick_cb(event_id_t id, char mode, void *private)
+{
+	tapdisk_ringbench_run(private);
+}
+
+static int
+tapdisk_ringbench_open(td_ringbench_t *rb)
+{
+	td_disk_info_t info;
+	blkif_sring_t *sring;
+	grant_ref_t grefs[1 << TD_RINGBENCH_MAX_ORDER];
+	size_t len;
+	int i, err;
+
+	err = tapdisk_server_initialize(NULL, NULL);
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_initialize(-1, -1, 0);
+	if (err)
+		goto out;
+
+	rb->vbd = tapdisk_server_get_vbd(0);
+	if (!rb->vbd) {
+		err = ENODEV;
+		goto out;
+	}
+
+	err = tapdisk_vbd_open_vdi(rb->vbd, rb->name,
+				   rb->read_pct < 100 ? 0 : TD_OPEN_RDONLY, -1);
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_get_disk_info(rb->vbd, &info);
+	if (err)
+		goto out;
+
+	rb->size = info.size;
+	if (rb->size < (td_sector_t)rb->nr_segs << (XC_PAGE_SHIFT - SECTOR_SHIFT)) {
+		fprintf(stderr, "image smaller than one block\n");
+		err = EINVAL;
+		goto out;
+	}
+
+	rb->ring_size = __CONST_RING_SIZE(blkif, XC_PAGE_SIZE << rb->order);
+	if (rb->depth > rb->ring_size) {
+		fprintf(stderr, "depth %d exceeds the ring size (%d)\n",
+			rb->depth, rb->ring_size);
+		err = EINVAL;
+		goto out;
+	}
+
+	rb->start    = calloc(rb->ring_size, sizeof(*rb->start));
+	rb->free_ids = calloc(rb->ring_size, sizeof(*rb->free_ids));
+	if (!rb->start || !rb->free_ids) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i = rb->ring_size - 1; i >= 0; i--)
+		rb->free_ids[rb->n_free++] = i;
+
+	/* the ring pages, then nr_segs data pages per slot */
+	rb->mem_pages = (1 << rb->order) + rb->ring_size * rb->nr_segs;
+	len = rb->mem_pages << XC_PAGE_SHIFT;
+
+	rb->mem_fd = memfd_create("tapdisk-ringbench", 0);
+	if (rb->mem_fd == -1) {
+		err = errno;
+		goto out;
+	}
+
+	if (ftruncate(rb->mem_fd, len)) {
+		err = errno;
+		goto out;
+	}
+
+	rb->mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED,
+		       rb->mem_fd, 0);
+	if (rb->mem == MAP_FAILED) {
+		rb->mem = NULL;
+		err = errno;
+		goto out;
+	}
+
+	/* what gets written, and touches the pages up front */
+	memset(rb->mem, 0xa5, len);
+
+	sring = rb->mem;
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&rb->front, sring, XC_PAGE_SIZE << rb->order);
+
+	rb->kick_fd = eventfd(0, EFD_NONBLOCK);
+	rb->irq_fd  = eventfd(0, EFD_NONBLOCK);
+	if (rb->kick_fd == -1 || rb->irq_fd == -1) {
+		err = errno;
+		goto out;
+	}
+
+	err = tapdisk_ringbench_ctx_open(rb);
+	if (err)
+		goto out;
+
+	for (i = 0; i < 1 << rb->order; i++)
+		grefs[i] = i;
+
+	err = tapdisk_xenblkif_connect(0, rb->devid, grefs, rb->order,
+				       TD_RINGBENCH_PORT,
+				       BLKIF_PROTOCOL_NATIVE,
+				       rb->poll_duration, 50,
+				       TD_RINGBENCH_POOL, 0, rb->vbd);
+	if (err) {
+		err = -err;
+		goto out;
+	}
+
+	rb->blkif = tapdisk_xenblkif_find(0, rb->devid, 0);
+	BUG_ON(!rb->blkif);
+
+	rb->irq_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      rb->irq_fd, TV_ZERO,
+					      tapdisk_ringbench_irq_cb, rb);
+	if (rb->irq_event < 0) {
+		err = -rb->irq_event;
+		goto out;
+	}
+
+	rb->tick_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+					      TV_USECS(TD_RINGBENCH_TICK_US),
+					      tapdisk_ringbench_tick_cb, rb);
+	if (rb->tick_event < 0) {
+		err = -rb->tick_event;
+		goto out;
+	}
+
+out:
+	if (err)
+		fprintf(stderr, "failed to open %s: %d\n", rb->name, err);
+	return err;
+}
+
+static void
+tapdisk_ringbench_close(td_ringbench_t *rb)
+{
+	/* a context the connect never took over is still ours to free */
+	if (rb->ctx && !rb->blkif) {
+		tapdisk_server_unregister_event(rb->ctx->ring_event);
+		close(rb->ctx->gntdev_fd);
+		list_del(&rb->ctx->entry);
+		free(rb->ctx);
+		rb->ctx = NULL;
+	}
+
+	tapdisk_ringbench_close_image(rb);
+
+	if (rb->mem)
+		munmap(rb->mem, rb->mem_pages << XC_PAGE_SHIFT);
+	if (rb->mem_fd != -1)
+		close(rb->mem_fd);
+	if (rb->kick_fd != -1)
+		close(rb->kick_fd);
+	if (rb->irq_fd != -1)
+		close(rb->irq_fd);
+
+	free(rb->start);
+	free(rb->free_ids);
+}
+
+static void
+tapdisk_ringbench_report(td_ringbench_t *rb)
+{
+	uint64_t ops = rb->reads + rb->writes;
+	double secs = (rb->t_end - rb->t_start) / 1e9;
+
+	if (secs <= 0)
+		secs = 1e-9;
+
+	printf("%s: %d KiB %s, %d%% reads, depth %d, ring %d slots\n",
+	       rb->name, rb->nr_segs * (XC_PAGE_SIZE >> 10),
+	       rb->random ? "random" : "sequential", rb->read_pct,
+	       rb->depth, rb->ring_size);
+	printf("  ops %"PRIu64" (%"PRIu64" reads, %"PRIu64" writes) "
+	       "in %.3f s\n", ops, rb->reads, rb->writes, secs);
+	printf("  %.0f IOPS, %.2f MB/s, latency us: avg %.1f max %.1f\n",
+	       ops / secs,
+	       ops * ((double)rb->nr_segs * XC_PAGE_SIZE) / secs / 1e6,
+	       ops ? rb->lat_sum / 1e3 / ops : 0, rb->lat_max / 1e3);
+	printf("  kicks %"PRIu64" (%.2f reqs/kick), process_ring %"PRIu64"\n",
+	       rb->kicks, rb->kicks ? (double)rb->issued / rb->kicks : 0,
+	       rb->process_ring);
+	printf("  notifies %"PRIu64" (%.2f rsps/notify), irqs %"PRIu64"\n",
+	       rb->notifies, rb->notifies ? (double)ops / rb->notifies : 0,
+	       rb->irqs);
+	printf("  grant copies %"PRIu64" (%.2f segs/copy), maps %"PRIu64"\n",
+	       rb->gcopies,
+	       rb->gcopies ? (double)rb->gcopy_segs / rb->gcopies : 0,
+	       rb->maps);
+	if (rb->perf)
+		printf("  cache misses per request: L1d %.1f, LLC %.2f\n",
+		       ops ? (double)rb->perf_val[0] / ops : 0,
+		       ops ? (double)rb->perf_val[1] / ops : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	td_ringbench_t *rb = &ringbench;
+	unsigned long kib;
+	int c, i, err, writes;
+
+	program = basename(argv[0]);
+
+	memset(rb, 0, sizeof(*rb));
+	rb->devid      = getpid();
+	rb->nr_segs    = 1;
+	rb->depth      = 32;
+	rb->read_pct   = 100;
+	rb->duration   = 10;
+	rb->rng        = 0x9e3779b97f4a7c15ULL;
+	rb->mem_fd     = -1;
+	rb->kick_fd    = -1;
+	rb->irq_fd     = -1;
+	rb->irq_event  = -1;
+	rb->tick_event = -1;
+	writes         = 0;
+	for (i = 0; i < TD_RINGBENCH_PERF_EVENTS; i++)
+		rb->perf_fd[i] = -1;
+
+	while ((c = getopt(argc, argv, "n:b:d:o:r:Rm:wc:t:p:s:Ph")) != -1) {
+		switch (c) {
+		case 'n':
+			rb->name = optarg;
+			break;
+		case 'b':
+			kib = strtoul(optarg, NULL, 10);
+			if (!kib || kib % (XC_PAGE_SIZE >> 10) ||
+			    kib / (XC_PAGE_SIZE >> 10) >
+			    BLKIF_MAX_SEGMENTS_PER_REQUEST)
+				goto fail_usage;
+			rb->nr_segs = kib / (XC_PAGE_SIZE >> 10);
+			break;
+		case 'd':
+			rb->depth = atoi(optarg);
+			if (rb->depth < 1)
+				goto fail_usage;
+			break;
+		case 'o':
+			rb->order = atoi(optarg);
+			if (rb->order < 0 || rb->order > TD_RINGBENCH_MAX_ORDER)
+				goto fail_usage;
+			break;
+		case 'r':
+			rb->rate = strtoull(optarg, NULL, 10);
+			break;
+		case 'R':
+			rb->random = 1;
+			break;
+		case 'm':
+			rb->read_pct = atoi(optarg);
+			if (rb->read_pct < 0 || rb->read_pct > 100)
+				goto fail_usage;
+			break;
+		case 'w':
+			writes = 1;
+			break;
+		case 'c':
+			rb->count = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			rb->duration = strtoull(optarg, NULL, 10);
+			break;
+		case 'p':
+			rb->poll_duration = atoi(optarg);
+			if (rb->poll_duration < 0)
+				goto fail_usage;
+			break;
+		case 's':
+			rb->rng = strtoull(optarg, NULL, 0) ? : rb->rng;
+			break;
+		case 'P':
+			rb->perf = 1;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			goto fail_usage;
+		}
+	}
+
+	if (!rb->name)
+		goto fail_usage;
+
+	if (rb->read_pct < 100 && !writes) {
+		fprintf(stderr, "-m below 100 writes to the image, "
+			"confirm with -w\n");
+		goto fail_usage;
+	}
+
+	rb->duration *= 1000000000ULL;
+
+	tapdisk_start_logging("tapdisk-ringbench", "daemon");
+
+	err = tapdisk_ringbench_open(rb);
+	if (err)
+		goto out;
+
+	if (rb->perf) {
+		err = tapdisk_ringbench_perf_open(rb);
+		if (err)
+			goto out;
+	}
+
+	rb->t_start = tapdisk_ringbench_now();
+	tapdisk_ringbench_perf_start(rb);
+	tapdisk_ringbench_submit(rb);
+
+	tapdisk_server_run();
+	if (!rb->t_end)
+		rb->t_end = tapdisk_ringbench_now();
+	tapdisk_ringbench_perf_stop(rb);
+
+	err = rb->err;
+	if (!err)
+		tapdisk_ringbench_report(rb);
+
+out:
+	tapdisk_ringbench_close(rb);
+	tapdisk_stop_logging();
+	return err;
+
+fail_usage:
+	usage(stderr);
+	return 1;
+}
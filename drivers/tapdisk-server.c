@@ -38,12 +38,14 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
+#include <sys/syscall.h>
 #ifdef HAVE_EVENTFD
 #include <sys/eventfd.h>
-#else
-#include <sys/syscall.h>
 #endif
 
 #include "tapdisk-syslog.h"
@@ -51,8 +53,13 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-log.h"
+#include "tapdisk-filter.h"
+#include "tapdisk-storage.h"
+#include "tapdisk-profile.h"
+#include "tapdisk-blktap.h"
 #include "td-blkif.h"
 #include "timeout-math.h"
+#include "util.h"
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -63,11 +70,62 @@
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
 
-typedef struct tapdisk_server {
+#define TAPDISK_MAX_WORKERS         64
+
+/*
+ * An event loop: the main thread runs one, and with TAPDISK3_WORKERS=<n>
+ * each of n threads runs another. A VBD lives on a single worker, which
+ * owns its events, its aio queue and its xenio contexts.
+ */
+typedef struct tapdisk_worker {
+	int                          id;
 	int                          run;
 	struct list_head             vbds;
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+
+	/* of the request being passed to a driver, see tapdisk_server_set_prio */
+	int                          prio;
+	struct td_profile           *profile;
+
+	pthread_t                    thread;
+	pid_t                        tid;
+	int                          nr_pinned;
+
+	/* set by tapdisk_server_set_cgroup, charged for the VBDs' I/O */
+	char                        *cgroup;
+
+	/* kicked for calls and notifications from other threads */
+	int                          kick_fd;
+	event_id_t                   kick_evid;
+	unsigned long                notify;
+
+	pthread_mutex_t              lock;
+	pthread_cond_t               cond;
+	struct {
+		tapdisk_server_call_t        fn;
+		void                        *arg;
+		int                          ret;
+		int                          done;
+	} call;
+} tapdisk_worker_t;
+
+/*
+ * Worker placement of a VBD, by uuid. Only the main thread uses these.
+ */
+struct tapdisk_pin {
+	td_uuid_t                    uuid;
+	tapdisk_worker_t            *worker;
+	struct list_head             entry;
+};
+
+typedef struct tapdisk_server {
+	tapdisk_worker_t             main;
+	tapdisk_worker_t            *workers;
+	int                          nr_workers;
+	struct list_head             pins;
+	int                          nr_vbds;
+
 	char                        *name;
 	char                        *ident;
 	int                          facility;
@@ -88,23 +146,42 @@ typedef struct tapdisk_server {
 							 factor */
 	} mem_state;
 
+	/* Memory budget state */
+	struct {
+		int                          fd; /* PSI fd */
+		event_id_t                   evid; /* sampling timer */
+		unsigned int                 budget; /* percent */
+	} psi_state;
+
 	/* CPU Utilisation Monitor client state */
 	struct {
 		int                         fd; /* shm fd */
 		cpumond_t                  *cpumon; /* mmap pointer */
+		size_t                      size; /* mmap length */
+		unsigned int                poll_psi_max; /* percent, 0: off */
 	} cpumond_state;
 
 	event_id_t                   tlog_reopen_evid;
+
+	/* AIO, workers and the clients above are set up for the first VBD */
+	int                          prepared;
+
+	/* CPUs given with tapdisk -a, none if nr_cpus is zero */
+	cpu_set_t                    cpus;
+	int                          nr_cpus;
 } tapdisk_server_t;
 
 static tapdisk_server_t server;
 
+/* the event loop of the calling thread */
+static __thread tapdisk_worker_t *worker = &server.main;
+
 unsigned int PAGE_SIZE;
 unsigned int PAGE_MASK;
 unsigned int PAGE_SHIFT;
 
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
-	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
+	list_for_each_entry_safe(vbd, tmp, &worker->vbds, next)
 
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
@@ -127,7 +204,13 @@ tapdisk_server_get_shared_image(td_image_t *image)
 struct list_head *
 tapdisk_server_get_all_vbds(void)
 {
-	return &server.vbds;
+	return &worker->vbds;
+}
+
+int
+tapdisk_server_in_worker(void)
+{
+	return worker != &server.main;
 }
 
 td_vbd_t *
@@ -145,7 +228,8 @@ tapdisk_server_get_vbd(uint16_t uuid)
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
-	list_add_tail(&vbd->next, &server.vbds);
+	list_add_tail(&vbd->next, &worker->vbds);
+	__sync_add_and_fetch(&server.nr_vbds, 1);
 }
 
 void
@@ -153,13 +237,58 @@ tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	__sync_sub_and_fetch(&server.nr_vbds, 1);
 	tapdisk_server_check_state();
 }
 
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tiocb->prio    = worker->prio;
+	tiocb->profile = worker->profile;
+	tiocb->prof_ts = tapdisk_profile_now(worker->profile);
+	tapdisk_queue_tiocb(&worker->aio_queue, tiocb);
+}
+
+int
+tapdisk_server_set_prio(int prio)
+{
+	int prev = worker->prio;
+
+	worker->prio = prio;
+
+	return prev;
+}
+
+struct td_profile *
+tapdisk_server_set_profile(struct td_profile *profile)
+{
+	struct td_profile *prev = worker->profile;
+
+	worker->profile = profile;
+
+	return prev;
+}
+
+void
+tapdisk_server_tune_fd(int fd, const struct tapdisk_storage_profile *profile)
+{
+	int err;
+
+	if (fd < 0 || (!profile->max_io_size && !profile->queue_depth))
+		return;
+
+	err = tapdisk_queue_tune_fd(&worker->aio_queue, fd,
+				    profile->max_io_size, profile->queue_depth);
+	if (err)
+		EPRINTF("tuning fd %d: %d\n", fd, err);
+}
+
+void
+tapdisk_server_untune_fd(int fd)
+{
+	if (fd >= 0)
+		tapdisk_queue_tune_fd(&worker->aio_queue, fd, 0, 0);
 }
 
 void
@@ -167,7 +296,8 @@ tapdisk_server_debug(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	if (worker->aio_queue.tio)
+		tapdisk_debug_queue(&worker->aio_queue);
 
 	tapdisk_server_for_each_vbd(vbd, tmp)
 		tapdisk_vbd_debug(vbd);
@@ -176,37 +306,75 @@ tapdisk_server_debug(void)
 	tlog_precious(1);
 }
 
+static void
+tapdisk_worker_kick(tapdisk_worker_t *w)
+{
+	uint64_t one = 1;
+	ssize_t n;
+
+	if (w->kick_fd >= 0)
+		n = write(w->kick_fd, &one, sizeof(one));
+	(void)n;
+}
+
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
-		server.run = 0;
+	if (!server.nr_vbds) {
+		server.main.run = 0;
+		if (worker != &server.main)
+			tapdisk_worker_kick(&server.main);
+	}
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      struct timeval timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&worker->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&worker->scheduler, event);
 }
 
 void
 tapdisk_server_mask_event(event_id_t event, int masked)
 {
-	return scheduler_mask_event(&server.scheduler, event, masked);
+	return scheduler_mask_event(&worker->scheduler, event, masked);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, TV_SECS(seconds));
+	scheduler_set_max_timeout(&worker->scheduler, TV_SECS(seconds));
+}
+
+void
+tapdisk_server_set_max_timeout_us(long usecs)
+{
+	scheduler_set_max_timeout(&worker->scheduler, TV_USECS(usecs));
+}
+
+void
+tapdisk_server_defer(scheduler_work_t *work)
+{
+	scheduler_defer(&worker->scheduler, work);
+}
+
+void
+tapdisk_server_cancel_work(scheduler_work_t *work)
+{
+	scheduler_cancel(&worker->scheduler, work);
+}
+
+scheduler_t *
+tapdisk_server_get_scheduler(void)
+{
+	return &worker->scheduler;
 }
 
 static void
@@ -242,7 +410,10 @@ tapdisk_server_check_progress(void)
 static void
 tapdisk_server_submit_tiocbs(void)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	if (unlikely(!worker->aio_queue.tio))
+		return;
+
+	tapdisk_submit_all_tiocbs(&worker->aio_queue);
 }
 
 static void
@@ -254,6 +425,20 @@ tapdisk_server_kick_responses(void)
 		tapdisk_vbd_kick(vbd);
 }
 
+static void
+tapdisk_server_flush_responses(void)
+{
+	td_vbd_t *vbd, *tmp;
+	struct td_xenblkif *blkif, *_blkif;
+
+	tapdisk_server_for_each_vbd(vbd, tmp) {
+		tapdisk_vbd_for_each_blkif(vbd, blkif, _blkif)
+			tapdisk_xenblkif_flush_responses(blkif);
+		if (vbd->tap)
+			tapdisk_blktap_flush_responses(vbd->tap);
+	}
+}
+
 static void
 tapdisk_server_check_vbds(void)
 {
@@ -291,14 +476,64 @@ tapdisk_server_stop_vbds(void)
 static int
 tapdisk_server_init_aio(void)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	const char *engine, *val;
+	struct tfilter *filter = NULL;
+	uint64_t secs;
+	int mode, err;
+
+	/*
+	 * TAPDISK3_FILTER takes TD_INJECT_FAULTS/TD_CHECK_INTEGRITY
+	 * mode bits, TAPDISK3_FILTER_SECTORS caps integrity tracking
+	 */
+	val = getenv("TAPDISK3_FILTER");
+	if (val) {
+		mode = strtol(val, NULL, 0);
+		val  = getenv("TAPDISK3_FILTER_SECTORS");
+		secs = val ? strtoull(val, NULL, 0) : 0;
+
+		filter = tapdisk_init_tfilter(mode, TAPDISK_TIOCBS, secs);
+	}
+
+	engine = getenv("TAPDISK3_IO_ENGINE");
+	if (engine && !strcmp(engine, "uring")) {
+		err = tapdisk_init_queue(&worker->aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_URING, filter);
+		if (!err)
+			return 0;
+
+		EPRINTF("failed to set up io_uring queue, "
+			"falling back to libaio: %s\n", strerror(-err));
+	}
+
+	if (!engine || strcmp(engine, "rwio")) {
+		err = tapdisk_init_queue(&worker->aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_LIO, filter);
+		if (!err)
+			return 0;
+
+		EPRINTF("failed to set up libaio queue, "
+			"falling back to rwio: %s\n", strerror(-err));
+	}
+
+	err = tapdisk_init_queue(&worker->aio_queue, TAPDISK_TIOCBS,
+				 TIO_DRV_RWIO, filter);
+	if (err)
+		tapdisk_free_tfilter(filter);
+
+	return err;
 }
 
 static void
 tapdisk_server_close_aio(void)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	struct tfilter *filter = worker->aio_queue.filter;
+
+	if (!worker->aio_queue.tio)
+		return;
+
+	tapdisk_free_queue(&worker->aio_queue);
+	tapdisk_free_tfilter(filter);
+	memset(&worker->aio_queue, 0, sizeof(worker->aio_queue));
 }
 
 int
@@ -345,14 +580,25 @@ tapdisk_server_close_tlog(void)
 	tlog_close();
 }
 
+static void tapdisk_server_stop_workers(void);
+static void tapdisk_server_close_kick(void);
+static void tapdisk_server_notify_workers(unsigned long);
+
+/* worker notifications, besides the signal numbers */
+#define TAPDISK_NOTIFY_MEM_MODE      (1UL << 0)
+
 static void
 tapdisk_server_close(void)
 {
+	tapdisk_server_stop_workers();
+
 	if (likely(server.tlog_reopen_evid >= 0))
 		tapdisk_server_unregister_event(server.tlog_reopen_evid);
 
+	tapdisk_server_close_kick();
 	tapdisk_server_close_tlog();
 	tapdisk_server_close_aio();
+	scheduler_uninitialize(&worker->scheduler);
 }
 
 void
@@ -364,28 +610,40 @@ tapdisk_server_iterate(void)
 	tapdisk_server_set_retry_timeout();
 	tapdisk_server_check_progress();
 
-	ret = scheduler_wait_for_events(&server.scheduler);
+	ret = scheduler_wait_for_events(&worker->scheduler);
 	if (ret < 0)
 		DBG(TLOG_WARN, "server wait returned %s\n", strerror(-ret));
 
 	tapdisk_server_check_vbds();
+
+	/*
+	 * Issue what the ring sweeps queued before the first submission, so
+	 * that their tiocbs go to the kernel together with those queued by
+	 * completions, in a single io_submit or io_uring_enter.
+	 */
+	tapdisk_server_recheck_vbds();
 	do {
 		tapdisk_server_submit_tiocbs();
 		tapdisk_server_kick_responses();
 
 		ret = tapdisk_server_recheck_vbds();
 	} while (ret); /* repeat until there are no new requests to issue */
+
+	tapdisk_server_flush_responses();
 }
 
 static void
 __tapdisk_server_run(void)
 {
-	while (server.run)
+	while (worker->run)
 		tapdisk_server_iterate();
 }
 
+/*
+ * Acts on the VBDs of the calling thread's event loop only.
+ */
 static void
-tapdisk_server_signal_handler(int signal)
+tapdisk_server_handle_signal(int signal)
 {
 	td_vbd_t *vbd, *tmp;
 	struct td_xenblkif *blkif;
@@ -418,10 +676,21 @@ tapdisk_server_signal_handler(int signal)
 			list_for_each_entry(blkif, &vbd->rings, entry)
 				tapdisk_start_polling(blkif);
 		break;
+	}
+}
 
+static void
+tapdisk_server_signal_handler(int signal)
+{
+	switch (signal) {
 	case SIGHUP:
 		tapdisk_server_event_set_timeout(server.tlog_reopen_evid, TV_ZERO);
 		break;
+
+	default:
+		tapdisk_server_handle_signal(signal);
+		tapdisk_server_notify_workers(1UL << signal);
+		break;
 	}
 }
 
@@ -500,22 +769,35 @@ static void lowmem_cleanup(void)
 	lowmem_state_init();
 }
 
+/* Reflects the memory mode in the stats of this event loop's rings */
+static void tapdisk_server_sync_mem_mode(void)
+{
+	td_vbd_t           *vbd,   *tmpv;
+	struct td_xenblkif *blkif, *tmpb;
+
+	tapdisk_server_for_each_vbd(vbd, tmpv)
+		tapdisk_vbd_for_each_blkif(vbd, blkif, tmpb) {
+			if (server.mem_state.mode == LOW_MEMORY_MODE) {
+				td_flag_set(blkif->stats.xenvbd->flags, BT3_LOW_MEMORY_MODE);
+				td_flag_set(blkif->vbd_stats.stats->flags, BT3_LOW_MEMORY_MODE);
+			} else {
+				td_flag_clear(blkif->stats.xenvbd->flags, BT3_LOW_MEMORY_MODE);
+				td_flag_clear(blkif->vbd_stats.stats->flags, BT3_LOW_MEMORY_MODE);
+			}
+	}
+}
+
 /* Called when backoff period finishes */
 static void lowmem_timeout(event_id_t id, char mode, void *data)
 {
 	int ret;
-	td_vbd_t           *vbd,   *tmpv;
-	struct td_xenblkif *blkif, *tmpb;
 
 	server.mem_state.mode = NORMAL_MEMORY_MODE;
 	tapdisk_server_unregister_event(server.mem_state.mem_evid);
 	server.mem_state.mem_evid = -1;
 
-	tapdisk_server_for_each_vbd(vbd, tmpv)
-		tapdisk_vbd_for_each_blkif(vbd, blkif, tmpb) {
-			td_flag_clear(blkif->stats.xenvbd->flags, BT3_LOW_MEMORY_MODE);
-			td_flag_clear(blkif->vbd_stats.stats->flags, BT3_LOW_MEMORY_MODE);
-	}
+	tapdisk_server_sync_mem_mode();
+	tapdisk_server_notify_workers(TAPDISK_NOTIFY_MEM_MODE);
 
 	if ((ret = tapdisk_server_reset_lowmem_mode()) < 0) {
 		ERR(-ret, "Failed to re-init low memory handler: %s\n",
@@ -532,9 +814,6 @@ static void lowmem_event(event_id_t id, char mode, void *data)
 	ssize_t n;
 	int backoff;
 
-	td_vbd_t           *vbd,   *tmpv;
-	struct td_xenblkif *blkif, *tmpb;
-
 	n = read(server.mem_state.efd, &result, sizeof(result));
 	if (n < 0) {
 		ERR(-errno, "Failed to read from eventfd: %s\n",
@@ -577,11 +856,8 @@ static void lowmem_event(event_id_t id, char mode, void *data)
 	}
 	server.mem_state.mode = LOW_MEMORY_MODE;
 
-	tapdisk_server_for_each_vbd(vbd, tmpv)
-		tapdisk_vbd_for_each_blkif(vbd, blkif, tmpb) {
-			td_flag_set(blkif->stats.xenvbd->flags, BT3_LOW_MEMORY_MODE);
-			td_flag_set(blkif->vbd_stats.stats->flags, BT3_LOW_MEMORY_MODE);
-	}
+	tapdisk_server_sync_mem_mode();
+	tapdisk_server_notify_workers(TAPDISK_NOTIFY_MEM_MODE);
 
 	/* Increment backoff up to a limit */
 	if (server.mem_state.backoff < MAX_BACKOFF)
@@ -663,16 +939,145 @@ tapdisk_server_initialize_lowmem_mode(void)
 	return tapdisk_server_reset_lowmem_mode();
 }
 
+/* Memory budget algorithm:
+ * Besides the low memory mode above, request buffers, the requests taken off
+ * each ring and the block and bitmap caches are scaled by a budget, in
+ * percent, derived from the memory pressure stall information (PSI) of the
+ * kernel: full while tasks hardly stall on memory, down to MEM_BUDGET_MIN as
+ * the share of time stalled reaches MEM_PSI_HIGH. The budget follows pressure
+ * down quickly and recovers slowly, so that moderate pressure trims memory use
+ * rather than stopping I/O.
+ */
+
+#define MEM_PSI_PATH "/proc/pressure/memory"
+#define MEM_PSI_INTERVAL 2 /* secs */
+#define MEM_PSI_LOW 5 /* % of time some task stalled, avg10 */
+#define MEM_PSI_HIGH 40
+#define MEM_BUDGET_MIN 10
+
+unsigned int
+tapdisk_server_mem_budget(void)
+{
+	return server.psi_state.budget;
+}
+
+static void mem_psi_state_init(void)
+{
+	server.psi_state.fd = -1;
+	server.psi_state.evid = -1;
+	server.psi_state.budget = TD_MEM_BUDGET_FULL;
+}
+
+static void mem_psi_cleanup(void)
+{
+	if (server.psi_state.evid >= 0)
+		tapdisk_server_unregister_event(server.psi_state.evid);
+	if (server.psi_state.fd >= 0)
+		close(server.psi_state.fd);
+
+	mem_psi_state_init();
+}
+
+static int cpumond_pressure(int, double *);
+
+static int
+mem_psi_read(double *avg10)
+{
+	char buf[256];
+	ssize_t n;
+
+	/* cpumond reads it for all tapdisks on the host */
+	if (!cpumond_pressure(CPUMOND_PSI_MEMORY, avg10))
+		return 0;
+
+	n = pread(server.psi_state.fd, buf, sizeof(buf) - 1, 0);
+	if (n < 0)
+		return -errno;
+	buf[n] = '\0';
+
+	if (sscanf(buf, "some avg10=%lf", avg10) != 1)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void mem_psi_timeout(event_id_t id, char mode, void *data)
+{
+	unsigned int budget, target;
+	double avg10;
+	int err;
+
+	err = mem_psi_read(&avg10);
+	if (err) {
+		ERR(-err, "Failed to read %s: %s\n", MEM_PSI_PATH,
+		    strerror(-err));
+		mem_psi_cleanup();
+		return;
+	}
+
+	if (avg10 <= MEM_PSI_LOW)
+		target = TD_MEM_BUDGET_FULL;
+	else if (avg10 >= MEM_PSI_HIGH)
+		target = MEM_BUDGET_MIN;
+	else
+		target = TD_MEM_BUDGET_FULL -
+			(TD_MEM_BUDGET_FULL - MEM_BUDGET_MIN) *
+			(avg10 - MEM_PSI_LOW) / (MEM_PSI_HIGH - MEM_PSI_LOW);
+
+	/* halve the distance going down, an eighth of it going up */
+	budget = server.psi_state.budget;
+	if (target < budget)
+		budget -= (budget - target + 1) / 2;
+	else if (target > budget)
+		budget += (target - budget + 7) / 8;
+
+	if (budget != server.psi_state.budget) {
+		DPRINTF("memory budget %u%% (pressure %.2f%%)\n", budget, avg10);
+		server.psi_state.budget = budget;
+	}
+}
+
+/* Once-off initialization, without PSI the budget stays full */
+static void
+tapdisk_server_initialize_mem_budget(void)
+{
+	mem_psi_state_init();
+
+	server.psi_state.fd = open(MEM_PSI_PATH, O_RDONLY | O_CLOEXEC);
+	if (server.psi_state.fd == -1)
+		return;
+
+	server.psi_state.evid =
+		tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					      -1,
+					      TV_SECS(MEM_PSI_INTERVAL),
+					      mem_psi_timeout,
+					      NULL);
+	if (server.psi_state.evid < 0) {
+		ERR(-server.psi_state.evid,
+		    "Failed to initialize memory budget: %s\n",
+		    strerror(-server.psi_state.evid));
+		mem_psi_cleanup();
+	}
+}
+
+/*
+ * Polling spins on a CPU; once runnable tasks stall waiting for one for
+ * more than this share of the time, polling only takes it from them.
+ */
+#define CPU_PSI_POLL_MAX 20 /* % of time some task stalled, avg10 */
+
 static void cpumond_state_init(void)
 {
 	server.cpumond_state.fd = -1;
 	server.cpumond_state.cpumon = (cpumond_t *) 0;
+	server.cpumond_state.size = 0;
 }
 
 static void cpumond_cleanup(void)
 {
 	if (server.cpumond_state.cpumon)
-		munmap(server.cpumond_state.cpumon, sizeof(cpumond_t));
+		munmap(server.cpumond_state.cpumon, server.cpumond_state.size);
 	if (server.cpumond_state.fd >= 0)
 		close(server.cpumond_state.fd);
 
@@ -688,15 +1093,121 @@ tapdisk_server_system_idle_cpu(void)
 		return 0.0;
 }
 
+float
+tapdisk_server_local_idle_cpu(void)
+{
+	const cpumond_t *mon = server.cpumond_state.cpumon;
+	uint64_t seq;
+	float idle;
+	int cpu, online, tries;
+
+	if (!mon || mon->version < CPUMOND_VERSION)
+		return tapdisk_server_system_idle_cpu();
+
+	cpu = sched_getcpu();
+	if (cpu < 0 || (size_t)cpu >= mon->nr_cpus ||
+	    CPUMOND_SIZE(cpu + 1) > server.cpumond_state.size)
+		return tapdisk_server_system_idle_cpu();
+
+	/* cpumond updates rarely, a retry is unlikely to be needed twice */
+	for (tries = 0; tries < 4; tries++) {
+		seq = __atomic_load_n(&mon->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		idle = mon->cpus[cpu].idle;
+		online = mon->cpus[cpu].online;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&mon->seq, __ATOMIC_RELAXED) == seq)
+			return online ? idle : tapdisk_server_system_idle_cpu();
+	}
+
+	return tapdisk_server_system_idle_cpu();
+}
+
+/*
+ * Share of the last 10 s, in percent, that some task stalled on @resource
+ * (CPUMOND_PSI_*), as published by cpumond.
+ */
+static int
+cpumond_pressure(int resource, double *some10)
+{
+	const cpumond_t *mon = server.cpumond_state.cpumon;
+	const cpumond_psi_t *psi;
+	uint64_t seq;
+	int tries, valid;
+	float val;
+
+	if (!mon || !(mon->flags & CPUMOND_F_PSI) ||
+	    CPUMOND_PSI_SIZE(mon->nr_cpus) > server.cpumond_state.size)
+		return -ENOENT;
+
+	psi = &CPUMOND_PSI(mon)[resource];
+
+	for (tries = 0; tries < 4; tries++) {
+		seq = __atomic_load_n(&mon->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		valid = psi->valid;
+		val = psi->some10;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&mon->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if (!valid)
+			return -ENOENT;
+
+		*some10 = val;
+		return 0;
+	}
+
+	return -EAGAIN;
+}
+
+int
+tapdisk_server_cpu_contended(void)
+{
+	double some10;
+
+	if (!server.cpumond_state.poll_psi_max)
+		return 0;
+
+	if (cpumond_pressure(CPUMOND_PSI_CPU, &some10))
+		return 0;
+
+	return some10 >= server.cpumond_state.poll_psi_max;
+}
+
 /* Create the CPU Utilisation Monitor client. */
 static int
 tapdisk_server_initialize_cpumond_client(void)
 {
+	struct stat st;
+	const char *val;
+
+	server.cpumond_state.poll_psi_max = CPU_PSI_POLL_MAX;
+	val = getenv("TAPDISK3_POLL_CPU_PRESSURE");
+	if (val && atoi(val) >= 0)
+		server.cpumond_state.poll_psi_max = atoi(val);
+
 	server.cpumond_state.fd = shm_open(CPUMOND_PATH, O_RDONLY, 0);
 	if (server.cpumond_state.fd == -1)
 		return -errno;
 
-	server.cpumond_state.cpumon = mmap(NULL, sizeof(cpumond_t), PROT_READ, MAP_PRIVATE, server.cpumond_state.fd, 0);
+	if (fstat(server.cpumond_state.fd, &st))
+		return -errno;
+
+	/*
+	 * A segment made by an older cpumond only holds curr and idle; the
+	 * rest of our header then reads as zero from the same page.
+	 */
+	server.cpumond_state.size = st.st_size > (off_t)sizeof(cpumond_t) ?
+		st.st_size : sizeof(cpumond_t);
+
+	server.cpumond_state.cpumon = mmap(NULL, server.cpumond_state.size, PROT_READ, MAP_SHARED, server.cpumond_state.fd, 0);
 	if (server.cpumond_state.cpumon == (cpumond_t *) -1) {
 		server.cpumond_state.cpumon = 0;
 		return -errno;
@@ -705,62 +1216,793 @@ tapdisk_server_initialize_cpumond_client(void)
 	return 0;
 }
 
-int
-tapdisk_server_init(void)
+static void
+tapdisk_worker_kick_event(event_id_t id __attribute__((unused)),
+			  char mode __attribute__((unused)), void *private)
 {
-	int ret;
-	unsigned int i = 0;
+	tapdisk_worker_t *w = private;
+	tapdisk_server_call_t fn;
+	unsigned long notify;
+	uint64_t val;
+	void *arg;
+	int sig, ret;
+
+	if (read(w->kick_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		ERR(-errno, "failed to read worker kick: %s\n", strerror(errno));
+
+	notify = __sync_fetch_and_and(&w->notify, 0);
+	if (notify & TAPDISK_NOTIFY_MEM_MODE)
+		tapdisk_server_sync_mem_mode();
+	for (sig = 1; sig < 32; sig++)
+		if (notify & (1UL << sig))
+			tapdisk_server_handle_signal(sig);
+
+	/*
+	 * take the call before running it: the callee may iterate this
+	 * event loop and come back here
+	 */
+	pthread_mutex_lock(&w->lock);
+	fn          = w->call.fn;
+	arg         = w->call.arg;
+	w->call.fn  = NULL;
+	pthread_mutex_unlock(&w->lock);
+
+	if (!fn)
+		return;
 
-	PAGE_SIZE = sysconf(_SC_PAGESIZE);
-	PAGE_MASK = ~(PAGE_SIZE - 1);
+	ret = fn(arg);
 
-	for (i = PAGE_SIZE, PAGE_SHIFT = 0; i > 1; i >>= 1, PAGE_SHIFT++);
+	pthread_mutex_lock(&w->lock);
+	w->call.ret  = ret;
+	w->call.done = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
 
-	memset(&server, 0, sizeof(server));
-	INIT_LIST_HEAD(&server.vbds);
+static int
+tapdisk_server_open_kick(void)
+{
+	int fd, err;
 
-	scheduler_initialize(&server.scheduler);
+	fd = eventfd(0, 0);
+	if (fd == -1)
+		return -errno;
 
-	if ((ret = tapdisk_server_initialize_lowmem_mode()) < 0) {
-		EPRINTF("Failed to initialize low memory handler: %s\n",
-		        strerror(-ret));
-		lowmem_cleanup();
-		goto out;
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		err = -errno;
+		close(fd);
+		return err;
 	}
 
-	if ((ret = tapdisk_server_initialize_cpumond_client()) < 0) {
-		EPRINTF("Failed to connect to cpumond: %s\n",
-			strerror(-ret));
-		cpumond_cleanup();
-		goto out;
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD, fd, TV_ZERO,
+					    tapdisk_worker_kick_event, worker);
+	if (err < 0) {
+		close(fd);
+		return err;
 	}
 
-out:
-	server.tlog_reopen_evid = -1;
+	worker->kick_fd   = fd;
+	worker->kick_evid = err;
 
 	return 0;
 }
 
-int
-tapdisk_server_complete(void)
+static void
+tapdisk_server_close_kick(void)
 {
-	int err;
+	if (worker->kick_fd < 0)
+		return;
 
-	err = tapdisk_server_init_aio();
-	if (err)
-		goto fail;
+	tapdisk_server_unregister_event(worker->kick_evid);
+	close(worker->kick_fd);
+	worker->kick_fd = -1;
+}
 
-	err = tapdisk_server_open_tlog();
-	if (err)
-		goto fail;
+static void
+tapdisk_server_notify_workers(unsigned long notify)
+{
+	int i;
 
-	server.run = 1;
+	for (i = 0; i < server.nr_workers; i++) {
+		tapdisk_worker_t *w = &server.workers[i];
 
-	return 0;
+		if (w == worker)
+			continue;
+
+		__sync_fetch_and_or(&w->notify, notify);
+		tapdisk_worker_kick(w);
+	}
+}
+
+/*
+ * Runs @fn on the event loop of @w and waits for it to return.
+ */
+static int
+tapdisk_worker_call(tapdisk_worker_t *w, tapdisk_server_call_t fn, void *arg)
+{
+	int ret;
+
+	if (w == worker)
+		return fn(arg);
+
+	pthread_mutex_lock(&w->lock);
+	w->call.fn   = fn;
+	w->call.arg  = arg;
+	w->call.done = 0;
+	pthread_mutex_unlock(&w->lock);
+
+	tapdisk_worker_kick(w);
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->call.done)
+		pthread_cond_wait(&w->cond, &w->lock);
+	ret = w->call.ret;
+	pthread_mutex_unlock(&w->lock);
+
+	return ret;
+}
+
+static struct tapdisk_pin *
+tapdisk_server_find_pin(td_uuid_t uuid)
+{
+	struct tapdisk_pin *pin;
+
+	list_for_each_entry(pin, &server.pins, entry)
+		if (pin->uuid == uuid)
+			return pin;
+
+	return NULL;
+}
+
+static struct tapdisk_pin *
+__tapdisk_server_pin_vbd(td_uuid_t uuid, tapdisk_worker_t *w)
+{
+	struct tapdisk_pin *pin;
+
+	pin = malloc(sizeof(*pin));
+	if (!pin)
+		return NULL;
+
+	pin->uuid   = uuid;
+	pin->worker = w;
+	w->nr_pinned++;
+	list_add_tail(&pin->entry, &server.pins);
+
+	DPRINTF("VBD %u placed on worker %d\n", uuid, w->id);
+
+	return pin;
+}
+
+/*
+ * The least loaded worker, keeping clear of those moved to a guest's
+ * cgroup while others are left.
+ */
+static struct tapdisk_pin *
+tapdisk_server_pin_vbd(td_uuid_t uuid)
+{
+	tapdisk_worker_t *w, *c;
+	int i;
+
+	w = NULL;
+	for (i = 0; i < server.nr_workers; i++) {
+		c = &server.workers[i];
+		if (!w || (!c->cgroup && w->cgroup) ||
+		    (!c->cgroup == !w->cgroup && c->nr_pinned < w->nr_pinned))
+			w = c;
+	}
+
+	return __tapdisk_server_pin_vbd(uuid, w);
+}
+
+static void
+tapdisk_server_unpin_vbd(struct tapdisk_pin *pin)
+{
+	pin->worker->nr_pinned--;
+	list_del(&pin->entry);
+	free(pin);
+}
+
+struct tapdisk_vbd_call {
+	td_uuid_t                    uuid;
+	tapdisk_server_call_t        fn;
+	void                        *arg;
+	int                          exists;
+};
+
+static int
+__tapdisk_server_call_vbd(void *private)
+{
+	struct tapdisk_vbd_call *call = private;
+	int err;
+
+	err = call->fn(call->arg);
+	call->exists = !!tapdisk_server_get_vbd(call->uuid);
+
+	return err;
+}
+
+int
+tapdisk_server_call_vbd(td_uuid_t uuid, tapdisk_server_call_t fn, void *arg)
+{
+	struct tapdisk_vbd_call call = { uuid, fn, arg, 0 };
+	struct tapdisk_pin *pin;
+	int err;
+
+	if (!server.nr_workers)
+		return fn(arg);
+
+	pin = tapdisk_server_find_pin(uuid);
+	if (!pin) {
+		pin = tapdisk_server_pin_vbd(uuid);
+		if (!pin)
+			return -ENOMEM;
+	}
+
+	err = tapdisk_worker_call(pin->worker, __tapdisk_server_call_vbd, &call);
+	if (!call.exists)
+		tapdisk_server_unpin_vbd(pin);
+
+	return err;
+}
+
+static int
+tapdisk_server_write_id(const char *path, pid_t id)
+{
+	char buf[16];
+	int fd, len, err;
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	err = 0;
+	len = snprintf(buf, sizeof(buf), "%d\n", id);
+	if (write(fd, buf, len) != len)
+		err = errno ? -errno : -EIO;
+
+	close(fd);
+	return err;
+}
+
+/*
+ * Moves thread @tid, or the whole process for 0, to cgroup directory
+ * @cgroup. A thread on its own needs a v1 hierarchy (tasks) or a threaded
+ * v2 subtree (cgroup.threads).
+ */
+static int
+tapdisk_server_cgroup_attach(const char *cgroup, pid_t tid)
+{
+	static const char * const files[] = { "cgroup.threads", "tasks" };
+	char path[PATH_MAX];
+	int i, err;
+
+	if (!tid) {
+		snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup);
+		return tapdisk_server_write_id(path, getpid());
+	}
+
+	err = -ENOENT;
+	for (i = 0; i < ARRAY_SIZE(files) && err == -ENOENT; i++) {
+		snprintf(path, sizeof(path), "%s/%s", cgroup, files[i]);
+		err = tapdisk_server_write_id(path, tid);
+	}
+
+	return err;
+}
+
+int
+tapdisk_server_set_cgroup(td_uuid_t uuid, const char *cgroup)
+{
+	struct tapdisk_pin *pin;
+	tapdisk_worker_t *w;
+	td_vbd_t *vbd;
+	char *name;
+	int i, err;
+
+	if (cgroup[0] != '/')
+		return -EINVAL;
+
+	if (!server.nr_workers) {
+		/* the process as a whole, as long as it serves just the VBD */
+		list_for_each_entry(vbd, &server.main.vbds, next)
+			if (vbd->uuid != uuid)
+				return -EBUSY;
+
+		err = tapdisk_server_cgroup_attach(cgroup, 0);
+		if (!err)
+			DPRINTF("moved to cgroup %s\n", cgroup);
+		return err;
+	}
+
+	w   = NULL;
+	pin = tapdisk_server_find_pin(uuid);
+	if (pin) {
+		w = pin->worker;
+		if (w->cgroup && !strcmp(w->cgroup, cgroup))
+			return 0;
+		if (w->nr_pinned > 1)
+			return -EBUSY;
+	} else {
+		/* a worker of the same guest, else an idle one */
+		for (i = 0; i < server.nr_workers && !w; i++)
+			if (server.workers[i].cgroup &&
+			    !strcmp(server.workers[i].cgroup, cgroup))
+				w = &server.workers[i];
+
+		for (i = 0; i < server.nr_workers && !w; i++)
+			if (!server.workers[i].nr_pinned)
+				w = &server.workers[i];
+
+		if (!w)
+			return -EBUSY;
+	}
+
+	if (!w->cgroup || strcmp(w->cgroup, cgroup)) {
+		name = strdup(cgroup);
+		if (!name)
+			return -ENOMEM;
+
+		err = tapdisk_server_cgroup_attach(cgroup, w->tid);
+		if (err) {
+			free(name);
+			return err;
+		}
+
+		free(w->cgroup);
+		w->cgroup = name;
+
+		DPRINTF("worker %d moved to cgroup %s\n", w->id, cgroup);
+	}
+
+	if (!pin && !__tapdisk_server_pin_vbd(uuid, w))
+		return -ENOMEM;
+
+	return 0;
+}
+
+int
+tapdisk_server_call_any(tapdisk_server_call_t fn, void *arg)
+{
+	int i, err;
+
+	err = fn(arg);
+
+	for (i = 0; i < server.nr_workers && err == -ENODEV; i++)
+		err = tapdisk_worker_call(&server.workers[i], fn, arg);
 
-fail:
-	tapdisk_server_close_tlog();
-	tapdisk_server_close_aio();
+	return err;
+}
+
+int
+tapdisk_server_call_all(tapdisk_server_call_t fn, void *arg)
+{
+	int i, err;
+
+	err = fn(arg);
+
+	for (i = 0; i < server.nr_workers && !err; i++)
+		err = tapdisk_worker_call(&server.workers[i], fn, arg);
+
+	return err;
+}
+
+/*
+ * Spreads the workers over the CPUs of the affinity mask, one CPU each,
+ * so that what a worker allocates comes from its own node.
+ */
+static void
+tapdisk_server_pin_worker(tapdisk_worker_t *w)
+{
+	cpu_set_t set;
+	int cpu, n, err;
+
+	n = (w->id - 1) % server.nr_cpus;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &server.cpus) && !n--)
+			break;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err)
+		EPRINTF("failed to pin worker %d to CPU %d: %s\n",
+			w->id, cpu, strerror(err));
+	else
+		DPRINTF("worker %d pinned to CPU %d\n", w->id, cpu);
+}
+
+static void *
+tapdisk_worker_thread(void *private)
+{
+	tapdisk_worker_t *w = private;
+	int err;
+
+	worker = w;
+	w->tid = syscall(SYS_gettid);
+
+	if (server.nr_cpus)
+		tapdisk_server_pin_worker(w);
+
+	scheduler_initialize(&w->scheduler);
+
+	err = tapdisk_server_init_aio();
+	if (!err) {
+		err = tapdisk_server_open_kick();
+		if (err)
+			tapdisk_server_close_aio();
+	}
+
+	pthread_mutex_lock(&w->lock);
+	w->call.ret  = err;
+	w->call.done = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	if (err) {
+		scheduler_uninitialize(&w->scheduler);
+		return NULL;
+	}
+
+	__tapdisk_server_run();
+
+	tapdisk_server_close_kick();
+	tapdisk_server_close_aio();
+	scheduler_uninitialize(&w->scheduler);
+
+	return NULL;
+}
+
+static int
+tapdisk_worker_start(tapdisk_worker_t *w, int id)
+{
+	int err;
+
+	memset(w, 0, sizeof(*w));
+	w->id      = id;
+	w->run     = 1;
+	w->kick_fd = -1;
+	INIT_LIST_HEAD(&w->vbds);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	err = pthread_create(&w->thread, NULL, tapdisk_worker_thread, w);
+	if (err)
+		return -err;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->call.done)
+		pthread_cond_wait(&w->cond, &w->lock);
+	err = w->call.ret;
+	pthread_mutex_unlock(&w->lock);
+
+	if (err)
+		pthread_join(w->thread, NULL);
+
+	return err;
+}
+
+static void
+tapdisk_worker_stop(tapdisk_worker_t *w)
+{
+	w->run = 0;
+	tapdisk_worker_kick(w);
+	pthread_join(w->thread, NULL);
+
+	free(w->cgroup);
+	w->cgroup = NULL;
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+}
+
+/*
+ * With TAPDISK3_WORKERS=<n>, VBDs are served by n worker threads, each
+ * with its own event loop. The main thread keeps the control socket and
+ * the server-wide events, and runs VBD messages on the owning worker.
+ */
+static int
+tapdisk_server_start_workers(void)
+{
+	const char *val;
+	sigset_t set, old;
+	int i, n, err;
+
+	val = getenv("TAPDISK3_WORKERS");
+	if (!val)
+		return 0;
+
+	n = atoi(val);
+	if (n <= 0)
+		return 0;
+	if (n > TAPDISK_MAX_WORKERS)
+		n = TAPDISK_MAX_WORKERS;
+
+	server.workers = calloc(n, sizeof(tapdisk_worker_t));
+	if (!server.workers)
+		return -ENOMEM;
+
+	err = tapdisk_server_open_kick();
+	if (err)
+		goto fail;
+
+	/* asynchronous signals go to the main thread, which forwards them */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < n; i++) {
+		err = tapdisk_worker_start(&server.workers[i], i + 1);
+		if (err)
+			break;
+		server.nr_workers++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err) {
+		EPRINTF("failed to start worker %d: %s\n", i + 1, strerror(-err));
+		goto fail;
+	}
+
+	DPRINTF("serving VBDs from %d worker threads\n", n);
+
+	return 0;
+
+fail:
+	tapdisk_server_stop_workers();
+	return err;
+}
+
+static void
+tapdisk_server_stop_workers(void)
+{
+	int i;
+
+	for (i = 0; i < server.nr_workers; i++)
+		tapdisk_worker_stop(&server.workers[i]);
+
+	while (!list_empty(&server.pins))
+		tapdisk_server_unpin_vbd(list_first_entry(&server.pins,
+							  struct tapdisk_pin,
+							  entry));
+
+	free(server.workers);
+	server.workers    = NULL;
+	server.nr_workers = 0;
+}
+
+/*
+ * Parses a list of CPUs or nodes such as "0-3,8,10-11".
+ */
+static int
+tapdisk_server_parse_cpulist(const char *list, cpu_set_t *set)
+{
+	const char *s = list;
+	char *end;
+	long first, last;
+
+	CPU_ZERO(set);
+
+	while (*s && *s != '\n') {
+		first = strtol(s, &end, 10);
+		if (end == s || first < 0)
+			return -EINVAL;
+
+		last = first;
+		if (*end == '-') {
+			s    = end + 1;
+			last = strtol(s, &end, 10);
+			if (end == s || last < first)
+				return -EINVAL;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return -ERANGE;
+
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+
+		s = end;
+		if (*s == ',')
+			s++;
+		else if (*s && *s != '\n')
+			return -EINVAL;
+	}
+
+	return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+
+#define TAPDISK_NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+#define TAPDISK_MAX_NODES    64
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED       1
+#endif
+
+/*
+ * Prefers memory from the node of the given CPUs, when they all sit on
+ * one. Otherwise allocations stay local to the CPU that first touches
+ * them, which is what pinning the workers relies on.
+ */
+static void
+tapdisk_server_set_mempolicy(const cpu_set_t *cpus)
+{
+	unsigned long mask;
+	cpu_set_t node_cpus, both;
+	char path[64], buf[1024];
+	int node, found;
+	FILE *f;
+
+	found = -1;
+
+	for (node = 0; node < TAPDISK_MAX_NODES; node++) {
+		snprintf(path, sizeof(path), TAPDISK_NODE_CPULIST, node);
+
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+
+		if (!fgets(buf, sizeof(buf), f) ||
+		    tapdisk_server_parse_cpulist(buf, &node_cpus)) {
+			fclose(f);
+			continue;
+		}
+		fclose(f);
+
+		CPU_AND(&both, &node_cpus, cpus);
+		if (!CPU_COUNT(&both))
+			continue;
+
+		if (found >= 0) {
+			DPRINTF("CPU affinity spans NUMA nodes %d and %d, "
+				"keeping local allocation\n", found, node);
+			return;
+		}
+
+		found = node;
+	}
+
+	if (found < 0)
+		return;
+
+#ifdef SYS_set_mempolicy
+	mask = 1UL << found;
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask,
+		    sizeof(mask) * 8) == -1) {
+		EPRINTF("failed to prefer memory from NUMA node %d: %s\n",
+			found, strerror(errno));
+		return;
+	}
+
+	DPRINTF("preferring memory from NUMA node %d\n", found);
+#else
+	(void)mask;
+#endif
+}
+
+int
+tapdisk_server_set_affinity(const char *cpus)
+{
+	int err;
+
+	err = tapdisk_server_parse_cpulist(cpus, &server.cpus);
+	if (err) {
+		EPRINTF("invalid CPU list '%s'\n", cpus);
+		return err;
+	}
+
+	if (sched_setaffinity(0, sizeof(server.cpus), &server.cpus)) {
+		err = -errno;
+		EPRINTF("failed to set CPU affinity '%s': %s\n",
+			cpus, strerror(-err));
+		return err;
+	}
+
+	server.nr_cpus = CPU_COUNT(&server.cpus);
+	DPRINTF("CPU affinity set to %s\n", cpus);
+
+	tapdisk_server_set_mempolicy(&server.cpus);
+
+	return 0;
+}
+
+int
+tapdisk_server_init(void)
+{
+	unsigned int i = 0;
+
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	PAGE_MASK = ~(PAGE_SIZE - 1);
+
+	for (i = PAGE_SIZE, PAGE_SHIFT = 0; i > 1; i >>= 1, PAGE_SHIFT++);
+
+	memset(&server, 0, sizeof(server));
+	INIT_LIST_HEAD(&server.main.vbds);
+	INIT_LIST_HEAD(&server.pins);
+	server.main.kick_fd = -1;
+
+	scheduler_initialize(&server.main.scheduler);
+
+	lowmem_state_init();
+	mem_psi_state_init();
+	cpumond_state_init();
+
+	server.tlog_reopen_evid = -1;
+
+	return 0;
+}
+
+/*
+ * Everything only VBDs need is kept out of tapdisk_server_init, so that
+ * a freshly spawned tapdisk answers tap-ctl as soon as its control
+ * socket is up, and set up here right after.
+ */
+int
+tapdisk_server_prepare(void)
+{
+	int err;
+
+	if (likely(server.prepared))
+		return 0;
+
+	tapdisk_server_initialize_mem_budget();
+
+	err = tapdisk_server_initialize_lowmem_mode();
+	if (err < 0) {
+		EPRINTF("Failed to initialize low memory handler: %s\n",
+		        strerror(-err));
+		lowmem_cleanup();
+	}
+
+	err = tapdisk_server_initialize_cpumond_client();
+	if (err < 0) {
+		EPRINTF("Failed to connect to cpumond: %s\n",
+			strerror(-err));
+		cpumond_cleanup();
+	}
+
+	err = tapdisk_server_init_aio();
+	if (err)
+		goto fail;
+
+	err = tapdisk_server_start_workers();
+	if (err)
+		goto fail;
+
+	server.prepared = 1;
+
+	return 0;
+
+fail:
+	EPRINTF("failed to prepare server: %s\n", strerror(-err));
+	tapdisk_server_close_kick();
+	tapdisk_server_close_aio();
+	cpumond_cleanup();
+	lowmem_cleanup();
+	mem_psi_cleanup();
+	return err;
+}
+
+int
+tapdisk_server_complete(void)
+{
+	int err;
+
+	err = tapdisk_server_open_tlog();
+	if (err)
+		goto fail;
+
+	server.main.run = 1;
+
+	return 0;
+
+fail:
+	tapdisk_server_close_tlog();
 	return err;
 }
 
@@ -775,6 +2017,10 @@ tapdisk_server_initialize(const char *read, const char *write)
 	if (err)
 		goto fail;
 
+	err = tapdisk_server_prepare();
+	if (err)
+		goto fail;
+
 	return 0;
 
 fail:
@@ -819,6 +2065,6 @@ out:
 
 int
 tapdisk_server_event_set_timeout(event_id_t event_id, struct timeval timeo) {
-	return scheduler_event_set_timeout(&server.scheduler, event_id, timeo);
+	return scheduler_event_set_timeout(&worker->scheduler, event_id, timeo);
 }
 
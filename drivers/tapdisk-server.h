@@ -39,12 +39,57 @@ enum memory_mode_t {NORMAL_MEMORY_MODE, LOW_MEMORY_MODE};
 
 enum memory_mode_t tapdisk_server_mem_mode(void);
 
+/*
+ * Share, in percent, of their configured size that caches and the requests
+ * taken off each ring may use. Below TD_MEM_BUDGET_FULL under memory
+ * pressure, independently of LOW_MEMORY_MODE.
+ */
+#define TD_MEM_BUDGET_FULL 100
+
+unsigned int tapdisk_server_mem_budget(void);
+
 struct tap_disk *tapdisk_server_find_driver_interface(int);
 
 td_image_t *tapdisk_server_get_shared_image(td_image_t *);
 
+/**
+ * Returns the VBDs served by the calling thread's event loop.
+ */
 struct list_head *tapdisk_server_get_all_vbds(void);
 
+typedef int (*tapdisk_server_call_t)(void *);
+
+/**
+ * Runs @fn on the event loop that owns the VBD with the specified uuid and
+ * waits for it, placing the VBD on the least loaded worker thread first if
+ * it has none yet. Without worker threads, this just calls @fn.
+ */
+int tapdisk_server_call_vbd(td_uuid_t, tapdisk_server_call_t fn, void *arg);
+
+/**
+ * Charges the I/O of the VBD with the specified uuid to cgroup directory
+ * @cgroup, by moving the worker thread that serves it there: a worker of
+ * the same guest, or an idle one. -EBUSY where the VBD would have to share
+ * with others. Without worker threads, moves the whole process if it
+ * serves no other VBD. Main thread only.
+ */
+int tapdisk_server_set_cgroup(td_uuid_t, const char *cgroup);
+
+/**
+ * Runs @fn on each event loop in turn until one returns other than -ENODEV.
+ */
+int tapdisk_server_call_any(tapdisk_server_call_t fn, void *arg);
+
+/**
+ * Runs @fn on each event loop in turn, stopping at the first error.
+ */
+int tapdisk_server_call_all(tapdisk_server_call_t fn, void *arg);
+
+/**
+ * Tells whether the caller runs on a worker thread, not the main thread.
+ */
+int tapdisk_server_in_worker(void);
+
 /**
  * Returns the VBD that corresponds to the specified minor.
  * Returns NULL if such a VBD does not exist.
@@ -63,16 +108,66 @@ void tapdisk_server_remove_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
 
+/**
+ * Sets the priority (TD_PRIO_*) tiocbs are queued with from now on,
+ * returning the previous one. Set around handing a request to a driver,
+ * so that what it queues meanwhile inherits the request's priority;
+ * tiocbs queued later on, from completions, are foreground.
+ */
+int tapdisk_server_set_prio(int prio);
+
+struct td_profile;
+
+/**
+ * Likewise sets the VBD profile that tiocbs queued from now on account
+ * their wait for submission to, returning the previous one.
+ */
+struct td_profile *tapdisk_server_set_profile(struct td_profile *);
+
+struct tapdisk_storage_profile;
+
+/**
+ * Fits the worker's queue to the device behind fd: merges stop at the
+ * device's max I/O size, and fair dispatch keeps no deeper than its
+ * queue. Untune before closing fd.
+ */
+void tapdisk_server_tune_fd(int fd, const struct tapdisk_storage_profile *);
+void tapdisk_server_untune_fd(int fd);
+
 void tapdisk_server_check_state(void);
 
 event_id_t tapdisk_server_register_event(char, int, struct timeval, event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_mask_event(event_id_t, int);
 void tapdisk_server_set_max_timeout(int);
+void tapdisk_server_set_max_timeout_us(long);
+
+/*
+ * Deferred work on the calling event loop, see scheduler_defer. Work
+ * queued from other threads goes to the loop's scheduler_post.
+ */
+void tapdisk_server_defer(scheduler_work_t *);
+void tapdisk_server_cancel_work(scheduler_work_t *);
+scheduler_t *tapdisk_server_get_scheduler(void);
 
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(const char *, const char *);
 int tapdisk_server_complete(void);
+
+/**
+ * Sets up the AIO queue, the worker threads and the memory and cpumond
+ * clients; call before creating a VBD. Later calls are no-ops once it
+ * succeeded.
+ */
+int tapdisk_server_prepare(void);
+
+/**
+ * Restricts tapdisk and its worker threads to a list of CPUs such as
+ * "0-3,8", and prefers memory from their NUMA node. Call after
+ * tapdisk_server_init, so that everything allocated for VBDs later on
+ * lands close to those CPUs.
+ */
+int tapdisk_server_set_affinity(const char *cpus);
 int tapdisk_server_run(void);
 void tapdisk_server_iterate(void);
 
@@ -85,4 +180,17 @@ int tapdisk_server_event_set_timeout(event_id_t, struct timeval timeo);
 
 float tapdisk_server_system_idle_cpu(void);
 
+/*
+ * Idle percentage of the CPU the calling thread runs on, as published by
+ * cpumond, or the host-wide figure if no per-CPU figure is available.
+ */
+float tapdisk_server_local_idle_cpu(void);
+
+/*
+ * Whether tasks stall waiting for CPU more than TAPDISK3_POLL_CPU_PRESSURE
+ * percent of the time (20 by default, 0 never), from the CPU pressure
+ * cpumond publishes. Polling then only takes CPU from others.
+ */
+int tapdisk_server_cpu_contended(void);
+
 #endif
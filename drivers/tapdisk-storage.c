@@ -34,9 +34,13 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
+#include <sys/sysmacros.h>
 
 #include "tapdisk-storage.h"
 
@@ -72,12 +76,95 @@ __tapdisk_blk_storage_type(const char *rpath)
 	return TAPDISK_STORAGE_TYPE_LVM;
 }
 
+/*
+ * Profiles are kept per device for the life of the process: every
+ * image on an SR shares one, and sysfs is read once per SR.
+ */
+#define TAPDISK_STORAGE_CACHE 16
+
+struct tapdisk_storage_entry {
+	dev_t                           dev;
+	struct tapdisk_storage_profile  profile;
+};
+
+static struct tapdisk_storage_entry storage_cache[TAPDISK_STORAGE_CACHE];
+static int storage_cached;
+static pthread_mutex_t storage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+__tapdisk_storage_read(dev_t dev, const char *attr, unsigned long *val)
+{
+	const char *fmt[] = {
+		"/sys/dev/block/%u:%u/queue/%s",
+		/* a partition has its disk's queue */
+		"/sys/dev/block/%u:%u/../queue/%s",
+	};
+	char path[PATH_MAX];
+	unsigned int i;
+	FILE *f;
+	int n;
+
+	for (i = 0; i < sizeof(fmt) / sizeof(fmt[0]); i++) {
+		snprintf(path, sizeof(path), fmt[i],
+			 major(dev), minor(dev), attr);
+
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+
+		n = fscanf(f, "%lu", val);
+		fclose(f);
+
+		return n == 1 ? 0 : -EINVAL;
+	}
+
+	return -ENOENT;
+}
+
+static void
+__tapdisk_storage_probe(dev_t dev, struct tapdisk_storage_profile *p)
+{
+	unsigned long val;
+	char path[PATH_MAX];
+	const char *env;
+	FILE *f;
+
+	env = getenv("TAPDISK3_STORAGE_TUNING");
+	if (env && !atoi(env))
+		return;
+
+	if (!__tapdisk_storage_read(dev, "rotational", &val))
+		p->rotational = !!val;
+	if (!__tapdisk_storage_read(dev, "nr_requests", &val))
+		p->queue_depth = val;
+	if (!__tapdisk_storage_read(dev, "logical_block_size", &val))
+		p->logical_block_size = val;
+	if (!__tapdisk_storage_read(dev, "optimal_io_size", &val))
+		p->optimal_io_size = val;
+	if (!__tapdisk_storage_read(dev, "max_sectors_kb", &val))
+		p->max_io_size = val << 10;
+
+	/* the bdi also exists for NFS mounts, which have no queue */
+	snprintf(path, sizeof(path), "/sys/class/bdi/%u:%u/read_ahead_kb",
+		 major(dev), minor(dev));
+	f = fopen(path, "r");
+	if (f) {
+		if (fscanf(f, "%lu", &val) == 1)
+			p->read_ahead_kb = val;
+		fclose(f);
+	} else if (!__tapdisk_storage_read(dev, "read_ahead_kb", &val))
+		p->read_ahead_kb = val;
+}
+
 int
-tapdisk_storage_type(const char *path)
+tapdisk_storage_profile(const char *path,
+			struct tapdisk_storage_profile *profile)
 {
+	struct tapdisk_storage_entry *e;
 	char rpath[PATH_MAX], *p;
 	struct stat st;
-	int err, rv;
+	dev_t dev;
+	int i, err, type;
 
 	p = realpath(path, rpath);
 	if (!p)
@@ -89,17 +176,59 @@ tapdisk_storage_type(const char *path)
 
 	switch (st.st_mode & S_IFMT) {
 	case S_IFBLK:
-		rv = __tapdisk_blk_storage_type(rpath);
+		dev = st.st_rdev;
 		break;
 	case S_IFREG:
-		rv = __tapdisk_fs_storage_type(rpath);
+		dev = st.st_dev;
 		break;
 	default:
-		rv = -EINVAL;
-		break;
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&storage_lock);
+	for (i = 0; i < storage_cached; i++)
+		if (storage_cache[i].dev == dev) {
+			*profile = storage_cache[i].profile;
+			pthread_mutex_unlock(&storage_lock);
+			return 0;
+		}
+	pthread_mutex_unlock(&storage_lock);
+
+	if (S_ISBLK(st.st_mode))
+		type = __tapdisk_blk_storage_type(rpath);
+	else
+		type = __tapdisk_fs_storage_type(rpath);
+	if (type < 0)
+		return type;
+
+	memset(profile, 0, sizeof(*profile));
+	profile->type       = type;
+	profile->rotational = -1;
+
+	__tapdisk_storage_probe(dev, profile);
+
+	pthread_mutex_lock(&storage_lock);
+	if (storage_cached < TAPDISK_STORAGE_CACHE) {
+		e          = &storage_cache[storage_cached++];
+		e->dev     = dev;
+		e->profile = *profile;
 	}
+	pthread_mutex_unlock(&storage_lock);
+
+	return 0;
+}
+
+int
+tapdisk_storage_type(const char *path)
+{
+	struct tapdisk_storage_profile profile;
+	int err;
+
+	err = tapdisk_storage_profile(path, &profile);
+	if (err)
+		return err;
 
-	return rv;
+	return profile.type;
 }
 
 const char *
@@ -35,7 +35,25 @@
 #define TAPDISK_STORAGE_TYPE_EXT       2
 #define TAPDISK_STORAGE_TYPE_LVM       3
 
+/*
+ * What tapdisk knows of the device backing an image, read from the
+ * block queue in sysfs. Zero (-1 for rotational) means unknown, as
+ * for NFS or with TAPDISK3_STORAGE_TUNING=0, and consumers keep
+ * their defaults then.
+ */
+struct tapdisk_storage_profile {
+	int                 type;
+	int                 rotational;
+	unsigned int        queue_depth;          /* nr_requests */
+	unsigned int        logical_block_size;   /* bytes */
+	unsigned int        optimal_io_size;      /* bytes */
+	unsigned int        max_io_size;          /* bytes, max_sectors_kb */
+	unsigned int        read_ahead_kb;
+};
+
 int tapdisk_storage_type(const char *path);
+int tapdisk_storage_profile(const char *path,
+			    struct tapdisk_storage_profile *profile);
 const char *tapdisk_storage_name(int type);
 
 #endif
@@ -39,13 +39,18 @@
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <limits.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <endian.h>
 
 #include "list.h"
 #include "scheduler.h"
 #include "tapdisk.h"
 #include "tapdisk-server.h"
 #include "tapdisk-disktype.h"
+#include "timeout-math.h"
 
 #define POLL_READ                        0
 #define POLL_WRITE                       1
@@ -54,8 +59,49 @@
 #define BUG(_cond)                       td_panic()
 #define BUG_ON(_cond)                    if (unlikely(_cond)) { td_panic(); }
 
-#define TD_STREAM_MAX_REQS               16
-#define TD_STREAM_REQ_SIZE               (sysconf(_SC_PAGE_SIZE) * 32)
+/*
+ * Reads are issued up to depth at a time and may complete in any order;
+ * the pool of depth requests is the reassembly window, each one being
+ * written out, in order, as soon as everything before it has been.
+ */
+#define TD_STREAM_DEFAULT_REQS           32
+#define TD_STREAM_MAX_REQS               256
+#define TD_STREAM_DEFAULT_REQ_SIZE       (1 << 20)
+#define TD_STREAM_MAX_REQ_SIZE           (16 << 20)
+#define TD_STREAM_MAX_IOVS               64
+
+/*
+ * Sparse stream format (-S on a non-seekable output), all fields little
+ * endian: a td_stream_header, then one td_stream_extent per run in disk
+ * order, each TD_STREAM_EXTENT_DATA one followed by its secs sectors of
+ * data, and a final TD_STREAM_EXTENT_END. Runs of TD_STREAM_EXTENT_ZERO
+ * carry no data and read as zeros.
+ */
+#define TD_STREAM_MAGIC                  "TDSPARSE"
+#define TD_STREAM_VERSION                1
+
+#define TD_STREAM_EXTENT_DATA            1
+#define TD_STREAM_EXTENT_ZERO            2
+#define TD_STREAM_EXTENT_END             3
+
+struct td_stream_header {
+	char                             magic[8];
+	uint32_t                         version;
+	uint32_t                         sector_size;
+	uint64_t                         sec;
+	uint64_t                         secs;
+} __attribute__((packed));
+
+struct td_stream_extent {
+	uint32_t                         type;
+	uint32_t                         reserved;
+	uint64_t                         sec;
+	uint64_t                         secs;
+} __attribute__((packed));
+
+#define TD_STREAM_OUT_PLAIN              0  /* every sector */
+#define TD_STREAM_OUT_SEEK               1  /* holes skipped with lseek */
+#define TD_STREAM_OUT_SPARSE             2  /* sparse stream format */
 
 typedef struct tapdisk_stream_request td_stream_req_t;
 typedef struct tapdisk_stream td_stream_t;
@@ -65,6 +111,11 @@ struct tapdisk_stream_request {
 	struct td_iovec                  iov;
 	td_vbd_request_t                 vreq;
 	struct list_head                 entry;
+
+	/* a hole is never read, and may be longer than a buffer */
+	int                              hole;
+	td_sector_t                      secs;
+	struct td_stream_extent          ext;
 };
 
 struct tapdisk_stream {
@@ -83,32 +134,50 @@ struct tapdisk_stream {
 	struct list_head                 pending_list;
 	struct list_head                 completed_list;
 
-	td_stream_req_t                  reqs[TD_STREAM_MAX_REQS];
-	td_stream_req_t                 *free[TD_STREAM_MAX_REQS];
+	size_t                           req_size;
+	td_stream_req_t                 *reqs;
+	td_stream_req_t                **free;
+	int                              n_reqs;
 	int                              n_free;
+
+	/* bytes of the oldest completed request already written */
+	size_t                           out_off;
+	int                              out_flags;
+	int                              out_mode;
+	off64_t                          out_start;
+	event_id_t                       out_event;
 };
 
 static unsigned int tapdisk_stream_count;
 
 static void tapdisk_stream_close_image(td_stream_t *);
-static void tapdisk_stream_queue_requests(td_stream_t *);
+static int tapdisk_stream_queue_requests(td_stream_t *);
 
 static void
 usage(const char *app, int err)
 {
 	printf("usage: %s <-n type:/path/to/image> "
-	       "[-c sector count] [-s skip sectors]\n", app);
+	       "[-c sector count] [-s skip sectors] "
+	       "[-d queue depth (max %d)] [-r request size in KiB] "
+	       "[-S skip unallocated ranges]\n",
+	       app, TD_STREAM_MAX_REQS);
 	exit(err);
 }
 
 static inline int
 tapdisk_stream_stop(td_stream_t *s)
 {
-	return (list_empty(&s->pending_list) && (!s->count || s->err));
+	if (!list_empty(&s->pending_list))
+		return 0;
+
+	if (s->err)
+		return 1;
+
+	return (!s->count && list_empty(&s->completed_list));
 }
 
 static int
-tapdisk_stream_req_create(td_stream_req_t *req)
+tapdisk_stream_req_create(td_stream_t *s, td_stream_req_t *req)
 {
 	int prot, flags;
 
@@ -118,7 +187,7 @@ tapdisk_stream_req_create(td_stream_req_t *req)
 	prot  = PROT_READ|PROT_WRITE;
 	flags = MAP_ANONYMOUS|MAP_PRIVATE;
 
-	req->buf = mmap(NULL, TD_STREAM_REQ_SIZE, prot, flags, -1, 0);
+	req->buf = mmap(NULL, s->req_size, prot, flags, -1, 0);
 	if (req->buf == MAP_FAILED) {
 		req->buf = NULL;
 		return -errno;
@@ -128,12 +197,12 @@ tapdisk_stream_req_create(td_stream_req_t *req)
 }
 
 static void
-tapdisk_stream_req_destroy(td_stream_req_t *req)
+tapdisk_stream_req_destroy(td_stream_t *s, td_stream_req_t *req)
 {
 	if (req->buf) {
-		int err = munmap(req->iov.base, TD_STREAM_REQ_SIZE);
+		int err = munmap(req->buf, s->req_size);
 		BUG_ON(err);
-		req->iov.base = NULL;
+		req->buf = NULL;
 	}
 }
 
@@ -151,7 +220,7 @@ tapdisk_stream_alloc_req(td_stream_t *s)
 void
 tapdisk_stream_free_req(td_stream_t *s, td_stream_req_t *req)
 {
-	BUG_ON(s->n_free >= MAX_REQUESTS);
+	BUG_ON(s->n_free >= s->n_reqs);
 	BUG_ON(!list_empty(&req->entry));
 	s->free[s->n_free++] = req;
 }
@@ -159,15 +228,17 @@ tapdisk_stream_free_req(td_stream_t *s, td_stream_req_t *req)
 static void
 tapdisk_stream_destroy_reqs(td_stream_t *s)
 {
-	td_stream_req_t *req;
+	int i;
 
-	do {
-		req = tapdisk_stream_alloc_req(s);
-		if (!req)
-			break;
+	if (s->reqs)
+		for (i = 0; i < s->n_reqs; i++)
+			tapdisk_stream_req_destroy(s, &s->reqs[i]);
 
-		tapdisk_stream_req_destroy(req);
-	} while (1);
+	free(s->reqs);
+	free(s->free);
+	s->reqs   = NULL;
+	s->free   = NULL;
+	s->n_free = 0;
 }
 
 static int
@@ -177,10 +248,17 @@ tapdisk_stream_create_reqs(td_stream_t *s)
 
 	s->n_free = 0;
 
-	for (i = 0; i < TD_STREAM_MAX_REQS; i++) {
+	s->reqs = calloc(s->n_reqs, sizeof(*s->reqs));
+	s->free = calloc(s->n_reqs, sizeof(*s->free));
+	if (!s->reqs || !s->free) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < s->n_reqs; i++) {
 		td_stream_req_t *req = &s->reqs[i];
 
-		err = tapdisk_stream_req_create(req);
+		err = tapdisk_stream_req_create(s, req);
 		if (err)
 			goto fail;
 
@@ -194,31 +272,156 @@ fail:
 	return err;
 }
 
+/*
+ * Fills iov with what a request puts on the output, minus the first
+ * skip bytes of it, and returns the number of entries used.
+ */
 static int
-tapdisk_stream_print_request(td_stream_t *s, td_stream_req_t *req)
+tapdisk_stream_req_iov(td_stream_t *s, td_stream_req_t *req,
+		       struct iovec *iov, size_t skip)
+{
+	int cnt = 0;
+
+	if (s->out_mode == TD_STREAM_OUT_SPARSE) {
+		iov[cnt].iov_base = &req->ext;
+		iov[cnt].iov_len  = sizeof(req->ext);
+		cnt++;
+	}
+
+	if (!req->hole) {
+		iov[cnt].iov_base = req->buf;
+		iov[cnt].iov_len  = req->secs << SECTOR_SHIFT;
+		cnt++;
+	}
+
+	for (; cnt && skip >= iov[0].iov_len; cnt--) {
+		skip -= iov[0].iov_len;
+		iov[0] = iov[1];
+	}
+
+	if (cnt) {
+		iov[0].iov_base = (char *)iov[0].iov_base + skip;
+		iov[0].iov_len -= skip;
+	}
+
+	return cnt;
+}
+
+static size_t
+tapdisk_stream_req_len(td_stream_t *s, td_stream_req_t *req)
 {
-	struct td_iovec *iov = &req->iov;
+	size_t len = 0;
 
-	int gcc = write(s->out_fd, iov->base, iov->secs << SECTOR_SHIFT);
-	if (gcc) {};
+	if (s->out_mode == TD_STREAM_OUT_SPARSE)
+		len += sizeof(req->ext);
+	if (!req->hole)
+		len += req->secs << SECTOR_SHIFT;
 
-	return iov->secs;
+	return len;
 }
 
+static void
+tapdisk_stream_retire_req(td_stream_t *s, td_stream_req_t *req)
+{
+	s->sec_out += req->secs;
+	s->out_off  = 0;
+
+	list_del_init(&req->entry);
+	tapdisk_stream_free_req(s, req);
+}
+
+/*
+ * Writes out the completed requests that continue the output, as many
+ * at a time as one writev() takes. The output is non-blocking: when it
+ * fills up, the write event is unmasked and reads go on meanwhile.
+ */
 static void
 tapdisk_stream_write_data(td_stream_t *s)
 {
+	struct iovec iov[TD_STREAM_MAX_IOVS];
 	td_stream_req_t *req, *next;
-
-	list_for_each_entry_safe(req, next, &s->completed_list, entry) {
+	td_sector_t sec;
+	size_t len;
+	ssize_t n;
+	int cnt;
+
+	while (!s->err && !list_empty(&s->completed_list)) {
+		req = list_first_entry(&s->completed_list,
+				       td_stream_req_t, entry);
 		if (req->vreq.sec != s->sec_out)
 			break;
 
-		s->sec_out += tapdisk_stream_print_request(s, req);
+		if (req->hole && s->out_mode == TD_STREAM_OUT_SEEK) {
+			if (lseek64(s->out_fd, req->secs << SECTOR_SHIFT,
+				    SEEK_CUR) == (off64_t)-1) {
+				fprintf(stderr, "error seeking output: %d\n",
+					errno);
+				s->err = errno;
+				break;
+			}
+
+			tapdisk_stream_retire_req(s, req);
+			continue;
+		}
+
+		cnt = 0;
+		sec = s->sec_out;
 
-		list_del_init(&req->entry);
-		tapdisk_stream_free_req(s, req);
+		list_for_each_entry(req, &s->completed_list, entry) {
+			if (req->vreq.sec != sec ||
+			    cnt > TD_STREAM_MAX_IOVS - 2)
+				break;
+
+			if (req->hole && s->out_mode == TD_STREAM_OUT_SEEK)
+				break;
+
+			cnt += tapdisk_stream_req_iov(s, req, iov + cnt,
+						      cnt ? 0 : s->out_off);
+			sec += req->secs;
+		}
+
+		if (!cnt)
+			break;
+
+		n = writev(s->out_fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				tapdisk_server_mask_event(s->out_event, 0);
+				return;
+			}
+
+			fprintf(stderr, "error writing output: %d\n", errno);
+			s->err = errno;
+			break;
+		}
+
+		n += s->out_off;
+		list_for_each_entry_safe(req, next, &s->completed_list, entry) {
+			len = tapdisk_stream_req_len(s, req);
+			if (n < len)
+				break;
+
+			n -= len;
+			tapdisk_stream_retire_req(s, req);
+		}
+		s->out_off = n;
 	}
+
+	tapdisk_server_mask_event(s->out_event, 1);
+}
+
+static void
+tapdisk_stream_progress(td_stream_t *s)
+{
+	/* holes complete as they are queued, and may free up more */
+	do {
+		tapdisk_stream_write_data(s);
+	} while (tapdisk_stream_queue_requests(s));
+
+	if (tapdisk_stream_stop(s))
+		tapdisk_stream_close_image(s);
 }
 
 static inline void
@@ -251,14 +454,7 @@ tapdisk_stream_complete_request(td_stream_t *s, td_stream_req_t *req,
 	if (!final)
 		return;
 
-	tapdisk_stream_write_data(s);
-
-	if (tapdisk_stream_stop(s)) {
-		tapdisk_stream_close_image(s);
-		return;
-	}
-
-	tapdisk_stream_queue_requests(s);
+	tapdisk_stream_progress(s);
 }
 
 static void
@@ -271,15 +467,61 @@ __tapdisk_stream_request_cb(td_vbd_request_t *vreq, int error,
 	tapdisk_stream_complete_request(s, req, error, final);
 }
 
+/*
+ * Returns the length of the run at s->sec_in that is all allocated, up to
+ * max sectors, or all unallocated, up to the rest of the range; *hole
+ * tells which.
+ */
+static td_sector_t
+tapdisk_stream_next_run(td_stream_t *s, td_sector_t max, int *hole)
+{
+	td_sector_t sec, run, secs;
+	int present;
+
+	secs  = 0;
+	sec   = s->sec_in;
+	run   = s->count;
+	*hole = !tapdisk_vbd_sector_status(s->vbd, sec, &run);
+
+	if (!*hole)
+		max = MIN(max, s->count);
+	else
+		max = s->count;
+
+	for (;;) {
+		secs += run;
+		sec  += run;
+		if (secs >= max)
+			return max;
+
+		run     = s->count - secs;
+		present = tapdisk_vbd_sector_status(s->vbd, sec, &run);
+		if (present == *hole)
+			return secs;
+	}
+}
+
 static void
 tapdisk_stream_queue_request(td_stream_t *s, td_stream_req_t *req)
 {
 	td_vbd_request_t *vreq;
 	struct td_iovec *iov;
-	int secs, err;
+	td_sector_t secs;
+	int err, hole;
 
 	iov   = &req->iov;
-	secs  = MIN(TD_STREAM_REQ_SIZE >> SECTOR_SHIFT, s->count);
+	secs  = MIN(s->req_size >> SECTOR_SHIFT, s->count);
+	hole  = 0;
+
+	if (s->out_mode != TD_STREAM_OUT_PLAIN)
+		secs = tapdisk_stream_next_run(s, secs, &hole);
+
+	req->hole     = hole;
+	req->secs     = secs;
+	req->ext.type = htole32(hole ? TD_STREAM_EXTENT_ZERO :
+				TD_STREAM_EXTENT_DATA);
+	req->ext.sec  = htole64(s->sec_in);
+	req->ext.secs = htole64(secs);
 
 	iov->base           = req->buf;
 	iov->secs           = secs;
@@ -287,6 +529,7 @@ tapdisk_stream_queue_request(td_stream_t *s, td_stream_req_t *req)
 	vreq                = &req->vreq;
 	vreq->iov           = iov;
 	vreq->iovcnt        = 1;
+	vreq->prio          = TD_PRIO_FOREGROUND;
 	vreq->sec           = s->sec_in;
 	vreq->op            = TD_OP_READ;
 	vreq->name          = NULL;
@@ -296,16 +539,22 @@ tapdisk_stream_queue_request(td_stream_t *s, td_stream_req_t *req)
 	s->count  -= secs;
 	s->sec_in += secs;
 
-	err = tapdisk_vbd_queue_request(s->vbd, vreq);
-	if (err)
-		tapdisk_stream_complete_request(s, req, err, 1);
+	if (hole) {
+		tapdisk_stream_queue_completed(s, req);
+		return;
+	}
 
 	list_add_tail(&req->entry, &s->pending_list);
+
+	err = tapdisk_vbd_queue_request(s->vbd, vreq);
+	if (err)
+		tapdisk_stream_complete_request(s, req, err, 0);
 }
 
-static void
+static int
 tapdisk_stream_queue_requests(td_stream_t *s)
 {
+	int queued = 0;
 
 	while (s->count && !s->err) {
 		td_stream_req_t *req;
@@ -315,7 +564,10 @@ tapdisk_stream_queue_requests(td_stream_t *s)
 			break;
 
 		tapdisk_stream_queue_request(s, req);
+		queued++;
 	}
+
+	return queued;
 }
 
 static int
@@ -398,28 +650,115 @@ tapdisk_stream_set_position(td_stream_t *s,
 void
 __tapdisk_stream_event_cb(event_id_t id, char mode, void *arg)
 {
+	td_stream_t *s = arg;
+
+	if (s->vbd)
+		tapdisk_stream_progress(s);
 }
 
+/*
+ * Writes all of buf with the output temporarily blocking, for the bits
+ * of the sparse format outside the request stream.
+ */
 static int
-tapdisk_stream_open_fds(struct tapdisk_stream *s)
+tapdisk_stream_write_sync(td_stream_t *s, const void *buf, size_t len)
 {
+	ssize_t n;
+	int err = 0;
+
+	if (fcntl(s->out_fd, F_SETFL, s->out_flags) == -1)
+		return errno;
+
+	while (len) {
+		n = write(s->out_fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			break;
+		}
+		buf  = (const char *)buf + n;
+		len -= n;
+	}
+
+	if (fcntl(s->out_fd, F_SETFL, s->out_flags | O_NONBLOCK) == -1 &&
+	    !err)
+		err = errno;
+
+	return err;
+}
+
+static int
+tapdisk_stream_open_fds(struct tapdisk_stream *s, int sparse)
+{
+	struct stat st;
+	int err;
+
 	s->out_fd = dup(STDOUT_FILENO);
 	if (s->out_fd == -1) {
 		fprintf(stderr, "failed to open output: %d\n", errno);
 		return errno;
 	}
 
+	/* shared with stdout, restored on close */
+	s->out_flags = fcntl(s->out_fd, F_GETFL);
+	if (s->out_flags == -1 ||
+	    fcntl(s->out_fd, F_SETFL, s->out_flags | O_NONBLOCK) == -1) {
+		fprintf(stderr, "failed to set up output: %d\n", errno);
+		return errno;
+	}
+
+	/*
+	 * Holes are skipped by seeking on a regular file, the output being
+	 * truncated where we start so they read back as zeros; anything
+	 * else gets the sparse stream format.
+	 */
+	s->out_mode = TD_STREAM_OUT_PLAIN;
+	if (sparse) {
+		if (fstat(s->out_fd, &st) == -1) {
+			fprintf(stderr, "failed to stat output: %d\n", errno);
+			return errno;
+		}
+
+		s->out_mode = TD_STREAM_OUT_SPARSE;
+
+		if (S_ISREG(st.st_mode) && !(s->out_flags & O_APPEND)) {
+			s->out_start = lseek64(s->out_fd, 0, SEEK_CUR);
+			if (s->out_start != (off64_t)-1 &&
+			    !ftruncate(s->out_fd, s->out_start))
+				s->out_mode = TD_STREAM_OUT_SEEK;
+		}
+	}
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
+					    s->out_fd, TV_ZERO,
+					    __tapdisk_stream_event_cb, s);
+	if (err < 0) {
+		fprintf(stderr, "failed to register output event: %d\n", err);
+		return -err;
+	}
+
+	s->out_event = err;
+	tapdisk_server_mask_event(s->out_event, 1);
+
 	return 0;
 }
 
 static void
 tapdisk_stream_close(struct tapdisk_stream *s)
 {
+	tapdisk_stream_close_image(s);
+
 	tapdisk_stream_destroy_reqs(s);
 
-	tapdisk_stream_close_image(s);
+	if (s->out_event >= 0) {
+		tapdisk_server_unregister_event(s->out_event);
+		s->out_event = -1;
+	}
 
 	if (s->out_fd >= 0) {
+		if (s->out_flags != -1)
+			fcntl(s->out_fd, F_SETFL, s->out_flags);
 		close(s->out_fd);
 		s->out_fd = -1;
 	}
@@ -427,19 +766,24 @@ tapdisk_stream_close(struct tapdisk_stream *s)
 
 static int
 tapdisk_stream_open(struct tapdisk_stream *s, const char *name,
-		    uint64_t count, uint64_t skip)
+		    uint64_t count, uint64_t skip, int depth, size_t size,
+		    int sparse)
 {
 	int err = 0;
 
 	memset(s, 0, sizeof(*s));
 	s->in_fd = s->out_fd = -1;
+	s->out_flags = -1;
+	s->out_event = -1;
+	s->n_reqs    = depth;
+	s->req_size  = size;
 	INIT_LIST_HEAD(&s->pending_list);
 	INIT_LIST_HEAD(&s->completed_list);
 
-	if (!err)
-		err = tapdisk_stream_open_fds(s);
 	if (!err)
 		err = tapdisk_stream_open_image(s, name);
+	if (!err)
+		err = tapdisk_stream_open_fds(s, sparse);
 	if (!err)
 		err = tapdisk_stream_set_position(s, count, skip);
 	if (!err)
@@ -454,25 +798,67 @@ tapdisk_stream_open(struct tapdisk_stream *s, const char *name,
 static int
 tapdisk_stream_run(struct tapdisk_stream *s)
 {
-	tapdisk_stream_queue_requests(s);
-	tapdisk_server_run();
+	struct td_stream_header hdr;
+	struct td_stream_extent end;
+	off64_t off;
+
+	if (s->out_mode == TD_STREAM_OUT_SPARSE) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, TD_STREAM_MAGIC, sizeof(hdr.magic));
+		hdr.version     = htole32(TD_STREAM_VERSION);
+		hdr.sector_size = htole32(1 << SECTOR_SHIFT);
+		hdr.sec         = htole64(s->sec_in);
+		hdr.secs        = htole64(s->count);
+
+		s->err = tapdisk_stream_write_sync(s, &hdr, sizeof(hdr));
+		if (s->err)
+			return s->err;
+	}
+
+	tapdisk_stream_progress(s);
+	if (s->vbd)
+		tapdisk_server_run();
+
+	if (s->err)
+		return s->err;
+
+	switch (s->out_mode) {
+	case TD_STREAM_OUT_SEEK:
+		/* a trailing hole was only seeked over */
+		off = lseek64(s->out_fd, 0, SEEK_CUR);
+		if (off == (off64_t)-1 || ftruncate(s->out_fd, off))
+			s->err = errno;
+		break;
+
+	case TD_STREAM_OUT_SPARSE:
+		memset(&end, 0, sizeof(end));
+		end.type = htole32(TD_STREAM_EXTENT_END);
+		end.sec  = htole64(s->sec_out);
+		s->err   = tapdisk_stream_write_sync(s, &end, sizeof(end));
+		break;
+	}
+
 	return s->err;
 }
 
 int
 main(int argc, char *argv[])
 {
-	int c, err;
+	int c, err, depth, sparse;
 	const char *params;
 	uint64_t count, skip;
+	size_t size;
 	struct tapdisk_stream stream;
 
 	err    = 0;
 	skip   = 0;
 	count  = (uint64_t)-1;
 	params = NULL;
+	depth  = TD_STREAM_DEFAULT_REQS;
+	sparse = 0;
+	size   = TD_STREAM_DEFAULT_REQ_SIZE;
 
-	while ((c = getopt(argc, argv, "n:c:s:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:c:s:d:r:Sh")) != -1) {
 		switch (c) {
 		case 'n':
 			params = optarg;
@@ -483,6 +869,20 @@ main(int argc, char *argv[])
 		case 's':
 			skip = strtoull(optarg, NULL, 10);
 			break;
+		case 'd':
+			depth = atoi(optarg);
+			if (depth < 1 || depth > TD_STREAM_MAX_REQS)
+				usage(argv[0], EINVAL);
+			break;
+		case 'S':
+			sparse = 1;
+			break;
+		case 'r':
+			size = strtoul(optarg, NULL, 10) << 10;
+			if (!size || size > TD_STREAM_MAX_REQ_SIZE ||
+			    size % sysconf(_SC_PAGE_SIZE))
+				usage(argv[0], EINVAL);
+			break;
 		default:
 			err = EINVAL;
 		case 'h':
@@ -495,7 +895,8 @@ main(int argc, char *argv[])
 
 	tapdisk_start_logging("tapdisk-stream", "daemon");
 
-	err = tapdisk_stream_open(&stream, params, count, skip);
+	err = tapdisk_stream_open(&stream, params, count, skip, depth, size,
+				  sparse);
 	if (err)
 		goto out;
 
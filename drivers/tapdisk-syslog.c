@@ -45,6 +45,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
@@ -382,6 +383,69 @@ fail:
 	return err;
 }
 
+static int
+tapdisk_syslog_sprintf(char *buf, size_t size,
+		       int prio, int facility, const struct timeval *tv,
+		       const char *ident, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = tapdisk_syslog_vsprintf(buf, size, prio, facility, tv,
+				      ident, fmt, ap);
+	va_end(ap);
+
+	return len;
+}
+
+/*
+ * For the log writer thread, off the event loop: sends right away,
+ * waiting a bit for syslogd rather than queueing. The ring and the
+ * socket event are for the event loop only, this never touches them.
+ */
+int
+tapdisk_syslog_write(td_syslog_t *log, int prio, const struct timeval *tv,
+		     const char *msg)
+{
+	char buf[TD_SYSLOG_PACKET_MAX];
+	struct pollfd pfd;
+	size_t len;
+	int err, reconnected = 0, waited = 0;
+
+	len = tapdisk_syslog_sprintf(buf, sizeof(buf), prio, log->facility,
+				     tv, log->ident, "%s", msg);
+
+	log->stats.count += 1;
+	log->stats.bytes += len;
+
+send:
+	err = tapdisk_syslog_sock_send(log, buf, len);
+	if (!err)
+		return 0;
+
+	if (err == -ENOTCONN && !reconnected++) {
+		err = tapdisk_syslog_sock_connect(log);
+		if (!err)
+			goto send;
+	}
+
+	if (err == -EAGAIN) {
+		pfd.fd     = log->sock;
+		pfd.events = POLLOUT;
+
+		if (!waited++ &&
+		    poll(&pfd, 1, TD_SYSLOG_WRITE_TIMEOUT) > 0)
+			goto send;
+
+		log->stats.drops++;
+		return err;
+	}
+
+	log->stats.fails++;
+	return err;
+}
+
 int
 tapdisk_syslog(td_syslog_t *log, int prio, const char *fmt, ...)
 {
@@ -38,6 +38,7 @@
 typedef struct _td_syslog td_syslog_t;
 
 #define TD_SYSLOG_PACKET_MAX  1024
+#define TD_SYSLOG_WRITE_TIMEOUT 1000 /* ms */
 
 struct _td_syslog_stats {
 	unsigned long long count;
@@ -79,5 +80,7 @@ void tapdisk_syslog_stats(td_syslog_t *, int prio);
 
 int tapdisk_vsyslog(td_syslog_t *, int prio, const char *fmt, va_list ap);
 int tapdisk_syslog(td_syslog_t *, int prio, const char *fmt, ...);
+int tapdisk_syslog_write(td_syslog_t *, int prio, const struct timeval *tv,
+			 const char *msg);
 
 #endif /* __TAPDISK_SYSLOG_H__ */
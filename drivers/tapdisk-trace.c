@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "tapdisk-trace.h"
+
+int
+tapdisk_trace_create(td_trace_t **_trace, unsigned int size)
+{
+	td_trace_t *trace;
+	uint64_t n;
+
+	if (!size)
+		size = TD_TRACE_DEFAULT_SIZE;
+	if (size > TD_TRACE_MAX_SIZE)
+		return -EINVAL;
+
+	for (n = 1; n < size; n <<= 1)
+		;
+
+	trace = calloc(1, sizeof(*trace));
+	if (!trace)
+		return -ENOMEM;
+
+	trace->ring = malloc(n * sizeof(*trace->ring));
+	if (!trace->ring) {
+		free(trace);
+		return -ENOMEM;
+	}
+
+	trace->mask = n - 1;
+
+	*_trace = trace;
+	return 0;
+}
+
+void
+tapdisk_trace_destroy(td_trace_t *trace)
+{
+	if (trace) {
+		free(trace->ring);
+		free(trace);
+	}
+}
+
+void
+tapdisk_trace_event(td_trace_t *trace, int event, int op,
+		    uint64_t sec, uint32_t secs, uint32_t seq,
+		    int level, int error)
+{
+	struct tapdisk_trace_rec *rec;
+	struct timespec ts;
+
+	if (unlikely(trace->head - trace->tail > trace->mask)) {
+		trace->tail++;
+		trace->dropped++;
+	}
+
+	rec = &trace->ring[trace->head++ & trace->mask];
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	rec->ts          = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->sec         = sec;
+	rec->secs        = secs;
+	rec->seq         = seq;
+	rec->error       = error;
+	rec->event       = event;
+	rec->op          = op;
+	rec->level       = level;
+	memset(rec->reserved, 0, sizeof(rec->reserved));
+}
+
+unsigned int
+tapdisk_trace_read(td_trace_t *trace, struct tapdisk_trace_rec *buf,
+		   unsigned int n, uint32_t *dropped)
+{
+	unsigned int i;
+
+	if (n > tapdisk_trace_pending(trace))
+		n = tapdisk_trace_pending(trace);
+
+	for (i = 0; i < n; i++)
+		buf[i] = trace->ring[trace->tail++ & trace->mask];
+
+	*dropped = trace->dropped;
+	trace->dropped = 0;
+
+	return n;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_TRACE_H_
+#define _TAPDISK_TRACE_H_
+
+#include <stdint.h>
+
+#include "compiler.h"
+#include "tapdisk-message.h"
+
+/*
+ * Binary I/O trace ring of a VBD. Records are struct tapdisk_trace_rec,
+ * written at head, read at tail. A full ring overwrites the oldest
+ * records, which readers learn about as dropped. Off unless started,
+ * then a clock read and a record copy per event.
+ */
+
+#define TD_TRACE_DEFAULT_SIZE       (1 << 16)
+#define TD_TRACE_MAX_SIZE           (1 << 22)
+
+typedef struct td_trace             td_trace_t;
+
+struct td_trace {
+	struct tapdisk_trace_rec   *ring;
+	uint64_t                    mask;
+
+	uint64_t                    head;
+	uint64_t                    tail;
+	uint64_t                    dropped;
+
+	uint32_t                    seq;
+};
+
+int tapdisk_trace_create(td_trace_t **, unsigned int size);
+void tapdisk_trace_destroy(td_trace_t *);
+
+void tapdisk_trace_event(td_trace_t *, int event, int op,
+			 uint64_t sec, uint32_t secs, uint32_t seq,
+			 int level, int error);
+
+static inline uint64_t
+tapdisk_trace_pending(td_trace_t *trace)
+{
+	return trace->head - trace->tail;
+}
+
+/*
+ * Copies up to @n records not read yet, oldest first, and consumes
+ * them. Returns the count, and the records dropped since last read.
+ */
+unsigned int tapdisk_trace_read(td_trace_t *, struct tapdisk_trace_rec *,
+				unsigned int n, uint32_t *dropped);
+
+#endif /* _TAPDISK_TRACE_H_ */
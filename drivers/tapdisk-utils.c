@@ -34,6 +34,8 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -44,6 +46,9 @@
 #include <sys/resource.h>
 #include <sys/utsname.h>
 #include <arpa/inet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef __linux__
 #include <linux/version.h>
@@ -198,6 +203,32 @@ tapdisk_namedup(char **dup, const char *name)
 	return 0;
 }
 
+/*
+ * Creates the directories leading to path, as far as they are missing.
+ */
+int
+tapdisk_mkdir_parents(const char *path)
+{
+	char *dir, *p;
+	int err = 0;
+
+	dir = strdup(path);
+	if (!dir)
+		return -ENOMEM;
+
+	for (p = dir + 1; (p = strchr(p, '/')); p++) {
+		*p = 0;
+		if (mkdir(dir, 0700) && errno != EEXIST) {
+			err = -errno;
+			break;
+		}
+		*p = '/';
+	}
+
+	free(dir);
+	return err;
+}
+
 /*Get Image size, secsize*/
 int
 tapdisk_get_image_size(int fd, uint64_t *_sectors, uint32_t *_sector_size)
@@ -438,9 +469,86 @@ out:
     return err;
 }
 
+int
+shm_attach(struct shm *shm) {
+
+    int err = 0;
+    struct stat st;
+
+    ASSERT(shm);
+    ASSERT(shm->path);
+
+    shm->fd = open(shm->path, O_RDWR);
+    if (shm->fd == -1) {
+        err = errno;
+        goto out;
+    }
+
+    if (fstat(shm->fd, &st) == -1) {
+        err = errno;
+        goto out;
+    }
+
+    if (!st.st_size || st.st_size > UINT_MAX) {
+        err = EINVAL;
+        goto out;
+    }
+
+    shm->size = st.st_size;
+    shm->mem = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            shm->fd, 0);
+    if (shm->mem == MAP_FAILED) {
+        err = errno;
+        shm->mem = NULL;
+        EPRINTF("failed to mmap %s: %s\n", shm->path, strerror(err));
+        goto out;
+    }
+
+out:
+    if (err && shm->fd != -1) {
+        close(shm->fd);
+        shm->fd = -1;
+    }
+    return err;
+}
+
 const long long USEC_PER_SEC = 1000000L;
 
 inline long long timeval_to_us(struct timeval *tv)
 {
 	return ((long long)tv->tv_sec * USEC_PER_SEC) + tv->tv_usec;
 }
+
+int
+tapdisk_buf_is_zero(const void *buf, size_t size)
+{
+	const char *b = buf;
+	const uint64_t *p, *end;
+
+#ifdef __SSE2__
+	const __m128i *v = (const __m128i *)b;
+	const __m128i *vend = v + size / (4 * sizeof(__m128i)) * 4;
+	__m128i acc;
+
+	for (; v < vend; v += 4) {
+		acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(v),
+						_mm_loadu_si128(v + 1)),
+				   _mm_or_si128(_mm_loadu_si128(v + 2),
+						_mm_loadu_si128(v + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc,
+						     _mm_setzero_si128())) != 0xffff)
+			return 0;
+	}
+
+	size -= (const char *)v - b;
+	b     = (const char *)v;
+#endif
+
+	p   = (const uint64_t *)b;
+	end = p + size / sizeof(uint64_t);
+	for (; p < end; p++)
+		if (*p)
+			return 0;
+
+	return 1;
+}
@@ -47,12 +47,16 @@ size_t tapdisk_syslog_strftime(char *, size_t, const struct timeval *);
 size_t tapdisk_syslog_strftv(char *, size_t, const struct timeval *);
 int tapdisk_set_resource_limits(void);
 int tapdisk_namedup(char **, const char *);
+int tapdisk_mkdir_parents(const char *);
 int tapdisk_parse_disk_type(const char *, char **, int *);
 int tapdisk_get_image_size(int, uint64_t *, uint32_t *);
 int tapdisk_linux_version(void);
 uint64_t ntohll(uint64_t);
 #define htonll ntohll
 
+/* whether size bytes at buf, a multiple of 8, are all zero */
+int tapdisk_buf_is_zero(const void *buf, size_t size);
+
 
 /**
  * Simplified version of snprintf that returns 0 if everything has gone OK and
@@ -100,6 +104,15 @@ shm_create(struct shm *shm);
 int
 shm_destroy(struct shm *shm);
 
+/**
+ * Maps an existing file in /dev/shm, read-write. The caller must populate
+ * the path member; the size member is set to the size of the file.
+ *
+ * Returns 0 in success, +errno on failure.
+ */
+int
+shm_attach(struct shm *shm);
+
 inline long long timeval_to_us(struct timeval *tv);
 
 #endif
@@ -43,6 +43,7 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "debug.h"
 #include "libvhd.h"
@@ -55,8 +56,17 @@
 #include "tapdisk-disktype.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-stats.h"
+#include "tapdisk-message.h"
+#include "tapdisk-trace.h"
+#include "tapdisk-profile.h"
+#include "tapdisk-probe.h"
 #include "tapdisk-storage.h"
 #include "tapdisk-nbdserver.h"
+#include "tapdisk-vhostblk.h"
+#include "tapdisk-mirror.h"
+#include "tapdisk-coalesce.h"
+#include "tapdisk-backup.h"
+#include "tapdisk-bootprof.h"
 #include "td-stats.h"
 #include "tapdisk-utils.h"
 #include "md5.h"
@@ -74,9 +84,22 @@
 static void tapdisk_vbd_complete_vbd_request(td_vbd_t *, td_vbd_request_t *);
 static int  tapdisk_vbd_queue_ready(td_vbd_t *);
 static void tapdisk_vbd_check_queue_state(td_vbd_t *);
+static void tapdisk_vbd_init_retry_cap(void);
 
 static bool log=true;
 
+static void
+tapdisk_vbd_wheel_init(struct td_vbd_wheel *wheel)
+{
+	int i;
+
+	for (i = 0; i < TD_VBD_WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&wheel->slots[i]);
+
+	wheel->clock = 0;
+	wheel->armed = 0;
+}
+
 /*
  * initialization
  */
@@ -99,16 +122,23 @@ tapdisk_vbd_create(uint16_t uuid)
 	}
 
 	shm_init(&vbd->rrd.shm);
+	tapdisk_vbd_init_retry_cap();
+
+	if (getenv("TAPDISK3_PROFILE"))
+		tapdisk_vbd_profile(vbd, TAPDISK_PROFILE_START);
 
 	vbd->uuid        = uuid;
 	vbd->req_timeout = TD_VBD_REQUEST_TIMEOUT;
 	vbd->watchdog_warned = false;
+	vbd->depth       = TAPDISK_DATA_REQUESTS;
 
 	INIT_LIST_HEAD(&vbd->images);
+	INIT_LIST_HEAD(&vbd->retained);
 	INIT_LIST_HEAD(&vbd->new_requests);
 	INIT_LIST_HEAD(&vbd->pending_requests);
 	INIT_LIST_HEAD(&vbd->failed_requests);
 	INIT_LIST_HEAD(&vbd->completed_requests);
+	tapdisk_vbd_wheel_init(&vbd->wheel);
 	INIT_LIST_HEAD(&vbd->next);
 	INIT_LIST_HEAD(&vbd->rings);
 	INIT_LIST_HEAD(&vbd->dead_rings);
@@ -121,6 +151,7 @@ int
 tapdisk_vbd_initialize(int rfd, int wfd, uint16_t uuid)
 {
 	td_vbd_t *vbd;
+	int err;
 
 	vbd = tapdisk_server_get_vbd(uuid);
 	if (vbd) {
@@ -128,6 +159,10 @@ tapdisk_vbd_initialize(int rfd, int wfd, uint16_t uuid)
 		return -EEXIST;
 	}
 
+	err = tapdisk_server_prepare();
+	if (err)
+		return err;
+
 	vbd = tapdisk_vbd_create(uuid);
 	if (!vbd) {
 		EPRINTF("failed to create vbd\n");
@@ -248,6 +283,14 @@ out:
     return -err;
 }
 
+static void
+tapdisk_vbd_index_reset(td_vbd_t *vbd)
+{
+	free(vbd->index.depth);
+	free(vbd->index.images);
+	memset(&vbd->index, 0, sizeof(vbd->index));
+}
+
 void
 tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
@@ -264,7 +307,9 @@ tapdisk_vbd_close_vdi(td_vbd_t *vbd)
         EPRINTF("failed to destroy stats file: %s\n", strerror(-err));
     }
 
+	tapdisk_coalesce_stop(vbd);
 	tapdisk_image_close_chain(&vbd->images);
+	tapdisk_vbd_index_reset(vbd);
 
 	if (vbd->secondary &&
 	    vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR) {
@@ -280,6 +325,80 @@ tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 	td_flag_set(vbd->state, TD_VBD_CLOSED);
 }
 
+int
+tapdisk_vbd_replace_leaf(td_vbd_t *vbd, td_image_t *image)
+{
+	td_image_t *leaf, *parent;
+	char *name;
+
+	leaf = tapdisk_vbd_first_image(vbd);
+	if (!leaf || tapdisk_vbd_is_last_image(vbd, leaf))
+		return -EINVAL;
+
+	if (!list_empty(&vbd->pending_requests))
+		return -EBUSY;
+
+	parent = tapdisk_vbd_next_image(leaf);
+
+	if (asprintf(&name, "%s:%s",
+		     tapdisk_disk_types[image->type]->name, image->name) < 0)
+		return -ENOMEM;
+
+	list_del_init(&leaf->next);
+	list_del_init(&parent->next);
+	list_add(&image->next, &vbd->images);
+	tapdisk_vbd_index_reset(vbd);
+
+	DPRINTF("%s: leaf %s dropped, now %s\n", vbd->name, leaf->name, name);
+
+	tapdisk_image_close(leaf);
+	tapdisk_image_close(parent);
+
+	free(vbd->name);
+	vbd->name = name;
+
+	return 0;
+}
+
+static int
+tapdisk_vbd_apply_depth(td_vbd_t *vbd)
+{
+	td_image_t *image, *tmp;
+	int err, ret = 0;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		err = td_set_depth(image, vbd->depth);
+		if (err) {
+			EPRINTF("%s: failed to grow pool to %d: %d\n",
+				image->name, vbd->depth, err);
+			ret = ret ? : err;
+		}
+	}
+
+	if (vbd->secondary) {
+		err = td_set_depth(vbd->secondary, vbd->depth);
+		if (err) {
+			EPRINTF("%s: failed to grow pool to %d: %d\n",
+				vbd->secondary->name, vbd->depth, err);
+			ret = ret ? : err;
+		}
+	}
+
+	return ret;
+}
+
+int
+tapdisk_vbd_set_depth(td_vbd_t *vbd, int nr)
+{
+	if (nr <= vbd->depth)
+		return 0;
+
+	DPRINTF("%s: depth %d -> %d\n", vbd->name, vbd->depth, nr);
+	vbd->depth = nr;
+
+	return tapdisk_vbd_apply_depth(vbd);
+}
+
 static int
 tapdisk_vbd_add_block_cache(td_vbd_t *vbd)
 {
@@ -393,6 +512,96 @@ done:
 	return 0;
 }
 
+static int
+tapdisk_vbd_add_wb_cache(td_vbd_t *vbd)
+{
+	td_image_t *cache, *leaf;
+	int err;
+
+	/* destaging would race with the mirror for the leaf */
+	if (td_flag_test(vbd->flags, TD_OPEN_SECONDARY)) {
+		EPRINTF("Write-back cache and secondary are exclusive\n");
+		return -EINVAL;
+	}
+
+	leaf = tapdisk_vbd_first_image(vbd);
+
+	cache = tapdisk_image_allocate(leaf->name,
+				       DISK_TYPE_WBCACHE,
+				       leaf->flags);
+	if (!cache)
+		return -ENOMEM;
+
+	cache->driver = tapdisk_driver_allocate(cache->type,
+						cache->name,
+						cache->flags);
+	if (!cache->driver) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	cache->driver->info = leaf->driver->info;
+
+	err = td_open(cache, &vbd->encryption);
+	if (err)
+		goto fail;
+
+	/* insert cache before the leaf */
+	list_add(&cache->next, &vbd->images);
+
+	DPRINTF("Added write-back cache driver\n");
+	return 0;
+
+fail:
+	tapdisk_image_free(cache);
+	return err;
+}
+
+/*
+ * The integrity check goes on top of everything, caches included, to
+ * see data as the guest does.
+ */
+static int
+tapdisk_vbd_add_crc(td_vbd_t *vbd)
+{
+	td_image_t *crc, *top;
+	const char *path;
+	int err;
+
+	err = tapdisk_disktype_parse_params(vbd->name, &path);
+	if (err < 0)
+		return err;
+
+	top = tapdisk_vbd_first_image(vbd);
+
+	crc = tapdisk_image_allocate(path, DISK_TYPE_CRC, top->flags);
+	if (!crc)
+		return -ENOMEM;
+
+	crc->driver = tapdisk_driver_allocate(crc->type,
+					      crc->name,
+					      crc->flags);
+	if (!crc->driver) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	crc->driver->info = top->driver->info;
+
+	err = td_open(crc, &vbd->encryption);
+	if (err)
+		goto fail;
+
+	list_add(&crc->next, &vbd->images);
+
+	DPRINTF("Added integrity check driver\n");
+	return 0;
+
+fail:
+	tapdisk_image_free(crc);
+	return err;
+}
+
 int
 tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 {
@@ -405,6 +614,7 @@ tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 		vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
 		vbd->secondary = NULL;
 		vbd->nbd_mirror_failed = 0;
+		tapdisk_mirror_close(vbd, 1);
 		return 0;
 	}
 
@@ -446,6 +656,17 @@ tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 	} else {
 		DPRINTF("In mirror mode\n");
 		vbd->secondary_mode = TD_VBD_SECONDARY_MIRROR;
+
+		/*
+		 * a mirror which cannot catch up is still a mirror; a bulk
+		 * copy looks at the primary chain only, so comes first
+		 */
+		err = tapdisk_mirror_open(vbd,
+				td_flag_test(vbd->flags, TD_OPEN_MIRROR_COPY));
+		if (err)
+			EPRINTF("No dirty log for the secondary: %d\n", err);
+		td_flag_clear(vbd->flags, TD_OPEN_MIRROR_COPY);
+
 		/*
 		 * we actually need this image to also be part of the chain, 
 		 * since it may already contain data
@@ -594,13 +815,21 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
 		}
 	}
 
-	err = tapdisk_image_open_chain(vbd->name, flags, prt_devnum, &vbd->encryption, &vbd->images);
+	err = tapdisk_image_open_chain(vbd->name, flags, prt_devnum, &vbd->encryption,
+				       &vbd->images, &vbd->retained);
 	if (err)
 		goto fail;
 
 	td_flag_clear(vbd->state, TD_VBD_CLOSED);
 	vbd->flags = flags;
 
+	/* below the log, which should see guest writes as they happen */
+	if (td_flag_test(vbd->flags, TD_OPEN_WB_CACHE)) {
+		err = tapdisk_vbd_add_wb_cache(vbd);
+		if (err)
+			goto fail;
+	}
+
 	if (td_flag_test(vbd->flags, TD_OPEN_ADD_LOG)) {
 		if (!vbd->logpath) {
 			err = -EINVAL;
@@ -623,6 +852,12 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
 			goto fail;
 	}
 
+	if (td_flag_test(vbd->flags, TD_OPEN_CRC)) {
+		err = tapdisk_vbd_add_crc(vbd);
+		if (err)
+			goto fail;
+	}
+
 	err = tapdisk_vbd_validate_chain(vbd);
 	if (err)
 		goto fail;
@@ -637,6 +872,13 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
 		}
 	}
 
+	/*
+	 * Rings which connected before a reopen keep their depth; a pool
+	 * which cannot grow only limits queue depth.
+	 */
+	if (vbd->depth > TAPDISK_DATA_REQUESTS)
+		tapdisk_vbd_apply_depth(vbd);
+
     err = vbd_stats_create(vbd);
     if (err)
         goto fail;
@@ -745,7 +987,8 @@ tapdisk_vbd_shutdown(td_vbd_t *vbd)
 {
 	int new, pending, failed, completed;
 
-	if (!list_empty(&vbd->pending_requests))
+	if (!list_empty(&vbd->pending_requests) || tapdisk_mirror_busy(vbd) ||
+	    tapdisk_coalesce_busy(vbd) || tapdisk_backup_busy(vbd))
 		return -EAGAIN;
 
 	tapdisk_vbd_queue_count(vbd, &new, &pending, &failed, &completed);
@@ -761,8 +1004,14 @@ tapdisk_vbd_shutdown(td_vbd_t *vbd)
 		vbd->kicked);
 
 	tapdisk_vbd_close_vdi(vbd);
+	tapdisk_image_close_chain(&vbd->retained);
+	tapdisk_mirror_close(vbd, 0);
+	tapdisk_backup_stop(vbd);
+	tapdisk_bootprof_stop(vbd);
 	tapdisk_vbd_detach(vbd);
 	tapdisk_server_remove_vbd(vbd);
+	tapdisk_vbd_trace_stop(vbd);
+	tapdisk_profile_destroy(vbd->profile);
 	free(vbd->name);
 	free(vbd);
 
@@ -775,7 +1024,8 @@ tapdisk_vbd_close(td_vbd_t *vbd)
 	/*
 	 * don't close if any requests are pending in the aio layer
 	 */
-	if (!list_empty(&vbd->pending_requests))
+	if (!list_empty(&vbd->pending_requests) || tapdisk_mirror_busy(vbd) ||
+	    tapdisk_coalesce_busy(vbd) || tapdisk_backup_busy(vbd))
 		goto fail;
 
 	/* 
@@ -867,7 +1117,8 @@ tapdisk_vbd_lock(td_vbd_t *vbd)
 int
 tapdisk_vbd_quiesce_queue(td_vbd_t *vbd)
 {
-	if (!list_empty(&vbd->pending_requests)) {
+	if (!list_empty(&vbd->pending_requests) || tapdisk_mirror_busy(vbd) ||
+	    tapdisk_coalesce_busy(vbd)) {
 		td_flag_set(vbd->state, TD_VBD_QUIESCE_REQUESTED);
 		return -EAGAIN;
 	}
@@ -942,6 +1193,8 @@ tapdisk_vbd_pause(td_vbd_t *vbd)
 
 	if (vbd->nbdserver)
 		tapdisk_nbdserver_pause(vbd->nbdserver, log);
+	if (vbd->vhostblk)
+		tapdisk_vhostblk_pause(vbd->vhostblk);
 
 	err = tapdisk_vbd_quiesce_queue(vbd);
 	if (err)
@@ -950,6 +1203,8 @@ tapdisk_vbd_pause(td_vbd_t *vbd)
 	list_for_each_entry(blkif, &vbd->rings, entry)
 		tapdisk_xenblkif_suspend(blkif);
 
+	/* parents unchanged on resume need not be opened again */
+	tapdisk_image_retain_chain(&vbd->images, &vbd->retained);
 	tapdisk_vbd_close_vdi(vbd);
 
 	/* Don't guard this one as at this point the pause operation is complete */
@@ -1002,6 +1257,9 @@ tapdisk_vbd_resume(td_vbd_t *vbd, const char *name)
 		}
 	}
 resume_failed:
+	/* what the new chain did not take */
+	tapdisk_image_close_chain(&vbd->retained);
+
 	if (err) {
 		td_flag_set(vbd->state, TD_VBD_RESUME_FAILED);
 		tapdisk_vbd_close_vdi(vbd);
@@ -1018,6 +1276,8 @@ resume_failed:
 
 	if (vbd->nbdserver)
 		tapdisk_nbdserver_unpause(vbd->nbdserver);
+	if (vbd->vhostblk)
+		tapdisk_vhostblk_unpause(vbd->vhostblk);
 
     list_for_each_entry(blkif, &vbd->rings, entry)
 		tapdisk_xenblkif_resume(blkif);
@@ -1060,23 +1320,283 @@ tapdisk_vbd_request_timeout(td_vbd_request_t *vreq)
 	return __tapdisk_vbd_request_timeout(vreq, &now);
 }
 
+/*
+ * Parks a failed request on the wheel until @due. Requests are never armed
+ * behind the wheel clock, so an immediate deadline is picked up on the next
+ * pass.
+ */
 static void
-tapdisk_vbd_check_queue_state(td_vbd_t *vbd)
+tapdisk_vbd_arm_request(td_vbd_t *vbd, td_vbd_request_t *vreq, time_t due)
+{
+	struct td_vbd_wheel *wheel = &vbd->wheel;
+
+	if (!list_empty(&vreq->wheel)) {
+		list_del_init(&vreq->wheel);
+		wheel->armed--;
+	}
+
+	if (due < wheel->clock)
+		due = wheel->clock;
+
+	vreq->due = due;
+	list_add_tail(&vreq->wheel,
+		      &wheel->slots[due & (TD_VBD_WHEEL_SLOTS - 1)]);
+	wheel->armed++;
+}
+
+/*
+ * How failed requests are retried, by error class. Retries back off
+ * exponentially from min to max seconds, with jitter so that VBDs which
+ * failed together (say, on the same filer) do not come back in lockstep.
+ * Capped classes count against TAPDISK3_RETRY_INFLIGHT, a process-wide
+ * limit on retries outstanding at the same time (0 for none).
+ */
+struct td_vbd_retry_policy {
+	int                         retry;
+	int                         capped;
+	int                         backoff_min;
+	int                         backoff_max;
+};
+
+#define TD_VBD_RETRY_INFLIGHT       64
+
+static const struct td_vbd_retry_policy td_vbd_retry_fatal     = { 0, 0, 0, 0 };
+static const struct td_vbd_retry_policy td_vbd_retry_busy      = { 1, 0, 0, 0 };
+static const struct td_vbd_retry_policy td_vbd_retry_transient = { 1, 1, 1, 16 };
+static const struct td_vbd_retry_policy td_vbd_retry_other     = { 1, 1, 1, 4 };
+
+static int td_vbd_retry_cap = TD_VBD_RETRY_INFLIGHT;
+static int td_vbd_retry_inflight;
+
+static void
+tapdisk_vbd_init_retry_cap(void)
+{
+	static int initialized;
+	const char *val;
+
+	if (initialized)
+		return;
+	initialized = 1;
+
+	val = getenv("TAPDISK3_RETRY_INFLIGHT");
+	if (val && atoi(val) >= 0) {
+		td_vbd_retry_cap = atoi(val);
+		DPRINTF("retry cap: %d\n", td_vbd_retry_cap);
+	}
+}
+
+static const struct td_vbd_retry_policy *
+tapdisk_vbd_retry_policy(int error)
+{
+	switch (abs(error)) {
+	case EPERM:
+	case ENOSYS:
+	case ESTALE:
+	case ENOSPC:
+	case EFAULT:
+		return &td_vbd_retry_fatal;
+
+	case EBUSY:
+		return &td_vbd_retry_busy;
+
+	case EIO:
+	case EAGAIN:
+	case ETIMEDOUT:
+	case ENOTCONN:
+	case ECONNRESET:
+	case ECONNREFUSED:
+	case EHOSTUNREACH:
+	case ENETUNREACH:
+		return &td_vbd_retry_transient;
+	}
+
+	return &td_vbd_retry_other;
+}
+
+/*
+ * Seconds to wait before the next retry: min << retries, up to max, then
+ * drawn from the upper half of that.
+ */
+static time_t
+tapdisk_vbd_retry_backoff(td_vbd_request_t *vreq)
+{
+	const struct td_vbd_retry_policy *policy;
+	time_t backoff;
+
+	policy  = tapdisk_vbd_retry_policy(vreq->error);
+	backoff = policy->backoff_min;
+
+	if (backoff)
+		backoff <<= MIN(vreq->num_retries, 8);
+	if (backoff > policy->backoff_max)
+		backoff = policy->backoff_max;
+
+	if (backoff > 1)
+		backoff = backoff / 2 + random() % (backoff - backoff / 2 + 1);
+
+	return backoff;
+}
+
+/*
+ * Takes a slot under the retry cap, if the request's error class is
+ * capped. Returns 0 if the request must wait.
+ */
+static int
+tapdisk_vbd_retry_get(td_vbd_request_t *vreq)
+{
+	if (!tapdisk_vbd_retry_policy(vreq->error)->capped ||
+	    !td_vbd_retry_cap)
+		return 1;
+
+	if (__sync_add_and_fetch(&td_vbd_retry_inflight, 1) > td_vbd_retry_cap) {
+		__sync_sub_and_fetch(&td_vbd_retry_inflight, 1);
+		return 0;
+	}
+
+	vreq->retrying = 1;
+	return 1;
+}
+
+static void
+tapdisk_vbd_retry_put(td_vbd_request_t *vreq)
+{
+	if (vreq->retrying) {
+		vreq->retrying = 0;
+	vreq->prof_ts  = 0;
+		__sync_sub_and_fetch(&td_vbd_retry_inflight, 1);
+	}
+}
+
+/*
+ * A failed request next needs attention when its backoff elapses, or
+ * when it expires, whichever comes first.
+ */
+static void
+tapdisk_vbd_arm_failed_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
+	time_t due, expiry;
+
+	due    = vreq->last_try.tv_sec + tapdisk_vbd_retry_backoff(vreq);
+	expiry = vreq->ts.tv_sec + vbd->req_timeout;
+	if (expiry < due)
+		due = expiry;
+
+	tapdisk_vbd_arm_request(vbd, vreq, due);
+}
+
+/*
+ * Moves every request due by @now from the wheel onto @list, linked through
+ * vreq->wheel. Only the slots the clock passed since the last call are
+ * visited, so the cost is in the number of due requests, not the number
+ * of failed ones.
+ */
+static void
+tapdisk_vbd_expire_wheel(td_vbd_t *vbd, time_t now, struct list_head *list)
+{
+	struct td_vbd_wheel *wheel = &vbd->wheel;
 	td_vbd_request_t *vreq, *tmp;
+	struct list_head *slot;
+	time_t t;
+
+	if (!wheel->armed)
+		goto out;
+
+	t = wheel->clock;
+	if (now - t >= TD_VBD_WHEEL_SLOTS)
+		t = now - TD_VBD_WHEEL_SLOTS + 1;
+
+	for (; t <= now && wheel->armed; t++) {
+		slot = &wheel->slots[t & (TD_VBD_WHEEL_SLOTS - 1)];
+
+		list_for_each_entry_safe(vreq, tmp, slot, wheel)
+			if (vreq->due <= now) {
+				list_move_tail(&vreq->wheel, list);
+				wheel->armed--;
+			}
+	}
+
+out:
+	if (now > wheel->clock)
+		wheel->clock = now;
+}
+
+static td_vbd_request_t *
+tapdisk_vbd_next_due_request(struct list_head *list)
+{
+	td_vbd_request_t *vreq;
+
+	if (list_empty(list))
+		return NULL;
+
+	vreq = list_first_entry(list, td_vbd_request_t, wheel);
+	list_del_init(&vreq->wheel);
+
+	return vreq;
+}
+
+/*
+ * Quiesced queues cannot retry, but still time out. Requests which are
+ * neither expired nor shut down are polled again after the retry interval.
+ */
+static void
+tapdisk_vbd_expire_failed_requests(td_vbd_t *vbd)
+{
+	td_vbd_request_t *vreq;
 	struct timeval now;
+	struct list_head due = LIST_HEAD_INIT(due);
 
 	gettimeofday(&now, NULL);
-	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->failed_requests)
-		if (__tapdisk_vbd_request_timeout(vreq, &now))
+	tapdisk_vbd_expire_wheel(vbd, now.tv_sec, &due);
+
+	while ((vreq = tapdisk_vbd_next_due_request(&due))) {
+		if (td_flag_test(vbd->state, TD_VBD_SHUTDOWN_REQUESTED) ||
+		    __tapdisk_vbd_request_timeout(vreq, &now))
 			tapdisk_vbd_complete_vbd_request(vbd, vreq);
+		else
+			tapdisk_vbd_arm_request(vbd, vreq,
+						now.tv_sec + TD_VBD_RETRY_INTERVAL);
+	}
+}
 
+static void
+tapdisk_vbd_check_queue_state(td_vbd_t *vbd)
+{
 	if (!list_empty(&vbd->new_requests) ||
 	    !list_empty(&vbd->failed_requests))
 		tapdisk_vbd_issue_requests(vbd);
 
 }
 
+/*
+ * Publishes the metrics snapshots of the VBD. If some change has to wait for
+ * the next publication, make sure the event loop wakes up for it.
+ */
+static void
+tapdisk_vbd_publish_metrics(td_vbd_t *vbd)
+{
+	struct td_xenblkif *blkif;
+	struct timespec now;
+	uint64_t now_us;
+	int pending;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+	pending = td_metrics_publish(&vbd->vdi_stats, now_us);
+
+	list_for_each_entry(blkif, &vbd->rings, entry)
+		pending |= td_metrics_publish(&blkif->vbd_stats, now_us);
+
+	if (vbd->tap)
+		pending |= td_metrics_publish(&vbd->tap->blktap_stats, now_us);
+
+	if (vbd->nbdserver)
+		pending |= td_metrics_publish(&vbd->nbdserver->nbd_stats, now_us);
+
+	if (pending)
+		tapdisk_server_set_max_timeout_us(td_metrics_publish_interval());
+}
+
 void
 tapdisk_vbd_check_state(td_vbd_t *vbd)
 {
@@ -1088,6 +1608,8 @@ tapdisk_vbd_check_state(td_vbd_t *vbd)
 	list_for_each_entry(blkif, &vbd->rings, entry)
 		tapdisk_xenblkif_ring_stats_update(blkif);
 
+	tapdisk_vbd_publish_metrics(vbd);
+
 	tapdisk_vbd_check_queue_state(vbd);
 
 	if (td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED))
@@ -1167,14 +1689,8 @@ tapdisk_vbd_request_should_retry(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	    td_flag_test(vbd->state, TD_VBD_SHUTDOWN_REQUESTED))
 		return 0;
 
-	switch (abs(vreq->error)) {
-	case EPERM:
-	case ENOSYS:
-	case ESTALE:
-	case ENOSPC:
-	case EFAULT:
+	if (!tapdisk_vbd_retry_policy(vreq->error)->retry)
 		return 0;
-	}
 
 	if (tapdisk_vbd_request_timeout(vreq))
 		return 0;
@@ -1186,14 +1702,132 @@ static void
 tapdisk_vbd_complete_vbd_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
 	if (!vreq->submitting && !vreq->secs_pending) {
+		TD_PROBE3(vbd_complete, vbd->uuid, vreq, vreq->error);
+
+		tapdisk_vbd_retry_put(vreq);
+
+		tapdisk_profile_add(vbd->profile, TD_PROF_COMPLETE,
+				    vreq->prof_ts);
+		vreq->prof_ts = 0;
+
 		if (vreq->error &&
-		    tapdisk_vbd_request_should_retry(vbd, vreq))
+		    tapdisk_vbd_request_should_retry(vbd, vreq)) {
 			tapdisk_vbd_move_request(vreq, &vbd->failed_requests);
-		else
+			tapdisk_vbd_arm_failed_request(vbd, vreq);
+		} else
 			tapdisk_vbd_move_request(vreq, &vbd->completed_requests);
 	}
 }
 
+static int
+tapdisk_vbd_image_level(td_vbd_t *vbd, td_image_t *image)
+{
+	td_image_t *img;
+	int level = 0;
+
+	tapdisk_for_each_image(img, &vbd->images) {
+		if (img == image)
+			return level < TAPDISK_TRACE_NO_LEVEL ?
+				level : TAPDISK_TRACE_NO_LEVEL;
+		level++;
+	}
+
+	return TAPDISK_TRACE_NO_LEVEL;
+}
+
+static void
+__tapdisk_vbd_trace_treq(td_vbd_t *vbd, int event, td_request_t treq, int err)
+{
+	tapdisk_trace_event(vbd->trace, event, treq.op, treq.sec, treq.secs,
+			    treq.vreq->seq,
+			    tapdisk_vbd_image_level(vbd, treq.image), err);
+}
+
+static void
+__tapdisk_vbd_trace_vreq(td_vbd_t *vbd, int event, td_vbd_request_t *vreq)
+{
+	uint32_t secs = 0;
+	int i;
+
+	for (i = 0; i < vreq->iovcnt; i++)
+		secs += vreq->iov[i].secs;
+
+	tapdisk_trace_event(vbd->trace, event, vreq->op, vreq->sec, secs,
+			    vreq->seq, TAPDISK_TRACE_NO_LEVEL, vreq->error);
+}
+
+#define tapdisk_vbd_trace_treq(_vbd, _event, _treq, _err)		\
+	do {								\
+		if (unlikely((_vbd)->trace))				\
+			__tapdisk_vbd_trace_treq(_vbd, _event, _treq, _err); \
+	} while (0)
+
+#define tapdisk_vbd_trace_vreq(_vbd, _event, _vreq)			\
+	do {								\
+		if (unlikely((_vbd)->trace))				\
+			__tapdisk_vbd_trace_vreq(_vbd, _event, _vreq);	\
+	} while (0)
+
+int
+tapdisk_vbd_trace_start(td_vbd_t *vbd, unsigned int size)
+{
+	td_trace_t *trace;
+	int err;
+
+	err = tapdisk_trace_create(&trace, size);
+	if (err)
+		return err;
+
+	tapdisk_vbd_trace_stop(vbd);
+	vbd->trace = trace;
+
+	DPRINTF("%s: tracing, %llu records\n", vbd->name,
+		(unsigned long long)trace->mask + 1);
+
+	return 0;
+}
+
+void
+tapdisk_vbd_trace_stop(td_vbd_t *vbd)
+{
+	if (vbd->trace) {
+		tapdisk_trace_destroy(vbd->trace);
+		vbd->trace = NULL;
+	}
+}
+
+int
+tapdisk_vbd_profile(td_vbd_t *vbd, int cmd)
+{
+	int err;
+
+	switch (cmd) {
+	case TAPDISK_PROFILE_START:
+		if (!vbd->profile) {
+			err = tapdisk_profile_create(&vbd->profile);
+			if (err)
+				return err;
+		}
+		vbd->profile->enabled = 1;
+		break;
+
+	case TAPDISK_PROFILE_STOP:
+		if (vbd->profile)
+			vbd->profile->enabled = 0;
+		break;
+
+	case TAPDISK_PROFILE_RESET:
+		if (vbd->profile)
+			tapdisk_profile_reset(vbd->profile);
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 static void
 FIXME_maybe_count_enospc_redirect(td_vbd_t *vbd, td_request_t treq)
 {
@@ -1217,9 +1851,18 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 	vbd->secs_pending  -= treq.secs;
 	vreq->secs_pending -= treq.secs;
 
+	tapdisk_vbd_trace_treq(vbd, TAPDISK_TRACE_COMPLETE, treq, err);
+
+        interval = timeval_to_us(&vbd->ts) - timeval_to_us(&vreq->ts);
+
 	if (err != -EBUSY) {
-		int write = treq.op == TD_OP_WRITE;
+		int write = treq.op != TD_OP_READ;
+		uint64_t *lat = write ?
+			image->stats.lat.wr : image->stats.lat.rd;
+
 		td_sector_count_add(&image->stats.hits, treq.secs, write);
+		td_sector_count_add(&image->stats.reqs, 1, write);
+		lat[tapdisk_image_lat_bucket(interval)]++;
 		if (err)
 			td_sector_count_add(&image->stats.fail,
 					    treq.secs, write);
@@ -1234,20 +1877,22 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 				tlog_drv_error(image->driver, err,
 					       "req %s: %s 0x%04x secs @ 0x%08"PRIx64" - %s",
 					       vreq->name,
-					       (treq.op == TD_OP_WRITE ? "write" : "read"),
+					       (treq.op == TD_OP_READ ? "read" :
+						treq.op == TD_OP_WRITE ? "write" :
+						treq.op == TD_OP_DISCARD ? "discard" :
+						treq.op == TD_OP_FLUSH ? "flush" :
+						"write-zeroes"),
 					       treq.secs, treq.sec, strerror(abs(err)));
 			vbd->errors++;
 		}
 		vreq->error = (vreq->error ? : err);
 	}
 
-        interval = timeval_to_us(&vbd->ts) - timeval_to_us(&vreq->ts);
-
         if(treq.op == TD_OP_READ){
             vbd->vdi_stats.stats->read_reqs_completed++;
             vbd->vdi_stats.stats->read_sectors += treq.secs;
             vbd->vdi_stats.stats->read_total_ticks += interval;
-        }else{
+        }else if(treq.op != TD_OP_DISCARD && treq.op != TD_OP_FLUSH){
             vbd->vdi_stats.stats->write_reqs_completed++;
             vbd->vdi_stats.stats->write_sectors += treq.secs;
             vbd->vdi_stats.stats->write_total_ticks += interval;
@@ -1269,7 +1914,8 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 	vreq->submitting++;
 
 	if (tapdisk_vbd_is_last_image(vbd, image)) {
-		memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
+		if (td_op_has_data(treq.op))
+			memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
 		td_complete_request(treq, 0);
 		goto done;
 	}
@@ -1297,13 +1943,16 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 		} else
 			treq.secs   = 0;
 
-		memset(clone.buf, 0, clone.secs << SECTOR_SHIFT);
+		if (td_op_has_data(treq.op))
+			memset(clone.buf, 0, clone.secs << SECTOR_SHIFT);
 		td_complete_request(clone, 0);
 
 		if (!treq.secs)
 			goto done;
 	}
 
+	tapdisk_vbd_trace_treq(vbd, TAPDISK_TRACE_SUBMIT, treq, 0);
+
 	switch (treq.op) {
 	case TD_OP_WRITE:
 		td_queue_write(parent, treq);
@@ -1312,6 +1961,18 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 	case TD_OP_READ:
 		td_queue_read(parent, treq);
 		break;
+
+	case TD_OP_DISCARD:
+		td_queue_discard(parent, treq);
+		break;
+
+	case TD_OP_WRITE_ZEROES:
+		td_queue_write_zeroes(parent, treq);
+		break;
+
+	case TD_OP_FLUSH:
+		td_queue_flush(parent, treq);
+		break;
 	}
 
 done:
@@ -1333,9 +1994,11 @@ tapdisk_vbd_forward_request(td_request_t treq)
 
 	tapdisk_vbd_mark_progress(vbd);
 
-	if (tapdisk_vbd_queue_ready(vbd))
+	if (tapdisk_vbd_queue_ready(vbd)) {
+		td_sector_count_add(&image->stats.fwd, 1,
+				    treq.op != TD_OP_READ);
 		__tapdisk_vbd_reissue_td_request(vbd, image, treq);
-	else
+	} else
 		__tapdisk_vbd_complete_td_request(vbd, vreq, treq, -EBUSY);
 }
 
@@ -1360,6 +2023,9 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 			DPRINTF("ENOSPC: disabling mirroring\n");
 			list_del_init(&leaf->next);
 			vbd->retired = leaf;
+			/* the secondary is all there is now */
+			if (!tapdisk_mirror_busy(vbd))
+				tapdisk_mirror_close(vbd, 1);
 		} else if (vbd->secondary_mode == TD_VBD_SECONDARY_STANDBY) {
 			DPRINTF("ENOSPC: failing over to secondary image\n");
 			list_add(&vbd->secondary->next, leaf->next.prev);
@@ -1370,6 +2036,7 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 			vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
 			signal_enospc(vbd);
 		}
+		tapdisk_vbd_index_reset(vbd);
 	}
 
 	if (res != 0 && image->type == DISK_TYPE_NBD && 
@@ -1377,16 +2044,13 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 			 (image == vbd->retired))) {
 		ERROR("Got non-zero res %d for NBD secondary - disabling "
 		      "mirroring: %s", res, vreq->name);
-		vbd->nbd_mirror_failed = 1;
 		res = 0; /* Pretend the writes have completed successfully */
 
+		if (treq.op == TD_OP_WRITE || treq.op == TD_OP_WRITE_ZEROES)
+			tapdisk_mirror_mark(vbd, treq.sec, treq.secs);
+
 		/* It was the secondary that timed out - disable secondary */
-		list_del_init(&image->next);
-		vbd->retired = image;
-		if (vbd->secondary_mode != TD_VBD_SECONDARY_DISABLED) {
-			vbd->secondary = NULL;
-			vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
-		}
+		tapdisk_vbd_retire_secondary(vbd, image);
 	}
 
 	DBG(TLOG_DBG, "%s: req %s seg %d sec 0x%08"PRIx64
@@ -1397,11 +2061,199 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 	__tapdisk_vbd_complete_td_request(vbd, vreq, treq, res);
 }
 
+/*
+ * An NBD secondary which failed a request: dropped from the chain, what
+ * it misses from now on goes to the dirty log.
+ */
+void
+tapdisk_vbd_retire_secondary(td_vbd_t *vbd, td_image_t *image)
+{
+	vbd->nbd_mirror_failed = 1;
+
+	list_del_init(&image->next);
+	vbd->retired = image;
+	if (vbd->secondary_mode != TD_VBD_SECONDARY_DISABLED) {
+		vbd->secondary = NULL;
+		vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
+	}
+	tapdisk_vbd_index_reset(vbd);
+}
+
 static inline void
 queue_mirror_req(td_vbd_t *vbd, td_request_t clone)
 {
+	if (tapdisk_mirror_async(vbd)) {
+		tapdisk_mirror_queue(vbd, clone);
+		return;
+	}
+
 	clone.image = vbd->secondary;
-	td_queue_write(vbd->secondary, clone);
+	if (clone.op == TD_OP_WRITE_ZEROES)
+		td_queue_write_zeroes(vbd->secondary, clone);
+	else
+		td_queue_write(vbd->secondary, clone);
+}
+
+static int
+tapdisk_vbd_index_init(td_vbd_t *vbd)
+{
+	struct td_vbd_index *index = &vbd->index;
+	td_image_t *image, *tmp;
+	const char *val;
+	int n;
+
+	val = getenv("TAPDISK3_CHAIN_INDEX");
+	if (val && !atoi(val))
+		return -ENOTSUP;
+
+	n = 0;
+	index->size = (td_sector_t)-1;
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		index->size = MIN(index->size, image->info.size);
+		n++;
+	}
+
+	/* nothing to skip */
+	if (n < 2 || n > TD_VBD_INDEX_MAX_DEPTH)
+		return -ENOTSUP;
+
+	index->images = calloc(n, sizeof(td_image_t *));
+	if (!index->images)
+		return -ENOMEM;
+
+	n = 0;
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		index->images[n++] = image;
+	index->nr_images = n;
+
+	index->chunks = (index->size + (1 << TD_VBD_INDEX_CHUNK_SHIFT) - 1) >>
+		TD_VBD_INDEX_CHUNK_SHIFT;
+	index->depth  = malloc(index->chunks);
+	if (!index->depth) {
+		free(index->images);
+		index->images = NULL;
+		return -ENOMEM;
+	}
+	memset(index->depth, TD_VBD_INDEX_UNKNOWN, index->chunks);
+
+	DPRINTF("%s: chain index for %d images, %"PRIu64" chunks\n",
+		vbd->name, n, index->chunks);
+	return 0;
+}
+
+static int
+tapdisk_vbd_index_chunk(td_vbd_t *vbd, td_sector_t chunk)
+{
+	struct td_vbd_index *index = &vbd->index;
+	td_sector_t sec, secs, run;
+	int depth;
+
+	sec  = chunk << TD_VBD_INDEX_CHUNK_SHIFT;
+	secs = MIN((td_sector_t)1 << TD_VBD_INDEX_CHUNK_SHIFT,
+		   index->size - sec);
+
+	/* the last image gets the read either way */
+	for (depth = 0; depth < index->nr_images - 1; depth++)
+		if (td_sector_present(index->images[depth], sec, &run) ||
+		    run < secs)
+			break;
+
+	return depth;
+}
+
+/*
+ * Returns the image a read of [sec, sec + secs) should start at.
+ */
+static td_image_t *
+tapdisk_vbd_index_lookup(td_vbd_t *vbd, td_sector_t sec, td_sector_t secs)
+{
+	struct td_vbd_index *index = &vbd->index;
+	td_sector_t chunk, last;
+	int depth;
+
+	if (index->disabled || vbd->retired ||
+	    vbd->secondary_mode != TD_VBD_SECONDARY_DISABLED)
+		goto leaf;
+
+	if (!index->depth && tapdisk_vbd_index_init(vbd)) {
+		index->disabled = 1;
+		goto leaf;
+	}
+
+	/* images smaller than the request end zero-fill on the way down */
+	if (!secs || sec + secs > index->size)
+		goto leaf;
+
+	depth = TD_VBD_INDEX_MAX_DEPTH;
+	last  = (sec + secs - 1) >> TD_VBD_INDEX_CHUNK_SHIFT;
+
+	for (chunk = sec >> TD_VBD_INDEX_CHUNK_SHIFT; chunk <= last; chunk++) {
+		if (index->depth[chunk] == TD_VBD_INDEX_UNKNOWN)
+			index->depth[chunk] = tapdisk_vbd_index_chunk(vbd, chunk);
+		depth = MIN(depth, index->depth[chunk]);
+	}
+
+	index->skipped += depth;
+	return index->images[depth];
+
+leaf:
+	return tapdisk_vbd_first_image(vbd);
+}
+
+static void
+tapdisk_vbd_index_write(td_vbd_t *vbd, td_sector_t sec, td_sector_t secs)
+{
+	struct td_vbd_index *index = &vbd->index;
+	td_sector_t chunk, last;
+
+	if (!index->depth || !secs)
+		return;
+
+	last = MIN((sec + secs - 1) >> TD_VBD_INDEX_CHUNK_SHIFT,
+		   index->chunks - 1);
+
+	for (chunk = sec >> TD_VBD_INDEX_CHUNK_SHIFT; chunk <= last; chunk++)
+		index->depth[chunk] = 0;
+}
+
+/*
+ * Tells whether any image in the chain may hold data at @sec: 1 if so, 0
+ * for a hole that reads as zeroes. On entry *secs is the longest run the
+ * caller cares about, on return the length of the run with the same
+ * answer. Images without allocation info are taken to be fully allocated.
+ */
+int
+tapdisk_vbd_sector_status(td_vbd_t *vbd, td_sector_t sec, td_sector_t *secs)
+{
+	td_image_t *image, *tmp;
+	td_sector_t limit, run;
+	int err, present;
+
+	limit   = *secs;
+	present = 0;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		/* reads past the end of a smaller parent zero-fill */
+		if (sec >= image->info.size)
+			continue;
+
+		limit = MIN(limit, image->info.size - sec);
+
+		err = td_sector_present(image, sec, &run);
+		if (err < 0) {
+			present = 1;
+			break;
+		}
+
+		limit = MIN(limit, MAX(run, 1));
+		if (err) {
+			present = 1;
+			break;
+		}
+	}
+
+	*secs = limit;
+	return present;
 }
 
 static int
@@ -1410,12 +2262,16 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	td_image_t *image;
 	td_request_t treq;
 	td_sector_t sec;
+	uint64_t start;
 	int i, err;
 
 	sec    = vreq->sec;
 	image  = tapdisk_vbd_first_image(vbd);
 
 	vreq->submitting = 1;
+	vreq->prof_ts    = start = tapdisk_profile_now(vbd->profile);
+
+	TD_PROBE4(vbd_issue, vbd->uuid, vreq, vreq->op, vreq->sec);
 
 	tapdisk_vbd_mark_progress(vbd);
 	vreq->last_try = vbd->ts;
@@ -1441,6 +2297,7 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		treq.buf            = iov->base;
 		treq.sec            = sec;
 		treq.secs           = iov->secs;
+		treq.prio           = vreq->prio;
 		treq.image          = image;
 		treq.cb             = tapdisk_vbd_complete_td_request;
 		treq.cb_data        = NULL;
@@ -1450,7 +2307,9 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		vreq->secs_pending += iov->secs;
 		vbd->secs_pending  += iov->secs;
 		if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR &&
-		    vreq->op == TD_OP_WRITE) {
+		    !tapdisk_mirror_async(vbd) &&
+		    (vreq->op == TD_OP_WRITE ||
+		     vreq->op == TD_OP_WRITE_ZEROES)) {
 			vreq->secs_pending += iov->secs;
 			vbd->secs_pending  += iov->secs;
 		}
@@ -1470,14 +2329,60 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 			 */
 			if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR)
 				queue_mirror_req(vbd, treq);
+			tapdisk_mirror_write(vbd, treq.sec, treq.secs);
+			tapdisk_coalesce_write(vbd, treq.sec, treq.secs);
+			tapdisk_vbd_index_write(vbd, treq.sec, treq.secs);
+			tapdisk_vbd_trace_treq(vbd, TAPDISK_TRACE_SUBMIT,
+					       treq, 0);
 			td_queue_write(treq.image, treq);
 			break;
 
 		case TD_OP_READ:
 			treq.op = TD_OP_READ;
                         vbd->vdi_stats.stats->read_reqs_submitted++;
+			treq.image = tapdisk_vbd_index_lookup(vbd, treq.sec,
+							      treq.secs);
+			tapdisk_vbd_trace_treq(vbd, TAPDISK_TRACE_SUBMIT,
+					       treq, 0);
 			td_queue_read(treq.image, treq);
 			break;
+
+		case TD_OP_DISCARD:
+			/*
+			 * A chain index entry may keep pointing at the leaf,
+			 * reads of discarded sectors are forwarded from there.
+			 */
+			treq.op = TD_OP_DISCARD;
+			tapdisk_coalesce_write(vbd, treq.sec, treq.secs);
+			tapdisk_vbd_trace_treq(vbd, TAPDISK_TRACE_SUBMIT,
+					       treq, 0);
+			td_queue_discard(treq.image, treq);
+			break;
+
+		case TD_OP_WRITE_ZEROES:
+			treq.op = TD_OP_WRITE_ZEROES;
+			vbd->vdi_stats.stats->write_reqs_submitted++;
+			if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR)
+				queue_mirror_req(vbd, treq);
+			tapdisk_mirror_write(vbd, treq.sec, treq.secs);
+			tapdisk_coalesce_write(vbd, treq.sec, treq.secs);
+			tapdisk_vbd_index_write(vbd, treq.sec, treq.secs);
+			tapdisk_vbd_trace_treq(vbd, TAPDISK_TRACE_SUBMIT,
+					       treq, 0);
+			td_queue_write_zeroes(treq.image, treq);
+			break;
+
+		case TD_OP_FLUSH:
+			/*
+			 * Covers the writes completed so far. Not mirrored:
+			 * the secondary is a chain of its own, there is
+			 * nothing to forward the request to.
+			 */
+			treq.op = TD_OP_FLUSH;
+			tapdisk_vbd_trace_treq(vbd, TAPDISK_TRACE_SUBMIT,
+					       treq, 0);
+			td_queue_flush(treq.image, treq);
+			break;
 		}
 
 		DBG(TLOG_DBG, "%s: req %s seg %d sec 0x%08"PRIx64" secs 0x%04x "
@@ -1489,6 +2394,8 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	err = 0;
 
 out:
+	tapdisk_profile_add(vbd->profile, TD_PROF_ISSUE, start);
+
 	vreq->submitting--;
 	if (!vreq->secs_pending) {
 		err = (err ? : vreq->error);
@@ -1513,23 +2420,30 @@ tapdisk_vbd_reissue_failed_requests(td_vbd_t *vbd)
 {
 	int err;
 	struct timeval now;
-	td_vbd_request_t *vreq, *tmp;
+	td_vbd_request_t *vreq;
+	struct list_head due = LIST_HEAD_INIT(due);
 
 	err = 0;
 	gettimeofday(&now, NULL);
+	tapdisk_vbd_expire_wheel(vbd, now.tv_sec, &due);
 
-	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->failed_requests) {
-		if (vreq->secs_pending)
+	while ((vreq = tapdisk_vbd_next_due_request(&due))) {
+		if (vreq->secs_pending) {
+			tapdisk_vbd_arm_request(vbd, vreq, now.tv_sec);
 			continue;
+		}
 
-		if (td_flag_test(vbd->state, TD_VBD_SHUTDOWN_REQUESTED)) {
+		if (td_flag_test(vbd->state, TD_VBD_SHUTDOWN_REQUESTED) ||
+		    __tapdisk_vbd_request_timeout(vreq, &now)) {
 			tapdisk_vbd_complete_vbd_request(vbd, vreq);
 			continue;
 		}
 
-		if (vreq->error != -EBUSY &&
-		    now.tv_sec - vreq->last_try.tv_sec < TD_VBD_RETRY_INTERVAL)
+		if (!tapdisk_vbd_retry_get(vreq)) {
+			tapdisk_vbd_arm_request(vbd, vreq,
+						now.tv_sec + TD_VBD_RETRY_INTERVAL);
 			continue;
+		}
 
 		vbd->retries++;
 		vreq->num_retries++;
@@ -1544,12 +2458,16 @@ tapdisk_vbd_reissue_failed_requests(td_vbd_t *vbd)
 		err = tapdisk_vbd_issue_request(vbd, vreq);
 		/*
 		 * if this request failed, but was not completed,
-		 * we'll back off for a while.
+		 * we'll back off for a while. Whatever else was due
+		 * stays due for the next pass.
 		 */
 		if (err && !tapdisk_vbd_request_completed(vbd, vreq))
 			break;
 	}
 
+	while ((vreq = tapdisk_vbd_next_due_request(&due)))
+		tapdisk_vbd_arm_request(vbd, vreq, now.tv_sec);
+
 	return 0;
 }
 
@@ -1559,7 +2477,7 @@ tapdisk_vbd_count_new_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	struct td_iovec *iov;
 	int write;
 
-	write = vreq->op == TD_OP_WRITE;
+	write = vreq->op != TD_OP_READ;
 
 	for (iov = &vreq->iov[0]; iov < &vreq->iov[vreq->iovcnt]; iov++)
 		td_sector_count_add(&vbd->secs, iov->secs, write);
@@ -1572,6 +2490,9 @@ tapdisk_vbd_issue_new_requests(td_vbd_t *vbd)
 	td_vbd_request_t *vreq, *tmp;
 
 	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
+		if (tapdisk_backup_hold(vbd, vreq))
+			continue;
+
 		err = tapdisk_vbd_issue_request(vbd, vreq);
 		/*
 		 * if this request failed, but was not completed,
@@ -1632,8 +2553,9 @@ tapdisk_vbd_issue_requests(td_vbd_t *vbd)
 
 		if (td_flag_test(vbd->state, TD_VBD_RESUME_FAILED))
 			return tapdisk_vbd_kill_requests(vbd);
-		else
-			return -EAGAIN;
+
+		tapdisk_vbd_expire_failed_requests(vbd);
+		return -EAGAIN;
 	}
 
 	err = tapdisk_vbd_reissue_failed_requests(vbd);
@@ -1648,10 +2570,20 @@ tapdisk_vbd_queue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
 	gettimeofday(&vreq->ts, NULL);
 	vreq->vbd = vbd;
+	INIT_LIST_HEAD(&vreq->wheel);
+	vreq->retrying = 0;
 
 	list_add_tail(&vreq->next, &vbd->new_requests);
 	vbd->received++;
 
+	if (unlikely(vbd->trace)) {
+		vreq->seq = vbd->trace->seq++;
+		__tapdisk_vbd_trace_vreq(vbd, TAPDISK_TRACE_QUEUE, vreq);
+	}
+
+	if (unlikely(vbd->bootprof))
+		tapdisk_bootprof_queue(vbd, vreq);
+
 	return 0;
 }
 
@@ -1681,6 +2613,8 @@ tapdisk_vbd_kick(td_vbd_t *vbd)
 		tapdisk_vbd_for_each_request(vreq, next, list) {
 			if (vreq->token == prev->token) {
 
+				tapdisk_vbd_trace_vreq(vbd, TAPDISK_TRACE_DONE,
+						       prev);
 				prev->cb(prev, prev->error, prev->token, 0);
 				vbd->returned++;
 
@@ -1689,6 +2623,7 @@ tapdisk_vbd_kick(td_vbd_t *vbd)
 			}
 		}
 
+		tapdisk_vbd_trace_vreq(vbd, TAPDISK_TRACE_DONE, prev);
 		prev->cb(prev, prev->error, prev->token, 1);
 		vbd->returned++;
 	}
@@ -1724,6 +2659,35 @@ tapdisk_vbd_start_nbdserver(td_vbd_t *vbd)
 }
 
 
+int
+tapdisk_vbd_start_vhostblk(td_vbd_t *vbd)
+{
+	td_disk_info_t info;
+	const char *val;
+	int err;
+
+	val = getenv("TAPDISK3_VHOST_BLK");
+	if (!val || !atoi(val))
+		return 0;
+
+	err = tapdisk_vbd_get_disk_info(vbd, &info);
+	if (err)
+		return err;
+
+	vbd->vhostblk = tapdisk_vhostblk_alloc(vbd, info);
+	if (!vbd->vhostblk)
+		return -ENOMEM;
+
+	err = tapdisk_vhostblk_listen(vbd->vhostblk);
+	if (err) {
+		tapdisk_vhostblk_free(vbd->vhostblk);
+		vbd->vhostblk = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
 static int
 tapdisk_vbd_reqs_outstanding(td_vbd_t *vbd)
 {
@@ -1758,19 +2722,50 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 		tapdisk_image_stats(image, st);
 	tapdisk_stats_leave(st, ']');
 
+	if (vbd->index.depth) {
+		tapdisk_stats_field(st, "chain_index", "{");
+		tapdisk_stats_field(st, "chunks", "llu",
+				    (unsigned long long)vbd->index.chunks);
+		tapdisk_stats_field(st, "skipped", "llu",
+				    (unsigned long long)vbd->index.skipped);
+		tapdisk_stats_leave(st, '}');
+	}
+
 	if (vbd->tap) {
 		tapdisk_stats_field(st, "tap", "{");
 		tapdisk_blktap_stats(vbd->tap, st);
 		tapdisk_stats_leave(st, '}');
 	}
 
+	if (vbd->nbdserver)
+		tapdisk_nbdserver_stats(vbd->nbdserver, st);
+
+	if (vbd->vhostblk)
+		tapdisk_vhostblk_stats(vbd->vhostblk, st);
+
     /*
      * TODO Is this used by any one?
      */
     if (!list_empty(&vbd->rings)) {
+        struct td_xenblkif *first = list_first_entry(&vbd->rings,
+                struct td_xenblkif, entry);
+
 	    tapdisk_stats_field(st, "xenbus", "{");
-        list_for_each_entry(blkif, &vbd->rings, entry)
-		    tapdisk_xenblkif_stats(blkif, st);
+	    tapdisk_xenblkif_stats(first, st);
+        /*
+         * The other rings of a multi-queue device.
+         */
+        if (!list_is_last(&first->entry, &vbd->rings)) {
+            tapdisk_stats_field(st, "queues", "[");
+            list_for_each_entry(blkif, &vbd->rings, entry) {
+                if (blkif == first)
+                    continue;
+                tapdisk_stats_enter(st, '{');
+                tapdisk_xenblkif_stats(blkif, st);
+                tapdisk_stats_leave(st, '}');
+            }
+            tapdisk_stats_leave(st, ']');
+        }
     	tapdisk_stats_leave(st, '}');
     }
 
@@ -1782,6 +2777,13 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 			"nbd_mirror_failed",
 			"d", vbd->nbd_mirror_failed);
 
+	tapdisk_mirror_stats(vbd, st);
+	tapdisk_coalesce_stats(vbd, st);
+	tapdisk_backup_stats(vbd, st);
+	tapdisk_bootprof_stats(vbd, st);
+	if (vbd->profile)
+		tapdisk_profile_stats(vbd->profile, st);
+
 	tapdisk_stats_field(st,
 			"reqs_outstanding",
 			"d", tapdisk_vbd_reqs_outstanding(vbd));
@@ -1793,6 +2795,36 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 	tapdisk_stats_leave(st, '}');
 }
 
+/*
+ * Counters of tapdisk_vbd_stats(), as a fixed record.
+ */
+void
+tapdisk_vbd_stats_bin(td_vbd_t *vbd, struct tapdisk_stats_bin_vbd *rec)
+{
+	td_image_t *image, *next;
+
+	memset(rec, 0, sizeof(*rec));
+
+	rec->minor        = vbd->uuid;
+	rec->state        = vbd->state;
+	rec->secs_rd      = vbd->secs.rd;
+	rec->secs_wr      = vbd->secs.wr;
+	rec->received     = vbd->received;
+	rec->returned     = vbd->returned;
+	rec->kicked       = vbd->kicked;
+	rec->secs_pending = vbd->secs_pending;
+	rec->retries      = vbd->retries;
+	rec->errors       = vbd->errors;
+
+	tapdisk_vbd_for_each_image(vbd, image, next) {
+		rec->hits_rd += image->stats.hits.rd;
+		rec->hits_wr += image->stats.hits.wr;
+		rec->fail_rd += image->stats.fail.rd;
+		rec->fail_wr += image->stats.fail.wr;
+		rec->images++;
+	}
+}
+
 
 bool inline
 tapdisk_vbd_contains_dead_rings(td_vbd_t * vbd)
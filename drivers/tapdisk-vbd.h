@@ -43,6 +43,20 @@
 #define TD_VBD_MAX_RETRIES          100
 #define TD_VBD_RETRY_INTERVAL       1
 
+/*
+ * Failed requests are parked on a timer wheel of one-second slots, keyed
+ * by the time they next need attention (retry or expiry). Deadlines more
+ * than TD_VBD_WHEEL_SLOTS seconds away simply stay in their slot for
+ * another lap. Must be a power of two.
+ */
+#define TD_VBD_WHEEL_SLOTS          64
+
+struct td_vbd_wheel {
+	struct list_head            slots[TD_VBD_WHEEL_SLOTS];
+	time_t                      clock;
+	int                         armed;
+};
+
 /*
  * VBD states
  */
@@ -61,7 +75,29 @@
 #define TD_VBD_SECONDARY_MIRROR     1
 #define TD_VBD_SECONDARY_STANDBY    2
 
+#define TD_VBD_INDEX_CHUNK_SHIFT    12 /* sectors per index chunk: 2MB */
+#define TD_VBD_INDEX_MAX_DEPTH      254
+#define TD_VBD_INDEX_UNKNOWN        0xff
+
 struct td_nbdserver;
+struct td_vhostblk;
+
+/*
+ * Chain index: for each chunk of the disk, the depth of the first image
+ * in the chain which may hold data for it. Reads start there instead of
+ * falling through every image above it in turn. Chunks are looked up
+ * lazily; a write pins its chunks to the leaf, and the whole index goes
+ * with the chain on close.
+ */
+struct td_vbd_index {
+	uint8_t                    *depth;
+	td_image_t                **images;     /* leaf first */
+	int                         nr_images;
+	td_sector_t                 chunks;
+	td_sector_t                 size;       /* of the smallest image */
+	int                         disabled;
+	uint64_t                    skipped;    /* image visits saved */
+};
 
 struct td_vbd_rrd {
 
@@ -77,48 +113,52 @@ struct td_vbd_rrd {
 };
 
 struct td_vbd_handle {
+	/*
+	 * Request queueing, issue and completion touch what comes first, kept
+	 * together to span few cache lines. Configuration and state only used
+	 * on setup, control requests or timeouts follows.
+	 */
+
 	/**
-	 * type:/path/to/file
+	 * VBD state (TD_VBD_XXX, excluding SECONDARY and request-related)
 	 */
-	char                       *name;
+	td_flag_t                   state;
 
-	td_blktap_t                *tap;
+	td_flag_t                   flags;
 
-	td_uuid_t                   uuid;
+	struct list_head            new_requests;
+	struct list_head            pending_requests;
+	struct list_head            failed_requests;
+	struct list_head            completed_requests;
+	struct td_vbd_wheel         wheel;
 
-	/**
-	 * shared rings
-	 */
-	struct list_head           rings;
+	uint64_t                    received;
+	uint64_t                    returned;
+	uint64_t                    kicked;
+	uint64_t                    secs_pending;
+	uint64_t                    retries;
+	uint64_t                    errors;
+	td_sector_count_t           secs;
+
+	struct timeval              ts;
 
 	/**
-	 * List of rings that contain pending requests but a disconnection was
-	 * issued. We need to maintain these rings until all their pending requests
-	 * complete. When the last request completes, the ring is destroyed and
-	 * removed from this list.
+	 * List of images: the leaf is at the head, the tree root is at the tail.
 	 */
-	struct list_head            dead_rings;
+	struct list_head            images;
 
-	td_flag_t                   flags;
+	struct td_vbd_index         index;
 
-	/**
-	 * VBD state (TD_VBD_XXX, excluding SECONDARY and request-related)
-	 */
-	td_flag_t                   state;
+	stats_t                     vdi_stats;
 
 	/**
-	 * List of images: the leaf is at the head, the tree root is at the tail.
+	 * shared rings
 	 */
-	struct list_head            images;
+	struct list_head           rings;
 
-	int                         parent_devnum;
-	char                       *secondary_name;
 	td_image_t                 *secondary;
 	uint8_t                     secondary_mode;
 
-	int                         FIXME_enospc_redirect_count_enabled;
-	uint64_t                    FIXME_enospc_redirect_count;
-
 	/*
 	 * when we encounter ENOSPC on the primary leaf image in mirror mode, 
 	 * we need to remove it from the VBD chain so that writes start going 
@@ -128,29 +168,71 @@ struct td_vbd_handle {
 	 */
 	td_image_t                 *retired;
 
-	int                         nbd_mirror_failed;
+	/*
+	 * What a mirror secondary missed while it was gone, and the resync
+	 * of it once it is back.
+	 */
+	struct td_mirror           *mirror;
 
-	struct list_head            new_requests;
-	struct list_head            pending_requests;
-	struct list_head            failed_requests;
-	struct list_head            completed_requests;
+	/* live coalesce of the leaf into its parent, while it runs */
+	struct td_coalesce         *coalesce;
+
+	/* point-in-time export, copying blocks aside before they change */
+	struct td_backup           *backup;
+
+	/* I/O trace ring, while tracing */
+	struct td_trace            *trace;
+
+	/* per-stage request profile, once started */
+	struct td_profile          *profile;
+
+	/* boot profile, while recording or replaying it */
+	struct td_bootprof         *bootprof;
 
-	td_vbd_request_t            request_list[MAX_REQUESTS]; /* XXX */
+	/**
+	 * type:/path/to/file
+	 */
+	char                       *name;
+
+	td_blktap_t                *tap;
+
+	td_uuid_t                   uuid;
+
+	int                         parent_devnum;
+	char                       *secondary_name;
 
 	struct list_head            next;
 
+	/**
+	 * List of rings that contain pending requests but a disconnection was
+	 * issued. We need to maintain these rings until all their pending requests
+	 * complete. When the last request completes, the ring is destroyed and
+	 * removed from this list.
+	 */
+	struct list_head            dead_rings;
+
+	/**
+	 * Parents kept open while paused, for resume to take back.
+	 */
+	struct list_head            retained;
+
+	int                         FIXME_enospc_redirect_count_enabled;
+	uint64_t                    FIXME_enospc_redirect_count;
+
+	int                         nbd_mirror_failed;
+
 	uint16_t                    req_timeout; /* in seconds */
-	struct timeval              ts;
 
-	uint64_t                    received;
-	uint64_t                    returned;
-	uint64_t                    kicked;
-	uint64_t                    secs_pending;
-	uint64_t                    retries;
-	uint64_t                    errors;
-	td_sector_count_t           secs;
+	/**
+	 * Data segments the connected rings may have in flight, which the
+	 * image pools are sized for.
+	 */
+	int                         depth;
+	uint32_t                    cache_size;  /* MiB of block cache, 0 for
+						  * the default */
 
 	struct td_nbdserver        *nbdserver;
+	struct td_vhostblk         *vhostblk;
 
 	/**
 	 * We keep a copy of the disk info because we might receive a disk info
@@ -159,7 +241,6 @@ struct td_vbd_handle {
 	td_disk_info_t              disk_info;
 
 	struct td_vbd_rrd           rrd;
-	stats_t vdi_stats;
 
 	char                       *logpath;
 
@@ -184,6 +265,11 @@ tapdisk_vbd_move_request(td_vbd_request_t *vreq, struct list_head *dest)
 	INIT_LIST_HEAD(&vreq->next);
 	list_add_tail(&vreq->next, dest);
 	vreq->list_head = dest;
+
+	if (!list_empty(&vreq->wheel)) {
+		list_del_init(&vreq->wheel);
+		vreq->vbd->wheel.armed--;
+	}
 }
 
 td_vbd_t *tapdisk_vbd_create(td_uuid_t);
@@ -207,6 +293,12 @@ int tapdisk_vbd_open_vdi(td_vbd_t * vbd, const char *params, td_flag_t flags,
         int prt_devnum);
 void tapdisk_vbd_close_vdi(td_vbd_t *);
 
+/*
+ * Replaces the leaf and its parent with @image, a writable copy of the
+ * parent, taking the parent's name. The queue must be quiesced.
+ */
+int tapdisk_vbd_replace_leaf(td_vbd_t *, td_image_t *image);
+
 int tapdisk_vbd_attach(td_vbd_t *, const char *, int);
 void tapdisk_vbd_detach(td_vbd_t *);
 
@@ -214,7 +306,15 @@ int tapdisk_vbd_queue_request(td_vbd_t *, td_vbd_request_t *);
 void tapdisk_vbd_forward_request(td_request_t);
 
 int tapdisk_vbd_get_disk_info(td_vbd_t *, td_disk_info_t *);
+int tapdisk_vbd_sector_status(td_vbd_t *, td_sector_t, td_sector_t *);
 int tapdisk_vbd_retry_needed(td_vbd_t *);
+void tapdisk_vbd_retire_secondary(td_vbd_t *, td_image_t *);
+
+/*
+ * Grows the request pools of the chain to hold @nr data segments in flight.
+ * The depth never shrinks.
+ */
+int tapdisk_vbd_set_depth(td_vbd_t *, int nr);
 int tapdisk_vbd_quiesce_queue(td_vbd_t *);
 int tapdisk_vbd_start_queue(td_vbd_t *);
 int tapdisk_vbd_issue_requests(td_vbd_t *);
@@ -236,7 +336,28 @@ int tapdisk_vbd_recheck_state(td_vbd_t *);
 void tapdisk_vbd_check_progress(td_vbd_t *);
 void tapdisk_vbd_debug(td_vbd_t *);
 int tapdisk_vbd_start_nbdserver(td_vbd_t *);
+
+/*
+ * Starts the vhost-user-blk back-end if TAPDISK3_VHOST_BLK is set, see
+ * tapdisk-vhostblk.h.
+ */
+int tapdisk_vbd_start_vhostblk(td_vbd_t *);
 void tapdisk_vbd_stats(td_vbd_t *, td_stats_t *);
+struct tapdisk_stats_bin_vbd;
+void tapdisk_vbd_stats_bin(td_vbd_t *, struct tapdisk_stats_bin_vbd *);
+
+/**
+ * Starts recording I/O into a trace ring of @size records, replacing
+ * any ring, or stops and drops it.
+ */
+int tapdisk_vbd_trace_start(td_vbd_t *, unsigned int size);
+void tapdisk_vbd_trace_stop(td_vbd_t *);
+
+/**
+ * Starts, stops or clears the per-stage request profile (one of
+ * TAPDISK_PROFILE_*).
+ */
+int tapdisk_vbd_profile(td_vbd_t *, int cmd);
 
 /**
  * Tells whether the VBD contains at least one dead ring.
@@ -0,0 +1,1550 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "debug.h"
+#include "tapdisk.h"
+#include "tapdisk-log.h"
+#include "tapdisk-server.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-stats.h"
+#include "tapdisk-vhostblk.h"
+#include "timeout-math.h"
+#include "compiler.h"
+
+#define INFO(_f, _a...)            tlog_syslog(TLOG_INFO, "vhost-blk: " _f, ##_a)
+#define ERR(_f, _a...)             tlog_syslog(TLOG_WARN, "vhost-blk: " _f, ##_a)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define TAPDISK_VHOSTBLK_MAX_PATH_LEN 256
+#define TAPDISK_VHOSTBLK_MAX_FDS      TAPDISK_VHOSTBLK_MAX_REGIONS
+
+/* data segments, plus the header and the status */
+#define TAPDISK_VHOSTBLK_MAX_DESCS    (TAPDISK_VHOSTBLK_SEG_MAX + 2)
+
+/* discards and zeroes are one vreq, whose length is an int */
+#define TAPDISK_VHOSTBLK_MAX_ZERO_SECS ((1U << 31) >> SECTOR_SHIFT)
+
+struct td_vhostblk_seg {
+	char                   *base;
+	uint32_t                len;
+	int                     write;
+};
+
+struct td_vhostblk_req {
+	td_vbd_request_t        vreq;
+	struct td_vhostblk_vq  *vq;
+	char                    name[32];
+
+	uint16_t                head;
+	uint32_t                type;
+	uint8_t                *status;
+	uint32_t                written;    /* bytes to the guest */
+
+	/*
+	 * Data buffers in guest memory, and what the VBD gets: the same
+	 * buffers, or a bounce buffer when they are not whole sectors.
+	 */
+	int                     n_iov;
+	struct iovec            iov[TAPDISK_VHOSTBLK_SEG_MAX];
+	struct td_iovec         tiov[TAPDISK_VHOSTBLK_SEG_MAX];
+	char                   *bounce;
+	size_t                  bytes;
+};
+
+struct td_vhostblk_vq {
+	td_vhostblk_t          *dev;
+	int                     index;
+
+	unsigned int            num;
+	uint64_t                desc_uva;
+	uint64_t                avail_uva;
+	uint64_t                used_uva;
+	struct vring_desc      *desc;
+	struct vring_avail     *avail;
+	struct vring_used      *used;
+	uint16_t                last_avail;
+	uint16_t                used_idx;
+
+	int                     kick_fd;
+	int                     call_fd;
+	event_id_t              kick_event;
+
+	/**
+	 * Taking requests: kicked and, with the protocol features,
+	 * enabled.
+	 */
+	bool                    started;
+	bool                    enabled;
+
+	/**
+	 * Left requests on the ring, for the deferred work to pick up,
+	 * and used entries the guest has not been told about.
+	 */
+	bool                    rescan;
+	bool                    signal;
+
+	int                     n_reqs;
+	int                     n_free;
+	struct td_vhostblk_req *reqs;
+	struct td_vhostblk_req **free;
+};
+
+struct td_vhostblk_region {
+	uint64_t                gpa;
+	uint64_t                uva;
+	uint64_t                size;
+	char                   *base;
+	void                   *map;
+	size_t                  map_size;
+};
+
+struct td_vhostblk {
+	td_vbd_t               *vbd;
+	td_disk_info_t          info;
+
+	char                    sockpath[TAPDISK_VHOSTBLK_MAX_PATH_LEN];
+	int                     listen_fd;
+	event_id_t              listen_event;
+
+	/**
+	 * The front-end connection.
+	 */
+	int                     fd;
+	event_id_t              fd_event;
+
+	uint64_t                features;
+	uint64_t                protocol_features;
+
+	int                     n_regions;
+	struct td_vhostblk_region regions[TAPDISK_VHOSTBLK_MAX_REGIONS];
+
+	int                     n_queues;
+	struct td_vhostblk_vq   vqs[TAPDISK_VHOSTBLK_MAX_QUEUES];
+
+	int                     n_inflight;
+	bool                    paused;
+
+	/**
+	 * Guest notifications and ring rescans, once per loop iteration.
+	 */
+	scheduler_work_t        work;
+
+	unsigned long long      reqs;
+	unsigned long long      kicks;
+	unsigned long long      calls;
+	unsigned long long      bounced;
+	unsigned long long      errors;
+};
+
+union td_vhostblk_payload {
+	uint64_t                      u64;
+	struct vhost_user_vring_state state;
+	struct vhost_user_vring_addr  addr;
+	struct vhost_user_memory      memory;
+	struct vhost_user_config      config;
+};
+
+static void tapdisk_vhostblk_vq_process(struct td_vhostblk_vq *);
+
+static uint64_t
+tapdisk_vhostblk_offered(td_vhostblk_t *dev)
+{
+	uint64_t features;
+
+	features = (1ULL << VIRTIO_F_VERSION_1) |
+		(1ULL << VHOST_USER_F_PROTOCOL_FEATURES) |
+		(1ULL << VIRTIO_RING_F_INDIRECT_DESC) |
+		(1ULL << VIRTIO_BLK_F_SEG_MAX) |
+		(1ULL << VIRTIO_BLK_F_BLK_SIZE) |
+		(1ULL << VIRTIO_BLK_F_FLUSH) |
+		(1ULL << VIRTIO_BLK_F_DISCARD) |
+		(1ULL << VIRTIO_BLK_F_WRITE_ZEROES);
+
+	if (dev->n_queues > 1)
+		features |= 1ULL << VIRTIO_BLK_F_MQ;
+
+	if (td_flag_test(dev->vbd->flags, TD_OPEN_RDONLY))
+		features |= 1ULL << VIRTIO_BLK_F_RO;
+
+	return features;
+}
+
+static bool
+tapdisk_vhostblk_readonly(td_vhostblk_t *dev)
+{
+	return td_flag_test(dev->vbd->flags, TD_OPEN_RDONLY);
+}
+
+/* -- guest memory -- */
+
+static void *
+tapdisk_vhostblk_gpa(td_vhostblk_t *dev, uint64_t gpa, uint64_t len)
+{
+	struct td_vhostblk_region *r;
+	int i;
+
+	for (i = 0; i < dev->n_regions; i++) {
+		r = &dev->regions[i];
+		if (gpa >= r->gpa && len <= r->size &&
+		    gpa - r->gpa <= r->size - len)
+			return r->base + (gpa - r->gpa);
+	}
+
+	return NULL;
+}
+
+static void *
+tapdisk_vhostblk_uva(td_vhostblk_t *dev, uint64_t uva, uint64_t len)
+{
+	struct td_vhostblk_region *r;
+	int i;
+
+	for (i = 0; i < dev->n_regions; i++) {
+		r = &dev->regions[i];
+		if (uva >= r->uva && len <= r->size &&
+		    uva - r->uva <= r->size - len)
+			return r->base + (uva - r->uva);
+	}
+
+	return NULL;
+}
+
+static void
+tapdisk_vhostblk_unmap(td_vhostblk_t *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->n_regions; i++)
+		munmap(dev->regions[i].map, dev->regions[i].map_size);
+
+	memset(dev->regions, 0, sizeof(dev->regions));
+	dev->n_regions = 0;
+}
+
+/*
+ * Completes the requests in flight. No new ones are taken meanwhile,
+ * and the front-end connection is masked, so that no message comes in
+ * on top of the one waiting.
+ */
+static void
+tapdisk_vhostblk_drain(td_vhostblk_t *dev)
+{
+	bool paused = dev->paused;
+	int i;
+
+	if (!dev->n_inflight)
+		return;
+
+	INFO("waiting for %d requests", dev->n_inflight);
+
+	dev->paused = true;
+	if (dev->fd_event >= 0)
+		tapdisk_server_mask_event(dev->fd_event, 1);
+
+	while (dev->n_inflight)
+		tapdisk_server_iterate();
+
+	if (dev->fd_event >= 0)
+		tapdisk_server_mask_event(dev->fd_event, 0);
+	dev->paused = paused;
+
+	if (paused)
+		return;
+
+	/* kicks were read meanwhile */
+	for (i = 0; i < dev->n_queues; i++)
+		if (dev->vqs[i].started)
+			dev->vqs[i].rescan = true;
+	tapdisk_server_defer(&dev->work);
+}
+
+/* -- requests -- */
+
+static struct td_vhostblk_req *
+tapdisk_vhostblk_alloc_req(struct td_vhostblk_vq *vq)
+{
+	struct td_vhostblk_req *req;
+
+	if (!vq->n_free)
+		return NULL;
+
+	req = vq->free[--vq->n_free];
+	vq->dev->n_inflight++;
+
+	return req;
+}
+
+static void
+tapdisk_vhostblk_free_req(struct td_vhostblk_vq *vq,
+			  struct td_vhostblk_req *req)
+{
+	vq->free[vq->n_free++] = req;
+	vq->dev->n_inflight--;
+}
+
+static void
+tapdisk_vhostblk_free_reqs(struct td_vhostblk_vq *vq)
+{
+	ASSERT(vq->n_free == vq->n_reqs);
+
+	free(vq->reqs);
+	free(vq->free);
+	vq->reqs   = NULL;
+	vq->free   = NULL;
+	vq->n_reqs = 0;
+	vq->n_free = 0;
+}
+
+static int
+tapdisk_vhostblk_alloc_reqs(struct td_vhostblk_vq *vq)
+{
+	int i;
+
+	if (vq->n_reqs == (int)vq->num)
+		return 0;
+
+	tapdisk_vhostblk_free_reqs(vq);
+
+	vq->reqs = calloc(vq->num, sizeof(*vq->reqs));
+	vq->free = calloc(vq->num, sizeof(*vq->free));
+	if (!vq->reqs || !vq->free) {
+		free(vq->reqs);
+		free(vq->free);
+		vq->reqs = NULL;
+		vq->free = NULL;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < (int)vq->num; i++) {
+		vq->reqs[i].vq = vq;
+		vq->free[i] = &vq->reqs[i];
+	}
+	vq->n_reqs = vq->n_free = vq->num;
+
+	return 0;
+}
+
+static void
+tapdisk_vhostblk_notify(struct td_vhostblk_vq *vq)
+{
+	uint64_t one = 1;
+	uint16_t flags;
+
+	if (vq->call_fd < 0 || !vq->started)
+		return;
+
+	/* the used index is out before the flags are looked at */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	flags = __atomic_load_n(&vq->avail->flags, __ATOMIC_RELAXED);
+	if (flags & VRING_AVAIL_F_NO_INTERRUPT)
+		return;
+
+	if (write(vq->call_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		ERR("queue %d: failed to signal the guest: %s", vq->index,
+		    strerror(errno));
+
+	vq->dev->calls++;
+}
+
+static void
+tapdisk_vhostblk_run(scheduler_work_t *work)
+{
+	td_vhostblk_t *dev = container_of(work, td_vhostblk_t, work);
+	struct td_vhostblk_vq *vq;
+	int i;
+
+	for (i = 0; i < dev->n_queues; i++) {
+		vq = &dev->vqs[i];
+
+		if (vq->rescan) {
+			vq->rescan = false;
+			tapdisk_vhostblk_vq_process(vq);
+		}
+
+		if (vq->signal) {
+			vq->signal = false;
+			tapdisk_vhostblk_notify(vq);
+		}
+	}
+}
+
+static void
+tapdisk_vhostblk_complete(struct td_vhostblk_req *req, uint8_t status)
+{
+	struct td_vhostblk_vq *vq = req->vq;
+	td_vhostblk_t *dev = vq->dev;
+	struct vring_used_elem *elem;
+	size_t off;
+	int i;
+
+	if (req->bounce) {
+		if (req->type == VIRTIO_BLK_T_IN && status == VIRTIO_BLK_S_OK)
+			for (i = 0, off = 0; i < req->n_iov; i++) {
+				memcpy(req->iov[i].iov_base, req->bounce + off,
+				       req->iov[i].iov_len);
+				off += req->iov[i].iov_len;
+			}
+		free(req->bounce);
+		req->bounce = NULL;
+	}
+
+	if (req->status)
+		*req->status = status;
+	if (status != VIRTIO_BLK_S_OK)
+		dev->errors++;
+
+	elem = &vq->used->ring[vq->used_idx % vq->num];
+	elem->id  = req->head;
+	elem->len = status == VIRTIO_BLK_S_OK ? req->written :
+		(req->status ? 1 : 0);
+	__atomic_store_n(&vq->used->idx, ++vq->used_idx, __ATOMIC_RELEASE);
+
+	tapdisk_vhostblk_free_req(vq, req);
+
+	vq->signal = true;
+	tapdisk_server_defer(&dev->work);
+}
+
+static void
+tapdisk_vhostblk_request_cb(td_vbd_request_t *vreq, int error,
+			    void *token, int final)
+{
+	struct td_vhostblk_req *req = token;
+
+	tapdisk_vhostblk_complete(req, error ? VIRTIO_BLK_S_IOERR :
+				  VIRTIO_BLK_S_OK);
+}
+
+/*
+ * Gathers the buffers of the chain starting at head, following an
+ * indirect table. Returns how many, or -errno for a broken chain.
+ */
+static int
+tapdisk_vhostblk_vq_map(struct td_vhostblk_vq *vq, uint16_t head,
+			struct td_vhostblk_seg *segs, int max)
+{
+	td_vhostblk_t *dev = vq->dev;
+	struct vring_desc *table = vq->desc, desc;
+	unsigned int size = vq->num, i = head, hops = 0;
+	int n = 0;
+
+	if (i >= size)
+		return -EINVAL;
+
+	desc = table[i];
+	if (desc.flags & VRING_DESC_F_INDIRECT) {
+		if (!desc.len || desc.len % sizeof(desc))
+			return -EINVAL;
+
+		table = tapdisk_vhostblk_gpa(dev, desc.addr, desc.len);
+		if (!table)
+			return -EFAULT;
+
+		size = desc.len / sizeof(desc);
+		i    = 0;
+	}
+
+	for (;;) {
+		if (i >= size || hops++ >= size)
+			return -EINVAL;
+
+		desc = table[i];
+		if (desc.flags & VRING_DESC_F_INDIRECT)
+			return -EINVAL;
+
+		if (n == max)
+			return -E2BIG;
+
+		segs[n].base  = tapdisk_vhostblk_gpa(dev, desc.addr, desc.len);
+		segs[n].len   = desc.len;
+		segs[n].write = !!(desc.flags & VRING_DESC_F_WRITE);
+		if (!segs[n].base && desc.len)
+			return -EFAULT;
+		n++;
+
+		if (!(desc.flags & VRING_DESC_F_NEXT))
+			break;
+		i = desc.next;
+	}
+
+	return n;
+}
+
+/* copies len bytes out of the data buffers */
+static int
+tapdisk_vhostblk_copy_from(struct td_vhostblk_req *req, void *buf,
+			   size_t len)
+{
+	size_t n, off = 0;
+	int i;
+
+	for (i = 0; i < req->n_iov && off < len; i++) {
+		n = MIN(req->iov[i].iov_len, len - off);
+		memcpy((char *)buf + off, req->iov[i].iov_base, n);
+		off += n;
+	}
+
+	return off == len ? 0 : -EINVAL;
+}
+
+static size_t
+tapdisk_vhostblk_copy_to(struct td_vhostblk_req *req, const void *buf,
+			 size_t len)
+{
+	size_t n, off = 0;
+	int i;
+
+	for (i = 0; i < req->n_iov && off < len; i++) {
+		n = MIN(req->iov[i].iov_len, len - off);
+		memcpy(req->iov[i].iov_base, (const char *)buf + off, n);
+		off += n;
+	}
+
+	return off;
+}
+
+/*
+ * Points the VBD request at the data buffers, or at a bounce buffer
+ * when some are not whole sectors, which the ring layout allows.
+ */
+static int
+tapdisk_vhostblk_prep_data(struct td_vhostblk_req *req)
+{
+	td_vhostblk_t *dev = req->vq->dev;
+	td_vbd_request_t *vreq = &req->vreq;
+	bool whole = true;
+	size_t off;
+	void *buf;
+	int i;
+
+	if (!req->bytes || req->bytes & (DEFAULT_SECTOR_SIZE - 1))
+		return -EINVAL;
+
+	for (i = 0; i < req->n_iov; i++)
+		if (req->iov[i].iov_len & (DEFAULT_SECTOR_SIZE - 1))
+			whole = false;
+
+	if (whole) {
+		for (i = 0; i < req->n_iov; i++) {
+			req->tiov[i].base = req->iov[i].iov_base;
+			req->tiov[i].secs = req->iov[i].iov_len >> SECTOR_SHIFT;
+		}
+		vreq->iov    = req->tiov;
+		vreq->iovcnt = req->n_iov;
+		return 0;
+	}
+
+	if (posix_memalign(&buf, 4096, req->bytes))
+		return -ENOMEM;
+	req->bounce = buf;
+	dev->bounced++;
+
+	if (req->type == VIRTIO_BLK_T_OUT)
+		for (i = 0, off = 0; i < req->n_iov; i++) {
+			memcpy(req->bounce + off, req->iov[i].iov_base,
+			       req->iov[i].iov_len);
+			off += req->iov[i].iov_len;
+		}
+
+	req->tiov[0].base = req->bounce;
+	req->tiov[0].secs = req->bytes >> SECTOR_SHIFT;
+	vreq->iov    = req->tiov;
+	vreq->iovcnt = 1;
+
+	return 0;
+}
+
+/*
+ * Takes the request at head off the ring and hands it to the VBD, or
+ * answers it right away. Returns the status to complete it with, or -1
+ * once it is on its way.
+ */
+static int
+tapdisk_vhostblk_vq_request(struct td_vhostblk_vq *vq,
+			    struct td_vhostblk_req *req)
+{
+	td_vhostblk_t *dev = vq->dev;
+	td_vbd_request_t *vreq = &req->vreq;
+	struct td_vhostblk_seg segs[TAPDISK_VHOSTBLK_MAX_DESCS];
+	struct virtio_blk_outhdr hdr;
+	struct virtio_blk_discard_write_zeroes range;
+	char id[VIRTIO_BLK_ID_BYTES];
+	struct td_vhostblk_seg *seg;
+	int i, n, write;
+
+	n = tapdisk_vhostblk_vq_map(vq, req->head, segs,
+				    TAPDISK_VHOSTBLK_MAX_DESCS);
+	if (n < 0) {
+		ERR("queue %d: bad descriptor chain at %u: %d", vq->index,
+		    req->head, n);
+		return VIRTIO_BLK_S_IOERR;
+	}
+
+	/* the header leads, readable, the status byte trails, writable */
+	seg = &segs[0];
+	if (seg->write || seg->len < sizeof(hdr)) {
+		ERR("queue %d: bad request header", vq->index);
+		return VIRTIO_BLK_S_IOERR;
+	}
+	memcpy(&hdr, seg->base, sizeof(hdr));
+	seg->base += sizeof(hdr);
+	seg->len  -= sizeof(hdr);
+
+	seg = &segs[n - 1];
+	if (!seg->write || !seg->len) {
+		ERR("queue %d: bad request status", vq->index);
+		return VIRTIO_BLK_S_IOERR;
+	}
+	req->status = (uint8_t *)seg->base + seg->len - 1;
+	seg->len--;
+
+	req->type    = hdr.type;
+	req->written = 1;
+	req->n_iov   = 0;
+	req->bytes   = 0;
+	write        = req->type != VIRTIO_BLK_T_IN &&
+		req->type != VIRTIO_BLK_T_GET_ID;
+
+	for (i = 0; i < n; i++) {
+		if (!segs[i].len)
+			continue;
+
+		if (segs[i].write == write) {
+			ERR("queue %d: data buffer the wrong way", vq->index);
+			return VIRTIO_BLK_S_IOERR;
+		}
+
+		if (req->n_iov == TAPDISK_VHOSTBLK_SEG_MAX)
+			return VIRTIO_BLK_S_IOERR;
+
+		req->iov[req->n_iov].iov_base = segs[i].base;
+		req->iov[req->n_iov].iov_len  = segs[i].len;
+		req->n_iov++;
+		req->bytes += segs[i].len;
+	}
+
+	snprintf(req->name, sizeof(req->name), "vhost-%d.%d.%u",
+		 dev->vbd->uuid, vq->index, req->head);
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->sec    = hdr.sector;
+	vreq->prio   = TD_PRIO_FOREGROUND;
+	vreq->token  = req;
+	vreq->cb     = tapdisk_vhostblk_request_cb;
+	vreq->name   = req->name;
+	vreq->vbd    = dev->vbd;
+
+	switch (req->type) {
+	case VIRTIO_BLK_T_IN:
+		vreq->op = TD_OP_READ;
+		if (tapdisk_vhostblk_prep_data(req))
+			return VIRTIO_BLK_S_IOERR;
+		req->written += req->bytes;
+		break;
+
+	case VIRTIO_BLK_T_OUT:
+		if (tapdisk_vhostblk_readonly(dev))
+			return VIRTIO_BLK_S_IOERR;
+		vreq->op = TD_OP_WRITE;
+		if (tapdisk_vhostblk_prep_data(req))
+			return VIRTIO_BLK_S_IOERR;
+		break;
+
+	case VIRTIO_BLK_T_FLUSH:
+		vreq->op  = TD_OP_FLUSH;
+		vreq->sec = 0;
+		req->tiov[0].base = NULL;
+		req->tiov[0].secs = 1;
+		vreq->iov    = req->tiov;
+		vreq->iovcnt = 1;
+		break;
+
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		if (tapdisk_vhostblk_readonly(dev))
+			return VIRTIO_BLK_S_IOERR;
+
+		/* max_discard_seg and max_write_zeroes_seg are 1 */
+		if (req->bytes != sizeof(range) ||
+		    tapdisk_vhostblk_copy_from(req, &range, sizeof(range)))
+			return VIRTIO_BLK_S_IOERR;
+
+		if (!range.num_sectors)
+			return VIRTIO_BLK_S_OK;
+		if (range.num_sectors > TAPDISK_VHOSTBLK_MAX_ZERO_SECS)
+			return VIRTIO_BLK_S_IOERR;
+
+		vreq->op  = req->type == VIRTIO_BLK_T_DISCARD ?
+			TD_OP_DISCARD : TD_OP_WRITE_ZEROES;
+		vreq->sec = range.sector;
+		req->tiov[0].base = NULL;
+		req->tiov[0].secs = range.num_sectors;
+		vreq->iov    = req->tiov;
+		vreq->iovcnt = 1;
+		break;
+
+	case VIRTIO_BLK_T_GET_ID:
+		memset(id, 0, sizeof(id));
+		snprintf(id, sizeof(id), "tapdisk-%d", dev->vbd->uuid);
+		req->written += tapdisk_vhostblk_copy_to(req, id, sizeof(id));
+		return VIRTIO_BLK_S_OK;
+
+	default:
+		return VIRTIO_BLK_S_UNSUPP;
+	}
+
+	if (tapdisk_vbd_queue_request(dev->vbd, vreq)) {
+		ERR("failed to queue %s", req->name);
+		return VIRTIO_BLK_S_IOERR;
+	}
+
+	dev->reqs++;
+	return -1;
+}
+
+static void
+tapdisk_vhostblk_vq_process(struct td_vhostblk_vq *vq)
+{
+	td_vhostblk_t *dev = vq->dev;
+	struct td_vhostblk_req *req;
+	uint16_t avail_idx;
+	int status;
+
+	if (!vq->started || !vq->enabled || dev->paused)
+		return;
+
+	avail_idx = __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+
+	while (vq->last_avail != avail_idx) {
+		req = tapdisk_vhostblk_alloc_req(vq);
+		if (!req) {
+			/* the next completion rescans */
+			vq->rescan = true;
+			break;
+		}
+
+		req->head   = vq->avail->ring[vq->last_avail % vq->num];
+		req->status = NULL;
+		req->bounce = NULL;
+		vq->last_avail++;
+
+		status = tapdisk_vhostblk_vq_request(vq, req);
+		if (status >= 0)
+			tapdisk_vhostblk_complete(req, status);
+	}
+}
+
+static void
+tapdisk_vhostblk_kick_cb(event_id_t id, char mode, void *data)
+{
+	struct td_vhostblk_vq *vq = data;
+	uint64_t n;
+
+	if (read(vq->kick_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+		ERR("queue %d: failed to read kick: %s", vq->index,
+		    strerror(errno));
+		return;
+	}
+
+	vq->dev->kicks++;
+	tapdisk_vhostblk_vq_process(vq);
+}
+
+/* -- virtqueues -- */
+
+static void
+tapdisk_vhostblk_vq_stop(struct td_vhostblk_vq *vq)
+{
+	td_vhostblk_t *dev = vq->dev;
+
+	if (vq->kick_event >= 0) {
+		tapdisk_server_unregister_event(vq->kick_event);
+		vq->kick_event = -1;
+	}
+
+	if (vq->kick_fd >= 0) {
+		close(vq->kick_fd);
+		vq->kick_fd = -1;
+	}
+
+	if (!vq->started)
+		return;
+
+	/* the base handed back has to cover whatever was taken */
+	tapdisk_vhostblk_drain(dev);
+
+	if (vq->signal) {
+		vq->signal = false;
+		tapdisk_vhostblk_notify(vq);
+	}
+
+	vq->started = false;
+	vq->rescan  = false;
+}
+
+static int
+tapdisk_vhostblk_vq_map_rings(struct td_vhostblk_vq *vq)
+{
+	td_vhostblk_t *dev = vq->dev;
+	size_t avail_size, used_size;
+
+	avail_size = sizeof(struct vring_avail) + vq->num * sizeof(uint16_t);
+	used_size  = sizeof(struct vring_used) +
+		vq->num * sizeof(struct vring_used_elem);
+
+	vq->desc  = tapdisk_vhostblk_uva(dev, vq->desc_uva,
+					 vq->num * sizeof(struct vring_desc));
+	vq->avail = tapdisk_vhostblk_uva(dev, vq->avail_uva, avail_size);
+	vq->used  = tapdisk_vhostblk_uva(dev, vq->used_uva, used_size);
+	if (!vq->desc || !vq->avail || !vq->used) {
+		ERR("queue %d: rings outside guest memory", vq->index);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_vhostblk_vq_start(struct td_vhostblk_vq *vq)
+{
+	td_vhostblk_t *dev = vq->dev;
+	int err;
+
+	if (!vq->num) {
+		ERR("queue %d: kicked before its size is set", vq->index);
+		return -EINVAL;
+	}
+
+	err = tapdisk_vhostblk_vq_map_rings(vq);
+	if (err)
+		return err;
+
+	err = tapdisk_vhostblk_alloc_reqs(vq);
+	if (err)
+		return err;
+
+	vq->used_idx = __atomic_load_n(&vq->used->idx, __ATOMIC_ACQUIRE);
+
+	vq->kick_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      vq->kick_fd, TV_ZERO,
+					      tapdisk_vhostblk_kick_cb, vq);
+	if (vq->kick_event < 0) {
+		err = vq->kick_event;
+		vq->kick_event = -1;
+		return err;
+	}
+
+	if (dev->paused)
+		tapdisk_server_mask_event(vq->kick_event, 1);
+
+	vq->started = true;
+	INFO("queue %d started, %u entries from %u", vq->index, vq->num,
+	     vq->last_avail);
+
+	/* enough for a full ring on each queue, see td_set_depth */
+	tapdisk_vbd_set_depth(dev->vbd, dev->n_queues * vq->num *
+			      MAX_SEGMENTS_PER_REQ);
+
+	tapdisk_vhostblk_vq_process(vq);
+
+	return 0;
+}
+
+static void
+tapdisk_vhostblk_vq_reset(struct td_vhostblk_vq *vq)
+{
+	tapdisk_vhostblk_vq_stop(vq);
+	tapdisk_vhostblk_free_reqs(vq);
+
+	if (vq->call_fd >= 0) {
+		close(vq->call_fd);
+		vq->call_fd = -1;
+	}
+
+	vq->num        = 0;
+	vq->desc_uva   = vq->avail_uva = vq->used_uva = 0;
+	vq->desc       = NULL;
+	vq->avail      = NULL;
+	vq->used       = NULL;
+	vq->last_avail = 0;
+	vq->used_idx   = 0;
+	vq->enabled    = false;
+	vq->signal     = false;
+}
+
+static struct td_vhostblk_vq *
+tapdisk_vhostblk_get_vq(td_vhostblk_t *dev, uint32_t index)
+{
+	index &= VHOST_USER_VRING_IDX_MASK;
+
+	if (index >= (uint32_t)dev->n_queues) {
+		ERR("no queue %u", index);
+		return NULL;
+	}
+
+	return &dev->vqs[index];
+}
+
+/* -- front-end messages -- */
+
+static int
+tapdisk_vhostblk_recv(td_vhostblk_t *dev, struct vhost_user_msg_header *hdr,
+		      union td_vhostblk_payload *payload, int *fds, int *n_fds)
+{
+	char control[CMSG_SPACE(TAPDISK_VHOSTBLK_MAX_FDS * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t n;
+
+	*n_fds = 0;
+
+	iov.iov_base = hdr;
+	iov.iov_len  = sizeof(*hdr);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control;
+	msg.msg_controllen = sizeof(control);
+
+	do {
+		n = recvmsg(dev->fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	} while (n < 0 && errno == EINTR);
+
+	if (n == 0)
+		return -ECONNRESET;
+	if (n < 0)
+		return -errno;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS) {
+			*n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), *n_fds * sizeof(int));
+			break;
+		}
+
+	if (n != sizeof(*hdr) || msg.msg_flags & MSG_CTRUNC)
+		return -EPROTO;
+
+	if (hdr->size > sizeof(*payload))
+		return -EMSGSIZE;
+
+	if (!hdr->size)
+		return 0;
+
+	do {
+		n = recv(dev->fd, payload, hdr->size, MSG_WAITALL);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		return -errno;
+	if (n != hdr->size)
+		return -ECONNRESET;
+
+	return 0;
+}
+
+static int
+tapdisk_vhostblk_reply(td_vhostblk_t *dev, struct vhost_user_msg_header *hdr,
+		       const void *payload, uint32_t size)
+{
+	struct vhost_user_msg_header rhdr;
+	struct iovec iov[2];
+	ssize_t n;
+
+	rhdr.request = hdr->request;
+	rhdr.flags   = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+	rhdr.size    = size;
+
+	iov[0].iov_base = &rhdr;
+	iov[0].iov_len  = sizeof(rhdr);
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len  = size;
+
+	do {
+		n = writev(dev->fd, iov, size ? 2 : 1);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		return -errno;
+	if (n != (ssize_t)(sizeof(rhdr) + size))
+		return -EIO;
+
+	return 0;
+}
+
+static int
+tapdisk_vhostblk_reply_u64(td_vhostblk_t *dev,
+			   struct vhost_user_msg_header *hdr, uint64_t val)
+{
+	return tapdisk_vhostblk_reply(dev, hdr, &val, sizeof(val));
+}
+
+static int
+tapdisk_vhostblk_set_mem_table(td_vhostblk_t *dev,
+			       struct vhost_user_memory *mem,
+			       int *fds, int n_fds)
+{
+	struct td_vhostblk_region *r;
+	struct vhost_user_region *ur;
+	int i, err;
+
+	if (!mem->nregions || mem->nregions > TAPDISK_VHOSTBLK_MAX_REGIONS ||
+	    mem->nregions != (uint32_t)n_fds) {
+		ERR("bad memory table: %u regions, %d fds", mem->nregions,
+		    n_fds);
+		return -EINVAL;
+	}
+
+	/* requests in flight point into the old mappings */
+	tapdisk_vhostblk_drain(dev);
+	tapdisk_vhostblk_unmap(dev);
+
+	for (i = 0; i < (int)mem->nregions; i++) {
+		ur = &mem->regions[i];
+		r  = &dev->regions[i];
+
+		r->map_size = ur->memory_size + ur->mmap_offset;
+		r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, fds[i], 0);
+		if (r->map == MAP_FAILED) {
+			err = -errno;
+			ERR("failed to map region %d: %s", i, strerror(-err));
+			r->map = NULL;
+			tapdisk_vhostblk_unmap(dev);
+			return err;
+		}
+
+		r->gpa  = ur->guest_phys_addr;
+		r->uva  = ur->userspace_addr;
+		r->size = ur->memory_size;
+		r->base = (char *)r->map + ur->mmap_offset;
+		dev->n_regions++;
+
+		INFO("region %d: gpa 0x%"PRIx64" size 0x%"PRIx64, i, r->gpa,
+		     r->size);
+	}
+
+	/* started rings move along with the memory */
+	for (i = 0; i < dev->n_queues; i++) {
+		struct td_vhostblk_vq *vq = &dev->vqs[i];
+
+		if (vq->started && tapdisk_vhostblk_vq_map_rings(vq))
+			tapdisk_vhostblk_vq_stop(vq);
+	}
+
+	return 0;
+}
+
+static void
+tapdisk_vhostblk_get_config(td_vhostblk_t *dev, struct virtio_blk_config *cfg)
+{
+	uint32_t align = dev->info.sector_size >> SECTOR_SHIFT;
+
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->capacity                 = dev->info.size;
+	cfg->seg_max                  = TAPDISK_VHOSTBLK_SEG_MAX;
+	cfg->blk_size                 = dev->info.sector_size;
+	cfg->num_queues               = dev->n_queues;
+	cfg->wce                      = 1;
+	cfg->max_discard_sectors      = TAPDISK_VHOSTBLK_MAX_ZERO_SECS;
+	cfg->max_discard_seg          = 1;
+	cfg->discard_sector_alignment = align ? align : 1;
+	cfg->max_write_zeroes_sectors = TAPDISK_VHOSTBLK_MAX_ZERO_SECS;
+	cfg->max_write_zeroes_seg     = 1;
+}
+
+/*
+ * Handles one message. Returns 1 if it was answered already, 0 or
+ * -errno otherwise, for the reply-ack.
+ */
+static int
+tapdisk_vhostblk_handle(td_vhostblk_t *dev, struct vhost_user_msg_header *hdr,
+			union td_vhostblk_payload *p, int *fds, int n_fds)
+{
+	struct td_vhostblk_vq *vq;
+	struct virtio_blk_config cfg;
+	struct vhost_user_config *c;
+	int i, err;
+
+	switch (hdr->request) {
+	case VHOST_USER_GET_FEATURES:
+		err = tapdisk_vhostblk_reply_u64(dev, hdr,
+						 tapdisk_vhostblk_offered(dev));
+		return err ? : 1;
+
+	case VHOST_USER_SET_FEATURES:
+		dev->features = p->u64 & tapdisk_vhostblk_offered(dev);
+		return 0;
+
+	case VHOST_USER_GET_PROTOCOL_FEATURES:
+		err = tapdisk_vhostblk_reply_u64(dev, hdr,
+				(1ULL << VHOST_USER_PROTOCOL_F_MQ) |
+				(1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) |
+				(1ULL << VHOST_USER_PROTOCOL_F_CONFIG));
+		return err ? : 1;
+
+	case VHOST_USER_SET_PROTOCOL_FEATURES:
+		dev->protocol_features = p->u64;
+		return 0;
+
+	case VHOST_USER_GET_QUEUE_NUM:
+		err = tapdisk_vhostblk_reply_u64(dev, hdr, dev->n_queues);
+		return err ? : 1;
+
+	case VHOST_USER_SET_OWNER:
+		return 0;
+
+	case VHOST_USER_RESET_OWNER:
+		for (i = 0; i < dev->n_queues; i++)
+			tapdisk_vhostblk_vq_reset(&dev->vqs[i]);
+		dev->features = 0;
+		return 0;
+
+	case VHOST_USER_SET_MEM_TABLE:
+		return tapdisk_vhostblk_set_mem_table(dev, &p->memory,
+						      fds, n_fds);
+
+	case VHOST_USER_SET_VRING_NUM:
+		vq = tapdisk_vhostblk_get_vq(dev, p->state.index);
+		if (!vq)
+			return -EINVAL;
+		if (vq->started || !p->state.num ||
+		    p->state.num > TAPDISK_VHOSTBLK_MAX_RING ||
+		    p->state.num & (p->state.num - 1))
+			return -EINVAL;
+		vq->num = p->state.num;
+		return 0;
+
+	case VHOST_USER_SET_VRING_ADDR:
+		vq = tapdisk_vhostblk_get_vq(dev, p->addr.index);
+		if (!vq || vq->started)
+			return -EINVAL;
+		vq->desc_uva  = p->addr.desc_user_addr;
+		vq->avail_uva = p->addr.avail_user_addr;
+		vq->used_uva  = p->addr.used_user_addr;
+		return 0;
+
+	case VHOST_USER_SET_VRING_BASE:
+		vq = tapdisk_vhostblk_get_vq(dev, p->state.index);
+		if (!vq || vq->started)
+			return -EINVAL;
+		vq->last_avail = p->state.num;
+		return 0;
+
+	case VHOST_USER_GET_VRING_BASE:
+		vq = tapdisk_vhostblk_get_vq(dev, p->state.index);
+		if (!vq)
+			return -EINVAL;
+		tapdisk_vhostblk_vq_stop(vq);
+		p->state.num = vq->last_avail;
+		err = tapdisk_vhostblk_reply(dev, hdr, &p->state,
+					     sizeof(p->state));
+		return err ? : 1;
+
+	case VHOST_USER_SET_VRING_KICK:
+		vq = tapdisk_vhostblk_get_vq(dev, p->u64);
+		if (!vq)
+			return -EINVAL;
+		if (p->u64 & VHOST_USER_VRING_NOFD_MASK || n_fds != 1) {
+			ERR("queue %d: polled rings are not supported",
+			    vq->index);
+			return -EOPNOTSUPP;
+		}
+		tapdisk_vhostblk_vq_stop(vq);
+		vq->kick_fd = fds[0];
+		fds[0] = -1;
+		if (!(dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+			vq->enabled = true;
+		return tapdisk_vhostblk_vq_start(vq);
+
+	case VHOST_USER_SET_VRING_CALL:
+		vq = tapdisk_vhostblk_get_vq(dev, p->u64);
+		if (!vq)
+			return -EINVAL;
+		if (vq->call_fd >= 0)
+			close(vq->call_fd);
+		vq->call_fd = -1;
+		if (!(p->u64 & VHOST_USER_VRING_NOFD_MASK) && n_fds == 1) {
+			vq->call_fd = fds[0];
+			fds[0] = -1;
+		}
+		return 0;
+
+	case VHOST_USER_SET_VRING_ERR:
+		/* errors go to the status bytes, nothing to tell here */
+		return 0;
+
+	case VHOST_USER_SET_VRING_ENABLE:
+		vq = tapdisk_vhostblk_get_vq(dev, p->state.index);
+		if (!vq)
+			return -EINVAL;
+		vq->enabled = !!p->state.num;
+		tapdisk_vhostblk_vq_process(vq);
+		return 0;
+
+	case VHOST_USER_GET_CONFIG:
+		c = &p->config;
+		if (c->size > sizeof(c->region) || c->offset > sizeof(cfg) ||
+		    c->size > sizeof(cfg) - c->offset)
+			return -EINVAL;
+		tapdisk_vhostblk_get_config(dev, &cfg);
+		memcpy(c->region, (char *)&cfg + c->offset, c->size);
+		err = tapdisk_vhostblk_reply(dev, hdr, c,
+				offsetof(struct vhost_user_config, region) +
+				c->size);
+		return err ? : 1;
+
+	case VHOST_USER_SET_CONFIG:
+		/* only the write cache flag is writable, and it stays on */
+		return 0;
+
+	case VHOST_USER_SET_LOG_BASE:
+	case VHOST_USER_SET_LOG_FD:
+	default:
+		ERR("unsupported request %u", hdr->request);
+		return -EOPNOTSUPP;
+	}
+}
+
+static void tapdisk_vhostblk_disconnect(td_vhostblk_t *);
+
+static void
+tapdisk_vhostblk_msg_cb(event_id_t id, char mode, void *data)
+{
+	td_vhostblk_t *dev = data;
+	struct vhost_user_msg_header hdr;
+	union td_vhostblk_payload payload;
+	int fds[TAPDISK_VHOSTBLK_MAX_FDS];
+	int i, n_fds, err;
+
+	err = tapdisk_vhostblk_recv(dev, &hdr, &payload, fds, &n_fds);
+	if (err) {
+		if (err != -ECONNRESET)
+			ERR("failed to receive message: %s", strerror(-err));
+		goto close;
+	}
+
+	if ((hdr.flags & VHOST_USER_VERSION_MASK) != VHOST_USER_VERSION) {
+		ERR("bad protocol version %u",
+		    hdr.flags & VHOST_USER_VERSION_MASK);
+		err = -EPROTO;
+		goto close;
+	}
+
+	err = tapdisk_vhostblk_handle(dev, &hdr, &payload, fds, n_fds);
+	if (err < 0)
+		ERR("request %u failed: %s", hdr.request, strerror(-err));
+
+	if (err <= 0 && hdr.flags & VHOST_USER_NEED_REPLY_MASK &&
+	    dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK))
+		err = tapdisk_vhostblk_reply_u64(dev, &hdr, err ? 1 : 0);
+
+	for (i = 0; i < n_fds; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+
+	return;
+
+close:
+	for (i = 0; i < n_fds; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	tapdisk_vhostblk_disconnect(dev);
+}
+
+/* -- connection -- */
+
+static void
+tapdisk_vhostblk_disconnect(td_vhostblk_t *dev)
+{
+	int i;
+
+	if (dev->fd < 0)
+		return;
+
+	INFO("front-end disconnected");
+
+	for (i = 0; i < dev->n_queues; i++)
+		tapdisk_vhostblk_vq_reset(&dev->vqs[i]);
+
+	if (dev->fd_event >= 0) {
+		tapdisk_server_unregister_event(dev->fd_event);
+		dev->fd_event = -1;
+	}
+
+	tapdisk_server_cancel_work(&dev->work);
+	tapdisk_vhostblk_unmap(dev);
+
+	close(dev->fd);
+	dev->fd = -1;
+	dev->features = 0;
+	dev->protocol_features = 0;
+
+	if (dev->listen_event >= 0)
+		tapdisk_server_mask_event(dev->listen_event, 0);
+}
+
+static void
+tapdisk_vhostblk_accept_cb(event_id_t id, char mode, void *data)
+{
+	td_vhostblk_t *dev = data;
+	int fd;
+
+	fd = accept4(dev->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		ERR("failed to accept connection: %s", strerror(errno));
+		return;
+	}
+
+	if (dev->fd >= 0) {
+		ERR("front-end already connected, closing the new one");
+		close(fd);
+		return;
+	}
+
+	dev->fd_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD, fd,
+					      TV_ZERO, tapdisk_vhostblk_msg_cb,
+					      dev);
+	if (dev->fd_event < 0) {
+		ERR("failed to register front-end: %s",
+		    strerror(-dev->fd_event));
+		dev->fd_event = -1;
+		close(fd);
+		return;
+	}
+
+	dev->fd = fd;
+	tapdisk_server_mask_event(dev->listen_event, 1);
+
+	INFO("front-end connected");
+}
+
+td_vhostblk_t *
+tapdisk_vhostblk_alloc(td_vbd_t *vbd, td_disk_info_t info)
+{
+	td_vhostblk_t *dev;
+	const char *val;
+	int i;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		ERR("failed to allocate vhost-user-blk back-end");
+		return NULL;
+	}
+
+	dev->vbd          = vbd;
+	dev->info         = info;
+	dev->listen_fd    = -1;
+	dev->listen_event = -1;
+	dev->fd           = -1;
+	dev->fd_event     = -1;
+	scheduler_work_init(&dev->work, tapdisk_vhostblk_run);
+
+	val = getenv("TAPDISK3_VHOST_BLK_QUEUES");
+	dev->n_queues = val ? atoi(val) : 1;
+	if (dev->n_queues < 1)
+		dev->n_queues = 1;
+	if (dev->n_queues > TAPDISK_VHOSTBLK_MAX_QUEUES)
+		dev->n_queues = TAPDISK_VHOSTBLK_MAX_QUEUES;
+
+	for (i = 0; i < TAPDISK_VHOSTBLK_MAX_QUEUES; i++) {
+		struct td_vhostblk_vq *vq = &dev->vqs[i];
+
+		vq->dev        = dev;
+		vq->index      = i;
+		vq->kick_fd    = -1;
+		vq->call_fd    = -1;
+		vq->kick_event = -1;
+	}
+
+	if (snprintf(dev->sockpath, sizeof(dev->sockpath), "%s%d.%d",
+		     TAPDISK_VHOSTBLK_SOCK_PATH, getpid(), vbd->uuid) >=
+	    (int)sizeof(dev->sockpath)) {
+		ERR("socket path too long");
+		free(dev);
+		return NULL;
+	}
+
+	return dev;
+}
+
+int
+tapdisk_vhostblk_listen(td_vhostblk_t *dev)
+{
+	struct sockaddr_un local;
+	int err;
+
+	ASSERT(dev->listen_fd == -1);
+
+	if (strlen(dev->sockpath) > sizeof(local.sun_path) - 1) {
+		ERR("socket name too long: %s", dev->sockpath);
+		return -ENAMETOOLONG;
+	}
+
+	dev->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (dev->listen_fd == -1) {
+		err = -errno;
+		ERR("failed to create UNIX domain socket: %s", strerror(-err));
+		return err;
+	}
+
+	memset(&local, 0, sizeof(local));
+	local.sun_family = AF_UNIX;
+	strcpy(local.sun_path, dev->sockpath);
+
+	if (unlink(local.sun_path) == -1 && errno != ENOENT) {
+		err = -errno;
+		ERR("failed to remove %s: %s", local.sun_path, strerror(-err));
+		goto out;
+	}
+
+	if (bind(dev->listen_fd, (struct sockaddr *)&local,
+		 sizeof(local)) == -1) {
+		err = -errno;
+		ERR("failed to bind: %s", strerror(-err));
+		goto out;
+	}
+
+	if (listen(dev->listen_fd, 1) == -1) {
+		err = -errno;
+		ERR("failed to listen: %s", strerror(-err));
+		goto out;
+	}
+
+	dev->listen_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      dev->listen_fd, TV_ZERO,
+					      tapdisk_vhostblk_accept_cb, dev);
+	if (dev->listen_event < 0) {
+		err = dev->listen_event;
+		dev->listen_event = -1;
+		goto out;
+	}
+
+	INFO("listening on %s, %d queues", dev->sockpath, dev->n_queues);
+	err = 0;
+
+out:
+	if (err) {
+		close(dev->listen_fd);
+		dev->listen_fd = -1;
+	}
+	return err;
+}
+
+void
+tapdisk_vhostblk_pause(td_vhostblk_t *dev)
+{
+	int i;
+
+	dev->paused = true;
+
+	for (i = 0; i < dev->n_queues; i++)
+		if (dev->vqs[i].kick_event >= 0)
+			tapdisk_server_mask_event(dev->vqs[i].kick_event, 1);
+}
+
+void
+tapdisk_vhostblk_unpause(td_vhostblk_t *dev)
+{
+	struct td_vhostblk_vq *vq;
+	int i;
+
+	dev->paused = false;
+
+	/* kicks came in while masked, look at the rings */
+	for (i = 0; i < dev->n_queues; i++) {
+		vq = &dev->vqs[i];
+		if (vq->kick_event >= 0)
+			tapdisk_server_mask_event(vq->kick_event, 0);
+		if (vq->started)
+			vq->rescan = true;
+	}
+
+	tapdisk_server_defer(&dev->work);
+}
+
+void
+tapdisk_vhostblk_free(td_vhostblk_t *dev)
+{
+	tapdisk_vhostblk_disconnect(dev);
+	tapdisk_server_cancel_work(&dev->work);
+
+	if (dev->listen_event >= 0)
+		tapdisk_server_unregister_event(dev->listen_event);
+
+	if (dev->listen_fd >= 0) {
+		close(dev->listen_fd);
+		if (unlink(dev->sockpath))
+			ERR("failed to remove %s: %s", dev->sockpath,
+			    strerror(errno));
+	}
+
+	free(dev);
+}
+
+void
+tapdisk_vhostblk_stats(td_vhostblk_t *dev, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "vhost_blk", "{");
+	tapdisk_stats_field(st, "connected", "d", dev->fd >= 0);
+	tapdisk_stats_field(st, "queues", "d", dev->n_queues);
+	tapdisk_stats_field(st, "inflight", "d", dev->n_inflight);
+	tapdisk_stats_field(st, "reqs", "llu", dev->reqs);
+	tapdisk_stats_field(st, "kicks", "llu", dev->kicks);
+	tapdisk_stats_field(st, "calls", "llu", dev->calls);
+	tapdisk_stats_field(st, "bounced", "llu", dev->bounced);
+	tapdisk_stats_field(st, "errors", "llu", dev->errors);
+	tapdisk_stats_leave(st, '}');
+}
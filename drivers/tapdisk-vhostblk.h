@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_VHOSTBLK_H_
+#define _TAPDISK_VHOSTBLK_H_
+
+/*
+ * vhost-user-blk back-end. A VMM (QEMU, cloud-hypervisor, an SPDK
+ * initiator) connects to a UNIX domain socket per VBD and shares the
+ * guest memory and virtqueues with us; requests are handed to the VBD
+ * with their iovecs pointing straight into guest memory.
+ *
+ * Enabled with TAPDISK3_VHOST_BLK=1, the socket is
+ * TAPDISK_VHOSTBLK_SOCK_PATH<pid>.<uuid>. TAPDISK3_VHOST_BLK_QUEUES sets
+ * the number of virtqueues offered (1 by default, at most
+ * TAPDISK_VHOSTBLK_MAX_QUEUES). One front-end at a time.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blktap2.h"
+#include "tapdisk.h"
+#include "tapdisk-stats.h"
+
+#define TAPDISK_VHOSTBLK_SOCK_PATH   BLKTAP2_CONTROL_DIR"/vhost-blk"
+
+#define TAPDISK_VHOSTBLK_MAX_QUEUES  8
+#define TAPDISK_VHOSTBLK_MAX_REGIONS 8
+#define TAPDISK_VHOSTBLK_MAX_RING    1024
+#define TAPDISK_VHOSTBLK_SEG_MAX     126
+
+/* front-end requests */
+enum {
+	VHOST_USER_GET_FEATURES = 1,
+	VHOST_USER_SET_FEATURES = 2,
+	VHOST_USER_SET_OWNER = 3,
+	VHOST_USER_RESET_OWNER = 4,
+	VHOST_USER_SET_MEM_TABLE = 5,
+	VHOST_USER_SET_LOG_BASE = 6,
+	VHOST_USER_SET_LOG_FD = 7,
+	VHOST_USER_SET_VRING_NUM = 8,
+	VHOST_USER_SET_VRING_ADDR = 9,
+	VHOST_USER_SET_VRING_BASE = 10,
+	VHOST_USER_GET_VRING_BASE = 11,
+	VHOST_USER_SET_VRING_KICK = 12,
+	VHOST_USER_SET_VRING_CALL = 13,
+	VHOST_USER_SET_VRING_ERR = 14,
+	VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+	VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+	VHOST_USER_GET_QUEUE_NUM = 17,
+	VHOST_USER_SET_VRING_ENABLE = 18,
+	VHOST_USER_GET_CONFIG = 24,
+	VHOST_USER_SET_CONFIG = 25
+};
+
+#define VHOST_USER_VERSION               0x1
+#define VHOST_USER_VERSION_MASK          0x3
+#define VHOST_USER_REPLY_MASK            (1 << 2)
+#define VHOST_USER_NEED_REPLY_MASK       (1 << 3)
+
+#define VHOST_USER_VRING_IDX_MASK        0xff
+#define VHOST_USER_VRING_NOFD_MASK       (1 << 8)
+
+/* protocol features */
+#define VHOST_USER_PROTOCOL_F_MQ         0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK  3
+#define VHOST_USER_PROTOCOL_F_CONFIG     9
+
+/* device features */
+#define VIRTIO_BLK_F_SIZE_MAX            1
+#define VIRTIO_BLK_F_SEG_MAX             2
+#define VIRTIO_BLK_F_RO                  5
+#define VIRTIO_BLK_F_BLK_SIZE            6
+#define VIRTIO_BLK_F_FLUSH               9
+#define VIRTIO_BLK_F_MQ                  12
+#define VIRTIO_BLK_F_DISCARD             13
+#define VIRTIO_BLK_F_WRITE_ZEROES        14
+#define VIRTIO_RING_F_INDIRECT_DESC      28
+#define VHOST_USER_F_PROTOCOL_FEATURES   30
+#define VIRTIO_F_VERSION_1               32
+
+enum {
+	VIRTIO_BLK_T_IN = 0,
+	VIRTIO_BLK_T_OUT = 1,
+	VIRTIO_BLK_T_FLUSH = 4,
+	VIRTIO_BLK_T_GET_ID = 8,
+	VIRTIO_BLK_T_DISCARD = 11,
+	VIRTIO_BLK_T_WRITE_ZEROES = 13
+};
+
+#define VIRTIO_BLK_S_OK                  0
+#define VIRTIO_BLK_S_IOERR               1
+#define VIRTIO_BLK_S_UNSUPP              2
+
+#define VIRTIO_BLK_ID_BYTES              20
+
+#define VRING_DESC_F_NEXT                1
+#define VRING_DESC_F_WRITE               2
+#define VRING_DESC_F_INDIRECT            4
+
+#define VRING_AVAIL_F_NO_INTERRUPT       1
+
+struct vhost_user_msg_header {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;
+} __attribute__ ((packed));
+
+struct vhost_user_region {
+	uint64_t guest_phys_addr;
+	uint64_t memory_size;
+	uint64_t userspace_addr;
+	uint64_t mmap_offset;
+} __attribute__ ((packed));
+
+struct vhost_user_memory {
+	uint32_t nregions;
+	uint32_t padding;
+	struct vhost_user_region regions[TAPDISK_VHOSTBLK_MAX_REGIONS];
+} __attribute__ ((packed));
+
+struct vhost_user_vring_state {
+	uint32_t index;
+	uint32_t num;
+} __attribute__ ((packed));
+
+struct vhost_user_vring_addr {
+	uint32_t index;
+	uint32_t flags;
+	uint64_t desc_user_addr;
+	uint64_t used_user_addr;
+	uint64_t avail_user_addr;
+	uint64_t log_guest_addr;
+} __attribute__ ((packed));
+
+struct vhost_user_config {
+	uint32_t offset;
+	uint32_t size;
+	uint32_t flags;
+	uint8_t  region[256];
+} __attribute__ ((packed));
+
+struct virtio_blk_config {
+	uint64_t capacity;
+	uint32_t size_max;
+	uint32_t seg_max;
+	uint16_t cylinders;
+	uint8_t  heads;
+	uint8_t  sectors;
+	uint32_t blk_size;
+	uint8_t  physical_block_exp;
+	uint8_t  alignment_offset;
+	uint16_t min_io_size;
+	uint32_t opt_io_size;
+	uint8_t  wce;
+	uint8_t  unused;
+	uint16_t num_queues;
+	uint32_t max_discard_sectors;
+	uint32_t max_discard_seg;
+	uint32_t discard_sector_alignment;
+	uint32_t max_write_zeroes_sectors;
+	uint32_t max_write_zeroes_seg;
+	uint8_t  write_zeroes_may_unmap;
+	uint8_t  unused1[3];
+} __attribute__ ((packed));
+
+struct virtio_blk_outhdr {
+	uint32_t type;
+	uint32_t ioprio;
+	uint64_t sector;
+} __attribute__ ((packed));
+
+struct virtio_blk_discard_write_zeroes {
+	uint64_t sector;
+	uint32_t num_sectors;
+	uint32_t flags;
+} __attribute__ ((packed));
+
+struct vring_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+struct vring_avail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+};
+
+struct vring_used_elem {
+	uint32_t id;
+	uint32_t len;
+};
+
+struct vring_used {
+	uint16_t flags;
+	uint16_t idx;
+	struct vring_used_elem ring[];
+};
+
+typedef struct td_vhostblk td_vhostblk_t;
+
+td_vhostblk_t *tapdisk_vhostblk_alloc(td_vbd_t *, td_disk_info_t);
+
+/**
+ * Listen for a front-end on the VBD's UNIX domain socket.
+ */
+int tapdisk_vhostblk_listen(td_vhostblk_t *);
+
+/**
+ * Disconnects the front-end, waiting for its requests, and frees the
+ * back-end.
+ */
+void tapdisk_vhostblk_free(td_vhostblk_t *);
+
+/**
+ * Stops taking requests off the virtqueues, those in flight complete.
+ */
+void tapdisk_vhostblk_pause(td_vhostblk_t *);
+void tapdisk_vhostblk_unpause(td_vhostblk_t *);
+
+void tapdisk_vhostblk_stats(td_vhostblk_t *, td_stats_t *);
+
+#endif /* _TAPDISK_VHOSTBLK_H_ */
@@ -77,6 +77,7 @@ extern unsigned int PAGE_SHIFT;
 #define MAX_REQUESTS                 32U
 #define SECTOR_SHIFT                 9
 #define DEFAULT_SECTOR_SIZE          512
+#define TD_4K_SECTOR_SIZE            4096
 
 #define TAPDISK_DATA_REQUESTS       (MAX_REQUESTS * MAX_SEGMENTS_PER_REQ)
 
@@ -87,6 +88,24 @@ extern unsigned int PAGE_SHIFT;
 
 #define TD_OP_READ                   0
 #define TD_OP_WRITE                  1
+#define TD_OP_DISCARD                2
+#define TD_OP_WRITE_ZEROES           3
+#define TD_OP_FLUSH                  4
+
+/*
+ * I/O priority of a request, carried down to its tiocbs. Background
+ * requests (copies, cache fills, prefetch) yield to foreground ones
+ * in the aio queue, see TAPDISK3_IO_BG_SHARE.
+ */
+#define TD_PRIO_FOREGROUND           0
+#define TD_PRIO_BACKGROUND           1
+
+/*
+ * discards and write-zeroes carry no buffer. Neither do flushes, which
+ * are issued as a single sector at 0 so they are accounted like any
+ * other request.
+ */
+#define td_op_has_data(op)           ((op) == TD_OP_READ || (op) == TD_OP_WRITE)
 
 #define TD_OPEN_QUIET                0x00001
 #define TD_OPEN_QUERY                0x00002
@@ -102,6 +121,10 @@ extern unsigned int PAGE_SHIFT;
 #define TD_OPEN_STANDBY              0x00800
 #define TD_IGNORE_ENOSPC             0x01000
 #define TD_OPEN_NO_O_DIRECT          0x02000
+#define TD_OPEN_MIRROR_COPY          0x04000
+#define TD_OPEN_WB_CACHE             0x08000
+#define TD_OPEN_4K                   0x10000
+#define TD_OPEN_CRC                  0x20000
 
 #define TD_CREATE_SPARSE             0x00001
 #define TD_CREATE_MULTITYPE          0x00002
@@ -134,6 +157,11 @@ struct td_disk_id {
 	int                          flags;
 };
 
+/*
+ * Sizes and request offsets are always counted in SECTOR_SIZE units, as on
+ * the blkif ring. sector_size is the logical sector size advertised to the
+ * guest, which requests are then aligned to: 512, or 4096 for 4K VBDs.
+ */
 struct td_disk_info {
 	td_sector_t                  size;
 	long                         sector_size;
@@ -150,6 +178,7 @@ struct td_vbd_request {
 	td_sector_t                 sec;
 	struct td_iovec            *iov;
 	int                         iovcnt;
+	int                         prio;
 
 	td_vreq_callback_t          cb;
 	void                       *token;
@@ -161,8 +190,15 @@ struct td_vbd_request {
 	int                         submitting;
 	int                         secs_pending;
 	int                         num_retries;
+	int                         retrying;
 	struct timeval		    ts;
 	struct timeval              last_try;
+	uint32_t                    seq; /* while tracing */
+
+	struct list_head            wheel; /* while failed */
+	time_t                      due;
+
+	uint64_t                    prof_ts; /* issued, while profiling */
 
 	td_vbd_t                   *vbd;
 	struct list_head            next;
@@ -175,6 +211,7 @@ struct td_request {
 
 	td_sector_t                  sec;
 	int                          secs;
+	int                          prio;
 
 	td_image_t                  *image;
 
@@ -209,6 +246,40 @@ struct tap_disk {
 	void (*td_debug)             (td_driver_t *);
 	void (*td_stats)             (td_driver_t *, td_stats_t *);
 
+	/**
+	 * Optional. Returns 0 if the image holds no data for sector sec and
+	 * would forward reads of it to its parent, 1 if it may hold some.
+	 * The answer holds for the *secs sectors from sec.
+	 */
+	int (*td_sector_present)     (td_driver_t *, td_sector_t sec,
+				      td_sector_t *secs);
+
+	/**
+	 * Optional. Tells the image the sectors of the request, which carries
+	 * no data, are no longer in use. Their contents are unspecified
+	 * afterwards: they may read as zeros, the old data or the parent's.
+	 */
+	void (*td_queue_discard)     (td_driver_t *, td_request_t);
+
+	/**
+	 * Optional. Makes the sectors of the request, which carries no data,
+	 * read as zeros. Without it, zeros are written from a buffer.
+	 */
+	void (*td_queue_write_zeroes) (td_driver_t *, td_request_t);
+
+	/**
+	 * Optional. Makes all writes completed before the request was queued
+	 * stable. Drivers which have nothing to sync complete it at once;
+	 * without it, the request is forwarded down the chain.
+	 */
+	void (*td_queue_flush)       (td_driver_t *, td_request_t);
+
+	/**
+	 * Optional. Makes room for nr data segments in flight at once. Called
+	 * as rings connect; pools only ever grow.
+	 */
+	int (*td_set_depth)          (td_driver_t *, int nr);
+
     /**
      * Callback to produce RRD output.
 	 *
@@ -82,18 +82,22 @@ fail:
 int
 main(int argc, char *argv[])
 {
-	char *control;
+	char *control, *cpus;
 	int c, err, nodaemon;
 	FILE *out;
 
 	control  = NULL;
+	cpus     = NULL;
 	nodaemon = 0;
 
-	while ((c = getopt(argc, argv, "Dh")) != -1) {
+	while ((c = getopt(argc, argv, "Da:h")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
 			break;
+		case 'a':
+			cpus = optarg;
+			break;
 		case 'h':
 			usage(argv[0], 0);
 			break;
@@ -111,6 +115,14 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
+	if (cpus) {
+		err = tapdisk_server_set_affinity(cpus);
+		if (err) {
+			DPRINTF("failed to set CPU affinity: %d\n", err);
+			goto out;
+		}
+	}
+
 	out = fdup(stdout, "w");
 	if (!out) {
 		err = -errno;
@@ -145,6 +157,13 @@ main(int argc, char *argv[])
 	fprintf(out, "%s\n", control);
 	fclose(out);
 
+	/*
+	 * tap-ctl goes on as soon as it has the socket; the rest is set up
+	 * meanwhile, so that pooled tapdisks wait fully prepared. A failure
+	 * here is retried, and reported, by the first attach.
+	 */
+	tapdisk_server_prepare();
+
 	err = td_metrics_start();
 	if (err) {
 		DPRINTF("failed to create metrics folder: %d\n", err);
@@ -35,6 +35,7 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <zlib.h>
+#include <sys/time.h>
 
 #include "debug.h"
 #include "blktap3.h"
@@ -50,7 +51,7 @@
 #include "td-req.h"
 
 struct td_xenblkif *
-tapdisk_xenblkif_find(const domid_t domid, const int devid)
+tapdisk_xenblkif_find(const domid_t domid, const int devid, const int queue)
 {
     struct td_xenblkif *blkif = NULL;
     struct td_xenio_ctx *ctx;
@@ -58,7 +59,8 @@ tapdisk_xenblkif_find(const domid_t domid, const int devid)
     tapdisk_xenio_for_each_ctx(ctx) {
         tapdisk_xenio_ctx_find_blkif(ctx, blkif,
                                      blkif->domid == domid &&
-                                     blkif->devid == devid);
+                                     blkif->devid == devid &&
+                                     (queue < 0 || blkif->queue == queue));
         if (blkif)
             return blkif;
     }
@@ -94,6 +96,13 @@ tapdisk_xenblkif_stats_destroy(struct td_xenblkif *blkif)
     free(blkif->xenvbd_stats.stats.path);
     blkif->xenvbd_stats.stats.path = NULL;
 
+    blkif->stats.latency = NULL;
+    err = shm_destroy(&blkif->xenvbd_stats.latency);
+    if (unlikely(err))
+        goto out;
+    free(blkif->xenvbd_stats.latency.path);
+    blkif->xenvbd_stats.latency.path = NULL;
+
     if (likely(blkif->xenvbd_stats.root)) {
         err = rmdir(blkif->xenvbd_stats.root);
         if (unlikely(err && errno != ENOENT)) {
@@ -168,10 +177,29 @@ tapdisk_xenblkif_stats_create(struct td_xenblkif *blkif)
     if (unlikely(err))
         goto out;
 
+    err = asprintf(&blkif->xenvbd_stats.latency.path, "%s/latency",
+            blkif->xenvbd_stats.root);
+    if (unlikely(err == -1)) {
+        err = errno;
+        blkif->xenvbd_stats.latency.path = NULL;
+        goto out;
+    }
+    blkif->xenvbd_stats.latency.size =
+        (sizeof(struct blkback_latency) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    err = shm_create(&blkif->xenvbd_stats.latency);
+    if (unlikely(err))
+        goto out;
+
     blkif->xenvbd_stats.last = 0;
 
 	blkif->stats.xenvbd = blkif->xenvbd_stats.stats.mem;
 
+	blkif->stats.latency = blkif->xenvbd_stats.latency.mem;
+	blkif->stats.latency->version = BT3_LAT_VERSION;
+	blkif->stats.latency->sub_bits = BT3_LAT_SUB_BITS;
+	blkif->stats.latency->buckets = BT3_LAT_BUCKETS;
+	blkif->stats.latency->sizes = BT3_LAT_SIZES;
+
     if (tapdisk_server_mem_mode()) {
         td_flag_set(blkif->stats.xenvbd->flags, BT3_LOW_MEMORY_MODE);
         td_flag_set(blkif->vbd_stats.stats->flags, BT3_LOW_MEMORY_MODE);
@@ -230,6 +258,11 @@ tapdisk_xenblkif_destroy(struct td_xenblkif * blkif)
         blkif->stoppolling_event = -1;
     }
 
+    if (blkif->rsp_event >= 0) {
+        tapdisk_server_unregister_event(blkif->rsp_event);
+        blkif->rsp_event = -1;
+    }
+
     tapdisk_xenblkif_reqs_free(blkif);
 
     if (blkif->ctx) {
@@ -279,15 +312,13 @@ tapdisk_xenblkif_reqs_pending(const struct td_xenblkif * const blkif)
 }
 
 
-int
-tapdisk_xenblkif_disconnect(const domid_t domid, const int devid)
+static int
+tapdisk_xenblkif_disconnect_ring(struct td_xenblkif *blkif)
 {
     int err;
-    struct td_xenblkif *blkif;
 
-    blkif = tapdisk_xenblkif_find(domid, devid);
-    if (!blkif)
-        return -ENODEV;
+    if (blkif->rsp_unpushed)
+        tapdisk_xenblkif_push_responses(blkif);
 
     if (tapdisk_xenblkif_reqs_pending(blkif)) {
         RING_DEBUG(blkif, "disconnect from ring with %d pending requests\n",
@@ -323,6 +354,28 @@ tapdisk_xenblkif_disconnect(const domid_t domid, const int devid)
 }
 
 
+int
+tapdisk_xenblkif_disconnect(const domid_t domid, const int devid)
+{
+    int err = -ENODEV, err2;
+    struct td_xenblkif *blkif;
+
+    /*
+     * Rings left with pending requests are marked dead and no longer
+     * found, so this goes through every ring of the device once. Dead rings
+     * don't touch the stats, so it doesn't matter that the other rings
+     * share those of ring 0.
+     */
+    while ((blkif = tapdisk_xenblkif_find(domid, devid, -1))) {
+        err2 = tapdisk_xenblkif_disconnect_ring(blkif);
+        if (err == -ENODEV || !err)
+            err = err2;
+    }
+
+    return err;
+}
+
+
 void
 tapdisk_xenblkif_sched_stoppolling(const struct td_xenblkif *blkif)
 {
@@ -331,7 +384,7 @@ tapdisk_xenblkif_sched_stoppolling(const struct td_xenblkif *blkif)
 	ASSERT(blkif);
 
 	err = tapdisk_server_event_set_timeout(
-		tapdisk_xenblkif_stoppolling_event_id(blkif), TV_USECS(blkif->poll_duration));
+		tapdisk_xenblkif_stoppolling_event_id(blkif), TV_USECS(blkif->poll_window));
 	ASSERT(!err);
 }
 
@@ -348,13 +401,127 @@ tapdisk_xenblkif_unsched_stoppolling(const struct td_xenblkif *blkif)
 }
 
 
+/*
+ * Adaptive polling tunables. The smoothed values move by 1/8 of the
+ * difference per sample; gap samples are capped so that a long idle period
+ * does not take many batches to forget.
+ */
+#define TD_POLL_MIN_US		10
+#define TD_POLL_GAP_CAP		4
+#define TD_POLL_HIT_ONE		256
+#define TD_POLL_HIT_MIN		(TD_POLL_HIT_ONE / 4)
+#define TD_POLL_BACKOFF_MAX	64
+
+static bool
+tapdisk_xenblkif_poll_adaptive(void)
+{
+    const char *val;
+
+    val = getenv("TAPDISK3_POLL_ADAPTIVE");
+    if (!val)
+        return true;
+
+    return atoi(val) != 0;
+}
+
+static void
+tapdisk_xenblkif_poll_init(struct td_xenblkif *blkif, int poll_duration)
+{
+    blkif->poll_duration = poll_duration;
+    blkif->poll_adaptive = tapdisk_xenblkif_poll_adaptive();
+    blkif->poll_window = poll_duration;
+    blkif->poll_gap = poll_duration;
+    blkif->poll_last = 0;
+    blkif->poll_hit = TD_POLL_HIT_ONE / 2;
+    blkif->poll_backoff = 1;
+    blkif->poll_skip = 0;
+}
+
+void
+tapdisk_xenblkif_poll_arrival(struct td_xenblkif *blkif)
+{
+    ASSERT(blkif);
+
+    if (blkif->poll_adaptive) {
+        struct timeval now;
+        long long us, gap;
+
+        gettimeofday(&now, NULL);
+        us = timeval_to_us(&now);
+
+        if (blkif->poll_last) {
+            gap = us - blkif->poll_last;
+            if (gap < 0)
+                gap = 0;
+            if (gap > (long long)blkif->poll_duration * TD_POLL_GAP_CAP)
+                gap = (long long)blkif->poll_duration * TD_POLL_GAP_CAP;
+            blkif->poll_gap += ((int)gap - blkif->poll_gap) / 8;
+        }
+        blkif->poll_last = us;
+
+        blkif->poll_window = blkif->poll_gap * 2;
+        if (blkif->poll_window < TD_POLL_MIN_US)
+            blkif->poll_window = TD_POLL_MIN_US;
+        if (blkif->poll_window > blkif->poll_duration)
+            blkif->poll_window = blkif->poll_duration;
+    }
+
+    if (blkif->in_polling) {
+        /* We found at least one request, so keep polling some more */
+        if (blkif->poll_adaptive) {
+            blkif->poll_hit += (TD_POLL_HIT_ONE - blkif->poll_hit) / 8;
+            if (blkif->poll_hit >= TD_POLL_HIT_ONE / 2)
+                blkif->poll_backoff = 1;
+        }
+        tapdisk_xenblkif_sched_stoppolling(blkif);
+    } else
+        /* We weren't polling, but polling is enabled, so let's start now */
+        tapdisk_start_polling(blkif);
+}
+
+/*
+ * A polling window expired without finding a request. If that happens too
+ * often, polling is not paying for the CPU it burns: skip the next few
+ * opportunities, more of them each time, and then give it another chance.
+ */
+static void
+tapdisk_xenblkif_poll_miss(struct td_xenblkif *blkif)
+{
+    if (!blkif->poll_adaptive)
+        return;
+
+    blkif->poll_hit -= blkif->poll_hit / 8;
+    if (blkif->poll_hit >= TD_POLL_HIT_MIN)
+        return;
+
+    blkif->poll_skip = blkif->poll_backoff;
+    if (blkif->poll_backoff < TD_POLL_BACKOFF_MAX)
+        blkif->poll_backoff *= 2;
+    blkif->poll_hit = TD_POLL_HIT_ONE / 2;
+}
+
 void
 tapdisk_start_polling(struct td_xenblkif *blkif)
 {
     ASSERT(blkif);
 
-    /* Only enter polling if the CPU utilisation is not too high */
-    if (tapdisk_server_system_idle_cpu() > (float)blkif->poll_idle_threshold) {
+    if (blkif->poll_adaptive) {
+        if (blkif->poll_skip) {
+            blkif->poll_skip--;
+            return;
+        }
+
+        /*
+         * Requests arrive further apart than we may poll for, the window
+         * would most likely expire empty.
+         */
+        if (blkif->poll_gap > blkif->poll_duration)
+            return;
+    }
+
+    /* Only enter polling if the CPU we run on is not too busy */
+    if (tapdisk_server_local_idle_cpu() > (float)blkif->poll_idle_threshold &&
+        !tapdisk_server_cpu_contended()) {
         blkif->in_polling = true;
 
         /* Start checking the ring immediately */
@@ -377,6 +544,7 @@ tapdisk_xenblkif_cb_stoppolling(event_id_t id __attribute__((unused)),
     if (!tapdisk_xenio_ctx_process_ring(blkif, blkif->ctx, 1)) {
         /* If there were no new requests this time, then stop polling */
         blkif->in_polling = false;
+        tapdisk_xenblkif_poll_miss(blkif);
 
         /* Stop obsessively checking the ring */
         tapdisk_xenblkif_unsched_chkrng(blkif);
@@ -431,12 +599,101 @@ tapdisk_xenblkif_cb_chkrng(event_id_t id __attribute__((unused)),
 }
 
 
+static void
+tapdisk_xenblkif_cb_rsp(event_id_t id __attribute__((unused)),
+        char mode __attribute__((unused)), void *private)
+{
+    struct td_xenblkif *blkif = private;
+    int err;
+
+    ASSERT(blkif);
+
+    err = tapdisk_server_event_set_timeout(blkif->rsp_event, TV_INF);
+    ASSERT(!err);
+    blkif->rsp_delayed = false;
+
+    if (blkif->rsp_unpushed)
+        tapdisk_xenblkif_push_responses(blkif);
+}
+
+void
+tapdisk_xenblkif_flush_responses(struct td_xenblkif *blkif)
+{
+    int err;
+
+    ASSERT(blkif);
+
+    if (!blkif->rsp_unpushed)
+        return;
+
+    /*
+     * With nothing left in flight there is nothing to coalesce with.
+     */
+    if (!blkif->rsp_delay || !tapdisk_xenblkif_reqs_pending(blkif)) {
+        if (blkif->rsp_delayed) {
+            err = tapdisk_server_event_set_timeout(blkif->rsp_event, TV_INF);
+            ASSERT(!err);
+            blkif->rsp_delayed = false;
+        }
+        tapdisk_xenblkif_push_responses(blkif);
+        return;
+    }
+
+    if (!blkif->rsp_delayed) {
+        err = tapdisk_server_event_set_timeout(blkif->rsp_event,
+                TV_USECS(blkif->rsp_delay));
+        ASSERT(!err);
+        blkif->rsp_delayed = true;
+    }
+}
+
+/*
+ * TAPDISK3_RSP_COALESCE_US=<us> lets responses wait up to that long for
+ * further completions before the front-end is notified. The epoll schedulers
+ * sleep in milliseconds, so if nothing else wakes the loop the wait is
+ * rounded up to that; the select scheduler honours microseconds.
+ */
+static int
+tapdisk_xenblkif_rsp_delay(void)
+{
+    const char *val;
+    int us;
+
+    val = getenv("TAPDISK3_RSP_COALESCE_US");
+    if (!val)
+        return 0;
+
+    us = atoi(val);
+    if (us <= 0)
+        return 0;
+
+    return us;
+}
+
+/*
+ * Grows the image pools so that every ring can be full of direct requests
+ * at once. Indirect requests may carry more segments; those wait for free
+ * driver requests as before.
+ */
+static void
+tapdisk_xenblkif_update_depth(td_vbd_t *vbd)
+{
+    struct td_xenblkif *blkif, *tmp;
+    int nr = 0;
+
+    tapdisk_vbd_for_each_blkif(vbd, blkif, tmp)
+        nr += blkif->ring_size;
+
+    tapdisk_vbd_set_depth(vbd, nr * BLKIF_MAX_SEGMENTS_PER_REQUEST);
+}
+
 int
 tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
         int order, evtchn_port_t port, int proto, int poll_duration,
-        int poll_idle_threshold, const char *pool, td_vbd_t * vbd)
+        int poll_idle_threshold, const char *pool, int queue, td_vbd_t * vbd)
 {
     struct td_xenblkif *td_blkif = NULL; /* TODO rename to blkif */
+    struct td_xenblkif *primary = NULL;
     struct td_xenio_ctx *td_ctx;
     int err;
     unsigned int i;
@@ -449,11 +706,23 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
     /*
      * Already connected?
      */
-    if (tapdisk_xenblkif_find(domid, devid)) {
+    if (tapdisk_xenblkif_find(domid, devid, queue)) {
         /* TODO log error */
         return -EALREADY;
     }
 
+    /*
+     * The other rings of a multi-queue device hang off ring 0.
+     */
+    if (queue) {
+        primary = tapdisk_xenblkif_find(domid, devid, 0);
+        if (!primary || primary->vbd != vbd) {
+            EPRINTF("%d/%d: ring %d connected before ring 0\n", domid, devid,
+                    queue);
+            return -EINVAL;
+        }
+    }
+
     err = tapdisk_xenio_ctx_get(pool, &td_ctx);
     if (err) {
         /* TODO log error */
@@ -469,14 +738,19 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
 
     td_blkif->domid = domid;
     td_blkif->devid = devid;
+    td_blkif->queue = queue;
     td_blkif->vbd = vbd;
     td_blkif->ctx = td_ctx;
     td_blkif->proto = proto;
     td_blkif->dead = false;
 	td_blkif->chkrng_event = -1;
 	td_blkif->stoppolling_event = -1;
+	td_blkif->rsp_event = -1;
+	td_blkif->rsp_unpushed = false;
+	td_blkif->rsp_delayed = false;
+	td_blkif->rsp_delay = tapdisk_xenblkif_rsp_delay();
 	td_blkif->in_polling = false;
-	td_blkif->poll_duration = poll_duration;
+	tapdisk_xenblkif_poll_init(td_blkif, poll_duration);
 	td_blkif->poll_idle_threshold = poll_idle_threshold;
 	td_blkif->barrier.msg = NULL;
 	td_blkif->barrier.io_done = false;
@@ -485,6 +759,7 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
     td_blkif->xenvbd_stats.root = NULL;
     shm_init(&td_blkif->xenvbd_stats.io_ring);
     shm_init(&td_blkif->xenvbd_stats.stats);
+    shm_init(&td_blkif->xenvbd_stats.latency);
 
     memset(&td_blkif->stats, 0, sizeof(td_blkif->stats));
 
@@ -586,9 +861,12 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
         goto fail;
     }
 
-    err = td_metrics_vbd_start(td_blkif->domid, td_blkif->devid, &td_blkif->vbd_stats);
-    if (unlikely(err))
-        goto fail;
+    if (!primary) {
+        err = td_metrics_vbd_start(td_blkif->domid, td_blkif->devid,
+                &td_blkif->vbd_stats);
+        if (unlikely(err))
+            goto fail;
+    }
 
 	td_blkif->stoppolling_event = tapdisk_server_register_event(
 			SCHEDULER_POLL_TIMEOUT,	-1, TV_INF,
@@ -599,14 +877,36 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
         goto fail;
     }
 
-    err = tapdisk_xenblkif_stats_create(td_blkif);
-    if (unlikely(err))
+	td_blkif->rsp_event = tapdisk_server_register_event(
+			SCHEDULER_POLL_TIMEOUT,	-1, TV_INF,
+			tapdisk_xenblkif_cb_rsp, td_blkif);
+    if (unlikely(td_blkif->rsp_event < 0)) {
+        err = td_blkif->rsp_event;
+        RING_ERR(td_blkif, "failed to register event: %s\n", strerror(-err));
         goto fail;
+    }
+
+    /*
+     * The stats files are per device, all rings account into those of
+     * ring 0.
+     */
+    if (!primary) {
+        err = tapdisk_xenblkif_stats_create(td_blkif);
+        if (unlikely(err))
+            goto fail;
+        td_blkif->vbd_stats.ext = td_blkif->stats.latency;
+    } else {
+        td_blkif->vbd_stats.stats = primary->vbd_stats.stats;
+        td_blkif->stats.xenvbd = primary->stats.xenvbd;
+        td_blkif->stats.latency = primary->stats.latency;
+    }
 
     list_add_tail(&td_blkif->entry, &vbd->rings);
 	list_add_tail(&td_blkif->entry_ctx, &td_ctx->blkifs);
 
-    DPRINTF("ring %p connected\n", td_blkif);
+	tapdisk_xenblkif_update_depth(vbd);
+
+    DPRINTF("ring %p (queue %d) connected\n", td_blkif, queue);
 
     return 0;
 
@@ -657,6 +957,12 @@ tapdisk_xenblkif_ring_stats_update(struct td_xenblkif *blkif)
     if (unlikely(blkif->dead))
         return 0;
 
+    /*
+     * Only ring 0 has a ring stats file.
+     */
+    if (blkif->queue)
+        return 0;
+
     ring = &blkif->rings.common;
 	if (!ring->sring)
         return 0;
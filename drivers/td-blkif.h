@@ -52,29 +52,42 @@ struct td_xenblkif_stats;
 
 struct td_xenblkif {
 
-    /**
-     * The domain ID where the front-end is running.
+    /*
+     * What ring processing and request completion touch, first, so that it
+     * spans as few cache lines as possible. Setup and teardown state follows.
      */
-    int domid;
 
     /**
-     * The device ID of the VBD.
+     * Pointer to the actual VBD.
      */
-    int devid;
-
+    struct td_vbd_handle *vbd;
 
     /**
 	 * Pointer to the context this block interface belongs to.
 	 */
     struct td_xenio_ctx *ctx;
 
+    blkif_back_rings_t rings;
+
     /**
-	 * allows struct td_blkif's to be linked into lists, for whomever needs to
-	 * maintain multiple struct td_blkif's
-	 */
-    struct list_head entry_ctx;
+     * Intermediate requests. The array is managed as a stack, with n_reqs_free
+     * pointing to the top of the stack, at the next available intermediate
+     * request.
+     */
+    struct td_xenblkif_req *reqs;
 
-    struct list_head entry;
+    /**
+     * Stack pointer to the aforementioned stack.
+     */
+    int n_reqs_free;
+
+    blkif_request_t **reqs_free;
+
+    /*
+     * Size of the ring, expressed in requests.
+     * TODO Do we really need to keep this around?
+     */
+    int ring_size;
 
     /**
      * The local port corresponding to the remote port of the domain where the
@@ -94,50 +107,124 @@ struct td_xenblkif {
      */
     int proto;
 
-    blkif_back_rings_t rings;
-
     /**
-     * TODO Why 8 specifically?
-     * TODO Do we really need to keep it around?
+     * The domain ID where the front-end is running.
      */
-    grant_ref_t ring_ref[8];
+    int domid;
 
     /**
-     * Number of pages in the ring that holds the request descriptors.
+     * The device ID of the VBD.
      */
-    unsigned int ring_n_pages;
+    int devid;
 
-    /*
-     * Size of the ring, expressed in requests.
-     * TODO Do we really need to keep this around?
+	bool dead;
+
+	struct {
+		/**
+		 * Pointer to he pending barrier request.
+		 */
+		blkif_request_t *msg;
+
+		/**
+		 * Tells whether the write I/O part of a barrier request (if any) has
+		 * completed.
+		 */
+		bool io_done;
+
+		/**
+		 * I/O error code for the write I/O part of a barrier request (if any).
+		 */
+		int io_err;
+	} barrier;
+
+    /**
+     * Requests of at least this many bytes map the guest pages and do I/O
+     * straight from them, instead of grant-copying through a request buffer.
+     * Zero disables grant mapping.
      */
-    int ring_size;
+    size_t grant_map_min;
 
     /**
-     * Intermediate requests. The array is managed as a stack, with n_reqs_free
-     * pointing to the top of the stack, at the next available intermediate
-     * request.
+     * Segments of a grant copy covering several requests, sized for a full
+     * ring or at least one indirect request, and the requests taking part
+     * in it. Completed reads wait in gcopy_reqs until the end of their
+     * completion batch.
      */
-    struct td_xenblkif_req *reqs;
+    struct gntdev_grant_copy_segment *gcopy_segs;
+    int gcopy_max_segs;
+    struct td_xenblkif_req **gcopy_reqs;
+    int n_gcopy_reqs;
+
+	/**
+	 * Responses put in the ring but not yet pushed. They are pushed once
+	 * per event loop iteration or, with a coalescing delay, up to rsp_delay
+	 * microseconds later if requests are still in flight, so that several
+	 * completion batches share one notification.
+	 */
+	bool rsp_unpushed;
+	int rsp_delay;
+	bool rsp_delayed;
+	event_id_t rsp_event;
 
     /**
-     * Stack pointer to the aforementioned stack.
+     * stats
      */
-    int n_reqs_free;
+    struct td_xenblkif_stats stats;
 
-    blkif_request_t **reqs_free;
+    stats_t vbd_stats;
+
+    /*
+     * Per batch or colder from here on.
+     */
+
+	bool in_polling;
+	int poll_duration; /* microseconds; 0 means no polling. */
+	int poll_idle_threshold;
+
+	/**
+	 * Adaptive polling. poll_duration is only an upper bound: the window
+	 * actually used, poll_window, follows twice the smoothed time between
+	 * request batches (poll_gap, sampled at poll_last). We do not start
+	 * polling when batches arrive further apart than poll_duration.
+	 * poll_hit is the smoothed share, in 1/256ths, of hits (batches found
+	 * while polling) among hits and expired windows. When it falls below
+	 * a quarter, the next poll_skip chances to poll are skipped, with
+	 * poll_backoff doubling each time. Set TAPDISK3_POLL_ADAPTIVE=0 for a
+	 * fixed poll_duration window.
+	 */
+	bool poll_adaptive;
+	int poll_window;
+	int poll_gap;
+	long long poll_last;
+	int poll_hit;
+	int poll_backoff;
+	int poll_skip;
 
     /**
-     * Pointer to the actual VBD.
+     * Index of this ring among the rings of a multi-queue device, 0 for the
+     * only ring of a single-queue one. Rings other than 0 share the stats of
+     * ring 0 and are served by the same event loop as the VBD.
      */
-    struct td_vbd_handle *vbd;
+    int queue;
 
     /**
-     * stats
+	 * allows struct td_blkif's to be linked into lists, for whomever needs to
+	 * maintain multiple struct td_blkif's
+	 */
+    struct list_head entry_ctx;
+
+    struct list_head entry;
+
+    /**
+     * TODO Why 8 specifically?
+     * TODO Do we really need to keep it around?
      */
-    struct td_xenblkif_stats stats;
+    grant_ref_t ring_ref[8];
 
-    stats_t vbd_stats;
+    /**
+     * Number of pages in the ring that holds the request descriptors.
+     */
+    unsigned int ring_n_pages;
 
     struct {
         /**
@@ -158,42 +245,16 @@ struct td_xenblkif {
          */
         struct shm stats;
 
+        /**
+         * Latency histograms, struct blkback_latency.
+         */
+        struct shm latency;
+
         time_t last;
     } xenvbd_stats;
 
-    /**
-     * Request buffer cache.
-     */
-    void **reqs_bufcache;
-    unsigned n_reqs_bufcache_free;
-    event_id_t reqs_bufcache_evtid;
-
-	bool dead;
-
-	struct {
-		/**
-		 * Pointer to he pending barrier request.
-		 */
-		blkif_request_t *msg;
-
-		/**
-		 * Tells whether the write I/O part of a barrier request (if any) has
-		 * completed.
-		 */
-		bool io_done;
-
-		/**
-		 * I/O error code for the write I/O part of a barrier request (if any).
-		 */
-		int io_err;
-	} barrier;
-
 	event_id_t chkrng_event;
 	event_id_t stoppolling_event;
-
-	bool in_polling;
-	int poll_duration; /* microseconds; 0 means no polling. */
-	int poll_idle_threshold;
 };
 
 #define RING_DEBUG(blkif, fmt, args...)                                     \
@@ -206,7 +267,7 @@ struct td_xenblkif {
 
 /* TODO rename from xenio */
 #define tapdisk_xenio_for_each_ctx(_ctx) \
-	list_for_each_entry(_ctx, &_td_xenio_ctxs, entry)
+	list_for_each_entry(_ctx, tapdisk_xenio_ctxs(), entry)
 
 /**
  * Connects the tapdisk to the shared ring.
@@ -218,19 +279,23 @@ struct td_xenblkif {
  * @param port event channel port of the guest domain to use for ring
  * notifications
  * @param proto protocol (native, x86, or x64)
- * @param poll_duration polling duration (microseconds; 0 means no polling)
+ * @param poll_duration maximum polling duration (microseconds; 0 means no
+ * polling)
  * @param poll_idle_threshold CPU threshold above which we permit polling
  * @param pool name of the context
+ * @param queue index of the ring, for front-ends using several rings; ring 0
+ * must be connected before any other
  * @param vbd the VBD
  * @returns 0 on success
  */
 int
 tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
         int order, evtchn_port_t port, int proto, int poll_duration,
-        int poll_idle_threshold, const char *pool, td_vbd_t * vbd);
+        int poll_idle_threshold, const char *pool, int queue, td_vbd_t * vbd);
 
 /**
- * Disconnects the tapdisk from the shared ring.
+ * Disconnects the tapdisk from the shared ring, or from all the rings of a
+ * multi-queue device.
  *
  * @param domid the domain ID of the guest domain
  * @param devid the device ID of the VBD
@@ -258,10 +323,11 @@ tapdisk_xenblkif_destroy(struct td_xenblkif * blkif);
  *
  * @param domid the domain ID
  * @param devid the device ID
+ * @param queue the ring index, -1 matches any ring of the device
  * @returns a pointer to the block interface if found, else NULL
  */
 struct td_xenblkif *
-tapdisk_xenblkif_find(const domid_t domid, const int devid);
+tapdisk_xenblkif_find(const domid_t domid, const int devid, const int queue);
 
 /**
  * Returns the event ID associated with the event channel. Since the event
@@ -328,6 +394,13 @@ tapdisk_xenblkif_unsched_stoppolling(const struct td_xenblkif *blkif);
 void
 tapdisk_start_polling(struct td_xenblkif *blkif);
 
+/**
+ * Accounts for a batch of requests taken off the ring and starts or extends
+ * polling accordingly.
+ */
+void
+tapdisk_xenblkif_poll_arrival(struct td_xenblkif *blkif);
+
 /**
  * Schedules a ring check.
  */
@@ -340,6 +413,14 @@ tapdisk_xenblkif_sched_chkrng(const struct td_xenblkif *blkif);
 void
 tapdisk_xenblkif_unsched_chkrng(const struct td_xenblkif *blkif);
 
+/**
+ * Pushes the pending responses of the ring, or defers them if a coalescing
+ * delay is configured and more completions are expected. Called at the end
+ * of each event loop iteration.
+ */
+void
+tapdisk_xenblkif_flush_responses(struct td_xenblkif *blkif);
+
 /**
  * Tells whether a barrier request can be completed.
  */
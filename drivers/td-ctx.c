@@ -36,6 +36,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <alloca.h>
+#include <sys/mman.h>
 
 #include "debug.h"
 #include "tapdisk-server.h"
@@ -45,7 +46,189 @@
 
 #define ERROR(_f, _a...)           tlog_syslog(TLOG_WARN, "td-ctx: " _f, ##_a)
 
-struct list_head _td_xenio_ctxs = LIST_HEAD_INIT(_td_xenio_ctxs);
+#define TD_XENIO_BUFS_EXPIRE    3 /* time in seconds */
+#define TD_XENIO_BUFCHUNKS_MIN  1 /* chunks to always keep */
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define TD_XENIO_MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+
+static __thread struct list_head _td_xenio_ctxs;
+
+struct list_head *
+tapdisk_xenio_ctxs(void)
+{
+	if (!_td_xenio_ctxs.next)
+		INIT_LIST_HEAD(&_td_xenio_ctxs);
+
+	return &_td_xenio_ctxs;
+}
+
+static struct td_xenio_bufchunk *
+tapdisk_xenio_bufchunk_alloc(void)
+{
+    struct td_xenio_bufchunk *chunk;
+    const int n = TD_XENIO_BUFCHUNK_SIZE / TD_XENIO_BUF_SIZE;
+    int i;
+
+    chunk = malloc(sizeof(*chunk) + n * sizeof(chunk->free[0]));
+    if (!chunk)
+        return NULL;
+
+    /*
+     * A hugetlb page if the administrator reserved some, otherwise normal
+     * pages, which are hinted for transparent huge pages.
+     *
+     * The mappings are private: the buffers are only ever touched by this
+     * process (grant copy goes through the hypervisor by address), and
+     * shared anonymous memory is shmem, which THP leaves alone unless
+     * shmem_enabled says otherwise.
+     */
+    chunk->huge = true;
+    chunk->base = mmap(NULL, TD_XENIO_BUFCHUNK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | TD_XENIO_MAP_HUGE_2MB,
+            -1, 0);
+    if (chunk->base == MAP_FAILED) {
+        chunk->huge = false;
+        chunk->base = mmap(NULL, TD_XENIO_BUFCHUNK_SIZE,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk->base == MAP_FAILED) {
+            int err = errno;
+            free(chunk);
+            errno = err;
+            return NULL;
+        }
+        madvise(chunk->base, TD_XENIO_BUFCHUNK_SIZE, MADV_HUGEPAGE);
+    }
+
+    chunk->n_bufs = n;
+    for (i = 0; i < n; i++)
+        chunk->free[i] = chunk->base + (n - 1 - i) * TD_XENIO_BUF_SIZE;
+    chunk->n_free = n;
+
+    return chunk;
+}
+
+static void
+tapdisk_xenio_bufchunk_free(struct td_xenio_bufchunk *chunk)
+{
+    list_del(&chunk->entry);
+    munmap(chunk->base, TD_XENIO_BUFCHUNK_SIZE);
+    free(chunk);
+}
+
+/**
+ * Releases the idle chunks of the context, keeping TD_XENIO_BUFCHUNKS_MIN.
+ */
+static void
+tapdisk_xenio_ctx_bufs_shrink(struct td_xenio_ctx * const ctx)
+{
+    struct td_xenio_bufchunk *chunk, *next;
+    int n = 0;
+
+    list_for_each_entry_safe(chunk, next, &ctx->bufchunks, entry) {
+        if (chunk->n_free == chunk->n_bufs && n >= TD_XENIO_BUFCHUNKS_MIN)
+            tapdisk_xenio_bufchunk_free(chunk);
+        else
+            n++;
+    }
+}
+
+static void
+tapdisk_xenio_ctx_bufs_expire_unreg(struct td_xenio_ctx * const ctx)
+{
+    if (ctx->bufs_expire_event >= 0) {
+        tapdisk_server_unregister_event(ctx->bufs_expire_event);
+        ctx->bufs_expire_event = -1;
+    }
+}
+
+static void
+tapdisk_xenio_ctx_bufs_expire(event_id_t id __attribute__((unused)),
+        char mode __attribute__((unused)), void *private)
+{
+    struct td_xenio_ctx *ctx = private;
+
+    tapdisk_xenio_ctx_bufs_shrink(ctx);
+    tapdisk_xenio_ctx_bufs_expire_unreg(ctx);
+}
+
+void *
+tapdisk_xenio_ctx_buf_get(struct td_xenio_ctx *ctx)
+{
+    struct td_xenio_bufchunk *chunk = NULL;
+    void *buf;
+
+    ASSERT(ctx);
+
+    if (!list_empty(&ctx->bufchunks))
+        chunk = list_first_entry(&ctx->bufchunks, struct td_xenio_bufchunk,
+                entry);
+
+    if (!chunk || !chunk->n_free) {
+        chunk = tapdisk_xenio_bufchunk_alloc();
+        if (unlikely(!chunk))
+            return NULL;
+        list_add(&chunk->entry, &ctx->bufchunks);
+    }
+
+    buf = chunk->free[--chunk->n_free];
+    if (!chunk->n_free)
+        list_move_tail(&chunk->entry, &ctx->bufchunks);
+    ctx->n_bufs_used++;
+
+    /* If we just got a request, we cancel the expire timer */
+    tapdisk_xenio_ctx_bufs_expire_unreg(ctx);
+
+    return buf;
+}
+
+void
+tapdisk_xenio_ctx_buf_put(struct td_xenio_ctx *ctx, void *buf)
+{
+    struct td_xenio_bufchunk *chunk;
+
+    ASSERT(ctx);
+
+    if (unlikely(!buf))
+        return;
+
+    list_for_each_entry(chunk, &ctx->bufchunks, entry)
+        if (buf >= chunk->base &&
+                buf < chunk->base + TD_XENIO_BUFCHUNK_SIZE)
+            break;
+    ASSERT(&chunk->entry != &ctx->bufchunks);
+
+#ifdef DEBUG
+	{
+		int i;
+
+		for (i = 0; i < chunk->n_free; i++)
+			ASSERT(chunk->free[i] != buf);
+	}
+#endif
+
+    if (!chunk->n_free)
+        list_move(&chunk->entry, &ctx->bufchunks);
+    chunk->free[chunk->n_free++] = buf;
+    ctx->n_bufs_used--;
+
+    /*
+     * If we're in low memory mode, release idle chunks immediately. Under
+     * lesser memory pressure, they expire sooner.
+     */
+    if (tapdisk_server_mem_mode() == LOW_MEMORY_MODE)
+        tapdisk_xenio_ctx_bufs_shrink(ctx);
+    else if (!ctx->n_bufs_used && ctx->bufs_expire_event < 0) {
+        /* We only set the expire event when no buffers are in use */
+        ctx->bufs_expire_event = tapdisk_server_register_event(
+                SCHEDULER_POLL_TIMEOUT, -1,
+                TV_USECS(TD_XENIO_BUFS_EXPIRE * 1000000ULL *
+                    tapdisk_server_mem_budget() / TD_MEM_BUDGET_FULL),
+                tapdisk_xenio_ctx_bufs_expire, ctx);
+    }
+}
 
 /**
  * TODO releases a pool?
@@ -76,6 +259,11 @@ tapdisk_xenio_ctx_close(struct td_xenio_ctx * const ctx)
         ctx->gntdev_fd = -1;
     }
 
+    tapdisk_xenio_ctx_bufs_expire_unreg(ctx);
+    while (!list_empty(&ctx->bufchunks))
+        tapdisk_xenio_bufchunk_free(list_first_entry(&ctx->bufchunks,
+                    struct td_xenio_bufchunk, entry));
+
     list_del(&ctx->entry);
 
 	free(ctx);
@@ -137,6 +325,41 @@ xenio_pending_blkif(struct td_xenio_ctx * const ctx)
         dst->seg[i] = src->seg[i];              \
 }
 
+/*
+ * Copies a BLKIF_OP_INDIRECT request into the native layout, which
+ * tapdisk_xenblkif_make_vbd_request expects to find over the request.
+ */
+#define blkif_get_req_indirect(_dst, src)       \
+{                                               \
+    int i;                                      \
+    blkif_request_indirect_t *dst =             \
+        (blkif_request_indirect_t *)(_dst);     \
+    dst->operation = src->operation;            \
+    dst->indirect_op = src->indirect_op;        \
+    dst->nr_segments = src->nr_segments;        \
+    dst->handle = src->handle;                  \
+    dst->id = src->id;                          \
+    dst->sector_number = src->sector_number;    \
+    xen_rmb();                                  \
+    for (i = 0; i < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; i++) \
+        dst->indirect_grefs[i] = src->indirect_grefs[i]; \
+}
+
+/*
+ * Copies a BLKIF_OP_DISCARD request into the native layout.
+ */
+#define blkif_get_req_discard(_dst, src)        \
+{                                               \
+    blkif_request_discard_t *dst =              \
+        (blkif_request_discard_t *)(_dst);      \
+    dst->operation = src->operation;            \
+    dst->flag = src->flag;                      \
+    dst->handle = src->handle;                  \
+    dst->id = src->id;                          \
+    dst->sector_number = src->sector_number;    \
+    dst->nr_sectors = src->nr_sectors;          \
+}
+
 /**
  * Utility function that retrieves a request using @idx as the ring index,
  * copying it to the @dst in a H/W independent way.
@@ -169,7 +392,14 @@ xenio_blkif_get_request(struct td_xenblkif * const blkif,
             {
                 blkif_x86_32_request_t *src;
                 src = RING_GET_REQUEST(&rings->x86_32, idx);
-                blkif_get_req(dst, src);
+                if (src->operation == BLKIF_OP_INDIRECT) {
+                    blkif_x86_32_request_indirect_t *isrc = (void *)src;
+                    blkif_get_req_indirect(dst, isrc);
+                } else if (src->operation == BLKIF_OP_DISCARD) {
+                    blkif_x86_32_request_discard_t *dsrc = (void *)src;
+                    blkif_get_req_discard(dst, dsrc);
+                } else
+                    blkif_get_req(dst, src);
                 break;
             }
 
@@ -177,7 +407,14 @@ xenio_blkif_get_request(struct td_xenblkif * const blkif,
             {
                 blkif_x86_64_request_t *src;
                 src = RING_GET_REQUEST(&rings->x86_64, idx);
-                blkif_get_req(dst, src);
+                if (src->operation == BLKIF_OP_INDIRECT) {
+                    blkif_x86_64_request_indirect_t *isrc = (void *)src;
+                    blkif_get_req_indirect(dst, isrc);
+                } else if (src->operation == BLKIF_OP_DISCARD) {
+                    blkif_x86_64_request_discard_t *dsrc = (void *)src;
+                    blkif_get_req_discard(dst, dsrc);
+                } else
+                    blkif_get_req(dst, src);
                 break;
             }
 
@@ -302,14 +539,24 @@ tapdisk_xenio_ctx_process_ring(struct td_xenblkif *blkif,
     /*
      * In each iteration, copy as many request descriptors from the shared ring
      * that can fit within the constraints.
-     * If there's memory available, use as many requests as available.
+     * If there's memory available, use as many requests as available, up to
+     * the memory budget's share of the ring in flight.
      * If in low memory mode, don't copy any if there's some in flight.
      * Otherwise, only copy one.
      */
 	if (tapdisk_server_mem_mode() == LOW_MEMORY_MODE)
 	    limit = blkif->ring_size != blkif->n_reqs_free ? 0 : 1;
-    else
-	    limit = blkif->n_reqs_free;
+    else {
+        int cap = blkif->ring_size * tapdisk_server_mem_budget() /
+            TD_MEM_BUDGET_FULL;
+        int in_flight = blkif->ring_size - blkif->n_reqs_free;
+
+        if (cap < 1)
+            cap = 1;
+        limit = cap > in_flight ? cap - in_flight : 0;
+        if (limit > blkif->n_reqs_free)
+            limit = blkif->n_reqs_free;
+    }
 
     do {
         reqs = &blkif->reqs_free[blkif->ring_size - blkif->n_reqs_free];
@@ -351,12 +598,8 @@ tapdisk_xenio_ctx_process_ring(struct td_xenblkif *blkif,
 		 */
 		return 0;
 
-    if (blkif->in_polling)
-        /* We found at least one request, so keep polling some more */
-        tapdisk_xenblkif_sched_stoppolling(blkif);
-    else if (blkif->poll_duration)
-        /* We weren't polling, but polling is enabled, so let's start now */
-        tapdisk_start_polling(blkif);
+    if (blkif->poll_duration)
+        tapdisk_xenblkif_poll_arrival(blkif);
 
     blkif->stats.reqs.in += n_reqs;
 
@@ -426,7 +669,9 @@ tapdisk_xenio_ctx_open(const char *pool)
     ctx->gntdev_fd = -1;
     ctx->pool = TD_XENBLKIF_DEFAULT_POOL;
 	INIT_LIST_HEAD(&ctx->blkifs);
-    list_add(&ctx->entry, &_td_xenio_ctxs);
+    INIT_LIST_HEAD(&ctx->bufchunks);
+    ctx->bufs_expire_event = -1;
+    list_add(&ctx->entry, tapdisk_xenio_ctxs());
 
     ctx->gntdev_fd = open("/dev/xen/gntdev", O_NONBLOCK);
     if (ctx->gntdev_fd == -1) {
@@ -35,6 +35,46 @@
 #include "td-blkif.h"
 #include "scheduler.h"
 
+/**
+ * Size of a request buffer, large enough for a request without indirect
+ * segments.
+ */
+#define TD_XENIO_BUF_SIZE (BLKIF_MAX_SEGMENTS_PER_REQUEST << XC_PAGE_SHIFT)
+
+/**
+ * Request buffers are carved out of chunks of this size, backed by a 2 MiB
+ * huge page if one can be had.
+ *
+ * With 11-page buffers a chunk holds 46 of them and the last 24 KiB are
+ * left unused, about 1% of the chunk. Shrinking the buffers to fit would
+ * split requests of BLKIF_MAX_SEGMENTS_PER_REQUEST segments across chunks,
+ * so the slack is accepted.
+ */
+#define TD_XENIO_BUFCHUNK_SIZE (2 << 20)
+
+/**
+ * A chunk of request buffers.
+ */
+struct td_xenio_bufchunk {
+    struct list_head entry;
+
+    void *base;
+
+    /**
+     * Tells whether the chunk is a hugetlb page, as opposed to normal pages
+     * that transparent huge pages may or may not back.
+     */
+    bool huge;
+
+    int n_bufs;
+
+    /**
+     * Stack of free buffers.
+     */
+    int n_free;
+    void *free[];
+};
+
 /**
  * A VBD context: groups two or more VBDs of the same tapdisk.
  *
@@ -79,6 +119,15 @@ struct td_xenio_ctx {
     struct list_head entry;
 
     int gntdev_fd;
+
+    /**
+     * Request buffers, shared by the block interfaces of this context.
+     * Chunks with free buffers come first. Idle chunks are released after
+     * a while, or right away in low memory mode.
+     */
+    struct list_head bufchunks;
+    int n_bufs_used;
+    event_id_t bufs_expire_event;
 };
 
 /**
@@ -96,6 +145,20 @@ tapdisk_xenio_ctx_get(const char *pool, struct td_xenio_ctx ** _ctx);
 void
 tapdisk_xenio_ctx_put(struct td_xenio_ctx * ctx);
 
+/**
+ * Gets a request buffer of TD_XENIO_BUF_SIZE bytes.
+ *
+ * @returns the buffer, NULL on failure, sets errno
+ */
+void *
+tapdisk_xenio_ctx_buf_get(struct td_xenio_ctx *ctx);
+
+/**
+ * Gives back a buffer obtained with tapdisk_xenio_ctx_buf_get.
+ */
+void
+tapdisk_xenio_ctx_buf_put(struct td_xenio_ctx *ctx, void *buf);
+
 /**
  * Process requests on the ring, if any. Returns the number of requests found.
  */
@@ -104,9 +167,9 @@ tapdisk_xenio_ctx_process_ring(struct td_xenblkif *blkif,
 		struct td_xenio_ctx *ctx, int final);
 
 /**
- * List of contexts.
+ * List of contexts of the calling thread's event loop.
  */
-extern struct list_head _td_xenio_ctxs;
+struct list_head *tapdisk_xenio_ctxs(void);
 
 /**
  * For each block interface of this context...
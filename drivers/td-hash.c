@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tapdisk-log.h"
+#include "crc32c.h"
+#include "md5.h"
+#include "td-hash.h"
+
+#define XXH_PRIME64_1                   0x9e3779b185ebca87ULL
+#define XXH_PRIME64_2                   0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME64_3                   0x165667b19e3779f9ULL
+#define XXH_PRIME64_4                   0x85ebca77c2b2ae63ULL
+#define XXH_PRIME64_5                   0x27d4eb2f165667c5ULL
+
+static inline uint64_t
+xxh64_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+xxh64_read64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static inline uint32_t
+xxh64_read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc  = xxh64_rotl(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t
+xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/*
+ * XXH64, as specified by the xxHash project: four independent lanes, so
+ * a block hashes at several bytes a cycle.
+ */
+uint64_t
+xxh64(const void *buf, size_t len, uint64_t seed)
+{
+	const unsigned char *p = buf, *end = p + len;
+	uint64_t h, v1, v2, v3, v4;
+
+	if (len >= 32) {
+		const unsigned char *limit = end - 32;
+
+		v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		v2 = seed + XXH_PRIME64_2;
+		v3 = seed;
+		v4 = seed - XXH_PRIME64_1;
+
+		do {
+			v1 = xxh64_round(v1, xxh64_read64(p));
+			v2 = xxh64_round(v2, xxh64_read64(p + 8));
+			v3 = xxh64_round(v3, xxh64_read64(p + 16));
+			v4 = xxh64_round(v4, xxh64_read64(p + 24));
+			p += 32;
+		} while (p <= limit);
+
+		h = xxh64_rotl(v1, 1) + xxh64_rotl(v2, 7) +
+			xxh64_rotl(v3, 12) + xxh64_rotl(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else
+		h = seed + XXH_PRIME64_5;
+
+	h += len;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh64_round(0, xxh64_read64(p));
+		h  = xxh64_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+
+	if (p + 4 <= end) {
+		h ^= (uint64_t)xxh64_read32(p) * XXH_PRIME64_1;
+		h  = xxh64_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+
+	for (; p < end; p++) {
+		h ^= *p * XXH_PRIME64_5;
+		h  = xxh64_rotl(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+static uint64_t
+td_hash_xxh64(const void *buf, size_t len)
+{
+	return xxh64(buf, len, 0);
+}
+
+/* 32 bits only: fine for buckets, more matches to confirm */
+static uint64_t
+td_hash_crc32c(const void *buf, size_t len)
+{
+	return crc32c(0, buf, len);
+}
+
+void
+td_hash_digest(const void *buf, size_t len, uint8_t digest[TD_HASH_DIGEST_LEN])
+{
+	MD5_CTX ctx;
+
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, buf, len);
+	MD5_Final(digest, &ctx);
+}
+
+static uint64_t
+td_hash_md5(const void *buf, size_t len)
+{
+	uint8_t digest[TD_HASH_DIGEST_LEN];
+	uint64_t h;
+
+	td_hash_digest(buf, len, digest);
+	memcpy(&h, digest, sizeof(h));
+
+	return h;
+}
+
+static const td_hash_ops_t td_hash_ops_xxh64 = {
+	.name   = "xxh64",
+	.strong = 0,
+	.hash   = td_hash_xxh64,
+};
+
+static const td_hash_ops_t td_hash_ops_crc32c = {
+	.name   = "crc32c",
+	.strong = 0,
+	.hash   = td_hash_crc32c,
+};
+
+static const td_hash_ops_t td_hash_ops_md5 = {
+	.name   = "md5",
+	.strong = 1,
+	.hash   = td_hash_md5,
+};
+
+const td_hash_ops_t *const td_hash_algorithms[] = {
+	&td_hash_ops_xxh64,
+	&td_hash_ops_crc32c,
+	&td_hash_ops_md5,
+	NULL,
+};
+
+const td_hash_ops_t *
+td_hash_find(const char *name)
+{
+	int i;
+
+	for (i = 0; td_hash_algorithms[i]; i++)
+		if (!strcmp(td_hash_algorithms[i]->name, name))
+			return td_hash_algorithms[i];
+
+	return NULL;
+}
+
+const td_hash_ops_t *
+td_hash_default(void)
+{
+	static const td_hash_ops_t *ops;
+	const td_hash_ops_t *o;
+	const char *name;
+
+	o = __atomic_load_n(&ops, __ATOMIC_ACQUIRE);
+	if (o)
+		return o;
+
+	o    = &td_hash_ops_xxh64;
+	name = getenv("TAPDISK3_HASH");
+	if (name) {
+		if (td_hash_find(name))
+			o = td_hash_find(name);
+		else
+			EPRINTF("TAPDISK3_HASH: no hash %s, using %s\n",
+				name, o->name);
+	}
+
+	if (!strcmp(o->name, "crc32c") && !crc32c_accelerated())
+		DPRINTF("TAPDISK3_HASH: crc32c without CRC instructions\n");
+
+	__atomic_store_n(&ops, o, __ATOMIC_RELEASE);
+
+	return o;
+}
+
+uint64_t
+td_hash(const void *buf, size_t len)
+{
+	return td_hash_default()->hash(buf, len);
+}
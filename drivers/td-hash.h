@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TD_HASH_H_
+#define _TD_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Content hashes. Most users only need to tell blocks apart quickly and
+ * confirm a match themselves, as the block cache store does with
+ * memcmp(): td_hash() is for them, a fast non-cryptographic hash chosen
+ * with TAPDISK3_HASH=<name> (xxh64 by default). Where a collision would
+ * go unnoticed, use a strong one, td_hash_digest().
+ */
+
+typedef struct td_hash_ops td_hash_ops_t;
+
+struct td_hash_ops {
+	const char                     *name;
+	int                             strong;
+	uint64_t                      (*hash)(const void *buf, size_t len);
+};
+
+/* NULL-terminated, fastest first */
+extern const td_hash_ops_t *const td_hash_algorithms[];
+
+const td_hash_ops_t *td_hash_find(const char *name);
+
+/* the one TAPDISK3_HASH names, or the default */
+const td_hash_ops_t *td_hash_default(void);
+
+uint64_t td_hash(const void *buf, size_t len);
+
+#define TD_HASH_DIGEST_LEN              16
+
+/* MD5, for content identity */
+void td_hash_digest(const void *buf, size_t len,
+		    uint8_t digest[TD_HASH_DIGEST_LEN]);
+
+uint64_t xxh64(const void *buf, size_t len, uint64_t seed);
+
+#endif /* _TD_HASH_H_ */
@@ -33,6 +33,7 @@
 #endif
 
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -42,6 +43,8 @@
 #include <getopt.h>
 #include <syslog.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
 #include <sys/time.h>
 
@@ -106,9 +109,12 @@ struct ratelimit_connection {
 
 	unsigned long                  need; /* I/O requested */
 	unsigned long                  gntd; /* I/O granted, pending */
+	unsigned long                  cls;  /* announced by the valve */
+	unsigned long                  resp; /* granted, not sent yet */
 
 	struct list_head               open; /* connected */
 	struct list_head               wait; /* need > 0 */
+	struct list_head               send; /* resp > 0 */
 
 	struct {
 		struct timeval         since;
@@ -118,6 +124,12 @@ struct ratelimit_connection {
 
 #define RLB_CONN_MAX                   1024
 
+/* epoll event data, besides connection ids */
+#define RLB_EV_LISTEN                  RLB_CONN_MAX
+#define RLB_EV_TIMER                   (RLB_CONN_MAX + 1)
+#define RLB_EV_STDIN                   (RLB_CONN_MAX + 2)
+#define RLB_EV_MAX                     64
+
 struct ratelimit_ops {
 	void    (*usage)(td_rlb_t *rlb, FILE *stream, void *data);
 
@@ -142,9 +154,25 @@ struct ratelimit_bridge {
 
 	struct list_head               open; /* all connections */
 	struct list_head               wait; /* all in need */
+	struct list_head               send; /* grants to send */
+
+	int                            epfd;
+	int                            tfd;  /* valve timeouts */
 
 	struct timeval                 ts, now;
 
+	struct {
+		unsigned long long     wakeups;
+		unsigned long long     events;
+		unsigned long long     grants;
+		unsigned long long     sends;
+		unsigned long long     busy;     /* us, dispatching */
+		unsigned long long     busy_max; /* us */
+	} stats;
+
+	/* latencies reported by valves, until a valve takes them */
+	unsigned long                  lat[TD_VALVE_LAT_BUCKETS];
+
 	td_rlb_conn_t                  connv[RLB_CONN_MAX];
 	td_rlb_conn_t                 *free[RLB_CONN_MAX];
 	int                            n_free;
@@ -531,6 +559,7 @@ rlb_conn_close(td_rlb_t *rlb, td_rlb_conn_t *conn)
 	}
 
 	list_del_init(&conn->wait);
+	list_del_init(&conn->send);
 	list_del(&conn->open);
 
 	rlb_conn_free(rlb, conn);
@@ -561,6 +590,18 @@ rlb_conn_receive(td_rlb_t *rlb, td_rlb_conn_t *conn)
 	for (i = 0; i < n / sizeof(buf[0]); i++) {
 		req = buf[i];
 
+		if (req.need == TD_VALVE_CLASS) {
+			conn->cls = req.done;
+			DBG(1, "conn[%d] class %lu",
+			    rlb_conn_id(rlb, conn), conn->cls);
+			continue;
+		}
+
+		if (TD_VALVE_IS_LATENCY(req.need)) {
+			rlb->lat[TD_VALVE_LATENCY_BUCKET(req.need)] += req.done;
+			continue;
+		}
+
 		if (unlikely(req.need > TD_RLB_REQUEST_MAX)) {
 			err = -EINVAL;
 			goto fail;
@@ -602,21 +643,25 @@ close:
 	rlb_conn_close(rlb, conn);
 }
 
+/*
+ * Grants are accounted for right away, but only sent once valves are
+ * done dispatching, one message per connection and wakeup.
+ */
 static void
 rlb_conn_respond(td_rlb_t *rlb, td_rlb_conn_t *conn, unsigned long need)
 {
-	int err;
-
 	BUG_ON(need > conn->need);
 
-	err = rlb_sock_send(rlb, conn, &need, sizeof(need));
-	if (err)
-		goto fail;
-
 	conn->need -= need;
 	conn->gntd += need;
 
-	DBG(8, "snd: %lu need=%lu gntd=%lu", need, conn->need, conn->gntd);
+	if (!conn->resp)
+		list_add_tail(&conn->send, &rlb->send);
+	conn->resp += need;
+
+	rlb->stats.grants++;
+
+	DBG(8, "gnt: %lu need=%lu gntd=%lu", need, conn->need, conn->gntd);
 
 	if (!conn->need) {
 		struct timeval delta;
@@ -626,12 +671,45 @@ rlb_conn_respond(td_rlb_t *rlb, td_rlb_conn_t *conn, unsigned long need)
 
 		list_del_init(&conn->wait);
 	}
+}
 
-	return;
+static void
+rlb_conn_flush(td_rlb_t *rlb)
+{
+	td_rlb_conn_t *conn, *next;
+	int err;
 
-fail:
-	WARN("err = %d, killing connection.", err);
-	rlb_conn_close(rlb, conn);
+	list_for_each_entry_safe(conn, next, &rlb->send, send) {
+		err = rlb_sock_send(rlb, conn, &conn->resp, sizeof(conn->resp));
+
+		DBG(8, "snd: %lu need=%lu gntd=%lu",
+		    conn->resp, conn->need, conn->gntd);
+
+		conn->resp = 0;
+		list_del_init(&conn->send);
+
+		rlb->stats.sends++;
+
+		if (err) {
+			WARN("err = %d, killing connection.", err);
+			rlb_conn_close(rlb, conn);
+		}
+	}
+}
+
+static int
+rlb_epoll_add(td_rlb_t *rlb, int fd, unsigned int id)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = id };
+	int err;
+
+	err = epoll_ctl(rlb->epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (err) {
+		err = -errno;
+		PERROR("epoll_ctl(%d)", fd);
+	}
+
+	return err;
 }
 
 static void
@@ -657,7 +735,16 @@ rlb_accept_conn(td_rlb_t *rlb)
 
 	memset(conn, 0, sizeof(*conn));
 	INIT_LIST_HEAD(&conn->wait);
+	INIT_LIST_HEAD(&conn->send);
 	conn->sock = s;
+
+	err = rlb_epoll_add(rlb, s, rlb_conn_id(rlb, conn));
+	if (err) {
+		close(s);
+		rlb_conn_free(rlb, conn);
+		goto fail;
+	}
+
 	list_add_tail(&conn->open, &rlb->open);
 
 	return;
@@ -884,6 +971,731 @@ static struct ratelimit_ops rlb_token_ops = {
 	.reset    = rlb_token_reset,
 };
 
+/*
+ * fair valve
+ *
+ * A token bucket shared by classes of connections, which valves join
+ * by announcing a class id. Each class may have a guaranteed rate,
+ * granted from a bucket of its own even when the shared one is in
+ * debt, and a ceiling. Credit of the shared bucket goes to waiting
+ * classes in proportion to their weights, by least virtual time: what
+ * idle classes do not use is shared among the others. Within a class,
+ * connections are served in order.
+ *
+ * Guarantees are charged to the shared bucket as well, so they should
+ * sum up to no more than its rate. Class buckets burst like the shared
+ * one, relative to their rates. Connections of unknown classes are in
+ * class 0.
+ */
+
+#define RLB_CLASS_MAX                  64
+
+typedef struct ratelimit_fair          td_rlb_fair_t;
+typedef struct ratelimit_class         td_rlb_class_t;
+
+struct ratelimit_class {
+	unsigned long             weight; /* 0 if not configured */
+	td_rlb_token_t            min;    /* rate 0 if no guarantee */
+	td_rlb_token_t            max;    /* rate 0 if no ceiling */
+
+	unsigned long long        vtime;
+	int                       active;
+
+	unsigned long long        gntd_min;
+	unsigned long long        gntd_shared;
+};
+
+struct ratelimit_fair {
+	td_rlb_token_t            root;
+	td_rlb_class_t            classes[RLB_CLASS_MAX];
+	struct timeval            timeo;
+};
+
+#define rlb_fair_for_each_class(_c, _f)					\
+	for ((_c) = (_f)->classes;					\
+	     (_c) < (_f)->classes + RLB_CLASS_MAX; (_c)++)		\
+		if ((_c)->weight)
+
+static td_rlb_class_t *
+rlb_fair_class(td_rlb_fair_t *f, td_rlb_conn_t *conn)
+{
+	if (conn->cls < RLB_CLASS_MAX && f->classes[conn->cls].weight)
+		return &f->classes[conn->cls];
+
+	return &f->classes[0];
+}
+
+/* until @token is out of debt */
+static long long
+rlb_token_wait_usec(td_rlb_token_t *token)
+{
+	long long us;
+
+	if (token->cred >= 0)
+		return 0;
+
+	us  = -token->cred;
+	us *= 1000000;
+	us += token->rate - 1;
+	us /= token->rate;
+
+	return us;
+}
+
+static void
+rlb_fair_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
+{
+	td_rlb_fair_t *f = data;
+	struct timeval *tv = &f->timeo;
+	td_rlb_conn_t *conn;
+	td_rlb_class_t *c;
+	long long us, t;
+
+	if (list_empty(&rlb->wait)) {
+		*_tv = NULL;
+		return;
+	}
+
+	us = LLONG_MAX;
+
+	list_for_each_entry(conn, &rlb->wait, wait) {
+		c = rlb_fair_class(f, conn);
+
+		t = rlb_token_wait_usec(&f->root);
+		if (c->max.rate)
+			t = MAX(t, rlb_token_wait_usec(&c->max));
+		if (c->min.rate)
+			t = MIN(t, rlb_token_wait_usec(&c->min));
+
+		us = MIN(us, t);
+	}
+
+	us = MAX(us, 1);
+
+	tv->tv_sec  = us / 1000000;
+	tv->tv_usec = us % 1000000;
+
+	*_tv = tv;
+}
+
+static void
+rlb_fair_grant(td_rlb_t *rlb, td_rlb_fair_t *f,
+	       td_rlb_class_t *c, td_rlb_conn_t *conn)
+{
+	unsigned long need = conn->need;
+
+	f->root.cred -= need;
+	if (c->max.rate)
+		c->max.cred -= need;
+
+	rlb_conn_respond(rlb, conn, need);
+}
+
+/*
+ * Classes starting to wait do not get to catch up on the time they
+ * were idle: their virtual time moves up to that of the busy ones.
+ */
+static void
+rlb_fair_activate(td_rlb_t *rlb, td_rlb_fair_t *f)
+{
+	unsigned long long vmin = ULLONG_MAX;
+	td_rlb_class_t *c;
+	td_rlb_conn_t *conn;
+	int waiting[RLB_CLASS_MAX] = { 0 };
+
+	list_for_each_entry(conn, &rlb->wait, wait)
+		waiting[rlb_fair_class(f, conn) - f->classes] = 1;
+
+	rlb_fair_for_each_class(c, f)
+		if (c->active)
+			vmin = MIN(vmin, c->vtime);
+
+	rlb_fair_for_each_class(c, f) {
+		int w = waiting[c - f->classes];
+
+		if (w && !c->active && vmin != ULLONG_MAX)
+			c->vtime = MAX(c->vtime, vmin);
+
+		c->active = w;
+	}
+}
+
+static void
+rlb_fair_dispatch(td_rlb_t *rlb, void *data)
+{
+	td_rlb_fair_t *f = data;
+	td_rlb_conn_t *conn, *next, *best;
+	td_rlb_class_t *c, *bc;
+
+	rlb_token_refill(rlb, &f->root);
+
+	rlb_fair_for_each_class(c, f) {
+		if (c->min.rate)
+			rlb_token_refill(rlb, &c->min);
+		if (c->max.rate)
+			rlb_token_refill(rlb, &c->max);
+	}
+
+	rlb_fair_activate(rlb, f);
+
+	/* guarantees first */
+
+	rlb_for_each_waiting_safe(conn, next, rlb) {
+		c = rlb_fair_class(f, conn);
+
+		if (!c->min.rate || c->min.cred < 0)
+			continue;
+
+		c->min.cred  -= conn->need;
+		c->gntd_min  += conn->need;
+
+		rlb_fair_grant(rlb, f, c, conn);
+	}
+
+	/* then shares, by least virtual time */
+
+	while (f->root.cred >= 0) {
+		best = NULL;
+		bc   = NULL;
+
+		list_for_each_entry(conn, &rlb->wait, wait) {
+			c = rlb_fair_class(f, conn);
+
+			if (c->max.rate && c->max.cred < 0)
+				continue;
+
+			if (!bc || c->vtime < bc->vtime) {
+				best = conn;
+				bc   = c;
+			}
+		}
+
+		if (!best)
+			break;
+
+		bc->vtime       += ((unsigned long long)best->need << 10) /
+			bc->weight;
+		bc->gntd_shared += best->need;
+
+		rlb_fair_grant(rlb, f, bc, best);
+	}
+}
+
+static void
+rlb_fair_reset(td_rlb_t *rlb, void *data)
+{
+	td_rlb_fair_t *f = data;
+	td_rlb_class_t *c;
+
+	rlb_token_reset(rlb, &f->root);
+
+	rlb_fair_for_each_class(c, f) {
+		rlb_token_reset(rlb, &c->min);
+		rlb_token_reset(rlb, &c->max);
+	}
+}
+
+static void
+rlb_fair_destroy(td_rlb_t *rlb, void *data)
+{
+	td_rlb_fair_t *f = data;
+
+	if (f)
+		free(f);
+}
+
+/*
+ * <id>:<weight>[:[<min>][:<max>]]
+ */
+static int
+rlb_fair_parse_rate(const char *s, long *rate)
+{
+	long val;
+
+	if (!s || !*s)
+		return 0;
+
+	val = rlb_strtol(s);
+	if (val < 0)
+		return -EINVAL;
+
+	*rate = val;
+	return 0;
+}
+
+static int
+rlb_fair_parse_class(td_rlb_fair_t *f, char *arg)
+{
+	char *s, *end;
+	td_rlb_class_t *c;
+	unsigned long id;
+	int err;
+
+	s = strsep(&arg, ":");
+	id = strtoul(s, &end, 0);
+	if (*end || end == s || id >= RLB_CLASS_MAX)
+		return -EINVAL;
+
+	c = &f->classes[id];
+
+	s = strsep(&arg, ":");
+	if (!s)
+		return -EINVAL;
+
+	c->weight = strtoul(s, &end, 0);
+	if (*end || !c->weight)
+		return -EINVAL;
+
+	err = rlb_fair_parse_rate(strsep(&arg, ":"), &c->min.rate);
+	if (err)
+		return err;
+
+	err = rlb_fair_parse_rate(strsep(&arg, ":"), &c->max.rate);
+	if (err)
+		return err;
+
+	return arg ? -EINVAL : 0;
+}
+
+static int
+rlb_fair_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+{
+	td_rlb_fair_t *f;
+	td_rlb_class_t *c;
+	int err;
+
+	f = calloc(1, sizeof(*f));
+	if (!f) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	f->classes[0].weight = 1;
+
+	do {
+		const struct option longopts[] = {
+			{ "rate",        1, NULL, 'r' },
+			{ "cap",         1, NULL, 'c' },
+			{ "class",       1, NULL, 'C' },
+			{ NULL,          0, NULL,  0  }
+		};
+		int c;
+
+		c = getopt_long(argc, argv, "r:c:C:", longopts, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'r':
+			f->root.rate = rlb_strtol(optarg);
+			if (f->root.rate < 0) {
+				ERR("invalid --rate");
+				goto usage;
+			}
+			break;
+
+		case 'c':
+			f->root.cap = rlb_strtol(optarg);
+			if (f->root.cap < 0) {
+				ERR("invalid --cap");
+				goto usage;
+			}
+			break;
+
+		case 'C':
+			if (rlb_fair_parse_class(f, optarg)) {
+				ERR("invalid --class %s", optarg);
+				goto usage;
+			}
+			break;
+
+		case '?':
+			goto usage;
+
+		default:
+			BUG();
+		}
+	} while (1);
+
+	if (!f->root.rate) {
+		ERR("--rate required");
+		goto usage;
+	}
+
+	rlb_fair_for_each_class(c, f) {
+		c->min.cap = (long long)c->min.rate * f->root.cap / f->root.rate;
+		c->max.cap = (long long)c->max.rate * f->root.cap / f->root.rate;
+	}
+
+	rlb_fair_reset(rlb, f);
+
+	*data = f;
+
+	return 0;
+
+fail:
+	if (f)
+		free(f);
+
+	return err;
+
+usage:
+	err = -EINVAL;
+	goto fail;
+}
+
+static void
+rlb_fair_usage(td_rlb_t *rlb, FILE *stream, void *data)
+{
+	fprintf(stream,
+		" {-t|--type}=fair --"
+		" {-r|--rate}=<rate [KMG]>"
+		" {-c|--cap}=<size [KMG]>"
+		" [{-C|--class}=<id>:<weight>[:[<min [KMG]>][:<max [KMG]>]] ..]");
+}
+
+static void
+rlb_fair_info(td_rlb_t *rlb, void *data)
+{
+	td_rlb_fair_t *f = data;
+	td_rlb_class_t *c;
+
+	INFO("FAIR: rate: %ld B/s cap: %ld B cred: %ld B",
+	     f->root.rate, f->root.cap, f->root.cred);
+
+	rlb_fair_for_each_class(c, f)
+		INFO("FAIR: class %td: weight %lu, min %ld B/s, max %ld B/s,"
+		     " granted %llu/%llu B (min/shared)%s",
+		     c - f->classes, c->weight, c->min.rate, c->max.rate,
+		     c->gntd_min, c->gntd_shared,
+		     c->active ? ", waiting" : "");
+}
+
+static struct ratelimit_ops rlb_fair_ops = {
+	.usage    = rlb_fair_usage,
+	.create   = rlb_fair_create,
+	.destroy  = rlb_fair_destroy,
+	.info     = rlb_fair_info,
+
+	.settimeo = rlb_fair_settimeo,
+	.timeout  = rlb_fair_dispatch,
+	.dispatch = rlb_fair_dispatch,
+	.reset    = rlb_fair_reset,
+};
+
+/*
+ * latency valve
+ *
+ * A token bucket whose rate follows backend latency, as reported by
+ * valves configured with feedback. Every period, the given percentile
+ * of latencies seen is held against the target: above it, the rate
+ * drops in proportion, by a tenth at least and half at most. At or
+ * below it, and only while clients had to wait for credit, the rate
+ * goes up again by a step, probing for bandwidth. Periods with too
+ * few samples carry them over into the next, for a few periods at most.
+ */
+
+#define RLB_LATENCY_MIN_SAMPLES        16
+#define RLB_LATENCY_MAX_PERIODS        10
+#define RLB_LATENCY_STEPS              32
+
+typedef struct ratelimit_latency       td_rlb_latency_t;
+
+struct ratelimit_latency {
+	td_rlb_token_t            token;
+
+	long                      rate_min;
+	long                      rate_max;
+	unsigned long             target;  /* us */
+	unsigned int              pct;
+	unsigned int              period;  /* ms */
+	unsigned int              burst;   /* ms */
+
+	struct timeval            ts;      /* last adjusted */
+	int                       busy;    /* clients waited since */
+	int                       sparse;  /* periods short of samples */
+	unsigned long long        p;       /* last percentile, us */
+	unsigned long long        n;       /* last sample count */
+
+	struct timeval            timeo;
+};
+
+/* upper bound of the @pct percentile of @n samples */
+static unsigned long long
+rlb_latency_percentile(const unsigned long *lat, unsigned long long n,
+		       unsigned int pct)
+{
+	unsigned long long sum = 0, rank;
+	int b;
+
+	rank = (n * pct + 99) / 100;
+
+	for (b = 0; b < TD_VALVE_LAT_BUCKETS - 1; b++) {
+		sum += lat[b];
+		if (sum >= rank)
+			break;
+	}
+
+	return td_valve_lat_usec(b + 1);
+}
+
+static void
+rlb_latency_adjust(td_rlb_t *rlb, td_rlb_latency_t *l)
+{
+	unsigned long long n = 0, p;
+	long long rate;
+	int b;
+
+	for (b = 0; b < TD_VALVE_LAT_BUCKETS; b++)
+		n += rlb->lat[b];
+
+	l->ts = rlb->now;
+
+	if (n < RLB_LATENCY_MIN_SAMPLES) {
+		if (++l->sparse < RLB_LATENCY_MAX_PERIODS)
+			return;
+		goto out;
+	}
+
+	l->n = n;
+
+	p    = rlb_latency_percentile(rlb->lat, n, l->pct);
+	l->p = p;
+	rate = l->token.rate;
+
+	if (p > l->target) {
+		rate  = rate * l->target / p;
+		rate  = MIN(rate, l->token.rate - l->token.rate / 10);
+		rate  = MAX(rate, l->token.rate / 2);
+	} else if (l->busy)
+		rate += MAX((l->rate_max - l->rate_min) / RLB_LATENCY_STEPS, 1);
+
+	rate = MAX(rate, l->rate_min);
+	rate = MIN(rate, l->rate_max);
+
+	if (rate != l->token.rate)
+		DBG(1, "p%u %lluus (%llu samples), rate %ld -> %lld B/s",
+		    l->pct, p, n, l->token.rate, rate);
+
+	l->token.rate = rate;
+	l->token.cap  = rate * l->burst / 1000;
+out:
+	memset(rlb->lat, 0, sizeof(rlb->lat));
+	l->busy   = 0;
+	l->sparse = 0;
+}
+
+static long long
+rlb_latency_next_usec(td_rlb_t *rlb, td_rlb_latency_t *l)
+{
+	struct timeval tv;
+	long long us;
+
+	timersub(&rlb->now, &l->ts, &tv);
+
+	us = (long long)l->period * 1000 - rlb_tv_usec(&tv);
+
+	return MAX(us, 0);
+}
+
+static void
+rlb_latency_dispatch(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *l = data;
+
+	rlb_token_refill(rlb, &l->token);
+
+	if (!rlb_latency_next_usec(rlb, l))
+		rlb_latency_adjust(rlb, l);
+
+	rlb_token_dispatch(rlb, &l->token);
+
+	if (!list_empty(&rlb->wait))
+		l->busy = 1;
+}
+
+static void
+rlb_latency_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
+{
+	td_rlb_latency_t *l = data;
+	struct timeval *tv = &l->timeo;
+	long long us;
+
+	if (list_empty(&rlb->wait)) {
+		*_tv = NULL;
+		return;
+	}
+
+	us = MIN(rlb_token_wait_usec(&l->token),
+		 rlb_latency_next_usec(rlb, l));
+	us = MAX(us, 1);
+
+	tv->tv_sec  = us / 1000000;
+	tv->tv_usec = us % 1000000;
+
+	*_tv = tv;
+}
+
+static void
+rlb_latency_reset(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *l = data;
+
+	rlb_token_reset(rlb, &l->token);
+}
+
+static void
+rlb_latency_destroy(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *l = data;
+
+	if (l)
+		free(l);
+}
+
+static int
+rlb_latency_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+{
+	td_rlb_latency_t *l;
+	int err;
+
+	l = calloc(1, sizeof(*l));
+	if (!l) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	l->pct    = 99;
+	l->period = 100;
+
+	do {
+		const struct option longopts[] = {
+			{ "target",      1, NULL, 'T' },
+			{ "percentile",  1, NULL, 'P' },
+			{ "min-rate",    1, NULL, 'm' },
+			{ "max-rate",    1, NULL, 'M' },
+			{ "period",      1, NULL, 'p' },
+			{ "burst",       1, NULL, 'b' },
+			{ NULL,          0, NULL,  0  }
+		};
+		long val;
+		int c;
+
+		c = getopt_long(argc, argv, "T:P:m:M:p:b:", longopts, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'T':
+			l->target = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'P':
+			l->pct = strtoul(optarg, NULL, 0);
+			if (!l->pct || l->pct > 100) {
+				ERR("invalid --percentile");
+				goto usage;
+			}
+			break;
+
+		case 'm':
+		case 'M':
+			val = rlb_strtol(optarg);
+			if (val < 0) {
+				ERR("invalid --%s-rate", c == 'm' ? "min" : "max");
+				goto usage;
+			}
+			if (c == 'm')
+				l->rate_min = val;
+			else
+				l->rate_max = val;
+			break;
+
+		case 'p':
+			l->period = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'b':
+			l->burst = strtoul(optarg, NULL, 0);
+			break;
+
+		case '?':
+			goto usage;
+
+		default:
+			BUG();
+		}
+	} while (1);
+
+	if (!l->target || !l->period) {
+		ERR("--target and --period must be non-zero");
+		goto usage;
+	}
+
+	if (!l->rate_max || l->rate_min > l->rate_max) {
+		ERR("--max-rate required, not below --min-rate");
+		goto usage;
+	}
+
+	l->rate_min   = MAX(l->rate_min, 1);
+	l->token.rate = l->rate_max;
+	l->token.cap  = (long long)l->token.rate * l->burst / 1000;
+	l->ts         = rlb->now;
+
+	rlb_token_reset(rlb, &l->token);
+
+	*data = l;
+
+	return 0;
+
+fail:
+	if (l)
+		free(l);
+
+	return err;
+
+usage:
+	err = -EINVAL;
+	goto fail;
+}
+
+static void
+rlb_latency_usage(td_rlb_t *rlb, FILE *stream, void *data)
+{
+	fprintf(stream,
+		" {-t|--type}=latency --"
+		" {-T|--target}=<usecs>"
+		" [{-P|--percentile}=<n>]"
+		" [{-m|--min-rate}=<rate [KMG]>]"
+		" {-M|--max-rate}=<rate [KMG]>"
+		" [{-p|--period}=<msecs>]"
+		" [{-b|--burst}=<msecs>]");
+}
+
+static void
+rlb_latency_info(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *l = data;
+
+	INFO("LATENCY: target p%u %lu us, last p%u %llu us (%llu samples)",
+	     l->pct, l->target, l->pct, l->p, l->n);
+	INFO("LATENCY: rate: %ld B/s [%ld..%ld] cap: %ld B cred: %ld B",
+	     l->token.rate, l->rate_min, l->rate_max,
+	     l->token.cap, l->token.cred);
+}
+
+static struct ratelimit_ops rlb_latency_ops = {
+	.usage    = rlb_latency_usage,
+	.create   = rlb_latency_create,
+	.destroy  = rlb_latency_destroy,
+	.info     = rlb_latency_info,
+
+	.settimeo = rlb_latency_settimeo,
+	.timeout  = rlb_latency_dispatch,
+	.dispatch = rlb_latency_dispatch,
+	.reset    = rlb_latency_reset,
+};
+
 /*
  * meminfo valve
  */
@@ -1314,8 +2126,16 @@ static struct ratelimit_ops rlb_meminfo_ops = {
 static void
 rlb_info(td_rlb_t *rlb)
 {
+	unsigned long long wakeups = MAX(rlb->stats.wakeups, 1);
+
 	rlb->valve.ops->info(rlb, rlb->valve.data);
 
+	INFO("LOOP: %llu wakeups, %llu events, %llu grants in %llu sends,"
+	     " dispatch %llu us avg, %llu us max",
+	     rlb->stats.wakeups, rlb->stats.events,
+	     rlb->stats.grants, rlb->stats.sends,
+	     rlb->stats.busy / wakeups, rlb->stats.busy_max);
+
 	rlb_conn_infos(rlb);
 }
 
@@ -1390,18 +2210,25 @@ rlb_find_valve(const char *name)
 	struct ratelimit_ops *ops = NULL;
 
 	switch (name[0]) {
-#if 0
 	case 'l':
+#if 0
 		if (!strcmp(name, "leaky"))
 			ops = &rlb_leaky_ops;
-		break;
 #endif
+		if (!strcmp(name, "latency"))
+			ops = &rlb_latency_ops;
+		break;
 
 	case 't':
 		if (!strcmp(name, "token"))
 			ops = &rlb_token_ops;
 		break;
 
+	case 'f':
+		if (!strcmp(name, "fair"))
+			ops = &rlb_fair_ops;
+		break;
+
 	case 'm':
 		if (!strcmp(name, "meminfo"))
 			ops = &rlb_meminfo_ops;
@@ -1412,82 +2239,109 @@ rlb_find_valve(const char *name)
 }
 
 static int
-rlb_main_iterate(td_rlb_t *rlb)
+rlb_settimer(td_rlb_t *rlb, const struct timeval *tv)
 {
-	td_rlb_conn_t *conn, *next;
-	struct timeval *tv;
-	struct timespec _ts, *ts = &_ts;
-	int nfds, err;
-	fd_set rfds;
-
-	FD_ZERO(&rfds);
-	nfds = 0;
+	struct itimerspec its = { { 0 } };
+	int err;
 
-	if (stdin) {
-		FD_SET(STDIN_FILENO, &rfds);
-		nfds = MAX(nfds, STDIN_FILENO);
+	if (tv) {
+		TIMEVAL_TO_TIMESPEC(tv, &its.it_value);
+		/* zero would disarm it */
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			its.it_value.tv_nsec = 1;
 	}
 
-	if (rlb->sock >= 0) {
-		FD_SET(rlb->sock, &rfds);
-		nfds = MAX(nfds, rlb->sock);
+	err = timerfd_settime(rlb->tfd, 0, &its, NULL);
+	if (err) {
+		err = -errno;
+		PERROR("timerfd_settime");
 	}
 
-	rlb_for_each_conn(conn, rlb) {
-		FD_SET(conn->sock, &rfds);
-		nfds = MAX(nfds, conn->sock);
-	}
+	return err;
+}
+
+/*
+ * One wakeup: receive from all connections ready, let the valve
+ * dispatch once, then send what it granted, a message per connection.
+ */
+static int
+rlb_main_iterate(td_rlb_t *rlb)
+{
+	struct epoll_event evs[RLB_EV_MAX];
+	td_rlb_conn_t *conn;
+	struct timeval *tv, end;
+	int timeout, listen, i, n, err;
+	unsigned long long busy;
+	uint64_t exp;
 
 	rlb->valve.ops->settimeo(rlb, &tv, rlb->valve.data);
-	if (tv) {
-		TIMEVAL_TO_TIMESPEC(tv, ts);
-	} else
-		ts = NULL;
+
+	err = rlb_settimer(rlb, tv);
+	if (err)
+		goto fail;
 
 	rlb->ts = rlb->now;
 
-	nfds = pselect(nfds + 1, &rfds, NULL, NULL, ts, &rlb_sigunblock);
-	if (nfds < 0) {
+	n = epoll_pwait(rlb->epfd, evs, ARRAY_SIZE(evs), -1, &rlb_sigunblock);
+	if (n < 0) {
 		err = -errno;
 		if (err != -EINTR)
-			PERROR("select");
+			PERROR("epoll_pwait");
 		goto fail;
 	}
 
 	gettimeofday(&rlb->now, NULL);
 
-	if (!nfds) {
-		BUG_ON(!ts);
-		rlb->valve.ops->timeout(rlb, rlb->valve.data);
-	}
+	rlb->stats.wakeups++;
+	rlb->stats.events += n;
 
-	if (nfds) {
-		rlb_for_each_conn_safe(conn, next, rlb)
-			if (FD_ISSET(conn->sock, &rfds)) {
-				rlb_conn_receive(rlb, conn);
-				if (!--nfds)
-					break;
-			}
+	timeout = 0;
+	listen  = 0;
 
-		rlb->valve.ops->dispatch(rlb, rlb->valve.data);
-	}
+	for (i = 0; i < n; i++) {
+		unsigned int id = evs[i].data.u32;
+
+		switch (id) {
+		case RLB_EV_LISTEN:
+			listen = 1;
+			break;
 
-	if (unlikely(nfds)) {
-		if (FD_ISSET(STDIN_FILENO, &rfds)) {
+		case RLB_EV_TIMER:
+			if (read(rlb->tfd, &exp, sizeof(exp)) == sizeof(exp))
+				timeout = 1;
+			break;
+
+		case RLB_EV_STDIN:
 			getc(stdin);
 			rlb_info(rlb);
-			nfds--;
-		}
-	}
+			break;
 
-	if (unlikely(nfds)) {
-		if (FD_ISSET(rlb->sock, &rfds)) {
-			rlb_accept_conn(rlb);
-			nfds--;
+		default:
+			BUG_ON(id >= RLB_CONN_MAX);
+			conn = &rlb->connv[id];
+			rlb_conn_receive(rlb, conn);
+			break;
 		}
 	}
 
-	BUG_ON(nfds);
+	if (timeout && n == 1)
+		rlb->valve.ops->timeout(rlb, rlb->valve.data);
+	else
+		rlb->valve.ops->dispatch(rlb, rlb->valve.data);
+
+	rlb_conn_flush(rlb);
+
+	gettimeofday(&end, NULL);
+	timersub(&end, &rlb->now, &end);
+	busy = rlb_tv_usec(&end);
+
+	rlb->stats.busy     += busy;
+	rlb->stats.busy_max  = MAX(rlb->stats.busy_max, busy);
+
+	/* accept last, nothing is queued for new connections yet */
+	if (unlikely(listen))
+		rlb_accept_conn(rlb);
+
 	err = 0;
 fail:
 	return err;
@@ -1498,6 +2352,12 @@ rlb_main_run(td_rlb_t *rlb)
 {
 	int err;
 
+	if (stdin) {
+		err = rlb_epoll_add(rlb, STDIN_FILENO, RLB_EV_STDIN);
+		if (err)
+			INFO("Not reading from stdin.");
+	}
+
 	do {
 		err = rlb_main_iterate(rlb);
 		if (err) {
@@ -1525,6 +2385,16 @@ rlb_shutdown(td_rlb_t *rlb)
 		rlb_conn_close(rlb, conn);
 
 	rlb_sock_close(rlb);
+
+	if (rlb->tfd >= 0) {
+		close(rlb->tfd);
+		rlb->tfd = -1;
+	}
+
+	if (rlb->epfd >= 0) {
+		close(rlb->epfd);
+		rlb->epfd = -1;
+	}
 }
 
 static void
@@ -1536,7 +2406,7 @@ rlb_usage(td_rlb_t *rlb, const char *prog, FILE *stream)
 		rlb->valve.ops->usage(rlb, stream, rlb->valve.data);
 	else
 		fprintf(stream,
-			" {-t|--type}={token|meminfo}"
+			" {-t|--type}={token|fair|latency|meminfo}"
 			" [-h|--help] [-D|--debug=<n>]");
 
 	fprintf(stream, "\n");
@@ -1566,7 +2436,10 @@ rlb_create(td_rlb_t *rlb, const char *name)
 	memset(rlb, 0, sizeof(*rlb));
 	INIT_LIST_HEAD(&rlb->open);
 	INIT_LIST_HEAD(&rlb->wait);
+	INIT_LIST_HEAD(&rlb->send);
 	rlb->sock = -1;
+	rlb->epfd = -1;
+	rlb->tfd  = -1;
 
 	for (i = RLB_CONN_MAX - 1; i >= 0; i--)
 		rlb_conn_free(rlb, &rlb->connv[i]);
@@ -1581,6 +2454,28 @@ rlb_create(td_rlb_t *rlb, const char *name)
 	if (err)
 		goto fail;
 
+	rlb->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (rlb->epfd < 0) {
+		PERROR("epoll_create1");
+		err = -errno;
+		goto fail;
+	}
+
+	rlb->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (rlb->tfd < 0) {
+		PERROR("timerfd_create");
+		err = -errno;
+		goto fail;
+	}
+
+	err = rlb_epoll_add(rlb, rlb->sock, RLB_EV_LISTEN);
+	if (err)
+		goto fail;
+
+	err = rlb_epoll_add(rlb, rlb->tfd, RLB_EV_TIMER);
+	if (err)
+		goto fail;
+
 	gettimeofday(&rlb->now, NULL);
 
 	return 0;
@@ -28,12 +28,18 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <xenctrl.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <syslog.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -51,6 +57,8 @@
 #include "tapdisk-vbd.h"
 #include "tapdisk-log.h"
 #include "tapdisk.h"
+#include "tapdisk-probe.h"
+#include "tapdisk-profile.h"
 #include "timeout-math.h"
 #include "util.h"
 
@@ -61,122 +69,78 @@
 #define ERR(blkif, fmt, args...) \
     EPRINTF("%d/%d: "fmt, (blkif)->domid, (blkif)->devid, ##args);
 
-#define TD_REQS_BUFCACHE_EXPIRE 3 // time in seconds
-#define TD_REQS_BUFCACHE_MIN    1 // buffers to always keep in the cache
-
-static void
-td_xenblkif_bufcache_free(struct td_xenblkif * const blkif);
-static inline void
-td_xenblkif_bufcache_evt_unreg(struct td_xenblkif * const blkif);
-
-static void
-td_xenblkif_bufcache_event(event_id_t id, char mode, void *private)
-{
-    struct td_xenblkif *blkif = private;
-
-    td_xenblkif_bufcache_free(blkif);
-
-    td_xenblkif_bufcache_evt_unreg(blkif);
-}
-
 /**
- * Unregister the event to expire the request buffer cache.
+ * Maps the guest pages of a request, so that I/O goes straight to or from
+ * them. Returns NULL if the request should take the grant-copy path.
  *
  * @param blkif the block interface
+ * @param tapreq the request to map
+ * @param size the size of the request in bytes
  */
-static inline void
-td_xenblkif_bufcache_evt_unreg(struct td_xenblkif * const blkif)
+static void *
+td_xenblkif_map_request(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const tapreq, const size_t size)
 {
-    if (blkif->reqs_bufcache_evtid > 0){
-        tapdisk_server_unregister_event(blkif->reqs_bufcache_evtid);
+    void *vma;
+
+    if (!blkif->grant_map_min || size < blkif->grant_map_min)
+        return NULL;
+
+    vma = xc_gnttab_map_domain_grant_refs(blkif->ctx->xcg_handle,
+            tapreq->nr_segments, blkif->domid, tapreq->gref,
+            tapreq->prot);
+    if (unlikely(!vma)) {
+        RING_DEBUG(blkif, "req %lu: failed to map %d grants, copying: %s\n",
+                tapreq->msg.id, tapreq->nr_segments, strerror(errno));
+        return NULL;
     }
-    blkif->reqs_bufcache_evtid = 0;
-}
 
-/**
- * Register the event to expire the request buffer cache.
- *
- * @param blkif the block interface
- */
-static inline void
-td_xenblkif_bufcache_evt_reg(struct td_xenblkif * const blkif)
-{
-    blkif->reqs_bufcache_evtid =
-        tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
-                                      -1, /* dummy fd */
-                                      TV_SECS(TD_REQS_BUFCACHE_EXPIRE),
-                                      td_xenblkif_bufcache_event,
-                                      blkif);
+    tapreq->mapped = true;
+
+    return vma;
 }
 
-/**
- * Free request buffer cache.
- *
- * @param blkif the block interface
- */
 static void
-td_xenblkif_bufcache_free(struct td_xenblkif * const blkif)
+td_xenblkif_unmap_request(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const tapreq)
 {
-    ASSERT(blkif);
+    int err;
 
-    while (blkif->n_reqs_bufcache_free > TD_REQS_BUFCACHE_MIN){
-        munmap(blkif->reqs_bufcache[--blkif->n_reqs_bufcache_free],
-               BLKIF_MAX_SEGMENTS_PER_REQUEST << XC_PAGE_SHIFT);
-    }
+    err = xc_gnttab_munmap(blkif->ctx->xcg_handle, tapreq->vma,
+            tapreq->nr_segments);
+    if (unlikely(err))
+        RING_ERR(blkif, "req %lu: failed to unmap %d grants: %s\n",
+                tapreq->msg.id, tapreq->nr_segments, strerror(errno));
+
+    tapreq->vma = NULL;
+    tapreq->mapped = false;
 }
 
 /**
- * Get buffer for a request. From cache if available or newly allocated.
- *
- * @param blkif the block interface
+ * Returns the buffer of an indirect request, allocating it if needed.
  */
 static void *
-td_xenblkif_bufcache_get(struct td_xenblkif * const blkif)
+td_xenblkif_indirect_get(struct td_xenblkif_indirect * const indirect)
 {
-    void *buf;
-
-    ASSERT(blkif);
-
-    if (!blkif->n_reqs_bufcache_free) {
-        buf = mmap(NULL, BLKIF_MAX_SEGMENTS_PER_REQUEST << XC_PAGE_SHIFT,
-                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-        if (unlikely(buf == MAP_FAILED))
-            buf = NULL;
-    } else
-        buf = blkif->reqs_bufcache[--blkif->n_reqs_bufcache_free];
-
-    // If we just got a request, we cancel the cache expire timer
-    td_xenblkif_bufcache_evt_unreg(blkif);
+    if (!indirect->vma) {
+        indirect->vma = mmap(NULL, TD_MAX_INDIRECT_SEGMENTS << XC_PAGE_SHIFT,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (unlikely(indirect->vma == MAP_FAILED)) {
+            indirect->vma = NULL;
+            return NULL;
+        }
+    }
 
-    return buf;
+    return indirect->vma;
 }
 
 static void
-td_xenblkif_bufcache_put(struct td_xenblkif * const blkif, void *buf)
+td_xenblkif_indirect_put(struct td_xenblkif_indirect * const indirect)
 {
-    ASSERT(blkif);
-
-    if (unlikely(!buf))
-        return;
-
-#ifdef DEBUG
-	{
-		int i;
-
-		for (i = 0; i < blkif->n_reqs_bufcache_free; i++)
-			ASSERT(blkif->reqs_bufcache[i] != buf);
-	}
-#endif
-
-    blkif->reqs_bufcache[blkif->n_reqs_bufcache_free++] = buf;
-
-    /* If we're in low memory mode, prune the bufcache immediately. */
-    if (tapdisk_server_mem_mode() == LOW_MEMORY_MODE) {
-        td_xenblkif_bufcache_free(blkif);
-    } else {
-        // We only set the expire event when no requests are inflight
-        if (blkif->n_reqs_free == blkif->ring_size)
-            td_xenblkif_bufcache_evt_reg(blkif);
+    /* like request buffers, give the memory back right away when low on it */
+    if (tapdisk_server_mem_mode() == LOW_MEMORY_MODE && indirect->vma) {
+        munmap(indirect->vma, TD_MAX_INDIRECT_SEGMENTS << XC_PAGE_SHIFT);
+        indirect->vma = NULL;
     }
 }
 
@@ -200,8 +164,12 @@ tapdisk_xenblkif_free_request(struct td_xenblkif * const blkif,
 
     blkif->reqs_free[blkif->ring_size - (++blkif->n_reqs_free)] = &tapreq->msg;
 
-	if (likely(tapreq->msg.nr_segments))
-	    td_xenblkif_bufcache_put(blkif, tapreq->vma);
+	if (unlikely(tapreq->mapped))
+		td_xenblkif_unmap_request(blkif, tapreq);
+	else if (unlikely(tapreq->indirect && tapreq->vma == tapreq->indirect->vma))
+		td_xenblkif_indirect_put(tapreq->indirect);
+	else if (likely(tapreq->nr_segments))
+	    tapdisk_xenio_ctx_buf_put(blkif->ctx, tapreq->vma);
 }
 
 /**
@@ -269,7 +237,9 @@ xenio_blkif_get_response(struct td_xenblkif* const blkif, const RING_IDX rp)
  * @param blkif the VBD
  * @param req the request for which the response should be put
  * @param status the status of the response (success or an error code)
- * @param final controls whether the front-end will be notified, if necessary
+ * @param final marks the end of a completion batch: the responses will be
+ * pushed and the front-end notified, if necessary, before the event loop
+ * waits again (see tapdisk_xenblkif_flush_responses)
  *
  * TODO @req can be NULL so the function will only notify the other end. This
  * is used in the error path of tapdisk_xenblkif_queue_requests. The point is
@@ -299,22 +269,28 @@ xenio_blkif_put_response(struct td_xenblkif * const blkif,
         ring->rsp_prod_pvt++;
     }
 
-    if (final) {
-        int notify;
-        RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(ring, notify);
-        if (notify) {
-            int err = xc_evtchn_notify(blkif->ctx->xce_handle, blkif->port);
-            if (err < 0) {
-                err = -errno;
-                if (req) {
-                    RING_ERR(blkif, "req %lu: failed to notify event channel: "
-                            "%s\n", req->msg.id, strerror(-err));
-                } else {
-                    RING_ERR(blkif, "failed to notify event channel: %s\n",
-                            strerror(-err));
-                }
-                return err;
-            }
+    if (final)
+        blkif->rsp_unpushed = true;
+
+    return 0;
+}
+
+int
+tapdisk_xenblkif_push_responses(struct td_xenblkif * const blkif)
+{
+    blkif_common_back_ring_t * const ring = &blkif->rings.common;
+    int notify;
+
+    blkif->rsp_unpushed = false;
+
+    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(ring, notify);
+    if (notify) {
+        int err = xc_evtchn_notify(blkif->ctx->xce_handle, blkif->port);
+        if (err < 0) {
+            err = -errno;
+            RING_ERR(blkif, "failed to notify event channel: %s\n",
+                    strerror(-err));
+            return err;
         }
     }
 
@@ -322,13 +298,25 @@ xenio_blkif_put_response(struct td_xenblkif * const blkif,
 }
 
 
+/**
+ * Returns the operation of the request, looking through BLKIF_OP_INDIRECT.
+ */
+static inline uint8_t
+blkif_rq_op(blkif_request_t const * const msg)
+{
+	if (BLKIF_OP_INDIRECT == msg->operation)
+		return ((blkif_request_indirect_t const *)msg)->indirect_op;
+
+	return msg->operation;
+}
+
 /**
  * Tells whether the request requires data to be read.
  */
 static inline bool
 blkif_rq_rd(blkif_request_t const * const msg)
 {
-	return BLKIF_OP_READ == msg->operation;
+	return BLKIF_OP_READ == blkif_rq_op(msg);
 }
 
 
@@ -338,7 +326,7 @@ blkif_rq_rd(blkif_request_t const * const msg)
 static inline bool
 blkif_rq_wr(blkif_request_t const * const msg)
 {
-	return BLKIF_OP_WRITE == msg->operation ||
+	return BLKIF_OP_WRITE == blkif_rq_op(msg) ||
 		(BLKIF_OP_WRITE_BARRIER == msg->operation && msg->nr_segments);
 }
 
@@ -353,93 +341,191 @@ blkif_rq_data(blkif_request_t const * const msg)
 }
 
 
+static inline td_profile_t *
+tapdisk_xenblkif_profile(const struct td_xenblkif * const blkif)
+{
+    return blkif->vbd ? blkif->vbd->profile : NULL;
+}
+
+/**
+ * Grant-copies the data of several requests with a single ioctl: from the
+ * guest for writes, to the guest for reads. All the requests must go in the
+ * same direction. The outcome of each request is stored in its gcopy_err.
+ *
+ * @param blkif the block interface
+ * @param reqs the requests to copy
+ * @param nr_reqs number of requests
+ * @returns 0 if all the requests were copied, -errno otherwise
+ */
 static int
-guest_copy2(struct td_xenblkif * const blkif,
-        struct td_xenblkif_req * const tapreq /* TODO rename to req */) {
+__guest_copy(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const reqs[], const int nr_reqs) {
 
-    int i = 0;
+    int i, j, n;
     long err = 0;
     struct ioctl_gntdev_grant_copy gcopy;
+    struct gntdev_grant_copy_segment *gcopy_seg;
+    const bool write = blkif_rq_wr(&reqs[0]->msg);
 
     ASSERT(blkif);
     ASSERT(blkif->ctx);
-    ASSERT(tapreq);
-    ASSERT(blkif_rq_data(&tapreq->msg));
-	ASSERT(tapreq->msg.nr_segments > 0);
-	ASSERT(tapreq->msg.nr_segments <= ARRAY_SIZE(tapreq->gcopy_segs));
+    ASSERT(blkif->gcopy_segs);
+    ASSERT(nr_reqs > 0 && nr_reqs <= blkif->ring_size);
 
-    for (i = 0; i < tapreq->msg.nr_segments; i++) {
-        struct blkif_request_segment *blkif_seg = &tapreq->msg.seg[i];
-        struct gntdev_grant_copy_segment *gcopy_seg = &tapreq->gcopy_segs[i];
+    gcopy_seg = blkif->gcopy_segs;
+
+    for (n = 0; n < nr_reqs; n++) {
+        struct td_xenblkif_req * const tapreq = reqs[n];
+
+        ASSERT(blkif_rq_data(&tapreq->msg));
+        ASSERT(blkif_rq_wr(&tapreq->msg) == write);
+        ASSERT(tapreq->nr_segments > 0);
+        ASSERT(tapreq->nr_segments <= blkif->gcopy_max_segs);
+
+        tapreq->gcopy_err = 0;
+
+        for (i = 0; i < tapreq->nr_segments; i++, gcopy_seg++) {
+            struct blkif_request_segment *blkif_seg = &tapreq->seg[i];
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
-        if (blkif_rq_wr(&tapreq->msg)) {
-            /* copy from guest */
-            gcopy_seg->dest.virt = tapreq->vma + (i << PAGE_SHIFT)
-                + (blkif_seg->first_sect << SECTOR_SHIFT);
-            gcopy_seg->source.foreign.ref = blkif_seg->gref;
-            gcopy_seg->source.foreign.offset = blkif_seg->first_sect << SECTOR_SHIFT;
-            gcopy_seg->source.foreign.domid = blkif->domid;
-            gcopy_seg->flags = GNTCOPY_source_gref;
-        } else {
-            /* copy to guest */
-            gcopy_seg->source.virt = tapreq->vma + (i << PAGE_SHIFT)
-                + (blkif_seg->first_sect << SECTOR_SHIFT);
-            gcopy_seg->dest.foreign.ref = blkif_seg->gref;
-            gcopy_seg->dest.foreign.offset = blkif_seg->first_sect << SECTOR_SHIFT;
-            gcopy_seg->dest.foreign.domid = blkif->domid;
-            gcopy_seg->flags = GNTCOPY_dest_gref;
-        }
+            if (write) {
+                /* copy from guest */
+                gcopy_seg->dest.virt = tapreq->vma + (i << PAGE_SHIFT)
+                    + (blkif_seg->first_sect << SECTOR_SHIFT);
+                gcopy_seg->source.foreign.ref = blkif_seg->gref;
+                gcopy_seg->source.foreign.offset = blkif_seg->first_sect << SECTOR_SHIFT;
+                gcopy_seg->source.foreign.domid = blkif->domid;
+                gcopy_seg->flags = GNTCOPY_source_gref;
+            } else {
+                /* copy to guest */
+                gcopy_seg->source.virt = tapreq->vma + (i << PAGE_SHIFT)
+                    + (blkif_seg->first_sect << SECTOR_SHIFT);
+                gcopy_seg->dest.foreign.ref = blkif_seg->gref;
+                gcopy_seg->dest.foreign.offset = blkif_seg->first_sect << SECTOR_SHIFT;
+                gcopy_seg->dest.foreign.domid = blkif->domid;
+                gcopy_seg->flags = GNTCOPY_dest_gref;
+            }
 
-        gcopy_seg->len = (blkif_seg->last_sect
-                - blkif_seg->first_sect
-                + 1)
-            << SECTOR_SHIFT;
-    }
+            gcopy_seg->len = (blkif_seg->last_sect
+                    - blkif_seg->first_sect
+                    + 1)
+                << SECTOR_SHIFT;
 #else
-        gcopy_seg->iov.iov_base = tapreq->vma + (i << PAGE_SHIFT)
-            + (blkif_seg->first_sect << SECTOR_SHIFT);
-        gcopy_seg->iov.iov_len = (blkif_seg->last_sect
-                - blkif_seg->first_sect
-                + 1)
-            << SECTOR_SHIFT;
-        gcopy_seg->ref = blkif_seg->gref;
-        gcopy_seg->offset = blkif_seg->first_sect << SECTOR_SHIFT;
+            gcopy_seg->iov.iov_base = tapreq->vma + (i << PAGE_SHIFT)
+                + (blkif_seg->first_sect << SECTOR_SHIFT);
+            gcopy_seg->iov.iov_len = (blkif_seg->last_sect
+                    - blkif_seg->first_sect
+                    + 1)
+                << SECTOR_SHIFT;
+            gcopy_seg->ref = blkif_seg->gref;
+            gcopy_seg->offset = blkif_seg->first_sect << SECTOR_SHIFT;
+#endif
+        }
     }
 
-    gcopy.dir = blkif_rq_wr(&tapreq->msg);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+    gcopy.dir = write;
     gcopy.domid = blkif->domid;
 #endif
-    gcopy.count = tapreq->msg.nr_segments;
-	gcopy.segments = tapreq->gcopy_segs;
+    gcopy.count = gcopy_seg - blkif->gcopy_segs;
+	gcopy.segments = blkif->gcopy_segs;
 
+    TD_PROBE4(guest_copy, blkif->domid, blkif->devid, gcopy.count, write);
     err = -ioctl(blkif->ctx->gntdev_fd, IOCTL_GNTDEV_GRANT_COPY, &gcopy);
+    TD_PROBE4(guest_copy_done, blkif->domid, blkif->devid, gcopy.count, err);
     if (err) {
         err = -errno;
-        RING_ERR(blkif, "failed to grant-copy request %"PRIu64" "
-                "(%d segments): %s\n", tapreq->msg.id,
-                tapreq->msg.nr_segments, strerror(-err));
+        RING_ERR(blkif, "failed to grant-copy %d requests (%d segments): "
+                "%s\n", nr_reqs, gcopy.count, strerror(-err));
+        for (n = 0; n < nr_reqs; n++)
+            reqs[n]->gcopy_err = err;
         goto out;
     }
 
-	for (i = 0; i < tapreq->msg.nr_segments; i++) {
-		struct gntdev_grant_copy_segment *gcopy_seg = &tapreq->gcopy_segs[i];
-		if (gcopy_seg->status != GNTST_okay) {
-			/*
-			 * TODO use gnttabop_error for reporting errors, defined in
-			 * xen/extras/mini-os/include/gnttab.h (header not available to
-			 * user space)
-			 */
-			RING_ERR(blkif, "req %lu: failed to grant-copy segment %d: %d\n",
-                    tapreq->msg.id, i, gcopy_seg->status);
-			err = -EIO;
-			goto out;
-		}
-	}
+    gcopy_seg = blkif->gcopy_segs;
+
+    for (n = 0; n < nr_reqs; n++) {
+        struct td_xenblkif_req * const tapreq = reqs[n];
+
+        for (j = 0; j < tapreq->nr_segments; j++, gcopy_seg++) {
+            if (gcopy_seg->status != GNTST_okay && !tapreq->gcopy_err) {
+                /*
+                 * TODO use gnttabop_error for reporting errors, defined in
+                 * xen/extras/mini-os/include/gnttab.h (header not available to
+                 * user space)
+                 */
+                RING_ERR(blkif, "req %lu: failed to grant-copy segment %d: %d\n",
+                        tapreq->msg.id, j, gcopy_seg->status);
+                tapreq->gcopy_err = -EIO;
+                err = -EIO;
+            }
+        }
+    }
 
 out:
     return err;
 }
 
+/**
+ * Grant-copies the data of several requests, with as few ioctls as the
+ * segment array of the ring allows. See __guest_copy.
+ */
+static int
+guest_copy(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const reqs[], const int nr_reqs) {
+
+    int i, n, nr_segs, err = 0, _err;
+    td_profile_t *prof = tapdisk_xenblkif_profile(blkif);
+    uint64_t start = tapdisk_profile_now(prof);
+
+    for (i = 0; i < nr_reqs; i += n) {
+        nr_segs = 0;
+        for (n = 0; i + n < nr_reqs; n++) {
+            if (nr_segs + reqs[i + n]->nr_segments > blkif->gcopy_max_segs)
+                break;
+            nr_segs += reqs[i + n]->nr_segments;
+        }
+
+        _err = __guest_copy(blkif, reqs + i, n);
+        if (_err)
+            err = _err;
+    }
+
+    tapdisk_profile_add(prof, TD_PROF_GRANT, start);
+
+    return err;
+}
+
+/**
+ * Copies the data of the reads put aside by __tapdisk_xenblkif_request_cb to
+ * the guest, and completes them.
+ *
+ * @param blkif the block interface
+ * @param final controls whether the other end should be notified
+ */
+static void
+tapdisk_xenblkif_complete_reads(struct td_xenblkif * const blkif,
+        const int final)
+{
+    int i, n = blkif->n_gcopy_reqs;
+
+    if (!n)
+        return;
+
+    guest_copy(blkif, blkif->gcopy_reqs, n);
+    blkif->n_gcopy_reqs = 0;
+
+    for (i = 0; i < n; i++) {
+        struct td_xenblkif_req *tapreq = blkif->gcopy_reqs[i];
+
+        if (tapreq->gcopy_err)
+            RING_ERR(blkif, "req %lu: failed to copy to guest: %s\n",
+                    tapreq->msg.id, strerror(-tapreq->gcopy_err));
+
+        tapdisk_xenblkif_complete_request(blkif, tapreq, tapreq->gcopy_err,
+                final && i == n - 1);
+    }
+}
+
 
 /**
  * Completes a request. If this is the last pending request of a dead block
@@ -457,9 +543,10 @@ tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
 {
 	int _err;
     long long *max = NULL, *sum = NULL, *cnt = NULL;
-	static int depth = 0;
+	static __thread int depth = 0;
 	bool processing_barrier_message;
     uint64_t *ticks = NULL;
+    uint64_t start;
 
     ASSERT(blkif);
     ASSERT(tapreq);
@@ -481,7 +568,7 @@ tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
 	 */
 	if (unlikely(processing_barrier_message)) {
 		ASSERT(blkif->barrier.msg == &tapreq->msg);
-		if (tapreq->msg.nr_segments && !blkif->barrier.io_done) {
+		if (tapreq->nr_segments && !blkif->barrier.io_done) {
 			blkif->barrier.io_err = err;
 			blkif->barrier.io_done = true;
 		}
@@ -502,14 +589,6 @@ tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
 			}
 			blkif->vbd_stats.stats->read_reqs_completed++;
 			ticks = &blkif->vbd_stats.stats->read_total_ticks;
-			if (likely(!err)) {
-				_err = guest_copy2(blkif, tapreq);
-				if (unlikely(_err)) {
-					err = _err;
-					RING_ERR(blkif, "req %lu: failed to copy from/to guest: "
-							"%s\n", tapreq->msg.id, strerror(-err));
-				}
-			}
 		} else if (blkif_rq_wr(&tapreq->msg)) {
 			if (likely(blkif->stats.xenvbd)) {
 				cnt = &blkif->stats.xenvbd->st_wr_cnt;
@@ -531,6 +610,17 @@ tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
 
 			*sum += interval;
 			*cnt += 1;
+
+			if (likely(blkif->stats.latency)) {
+				unsigned long long secs = 0;
+				int i;
+
+				for (i = 0; i < tapreq->vreq.iovcnt; i++)
+					secs += tapreq->vreq.iov[i].secs;
+				tapdisk_xenblkif_latency_add(blkif->stats.latency,
+						blkif_rq_wr(&tapreq->msg), secs << SECTOR_SHIFT,
+						interval);
+			}
 		}
 
 		if (likely(err == 0))
@@ -538,7 +628,16 @@ tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
 		else
             _err = BLKIF_RSP_ERROR;
 
+		start = tapdisk_profile_now(tapdisk_xenblkif_profile(blkif));
+
+		/* the guest may reuse the grants as soon as it sees the response */
+		if (tapreq->mapped)
+			td_xenblkif_unmap_request(blkif, tapreq);
+
 		xenio_blkif_put_response(blkif, tapreq, _err, final);
+
+		tapdisk_profile_add(tapdisk_xenblkif_profile(blkif),
+				TD_PROF_RESPONSE, start);
 	}
 
     tapdisk_xenblkif_free_request(blkif, tapreq);
@@ -612,6 +711,19 @@ __tapdisk_xenblkif_request_cb(struct td_vbd_request * const vreq,
         }
     }
 
+    /*
+     * Successful reads are put aside until the last completion of this
+     * batch, so that their data is copied to the guest in one go.
+     */
+    if (likely(!error && !blkif->dead && !tapreq->mapped &&
+                blkif_rq_rd(&tapreq->msg))) {
+        blkif->gcopy_reqs[blkif->n_gcopy_reqs++] = tapreq;
+        if (final)
+            tapdisk_xenblkif_complete_reads(blkif, 1);
+        return;
+    }
+
+    tapdisk_xenblkif_complete_reads(blkif, 0);
     tapdisk_xenblkif_complete_request(blkif, tapreq, error, final);
 }
 
@@ -633,26 +745,36 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
     vreq = &req->vreq;
     ASSERT(vreq);
 
-    req->vma = td_xenblkif_bufcache_get(blkif);
-    if (unlikely(!req->vma)) {
-        err = errno;
-        goto out;
-    }
-
-    for (i = 0; i < req->msg.nr_segments; i++) {
-        struct blkif_request_segment *seg = &req->msg.seg[i];
+    for (i = 0; i < req->nr_segments; i++) {
+        struct blkif_request_segment *seg = &req->seg[i];
         req->gref[i] = seg->gref;
 
         /*
          * Note that first and last may be equal, which means only one sector
          * must be transferred.
          */
-        if (seg->last_sect < seg->first_sect) {
+        if (seg->last_sect < seg->first_sect ||
+                seg->last_sect >= XC_PAGE_SIZE >> SECTOR_SHIFT) {
             RING_ERR(blkif, "req %lu: invalid sectors %d-%d\n",
                     req->msg.id, seg->first_sect, seg->last_sect);
             err = EINVAL;
             goto out;
         }
+
+        nr_sect += seg->last_sect - seg->first_sect + 1;
+    }
+
+    req->vma = td_xenblkif_map_request(blkif, req,
+            (size_t)nr_sect << SECTOR_SHIFT);
+    if (!req->vma) {
+        if (req->indirect && req->seg == req->indirect->seg)
+            req->vma = td_xenblkif_indirect_get(req->indirect);
+        else
+            req->vma = tapdisk_xenio_ctx_buf_get(blkif->ctx);
+        if (unlikely(!req->vma)) {
+            err = errno;
+            goto out;
+        }
     }
 
     /*
@@ -668,8 +790,8 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
     last = NULL;
     page = req->vma;
 
-    for (i = 0; i < req->msg.nr_segments; i++) { /* for each segment */
-        struct blkif_request_segment *seg = &req->msg.seg[i];
+    for (i = 0; i < req->nr_segments; i++) { /* for each segment */
+        struct blkif_request_segment *seg = &req->seg[i];
         size_t size;
 
         /* TODO check that first_sect/last_sect are within page */
@@ -686,20 +808,14 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
 
         last = iov->base + (iov->secs << SECTOR_SHIFT);
         page += XC_PAGE_SIZE;
-        nr_sect += size;
     }
 
     vreq->iov = req->iov;
     vreq->iovcnt = iov - req->iov + 1;
     vreq->sec = req->msg.sector_number;
 
+    /* write data is copied from the guest by the caller */
     if (blkif_rq_wr(&req->msg)) {
-        err = guest_copy2(blkif, req);
-        if (err) {
-            RING_ERR(blkif, "req %lu: failed to copy from guest: %s\n",
-                    req->msg.id, strerror(-err));
-            goto out;
-        }
 		if (likely(blkif->stats.xenvbd))
 			blkif->stats.xenvbd->st_wr_sect += nr_sect;
         blkif->vbd_stats.stats->write_sectors += nr_sect;
@@ -725,6 +841,174 @@ out:
 }
 
 
+/**
+ * Initialises the VBD request of a BLKIF_OP_DISCARD request: a single
+ * vector without a buffer that spans the discarded sectors.
+ *
+ * @param blkif the block interface
+ * @param req the request to prepare
+ * @returns 0 on success, a positive error code otherwise
+ */
+static inline int
+tapdisk_xenblkif_parse_discard(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const req)
+{
+    blkif_request_discard_t *msg = (blkif_request_discard_t *)&req->msg;
+    td_vbd_request_t *vreq = &req->vreq;
+
+    if (unlikely(!msg->nr_sectors || msg->nr_sectors > INT_MAX)) {
+        RING_ERR(blkif, "req %lu: invalid discard of %"PRIu64" sectors\n",
+                req->msg.id, (uint64_t)msg->nr_sectors);
+        return EINVAL;
+    }
+
+    req->iov[0].base = NULL;
+    req->iov[0].secs = msg->nr_sectors;
+
+    vreq->iov = req->iov;
+    vreq->iovcnt = 1;
+    vreq->sec = msg->sector_number;
+
+    snprintf(req->name, sizeof(req->name), "xenvbd-%d-%d.%"SCNx64"",
+             blkif->domid, blkif->devid, req->msg.id);
+
+    vreq->name = req->name;
+    vreq->token = blkif;
+    vreq->cb = __tapdisk_xenblkif_request_cb;
+
+    return 0;
+}
+
+/**
+ * Prepares a BLKIF_OP_FLUSH_DISKCACHE request. It carries no data and is
+ * issued as a single sector at 0, so that it gets accounted for like any
+ * other request.
+ *
+ * @param blkif the block interface
+ * @param req the request to prepare
+ * @returns 0 on success, a positive error code otherwise
+ */
+static inline int
+tapdisk_xenblkif_parse_flush(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const req)
+{
+    td_vbd_request_t *vreq = &req->vreq;
+
+    req->iov[0].base = NULL;
+    req->iov[0].secs = 1;
+
+    vreq->iov = req->iov;
+    vreq->iovcnt = 1;
+    vreq->sec = 0;
+
+    snprintf(req->name, sizeof(req->name), "xenvbd-%d-%d.%"SCNx64"",
+             blkif->domid, blkif->devid, req->msg.id);
+
+    vreq->name = req->name;
+    vreq->token = blkif;
+    vreq->cb = __tapdisk_xenblkif_request_cb;
+
+    return 0;
+}
+
+
+/**
+ * Reads the segments of a BLKIF_OP_INDIRECT request from the indirect pages
+ * it references. The request then uses the indirect storage of its slot.
+ *
+ * @param blkif the block interface
+ * @param tapreq the request
+ * @returns 0 on success, an error code otherwise
+ */
+static int
+tapdisk_xenblkif_get_indirect(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const tapreq)
+{
+    blkif_request_indirect_t * const msg =
+        (blkif_request_indirect_t *)&tapreq->msg;
+    struct gntdev_grant_copy_segment
+        gcopy_segs[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
+    struct ioctl_gntdev_grant_copy gcopy;
+    struct td_xenblkif_indirect *indirect;
+    int i, nr_pages, nr_segments;
+
+    nr_segments = msg->nr_segments;
+
+    if (unlikely(msg->indirect_op != BLKIF_OP_READ &&
+                msg->indirect_op != BLKIF_OP_WRITE)) {
+        RING_ERR(blkif, "req %lu: invalid indirect request type %d\n",
+                msg->id, msg->indirect_op);
+        return EOPNOTSUPP;
+    }
+
+    if (unlikely(!nr_segments || nr_segments > TD_MAX_INDIRECT_SEGMENTS)) {
+        RING_ERR(blkif, "req %lu: bad number of indirect segments (%d)\n",
+                msg->id, nr_segments);
+        return EINVAL;
+    }
+
+    indirect = tapreq->indirect;
+    if (!indirect) {
+        indirect = calloc(1, sizeof(*indirect));
+        if (unlikely(!indirect))
+            return ENOMEM;
+        tapreq->indirect = indirect;
+    }
+
+    nr_pages = (nr_segments + TD_SEGS_PER_INDIRECT_FRAME - 1)
+        / TD_SEGS_PER_INDIRECT_FRAME;
+
+    for (i = 0; i < nr_pages; i++) {
+        struct gntdev_grant_copy_segment *gcopy_seg = &gcopy_segs[i];
+        int n = nr_segments - i * TD_SEGS_PER_INDIRECT_FRAME;
+
+        if (n > TD_SEGS_PER_INDIRECT_FRAME)
+            n = TD_SEGS_PER_INDIRECT_FRAME;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+        gcopy_seg->dest.virt = indirect->seg + i * TD_SEGS_PER_INDIRECT_FRAME;
+        gcopy_seg->source.foreign.ref = msg->indirect_grefs[i];
+        gcopy_seg->source.foreign.offset = 0;
+        gcopy_seg->source.foreign.domid = blkif->domid;
+        gcopy_seg->flags = GNTCOPY_source_gref;
+        gcopy_seg->len = n * sizeof(struct blkif_request_segment);
+#else
+        gcopy_seg->iov.iov_base = indirect->seg + i * TD_SEGS_PER_INDIRECT_FRAME;
+        gcopy_seg->iov.iov_len = n * sizeof(struct blkif_request_segment);
+        gcopy_seg->ref = msg->indirect_grefs[i];
+        gcopy_seg->offset = 0;
+#endif
+    }
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+    gcopy.dir = 1;
+    gcopy.domid = blkif->domid;
+#endif
+    gcopy.count = nr_pages;
+    gcopy.segments = gcopy_segs;
+
+    if (ioctl(blkif->ctx->gntdev_fd, IOCTL_GNTDEV_GRANT_COPY, &gcopy)) {
+        RING_ERR(blkif, "req %lu: failed to grant-copy %d indirect pages: "
+                "%s\n", msg->id, nr_pages, strerror(errno));
+        return errno;
+    }
+
+    for (i = 0; i < nr_pages; i++) {
+        if (gcopy_segs[i].status != GNTST_okay) {
+            RING_ERR(blkif, "req %lu: failed to grant-copy indirect page %d: "
+                    "%d\n", msg->id, i, gcopy_segs[i].status);
+            return EIO;
+        }
+    }
+
+    tapreq->nr_segments = nr_segments;
+    tapreq->seg = indirect->seg;
+    tapreq->iov = indirect->iov;
+    tapreq->gref = indirect->gref;
+
+    return 0;
+}
+
 /**
  * Initialises the standard tapdisk request (td_vbd_request_t) from the
  * intermediate ring request (td_xenblkif_req) in order to prepare it
@@ -741,6 +1025,7 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
         struct td_xenblkif_req * const tapreq)
 {
     int err = 0;
+    int max_segments;
     td_vbd_request_t *vreq;
 
     ASSERT(tapreq);
@@ -750,7 +1035,22 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
     memset(vreq, 0, sizeof(*vreq));
 
 	tapreq->vma = NULL;
-    switch (tapreq->msg.operation) {
+	tapreq->mapped = false;
+	tapreq->nr_segments = tapreq->msg.nr_segments;
+	tapreq->seg = tapreq->msg.seg;
+	tapreq->iov = tapreq->direct_iov;
+	tapreq->gref = tapreq->direct_gref;
+	max_segments = BLKIF_MAX_SEGMENTS_PER_REQUEST;
+
+	if (tapreq->msg.operation == BLKIF_OP_INDIRECT) {
+		tapreq->nr_segments = 0;
+		err = tapdisk_xenblkif_get_indirect(blkif, tapreq);
+		if (unlikely(err))
+			goto out;
+		max_segments = TD_MAX_INDIRECT_SEGMENTS;
+	}
+
+    switch (blkif_rq_op(&tapreq->msg)) {
     case BLKIF_OP_READ:
         if (likely(blkif->stats.xenvbd))
 			blkif->stats.xenvbd->st_rd_req++;
@@ -766,6 +1066,28 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
         tapreq->prot = PROT_READ;
         vreq->op = TD_OP_WRITE;
         break;
+    case BLKIF_OP_DISCARD:
+        if (likely(blkif->stats.xenvbd))
+			blkif->stats.xenvbd->st_ds_req++;
+        /* the byte that holds nr_segments is the discard flag */
+        tapreq->nr_segments = 0;
+        vreq->op = TD_OP_DISCARD;
+        break;
+    case BLKIF_OP_FLUSH_DISKCACHE:
+        if (likely(blkif->stats.xenvbd))
+			blkif->stats.xenvbd->st_f_req++;
+        /*
+         * Frontends which see feature-flush-cache leave FUA to the flushes,
+         * which never carry data.
+         */
+        if (unlikely(tapreq->nr_segments)) {
+            RING_ERR(blkif, "req %lu: flush with %d segments\n",
+                    tapreq->msg.id, tapreq->nr_segments);
+            err = EOPNOTSUPP;
+            goto out;
+        }
+        vreq->op = TD_OP_FLUSH;
+        break;
     default:
         RING_ERR(blkif, "req %lu: invalid request type %d\n",
                 tapreq->msg.id, tapreq->msg.operation);
@@ -778,16 +1100,22 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
     /*
      * Check that the number of segments is sane.
      */
-    if (unlikely((tapreq->msg.nr_segments == 0 &&
-                tapreq->msg.operation != BLKIF_OP_WRITE_BARRIER) ||
-            tapreq->msg.nr_segments > BLKIF_MAX_SEGMENTS_PER_REQUEST)) {
+    if (unlikely((tapreq->nr_segments == 0 &&
+                tapreq->msg.operation != BLKIF_OP_WRITE_BARRIER &&
+                tapreq->msg.operation != BLKIF_OP_DISCARD &&
+                tapreq->msg.operation != BLKIF_OP_FLUSH_DISKCACHE) ||
+            tapreq->nr_segments > max_segments)) {
         RING_ERR(blkif, "req %lu: bad number of segments in request (%d)\n",
-                tapreq->msg.id, tapreq->msg.nr_segments);
+                tapreq->msg.id, tapreq->nr_segments);
         err = EINVAL;
         goto out;
     }
 
-    if (likely(tapreq->msg.nr_segments))
+    if (unlikely(tapreq->msg.operation == BLKIF_OP_DISCARD))
+        err = tapdisk_xenblkif_parse_discard(blkif, tapreq);
+    else if (unlikely(tapreq->msg.operation == BLKIF_OP_FLUSH_DISKCACHE))
+        err = tapdisk_xenblkif_parse_flush(blkif, tapreq);
+    else if (likely(tapreq->nr_segments))
         err = tapdisk_xenblkif_parse_request(blkif, tapreq);
     /*
      * If we only got one request from the ring and that was a barrier one,
@@ -807,64 +1135,31 @@ out:
 }
 
 
-/**
- * Queues a ring request, after it prepares it, to the standard taodisk queue
- * for processing.
- *
- * @param blkif the block interface
- * @param msg the ring request
- * @param tapreq the intermediate request TODO rename to req
- *
- * TODO don't really need to supply the ring request since it's either way
- * contained in the tapreq
- *
- * XXX only called by tapdisk_xenblkif_queue_requests
- */
-static inline int
-tapdisk_xenblkif_queue_request(struct td_xenblkif * const blkif,
-        blkif_request_t *msg, struct td_xenblkif_req *tapreq)
-{
-    int err;
-
-    ASSERT(blkif);
-    ASSERT(msg);
-    ASSERT(tapreq);
-
-    err = tapdisk_xenblkif_make_vbd_request(blkif, tapreq);
-    if (unlikely(err)) {
-        /* TODO log error */
-        blkif->stats.errors.map++;
-        return err;
-    }
-
-	if (likely(tapreq->msg.nr_segments)) {
-		err = tapdisk_vbd_queue_request(blkif->vbd, &tapreq->vreq);
-		if (unlikely(err)) {
-			/* TODO log error */
-			blkif->stats.errors.vbd++;
-			return err;
-		}
-	}
-
-    return 0;
-}
-
-
 void
 tapdisk_xenblkif_queue_requests(struct td_xenblkif * const blkif,
         blkif_request_t *reqs[], const int nr_reqs)
 {
-    int i;
+    int i, n;
     int err;
     int nr_errors = 0;
+    int nr_copies = 0;
+    td_profile_t *prof;
+    uint64_t start;
 
     ASSERT(blkif);
     ASSERT(reqs);
     ASSERT(nr_reqs >= 0);
 
-    for (i = 0; i < nr_reqs; i++) { /* for each request in the ring... */
+    prof = tapdisk_xenblkif_profile(blkif);
+
+    /*
+     * Prepares the requests, keeping in reqs the ones that carry data, and
+     * puts aside the writes whose data must be grant-copied.
+     */
+    for (i = 0, n = 0; i < nr_reqs; i++) { /* for each request in the ring... */
         blkif_request_t *msg = reqs[i];
         struct td_xenblkif_req *tapreq;
+        bool nodata;
 
         ASSERT(msg);
 
@@ -872,9 +1167,55 @@ tapdisk_xenblkif_queue_requests(struct td_xenblkif * const blkif,
 
         ASSERT(tapreq);
 
-        err = tapdisk_xenblkif_queue_request(blkif, msg, tapreq);
-        if (err) {
+        TD_PROBE4(xenblkif_queue, blkif->domid, blkif->devid, msg->id,
+                blkif_rq_op(msg));
+
+        /* a barrier without data may complete right away */
+        nodata = tapreq->msg.operation == BLKIF_OP_WRITE_BARRIER &&
+            !tapreq->msg.nr_segments;
+
+        start = tapdisk_profile_now(prof);
+        err = tapdisk_xenblkif_make_vbd_request(blkif, tapreq);
+        tapdisk_profile_add(prof, TD_PROF_RING, start);
+        if (unlikely(err)) {
             /* TODO log error */
+            blkif->stats.errors.map++;
+            nr_errors++;
+            tapdisk_xenblkif_complete_request(blkif, tapreq, err, 1);
+            continue;
+        }
+
+        if (likely(!nodata)) {
+            reqs[n++] = msg;
+            tapreq->gcopy_err = 0;
+            if (blkif_rq_wr(&tapreq->msg) && !tapreq->mapped)
+                blkif->gcopy_reqs[nr_copies++] = tapreq;
+        }
+    }
+
+    /*
+     * One grant copy for the data of all the writes in this batch.
+     */
+    if (nr_copies)
+        guest_copy(blkif, blkif->gcopy_reqs, nr_copies);
+
+    for (i = 0; i < n; i++) {
+        struct td_xenblkif_req *tapreq = msg_to_tapreq(reqs[i]);
+
+        err = tapreq->gcopy_err;
+        if (unlikely(err)) {
+            RING_ERR(blkif, "req %lu: failed to copy from guest: %s\n",
+                    tapreq->msg.id, strerror(-err));
+            blkif->stats.errors.map++;
+        } else {
+            err = tapdisk_vbd_queue_request(blkif->vbd, &tapreq->vreq);
+            if (unlikely(err)) {
+                /* TODO log error */
+                blkif->stats.errors.vbd++;
+            }
+        }
+
+        if (unlikely(err)) {
             nr_errors++;
             tapdisk_xenblkif_complete_request(blkif, tapreq, err, 1);
         }
@@ -891,10 +1232,19 @@ tapdisk_xenblkif_queue_requests(struct td_xenblkif * const blkif,
 void
 tapdisk_xenblkif_reqs_free(struct td_xenblkif * const blkif)
 {
+    int i;
+
     ASSERT(blkif);
 
-    td_xenblkif_bufcache_free(blkif);
-    td_xenblkif_bufcache_evt_unreg(blkif);
+    for (i = 0; blkif->reqs && i < blkif->ring_size; i++) {
+        struct td_xenblkif_indirect *indirect = blkif->reqs[i].indirect;
+
+        if (!indirect)
+            continue;
+        if (indirect->vma)
+            munmap(indirect->vma, TD_MAX_INDIRECT_SEGMENTS << XC_PAGE_SHIFT);
+        free(indirect);
+    }
 
     free(blkif->reqs);
     blkif->reqs = NULL;
@@ -902,6 +1252,32 @@ tapdisk_xenblkif_reqs_free(struct td_xenblkif * const blkif)
     free(blkif->reqs_free);
     blkif->reqs_free = NULL;
 
+    free(blkif->gcopy_segs);
+    blkif->gcopy_segs = NULL;
+
+    free(blkif->gcopy_reqs);
+    blkif->gcopy_reqs = NULL;
+}
+
+/*
+ * TAPDISK3_GRANT_MAP_MIN=<bytes> maps the guest pages of requests of at
+ * least that size, the rest keep being grant-copied.
+ */
+static size_t
+td_xenblkif_grant_map_min(void)
+{
+    const char *val;
+    long long min;
+
+    val = getenv("TAPDISK3_GRANT_MAP_MIN");
+    if (!val)
+        return 0;
+
+    min = atoll(val);
+    if (min <= 0)
+        return 0;
+
+    return min;
 }
 
 int
@@ -934,19 +1310,29 @@ tapdisk_xenblkif_reqs_init(struct td_xenblkif *td_blkif)
     for (i = 0; i < td_blkif->ring_size; i++)
         tapdisk_xenblkif_free_request(td_blkif, &td_blkif->reqs[i]);
 
-    // Allocate the buffer cache
-    td_blkif->reqs_bufcache = malloc(sizeof(void*) * td_blkif->ring_size);
-    if (!td_blkif->reqs_bufcache) {
+    td_blkif->grant_map_min = td_xenblkif_grant_map_min();
+
+    /* big enough for a full ring, and for the largest indirect request */
+    td_blkif->gcopy_max_segs = td_blkif->ring_size *
+        BLKIF_MAX_SEGMENTS_PER_REQUEST;
+    if (td_blkif->gcopy_max_segs < TD_MAX_INDIRECT_SEGMENTS)
+        td_blkif->gcopy_max_segs = TD_MAX_INDIRECT_SEGMENTS;
+
+    td_blkif->gcopy_segs = malloc(td_blkif->gcopy_max_segs *
+            sizeof(*td_blkif->gcopy_segs));
+    td_blkif->gcopy_reqs = malloc(td_blkif->ring_size *
+            sizeof(*td_blkif->gcopy_reqs));
+    if (!td_blkif->gcopy_segs || !td_blkif->gcopy_reqs) {
         err = -errno;
         goto fail;
     }
-    td_blkif->n_reqs_bufcache_free = 0;
-    td_blkif->reqs_bufcache_evtid = 0;
+    td_blkif->n_gcopy_reqs = 0;
 
-    // Populate cache with one buffer
-    buf = td_xenblkif_bufcache_get(td_blkif);
-    td_xenblkif_bufcache_put(td_blkif, buf);
-    td_xenblkif_bufcache_evt_unreg(td_blkif);
+    /*
+     * Make sure the context has buffers before the first request comes in.
+     */
+    buf = tapdisk_xenio_ctx_buf_get(td_blkif->ctx);
+    tapdisk_xenio_ctx_buf_put(td_blkif->ctx, buf);
 
     return 0;
 
@@ -35,8 +35,24 @@
 #include <sys/types.h>
 #include <xen/io/blkif.h>
 #include <xen/gntdev.h>
+#include "xen_blkif.h"
 #include "td-blkif.h"
 
+/**
+ * Per-request storage for BLKIF_OP_INDIRECT requests, allocated the first
+ * time a request slot carries one and kept until the ring goes away.
+ */
+struct td_xenblkif_indirect {
+    struct blkif_request_segment seg[TD_MAX_INDIRECT_SEGMENTS];
+    struct td_iovec iov[TD_MAX_INDIRECT_SEGMENTS];
+    grant_ref_t gref[TD_MAX_INDIRECT_SEGMENTS];
+
+    /**
+     * Buffer of TD_MAX_INDIRECT_SEGMENTS pages, in place of a request buffer of the context.
+     */
+    void *vma;
+};
+
 /**
  * Representation of the intermediate request used to retrieve a request from
  * the shared ring and handle it over to the main tapdisk request processing
@@ -66,6 +82,12 @@ struct td_xenblkif_req {
      */
     void *vma;
 
+    /**
+     * Tells whether vma maps the guest pages, instead of being a request
+     * buffer the data must be grant-copied to or from.
+     */
+    bool mapped;
+
     /*
      * TODO Why 16+1? This member is copied to the corresponding one in
      * td_vbd_request_t, so check the limit of that, if there is one.
@@ -75,15 +97,32 @@ struct td_xenblkif_req {
     struct timeval ts;
 
     /**
-     * The scatter/gather list td_vbd_request_t.iov points to.
+     * Number of segments of the request, and the segments themselves: the
+     * ones in msg, or for BLKIF_OP_INDIRECT the ones read from the indirect
+     * pages.
      */
-    struct td_iovec iov[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    int nr_segments;
+    struct blkif_request_segment *seg;
+
+    /**
+     * The scatter/gather list td_vbd_request_t.iov points to, and the grant
+     * refs of the segments. Both point to the arrays below, or to the
+     * indirect ones.
+     */
+    struct td_iovec *iov;
+    grant_ref_t *gref;
+
+    struct td_iovec direct_iov[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    grant_ref_t direct_gref[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+
+    struct td_xenblkif_indirect *indirect;
 
-    grant_ref_t gref[BLKIF_MAX_SEGMENTS_PER_REQUEST];
     int prot;
 
-	struct gntdev_grant_copy_segment
-		gcopy_segs[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    /**
+     * Outcome of the last grant copy of this request's data.
+     */
+    int gcopy_err;
 };
 
 struct td_xenblkif;
@@ -131,6 +170,15 @@ void
 tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
         struct td_xenblkif_req* tapreq, int err, const int final);
 
+/**
+ * Pushes the responses put in the ring so far and notifies the front-end if
+ * it asked to.
+ *
+ * @returns 0 on success, -errno if the notification failed
+ */
+int
+tapdisk_xenblkif_push_responses(struct td_xenblkif * const blkif);
+
 #define msg_to_tapreq(_req) \
 	container_of(_req, struct td_xenblkif_req, msg)
 
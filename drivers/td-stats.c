@@ -32,10 +32,116 @@
 #include <xenctrl.h>
 
 #include "debug.h"
+#include "util.h"
 #include "tapdisk-log.h"
 #include "td-stats.h"
 #include "td-ctx.h"
 
+static int
+tapdisk_latency_bucket(unsigned long long usecs)
+{
+    int e;
+
+    if (usecs < BT3_LAT_SUB_BUCKETS)
+        return usecs;
+
+    e = 63 - __builtin_clzll(usecs);
+    if (e >= BT3_LAT_MAX_BITS)
+        return BT3_LAT_BUCKETS - 1;
+
+    return BT3_LAT_SUB_BUCKETS + (e - BT3_LAT_SUB_BITS) * BT3_LAT_SUB_BUCKETS
+        + ((usecs >> (e - BT3_LAT_SUB_BITS)) & (BT3_LAT_SUB_BUCKETS - 1));
+}
+
+/*
+ * Highest latency that falls into the bucket.
+ */
+static unsigned long long
+tapdisk_latency_bucket_max(int i)
+{
+    int k, e;
+
+    if (i < BT3_LAT_SUB_BUCKETS - 1)
+        return i;
+
+    k = i + 1 - BT3_LAT_SUB_BUCKETS;
+    e = k / BT3_LAT_SUB_BUCKETS + BT3_LAT_SUB_BITS;
+
+    return ((unsigned long long)(BT3_LAT_SUB_BUCKETS +
+                k % BT3_LAT_SUB_BUCKETS) << (e - BT3_LAT_SUB_BITS)) - 1;
+}
+
+void
+tapdisk_xenblkif_latency_add(struct blkback_latency *lat, int write,
+        unsigned long long bytes, long long usecs)
+{
+    int size;
+
+    if (bytes <= 4 << 10)
+        size = BT3_LAT_SIZE_4K;
+    else if (bytes <= 16 << 10)
+        size = BT3_LAT_SIZE_16K;
+    else if (bytes <= 64 << 10)
+        size = BT3_LAT_SIZE_64K;
+    else
+        size = BT3_LAT_SIZE_LARGE;
+
+    if (usecs < 0)
+        usecs = 0;
+
+    if (write)
+        lat->wr[size][tapdisk_latency_bucket(usecs)]++;
+    else
+        lat->rd[size][tapdisk_latency_bucket(usecs)]++;
+}
+
+/*
+ * Prints the count and the 50th, 99th and 99.9th percentiles of each size
+ * class that saw requests.
+ */
+static void
+tapdisk_latency_stats(td_stats_t * st, const char *name,
+        unsigned long long hist[BT3_LAT_SIZES][BT3_LAT_BUCKETS])
+{
+    static const char * const sizes[BT3_LAT_SIZES] = {
+        [BT3_LAT_SIZE_4K] = "4k",
+        [BT3_LAT_SIZE_16K] = "16k",
+        [BT3_LAT_SIZE_64K] = "64k",
+        [BT3_LAT_SIZE_LARGE] = "large",
+    };
+    static const int permille[] = {500, 990, 999};
+    static const char * const keys[] = {"p50", "p99", "p999"};
+    int size, i;
+    unsigned p;
+
+    tapdisk_stats_field(st, name, "{");
+
+    for (size = 0; size < BT3_LAT_SIZES; size++) {
+        unsigned long long count = 0, sum = 0;
+
+        for (i = 0; i < BT3_LAT_BUCKETS; i++)
+            count += hist[size][i];
+        if (!count)
+            continue;
+
+        tapdisk_stats_field(st, sizes[size], "{");
+        tapdisk_stats_field(st, "count", "llu", count);
+        for (i = 0, p = 0; i < BT3_LAT_BUCKETS && p < ARRAY_SIZE(permille);
+                i++) {
+            sum += hist[size][i];
+            while (p < ARRAY_SIZE(permille) &&
+                    sum * 1000 >= count * permille[p]) {
+                tapdisk_stats_field(st, keys[p], "llu",
+                        tapdisk_latency_bucket_max(i));
+                p++;
+            }
+        }
+        tapdisk_stats_leave(st, '}');
+    }
+
+    tapdisk_stats_leave(st, '}');
+}
+
 void
 tapdisk_xenblkif_stats(struct td_xenblkif * blkif, td_stats_t * st)
 {
@@ -46,6 +152,8 @@ tapdisk_xenblkif_stats(struct td_xenblkif * blkif, td_stats_t * st)
     tapdisk_stats_field(st, "pool", "s", blkif->ctx->pool);
     tapdisk_stats_field(st, "domid", "d", blkif->domid);
     tapdisk_stats_field(st, "devid", "d", blkif->devid);
+    if (blkif->queue)
+        tapdisk_stats_field(st, "queue", "d", blkif->queue);
 
     tapdisk_stats_field(st, "reqs", "[");
     tapdisk_stats_val(st, "llu", blkif->stats.reqs.in);
@@ -63,4 +171,14 @@ tapdisk_xenblkif_stats(struct td_xenblkif * blkif, td_stats_t * st)
     tapdisk_stats_field(st, "vbd", "llu", blkif->stats.errors.vbd);
     tapdisk_stats_field(st, "img", "llu", blkif->stats.errors.img);
     tapdisk_stats_leave(st, '}');
+
+    /*
+     * The other rings of a multi-queue device share these with ring 0.
+     */
+    if (!blkif->queue && blkif->stats.latency) {
+        tapdisk_stats_field(st, "latency", "{");
+        tapdisk_latency_stats(st, "read", blkif->stats.latency->rd);
+        tapdisk_latency_stats(st, "write", blkif->stats.latency->wr);
+        tapdisk_stats_leave(st, '}');
+    }
 }
@@ -50,8 +50,18 @@ struct td_xenblkif_stats {
     } errors;
 
 	struct blkback_stats *xenvbd;
+
+	struct blkback_latency *latency;
 };
 
+/**
+ * Accounts a request of @bytes bytes that took @usecs us into the read or
+ * write histograms.
+ */
+void
+tapdisk_xenblkif_latency_add(struct blkback_latency *lat, int write,
+		unsigned long long bytes, long long usecs);
+
 #include "td-blkif.h"
 struct td_xenblkif;
 
@@ -35,6 +35,8 @@
 #define BLKTAP2_CONTROL_NAME           "blktap/control"
 #define BLKTAP2_CONTROL_DIR            "/var/run/blktap-control"
 #define BLKTAP2_CONTROL_SOCKET         "ctl"
+#define BLKTAP2_LIST_DIR               BLKTAP2_CONTROL_DIR"/list"
+#define BLKTAP2_POOL_DIR               BLKTAP2_CONTROL_DIR"/pool"
 #define BLKTAP2_DIRECTORY              "/dev/xen/blktap-2"
 #define BLKTAP2_CONTROL_DEVICE         BLKTAP2_DIRECTORY"/control"
 #define BLKTAP2_RING_DEVICE            BLKTAP2_DIRECTORY"/blktap"
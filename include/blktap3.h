@@ -56,8 +56,7 @@ struct blkback_stats {
 	unsigned long long st_ds_req;
 
 	/**
-	 * BLKIF_OP_FLUSH_DISKCACHE, not currently supported in blktap3,
-	 * should always be zero
+	 * BLKIF_OP_FLUSH_DISKCACHE
 	 */
 	unsigned long long st_f_req;
 
@@ -125,4 +124,46 @@ struct blkback_stats {
 	unsigned long long flags;
 } __attribute__ ((aligned (8)));
 
+/**
+ * Latency histograms, log-linear: below BT3_LAT_SUB_BUCKETS us each value
+ * has a bucket of its own, above that each power of two is split into
+ * BT3_LAT_SUB_BUCKETS equal buckets, so a bucket is at most 25% wide.
+ * Latencies of 2^BT3_LAT_MAX_BITS us (about two minutes) and more land in
+ * the last bucket.
+ */
+#define BT3_LAT_VERSION         1
+#define BT3_LAT_SUB_BITS        2
+#define BT3_LAT_SUB_BUCKETS     (1 << BT3_LAT_SUB_BITS)
+#define BT3_LAT_MAX_BITS        27
+#define BT3_LAT_BUCKETS \
+	(BT3_LAT_SUB_BUCKETS * (BT3_LAT_MAX_BITS - BT3_LAT_SUB_BITS + 1))
+
+/**
+ * Request size classes, each with its own histograms.
+ */
+enum {
+	BT3_LAT_SIZE_4K,    /* up to 4 KiB */
+	BT3_LAT_SIZE_16K,   /* up to 16 KiB */
+	BT3_LAT_SIZE_64K,   /* up to 64 KiB */
+	BT3_LAT_SIZE_LARGE, /* more than 64 KiB */
+	BT3_LAT_SIZES
+};
+
+/**
+ * Request response time histograms, in us, per direction and size class.
+ */
+struct blkback_latency {
+	/**
+	 * BT3_LAT_VERSION, and the layout parameters so that readers can
+	 * check them.
+	 */
+	unsigned int version;
+	unsigned int sub_bits;
+	unsigned int buckets;
+	unsigned int sizes;
+
+	unsigned long long rd[BT3_LAT_SIZES][BT3_LAT_BUCKETS];
+	unsigned long long wr[BT3_LAT_SIZES][BT3_LAT_BUCKETS];
+} __attribute__ ((aligned (8)));
+
 #endif /* __BLKTAP_3_H__ */
@@ -31,11 +31,26 @@
 #ifndef _CBT_UTIL_H_
 #define _CBT_UTIL_H_
 
+#include <stdio.h>
+#include <stdint.h>
 #include <uuid/uuid.h>
 #include "../drivers/tapdisk-log.h"
 
 #define CBT_BLOCK_SIZE (64 * 1024)
 
+/*
+ * Optional fine layer: a log file long enough to hold it carries, after
+ * the coarse bitmap, CBT_FINE_PER_BLOCK bits per CBT block, one for each
+ * CBT_FINE_BLOCK_SIZE sub-block. The file is sparse and only the pages
+ * covering dirty blocks are ever written. A set coarse bit whose fine
+ * bits are all clear stands for the whole block.
+ */
+#define CBT_FINE_BLOCK_SIZE (4 * 1024)
+#define CBT_FINE_PER_BLOCK (CBT_BLOCK_SIZE / CBT_FINE_BLOCK_SIZE)
+
+/* bitmap bytes read at a time when walking changed extents */
+#define CBT_EXTENT_CHUNK (64 * 1024)
+
 struct cbt_log_metadata {
 	uuid_t 		parent;
 	uuid_t 		child;
@@ -62,5 +77,37 @@ bitmap_size(uint64_t sz)
 	return (roundup_div(num_blocks, 8));
 }
 
+static inline uint64_t
+fine_bitmap_size(uint64_t sz)
+{
+	// Whole blocks, so each block's sub-block bits share two bytes
+	return roundup_div(sz, CBT_BLOCK_SIZE) * (CBT_FINE_PER_BLOCK / 8);
+}
+
+static inline uint64_t
+fine_bitmap_offset(uint64_t sz)
+{
+	// Word aligned, so tapdisk can set bits a long at a time
+	return roundup_div(sizeof(struct cbt_log_metadata) + bitmap_size(sz),
+			   8) * 8;
+}
+
+/*
+ * Whether the log file behind @f, for a disk of @size bytes, has the
+ * fine layer. Streams without a file descriptor never do.
+ */
+int cbt_log_has_fine(FILE *f, uint64_t size);
+
+
+typedef int (*cbt_extent_fn_t)(uint64_t offset, uint64_t length, void *arg);
+
+/*
+ * Streams the bitmap following the metadata at the current position of @f
+ * and calls @fn for each maximal run of changed blocks, in bytes, clipped
+ * to the disk @size. Runs are narrowed to changed sub-blocks when the log
+ * has the fine layer. Stops at, and returns, the first non-zero result.
+ */
+int cbt_log_read_extents(FILE *f, uint64_t size, cbt_extent_fn_t fn,
+			 void *arg);
 
 #endif
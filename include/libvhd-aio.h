@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VHD_AIO_H_
+#define _VHD_AIO_H_
+
+#include <inttypes.h>
+
+#include "libvhd.h"
+
+#define VHD_AIO_READ               0x01
+#define VHD_AIO_WRITE              0x02
+
+/*
+ * Batched, asynchronous I/O on a vhd_context_t: requests are resolved
+ * through the BAT, the sector bitmaps and the parent chain when they are
+ * submitted, and the resulting extents are read or written with libaio,
+ * up to the depth given to vhd_aio_open() at a time. Buffers must be
+ * sector aligned, as for vhd_io_read().
+ *
+ * Writes go out asynchronously where the sectors are already allocated
+ * and marked in the leaf; anything needing a block allocated or a bitmap
+ * updated is written synchronously by vhd_aio_submit(), through
+ * vhd_io_write(), and completes at once.
+ */
+typedef struct vhd_aio_req {
+	int                        op;
+	uint64_t                   sec;
+	uint32_t                   secs;
+	char                      *buf;
+	int                        err;      /* set on completion */
+	void                      *data;     /* for the caller */
+
+	/* private */
+	int                        pending;
+	struct vhd_aio_req        *next;
+} vhd_aio_req_t;
+
+typedef struct vhd_aio vhd_aio_t;
+
+int vhd_aio_open(vhd_context_t *, int depth, vhd_aio_t **);
+void vhd_aio_close(vhd_aio_t *);
+
+/*
+ * queues up to n requests, as io_submit(2): returns how many were, or an
+ * error if the first could not be resolved
+ */
+int vhd_aio_submit(vhd_aio_t *, vhd_aio_req_t **reqs, int n);
+
+/*
+ * waits for at least one request to complete, unless none are in
+ * flight, and returns up to max of them in reqs
+ */
+int vhd_aio_reap(vhd_aio_t *, vhd_aio_req_t **reqs, int max);
+
+/* number of submitted requests not yet reaped */
+int vhd_aio_pending(vhd_aio_t *);
+
+#endif
@@ -57,6 +57,7 @@ typedef struct vhd_journal {
 	char                      *jname;
 	int                        jfd;
 	int                        is_block; /* is jfd a block device */
+	int                        batch;    /* vhd_journal_begin() depth */
 	vhd_journal_header_t       header;
 	vhd_context_t              vhd;
 } vhd_journal_t;
@@ -64,6 +65,16 @@ typedef struct vhd_journal {
 int vhd_journal_create(vhd_journal_t *, const char *file, const char *jfile);
 int vhd_journal_open(vhd_journal_t *, const char *file, const char *jfile);
 int vhd_journal_add_block(vhd_journal_t *, uint32_t block, char mode);
+int vhd_journal_add_bitmap(vhd_journal_t *, uint32_t block, char *map);
+
+/*
+ * Entries added between begin and end are appended without rewriting the
+ * journal header or syncing; end writes the header and syncs once. Pairs
+ * nest, only the outermost end commits. Nothing the entries cover may be
+ * modified before end returns.
+ */
+int vhd_journal_begin(vhd_journal_t *);
+int vhd_journal_end(vhd_journal_t *);
 int vhd_journal_commit(vhd_journal_t *);
 int vhd_journal_revert(vhd_journal_t *);
 int vhd_journal_close(vhd_journal_t *);
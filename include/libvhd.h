@@ -66,6 +66,10 @@
 #define VHD_BLOCK_SHIFT            21
 #define VHD_BLOCK_SIZE             (1ULL << VHD_BLOCK_SHIFT)
 
+/* range of block sizes vhd_create_ext() accepts, VHD_BLOCK_SIZE default */
+#define VHD_BLOCK_SHIFT_MIN        (VHD_SECTOR_SHIFT + 3)
+#define VHD_BLOCK_SHIFT_MAX        26
+
 #define UTF_16                     "UTF-16"
 #define UTF_16LE                   "UTF-16LE"
 #define UTF_16BE                   "UTF-16BE"
@@ -78,6 +82,7 @@
 #define VHD_OPEN_CACHED            0x00020
 #define VHD_OPEN_IO_WRITE_SPARSE   0x00040
 #define VHD_OPEN_USE_BKP_FOOTER    0x00080
+#define VHD_OPEN_CACHE_BITMAPS     0x00100
 
 #define VHD_FLAG_CREAT_FILE_SIZE_FIXED   0x00001
 #define VHD_FLAG_CREAT_PARENT_RAW        0x00002
@@ -123,6 +128,8 @@ typedef struct dd_batmap_hdr       vhd_batmap_header_t;
 typedef struct prt_loc             vhd_parent_locator_t;
 typedef struct vhd_context         vhd_context_t;
 typedef uint32_t                   vhd_flag_creat_t;
+typedef struct vhd_parent_info     vhd_parent_info_t;
+typedef struct vhd_snapshot_req    vhd_snapshot_req_t;
 
 struct vhd_bat {
 	uint32_t                   spb;
@@ -136,6 +143,8 @@ struct vhd_batmap {
 };
 
 struct crypto_blkcipher;
+struct vhd_bitmap_cache;
+struct vhd_buf_pool;
 
 struct vhd_context {
 	int                        fd;
@@ -155,6 +164,34 @@ struct vhd_context {
 	struct list_head           next;
 
 	char                      *custom_parent;
+
+	/* VHD_OPEN_CACHE_BITMAPS, read-only contexts only */
+	struct vhd_bitmap_cache   *bitmaps;
+
+	/* aligned bitmap and block buffers, see vhd_buf_get() */
+	struct vhd_buf_pool       *bufs;
+};
+
+/*
+ * what a snapshot needs to know of its parent, as vhd_parent_info()
+ * reads it: lets callers snapshotting many vdis at once gather parent
+ * metadata ahead of the pause rather than during it
+ */
+struct vhd_parent_info {
+	char                       path[VHD_MAX_NAME_LEN];
+	int                        raw;
+	uint32_t                   block_size;
+	uint64_t                   size;
+	uint32_t                   timestamp;
+	uuid_t                     uuid;
+};
+
+struct vhd_snapshot_req {
+	const char                *name;
+	uint64_t                   bytes;
+	uint64_t                   mbytes;
+	const vhd_parent_info_t   *parent;
+	int                        err;      /* set by vhd_snapshot_batch() */
 };
 
 static inline int
@@ -206,6 +243,17 @@ vhd_type_dynamic(vhd_context_t *ctx)
 		ctx->footer.type == HD_TYPE_DIFF);
 }
 
+/*
+ * log2 of the block size. Fixed disks have no header, they are handled
+ * in blocks of the default size.
+ */
+static inline int
+vhd_block_shift(vhd_context_t *ctx)
+{
+	return ctx->header.block_size ?
+		__builtin_ctz(ctx->header.block_size) : VHD_BLOCK_SHIFT;
+}
+
 static inline int
 vhd_creator_tapdisk(vhd_context_t *ctx)
 {
@@ -277,15 +325,31 @@ void vhd_close(vhd_context_t *);
  */
 int vhd_create(const char *name, uint64_t bytes, int type, uint64_t mbytes,
 		vhd_flag_creat_t);
+/* vhd_create_ext: as vhd_create, with blocks of @block_size bytes, a power
+ * of two between 1 << VHD_BLOCK_SHIFT_MIN and 1 << VHD_BLOCK_SHIFT_MAX */
+int vhd_create_ext(const char *name, uint64_t bytes, int type,
+		uint64_t mbytes, uint32_t block_size, vhd_flag_creat_t);
 /* vhd_snapshot: the bytes parameter is optional and can be 0 if the snapshot 
- * is to have the same size as the (first non-empty) parent */
-int vhd_snapshot(const char *snapshot, uint64_t bytes, const char *parent,
+ * is to have the same size as the (first non-empty) parent. The snapshot
+ * has the block size of its parent. */int vhd_snapshot(const char *snapshot, uint64_t bytes, const char *parent,
 		uint64_t mbytes, vhd_flag_creat_t);
+/* vhd_parent_info: gather what vhd_snapshot_batch() needs of @parent */
+int vhd_parent_info(const char *parent, vhd_flag_creat_t,
+		vhd_parent_info_t *);
+/* vhd_snapshot_batch: create @n snapshots from the parent metadata in
+ * each request, without reading the parents, and sync them together.
+ * All or nothing: on failure the snapshots created are removed, and
+ * each request's err says how it fared. */
+int vhd_snapshot_batch(vhd_snapshot_req_t *, int n);
 
 int vhd_hidden(vhd_context_t *, int *);
 int vhd_chain_depth(vhd_context_t *, int *);
 int vhd_marker(vhd_context_t *, char *);   
 int vhd_set_marker(vhd_context_t *, char); 
+/* vhd_mdlog_pending: whether updates to the image wait in a tapdisk
+ * metadata log, which must be replayed before it is written to */
+int vhd_mdlog_pending(vhd_context_t *, char *);
+int vhd_set_mdlog_pending(vhd_context_t *, char);
 int vhd_get_keyhash(vhd_context_t *, struct vhd_keyhash *);
 int vhd_set_keyhash(vhd_context_t *, const struct vhd_keyhash *);
 
@@ -323,6 +387,11 @@ int vhd_set_virt_size(vhd_context_t *, uint64_t);
 int vhd_bitmap_test(vhd_context_t *, char *, uint32_t);
 void vhd_bitmap_set(vhd_context_t *, char *, uint32_t);
 void vhd_bitmap_clear(vhd_context_t *, char *, uint32_t);
+uint32_t vhd_bitmap_scan(vhd_context_t *, char *, uint32_t, uint32_t, int);
+int vhd_bitmap_full(vhd_context_t *, char *);
+uint32_t vhd_bitmap_count(vhd_context_t *, char *);
+uint32_t vhd_batmap_count(vhd_context_t *, vhd_batmap_t *);
+int vhd_allocated(vhd_context_t *, uint64_t *blocks, uint64_t *sectors);
 
 int vhd_initialize_header_parent_name(vhd_context_t *, const char *);
 int vhd_write_parent_locators(vhd_context_t *, const char *);
@@ -331,6 +400,8 @@ int vhd_parent_locator_get(vhd_context_t *, char **);
 int vhd_custom_parent_set(vhd_context_t *vhd, const char *parent);
 
 int vhd_parent_locator_read(vhd_context_t *, vhd_parent_locator_t *, char **);
+int vhd_parent_locator_decode(vhd_context_t *, vhd_parent_locator_t *,
+			      char *, char **);
 int vhd_find_parent(vhd_context_t *, const char *, char **);
 int vhd_parent_locator_write_at(vhd_context_t *, const char *,
 				off64_t, uint32_t, size_t,
@@ -351,6 +422,14 @@ int vhd_read_batmap(vhd_context_t *, vhd_batmap_t *);
 int vhd_read_bitmap(vhd_context_t *, uint32_t block, char **bufp);
 int vhd_read_block(vhd_context_t *, uint32_t block, char **bufp);
 
+/*
+ * Page-aligned buffers kept per context for reuse. Buffers handed out
+ * by vhd_buf_get(), vhd_read_bitmap() and vhd_read_block() may be
+ * returned with vhd_buf_put() or simply free()d.
+ */
+void *vhd_buf_get(vhd_context_t *, size_t size);
+void vhd_buf_put(vhd_context_t *, void *buf, size_t size);
+
 int vhd_write_footer(vhd_context_t *, vhd_footer_t *);
 int vhd_write_footer_at(vhd_context_t *, vhd_footer_t *, off64_t);
 int vhd_write_header(vhd_context_t *, vhd_header_t *);
@@ -364,5 +443,9 @@ int vhd_io_read(vhd_context_t *, char *, uint64_t, uint32_t);
 int vhd_io_write(vhd_context_t *, char *, uint64_t, uint32_t);
 int vhd_io_read_bytes(vhd_context_t *, void *, size_t, uint64_t);
 int vhd_io_write_bytes(vhd_context_t *, void *, size_t, uint64_t);
+int vhd_io_copy(vhd_context_t *, vhd_context_t *, uint64_t, uint32_t);
+
+int vhd_copy_range(int, off64_t, int, off64_t, size_t);
+int vhd_clone(const char *src, const char *dst, int raw);
 
 #endif
@@ -85,6 +85,34 @@ int tap_ctl_connect_send_receive_ex(int id,
 				    struct timeval *timeout);
 char *tap_ctl_socket_name(int id);
 
+/*
+ * A control connection kept open across requests. Requests may be sent
+ * ahead of time, tapdisk answers them in order, so that each
+ * tap_ctl_session_receive returns the response to the oldest request
+ * still pending. Payloads following a response, such as those of stats,
+ * are read from session->fd by the caller.
+ */
+typedef struct tap_ctl_session {
+	int         id;
+	int         fd;
+	int         pending;
+} tap_ctl_session_t;
+
+int tap_ctl_session_open(int id, tap_ctl_session_t *session);
+int tap_ctl_session_send(tap_ctl_session_t *session,
+			 tapdisk_message_t *message, struct timeval *timeout);
+int tap_ctl_session_send_ex(tap_ctl_session_t *session,
+			    tapdisk_message_t *message, const char *logpath,
+			    uint8_t key_size, const uint8_t *encryption_key,
+			    struct timeval *timeout);
+int tap_ctl_session_receive(tap_ctl_session_t *session,
+			    tapdisk_message_t *message,
+			    struct timeval *timeout);
+int tap_ctl_session_send_and_receive(tap_ctl_session_t *session,
+				     tapdisk_message_t *message,
+				     struct timeval *timeout);
+void tap_ctl_session_close(tap_ctl_session_t *session);
+
 typedef struct {
 	pid_t       pid;
 	int         minor;
@@ -102,6 +130,15 @@ typedef struct {
 	list_for_each_entry_safe(_pos, _n, _head, entry)
 
 int tap_ctl_list(struct list_head *list);
+
+/*
+ * Like tap_ctl_list. Tapdisks which did not publish their VBDs, or all of
+ * them with TAP_CTL_LIST_LIVE, are asked concurrently, waiting at most
+ * @timeout seconds for each.
+ */
+#define TAP_CTL_LIST_LIVE     0x1
+#define TAP_CTL_LIST_TIMEOUT  10
+int tap_ctl_list_flags(struct list_head *list, int flags, int timeout);
 int tap_ctl_list_pid(pid_t pid, struct list_head *list);
 void tap_ctl_list_free(struct list_head *list);
 
@@ -111,19 +148,55 @@ int tap_ctl_allocate(int *minor, char **devname);
 int tap_ctl_free(const int minor);
 
 int tap_ctl_create(const char *params, char **devname, int flags, 
-		int prt_minor, char *secondary, int timeout, const char *slice, const char *logpath);
+		int prt_minor, char *secondary, int timeout, int cache_size,
+		const char *slice, const char *logpath);
 int tap_ctl_destroy(const int id, const int minor, int force,
 		    struct timeval *timeout);
 
 int tap_ctl_spawn(const char *slice);
+
+/**
+ * Like tap_ctl_spawn, and restricts the new tapdisk to a list of CPUs
+ * such as "0-3,8", preferring memory from their NUMA node. Pass the CPUs
+ * the guest's vCPUs run on.
+ */
+int tap_ctl_spawn_cpus(const char *slice, const char *cpus);
+
+/**
+ * Always fork a new tapdisk, bypassing the pool.
+ */
+int tap_ctl_spawn_new(const char *slice, const char *cpus);
 pid_t tap_ctl_get_pid(const int id);
 
+/**
+ * Pool of idle, already initialized tapdisks which tap_ctl_spawn hands
+ * out before forking a new one. Entries are BLKTAP2_POOL_DIR/<pid>; the
+ * pool is topped up to its target size in the background.
+ */
+int tap_ctl_pool_claim(void);
+int tap_ctl_pool_fill(void);
+void tap_ctl_pool_refill(void);
+int tap_ctl_pool_get_size(void);
+int tap_ctl_pool_set_size(int size);
+int tap_ctl_pool_list(pid_t *pids, int max);
+
 int tap_ctl_attach(const int id, const int minor);
+int tap_ctl_attach_response(const int id, tapdisk_message_t *message);
 int tap_ctl_detach(const int id, const int minor);
 
 int tap_ctl_open(const int id, const int minor, const char *params, int flags,
 		 const int prt_minor, const char *secondary, int timeout,
-		 const char *logpath, uint8_t key_size, uint8_t *encryption_key);
+		 int cache_size, const char *logpath, uint8_t key_size,
+		 uint8_t *encryption_key);
+
+/*
+ * The request tap_ctl_open sends, and the check of its response, for
+ * callers sending it over a session.
+ */
+int tap_ctl_open_message(tapdisk_message_t *message, const int minor,
+			 const char *params, int flags, const int prt_minor,
+			 const char *secondary, int timeout, int cache_size);
+int tap_ctl_open_response(const int id, tapdisk_message_t *message);
 int tap_ctl_close(const int id, const int minor, const int force,
 		  struct timeval *timeout);
 
@@ -132,6 +205,20 @@ int tap_ctl_close(const int id, const int minor, const int force,
  */
 int tap_ctl_pause(const int id, const int minor, struct timeval *timeout);
 
+/**
+ * Pauses VBD @minors[i] of tapdisk @pids[i], for each i < @n, together,
+ * for a snapshot consistent across them: each tapdisk gets one request
+ * and quiesces its VBDs in parallel with the others. Either all end up
+ * paused, or none. @timeout is a deadline, as for tap_ctl_pause.
+ */
+int tap_ctl_pause_group(const pid_t *pids, const int *minors, int n,
+			struct timeval *timeout);
+
+/**
+ * Resumes the VBDs of a group pause on the images and logs they had.
+ */
+int tap_ctl_resume_group(const pid_t *pids, const int *minors, int n);
+
 /**
  * Unpauses the VBD
  *
@@ -146,6 +233,77 @@ int tap_ctl_unpause(const int id, const int minor, const char *params,
 
 ssize_t tap_ctl_stats(pid_t pid, int minor, char *buf, size_t size);
 int tap_ctl_stats_fwrite(pid_t pid, int minor, FILE *out);
+ssize_t tap_ctl_stats_bin(pid_t pid, int minor, void *buf, size_t size);
+int tap_ctl_stats_subscribe(pid_t pid, int minor, unsigned int interval,
+			    unsigned int threshold);
+ssize_t tap_ctl_stats_update(int sfd, void *buf, size_t size,
+			     struct timeval *timeout);
+
+/**
+ * Starts I/O tracing into a ring of @size records (0 for the default),
+ * or stops it, dropping what was not read.
+ */
+int tap_ctl_trace_start(pid_t pid, int minor, unsigned int size);
+int tap_ctl_trace_stop(pid_t pid, int minor);
+ssize_t tap_ctl_trace_read(pid_t pid, int minor, void *buf, size_t size);
+
+/**
+ * Starts coalescing the leaf of a VBD into its parent while it runs, at
+ * up to @rate MiB/s (0 for no limit), or abandons it. Progress is in the
+ * stats; the VBD takes the parent's name once done.
+ */
+int tap_ctl_profile_start(pid_t pid, int minor);
+int tap_ctl_profile_stop(pid_t pid, int minor);
+int tap_ctl_profile_reset(pid_t pid, int minor);
+
+int tap_ctl_coalesce_start(pid_t pid, int minor, unsigned int rate);
+int tap_ctl_coalesce_stop(pid_t pid, int minor);
+
+/**
+ * Starts exporting VBD @minor as it is now, read-only over NBD, while it
+ * runs on; or ends the export. The socket is in the stats.
+ */
+int tap_ctl_backup_start(pid_t pid, int minor);
+int tap_ctl_backup_stop(pid_t pid, int minor);
+
+/**
+ * Clones the aio image of VBD @minor to a new file @path as a reflink,
+ * with the VBD paused for as long as that takes: a snapshot that adds no
+ * chain level. -EOPNOTSUPP where the filesystem has no reflinks.
+ */
+int tap_ctl_clone(pid_t pid, int minor, const char *path);
+
+/**
+ * Charges the I/O of VBD @minor of tapdisk @pid to the guest's cgroup
+ * directory @cgroup, e.g. /sys/fs/cgroup/blkio/machine/vm-3. Best before
+ * the VBD is attached, so it gets a worker thread of its own; -EBUSY once
+ * it would share one with other guests.
+ */
+int tap_ctl_cgroup(pid_t pid, int minor, const char *cgroup);
+
+/**
+ * Moves the changed block tracking of VBD @minor of tapdisk @pid on to
+ * the new log file @log, without a pause: writes taken until then are in
+ * the old log, all later ones in @log. Sets @epoch to the number of logs
+ * rotated through since the VBD was opened, 0 for a paused VBD.
+ */
+int tap_ctl_cbt_rotate(pid_t pid, int minor, const char *log,
+		       uint64_t *epoch);
+
+/**
+ * Reads the flight recorder of tapdisk @pid, which need not be running
+ * any more, into @lines, a string of its log lines, oldest first, for
+ * the caller to free. Returns its length.
+ */
+ssize_t tap_ctl_flight_read(pid_t pid, char **lines);
+int tap_ctl_flight_remove(pid_t pid);
+
+/**
+ * Hands the NBD clients of paused VBD @minor of tapdisk @pid over to VBD
+ * @to_minor of tapdisk @to_pid, e.g. a freshly started tapdisk replacing
+ * it, without the clients having to reconnect.
+ */
+int tap_ctl_nbd_handoff(pid_t pid, int minor, pid_t to_pid, int to_minor);
 
 int tap_ctl_blk_major(void);
 
@@ -175,7 +333,33 @@ int tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int
 		port, int proto, const char *pool, const int minor);
 
 /**
- * Instructs a tapdisk to disconnect from the shared ring.
+ * Like tap_ctl_connect_xenblkif, for one of the rings of a front-end using
+ * several of them. The tapdisk must already be connected to ring 0 before
+ * any other ring is connected.
+ *
+ * @param queue index of the ring
+ */
+int tap_ctl_connect_xenblkif_queue(const pid_t pid, const domid_t domid,
+		const int devid, int poll_duration, int poll_idle_threshold,
+		const grant_ref_t * grefs, const int order, const evtchn_port_t
+		port, int proto, const char *pool, const int minor,
+		const int queue);
+
+/*
+ * The request tap_ctl_connect_xenblkif_queue sends, and the check of its
+ * response, for callers waiting on the control socket themselves.
+ */
+int tap_ctl_connect_xenblkif_message(tapdisk_message_t *message,
+		const domid_t domid, const int devid, int poll_duration,
+		int poll_idle_threshold, const grant_ref_t * grefs, const int order,
+		const evtchn_port_t port, int proto, const char *pool,
+		const int minor, const int queue);
+int tap_ctl_connect_xenblkif_response(const pid_t pid,
+		tapdisk_message_t *message);
+
+/**
+ * Instructs a tapdisk to disconnect from the shared ring, or from all the
+ * rings of a multi-queue device.
  *
  * @param pid process ID of the tapdisk
  * @param domid the ID of the guest VM
@@ -56,6 +56,10 @@
 #define TAPDISK_MESSAGE_FLAG_STANDBY     0x100
 #define TAPDISK_MESSAGE_FLAG_NO_O_DIRECT 0x200
 #define TAPDISK_MESSAGE_FLAG_OPEN_ENCRYPTED 0x400
+#define TAPDISK_MESSAGE_FLAG_MIRROR_COPY 0x800
+#define TAPDISK_MESSAGE_FLAG_ADD_WBCACHE 0x1000
+#define TAPDISK_MESSAGE_FLAG_4K          0x2000
+#define TAPDISK_MESSAGE_FLAG_CRC         0x4000
 
 typedef struct tapdisk_message           tapdisk_message_t;
 typedef uint32_t                         tapdisk_message_flag_t;
@@ -66,6 +70,12 @@ typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
 typedef struct tapdisk_message_stat      tapdisk_message_stat_t;
+typedef struct tapdisk_message_trace     tapdisk_message_trace_t;
+typedef struct tapdisk_message_profile   tapdisk_message_profile_t;
+typedef struct tapdisk_message_coalesce  tapdisk_message_coalesce_t;
+typedef struct tapdisk_message_handoff   tapdisk_message_handoff_t;
+typedef struct tapdisk_message_subscribe tapdisk_message_subscribe_t;
+typedef struct tapdisk_message_backup    tapdisk_message_backup_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -76,6 +86,7 @@ struct tapdisk_message_params {
 	uint32_t                         prt_devnum;
 	uint16_t                         req_timeout;
 	char                             secondary[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+	uint32_t                         cache_size; /* MiB, with ADD_CACHE */
 };
 
 struct tapdisk_message_image {
@@ -93,6 +104,11 @@ struct tapdisk_message_response {
 	char                             message[TAPDISK_MESSAGE_STRING_LENGTH];
 };
 
+/*
+ * Also the VBDs of TAPDISK_MESSAGE_PAUSE_GROUP and RESUME_GROUP, which
+ * pause them all at once, or none, and resume them on the images they
+ * had.
+ */
 struct tapdisk_message_minors {
 	int                              count;
 	int                              list[TAPDISK_MESSAGE_MAX_MINORS];
@@ -111,6 +127,180 @@ struct tapdisk_message_stat {
 	size_t                           length;
 };
 
+/*
+ * TAPDISK_MESSAGE_STATS_BIN responses carry u.info.length bytes: a
+ * header, then count records of rec_size bytes each, one per VBD.
+ * Fields are only ever added at the end of a record, with version
+ * bumped; readers use the prefix they know and skip the rest.
+ */
+#define TAPDISK_STATS_BIN_VERSION        1
+
+struct tapdisk_stats_bin_hdr {
+	uint32_t                         version;
+	uint32_t                         rec_size;
+	uint32_t                         count;
+	uint32_t                         reserved;
+};
+
+struct tapdisk_stats_bin_vbd {
+	uint32_t                         minor;
+	uint32_t                         state;
+	uint64_t                         secs_rd;
+	uint64_t                         secs_wr;
+	uint64_t                         received;
+	uint64_t                         returned;
+	uint64_t                         kicked;
+	uint64_t                         secs_pending;
+	uint64_t                         retries;
+	uint64_t                         errors;
+	/* summed over the images of the chain */
+	uint64_t                         hits_rd;
+	uint64_t                         hits_wr;
+	uint64_t                         fail_rd;
+	uint64_t                         fail_wr;
+	uint32_t                         images;
+	uint32_t                         reserved;
+};
+
+/*
+ * I/O tracing. TAPDISK_MESSAGE_TRACE starts (size records, rounded
+ * up to a power of two) or stops recording into a per-VBD ring.
+ * TAPDISK_MESSAGE_TRACE_READ responses carry u.info.length bytes: a
+ * header, then count records of rec_size bytes, oldest first, which
+ * were not read before. Records overwritten unread are counted in
+ * dropped.
+ */
+#define TAPDISK_TRACE_VERSION            1
+
+#define TAPDISK_TRACE_START              1
+#define TAPDISK_TRACE_STOP               2
+
+/* events */
+#define TAPDISK_TRACE_QUEUE              1 /* request queued to the VBD */
+#define TAPDISK_TRACE_SUBMIT             2 /* segment issued to an image */
+#define TAPDISK_TRACE_COMPLETE           3 /* segment completed by it */
+#define TAPDISK_TRACE_DONE               4 /* request returned */
+
+#define TAPDISK_TRACE_NO_LEVEL           0xff
+
+struct tapdisk_message_trace {
+	uint32_t                         cmd;
+	uint32_t                         size;
+};
+
+/*
+ * Per-stage request profiling. TAPDISK_PROFILE_START (re)enables the
+ * VBD's stage histograms, TAPDISK_PROFILE_STOP freezes them and
+ * TAPDISK_PROFILE_RESET clears them. See the profile section of the VBD
+ * stats.
+ */
+#define TAPDISK_PROFILE_START            1
+#define TAPDISK_PROFILE_STOP             2
+#define TAPDISK_PROFILE_RESET            3
+
+struct tapdisk_message_profile {
+	uint32_t                         cmd;
+	uint32_t                         reserved;
+};
+
+/*
+ * Live coalesce of the leaf into its parent. TAPDISK_COALESCE_START
+ * copies at up to rate MiB/s, 0 for no limit; the VBD drops the leaf
+ * from its chain once done. See the coalesce section of the VBD stats.
+ */
+#define TAPDISK_COALESCE_START           1
+#define TAPDISK_COALESCE_STOP            2
+
+struct tapdisk_message_coalesce {
+	uint32_t                         cmd;
+	uint32_t                         rate;
+};
+
+/*
+ * Point-in-time export of a live VBD for backups. TAPDISK_BACKUP_START
+ * freezes the view and serves it read-only over NBD, next to the VBD;
+ * TAPDISK_BACKUP_STOP ends it. See the backup section of the VBD stats
+ * for the socket.
+ */
+#define TAPDISK_BACKUP_START             1
+#define TAPDISK_BACKUP_STOP              2
+
+struct tapdisk_message_backup {
+	uint32_t                         cmd;
+	uint32_t                         reserved;
+};
+
+/*
+ * Hands the NBD clients of a paused VBD over to the VBD at minor of
+ * tapdisk pid, which must be serving NBD. The response message says how
+ * many went.
+ */
+struct tapdisk_message_handoff {
+	uint32_t                         pid;
+	uint32_t                         minor;
+};
+
+/*
+ * Subscribes the connection to stats updates, for one VBD or, with
+ * cookie -1, all of them. Every interval ms, tapdisk pushes a
+ * TAPDISK_MESSAGE_STATS_UPDATE laid out as the STATS_BIN response,
+ * with a record for each VBD whose counters moved since it was last
+ * reported. Records carry the differences of the counters, but
+ * secs_pending, state and images as they are; the first update has
+ * every VBD, counting from zero.
+ * With a threshold, a VBD is only reported once it transferred that
+ * many sectors, or on errors or a change of state; nothing is lost in
+ * between. A VBD gone away is reported with state
+ * TAPDISK_STATS_UPDATE_GONE. No update is sent while nothing moved.
+ * The connection stays a session, other requests may go along.
+ */
+#define TAPDISK_STATS_UPDATE_GONE        0xffffffff
+
+struct tapdisk_message_subscribe {
+	uint32_t                         interval; /* ms, 0 for 1s */
+	uint32_t                         threshold; /* sectors */
+};
+
+struct tapdisk_trace_hdr {
+	uint32_t                         version;
+	uint32_t                         rec_size;
+	uint32_t                         count;
+	uint32_t                         dropped;
+};
+
+struct tapdisk_trace_rec {
+	uint64_t                         ts;    /* ns, CLOCK_MONOTONIC */
+	uint64_t                         sec;
+	uint32_t                         secs;
+	uint32_t                         seq;   /* of the VBD request */
+	int16_t                          error;
+	uint8_t                          event;
+	uint8_t                          op;    /* TD_OP_* */
+	uint8_t                          level; /* in the chain, 0 is the leaf */
+	uint8_t                          reserved[3];
+};
+
+/*
+ * The flight recorder: the tlog lines of a tapdisk, kept in shared
+ * memory at TAPDISK_FLIGHT_PATH<pid>, which outlives the process. A
+ * header, then a ring of size bytes: head counts the bytes ever written,
+ * the last size of them are in the ring at head % size. Lines written
+ * as the process died may be torn, or have holes of NULs.
+ */
+#define TAPDISK_FLIGHT_PATH              "/dev/shm/td3-flight."
+#define TAPDISK_FLIGHT_MAGIC             0x74646672 /* "tdfr" */
+#define TAPDISK_FLIGHT_VERSION           1
+
+struct tapdisk_flight_hdr {
+	uint32_t                         magic;
+	uint32_t                         version;
+	uint32_t                         size;
+	int32_t                          pid;
+	uint64_t                         head;
+	uint64_t                         started; /* s, CLOCK_REALTIME */
+	uint8_t                          reserved[32];
+};
+
 /**
  * Tapdisk message containing all the necessary information required for the
  * tapdisk to connect to a guest's blkfront.
@@ -162,6 +352,12 @@ typedef struct tapdisk_message_blkif {
 	 * Idle CPU threshold above which polling is permitted.
 	 */
 	uint32_t poll_idle_threshold;
+
+	/**
+	 * Index of the ring for front-ends using several rings
+	 * (multi-queue-num-queues), 0 otherwise.
+	 */
+	uint32_t queue;
 } tapdisk_message_blkif_t;
 
 /**
@@ -199,6 +395,12 @@ struct tapdisk_message {
 		tapdisk_message_stat_t     info;
 		tapdisk_message_blkif_t    blkif;
         tapdisk_message_resume_t   resume;
+		tapdisk_message_trace_t    trace;
+		tapdisk_message_profile_t  profile;
+		tapdisk_message_coalesce_t coalesce;
+		tapdisk_message_handoff_t  handoff;
+		tapdisk_message_subscribe_t subscribe;
+		tapdisk_message_backup_t   backup;
 	} u;
 };
 
@@ -233,9 +435,36 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_DISK_INFO,
 	TAPDISK_MESSAGE_DISK_INFO_RSP,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_STATS_BIN,
+	TAPDISK_MESSAGE_STATS_BIN_RSP,
+	TAPDISK_MESSAGE_TRACE,
+	TAPDISK_MESSAGE_TRACE_RSP,
+	TAPDISK_MESSAGE_TRACE_READ,
+	TAPDISK_MESSAGE_TRACE_READ_RSP,
+	TAPDISK_MESSAGE_COALESCE,
+	TAPDISK_MESSAGE_COALESCE_RSP,
+	TAPDISK_MESSAGE_SESSION,
+	TAPDISK_MESSAGE_SESSION_RSP,
+	TAPDISK_MESSAGE_NBD_HANDOFF,
+	TAPDISK_MESSAGE_NBD_HANDOFF_RSP,
+	TAPDISK_MESSAGE_STATS_SUBSCRIBE,
+	TAPDISK_MESSAGE_STATS_SUBSCRIBE_RSP,
+	TAPDISK_MESSAGE_STATS_UPDATE,
+	TAPDISK_MESSAGE_PROFILE,
+	TAPDISK_MESSAGE_PROFILE_RSP,
+	TAPDISK_MESSAGE_BACKUP,
+	TAPDISK_MESSAGE_BACKUP_RSP,
+	TAPDISK_MESSAGE_CGROUP,
+	TAPDISK_MESSAGE_CGROUP_RSP,
+	TAPDISK_MESSAGE_CBT_ROTATE,
+	TAPDISK_MESSAGE_CBT_ROTATE_RSP,
+	TAPDISK_MESSAGE_PAUSE_GROUP,
+	TAPDISK_MESSAGE_PAUSE_GROUP_RSP,
+	TAPDISK_MESSAGE_RESUME_GROUP,
+	TAPDISK_MESSAGE_RESUME_GROUP_RSP,
 };
 
-#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_EXIT
+#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_RESUME_GROUP_RSP
 
 static inline char *
 tapdisk_message_name(enum tapdisk_message_id id)
@@ -328,6 +557,87 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_STATS_BIN:
+		return "binary stats";
+
+	case TAPDISK_MESSAGE_STATS_BIN_RSP:
+		return "binary stats response";
+
+	case TAPDISK_MESSAGE_TRACE:
+		return "trace";
+
+	case TAPDISK_MESSAGE_TRACE_RSP:
+		return "trace response";
+
+	case TAPDISK_MESSAGE_TRACE_READ:
+		return "trace read";
+
+	case TAPDISK_MESSAGE_TRACE_READ_RSP:
+		return "trace read response";
+
+	case TAPDISK_MESSAGE_COALESCE:
+		return "coalesce";
+
+	case TAPDISK_MESSAGE_COALESCE_RSP:
+		return "coalesce response";
+
+	case TAPDISK_MESSAGE_SESSION:
+		return "session";
+
+	case TAPDISK_MESSAGE_SESSION_RSP:
+		return "session response";
+
+	case TAPDISK_MESSAGE_NBD_HANDOFF:
+		return "nbd handoff";
+
+	case TAPDISK_MESSAGE_NBD_HANDOFF_RSP:
+		return "nbd handoff response";
+
+	case TAPDISK_MESSAGE_STATS_SUBSCRIBE:
+		return "stats subscribe";
+
+	case TAPDISK_MESSAGE_STATS_SUBSCRIBE_RSP:
+		return "stats subscribe response";
+
+	case TAPDISK_MESSAGE_STATS_UPDATE:
+		return "stats update";
+
+	case TAPDISK_MESSAGE_PROFILE:
+		return "profile";
+
+	case TAPDISK_MESSAGE_PROFILE_RSP:
+		return "profile response";
+
+	case TAPDISK_MESSAGE_BACKUP:
+		return "backup";
+
+	case TAPDISK_MESSAGE_BACKUP_RSP:
+		return "backup response";
+
+	case TAPDISK_MESSAGE_CGROUP:
+		return "cgroup";
+
+	case TAPDISK_MESSAGE_CGROUP_RSP:
+		return "cgroup response";
+
+	case TAPDISK_MESSAGE_CBT_ROTATE:
+		return "cbt rotate";
+
+	case TAPDISK_MESSAGE_CBT_ROTATE_RSP:
+		return "cbt rotate response";
+
+	case TAPDISK_MESSAGE_PAUSE_GROUP:
+		return "pause group";
+
+	case TAPDISK_MESSAGE_PAUSE_GROUP_RSP:
+		return "pause group response";
+
+	case TAPDISK_MESSAGE_RESUME_GROUP:
+		return "resume group";
+
+	case TAPDISK_MESSAGE_RESUME_GROUP_RSP:
+		return "resume group response";
+
 	default:
 		return "unknown";
 	}
@@ -46,5 +46,7 @@ int vhd_util_check(int argc, char **argv);
 int vhd_util_revert(int argc, char **argv);
 int vhd_util_key(int argc, char **argv);
 int vhd_util_copy(int argc, char **argv);
+int vhd_util_compress(int argc, char **argv);
+int vhd_util_clone(int argc, char **argv);
 
 #endif
@@ -170,7 +170,8 @@ struct dd_batmap_hdr {
   uint32_t    checksum;        /* batmap checksum -- 1's complement of batmap  */
   char        marker;          /* generic marker field                         */
   struct vhd_keyhash keyhash;  /* nonce & SHA256 hash of encryption key   */
-  char   res[418];        /* reserved                                     */
+  char        mdlog;           /* a tapdisk metadata log holds updates         */
+  char   res[417];        /* reserved                                     */
 };
 
 static const char VHD_BATMAP_COOKIE[9] = "tdbatmap";
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ZIMG_H__
+#define __ZIMG_H__
+
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/*
+ * Compressed read-only images, for parents that are only ever read:
+ * the flattened contents of a VHD chain cut into fixed size blocks, each
+ * deflated on its own, with an index of where each one starts.
+ *
+ *   header (ZIMG_HEADER_SIZE) | block 0 | block 1 | ... | index
+ *
+ * The index holds n_blocks + 1 offsets, block i spanning
+ * [index[i], index[i + 1]). An empty block reads as zeroes and one of
+ * exactly block_size bytes is stored as is, having not compressed.
+ * Everything is little-endian.
+ */
+
+#define ZIMG_MAGIC          "tdzimg\0\0"
+#define ZIMG_VERSION        1
+#define ZIMG_HEADER_SIZE    4096
+#define ZIMG_DEFLATE        1
+
+#define ZIMG_BLOCK_MIN      (4 << 10)
+#define ZIMG_BLOCK_MAX      (4 << 20)
+#define ZIMG_BLOCK_DEFAULT  (64 << 10)
+
+struct zimg_header {
+	char                    magic[8];
+	uint32_t                version;
+	uint32_t                compression;
+	uint32_t                block_size;     /* bytes, a power of two */
+	uint32_t                reserved;
+	uint64_t                size;           /* virtual size, bytes */
+	uint64_t                n_blocks;
+	uint64_t                index_offset;
+} __attribute__((packed));
+
+static inline int
+zimg_probe(const char *path)
+{
+	char magic[sizeof(((struct zimg_header *)0)->magic)];
+	int fd, n;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	n = pread(fd, magic, sizeof(magic), 0);
+	close(fd);
+
+	return n == sizeof(magic) && !memcmp(magic, ZIMG_MAGIC, sizeof(magic));
+}
+
+#endif
@@ -0,0 +1,1070 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reads a VG straight from the LVM2 text metadata on its PVs, without
+ * forking the LVM tools. PVs are found by their label, scanning the block
+ * devices in /proc/partitions, and the current metadata is located through
+ * the metadata area header. All three are checksummed, so a read racing
+ * with an update on shared storage fails, and lvm_scan_vg() falls back to
+ * vgs/lvs.
+ *
+ * The last VG read is cached with its seqno and the devices of its PVs.
+ * Reading it again costs one metadata read, and no parsing if the seqno
+ * did not change.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <syslog.h>
+
+#include "lvm-util.h"
+#include "lvm-util-priv.h"
+
+#define EPRINTF(_f, _a...)					\
+	do {							\
+		syslog(LOG_INFO, "%s: " _f, __func__, ##_a);	\
+	} while (0)
+
+#ifndef MIN
+#define MIN(a, b)                ((a) < (b) ? (a) : (b))
+#endif
+
+#define LVM_SECTOR_SIZE          512
+#define LVM_IO_ALIGN             4096
+#define LVM_LABEL_SCAN_SECTORS   4
+#define LVM_LABEL_ID             "LABELONE"
+#define LVM_LABEL_TYPE           "LVM2 001"
+#define LVM_ID_LEN               32
+#define LVM_MDA_HEADER_SIZE      512
+#define LVM_MDA_MAGIC            " LVM2 x[5A%r0N*>"
+#define LVM_MDA_VERSION          1
+#define LVM_MDA_MAX              2
+#define LVM_RAW_LOCN_IGNORED     0x1
+#define LVM_CRC_INITIAL          0xf597a6cfU
+#define LVM_METADATA_MAX         (16 << 20)
+
+struct lvm_label_header {
+	char                     id[8];
+	uint64_t                 sector;
+	uint32_t                 crc;
+	uint32_t                 offset;
+	char                     type[8];
+} __attribute__((packed));
+
+struct lvm_disk_locn {
+	uint64_t                 offset;
+	uint64_t                 size;
+} __attribute__((packed));
+
+struct lvm_pv_header {
+	char                     uuid[LVM_ID_LEN];
+	uint64_t                 device_size;
+	struct lvm_disk_locn     areas[0];
+} __attribute__((packed));
+
+struct lvm_raw_locn {
+	uint64_t                 offset;
+	uint64_t                 size;
+	uint32_t                 checksum;
+	uint32_t                 flags;
+} __attribute__((packed));
+
+struct lvm_mda_header {
+	uint32_t                 checksum;
+	char                     magic[16];
+	uint32_t                 version;
+	uint64_t                 start;
+	uint64_t                 size;
+	struct lvm_raw_locn      raw_locns[0];
+} __attribute__((packed));
+
+/* a PV label found on a device */
+struct lvm_pv_label {
+	char                     path[MAX_NAME_SIZE];
+	char                     uuid[LVM_ID_LEN + 1];
+	int                      mdas;
+	struct lvm_disk_locn     mda[LVM_MDA_MAX];
+};
+
+/* a node of the parsed metadata: a section, a value, or a list */
+struct lvm_node {
+	char                    *key;
+	char                    *value;
+	int                      list;
+	struct lvm_node         *child;
+	struct lvm_node         *next;
+};
+
+static struct {
+	char                     name[MAX_NAME_SIZE];
+	char                     id[LVM_ID_LEN + 7];
+	uint64_t                 seqno;
+	struct vg                vg;
+	int                      n_labels;
+	struct lvm_pv_label     *labels;
+} lvm_cache;
+
+static uint32_t
+lvm_crc(uint32_t crc, const void *buf, size_t size)
+{
+	static const uint32_t crctab[] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+	};
+	const uint8_t *p = buf;
+
+	while (size--) {
+		crc ^= *p++;
+		crc  = (crc >> 4) ^ crctab[crc & 0xf];
+		crc  = (crc >> 4) ^ crctab[crc & 0xf];
+	}
+
+	return crc;
+}
+
+/*
+ * Metadata on shared storage is updated by other hosts, so reads bypass
+ * the page cache. Returns a NUL terminated copy of [offset, offset + size).
+ */
+static int
+lvm_read(int fd, uint64_t offset, size_t size, char **_buf)
+{
+	uint64_t start, end;
+	void *io;
+	char *buf;
+	ssize_t n;
+	int err;
+
+	*_buf = NULL;
+
+	start = offset & ~((uint64_t)LVM_IO_ALIGN - 1);
+	end   = (offset + size + LVM_IO_ALIGN - 1) &
+		~((uint64_t)LVM_IO_ALIGN - 1);
+
+	err = posix_memalign(&io, LVM_IO_ALIGN, end - start);
+	if (err)
+		return -err;
+
+	n = pread(fd, io, end - start, start);
+	if (n < 0 || (uint64_t)n < offset + size - start) {
+		err = (n < 0 ? -errno : -EIO);
+		goto out;
+	}
+
+	buf = malloc(size + 1);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	memcpy(buf, (char *)io + (offset - start), size);
+	buf[size] = '\0';
+	*_buf     = buf;
+	err       = 0;
+
+out:
+	free(io);
+	return err;
+}
+
+static int
+lvm_read_label(const char *path, struct lvm_pv_label *label)
+{
+	struct lvm_label_header *lh;
+	struct lvm_pv_header *ph;
+	struct lvm_disk_locn *dl;
+	size_t off, size;
+	char *buf;
+	int i, fd, err;
+
+	if (strnlen(path, sizeof(label->path)) == sizeof(label->path))
+		return -ENAMETOOLONG;
+
+	fd = open(path, O_RDONLY | O_DIRECT);
+	if (fd == -1)
+		return -errno;
+
+	size = LVM_LABEL_SCAN_SECTORS * LVM_SECTOR_SIZE;
+	err  = lvm_read(fd, 0, size, &buf);
+	close(fd);
+	if (err)
+		return err;
+
+	err = -ENOENT;
+	for (i = 0; i < LVM_LABEL_SCAN_SECTORS; i++) {
+		lh = (struct lvm_label_header *)(buf + i * LVM_SECTOR_SIZE);
+		if (!memcmp(lh->id, LVM_LABEL_ID, sizeof(lh->id)))
+			break;
+	}
+
+	if (i == LVM_LABEL_SCAN_SECTORS ||
+	    le64toh(lh->sector) != i ||
+	    memcmp(lh->type, LVM_LABEL_TYPE, sizeof(lh->type)))
+		goto out;
+
+	err = -EINVAL;
+	if (le32toh(lh->crc) !=
+	    lvm_crc(LVM_CRC_INITIAL, &lh->offset,
+		    LVM_SECTOR_SIZE - offsetof(struct lvm_label_header, offset)))
+		goto out;
+
+	off = le32toh(lh->offset);
+	if (off < sizeof(*lh) || off + sizeof(*ph) > LVM_SECTOR_SIZE)
+		goto out;
+
+	memset(label, 0, sizeof(*label));
+	strcpy(label->path, path);
+
+	ph = (struct lvm_pv_header *)((char *)lh + off);
+	memcpy(label->uuid, ph->uuid, LVM_ID_LEN);
+
+	/* data areas, then metadata areas, each list ends with a null entry */
+	dl = ph->areas;
+	for (i = 0; i < 2; i++) {
+		for (;; dl++) {
+			if ((char *)(dl + 1) > (char *)lh + LVM_SECTOR_SIZE)
+				goto out;
+			if (!dl->offset)
+				break;
+			if (i && label->mdas < LVM_MDA_MAX) {
+				label->mda[label->mdas].offset = le64toh(dl->offset);
+				label->mda[label->mdas].size   = le64toh(dl->size);
+				label->mdas++;
+			}
+		}
+		dl++;
+	}
+
+	err = 0;
+
+out:
+	free(buf);
+	return err;
+}
+
+static int
+lvm_lv_device(const char *name)
+{
+	char path[PATH_MAX], uuid[8];
+	FILE *f;
+	int lv;
+
+	if (strncmp(name, "dm-", 3))
+		return 0;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/dm/uuid", name);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	lv = (fgets(uuid, sizeof(uuid), f) && !strncmp(uuid, "LVM-", 4));
+	fclose(f);
+
+	return lv;
+}
+
+/*
+ * Find the PV labels on the block devices of the host, skipping LVs,
+ * which are not read by the LVM tools either.
+ */
+static int
+lvm_scan_labels(struct lvm_pv_label **_labels, int *_n)
+{
+	struct lvm_pv_label *labels, *tmp;
+	char name[MAX_NAME_SIZE], path[MAX_NAME_SIZE + 5];
+	char buf[512];
+	int n, size;
+	FILE *f;
+
+	*_labels = NULL;
+	*_n      = 0;
+
+	f = fopen("/proc/partitions", "r");
+	if (!f)
+		return -errno;
+
+	labels = NULL;
+	n      = 0;
+	size   = 0;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		if (sscanf(buf, "%*u %*u %*u %255s", name) != 1)
+			continue;
+
+		if (lvm_lv_device(name))
+			continue;
+
+		if (n == size) {
+			size = (size ? size * 2 : 8);
+			tmp  = realloc(labels, size * sizeof(*labels));
+			if (!tmp) {
+				free(labels);
+				fclose(f);
+				return -ENOMEM;
+			}
+			labels = tmp;
+		}
+
+		snprintf(path, sizeof(path), "/dev/%s", name);
+		if (!lvm_read_label(path, labels + n))
+			n++;
+	}
+
+	fclose(f);
+
+	*_labels = labels;
+	*_n      = n;
+	return 0;
+}
+
+/*
+ * Read the current metadata text from the first usable metadata area of
+ * a PV. The text is a ring after the header, and may wrap around.
+ */
+static int
+lvm_read_metadata(const struct lvm_pv_label *label, char **_text)
+{
+	struct lvm_mda_header *mh;
+	struct lvm_raw_locn *rl;
+	uint64_t start, size, off, len, first;
+	char *hdr, *text, *part, *tmp;
+	uint32_t crc;
+	int i, fd, err;
+
+	*_text = NULL;
+
+	fd = open(label->path, O_RDONLY | O_DIRECT);
+	if (fd == -1)
+		return -errno;
+
+	hdr  = NULL;
+	text = NULL;
+	err  = -ENOENT;
+
+	for (i = 0; i < label->mdas; i++) {
+		start = label->mda[i].offset;
+
+		free(hdr);
+		err = lvm_read(fd, start, LVM_MDA_HEADER_SIZE, &hdr);
+		if (err)
+			break;
+
+		mh = (struct lvm_mda_header *)hdr;
+		rl = mh->raw_locns;
+
+		err = -EINVAL;
+		if (memcmp(mh->magic, LVM_MDA_MAGIC, sizeof(mh->magic)) ||
+		    le32toh(mh->version) != LVM_MDA_VERSION ||
+		    le64toh(mh->start) != start ||
+		    le32toh(mh->checksum) !=
+		    lvm_crc(LVM_CRC_INITIAL, mh->magic,
+			    LVM_MDA_HEADER_SIZE - sizeof(mh->checksum)))
+			continue;
+
+		size = le64toh(mh->size);
+		off  = le64toh(rl->offset);
+		len  = le64toh(rl->size);
+
+		if (!off || (le32toh(rl->flags) & LVM_RAW_LOCN_IGNORED))
+			continue;
+
+		if (off < LVM_MDA_HEADER_SIZE || off >= size ||
+		    len > size - LVM_MDA_HEADER_SIZE || len > LVM_METADATA_MAX)
+			continue;
+
+		first = MIN(len, size - off);
+
+		err = lvm_read(fd, start + off, first, &text);
+		if (err)
+			break;
+
+		if (first < len) {
+			err = lvm_read(fd, start + LVM_MDA_HEADER_SIZE,
+				       len - first, &part);
+			if (err)
+				break;
+
+			err = -ENOMEM;
+			tmp = realloc(text, len + 1);
+			if (!tmp) {
+				free(part);
+				break;
+			}
+			text = tmp;
+
+			memcpy(text + first, part, len - first);
+			text[len] = '\0';
+			free(part);
+		}
+
+		crc = lvm_crc(LVM_CRC_INITIAL, text, len);
+		if (crc != le32toh(rl->checksum)) {
+			EPRINTF("%s: metadata checksum mismatch\n", label->path);
+			free(text);
+			text = NULL;
+			err  = -EAGAIN;
+			continue;
+		}
+
+		err = 0;
+		break;
+	}
+
+	close(fd);
+	free(hdr);
+
+	if (err) {
+		free(text);
+		return err;
+	}
+
+	*_text = text;
+	return 0;
+}
+
+
+static void
+lvm_free_nodes(struct lvm_node *node)
+{
+	struct lvm_node *next;
+
+	for (; node; node = next) {
+		next = node->next;
+		lvm_free_nodes(node->child);
+		free(node->key);
+		free(node->value);
+		free(node);
+	}
+}
+
+static char *
+lvm_skip_space(char *p)
+{
+	for (;;) {
+		while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+			p++;
+
+		if (*p != '#')
+			return p;
+
+		while (*p && *p != '\n')
+			p++;
+	}
+}
+
+static int
+lvm_ident_char(char c)
+{
+	return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		(c >= '0' && c <= '9') || (c && strchr("_.+-", c)));
+}
+
+static struct lvm_node *
+lvm_new_node(struct lvm_node ***tail)
+{
+	struct lvm_node *node;
+
+	node = calloc(1, sizeof(*node));
+	if (!node)
+		return NULL;
+
+	**tail = node;
+	*tail  = &node->next;
+
+	return node;
+}
+
+/* a quoted string, with escapes removed, or a number */
+static int
+lvm_parse_scalar(char **_p, char **value)
+{
+	char *p, *start, *v;
+
+	p = start = *_p;
+
+	if (*p == '"') {
+		start = ++p;
+		while (*p != '"') {
+			if (!*p)
+				return -EINVAL;
+			if (*p == '\\' && p[1])
+				p++;
+			p++;
+		}
+
+		v = *value = malloc(p - start + 1);
+		if (!v)
+			return -ENOMEM;
+
+		while (start < p) {
+			if (*start == '\\')
+				start++;
+			*v++ = *start++;
+		}
+		*v  = '\0';
+		*_p = p + 1;
+		return 0;
+	}
+
+	while (lvm_ident_char(*p))
+		p++;
+
+	if (p == start)
+		return -EINVAL;
+
+	*value = strndup(start, p - start);
+	if (!*value)
+		return -ENOMEM;
+
+	*_p = p;
+	return 0;
+}
+
+static int
+lvm_parse_list(char **_p, struct lvm_node *list)
+{
+	struct lvm_node **tail, *node;
+	char *p;
+	int err;
+
+	tail = &list->child;
+	p    = lvm_skip_space(*_p);
+
+	while (*p != ']') {
+		node = lvm_new_node(&tail);
+		if (!node)
+			return -ENOMEM;
+
+		err = lvm_parse_scalar(&p, &node->value);
+		if (err)
+			return err;
+
+		p = lvm_skip_space(p);
+		if (*p == ',')
+			p = lvm_skip_space(p + 1);
+		else if (*p != ']')
+			return -EINVAL;
+	}
+
+	*_p = p + 1;
+	return 0;
+}
+
+static int
+lvm_parse_section(char **_p, struct lvm_node **tail, int nested)
+{
+	struct lvm_node *node;
+	char *p, *key;
+	int err;
+
+	p = *_p;
+
+	for (;;) {
+		p = lvm_skip_space(p);
+
+		if (*p == '}') {
+			if (!nested)
+				return -EINVAL;
+			p++;
+			break;
+		}
+
+		if (!*p) {
+			if (nested)
+				return -EINVAL;
+			break;
+		}
+
+		key = p;
+		while (lvm_ident_char(*p))
+			p++;
+		if (p == key)
+			return -EINVAL;
+
+		node = lvm_new_node(&tail);
+		if (!node)
+			return -ENOMEM;
+
+		node->key = strndup(key, p - key);
+		if (!node->key)
+			return -ENOMEM;
+
+		p = lvm_skip_space(p);
+
+		if (*p == '{') {
+			p++;
+			err = lvm_parse_section(&p, &node->child, 1);
+			if (err)
+				return err;
+			continue;
+		}
+
+		if (*p != '=')
+			return -EINVAL;
+
+		p = lvm_skip_space(p + 1);
+
+		if (*p == '[') {
+			p++;
+			node->list = 1;
+			err = lvm_parse_list(&p, node);
+		} else
+			err = lvm_parse_scalar(&p, &node->value);
+		if (err)
+			return err;
+	}
+
+	*_p = p;
+	return 0;
+}
+
+static inline int
+lvm_is_section(struct lvm_node *node)
+{
+	return (!node->value && !node->list);
+}
+
+static struct lvm_node *
+lvm_find(struct lvm_node *section, const char *key)
+{
+	struct lvm_node *node;
+
+	for (node = section ? section->child : NULL; node; node = node->next)
+		if (!strcmp(node->key, key))
+			return node;
+
+	return NULL;
+}
+
+static int
+lvm_find_u64(struct lvm_node *section, const char *key, uint64_t *val)
+{
+	struct lvm_node *node;
+	char *end;
+
+	node = lvm_find(section, key);
+	if (!node || !node->value)
+		return -EINVAL;
+
+	*val = strtoull(node->value, &end, 10);
+	return (*end ? -EINVAL : 0);
+}
+
+static const char *
+lvm_find_str(struct lvm_node *section, const char *key)
+{
+	struct lvm_node *node = lvm_find(section, key);
+	return (node ? node->value : NULL);
+}
+
+static int
+lvm_list_has(struct lvm_node *list, const char *value)
+{
+	struct lvm_node *node;
+
+	if (!list || !list->list)
+		return 0;
+
+	for (node = list->child; node; node = node->next)
+		if (!strcmp(node->value, value))
+			return 1;
+
+	return 0;
+}
+
+static int
+lvm_copy_str(char *dst, const char *src, size_t size)
+{
+	if (strnlen(src, size) == size)
+		return -ENAMETOOLONG;
+
+	strcpy(dst, src);
+	return 0;
+}
+
+/* LVM UUIDs are shown with dashes, and stored without */
+static int
+lvm_uuid_equal(const char *id, const char *uuid)
+{
+	int i;
+
+	for (i = 0; i < LVM_ID_LEN; id++) {
+		if (!*id)
+			return 0;
+		if (*id == '-')
+			continue;
+		if (*id != uuid[i++])
+			return 0;
+	}
+
+	return !*id;
+}
+
+static const struct lvm_pv_label *
+lvm_find_label(const struct lvm_pv_label *labels, int n, const char *id)
+{
+	int i;
+
+	for (i = 0; id && i < n; i++)
+		if (lvm_uuid_equal(id, labels[i].uuid))
+			return labels + i;
+
+	return NULL;
+}
+
+static int
+lvm_parse_lv(struct vg *vg, struct lvm_node *pv_sections,
+	     struct lvm_node *section, struct lv *lv)
+{
+	struct lvm_node *seg, *stripes, *pv;
+	uint64_t start, extents, stripe_count, segments, pe;
+	const char *type;
+	int i, err;
+
+	err = lvm_copy_str(lv->name, section->key, sizeof(lv->name) - 1);
+	if (err)
+		return err;
+
+	if (lvm_find_u64(section, "segment_count", &segments))
+		return -EINVAL;
+	lv->segments = segments;
+
+	for (seg = section->child; seg; seg = seg->next) {
+		if (!lvm_is_section(seg))
+			continue;
+
+		if (lvm_find_u64(seg, "start_extent", &start) ||
+		    lvm_find_u64(seg, "extent_count", &extents))
+			return -EINVAL;
+
+		lv->size += extents * vg->extent_size;
+
+		if (start)
+			continue;
+
+		lv->first_segment.type    = LVM_SEG_TYPE_UNKNOWN;
+		lv->first_segment.pe_size = extents * vg->extent_size;
+
+		/* lvs shows a segment striped over one PV as linear */
+		type = lvm_find_str(seg, "type");
+		if (!type || strcmp(type, "striped") ||
+		    lvm_find_u64(seg, "stripe_count", &stripe_count) ||
+		    stripe_count != 1)
+			continue;
+
+		stripes = lvm_find(seg, "stripes");
+		if (!stripes || !stripes->child || !stripes->child->next)
+			return -EINVAL;
+
+		/* vg->pvs is in the order of physical_volumes */
+		i = 0;
+		for (pv = pv_sections->child; pv; pv = pv->next) {
+			if (!lvm_is_section(pv))
+				continue;
+			if (!strcmp(pv->key, stripes->child->value))
+				break;
+			i++;
+		}
+		if (!pv)
+			return -EINVAL;
+
+		pe = strtoull(stripes->child->next->value, NULL, 10);
+
+		lv->first_segment.type     = LVM_SEG_TYPE_LINEAR;
+		lv->first_segment.pe_start = pe * vg->extent_size +
+			vg->pvs[i].start;
+		strcpy(lv->first_segment.device, vg->pvs[i].name);
+	}
+
+	return 0;
+}
+
+static int
+lvm_parse_vg(const char *vg_name, char *text,
+	     const struct lvm_pv_label *labels, int n_labels,
+	     struct vg *vg, uint64_t *seqno)
+{
+	struct lvm_node root, *section, *pvs, *lvs, *node;
+	const struct lvm_pv_label *label;
+	uint64_t extent_size, pe_start;
+	int i, err;
+
+	memset(&root, 0, sizeof(root));
+
+	err = lvm_parse_section(&text, &root.child, 0);
+	if (err)
+		goto out;
+
+	err = -EINVAL;
+	for (section = root.child; section; section = section->next)
+		if (lvm_is_section(section))
+			break;
+
+	if (!section || strcmp(section->key, vg_name))
+		goto out;
+
+	if (lvm_find_u64(section, "seqno", seqno) ||
+	    lvm_find_u64(section, "extent_size", &extent_size))
+		goto out;
+
+	pvs = lvm_find(section, "physical_volumes");
+	lvs = lvm_find(section, "logical_volumes");
+	if (!pvs)
+		goto out;
+
+	snprintf(vg->name, sizeof(vg->name), "%s", vg_name);
+	vg->extent_size = extent_size * LVM_SECTOR_SIZE;
+
+	for (node = pvs->child; node; node = node->next)
+		if (lvm_is_section(node))
+			vg->pv_cnt++;
+
+	/* LVM tools do not show hidden LVs, such as snapshot COWs */
+	for (node = lvs ? lvs->child : NULL; node; node = node->next)
+		if (lvm_is_section(node) &&
+		    lvm_list_has(lvm_find(node, "status"), "VISIBLE"))
+			vg->lv_cnt++;
+
+	err = -ENOMEM;
+	vg->pvs = calloc(vg->pv_cnt ? : 1, sizeof(struct pv));
+	vg->lvs = calloc(vg->lv_cnt ? : 1, sizeof(struct lv));
+	if (!vg->pvs || !vg->lvs)
+		goto out;
+
+	i = 0;
+	for (node = pvs->child; node; node = node->next) {
+		if (!lvm_is_section(node))
+			continue;
+
+		label = lvm_find_label(labels, n_labels,
+				       lvm_find_str(node, "id"));
+		if (!label) {
+			err = -ENODEV;
+			goto out;
+		}
+
+		err = -EINVAL;
+		if (lvm_find_u64(node, "pe_start", &pe_start))
+			goto out;
+
+		strcpy(vg->pvs[i].name, label->path);
+		vg->pvs[i].start = pe_start * LVM_SECTOR_SIZE;
+		i++;
+	}
+
+	i = 0;
+	for (node = lvs ? lvs->child : NULL; node; node = node->next) {
+		if (!lvm_is_section(node) ||
+		    !lvm_list_has(lvm_find(node, "status"), "VISIBLE"))
+			continue;
+
+		err = lvm_parse_lv(vg, pvs, node, vg->lvs + i);
+		if (err)
+			goto out;
+		i++;
+	}
+
+	err = 0;
+
+out:
+	lvm_free_nodes(root.child);
+	if (err) {
+		EPRINTF("cannot parse metadata of %s: %d\n", vg_name, err);
+		lvm_free_vg(vg);
+	}
+	return err;
+}
+
+/*
+ * The metadata text opens with the VG section, whose first values are its
+ * id and seqno. This lets the cache be validated without parsing.
+ */
+static int
+lvm_peek_vg(const char *text, const char *vg_name,
+	    char *id, size_t id_size, uint64_t *seqno)
+{
+	const char *p, *q;
+	size_t len;
+
+	len = strlen(vg_name);
+	if (strncmp(text, vg_name, len) || !strchr(" {", text[len]))
+		return -ENOENT;
+
+	p = strstr(text, "id = \"");
+	q = strstr(text, "seqno = ");
+	if (!p || !q)
+		return -EINVAL;
+
+	p  += strlen("id = \"");
+	len = strcspn(p, "\"");
+	if (len >= id_size)
+		return -EINVAL;
+
+	memcpy(id, p, len);
+	id[len] = '\0';
+
+	*seqno = strtoull(q + strlen("seqno = "), NULL, 10);
+	return 0;
+}
+
+static int
+lvm_copy_vg(struct vg *dst, const struct vg *src)
+{
+	*dst     = *src;
+	dst->pvs = calloc(src->pv_cnt ? : 1, sizeof(struct pv));
+	dst->lvs = calloc(src->lv_cnt ? : 1, sizeof(struct lv));
+
+	if (!dst->pvs || !dst->lvs) {
+		lvm_free_vg(dst);
+		return -ENOMEM;
+	}
+
+	memcpy(dst->pvs, src->pvs, src->pv_cnt * sizeof(struct pv));
+	memcpy(dst->lvs, src->lvs, src->lv_cnt * sizeof(struct lv));
+	return 0;
+}
+
+static void
+lvm_cache_clear(void)
+{
+	lvm_free_vg(&lvm_cache.vg);
+	free(lvm_cache.labels);
+	memset(&lvm_cache, 0, sizeof(lvm_cache));
+}
+
+/* remember the VG, and the labels of its PVs only */
+static void
+lvm_cache_update(const struct vg *vg, const char *id, uint64_t seqno,
+		 const struct lvm_pv_label *labels, int n_labels)
+{
+	int i, j;
+
+	lvm_cache_clear();
+
+	lvm_cache.labels = calloc(vg->pv_cnt ? : 1, sizeof(*labels));
+	if (!lvm_cache.labels || lvm_copy_vg(&lvm_cache.vg, vg)) {
+		lvm_cache_clear();
+		return;
+	}
+
+	for (i = 0; i < n_labels; i++)
+		for (j = 0; j < vg->pv_cnt; j++)
+			if (!strcmp(labels[i].path, vg->pvs[j].name)) {
+				lvm_cache.labels[lvm_cache.n_labels++] = labels[i];
+				break;
+			}
+
+	strcpy(lvm_cache.name, vg->name);
+	strcpy(lvm_cache.id, id);
+	lvm_cache.seqno = seqno;
+}
+
+static int
+lvm_read_vg_labels(const char *vg_name,
+		   const struct lvm_pv_label *labels, int n_labels,
+		   struct vg *vg)
+{
+	char id[sizeof(lvm_cache.id)];
+	uint64_t seqno;
+	char *text;
+	int i, err;
+
+	err = -ENOENT;
+
+	for (i = 0; i < n_labels; i++) {
+		err = lvm_read_metadata(labels + i, &text);
+		if (err)
+			continue;
+
+		err = lvm_peek_vg(text, vg_name, id, sizeof(id), &seqno);
+		if (err) {
+			free(text);
+			continue;
+		}
+
+		if (!strcmp(lvm_cache.name, vg_name) &&
+		    !strcmp(lvm_cache.id, id) && lvm_cache.seqno == seqno) {
+			free(text);
+			return lvm_copy_vg(vg, &lvm_cache.vg);
+		}
+
+		err = lvm_parse_vg(vg_name, text, labels, n_labels,
+				   vg, &seqno);
+		free(text);
+		if (!err)
+			lvm_cache_update(vg, id, seqno, labels, n_labels);
+		return err;
+	}
+
+	return err;
+}
+
+int
+lvm_read_vg(const char *vg_name, struct vg *vg)
+{
+	struct lvm_pv_label *labels;
+	int n_labels, err;
+
+	memset(vg, 0, sizeof(*vg));
+
+	if (strnlen(vg_name, MAX_NAME_SIZE) == MAX_NAME_SIZE)
+		return -ENAMETOOLONG;
+
+	/* the PVs of the VG are known, unless some were added since */
+	if (!strcmp(lvm_cache.name, vg_name)) {
+		err = lvm_read_vg_labels(vg_name, lvm_cache.labels,
+					 lvm_cache.n_labels, vg);
+		if (!err)
+			return 0;
+	}
+
+	err = lvm_scan_labels(&labels, &n_labels);
+	if (err)
+		return err;
+
+	err = lvm_read_vg_labels(vg_name, labels, n_labels, vg);
+	free(labels);
+
+	return err;
+}
@@ -38,4 +38,11 @@ lvm_scan_vg(const char *vg_name, struct vg *vg);
 void
 lvm_free_vg(struct vg *vg);
 
+int
+lvm_activate_lvs(const char *vg_name, const char **lv_names,
+		 int n, int refresh);
+
+int
+lvm_read_vg(const char *vg_name, struct vg *vg);
+
 #endif /*_LVM_UTIL_PRIV_H*/
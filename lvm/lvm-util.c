@@ -34,11 +34,15 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "lvm-util.h"
+#include "lvm-util-priv.h"
 
 #define EPRINTF(_f, _a...)					\
 	do {							\
@@ -305,6 +309,122 @@ out:
 	return err;
 }
 
+/*
+ * Device-mapper names double the dashes in VG and LV names, and join them
+ * with a single one.
+ */
+static int
+lvm_dm_path(char *path, size_t size, const char *vg_name, const char *lv_name)
+{
+	const char *names[] = { vg_name, lv_name };
+	size_t len;
+	int i;
+
+	len = snprintf(path, size, "/dev/mapper/");
+
+	for (i = 0; i < 2; i++) {
+		const char *c;
+
+		if (i && len < size)
+			path[len++] = '-';
+
+		for (c = names[i]; *c && len < size; c++) {
+			if (*c == '-')
+				path[len++] = '-';
+			if (len < size)
+				path[len++] = *c;
+		}
+	}
+
+	if (len >= size)
+		return -ENAMETOOLONG;
+
+	path[len] = '\0';
+	return 0;
+}
+
+static int
+lvm_lv_active(const char *vg_name, const char *lv_name)
+{
+	char path[4 * MAX_NAME_SIZE + 16];
+
+	if (lvm_dm_path(path, sizeof(path), vg_name, lv_name))
+		return 0;
+
+	return !access(path, F_OK);
+}
+
+/*
+ * Activate, or refresh, the LVs of a VHD chain with a single lvchange.
+ * LVs which are already active are left out of an activation, and no
+ * command runs at all if the whole chain is.
+ */
+int
+lvm_activate_lvs(const char *vg_name, const char **lv_names, int n, int refresh)
+{
+	char **argv;
+	int i, argc, err, status;
+	pid_t pid;
+
+	argv = calloc(n + 4, sizeof(char *));
+	if (!argv)
+		return -ENOMEM;
+
+	argc = 0;
+	argv[argc++] = "lvchange";
+	argv[argc++] = (refresh ? "--refresh" : "-ay");
+
+	for (i = 0; i < n; i++) {
+		if (!refresh && lvm_lv_active(vg_name, lv_names[i]))
+			continue;
+
+		err = asprintf(argv + argc, "%s/%s", vg_name, lv_names[i]);
+		if (err == -1) {
+			err = -ENOMEM;
+			goto out;
+		}
+		argc++;
+	}
+
+	err = 0;
+	if (argc == 2)
+		goto out;
+
+	pid = fork();
+	if (pid == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	if (!pid) {
+		int fd = open("/dev/null", O_WRONLY);
+		if (fd != -1) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		EPRINTF("%s of %d LVs in %s failed: %d\n",
+			refresh ? "refresh" : "activation", argc - 2,
+			vg_name, status);
+		err = -EIO;
+	}
+
+out:
+	for (i = 2; i < argc; i++)
+		free(argv[i]);
+	free(argv);
+	return err;
+}
+
 void
 lvm_free_vg(struct vg *vg)
 {
@@ -318,6 +438,11 @@ lvm_scan_vg(const char *vg_name, struct vg *vg)
 {
 	int err;
 
+	/* the LVM tools are only needed when the metadata cannot be read */
+	err = lvm_read_vg(vg_name, vg);
+	if (!err)
+		return 0;
+
 	memset(vg, 0, sizeof(*vg));
 
 	err = lvm_open_vg(vg_name, vg);
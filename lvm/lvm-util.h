@@ -70,5 +70,7 @@ struct vg {
 
 int lvm_scan_vg(const char *vg_name, struct vg *vg);
 void lvm_free_vg(struct vg *vg);
+int lvm_activate_lvs(const char *vg_name, const char **lv_names,
+		     int n, int refresh);
 
 #endif
@@ -44,7 +44,8 @@
 static int
 usage(void)
 {
-	printf("usage: lvm-util <vgname>\n");
+	printf("usage: lvm-util <vgname>\n"
+	       "       lvm-util <-a activate | -r refresh> <vgname> <lvname>...\n");
 	exit(EINVAL);
 }
 
@@ -57,6 +58,15 @@ main(int argc, char **argv)
 	struct lv *lv;
 	struct lv_segment *seg;
 
+	if (argc > 3 && (!strcmp(argv[1], "-a") || !strcmp(argv[1], "-r"))) {
+		err = lvm_activate_lvs(argv[2], (const char **)argv + 3,
+				       argc - 3, argv[1][1] == 'r');
+		if (err)
+			printf("%s failed: %d\n",
+			       argv[1][1] == 'r' ? "refresh" : "activation", err);
+		return (err >= 0 ? err : -err);
+	}
+
 	if (argc != 2)
 		usage();
 
@@ -89,6 +89,19 @@ test_get_command_coalesce(void **state)
 	assert_ptr_equal(cmd->func, cbt_util_coalesce);
 }
 
+void
+test_get_command_extents(void **state)
+{
+	struct command *cmd;
+
+	char* requested_command = { "extents" };
+
+	cmd = get_command(requested_command);
+
+	assert_string_equal(cmd->name, "extents");
+	assert_ptr_equal(cmd->func, cbt_util_extents);
+}
+
 void
 test_get_command_bad_command(void **state)
 {
@@ -33,6 +33,9 @@
 #include <setjmp.h>
 #include <cmocka.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <cbt-util-priv.h>
 #include <wrappers.h>
@@ -61,6 +64,31 @@ void test_cbt_util_create_success(void **state)
 	test_free(log_meta);
 }
 
+void test_cbt_util_create_fine_success(void **state)
+{
+	int result, fd;
+	char* args[] = { "cbt-util", "-n", "test_disk.log", "-s", "4194304", "-F" };
+	char path[] = "/tmp/test-cbt-util-XXXXXX";
+	struct stat st;
+
+	/* needs a real file descriptor to be sized */
+	fd = mkstemp(path);
+	assert_true(fd >= 0);
+	FILE *test_log = fdopen(fd, "w+");
+
+	will_return(__wrap_fopen, test_log);
+	expect_value(__wrap_fclose, fp, test_log);
+
+	result = cbt_util_create(6, args);
+
+	assert_int_equal(result, 0);
+	assert_int_equal(stat(path, &st), 0);
+	assert_int_equal(st.st_size,
+			 fine_bitmap_offset(4194304) + fine_bitmap_size(4194304));
+
+	unlink(path);
+}
+
 void test_cbt_util_create_file_open_failure(void **state)
 {
 	int result;
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2017, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <uuid/uuid.h>
+#include <unistd.h>
+
+#include <cbt-util-priv.h>
+#include <wrappers.h>
+#include "test-suites.h"
+
+/*
+ * Builds an in-memory log file for a disk of @size bytes whose bitmap is
+ * @bitmap (@len bytes, the rest zero).
+ */
+static void *
+make_log(uint64_t size, const unsigned char *bitmap, size_t len,
+	 size_t *file_size)
+{
+	void *log;
+	uint64_t bmsize = bitmap_size(size);
+
+	*file_size = sizeof(struct cbt_log_metadata) + bmsize;
+	log = malloc(*file_size);
+	memset(log, 0, *file_size);
+
+	((struct cbt_log_metadata*)log)->size = size;
+	memcpy(log + sizeof(struct cbt_log_metadata), bitmap, len);
+
+	return log;
+}
+
+void test_cbt_util_extents_success(void **state)
+{
+	int result;
+	char* args[] = { "cbt-util", "-n", "test_disk.log" };
+	unsigned char bitmap[] = { 0x0f, 0x00, 0xf0, 0x01, 0, 0, 0, 0x80 };
+	void *log;
+	size_t file_size;
+	struct printf_data *output;
+
+	log = make_log(4194304, bitmap, sizeof(bitmap), &file_size);
+	FILE *test_log = fmemopen(log, file_size, "r");
+
+	will_return(__wrap_fopen, test_log);
+	expect_value(__wrap_fclose, fp, test_log);
+
+	output = setup_vprintf_mock(1024);
+
+	result = cbt_util_extents(3, args);
+
+	assert_int_equal(result, 0);
+	assert_string_equal(output->buf,
+			    "0 262144\n1310720 327680\n4128768 65536\n");
+	free_printf_data(output);
+	free(log);
+}
+
+void test_cbt_util_extents_clip_to_size(void **state)
+{
+	int result;
+	char* args[] = { "cbt-util", "-n", "test_disk.log" };
+	unsigned char bitmap[] = { 0xff };
+	void *log;
+	size_t file_size;
+	struct printf_data *output;
+
+	/* two blocks, the second partial: stray bits past it are ignored */
+	log = make_log(100000, bitmap, sizeof(bitmap), &file_size);
+	FILE *test_log = fmemopen(log, file_size, "r");
+
+	will_return(__wrap_fopen, test_log);
+	expect_value(__wrap_fclose, fp, test_log);
+
+	output = setup_vprintf_mock(1024);
+
+	result = cbt_util_extents(3, args);
+
+	assert_int_equal(result, 0);
+	assert_string_equal(output->buf, "0 100000\n");
+	free_printf_data(output);
+	free(log);
+}
+
+void test_cbt_util_extents_across_chunks(void **state)
+{
+	int result;
+	char* args[] = { "cbt-util", "-n", "test_disk.log" };
+	unsigned char *bitmap;
+	void *log;
+	size_t file_size;
+	struct printf_data *output;
+	uint64_t size = ((uint64_t)CBT_EXTENT_CHUNK * 8 + 64) * CBT_BLOCK_SIZE;
+
+	bitmap = malloc(CBT_EXTENT_CHUNK + 1);
+	memset(bitmap, 0, CBT_EXTENT_CHUNK + 1);
+	bitmap[CBT_EXTENT_CHUNK - 1] = 0x80;
+	bitmap[CBT_EXTENT_CHUNK]     = 0x01;
+
+	log = make_log(size, bitmap, CBT_EXTENT_CHUNK + 1, &file_size);
+	FILE *test_log = fmemopen(log, file_size, "r");
+
+	will_return(__wrap_fopen, test_log);
+	expect_value(__wrap_fclose, fp, test_log);
+
+	output = setup_vprintf_mock(1024);
+
+	result = cbt_util_extents(3, args);
+
+	assert_int_equal(result, 0);
+	assert_string_equal(output->buf, "34359672832 131072\n");
+	free_printf_data(output);
+	free(bitmap);
+	free(log);
+}
+
+void test_cbt_util_extents_fine_success(void **state)
+{
+	int result, fd;
+	char* args[] = { "cbt-util", "-n", "test_disk.log" };
+	char path[] = "/tmp/test-cbt-util-XXXXXX";
+	/* blocks 0, 1 and 3 changed */
+	unsigned char bitmap[] = { 0x0b };
+	/* 4K sub-blocks 0-1 and 15 of block 0, 0 of block 1, none of 3 */
+	unsigned char fine[] = { 0x03, 0x80, 0x01, 0x00 };
+	uint64_t size = 4194304;
+	void *log;
+	size_t file_size;
+	struct printf_data *output;
+
+	log = make_log(size, bitmap, sizeof(bitmap), &file_size);
+
+	/* the fine layer is only seen on a real file */
+	fd = mkstemp(path);
+	assert_true(fd >= 0);
+	assert_int_equal(pwrite(fd, log, file_size, 0), file_size);
+	assert_int_equal(pwrite(fd, fine, sizeof(fine),
+				fine_bitmap_offset(size)), sizeof(fine));
+	assert_int_equal(ftruncate(fd, fine_bitmap_offset(size) +
+				   fine_bitmap_size(size)), 0);
+	unlink(path);
+
+	FILE *test_log = fdopen(fd, "r");
+
+	will_return(__wrap_fopen, test_log);
+	expect_value(__wrap_fclose, fp, test_log);
+
+	output = setup_vprintf_mock(1024);
+
+	result = cbt_util_extents(3, args);
+
+	assert_int_equal(result, 0);
+	assert_string_equal(output->buf,
+			    "0 8192\n61440 8192\n196608 65536\n");
+	free_printf_data(output);
+	free(log);
+}
+
+void test_cbt_util_extents_empty(void **state)
+{
+	int result;
+	char* args[] = { "cbt-util", "-n", "test_disk.log" };
+	void *log;
+	size_t file_size;
+	struct printf_data *output;
+
+	log = make_log(4194304, NULL, 0, &file_size);
+	FILE *test_log = fmemopen(log, file_size, "r");
+
+	will_return(__wrap_fopen, test_log);
+	expect_value(__wrap_fclose, fp, test_log);
+
+	output = setup_vprintf_mock(1024);
+
+	result = cbt_util_extents(3, args);
+
+	assert_int_equal(result, 0);
+	assert_int_equal(output->offset, 0);
+	free_printf_data(output);
+	free(log);
+}
+
+void test_cbt_util_extents_no_name_failure(void **state)
+{
+	int result;
+	char* args[] = { "cbt-util", "-v", "test_disk.vhd" };
+	struct printf_data *output;
+
+	output = setup_vprintf_mock(1024);
+
+	result = cbt_util_extents(3, args);
+
+	assert_int_equal(result, -EINVAL);
+	free_printf_data(output);
+}
+
+void test_cbt_util_extents_nofile_failure(void **state)
+{
+	int result;
+	char* args[] = { "cbt-util", "-n", "test_disk.log" };
+
+	will_return(__wrap_fopen, NULL);
+
+	result = cbt_util_extents(3, args);
+
+	assert_int_equal(result, -ENOENT);
+}
+
+void test_cbt_util_extents_no_meta_failure(void **state)
+{
+	int result;
+	char* args[] = { "cbt-util", "-n", "test_disk.log" };
+	void *log_meta[1];
+
+	FILE *test_log = fmemopen((void*)log_meta, 1, "r");
+
+	will_return(__wrap_fopen, test_log);
+	expect_value(__wrap_fclose, fp, test_log);
+
+	result = cbt_util_extents(3, args);
+
+	assert_int_equal(result, -EIO);
+}
+
+void test_cbt_util_extents_no_bitmap_failure(void **state)
+{
+	int result;
+	char* args[] = { "cbt-util", "-n", "test_disk.log" };
+	void *log_meta;
+
+	log_meta = malloc(sizeof(struct cbt_log_metadata));
+	((struct cbt_log_metadata*)log_meta)->size = 4194304;
+	FILE *test_log = fmemopen(log_meta, sizeof(struct cbt_log_metadata), "r");
+
+	will_return(__wrap_fopen, test_log);
+	expect_value(__wrap_fclose, fp, test_log);
+
+	result = cbt_util_extents(3, args);
+
+	assert_int_equal(result, -EIO);
+	free(log_meta);
+}
+
+void test_cbt_util_extents_malloc_failure(void **state)
+{
+	int result;
+	char* args[] = { "cbt-util", "-n", "test_disk.log" };
+
+	malloc_succeeds(false);
+
+	result = cbt_util_extents(3, args);
+	assert_int_equal(result, -ENOMEM);
+
+	disable_malloc_mock();
+}
+
+void test_cbt_util_extents_bitmap_malloc_failure(void **state)
+{
+	int result;
+	char* args[] = { "cbt-util", "-n", "test_disk.log" };
+	void *log;
+	size_t file_size;
+
+	log = make_log(4194304, NULL, 0, &file_size);
+	FILE *test_log = fmemopen(log, file_size, "r");
+
+	will_return(__wrap_fopen, test_log);
+	expect_value(__wrap_fclose, fp, test_log);
+
+	malloc_succeeds(true);
+	malloc_succeeds(false);
+
+	result = cbt_util_extents(3, args);
+	assert_int_equal(result, -ENOMEM);
+
+	disable_malloc_mock();
+	free(log);
+}
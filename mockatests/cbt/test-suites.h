@@ -42,6 +42,7 @@ void test_get_command_create(void **state);
 void test_get_command_set(void **state);
 void test_get_command_get(void **state);
 void test_get_command_coalesce(void **state);
+void test_get_command_extents(void **state);
 void test_get_command_bad_command(void **state);
 void test_get_command_over_long_command(void **state);
 
@@ -81,6 +82,7 @@ void test_cbt_util_set_no_file_failure(void **state);
 
 /* 'cbt-util create' tests */
 void test_cbt_util_create_success(void **state);
+void test_cbt_util_create_fine_success(void **state);
 void test_cbt_util_create_file_open_failure(void **state);
 void test_cbt_util_create_metadata_write_failure(void **state);
 void test_cbt_util_create_bitmap_write_failure(void **state);
@@ -107,12 +109,26 @@ void test_cbt_util_coalesce_success(void **state);
 void test_cbt_util_coalesce_set_file_pointer_failure(void **state);
 void test_cbt_util_coalesce_write_bitmap_failure(void **state);
 
+/* 'cbt-util extents' tests */
+void test_cbt_util_extents_success(void **state);
+void test_cbt_util_extents_clip_to_size(void **state);
+void test_cbt_util_extents_across_chunks(void **state);
+void test_cbt_util_extents_fine_success(void **state);
+void test_cbt_util_extents_empty(void **state);
+void test_cbt_util_extents_no_name_failure(void **state);
+void test_cbt_util_extents_nofile_failure(void **state);
+void test_cbt_util_extents_no_meta_failure(void **state);
+void test_cbt_util_extents_no_bitmap_failure(void **state);
+void test_cbt_util_extents_malloc_failure(void **state);
+void test_cbt_util_extents_bitmap_malloc_failure(void **state);
+
 /* Functions under test */
 
 extern int cbt_util_create(int , char **);
 extern int cbt_util_set(int , char **);
 extern int cbt_util_get(int , char **);
 extern int cbt_util_coalesce(int , char **);
+extern int cbt_util_extents(int , char **);
 extern void help(void);
 
 static const struct CMUnitTest cbt_command_tests[] = {
@@ -120,6 +136,7 @@ static const struct CMUnitTest cbt_command_tests[] = {
 	cmocka_unit_test(test_get_command_set),
 	cmocka_unit_test(test_get_command_get),
 	cmocka_unit_test(test_get_command_coalesce),
+	cmocka_unit_test(test_get_command_extents),
 	cmocka_unit_test(test_get_command_bad_command),
 	cmocka_unit_test(test_get_command_over_long_command),
 	cmocka_unit_test(test_help_success)
@@ -160,6 +177,7 @@ static const struct CMUnitTest cbt_get_tests[] = {
 
 static const struct CMUnitTest cbt_create_tests[] = {
 	cmocka_unit_test(test_cbt_util_create_success),
+	cmocka_unit_test(test_cbt_util_create_fine_success),
 	cmocka_unit_test(test_cbt_util_create_file_open_failure),
 	cmocka_unit_test(test_cbt_util_create_metadata_write_failure),
 	cmocka_unit_test(test_cbt_util_create_bitmap_write_failure),
@@ -188,4 +206,18 @@ static const struct CMUnitTest cbt_coalesce_tests[] = {
 	cmocka_unit_test(test_cbt_util_coalesce_write_bitmap_failure)
 };
 
+static const struct CMUnitTest cbt_extents_tests[] = {
+	cmocka_unit_test(test_cbt_util_extents_success),
+	cmocka_unit_test(test_cbt_util_extents_clip_to_size),
+	cmocka_unit_test(test_cbt_util_extents_across_chunks),
+	cmocka_unit_test(test_cbt_util_extents_fine_success),
+	cmocka_unit_test(test_cbt_util_extents_empty),
+	cmocka_unit_test(test_cbt_util_extents_no_name_failure),
+	cmocka_unit_test(test_cbt_util_extents_nofile_failure),
+	cmocka_unit_test(test_cbt_util_extents_no_meta_failure),
+	cmocka_unit_test(test_cbt_util_extents_no_bitmap_failure),
+	cmocka_unit_test(test_cbt_util_extents_malloc_failure),
+	cmocka_unit_test(test_cbt_util_extents_bitmap_malloc_failure)
+};
+
 #endif /* __TEST_SUITES_H__ */
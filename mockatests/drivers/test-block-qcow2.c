@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2018, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#include "test-suites.h"
+
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-queue.h"
+
+/*
+ * The smallest clusters there are, so that a refcount block (256
+ * clusters) and an L2 table (64 clusters) fill up after few writes.
+ */
+#define TEST_CLUSTER_BITS 9
+#define TEST_CLUSTER_SIZE (1 << TEST_CLUSTER_BITS)
+#define TEST_IMAGE_SIZE   (1 << 20)
+#define TEST_L2_ENTRIES   (TEST_CLUSTER_SIZE / 8)
+#define TEST_RB_ENTRIES   (TEST_CLUSTER_SIZE / 2)
+#define TEST_L1_SIZE      (TEST_IMAGE_SIZE / TEST_CLUSTER_SIZE / TEST_L2_ENTRIES)
+
+/* header, refcount table, refcount block, L1 table */
+#define TEST_RT_OFFSET    (1 * TEST_CLUSTER_SIZE)
+#define TEST_RB_OFFSET    (2 * TEST_CLUSTER_SIZE)
+#define TEST_L1_OFFSET    (3 * TEST_CLUSTER_SIZE)
+#define TEST_FREE_OFFSET  (4 * TEST_CLUSTER_SIZE)
+
+#define TEST_COPIED       (1ULL << 63)
+#define TEST_OFFSET_MASK  0x00fffffffffffe00ULL
+
+#define TEST_MAX_TIOCBS   64
+
+struct test_qcow2 {
+	td_driver_t  *driver;
+	int           fd;
+	char          path[32];
+
+	int           n_done;
+	int           err;
+};
+
+/*
+ * The driver's tiocbs are held here rather than queued, so that the
+ * image can be looked at between queueing the data and the completion
+ * which links it in.
+ */
+static struct tiocb *pending[TEST_MAX_TIOCBS];
+static int n_pending;
+
+void
+__wrap_tapdisk_driver_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
+{
+	assert_true(n_pending < TEST_MAX_TIOCBS);
+	pending[n_pending++] = tiocb;
+}
+
+static void
+test_qcow2_drain(void)
+{
+	struct tiocb *tiocb;
+	struct iocb *io;
+	ssize_t n;
+	int i, err;
+
+	for (i = 0; i < n_pending; i++) {
+		tiocb = pending[i];
+		io    = &tiocb->iocb;
+
+		switch (io->aio_lio_opcode) {
+		case IO_CMD_PREAD:
+			n = pread(io->aio_fildes, io->u.c.buf, io->u.c.nbytes,
+				  io->u.c.offset);
+			break;
+		case IO_CMD_PWRITE:
+			n = pwrite(io->aio_fildes, io->u.c.buf, io->u.c.nbytes,
+				   io->u.c.offset);
+			break;
+		default:
+			fail();
+		}
+
+		if (n == io->u.c.nbytes)
+			err = 0;
+		else
+			err = n < 0 ? -errno : -EIO;
+
+		/* may queue more */
+		tiocb->cb(tiocb->arg, tiocb, err);
+	}
+
+	n_pending = 0;
+}
+
+static void
+put_be16(char *p, uint16_t v)
+{
+	v = htobe16(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void
+put_be32(char *p, uint32_t v)
+{
+	v = htobe32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void
+put_be64(char *p, uint64_t v)
+{
+	v = htobe64(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static uint64_t
+test_qcow2_read64(struct test_qcow2 *tq, uint64_t offset)
+{
+	uint64_t v;
+
+	assert_int_equal(pread(tq->fd, &v, sizeof(v), offset), sizeof(v));
+	return be64toh(v);
+}
+
+static uint16_t
+test_qcow2_refcount(struct test_qcow2 *tq, uint64_t offset)
+{
+	uint64_t cluster, rb;
+	uint16_t v;
+
+	cluster = offset >> TEST_CLUSTER_BITS;
+	rb      = test_qcow2_read64(tq, TEST_RT_OFFSET +
+				    (cluster / TEST_RB_ENTRIES) * 8);
+	if (!rb)
+		return 0;
+
+	assert_int_equal(pread(tq->fd, &v, sizeof(v),
+			       rb + (cluster % TEST_RB_ENTRIES) * 2),
+			 sizeof(v));
+	return be16toh(v);
+}
+
+static uint64_t
+test_qcow2_l1(struct test_qcow2 *tq, uint64_t vc)
+{
+	return test_qcow2_read64(tq, TEST_L1_OFFSET +
+				 (vc / TEST_L2_ENTRIES) * 8);
+}
+
+static uint64_t
+test_qcow2_l2(struct test_qcow2 *tq, uint64_t vc)
+{
+	uint64_t l2 = test_qcow2_l1(tq, vc) & TEST_OFFSET_MASK;
+
+	if (!l2)
+		return 0;
+
+	return test_qcow2_read64(tq, l2 + (vc % TEST_L2_ENTRIES) * 8);
+}
+
+/*
+ * A v3 image of TEST_IMAGE_SIZE bytes with nothing allocated, its
+ * refcount table already big enough for all of it.
+ */
+int
+test_qcow2_setup(void **state)
+{
+	struct test_qcow2 *tq;
+	char *buf;
+	int err;
+
+	tq = calloc(1, sizeof(*tq));
+	assert_non_null(tq);
+
+	strcpy(tq->path, "/tmp/test-qcow2.XXXXXX");
+	tq->fd = mkstemp(tq->path);
+	assert_true(tq->fd >= 0);
+
+	buf = calloc(1, TEST_FREE_OFFSET);
+	assert_non_null(buf);
+
+	put_be32(buf +   0, 0x514649fb);
+	put_be32(buf +   4, 3);
+	put_be32(buf +  20, TEST_CLUSTER_BITS);
+	put_be64(buf +  24, TEST_IMAGE_SIZE);
+	put_be32(buf +  36, TEST_L1_SIZE);
+	put_be64(buf +  40, TEST_L1_OFFSET);
+	put_be64(buf +  48, TEST_RT_OFFSET);
+	put_be32(buf +  56, 1);
+	put_be32(buf +  96, 4);
+	put_be32(buf + 100, 104);
+
+	put_be64(buf + TEST_RT_OFFSET, TEST_RB_OFFSET);
+
+	put_be16(buf + TEST_RB_OFFSET + 0, 1);
+	put_be16(buf + TEST_RB_OFFSET + 2, 1);
+	put_be16(buf + TEST_RB_OFFSET + 4, 1);
+	put_be16(buf + TEST_RB_OFFSET + 6, 1);
+
+	assert_int_equal(pwrite(tq->fd, buf, TEST_FREE_OFFSET, 0),
+			 TEST_FREE_OFFSET);
+	free(buf);
+
+	tq->driver = tapdisk_driver_allocate(DISK_TYPE_QCOW2, tq->path, 0);
+	assert_non_null(tq->driver);
+
+	err = tq->driver->ops->td_open(tq->driver, tq->path, NULL,
+				       TD_OPEN_NO_O_DIRECT);
+	assert_int_equal(err, 0);
+
+	n_pending = 0;
+	*state    = tq;
+
+	return 0;
+}
+
+int
+test_qcow2_teardown(void **state)
+{
+	struct test_qcow2 *tq = *state;
+
+	tq->driver->ops->td_close(tq->driver);
+	tapdisk_driver_free(tq->driver);
+
+	close(tq->fd);
+	unlink(tq->path);
+	free(tq);
+
+	return 0;
+}
+
+static void
+test_qcow2_cb(td_request_t treq, int err)
+{
+	struct test_qcow2 *tq = treq.cb_data;
+
+	tq->n_done++;
+	tq->err = tq->err ? : err;
+}
+
+static void
+test_qcow2_queue(struct test_qcow2 *tq, int op, uint64_t vc, char *buf)
+{
+	td_request_t treq;
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op      = op;
+	treq.buf     = buf;
+	treq.sec     = vc * (TEST_CLUSTER_SIZE >> SECTOR_SHIFT);
+	treq.secs    = TEST_CLUSTER_SIZE >> SECTOR_SHIFT;
+	treq.cb      = test_qcow2_cb;
+	treq.cb_data = tq;
+
+	if (op == TD_OP_WRITE)
+		tq->driver->ops->td_queue_write(tq->driver, treq);
+	else
+		tq->driver->ops->td_queue_read(tq->driver, treq);
+}
+
+/* writes guest cluster @vc full of (@vc & 0xff) */
+static void
+test_qcow2_write(struct test_qcow2 *tq, uint64_t vc)
+{
+	char buf[TEST_CLUSTER_SIZE];
+
+	memset(buf, vc & 0xff, sizeof(buf));
+
+	tq->n_done = 0;
+	test_qcow2_queue(tq, TD_OP_WRITE, vc, buf);
+	test_qcow2_drain();
+
+	assert_int_equal(tq->n_done, 1);
+	assert_int_equal(tq->err, 0);
+}
+
+static void
+test_qcow2_verify(struct test_qcow2 *tq, uint64_t vc)
+{
+	char buf[TEST_CLUSTER_SIZE];
+	int i;
+
+	memset(buf, ~vc & 0xff, sizeof(buf));
+
+	tq->n_done = 0;
+	test_qcow2_queue(tq, TD_OP_READ, vc, buf);
+	test_qcow2_drain();
+
+	assert_int_equal(tq->n_done, 1);
+	assert_int_equal(tq->err, 0);
+
+	for (i = 0; i < sizeof(buf); i++)
+		assert_int_equal(buf[i] & 0xff, vc & 0xff);
+}
+
+static void
+test_qcow2_ref(int *refs, uint64_t n, uint64_t offset)
+{
+	assert_int_equal(offset & (TEST_CLUSTER_SIZE - 1), 0);
+	assert_true(offset >> TEST_CLUSTER_BITS < n);
+
+	refs[offset >> TEST_CLUSTER_BITS]++;
+}
+
+/*
+ * Every cluster of the file is referenced exactly once, from the
+ * header, the refcount table or an L1 or L2 table, has a refcount of 1
+ * and is marked COPIED where the entry has the flag: nothing leaked,
+ * nothing shared.
+ */
+static void
+test_qcow2_check(struct test_qcow2 *tq)
+{
+	uint64_t n, i, j, rb, l2, entry;
+	struct stat st;
+	int *refs;
+
+	assert_int_equal(fstat(tq->fd, &st), 0);
+	assert_int_equal(st.st_size & (TEST_CLUSTER_SIZE - 1), 0);
+
+	n    = st.st_size >> TEST_CLUSTER_BITS;
+	refs = calloc(n, sizeof(*refs));
+	assert_non_null(refs);
+
+	test_qcow2_ref(refs, n, 0);
+	test_qcow2_ref(refs, n, TEST_RT_OFFSET);
+	test_qcow2_ref(refs, n, TEST_L1_OFFSET);
+
+	for (i = 0; i < TEST_CLUSTER_SIZE / 8; i++) {
+		rb = test_qcow2_read64(tq, TEST_RT_OFFSET + i * 8);
+		if (rb)
+			test_qcow2_ref(refs, n, rb);
+	}
+
+	for (i = 0; i < TEST_L1_SIZE; i++) {
+		entry = test_qcow2_l1(tq, i * TEST_L2_ENTRIES);
+		l2    = entry & TEST_OFFSET_MASK;
+		if (!l2)
+			continue;
+
+		assert_true(entry & TEST_COPIED);
+		test_qcow2_ref(refs, n, l2);
+
+		for (j = 0; j < TEST_L2_ENTRIES; j++) {
+			entry = test_qcow2_read64(tq, l2 + j * 8);
+			if (!entry)
+				continue;
+
+			assert_true(entry & TEST_COPIED);
+			test_qcow2_ref(refs, n, entry & TEST_OFFSET_MASK);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		assert_int_equal(refs[i], 1);
+		assert_int_equal(test_qcow2_refcount(tq, i << TEST_CLUSTER_BITS),
+				 1);
+	}
+
+	free(refs);
+}
+
+/*
+ * Data goes to the next free cluster as it is queued, and nothing on
+ * disk points at it, or counts it, until it is written. Only then is
+ * it linked in: refcount, then a new L2 table right behind it, then
+ * the L1 entry of that.
+ */
+void
+test_qcow2_alloc_order(void **state)
+{
+	struct test_qcow2 *tq = *state;
+	const uint64_t f = TEST_FREE_OFFSET, cs = TEST_CLUSTER_SIZE;
+	char buf[TEST_CLUSTER_SIZE];
+
+	memset(buf, 0, sizeof(buf));
+
+	tq->n_done = 0;
+	test_qcow2_queue(tq, TD_OP_WRITE, 0, buf);
+
+	assert_int_equal(n_pending, 1);
+	assert_int_equal(pending[0]->iocb.u.c.offset, f);
+	assert_int_equal(test_qcow2_refcount(tq, f), 0);
+	assert_int_equal(test_qcow2_l1(tq, 0), 0);
+
+	test_qcow2_drain();
+	assert_int_equal(tq->n_done, 1);
+	assert_int_equal(tq->err, 0);
+
+	assert_int_equal(test_qcow2_l1(tq, 0), (f + cs) | TEST_COPIED);
+	assert_int_equal(test_qcow2_l2(tq, 0), f | TEST_COPIED);
+
+	/* the same L2 table */
+	test_qcow2_write(tq, 1);
+	assert_int_equal(test_qcow2_l1(tq, 1), (f + cs) | TEST_COPIED);
+	assert_int_equal(test_qcow2_l2(tq, 1), (f + 2 * cs) | TEST_COPIED);
+
+	/* the next one */
+	test_qcow2_write(tq, TEST_L2_ENTRIES);
+	assert_int_equal(test_qcow2_l2(tq, TEST_L2_ENTRIES),
+			 (f + 3 * cs) | TEST_COPIED);
+	assert_int_equal(test_qcow2_l1(tq, TEST_L2_ENTRIES),
+			 (f + 4 * cs) | TEST_COPIED);
+
+	/* rewrites stay in place */
+	test_qcow2_write(tq, 1);
+	assert_int_equal(test_qcow2_l2(tq, 1), (f + 2 * cs) | TEST_COPIED);
+
+	test_qcow2_check(tq);
+
+	test_qcow2_verify(tq, 0);
+	test_qcow2_verify(tq, 1);
+	test_qcow2_verify(tq, TEST_L2_ENTRIES);
+}
+
+/*
+ * Past the first TEST_RB_ENTRIES clusters a second refcount block is
+ * needed. It lands in its own range and counts itself.
+ */
+void
+test_qcow2_second_refblock(void **state)
+{
+	struct test_qcow2 *tq = *state;
+	uint64_t vc, rb, n = TEST_RB_ENTRIES + TEST_L2_ENTRIES;
+
+	for (vc = 0; vc < n; vc++)
+		test_qcow2_write(tq, vc);
+
+	rb = test_qcow2_read64(tq, TEST_RT_OFFSET + 8);
+	assert_true(rb);
+	assert_int_equal((rb >> TEST_CLUSTER_BITS) / TEST_RB_ENTRIES, 1);
+	assert_int_equal(test_qcow2_read64(tq, TEST_RT_OFFSET + 16), 0);
+
+	test_qcow2_check(tq);
+
+	for (vc = 0; vc < n; vc++)
+		test_qcow2_verify(tq, vc);
+}
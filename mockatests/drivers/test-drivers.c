@@ -39,7 +39,11 @@
 int main(void)
 {
 	int result =
-		cmocka_run_group_tests_name("Stats tests", tapdisk_stats_tests, NULL, NULL);
+		cmocka_run_group_tests_name("Stats tests", tapdisk_stats_tests, NULL, NULL) +
+		cmocka_run_group_tests_name("Scheduler tests", tapdisk_scheduler_tests, NULL, NULL) +
+		cmocka_run_group_tests_name("Queue tests", tapdisk_queue_tests, NULL, NULL) +
+		cmocka_run_group_tests_name("Qcow2 tests", tapdisk_qcow2_tests, NULL, NULL) +
+		cmocka_run_group_tests_name("vhost-user-blk tests", tapdisk_vhostblk_tests, NULL, NULL);
 
 	return result;
 }
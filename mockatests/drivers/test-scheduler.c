@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2018, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+#include "test-suites.h"
+
+#include "scheduler.h"
+#include "timeout-math.h"
+
+struct test_fd_event {
+	int  fd;
+	int  fired;
+	char mode;
+};
+
+/* drains the pipe, as edge-triggered epoll requires */
+static void
+test_fd_event_cb(event_id_t id, char mode, void *private)
+{
+	struct test_fd_event *ev = private;
+	char buf[16];
+
+	ev->fired++;
+	ev->mode = mode;
+
+	while (read(ev->fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static void
+test_scheduler_wait(scheduler_t *s, int usecs)
+{
+	scheduler_set_max_timeout(s, TV_USECS(usecs));
+	assert_int_equal(scheduler_wait_for_events(s), 0);
+}
+
+/*
+ * A readable pipe wakes its event, a masked event stays quiet until it is
+ * unmasked, and unregistering one of two events on the same descriptor
+ * leaves the other watching it.
+ */
+static void
+test_scheduler_fd_events(enum scheduler_backend backend)
+{
+	struct test_fd_event a = { 0 }, b = { 0 };
+	event_id_t ida, idb;
+	scheduler_t s;
+	int fds[2];
+
+	assert_int_equal(pipe(fds), 0);
+	assert_int_equal(fcntl(fds[0], F_SETFL, O_NONBLOCK), 0);
+	a.fd = b.fd = fds[0];
+
+	scheduler_initialize(&s);
+	assert_int_equal(scheduler_set_backend(&s, backend), 0);
+
+	ida = scheduler_register_event(&s, SCHEDULER_POLL_READ_FD, fds[0],
+				       TV_ZERO, test_fd_event_cb, &a);
+	assert_true(ida > 0);
+
+	test_scheduler_wait(&s, 10000);
+	assert_int_equal(a.fired, 0);
+
+	assert_int_equal(write(fds[1], "x", 1), 1);
+	test_scheduler_wait(&s, 10000);
+	assert_int_equal(a.fired, 1);
+	assert_int_equal(a.mode, SCHEDULER_POLL_READ_FD);
+
+	scheduler_mask_event(&s, ida, 1);
+	assert_int_equal(write(fds[1], "x", 1), 1);
+	test_scheduler_wait(&s, 10000);
+	assert_int_equal(a.fired, 1);
+
+	scheduler_mask_event(&s, ida, 0);
+	test_scheduler_wait(&s, 10000);
+	assert_int_equal(a.fired, 2);
+
+	idb = scheduler_register_event(&s, SCHEDULER_POLL_READ_FD, fds[0],
+				       TV_ZERO, test_fd_event_cb, &b);
+	assert_true(idb > 0);
+
+	scheduler_unregister_event(&s, ida);
+	assert_int_equal(write(fds[1], "x", 1), 1);
+	test_scheduler_wait(&s, 10000);
+	assert_int_equal(a.fired, 2);
+	assert_int_equal(b.fired, 1);
+
+	scheduler_unregister_event(&s, idb);
+	test_scheduler_wait(&s, 0);
+	scheduler_uninitialize(&s);
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+void
+test_scheduler_select_fd_events(void **state)
+{
+	test_scheduler_fd_events(SCHEDULER_BACKEND_SELECT);
+}
+
+void
+test_scheduler_epoll_fd_events(void **state)
+{
+	test_scheduler_fd_events(SCHEDULER_BACKEND_EPOLL);
+}
+
+void
+test_scheduler_epoll_et_fd_events(void **state)
+{
+	test_scheduler_fd_events(SCHEDULER_BACKEND_EPOLL_ET);
+}
+
+/*
+ * epoll refuses regular files. Their events run on every iteration, as
+ * select(2) reports such files always ready.
+ */
+void
+test_scheduler_epoll_regular_file(void **state)
+{
+	struct test_fd_event ev = { 0 };
+	event_id_t id;
+	scheduler_t s;
+	FILE *f;
+
+	f = tmpfile();
+	assert_non_null(f);
+	ev.fd = fileno(f);
+
+	scheduler_initialize(&s);
+	assert_int_equal(scheduler_set_backend(&s, SCHEDULER_BACKEND_EPOLL), 0);
+
+	id = scheduler_register_event(&s, SCHEDULER_POLL_READ_FD, ev.fd,
+				      TV_ZERO, test_fd_event_cb, &ev);
+	assert_true(id > 0);
+
+	test_scheduler_wait(&s, 1000000);
+	test_scheduler_wait(&s, 1000000);
+	assert_int_equal(ev.fired, 2);
+
+	scheduler_mask_event(&s, id, 1);
+	test_scheduler_wait(&s, 10000);
+	assert_int_equal(ev.fired, 2);
+
+	scheduler_unregister_event(&s, id);
+	test_scheduler_wait(&s, 0);
+	scheduler_uninitialize(&s);
+
+	fclose(f);
+}
+
+#define TEST_N_TIMERS 16
+
+struct test_timers {
+	scheduler_t s;
+	event_id_t  ids[TEST_N_TIMERS];
+	int         order[TEST_N_TIMERS];
+	int         n_fired;
+};
+
+struct test_timer {
+	struct test_timers *timers;
+	int                 idx;
+};
+
+/* one-shot: a timeout event stays armed until it is unregistered */
+static void
+test_timer_cb(event_id_t id, char mode, void *private)
+{
+	struct test_timer *t = private;
+	struct test_timers *timers = t->timers;
+
+	assert_int_equal(mode, SCHEDULER_POLL_TIMEOUT);
+
+	timers->order[timers->n_fired++] = t->idx;
+	scheduler_unregister_event(&timers->s, id);
+}
+
+static void
+test_timers_register(struct test_timers *timers, struct test_timer *t,
+		     int idx, int msecs)
+{
+	t->timers = timers;
+	t->idx    = idx;
+
+	timers->ids[idx] =
+		scheduler_register_event(&timers->s, SCHEDULER_POLL_TIMEOUT, -1,
+					 TV_USECS(msecs * 1000),
+					 test_timer_cb, t);
+	assert_true(timers->ids[idx] > 0);
+}
+
+static void
+test_timers_run(struct test_timers *timers, int n)
+{
+	int i;
+
+	for (i = 0; i < 100 && timers->n_fired < n; i++)
+		test_scheduler_wait(&timers->s, 100000);
+
+	assert_int_equal(timers->n_fired, n);
+}
+
+/*
+ * Deadlines of 5 to 80 ms, registered out of order, fire earliest first.
+ */
+void
+test_scheduler_timeouts_in_deadline_order(void **state)
+{
+	static const int perm[TEST_N_TIMERS] = {
+		11, 3, 15, 0, 7, 12, 1, 9, 14, 4, 6, 13, 2, 10, 8, 5
+	};
+	struct test_timer t[TEST_N_TIMERS];
+	struct test_timers timers = { .n_fired = 0 };
+	int i;
+
+	scheduler_initialize(&timers.s);
+
+	for (i = 0; i < TEST_N_TIMERS; i++)
+		test_timers_register(&timers, &t[i], i, (perm[i] + 1) * 5);
+
+	test_timers_run(&timers, TEST_N_TIMERS);
+
+	for (i = 0; i < TEST_N_TIMERS; i++)
+		assert_int_equal(perm[timers.order[i]], i);
+
+	scheduler_uninitialize(&timers.s);
+}
+
+/*
+ * Unregistering timers from the middle of the heap keeps the others in
+ * order.
+ */
+void
+test_scheduler_timeouts_unregister(void **state)
+{
+	struct test_timer t[TEST_N_TIMERS];
+	struct test_timers timers = { .n_fired = 0 };
+	int i;
+
+	scheduler_initialize(&timers.s);
+
+	for (i = 0; i < TEST_N_TIMERS; i++)
+		test_timers_register(&timers, &t[i], i,
+				     (TEST_N_TIMERS - i) * 5);
+
+	for (i = 0; i < TEST_N_TIMERS; i += 3)
+		scheduler_unregister_event(&timers.s, timers.ids[i]);
+
+	test_timers_run(&timers, TEST_N_TIMERS - (TEST_N_TIMERS + 2) / 3);
+
+	for (i = 1; i < timers.n_fired; i++)
+		assert_true(timers.order[i] < timers.order[i - 1]);
+	for (i = 0; i < timers.n_fired; i++)
+		assert_int_not_equal(timers.order[i] % 3, 0);
+
+	scheduler_uninitialize(&timers.s);
+}
+
+/*
+ * A timer whose timeout is changed moves to its new place in the heap.
+ */
+void
+test_scheduler_timeouts_set_timeout(void **state)
+{
+	struct test_timer t[3];
+	struct test_timers timers = { .n_fired = 0 };
+	int i;
+
+	scheduler_initialize(&timers.s);
+
+	for (i = 0; i < 3; i++)
+		test_timers_register(&timers, &t[i], i, (i + 1) * 10);
+
+	assert_int_equal(scheduler_event_set_timeout(&timers.s, timers.ids[0],
+						     TV_USECS(40000)), 0);
+
+	test_timers_run(&timers, 3);
+
+	assert_int_equal(timers.order[0], 1);
+	assert_int_equal(timers.order[1], 2);
+	assert_int_equal(timers.order[2], 0);
+
+	scheduler_uninitialize(&timers.s);
+}
+
+/*
+ * A masked timer does not fire, however long past its deadline.
+ */
+void
+test_scheduler_timeouts_masked(void **state)
+{
+	struct test_timers timers = { .n_fired = 0 };
+	struct test_timer t;
+
+	scheduler_initialize(&timers.s);
+
+	test_timers_register(&timers, &t, 0, 10);
+	scheduler_mask_event(&timers.s, timers.ids[0], 1);
+
+	test_scheduler_wait(&timers.s, 50000);
+	assert_int_equal(timers.n_fired, 0);
+
+	scheduler_unregister_event(&timers.s, timers.ids[0]);
+	test_scheduler_wait(&timers.s, 0);
+	scheduler_uninitialize(&timers.s);
+}
+
+/*
+ * A deadline that passes while the timer is masked fires on the first
+ * iteration after unmasking, not one period later.
+ */
+void
+test_scheduler_timeouts_unmask_keeps_deadline(void **state)
+{
+	struct test_timers timers = { .n_fired = 0 };
+	struct timeval start, end, elapsed;
+	struct test_timer t;
+
+	scheduler_initialize(&timers.s);
+
+	test_timers_register(&timers, &t, 0, 200);
+	scheduler_mask_event(&timers.s, timers.ids[0], 1);
+
+	usleep(250000);
+
+	scheduler_mask_event(&timers.s, timers.ids[0], 0);
+
+	gettimeofday(&start, NULL);
+	test_scheduler_wait(&timers.s, 1000000);
+	gettimeofday(&end, NULL);
+
+	assert_int_equal(timers.n_fired, 1);
+
+	TV_SUB(end, start, elapsed);
+	assert_true(TV_BEFORE(elapsed, TV_USECS(100000)));
+
+	test_scheduler_wait(&timers.s, 0);
+	scheduler_uninitialize(&timers.s);
+}
@@ -46,6 +46,70 @@ static const struct CMUnitTest tapdisk_stats_tests[] = {
 	cmocka_unit_test(test_stats_realloc_buffer_edgecase)
 };
 
+void test_scheduler_select_fd_events(void **state);
+void test_scheduler_epoll_fd_events(void **state);
+void test_scheduler_epoll_et_fd_events(void **state);
+void test_scheduler_epoll_regular_file(void **state);
+void test_scheduler_timeouts_in_deadline_order(void **state);
+void test_scheduler_timeouts_unregister(void **state);
+void test_scheduler_timeouts_set_timeout(void **state);
+void test_scheduler_timeouts_masked(void **state);
+void test_scheduler_timeouts_unmask_keeps_deadline(void **state);
+
+static const struct CMUnitTest tapdisk_scheduler_tests[] = {
+	cmocka_unit_test(test_scheduler_select_fd_events),
+	cmocka_unit_test(test_scheduler_epoll_fd_events),
+	cmocka_unit_test(test_scheduler_epoll_et_fd_events),
+	cmocka_unit_test(test_scheduler_epoll_regular_file),
+	cmocka_unit_test(test_scheduler_timeouts_in_deadline_order),
+	cmocka_unit_test(test_scheduler_timeouts_unregister),
+	cmocka_unit_test(test_scheduler_timeouts_set_timeout),
+	cmocka_unit_test(test_scheduler_timeouts_masked),
+	cmocka_unit_test(test_scheduler_timeouts_unmask_keeps_deadline)
+};
+
+int test_queue_uring_setup(void **state);
+int test_queue_uring_teardown(void **state);
+void test_queue_uring_partial_submit(void **state);
+void test_queue_uring_sq_full(void **state);
+
+static const struct CMUnitTest tapdisk_queue_tests[] = {
+	cmocka_unit_test_setup_teardown(test_queue_uring_partial_submit,
+					test_queue_uring_setup,
+					test_queue_uring_teardown),
+	cmocka_unit_test_setup_teardown(test_queue_uring_sq_full,
+					test_queue_uring_setup,
+					test_queue_uring_teardown)
+};
+
+int test_qcow2_setup(void **state);
+int test_qcow2_teardown(void **state);
+void test_qcow2_alloc_order(void **state);
+void test_qcow2_second_refblock(void **state);
+
+static const struct CMUnitTest tapdisk_qcow2_tests[] = {
+	cmocka_unit_test_setup_teardown(test_qcow2_alloc_order,
+					test_qcow2_setup,
+					test_qcow2_teardown),
+	cmocka_unit_test_setup_teardown(test_qcow2_second_refblock,
+					test_qcow2_setup,
+					test_qcow2_teardown)
+};
+
+int test_vhostblk_setup(void **state);
+int test_vhostblk_teardown(void **state);
+void test_vhostblk_negotiation(void **state);
+void test_vhostblk_ring(void **state);
+
+static const struct CMUnitTest tapdisk_vhostblk_tests[] = {
+	cmocka_unit_test_setup_teardown(test_vhostblk_negotiation,
+					test_vhostblk_setup,
+					test_vhostblk_teardown),
+	cmocka_unit_test_setup_teardown(test_vhostblk_ring,
+					test_vhostblk_setup,
+					test_vhostblk_teardown)
+};
+
 
 
 #endif /* __TEST_SUITES_H__ */
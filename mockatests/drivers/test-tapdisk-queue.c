@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2018, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "test-suites.h"
+
+#include "tapdisk-queue.h"
+#include "tapdisk-server.h"
+
+#define TEST_N_TIOCBS   4
+#define TEST_TIOCB_SIZE 4096
+
+/*
+ * io_uring_enter(2) takes at most this many SQEs on its next call, as if
+ * the SQ were full past them. Negative for no limit.
+ */
+static int uring_enter_limit = -1;
+
+long __real_syscall(long number, ...);
+
+long
+__wrap_syscall(long number, ...)
+{
+	long a[6];
+	va_list ap;
+	int i;
+
+	va_start(ap, number);
+	for (i = 0; i < 6; i++)
+		a[i] = va_arg(ap, long);
+	va_end(ap);
+
+	if (number == __NR_io_uring_enter && uring_enter_limit >= 0) {
+		if (a[1] > uring_enter_limit)
+			a[1] = uring_enter_limit;
+		uring_enter_limit = -1;
+	}
+
+	return __real_syscall(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+struct test_queue {
+	struct tqueue queue;
+	int           fd;
+	char          path[32];
+
+	struct tiocb  tiocbs[TEST_N_TIOCBS];
+	char         *bufs[TEST_N_TIOCBS];
+	int           errs[TEST_N_TIOCBS];
+	int           n_done;
+};
+
+static void
+test_queue_cb(void *arg, struct tiocb *tiocb, int err)
+{
+	struct test_queue *tq = arg;
+	int i = tiocb - tq->tiocbs;
+
+	tq->errs[i] = err;
+	tq->n_done++;
+}
+
+/*
+ * A file with TEST_N_TIOCBS blocks of data, one filled with 1s, the next
+ * with 2s and so on, every other block, so that reads of them do not
+ * merge.
+ */
+int
+test_queue_uring_setup(void **state)
+{
+	struct test_queue *tq;
+	char *buf;
+	int i, err;
+
+	tq = calloc(1, sizeof(*tq));
+	assert_non_null(tq);
+
+	strcpy(tq->path, "/tmp/test-queue.XXXXXX");
+	tq->fd = mkstemp(tq->path);
+	assert_true(tq->fd >= 0);
+
+	buf = malloc(TEST_TIOCB_SIZE);
+	assert_non_null(buf);
+
+	for (i = 0; i < TEST_N_TIOCBS; i++) {
+		memset(buf, i + 1, TEST_TIOCB_SIZE);
+		assert_int_equal(pwrite(tq->fd, buf, TEST_TIOCB_SIZE,
+					2 * i * TEST_TIOCB_SIZE),
+				 TEST_TIOCB_SIZE);
+
+		assert_int_equal(posix_memalign((void **)&tq->bufs[i], 4096,
+						TEST_TIOCB_SIZE), 0);
+	}
+
+	free(buf);
+
+	tapdisk_server_init();
+
+	err = tapdisk_init_queue(&tq->queue, TEST_N_TIOCBS,
+				 TIO_DRV_URING, NULL);
+	if (err) {
+		print_message("io_uring unavailable: %s\n", strerror(-err));
+		close(tq->fd);
+		unlink(tq->path);
+		free(tq);
+		*state = NULL;
+		return 0;
+	}
+
+	*state = tq;
+	return 0;
+}
+
+int
+test_queue_uring_teardown(void **state)
+{
+	struct test_queue *tq = *state;
+	int i;
+
+	if (!tq)
+		return 0;
+
+	tapdisk_free_queue(&tq->queue);
+
+	for (i = 0; i < TEST_N_TIOCBS; i++)
+		free(tq->bufs[i]);
+
+	close(tq->fd);
+	unlink(tq->path);
+	free(tq);
+
+	return 0;
+}
+
+static void
+test_queue_reads(struct test_queue *tq)
+{
+	int i;
+
+	for (i = 0; i < TEST_N_TIOCBS; i++) {
+		memset(&tq->tiocbs[i], 0, sizeof(tq->tiocbs[i]));
+		memset(tq->bufs[i], 0, TEST_TIOCB_SIZE);
+		tq->errs[i] = -1;
+
+		tapdisk_prep_tiocb(&tq->tiocbs[i], tq->fd, 0, tq->bufs[i],
+				   TEST_TIOCB_SIZE, 2 * i * TEST_TIOCB_SIZE,
+				   test_queue_cb, tq);
+		tapdisk_queue_tiocb(&tq->queue, &tq->tiocbs[i]);
+	}
+
+	tq->n_done = 0;
+}
+
+static void
+test_queue_complete(struct test_queue *tq)
+{
+	int i, j;
+
+	for (i = 0; i < 100 && tq->n_done < TEST_N_TIOCBS; i++)
+		tapdisk_server_iterate();
+
+	assert_int_equal(tq->n_done, TEST_N_TIOCBS);
+
+	for (i = 0; i < TEST_N_TIOCBS; i++) {
+		assert_int_equal(tq->errs[i], 0);
+		for (j = 0; j < TEST_TIOCB_SIZE; j++)
+			assert_int_equal(tq->bufs[i][j], i + 1);
+	}
+}
+
+/*
+ * The kernel takes only part of a batch: the rest is requeued and goes
+ * with the next pass of the same submission, rather than failing.
+ */
+void
+test_queue_uring_partial_submit(void **state)
+{
+	struct test_queue *tq = *state;
+
+	if (!tq)
+		skip();
+
+	test_queue_reads(tq);
+
+	uring_enter_limit = 1;
+	assert_int_equal(tapdisk_submit_all_tiocbs(&tq->queue),
+			 TEST_N_TIOCBS);
+	assert_true(tapdisk_queue_empty(&tq->queue));
+
+	test_queue_complete(tq);
+}
+
+/*
+ * No room at all: the batch stays queued, without spinning or failing,
+ * and is submitted by the next call.
+ */
+void
+test_queue_uring_sq_full(void **state)
+{
+	struct test_queue *tq = *state;
+
+	if (!tq)
+		skip();
+
+	test_queue_reads(tq);
+
+	uring_enter_limit = 0;
+	assert_int_equal(tapdisk_submit_all_tiocbs(&tq->queue), 0);
+	assert_int_equal(tapdisk_queue_count(&tq->queue), TEST_N_TIOCBS);
+	assert_int_equal(tq->n_done, 0);
+
+	assert_int_equal(tapdisk_submit_all_tiocbs(&tq->queue),
+			 TEST_N_TIOCBS);
+
+	test_queue_complete(tq);
+}
@@ -0,0 +1,536 @@
+/*
+ * Copyright (c) 2018, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "test-suites.h"
+
+#include "tapdisk.h"
+#include "tapdisk-server.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-vhostblk.h"
+
+#define TEST_UUID       7
+#define TEST_SECTORS    2048
+#define TEST_RING       16
+
+/* guest memory, one region, its guest and front-end addresses apart */
+#define TEST_MEM_SIZE   (64 << 10)
+#define TEST_MEM_GPA    0x100000ULL
+#define TEST_MEM_UVA    0x7f0000000000ULL
+#define TEST_DESC_OFF   0x0000
+#define TEST_AVAIL_OFF  0x1000
+#define TEST_USED_OFF   0x2000
+#define TEST_DATA_OFF   0x4000
+
+struct test_vhostblk {
+	td_vbd_t      *vbd;
+	td_vhostblk_t *dev;
+	int            fd;      /* the front-end end of the connection */
+
+	int            mem_fd;
+	char          *mem;
+	int            kick_fd;
+	int            call_fd;
+};
+
+union test_vhostblk_payload {
+	uint64_t                      u64;
+	struct vhost_user_vring_state state;
+	struct vhost_user_vring_addr  addr;
+	struct vhost_user_memory      memory;
+	struct vhost_user_config      config;
+};
+
+static void
+test_vhostblk_send(struct test_vhostblk *tv, uint32_t request,
+		   uint32_t flags, const void *payload, uint32_t size,
+		   int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct vhost_user_msg_header hdr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov[2];
+
+	hdr.request = request;
+	hdr.flags   = VHOST_USER_VERSION | flags;
+	hdr.size    = size;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len  = sizeof(hdr);
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len  = size;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = size ? 2 : 1;
+
+	if (fd >= 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	assert_int_equal(sendmsg(tv->fd, &msg, 0), sizeof(hdr) + size);
+}
+
+/* runs the back-end until @fd has something to read */
+static void
+test_vhostblk_wait(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		if (poll(&pfd, 1, 0) == 1)
+			return;
+		tapdisk_server_iterate();
+	}
+
+	fail_msg("no answer from the back-end");
+}
+
+static void
+test_vhostblk_recv(struct test_vhostblk *tv, uint32_t request,
+		   void *payload, uint32_t size)
+{
+	struct vhost_user_msg_header hdr;
+
+	test_vhostblk_wait(tv->fd);
+
+	assert_int_equal(recv(tv->fd, &hdr, sizeof(hdr), MSG_WAITALL),
+			 sizeof(hdr));
+	assert_int_equal(hdr.request, request);
+	assert_int_equal(hdr.flags,
+			 VHOST_USER_VERSION | VHOST_USER_REPLY_MASK);
+	assert_int_equal(hdr.size, size);
+	assert_int_equal(recv(tv->fd, payload, size, MSG_WAITALL), size);
+}
+
+static uint64_t
+test_vhostblk_get_u64(struct test_vhostblk *tv, uint32_t request)
+{
+	uint64_t val;
+
+	test_vhostblk_send(tv, request, 0, NULL, 0, -1);
+	test_vhostblk_recv(tv, request, &val, sizeof(val));
+
+	return val;
+}
+
+/* sends with a reply-ack asked for, and returns it: 0 for success */
+static uint64_t
+test_vhostblk_set(struct test_vhostblk *tv, uint32_t request,
+		  const void *payload, uint32_t size, int fd)
+{
+	uint64_t ack;
+
+	test_vhostblk_send(tv, request, VHOST_USER_NEED_REPLY_MASK,
+			   payload, size, fd);
+	test_vhostblk_recv(tv, request, &ack, sizeof(ack));
+
+	return ack;
+}
+
+static uint64_t
+test_vhostblk_set_u64(struct test_vhostblk *tv, uint32_t request,
+		      uint64_t val, int fd)
+{
+	return test_vhostblk_set(tv, request, &val, sizeof(val), fd);
+}
+
+static uint64_t
+test_vhostblk_set_state(struct test_vhostblk *tv, uint32_t request,
+			uint32_t index, uint32_t num)
+{
+	struct vhost_user_vring_state state = { index, num };
+
+	return test_vhostblk_set(tv, request, &state, sizeof(state), -1);
+}
+
+/*
+ * A back-end for a VBD without images, and a front-end connected to
+ * it, with the protocol features and the reply-ack negotiated.
+ */
+int
+test_vhostblk_setup(void **state)
+{
+	struct test_vhostblk *tv;
+	struct sockaddr_un addr;
+	td_disk_info_t info;
+	uint64_t features;
+	int err;
+
+	tv = calloc(1, sizeof(*tv));
+	assert_non_null(tv);
+	tv->mem_fd = tv->kick_fd = tv->call_fd = -1;
+
+	tapdisk_server_init();
+
+	tv->vbd = tapdisk_vbd_create(TEST_UUID);
+	assert_non_null(tv->vbd);
+
+	memset(&info, 0, sizeof(info));
+	info.size        = TEST_SECTORS;
+	info.sector_size = DEFAULT_SECTOR_SIZE;
+
+	tv->dev = tapdisk_vhostblk_alloc(tv->vbd, info);
+	assert_non_null(tv->dev);
+
+	if (mkdir(BLKTAP2_CONTROL_DIR, 0755) && errno != EEXIST)
+		goto skip;
+
+	err = tapdisk_vhostblk_listen(tv->dev);
+	if (err) {
+		print_message("cannot listen: %s\n", strerror(-err));
+		goto skip;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s%d.%d",
+		 TAPDISK_VHOSTBLK_SOCK_PATH, getpid(), TEST_UUID);
+
+	tv->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert_true(tv->fd >= 0);
+	assert_int_equal(connect(tv->fd, (struct sockaddr *)&addr,
+				 sizeof(addr)), 0);
+
+	features = test_vhostblk_get_u64(tv, VHOST_USER_GET_FEATURES);
+	test_vhostblk_send(tv, VHOST_USER_SET_FEATURES, 0,
+			   &features, sizeof(features), -1);
+
+	features = test_vhostblk_get_u64(tv,
+					 VHOST_USER_GET_PROTOCOL_FEATURES);
+	assert_int_equal(test_vhostblk_set_u64(tv,
+				VHOST_USER_SET_PROTOCOL_FEATURES,
+				features, -1), 0);
+
+	*state = tv;
+	return 0;
+
+skip:
+	tapdisk_vhostblk_free(tv->dev);
+	free(tv->vbd);
+	free(tv);
+	*state = NULL;
+	return 0;
+}
+
+int
+test_vhostblk_teardown(void **state)
+{
+	struct test_vhostblk *tv = *state;
+
+	if (!tv)
+		return 0;
+
+	close(tv->fd);
+	tapdisk_vhostblk_free(tv->dev);
+	free(tv->vbd);
+
+	if (tv->mem)
+		munmap(tv->mem, TEST_MEM_SIZE);
+	if (tv->mem_fd >= 0)
+		close(tv->mem_fd);
+	if (tv->kick_fd >= 0)
+		close(tv->kick_fd);
+	if (tv->call_fd >= 0)
+		close(tv->call_fd);
+
+	free(tv);
+	return 0;
+}
+
+/*
+ * What a virtio-blk driver needs to know before it looks at the rings,
+ * and bad requests refused rather than taken in.
+ */
+void
+test_vhostblk_negotiation(void **state)
+{
+	struct test_vhostblk *tv = *state;
+	struct vhost_user_config config;
+	struct virtio_blk_config *cfg;
+	uint64_t features;
+
+	if (!tv)
+		skip();
+
+	features = test_vhostblk_get_u64(tv, VHOST_USER_GET_FEATURES);
+	assert_true(features & (1ULL << VIRTIO_F_VERSION_1));
+	assert_true(features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES));
+	assert_true(features & (1ULL << VIRTIO_BLK_F_FLUSH));
+	assert_false(features & (1ULL << VIRTIO_BLK_F_RO));
+	assert_false(features & (1ULL << VIRTIO_BLK_F_MQ));
+
+	features = test_vhostblk_get_u64(tv,
+					 VHOST_USER_GET_PROTOCOL_FEATURES);
+	assert_true(features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK));
+	assert_true(features & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG));
+
+	assert_int_equal(test_vhostblk_get_u64(tv, VHOST_USER_GET_QUEUE_NUM),
+			 1);
+
+	memset(&config, 0, sizeof(config));
+	config.size = sizeof(*cfg);
+	test_vhostblk_send(tv, VHOST_USER_GET_CONFIG, 0, &config,
+			   offsetof(struct vhost_user_config, region) +
+			   config.size, -1);
+	test_vhostblk_recv(tv, VHOST_USER_GET_CONFIG, &config,
+			   offsetof(struct vhost_user_config, region) +
+			   sizeof(*cfg));
+
+	cfg = (struct virtio_blk_config *)config.region;
+	assert_int_equal(cfg->capacity, TEST_SECTORS);
+	assert_int_equal(cfg->blk_size, DEFAULT_SECTOR_SIZE);
+	assert_int_equal(cfg->seg_max, TAPDISK_VHOSTBLK_SEG_MAX);
+	assert_int_equal(cfg->num_queues, 1);
+
+	/* not a power of 2, no such queue, not supported */
+	assert_int_not_equal(test_vhostblk_set_state(tv,
+				VHOST_USER_SET_VRING_NUM, 0, 3), 0);
+	assert_int_not_equal(test_vhostblk_set_state(tv,
+				VHOST_USER_SET_VRING_NUM, 1, TEST_RING), 0);
+	assert_int_not_equal(test_vhostblk_set_u64(tv,
+				VHOST_USER_SET_LOG_BASE, 0, -1), 0);
+
+	assert_int_equal(test_vhostblk_set_state(tv,
+				VHOST_USER_SET_VRING_NUM, 0, TEST_RING), 0);
+}
+
+static struct vring_desc *
+test_vhostblk_desc(struct test_vhostblk *tv)
+{
+	return (struct vring_desc *)(tv->mem + TEST_DESC_OFF);
+}
+
+static struct vring_avail *
+test_vhostblk_avail(struct test_vhostblk *tv)
+{
+	return (struct vring_avail *)(tv->mem + TEST_AVAIL_OFF);
+}
+
+static struct vring_used *
+test_vhostblk_used(struct test_vhostblk *tv)
+{
+	return (struct vring_used *)(tv->mem + TEST_USED_OFF);
+}
+
+static void
+test_vhostblk_set_desc(struct test_vhostblk *tv, int i, uint64_t off,
+		       uint32_t len, uint16_t flags)
+{
+	struct vring_desc *desc = &test_vhostblk_desc(tv)[i];
+
+	desc->addr  = TEST_MEM_GPA + off;
+	desc->len   = len;
+	desc->flags = flags;
+	desc->next  = i + 1;
+}
+
+static void
+test_vhostblk_post(struct test_vhostblk *tv, uint16_t head)
+{
+	struct vring_avail *avail = test_vhostblk_avail(tv);
+
+	avail->ring[avail->idx % TEST_RING] = head;
+	__atomic_store_n(&avail->idx, avail->idx + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Guest memory shared through a file, the ring set up in it and
+ * started by its kick.
+ */
+static void
+test_vhostblk_start(struct test_vhostblk *tv)
+{
+	char path[] = "/tmp/test-vhostblk.XXXXXX";
+	struct vhost_user_memory mem;
+	struct vhost_user_vring_addr addr;
+
+	tv->mem_fd = mkstemp(path);
+	assert_true(tv->mem_fd >= 0);
+	unlink(path);
+	assert_int_equal(ftruncate(tv->mem_fd, TEST_MEM_SIZE), 0);
+
+	tv->mem = mmap(NULL, TEST_MEM_SIZE, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, tv->mem_fd, 0);
+	assert_true(tv->mem != MAP_FAILED);
+
+	memset(&mem, 0, sizeof(mem));
+	mem.nregions                   = 1;
+	mem.regions[0].guest_phys_addr = TEST_MEM_GPA;
+	mem.regions[0].memory_size     = TEST_MEM_SIZE;
+	mem.regions[0].userspace_addr  = TEST_MEM_UVA;
+	assert_int_equal(test_vhostblk_set(tv, VHOST_USER_SET_MEM_TABLE,
+					   &mem, offsetof(struct
+					   vhost_user_memory, regions[1]),
+					   tv->mem_fd), 0);
+
+	assert_int_equal(test_vhostblk_set_state(tv,
+				VHOST_USER_SET_VRING_NUM, 0, TEST_RING), 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.desc_user_addr  = TEST_MEM_UVA + TEST_DESC_OFF;
+	addr.avail_user_addr = TEST_MEM_UVA + TEST_AVAIL_OFF;
+	addr.used_user_addr  = TEST_MEM_UVA + TEST_USED_OFF;
+	assert_int_equal(test_vhostblk_set(tv, VHOST_USER_SET_VRING_ADDR,
+					   &addr, sizeof(addr), -1), 0);
+
+	assert_int_equal(test_vhostblk_set_state(tv,
+				VHOST_USER_SET_VRING_BASE, 0, 0), 0);
+
+	tv->call_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert_true(tv->call_fd >= 0);
+	assert_int_equal(test_vhostblk_set_u64(tv,
+				VHOST_USER_SET_VRING_CALL, 0, tv->call_fd), 0);
+
+	tv->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert_true(tv->kick_fd >= 0);
+	assert_int_equal(test_vhostblk_set_u64(tv,
+				VHOST_USER_SET_VRING_KICK, 0, tv->kick_fd), 0);
+
+	/* with the protocol features, rings start disabled */
+	assert_int_equal(test_vhostblk_set_state(tv,
+				VHOST_USER_SET_VRING_ENABLE, 0, 1), 0);
+}
+
+/*
+ * Requests the back-end answers itself, with no I/O on the VBD: the
+ * device id, an unknown type and a chain without a status byte. Each
+ * lands in the used ring with its status, and the guest is signalled.
+ */
+void
+test_vhostblk_ring(void **state)
+{
+	struct test_vhostblk *tv = *state;
+	struct vhost_user_vring_state base;
+	struct virtio_blk_outhdr *hdr;
+	struct vring_used *used;
+	uint64_t calls;
+	uint8_t *status;
+	char *id;
+
+	if (!tv)
+		skip();
+
+	test_vhostblk_start(tv);
+
+	/* GET_ID: header, 20 bytes of id, status */
+	hdr = (struct virtio_blk_outhdr *)(tv->mem + TEST_DATA_OFF);
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->type = VIRTIO_BLK_T_GET_ID;
+	id = tv->mem + TEST_DATA_OFF + 0x100;
+	memset(id, 0xff, VIRTIO_BLK_ID_BYTES);
+	status = (uint8_t *)tv->mem + TEST_DATA_OFF + 0x200;
+	*status = 0xff;
+
+	test_vhostblk_set_desc(tv, 0, TEST_DATA_OFF, sizeof(*hdr),
+			       VRING_DESC_F_NEXT);
+	test_vhostblk_set_desc(tv, 1, TEST_DATA_OFF + 0x100,
+			       VIRTIO_BLK_ID_BYTES,
+			       VRING_DESC_F_NEXT | VRING_DESC_F_WRITE);
+	test_vhostblk_set_desc(tv, 2, TEST_DATA_OFF + 0x200, 1,
+			       VRING_DESC_F_WRITE);
+	test_vhostblk_post(tv, 0);
+
+	/* an unknown type: header, status */
+	hdr = (struct virtio_blk_outhdr *)(tv->mem + TEST_DATA_OFF + 0x300);
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->type = 99;
+	status[1] = 0xff;
+
+	test_vhostblk_set_desc(tv, 3, TEST_DATA_OFF + 0x300, sizeof(*hdr),
+			       VRING_DESC_F_NEXT);
+	test_vhostblk_set_desc(tv, 4, TEST_DATA_OFF + 0x201, 1,
+			       VRING_DESC_F_WRITE);
+	test_vhostblk_post(tv, 3);
+
+	/* a read-only status byte */
+	status[2] = 0xff;
+	test_vhostblk_set_desc(tv, 5, TEST_DATA_OFF + 0x300, sizeof(*hdr),
+			       VRING_DESC_F_NEXT);
+	test_vhostblk_set_desc(tv, 6, TEST_DATA_OFF + 0x202, 1, 0);
+	test_vhostblk_post(tv, 5);
+
+	calls = 1;
+	assert_int_equal(write(tv->kick_fd, &calls, sizeof(calls)),
+			 sizeof(calls));
+
+	test_vhostblk_wait(tv->call_fd);
+	assert_int_equal(read(tv->call_fd, &calls, sizeof(calls)),
+			 sizeof(calls));
+
+	used = test_vhostblk_used(tv);
+	assert_int_equal(__atomic_load_n(&used->idx, __ATOMIC_ACQUIRE), 3);
+
+	assert_int_equal(used->ring[0].id, 0);
+	assert_int_equal(used->ring[0].len, 1 + VIRTIO_BLK_ID_BYTES);
+	assert_int_equal(status[0], VIRTIO_BLK_S_OK);
+	assert_string_equal(id, "tapdisk-7");
+
+	assert_int_equal(used->ring[1].id, 3);
+	assert_int_equal(used->ring[1].len, 1);
+	assert_int_equal(status[1], VIRTIO_BLK_S_UNSUPP);
+
+	assert_int_equal(used->ring[2].id, 5);
+	assert_int_equal(used->ring[2].len, 0);
+	assert_int_equal(status[2], 0xff);
+
+	/* the ring stops where it was, for the next front-end */
+	memset(&base, 0, sizeof(base));
+	test_vhostblk_send(tv, VHOST_USER_GET_VRING_BASE, 0, &base,
+			   sizeof(base), -1);
+	test_vhostblk_recv(tv, VHOST_USER_GET_VRING_BASE, &base,
+			   sizeof(base));
+	assert_int_equal(base.num, 3);
+}
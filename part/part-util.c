@@ -44,7 +44,9 @@
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include <linux/hdreg.h>
+#include <sys/stat.h>
 
+#include "libvhd.h"
 #include "partition.h"
 
 #if BYTE_ORDER == LITTLE_ENDIAN
@@ -55,6 +57,206 @@
   #define cpu_to_le64(x) bswap_64(x)
 #endif
 
+#define PART_BUF_ALIGN 4096
+
+/*
+ * An image read a few sectors at a time: VHDs through libvhd, following
+ * the chain for sectors the leaf does not hold, so that only the BATs,
+ * bitmaps and blocks covering the partition tables are read; anything
+ * else as it is.
+ */
+struct part_image {
+	int                           fd;
+	int                           is_vhd;
+	vhd_context_t                 vhd;
+};
+
+static int
+part_image_has_cookie(int fd, off64_t off)
+{
+	char buf[sizeof(HD_COOKIE) - 1];
+
+	if (off < 0)
+		return 0;
+
+	if (pread(fd, buf, sizeof(buf), off) != sizeof(buf))
+		return 0;
+
+	return !memcmp(buf, HD_COOKIE, sizeof(buf));
+}
+
+static int
+part_image_open(struct part_image *img, const char *image)
+{
+	struct stat st;
+	off64_t end;
+	int err, flags;
+
+	memset(img, 0, sizeof(*img));
+
+	img->fd = open(image, O_RDONLY | O_LARGEFILE);
+	if (img->fd == -1)
+		return -1;
+
+	/* footer at the end, or its copy at the start of dynamic disks */
+	end = lseek64(img->fd, 0, SEEK_END);
+	if (!part_image_has_cookie(img->fd, end - sizeof(vhd_footer_t)) &&
+	    !part_image_has_cookie(img->fd, 0))
+		return 0;
+
+	if (fstat(img->fd, &st))
+		goto fail;
+
+	flags = VHD_OPEN_RDONLY;
+	if (S_ISREG(st.st_mode))
+		flags |= VHD_OPEN_CACHED;
+
+	err = vhd_open(&img->vhd, image, flags);
+	if (err) {
+		errno = -err;
+		goto fail;
+	}
+
+	close(img->fd);
+	img->fd     = -1;
+	img->is_vhd = 1;
+
+	return 0;
+
+fail:
+	err = errno;
+	close(img->fd);
+	img->fd = -1;
+	errno = err;
+	return -1;
+}
+
+static void
+part_image_close(struct part_image *img)
+{
+	if (img->is_vhd)
+		vhd_close(&img->vhd);
+	else if (img->fd != -1)
+		close(img->fd);
+}
+
+static int
+part_image_read(struct part_image *img, void *buf, uint64_t sec, uint32_t secs)
+{
+	size_t size = (size_t)secs << VHD_SECTOR_SHIFT;
+	ssize_t n;
+	int err;
+
+	if (img->is_vhd) {
+		err = vhd_io_read(&img->vhd, buf, sec, secs);
+		if (err) {
+			errno = -err;
+			return -1;
+		}
+		return 0;
+	}
+
+	n = pread(img->fd, buf, size, sec << VHD_SECTOR_SHIFT);
+	if (n != size) {
+		errno = n == -1 ? errno : EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads and validates the MBR, and for a protective one the GPT header
+ * and, with @entries, the array of entries, in a buffer to free. Returns
+ * 1 for an image without a valid MBR, -1 with errno set on failure; a
+ * GPT that does not validate is left out with a zero signature.
+ */
+static int
+read_partitions(const char *image, struct partition_table *pt,
+		struct gpt_header *gpt, struct gpt_entry **entries)
+{
+	struct part_image img;
+	char *buf;
+	uint32_t secs;
+	int i, ret;
+
+	ret = -1;
+	buf = NULL;
+	gpt->signature = 0;
+	if (entries)
+		*entries = NULL;
+
+	if (part_image_open(&img, image))
+		return -1;
+
+	if (posix_memalign((void **)&buf, PART_BUF_ALIGN, 2 << VHD_SECTOR_SHIFT)) {
+		buf = NULL;
+		errno = ENOMEM;
+		goto out;
+	}
+
+	if (part_image_read(&img, buf, 0, 2))
+		goto out;
+
+	memcpy(pt, buf, sizeof(*pt));
+	partition_table_in(pt);
+	if (partition_table_validate(pt)) {
+		ret = 1;
+		goto out;
+	}
+
+	ret = 0;
+	if (!partition_table_is_gpt(pt))
+		goto out;
+
+	memcpy(gpt, buf + sizeof(*pt), sizeof(*gpt));
+	gpt_header_in(gpt);
+	if (gpt_header_validate(gpt)) {
+		gpt->signature = 0;
+		goto out;
+	}
+
+	if (!entries)
+		goto out;
+
+	free(buf);
+	secs = ((uint64_t)gpt->nr_entries * gpt->entry_size +
+		VHD_SECTOR_SIZE - 1) >> VHD_SECTOR_SHIFT;
+	if (posix_memalign((void **)&buf, PART_BUF_ALIGN,
+			   (size_t)secs << VHD_SECTOR_SHIFT)) {
+		buf = NULL;
+		errno = ENOMEM;
+		ret = -1;
+		goto out;
+	}
+
+	if (part_image_read(&img, buf, gpt->entries_lba, secs)) {
+		ret = -1;
+		goto out;
+	}
+
+	if (gpt_entries_validate(gpt, buf)) {
+		gpt->signature = 0;
+		goto out;
+	}
+
+	/* packed to struct gpt_entry, for entries larger than that */
+	for (i = 0; i < gpt->nr_entries; i++) {
+		memmove((struct gpt_entry *)buf + i,
+			buf + (size_t)i * gpt->entry_size,
+			sizeof(struct gpt_entry));
+		gpt_entry_in((struct gpt_entry *)buf + i);
+	}
+
+	*entries = (struct gpt_entry *)buf;
+	buf = NULL;
+
+out:
+	free(buf);
+	part_image_close(&img);
+	return ret;
+}
+
 static void
 usage(const char *app)
 {
@@ -107,37 +309,64 @@ partition_table_dump(struct partition_table *pt)
 	}
 }
 
-static int
-dump_partitions(const char *image)
+static void
+guid_dump(const char *name, int i, const uint8_t *g)
 {
-	int fd, ret;
-	struct partition_table pt;
+	printf("  %d %-12s %02x%02x%02x%02x-%02x%02x-%02x%02x-"
+	       "%02x%02x-%02x%02x%02x%02x%02x%02x\n", i, name,
+	       g[3], g[2], g[1], g[0], g[5], g[4], g[7], g[6],
+	       g[8], g[9], g[10], g[11], g[12], g[13], g[14], g[15]);
+}
 
-	ret = 1;
+static void
+gpt_dump(struct gpt_header *gpt, struct gpt_entry *entries)
+{
+	int i;
 
-	fd = open(image, O_RDONLY);
-	if (fd == -1)
-		goto out;
+	printf("gpt revision     0x%08x\n", gpt->revision);
+	printf("gpt first lba    0x%"PRIx64"\n", gpt->first_usable_lba);
+	printf("gpt last lba     0x%"PRIx64"\n", gpt->last_usable_lba);
+	printf("gpt entries      %u\n", gpt->nr_entries);
+	printf("\n");
 
-	if (read(fd, &pt, sizeof(pt)) != sizeof(pt)) {
-		errno = errno ? : EIO;
-		goto out;
+	for (i = 0; i < gpt->nr_entries; i++) {
+		struct gpt_entry *e = entries + i;
+
+		if (!gpt_entry_used(e))
+			continue;
+
+		guid_dump("type", i + 1, e->type_guid);
+		guid_dump("guid", i + 1, e->unique_guid);
+		printf("  %d first lba    0x%"PRIx64"\n", i + 1, e->first_lba);
+		printf("  %d last lba     0x%"PRIx64"\n", i + 1, e->last_lba);
+		printf("  %d attributes   0x%"PRIx64"\n", i + 1, e->attributes);
+		printf("\n");
 	}
+}
 
-	partition_table_in(&pt);
-	if (partition_table_validate(&pt)) {
+static int
+dump_partitions(const char *image)
+{
+	struct partition_table pt;
+	struct gpt_header gpt;
+	struct gpt_entry *entries;
+	int ret;
+
+	ret = read_partitions(image, &pt, &gpt, &entries);
+	if (ret < 0)
+		return 1;
+	if (ret) {
 		errno = EINVAL;
 		printf("table invalid\n");
-		goto out;
+		return 1;
 	}
 
 	partition_table_dump(&pt);
-	ret = 0;
+	if (entries)
+		gpt_dump(&gpt, entries);
 
-out:
-	if (fd >= 0)
-		close(fd);
-	return ret;
+	free(entries);
+	return 0;
 }
 
 static void
@@ -166,70 +395,54 @@ __dump_signature(struct partition_table *pt, int part)
 static int
 dump_signature(const char *image, int part)
 {
-	int fd, ret;
 	struct partition_table pt;
+	struct gpt_header gpt;
+	int ret;
 
-	ret = 1;
-
-	fd = open(image, O_RDONLY);
-	if (fd == -1)
-		goto out;
-
-	if (read(fd, &pt, sizeof(pt)) != sizeof(pt)) {
-		errno = errno ? : EIO;
-		goto out;
-	}
-
-	partition_table_in(&pt);
-	if (partition_table_validate(&pt)) {
+	ret = read_partitions(image, &pt, &gpt, NULL);
+	if (ret < 0)
+		return 1;
+	if (ret) {
 		errno = EINVAL;
 		printf("table invalid\n");
-		goto out;
+		return 1;
 	}
 
 	__dump_signature(&pt, part);
-	ret = 0;
-
-out:
-	if (fd >= 0)
-		close(fd);
-	return ret;
+	return 0;
 }
 
+/*
+ * Primary partitions, or for a GPT the highest entry in use, as the
+ * kernel numbers them.
+ */
 static int
 count_partitions(const char *image, int *count)
 {
-	int i, fd, ret;
 	struct partition_table pt;
+	struct gpt_header gpt;
+	struct gpt_entry *entries;
+	int i, ret;
 
-	ret = 1;
-
-	fd = open(image, O_RDONLY);
-	if (fd == -1)
-		goto out;
+	*count = 0;
 
-	if (read(fd, &pt, sizeof(pt)) != sizeof(pt)) {
-		errno = errno ? : EIO;
-		goto out;
-	}
+	ret = read_partitions(image, &pt, &gpt, &entries);
+	if (ret)
+		return ret < 0;
 
-	partition_table_in(&pt);
-	if (partition_table_validate(&pt)) {
-		*count = 0;
-		goto done;
+	if (entries) {
+		for (i = 0; i < gpt.nr_entries; i++)
+			if (gpt_entry_used(entries + i))
+				*count = i + 1;
+		free(entries);
+		return 0;
 	}
 
-	*count = 0;
 	for (i = 0; i < 4; i++)
 		if (pt.partitions[i].type)
 			(*count)++;
 
-done:
-	ret = 0;
-out:
-	if (fd >= 0)
-		close(fd);
-	return ret;
+	return 0;
 }
 
 static int
@@ -33,6 +33,7 @@
 #endif
 
 #include <errno.h>
+#include <string.h>
 #include <endian.h>
 #include <byteswap.h>
 
@@ -42,13 +43,17 @@
 #if BYTE_ORDER == LITTLE_ENDIAN
   #define le16_to_cpu(x) (x)
   #define le32_to_cpu(x) (x)
+  #define le64_to_cpu(x) (x)
   #define cpu_to_le16(x) (x)
   #define cpu_to_le32(x) (x)
+  #define cpu_to_le64(x) (x)
 #else
   #define le16_to_cpu(x) bswap_16(x)
   #define le32_to_cpu(x) bswap_32(x)
+  #define le64_to_cpu(x) bswap_64(x)
   #define cpu_to_le16(x) bswap_16(x)
   #define cpu_to_le32(x) bswap_32(x)
+  #define cpu_to_le64(x) bswap_64(x)
 #endif
 
 void
@@ -138,3 +143,131 @@ lba_to_chs(struct partition_geometry *geo, uint64_t lba)
 
 	return c;
 }
+
+int
+partition_table_is_gpt(struct partition_table *pt)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(pt->partitions); i++)
+		if (pt->partitions[i].type == PARTITION_TYPE_GPT)
+			return 1;
+
+	return 0;
+}
+
+static uint32_t
+partition_crc32(const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	uint32_t crc = ~0U;
+	int i;
+
+	while (size--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+static void
+gpt_header_swap(struct gpt_header *h, int in)
+{
+	if (in) {
+		h->signature        = le64_to_cpu(h->signature);
+		h->revision         = le32_to_cpu(h->revision);
+		h->header_size      = le32_to_cpu(h->header_size);
+		h->header_crc32     = le32_to_cpu(h->header_crc32);
+		h->my_lba           = le64_to_cpu(h->my_lba);
+		h->alternate_lba    = le64_to_cpu(h->alternate_lba);
+		h->first_usable_lba = le64_to_cpu(h->first_usable_lba);
+		h->last_usable_lba  = le64_to_cpu(h->last_usable_lba);
+		h->entries_lba      = le64_to_cpu(h->entries_lba);
+		h->nr_entries       = le32_to_cpu(h->nr_entries);
+		h->entry_size       = le32_to_cpu(h->entry_size);
+		h->entries_crc32    = le32_to_cpu(h->entries_crc32);
+	} else {
+		h->signature        = cpu_to_le64(h->signature);
+		h->revision         = cpu_to_le32(h->revision);
+		h->header_size      = cpu_to_le32(h->header_size);
+		h->header_crc32     = cpu_to_le32(h->header_crc32);
+		h->my_lba           = cpu_to_le64(h->my_lba);
+		h->alternate_lba    = cpu_to_le64(h->alternate_lba);
+		h->first_usable_lba = cpu_to_le64(h->first_usable_lba);
+		h->last_usable_lba  = cpu_to_le64(h->last_usable_lba);
+		h->entries_lba      = cpu_to_le64(h->entries_lba);
+		h->nr_entries       = cpu_to_le32(h->nr_entries);
+		h->entry_size       = cpu_to_le32(h->entry_size);
+		h->entries_crc32    = cpu_to_le32(h->entries_crc32);
+	}
+}
+
+void
+gpt_header_in(struct gpt_header *h)
+{
+	gpt_header_swap(h, 1);
+}
+
+void
+gpt_header_out(struct gpt_header *h)
+{
+	gpt_header_swap(h, 0);
+}
+
+int
+gpt_header_validate(struct gpt_header *h)
+{
+	struct gpt_header raw;
+
+	if (h->signature != GPT_SIGNATURE)
+		return EINVAL;
+
+	if (h->header_size < GPT_HEADER_MIN_SIZE ||
+	    h->header_size > sizeof(*h))
+		return EINVAL;
+
+	if (h->my_lba != GPT_HEADER_SECTOR)
+		return EINVAL;
+
+	if (h->entry_size < GPT_ENTRY_MIN_SIZE || h->entry_size % 8 ||
+	    (uint64_t)h->nr_entries * h->entry_size > GPT_ENTRIES_MAX_SIZE)
+		return EINVAL;
+
+	raw = *h;
+	raw.header_crc32 = 0;
+	gpt_header_out(&raw);
+
+	if (partition_crc32(&raw, h->header_size) != h->header_crc32)
+		return EINVAL;
+
+	return 0;
+}
+
+int
+gpt_entries_validate(struct gpt_header *h, const void *entries)
+{
+	size_t size = (size_t)h->nr_entries * h->entry_size;
+
+	if (partition_crc32(entries, size) != h->entries_crc32)
+		return EINVAL;
+
+	return 0;
+}
+
+void
+gpt_entry_in(struct gpt_entry *e)
+{
+	e->first_lba  = le64_to_cpu(e->first_lba);
+	e->last_lba   = le64_to_cpu(e->last_lba);
+	e->attributes = le64_to_cpu(e->attributes);
+}
+
+int
+gpt_entry_used(struct gpt_entry *e)
+{
+	static const uint8_t unused[sizeof(e->type_guid)];
+
+	return !!memcmp(e->type_guid, unused, sizeof(unused));
+}
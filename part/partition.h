@@ -39,6 +39,14 @@
 #define MBR_SIGNATURE                 0xAA55
 #define MBR_START_SECTOR              0x80
 
+#define PARTITION_TYPE_GPT            0xEE
+
+#define GPT_SIGNATURE                 0x5452415020494645ULL /* EFI PART */
+#define GPT_HEADER_SECTOR             1
+#define GPT_HEADER_MIN_SIZE           92
+#define GPT_ENTRY_MIN_SIZE            128
+#define GPT_ENTRIES_MAX_SIZE          (1 << 20)
+
 struct partition_geometry {
 	unsigned char                 heads;
 	unsigned char                 sectors;
@@ -66,10 +74,50 @@ struct partition_table {
 	uint16_t                      mbr_signature;
 } __attribute__((__packed__));
 
+/*
+ * GUID partition table, behind a protective MBR: the header in sector 1
+ * and the array of entries it points to.
+ */
+struct gpt_header {
+	uint64_t                      signature;
+	uint32_t                      revision;
+	uint32_t                      header_size;
+	uint32_t                      header_crc32;
+	uint32_t                      reserved;
+	uint64_t                      my_lba;
+	uint64_t                      alternate_lba;
+	uint64_t                      first_usable_lba;
+	uint64_t                      last_usable_lba;
+	uint8_t                       disk_guid[16];
+	uint64_t                      entries_lba;
+	uint32_t                      nr_entries;
+	uint32_t                      entry_size;
+	uint32_t                      entries_crc32;
+	uint8_t                       pad[420];
+} __attribute__((__packed__));
+
+struct gpt_entry {
+	uint8_t                       type_guid[16];
+	uint8_t                       unique_guid[16];
+	uint64_t                      first_lba;
+	uint64_t                      last_lba;
+	uint64_t                      attributes;
+	uint16_t                      name[36];
+} __attribute__((__packed__));
+
 void partition_table_in(struct partition_table *);
 void partition_table_out(struct partition_table *);
 int partition_table_validate(struct partition_table *);
 void partition_table_dump(struct partition_table *);
 struct partition_chs lba_to_chs(struct partition_geometry *, uint64_t);
 
+int partition_table_is_gpt(struct partition_table *);
+void gpt_header_in(struct gpt_header *);
+void gpt_header_out(struct gpt_header *);
+int gpt_header_validate(struct gpt_header *);
+/* checks the entries as read, before gpt_entry_in() */
+int gpt_entries_validate(struct gpt_header *, const void *entries);
+void gpt_entry_in(struct gpt_entry *);
+int gpt_entry_used(struct gpt_entry *);
+
 #endif
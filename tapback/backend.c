@@ -35,9 +35,12 @@
 
 #include "tapback.h"
 #include "xenstore.h"
+#include "blktap2.h"
 #include <xen/io/blkif.h>
 #include <unistd.h>
 #include <signal.h>
+#include <limits.h>
+#include <sys/inotify.h>
 #include <stdlib.h>
 
 extern int tapdev_major;
@@ -77,6 +80,8 @@ tapback_backend_destroy_device(vbd_t * const device)
 
     DBG(device, "removing VBD\n");
 
+    tapback_device_connect_cancel(device);
+
 	if (device->tap && device->connected) {
 
 		DBG(device, "implicitly disconnecting tapdisk[%d] minor=%d from the "
@@ -117,10 +122,139 @@ tapback_backend_destroy_device(vbd_t * const device)
 	return 0;
 }
 
+/*
+ * Tapdisks publish the VBDs they serve to BLKTAP2_LIST_DIR/<pid>. Instead of
+ * listing every tapdisk each time a device connects, the slave keeps the
+ * list around and re-reads only the files inotify reports as changed.
+ */
+
+/**
+ * Replaces the cached tapdisk list with a full listing.
+ */
+static int
+tapdisks_reload(backend_t *backend)
+{
+    struct list_head *tapdisks = &backend->slave.slave.tapdisks;
+    struct list_head list = LIST_HEAD_INIT(list);
+    int err;
+
+    err = tap_ctl_list(&list);
+    if (err) {
+        WARN(NULL, "error listing tapdisks: %s\n", strerror(-err));
+        return err;
+    }
+
+    tap_ctl_list_free(tapdisks);
+    list_splice(&list, tapdisks);
+
+    return 0;
+}
+
+static void
+tapdisks_forget(backend_t *backend, const pid_t pid)
+{
+    tap_list_t *tap, *next;
+
+    list_for_each_entry_safe(tap, next, &backend->slave.slave.tapdisks,
+            entry) {
+        if (tap->pid != pid)
+            continue;
+        list_del(&tap->entry);
+        free(tap->type);
+        free(tap->path);
+        free(tap);
+    }
+}
+
+/**
+ * Applies the changes to BLKTAP2_LIST_DIR since the last call. The first call
+ * sets up the notifications and lists all tapdisks.
+ *
+ * @returns 0 if the cached list is current, -errno otherwise
+ */
+static int
+tapdisks_update(backend_t *backend)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int fd = backend->slave.slave.tapdisks_fd;
+    bool reload = false;
+    ssize_t len;
+
+    if (fd < 0) {
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0)
+            return -errno;
+
+        if (inotify_add_watch(fd, BLKTAP2_LIST_DIR,
+                    IN_MOVED_TO | IN_DELETE) < 0) {
+            int err = -errno;
+            /*
+             * Not there until the first tapdisk publishes its VBDs.
+             */
+            if (err != -ENOENT)
+                WARN(NULL, "failed to watch %s: %s\n", BLKTAP2_LIST_DIR,
+                        strerror(-err));
+            close(fd);
+            return err;
+        }
+
+        backend->slave.slave.tapdisks_fd = fd;
+        reload = true;
+    }
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        char *p;
+
+        for (p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = (struct inotify_event *)p;
+            char *end;
+            pid_t pid;
+
+            p += sizeof(*ev) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                reload = true;
+                continue;
+            }
+
+            if (!ev->len)
+                continue;
+
+            pid = strtol(ev->name, &end, 10);
+            if (*end != 0 || end == ev->name)
+                continue;
+
+            tapdisks_forget(backend, pid);
+
+            if (ev->mask & IN_MOVED_TO) {
+                struct list_head list = LIST_HEAD_INIT(list);
+
+                if (!tap_ctl_list_pid(pid, &list))
+                    list_splice_tail(&list, &backend->slave.slave.tapdisks);
+            }
+        }
+    }
+
+    if (len < 0 && errno != EAGAIN) {
+        int err = -errno;
+        WARN(NULL, "failed to read %s notifications: %s\n",
+                BLKTAP2_LIST_DIR, strerror(-err));
+        close(fd);
+        backend->slave.slave.tapdisks_fd = -1;
+        return err;
+    }
+
+    if (reload)
+        return tapdisks_reload(backend);
+
+    return 0;
+}
+
 /**
  * Retrieves the tapdisk designated to serve this device, storing this
  * information in the supplied VBD handle.
  *
+ * @param backend the back-end whose tapdisk list to look in
  * @param minor
  * @param tap output parameter that receives the tapdisk process information.
  * The parameter is undefined when the function returns a non-zero value.
@@ -132,31 +266,34 @@ tapback_backend_destroy_device(vbd_t * const device)
  * XXX Only called by blkback_probe.
  */
 static inline int
-find_tapdisk(const int minor, tap_list_t *tap)
+find_tapdisk(backend_t *backend, const int minor, tap_list_t *tap)
 {
-    struct list_head list = LIST_HEAD_INIT(list);
     tap_list_t *_tap;
-    int err;
+    int err, tries;
 
-    err = tap_ctl_list(&list);
-    if (err) {
-        WARN(NULL, "error listing tapdisks: %s\n", strerror(-err));
-        goto out;
-    }
+    /*
+     * Look in the cached list first. A tapdisk which doesn't publish its
+     * VBDs, or a missed notification, is caught by listing them all.
+     */
+    err = tapdisks_update(backend);
+    for (tries = err ? 1 : 0; tries < 2; tries++) {
+        if (tries) {
+            err = tapdisks_reload(backend);
+            if (err)
+                goto out;
+        }
 
-    err = -ESRCH;
-    if (!list_empty(&list)) {
-        tap_list_for_each_entry(_tap, &list) {
+        tap_list_for_each_entry(_tap, &backend->slave.slave.tapdisks) {
             if (_tap->minor == minor) {
-                err = 0;
                 memcpy(tap, _tap, sizeof(*tap));
-                break;
+                err = 0;
+                goto out;
             }
         }
-        tap_ctl_list_free(&list);
-    } else
-        DBG(NULL, "no tapdisks\n");
+    }
 
+    DBG(NULL, "no tapdisk serving minor %d\n", minor);
+    err = -ESRCH;
 out:
     return err;
 }
@@ -329,6 +466,15 @@ physical_device_changed(vbd_t *device) {
         goto out;
     }
 
+    /*
+     * The key gets rewritten, and its watch fires again, without the device
+     * changing; the tapdisk lookup below is expensive so don't repeat it.
+     */
+    if (device->tap && major == device->major && minor == device->minor) {
+        DBG(device, "physical device unchanged\n");
+        goto out;
+    }
+
     if (major != tapdev_major) {
         WARN(device, "ignoring non-blktap2 physical device: %d\n", major);
         err = -EINVAL;
@@ -353,7 +499,7 @@ physical_device_changed(vbd_t *device) {
 
     DBG(device, "need to find tapdisk serving minor=%d\n", device->minor);
 
-    err = find_tapdisk(device->minor, device->tap);
+    err = find_tapdisk(device->backend, device->minor, device->tap);
     if (err) {
         WARN(device, "error looking for tapdisk: %s\n", strerror(-err));
         goto out;
@@ -507,9 +653,12 @@ hotplug_status_changed(vbd_t * const device) {
 	}
 	if (!strcmp(hotplug_status, "connected")) {
 
-        DBG(device, "physical device available (hotplug scripts ran)\n");
+        if (device->hotplug_status_connected) {
+            DBG(device, "hotplug-status unchanged\n");
+            goto out;
+        }
 
-		device->hotplug_status_connected = true;
+        DBG(device, "physical device available (hotplug scripts ran)\n");
 
         device_type = tapback_device_read_otherend(device, XBT_NULL,
                 "device-type");
@@ -557,6 +706,8 @@ hotplug_status_changed(vbd_t * const device) {
         if (polling_idle_threshold)
             device->polling_idle_threshold = atoi(polling_idle_threshold);
 
+        device->hotplug_status_connected = true;
+
         /*
          * Attempt to connect as everything may be ready and the only thing the
          * back-end is waiting for is this XenStore key to be written.
@@ -583,6 +734,8 @@ out:
 	free(hotplug_status);
     free(device_type);
 	free(mode);
+	free(polling_duration);
+	free(polling_idle_threshold);
 
 	return err;
 }
@@ -1065,7 +1218,7 @@ tapback_backend_handle_backend_watch(backend_t *backend,
                  * FIXME Shall we watch the child process?
                  */
             } else { /* child */
-                char *args[7];
+                char *args[11];
                 int i = 0;
 
                 args[i++] = (char*)tapback_name;
@@ -1081,6 +1234,19 @@ tapback_backend_handle_backend_watch(backend_t *backend,
                     args[i++] = "-v";
 				if (!backend->barrier)
 					args[i++] = "-b";
+				if (!backend->indirect)
+					args[i++] = "-I";
+				if (!backend->discard)
+					args[i++] = "-D";
+				if (backend->max_queues > 1) {
+					args[i++] = "-q";
+					err = asprintf(&args[i++], "%u", backend->max_queues);
+					if (err == -1) {
+						err = -errno;
+						WARN(NULL, "failed to asprintf: %s\n", strerror(-err));
+						abort();
+					}
+				}
                 args[i] = NULL;
                 /*
                  * TODO we're hard-coding the name of the binary, better let
@@ -33,6 +33,7 @@
 
 #include "tapback.h"
 
+#include <unistd.h>
 #include <xen/io/protocols.h>
 #include "xen_blkif.h"
 
@@ -68,6 +69,90 @@ xenbus_switch_state(vbd_t * const device,
     return err;
 }
 
+/**
+ * Reads the grant references and the event channel of a ring. For a
+ * multi-queue front-end they live under queue-<n>/, otherwise directly in
+ * the front-end directory.
+ *
+ * @param device the VBD
+ * @param queue the ring to read, -1 for the only ring of a single-queue
+ * front-end
+ * @param order number of pages in the ring, expressed as a page order
+ * @param gref output parameter that receives the grant references
+ * @param port output parameter that receives the event channel
+ * @returns 0 on success, a positive error code otherwise
+ */
+static int
+read_ring(vbd_t * const device, const int queue, const int order,
+        grant_ref_t * const gref, evtchn_port_t * const port)
+{
+    /*
+     * +10 is for INT_MAX, +1 for NULL termination
+     */
+    char prefix[sizeof("queue-/") + 10 + 1] = "";
+    char path[sizeof(prefix) + sizeof(EVENT_CHANNEL) + 10 + 1];
+    int i;
+
+    if (queue >= 0)
+        snprintf(prefix, sizeof(prefix), "queue-%d/", queue);
+
+    /*
+     * Read the grant references.
+     */
+    for (i = 0; i < 1 << order; i++) {
+        if (order)
+            snprintf(path, sizeof(path), "%s%s%d", prefix, RING_REF, i);
+        else
+            snprintf(path, sizeof(path), "%s%s", prefix, RING_REF);
+        if (1 != tapback_device_scanf_otherend(device, XBT_NULL, path,
+                    "%u", &gref[i])) {
+            WARN(device, "failed to read grant ref %s\n", path);
+            return ENOENT;
+        }
+    }
+
+    /*
+     * Read the event channel.
+     */
+    snprintf(path, sizeof(path), "%s%s", prefix, EVENT_CHANNEL);
+    if (1 != tapback_device_scanf_otherend(device, XBT_NULL, path,
+                "%u", port)) {
+        WARN(device, "failed to read event channel %s\n", path);
+        return ENOENT;
+    }
+
+    return 0;
+}
+
+/**
+ * A connect of a tapdisk to the shared ring(s) of a VBD. The rings are
+ * connected one after the other over a fresh control connection each, and
+ * tapback's event loop waits for the responses, so that a slow tapdisk does
+ * not hold up the other devices.
+ */
+struct tapback_connect {
+    vbd_t *device;
+    struct list_head entry;
+
+    /**
+     * Control connection of the request in flight, -1 if there is none.
+     */
+    int fd;
+
+    /**
+     * Counted against TAPBACK_MAX_CONNECTS.
+     */
+    bool running;
+
+    unsigned queue;
+    unsigned nr_queues;
+    int order;
+    int proto;
+    grant_ref_t *gref;
+};
+
+static void connect_tap_kick(backend_t *backend);
+
 /**
  * Core functions that instructs the tapdisk to connect to the shared ring (if
  * not already connected).
@@ -77,19 +162,25 @@ xenbus_switch_state(vbd_t * const device,
  * This function is idempotent: if the tapback daemon gets restarted this
  * function will be called again but it won't really do anything.
  *
+ * A multi-queue front-end gets one ring per queue, ring 0 first.
+ *
+ * The tapdisk is asked asynchronously, connect_tap_done() completes the
+ * connection.
+ *
  * @param device the VBD the tapdisk should connect to
- * @returns (a) 0 on success, (b) ESRCH if the tapdisk is not available, and
- * (c) an error code otherwise
+ * @returns (a) EINPROGRESS if the connect got started, (b) ESRCH if the
+ * tapdisk is not available, and (c) an error code otherwise
  */
 static inline int
 connect_tap(vbd_t * const device)
 {
-    evtchn_port_t port = 0;
+    struct tapback_connect *conn = NULL;
     grant_ref_t *gref = NULL;
     int err = 0;
     char *proto_str = NULL;
     char *persistent_grants_str = NULL;
     int nr_pages = 0, proto = 0, order = 0;
+    unsigned nr_queues;
     bool persistent_grants = false;
 
     ASSERT(device);
@@ -101,6 +192,7 @@ connect_tap(vbd_t * const device)
      * place?
      */
     ASSERT(!device->connected);
+    ASSERT(!device->connect);
 
     /*
      * The physical-device XenStore key has not been written yet.
@@ -128,45 +220,16 @@ connect_tap(vbd_t * const device)
     }
 
     /*
-     * Read the grant references.
+     * How many rings does the front-end use? With a single ring, its nodes
+     * are not under queue-0/.
      */
-    if (order) {
-        int i = 0;
-        /*
-         * +10 is for INT_MAX, +1 for NULL termination
-         */
-
-        static const size_t len = sizeof(RING_REF) + 10 + 1;
-        char ring_ref[len];
-        for (i = 0; i < nr_pages; i++) {
-            if (snprintf(ring_ref, len, "%s%d", RING_REF, i) >= (int)len) {
-                DBG(device, "error printing to buffer\n");
-                err = EINVAL;
-                goto out;
-            }
-            if (1 != tapback_device_scanf_otherend(device, XBT_NULL, ring_ref,
-                        "%u", &gref[i])) {
-                WARN(device, "failed to read grant ref 0x%x\n", i);
-                err = ENOENT;
-                goto out;
-            }
-        }
-    } else {
-        if (1 != tapback_device_scanf_otherend(device, XBT_NULL, RING_REF,
-                    "%u", &gref[0])) {
-            WARN(device, "failed to read grant ref\n");
-            err = ENOENT;
-            goto out;
-        }
-    }
-
-    /*
-     * Read the event channel.
-     */
-    if (1 != tapback_device_scanf_otherend(device, XBT_NULL, EVENT_CHANNEL,
-                "%u", &port)) {
-        WARN(device, "failed to read event channel\n");
-        err = ENOENT;
+    if (1 != tapback_device_scanf_otherend(device, XBT_NULL, MQ_NUM_QUEUES,
+                "%u", &nr_queues))
+        nr_queues = 1;
+    else if (!nr_queues || nr_queues > device->backend->max_queues) {
+        WARN(device, "invalid %s %u, max %u\n", MQ_NUM_QUEUES, nr_queues,
+                device->backend->max_queues);
+        err = EINVAL;
         goto out;
     }
 
@@ -215,33 +278,139 @@ connect_tap(vbd_t * const device)
     if (persistent_grants)
         WARN(device, "front-end supports persistent grants but we don't\n");
 
-    /*
-     * Create the shared ring and ask the tapdisk to connect to it.
-     */
-    if ((err = -tap_ctl_connect_xenblkif(device->tap->pid, device->domid,
-                    device->devid, device->polling_duration, device->polling_idle_threshold,
-		    gref, order, port, proto, NULL,
-                    device->minor))) {
+    conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        WARN(device, "failed to allocate memory for the connect.\n");
+        err = ENOMEM;
+        goto out;
+    }
+
+    conn->device = device;
+    conn->fd = -1;
+    conn->nr_queues = nr_queues;
+    conn->order = order;
+    conn->proto = proto;
+    conn->gref = gref;
+    gref = NULL;
+
+    device->connect = conn;
+    list_add_tail(&conn->entry, &device->backend->slave.slave.connects);
+    connect_tap_kick(device->backend);
+
+    err = EINPROGRESS;
+
+out:
+    free(gref);
+    free(proto_str);
+    free(persistent_grants_str);
+
+    return err;
+}
+
+/**
+ * Asks the tapdisk to connect to the current ring of the connect.
+ *
+ * @returns 0 on success, a positive error code otherwise
+ */
+static int
+connect_tap_send(struct tapback_connect *conn)
+{
+    vbd_t *device = conn->device;
+    tapdisk_message_t message;
+    evtchn_port_t port = 0;
+    int err;
+
+    err = read_ring(device, conn->nr_queues > 1 ? (int)conn->queue : -1,
+            conn->order, conn->gref, &port);
+    if (err)
+        return err;
+
+    err = -tap_ctl_connect_xenblkif_message(&message, device->domid,
+            device->devid, device->polling_duration,
+            device->polling_idle_threshold, conn->gref, conn->order, port,
+            conn->proto, NULL, device->minor, conn->queue);
+    if (err)
+        return err;
+
+    err = -tap_ctl_connect_id(device->tap->pid, &conn->fd);
+    if (err) {
+        WARN(device, "failed to connect to tapdisk[%d]: %s\n",
+                device->tap->pid, strerror(err));
+        return err;
+    }
+
+    err = -tap_ctl_write_message(conn->fd, &message, NULL);
+    if (err) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    return err;
+}
+
+/**
+ * Reads the tapdisk's response for the current ring.
+ *
+ * @returns 0 on success, a positive error code otherwise
+ */
+static int
+connect_tap_receive(struct tapback_connect *conn)
+{
+    vbd_t *device = conn->device;
+    tapdisk_message_t message;
+    int err;
+
+    ASSERT(conn->fd >= 0);
+
+    err = -tap_ctl_read_message(conn->fd, &message, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    if (!err)
+        err = -tap_ctl_connect_xenblkif_response(device->tap->pid, &message);
+
+    if (err) {
         /*
-         * This happens if the tapback dameon gets restarted while there are
-         * active VBDs.
+         * This happens if the tapback dameon gets restarted while there
+         * are active VBDs.
          */
         if (err == EALREADY) {
             INFO(device, "tapdisk[%d] minor=%d already connected to the "
-					"shared ring\n", device->tap->pid, device->tap->minor);
+                    "shared ring %u\n", device->tap->pid,
+                    device->tap->minor, conn->queue);
             err = 0;
         } else {
             WARN(device, "tapdisk[%d] failed to connect to the shared "
-                    "ring: %s\n", device->tap->pid, strerror(err));
-            goto out;
+                    "ring %u: %s\n", device->tap->pid, conn->queue,
+                    strerror(err));
+            return err;
         }
     }
 
+    /*
+     * So that a failure on a later ring disconnects the earlier ones.
+     */
     device->connected = true;
 
-    DBG(device, "tapdisk[%d] connected to shared ring\n", device->tap->pid);
+    return 0;
+}
+
+static int
+connect_frontend(vbd_t *device);
+
+/**
+ * Ends a connect, connecting the front-end if the tapdisk is connected to all
+ * the rings and disconnecting the tapdisk otherwise.
+ */
+static void
+connect_tap_done(struct tapback_connect *conn, int err)
+{
+    vbd_t *device = conn->device;
+
+    ASSERT(conn->fd < 0);
+
+    if (!err)
+        DBG(device, "tapdisk[%d] connected to %u shared ring(s)\n",
+                device->tap->pid, conn->nr_queues);
 
-out:
     if (err && device->connected) {
         const int err2 = -tap_ctl_disconnect_xenblkif(device->tap->pid,
                 device->domid, device->devid, NULL);
@@ -254,18 +423,125 @@ out:
         device->connected = false;
     }
 
-    free(gref);
-    free(proto_str);
-    free(persistent_grants_str);
+    if (conn->running)
+        device->backend->slave.slave.nr_connecting--;
+    list_del(&conn->entry);
+    free(conn->gref);
+    free(conn);
+    device->connect = NULL;
 
-    return err;
+    if (err)
+        return;
+
+    /*
+     * Even if tapdisk is already connected to the shared ring, we continue
+     * connecting since we don't know how far the connection process had gone
+     * before the tapback daemon was restarted.
+     */
+    err = -connect_frontend(device);
+    if (err)
+        WARN(device, "failed to connect to the front-end: %s\n",
+                strerror(err));
+}
+
+/**
+ * Starts waiting connects while there are free slots.
+ */
+static void
+connect_tap_kick(backend_t *backend)
+{
+    struct tapback_connect *conn, *next;
+    int err;
+
+    list_for_each_entry_safe(conn, next, &backend->slave.slave.connects,
+            entry) {
+        if (backend->slave.slave.nr_connecting >= TAPBACK_MAX_CONNECTS)
+            break;
+        if (conn->running)
+            continue;
+
+        conn->running = true;
+        backend->slave.slave.nr_connecting++;
+
+        err = connect_tap_send(conn);
+        if (err)
+            connect_tap_done(conn, err);
+    }
+}
+
+int
+tapback_backend_connect_fds(backend_t *backend, fd_set *rfds)
+{
+    struct tapback_connect *conn;
+    int max = -1;
+
+    if (tapback_is_master(backend))
+        return -1;
+
+    list_for_each_entry(conn, &backend->slave.slave.connects, entry) {
+        if (conn->fd < 0)
+            continue;
+        FD_SET(conn->fd, rfds);
+        if (conn->fd > max)
+            max = conn->fd;
+    }
+
+    return max;
+}
+
+void
+tapback_backend_connect_complete(backend_t *backend, fd_set *rfds)
+{
+    struct tapback_connect *conn, *next;
+    int err;
+
+    if (tapback_is_master(backend))
+        return;
+
+    list_for_each_entry_safe(conn, next, &backend->slave.slave.connects,
+            entry) {
+        if (conn->fd < 0 || !FD_ISSET(conn->fd, rfds))
+            continue;
+
+        err = connect_tap_receive(conn);
+        if (!err && ++conn->queue < conn->nr_queues) {
+            err = connect_tap_send(conn);
+            if (!err)
+                continue;
+        }
+        connect_tap_done(conn, err);
+    }
+
+    connect_tap_kick(backend);
+}
+
+void
+tapback_device_connect_cancel(vbd_t * const device)
+{
+    struct tapback_connect *conn = device->connect;
+    backend_t *backend = device->backend;
+
+    if (!conn)
+        return;
+
+    DBG(device, "cancelling connect\n");
+
+    /*
+     * The tapdisk acts on a request it has received regardless, wait for it
+     * so that we know whether there is a ring to disconnect from.
+     */
+    if (conn->fd >= 0)
+        connect_tap_receive(conn);
+
+    connect_tap_done(conn, ECANCELED);
+    connect_tap_kick(backend);
 }
 
 
 /**
  * Returns 0 on success, a negative error code otherwise.
  */
-static inline int
+static int
 connect_frontend(vbd_t *device) {
 
     int err = 0;
@@ -283,11 +559,6 @@ connect_frontend(vbd_t *device) {
 
         abort_transaction = true;
 
-        /*
-         * FIXME blkback writes discard-granularity, discard-alignment,
-         * discard-secure, feature-discard but we don't.
-         */
-
         /*
 		 * Write the number of sectors, sector size, info, and barrier support
 		 * to the back-end path in XenStore so that the front-end creates a VBD
@@ -300,6 +571,55 @@ connect_frontend(vbd_t *device) {
             break;
         }
 
+        /*
+         * Frontends prefer flushes to barriers when offered both: writes
+         * then complete without waiting on each other, and only flushes
+         * sync the images.
+         */
+        if ((err = tapback_device_printf(device, xst, "feature-flush-cache",
+                        true, "%d", 1))) {
+            WARN(device, "failed to write feature-flush-cache: %s\n",
+                    strerror(-err));
+            break;
+        }
+
+        if (device->backend->indirect &&
+                (err = tapback_device_printf(device, xst,
+                        "feature-max-indirect-segments", true, "%u",
+                        TD_MAX_INDIRECT_SEGMENTS))) {
+            WARN(device, "failed to write feature-max-indirect-segments: %s\n",
+                    strerror(-err));
+            break;
+        }
+
+        /*
+         * Discards are passed down to the image, which releases what it
+         * can at sector granularity. They are not secure erases.
+         */
+        if (device->backend->discard) {
+            if ((err = tapback_device_printf(device, xst, "feature-discard",
+                            true, "%d", 1))) {
+                WARN(device, "failed to write feature-discard: %s\n",
+                        strerror(-err));
+                break;
+            }
+
+            if ((err = tapback_device_printf(device, xst,
+                            "discard-granularity", true, "%u",
+                            device->sector_size))) {
+                WARN(device, "failed to write discard-granularity: %s\n",
+                        strerror(-err));
+                break;
+            }
+
+            if ((err = tapback_device_printf(device, xst,
+                            "discard-alignment", true, "%u", 0))) {
+                WARN(device, "failed to write discard-alignment: %s\n",
+                        strerror(-err));
+                break;
+            }
+        }
+
         if ((err = tapback_device_printf(device, xst, "sector-size", true,
                         "%u", device->sector_size))) {
             WARN(device, "failed to write sector-size: %s\n", strerror(-err));
@@ -360,19 +680,11 @@ xenbus_connect(vbd_t *device) {
 
     err = connect_tap(device);
     /*
-     * No tapdisk yet (the physical-device XenStore key has not been written).
+     * The front-end gets connected once the tapdisk is, see
+     * connect_tap_done().
      */
-    if (err == ESRCH)
-        goto out;
-    /*
-     * Even if tapdisk is already connected to the shared ring, we continue
-     * connecting since we don't know how far the connection process had gone
-     * before the tapback daemon was restarted.
-     */
-    if (err && err != -EALREADY)
-        goto out;
-    err = -connect_frontend(device);
-out:
+    if (err == EINPROGRESS)
+        err = 0;
     return err;
 }
 
@@ -395,6 +707,8 @@ backend_close(vbd_t * const device)
 
     ASSERT(device);
 
+    tapback_device_connect_cancel(device);
+
     if (!device->connected) {
         /*
          * This VBD might be a CD-ROM device, or a disk device that never went
@@ -440,15 +754,31 @@ frontend_changed(vbd_t * const device, const XenbusState state)
 
     switch (state) {
         case XenbusStateInitialising:
-			if (device->hotplug_status_connected)
+			if (device->hotplug_status_connected) {
+				/*
+				 * The front-end reads this before it sets up its rings.
+				 */
+				if (device->backend->max_queues > 1) {
+					err = -tapback_device_printf(device, XBT_NULL,
+							MQ_MAX_QUEUES, true, "%u",
+							device->backend->max_queues);
+					if (err) {
+						WARN(device, "failed to write %s: %s\n",
+								MQ_MAX_QUEUES, strerror(err));
+						break;
+					}
+				}
 				err = xenbus_switch_state(device, XenbusStateInitWait);
+			}
             break;
         case XenbusStateInitialised:
     	case XenbusStateConnected:
             if (!device->hotplug_status_connected)
                 DBG(device, "udev scripts haven't yet run\n");
             else {
-                if (device->state != XenbusStateConnected) {
+                if (device->connect)
+                    DBG(device, "connect in progress\n");
+                else if (device->state != XenbusStateConnected) {
                     DBG(device, "connecting to front-end\n");
                     err = xenbus_connect(device);
                 } else
@@ -55,6 +55,11 @@
 #include "tapback.h"
 #include <signal.h>
 
+/*
+ * Maximum number of watch events read and coalesced in one go.
+ */
+#define TAPBACK_WATCH_BATCH 256
+
 const char tapback_name[] = "tapback";
 unsigned log_level;
 int tapdev_major;
@@ -78,20 +83,18 @@ char *xenbus_strstate(const XenbusState xbs)
 }
 
 /**
- * Read changes that occurred on the "backend/<backend name>" XenStore path
- * or one of the front-end paths and act accordingly.
+ * Act on a change that occurred on the "backend/<backend name>" XenStore path
+ * or one of the front-end paths.
  */
 static inline void
-tapback_read_watch(backend_t *backend)
+tapback_handle_watch(backend_t *backend, char **watch)
 {
-    char **watch = NULL, *path = NULL, *token = NULL;
-    unsigned int n = 0;
+    char *path = NULL, *token = NULL;
     int err = 0;
 
 	ASSERT(backend);
+	ASSERT(watch);
 
-    /* read the change */
-    watch = xs_read_watch(backend->xs, &n);
     path = watch[XS_WATCH_PATH];
     token = watch[XS_WATCH_TOKEN];
 
@@ -142,9 +145,80 @@ tapback_read_watch(backend_t *backend)
 	if (err)
 		WARN(NULL, "failed to process XenStore watch on %s: %s\n",
 				path, strerror(abs(err)));
+}
+
+/*
+ * The master only cares about domains coming and going, so it reduces
+ * "backend/<backend name>/<domid>/..." to the domain path; otherwise every key
+ * written for every VBD would be a separate event.
+ */
+static void
+tapback_watch_coarsen(char *path)
+{
+    int n = 0;
+
+    for (; *path; path++)
+        if (*path == '/' && ++n == 3) {
+            *path = '\0';
+            break;
+        }
+}
+
+/**
+ * Read all pending watch events and process them once each.
+ *
+ * The handlers read the current XenStore contents rather than relying on the
+ * event, so when the same path fired several times during a burst (VM start,
+ * migration) only the first occurrence needs to be processed.
+ */
+static inline void
+tapback_read_watches(backend_t *backend)
+{
+    char **batch[TAPBACK_WATCH_BATCH];
+    unsigned int i, j, n = 0, len = 0, m = 0;
+
+	ASSERT(backend);
+
+    /* select() said there's at least one, so this doesn't block */
+    batch[n] = xs_read_watch(backend->xs, &len);
+    if (!batch[n]) {
+        WARN(NULL, "failed to read watch: %s\n", strerror(errno));
+        return;
+    }
+    n++;
+
+    while (n < TAPBACK_WATCH_BATCH && (batch[n] = xs_check_watch(backend->xs)))
+        n++;
+
+    for (i = 0; i < n; i++) {
+        char *path = batch[i][XS_WATCH_PATH];
+        char *token = batch[i][XS_WATCH_TOKEN];
+
+        if (tapback_is_master(backend) &&
+                !strcmp(token, backend->backend_token))
+            tapback_watch_coarsen(path);
+
+        for (j = 0; j < i; j++) {
+            if (batch[j] && !strcmp(batch[j][XS_WATCH_PATH], path) &&
+                    !strcmp(batch[j][XS_WATCH_TOKEN], token)) {
+                free(batch[i]);
+                batch[i] = NULL;
+                break;
+            }
+        }
+        if (batch[i])
+            m++;
+    }
+
+    if (n > 1)
+        DBG(NULL, "%u watch events, %u after coalescing\n", n, m);
 
-    free(watch);
-    return;
+    for (i = 0; i < n; i++) {
+        if (!batch[i])
+            continue;
+        tapback_handle_watch(backend, batch[i]);
+        free(batch[i]);
+    }
 }
 
 /**
@@ -230,7 +304,8 @@ tapback_write_pid(const char *pidfile)
  */
 static inline backend_t *
 tapback_backend_create(const char *name, const char *pidfile,
-        const domid_t domid, const bool barrier)
+        const domid_t domid, const bool barrier, const bool indirect,
+        const bool discard, const unsigned max_queues)
 {
     int err;
     int len;
@@ -266,6 +341,9 @@ tapback_backend_create(const char *name, const char *pidfile,
     }
 
 	backend->barrier = barrier;
+	backend->indirect = indirect;
+	backend->discard = discard;
+	backend->max_queues = max_queues;
 
     backend->path = NULL;
 
@@ -274,6 +352,9 @@ tapback_backend_create(const char *name, const char *pidfile,
     if (domid) {
         backend->slave_domid = domid;
         INIT_LIST_HEAD(&backend->slave.slave.devices);
+        INIT_LIST_HEAD(&backend->slave.slave.connects);
+        INIT_LIST_HEAD(&backend->slave.slave.tapdisks);
+        backend->slave.slave.tapdisks_fd = -1;
         err = asprintf(&backend->path, "%s/%s/%d", XENSTORE_BACKEND,
                 backend->name, backend->slave_domid);
         if (err == -1) {
@@ -447,15 +528,22 @@ tapback_backend_run(backend_t *backend)
 
     do {
         fd_set rfds;
-        int nfds = 0;
+        int nfds = 0, max;
 
         FD_ZERO(&rfds);
         FD_SET(fd, &rfds);
 
+        /*
+         * tapdisks answering ring connects
+         */
+        max = tapback_backend_connect_fds(backend, &rfds);
+        if (max < fd)
+            max = fd;
+
         /*
          * poll the fd for changes in the XenStore path we're interested in
          */
-        nfds = select(fd + 1, &rfds, NULL, NULL, NULL);
+        nfds = select(max + 1, &rfds, NULL, NULL, NULL);
         if (nfds == -1) {
             if (likely(errno == EINTR))
                 continue;
@@ -464,8 +552,10 @@ tapback_backend_run(backend_t *backend)
             break;
         }
 
+        tapback_backend_connect_complete(backend, &rfds);
+
         if (FD_ISSET(fd, &rfds))
-            tapback_read_watch(backend);
+            tapback_read_watches(backend);
         DBG(NULL, "--\n");
     } while (1);
 
@@ -513,6 +603,9 @@ usage(FILE * const stream, const char * const prog)
 			"\t[-h|--help]\n"
             "\t[-v|--verbose]\n"
 			"\t[-b]--nobarrier]\n"
+			"\t[-I|--noindirect]\n"
+			"\t[-D|--nodiscard]\n"
+			"\t[-q|--max-queues <n>]\n"
             "\t[-n|--name]\n", prog);
 }
 
@@ -586,6 +679,9 @@ int main(int argc, char **argv)
 	backend_t *backend = NULL;
     domid_t opt_domid = 0;
 	bool opt_barrier = true;
+	bool opt_indirect = true;
+	bool opt_discard = true;
+	unsigned opt_max_queues = 1;
 
 	if (access("/dev/xen/gntdev", F_OK ) == -1) {
 		WARN(NULL, "grant device does not exist\n");
@@ -613,11 +709,14 @@ int main(int argc, char **argv)
             {"pidfile", 0, NULL, 'p'},
             {"domain", 0, NULL, 'x'},
 			{"nobarrier", 0, NULL, 'b'},
+			{"noindirect", 0, NULL, 'I'},
+			{"nodiscard", 0, NULL, 'D'},
+			{"max-queues", 1, NULL, 'q'},
 
         };
         int c;
 
-        c = getopt_long(argc, argv, "hdvn:p:x:b", longopts, NULL);
+        c = getopt_long(argc, argv, "hdvn:p:x:bIDq:", longopts, NULL);
         if (c < 0)
             break;
 
@@ -657,6 +756,20 @@ int main(int argc, char **argv)
 		case 'b':
 			opt_barrier = false;
 			break;
+		case 'I':
+			opt_indirect = false;
+			break;
+		case 'D':
+			opt_discard = false;
+			break;
+		case 'q':
+			opt_max_queues = strtoul(optarg, &end, 0);
+			if (*end != 0 || end == optarg || !opt_max_queues) {
+				WARN(NULL, "invalid number of queues %s\n", optarg);
+				err = EINVAL;
+				goto fail;
+			}
+			break;
         case '?':
             goto usage;
         }
@@ -691,7 +804,7 @@ int main(int argc, char **argv)
     }
 
 	backend = tapback_backend_create(opt_name, opt_pidfile, opt_domid,
-			opt_barrier);
+			opt_barrier, opt_indirect, opt_discard, opt_max_queues);
 	if (!backend) {
 		err = errno;
         WARN(NULL, "error creating back-end: %s\n", strerror(err));
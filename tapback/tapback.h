@@ -39,6 +39,7 @@
 #include <search.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <sys/un.h>
 
 #include <xen/xen.h>
@@ -121,8 +122,16 @@ int pretty_time(char *buf, unsigned char buf_len);
 #define EVENT_CHANNEL           "event-channel"
 #define FEAT_PERSIST            "feature-persistent"
 #define PROTO                   "protocol"
+#define MQ_MAX_QUEUES           "multi-queue-max-queues"
+#define MQ_NUM_QUEUES           "multi-queue-num-queues"
 #define FRONTEND_KEY            "frontend"
 
+/*
+ * Maximum number of tapdisks asked to connect to their rings at the same
+ * time.
+ */
+#define TAPBACK_MAX_CONNECTS    32
+
 struct backend_master {
     void *slaves;
 };
@@ -143,6 +152,20 @@ struct backend_slave {
              * size of the request ring buffer"
              */
             int max_ring_page_order;
+
+            /**
+             * Tapdisk ring connects in progress or waiting for a slot, see
+             * TAPBACK_MAX_CONNECTS.
+             */
+            struct list_head connects;
+            unsigned nr_connecting;
+
+            /**
+             * Tapdisks and the VBDs they serve, kept current through inotify
+             * on BLKTAP2_LIST_DIR (tapdisks_fd), -1 until set up.
+             */
+            struct list_head tapdisks;
+            int tapdisks_fd;
         } slave;
         struct {
             pid_t pid;
@@ -208,6 +231,22 @@ typedef struct backend {
 	 * Tells whether we support write I/O barriers.
 	 */
 	bool barrier;
+
+	/**
+	 * Tells whether we advertise indirect descriptors.
+	 */
+	bool indirect;
+
+	/**
+	 * Tells whether we advertise discard support.
+	 */
+	bool discard;
+
+	/**
+	 * Maximum number of rings a front-end may use per VBD, 1 disables
+	 * multi-queue.
+	 */
+	unsigned max_queues;
 } backend_t;
 
 /**
@@ -305,6 +344,11 @@ typedef struct vbd {
 	 */
 	int polling_idle_threshold;
 
+	/**
+	 * Connect to the shared ring(s) in progress, NULL if there is none.
+	 */
+	struct tapback_connect *connect;
+
 	/*
 	 * FIXME rename to backend_state
 	 */
@@ -490,6 +534,27 @@ xenbus_switch_state(vbd_t * const device, const XenbusState state);
 int
 frontend_changed(vbd_t * const device, const XenbusState state);
 
+/**
+ * Adds the control sockets of the connects in progress to rfds.
+ *
+ * @returns the highest descriptor added, or -1
+ */
+int
+tapback_backend_connect_fds(backend_t *backend, fd_set *rfds);
+
+/**
+ * Completes the connects whose tapdisk has responded.
+ */
+void
+tapback_backend_connect_complete(backend_t *backend, fd_set *rfds);
+
+/**
+ * Waits for the device's connect in progress, if any, and abandons it,
+ * disconnecting the tapdisk from whatever rings it did connect to.
+ */
+void
+tapback_device_connect_cancel(vbd_t * const device);
+
 /**
  * Returns the current domain ID or -errno.
  */
@@ -0,0 +1,828 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Serves the tapdisk metrics files, /dev/shm/td3-<pid>/{vdi,vbd,blktap,nbd}-*,
+ * as OpenMetrics on GET /metrics. Only the snapshots tapdisk publishes in
+ * those files are read (see tapdisk-metrics-stats.h), tapdisk itself is
+ * never asked for anything.
+ *
+ * Files are mapped once and kept mapped across scrapes; each scrape only
+ * lists the directories to pick up new files and drop the ones gone.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+
+#include "blktap3.h"
+#include "tapdisk-metrics-stats.h"
+
+#define TD_EXPORTER_PORT        9780
+#define TD_EXPORTER_SHM_DIR     "/dev/shm"
+#define TD_EXPORTER_HASH_BITS   12
+#define TD_EXPORTER_TIMEOUT_MS  5000
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+enum {
+	TD_EXP_VDI,
+	TD_EXP_VBD,
+	TD_EXP_BLKTAP,
+	TD_EXP_NBD,
+	TD_EXP_KINDS
+};
+
+static const char * const td_exp_kinds[TD_EXP_KINDS] = {
+	[TD_EXP_VDI]    = "vdi",
+	[TD_EXP_VBD]    = "vbd",
+	[TD_EXP_BLKTAP] = "blktap",
+	[TD_EXP_NBD]    = "nbd",
+};
+
+struct td_exp_file {
+	struct td_exp_file     *next;
+	unsigned int            hash;
+	unsigned int            gen;
+
+	int                     pid;
+	int                     kind;
+	int                     id[2];
+	ino_t                   ino;
+
+	void                   *mem;
+	size_t                  size;
+
+	/* consistent copy, taken at the start of each scrape */
+	int                     valid;
+	struct stats            stats;
+	int                     has_latency;
+	struct blkback_latency  latency;
+
+	/* OpenMetrics labels of the file */
+	char                    labels[96];
+};
+
+struct td_exp_buf {
+	char                   *data;
+	size_t                  len;
+	size_t                  size;
+};
+
+static struct td_exp_file *files[1 << TD_EXPORTER_HASH_BITS];
+static unsigned int gen;
+static int by_size;
+static int no_histograms;
+static volatile sig_atomic_t run = 1;
+
+static void
+sighandler(int signo)
+{
+	run = 0;
+}
+
+static unsigned int
+td_exp_hash(int pid, int kind, int id0, int id1)
+{
+	uint32_t h = 2166136261u;
+
+	h = (h ^ pid) * 16777619u;
+	h = (h ^ kind) * 16777619u;
+	h = (h ^ id0) * 16777619u;
+	h = (h ^ id1) * 16777619u;
+
+	return h;
+}
+
+static void
+td_exp_file_free(struct td_exp_file *f)
+{
+	if (f->mem)
+		munmap(f->mem, f->size);
+	free(f);
+}
+
+/*
+ * Maps @name under @dir, read-only. Tapdisk sizes the file before the
+ * directory entry can be seen, so a file smaller than a snapshot is not one
+ * of ours.
+ */
+static struct td_exp_file *
+td_exp_file_open(int dir, const char *name, int pid, int kind,
+		 int id0, int id1)
+{
+	struct td_exp_file *f;
+	struct stat st;
+	int fd;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return NULL;
+
+	fd = openat(dir, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		goto fail;
+
+	if (fstat(fd, &st) ||
+	    st.st_size < TD_METRICS_SNAPSHOT_OFFSET +
+			 (off_t)sizeof(struct stats_snapshot)) {
+		close(fd);
+		goto fail;
+	}
+
+	f->size = st.st_size;
+	f->mem  = mmap(NULL, f->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (f->mem == MAP_FAILED) {
+		f->mem = NULL;
+		goto fail;
+	}
+
+	f->ino   = st.st_ino;
+	f->pid   = pid;
+	f->kind  = kind;
+	f->id[0] = id0;
+	f->id[1] = id1;
+	f->hash  = td_exp_hash(pid, kind, id0, id1);
+
+	if (kind == TD_EXP_VBD)
+		snprintf(f->labels, sizeof(f->labels),
+			 "pid=\"%d\",kind=\"vbd\",domid=\"%d\",devid=\"%d\"",
+			 pid, id0, id1);
+	else
+		snprintf(f->labels, sizeof(f->labels),
+			 "pid=\"%d\",kind=\"%s\",minor=\"%d\"",
+			 pid, td_exp_kinds[kind], id0);
+
+	return f;
+
+fail:
+	td_exp_file_free(f);
+	return NULL;
+}
+
+static void
+td_exp_file_add(int dir, const char *name, ino_t ino, int pid, int kind,
+		int id0, int id1)
+{
+	struct td_exp_file **pp, *f;
+	unsigned int h;
+
+	h  = td_exp_hash(pid, kind, id0, id1);
+	pp = &files[h & (ARRAY_SIZE(files) - 1)];
+
+	for (f = *pp; f; f = f->next)
+		if (f->hash == h && f->pid == pid && f->kind == kind &&
+		    f->id[0] == id0 && f->id[1] == id1)
+			break;
+
+	if (f && f->ino == ino) {
+		f->gen = gen;
+		return;
+	}
+
+	/* a new file, or one recreated since the last scrape */
+	if (f)
+		f->gen = gen - 1;
+
+	f = td_exp_file_open(dir, name, pid, kind, id0, id1);
+	if (!f)
+		return;
+
+	f->gen  = gen;
+	f->next = *pp;
+	*pp     = f;
+}
+
+static int
+td_exp_parse(const char *name, int *kind, int *id0, int *id1)
+{
+	int n = 0;
+
+	*id1 = 0;
+
+	if (sscanf(name, "vbd-%d-%d%n", id0, id1, &n) == 2 && !name[n])
+		*kind = TD_EXP_VBD;
+	else if (sscanf(name, "vdi-%d%n", id0, &n) == 1 && !name[n])
+		*kind = TD_EXP_VDI;
+	else if (sscanf(name, "blktap-%d%n", id0, &n) == 1 && !name[n])
+		*kind = TD_EXP_BLKTAP;
+	else if (sscanf(name, "nbd-%d%n", id0, &n) == 1 && !name[n])
+		*kind = TD_EXP_NBD;
+	else
+		return -1;
+
+	return 0;
+}
+
+static void
+td_exp_scan_pid(int shm, const char *name, int pid)
+{
+	struct dirent *d;
+	int fd, kind, id0, id1;
+	DIR *dir;
+
+	fd = openat(shm, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return;
+	}
+
+	while ((d = readdir(dir)))
+		if (!td_exp_parse(d->d_name, &kind, &id0, &id1))
+			td_exp_file_add(dirfd(dir), d->d_name, d->d_ino,
+					pid, kind, id0, id1);
+
+	closedir(dir);
+}
+
+/*
+ * Picks up the metrics files of all tapdisks and drops those no longer
+ * listed, which tapdisk removed or which belonged to a tapdisk gone.
+ */
+static void
+td_exp_scan(void)
+{
+	struct td_exp_file **pp, *f;
+	struct dirent *d;
+	unsigned int i;
+	int shm, pid, n;
+	DIR *dir;
+
+	gen++;
+
+	dir = opendir(TD_EXPORTER_SHM_DIR);
+	if (!dir) {
+		perror("opendir");
+		return;
+	}
+
+	shm = dirfd(dir);
+	while ((d = readdir(dir)))
+		if (sscanf(d->d_name, "td3-%d%n", &pid, &n) == 1 &&
+		    !d->d_name[n])
+			td_exp_scan_pid(shm, d->d_name, pid);
+
+	closedir(dir);
+
+	for (i = 0; i < ARRAY_SIZE(files); i++)
+		for (pp = &files[i]; (f = *pp); )
+			if (f->gen != gen) {
+				*pp = f->next;
+				td_exp_file_free(f);
+			} else
+				pp = &f->next;
+}
+
+/*
+ * Copies the snapshot out under its sequence counter, as described in
+ * tapdisk-metrics-stats.h. A file with no snapshot published yet reports
+ * the live counters.
+ */
+static void
+td_exp_file_read(struct td_exp_file *f)
+{
+	const struct stats_snapshot *snap;
+	size_t need, len;
+	uint64_t seq;
+	int tries;
+
+	snap = (void *)((char *)f->mem + TD_METRICS_SNAPSHOT_OFFSET);
+	need = offsetof(struct stats_snapshot, ext) -
+		offsetof(struct stats_snapshot, stats);
+
+	f->valid       = 0;
+	f->has_latency = 0;
+
+	if (snap->version != TD_METRICS_SNAPSHOT_VERSION)
+		return;
+
+	len = snap->length;
+	if (len > f->size - TD_METRICS_SNAPSHOT_OFFSET -
+	    offsetof(struct stats_snapshot, stats))
+		return;
+
+	if (!__atomic_load_n(&snap->published, __ATOMIC_RELAXED)) {
+		memcpy(&f->stats, f->mem, sizeof(f->stats));
+		f->valid = 1;
+		return;
+	}
+
+	for (tries = 0; tries < 100; tries++) {
+		seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(&f->stats, &snap->stats, sizeof(f->stats));
+		if (f->kind == TD_EXP_VBD &&
+		    len >= need + sizeof(struct blkback_latency)) {
+			memcpy(&f->latency, snap->ext, sizeof(f->latency));
+			f->has_latency = 1;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (seq == __atomic_load_n(&snap->seq, __ATOMIC_RELAXED)) {
+			f->valid = 1;
+			break;
+		}
+	}
+
+	if (f->has_latency &&
+	    (f->latency.version != BT3_LAT_VERSION ||
+	     f->latency.sub_bits != BT3_LAT_SUB_BITS ||
+	     f->latency.buckets != BT3_LAT_BUCKETS ||
+	     f->latency.sizes != BT3_LAT_SIZES))
+		f->has_latency = 0;
+}
+
+static int
+td_exp_printf(struct td_exp_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+
+		if (n < 0)
+			return -EINVAL;
+
+		if (b->len + n < b->size) {
+			b->len += n;
+			return 0;
+		} else {
+			size_t size = b->size ? b->size * 2 : 1 << 16;
+			char *data;
+
+			while (size <= b->len + n)
+				size *= 2;
+
+			data = realloc(b->data, size);
+			if (!data)
+				return -ENOMEM;
+
+			b->data = data;
+			b->size = size;
+		}
+	}
+}
+
+#define td_exp_for_each_file(f, i)					\
+	for (i = 0; i < ARRAY_SIZE(files); i++)				\
+		for (f = files[i]; f; f = f->next)			\
+			if (f->valid)
+
+static const struct {
+	const char *name;
+	const char *help;
+	size_t      offset;
+	int         usecs;
+} td_exp_counters[] = {
+	{ "tapdisk_read_requests_submitted", "Read requests received",
+	  offsetof(struct stats, read_reqs_submitted) },
+	{ "tapdisk_read_requests_completed", "Read requests completed",
+	  offsetof(struct stats, read_reqs_completed) },
+	{ "tapdisk_read_sectors", "Sectors read",
+	  offsetof(struct stats, read_sectors) },
+	{ "tapdisk_read_time_seconds", "Time spent completing read requests",
+	  offsetof(struct stats, read_total_ticks), 1 },
+	{ "tapdisk_write_requests_submitted", "Write requests received",
+	  offsetof(struct stats, write_reqs_submitted) },
+	{ "tapdisk_write_requests_completed", "Write requests completed",
+	  offsetof(struct stats, write_reqs_completed) },
+	{ "tapdisk_write_sectors", "Sectors written",
+	  offsetof(struct stats, write_sectors) },
+	{ "tapdisk_write_time_seconds", "Time spent completing write requests",
+	  offsetof(struct stats, write_total_ticks), 1 },
+	{ "tapdisk_io_errors", "Requests completed with an error",
+	  offsetof(struct stats, io_errors) },
+};
+
+/*
+ * Highest latency, in us, that falls into histogram bucket @i, as
+ * tapdisk_latency_bucket_max() in td-stats.c.
+ */
+static unsigned long long
+td_exp_bucket_max(int i)
+{
+	int k, e;
+
+	if (i < BT3_LAT_SUB_BUCKETS - 1)
+		return i;
+
+	k = i + 1 - BT3_LAT_SUB_BUCKETS;
+	e = k / BT3_LAT_SUB_BUCKETS + BT3_LAT_SUB_BITS;
+
+	return ((unsigned long long)(BT3_LAT_SUB_BUCKETS +
+		k % BT3_LAT_SUB_BUCKETS) << (e - BT3_LAT_SUB_BITS)) - 1;
+}
+
+/*
+ * One histogram per direction, and per size class with -s. Only the
+ * power of two bounds are exported: the full log-linear resolution would
+ * be four times the series for every VBD on the host.
+ */
+static int
+td_exp_histogram(struct td_exp_buf *b, const struct td_exp_file *f,
+		 const char *op, const char *size,
+		 unsigned long long hist[BT3_LAT_SIZES][BT3_LAT_BUCKETS],
+		 int first, int last)
+{
+	unsigned long long count;
+	int i, s, err;
+
+	count = 0;
+	for (i = 0; i < BT3_LAT_BUCKETS; i++) {
+		for (s = first; s <= last; s++)
+			count += hist[s][i];
+
+		if (i == BT3_LAT_BUCKETS - 1 ||
+		    (i + 1) % BT3_LAT_SUB_BUCKETS)
+			continue;
+
+		err = td_exp_printf(b, "tapdisk_request_latency_seconds_bucket"
+				    "{%s,op=\"%s\"%s%s%s,le=\"%.6f\"} %llu\n",
+				    f->labels, op,
+				    size ? ",size=\"" : "", size ? : "",
+				    size ? "\"" : "",
+				    td_exp_bucket_max(i) / 1e6, count);
+		if (err)
+			return err;
+	}
+
+	return td_exp_printf(b, "tapdisk_request_latency_seconds_bucket"
+			     "{%s,op=\"%s\"%s%s%s,le=\"+Inf\"} %llu\n"
+			     "tapdisk_request_latency_seconds_count"
+			     "{%s,op=\"%s\"%s%s%s} %llu\n",
+			     f->labels, op,
+			     size ? ",size=\"" : "", size ? : "",
+			     size ? "\"" : "", count,
+			     f->labels, op,
+			     size ? ",size=\"" : "", size ? : "",
+			     size ? "\"" : "", count);
+}
+
+static int
+td_exp_render(struct td_exp_buf *b)
+{
+	static const char * const sizes[BT3_LAT_SIZES] = {
+		[BT3_LAT_SIZE_4K] = "4k",
+		[BT3_LAT_SIZE_16K] = "16k",
+		[BT3_LAT_SIZE_64K] = "64k",
+		[BT3_LAT_SIZE_LARGE] = "large",
+	};
+	struct td_exp_file *f;
+	unsigned int i, c;
+	int s, err;
+
+	b->len = 0;
+
+	for (i = 0; i < ARRAY_SIZE(files); i++)
+		for (f = files[i]; f; f = f->next)
+			td_exp_file_read(f);
+
+	for (c = 0; c < ARRAY_SIZE(td_exp_counters); c++) {
+		err = td_exp_printf(b, "# TYPE %s counter\n# HELP %s %s.\n",
+				    td_exp_counters[c].name,
+				    td_exp_counters[c].name,
+				    td_exp_counters[c].help);
+		if (err)
+			return err;
+
+		td_exp_for_each_file(f, i) {
+			uint64_t v = *(uint64_t *)((char *)&f->stats +
+						   td_exp_counters[c].offset);
+
+			if (td_exp_counters[c].usecs)
+				err = td_exp_printf(b, "%s_total{%s} %.6f\n",
+						    td_exp_counters[c].name,
+						    f->labels, v / 1e6);
+			else
+				err = td_exp_printf(b, "%s_total{%s} %llu\n",
+						    td_exp_counters[c].name,
+						    f->labels,
+						    (unsigned long long)v);
+			if (err)
+				return err;
+		}
+	}
+
+	err = td_exp_printf(b, "# TYPE tapdisk_low_memory_mode gauge\n"
+			    "# HELP tapdisk_low_memory_mode "
+			    "Whether tapdisk runs in low memory mode.\n");
+	if (err)
+		return err;
+
+	td_exp_for_each_file(f, i) {
+		err = td_exp_printf(b, "tapdisk_low_memory_mode{%s} %d\n",
+				    f->labels,
+				    !!(f->stats.flags & BT3_LOW_MEMORY_MODE));
+		if (err)
+			return err;
+	}
+
+	if (no_histograms)
+		goto out;
+
+	err = td_exp_printf(b, "# TYPE tapdisk_request_latency_seconds "
+			    "histogram\n"
+			    "# HELP tapdisk_request_latency_seconds "
+			    "Response time of the requests of the VBD.\n");
+	if (err)
+		return err;
+
+	td_exp_for_each_file(f, i) {
+		if (!f->has_latency)
+			continue;
+
+		if (!by_size) {
+			err = td_exp_histogram(b, f, "read", NULL,
+					       f->latency.rd,
+					       0, BT3_LAT_SIZES - 1);
+			if (!err)
+				err = td_exp_histogram(b, f, "write", NULL,
+						       f->latency.wr,
+						       0, BT3_LAT_SIZES - 1);
+			if (err)
+				return err;
+			continue;
+		}
+
+		for (s = 0; s < BT3_LAT_SIZES; s++) {
+			err = td_exp_histogram(b, f, "read", sizes[s],
+					       f->latency.rd, s, s);
+			if (!err)
+				err = td_exp_histogram(b, f, "write", sizes[s],
+						       f->latency.wr, s, s);
+			if (err)
+				return err;
+		}
+	}
+
+out:
+	return td_exp_printf(b, "# EOF\n");
+}
+
+static int
+td_exp_write(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, data, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		data += n;
+		len  -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads the request head, one request per connection. Anything but
+ * GET /metrics gets a 404.
+ */
+static void
+td_exp_serve(int fd, struct td_exp_buf *b)
+{
+	char req[2048], head[256];
+	struct pollfd pfd;
+	size_t len;
+	ssize_t n;
+	int err;
+
+	len = 0;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (len < sizeof(req) - 1) {
+		if (poll(&pfd, 1, TD_EXPORTER_TIMEOUT_MS) <= 0)
+			return;
+
+		n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+		if (n <= 0)
+			return;
+
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+
+	if (strncmp(req, "GET /metrics ", 13) &&
+	    strncmp(req, "GET /metrics?", 13)) {
+		static const char nf[] =
+			"HTTP/1.0 404 Not Found\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: 10\r\n"
+			"Connection: close\r\n\r\n"
+			"Not Found\n";
+
+		td_exp_write(fd, nf, sizeof(nf) - 1);
+		return;
+	}
+
+	td_exp_scan();
+
+	err = td_exp_render(b);
+	if (err) {
+		static const char ise[] =
+			"HTTP/1.0 500 Internal Server Error\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n\r\n";
+
+		td_exp_write(fd, ise, sizeof(ise) - 1);
+		return;
+	}
+
+	n = snprintf(head, sizeof(head),
+		     "HTTP/1.0 200 OK\r\n"
+		     "Content-Type: application/openmetrics-text; "
+		     "version=1.0.0; charset=utf-8\r\n"
+		     "Content-Length: %zu\r\n"
+		     "Connection: close\r\n\r\n", b->len);
+
+	if (!td_exp_write(fd, head, n))
+		td_exp_write(fd, b->data, b->len);
+}
+
+static int
+td_exp_listen(const char *addr, int port)
+{
+	struct sockaddr_in6 sin6;
+	struct sockaddr_in sin;
+	struct sockaddr *sa;
+	socklen_t salen;
+	int fd, on = 1;
+
+	memset(&sin6, 0, sizeof(sin6));
+	memset(&sin, 0, sizeof(sin));
+
+	if (!addr) {
+		sin6.sin6_family = AF_INET6;
+		sin6.sin6_addr   = in6addr_any;
+		sin6.sin6_port   = htons(port);
+		sa    = (struct sockaddr *)&sin6;
+		salen = sizeof(sin6);
+	} else if (inet_pton(AF_INET, addr, &sin.sin_addr) == 1) {
+		sin.sin_family = AF_INET;
+		sin.sin_port   = htons(port);
+		sa    = (struct sockaddr *)&sin;
+		salen = sizeof(sin);
+	} else if (inet_pton(AF_INET6, addr, &sin6.sin6_addr) == 1) {
+		sin6.sin6_family = AF_INET6;
+		sin6.sin6_port   = htons(port);
+		sa    = (struct sockaddr *)&sin6;
+		salen = sizeof(sin6);
+	} else {
+		fprintf(stderr, "invalid address %s\n", addr);
+		return -1;
+	}
+
+	fd = socket(sa->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if (bind(fd, sa, salen) || listen(fd, 16)) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-a|--address <addr>] [-p|--port <port>] "
+		"[-s|--by-size] [-H|--no-histograms]\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct option longopts[] = {
+		{ "address",       required_argument, NULL, 'a' },
+		{ "port",          required_argument, NULL, 'p' },
+		{ "by-size",       no_argument,       NULL, 's' },
+		{ "no-histograms", no_argument,       NULL, 'H' },
+		{ "help",          no_argument,       NULL, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	struct td_exp_buf buf = { 0 };
+	struct sigaction sa;
+	const char *addr = NULL;
+	int port = TD_EXPORTER_PORT;
+	int c, fd, sock;
+
+	while ((c = getopt_long(argc, argv, "a:p:sHh", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			if (port <= 0 || port > 65535) {
+				fprintf(stderr, "invalid port %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			by_size = 1;
+			break;
+		case 'H':
+			no_histograms = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	sock = td_exp_listen(addr, port);
+	if (sock == -1)
+		return EXIT_FAILURE;
+
+	while (run) {
+		fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno != EINTR)
+				perror("accept");
+			continue;
+		}
+
+		td_exp_serve(fd, &buf);
+		close(fd);
+	}
+
+	close(sock);
+	free(buf.data);
+
+	return EXIT_SUCCESS;
+}
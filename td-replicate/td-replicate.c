@@ -0,0 +1,954 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Continuous replication of a VBD to a remote tapdisk, from its changed
+ * block tracking. Each round:
+ *
+ *  - rotates the VBD's CBT log to a new file (tap-ctl rotate), the old
+ *    one then holds every write up to this point;
+ *  - starts a point-in-time export of the VBD (tap-ctl backup), after
+ *    the rotation so that no write falls between the two;
+ *  - reads the extents changed in the old log from the export and writes
+ *    them to the target over NBD, up to a queue depth at a time, all-zero
+ *    chunks as NBD_CMD_WRITE_ZEROES where the target takes them;
+ *  - flushes the target, ends the export and drops the old log.
+ *
+ * A failed round keeps its logs for the next. The target holds the disk
+ * as it was at the rotation of the last round done: the time since is
+ * the lag (RPO) reported after each round, with the throughput, and kept
+ * in the stats file for monitoring.
+ *
+ * The daemon owns the VBD's CBT log: the logs it rotates to are named
+ * <log>.<n>, next to the one the VBD was started with.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <time.h>
+#include <endian.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "blktap2.h"
+#include "tap-ctl.h"
+#include "cbt-util.h"
+
+#define TD_REPL_INTERVAL        60
+#define TD_REPL_DEPTH           16
+#define TD_REPL_MAX_DEPTH       64
+#define TD_REPL_CHUNK           (1 << 20)
+
+/* the point-in-time export, as in tapdisk-nbdserver.h */
+#define TD_REPL_BACKUP_SOCK     BLKTAP2_CONTROL_DIR"/nbd-backup"
+
+/* what the client side of the NBD protocol needs */
+#define NBD_NEGOTIATION_MAGIC   0x00420281861253ULL
+#define NBD_OPTS_MAGIC          0x49484156454F5054ULL /* "IHAVEOPT" */
+#define NBD_REQUEST_MAGIC       0x25609513
+#define NBD_REPLY_MAGIC         0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES      (1 << 1)
+
+#define NBD_FLAG_READ_ONLY      (1 << 1)
+#define NBD_FLAG_SEND_FLUSH     (1 << 2)
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+
+#define NBD_OPT_EXPORT_NAME     1
+
+enum {
+	NBD_CMD_READ         = 0,
+	NBD_CMD_WRITE        = 1,
+	NBD_CMD_DISC         = 2,
+	NBD_CMD_FLUSH        = 3,
+	NBD_CMD_WRITE_ZEROES = 6
+};
+
+struct nbd_opt_header {
+	uint64_t                magic;
+	uint32_t                option;
+	uint32_t                length;
+} __attribute__ ((packed));
+
+struct nbd_request {
+	uint32_t                magic;
+	uint32_t                type;
+	char                    handle[8];
+	uint64_t                from;
+	uint32_t                len;
+} __attribute__ ((packed));
+
+struct nbd_reply {
+	uint32_t                magic;
+	uint32_t                error;
+	char                    handle[8];
+} __attribute__ ((packed));
+
+struct td_repl_conn {
+	int                     fd;
+	const char             *addr;
+	uint64_t                size;
+	uint16_t                flags;
+};
+
+struct td_repl_extent {
+	uint64_t                off;
+	uint64_t                len;
+};
+
+struct td_repl_slot {
+	char                   *buf;
+	uint64_t                off;
+	uint32_t                len;
+};
+
+struct td_repl {
+	pid_t                   pid;
+	int                     minor;
+	const char             *target;
+	int                     depth;
+	uint32_t                chunk;
+	const char             *stats;
+
+	/* the log the VBD was started with, the one it writes now */
+	const char             *log;
+	char                   *current;
+	uint64_t                seq;
+
+	/* rotated out, not replicated yet */
+	char                  **pending;
+	int                     nr_pending;
+
+	struct td_repl_extent  *ext;
+	size_t                  nr_ext;
+	size_t                  ext_size;
+
+	struct td_repl_slot     slots[TD_REPL_MAX_DEPTH];
+
+	/* rotation time of the last round done */
+	time_t                  synced;
+};
+
+static volatile sig_atomic_t run = 1;
+
+static void
+sighandler(int signo)
+{
+	run = 0;
+}
+
+static int
+td_repl_recv(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n == -1 && errno == EINTR && run)
+			continue;
+		if (n == -1)
+			return -errno;
+		if (!n)
+			return -ECONNRESET;
+		p   += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+td_repl_sendv(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt) {
+		n = writev(fd, iov, cnt);
+		if (n == -1 && errno == EINTR && run)
+			continue;
+		if (n == -1)
+			return -errno;
+
+		while (cnt && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base  = (char *)iov->iov_base + n;
+			iov->iov_len  -= n;
+		}
+	}
+
+	return 0;
+}
+
+static int
+td_repl_send(int fd, const void *buf, size_t len)
+{
+	struct iovec iov = { (void *)buf, len };
+
+	return td_repl_sendv(fd, &iov, 1);
+}
+
+/*
+ * A UNIX domain socket for an absolute path, else <host>:<port>.
+ */
+static int
+td_repl_connect(const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_un sun;
+	char host[256], *port;
+	int fd, one = 1, err;
+
+	if (addr[0] == '/') {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(addr) >= sizeof(sun.sun_path))
+			return -ENAMETOOLONG;
+		strcpy(sun.sun_path, addr);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+			return -errno;
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+			err = -errno;
+			close(fd);
+			return err;
+		}
+		return fd;
+	}
+
+	if (snprintf(host, sizeof(host), "%s", addr) >= sizeof(host))
+		return -ENAMETOOLONG;
+	port = strrchr(host, ':');
+	if (!port)
+		return -EINVAL;
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res))
+		return -EHOSTUNREACH;
+
+	err = -EHOSTUNREACH;
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+				   &one, sizeof(one));
+			break;
+		}
+		err = -errno;
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd >= 0 ? fd : err;
+}
+
+/*
+ * Oldstyle, or fixed newstyle with NBD_OPT_EXPORT_NAME and the default
+ * export: both tapdisk servers serve just the one.
+ */
+static int
+td_repl_negotiate(struct td_repl_conn *c)
+{
+	struct nbd_opt_header opt;
+	char magic[8], pad[124];
+	uint64_t magic2, size;
+	uint32_t flags32, cflags;
+	uint16_t hflags, flags;
+	int err;
+
+	err = td_repl_recv(c->fd, magic, sizeof(magic));
+	if (err)
+		return err;
+	if (memcmp(magic, "NBDMAGIC", sizeof(magic)))
+		return -EPROTO;
+
+	err = td_repl_recv(c->fd, &magic2, sizeof(magic2));
+	if (err)
+		return err;
+
+	if (be64toh(magic2) == NBD_NEGOTIATION_MAGIC) {
+		err = td_repl_recv(c->fd, &size, sizeof(size));
+		if (!err)
+			err = td_repl_recv(c->fd, &flags32, sizeof(flags32));
+		if (!err)
+			err = td_repl_recv(c->fd, pad, sizeof(pad));
+		if (err)
+			return err;
+
+		c->size  = be64toh(size);
+		c->flags = ntohl(flags32);
+		return 0;
+	}
+
+	if (be64toh(magic2) != NBD_OPTS_MAGIC)
+		return -EPROTO;
+
+	err = td_repl_recv(c->fd, &hflags, sizeof(hflags));
+	if (err)
+		return err;
+	hflags = ntohs(hflags);
+
+	cflags = htonl(hflags & (NBD_FLAG_FIXED_NEWSTYLE |
+				 NBD_FLAG_NO_ZEROES));
+	err = td_repl_send(c->fd, &cflags, sizeof(cflags));
+	if (err)
+		return err;
+
+	opt.magic  = htobe64(NBD_OPTS_MAGIC);
+	opt.option = htonl(NBD_OPT_EXPORT_NAME);
+	opt.length = 0;
+	err = td_repl_send(c->fd, &opt, sizeof(opt));
+	if (err)
+		return err;
+
+	err = td_repl_recv(c->fd, &size, sizeof(size));
+	if (!err)
+		err = td_repl_recv(c->fd, &flags, sizeof(flags));
+	if (!err && !(hflags & NBD_FLAG_NO_ZEROES))
+		err = td_repl_recv(c->fd, pad, sizeof(pad));
+	if (err)
+		return err;
+
+	c->size  = be64toh(size);
+	c->flags = ntohs(flags);
+	return 0;
+}
+
+static int
+td_repl_open(struct td_repl_conn *c, const char *addr)
+{
+	int err;
+
+	c->addr = addr;
+	c->fd   = td_repl_connect(addr);
+	if (c->fd < 0) {
+		err = c->fd;
+		fprintf(stderr, "connecting to %s: %s\n", addr, strerror(-err));
+		return err;
+	}
+
+	err = td_repl_negotiate(c);
+	if (err)
+		fprintf(stderr, "negotiating with %s: %s\n",
+			addr, strerror(-err));
+
+	return err;
+}
+
+static void
+td_repl_close(struct td_repl_conn *c)
+{
+	struct nbd_request req;
+
+	if (c->fd < 0)
+		return;
+
+	memset(&req, 0, sizeof(req));
+	req.magic = htonl(NBD_REQUEST_MAGIC);
+	req.type  = htonl(NBD_CMD_DISC);
+	td_repl_send(c->fd, &req, sizeof(req));
+
+	close(c->fd);
+	c->fd = -1;
+}
+
+static int
+td_repl_request(struct td_repl_conn *c, int type, uint64_t handle,
+		uint64_t from, uint32_t len, const void *data)
+{
+	struct nbd_request req;
+	struct iovec iov[2];
+
+	req.magic = htonl(NBD_REQUEST_MAGIC);
+	req.type  = htonl(type);
+	memcpy(req.handle, &handle, sizeof(req.handle));
+	req.from  = htobe64(from);
+	req.len   = htonl(len);
+
+	iov[0].iov_base = &req;
+	iov[0].iov_len  = sizeof(req);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len  = len;
+
+	return td_repl_sendv(c->fd, iov, data ? 2 : 1);
+}
+
+/*
+ * The next simple reply: its handle, and the error it carries.
+ */
+static int
+td_repl_reply(struct td_repl_conn *c, uint64_t *handle)
+{
+	struct nbd_reply rep;
+	int err;
+
+	err = td_repl_recv(c->fd, &rep, sizeof(rep));
+	if (err)
+		return err;
+
+	if (ntohl(rep.magic) != NBD_REPLY_MAGIC)
+		return -EPROTO;
+
+	memcpy(handle, rep.handle, sizeof(*handle));
+
+	return -(int)ntohl(rep.error);
+}
+
+static int
+td_repl_add_extent(uint64_t off, uint64_t len, void *arg)
+{
+	struct td_repl *r = arg;
+	struct td_repl_extent *ext;
+	size_t size;
+
+	if (r->nr_ext == r->ext_size) {
+		size = r->ext_size ? r->ext_size * 2 : 256;
+		ext  = realloc(r->ext, size * sizeof(*ext));
+		if (!ext)
+			return -ENOMEM;
+		r->ext      = ext;
+		r->ext_size = size;
+	}
+
+	r->ext[r->nr_ext].off = off;
+	r->ext[r->nr_ext].len = len;
+	r->nr_ext++;
+
+	return 0;
+}
+
+static int
+td_repl_read_log(struct td_repl *r, const char *path)
+{
+	struct cbt_log_metadata meta;
+	FILE *f;
+	int err;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	if (fread(&meta, sizeof(meta), 1, f) != 1)
+		err = -EIO;
+	else
+		err = cbt_log_read_extents(f, meta.size, td_repl_add_extent, r);
+
+	fclose(f);
+	return err;
+}
+
+/*
+ * A fresh log for the VBD to rotate to, with the metadata of the current
+ * one, marked inconsistent while in use, and the same layers.
+ */
+static int
+td_repl_new_log(struct td_repl *r, char **path)
+{
+	struct cbt_log_metadata meta;
+	struct stat st;
+	int in, out, err;
+
+	in = open(r->current, O_RDONLY | O_CLOEXEC);
+	if (in == -1)
+		return -errno;
+
+	out = -1;
+	*path = NULL;
+
+	if (fstat(in, &st) ||
+	    pread(in, &meta, sizeof(meta), 0) != sizeof(meta)) {
+		err = errno ? -errno : -EIO;
+		goto out;
+	}
+	meta.consistent = 0;
+
+	do {
+		free(*path);
+		if (asprintf(path, "%s.%"PRIu64, r->log, ++r->seq) == -1) {
+			*path = NULL;
+			err = -ENOMEM;
+			goto out;
+		}
+		out = open(*path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+			   st.st_mode & 0777);
+	} while (out == -1 && errno == EEXIST);
+
+	if (out == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	if (write(out, &meta, sizeof(meta)) != sizeof(meta) ||
+	    ftruncate(out, st.st_size) || fsync(out)) {
+		err = errno ? -errno : -EIO;
+		unlink(*path);
+		goto out;
+	}
+
+	err = 0;
+
+out:
+	if (err) {
+		free(*path);
+		*path = NULL;
+	}
+	if (out != -1)
+		close(out);
+	close(in);
+	return err;
+}
+
+static int
+td_repl_next(struct td_repl *r, size_t *e, uint64_t *pos, uint64_t size,
+	     struct td_repl_slot *s)
+{
+	struct td_repl_extent *x;
+	uint64_t len;
+
+	for (;;) {
+		if (*e == r->nr_ext)
+			return 0;
+
+		x   = &r->ext[*e];
+		len = x->off < size ? size - x->off : 0;
+		if (x->len < len)
+			len = x->len;
+		if (*pos < len)
+			break;
+
+		(*e)++;
+		*pos = 0;
+	}
+
+	s->off = x->off + *pos;
+	s->len = len - *pos < r->chunk ? len - *pos : r->chunk;
+	*pos  += s->len;
+
+	return 1;
+}
+
+static int
+td_repl_zero(const char *buf, uint32_t len)
+{
+	const uint64_t *p = (const uint64_t *)buf;
+	uint32_t i;
+
+	for (i = 0; i < len / sizeof(*p); i++)
+		if (p[i])
+			return 0;
+
+	for (i *= sizeof(*p); i < len; i++)
+		if (buf[i])
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Up to depth reads in flight from @src; as each completes its chunk is
+ * written to @dst and the slot reads the next. No more than depth writes
+ * go unanswered either, so neither server holds replies we do not read.
+ */
+static int
+td_repl_copy(struct td_repl *r, struct td_repl_conn *src,
+	     struct td_repl_conn *dst, uint64_t *bytes)
+{
+	struct td_repl_slot *s;
+	uint64_t h, pos;
+	int i, err, reads, writes, type;
+	size_t e;
+
+	e      = 0;
+	pos    = 0;
+	reads  = 0;
+	writes = 0;
+
+	for (i = 0; i < r->depth; i++) {
+		if (!td_repl_next(r, &e, &pos, src->size, &r->slots[i]))
+			break;
+
+		err = td_repl_request(src, NBD_CMD_READ, i,
+				      r->slots[i].off, r->slots[i].len, NULL);
+		if (err)
+			return err;
+		reads++;
+	}
+
+	while (reads) {
+		err = td_repl_reply(src, &h);
+		if (!err && h >= r->depth)
+			err = -EPROTO;
+		if (err)
+			return err;
+
+		s = &r->slots[h];
+		err = td_repl_recv(src->fd, s->buf, s->len);
+		if (err)
+			return err;
+		reads--;
+
+		for (; writes >= r->depth; writes--) {
+			err = td_repl_reply(dst, &h);
+			if (err)
+				return err;
+		}
+
+		type = NBD_CMD_WRITE;
+		if ((dst->flags & NBD_FLAG_SEND_WRITE_ZEROES) &&
+		    td_repl_zero(s->buf, s->len))
+			type = NBD_CMD_WRITE_ZEROES;
+
+		err = td_repl_request(dst, type, s->off, s->off, s->len,
+				      type == NBD_CMD_WRITE ?
+				      s->buf : NULL);
+		if (err)
+			return err;
+		writes++;
+		*bytes += s->len;
+
+		if (td_repl_next(r, &e, &pos, src->size, s)) {
+			err = td_repl_request(src, NBD_CMD_READ,
+					      s - r->slots, s->off, s->len,
+					      NULL);
+			if (err)
+				return err;
+			reads++;
+		}
+	}
+
+	for (; writes; writes--) {
+		err = td_repl_reply(dst, &h);
+		if (err)
+			return err;
+	}
+
+	if (dst->flags & NBD_FLAG_SEND_FLUSH) {
+		err = td_repl_request(dst, NBD_CMD_FLUSH, 0, 0, 0, NULL);
+		if (!err)
+			err = td_repl_reply(dst, &h);
+	}
+
+	return err;
+}
+
+static void
+td_repl_report(struct td_repl *r, uint64_t epoch, uint64_t bytes,
+	       double secs, int err)
+{
+	double rate = secs > 0 ? bytes / secs : 0;
+	time_t lag = r->synced ? time(NULL) - r->synced : -1;
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	if (err)
+		printf("epoch %"PRIu64": failed: %s, lag %lds\n",
+		       epoch, strerror(-err), (long)lag);
+	else
+		printf("epoch %"PRIu64": %zu extents, %"PRIu64" bytes "
+		       "in %.1fs, %.1f MiB/s, lag %lds\n", epoch, r->nr_ext,
+		       bytes, secs, rate / (1 << 20), (long)lag);
+	fflush(stdout);
+
+	if (!r->stats)
+		return;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", r->stats) >= sizeof(tmp))
+		return;
+
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+
+	fprintf(f, "{ \"epoch\": %"PRIu64", \"error\": %d, "
+		"\"bytes\": %"PRIu64", \"seconds\": %.3f, "
+		"\"bytes_per_second\": %.0f, \"synced\": %ld, "
+		"\"lag\": %ld }\n", epoch, -err, bytes, secs, rate,
+		(long)r->synced, (long)lag);
+
+	if (fclose(f) || rename(tmp, r->stats))
+		unlink(tmp);
+}
+
+static int
+td_repl_round(struct td_repl *r, int full)
+{
+	struct td_repl_conn src = { .fd = -1 }, dst = { .fd = -1 };
+	struct timespec t0, t1;
+	char sock[PATH_MAX], *next, **pending;
+	uint64_t epoch, bytes;
+	int i, err, ret;
+	time_t cut;
+
+	epoch = 0;
+	bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	err = td_repl_new_log(r, &next);
+	if (err) {
+		fprintf(stderr, "creating a log next to %s: %s\n",
+			r->log, strerror(-err));
+		goto report;
+	}
+
+	pending = realloc(r->pending, (r->nr_pending + 1) * sizeof(*pending));
+	if (!pending) {
+		err = -ENOMEM;
+		unlink(next);
+		free(next);
+		goto report;
+	}
+	r->pending = pending;
+
+	err = tap_ctl_cbt_rotate(r->pid, r->minor, next, &epoch);
+	if (err) {
+		unlink(next);
+		free(next);
+		goto report;
+	}
+	cut = time(NULL);
+
+	r->pending[r->nr_pending++] = r->current;
+	r->current = next;
+
+	err = tap_ctl_backup_start(r->pid, r->minor);
+	if (err)
+		goto report;
+
+	snprintf(sock, sizeof(sock), "%s%d.%d",
+		 TD_REPL_BACKUP_SOCK, r->pid, r->minor);
+
+	err = td_repl_open(&src, sock);
+	if (!err)
+		err = td_repl_open(&dst, r->target);
+	if (err)
+		goto out;
+
+	if (dst.flags & NBD_FLAG_READ_ONLY) {
+		err = -EROFS;
+		goto out;
+	}
+	if (dst.size < src.size) {
+		err = -ENOSPC;
+		goto out;
+	}
+
+	r->nr_ext = 0;
+	if (full)
+		err = td_repl_add_extent(0, src.size, r);
+	else
+		for (i = 0; i < r->nr_pending && !err; i++)
+			err = td_repl_read_log(r, r->pending[i]);
+	if (err)
+		goto out;
+
+	err = td_repl_copy(r, &src, &dst, &bytes);
+
+out:
+	td_repl_close(&src);
+	td_repl_close(&dst);
+
+	ret = tap_ctl_backup_stop(r->pid, r->minor);
+	if (!err)
+		err = ret;
+
+	if (!err) {
+		for (i = 0; i < r->nr_pending; i++) {
+			if (strcmp(r->pending[i], r->log))
+				unlink(r->pending[i]);
+			free(r->pending[i]);
+		}
+		r->nr_pending = 0;
+		r->synced     = cut;
+	}
+
+report:
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	td_repl_report(r, epoch, bytes, (t1.tv_sec - t0.tv_sec) +
+		       (t1.tv_nsec - t0.tv_nsec) / 1e9, err);
+
+	return err;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s <-p pid> <-m minor> <-l log> "
+		"<-t target> [-i interval] [-q depth] [-b chunk KiB] "
+		"[-S stats file] [-F] [-1]\n"
+		"Replicates the VBD to the NBD target, a socket path or "
+		"<host>:<port>, every interval seconds, from the CBT log "
+		"the VBD writes to now; -F copies it all first, -1 runs "
+		"once.\n",
+		prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct td_repl r;
+	struct sigaction sa;
+	unsigned int interval;
+	int c, i, full, once, err;
+	long chunk;
+
+	memset(&r, 0, sizeof(r));
+	r.pid    = -1;
+	r.minor  = -1;
+	r.depth  = TD_REPL_DEPTH;
+	r.chunk  = TD_REPL_CHUNK;
+	interval = TD_REPL_INTERVAL;
+	full     = 0;
+	once     = 0;
+
+	while ((c = getopt(argc, argv, "p:m:l:t:i:q:b:S:F1h")) != -1) {
+		switch (c) {
+		case 'p':
+			r.pid = atoi(optarg);
+			break;
+		case 'm':
+			r.minor = atoi(optarg);
+			break;
+		case 'l':
+			r.log = optarg;
+			break;
+		case 't':
+			r.target = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'q':
+			r.depth = atoi(optarg);
+			if (r.depth < 1 || r.depth > TD_REPL_MAX_DEPTH) {
+				fprintf(stderr, "depth is 1 to %d\n",
+					TD_REPL_MAX_DEPTH);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			chunk = atol(optarg);
+			if (chunk < 4 || chunk > 32768 || chunk % 4) {
+				fprintf(stderr, "chunk is 4 to 32768 KiB, "
+					"in 4 KiB steps\n");
+				return EXIT_FAILURE;
+			}
+			r.chunk = chunk << 10;
+			break;
+		case 'S':
+			r.stats = optarg;
+			break;
+		case 'F':
+			full = 1;
+			break;
+		case '1':
+			once = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (r.pid == -1 || r.minor == -1 || !r.log || !r.target) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	r.current = strdup(r.log);
+	if (!r.current)
+		return EXIT_FAILURE;
+	r.seq = time(NULL);
+
+	for (i = 0; i < r.depth; i++)
+		if (posix_memalign((void **)&r.slots[i].buf, 4096, r.chunk)) {
+			fprintf(stderr, "out of memory\n");
+			return EXIT_FAILURE;
+		}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	do {
+		err = td_repl_round(&r, full);
+		if (!err)
+			full = 0;
+
+		if (once)
+			break;
+
+		for (i = interval; i && run; i--)
+			sleep(1);
+	} while (run);
+
+	for (i = 0; i < r.depth; i++)
+		free(r.slots[i].buf);
+	for (i = 0; i < r.nr_pending; i++)
+		free(r.pending[i]);
+	free(r.pending);
+	free(r.current);
+	free(r.ext);
+
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -30,6 +30,8 @@
 
 #include "unity.h"
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 /* Header file for SUT */
 #include "drivers/block-aio.h"
@@ -56,7 +58,9 @@ void test_tdaio_queue_read_computes_size_and_offset_correctly(void)
     uint64_t expected_offset;
     struct aio_request aio;
     struct tdaio_state prv;
+    struct aio_request *free_list[1];
 
+    memset(&prv, 0, sizeof(prv));
     driver.data = &prv;
     treq.secs = 10;
     driver.info.sector_size = 2048;
@@ -64,6 +68,7 @@ void test_tdaio_queue_read_computes_size_and_offset_correctly(void)
 
     prv.aio_free_count = 1;
 
+    prv.aio_free_list = free_list;
     prv.aio_free_list[0] = &aio;
 
     // Expectations
@@ -84,3 +89,84 @@ void test_tdaio_queue_read_computes_size_and_offset_correctly(void)
     // Call to the method to test
     tdaio_queue_read(&driver, treq);
 }
+
+void test_tdaio_queue_read_passes_aligned_requests_through(void)
+{
+    // Initialisation
+    td_driver_t driver;
+    td_request_t treq;
+
+    static char buf[8192] __attribute__((aligned(4096)));
+    struct aio_request aio;
+    struct tdaio_state prv;
+    struct aio_request *free_list[1];
+
+    memset(&prv, 0, sizeof(prv));
+    driver.data = &prv;
+    prv.align = 4096;
+    prv.mem_align = 4096;
+
+    treq.buf = buf;
+    treq.secs = 16;
+    treq.sec = (uint64_t) 8;
+
+    prv.aio_free_count = 1;
+    prv.aio_free_list = free_list;
+    prv.aio_free_list[0] = &aio;
+
+    // Expectations
+    td_prep_read_Expect(
+        &aio.tiocb,
+        prv.fd,
+        treq.buf,
+        treq.secs * SECTOR_SIZE,
+        treq.sec * (uint64_t) SECTOR_SIZE,
+        tdaio_complete,
+        &aio);
+
+    td_queue_tiocb_Ignore();
+
+    // Call to the method to test
+    tdaio_queue_read(&driver, treq);
+}
+
+void test_tdaio_sector_present_reports_holes_of_sparse_files(void)
+{
+    // Initialisation
+    extern struct tap_disk tapdisk_aio;
+    static char buf[4096];
+    char path[] = "/tmp/test_block-aio.XXXXXX";
+    td_driver_t driver;
+    struct tdaio_state prv;
+    td_sector_t secs;
+    int fd;
+
+    fd = mkstemp(path);
+    TEST_ASSERT_NOT_EQUAL(-1, fd);
+    unlink(path);
+
+    /* 1MiB, data only in the 4KiB at 512KiB */
+    TEST_ASSERT_EQUAL(0, ftruncate(fd, 1 << 20));
+    memset(buf, 0xa5, sizeof(buf));
+    TEST_ASSERT_EQUAL(sizeof(buf), pwrite(fd, buf, sizeof(buf), 512 << 10));
+
+    memset(&prv, 0, sizeof(prv));
+    prv.fd = fd;
+    driver.data = &prv;
+    driver.info.size = (1 << 20) >> SECTOR_SHIFT;
+
+    // Call to the method to test
+    TEST_ASSERT_EQUAL(0, tapdisk_aio.td_sector_present(&driver, 0, &secs));
+    TEST_ASSERT_EQUAL(1024, secs);
+
+    TEST_ASSERT_EQUAL(1, tapdisk_aio.td_sector_present(&driver, 1024, &secs));
+    TEST_ASSERT_EQUAL(8, secs);
+
+    /* answered from the extent just found */
+    TEST_ASSERT_EQUAL(1, tapdisk_aio.td_sector_present(&driver, 1028, &secs));
+    TEST_ASSERT_EQUAL(4, secs);
+    TEST_ASSERT_EQUAL(2, prv.ext_lookups);
+    TEST_ASSERT_EQUAL(1, prv.ext_hits);
+
+    close(fd);
+}
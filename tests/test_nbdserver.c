@@ -47,6 +47,8 @@
 #include "mock_tapdisk-utils.h"
 #include "mock_tapdisk-vbd.h"
 #include "mock_tapdisk-fdreceiver.h"
+#include "mock_tapdisk-nbdtls.h"
+#include "mock_tapdisk-stats.h"
 
 unsigned PAGE_SIZE = 1 << 12;
 
@@ -111,7 +113,7 @@ void test_nbdserver_client_pending_req(void)
 
 	tapdisk_nbdserver_free_request(client, req);
 
-	TEST_ASSERT_TRUE_MESSAGE(
+	TEST_ASSERT_FALSE_MESSAGE(
 		tapdisk_nbdserver_contains_client(&server, client),
 		"NBD client marked dead should be freed when last request completes");
 }
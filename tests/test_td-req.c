@@ -28,6 +28,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
 #include "unity.h"
 #include "drivers/tapdisk.h"
 #include "mock_tapdisk-stats.h"
@@ -61,11 +62,10 @@ struct td_xenblkif* create_dead_blkif(void) {
     struct td_xenblkif* blkif;
     blkif_request_t* free_requests;
 
-    blkif = malloc(sizeof(struct td_xenblkif));
+    blkif = calloc(1, sizeof(struct td_xenblkif));
     free_requests = malloc(RING_SIZE * sizeof(blkif_request_t));
 
-    blkif->reqs_bufcache = malloc(RING_SIZE * sizeof(void*));
-    blkif->n_reqs_bufcache_free = 0;
+    blkif->ctx = calloc(1, sizeof(struct td_xenio_ctx));
 
     blkif->dead = 1;
     blkif->n_reqs_free = 10;
@@ -75,6 +75,15 @@ struct td_xenblkif* create_dead_blkif(void) {
     return blkif;
 }
 
+static char request_buf[4096];
+
+void init_data_request(struct td_xenblkif_req* request) {
+    memset(request, 0, sizeof(*request));
+    request->msg.operation = BLKIF_OP_READ;
+    request->nr_segments = 1;
+    request->vma = request_buf;
+}
+
 
 void test_comptetion_of_non_last_req_on_dead_ring_does_not_destroy_ring(void)
 {
@@ -82,6 +91,10 @@ void test_comptetion_of_non_last_req_on_dead_ring_does_not_destroy_ring(void)
     struct td_xenblkif* blkif;
 
     blkif = create_dead_blkif();
+    init_data_request(&request);
+
+    /* The request buffer goes back to the context's pool */
+    tapdisk_xenio_ctx_buf_put_Expect(blkif->ctx, request.vma);
 
     /* We report that we still have pending requests */
     tapdisk_xenblkif_reqs_pending_IgnoreAndReturn(1);
@@ -101,6 +114,10 @@ void test_completion_of_last_req_on_dead_ring_destroys_ring(void)
     struct td_xenblkif* blkif;
 
     blkif = create_dead_blkif();
+    init_data_request(&request);
+
+    /* The request buffer goes back to the context's pool */
+    tapdisk_xenio_ctx_buf_put_Expect(blkif->ctx, request.vma);
 
     /* We report that this is the last request */
     tapdisk_xenblkif_reqs_pending_IgnoreAndReturn(0);
@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libaio.h>
+
+#include "libvhd-aio.h"
+
+#define VHD_AIO_BITMAPS            8  /* cached bitmaps per image */
+#define VHD_AIO_MAX_CHAIN          64
+
+struct vhd_aio_bitmap {
+	uint32_t                   block;
+	char                      *map;
+};
+
+/*
+ * one image of the chain: a vhd, or the raw image at its root
+ */
+struct vhd_aio_layer {
+	vhd_context_t             *vhd;
+	int                        raw_fd;
+	int                        owned;
+	struct vhd_aio_bitmap      bitmaps[VHD_AIO_BITMAPS];
+	int                        next_bitmap;
+};
+
+/*
+ * one contiguous extent of a request, in one file
+ */
+struct vhd_aio_seg {
+	struct iocb                iocb;
+	vhd_aio_req_t             *req;
+	struct vhd_aio_seg        *next;
+};
+
+struct vhd_aio {
+	vhd_context_t             *vhd;
+	io_context_t               ioctx;
+	int                        depth;
+	int                        inflight;
+	int                        pending;
+
+	struct vhd_aio_layer       layers[VHD_AIO_MAX_CHAIN];
+	int                        nr_layers;
+
+	/* extents waiting for a free slot, in submission order */
+	struct vhd_aio_seg        *queue;
+	struct vhd_aio_seg       **queue_tail;
+
+	/* completed requests, in completion order */
+	vhd_aio_req_t             *done;
+	vhd_aio_req_t            **done_tail;
+};
+
+static void
+vhd_aio_layer_drop_bitmaps(struct vhd_aio_layer *l)
+{
+	int i;
+
+	for (i = 0; i < VHD_AIO_BITMAPS; i++) {
+		free(l->bitmaps[i].map);
+		l->bitmaps[i].map = NULL;
+	}
+}
+
+static int
+vhd_aio_layer_bitmap(struct vhd_aio_layer *l, uint32_t block, char **map)
+{
+	struct vhd_aio_bitmap *b;
+	int i, err;
+
+	for (i = 0; i < VHD_AIO_BITMAPS; i++)
+		if (l->bitmaps[i].map && l->bitmaps[i].block == block) {
+			*map = l->bitmaps[i].map;
+			return 0;
+		}
+
+	b = &l->bitmaps[l->next_bitmap];
+	l->next_bitmap = (l->next_bitmap + 1) % VHD_AIO_BITMAPS;
+
+	free(b->map);
+	b->map = NULL;
+
+	err = vhd_read_bitmap(l->vhd, block, &b->map);
+	if (err)
+		return err;
+
+	b->block = block;
+	*map     = b->map;
+	return 0;
+}
+
+static int
+vhd_aio_open_chain(vhd_aio_t *aio)
+{
+	struct vhd_aio_layer *l;
+	vhd_context_t *vhd, *parent;
+	char *next;
+	int err;
+
+	vhd = aio->vhd;
+
+	for (;;) {
+		if (aio->nr_layers == VHD_AIO_MAX_CHAIN)
+			return -ELOOP;
+
+		l = &aio->layers[aio->nr_layers++];
+		l->vhd    = vhd;
+		l->raw_fd = -1;
+		l->owned  = vhd != aio->vhd;
+
+		if (vhd_type_dynamic(vhd)) {
+			err = vhd_get_bat(vhd);
+			if (err)
+				return err;
+		}
+
+		if (vhd->footer.type != HD_TYPE_DIFF)
+			return 0;
+
+		err = vhd_parent_locator_get(vhd, &next);
+		if (err)
+			return err;
+
+		if (vhd_parent_raw(vhd)) {
+			l = &aio->layers[aio->nr_layers++];
+			l->raw_fd = open_optional_odirect(next, O_RDONLY | O_DIRECT |
+							  O_LARGEFILE);
+			free(next);
+			return (l->raw_fd == -1 ? -errno : 0);
+		}
+
+		parent = calloc(1, sizeof(*parent));
+		if (!parent) {
+			free(next);
+			return -ENOMEM;
+		}
+
+		err = vhd_open(parent, next, VHD_OPEN_RDONLY);
+		free(next);
+		if (err) {
+			free(parent);
+			return err;
+		}
+
+		vhd = parent;
+	}
+}
+
+int
+vhd_aio_open(vhd_context_t *vhd, int depth, vhd_aio_t **out)
+{
+	vhd_aio_t *aio;
+	int err;
+
+	if (depth < 1)
+		return -EINVAL;
+
+	aio = calloc(1, sizeof(*aio));
+	if (!aio)
+		return -ENOMEM;
+
+	aio->vhd        = vhd;
+	aio->depth      = depth;
+	aio->queue_tail = &aio->queue;
+	aio->done_tail  = &aio->done;
+
+	err = io_setup(depth, &aio->ioctx);
+	if (err) {
+		free(aio);
+		return err;
+	}
+
+	err = vhd_aio_open_chain(aio);
+	if (err) {
+		vhd_aio_close(aio);
+		return err;
+	}
+
+	*out = aio;
+	return 0;
+}
+
+void
+vhd_aio_close(vhd_aio_t *aio)
+{
+	struct vhd_aio_layer *l;
+	struct vhd_aio_seg *seg;
+	int i;
+
+	if (!aio)
+		return;
+
+	/* waits for anything still in flight */
+	io_destroy(aio->ioctx);
+
+	while ((seg = aio->queue)) {
+		aio->queue = seg->next;
+		free(seg);
+	}
+
+	for (i = 0; i < aio->nr_layers; i++) {
+		l = &aio->layers[i];
+
+		vhd_aio_layer_drop_bitmaps(l);
+		if (l->raw_fd != -1)
+			close(l->raw_fd);
+		if (l->owned) {
+			vhd_close(l->vhd);
+			free(l->vhd);
+		}
+	}
+
+	free(aio);
+}
+
+static void
+vhd_aio_complete(vhd_aio_t *aio, vhd_aio_req_t *req)
+{
+	req->next       = NULL;
+	*aio->done_tail = req;
+	aio->done_tail  = &req->next;
+}
+
+static int
+vhd_aio_add_seg(struct vhd_aio_seg **list, vhd_aio_req_t *req, int fd,
+		char *buf, uint32_t secs, uint64_t off)
+{
+	struct vhd_aio_seg *seg;
+
+	seg = malloc(sizeof(*seg));
+	if (!seg)
+		return -ENOMEM;
+
+	if (req->op == VHD_AIO_WRITE)
+		io_prep_pwrite(&seg->iocb, fd, buf,
+			       vhd_sectors_to_bytes(secs), off);
+	else
+		io_prep_pread(&seg->iocb, fd, buf,
+			      vhd_sectors_to_bytes(secs), off);
+
+	seg->iocb.data = seg;
+	seg->req       = req;
+	seg->next      = *list;
+	*list          = seg;
+
+	return 0;
+}
+
+/*
+ * resolves the read of secs sectors at sec into buf, starting at image
+ * index li of the chain, into extents added to list
+ */
+static int
+vhd_aio_resolve_read(vhd_aio_t *aio, struct vhd_aio_seg **list,
+		     vhd_aio_req_t *req, int li, char *buf,
+		     uint64_t sec, uint32_t secs)
+{
+	struct vhd_aio_layer *l;
+	vhd_context_t *vhd;
+	uint32_t blk, off, cnt, i, end;
+	uint64_t max;
+	char *map;
+	int err, set;
+
+	if (li == aio->nr_layers) {
+		memset(buf, 0, vhd_sectors_to_bytes(secs));
+		return 0;
+	}
+
+	l = &aio->layers[li];
+	if (l->raw_fd != -1)
+		return vhd_aio_add_seg(list, req, l->raw_fd, buf, secs,
+				       vhd_sectors_to_bytes(sec));
+
+	vhd = l->vhd;
+	max = vhd->footer.curr_size >> VHD_SECTOR_SHIFT;
+
+	/* past the end of a smaller parent reads as zeros */
+	if (sec + secs > max) {
+		cnt = sec < max ? max - sec : 0;
+		memset(buf + vhd_sectors_to_bytes(cnt), 0,
+		       vhd_sectors_to_bytes(secs - cnt));
+		secs = cnt;
+	}
+
+	if (!secs)
+		return 0;
+
+	if (!vhd_type_dynamic(vhd))
+		return vhd_aio_add_seg(list, req, vhd->fd, buf, secs,
+				       vhd_sectors_to_bytes(sec));
+
+	while (secs) {
+		blk = sec / vhd->spb;
+		off = sec % vhd->spb;
+		cnt = MIN(secs, vhd->spb - off);
+
+		if (vhd->bat.bat[blk] == DD_BLK_UNUSED) {
+			err = vhd_aio_resolve_read(aio, list, req, li + 1,
+						   buf, sec, cnt);
+			if (err)
+				return err;
+			goto next;
+		}
+
+		err = vhd_aio_layer_bitmap(l, blk, &map);
+		if (err)
+			return err;
+
+		for (i = off; i < off + cnt; i = end) {
+			set = vhd_bitmap_test(vhd, map, i);
+			end = vhd_bitmap_scan(vhd, map, i, off + cnt, !set);
+
+			if (set)
+				err = vhd_aio_add_seg(list, req, vhd->fd,
+						      buf + vhd_sectors_to_bytes(i - off),
+						      end - i,
+						      vhd_sectors_to_bytes((uint64_t)vhd->bat.bat[blk] +
+									   vhd->bm_secs + i));
+			else
+				err = vhd_aio_resolve_read(aio, list, req, li + 1,
+							   buf + vhd_sectors_to_bytes(i - off),
+							   sec + (i - off), end - i);
+			if (err)
+				return err;
+		}
+
+	next:
+		sec  += cnt;
+		secs -= cnt;
+		buf  += vhd_sectors_to_bytes(cnt);
+	}
+
+	return 0;
+}
+
+/*
+ * resolves a write that needs no allocation or bitmap update, or returns
+ * -EAGAIN for one that must go through vhd_io_write()
+ */
+static int
+vhd_aio_resolve_write(vhd_aio_t *aio, struct vhd_aio_seg **list,
+		      vhd_aio_req_t *req)
+{
+	struct vhd_aio_layer *l = &aio->layers[0];
+	vhd_context_t *vhd = aio->vhd;
+	uint64_t sec = req->sec;
+	uint32_t secs = req->secs, blk, off, cnt;
+	char *buf = req->buf, *map;
+	int err;
+
+	if (!vhd_type_dynamic(vhd))
+		return vhd_aio_add_seg(list, req, vhd->fd, buf, secs,
+				       vhd_sectors_to_bytes(sec));
+
+	while (secs) {
+		blk = sec / vhd->spb;
+		off = sec % vhd->spb;
+		cnt = MIN(secs, vhd->spb - off);
+
+		if (vhd->bat.bat[blk] == DD_BLK_UNUSED)
+			return -EAGAIN;
+
+		err = vhd_aio_layer_bitmap(l, blk, &map);
+		if (err)
+			return err;
+
+		if (vhd_bitmap_scan(vhd, map, off, off + cnt, 0) < off + cnt)
+			return -EAGAIN;
+
+		err = vhd_aio_add_seg(list, req, vhd->fd, buf, cnt,
+				      vhd_sectors_to_bytes((uint64_t)vhd->bat.bat[blk] +
+							   vhd->bm_secs + off));
+		if (err)
+			return err;
+
+		sec  += cnt;
+		secs -= cnt;
+		buf  += vhd_sectors_to_bytes(cnt);
+	}
+
+	return 0;
+}
+
+static void
+vhd_aio_free_segs(struct vhd_aio_seg *list)
+{
+	struct vhd_aio_seg *seg;
+
+	while ((seg = list)) {
+		list = seg->next;
+		free(seg);
+	}
+}
+
+/*
+ * moves queued extents into free slots
+ */
+static int
+vhd_aio_kick(vhd_aio_t *aio)
+{
+	struct iocb *iocbs[aio->depth];
+	struct vhd_aio_seg *seg;
+	int i, n, err;
+
+	for (n = 0, seg = aio->queue;
+	     seg && aio->inflight + n < aio->depth; seg = seg->next)
+		iocbs[n++] = &seg->iocb;
+
+	if (!n)
+		return 0;
+
+	err = io_submit(aio->ioctx, n, iocbs);
+	if (err < 0)
+		return err;
+
+	for (i = 0; i < err; i++) {
+		seg        = aio->queue;
+		aio->queue = seg->next;
+	}
+	if (!aio->queue)
+		aio->queue_tail = &aio->queue;
+
+	aio->inflight += err;
+	return 0;
+}
+
+int
+vhd_aio_submit(vhd_aio_t *aio, vhd_aio_req_t **reqs, int n)
+{
+	struct vhd_aio_seg *list, *seg, *rev;
+	vhd_aio_req_t *req;
+	int i, err;
+
+	for (i = 0; i < n; i++) {
+		req  = reqs[i];
+		list = NULL;
+
+		req->err     = 0;
+		req->pending = 0;
+
+		if (vhd_sectors_to_bytes(req->sec + req->secs) >
+		    aio->vhd->footer.curr_size)
+			err = -ERANGE;
+		else if (req->op == VHD_AIO_READ)
+			err = vhd_aio_resolve_read(aio, &list, req, 0, req->buf,
+						   req->sec, req->secs);
+		else if (req->op == VHD_AIO_WRITE)
+			err = vhd_aio_resolve_write(aio, &list, req);
+		else
+			err = -EINVAL;
+
+		if (err == -EAGAIN) {
+			vhd_aio_free_segs(list);
+			list = NULL;
+
+			req->err = vhd_io_write(aio->vhd, req->buf, req->sec,
+						req->secs);
+			/* the block or its bitmap may have changed */
+			vhd_aio_layer_drop_bitmaps(&aio->layers[0]);
+			err = 0;
+		}
+
+		if (err) {
+			vhd_aio_free_segs(list);
+			if (!i)
+				return err;
+			break;
+		}
+
+		/* extents were added in reverse, queue them in order */
+		for (rev = NULL; (seg = list); rev = seg) {
+			list      = seg->next;
+			seg->next = rev;
+		}
+
+		for (seg = rev; seg; seg = seg->next) {
+			req->pending++;
+			*aio->queue_tail = seg;
+			aio->queue_tail  = &seg->next;
+		}
+
+		aio->pending++;
+		if (!req->pending)
+			vhd_aio_complete(aio, req);
+	}
+
+	err = vhd_aio_kick(aio);
+	if (err && !i)
+		return err;
+
+	return i;
+}
+
+int
+vhd_aio_reap(vhd_aio_t *aio, vhd_aio_req_t **reqs, int max)
+{
+	struct io_event events[aio->depth];
+	struct vhd_aio_seg *seg;
+	vhd_aio_req_t *req;
+	int i, n, got, err;
+
+	while (!aio->done && aio->inflight) {
+		got = io_getevents(aio->ioctx, 1, aio->inflight, events, NULL);
+		if (got == -EINTR)
+			continue;
+		if (got < 0)
+			return got;
+
+		aio->inflight -= got;
+
+		for (i = 0; i < got; i++) {
+			seg = events[i].data;
+			req = seg->req;
+
+			if (events[i].res != seg->iocb.u.c.nbytes && !req->err)
+				req->err = (long)events[i].res < 0 ?
+					(long)events[i].res : -EIO;
+
+			free(seg);
+			if (!--req->pending)
+				vhd_aio_complete(aio, req);
+		}
+
+		err = vhd_aio_kick(aio);
+		if (err)
+			return err;
+	}
+
+	for (n = 0; n < max && aio->done; n++) {
+		req       = aio->done;
+		aio->done = req->next;
+		reqs[n]   = req;
+	}
+	if (!aio->done)
+		aio->done_tail = &aio->done;
+
+	aio->pending -= n;
+	return n;
+}
+
+int
+vhd_aio_pending(vhd_aio_t *aio)
+{
+	return aio->pending;
+}
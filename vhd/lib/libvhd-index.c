@@ -144,7 +144,8 @@ vhdi_check_block_size(uint32_t block_size)
 		if ((block_size >> i) & 0x0001)
 			cnt++;
 
-	if (cnt == 1)
+	if (cnt == 1 && block_size >= VHD_SECTOR_SIZE &&
+	    block_size <= (1ULL << VHD_BLOCK_SHIFT_MAX))
 		return 0;
 
 	return -EINVAL;
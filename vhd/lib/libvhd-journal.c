@@ -400,6 +400,10 @@ vhd_journal_update(vhd_journal_t *j, off64_t offset,
 		*off = j->header.journal_eof;
 	j->header.journal_eof += (size + sizeof(vhd_journal_entry_t));
 
+	/* the header goes out once, at vhd_journal_end() */
+	if (j->batch)
+		return 0;
+
 	err = vhd_journal_write_header(j, &j->header);
 	if (err) {
 		if (!--(*entries))
@@ -1325,7 +1329,10 @@ vhd_journal_create(vhd_journal_t *j, const char *file, const char *jfile)
 	if (err)
 		goto fail2;
 
+	/* add_metadata writes the header once it is done */
+	j->batch++;
 	err = vhd_journal_add_metadata(j);
+	j->batch--;
 	if (err)
 		goto fail2;
 
@@ -1416,6 +1423,73 @@ vhd_journal_add_block(vhd_journal_t *j, uint32_t block, char mode)
 			return err;
 	}
 
+	if (j->batch)
+		return 0;
+
+	return vhd_journal_sync(j);
+}
+
+/*
+ * journal the bitmap of @block from @map, which the caller has read
+ * from the vhd itself, so bulk updates can batch the reads
+ */
+int
+vhd_journal_add_bitmap(vhd_journal_t *j, uint32_t block, char *map)
+{
+	int err;
+	uint64_t blk;
+	vhd_context_t *vhd;
+
+	vhd = &j->vhd;
+
+	if (!vhd_type_dynamic(vhd))
+		return -EINVAL;
+
+	err = vhd_get_bat(vhd);
+	if (err)
+		return err;
+
+	if (block >= vhd->bat.entries)
+		return -ERANGE;
+
+	blk = vhd->bat.bat[block];
+	if (blk == DD_BLK_UNUSED)
+		return 0;
+
+	err = vhd_journal_update(j, vhd_sectors_to_bytes(blk), map,
+				 vhd_sectors_to_bytes(vhd->bm_secs),
+				 VHD_JOURNAL_ENTRY_TYPE_DATA);
+	if (err)
+		return err;
+
+	if (j->batch)
+		return 0;
+
+	return vhd_journal_sync(j);
+}
+
+int
+vhd_journal_begin(vhd_journal_t *j)
+{
+	j->batch++;
+	return 0;
+}
+
+int
+vhd_journal_end(vhd_journal_t *j)
+{
+	int err;
+
+	if (!j->batch)
+		return -EINVAL;
+
+	if (--j->batch)
+		return 0;
+
+	err = vhd_journal_write_header(j, &j->header);
+	if (err)
+		return err;
+
 	return vhd_journal_sync(j);
 }
 
@@ -45,9 +45,13 @@
 #include <iconv.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <libaio.h>
 
 #include "debug.h"
 #include "xattr.h"
@@ -66,6 +70,9 @@
 
 #define VHD_HEADER_MAX_RETRIES 10
 
+/* reflinks are of whole filesystem blocks, 4k on XFS and btrfs */
+#define VHD_CLONE_ALIGN 4096
+
 static int libvhd_dbg = 0;
 
 void
@@ -100,6 +107,15 @@ static int vhd_cache_enabled(vhd_context_t *);
 static int vhd_cache_load(vhd_context_t *);
 static int vhd_cache_unload(vhd_context_t *);
 static vhd_context_t * vhd_cache_get_parent(vhd_context_t *);
+static void vhd_bitmap_cache_free(vhd_context_t *);
+static void vhd_buf_pool_free(vhd_context_t *);
+static char * vhd_bitmap_cache_get(vhd_context_t *, uint32_t);
+
+static inline size_t
+vhd_bitmap_bytes(vhd_context_t *ctx)
+{
+	return vhd_bytes_padded(ctx->spb >> 3);
+}
 
 static inline int
 old_test_bit(volatile char *addr, int nr)
@@ -406,7 +422,7 @@ vhd_checksum_batmap(vhd_context_t *ctx, vhd_batmap_t *batmap)
 	checksum = 0;
 
 	map_size = vhd_sectors_to_bytes(secs_round_up_no_zero(
-			ctx->footer.curr_size >> (VHD_BLOCK_SHIFT + 3)));
+			ctx->footer.curr_size >> (vhd_block_shift(ctx) + 3)));
 
 	for (i = 0; i < map_size; i++) {
 		if (batmap->header.batmap_version == VHD_BATMAP_VERSION(1, 1))
@@ -630,6 +646,250 @@ vhd_bitmap_clear(vhd_context_t *ctx, char *map, uint32_t block)
 	return clear_bit(map, block);
 }
 
+/*
+ * Returns the index of the first bit in [start, end) of @map equal to
+ * @set, or @end if there is none.  Whole 64-bit words are examined at a
+ * time; only a trailing partial word falls back to per-bit tests.
+ * @old selects the legacy tapdisk layout (native uint32 words, LSB first)
+ * instead of the standard one (bytes, MSB first).
+ */
+static uint32_t
+__vhd_bitmap_scan(const char *map, uint32_t start, uint32_t end,
+		  int set, int old)
+{
+	uint32_t nr = start;
+
+	while (nr < end) {
+		uint32_t base = nr & ~63U;
+		uint64_t word;
+
+		if (base + 64 > end)
+			break;
+
+		if (old) {
+			uint32_t w[2];
+
+			memcpy(w, map + (base >> 3), sizeof(w));
+			word = ((uint64_t)w[1] << 32) | w[0];
+			if (!set)
+				word = ~word;
+			word &= ~0ULL << (nr - base);
+			if (word)
+				return base + __builtin_ctzll(word);
+		} else {
+			memcpy(&word, map + (base >> 3), sizeof(word));
+			word = be64toh(word);
+			if (!set)
+				word = ~word;
+			word &= ~0ULL >> (nr - base);
+			if (word)
+				return base + __builtin_clzll(word);
+		}
+
+		nr = base + 64;
+	}
+
+	for (; nr < end; nr++) {
+		int bit = old ? old_test_bit((char *)map, nr) :
+			test_bit((char *)map, nr);
+		if (bit == !!set)
+			break;
+	}
+
+	return nr;
+}
+
+static inline int
+vhd_bitmap_old(vhd_context_t *ctx)
+{
+	return vhd_creator_tapdisk(ctx) && ctx->footer.crtr_ver == 0x00000001;
+}
+
+/*
+ * Returns the first sector in [start, end) of the block bitmap @map whose
+ * bit equals @set, or @end.  A run of allocated sectors is therefore
+ * [vhd_bitmap_scan(.., 1), vhd_bitmap_scan(.., 0)).
+ */
+uint32_t
+vhd_bitmap_scan(vhd_context_t *ctx, char *map,
+		uint32_t start, uint32_t end, int set)
+{
+	return __vhd_bitmap_scan(map, start, end, set, vhd_bitmap_old(ctx));
+}
+
+/*
+ * Returns 1 if every sector of the block bitmap @map is allocated.
+ */
+int
+vhd_bitmap_full(vhd_context_t *ctx, char *map)
+{
+	return vhd_bitmap_scan(ctx, map, 0, ctx->spb, 0) == ctx->spb;
+}
+
+typedef uint64_t (*vhd_popcount_fn_t)(const char *, size_t);
+
+static uint64_t
+vhd_popcount_sw(const char *map, size_t words)
+{
+	uint64_t w, n = 0;
+	size_t i;
+
+	for (i = 0; i < words; i++) {
+		memcpy(&w, map + (i << 3), sizeof(w));
+		n += __builtin_popcountll(w);
+	}
+
+	return n;
+}
+
+#if defined(__x86_64__)
+/* the same, with the builtin compiled to POPCNT */
+static __attribute__((target("popcnt"))) uint64_t
+vhd_popcount_hw(const char *map, size_t words)
+{
+	uint64_t w, n = 0;
+	size_t i;
+
+	for (i = 0; i < words; i++) {
+		memcpy(&w, map + (i << 3), sizeof(w));
+		n += __builtin_popcountll(w);
+	}
+
+	return n;
+}
+#endif
+
+static vhd_popcount_fn_t
+vhd_popcount_select(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("popcnt"))
+		return vhd_popcount_hw;
+#endif
+	return vhd_popcount_sw;
+}
+
+/*
+ * Bits set in the first @size bytes of @map. Bit order does not matter
+ * to a count, so this serves both bitmap layouts and the batmap.
+ */
+static uint64_t
+vhd_popcount(const char *map, size_t size)
+{
+	static vhd_popcount_fn_t fn;
+	uint64_t n;
+	size_t i;
+
+	if (!fn)
+		fn = vhd_popcount_select();
+
+	n = fn(map, size >> 3);
+	for (i = size & ~7UL; i < size; i++)
+		n += __builtin_popcount((unsigned char)map[i]);
+
+	return n;
+}
+
+/*
+ * Returns the number of sectors allocated in the block bitmap @map.
+ */
+uint32_t
+vhd_bitmap_count(vhd_context_t *ctx, char *map)
+{
+	return vhd_popcount(map, ctx->spb >> 3);
+}
+
+/*
+ * Returns the number of blocks the batmap has full.
+ */
+uint32_t
+vhd_batmap_count(vhd_context_t *ctx, vhd_batmap_t *batmap)
+{
+	uint32_t i, n, entries;
+
+	if (!vhd_has_batmap(ctx) || !batmap->map)
+		return 0;
+
+	entries = MIN(ctx->bat.entries,
+		      batmap->header.batmap_size << (VHD_SECTOR_SHIFT + 3));
+
+	n = vhd_popcount(batmap->map, entries >> 3);
+	for (i = entries & ~7U; i < entries; i++)
+		n += !!vhd_batmap_test(ctx, batmap, i);
+
+	return n;
+}
+
+/*
+ * Counts the allocated blocks of a dynamic image and, with @sectors, the
+ * sectors set in their bitmaps. Blocks the batmap has full are counted
+ * whole without reading their bitmaps, so when the batmap has every
+ * allocated block full, no bitmap is read at all.
+ */
+int
+vhd_allocated(vhd_context_t *ctx, uint64_t *blocks, uint64_t *sectors)
+{
+	uint64_t nblocks, nsecs;
+	uint32_t i;
+	char *map;
+	int err;
+
+	if (!vhd_type_dynamic(ctx))
+		return -EINVAL;
+
+	err = vhd_get_bat(ctx);
+	if (err)
+		return err;
+
+	if (sectors && vhd_has_batmap(ctx)) {
+		err = vhd_get_batmap(ctx);
+		if (err)
+			return err;
+	}
+
+	nblocks = 0;
+	nsecs   = 0;
+
+	for (i = 0; i < ctx->bat.entries; i++)
+		if (ctx->bat.bat[i] != DD_BLK_UNUSED)
+			nblocks++;
+
+	if (!sectors)
+		goto out;
+
+	if (vhd_batmap_count(ctx, &ctx->batmap) == nblocks) {
+		nsecs = nblocks * ctx->spb;
+		goto out;
+	}
+
+	for (i = 0; i < ctx->bat.entries; i++) {
+		if (ctx->bat.bat[i] == DD_BLK_UNUSED)
+			continue;
+
+		if (vhd_has_batmap(ctx) &&
+		    vhd_batmap_test(ctx, &ctx->batmap, i)) {
+			nsecs += ctx->spb;
+			continue;
+		}
+
+		err = vhd_read_bitmap(ctx, i, &map);
+		if (err)
+			return err;
+
+		nsecs += vhd_bitmap_count(ctx, map);
+		vhd_buf_put(ctx, map, vhd_bitmap_bytes(ctx));
+	}
+
+out:
+	if (blocks)
+		*blocks = nblocks;
+	if (sectors)
+		*sectors = nsecs;
+
+	return 0;
+}
+
 /*
  * returns absolute offset of the first 
  * byte of the file which is not vhd metadata
@@ -1116,7 +1376,8 @@ vhd_read_bat(vhd_context_t *ctx, vhd_bat_t *bat)
 	/* The BAT size is stored in ctx->header.max_bat_size. However, we
 	 * sometimes preallocate BAT + batmap for max VHD size, so only read in
 	 * the BAT entries that are in use for curr_size */
-	vhd_blks = (ctx->footer.curr_size + ((1 << VHD_BLOCK_SHIFT) - 1)) >> VHD_BLOCK_SHIFT;
+	vhd_blks = (ctx->footer.curr_size +
+		    ((1ULL << vhd_block_shift(ctx)) - 1)) >> vhd_block_shift(ctx);
 	if (ctx->header.max_bat_size < vhd_blks) {
 		VHDLOG("more VHD blocks (%u) than possible (%u)\n",
 		       vhd_blks, ctx->header.max_bat_size);
@@ -1209,7 +1470,7 @@ vhd_read_batmap_map(vhd_context_t *ctx, vhd_batmap_t *batmap)
 	size_t map_size;
 
 	map_size = vhd_sectors_to_bytes(secs_round_up_no_zero(
-			ctx->footer.curr_size >> (VHD_BLOCK_SHIFT + 3)));
+			ctx->footer.curr_size >> (vhd_block_shift(ctx) + 3)));
 	ASSERT(vhd_sectors_to_bytes(batmap->header.batmap_size) >= map_size);
 
 	err = posix_memalign(&buf, VHD_SECTOR_SIZE, map_size);
@@ -1599,16 +1860,51 @@ vhd_header_decode_parent(vhd_context_t *ctx, vhd_header_t *header, char **buf)
 	return (*buf == NULL ? -EINVAL : 0);
 }
 
+/*
+ * Decodes parent locator @loc from its raw data @raw, as read from
+ * loc->data_offset, vhd_parent_locator_size(@loc) bytes long.
+ */
+int
+vhd_parent_locator_decode(vhd_context_t *ctx, vhd_parent_locator_t *loc,
+			  char *raw, char **parent)
+{
+	char *out, *name;
+
+	name    = NULL;
+	*parent = NULL;
+
+	out = malloc(loc->data_len + 1);
+	if (!out)
+		return -ENOMEM;
+
+	switch (loc->code) {
+	case PLAT_CODE_MACX:
+		name = vhd_macx_decode_location(raw, out, loc->data_len);
+		break;
+	case PLAT_CODE_W2KU:
+	case PLAT_CODE_W2RU:
+		name = vhd_w2u_decode_location(raw, out,
+					       loc->data_len, UTF_16LE);
+		break;
+	}
+
+	free(out);
+
+	if (!name)
+		return -EINVAL;
+
+	*parent = name;
+	return 0;
+}
+
 int
 vhd_parent_locator_read(vhd_context_t *ctx,
 			vhd_parent_locator_t *loc, char **parent)
 {
 	int err, size;
-	void *raw, *out, *name;
+	void *raw;
 
 	raw     = NULL;
-	out     = NULL;
-	name    = NULL;
 	*parent = NULL;
 
 	if (ctx->footer.type != HD_TYPE_DIFF) {
@@ -1647,34 +1943,10 @@ vhd_parent_locator_read(vhd_context_t *ctx,
 	if (err)
 		goto out;
 
-	out = malloc(loc->data_len + 1);
-	if (!out) {
-		err = -ENOMEM;
-		goto out;
-	}
-
-	switch (loc->code) {
-	case PLAT_CODE_MACX:
-		name = vhd_macx_decode_location(raw, out, loc->data_len);
-		break;
-	case PLAT_CODE_W2KU:
-	case PLAT_CODE_W2RU:
-		name = vhd_w2u_decode_location(raw, out,
-					       loc->data_len, UTF_16LE);
-		break;
-	}
-
-	if (!name) {
-		err = -EINVAL;
-		goto out;
-	}
-
-	err     = 0;
-	*parent = name;
+	err = vhd_parent_locator_decode(ctx, loc, raw, parent);
 
 out:
 	free(raw);
-	free(out);
 
 	if (err) {
 		VHDLOG("%s: error reading parent locator: %d\n",
@@ -1687,6 +1959,174 @@ out:
 	return err;
 }
 
+/*
+ * Resolving a parent means reading its locators off disk, decoding them
+ * and canonicalizing the result, every time a chain is opened. Keep the
+ * outcome per process, keyed by child path and parent uuid. Entries are
+ * trusted only while the child (whose header holds the locators) and the
+ * parent are still the same inodes with the same mtimes.
+ */
+#define VHD_PARENT_CACHE_SIZE 64
+
+struct vhd_parent_cache_entry {
+	char                      *child;
+	uuid_t                     prt_uuid;
+	dev_t                      child_dev;
+	ino_t                      child_ino;
+	struct timespec            child_mtime;
+
+	char                      *parent;
+	dev_t                      parent_dev;
+	ino_t                      parent_ino;
+	struct timespec            parent_mtime;
+
+	uint64_t                   used;
+};
+
+static struct {
+	pthread_mutex_t                lock;
+	uint64_t                       clock;
+	struct vhd_parent_cache_entry  entries[VHD_PARENT_CACHE_SIZE];
+} vhd_parent_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static inline int
+vhd_parent_cache_same(const struct stat *st, dev_t dev, ino_t ino,
+		      const struct timespec *mtime)
+{
+	return st->st_dev == dev && st->st_ino == ino &&
+		st->st_mtim.tv_sec == mtime->tv_sec &&
+		st->st_mtim.tv_nsec == mtime->tv_nsec;
+}
+
+static struct vhd_parent_cache_entry *
+vhd_parent_cache_find(vhd_context_t *ctx)
+{
+	struct vhd_parent_cache_entry *e;
+	int i;
+
+	for (i = 0; i < VHD_PARENT_CACHE_SIZE; i++) {
+		e = vhd_parent_cache.entries + i;
+		if (e->child && !strcmp(e->child, ctx->file) &&
+		    !uuid_compare(e->prt_uuid, ctx->header.prt_uuid))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void
+vhd_parent_cache_drop(struct vhd_parent_cache_entry *e)
+{
+	free(e->child);
+	free(e->parent);
+	memset(e, 0, sizeof(*e));
+}
+
+static int
+vhd_parent_cache_get(vhd_context_t *ctx, char **parent)
+{
+	struct vhd_parent_cache_entry *e;
+	char path[PATH_MAX];
+	struct timespec mtime;
+	struct stat st;
+	dev_t dev;
+	ino_t ino;
+
+	/*
+	 * relative names depend on the cwd at the time, and block devices
+	 * don't get their mtimes updated by writes
+	 */
+	if (ctx->file[0] != '/' || fstat(ctx->fd, &st) || S_ISBLK(st.st_mode))
+		return -ENOENT;
+
+	pthread_mutex_lock(&vhd_parent_cache.lock);
+
+	e = vhd_parent_cache_find(ctx);
+	if (!e || !vhd_parent_cache_same(&st, e->child_dev, e->child_ino,
+					 &e->child_mtime)) {
+		if (e)
+			vhd_parent_cache_drop(e);
+		pthread_mutex_unlock(&vhd_parent_cache.lock);
+		return -ENOENT;
+	}
+
+	snprintf(path, sizeof(path), "%s", e->parent);
+	dev   = e->parent_dev;
+	ino   = e->parent_ino;
+	mtime = e->parent_mtime;
+	e->used = ++vhd_parent_cache.clock;
+
+	pthread_mutex_unlock(&vhd_parent_cache.lock);
+
+	if (stat(path, &st) || !vhd_parent_cache_same(&st, dev, ino, &mtime)) {
+		pthread_mutex_lock(&vhd_parent_cache.lock);
+		e = vhd_parent_cache_find(ctx);
+		if (e)
+			vhd_parent_cache_drop(e);
+		pthread_mutex_unlock(&vhd_parent_cache.lock);
+		return -ENOENT;
+	}
+
+	*parent = strdup(path);
+	return (*parent ? 0 : -ENOMEM);
+}
+
+static void
+vhd_parent_cache_put(vhd_context_t *ctx, const char *parent)
+{
+	struct vhd_parent_cache_entry *e, *lru;
+	struct stat cst, pst;
+	char *child, *path;
+	int i;
+
+	if (ctx->file[0] != '/' || fstat(ctx->fd, &cst) ||
+	    S_ISBLK(cst.st_mode) || stat(parent, &pst))
+		return;
+
+	child = strdup(ctx->file);
+	path  = strdup(parent);
+	if (!child || !path)
+		goto out;
+
+	pthread_mutex_lock(&vhd_parent_cache.lock);
+
+	e = vhd_parent_cache_find(ctx);
+	if (!e) {
+		lru = vhd_parent_cache.entries;
+		for (i = 0; i < VHD_PARENT_CACHE_SIZE; i++) {
+			e = vhd_parent_cache.entries + i;
+			if (!e->child)
+				break;
+			if (e->used < lru->used)
+				lru = e;
+		}
+		if (i == VHD_PARENT_CACHE_SIZE)
+			e = lru;
+	}
+
+	vhd_parent_cache_drop(e);
+
+	e->child        = child;
+	e->child_dev    = cst.st_dev;
+	e->child_ino    = cst.st_ino;
+	e->child_mtime  = cst.st_mtim;
+	e->parent       = path;
+	e->parent_dev   = pst.st_dev;
+	e->parent_ino   = pst.st_ino;
+	e->parent_mtime = pst.st_mtim;
+	e->used         = ++vhd_parent_cache.clock;
+	uuid_copy(e->prt_uuid, ctx->header.prt_uuid);
+	child = path = NULL;
+
+	pthread_mutex_unlock(&vhd_parent_cache.lock);
+
+out:
+	free(child);
+	free(path);
+}
+
 int
 vhd_parent_locator_get(vhd_context_t *ctx, char **parent)
 {
@@ -1703,6 +2143,9 @@ vhd_parent_locator_get(vhd_context_t *ctx, char **parent)
 	if (ctx->custom_parent)
 		return vhd_find_parent(ctx, ctx->custom_parent, parent);
 
+	if (!vhd_parent_cache_get(ctx, parent))
+		return 0;
+
 	n = vhd_parent_locator_count(ctx);
 	for (i = 0; i < n; i++) {
 		int _err;
@@ -1719,6 +2162,7 @@ vhd_parent_locator_get(vhd_context_t *ctx, char **parent)
 		free(name);
 
 		if (!err) {
+			vhd_parent_cache_put(ctx, location);
 			*parent = location;
 			return 0;
 		}
@@ -1872,17 +2316,100 @@ vhd_footer_offset_at_eof(vhd_context_t *ctx, off64_t *off)
 	return 0;
 }
 
-int
-vhd_read_bitmap(vhd_context_t *ctx, uint32_t block, char **bufp)
+/*
+ * Tools walking an image read a bitmap and often a block per step, all
+ * of the same few sizes: keep the last buffers given back rather than
+ * going to the allocator, and faulting in fresh pages, every time.
+ */
+#define VHD_BUF_POOL_SIZE 8
+#define VHD_BUF_ALIGN     4096
+
+struct vhd_buf_pool {
+	struct {
+		void                      *buf;
+		size_t                     size;
+	} slots[VHD_BUF_POOL_SIZE];
+};
+
+static void
+vhd_buf_pool_free(vhd_context_t *ctx)
 {
-	int err;
-	void *buf;
-	size_t size;
-	off64_t off;
-	uint64_t blk;
+	struct vhd_buf_pool *pool = ctx->bufs;
+	int i;
 
-	buf   = NULL;
-	*bufp = NULL;
+	if (!pool)
+		return;
+
+	for (i = 0; i < VHD_BUF_POOL_SIZE; i++)
+		free(pool->slots[i].buf);
+
+	free(pool);
+	ctx->bufs = NULL;
+}
+
+void *
+vhd_buf_get(vhd_context_t *ctx, size_t size)
+{
+	struct vhd_buf_pool *pool = ctx->bufs;
+	void *buf;
+	int i, err;
+
+	if (pool)
+		for (i = 0; i < VHD_BUF_POOL_SIZE; i++)
+			if (pool->slots[i].buf && pool->slots[i].size == size) {
+				buf = pool->slots[i].buf;
+				pool->slots[i].buf = NULL;
+				return buf;
+			}
+
+	err = posix_memalign(&buf, VHD_BUF_ALIGN, size);
+	if (err) {
+		errno = err;
+		return NULL;
+	}
+
+	return buf;
+}
+
+void
+vhd_buf_put(vhd_context_t *ctx, void *buf, size_t size)
+{
+	struct vhd_buf_pool *pool = ctx->bufs;
+	int i;
+
+	if (!buf)
+		return;
+
+	if (!pool) {
+		pool = calloc(1, sizeof(*pool));
+		if (!pool)
+			goto free;
+		ctx->bufs = pool;
+	}
+
+	for (i = 0; i < VHD_BUF_POOL_SIZE; i++)
+		if (!pool->slots[i].buf) {
+			pool->slots[i].buf  = buf;
+			pool->slots[i].size = size;
+			return;
+		}
+
+free:
+	free(buf);
+}
+
+int
+vhd_read_bitmap(vhd_context_t *ctx, uint32_t block, char **bufp)
+{
+	int err;
+	void *buf;
+	char *cached;
+	size_t size;
+	off64_t off;
+	uint64_t blk;
+
+	buf   = NULL;
+	*bufp = NULL;
 
 	if (!vhd_type_dynamic(ctx))
 		return -EINVAL;
@@ -1899,15 +2426,22 @@ vhd_read_bitmap(vhd_context_t *ctx, uint32_t block, char **bufp)
 		return -EINVAL;
 
 	off  = vhd_sectors_to_bytes(blk);
-	size = vhd_bytes_padded(ctx->spb >> 3);
+	size = vhd_bitmap_bytes(ctx);
 
-	err  = vhd_seek(ctx, off, SEEK_SET);
-	if (err)
-		return err;
+	buf  = vhd_buf_get(ctx, size);
+	if (!buf)
+		return -errno;
 
-	err  = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
+	cached = vhd_bitmap_cache_get(ctx, block);
+	if (cached) {
+		memcpy(buf, cached, size);
+		*bufp = buf;
+		return 0;
+	}
+
+	err  = vhd_seek(ctx, off, SEEK_SET);
 	if (err)
-		return -err;
+		goto fail;
 
 	err  = vhd_read(ctx, buf, size);
 	if (err)
@@ -1917,7 +2451,7 @@ vhd_read_bitmap(vhd_context_t *ctx, uint32_t block, char **bufp)
 	return 0;
 
 fail:
-	free(buf);
+	vhd_buf_put(ctx, buf, size);
 	return err;
 }
 
@@ -1954,11 +2488,9 @@ vhd_read_block(vhd_context_t *ctx, uint32_t block, char **bufp)
 	if (err)
 		return err;
 
-	err  = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
-	if (err) {
-		err = -err;
-		goto fail;
-	}
+	buf  = vhd_buf_get(ctx, size);
+	if (!buf)
+		return -errno;
 
 	if (end < off + ctx->header.block_size) {
 		size = end - off;
@@ -1977,7 +2509,7 @@ vhd_read_block(vhd_context_t *ctx, uint32_t block, char **bufp)
 	return 0;
 
 fail:
-	free(buf);
+	vhd_buf_put(ctx, buf, ctx->header.block_size);
 	return err;
 }
 
@@ -2214,7 +2746,7 @@ vhd_write_batmap(vhd_context_t *ctx, vhd_batmap_t *batmap)
 
 	off      = b.header.batmap_offset;
 	map_size = vhd_sectors_to_bytes(secs_round_up_no_zero(
-			ctx->footer.curr_size >> (VHD_BLOCK_SHIFT + 3)));
+			ctx->footer.curr_size >> (vhd_block_shift(ctx) + 3)));
 	ASSERT(vhd_sectors_to_bytes(b.header.batmap_size) >= map_size);
 
 	err  = vhd_seek(ctx, off, SEEK_SET);
@@ -2701,6 +3233,8 @@ void
 vhd_close(vhd_context_t *ctx)
 {
 	vhd_cache_unload(ctx);
+	vhd_bitmap_cache_free(ctx);
+	vhd_buf_pool_free(ctx);
 
 	if (ctx->fd != -1) {
 		fsync(ctx->fd);
@@ -2800,12 +3334,9 @@ get_file_size(const char *name)
 }
 
 static int
-vhd_initialize_header(vhd_context_t *ctx, const char *parent_path, 
-		uint64_t size, int raw, uint64_t *psize)
+vhd_initialize_header(vhd_context_t *ctx, const vhd_parent_info_t *parent,
+		uint64_t size, uint32_t block_size, uint64_t *psize)
 {
-	int err;
-	struct stat stats;
-	vhd_context_t parent;
 	uint64_t _max_bat_size;
 
 	if (!vhd_type_dynamic(ctx))
@@ -2816,12 +3347,12 @@ vhd_initialize_header(vhd_context_t *ctx, const char *parent_path,
 	ctx->header.data_offset  = (uint64_t)-1;
 	ctx->header.table_offset = VHD_SECTOR_SIZE * 3; /* 1 ftr + 2 hdr */
 	ctx->header.hdr_ver      = DD_VERSION;
-	ctx->header.block_size   = VHD_BLOCK_SIZE;
+	ctx->header.block_size   = block_size;
 	ctx->header.prt_ts       = 0;
 	ctx->header.res1         = 0;
 
 	_max_bat_size = (ctx->footer.curr_size +
-			VHD_BLOCK_SIZE - 1) >> VHD_BLOCK_SHIFT;
+			block_size - 1) >> vhd_block_shift(ctx);
 	if (unlikely(_max_bat_size > UINT_MAX))
 		return -EINVAL;
 	ctx->header.max_bat_size = _max_bat_size;
@@ -2831,32 +3362,13 @@ vhd_initialize_header(vhd_context_t *ctx, const char *parent_path,
 	if (ctx->footer.type == HD_TYPE_DYNAMIC)
 		return 0;
 
-	err = stat(parent_path, &stats);
-	if (err == -1)
-		return -errno;
+	ctx->header.prt_ts = parent->timestamp;
+	uuid_copy(ctx->header.prt_uuid, parent->uuid);
 
-	if (raw) {
-		ctx->header.prt_ts = vhd_time(stats.st_mtime);
-		*psize = get_file_size(parent_path);
-		if (!size)
-			size = *psize;
-	}
-	else {
-		err = vhd_open(&parent, parent_path, VHD_OPEN_RDONLY);
-		if (err)
-			return err;
+	*psize = parent->size;
+	if (!size)
+		size = *psize;
 
-		ctx->header.prt_ts = vhd_time(stats.st_mtime);
-		uuid_copy(ctx->header.prt_uuid, parent.footer.uuid);
-		if (uuid_is_null(ctx->header.prt_uuid)) {
-			vhd_close(&parent);
-			return -EINVAL;
-		}
-		*psize = parent.footer.curr_size;
-		if (!size)
-			size = *psize;
-		vhd_close(&parent);
-	}
 	if (size < *psize) {
 		VHDLOG("snapshot size (%"PRIu64") < parent size (%"PRIu64")\n",
 				size, *psize);
@@ -2866,9 +3378,9 @@ vhd_initialize_header(vhd_context_t *ctx, const char *parent_path,
 	ctx->footer.curr_size    = size;
 	ctx->footer.geometry     = vhd_chs(size);
 	ctx->header.max_bat_size = 
-		(size + VHD_BLOCK_SIZE - 1) >> VHD_BLOCK_SHIFT;
+		(size + block_size - 1) >> vhd_block_shift(ctx);
 
-	return vhd_initialize_header_parent_name(ctx, parent_path);
+	return vhd_initialize_header_parent_name(ctx, parent->path);
 }
 
 int
@@ -3130,11 +3642,11 @@ vhd_set_phys_size(vhd_context_t *ctx, off64_t size)
 static int
 vhd_set_virt_size_no_write(vhd_context_t *ctx, uint64_t size)
 {
-	if ((size >> VHD_BLOCK_SHIFT) > ctx->header.max_bat_size) {
+	if ((size >> vhd_block_shift(ctx)) > ctx->header.max_bat_size) {
 		VHDLOG("not enough metadata space reserved for fast "
 				"resize (BAT size %u, need %"PRIu64")\n",
 				ctx->header.max_bat_size, 
-				size >> VHD_BLOCK_SHIFT);
+				size >> vhd_block_shift(ctx));
 		return -EINVAL;
 	}
 
@@ -3156,15 +3668,72 @@ vhd_set_virt_size(vhd_context_t *ctx, uint64_t size)
 	return vhd_write_footer(ctx, &ctx->footer);
 }
 
-static int
-__vhd_create(const char *name, const char *parent, uint64_t bytes, int type,
-		uint64_t mbytes, vhd_flag_creat_t flags)
+/*
+ * Snapshots of VHDs take the block size of their parent, or coalescing
+ * them later would not be possible.
+ */
+int
+vhd_parent_info(const char *parent, vhd_flag_creat_t flags,
+		vhd_parent_info_t *info)
 {
 	int err;
-	off64_t off;
+	off64_t end;
+	struct stat stats;
 	vhd_context_t ctx;
+
+	memset(info, 0, sizeof(vhd_parent_info_t));
+
+	if (strnlen(parent, VHD_MAX_NAME_LEN) >= VHD_MAX_NAME_LEN)
+		return -ENAMETOOLONG;
+
+	strcpy(info->path, parent);
+	info->raw        = vhd_flag_test(flags, VHD_FLAG_CREAT_PARENT_RAW);
+	info->block_size = VHD_BLOCK_SIZE;
+
+	if (info->raw) {
+		end = get_file_size(parent);
+		if (end < 0)
+			return end;
+		info->size = end;
+	} else {
+		err = vhd_open(&ctx, parent, VHD_OPEN_RDONLY);
+		if (err)
+			return err;
+
+		if (vhd_type_dynamic(&ctx))
+			info->block_size = ctx.header.block_size;
+
+		info->size = ctx.footer.curr_size;
+		uuid_copy(info->uuid, ctx.footer.uuid);
+		vhd_close(&ctx);
+
+		if (uuid_is_null(info->uuid))
+			return -EINVAL;
+	}
+
+	if (stat(parent, &stats) == -1)
+		return -errno;
+
+	info->timestamp = vhd_time(stats.st_mtime);
+	return 0;
+}
+
+/*
+ * writes out a new vhd, leaving @ctx open; the caller closes it, and
+ * removes the file if this fails with ctx->fd open
+ */
+static int
+__vhd_create_ctx(vhd_context_t *ctx, const char *name,
+		 const vhd_parent_info_t *parent, uint64_t bytes, int type,
+		 uint64_t mbytes, uint32_t block_size)
+{
+	int err, shift;
+	off64_t off;
 	uint64_t size, psize, blks;
 
+	memset(ctx, 0, sizeof(vhd_context_t));
+	ctx->fd = -1;
+
 	switch (type) {
 	case HD_TYPE_DIFF:
 		if (!parent)
@@ -3182,111 +3751,143 @@ __vhd_create(const char *name, const char *parent, uint64_t bytes, int type,
 	if (bytes && mbytes && mbytes < bytes)
 		return -EINVAL;
 
-	memset(&ctx, 0, sizeof(vhd_context_t));
+	if (type == HD_TYPE_DIFF)
+		block_size = parent->block_size;
+	else if (type == HD_TYPE_FIXED)
+		block_size = VHD_BLOCK_SIZE;
+
+	if (!block_size || (block_size & (block_size - 1)))
+		return -EINVAL;
+
+	shift = __builtin_ctz(block_size);
+	if (type != HD_TYPE_DIFF &&
+	    (shift < VHD_BLOCK_SHIFT_MIN || shift > VHD_BLOCK_SHIFT_MAX))
+		return -EINVAL;
+
 	psize = 0;
-	blks   = (bytes + VHD_BLOCK_SIZE - 1) >> VHD_BLOCK_SHIFT;
+	blks   = (bytes + block_size - 1) >> shift;
 	/* If mbytes is provided (virtual-size-for-metadata-preallocation),
 	 * create the VHD of size mbytes, which will create the BAT & the 
 	 * batmap of the appropriate size. Once the BAT & batmap are 
 	 * initialized, reset the virtual size to the requested one.
 	 */
 	if (mbytes)
-		blks = (mbytes + VHD_BLOCK_SIZE - 1) >> VHD_BLOCK_SHIFT;
-	size = blks << VHD_BLOCK_SHIFT;
+		blks = (mbytes + block_size - 1) >> shift;
+	size = blks << shift;
 
-	ctx.fd = open_optional_odirect(name, O_WRONLY | O_CREAT |
+	ctx->fd = open_optional_odirect(name, O_WRONLY | O_CREAT |
 		      O_TRUNC | O_LARGEFILE | O_DIRECT, 0644);
-	if (ctx.fd == -1) {
+	if (ctx->fd == -1) {
         fprintf(stderr, "%s: failed to create: %d\n", name, -errno);
         return -errno;
     }
 
-	ctx.file = strdup(name);
-	if (!ctx.file) {
-		err = -ENOMEM;
-		goto out;
-	}
+	ctx->file = strdup(name);
+	if (!ctx->file)
+		return -ENOMEM;
 
-	err = vhd_test_file_fixed(ctx.file, &ctx.is_block);
+	err = vhd_test_file_fixed(ctx->file, &ctx->is_block);
 	if (err)
-		goto out;
+		return err;
 
-	vhd_initialize_footer(&ctx, type, size);
+	vhd_initialize_footer(ctx, type, size);
 
 	if (type == HD_TYPE_FIXED) {
-		err = vhd_initialize_fixed_disk(&ctx);
+		err = vhd_initialize_fixed_disk(ctx);
 		if (err)
-			goto out;
+			return err;
 	} else {
-		int raw = vhd_flag_test(flags, VHD_FLAG_CREAT_PARENT_RAW);
-		err = vhd_initialize_header(&ctx, parent, size, raw, &psize);
+		err = vhd_initialize_header(ctx, parent, size, block_size,
+					    &psize);
 		if (err)
-			goto out;
+			return err;
 
-		err = vhd_create_batmap(&ctx);
+		err = vhd_create_batmap(ctx);
 		if (err)
-			goto out;
+			return err;
 
-		err = vhd_create_bat(&ctx);
+		err = vhd_create_bat(ctx);
 		if (err)
-			goto out;
+			return err;
 
 		if (type == HD_TYPE_DIFF) {
-			err = vhd_write_parent_locators(&ctx, parent);
+			err = vhd_write_parent_locators(ctx, parent->path);
 			if (err)
-				goto out;
+				return err;
 		}
 	}
 
 	if (mbytes) {
 		/* set the virtual size to the requested size */
 		if (bytes) {
-			blks = (bytes + VHD_BLOCK_SIZE - 1) >> VHD_BLOCK_SHIFT;
-			size = blks << VHD_BLOCK_SHIFT;
+			blks = (bytes + block_size - 1) >> shift;
+			size = blks << shift;
 
 		}
 		else {
 			size = psize;
 		}
-		ctx.footer.orig_size = size;
-		err = vhd_set_virt_size_no_write(&ctx, size);
+		ctx->footer.orig_size = size;
+		err = vhd_set_virt_size_no_write(ctx, size);
 		if (err)
-			goto out;
+			return err;
 	}
 
 	if (type != HD_TYPE_FIXED) {
-		err = vhd_write_footer_at(&ctx, &ctx.footer, 0);
+		err = vhd_write_footer_at(ctx, &ctx->footer, 0);
 		if (err)
-			goto out;
+			return err;
 
-		err = vhd_write_header_at(&ctx, &ctx.header, VHD_SECTOR_SIZE);
+		err = vhd_write_header_at(ctx, &ctx->header, VHD_SECTOR_SIZE);
 		if (err)
-			goto out;
+			return err;
 	}
 
-	err = vhd_seek(&ctx, 0, SEEK_END);
+	err = vhd_seek(ctx, 0, SEEK_END);
 	if (err)
-		goto out;
+		return err;
 
-	off = vhd_position(&ctx);
-	if (off == (off64_t)-1) {
-		err = -errno;
-		goto out;
-	}
+	off = vhd_position(ctx);
+	if (off == (off64_t)-1)
+		return -errno;
 
-	if (ctx.is_block)
+	if (ctx->is_block)
 		off -= sizeof(vhd_footer_t);
 
-	err = vhd_write_footer_at(&ctx, &ctx.footer, off);
-	if (err)
-		goto out;
+	return vhd_write_footer_at(ctx, &ctx->footer, off);
+}
 
-	err = 0;
+static void
+__vhd_create_close(vhd_context_t *ctx, const char *name, int err)
+{
+	int created = (ctx->fd != -1 && !ctx->is_block);
 
-out:
-	vhd_close(&ctx);
-	if (err && !ctx.is_block)
+	vhd_close(ctx);
+	if (err && created)
 		unlink(name);
+}
+
+static int
+__vhd_create(const char *name, const char *parent, uint64_t bytes, int type,
+		uint64_t mbytes, uint32_t block_size, vhd_flag_creat_t flags)
+{
+	int err;
+	vhd_context_t ctx;
+	vhd_parent_info_t info;
+
+	if (type == HD_TYPE_DIFF) {
+		if (!parent)
+			return -EINVAL;
+
+		err = vhd_parent_info(parent, flags, &info);
+		if (err)
+			return err;
+	}
+
+	err = __vhd_create_ctx(&ctx, name,
+			       type == HD_TYPE_DIFF ? &info : NULL,
+			       bytes, type, mbytes, block_size);
+	__vhd_create_close(&ctx, name, err);
 	return err;
 }
 
@@ -3294,14 +3895,69 @@ int
 vhd_create(const char *name, uint64_t bytes, int type, uint64_t mbytes,
 		vhd_flag_creat_t flags)
 {
-	return __vhd_create(name, NULL, bytes, type, mbytes, flags);
+	return __vhd_create(name, NULL, bytes, type, mbytes,
+			    VHD_BLOCK_SIZE, flags);
+}
+
+int
+vhd_create_ext(const char *name, uint64_t bytes, int type, uint64_t mbytes,
+		uint32_t block_size, vhd_flag_creat_t flags)
+{
+	return __vhd_create(name, NULL, bytes, type, mbytes, block_size, flags);
 }
 
 int
 vhd_snapshot(const char *name, uint64_t bytes, const char *parent,
 		uint64_t mbytes, vhd_flag_creat_t flags)
 {
-	return __vhd_create(name, parent, bytes, HD_TYPE_DIFF, mbytes, flags);
+	return __vhd_create(name, parent, bytes, HD_TYPE_DIFF, mbytes, 0, flags);
+}
+
+/*
+ * every snapshot is written out before any is synced, so the fsyncs
+ * share journal commits rather than each waiting out its own
+ */
+int
+vhd_snapshot_batch(vhd_snapshot_req_t *reqs, int n)
+{
+	int i, made, err;
+	vhd_context_t *ctxs;
+
+	ctxs = calloc(n ? : 1, sizeof(vhd_context_t));
+	if (!ctxs)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++)
+		reqs[i].err = -ECANCELED;
+
+	err = 0;
+
+	for (made = 0; made < n; made++) {
+		vhd_snapshot_req_t *req = reqs + made;
+
+		err = __vhd_create_ctx(ctxs + made, req->name, req->parent,
+				       req->bytes, HD_TYPE_DIFF, req->mbytes, 0);
+		if (err) {
+			req->err = err;
+			made++;
+			break;
+		}
+	}
+
+	for (i = 0; !err && i < made; i++)
+		if (fsync(ctxs[i].fd)) {
+			err = -errno;
+			reqs[i].err = err;
+		}
+
+	for (i = 0; i < made; i++) {
+		if (!err)
+			reqs[i].err = 0;
+		__vhd_create_close(ctxs + i, reqs[i].name, err);
+	}
+
+	free(ctxs);
+	return err;
 }
 
 static int
@@ -3377,7 +4033,7 @@ __vhd_io_dynamic_read_link(vhd_context_t *ctx, char *map,
 
 		err = vhd_read_block(ctx, blk, &data);
 		if (err) {
-			free(bitmap);
+			vhd_buf_put(ctx, bitmap, vhd_bitmap_bytes(ctx));
 			return err;
 		}
 
@@ -3389,8 +4045,8 @@ __vhd_io_dynamic_read_link(vhd_context_t *ctx, char *map,
 					   buf, src, cnt);
 
 	next:
-		free(data);
-		free(bitmap);
+		vhd_buf_put(ctx, data, ctx->header.block_size);
+		vhd_buf_put(ctx, bitmap, vhd_bitmap_bytes(ctx));
 
 		secs    -= cnt;
 		sector  += cnt;
@@ -3623,14 +4279,48 @@ out:
 	return err;
 }
 
+/*
+ * Sets the bitmap bits of @cnt sectors just written from @sec of @blk,
+ * and the block's batmap bit once its bitmap is full.
+ */
+static int
+__vhd_io_dynamic_mark(vhd_context_t *ctx, uint32_t blk, uint32_t sec, int cnt)
+{
+	char *map;
+	int i, err;
+
+	if (vhd_has_batmap(ctx) &&
+	    vhd_batmap_test(ctx, &ctx->batmap, blk))
+		return 0;
+
+	err = vhd_read_bitmap(ctx, blk, &map);
+	if (err)
+		return err;
+
+	for (i = 0; i < cnt; i++)
+		vhd_bitmap_set(ctx, map, sec + i);
+
+	err = vhd_write_bitmap(ctx, blk, map);
+	if (err)
+		goto out;
+
+	if (vhd_has_batmap(ctx) && vhd_bitmap_full(ctx, map)) {
+		vhd_batmap_set(ctx, &ctx->batmap, blk);
+		err = vhd_write_batmap(ctx, &ctx->batmap);
+	}
+
+out:
+	vhd_buf_put(ctx, map, vhd_bitmap_bytes(ctx));
+	return err;
+}
+
 static int
 __vhd_io_dynamic_write(vhd_context_t *ctx,
 		       char *buf, uint64_t sector, uint32_t secs)
 {
-	char *map;
 	off64_t off;
 	uint32_t blk, sec;
-	int i, err, cnt, ret;
+	int err, cnt, ret;
 
 	if (vhd_sectors_to_bytes(sector + secs) > ctx->footer.curr_size)
 		return -ERANGE;
@@ -3680,38 +4370,10 @@ __vhd_io_dynamic_write(vhd_context_t *ctx,
 		if (err)
 			return err;
 
-		if (vhd_has_batmap(ctx) &&
-		    vhd_batmap_test(ctx, &ctx->batmap, blk))
-			goto next;
-
-		err = vhd_read_bitmap(ctx, blk, &map);
-		if (err)
-			return err;
-
-		for (i = 0; i < cnt; i++)
-			vhd_bitmap_set(ctx, map, sec + i);
-
-		err = vhd_write_bitmap(ctx, blk, map);
+		err = __vhd_io_dynamic_mark(ctx, blk, sec, cnt);
 		if (err)
-			goto fail;
-
-		if (vhd_has_batmap(ctx)) {
-			for (i = 0; i < ctx->spb; i++)
-				if (!vhd_bitmap_test(ctx, map, i)) {
-					free(map);
-					goto next;
-				}
-
-			vhd_batmap_set(ctx, &ctx->batmap, blk);
-			err = vhd_write_batmap(ctx, &ctx->batmap);
-			if (err)
-				goto fail;
-		}
-
-		free(map);
-		map = NULL;
+			goto out;
 
-	next:
 		secs   -= cnt;
 		sector += cnt;
 		buf    += vhd_sectors_to_bytes(cnt);
@@ -3722,10 +4384,6 @@ __vhd_io_dynamic_write(vhd_context_t *ctx,
 out:
 	ret = vhd_write_footer(ctx, &ctx->footer);
 	return (err ? err : ret);
-
-fail:
-	free(map);
-	goto out;
 }
 
 int
@@ -3740,14 +4398,260 @@ vhd_io_write(vhd_context_t *ctx, char *buf, uint64_t sec, uint32_t secs)
 	return __vhd_io_dynamic_write(ctx, buf, sec, secs);
 }
 
-static void
-vhd_cache_init(vhd_context_t *ctx)
-{
-	INIT_LIST_HEAD(&ctx->next);
-}
+static int vhd_clone_unsupported;
+static int vhd_copy_range_unsupported;
 
-static int
-vhd_cache_enabled(vhd_context_t *ctx)
+/*
+ * Copies @len bytes between two files without passing them through user
+ * space: as a reflink where the filesystem can share the extents (XFS,
+ * btrfs), else with copy_file_range(), which NFS 4.2 turns into a server
+ * side copy. Returns -EOPNOTSUPP where neither works and the caller has
+ * to copy through a buffer; once refused, neither is tried again.
+ */
+int
+vhd_copy_range(int in, off64_t in_off, int out, off64_t out_off, size_t len)
+{
+#ifdef FICLONERANGE
+	struct file_clone_range range;
+
+	if (!vhd_clone_unsupported &&
+	    !((in_off | out_off | len) & (VHD_CLONE_ALIGN - 1))) {
+		range.src_fd      = in;
+		range.src_offset  = in_off;
+		range.src_length  = len;
+		range.dest_offset = out_off;
+
+		if (!ioctl(out, FICLONERANGE, &range))
+			return 0;
+
+		/* EINVAL is the filesystem block size, worth a plain copy */
+		if (errno != EINVAL)
+			vhd_clone_unsupported = 1;
+	}
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (len && !vhd_copy_range_unsupported) {
+		ssize_t ret;
+
+		ret = copy_file_range(in, &in_off, out, &out_off, len, 0);
+		if (ret > 0) {
+			len -= ret;
+			continue;
+		}
+
+		if (!ret)
+			return -EIO;
+
+		switch (errno) {
+		case EINTR:
+			continue;
+		case ENOSYS:
+		case EXDEV:
+		case EOPNOTSUPP:
+		case EINVAL:
+			vhd_copy_range_unsupported = 1;
+			break;
+		default:
+			VHDLOG("copy_file_range of %zu failed: %d\n",
+			       len, -errno);
+			return -errno;
+		}
+	}
+
+	if (!len)
+		return 0;
+#endif
+
+	return -EOPNOTSUPP;
+}
+
+/*
+ * Creates @dst as a reflink of all of @src: nothing is copied and, unlike
+ * a snapshot, no level is added to the chain. A VHD clone gets a uuid of
+ * its own. Returns -EOPNOTSUPP where the filesystem has no reflinks.
+ */
+int
+vhd_clone(const char *src, const char *dst, int raw)
+{
+	vhd_context_t vhd;
+	struct stat st;
+	int err, in, out;
+
+	out = -1;
+
+	in = open(src, O_RDONLY | O_LARGEFILE);
+	if (in == -1)
+		return -errno;
+
+	if (fstat(in, &st) == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	out = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE,
+		   st.st_mode & 0777);
+	if (out == -1) {
+		err = -errno;
+		goto out;
+	}
+
+#ifdef FICLONE
+	err = 0;
+	if (ioctl(out, FICLONE, in) == -1) {
+		switch (errno) {
+		case EXDEV:
+		case EINVAL:
+		case ENOTTY:
+		case EOPNOTSUPP:
+			err = -EOPNOTSUPP;
+			break;
+		default:
+			err = -errno;
+		}
+	}
+#else
+	err = -EOPNOTSUPP;
+#endif
+	if (err)
+		goto out;
+
+	if (!raw) {
+		err = vhd_open(&vhd, dst, VHD_OPEN_RDWR);
+		if (err)
+			goto out;
+
+		uuid_generate(vhd.footer.uuid);
+		err = vhd_write_footer(&vhd, &vhd.footer);
+		vhd_close(&vhd);
+	}
+
+out:
+	if (out != -1) {
+		close(out);
+		if (err)
+			unlink(dst);
+	}
+	close(in);
+	return err;
+}
+
+static int
+__vhd_io_data_offset(vhd_context_t *ctx, uint64_t sec, off64_t *off)
+{
+	uint32_t blk;
+
+	if (!vhd_type_dynamic(ctx)) {
+		*off = vhd_sectors_to_bytes(sec);
+		return 0;
+	}
+
+	blk = sec / ctx->spb;
+	if (blk >= ctx->bat.entries || ctx->bat.bat[blk] == DD_BLK_UNUSED)
+		return -EINVAL;
+
+	*off = vhd_sectors_to_bytes(ctx->bat.bat[blk] + ctx->bm_secs +
+				    sec % ctx->spb);
+	return 0;
+}
+
+/*
+ * Writes @secs sectors at @sec of @ctx from the same sectors of @src,
+ * where they must be allocated, with vhd_copy_range(). Returns
+ * -EOPNOTSUPP if they have to go through a buffer instead, because
+ * either side is encrypted or the files cannot be copied between.
+ */
+int
+vhd_io_copy(vhd_context_t *ctx, vhd_context_t *src, uint64_t sec, uint32_t secs)
+{
+	off64_t in, out;
+	uint32_t blk, cnt;
+	int err, ret;
+
+	if (vhd_sectors_to_bytes(sec + secs) > ctx->footer.curr_size)
+		return -ERANGE;
+
+	if (ctx->xts_tfm || src->xts_tfm)
+		return -EOPNOTSUPP;
+
+	if (vhd_type_dynamic(src)) {
+		err = vhd_get_bat(src);
+		if (err)
+			return err;
+	}
+
+	if (vhd_type_dynamic(ctx)) {
+		err = vhd_get_bat(ctx);
+		if (err)
+			return err;
+
+		if (vhd_has_batmap(ctx)) {
+			err = vhd_get_batmap(ctx);
+			if (err)
+				return err;
+		}
+	}
+
+	while (secs) {
+		cnt = secs;
+		if (vhd_type_dynamic(src))
+			cnt = MIN(cnt, src->spb - sec % src->spb);
+		if (vhd_type_dynamic(ctx))
+			cnt = MIN(cnt, ctx->spb - sec % ctx->spb);
+
+		err = __vhd_io_data_offset(src, sec, &in);
+		if (err)
+			goto out;
+
+		blk = 0;
+		if (vhd_type_dynamic(ctx)) {
+			blk = sec / ctx->spb;
+			if (ctx->bat.bat[blk] == DD_BLK_UNUSED) {
+				err = __vhd_io_allocate_block(ctx, blk,
+							      cnt < ctx->spb);
+				if (err)
+					goto out;
+			}
+		}
+
+		err = __vhd_io_data_offset(ctx, sec, &out);
+		if (err)
+			goto out;
+
+		err = vhd_copy_range(src->fd, in, ctx->fd, out,
+				     vhd_sectors_to_bytes(cnt));
+		if (err)
+			goto out;
+
+		if (vhd_type_dynamic(ctx)) {
+			err = __vhd_io_dynamic_mark(ctx, blk,
+						    sec % ctx->spb, cnt);
+			if (err)
+				goto out;
+		}
+
+		secs -= cnt;
+		sec  += cnt;
+	}
+
+	err = 0;
+
+out:
+	if (!vhd_type_dynamic(ctx))
+		return err;
+
+	ret = vhd_write_footer(ctx, &ctx->footer);
+	return (err ? err : ret);
+}
+
+static void
+vhd_cache_init(vhd_context_t *ctx)
+{
+	INIT_LIST_HEAD(&ctx->next);
+}
+
+static int
+vhd_cache_enabled(vhd_context_t *ctx)
 {
 	return vhd_flag_test(ctx->oflags, VHD_OPEN_CACHED) &&
         !vhd_flag_test(ctx->oflags, VHD_OPEN_RDWR);
@@ -3859,6 +4763,202 @@ out:
 	return vhd;
 }
 
+/*
+ * Bitmap cache for read-only contexts opened with VHD_OPEN_CACHE_BITMAPS.
+ * Entries are keyed by the bitmap's sector in the file, so a block that
+ * is moved never hits a stale copy, and are recycled LRU. A miss also
+ * reads the bitmaps of the next few allocated blocks, submitted together
+ * through libaio, so a sequential scan pays one bitmap read per batch
+ * rather than one per block.
+ */
+#define VHD_BITMAP_CACHE_SIZE      64
+#define VHD_BITMAP_READAHEAD       8
+
+struct vhd_bitmap_cache_entry {
+	uint64_t                   sec;       /* 0 if empty */
+	uint64_t                   used;
+	char                      *map;
+};
+
+struct vhd_bitmap_cache {
+	size_t                     size;
+	uint64_t                   clock;
+	io_context_t               aio;
+	struct vhd_bitmap_cache_entry entries[VHD_BITMAP_CACHE_SIZE];
+};
+
+static void
+vhd_bitmap_cache_free(vhd_context_t *ctx)
+{
+	struct vhd_bitmap_cache *cache = ctx->bitmaps;
+	int i;
+
+	if (!cache)
+		return;
+
+	if (cache->aio)
+		io_destroy(cache->aio);
+
+	for (i = 0; i < VHD_BITMAP_CACHE_SIZE; i++)
+		free(cache->entries[i].map);
+
+	free(cache);
+	ctx->bitmaps = NULL;
+}
+
+static int
+vhd_bitmap_cache_init(vhd_context_t *ctx)
+{
+	struct vhd_bitmap_cache *cache;
+	void *map;
+	int i, err;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return -ENOMEM;
+
+	ctx->bitmaps = cache;
+	cache->size  = vhd_bytes_padded(ctx->spb >> 3);
+
+	for (i = 0; i < VHD_BITMAP_CACHE_SIZE; i++) {
+		err = posix_memalign(&map, VHD_SECTOR_SIZE, cache->size);
+		if (err) {
+			vhd_bitmap_cache_free(ctx);
+			return -err;
+		}
+		cache->entries[i].map = map;
+	}
+
+	/* without aio, misses are read one at a time */
+	if (io_setup(VHD_BITMAP_READAHEAD, &cache->aio))
+		cache->aio = 0;
+
+	return 0;
+}
+
+static struct vhd_bitmap_cache_entry *
+vhd_bitmap_cache_lookup(struct vhd_bitmap_cache *cache, uint64_t sec)
+{
+	int i;
+
+	for (i = 0; i < VHD_BITMAP_CACHE_SIZE; i++)
+		if (cache->entries[i].sec == sec) {
+			cache->entries[i].used = ++cache->clock;
+			return &cache->entries[i];
+		}
+
+	return NULL;
+}
+
+static struct vhd_bitmap_cache_entry *
+vhd_bitmap_cache_victim(struct vhd_bitmap_cache *cache)
+{
+	struct vhd_bitmap_cache_entry *e, *victim;
+	int i;
+
+	victim = &cache->entries[0];
+	for (i = 1; i < VHD_BITMAP_CACHE_SIZE; i++) {
+		e = &cache->entries[i];
+		if (e->used < victim->used)
+			victim = e;
+	}
+
+	victim->sec  = 0;
+	victim->used = ++cache->clock;
+	return victim;
+}
+
+/*
+ * reads the bitmap of block, and those of the allocated blocks after it
+ * that are not cached yet
+ */
+static int
+vhd_bitmap_cache_fill(vhd_context_t *ctx, uint32_t block)
+{
+	struct vhd_bitmap_cache *cache = ctx->bitmaps;
+	struct vhd_bitmap_cache_entry *fill[VHD_BITMAP_READAHEAD];
+	struct iocb iocbs[VHD_BITMAP_READAHEAD], *piocbs[VHD_BITMAP_READAHEAD];
+	struct io_event events[VHD_BITMAP_READAHEAD];
+	uint64_t secs[VHD_BITMAP_READAHEAD];
+	int i, k, n, got, err, submitted;
+	uint32_t blk;
+
+	n = 0;
+	for (blk = block;
+	     blk < ctx->bat.entries && n < VHD_BITMAP_READAHEAD; blk++) {
+		if (ctx->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+		if (blk != block &&
+		    vhd_bitmap_cache_lookup(cache, ctx->bat.bat[blk]))
+			continue;
+
+		secs[n] = ctx->bat.bat[blk];
+		fill[n] = vhd_bitmap_cache_victim(cache);
+		io_prep_pread(&iocbs[n], ctx->fd, fill[n]->map, cache->size,
+			      vhd_sectors_to_bytes(secs[n]));
+		piocbs[n] = &iocbs[n];
+		n++;
+	}
+
+	submitted = cache->aio ? io_submit(cache->aio, n, piocbs) : 0;
+	if (submitted < 0)
+		submitted = 0;
+
+	for (got = 0; got < submitted; ) {
+		err = io_getevents(cache->aio, submitted - got,
+				   submitted - got, events, NULL);
+		if (err == -EINTR)
+			continue;
+		if (err < 0)
+			return err;
+
+		for (i = 0; i < err; i++) {
+			k = events[i].obj - iocbs;
+			if (events[i].res == cache->size)
+				fill[k]->sec = secs[k];
+		}
+
+		got += err;
+	}
+
+	if (!submitted) {
+		err = pread(ctx->fd, fill[0]->map, cache->size,
+			    vhd_sectors_to_bytes(secs[0]));
+		if (err != cache->size)
+			return (err == -1 ? -errno : -EIO);
+		fill[0]->sec = secs[0];
+	}
+
+	return fill[0]->sec ? 0 : -EIO;
+}
+
+/*
+ * returns the cached bitmap of an allocated block, or NULL if the
+ * context does not cache bitmaps or the read failed
+ */
+static char *
+vhd_bitmap_cache_get(vhd_context_t *ctx, uint32_t block)
+{
+	struct vhd_bitmap_cache_entry *e;
+
+	if (!vhd_flag_test(ctx->oflags, VHD_OPEN_CACHE_BITMAPS) ||
+	    !vhd_flag_test(ctx->oflags, VHD_OPEN_RDONLY))
+		return NULL;
+
+	if (!ctx->bitmaps && vhd_bitmap_cache_init(ctx))
+		return NULL;
+
+	e = vhd_bitmap_cache_lookup(ctx->bitmaps, ctx->bat.bat[block]);
+	if (e)
+		return e->map;
+
+	if (vhd_bitmap_cache_fill(ctx, block))
+		return NULL;
+
+	e = vhd_bitmap_cache_lookup(ctx->bitmaps, ctx->bat.bat[block]);
+	return e ? e->map : NULL;
+}
+
 typedef struct vhd_block_vector vhd_block_vector_t;
 typedef struct vhd_block_vector_entry vhd_block_vector_entry_t;
 
@@ -3915,6 +5015,25 @@ out:
 	return err;
 }
 
+static void
+vhd_block_vector_add(vhd_block_vector_t *vec, char *buf,
+		     uint64_t blk_start, uint64_t blk_end,
+		     uint32_t sec, uint32_t end)
+{
+	vhd_block_vector_entry_t *v;
+	uint64_t off, lim;
+
+	off = MAX(vhd_sectors_to_bytes(sec), blk_start);
+	lim = MIN(vhd_sectors_to_bytes(end), blk_end);
+
+	v        = vec->array + vec->entries;
+	v->off   = off;
+	v->bytes = lim - off;
+	v->buf   = buf + (off - blk_start);
+
+	vec->entries++;
+}
+
 /**
  * @vec: block vector to initialize
  * @block: vhd block number
@@ -3934,9 +5053,9 @@ vhd_block_vector_init(vhd_context_t *ctx,
 		      vhd_block_vector_t *vec, uint32_t block, char *map,
 		      char *buf, uint64_t blk_start, uint64_t blk_end)
 {
-	int err, sec;
+	int err;
 	char *bitmap;
-	uint32_t first_sec, last_sec;
+	uint32_t first_sec, last_sec, sec, end, prev, i;
 
 	bitmap = NULL;
 	memset(vec, 0, sizeof(*vec));
@@ -3954,46 +5073,42 @@ vhd_block_vector_init(vhd_context_t *ctx,
 		goto out;
 	}
 
-	for (sec = first_sec; sec < last_sec; sec++) {
-		uint32_t cnt;
-		vhd_block_vector_entry_t *v;
-
-		cnt = VHD_SECTOR_SIZE - (blk_start & (VHD_SECTOR_SIZE - 1));
-		if (cnt > blk_end - blk_start)
-			cnt = blk_end - blk_start;
+	prev = first_sec;
 
-		if (map && !test_bit(map, sec))
-			goto next;
+	for (sec = vhd_bitmap_scan(ctx, bitmap, first_sec, last_sec, 1);
+	     sec < last_sec;
+	     sec = vhd_bitmap_scan(ctx, bitmap, end, last_sec, 1)) {
+		uint32_t msec, mend;
 
-		if (vhd_bitmap_test(ctx, bitmap, sec)) {
-			if (vec->entries > 0) {
-				v = vec->array + vec->entries - 1;
-				if (v->off + v->bytes == blk_start) {
-					v->bytes += cnt;
-					goto next;
-				}
-			}
+		end = vhd_bitmap_scan(ctx, bitmap, sec, last_sec, 0);
 
-			v        = vec->array + vec->entries;
-			v->off   = blk_start;
-			v->bytes = cnt;
-			v->buf   = buf;
+		if (!map) {
+			vhd_block_vector_add(vec, buf, blk_start, blk_end,
+					     sec, end);
+			continue;
+		}
 
-			vec->entries++;
+		for (i = prev; i < sec; i++)
+			clear_bit(map, i);
+		prev = end;
 
-		} else if (map) {
-			clear_bit(map, sec);
+		for (msec = __vhd_bitmap_scan(map, sec, end, 1, 0);
+		     msec < end;
+		     msec = __vhd_bitmap_scan(map, mend, end, 1, 0)) {
+			mend = __vhd_bitmap_scan(map, msec, end, 0, 0);
+			vhd_block_vector_add(vec, buf, blk_start, blk_end,
+					     msec, mend);
 		}
-
-	next:
-		blk_start += cnt;
-		buf       += cnt;
 	}
 
+	if (map)
+		for (i = prev; i < last_sec; i++)
+			clear_bit(map, i);
+
 	vec->block = block;
 
 out:
-	free(bitmap);
+	vhd_buf_put(ctx, bitmap, vhd_bitmap_bytes(ctx));
 	return err;
 }
 
@@ -4374,12 +5489,11 @@ __vhd_io_dynamic_write_bytes_aligned(vhd_context_t *ctx,
 			goto fail;
 
 		if (vhd_has_batmap(ctx)) {
-			for (i = 0; i < ctx->spb; i++)
-				if (!vhd_bitmap_test(ctx, map, i)) {
-					free(map);
-					map = NULL;
-					goto next;
-				}
+			if (!vhd_bitmap_full(ctx, map)) {
+				vhd_buf_put(ctx, map, vhd_bitmap_bytes(ctx));
+				map = NULL;
+				goto next;
+			}
 
 			vhd_batmap_set(ctx, &ctx->batmap, blk);
 			err = vhd_write_batmap(ctx, &ctx->batmap);
@@ -4387,7 +5501,7 @@ __vhd_io_dynamic_write_bytes_aligned(vhd_context_t *ctx,
 				goto fail;
 		}
 
-		free(map);
+		vhd_buf_put(ctx, map, vhd_bitmap_bytes(ctx));
 		map = NULL;
 
 	next:
@@ -4404,7 +5518,7 @@ out:
 	return (err ? err : ret);
 
 fail:
-	free(map);
+	vhd_buf_put(ctx, map, vhd_bitmap_bytes(ctx));
 	goto out;
 }
 
@@ -4540,6 +5654,49 @@ vhd_set_marker(vhd_context_t *ctx, char marker)
 	return vhd_write_batmap_header(ctx, &batmap);
 }
 
+int
+vhd_mdlog_pending(vhd_context_t *ctx, char *pending)
+{
+	int err;
+	vhd_batmap_t batmap;
+
+	*pending = 0;
+
+	if (!vhd_has_batmap(ctx))
+		return xattr_get(ctx->fd,
+				 VHD_XATTR_MDLOG,
+				 (void *)pending,
+				 sizeof(*pending));
+
+	err = vhd_read_batmap_header(ctx, &batmap);
+	if (err)
+		return err;
+
+	*pending = batmap.header.mdlog;
+	return 0;
+}
+
+int
+vhd_set_mdlog_pending(vhd_context_t *ctx, char pending)
+{
+	int err;
+	vhd_batmap_t batmap;
+
+	if (!vhd_has_batmap(ctx))
+		return xattr_set(ctx->fd,
+				 VHD_XATTR_MDLOG,
+				 (void *)&pending,
+				 sizeof(pending));
+
+	err = vhd_read_batmap_header(ctx, &batmap);
+	if (err)
+		return err;
+
+	batmap.header.mdlog = pending;
+	ctx->batmap.header.mdlog = pending;
+	return vhd_write_batmap_header(ctx, &batmap);
+}
+
 int
 vhd_get_keyhash(vhd_context_t *ctx, struct vhd_keyhash *keyhash)
 {
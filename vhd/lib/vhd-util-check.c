@@ -40,7 +40,10 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <libaio.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "list.h"
 #include "libvhd.h"
@@ -50,6 +53,9 @@
 // account for time skew with NFS servers
 #define TIMESTAMP_MAX_SLACK 1800
 
+#define VHD_CHECK_DEPTH         32  /* block reads in flight per thread */
+#define VHD_CHECK_THREADS_MAX   16
+
 struct vhd_util_check_options {
 	char                             ignore_footer;
 	char                             ignore_parent_uuid;
@@ -57,6 +63,7 @@ struct vhd_util_check_options {
 	char                             check_data;
 	char                             no_check_bat;
 	char                             collect_stats;
+	int                              threads;
 };
 
 struct vhd_util_check_stats {
@@ -698,45 +705,50 @@ vhd_util_check_differencing_header(struct vhd_util_check_ctx *ctx,
 	return 0;
 }
 
+/*
+ * Validates one allocated block given its bitmap and, with -b, its data.
+ * Called concurrently from the scan threads: each block owns a disjoint,
+ * byte-aligned range of the stats bitmap, and written sectors are counted
+ * into @written for the caller to sum.
+ */
 static int
-vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
-		      vhd_context_t *vhd, uint32_t block)
+vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd,
+		      uint32_t block, char *bitmap, char *data,
+		      uint64_t *written)
 {
-	int err, i;
+	struct vhd_util_check_stats *stats;
+	uint32_t i, end;
 	uint64_t sector;
-	char *bitmap, *data;
+	int err;
 
-	data   = NULL;
-	bitmap = NULL;
+	err    = 0;
+	stats  = ctx->opts.collect_stats ? ctx_cur_stats(ctx) : NULL;
 	sector = (uint64_t)block * vhd->spb;
 
-	err = vhd_read_bitmap(vhd, block, &bitmap);
-	if (err) {
-		printf("error reading bitmap 0x%x\n", block);
-		goto out;
-	}
-
-	if (ctx->opts.check_data) {
-		err = vhd_read_block(vhd, block, &data);
-		if (err) {
-			printf("error reading data block 0x%x\n", block);
-			goto out;
+	if (stats) {
+		*written += vhd_bitmap_count(vhd, bitmap);
+
+		for (i = vhd_bitmap_scan(vhd, bitmap, 0, vhd->spb, 1);
+		     i < vhd->spb;
+		     i = vhd_bitmap_scan(vhd, bitmap, end, vhd->spb, 1)) {
+			end = vhd_bitmap_scan(vhd, bitmap, i, vhd->spb, 0);
+			for (; i < end; i++)
+				set_bit_u64(stats->bitmap, sector + i);
 		}
 	}
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (ctx->opts.collect_stats &&
-		    vhd_bitmap_test(vhd, bitmap, i)) {
-			ctx_cur_stats(ctx)->secs_written++;
-			set_bit_u64(ctx_cur_stats(ctx)->bitmap, sector + i);
-		}
+	if (!data)
+		return 0;
+
+	for (i = vhd_bitmap_scan(vhd, bitmap, 0, vhd->spb, 0);
+	     i < vhd->spb;
+	     i = vhd_bitmap_scan(vhd, bitmap, end, vhd->spb, 0)) {
+		end = vhd_bitmap_scan(vhd, bitmap, i, vhd->spb, 1);
 
-		if (ctx->opts.check_data) {
-			char *buf = data + (i << VHD_SECTOR_SHIFT);
-			int set   = vhd_util_check_zeros(buf, VHD_SECTOR_SIZE);
-			int map   = vhd_bitmap_test(vhd, bitmap, i);
+		for (; i < end; i++) {
+			char *buf = data + vhd_sectors_to_bytes(i);
 
-			if (set && !map) {
+			if (vhd_util_check_zeros(buf, VHD_SECTOR_SIZE)) {
 				printf("sector 0x%x of block 0x%x has data "
 				       "where bitmap is clear\n", i, block);
 				err = -EINVAL;
@@ -744,18 +756,211 @@ vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
 		}
 	}
 
-out:
-	free(data);
-	free(bitmap);
 	return err;
 }
 
+struct vhd_util_check_extent {
+	uint32_t                         off;
+	uint32_t                         block;
+};
+
+/*
+ * Bitmap (and data) validation of a whole image. The allocated blocks, in
+ * file order, are split into runs of VHD_CHECK_DEPTH that the scan threads
+ * claim in turn; each thread reads its run with libaio, bitmap and data of
+ * a block in one read, and validates while the other threads' reads are
+ * in flight.
+ */
+struct vhd_util_check_scan {
+	struct vhd_util_check_ctx       *ctx;
+	vhd_context_t                   *vhd;
+	struct vhd_util_check_extent    *extents;
+	uint32_t                         nr_extents;
+	size_t                           size;      /* of each read */
+	uint32_t                         next;      /* next extent to claim */
+	uint64_t                         written;
+	int                              err;
+};
+
+static int
+vhd_util_check_read(struct vhd_util_check_scan *scan, io_context_t aio,
+		    struct iocb *iocbs, char *bufs, uint32_t first, int n)
+{
+	struct iocb *list[VHD_CHECK_DEPTH];
+	struct io_event events[VHD_CHECK_DEPTH];
+	vhd_context_t *vhd = scan->vhd;
+	size_t bm_size = vhd_sectors_to_bytes(vhd->bm_secs);
+	int i, done, err;
+	long res;
+
+	for (i = 0; i < n; i++) {
+		io_prep_pread(&iocbs[i], vhd->fd, bufs + i * scan->size,
+			      scan->size,
+			      vhd_sectors_to_bytes(scan->extents[first + i].off));
+		iocbs[i].data = (void *)(uintptr_t)i;
+		list[i] = &iocbs[i];
+	}
+
+	err = io_submit(aio, n, list);
+	if (err != n) {
+		printf("error submitting reads: %d\n", err);
+		return (err < 0 ? err : -EIO);
+	}
+
+	err = 0;
+	for (done = 0; done < n; ) {
+		int got = io_getevents(aio, 1, n - done, events, NULL);
+		if (got == -EINTR)
+			continue;
+		if (got < 0)
+			return got;
+
+		for (done += got; got--; ) {
+			i   = (uintptr_t)events[got].data;
+			res = events[got].res;
+
+			/* the last block may run into a missing footer */
+			if (res >= (long)bm_size && res < (long)scan->size) {
+				memset(bufs + i * scan->size + res, 0,
+				       scan->size - res);
+				continue;
+			}
+
+			if (res != scan->size) {
+				printf("error reading block 0x%x: %ld\n",
+				       scan->extents[first + i].block, res);
+				err = -EIO;
+			}
+		}
+	}
+
+	return err;
+}
+
+static void *
+vhd_util_check_scan_thread(void *arg)
+{
+	struct vhd_util_check_scan *scan = arg;
+	vhd_context_t *vhd = scan->vhd;
+	size_t bm_size = vhd_sectors_to_bytes(vhd->bm_secs);
+	struct iocb iocbs[VHD_CHECK_DEPTH];
+	io_context_t aio = 0;
+	uint64_t written = 0;
+	char *bufs = NULL;
+	int i, n, err;
+
+	err = io_setup(VHD_CHECK_DEPTH, &aio);
+	if (err) {
+		printf("error setting up aio: %d\n", err);
+		goto out;
+	}
+
+	err = posix_memalign((void **)&bufs, VHD_SECTOR_SIZE,
+			     VHD_CHECK_DEPTH * scan->size);
+	if (err) {
+		err = -err;
+		bufs = NULL;
+		goto out;
+	}
+
+	for (;;) {
+		uint32_t first;
+
+		if (__atomic_load_n(&scan->err, __ATOMIC_RELAXED))
+			break;
+
+		first = __atomic_fetch_add(&scan->next, VHD_CHECK_DEPTH,
+					   __ATOMIC_RELAXED);
+		if (first >= scan->nr_extents)
+			break;
+
+		n = MIN(VHD_CHECK_DEPTH, scan->nr_extents - first);
+
+		err = vhd_util_check_read(scan, aio, iocbs, bufs, first, n);
+		if (err)
+			goto out;
+
+		for (i = 0; i < n; i++) {
+			char *buf = bufs + i * scan->size;
+
+			err = vhd_util_check_bitmap(scan->ctx, vhd,
+					scan->extents[first + i].block, buf,
+					scan->ctx->opts.check_data ?
+					buf + bm_size : NULL, &written);
+			if (err)
+				goto out;
+		}
+	}
+
+out:
+	if (err)
+		__atomic_compare_exchange_n(&scan->err, &(int){ 0 }, err, 0,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED);
+	__atomic_fetch_add(&scan->written, written, __ATOMIC_RELAXED);
+	free(bufs);
+	if (aio)
+		io_destroy(aio);
+	return NULL;
+}
+
+static int
+vhd_util_check_scan(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd,
+		    struct vhd_util_check_extent *extents, uint32_t n)
+{
+	struct vhd_util_check_scan scan;
+	pthread_t threads[VHD_CHECK_THREADS_MAX];
+	int i, nr_threads, err;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.ctx        = ctx;
+	scan.vhd        = vhd;
+	scan.extents    = extents;
+	scan.nr_extents = n;
+	scan.size       = vhd_sectors_to_bytes(vhd->bm_secs);
+	if (ctx->opts.check_data)
+		scan.size += vhd_sectors_to_bytes(vhd->spb);
+
+	nr_threads = MIN(ctx->opts.threads,
+			 (n + VHD_CHECK_DEPTH - 1) / VHD_CHECK_DEPTH);
+
+	for (i = 0; i < nr_threads; i++) {
+		err = pthread_create(&threads[i], NULL,
+				     vhd_util_check_scan_thread, &scan);
+		if (err) {
+			printf("error creating check thread: %d\n", -err);
+			break;
+		}
+	}
+
+	nr_threads = i;
+	if (!nr_threads)
+		vhd_util_check_scan_thread(&scan);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (ctx->opts.collect_stats)
+		ctx_cur_stats(ctx)->secs_written += scan.written;
+
+	return scan.err;
+}
+
+static int
+vhd_util_check_extent_cmp(const void *a, const void *b)
+{
+	const struct vhd_util_check_extent *x = a, *y = b;
+
+	return (x->off > y->off) - (x->off < y->off);
+}
+
 static int
 vhd_util_check_bat(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
 {
 	off64_t eof, eoh;
 	uint64_t vhd_blks;
-	int i, j, err, block_size;
+	struct vhd_util_check_extent *extents;
+	int i, n, err, block_size;
 
 	if (ctx->opts.collect_stats) {
 		err = vhd_util_check_stats_alloc_one(ctx, vhd);
@@ -802,14 +1007,20 @@ vhd_util_check_bat(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
 	eoh >>= VHD_SECTOR_SHIFT;
 	block_size = vhd->spb + vhd->bm_secs;
 
-	vhd_blks = vhd->footer.curr_size >> VHD_BLOCK_SHIFT;
+	vhd_blks = vhd->footer.curr_size >> vhd_block_shift(vhd);
 	if (vhd_blks > vhd->header.max_bat_size) {
 		printf("VHD size (%"PRIu64" blocks) exceeds BAT size (%u)\n",
 		       vhd_blks, vhd->header.max_bat_size);
 		return -EINVAL;
 	}
 
-	for (i = 0; i < vhd_blks; i++) {
+	extents = malloc(vhd_blks * sizeof(*extents));
+	if (vhd_blks && !extents) {
+		printf("failed to allocate block list\n");
+		return -ENOMEM;
+	}
+
+	for (n = 0, i = 0; i < vhd_blks; i++) {
 		uint32_t off = vhd->bat.bat[i];
 		if (off == DD_BLK_UNUSED)
 			continue;
@@ -817,7 +1028,8 @@ vhd_util_check_bat(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
 		if (off < eoh) {
 			printf("block %d (offset 0x%x) clobbers headers\n",
 			       i, off);
-			return -EINVAL;
+			err = -EINVAL;
+			goto out;
 		}
 
 		if (off + block_size > eof) {
@@ -826,51 +1038,51 @@ vhd_util_check_bat(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
 			      off + block_size == eof + 1)) {
 				printf("block %d (offset 0x%x) clobbers "
 				       "footer\n", i, off);
-				return -EINVAL;
+				err = -EINVAL;
+				goto out;
 			}
 		}
 
-		if (ctx->opts.no_check_bat)
-			continue;
-
-		for (j = 0; j < vhd_blks; j++) {
-			uint32_t joff = vhd->bat.bat[j];
-
-			if (i == j)
-				continue;
-
-			if (joff == DD_BLK_UNUSED)
-				continue;
-
-			if (off == joff)
-				err = -EINVAL;
-
-			if (off > joff && off < joff + block_size)
-				err = -EINVAL;
+		extents[n].off   = off;
+		extents[n].block = i;
+		n++;
+	}
 
-			if (off + block_size > joff &&
-			    off + block_size < joff + block_size)
+	/*
+	 * In file order, any two blocks that overlap leave an overlapping
+	 * pair of neighbours.
+	 */
+	qsort(extents, n, sizeof(*extents), vhd_util_check_extent_cmp);
+
+	if (!ctx->opts.no_check_bat) {
+		for (i = 1; i < n; i++) {
+			struct vhd_util_check_extent *cur  = &extents[i];
+			struct vhd_util_check_extent *prev = &extents[i - 1];
+
+			if (cur->off < prev->off + block_size) {
+				printf("block %u (offset 0x%x) clobbers "
+				       "block %u (offset 0x%x)\n",
+				       cur->block, cur->off,
+				       prev->block, prev->off);
 				err = -EINVAL;
-
-			if (err) {
-				printf("block %d (offset 0x%x) clobbers "
-				       "block %d (offset 0x%x)\n",
-				       i, off, j, joff);
-				return err;
+				goto out;
 			}
 		}
+	}
 
-		if (ctx->opts.check_data || ctx->opts.collect_stats) {
-			if (ctx->opts.collect_stats)
-				ctx_cur_stats(ctx)->secs_allocated += vhd->spb;
+	err = 0;
 
-			err = vhd_util_check_bitmap(ctx, vhd, i);
-			if (err)
-				return err;
-		}
+	if (ctx->opts.check_data || ctx->opts.collect_stats) {
+		if (ctx->opts.collect_stats)
+			ctx_cur_stats(ctx)->secs_allocated +=
+				(uint64_t)n * vhd->spb;
+
+		err = vhd_util_check_scan(ctx, vhd, extents, n);
 	}
 
-	return 0;
+out:
+	free(extents);
+	return err;
 }
 
 static int
@@ -897,7 +1109,7 @@ vhd_util_check_batmap(vhd_context_t *vhd)
 		return -EINVAL;
 	}
 
-	for (i = 0; i < vhd->footer.curr_size >> VHD_BLOCK_SHIFT; i++) {
+	for (i = 0; i < vhd->footer.curr_size >> vhd_block_shift(vhd); i++) {
 		if (!vhd_batmap_test(vhd, &vhd->batmap, i))
 			continue;
 
@@ -1192,49 +1404,285 @@ out:
 	return err;
 }
 
+static int
+vhd_util_check_one(struct vhd_util_check_options *opts,
+		   const char *name, int parents)
+{
+	int err;
+	struct vhd_util_check_ctx ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.opts = *opts;
+	vhd_util_check_stats_init(&ctx);
+
+	err = vhd_util_check_vhd(&ctx, name);
+	if (err)
+		goto out;
+
+	if (parents)
+		err = vhd_util_check_parents(&ctx, name);
+
+	if (ctx.opts.collect_stats)
+		vhd_util_check_stats_print(&ctx);
+
+out:
+	vhd_util_check_stats_free(&ctx);
+	return err;
+}
+
+struct vhd_util_check_job {
+	const char                      *name;
+	pid_t                            pid;
+	FILE                            *out;
+	int                              err;
+	int                              done;
+};
+
+static int
+vhd_util_check_job_start(struct vhd_util_check_job *job,
+			 struct vhd_util_check_options *opts, int parents)
+{
+	int err;
+
+	job->out = tmpfile();
+	if (!job->out) {
+		printf("error creating output file for %s: %d\n",
+		       job->name, -errno);
+		return -errno;
+	}
+
+	fflush(stdout);
+
+	job->pid = fork();
+	if (job->pid == -1) {
+		printf("error forking check of %s: %d\n", job->name, -errno);
+		fclose(job->out);
+		job->out = NULL;
+		return -errno;
+	}
+
+	if (!job->pid) {
+		dup2(fileno(job->out), STDOUT_FILENO);
+		err = vhd_util_check_one(opts, job->name, parents);
+		fflush(stdout);
+		_exit(-err & 0xff);
+	}
+
+	return 0;
+}
+
+static void
+vhd_util_check_job_print(struct vhd_util_check_job *job)
+{
+	char buf[4096];
+	size_t n;
+
+	if (!job->out)
+		return;
+
+	rewind(job->out);
+	while ((n = fread(buf, 1, sizeof(buf), job->out)) > 0)
+		fwrite(buf, 1, n, stdout);
+	fflush(stdout);
+
+	fclose(job->out);
+	job->out = NULL;
+}
+
+/*
+ * Checks several images, up to @jobs at a time, each in a child of its own
+ * whose output is captured and printed in the order the images were given.
+ * Returns the first error, in that order.
+ */
+static int
+vhd_util_check_many(struct vhd_util_check_options *opts, char **names,
+		    int n, int parents, int jobs)
+{
+	struct vhd_util_check_job *job;
+	int i, next, printed, running, status, err;
+	pid_t pid;
+
+	job = calloc(n, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++)
+		job[i].name = names[i];
+
+	next = printed = running = 0;
+
+	while (printed < n) {
+		while (next < n && running < jobs) {
+			job[next].err = vhd_util_check_job_start(&job[next],
+								 opts, parents);
+			if (job[next].err)
+				job[next].done = 1;
+			else
+				running++;
+			next++;
+		}
+
+		while (printed < n && job[printed].done) {
+			vhd_util_check_job_print(&job[printed]);
+			printed++;
+		}
+
+		if (!running)
+			continue;
+
+		pid = wait(&status);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (i = 0; i < next; i++)
+			if (job[i].pid == pid && !job[i].done)
+				break;
+		if (i == next)
+			continue;
+
+		running--;
+		job[i].done = 1;
+		job[i].err  = WIFEXITED(status) ? -WEXITSTATUS(status) : -EIO;
+	}
+
+	err = 0;
+	for (i = 0; i < n; i++) {
+		vhd_util_check_job_print(&job[i]);
+		if (!job[i].done)
+			job[i].err = -ECHILD;
+		if (!err)
+			err = job[i].err;
+	}
+
+	free(job);
+	return err;
+}
+
+static int
+vhd_util_check_read_list(const char *path, char ***names, int *n)
+{
+	char *line, **list;
+	size_t size;
+	ssize_t len;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		printf("error opening %s: %d\n", path, -errno);
+		return -errno;
+	}
+
+	line = NULL;
+	size = 0;
+
+	while ((len = getline(&line, &size, f)) != -1) {
+		while (len && (line[len - 1] == '\n' || line[len - 1] == ' '))
+			line[--len] = '\0';
+		if (!len)
+			continue;
+
+		list = realloc(*names, (*n + 1) * sizeof(*list));
+		if (!list)
+			goto fail;
+		*names = list;
+
+		list[*n] = strdup(line);
+		if (!list[*n])
+			goto fail;
+		(*n)++;
+	}
+
+	free(line);
+	fclose(f);
+	return 0;
+
+fail:
+	free(line);
+	fclose(f);
+	return -ENOMEM;
+}
+
 int
 vhd_util_check(int argc, char **argv)
 {
-	char *name;
-	int c, err, parents;
-	struct vhd_util_check_ctx ctx;
+	char **names, **list;
+	int i, c, err, parents, jobs, n;
+	struct vhd_util_check_options opts;
+
+	names   = NULL;
+	n       = 0;
 
 	if (!argc || !argv) {
 		err = -EINVAL;
 		goto usage;
 	}
 
-	name    = NULL;
 	parents = 0;
-	memset(&ctx, 0, sizeof(ctx));
-	vhd_util_check_stats_init(&ctx);
+	jobs    = 1;
+	memset(&opts, 0, sizeof(opts));
+	opts.threads = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1),
+			   VHD_CHECK_THREADS_MAX);
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:iItpbBsh")) != -1) {
+	while ((c = getopt(argc, argv, "n:l:j:T:iItpbBsh")) != -1) {
 		switch (c) {
 		case 'n':
-			name = optarg;
+			list = realloc(names, (n + 1) * sizeof(*names));
+			if (!list) {
+				err = -ENOMEM;
+				goto out;
+			}
+			names = list;
+			names[n] = strdup(optarg);
+			if (!names[n]) {
+				err = -ENOMEM;
+				goto out;
+			}
+			n++;
+			break;
+		case 'l':
+			err = vhd_util_check_read_list(optarg, &names, &n);
+			if (err)
+				goto out;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				err = -EINVAL;
+				goto usage;
+			}
+			break;
+		case 'T':
+			opts.threads = atoi(optarg);
+			if (opts.threads < 1 ||
+			    opts.threads > VHD_CHECK_THREADS_MAX) {
+				err = -EINVAL;
+				goto usage;
+			}
 			break;
 		case 'i':
-			ctx.opts.ignore_footer = 1;
+			opts.ignore_footer = 1;
 			break;
 		case 'I':
-			ctx.opts.ignore_parent_uuid = 1;
+			opts.ignore_parent_uuid = 1;
 			break;
 		case 't':
-			ctx.opts.ignore_timestamps = 1;
+			opts.ignore_timestamps = 1;
 			break;
 		case 'p':
 			parents = 1;
 			break;
 		case 'b':
-			ctx.opts.check_data = 1;
+			opts.check_data = 1;
 			break;
 		case 'B':
-			ctx.opts.no_check_bat = 1;
+			opts.no_check_bat = 1;
 			break;
 		case 's':
-			ctx.opts.collect_stats = 1;
+			opts.collect_stats = 1;
 			break;
 		case 'h':
 			err = 0;
@@ -1245,36 +1693,41 @@ vhd_util_check(int argc, char **argv)
 		}
 	}
 
-	if (!name || optind != argc) {
+	if (!n || optind != argc) {
 		err = -EINVAL;
 		goto usage;
 	}
 
-	if ((ctx.opts.collect_stats || ctx.opts.check_data) &&
-			ctx.opts.no_check_bat) {
+	if ((opts.collect_stats || opts.check_data) && opts.no_check_bat) {
 		err = -EINVAL;
 		goto usage;
 	}
 
-	err = vhd_util_check_vhd(&ctx, name);
-	if (err)
+	if (n > 1 && jobs > 1) {
+		err = vhd_util_check_many(&opts, names, n, parents, jobs);
 		goto out;
+	}
 
-	if (parents)
-		err = vhd_util_check_parents(&ctx, name);
-
-	if (ctx.opts.collect_stats)
-		vhd_util_check_stats_print(&ctx);
-
-	vhd_util_check_stats_free(&ctx);
+	for (err = 0, i = 0; i < n; i++) {
+		int e = vhd_util_check_one(&opts, names[i], parents);
+		if (!err)
+			err = e;
+	}
 
 out:
+	for (i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
 	return err;
 
 usage:
-	printf("options: -n <file> [-i ignore missing primary footers] "
+	printf("options: -n <file> [-n <file> ...] [-l <file listing images>] "
+	       "[-j check this many images at once] "
+	       "[-T bitmap threads per image (1-%d)] "
+	       "[-i ignore missing primary footers] "
 	       "[-I ignore parent uuids] [-t ignore timestamps] "
 	       "[-B do not check BAT for overlapping (precludes -s, -b)] "
-	       "[-p check parents] [-b check bitmaps] [-s stats] [-h help]\n");
-	return err;
+	       "[-p check parents] [-b check bitmaps] [-s stats] [-h help]\n",
+	       VHD_CHECK_THREADS_MAX);
+	goto out;
 }
@@ -38,6 +38,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <limits.h>
+#include <time.h>
+#include <libaio.h>
 
 #include "libvhd.h"
 #include "canonpath.h"
@@ -65,81 +67,349 @@ __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 	return (errno ? -errno : -EIO);
 }
 
+#define VHD_COALESCE_DEPTH      16  /* blocks read ahead of the writes */
+#define VHD_COALESCE_DEPTH_MAX  256
+
+struct vhd_coalesce_block {
+	uint64_t                block;
+	uint64_t                key;        /* where it lands in the parent */
+	char                   *buf;        /* bitmap, then data */
+	size_t                  size;       /* read into buf */
+	struct iocb             iocb;
+};
+
+struct vhd_coalesce_batch {
+	int                     n;
+	struct vhd_coalesce_block *blocks;
+};
+
 /*
- * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
+ * Coalesces a child onto its parent a batch of blocks at a time. The next
+ * batch is read with libaio while the last is written, bitmap and data of
+ * each block in one read, into buffers allocated once. Writes are issued
+ * in parent order, and all I/O can be capped to a rate in bytes/sec.
+ *
+ * With offload, only the bitmaps are read and the data is copied server
+ * side (reflinks, copy_file_range()) for as long as the files allow it,
+ * after which blocks are read and written through the buffers again.
  */
+struct vhd_coalesce {
+	vhd_context_t          *from;
+	vhd_context_t          *to;
+	int                     to_fd;
+	int                     depth;
+	uint64_t                rate;
+	int                     offload;
+
+	io_context_t            aio;
+	size_t                  size;       /* of each read */
+	uint64_t                next;       /* block to look at next */
+	char                   *bufs;
+	struct vhd_coalesce_batch batch[2];
+
+	struct timespec         start;
+	uint64_t                bytes;
+};
+
 static int
-vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-			int parent_fd, uint64_t block)
+vhd_coalesce_key_cmp(const void *a, const void *b)
 {
-	int i, err;
-	void *buf;
-	char *map;
-	uint64_t sec, secs;
+	const struct vhd_coalesce_block *x = a, *y = b;
 
-	buf = NULL;
-	map = NULL;
-	sec = block * vhd->spb;
+	return (x->key > y->key) - (x->key < y->key);
+}
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
-		return 0;
+/*
+ * Sorts a batch the way its writes fall in the parent: blocks the parent
+ * already has by their offset there, then those it will allocate, which
+ * it does at its end, in the order they are written.
+ */
+static void
+vhd_coalesce_sort(struct vhd_coalesce *c, struct vhd_coalesce_batch *b)
+{
+	vhd_context_t *to = c->to;
+	uint64_t blk;
+	int i;
+
+	for (i = 0; i < b->n; i++) {
+		blk = b->blocks[i].block;
+		b->blocks[i].key = blk;
+		if (!to->file || !to->bat.bat || blk >= to->bat.entries)
+			continue;
+		if (to->bat.bat[blk] == DD_BLK_UNUSED)
+			b->blocks[i].key = (1ULL << 32) + blk;
+		else
+			b->blocks[i].key = to->bat.bat[blk];
+	}
 
-	err = posix_memalign(&buf, 4096, vhd->header.block_size);
-	if (err)
-		return -err;
+	qsort(b->blocks, b->n, sizeof(*b->blocks), vhd_coalesce_key_cmp);
+}
 
-	err = vhd_io_read(vhd, buf, sec, vhd->spb);
-	if (err)
-		goto done;
+/*
+ * Reads the next allocated blocks of the child, up to the queue depth.
+ */
+static int
+vhd_coalesce_read_batch(struct vhd_coalesce *c, struct vhd_coalesce_batch *b)
+{
+	vhd_context_t *from = c->from;
+	struct vhd_coalesce_block *blk;
+	struct iocb *iocbs[VHD_COALESCE_DEPTH_MAX];
+	int err;
 
-	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
-		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
-		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
-		goto done;
+	b->n = 0;
+
+	for (; c->next < from->bat.entries && b->n < c->depth; c->next++) {
+		if (from->bat.bat[c->next] == DD_BLK_UNUSED)
+			continue;
+
+		blk        = &b->blocks[b->n];
+		blk->block = c->next;
+		blk->size  = (c->offload ?
+			      vhd_sectors_to_bytes(from->bm_secs) : c->size);
+		io_prep_pread(&blk->iocb, from->fd, blk->buf, blk->size,
+			      vhd_sectors_to_bytes(from->bat.bat[c->next]));
+		blk->iocb.data = blk;
+		iocbs[b->n++]  = &blk->iocb;
 	}
 
-	err = vhd_read_bitmap(vhd, block, &map);
-	if (err)
-		goto done;
+	if (!b->n)
+		return 0;
+
+	err = io_submit(c->aio, b->n, iocbs);
+	if (err != b->n) {
+		printf("error submitting reads: %d\n", err);
+		return (err < 0 ? err : -EIO);
+	}
+
+	return 0;
+}
+
+static int
+vhd_coalesce_wait_batch(struct vhd_coalesce *c, struct vhd_coalesce_batch *b)
+{
+	struct io_event events[VHD_COALESCE_DEPTH_MAX];
+	struct vhd_coalesce_block *blk;
+	int i, n, err;
+
+	err = 0;
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
+	for (n = 0; n < b->n; ) {
+		i = io_getevents(c->aio, 1, b->n - n, events, NULL);
+		if (i == -EINTR)
 			continue;
+		if (i < 0)
+			return i;
+
+		for (n += i; i--; ) {
+			blk = events[i].data;
+			if (events[i].res != blk->size) {
+				printf("error reading block 0x%"PRIx64": %ld\n",
+				       blk->block, (long)events[i].res);
+				err = -EIO;
+			}
+			c->bytes += blk->size;
+		}
+	}
+
+	return err;
+}
+
+static int
+vhd_coalesce_write(struct vhd_coalesce *c, char *buf, uint64_t sec,
+		   uint32_t secs)
+{
+	if (c->to->file)
+		return vhd_io_write(c->to, buf, sec, secs);
+	return __raw_io_write(c->to_fd, buf, sec, secs);
+}
+
+/*
+ * Reads the data of a block that only had its bitmap read for offload.
+ */
+static int
+vhd_coalesce_read_data(struct vhd_coalesce *c, struct vhd_coalesce_block *blk)
+{
+	vhd_context_t *from = c->from;
+	ssize_t n;
+
+	n = pread(from->fd, blk->buf, c->size,
+		  vhd_sectors_to_bytes(from->bat.bat[blk->block]));
+	if (n != c->size) {
+		printf("error reading block 0x%"PRIx64": %zd\n",
+		       blk->block, n);
+		return (n < 0 ? -errno : -EIO);
+	}
+
+	c->bytes += c->size - blk->size;
+	blk->size = c->size;
+	return 0;
+}
 
-		for (secs = 0; i + secs < vhd->spb; secs++)
-			if (!vhd_bitmap_test(vhd, map, i + secs))
-				break;
+/*
+ * Writes @secs sectors from @i of a block, server side while that works.
+ */
+static int
+vhd_coalesce_write_run(struct vhd_coalesce *c,
+		       struct vhd_coalesce_block *blk, uint32_t i, uint32_t secs)
+{
+	vhd_context_t *from = c->from;
+	uint64_t sec;
+	off64_t off;
+	char *data;
+	int err;
 
-		if (parent->file)
-			err = vhd_io_write(parent,
-					   buf + vhd_sectors_to_bytes(i),
-					   sec + i, secs);
+	sec = blk->block * from->spb + i;
+
+	if (c->offload) {
+		off = vhd_sectors_to_bytes(from->bat.bat[blk->block] +
+					   from->bm_secs + i);
+		if (c->to->file)
+			err = vhd_io_copy(c->to, from, sec, secs);
 		else
-			err = __raw_io_write(parent_fd,
-					     buf + vhd_sectors_to_bytes(i),
-					     sec + i, secs);
+			err = vhd_copy_range(from->fd, off, c->to_fd,
+					     vhd_sectors_to_bytes(sec),
+					     vhd_sectors_to_bytes(secs));
+		if (err != -EOPNOTSUPP)
+			return err;
+
+		c->offload = 0;
+	}
+
+	if (blk->size < c->size) {
+		err = vhd_coalesce_read_data(c, blk);
 		if (err)
-			goto done;
+			return err;
+	}
+
+	data = blk->buf + vhd_sectors_to_bytes(from->bm_secs + i);
+	return vhd_coalesce_write(c, data, sec, secs);
+}
 
-		i += secs;
+/*
+ * Writes the sectors of a block read whose bitmap bits are set.
+ */
+static int
+vhd_coalesce_write_block(struct vhd_coalesce *c,
+			 struct vhd_coalesce_block *blk)
+{
+	vhd_context_t *from = c->from;
+	uint64_t secs;
+	char *map;
+	int i, err;
+
+	map = blk->buf;
+
+	if (vhd_has_batmap(from) &&
+	    vhd_batmap_test(from, &from->batmap, blk->block)) {
+		c->bytes += vhd_sectors_to_bytes(from->spb);
+		return vhd_coalesce_write_run(c, blk, 0, from->spb);
 	}
 
-	err = 0;
+	for (i = vhd_bitmap_scan(from, map, 0, from->spb, 1);
+	     i < from->spb;
+	     i = vhd_bitmap_scan(from, map, i + secs, from->spb, 1)) {
+		secs = vhd_bitmap_scan(from, map, i, from->spb, 0) - i;
 
-done:
-	free(buf);
-	free(map);
-	return err;
+		err = vhd_coalesce_write_run(c, blk, i, secs);
+		if (err)
+			return err;
+
+		c->bytes += vhd_sectors_to_bytes(secs);
+	}
+
+	return 0;
+}
+
+/*
+ * Sleeps for as long as the I/O done so far is ahead of the rate cap.
+ */
+static void
+vhd_coalesce_throttle(struct vhd_coalesce *c)
+{
+	struct timespec now, ts;
+	uint64_t elapsed, due;
+
+	if (!c->rate)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - c->start.tv_sec) * 1000000000ULL +
+		now.tv_nsec - c->start.tv_nsec;
+	due = (uint64_t)((double)c->bytes / c->rate * 1000000000.0);
+
+	if (due <= elapsed)
+		return;
+
+	ts.tv_sec  = (due - elapsed) / 1000000000ULL;
+	ts.tv_nsec = (due - elapsed) % 1000000000ULL;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
 }
 
 static int
-vhd_util_coalesce_onto(vhd_context_t *from,
-		       vhd_context_t *to, int to_fd, int progress)
+vhd_coalesce_init(struct vhd_coalesce *c)
 {
-	int err;
-	uint64_t i;
+	struct vhd_coalesce_block *blocks;
+	vhd_context_t *from = c->from;
+	int i, err;
+	void *buf;
+
+	if (c->depth <= 0)
+		c->depth = VHD_COALESCE_DEPTH;
+	if (c->depth > VHD_COALESCE_DEPTH_MAX)
+		c->depth = VHD_COALESCE_DEPTH_MAX;
+
+	c->size = vhd_sectors_to_bytes(from->bm_secs + from->spb);
+	c->next = 0;
+
+	blocks = calloc(2 * c->depth, sizeof(*blocks));
+	if (!blocks)
+		return -ENOMEM;
+
+	err = posix_memalign(&buf, 4096, 2 * c->depth * c->size);
+	if (err) {
+		free(blocks);
+		return -err;
+	}
+
+	c->bufs = buf;
+	for (i = 0; i < 2 * c->depth; i++)
+		blocks[i].buf = c->bufs + i * c->size;
+
+	c->batch[0].blocks = blocks;
+	c->batch[1].blocks = blocks + c->depth;
+
+	c->aio = 0;
+	err = io_setup(2 * c->depth, &c->aio);
+	if (err) {
+		printf("error setting up aio: %d\n", err);
+		free(c->bufs);
+		free(blocks);
+		return err;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+	c->bytes = 0;
+
+	return 0;
+}
+
+static void
+vhd_coalesce_free(struct vhd_coalesce *c)
+{
+	/* waits for reads still in flight */
+	io_destroy(c->aio);
+	free(c->batch[0].blocks);
+	free(c->bufs);
+}
+
+static int
+vhd_util_coalesce_onto(vhd_context_t *from, vhd_context_t *to, int to_fd,
+		       int depth, uint64_t rate, int progress, int offload)
+{
+	struct vhd_coalesce_batch *cur, *next, *tmp;
+	struct vhd_coalesce c;
+	int i, err;
 
 	err = vhd_get_bat(from);
 	if (err)
@@ -151,15 +421,54 @@ vhd_util_coalesce_onto(vhd_context_t *from,
 			goto out;
 	}
 
-	for (i = 0; i < from->bat.entries; i++) {
+	memset(&c, 0, sizeof(c));
+	c.from     = from;
+	c.to       = to;
+	c.to_fd    = to_fd;
+	c.depth    = depth;
+	c.rate     = rate;
+	c.offload  = offload;
+
+	err = vhd_coalesce_init(&c);
+	if (err)
+		goto out;
+
+	cur  = &c.batch[0];
+	next = &c.batch[1];
+
+	err = vhd_coalesce_read_batch(&c, cur);
+	if (err)
+		goto free;
+
+	while (cur->n) {
+		err = vhd_coalesce_wait_batch(&c, cur);
+		if (err)
+			goto free;
+
+		/* the next reads overlap this batch's writes */
+		err = vhd_coalesce_read_batch(&c, next);
+		if (err)
+			goto free;
+
+		vhd_coalesce_sort(&c, cur);
+
+		for (i = 0; i < cur->n; i++) {
+			err = vhd_coalesce_write_block(&c, &cur->blocks[i]);
+			if (err)
+				goto free;
+		}
+
 		if (progress) {
 			printf("\r%6.2f%%",
-			       ((float)i / (float)from->bat.entries) * 100.00);
+			       ((float)c.next / (float)from->bat.entries) * 100.00);
 			fflush(stdout);
 		}
-		err = vhd_util_coalesce_block(from, to, to_fd, i);
-		if (err)
-			goto out;
+
+		vhd_coalesce_throttle(&c);
+
+		tmp  = cur;
+		cur  = next;
+		next = tmp;
 	}
 
 	err = 0;
@@ -167,13 +476,15 @@ vhd_util_coalesce_onto(vhd_context_t *from,
 	if (progress)
 		printf("\r100.00%%\n");
 
+free:
+	vhd_coalesce_free(&c);
 out:
 	return err;
 }
 
 static int
 vhd_util_coalesce_parent(const char *name, int sparse, int progress,
-        const char *step_parent)
+        const char *step_parent, int depth, uint64_t rate, int offload)
 {
 	char *pname;
 	int err, parent_fd;
@@ -232,7 +543,8 @@ vhd_util_coalesce_parent(const char *name, int sparse, int progress,
 		}
 	}
 
-	err = vhd_util_coalesce_onto(&vhd, &parent, parent_fd, progress);
+	err = vhd_util_coalesce_onto(&vhd, &parent, parent_fd,
+				     depth, rate, progress, offload);
 
 	free(pname);
 	vhd_close(&vhd);
@@ -431,7 +743,8 @@ vhd_util_coalesce_clear_bitmap(vhd_context_t *child, char *cmap,
 {
 	char *amap = NULL;
 	int dirty = 0;
-	int i, err;
+	uint32_t i, end;
+	int err;
 
 	if (child->spb != ancestor->spb) {
 		err = -EINVAL;
@@ -448,8 +761,12 @@ vhd_util_coalesce_clear_bitmap(vhd_context_t *child, char *cmap,
 	if (err)
 		goto out;
 
-	for (i = 0; i < child->spb; i++) {
-		if (vhd_bitmap_test(child, cmap, i)) {
+	for (i = vhd_bitmap_scan(child, cmap, 0, child->spb, 1);
+	     i < child->spb;
+	     i = vhd_bitmap_scan(child, cmap, end, child->spb, 1)) {
+		end = vhd_bitmap_scan(child, cmap, i, child->spb, 0);
+
+		for (; i < end; i++) {
 			if (vhd_bitmap_test(ancestor, amap, i)) {
 				dirty = 1;
 				vhd_bitmap_clear(ancestor, amap, i);
@@ -473,7 +790,8 @@ vhd_util_coalesce_clear_bitmap(vhd_context_t *child, char *cmap,
 done:
 	err = 0;
 out:
-	free(amap);
+	vhd_buf_put(ancestor, amap,
+		    vhd_sectors_to_bytes(ancestor->bm_secs));
 	return err;
 }
 
@@ -509,13 +827,14 @@ vhd_util_coalesce_clear_bitmaps(struct list_head *chain, vhd_context_t *child,
 done:
 	err = 0;
 out:
-	free(map);
+	vhd_buf_put(child, map, vhd_sectors_to_bytes(child->bm_secs));
 	return err;
 }
 
 static int
-vhd_util_coalesce_ancestor(const char *cname,
-			   const char *aname, int sparse, int progress)
+vhd_util_coalesce_ancestor(const char *cname, const char *aname,
+			   int sparse, int progress, int depth, uint64_t rate,
+			   int offload)
 {
 	uint64_t i;
 	int err, raw_fd;
@@ -545,7 +864,8 @@ vhd_util_coalesce_ancestor(const char *cname,
 		goto out;
 	}
 
-	err = vhd_util_coalesce_onto(child, ancestor, raw_fd, progress);
+	err = vhd_util_coalesce_onto(child, ancestor, raw_fd,
+				     depth, rate, progress, offload);
 	if (err)
 		goto out;
 
@@ -576,7 +896,8 @@ vhd_util_coalesce_open_output(vhd_context_t *dst,
 		return -errno;
 	}
 
-	err = vhd_create(name, src->footer.curr_size, HD_TYPE_DYNAMIC, 0, 0);
+	err = vhd_create_ext(name, src->footer.curr_size, HD_TYPE_DYNAMIC, 0,
+			     src->header.block_size, 0);
 	if (err) {
 		printf("error creating %s: %d\n", name, err);
 		return err;
@@ -618,12 +939,11 @@ vhd_util_coalesce_block_out(vhd_context_t *dst,
 	void *buf;
 	char *p;
 
-	buf = NULL;
 	sec = block * src->spb;
 
-	err = posix_memalign(&buf, 4096, src->header.block_size);
-	if (err)
-		return -err;
+	buf = vhd_buf_get(src, src->header.block_size);
+	if (!buf)
+		return -errno;
 
 	err = vhd_io_read(src, buf, sec, src->spb);
 	if (err)
@@ -637,7 +957,7 @@ vhd_util_coalesce_block_out(vhd_context_t *dst,
 	}
 
 done:
-	free(buf);
+	vhd_buf_put(src, buf, src->header.block_size);
 	return err;
 }
 
@@ -649,7 +969,8 @@ vhd_util_coalesce_out(const char *src_name, const char *dst_name,
 	int err, flags;
 	vhd_context_t src, dst;
 
-	err = vhd_open(&src, src_name, VHD_OPEN_RDONLY | VHD_OPEN_CACHED);
+	err = vhd_open(&src, src_name,
+		       VHD_OPEN_RDONLY | VHD_OPEN_CACHED | VHD_OPEN_CACHE_BITMAPS);
 	if (err)
 		return err;
 
@@ -698,7 +1019,8 @@ int
 vhd_util_coalesce(int argc, char **argv)
 {
 	char *name, *oname, *ancestor, *step_parent;
-	int err, c, progress, sparse;
+	int err, c, progress, sparse, depth, offload;
+	uint64_t rate;
 
 	name        = NULL;
 	oname       = NULL;
@@ -706,12 +1028,15 @@ vhd_util_coalesce(int argc, char **argv)
 	step_parent = NULL;
 	sparse      = 0;
 	progress    = 0;
+	depth       = VHD_COALESCE_DEPTH;
+	rate        = 0;
+	offload     = 1;
 
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:o:a:x:sph")) != -1) {
+	while ((c = getopt(argc, argv, "n:o:a:x:q:r:spBh")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -731,6 +1056,17 @@ vhd_util_coalesce(int argc, char **argv)
 		case 'x':
 			step_parent = optarg;
 			break;
+		case 'q':
+			depth = atoi(optarg);
+			if (depth <= 0 || depth > VHD_COALESCE_DEPTH_MAX)
+				goto usage;
+			break;
+		case 'r':
+			rate = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'B':
+			offload = 0;
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -746,10 +1082,12 @@ vhd_util_coalesce(int argc, char **argv)
 	if (oname)
 		err = vhd_util_coalesce_out(name, oname, sparse, progress);
 	else if (ancestor)
-		err = vhd_util_coalesce_ancestor(name, ancestor,
-						 sparse, progress);
+		err = vhd_util_coalesce_ancestor(name, ancestor, sparse,
+						 progress, depth, rate, offload);
 	else
-		err = vhd_util_coalesce_parent(name, sparse, progress, step_parent);
+		err = vhd_util_coalesce_parent(name, sparse, progress,
+					       step_parent, depth, rate,
+					       offload);
 
 	if (err)
 		printf("error coalescing: %d\n", err);
@@ -759,6 +1097,7 @@ vhd_util_coalesce(int argc, char **argv)
 usage:
 	printf("options: <-n name> [-a ancestor] "
 	       "[-o output] [-s sparse] [-p progress] [-x custom parent] "
-	       "[-h help]\n");
+	       "[-q blocks in flight] [-r rate cap, MiB/s] "
+	       "[-B no server side copy] [-h help]\n");
 	return -EINVAL;
 }
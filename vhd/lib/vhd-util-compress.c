@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "libvhd.h"
+#include "zimg.h"
+
+#define VHD_COMPRESS_THREADS_MAX	16
+
+/*
+ * Blocks are read through the chain in batches of one per thread,
+ * deflated in parallel and written out in order.
+ */
+struct vhd_compress_slot {
+	uint64_t		block;
+	char			*buf;
+	size_t			len;
+	char			*out;
+	uLongf			out_len;
+	int			level;
+	int			err;
+	pthread_t		thread;
+};
+
+static int
+vhd_compress_zero(const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (buf[i])
+			return 0;
+
+	return 1;
+}
+
+static void *
+vhd_compress_thread(void *arg)
+{
+	struct vhd_compress_slot *slot = arg;
+
+	slot->err = 0;
+
+	if (vhd_compress_zero(slot->buf, slot->len)) {
+		slot->out_len = 0;
+		return NULL;
+	}
+
+	slot->out_len = compressBound(slot->len);
+	if (compress2((Bytef *)slot->out, &slot->out_len,
+		      (Bytef *)slot->buf, slot->len, slot->level) != Z_OK) {
+		slot->err = -EIO;
+		return NULL;
+	}
+
+	/* not worth inflating on every read */
+	if (slot->out_len >= slot->len) {
+		memcpy(slot->out, slot->buf, slot->len);
+		slot->out_len = slot->len;
+	}
+
+	return NULL;
+}
+
+static int
+vhd_compress_write(int fd, const void *buf, size_t len, uint64_t off)
+{
+	ssize_t n;
+
+	n = pwrite(fd, buf, len, off);
+	if (n == len)
+		return 0;
+
+	return n < 0 ? -errno : -ENOSPC;
+}
+
+static int
+vhd_compress_blocks(vhd_context_t *vhd, int fd, struct zimg_header *hdr,
+		    uint64_t *index, int level, int threads, int progress)
+{
+	struct vhd_compress_slot slots[VHD_COMPRESS_THREADS_MAX];
+	uint64_t blk, off, sec, size = le64toh(hdr->size);
+	size_t bs = le32toh(hdr->block_size);
+	uint64_t n_blocks = le64toh(hdr->n_blocks);
+	uint64_t written = 0;
+	time_t last = 0;
+	int i, n, err = 0;
+
+	memset(slots, 0, sizeof(slots));
+
+	for (i = 0; i < threads; i++) {
+		slots[i].buf = malloc(bs);
+		slots[i].out = malloc(compressBound(bs));
+		slots[i].level = level;
+		if (!slots[i].buf || !slots[i].out) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	off = ZIMG_HEADER_SIZE;
+
+	for (blk = 0; blk < n_blocks; blk += n) {
+		n = MIN(threads, n_blocks - blk);
+
+		for (i = 0; i < n; i++) {
+			struct vhd_compress_slot *slot = &slots[i];
+
+			slot->block = blk + i;
+			slot->len   = MIN(bs, size - slot->block * bs);
+			sec         = slot->block * bs >> VHD_SECTOR_SHIFT;
+
+			err = vhd_io_read(vhd, slot->buf, sec,
+					  slot->len >> VHD_SECTOR_SHIFT);
+			if (err) {
+				printf("Failed to read block %"PRIu64": %d\n",
+				       slot->block, err);
+				goto out;
+			}
+		}
+
+		for (i = 0; i < n; i++)
+			if (i == n - 1 || pthread_create(&slots[i].thread,
+						NULL, vhd_compress_thread,
+						&slots[i])) {
+				slots[i].thread = 0;
+				vhd_compress_thread(&slots[i]);
+			}
+
+		for (i = 0; i < n; i++) {
+			struct vhd_compress_slot *slot = &slots[i];
+
+			if (slot->thread)
+				pthread_join(slot->thread, NULL);
+
+			if (!err)
+				err = slot->err;
+		}
+
+		for (i = 0; i < n && !err; i++) {
+			struct vhd_compress_slot *slot = &slots[i];
+
+			index[slot->block] = htole64(off);
+
+			/* a short last block must not pass for a stored one */
+			if (slot->out_len == slot->len && slot->len < bs) {
+				memset(slot->out + slot->len, 0, bs - slot->len);
+				slot->out_len = bs;
+			}
+
+			err = vhd_compress_write(fd, slot->out, slot->out_len,
+						 off);
+			off     += slot->out_len;
+			written += slot->len;
+		}
+		if (err)
+			goto out;
+
+		if (progress && (time(NULL) != last || blk + n == n_blocks)) {
+			last = time(NULL);
+			printf("\r%6.2f%%, %.1f%% of the size",
+			       (float)(blk + n) / n_blocks * 100.00,
+			       written ? (float)(off - ZIMG_HEADER_SIZE) /
+			       written * 100.00 : 0);
+			fflush(stdout);
+		}
+	}
+
+	index[n_blocks] = htole64(off);
+	hdr->index_offset = htole64(off);
+
+	err = vhd_compress_write(fd, index, (n_blocks + 1) * sizeof(*index),
+				 off);
+	off += (n_blocks + 1) * sizeof(*index);
+
+	/* padded for tapdisk to read it O_DIRECT up to the end */
+	if (!err && ftruncate(fd, (off + 4095) & ~4095ULL))
+		err = -errno;
+
+	if (progress)
+		printf("\n");
+
+out:
+	for (i = 0; i < threads; i++) {
+		free(slots[i].buf);
+		free(slots[i].out);
+	}
+
+	return err;
+}
+
+static int
+compress_vhd(const char *name, const char *new_name, size_t block_size,
+	     int level, int threads, int progress)
+{
+	struct zimg_header *hdr = NULL;
+	uint64_t *index = NULL;
+	uint64_t n_blocks;
+	vhd_context_t vhd;
+	int err, fd = -1;
+
+	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY | VHD_OPEN_CACHE_BITMAPS);
+	if (err) {
+		printf("error opening %s: %d\n", name, err);
+		return err;
+	}
+
+	n_blocks = (vhd.footer.curr_size + block_size - 1) / block_size;
+
+	hdr   = calloc(1, ZIMG_HEADER_SIZE);
+	index = calloc(n_blocks + 1, sizeof(*index));
+	if (!hdr || !index) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	memcpy(hdr->magic, ZIMG_MAGIC, sizeof(hdr->magic));
+	hdr->version     = htole32(ZIMG_VERSION);
+	hdr->compression = htole32(ZIMG_DEFLATE);
+	hdr->block_size  = htole32(block_size);
+	hdr->size        = htole64(vhd.footer.curr_size);
+	hdr->n_blocks    = htole64(n_blocks);
+
+	fd = open(new_name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		err = -errno;
+		printf("error creating %s: %d\n", new_name, err);
+		goto out;
+	}
+
+	err = vhd_compress_blocks(&vhd, fd, hdr, index, level, threads,
+				  progress);
+	if (err)
+		goto fail;
+
+	/* the magic goes down last, a torn image never opens */
+	err = fsync(fd) ? -errno : 0;
+	if (!err)
+		err = vhd_compress_write(fd, hdr, ZIMG_HEADER_SIZE, 0);
+	if (!err)
+		err = fsync(fd) ? -errno : 0;
+	if (err)
+		goto fail;
+
+	goto out;
+
+fail:
+	printf("Failed to compress %s: %d\n", name, err);
+	unlink(new_name);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(index);
+	free(hdr);
+	vhd_close(&vhd);
+
+	return err;
+}
+
+int
+vhd_util_compress(int argc, char **argv)
+{
+	char *name, *new_name;
+	int c, level, threads, progress;
+	long block_kb;
+
+	name     = NULL;
+	new_name = NULL;
+	block_kb = ZIMG_BLOCK_DEFAULT >> 10;
+	level    = Z_BEST_SPEED;
+	progress = 0;
+	threads  = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1),
+		       VHD_COMPRESS_THREADS_MAX);
+
+	if (!argc || !argv)
+		goto usage;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:N:b:l:j:ph")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'N':
+			new_name = optarg;
+			break;
+		case 'b':
+			block_kb = atol(optarg);
+			break;
+		case 'l':
+			level = atoi(optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'p':
+			progress = 1;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || !new_name) {
+		fprintf(stderr, "Must supply both VHD and image names\n");
+		goto usage;
+	}
+
+	if (block_kb < ZIMG_BLOCK_MIN >> 10 || block_kb > ZIMG_BLOCK_MAX >> 10 ||
+	    (block_kb & (block_kb - 1))) {
+		fprintf(stderr, "Block size must be a power of two from "
+			"%d to %d KiB\n", ZIMG_BLOCK_MIN >> 10,
+			ZIMG_BLOCK_MAX >> 10);
+		goto usage;
+	}
+
+	if (level < Z_BEST_SPEED || level > Z_BEST_COMPRESSION) {
+		fprintf(stderr, "Level must be %d to %d\n",
+			Z_BEST_SPEED, Z_BEST_COMPRESSION);
+		goto usage;
+	}
+
+	if (threads < 1 || threads > VHD_COMPRESS_THREADS_MAX) {
+		fprintf(stderr, "Threads must be 1 to %d\n",
+			VHD_COMPRESS_THREADS_MAX);
+		goto usage;
+	}
+
+	return compress_vhd(name, new_name, block_kb << 10, level, threads,
+			    progress);
+
+usage:
+	printf("options: -n <name> -N <new image name> [-b <block KiB>] "
+	       "[-l <level 1-9>] [-j <threads>] [-p progress] [-h help]\n"
+	       "Writes the contents of the VHD chain to a compressed, "
+	       "read-only image,\nwhich a VHD can take as its raw parent "
+	       "(vhd-util modify -p <image> -m).\n");
+	return -EINVAL;
+}
@@ -43,6 +43,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "libvhd.h"
 
@@ -55,9 +58,17 @@ typedef int (*vhd_open_crypto)(vhd_context_t *, const uint8_t *, size_t,
 typedef int (*vhd_crypto_encrypt_block)(vhd_context_t *, uint64_t,
 					uint8_t *, uint8_t *,
 					unsigned int);
+typedef struct crypto_blkcipher *(*vhd_crypto_clone)(vhd_context_t *);
+typedef void (*vhd_crypto_free)(struct crypto_blkcipher *);
+typedef int (*vhd_crypto_encrypt_sectors_with)(struct crypto_blkcipher *,
+					       uint64_t, uint8_t *, uint8_t *,
+					       unsigned int);
 vhd_calculate_keyhash pvhd_calculate_keyhash;
 vhd_open_crypto pvhd_open_crypto;
 vhd_crypto_encrypt_block pvhd_crypto_encrypt_block;
+vhd_crypto_clone pvhd_crypto_clone;
+vhd_crypto_free pvhd_crypto_free;
+vhd_crypto_encrypt_sectors_with pvhd_crypto_encrypt_sectors_with;
 void *crypto_handle;
 
 static int
@@ -86,64 +97,492 @@ __load_crypto()
 	if (!pvhd_crypto_encrypt_block) {
 		return -EINVAL;
 	}
+
+	/* optional, for encrypting on several threads */
+	pvhd_crypto_clone = (struct crypto_blkcipher *(*)(vhd_context_t *))
+		dlsym(crypto_handle, "vhd_crypto_clone");
+	pvhd_crypto_free = (void (*)(struct crypto_blkcipher *))
+		dlsym(crypto_handle, "vhd_crypto_free");
+	pvhd_crypto_encrypt_sectors_with =
+		(int (*)(struct crypto_blkcipher *, uint64_t, uint8_t *,
+			 uint8_t *, unsigned int))
+		dlsym(crypto_handle, "vhd_crypto_encrypt_sectors_with");
+	if (!pvhd_crypto_clone || !pvhd_crypto_free ||
+	    !pvhd_crypto_encrypt_sectors_with)
+		pvhd_crypto_clone = NULL;
+
 	return 0;
 }
 
+#define VHD_COPY_THREADS_MAX	16
+
+/*
+ * Blocks move through a ring of slots: the main thread reads them in,
+ * crypto workers encrypt them in any order and a writer thread writes
+ * them out in block order, so reads, encryption and writes overlap.
+ */
+enum {
+	VHD_COPY_FREE,
+	VHD_COPY_READ,
+	VHD_COPY_CRYPT,
+	VHD_COPY_READY,
+};
+
+struct vhd_copy_slot {
+	uint64_t		block;
+	void			*buf;
+	char			*map;
+	int			state;
+};
+
+struct vhd_copy {
+	vhd_context_t		*source;
+	vhd_context_t		*target;
+
+	struct vhd_copy_slot	*slots;
+	int			depth;
+	uint64_t		head;
+	uint64_t		tail;
+	int			done;
+	int			err;
+
+	uint64_t		next;       /* first block left to the pipeline */
+	int			progress;
+	uint64_t		blocks;
+	uint64_t		copied;
+	struct timeval		start;
+	struct timeval		last;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+};
+
+struct vhd_copy_worker {
+	struct vhd_copy		*copy;
+	struct crypto_blkcipher	*tfm;
+	pthread_t		thread;
+};
+
+static void
+vhd_copy_fail(struct vhd_copy *c, int err)
+{
+	if (!c->err)
+		c->err = err;
+	pthread_cond_broadcast(&c->cond);
+}
+
 static int
-vhd_encrypt_copy_block(vhd_context_t *source_vhd, vhd_context_t *target_vhd, uint64_t block)
+vhd_copy_encrypt(struct vhd_copy_worker *w, struct vhd_copy_slot *slot)
+{
+	vhd_context_t *source = w->copy->source;
+	vhd_context_t *target = w->copy->target;
+	uint64_t sec = slot->block * source->spb;
+	uint32_t i, end;
+	int err;
+
+	for (i = vhd_bitmap_scan(source, slot->map, 0, source->spb, 1);
+	     i < source->spb;
+	     i = vhd_bitmap_scan(source, slot->map, end, source->spb, 1)) {
+		end = vhd_bitmap_scan(source, slot->map, i, source->spb, 0);
+
+		if (w->tfm) {
+			uint8_t *ptr = slot->buf + i * VHD_SECTOR_SIZE;
+
+			err = pvhd_crypto_encrypt_sectors_with(w->tfm, sec + i,
+							       ptr, ptr, end - i);
+			if (err)
+				return err;
+			continue;
+		}
+
+		for (; i < end; i++) {
+			void *blk_ptr = slot->buf + i * VHD_SECTOR_SIZE;
+			pvhd_crypto_encrypt_block(target, sec + i, blk_ptr,
+						  blk_ptr, VHD_SECTOR_SIZE);
+		}
+	}
+
+	return 0;
+}
+
+static void *
+vhd_copy_crypt_thread(void *arg)
 {
+	struct vhd_copy_worker *w = arg;
+	struct vhd_copy *c = w->copy;
+	struct vhd_copy_slot *slot;
+	uint64_t seq;
 	int err;
-	int i;
-	void *buf;
+
+	pthread_mutex_lock(&c->lock);
+
+	while (!c->err) {
+		slot = NULL;
+		for (seq = c->tail; seq < c->head; seq++)
+			if (c->slots[seq % c->depth].state == VHD_COPY_READ) {
+				slot = &c->slots[seq % c->depth];
+				break;
+			}
+
+		if (!slot) {
+			if (c->done)
+				break;
+			pthread_cond_wait(&c->cond, &c->lock);
+			continue;
+		}
+
+		slot->state = VHD_COPY_CRYPT;
+		pthread_mutex_unlock(&c->lock);
+
+		err = vhd_copy_encrypt(w, slot);
+
+		pthread_mutex_lock(&c->lock);
+		if (err) {
+			printf("Failed to encrypt block %"PRIu64": %d\n",
+			       slot->block, err);
+			vhd_copy_fail(c, err);
+			break;
+		}
+
+		slot->state = VHD_COPY_READY;
+		pthread_cond_broadcast(&c->cond);
+	}
+
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+static void
+vhd_copy_report(struct vhd_copy *c, uint64_t copied, int final)
+{
+	struct timeval now, t;
+	double secs, mb;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &c->last, &t);
+	if (!final && !t.tv_sec)
+		return;
+
+	c->last = now;
+	timersub(&now, &c->start, &t);
+	secs = t.tv_sec + t.tv_usec / 1000000.0;
+	mb   = (double)copied * c->source->header.block_size / (1000 * 1000);
+
+	printf("\r%6.2f%% %.1f MB/s",
+	       c->blocks ? (float)copied / (float)c->blocks * 100.00 : 100.00,
+	       secs > 0 ? mb / secs : 0);
+	if (final)
+		printf("\n");
+	fflush(stdout);
+}
+
+static void *
+vhd_copy_write_thread(void *arg)
+{
+	struct vhd_copy *c = arg;
+	struct vhd_copy_slot *slot;
+	uint64_t copied = c->copied;
+	int err;
+
+	pthread_mutex_lock(&c->lock);
+
+	while (!c->err) {
+		slot = &c->slots[c->tail % c->depth];
+
+		if (c->tail == c->head || slot->state != VHD_COPY_READY) {
+			if (c->tail == c->head && c->done)
+				break;
+			pthread_cond_wait(&c->cond, &c->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&c->lock);
+
+		err = vhd_io_write(c->target, slot->buf,
+				   slot->block * c->source->spb,
+				   c->source->spb);
+		if (err)
+			printf("Failed to write block %"PRIu64" : %d\n",
+			       slot->block, err);
+		else if (c->progress)
+			vhd_copy_report(c, ++copied, 0);
+
+		pthread_mutex_lock(&c->lock);
+		if (err) {
+			vhd_copy_fail(c, err);
+			break;
+		}
+
+		free(slot->map);
+		slot->map   = NULL;
+		slot->state = VHD_COPY_FREE;
+		c->tail++;
+		pthread_cond_broadcast(&c->cond);
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	if (c->progress && !c->err)
+		vhd_copy_report(c, copied, 1);
+
+	return NULL;
+}
+
+/*
+ * Reads allocated blocks of the source in order and queues them. Blocks
+ * with nothing in their bitmap are skipped unless the source has a
+ * parent that their sectors would be read from.
+ */
+static int
+vhd_copy_read(struct vhd_copy *c, int encrypt)
+{
+	vhd_context_t *source = c->source;
+	struct vhd_copy_slot *slot;
+	uint64_t blk;
 	char *map;
-	uint64_t sec;
+	int err = 0;
+
+	for (blk = c->next; blk < source->bat.entries; blk++) {
+		if (source->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
 
-	buf = NULL;
-	map = NULL;
-	sec = block * source_vhd->spb;
+		map = NULL;
+		err = vhd_read_bitmap(source, blk, &map);
+		if (err)
+			break;
 
-	if (source_vhd->bat.bat[block] == DD_BLK_UNUSED)
-		return 0;
+		if (source->footer.type != HD_TYPE_DIFF &&
+		    vhd_bitmap_scan(source, map, 0, source->spb, 1) >= source->spb) {
+			vhd_buf_put(source, map,
+				    vhd_sectors_to_bytes(source->bm_secs));
+			continue;
+		}
 
-	err = posix_memalign(&buf, 4096, source_vhd->header.block_size);
-	if (err)
-		return -err;
+		pthread_mutex_lock(&c->lock);
+		while (!c->err && c->head - c->tail == c->depth)
+			pthread_cond_wait(&c->cond, &c->lock);
+		err  = c->err;
+		slot = &c->slots[c->head % c->depth];
+		pthread_mutex_unlock(&c->lock);
 
-	err = vhd_io_read(source_vhd, buf, sec, source_vhd->spb);
-	if (err)
-		goto done;
+		if (!err)
+			err = vhd_io_read(source, slot->buf, blk * source->spb,
+					  source->spb);
+		if (err) {
+			free(map);
+			break;
+		}
 
-	err = vhd_read_bitmap(source_vhd, block, &map);
+		pthread_mutex_lock(&c->lock);
+		slot->block = blk;
+		slot->map   = map;
+		slot->state = encrypt ? VHD_COPY_READ : VHD_COPY_READY;
+		c->head++;
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	pthread_mutex_lock(&c->lock);
 	if (err)
-		goto done;
-
-	if (target_vhd->xts_tfm) {
-		/* If the target is encryted, encrypt each block with data */
-		for (i = 0; i < source_vhd->spb; i++) {
-			if (vhd_bitmap_test(source_vhd, map, i)) {
-				void * blk_ptr = buf + i * VHD_SECTOR_SIZE;
-				pvhd_crypto_encrypt_block(target_vhd, sec + i, blk_ptr, blk_ptr, VHD_SECTOR_SIZE);
+		vhd_copy_fail(c, err);
+	c->done = 1;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+
+	return err;
+}
+
+/*
+ * Copies the allocated sectors of a block server side, or the whole
+ * block through @buf if some of it is to be read from the parents.
+ */
+static int
+vhd_copy_offload_block(struct vhd_copy *c, uint64_t blk, char *map, void *buf)
+{
+	vhd_context_t *source = c->source;
+	uint64_t sec = blk * source->spb;
+	uint32_t i, end;
+	int err;
+
+	if (vhd_bitmap_full(source, map))
+		return vhd_io_copy(c->target, source, sec, source->spb);
+
+	if (source->footer.type == HD_TYPE_DIFF) {
+		err = vhd_io_read(source, buf, sec, source->spb);
+		if (err)
+			return err;
+		return vhd_io_write(c->target, buf, sec, source->spb);
+	}
+
+	for (i = vhd_bitmap_scan(source, map, 0, source->spb, 1);
+	     i < source->spb;
+	     i = vhd_bitmap_scan(source, map, end, source->spb, 1)) {
+		end = vhd_bitmap_scan(source, map, i, source->spb, 0);
+
+		err = vhd_io_copy(c->target, source, sec + i, end - i);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Unencrypted copies go server side (reflinks, copy_file_range()) block
+ * by block for as long as the files allow it. The first block that
+ * cannot, and all after it, are left to the buffered pipeline.
+ */
+static int
+vhd_copy_offload(struct vhd_copy *c, void *buf)
+{
+	vhd_context_t *source = c->source;
+	uint64_t blk;
+	char *map;
+	int err;
+
+	for (blk = 0; blk < source->bat.entries; blk++) {
+		if (source->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+
+		map = NULL;
+		err = vhd_read_bitmap(source, blk, &map);
+		if (err)
+			return err;
+
+		err = vhd_copy_offload_block(c, blk, map, buf);
+		vhd_buf_put(source, map, vhd_sectors_to_bytes(source->bm_secs));
+		if (err == -EOPNOTSUPP)
+			break;
+		if (err) {
+			printf("Failed to copy block %"PRIu64" : %d\n",
+			       blk, err);
+			return err;
+		}
+
+		if (c->progress)
+			vhd_copy_report(c, ++c->copied, 0);
+	}
+
+	c->next = blk;
+	return 0;
+}
+
+static int
+vhd_copy_blocks(vhd_context_t *source, vhd_context_t *target, int threads,
+		int progress, int offload)
+{
+	struct vhd_copy_worker workers[VHD_COPY_THREADS_MAX];
+	struct vhd_copy c;
+	pthread_t writer;
+	int i, err, encrypt, nworkers, started;
+	uint64_t blk;
+
+	memset(&c, 0, sizeof(c));
+	memset(workers, 0, sizeof(workers));
+	c.source   = source;
+	c.target   = target;
+	c.progress = progress;
+	encrypt    = !!target->xts_tfm;
+	nworkers   = 0;
+	started    = 0;
+
+	/* without per-thread ciphers, encrypting stays on one thread */
+	if (encrypt)
+		nworkers = pvhd_crypto_clone ? threads : 1;
+
+	c.depth = 2 * (nworkers + 1);
+	c.slots = calloc(c.depth, sizeof(*c.slots));
+	if (!c.slots)
+		return -ENOMEM;
+
+	for (i = 0; i < c.depth; i++) {
+		err = posix_memalign(&c.slots[i].buf, 4096,
+				     source->header.block_size);
+		if (err) {
+			c.slots[i].buf = NULL;
+			err = -err;
+			goto out;
+		}
+	}
+
+	if (pvhd_crypto_clone)
+		for (i = 0; i < nworkers; i++) {
+			workers[i].tfm = pvhd_crypto_clone(target);
+			if (!workers[i].tfm) {
+				printf("Failed to set up cipher for thread %d\n", i);
+				err = -EINVAL;
+				goto out;
 			}
 		}
+
+	for (blk = 0; blk < source->bat.entries; blk++)
+		if (source->bat.bat[blk] != DD_BLK_UNUSED)
+			c.blocks++;
+
+	pthread_mutex_init(&c.lock, NULL);
+	pthread_cond_init(&c.cond, NULL);
+	gettimeofday(&c.start, NULL);
+	c.last = c.start;
+
+	if (offload && !encrypt) {
+		err = vhd_copy_offload(&c, c.slots[0].buf);
+		if (err)
+			goto destroy;
 	}
 
-	err = vhd_io_write(target_vhd, buf, sec, source_vhd->spb);
-	if (err) {
-		printf("Failed to write block %lu : %d\n", block, err);
+	err = -pthread_create(&writer, NULL, vhd_copy_write_thread, &c);
+	if (err)
+		goto destroy;
+
+	for (; started < nworkers; started++) {
+		workers[started].copy = &c;
+		err = -pthread_create(&workers[started].thread, NULL,
+				      vhd_copy_crypt_thread, &workers[started]);
+		if (err) {
+			pthread_mutex_lock(&c.lock);
+			vhd_copy_fail(&c, err);
+			pthread_mutex_unlock(&c.lock);
+			break;
+		}
+	}
+
+	if (!err)
+		vhd_copy_read(&c, encrypt);
+	else {
+		pthread_mutex_lock(&c.lock);
+		c.done = 1;
+		pthread_cond_broadcast(&c.cond);
+		pthread_mutex_unlock(&c.lock);
 	}
 
-done:
-	free(buf);
-	free(map);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+	pthread_join(writer, NULL);
+
+	err = c.err;
+
+destroy:
+	pthread_cond_destroy(&c.cond);
+	pthread_mutex_destroy(&c.lock);
+out:
+	for (i = 0; i < nworkers; i++)
+		if (workers[i].tfm)
+			pvhd_crypto_free(workers[i].tfm);
+	for (i = 0; i < c.depth; i++) {
+		free(c.slots[i].buf);
+		free(c.slots[i].map);
+	}
+	free(c.slots);
 
 	return err;
 }
 
 static int
-copy_vhd(const char *name, const char *new_name, int key_size, const uint8_t *encryption_key)
+copy_vhd(const char *name, const char *new_name, int key_size,
+	 const uint8_t *encryption_key, int threads, int progress,
+	 int offload)
 {
 	int err = 0;
-	int i;
 
 	vhd_context_t source_vhd, target_vhd;
 	struct vhd_keyhash keyhash;
@@ -157,7 +596,8 @@ copy_vhd(const char *name, const char *new_name, int key_size, const uint8_t *en
 
 	memset(&keyhash, 0, sizeof(keyhash));
 
-	err = vhd_open(&source_vhd, name, VHD_OPEN_RDONLY);
+	err = vhd_open(&source_vhd, name,
+		       VHD_OPEN_RDONLY | VHD_OPEN_CACHE_BITMAPS);
 	if (err) {
 		printf("error opening %s: %d\n", name, err);
 		return -err;
@@ -169,8 +609,9 @@ copy_vhd(const char *name, const char *new_name, int key_size, const uint8_t *en
 		return -EINVAL;
 	}
 
-	err = vhd_create(new_name, source_vhd.footer.curr_size,
-			 source_vhd.footer.type, source_vhd.footer.curr_size, 0);
+	err = vhd_create_ext(new_name, source_vhd.footer.curr_size,
+			     source_vhd.footer.type, source_vhd.footer.curr_size,
+			     1U << vhd_block_shift(&source_vhd), 0);
 
 	if (err) {
 		printf("error creating %s: %d\n", new_name, err);
@@ -221,12 +662,11 @@ copy_vhd(const char *name, const char *new_name, int key_size, const uint8_t *en
 			goto out;
 	}
 
-	for (i = 0; i < source_vhd.bat.entries; i++) {
-		err = vhd_encrypt_copy_block(&source_vhd, &target_vhd, i);
-		if (err) {
-			printf("Failed to encrypt block %d: %d\n", i, err);
-			goto out;
-		}
+	err = vhd_copy_blocks(&source_vhd, &target_vhd, threads, progress,
+			      offload);
+	if (err) {
+		printf("Failed to copy %s: %d\n", name, err);
+		goto out;
 	}
 
 out:
@@ -267,11 +707,18 @@ vhd_util_copy(int argc, char **argv)
 	int key_fd;
 	int key_size;
 	int err;
+	int threads;
+	int progress;
+	int offload;
 
 	name = NULL;
 	new_name = NULL;
 	encryption_key = NULL;
 	key_size = 0;
+	progress = 0;
+	offload = 1;
+	threads = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1),
+		      VHD_COPY_THREADS_MAX);
 
 
 	if (!argc || !argv)
@@ -279,7 +726,7 @@ vhd_util_copy(int argc, char **argv)
 
 	optind = 0;
 
-	while ((c = getopt(argc, argv, "n:N:k:Eh")) != -1) {
+	while ((c = getopt(argc, argv, "n:N:k:Ej:pBh")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -314,6 +761,20 @@ vhd_util_copy(int argc, char **argv)
 				return -err;
 			}
 			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > VHD_COPY_THREADS_MAX) {
+				fprintf(stderr, "Threads must be 1 to %d\n",
+					VHD_COPY_THREADS_MAX);
+				goto usage;
+			}
+			break;
+		case 'p':
+			progress = 1;
+			break;
+		case 'B':
+			offload = 0;
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -325,11 +786,13 @@ vhd_util_copy(int argc, char **argv)
 		goto usage;
 	}
 
-	return copy_vhd(name, new_name, key_size, encryption_key);
+	return copy_vhd(name, new_name, key_size, encryption_key, threads,
+			progress, offload);
 usage:
 	printf("options: -n <name> -N <new VHD name> "
 	       "[-k <keyfile> | -E (pass encryption key on stdin)] "
-	       "[-h help] \n");
+	       "[-j <encryption threads>] [-p progress] "
+	       "[-B no server side copy] [-h help] \n");
 	if (encryption_key) {
 		free(encryption_key);
 	}
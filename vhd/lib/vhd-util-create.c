@@ -43,13 +43,14 @@ int
 vhd_util_create(int argc, char **argv)
 {
 	char *name;
-	uint64_t size, msize;
+	uint64_t size, msize, bsize;
 	int c, sparse, err;
 	vhd_flag_creat_t flags;
 
 	err       = -EINVAL;
 	size      = 0;
 	msize     = 0;
+	bsize     = VHD_BLOCK_SIZE >> 20;
 	sparse    = 1;
 	name      = NULL;
 	flags     = 0;
@@ -58,7 +59,7 @@ vhd_util_create(int argc, char **argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:s:S:rh")) != -1) {
+	while ((c = getopt(argc, argv, "n:s:S:B:rh")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -71,6 +72,9 @@ vhd_util_create(int argc, char **argv)
 			err = 0;
 			msize = strtoull(optarg, NULL, 10);
 			break;
+		case 'B':
+			bsize = strtoull(optarg, NULL, 10);
+			break;
 		case 'r':
 			sparse = 0;
 			break;
@@ -88,13 +92,21 @@ vhd_util_create(int argc, char **argv)
 		return -EINVAL;
 	}
 
-	return vhd_create(name, size << 20,
+	if (!bsize || bsize > (1ULL << VHD_BLOCK_SHIFT_MAX) >> 20 ||
+	    (bsize & (bsize - 1))) {
+		printf("Error: <-B block size> must be a power of two "
+		       "up to %llu\n", (1ULL << VHD_BLOCK_SHIFT_MAX) >> 20);
+		return -EINVAL;
+	}
+
+	return vhd_create_ext(name, size << 20,
 				  (sparse ? HD_TYPE_DYNAMIC : HD_TYPE_FIXED),
-				  msize << 20, flags);
+				  msize << 20, bsize << 20, flags);
 
 usage:
 	printf("options: <-n name> <-s size (MB)> [-r reserve] [-h help] "
 			"[<-S size (MB) for metadata preallocation "
-			"(see vhd-util resize)>]\n");
+			"(see vhd-util resize)>] "
+			"[-B block size (MB), default 2]\n");
 	return -EINVAL;
 }
@@ -40,9 +40,14 @@
 #include <limits.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <libaio.h>
+#include <sys/mman.h>
 
 #include "libvhd.h"
 
+#define VHD_FILL_DEPTH             64
+#define VHD_FILL_ZERO_CHUNK        (8 << 20)
+
 #ifndef ULLONG_MAX
 #define ULLONG_MAX (~0ULL)
 #endif
@@ -151,6 +156,250 @@ out:
 	return err;
 }
 
+static int
+vhd_fill_write_zeros(int fd, off64_t off, off64_t len)
+{
+	size_t size;
+	ssize_t ret;
+	char *zeros;
+
+	size  = MIN(len, VHD_FILL_ZERO_CHUNK);
+	zeros = mmap(0, size, PROT_READ, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (zeros == MAP_FAILED)
+		return -errno;
+
+	while (len) {
+		ret = pwrite(fd, zeros, MIN(len, size), off);
+		if (ret <= 0) {
+			munmap(zeros, size);
+			return (ret ? -errno : -EIO);
+		}
+		off += ret;
+		len -= ret;
+	}
+
+	munmap(zeros, size);
+	return 0;
+}
+
+/*
+ * allocates [off, off + len) and makes it read as zeros: in one
+ * FALLOC_FL_ZERO_RANGE call where the filesystem has it, otherwise by
+ * reserving the range and writing zeros over what lay below the old end
+ * of file, and only writing it all out where even that is unsupported
+ */
+static int
+vhd_fill_zero_range(int fd, off64_t off, off64_t len)
+{
+	off64_t eof, stale;
+
+#ifdef FALLOC_FL_ZERO_RANGE
+	if (!fallocate(fd, FALLOC_FL_ZERO_RANGE, off, len))
+		return 0;
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		return -errno;
+#endif
+
+	eof = lseek64(fd, 0, SEEK_END);
+	if (eof == (off64_t)-1)
+		return -errno;
+
+	if (fallocate(fd, 0, off, len)) {
+		if (errno != EOPNOTSUPP && errno != ENOSYS)
+			return -errno;
+		return vhd_fill_write_zeros(fd, off, len);
+	}
+
+	stale = eof > off ? MIN(eof - off, len) : 0;
+	return stale ? vhd_fill_write_zeros(fd, off, stale) : 0;
+}
+
+/*
+ * writes a fully set bitmap at each of the n sector offsets, up to
+ * VHD_FILL_DEPTH at a time
+ */
+static int
+vhd_fill_write_bitmaps(vhd_context_t *ctx, const uint64_t *secs, uint32_t n)
+{
+	struct iocb iocbs[VHD_FILL_DEPTH], *piocbs[VHD_FILL_DEPTH];
+	struct io_event events[VHD_FILL_DEPTH];
+	io_context_t aio = 0;
+	size_t size;
+	void *map;
+	uint32_t i, j, cnt;
+	int err, got;
+
+	size = vhd_sectors_to_bytes(ctx->bm_secs);
+
+	err = posix_memalign(&map, VHD_SECTOR_SIZE, size);
+	if (err)
+		return -err;
+
+	memset(map, 0, size);
+	for (i = 0; i < ctx->spb; i++)
+		vhd_bitmap_set(ctx, map, i);
+
+	if (io_setup(VHD_FILL_DEPTH, &aio))
+		aio = 0;
+
+	for (i = 0; i < n; i += cnt) {
+		cnt = MIN(n - i, VHD_FILL_DEPTH);
+
+		if (!aio) {
+			for (j = 0; j < cnt; j++)
+				if (pwrite(ctx->fd, map, size,
+					   vhd_sectors_to_bytes(secs[i + j])) !=
+				    size) {
+					err = errno ? -errno : -EIO;
+					goto out;
+				}
+			continue;
+		}
+
+		for (j = 0; j < cnt; j++) {
+			io_prep_pwrite(&iocbs[j], ctx->fd, map, size,
+				       vhd_sectors_to_bytes(secs[i + j]));
+			piocbs[j] = &iocbs[j];
+		}
+
+		err = io_submit(aio, cnt, piocbs);
+		if (err != cnt) {
+			err = err < 0 ? err : -EIO;
+			goto out;
+		}
+
+		for (got = 0; got < cnt; ) {
+			err = io_getevents(aio, cnt - got, cnt - got,
+					   events, NULL);
+			if (err == -EINTR)
+				continue;
+			if (err < 0)
+				goto out;
+
+			for (j = 0; j < err; j++)
+				if (events[j].res != size) {
+					err = -EIO;
+					goto out;
+				}
+
+			got += err;
+		}
+	}
+
+	err = 0;
+
+out:
+	if (aio)
+		io_destroy(aio);
+	free(map);
+	return err;
+}
+
+/*
+ * Thick provisioning: lays out every unallocated block in the range
+ * after the end of data at once, allocates and zeroes their space with
+ * one fallocate, writes their bitmaps fully set in batches, and only then
+ * publishes them through the BAT and the footer. A crash before the BAT
+ * is written leaves the image as it was, with unused space past its end.
+ * Allocated blocks are left alone. Differencing disks are refused, as
+ * zeroed sectors would hide the parent's data.
+ */
+static int
+vhd_io_preallocate_blocks(vhd_context_t *ctx, const uint32_t from_extent,
+		const uint32_t to_extent, const bool ignore_2tb_limit)
+{
+	off64_t eod;
+	uint64_t max, *secs;
+	uint32_t i, n;
+	int err, spp;
+
+	assert(ctx);
+	assert(from_extent <= to_extent);
+
+	if (ctx->footer.type == HD_TYPE_DIFF)
+		return -EINVAL;
+
+	spp = getpagesize() >> VHD_SECTOR_SHIFT;
+
+	err = vhd_end_of_data(ctx, &eod);
+	if (err)
+		return err;
+
+	secs = calloc(to_extent - from_extent + 1, sizeof(*secs));
+	if (!secs)
+		return -ENOMEM;
+
+	n   = 0;
+	max = eod >> VHD_SECTOR_SHIFT;
+
+	for (i = from_extent; i <= to_extent; i++) {
+		if (ctx->bat.bat[i] != DD_BLK_UNUSED)
+			continue;
+
+		/* data region of segment should begin on page boundary */
+		if ((max + ctx->bm_secs) % spp)
+			max += spp - ((max + ctx->bm_secs) % spp);
+
+		if (max > UINT_MAX && !ignore_2tb_limit) {
+			printf("sector offset for extent %u exceeds the 2 TB limit\n", i);
+			err = -EOVERFLOW;
+			goto out;
+		}
+
+		secs[n++] = max;
+		max += ctx->bm_secs + ctx->spb;
+	}
+
+	if (!n)
+		goto out;
+
+	err = vhd_fill_zero_range(ctx->fd, eod,
+				  vhd_sectors_to_bytes(max) - eod);
+	if (err) {
+		printf("failed to allocate space: %s\n", strerror(-err));
+		goto out;
+	}
+
+	err = vhd_fill_write_bitmaps(ctx, secs, n);
+	if (err) {
+		printf("failed to initialise bitmaps: %s\n", strerror(-err));
+		goto out;
+	}
+
+	if (fdatasync(ctx->fd)) {
+		err = -errno;
+		goto out;
+	}
+
+	if (vhd_has_batmap(ctx)) {
+		err = vhd_get_batmap(ctx);
+		if (err)
+			goto out;
+	}
+
+	for (i = from_extent, n = 0; i <= to_extent; i++)
+		if (ctx->bat.bat[i] == DD_BLK_UNUSED) {
+			ctx->bat.bat[i] = secs[n++];
+			vhd_batmap_set(ctx, &ctx->batmap, i);
+		}
+
+	err = vhd_write_bat(ctx, &ctx->bat);
+	if (err)
+		goto out;
+
+	if (vhd_has_batmap(ctx)) {
+		err = vhd_write_batmap(ctx, &ctx->batmap);
+		if (err)
+			goto out;
+	}
+
+	err = vhd_write_footer(ctx, &ctx->footer);
+
+out:
+	free(secs);
+	return err;
+}
+
 int
 vhd_util_fill(int argc, char **argv)
 {
@@ -159,12 +408,13 @@ vhd_util_fill(int argc, char **argv)
 	void *buf;
 	vhd_context_t vhd;
 	uint64_t i, sec, secs, from_sector, to_sector;
-	int init_bat;
+	int init_bat, prealloc;
 	bool ignore_2tb_limit;
 
 	buf          = NULL;
 	name         = NULL;
 	init_bat     = 0;
+	prealloc     = 0;
 	from_sector  = ULLONG_MAX;
 	to_sector    = ULLONG_MAX;
 	ignore_2tb_limit = false;
@@ -173,7 +423,7 @@ vhd_util_fill(int argc, char **argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:f:t:bBh")) != -1) {
+	while ((c = getopt(argc, argv, "n:f:t:bzBh")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -187,6 +437,10 @@ vhd_util_fill(int argc, char **argv)
 		case 'b':
 			init_bat = 1;
 			break;
+		case 'z':
+			init_bat = 1;
+			prealloc = 1;
+			break;
 		case 'B':
 			ignore_2tb_limit = true;
 			break;
@@ -240,8 +494,12 @@ vhd_util_fill(int argc, char **argv)
 			to_extent = to_sector / vhd.spb;
 		else
 			to_extent = vhd.bat.entries - 1;
-		err = vhd_io_allocate_blocks_fast(&vhd, from_extent, to_extent,
-				ignore_2tb_limit);
+		if (prealloc)
+			err = vhd_io_preallocate_blocks(&vhd, from_extent,
+					to_extent, ignore_2tb_limit);
+		else
+			err = vhd_io_allocate_blocks_fast(&vhd, from_extent,
+					to_extent, ignore_2tb_limit);
 		if (err)
 			goto done;
 	} else {
@@ -276,9 +534,11 @@ done:
 
 usage:
 	printf("options: <-n name> [-h help] [-b initialise the BAT and bitmaps, "
-			"don't write to the data blocks (much faster)] [-f start "
-			"intialisation from this sector, only usable with -b] [-t "
-			"intialise up to this sector (inclusive), only usable with -b] "
-			"[-B ignore the 2 TB limit, only usable with -b]\n");
+			"don't write to the data blocks (much faster)] [-z like -b, but "
+			"also allocate and zero the data blocks, skipping allocated "
+			"ones] [-f start "
+			"intialisation from this sector, only usable with -b/-z] [-t "
+			"intialise up to this sector (inclusive), only usable with "
+			"-b/-z] [-B ignore the 2 TB limit, only usable with -b/-z]\n");
 	return -EINVAL;
 }
@@ -47,6 +47,7 @@ vhd_util_query(int argc, char **argv)
 	vhd_context_t vhd;
 	off64_t currsize;
 	int ret, err, c, size, physize, parent, fields, depth, fastresize, marker, allocated;
+	int allocated_bytes;
 
 	name       = NULL;
 	size       = 0;
@@ -57,6 +58,7 @@ vhd_util_query(int argc, char **argv)
 	fastresize = 0;
 	marker     = 0;
 	allocated  = 0;
+	allocated_bytes = 0;
 
 	if (!argc || !argv) {
 		err = -EINVAL;
@@ -64,7 +66,7 @@ vhd_util_query(int argc, char **argv)
 	}
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:vspfdSmah")) != -1) {
+	while ((c = getopt(argc, argv, "n:vspfdSmaAh")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -93,6 +95,9 @@ vhd_util_query(int argc, char **argv)
 		case 'a':
 			allocated = 1;
 			break;
+		case 'A':
+			allocated_bytes = 1;
+			break;
 		case 'h':
 			err = 0;
 			goto usage;
@@ -181,18 +186,25 @@ vhd_util_query(int argc, char **argv)
 	}
 
 	if (allocated) {
-		ret = vhd_get_bat(&vhd);
+		uint64_t used;
+
+		ret = vhd_allocated(&vhd, &used, NULL);
 		if (ret)
 			printf("error reading bat: %d\n", ret);
-		else {
-			uint32_t i, used;
+		else
+			printf("%"PRIu64"\n", used);
+
+		err = (err ? : ret);
+	}
 
-			for (i = 0, used = 0; i < vhd.bat.entries; i++)
-				if (vhd.bat.bat[i] != DD_BLK_UNUSED)
-					used++;
+	if (allocated_bytes) {
+		uint64_t secs;
 
-			printf("%u\n", used);
-		}
+		ret = vhd_allocated(&vhd, NULL, &secs);
+		if (ret)
+			printf("error counting allocated sectors: %d\n", ret);
+		else
+			printf("%"PRIu64"\n", secs << VHD_SECTOR_SHIFT);
 
 		err = (err ? : ret);
 	}
@@ -200,7 +212,8 @@ vhd_util_query(int argc, char **argv)
 	if (fastresize) {
 		uint64_t max_size;
 
-		max_size = vhd.header.max_bat_size << (VHD_BLOCK_SHIFT - 20);
+		max_size = (uint64_t)vhd.header.max_bat_size <<
+			(vhd_block_shift(&vhd) - 20);
 		printf("%"PRIu64"\n", max_size);
 	}
 		
@@ -212,6 +225,7 @@ usage:
 	       "[-s print physical utilization (bytes)] [-p print parent] "
 	       "[-f print fields] [-m print marker] [-d print chain depth] "
 	       "[-S print max virtual size (MB) for fast resize] "
-	       "[-a print allocated block count] [-h help]\n");
+	       "[-a print allocated block count] "
+	       "[-A print allocated bytes] [-h help]\n");
 	return err;
 }
@@ -542,9 +542,9 @@ vhd_print_bitmap_extents(vhd_context_t *vhd, uint64_t sector, int count,
 			 int hex)
 {
 	char *buf;
-	uint64_t cur;
-	int i, err, bit;
-	uint32_t blk, bm_blk, sec;
+	uint64_t cur, end;
+	int err;
+	uint32_t blk, sec, lim, next;
 	int64_t s, r;
 
 	if (vhd_sectors_to_bytes(sector + count) > vhd->footer.curr_size) {
@@ -552,44 +552,53 @@ vhd_print_bitmap_extents(vhd_context_t *vhd, uint64_t sector, int count,
 		return -ERANGE;
 	}
 
-	bm_blk = -1;
-	buf    = NULL;
+	buf = NULL;
 	s = -1;
 	r = 0;
 
-	for (i = 0; i < count; i++) {
-		cur = sector + i;
+	cur = sector;
+	end = sector + count;
+
+	while (cur < end) {
 		blk = cur / vhd->spb;
 		sec = cur % vhd->spb;
+		lim = MIN((uint64_t)vhd->spb, sec + (end - cur));
+		cur = (uint64_t)blk * vhd->spb + lim;
 
-		if (blk != bm_blk) {
-			bm_blk = blk;
-			free(buf);
-			buf = NULL;
-
-			if (vhd->bat.bat[blk] != DD_BLK_UNUSED) {
-				err = vhd_read_bitmap(vhd, blk, &buf);
-				if (err)
-					goto out;
-			}
-		}
-
-		if (vhd->bat.bat[blk] == DD_BLK_UNUSED)
-			bit = 0;
-		else
-			bit = vhd_bitmap_test(vhd, buf, sec);
-
-		if (bit) {
-			if (r == 0)
-				s = cur;
-			r++;
-		} else {
+		if (vhd->bat.bat[blk] == DD_BLK_UNUSED) {
 			if (r > 0) {
 				printf("%s ", conv(hex, s));
 				printf("%s\n", conv(hex, r));
 			}
 			r = 0;
+			continue;
 		}
+
+		err = vhd_read_bitmap(vhd, blk, &buf);
+		if (err)
+			goto out;
+
+		while (sec < lim) {
+			next = vhd_bitmap_scan(vhd, buf, sec, lim, 1);
+			if (next != sec) {
+				if (r > 0) {
+					printf("%s ", conv(hex, s));
+					printf("%s\n", conv(hex, r));
+				}
+				r = 0;
+				sec = next;
+				continue;
+			}
+
+			next = vhd_bitmap_scan(vhd, buf, sec, lim, 0);
+			if (r == 0)
+				s = (uint64_t)blk * vhd->spb + sec;
+			r  += next - sec;
+			sec = next;
+		}
+
+		free(buf);
+		buf = NULL;
 	}
 	if (r > 0) {
 		printf("%s ", conv(hex, s));
@@ -844,7 +853,8 @@ vhd_util_read(int argc, char **argv)
 	if (!name || optind != argc)
 		goto usage;
 
-	flags = VHD_OPEN_RDONLY | VHD_OPEN_IGNORE_DISABLED;
+	flags = VHD_OPEN_RDONLY | VHD_OPEN_IGNORE_DISABLED |
+		VHD_OPEN_CACHE_BITMAPS;
 	if (cache)
 		flags |= VHD_OPEN_CACHED | VHD_OPEN_FAST;
 	err = vhd_open(&vhd, name, flags);
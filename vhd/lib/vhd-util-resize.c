@@ -41,9 +41,12 @@
 #include <syslog.h>
 #include <inttypes.h>
 #include <sys/mman.h>
+#include <libaio.h>
 
 #include "libvhd-journal.h"
 
+#define VHD_RESIZE_DEPTH 8 /* block moves in flight */
+
 #if 1
 #define DFPRINTF(_f, _a...) fprintf(stdout, _f, ##_a)
 #else
@@ -241,8 +244,11 @@ quicksort(vhd_block_t *list, int left, int right)
 	quicksort(list, new_pidx + 1, right);
 }
 
+/*
+ * moves block src to offset; the caller must have journaled it
+ */
 static int
-vhd_move_block(vhd_journal_t *journal, uint32_t src, off64_t offset)
+__vhd_move_block(vhd_journal_t *journal, uint32_t src, off64_t offset)
 {
 	int err;
 	char *buf;
@@ -260,11 +266,6 @@ vhd_move_block(vhd_journal_t *journal, uint32_t src, off64_t offset)
 		return -EINVAL;
 	src_off = vhd_sectors_to_bytes(src_off);
 
-	err  = vhd_journal_add_block(journal, src,
-				     VHD_JOURNAL_DATA | VHD_JOURNAL_METADATA);
-	if (err)
-		goto out;
-
 	err  = vhd_read_bitmap(vhd, src, &buf);
 	if (err)
 		goto out;
@@ -277,7 +278,7 @@ vhd_move_block(vhd_journal_t *journal, uint32_t src, off64_t offset)
 	if (err)
 		goto out;
 
-	free(buf);
+	vhd_buf_put(vhd, buf, size);
 	buf   = NULL;
 	off  += size;
 	size  = vhd_sectors_to_bytes(vhd->spb);
@@ -300,7 +301,7 @@ vhd_move_block(vhd_journal_t *journal, uint32_t src, off64_t offset)
 			      vhd_sectors_to_bytes(vhd->bm_secs + vhd->spb));
 
 out:
-	free(buf);
+	vhd_buf_put(vhd, buf, size);
 	return err;
 }
 
@@ -314,12 +315,29 @@ vhd_clobber_block(vhd_journal_t *journal, uint32_t src, uint32_t dest)
 	vhd = &journal->vhd;
 	off = vhd_sectors_to_bytes(vhd->bat.bat[dest]);
 
+	if (vhd->bat.bat[src] == DD_BLK_UNUSED)
+		return -EINVAL;
+
+	/* both blocks go to the journal with a single sync */
+	err = vhd_journal_begin(journal);
+	if (err)
+		return err;
+
 	err = vhd_journal_add_block(journal, dest,
 				    VHD_JOURNAL_DATA | VHD_JOURNAL_METADATA);
+	if (!err)
+		err = vhd_journal_add_block(journal, src,
+					    VHD_JOURNAL_DATA | VHD_JOURNAL_METADATA);
+	if (err) {
+		vhd_journal_end(journal);
+		return err;
+	}
+
+	err = vhd_journal_end(journal);
 	if (err)
 		return err;
 
-	err = vhd_move_block(journal, src, off);
+	err = __vhd_move_block(journal, src, off);
 	if (err)
 		return err;
 
@@ -666,7 +684,7 @@ vhd_check_for_clobber(vhd_context_t *vhd, off64_t off, int mode)
 		vhd_first_data_block(vhd, &fb);
 		if (fb.offset && in_range(off,
 					  vhd_sectors_to_bytes(fb.offset),
-					  VHD_BLOCK_SIZE)) {
+					  vhd->header.block_size)) {
 			msg = "data block";
 			goto fail;
 		}
@@ -887,6 +905,209 @@ vhd_add_bat_entries(vhd_journal_t *journal, int entries)
 	return 0;
 }
 
+/*
+ * journals every allocated block starting at or below sector limit
+ */
+static int
+vhd_journal_blocks_below(vhd_journal_t *journal, uint64_t limit)
+{
+	int err;
+	uint32_t i;
+	vhd_context_t *vhd;
+
+	vhd = &journal->vhd;
+
+	err = vhd_journal_begin(journal);
+	if (err)
+		return err;
+
+	for (i = 0; i < vhd->bat.entries; i++) {
+		if (vhd->bat.bat[i] == DD_BLK_UNUSED ||
+		    vhd->bat.bat[i] > limit)
+			continue;
+
+		err = vhd_journal_add_block(journal, i,
+					    VHD_JOURNAL_DATA | VHD_JOURNAL_METADATA);
+		if (err)
+			break;
+	}
+
+	if (err) {
+		vhd_journal_end(journal);
+		return err;
+	}
+
+	return vhd_journal_end(journal);
+}
+
+static int
+vhd_block_offset_cmp(const void *a, const void *b)
+{
+	const vhd_block_t *x = a, *y = b;
+
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static int
+vhd_move_blocks_wait(io_context_t aio, int n)
+{
+	struct io_event events[VHD_RESIZE_DEPTH * 2];
+	int got, err = 0;
+
+	while (n) {
+		got = io_getevents(aio, 1, n, events, NULL);
+		if (got == -EINTR)
+			continue;
+		if (got < 0)
+			return got;
+
+		for (n -= got; got--; )
+			if (events[got].res != events[got].obj->u.c.nbytes) {
+				/* the last block may run into a missing footer */
+				if (events[got].obj->aio_lio_opcode == IO_CMD_PREAD &&
+				    (long)events[got].res >= 0) {
+					memset(events[got].obj->u.c.buf +
+					       events[got].res, 0,
+					       events[got].obj->u.c.nbytes -
+					       events[got].res);
+					continue;
+				}
+				err = -EIO;
+			}
+	}
+
+	return err;
+}
+
+/*
+ * moves every allocated block starting at or below sector limit to the
+ * end of the file, lowest first, with the data region of each on a page
+ * boundary. VHD_RESIZE_DEPTH blocks are read at a time, then written to
+ * their new place while their old place is zeroed. The blocks must have
+ * been journaled.
+ */
+static int
+vhd_move_blocks_below(vhd_journal_t *journal, uint64_t limit)
+{
+	int i, k, n, cnt, err;
+	char *bufs, *zeros;
+	size_t size, bm_size;
+	io_context_t aio;
+	vhd_context_t *vhd;
+	vhd_block_t *list;
+	struct iocb iocbs[VHD_RESIZE_DEPTH * 2], *iocbp[VHD_RESIZE_DEPTH * 2];
+	uint32_t gaps[VHD_RESIZE_DEPTH];
+	off64_t offs[VHD_RESIZE_DEPTH], next;
+
+	vhd     = &journal->vhd;
+	bufs    = NULL;
+	zeros   = NULL;
+	list    = NULL;
+	aio     = 0;
+	bm_size = vhd_sectors_to_bytes(vhd->bm_secs);
+	size    = bm_size + vhd_sectors_to_bytes(vhd->spb);
+
+	list = malloc(vhd->bat.entries * sizeof(vhd_block_t));
+	if (!list)
+		return -ENOMEM;
+
+	for (cnt = 0, i = 0; i < vhd->bat.entries; i++)
+		if (vhd->bat.bat[i] != DD_BLK_UNUSED &&
+		    vhd->bat.bat[i] <= limit) {
+			list[cnt].block  = i;
+			list[cnt].offset = vhd->bat.bat[i];
+			cnt++;
+		}
+
+	qsort(list, cnt, sizeof(vhd_block_t), vhd_block_offset_cmp);
+
+	/* each buffer has room for the alignment gap ahead of the block */
+	err = posix_memalign((void **)&bufs, 4096,
+			     VHD_RESIZE_DEPTH * (size + 4096));
+	if (err) {
+		bufs = NULL;
+		err  = -err;
+		goto out;
+	}
+
+	err = posix_memalign((void **)&zeros, 4096, size);
+	if (err) {
+		zeros = NULL;
+		err   = -err;
+		goto out;
+	}
+	memset(zeros, 0, size);
+
+	err = io_setup(VHD_RESIZE_DEPTH * 2, &aio);
+	if (err) {
+		aio = 0;
+		goto out;
+	}
+
+	next = vhd_sectors_to_bytes(vhd_next_block_offset(vhd));
+
+	for (i = 0; i < cnt; i += n) {
+		n = MIN(VHD_RESIZE_DEPTH, cnt - i);
+
+		for (k = 0; k < n; k++) {
+			/* data region of segment should begin on page boundary */
+			gaps[k] = (4096 - (next + bm_size) % 4096) % 4096;
+			offs[k] = next;
+			next   += gaps[k] + size;
+
+			io_prep_pread(&iocbs[k], vhd->fd,
+				      bufs + k * (size + 4096) + gaps[k], size,
+				      vhd_sectors_to_bytes(list[i + k].offset));
+			iocbp[k] = &iocbs[k];
+		}
+
+		err = io_submit(aio, n, iocbp);
+		if (err != n) {
+			err = (err < 0 ? err : -EIO);
+			goto out;
+		}
+
+		err = vhd_move_blocks_wait(aio, n);
+		if (err)
+			goto out;
+
+		for (k = 0; k < n; k++) {
+			char *buf = bufs + k * (size + 4096);
+
+			memset(buf, 0, gaps[k]);
+			io_prep_pwrite(&iocbs[k], vhd->fd, buf, gaps[k] + size,
+				       offs[k]);
+			io_prep_pwrite(&iocbs[n + k], vhd->fd, zeros, size,
+				       vhd_sectors_to_bytes(list[i + k].offset));
+			iocbp[k]     = &iocbs[k];
+			iocbp[n + k] = &iocbs[n + k];
+
+			vhd->bat.bat[list[i + k].block] =
+				(offs[k] + gaps[k]) >> VHD_SECTOR_SHIFT;
+		}
+
+		err = io_submit(aio, 2 * n, iocbp);
+		if (err != 2 * n) {
+			err = (err < 0 ? err : -EIO);
+			goto out;
+		}
+
+		err = vhd_move_blocks_wait(aio, 2 * n);
+		if (err)
+			goto out;
+	}
+
+	err = 0;
+
+out:
+	if (aio)
+		io_destroy(aio);
+	free(zeros);
+	free(bufs);
+	free(list);
+	return err;
+}
+
 static int
 vhd_dynamic_grow(vhd_journal_t *journal, uint64_t secs)
 {
@@ -961,28 +1182,19 @@ vhd_dynamic_grow(vhd_journal_t *journal, uint64_t secs)
 	if (!first_block.offset)
 		goto shift_metadata;
 
+	/* journal every block the loop below can move, with one sync */
+	err = vhd_journal_blocks_below(journal,
+				       (eom + size_needed) >> VHD_SECTOR_SHIFT);
+	if (err)
+		return err;
+
 	/* 
 	 * not enough space -- 
 	 * move vhd data blocks to the end of the file to make room 
 	 */
 	do {
-		off64_t new_off, bm_size, gap_size;
-
-		new_off = vhd_sectors_to_bytes(vhd_next_block_offset(vhd));
-
-		/* data region of segment should begin on page boundary */
-		bm_size = vhd_sectors_to_bytes(vhd->bm_secs);
-		if ((new_off + bm_size) % 4096) {
-			gap_size = 4096 - ((new_off + bm_size) % 4096);
-
-			err = vhd_write_zeros(journal, new_off, gap_size);
-			if (err)
-				return err;
-
-			new_off += gap_size;
-		}
-
-		err = vhd_move_block(journal, first_block.block, new_off);
+		err = vhd_move_blocks_below(journal,
+					    (eom + size_needed) >> VHD_SECTOR_SHIFT);
 		if (err)
 			return err;
 
@@ -1082,8 +1294,8 @@ vhd_dynamic_grow_fast(const char *name, uint64_t bytes)
 			goto done;
 	}
 
-	blks   = (bytes + VHD_BLOCK_SIZE - 1) >> VHD_BLOCK_SHIFT;
-	size   = blks << VHD_BLOCK_SHIFT;
+	blks   = (bytes + vhd.header.block_size - 1) >> vhd_block_shift(&vhd);
+	size   = blks << vhd_block_shift(&vhd);
 	if (size < vhd.footer.curr_size) {
 		printf("%s: size (%"PRIu64") < curr size (%"PRIu64")\n", 
 		       name, size, vhd.footer.curr_size);
@@ -43,6 +43,7 @@
 #include <limits.h>
 #include <libgen.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -58,6 +59,19 @@
 #define VHD_SCAN_VERBOSE     0x10
 #define VHD_SCAN_PARENTS     0x20
 #define VHD_SCAN_MARKERS     0x40
+#define VHD_SCAN_ACTIVATE    0x80
+
+#define VHD_SCAN_WORKERS     8
+#define VHD_SCAN_WORKERS_MAX 64
+
+#define VHD_SCAN_ALIGN       4096
+#define VHD_SCAN_HEAD_SIZE   (64 << 10)  /* first read of each volume */
+#define VHD_SCAN_SPAN_MAX    (1 << 20)   /* largest read to merge into */
+
+#define VHD_SCAN_CACHE_MAGIC "# vhd-util scan cache v1"
+
+/* scan flags a cached result depends on */
+#define VHD_SCAN_CACHE_FLAGS (VHD_SCAN_FAST | VHD_SCAN_PRETTY | VHD_SCAN_MARKERS)
 
 #define VHD_TYPE_RAW_FILE    0x01
 #define VHD_TYPE_VHD_FILE    0x02
@@ -88,6 +102,11 @@ struct target {
 	uint64_t             start;
 	uint64_t             end;
 	uint8_t              type;
+
+	/* files only: what a cached scan result is keyed on */
+	dev_t                dev;
+	ino_t                ino;
+	struct timespec      mtime;
 };
 
 struct iterator {
@@ -126,9 +145,66 @@ struct vhd_scan {
 	struct vhd_image   **lists;
 };
 
+/*
+ * Outcome of probing one target. Probes run on worker threads; printing
+ * and queueing parents stay on the main thread, in target order.
+ */
+struct vhd_scan_result {
+	struct vhd_image     image;
+	int                  err;
+	uint8_t              parent_raw;
+	uint8_t              borrowed;  /* image.name is target->name */
+	uint8_t              cached;
+};
+
+struct vhd_scan_wave {
+	struct target       *targets;
+	struct vhd_scan_result *results;
+	int                  cnt;
+	int                  next;
+};
+
+/*
+ * Results for VHD files from earlier scans, keyed on the file's identity
+ * and mtime. A file that has not changed since is not opened at all.
+ */
+struct vhd_scan_cache_entry {
+	char                *name;
+	dev_t                dev;
+	ino_t                ino;
+	struct timespec      mtime;
+	uint64_t             size;
+	int                  flags;
+	uint64_t             capacity;
+	uint8_t              hidden;
+	char                 marker;
+	uint8_t              parent_raw;
+	struct vhd_keyhash   keyhash;
+	char                *parent;
+};
+
+struct vhd_scan_cache {
+	const char          *path;
+	int                  cnt;
+	int                  size;
+	int                  nsorted;   /* entries bsearch may look at */
+	int                  dirty;
+	struct vhd_scan_cache_entry *entries;
+};
+
+/* LVs scanned with -A, activated together once the scan is done */
+struct vhd_scan_activation {
+	int                  cnt;
+	int                  size;
+	const char         **names;
+};
+
 static int flags;
+static int workers;
 static struct vg vg;
 static struct vhd_scan scan;
+static struct vhd_scan_cache cache;
+static struct vhd_scan_activation activation;
 
 static int
 vhd_util_scan_pretty_allocate_list(int cnt)
@@ -512,38 +588,6 @@ vhd_util_scan_extract_volume_name(char *dst, const char *src)
 	return 0;
 }
 
-static int
-vhd_util_scan_get_volume_parent(vhd_context_t *vhd, struct vhd_image *image)
-{
-	int err;
-	char name[VHD_MAX_NAME_LEN];
-	vhd_parent_locator_t *loc, copy;
-
-	if (flags & VHD_SCAN_FAST) {
-		err = vhd_header_decode_parent(vhd,
-					       &vhd->header, &image->parent);
-		if (!err)
-			goto found;
-	}
-
-	loc = vhd_util_scan_get_parent_locator(vhd);
-	if (!loc)
-		return -EINVAL;
-
-	copy = *loc;
-	copy.data_offset += image->target->start;
-	err = vhd_parent_locator_read(vhd, &copy, &image->parent);
-	if (err)
-		return err;
-
-found:
-	err = vhd_util_scan_extract_volume_name(name, image->parent);
-	if (!err)
-		return copy_name(image->parent, name);
-
-	return 0;
-}
-
 static int
 vhd_util_scan_get_parent(vhd_context_t *vhd, struct vhd_image *image)
 {
@@ -557,9 +601,6 @@ vhd_util_scan_get_parent(vhd_context_t *vhd, struct vhd_image *image)
 
 	loc = NULL;
 
-	if (target_volume(image->target->type))
-		return vhd_util_scan_get_volume_parent(vhd, image);
-
 	if (flags & VHD_SCAN_FAST) {
 		err = vhd_header_decode_parent(vhd,
 					       &vhd->header, &image->parent);
@@ -664,76 +705,320 @@ vhd_util_scan_open_file(vhd_context_t *vhd, struct vhd_image *image)
 	return 0;
 }
 
+/*
+ * Volume metadata is read in as few round trips as possible: one aligned
+ * read of the head of the image, which holds footer and header and, for
+ * smaller images, BAT, batmap and parent locator too; then at most one
+ * more read spanning whatever else is needed. Everything is parsed from
+ * these buffers. Offsets are relative to the start of the image.
+ */
+struct vhd_scan_buf {
+	char                *data;
+	uint64_t             off;
+	size_t               len;
+};
+
+#define VHD_SCAN_BUFS        3
+
 static int
-vhd_util_scan_read_volume_headers(vhd_context_t *vhd, struct vhd_image *image)
+vhd_util_scan_buf_read(vhd_context_t *vhd, struct target *target,
+		       struct vhd_scan_buf *buf, uint64_t off, uint64_t end)
 {
+	uint64_t size;
+	ssize_t n;
 	int err;
-	void *buf;
-	size_t size;
-	struct target *target;
 
-	buf    = NULL;
-	target = image->target;
-	size   = sizeof(vhd_footer_t) + sizeof(vhd_header_t);
+	size = target->end - target->start;
+	off &= ~((uint64_t)VHD_SCAN_ALIGN - 1);
+	end  = (end + VHD_SCAN_ALIGN - 1) & ~((uint64_t)VHD_SCAN_ALIGN - 1);
+	end  = MIN(end, size);
+
+	if (off >= end)
+		return -EINVAL;
 
-	err = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
+	err = posix_memalign((void **)&buf->data, VHD_SCAN_ALIGN, end - off);
 	if (err) {
-		buf            = NULL;
-		image->message = "allocating image";
-		image->error   = -err;
-		goto out;
+		buf->data = NULL;
+		return -err;
 	}
 
-	err = vhd_seek(vhd, target->start, SEEK_SET);
-	if (err) {
-		image->message = "seeking to headers";
-		image->error   = err;
-		goto out;
+	n = pread(vhd->fd, buf->data, end - off, target->start + off);
+	if (n < 0) {
+		err = -errno;
+		free(buf->data);
+		buf->data = NULL;
+		return err;
+	}
+
+	buf->off = off;
+	buf->len = n;
+	return 0;
+}
+
+static void *
+vhd_util_scan_buf_get(struct vhd_scan_buf *bufs, uint64_t off, size_t len)
+{
+	int i;
+
+	for (i = 0; i < VHD_SCAN_BUFS; i++) {
+		struct vhd_scan_buf *buf = bufs + i;
+
+		if (buf->data && off >= buf->off &&
+		    off + len <= buf->off + buf->len)
+			return buf->data + (off - buf->off);
+	}
+
+	return NULL;
+}
+
+/*
+ * Makes sure both ranges are buffered, with a single read if they are
+ * close enough together. @len2 may be 0.
+ */
+static int
+vhd_util_scan_buf_fill(vhd_context_t *vhd, struct target *target,
+		       struct vhd_scan_buf *bufs,
+		       uint64_t off1, size_t len1, uint64_t off2, size_t len2)
+{
+	int i, err, miss1, miss2;
+
+	miss1 = len1 && !vhd_util_scan_buf_get(bufs, off1, len1);
+	miss2 = len2 && !vhd_util_scan_buf_get(bufs, off2, len2);
+
+	for (i = 0; i < VHD_SCAN_BUFS && bufs[i].data; i++)
+		;
+
+	if (miss1 && miss2 &&
+	    MAX(off1 + len1, off2 + len2) - MIN(off1, off2) <=
+	    VHD_SCAN_SPAN_MAX && i < VHD_SCAN_BUFS)
+		return vhd_util_scan_buf_read(vhd, target, bufs + i,
+					      MIN(off1, off2),
+					      MAX(off1 + len1, off2 + len2));
+
+	if (miss1) {
+		if (i == VHD_SCAN_BUFS)
+			return -ENOMEM;
+		err = vhd_util_scan_buf_read(vhd, target, bufs + i++,
+					     off1, off1 + len1);
+		if (err)
+			return err;
 	}
 
-	err = vhd_read(vhd, buf, size);
+	if (miss2) {
+		if (i == VHD_SCAN_BUFS)
+			return -ENOMEM;
+		err = vhd_util_scan_buf_read(vhd, target, bufs + i++,
+					     off2, off2 + len2);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int
+vhd_util_scan_read_volume_headers(vhd_context_t *vhd, struct vhd_image *image,
+				  struct vhd_scan_buf *bufs)
+{
+	int err;
+	void *p;
+	uint64_t off;
+	struct target *target;
+
+	target = image->target;
+
+	err = vhd_util_scan_buf_read(vhd, target, bufs, 0, VHD_SCAN_HEAD_SIZE);
+	if (!err && !(p = vhd_util_scan_buf_get(bufs, 0,
+						 sizeof(vhd_footer_t))))
+		err = -EIO;
 	if (err) {
 		image->message = "reading headers";
 		image->error   = err;
-		goto out;
+		return err;
 	}
 
-	memcpy(&vhd->footer, buf, sizeof(vhd_footer_t));
+	memcpy(&vhd->footer, p, sizeof(vhd_footer_t));
 	vhd_footer_in(&vhd->footer);
 	err = vhd_validate_footer(&vhd->footer);
 	if (err) {
 		image->message = "invalid footer";
 		image->error   = err;
-		goto out;
+		return err;
 	}
 
 	/* lvhd vhds should always be dynamic */
-	if (vhd_type_dynamic(vhd)) {
-		if (vhd->footer.data_offset != sizeof(vhd_footer_t))
-			err = vhd_read_header_at(vhd, &vhd->header,
-						 vhd->footer.data_offset +
-						 target->start);
-		else {
-			memcpy(&vhd->header,
-			       buf + sizeof(vhd_footer_t),
-			       sizeof(vhd_header_t));
-			vhd_header_in(&vhd->header);
-			err = vhd_validate_header(&vhd->header);
+	if (!vhd_type_dynamic(vhd))
+		return 0;
+
+	off = vhd->footer.data_offset;
+
+	err = vhd_util_scan_buf_fill(vhd, target, bufs,
+				     off, sizeof(vhd_header_t), 0, 0);
+	if (!err && !(p = vhd_util_scan_buf_get(bufs, off,
+						 sizeof(vhd_header_t))))
+		err = -EIO;
+	if (!err) {
+		memcpy(&vhd->header, p, sizeof(vhd_header_t));
+		vhd_header_in(&vhd->header);
+		err = vhd_validate_header(&vhd->header);
+	}
+
+	if (err) {
+		image->message = "reading header";
+		image->error   = err;
+		return err;
+	}
+
+	vhd->spb = vhd->header.block_size >> VHD_SECTOR_SHIFT;
+	vhd->bm_secs = secs_round_up_no_zero(vhd->spb >> 3);
+
+	return 0;
+}
+
+/*
+ * Like vhd_marker() and vhd_get_keyhash(), but from the buffered batmap
+ * header. Volumes carry no xattrs, so without a batmap both are clear.
+ */
+static int
+vhd_util_scan_parse_volume_markers(vhd_context_t *vhd, struct vhd_image *image,
+				   struct vhd_scan_buf *bufs, off64_t off)
+{
+	vhd_batmap_t batmap;
+	void *p;
+
+	image->marker = 0;
+	memset(&image->keyhash, 0, sizeof(image->keyhash));
+
+	if (!vhd_type_dynamic(vhd) || !vhd_creator_tapdisk(vhd) ||
+	    vhd->footer.crtr_ver <= VHD_VERSION(0, 1))
+		return 0;
+
+	p = vhd_util_scan_buf_get(bufs, off, sizeof(vhd_batmap_header_t));
+	if (!p)
+		return -EIO;
+
+	memcpy(&batmap.header, p, sizeof(vhd_batmap_header_t));
+	vhd_batmap_header_in(&batmap);
+
+	if (vhd_validate_batmap_header(&batmap)) {
+		/* version 1.1 vhds may have been updated from 0.1 */
+		if (vhd->footer.crtr_ver < VHD_VERSION(1, 2))
+			return 0;
+		return -EINVAL;
+	}
+
+	image->marker = batmap.header.marker;
+	memcpy(&image->keyhash, &batmap.header.keyhash,
+	       sizeof(image->keyhash));
+	return 0;
+}
+
+static int
+vhd_util_scan_parse_volume_parent(vhd_context_t *vhd, struct vhd_image *image,
+				  struct vhd_scan_buf *bufs,
+				  vhd_parent_locator_t *loc)
+{
+	int err;
+	void *p;
+	char name[VHD_MAX_NAME_LEN];
+
+	if (!image->parent) {
+		if (!loc)
+			return -EINVAL;
+
+		p = vhd_util_scan_buf_get(bufs, loc->data_offset,
+					  vhd_parent_locator_size(loc));
+		if (!p)
+			return -EIO;
+
+		err = vhd_parent_locator_decode(vhd, loc, p, &image->parent);
+		if (err)
+			return err;
+	}
+
+	err = vhd_util_scan_extract_volume_name(name, image->parent);
+	if (!err)
+		return copy_name(image->parent, name);
+
+	return 0;
+}
+
+/*
+ * Everything scan needs from a VHD volume: headers, 'hidden' (the footer
+ * copy at the head of the image, which is what vhd_hidden() would read),
+ * markers and parent.
+ */
+static int
+vhd_util_scan_read_volume(vhd_context_t *vhd, struct vhd_image *image)
+{
+	int i, err;
+	off64_t boff;
+	size_t blen, llen;
+	vhd_parent_locator_t *loc;
+	struct vhd_scan_buf bufs[VHD_SCAN_BUFS];
+
+	memset(bufs, 0, sizeof(bufs));
+	loc  = NULL;
+	blen = 0;
+	llen = 0;
+	boff = 0;
+
+	err = vhd_util_scan_read_volume_headers(vhd, image, bufs);
+	if (err)
+		goto out;
+
+	image->hidden = vhd->footer.hidden;
+
+	if ((flags & VHD_SCAN_MARKERS) && vhd_type_dynamic(vhd) &&
+	    vhd_creator_tapdisk(vhd) &&
+	    vhd->footer.crtr_ver > VHD_VERSION(0, 1)) {
+		vhd_batmap_header_offset(vhd, &boff);
+		blen = sizeof(vhd_batmap_header_t);
+	}
+
+	if (vhd->footer.type == HD_TYPE_DIFF) {
+		if (!(flags & VHD_SCAN_FAST) ||
+		    vhd_header_decode_parent(vhd, &vhd->header,
+					     &image->parent)) {
+			image->parent = NULL;
+			loc = vhd_util_scan_get_parent_locator(vhd);
+			if (loc)
+				llen = vhd_parent_locator_size(loc);
 		}
+	}
+
+	err = vhd_util_scan_buf_fill(vhd, image->target, bufs,
+				     boff, blen,
+				     loc ? loc->data_offset : 0, llen);
+	if (err) {
+		image->message = "reading metadata";
+		image->error   = err;
+		goto out;
+	}
 
+	if (flags & VHD_SCAN_MARKERS) {
+		err = vhd_util_scan_parse_volume_markers(vhd, image,
+							 bufs, boff);
 		if (err) {
-			image->message = "reading header";
+			image->message = "checking markers";
 			image->error   = err;
 			goto out;
 		}
+	}
 
-		vhd->spb = vhd->header.block_size >> VHD_SECTOR_SHIFT;
-		vhd->bm_secs = secs_round_up_no_zero(vhd->spb >> 3);
+	if (vhd->footer.type == HD_TYPE_DIFF) {
+		err = vhd_util_scan_parse_volume_parent(vhd, image, bufs, loc);
+		if (err) {
+			image->message = "getting parent";
+			image->error   = err;
+			goto out;
+		}
 	}
 
 out:
-	free(buf);
-	return image->error;
+	for (i = 0; i < VHD_SCAN_BUFS; i++)
+		free(bufs[i].data);
+	return err;
 }
 
 static int
@@ -768,14 +1053,11 @@ vhd_util_scan_open_volume(vhd_context_t *vhd, struct vhd_image *image)
 		return image->error;
 	}
 
-	if (target_vhd(target->type))
-		return vhd_util_scan_read_volume_headers(vhd, image);
-
 	return 0;
 }
 
 static int
-vhd_util_scan_open(vhd_context_t *vhd, struct vhd_image *image)
+vhd_util_scan_get_name(struct vhd_image *image)
 {
 	struct target *target;
 
@@ -797,7 +1079,13 @@ vhd_util_scan_open(vhd_context_t *vhd, struct vhd_image *image)
 		}
 	}
 
-	if (target_volume(target->type))
+	return 0;
+}
+
+static int
+vhd_util_scan_open(vhd_context_t *vhd, struct vhd_image *image)
+{
+	if (target_volume(image->target->type))
 		return vhd_util_scan_open_volume(vhd, image);
 	else
 		return vhd_util_scan_open_file(vhd, image);
@@ -826,6 +1114,9 @@ vhd_util_scan_init_file_target(struct target *target,
 	target->start = 0;
 	target->size  = stats.st_size;
 	target->end   = stats.st_size;
+	target->dev   = stats.st_dev;
+	target->ino   = stats.st_ino;
+	target->mtime = stats.st_mtim;
 
 	return 0;
 }
@@ -981,12 +1272,12 @@ iterator_free(struct iterator *itr)
 
 static void
 vhd_util_scan_add_parent(struct iterator *itr,
-			 vhd_context_t *vhd, struct vhd_image *image)
+			 int parent_raw, struct vhd_image *image)
 {
 	int err;
 	uint8_t type;
 
-	if (vhd_parent_raw(vhd))
+	if (parent_raw)
 		type = target_volume(image->target->type) ? 
 			VHD_TYPE_RAW_VOLUME : VHD_TYPE_RAW_FILE;
 	else
@@ -999,83 +1290,614 @@ vhd_util_scan_add_parent(struct iterator *itr,
 }
 
 static int
-vhd_util_scan_targets(int cnt, struct target *targets)
+vhd_util_scan_cache_entry_cmp(const void *lhs, const void *rhs)
 {
-	int ret, err;
+	const struct vhd_scan_cache_entry *l = lhs, *r = rhs;
+
+	return strcmp(l->name, r->name);
+}
+
+static void
+vhd_util_scan_cache_sort(void)
+{
+	if (cache.nsorted != cache.cnt) {
+		qsort(cache.entries, cache.cnt, sizeof(*cache.entries),
+		      vhd_util_scan_cache_entry_cmp);
+		cache.nsorted = cache.cnt;
+	}
+}
+
+static struct vhd_scan_cache_entry *
+vhd_util_scan_cache_find(const char *name)
+{
+	struct vhd_scan_cache_entry key;
+
+	if (!cache.nsorted)
+		return NULL;
+
+	key.name = (char *)name;
+	return bsearch(&key, cache.entries, cache.nsorted,
+		       sizeof(*cache.entries), vhd_util_scan_cache_entry_cmp);
+}
+
+static int
+vhd_util_scan_cache_valid(struct vhd_scan_cache_entry *entry,
+			  struct target *target)
+{
+	return (entry->dev == target->dev &&
+		entry->ino == target->ino &&
+		entry->mtime.tv_sec == target->mtime.tv_sec &&
+		entry->mtime.tv_nsec == target->mtime.tv_nsec &&
+		entry->size == target->size &&
+		entry->flags == (flags & VHD_SCAN_CACHE_FLAGS));
+}
+
+static void
+vhd_util_scan_cache_free(void)
+{
+	int i;
+
+	for (i = 0; i < cache.cnt; i++) {
+		free(cache.entries[i].name);
+		free(cache.entries[i].parent);
+	}
+
+	free(cache.entries);
+	memset(&cache, 0, sizeof(cache));
+}
+
+static struct vhd_scan_cache_entry *
+vhd_util_scan_cache_alloc(void)
+{
+	struct vhd_scan_cache_entry *entry;
+
+	if (cache.cnt == cache.size) {
+		int size = cache.size ? cache.size * 2 : 64;
+
+		entry = realloc(cache.entries, size * sizeof(*entry));
+		if (!entry)
+			return NULL;
+
+		cache.entries = entry;
+		cache.size    = size;
+	}
+
+	entry = cache.entries + cache.cnt;
+	memset(entry, 0, sizeof(*entry));
+	return entry;
+}
+
+static int
+vhd_util_scan_cache_hex_in(uint8_t *dst, size_t len, const char *src)
+{
+	size_t i;
+	unsigned int byte;
+
+	if (strlen(src) != len * 2)
+		return -EINVAL;
+
+	for (i = 0; i < len; i++) {
+		if (sscanf(src + i * 2, "%2x", &byte) != 1)
+			return -EINVAL;
+		dst[i] = byte;
+	}
+
+	return 0;
+}
+
+static void
+vhd_util_scan_cache_hex_out(FILE *f, const uint8_t *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		fprintf(f, "%02x", src[i]);
+}
+
+static int
+vhd_util_scan_cache_parse(char *line)
+{
+	struct vhd_scan_cache_entry *entry;
+	char *field[15], *p;
+	unsigned int hidden, marker, raw, cookie;
+	unsigned long long dev, ino;
+	long long sec, nsec;
+	int i;
+
+	p = line;
+	for (i = 0; i < sizeof(field) / sizeof(field[0]); i++) {
+		field[i] = strsep(&p, "\t");
+		if (!field[i])
+			return -EINVAL;
+	}
+
+	entry = vhd_util_scan_cache_alloc();
+	if (!entry)
+		return -ENOMEM;
+
+	if (sscanf(field[1], "%llu", &dev) != 1 ||
+	    sscanf(field[2], "%llu", &ino) != 1 ||
+	    sscanf(field[3], "%lld", &sec) != 1 ||
+	    sscanf(field[4], "%lld", &nsec) != 1 ||
+	    sscanf(field[5], "%"SCNu64, &entry->size) != 1 ||
+	    sscanf(field[6], "%d", &entry->flags) != 1 ||
+	    sscanf(field[7], "%"SCNu64, &entry->capacity) != 1 ||
+	    sscanf(field[8], "%u", &hidden) != 1 ||
+	    sscanf(field[9], "%u", &marker) != 1 ||
+	    sscanf(field[10], "%u", &raw) != 1 ||
+	    sscanf(field[11], "%u", &cookie) != 1)
+		return -EINVAL;
+
+	if (vhd_util_scan_cache_hex_in(entry->keyhash.nonce,
+				       sizeof(entry->keyhash.nonce), field[12]) ||
+	    vhd_util_scan_cache_hex_in(entry->keyhash.hash,
+				       sizeof(entry->keyhash.hash), field[13]))
+		return -EINVAL;
+
+	entry->dev            = dev;
+	entry->ino            = ino;
+	entry->mtime.tv_sec   = sec;
+	entry->mtime.tv_nsec  = nsec;
+	entry->hidden         = hidden;
+	entry->marker         = marker;
+	entry->parent_raw     = raw;
+	entry->keyhash.cookie = cookie;
+
+	entry->name = strdup(field[0]);
+	if (!entry->name)
+		return -ENOMEM;
+
+	if (*field[14]) {
+		entry->parent = strdup(field[14]);
+		if (!entry->parent) {
+			free(entry->name);
+			return -ENOMEM;
+		}
+	}
+
+	cache.cnt++;
+	return 0;
+}
+
+/*
+ * A missing or unreadable cache is an empty one: it only ever saves work.
+ */
+static void
+vhd_util_scan_cache_load(const char *path)
+{
+	char *line;
+	size_t size;
+	ssize_t len;
+	FILE *f;
+
+	memset(&cache, 0, sizeof(cache));
+	cache.path = path;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	line = NULL;
+	size = 0;
+
+	len = getline(&line, &size, f);
+	if (len <= 0 || strncmp(line, VHD_SCAN_CACHE_MAGIC,
+				strlen(VHD_SCAN_CACHE_MAGIC)))
+		goto out;
+
+	while ((len = getline(&line, &size, f)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+
+		if (vhd_util_scan_cache_parse(line)) {
+			EPRINTF("ignoring bad cache entry in %s\n", path);
+			continue;
+		}
+	}
+
+out:
+	free(line);
+	fclose(f);
+
+	vhd_util_scan_cache_sort();
+}
+
+static void
+vhd_util_scan_cache_save(void)
+{
+	struct vhd_scan_cache_entry *entry;
+	char *tmp;
+	FILE *f;
+	int i;
+
+	if (!cache.path || !cache.dirty)
+		return;
+
+	if (asprintf(&tmp, "%s.%d", cache.path, getpid()) == -1)
+		return;
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		EPRINTF("failed to write scan cache %s: %d\n", tmp, -errno);
+		free(tmp);
+		return;
+	}
+
+	fprintf(f, "%s\n", VHD_SCAN_CACHE_MAGIC);
+
+	for (i = 0; i < cache.cnt; i++) {
+		entry = cache.entries + i;
+
+		fprintf(f, "%s\t%llu\t%llu\t%lld\t%lld\t%"PRIu64"\t%d\t%"PRIu64
+			"\t%u\t%u\t%u\t%u\t",
+			entry->name, (unsigned long long)entry->dev,
+			(unsigned long long)entry->ino,
+			(long long)entry->mtime.tv_sec,
+			(long long)entry->mtime.tv_nsec, entry->size,
+			entry->flags, entry->capacity, entry->hidden,
+			(uint8_t)entry->marker, entry->parent_raw,
+			entry->keyhash.cookie);
+		vhd_util_scan_cache_hex_out(f, entry->keyhash.nonce,
+					    sizeof(entry->keyhash.nonce));
+		fputc('\t', f);
+		vhd_util_scan_cache_hex_out(f, entry->keyhash.hash,
+					    sizeof(entry->keyhash.hash));
+		fprintf(f, "\t%s\n", entry->parent ? : "");
+	}
+
+	if (fflush(f) || fsync(fileno(f)) || ferror(f)) {
+		EPRINTF("failed to write scan cache %s: %d\n", tmp, -errno);
+		fclose(f);
+		unlink(tmp);
+	} else if (fclose(f) || rename(tmp, cache.path)) {
+		EPRINTF("failed to replace scan cache %s: %d\n",
+			cache.path, -errno);
+		unlink(tmp);
+	}
+
+	free(tmp);
+}
+
+static int
+vhd_util_scan_cache_get(struct vhd_scan_result *res)
+{
+	struct vhd_scan_cache_entry *entry;
+	struct vhd_image *image = &res->image;
+
+	if (!cache.path || image->target->type != VHD_TYPE_VHD_FILE)
+		return 0;
+
+	entry = vhd_util_scan_cache_find(image->target->name);
+	if (!entry || !vhd_util_scan_cache_valid(entry, image->target))
+		return 0;
+
+	if (entry->parent) {
+		image->parent = strdup(entry->parent);
+		if (!image->parent)
+			return 0;
+	}
+
+	image->size     = image->target->size;
+	image->capacity = entry->capacity;
+	image->hidden   = entry->hidden;
+	image->marker   = entry->marker;
+	image->keyhash  = entry->keyhash;
+	res->parent_raw = entry->parent_raw;
+	res->cached     = 1;
+
+	return 1;
+}
+
+/*
+ * Main thread only, between waves: workers read the cache unlocked.
+ */
+static void
+vhd_util_scan_cache_put(struct vhd_scan_result *res)
+{
+	struct vhd_scan_cache_entry *entry;
+	struct vhd_image *image = &res->image;
+	struct target *target = image->target;
+	char *name, *parent;
+
+	if (!cache.path || res->cached || res->err ||
+	    target->type != VHD_TYPE_VHD_FILE)
+		return;
+
+	if (strpbrk(target->name, "\t\n") ||
+	    (image->parent && strpbrk(image->parent, "\t\n")))
+		return;
+
+	parent = NULL;
+	if (image->parent) {
+		parent = strdup(image->parent);
+		if (!parent)
+			return;
+	}
+
+	entry = vhd_util_scan_cache_find(target->name);
+	if (entry) {
+		free(entry->parent);
+		name = entry->name;
+	} else {
+		name = strdup(target->name);
+		entry = name ? vhd_util_scan_cache_alloc() : NULL;
+		if (!entry) {
+			free(name);
+			free(parent);
+			return;
+		}
+		cache.cnt++;
+	}
+
+	memset(entry, 0, sizeof(*entry));
+	entry->name       = name;
+	entry->parent     = parent;
+	entry->dev        = target->dev;
+	entry->ino        = target->ino;
+	entry->mtime      = target->mtime;
+	entry->size       = target->size;
+	entry->flags      = flags & VHD_SCAN_CACHE_FLAGS;
+	entry->capacity   = image->capacity;
+	entry->hidden     = image->hidden;
+	entry->marker     = image->marker;
+	entry->keyhash    = image->keyhash;
+	entry->parent_raw = res->parent_raw;
+
+	cache.dirty = 1;
+}
+
+static int
+vhd_util_scan_probe(struct target *target, struct vhd_scan_result *res)
+{
+	int err;
 	vhd_context_t vhd;
-	struct iterator itr;
-	struct target *target;
-	struct vhd_image image;
+	struct vhd_image *image;
 
-	ret = 0;
-	err = 0;
+	image = &res->image;
+	memset(&vhd, 0, sizeof(vhd));
+	memset(res, 0, sizeof(*res));
 
-	err = iterator_init(&itr, cnt, targets);
+	image->target = target;
+
+	err = vhd_util_scan_get_name(image);
 	if (err)
-		return err;
+		goto end;
 
-	while ((target = iterator_next(&itr))) {
-		memset(&vhd, 0, sizeof(vhd));
-		memset(&image, 0, sizeof(image));
+	if (vhd_util_scan_cache_get(res))
+		goto end;
 
-		image.target = target;
+	err = vhd_util_scan_open(&vhd, image);
+	if (err)
+		goto end;
 
-		err = vhd_util_scan_open(&vhd, &image);
-		if (err) {
-			ret = -EAGAIN;
-			goto end;
-		}
+	if (target_volume(target->type)) {
+		if (target_vhd(target->type))
+			err = vhd_util_scan_read_volume(&vhd, image);
+		else
+			image->hidden = 1;
+		if (!err)
+			vhd_util_scan_get_size(&vhd, image);
+		goto end;
+	}
 
-		err = vhd_util_scan_get_size(&vhd, &image);
+	err = vhd_util_scan_get_size(&vhd, image);
+	if (err) {
+		image->message = "getting physical size";
+		image->error   = err;
+		goto end;
+	}
+
+	err = vhd_util_scan_get_hidden(&vhd, image);
+	if (err) {
+		image->message = "checking 'hidden' field";
+		image->error   = err;
+		goto end;
+	}
+
+	if (flags & VHD_SCAN_MARKERS) {
+		err = vhd_util_scan_get_markers(&vhd, image);
 		if (err) {
-			ret           = -EAGAIN;
-			image.message = "getting physical size";
-			image.error   = err;
+			image->message = "checking markers";
+			image->error   = err;
 			goto end;
 		}
+	}
 
-		err = vhd_util_scan_get_hidden(&vhd, &image);
+	if (vhd.footer.type == HD_TYPE_DIFF) {
+		err = vhd_util_scan_get_parent(&vhd, image);
 		if (err) {
-			ret           = -EAGAIN;
-			image.message = "checking 'hidden' field";
-			image.error   = err;
+			image->message = "getting parent";
+			image->error   = err;
 			goto end;
 		}
+	}
 
-		if (flags & VHD_SCAN_MARKERS) {
-			err = vhd_util_scan_get_markers(&vhd, &image);
-			if (err) {
-				ret           = -EAGAIN;
-				image.message = "checking markers";
-				image.error   = err;
-				goto end;
-			}
+end:
+	if (image->parent && vhd.file)
+		res->parent_raw = !!vhd_parent_raw(&vhd);
+	if (vhd.file)
+		vhd_close(&vhd);
+
+	res->borrowed = (image->name == target->name);
+	res->err      = err;
+	return err;
+}
+
+static void *
+vhd_util_scan_worker(void *arg)
+{
+	struct vhd_scan_wave *wave = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&wave->next, 1,
+				       __ATOMIC_RELAXED)) < wave->cnt)
+		vhd_util_scan_probe(wave->targets + i, wave->results + i);
+
+	return NULL;
+}
+
+/*
+ * Probes @cnt targets on up to @workers threads. Each result is written
+ * only by the thread that probed it.
+ */
+static void
+vhd_util_scan_probe_wave(struct target *targets,
+			 struct vhd_scan_result *results, int cnt)
+{
+	pthread_t threads[VHD_SCAN_WORKERS_MAX];
+	struct vhd_scan_wave wave;
+	int i, n;
+
+	wave.targets = targets;
+	wave.results = results;
+	wave.cnt     = cnt;
+	wave.next    = 0;
+
+	n = MIN(workers, cnt);
+
+	for (i = 0; i < n - 1; i++)
+		if (pthread_create(&threads[i], NULL,
+				   vhd_util_scan_worker, &wave))
+			break;
+
+	n = i;
+	vhd_util_scan_worker(&wave);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static int
+vhd_util_scan_add_activation(struct target *target)
+{
+	const char **names;
+	char *name;
+
+	if (activation.cnt == activation.size) {
+		int size = (activation.size ? activation.size * 2 : 32);
+
+		names = realloc(activation.names, size * sizeof(*names));
+		if (!names)
+			return -ENOMEM;
+
+		activation.names = names;
+		activation.size  = size;
+	}
+
+	name = strdup(target->name);
+	if (!name)
+		return -ENOMEM;
+
+	activation.names[activation.cnt++] = name;
+	return 0;
+}
+
+/*
+ * Activate the chains scanned, leaves and parents alike, with a single
+ * LVM command rather than one per LV.
+ */
+static int
+vhd_util_scan_activate(const char *volume)
+{
+	int i, err;
+
+	err = 0;
+	if (activation.cnt)
+		err = lvm_activate_lvs(volume, activation.names,
+				       activation.cnt, 0);
+	if (err)
+		printf("activating %d volumes failed: %d\n",
+		       activation.cnt, err);
+
+	for (i = 0; i < activation.cnt; i++)
+		free((char *)activation.names[i]);
+	free(activation.names);
+	memset(&activation, 0, sizeof(activation));
+
+	return err;
+}
+
+static void
+vhd_util_scan_put_result(struct vhd_scan_result *res)
+{
+	if (!res->borrowed)
+		free(res->image.name);
+	free(res->image.parent);
+	memset(res, 0, sizeof(*res));
+}
+
+/*
+ * Targets are probed a wave at a time: everything queued so far, in
+ * parallel. Results are then printed in order, queueing parents as they
+ * are found, exactly as a serial scan would; the parents make up the
+ * next wave.
+ */
+static int
+vhd_util_scan_targets(int cnt, struct target *targets)
+{
+	int i, n, ret, err, stop;
+	struct iterator itr;
+	struct target *target;
+	struct vhd_scan_result *results, *res;
+
+	ret  = 0;
+	err  = 0;
+	stop = 0;
+
+	err = iterator_init(&itr, cnt, targets);
+	if (err)
+		return err;
+
+	while (!stop && itr.cur < itr.cur_size) {
+		n = itr.cur_size - itr.cur;
+
+		results = calloc(n, sizeof(*results));
+		if (!results) {
+			err = -ENOMEM;
+			break;
 		}
 
-		if (vhd.footer.type == HD_TYPE_DIFF) {
-			err = vhd_util_scan_get_parent(&vhd, &image);
-			if (err) {
-				ret           = -EAGAIN;
-				image.message = "getting parent";
-				image.error   = err;
-				goto end;
+		vhd_util_scan_probe_wave(itr.targets + itr.cur, results, n);
+
+		for (i = 0; i < n; i++) {
+			res = results + i;
+
+			/* queueing parents may have moved the targets */
+			target = iterator_next(&itr);
+			res->image.target = target;
+			if (res->borrowed)
+				res->image.name = target->name;
+
+			err = res->err;
+			if (err)
+				ret = -EAGAIN;
+
+			vhd_util_scan_cache_put(res);
+			vhd_util_scan_print_image(&res->image);
+
+			if (flags & VHD_SCAN_PARENTS && res->image.parent)
+				vhd_util_scan_add_parent(&itr, res->parent_raw,
+							 &res->image);
+
+			if (!err && (flags & VHD_SCAN_ACTIVATE)) {
+				err = vhd_util_scan_add_activation(target);
+				if (err)
+					ret = err;
 			}
-		}
 
-	end:
-		vhd_util_scan_print_image(&image);
+			vhd_util_scan_put_result(res);
 
-		if (flags & VHD_SCAN_PARENTS && image.parent)
-			vhd_util_scan_add_parent(&itr, &vhd, &image);
+			if (err && !(flags & VHD_SCAN_NOFAIL)) {
+				stop = 1;
+				break;
+			}
+		}
 
-		if (vhd.file)
-			vhd_close(&vhd);
-		if (image.name != target->name)
-			free(image.name);
-		free(image.parent);
+		for (; i < n; i++)
+			vhd_util_scan_put_result(results + i);
+		free(results);
 
-		if (err && !(flags & VHD_SCAN_NOFAIL))
-			break;
+		vhd_util_scan_cache_sort();
 	}
 
 	iterator_free(&itr);
@@ -1317,19 +2139,31 @@ int
 vhd_util_scan(int argc, char **argv)
 {
 	int c, err, cnt;
-	char *filter, *volume;
+	char *filter, *volume, *cpath;
 	struct target *targets;
 
 	cnt     = 0;
 	err     = 0;
 	flags   = 0;
+	workers = VHD_SCAN_WORKERS;
 	filter  = NULL;
 	volume  = NULL;
 	targets = NULL;
+	cpath   = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "m:fcl:pavMh")) != -1) {
+	while ((c = getopt(argc, argv, "m:fcl:pavMAj:C:h")) != -1) {
 		switch (c) {
+		case 'j':
+			workers = atoi(optarg);
+			if (workers < 1 || workers > VHD_SCAN_WORKERS_MAX) {
+				err = -EINVAL;
+				goto usage;
+			}
+			break;
+		case 'C':
+			cpath = optarg;
+			break;
 		case 'm':
 			filter = optarg;
 			break;
@@ -1355,6 +2189,9 @@ vhd_util_scan(int argc, char **argv)
 		case 'M':
 			flags |= VHD_SCAN_MARKERS;
 			break;
+		case 'A':
+			flags |= VHD_SCAN_ACTIVATE | VHD_SCAN_PARENTS;
+			break;
 		case 'h':
 			goto usage;
 		default:
@@ -1368,6 +2205,11 @@ vhd_util_scan(int argc, char **argv)
 		goto usage;
 	}
 
+	if ((flags & VHD_SCAN_ACTIVATE) && !(flags & VHD_SCAN_VOLUME)) {
+		err = -EINVAL;
+		goto usage;
+	}
+
 	if (flags & VHD_SCAN_PRETTY)
 		flags &= ~VHD_SCAN_FAST;
 
@@ -1381,11 +2223,23 @@ vhd_util_scan(int argc, char **argv)
 	if (!cnt)
 		return 0;
 
+	if (cpath)
+		vhd_util_scan_cache_load(cpath);
+
 	if (flags & VHD_SCAN_PRETTY)
 		err = vhd_util_scan_targets_pretty(cnt, targets);
 	else
 		err = vhd_util_scan_targets(cnt, targets);
 
+	vhd_util_scan_cache_save();
+	vhd_util_scan_cache_free();
+
+	if (flags & VHD_SCAN_ACTIVATE) {
+		int aerr = vhd_util_scan_activate(volume);
+		if (!err)
+			err = aerr;
+	}
+
 	free(targets);
 	lvm_free_vg(&vg);
 
@@ -1395,6 +2249,9 @@ usage:
 	printf("usage: [OPTIONS] FILES\n"
 	       "options: [-m match filter] [-f fast] [-c continue on failure] "
 	       "[-l LVM volume] [-p pretty print] [-a scan parents] "
-	       "[-v verbose] [-h help] [-M show markers]\n");
+	       "[-v verbose] [-h help] [-M show markers] "
+	       "[-j parallel header reads (1-%d)] [-C cache file] "
+	       "[-A activate scanned volumes and their parents, with -l]\n",
+	       VHD_SCAN_WORKERS_MAX);
 	return err;
 }
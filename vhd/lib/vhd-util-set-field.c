@@ -83,7 +83,8 @@ vhd_util_set_field(int argc, char **argv)
 		goto usage;
 	}
 
-	if (strcmp(field, "hidden") && strcmp(field, "marker")) {
+	if (strcmp(field, "hidden") && strcmp(field, "marker") &&
+	    strcmp(field, "mdlog")) {
 		printf("invalid field %s\n", field);
 		goto usage;
 	}
@@ -106,6 +107,9 @@ vhd_util_set_field(int argc, char **argv)
 			/* if no space to write the primary footer, at least write the 
 			 * backup footer so that it's possible to delete the VDI */
 			err = vhd_write_footer_at(&vhd, &vhd.footer, 0);
+	} else if (!strcmp(field, "mdlog")) {
+		/* gives up on a lost metadata log, and what it held */
+		err = vhd_set_mdlog_pending(&vhd, (char)value);
 	} else {
 		err = vhd_set_marker(&vhd, (char)value);
 	}
@@ -5,6 +5,7 @@
 
 #define VHD_XATTR_MARKER  "user.com.citrix.xenclient.backend.marker"
 #define VHD_XATTR_KEYHASH "user.com.citrix.xenclient.backend.keyhash"
+#define VHD_XATTR_MDLOG   "user.com.citrix.xenclient.backend.mdlog"
 
 int xattr_get(int, const char *, void *, size_t);
 int xattr_set(int, const char *, const void *, size_t);
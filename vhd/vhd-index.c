@@ -39,6 +39,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 
 #include "libvhd.h"
 #include "libvhd-index.h"
@@ -49,6 +52,7 @@ usage(void)
 	printf("usage: vhd-index <command>\n"
 	       "commands:\n"
 	       "\t   index: <-i index name> <-v vhd file>\n"
+	       "\t   dedup: <-D index name> <-v vhd file>\n"
 	       "\t summary: <-s index name> [-v vhd file [-b block]]\n");
 	exit(-EINVAL);
 }
@@ -168,14 +172,76 @@ vhd_index_get_file_id(vhdi_name_t *name, const char *file,
 	return vhd_index_add_file_table_entry(name, file, files, fid);
 }
 
+/*
+ * bats are built by up to vhd_index_jobs threads, each taking a
+ * contiguous range of blocks and opening the vhds it needs itself.
+ * bitmap reads and offset lookups run concurrently; the index file and
+ * the file table are shared, so accesses to them are serialized.
+ */
+#define VHD_INDEX_MAX_JOBS            16
+
+static int vhd_index_jobs;
+static int vhd_index_full;
+
+typedef struct vhdi_builder           vhdi_builder_t;
+typedef struct vhdi_job               vhdi_job_t;
+typedef struct vhdi_gen               vhdi_gen_t;
+
+enum {
+	VHD_INDEX_ADD,
+	VHD_INDEX_CLONE,
+	VHD_INDEX_UPDATE,
+};
+
+struct vhdi_builder {
+	int                           mode;
+	vhdi_name_t                  *name;
+	vhdi_context_t                vhdi;
+	vhdi_bat_t                    bat;
+	vhdi_file_table_t             files;
+	pthread_mutex_t               lock;
+
+	char                         *finished;  /* add: block fully mapped */
+	char                         *todo;      /* update: NULL for all */
+};
+
+struct vhdi_job {
+	vhdi_builder_t               *b;
+	uint32_t                      start;
+	uint32_t                      end;
+	int                           err;
+	pthread_t                     thread;
+};
+
+/*
+ * <vhd>.bat.gen records the vhd's own bat as of the last time its
+ * index bat was written, so updates only revisit blocks that have
+ * been allocated or moved since.  a vhd modified in place fails the
+ * file table's timestamp check and has to be reindexed anyway.
+ */
+#define VHDI_GEN_MAGIC                "vhdigen"
+#define VHDI_GEN_VERSION              1
+
+struct vhdi_gen {
+	char                          magic[8];
+	uint32_t                      version;
+	uint32_t                      entries;
+	uint32_t                      timestamp;
+	uint32_t                      reserved;
+};
+
 static inline int
-vhd_index_get_block(vhdi_context_t *vhdi, vhd_context_t *vhd,
+vhd_index_get_block(vhdi_builder_t *b, vhd_context_t *vhd,
 		    uint32_t block, vhdi_block_t *vhdi_block)
 {
-	int i;
+	int i, err;
 
-	if (block)
-		return vhdi_read_block(vhdi, vhdi_block, block);
+	if (block) {
+		pthread_mutex_lock(&b->lock);
+		err = vhdi_read_block(&b->vhdi, vhdi_block, block);
+		pthread_mutex_unlock(&b->lock);
+		return err;
+	}
 
 	vhdi_block->entries = vhd->spb;
 	vhdi_block->table   = calloc(vhd->spb, sizeof(vhdi_entry_t));
@@ -188,26 +254,65 @@ vhd_index_get_block(vhdi_context_t *vhdi, vhd_context_t *vhd,
 	return 0;
 }
 
+/*
+ * resolve a vhd's file id once per open rather than once per block
+ */
+static inline int
+vhd_index_vhd_file_id(vhdi_builder_t *b, vhd_context_t *vhd,
+		      vhdi_file_id_t *fid)
+{
+	int err;
+
+	if (*fid)
+		return 0;
+
+	pthread_mutex_lock(&b->lock);
+	err = vhd_index_get_file_id(b->name, vhd->file, &b->files, fid);
+	pthread_mutex_unlock(&b->lock);
+
+	return err;
+}
+
+static int
+vhd_index_put_block(vhdi_builder_t *b, vhdi_block_t *vhdi_block,
+		    uint32_t block, int append)
+{
+	int err;
+	uint32_t location;
+
+	pthread_mutex_lock(&b->lock);
+
+	if (append) {
+		err = vhdi_append_block(&b->vhdi, vhdi_block, &location);
+		if (!err)
+			b->bat.table[block] = location;
+	} else
+		err = vhdi_write_block(&b->vhdi, vhdi_block,
+				       b->bat.table[block]);
+
+	pthread_mutex_unlock(&b->lock);
+
+	return err;
+}
+
 static int
-vhd_index_add_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
-			vhdi_bat_t *bat, vhdi_file_table_t *files,
-			vhd_context_t *vhd, uint32_t block, char *finished)
+vhd_index_add_bat_entry(vhdi_builder_t *b, vhd_context_t *vhd,
+			vhdi_file_id_t *fid, uint32_t block, char *finished)
 {
 	char *map;
-	vhdi_file_id_t fid;
 	uint32_t i, count, off;
 	vhdi_block_t vhdi_block;
 	int err, update, append;
 
-	fid    = 0;
+	map    = NULL;
 	count  = 0;
 	update = 0;
-	append = (bat->table[block] == 0);
+	append = (b->bat.table[block] == 0);
 
 	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
 		return 0;
 
-	err = vhd_index_get_block(vhdi, vhd, bat->table[block], &vhdi_block);
+	err = vhd_index_get_block(b, vhd, b->bat.table[block], &vhdi_block);
 	if (err)
 		return err;
 
@@ -215,7 +320,7 @@ vhd_index_add_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
 	if (err)
 		goto out;
 
-	err = vhd_index_get_file_id(name, vhd->file, files, &fid);
+	err = vhd_index_vhd_file_id(b, vhd, fid);
 	if (err)
 		goto out;
 
@@ -232,27 +337,16 @@ vhd_index_add_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
 		if (err)
 			goto out;
 
-		vhdi_block.table[i].file_id = fid;
+		vhdi_block.table[i].file_id = *fid;
 		vhdi_block.table[i].offset  = off;
 		count++;
 		update++;
 	}
 
 	if (update) {
-		if (append) {
-			uint32_t location;
-
-			err = vhdi_append_block(vhdi, &vhdi_block, &location);
-			if (err)
-				goto out;
-
-			bat->table[block] = location;
-		} else {
-			err = vhdi_write_block(vhdi, &vhdi_block,
-					       bat->table[block]);
-			if (err)
-				goto out;
-		}
+		err = vhd_index_put_block(b, &vhdi_block, block, append);
+		if (err)
+			goto out;
 	}
 
 	if (count == vhd->spb)
@@ -268,23 +362,21 @@ out:
 }
 
 static int
-vhd_index_clone_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
-			  vhdi_bat_t *bat, vhdi_file_table_t *files,
-			  vhd_context_t *vhd, uint32_t block)
+vhd_index_clone_bat_entry(vhdi_builder_t *b, vhd_context_t *vhd,
+			  vhdi_file_id_t *fid, uint32_t block)
 {
 	char *map;
 	int err, update;
 	uint32_t i, off;
-	vhdi_file_id_t fid;
 	vhdi_block_t vhdi_block;
 
-	fid    = 0;
+	map    = NULL;
 	update = 0;
 
 	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
 		return 0;
 
-	err = vhd_index_get_block(vhdi, vhd, bat->table[block], &vhdi_block);
+	err = vhd_index_get_block(b, vhd, b->bat.table[block], &vhdi_block);
 	if (err)
 		return err;
 
@@ -292,7 +384,7 @@ vhd_index_clone_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
 	if (err)
 		goto out;
 
-	err = vhd_index_get_file_id(name, vhd->file, files, &fid);
+	err = vhd_index_vhd_file_id(b, vhd, fid);
 	if (err)
 		goto out;
 
@@ -304,19 +396,15 @@ vhd_index_clone_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
 		if (err)
 			goto out;
 
-		vhdi_block.table[i].file_id = fid;
+		vhdi_block.table[i].file_id = *fid;
 		vhdi_block.table[i].offset  = off;
 		update++;
 	}
 
 	if (update) {
-		uint32_t location;
-
-		err = vhdi_append_block(vhdi, &vhdi_block, &location);
+		err = vhd_index_put_block(b, &vhdi_block, block, 1);
 		if (err)
 			goto out;
-
-		bat->table[block] = location;
 	}
 
 	err = 0;
@@ -329,23 +417,21 @@ out:
 }
 
 static int
-vhd_index_update_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
-			   vhdi_bat_t *bat, vhdi_file_table_t *files,
-			   vhd_context_t *vhd, uint32_t block)
+vhd_index_update_bat_entry(vhdi_builder_t *b, vhd_context_t *vhd,
+			   vhdi_file_id_t *fid, uint32_t block)
 {
 	char *map;
 	int err, update;
 	uint32_t i, off;
-	vhdi_file_id_t fid;
 	vhdi_block_t vhdi_block;
 
-	fid    = 0;
+	map    = NULL;
 	update = 0;
 
 	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
 		return 0;
 
-	err = vhd_index_get_block(vhdi, vhd, bat->table[block], &vhdi_block);
+	err = vhd_index_get_block(b, vhd, b->bat.table[block], &vhdi_block);
 	if (err)
 		return err;
 
@@ -353,7 +439,7 @@ vhd_index_update_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
 	if (err)
 		goto out;
 
-	err = vhd_index_get_file_id(name, vhd->file, files, &fid);
+	err = vhd_index_vhd_file_id(b, vhd, fid);
 	if (err)
 		goto out;
 
@@ -365,23 +451,19 @@ vhd_index_update_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
 		if (err)
 			goto out;
 
-		if (vhdi_block.table[i].file_id == fid &&
+		if (vhdi_block.table[i].file_id == *fid &&
 		    vhdi_block.table[i].offset  == off)
 			continue;
 
-		vhdi_block.table[i].file_id = fid;
+		vhdi_block.table[i].file_id = *fid;
 		vhdi_block.table[i].offset  = off;
 		update++;
 	}
 
 	if (update) {
-		uint32_t location;
-
-		err = vhdi_append_block(vhdi, &vhdi_block, &location);
+		err = vhd_index_put_block(b, &vhdi_block, block, 1);
 		if (err)
 			goto out;
-
-		bat->table[block] = location;
 	}
 
 	err = 0;
@@ -393,60 +475,25 @@ out:
 	return err;
 }
 
+/*
+ * walk the chain from the leaf for blocks [start, end), stopping once
+ * every block in the range is fully mapped
+ */
 static int
-vhd_index_add_bat(vhdi_name_t *name,
-		  uint64_t vhd_blocks, uint32_t vhd_block_size)
+vhd_index_scan_chain(vhdi_job_t *job)
 {
 	int err;
-	vhdi_bat_t bat;
 	vhd_context_t vhd;
-	vhdi_context_t vhdi;
-	vhdi_file_table_t files;
-	char *vhd_file, *finished;
-	uint32_t block, remaining;
-
-	memset(&bat, 0, sizeof(vhdi_bat_t));
-	memset(&files, 0, sizeof(vhdi_file_table_t));
-
-	vhd_file           = NULL;
-	finished           = NULL;
-	bat.vhd_blocks     = vhd_blocks;
-	bat.vhd_block_size = vhd_block_size;
-
-	strcpy(bat.vhd_path, name->vhd);
-	strcpy(bat.index_path, name->index);
-	strcpy(bat.file_table_path, name->files);
-
-	err = vhdi_open(&vhdi, name->index, O_RDWR);
-	if (err)
-		return err;
-
-	err = vhdi_file_table_load(name->files, &files);
-	if (err) {
-		vhdi_close(&vhdi);
-		return err;
-	}
-
-	err = vhdi_bat_create(name->bat, name->vhd, name->index, name->files);
-	if (err)
-		goto out;
-
-	bat.table = calloc(vhd_blocks, sizeof(uint32_t));
-	if (!bat.table) {
-		err = -ENOMEM;
-		goto out;
-	}
+	vhdi_file_id_t fid;
+	vhdi_builder_t *b = job->b;
+	uint32_t block, end, remaining;
+	char *vhd_file, *finished = b->finished;
 
-	vhd_file = strdup(name->vhd);
+	vhd_file = strdup(b->name->vhd);
 	if (!vhd_file)
-		goto out;
+		return -ENOMEM;
 
-	remaining = vhd_blocks;
-	finished  = calloc(remaining, sizeof(char));
-	if (!finished) {
-		err = -ENOMEM;
-		goto out;
-	}
+	remaining = job->end - job->start;
 
 	for (;;) {
 		err = vhd_open(&vhd, vhd_file, VHD_OPEN_RDONLY);
@@ -457,12 +504,14 @@ vhd_index_add_bat(vhdi_name_t *name,
 		if (err)
 			goto out_vhd;
 
-		for (block = 0; block < vhd.bat.entries; block++) {
+		fid = 0;
+		end = MIN(job->end, vhd.bat.entries);
+
+		for (block = job->start; block < end; block++) {
 			if (finished[block])
 				continue;
 
-			err = vhd_index_add_bat_entry(name, &vhdi, &bat,
-						      &files, &vhd, block,
+			err = vhd_index_add_bat_entry(b, &vhd, &fid, block,
 						      &finished[block]);
 			if (err)
 				goto out_bat;
@@ -490,254 +539,1179 @@ vhd_index_add_bat(vhdi_name_t *name,
 		vhd_close(&vhd);
 		if (err)
 			goto out;
-	} 
+	}
+
+out:
+	free(vhd_file);
+	return err;
+}
+
+static int
+vhd_index_scan_vhd(vhdi_job_t *job)
+{
+	int err;
+	vhd_context_t vhd;
+	vhdi_file_id_t fid;
+	uint32_t block, end;
+	vhdi_builder_t *b = job->b;
+
+	err = vhd_open(&vhd, b->name->vhd, VHD_OPEN_RDONLY);
+	if (err)
+		return err;
+
+	err = vhd_get_bat(&vhd);
+	if (err)
+		goto out;
+
+	fid = 0;
+	end = MIN(job->end, vhd.bat.entries);
+
+	for (block = job->start; block < end; block++) {
+		if (b->todo && !b->todo[block])
+			continue;
+
+		if (b->mode == VHD_INDEX_CLONE)
+			err = vhd_index_clone_bat_entry(b, &vhd, &fid, block);
+		else
+			err = vhd_index_update_bat_entry(b, &vhd, &fid, block);
+		if (err)
+			break;
+	}
+
+	vhd_put_bat(&vhd);
+out:
+	vhd_close(&vhd);
+	return err;
+}
+
+static void *
+vhd_index_job(void *arg)
+{
+	vhdi_job_t *job = arg;
+
+	if (job->b->mode == VHD_INDEX_ADD)
+		job->err = vhd_index_scan_chain(job);
+	else
+		job->err = vhd_index_scan_vhd(job);
+
+	return NULL;
+}
+
+static int
+vhd_index_run_jobs(vhdi_builder_t *b, uint32_t blocks)
+{
+	int i, n, err;
+	vhdi_job_t *jobs;
+	uint32_t chunk;
+
+	n = vhd_index_jobs;
+	if (n < 1)
+		n = 1;
+	if (n > blocks)
+		n = blocks ? : 1;
+
+	jobs = calloc(n, sizeof(vhdi_job_t));
+	if (!jobs)
+		return -ENOMEM;
+
+	chunk = (blocks + n - 1) / n;
+
+	for (i = 0; i < n; i++) {
+		jobs[i].b     = b;
+		jobs[i].start = MIN((uint64_t)i * chunk, blocks);
+		jobs[i].end   = MIN((uint64_t)(i + 1) * chunk, blocks);
+
+		/* the last range runs here, as do any we can't spawn */
+		if (i == n - 1 ||
+		    pthread_create(&jobs[i].thread, NULL, vhd_index_job,
+				   jobs + i)) {
+			jobs[i].thread = 0;
+			vhd_index_job(jobs + i);
+		}
+	}
+
+	err = 0;
+	for (i = 0; i < n; i++) {
+		if (jobs[i].thread)
+			pthread_join(jobs[i].thread, NULL);
+		if (!err)
+			err = jobs[i].err;
+	}
+
+	free(jobs);
+	return err;
+}
+
+static int
+vhd_index_open_builder(vhdi_builder_t *b, vhdi_name_t *name, int mode)
+{
+	int err;
+
+	memset(b, 0, sizeof(vhdi_builder_t));
+	b->mode = mode;
+	b->name = name;
+
+	err = vhdi_open(&b->vhdi, name->index, O_RDWR);
+	if (err)
+		return err;
+
+	err = vhdi_file_table_load(name->files, &b->files);
+	if (err) {
+		vhdi_close(&b->vhdi);
+		return err;
+	}
+
+	pthread_mutex_init(&b->lock, NULL);
+	return 0;
+}
+
+static void
+vhd_index_close_builder(vhdi_builder_t *b)
+{
+	pthread_mutex_destroy(&b->lock);
+	vhdi_file_table_free(&b->files);
+	vhdi_close(&b->vhdi);
+	free(b->bat.table);
+	free(b->finished);
+	free(b->todo);
+}
+
+static char *
+vhd_index_gen_path(vhdi_name_t *name)
+{
+	char *path;
+
+	if (asprintf(&path, "%s.gen", name->bat) == -1)
+		return NULL;
+
+	return path;
+}
+
+static int
+vhd_index_load_gen(vhdi_name_t *name, uint32_t **_bat,
+		   uint32_t *_entries, uint32_t *_timestamp)
+{
+	int fd, err;
+	char *path;
+	uint32_t i, *bat;
+	vhdi_gen_t gen;
+	size_t size;
+
+	*_bat       = NULL;
+	*_entries   = 0;
+	*_timestamp = 0;
+
+	path = vhd_index_gen_path(name);
+	if (!path)
+		return -ENOMEM;
+
+	bat = NULL;
+	fd  = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1)
+		return -errno;
+
+	err = -EINVAL;
+	if (read(fd, &gen, sizeof(gen)) != sizeof(gen))
+		goto out;
+
+	BE32_IN(&gen.version);
+	BE32_IN(&gen.entries);
+	BE32_IN(&gen.timestamp);
+
+	if (memcmp(gen.magic, VHDI_GEN_MAGIC, sizeof(gen.magic)) ||
+	    gen.version != VHDI_GEN_VERSION)
+		goto out;
+
+	size = (size_t)gen.entries * sizeof(uint32_t);
+	bat  = malloc(size ? : 1);
+	if (!bat) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (read(fd, bat, size) != size)
+		goto out;
+
+	for (i = 0; i < gen.entries; i++)
+		BE32_IN(bat + i);
 
-	err = vhdi_bat_write(name->bat, &bat);
+	*_bat       = bat;
+	*_entries   = gen.entries;
+	*_timestamp = gen.timestamp;
+	bat         = NULL;
+	err         = 0;
+
+out:
+	free(bat);
+	close(fd);
+	return err;
+}
+
+static int
+vhd_index_save_gen(vhdi_name_t *name)
+{
+	int fd, err;
+	uint32_t i, *bat;
+	char *path, *tmp;
+	vhd_context_t vhd;
+	struct stat st;
+	vhdi_gen_t gen;
+	size_t size;
+
+	fd   = -1;
+	bat  = NULL;
+	tmp  = NULL;
+	path = vhd_index_gen_path(name);
+	if (!path)
+		return -ENOMEM;
+
+	err = vhd_open(&vhd, name->vhd, VHD_OPEN_RDONLY);
 	if (err)
 		goto out;
 
+	err = vhd_get_bat(&vhd);
+	if (err) {
+		vhd_close(&vhd);
+		goto out;
+	}
+
+	if (stat(name->vhd, &st)) {
+		err = -errno;
+		goto out_vhd;
+	}
+
+	memset(&gen, 0, sizeof(gen));
+	memcpy(gen.magic, VHDI_GEN_MAGIC, sizeof(gen.magic));
+	gen.version   = VHDI_GEN_VERSION;
+	gen.entries   = vhd.bat.entries;
+	gen.timestamp = vhd_time(st.st_mtime);
+	BE32_OUT(&gen.version);
+	BE32_OUT(&gen.entries);
+	BE32_OUT(&gen.timestamp);
+
+	size = (size_t)vhd.bat.entries * sizeof(uint32_t);
+	bat  = malloc(size ? : 1);
+	if (!bat) {
+		err = -ENOMEM;
+		goto out_vhd;
+	}
+
+	for (i = 0; i < vhd.bat.entries; i++) {
+		bat[i] = vhd.bat.bat[i];
+		BE32_OUT(bat + i);
+	}
+
+	if (asprintf(&tmp, "%s.tmp", path) == -1) {
+		tmp = NULL;
+		err = -ENOMEM;
+		goto out_vhd;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		err = -errno;
+		goto out_vhd;
+	}
+
+	if (write(fd, &gen, sizeof(gen)) != sizeof(gen) ||
+	    write(fd, bat, size) != size) {
+		err = (errno ? -errno : -EIO);
+		goto out_vhd;
+	}
+
+	if (fsync(fd) || rename(tmp, path)) {
+		err = -errno;
+		goto out_vhd;
+	}
+
 	err = 0;
 
+out_vhd:
+	vhd_put_bat(&vhd);
+	vhd_close(&vhd);
 out:
+	if (fd != -1)
+		close(fd);
+	if (err && tmp)
+		unlink(tmp);
+	free(tmp);
+	free(bat);
+	free(path);
+	return err;
+}
+
+static void
+vhd_index_remove_gen(vhdi_name_t *name)
+{
+	char *path = vhd_index_gen_path(name);
+
+	if (path)
+		unlink(path);
+	free(path);
+}
+
+static int
+vhd_index_add_bat(vhdi_name_t *name,
+		  uint64_t vhd_blocks, uint32_t vhd_block_size)
+{
+	int err;
+	vhdi_builder_t b;
+
+	err = vhd_index_open_builder(&b, name, VHD_INDEX_ADD);
 	if (err)
-		unlink(name->bat);
+		return err;
 
-	vhdi_file_table_free(&files);
-	vhdi_close(&vhdi);
-	free(bat.table);
-	free(finished);
-	free(vhd_file);
+	b.bat.vhd_blocks     = vhd_blocks;
+	b.bat.vhd_block_size = vhd_block_size;
+
+	strcpy(b.bat.vhd_path, name->vhd);
+	strcpy(b.bat.index_path, name->index);
+	strcpy(b.bat.file_table_path, name->files);
+
+	err = vhdi_bat_create(name->bat, name->vhd, name->index, name->files);
+	if (err)
+		goto out;
+
+	b.bat.table = calloc(vhd_blocks, sizeof(uint32_t));
+	if (!b.bat.table) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	b.finished = calloc(vhd_blocks, sizeof(char));
+	if (!b.finished) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = vhd_index_run_jobs(&b, vhd_blocks);
+	if (err)
+		goto out;
+
+	err = vhdi_bat_write(name->bat, &b.bat);
+	if (err)
+		goto out;
+
+	err = vhd_index_save_gen(name);
+
+out:
+	if (err)
+		unlink(name->bat);
+
+	vhd_index_close_builder(&b);
+
+	return err;
+}
+
+static int
+vhd_index_clone_bat(vhdi_name_t *name, const char *parent)
+{
+	int err;
+	char *pbat = NULL;
+	vhdi_builder_t b;
+
+	err = asprintf(&pbat, "%s.bat", parent);
+	if (err == -1) {
+		free(pbat);
+		return -ENOMEM;
+	}
+
+	err = access(pbat, R_OK);
+	if (err == -1) {
+		free(pbat);
+		return -errno;
+	}
+
+	err = vhd_index_open_builder(&b, name, VHD_INDEX_CLONE);
+	if (err)
+		goto out;
+
+	err = vhdi_bat_load(pbat, &b.bat);
+	if (err)
+		goto out_b;
+
+	err = vhdi_bat_create(name->bat, name->vhd, name->index, name->files);
+	if (err)
+		goto out_b;
+
+	err = vhdi_bat_write(name->bat, &b.bat);
+	if (err)
+		goto out_b;
+
+	err = vhd_index_run_jobs(&b, b.bat.vhd_blocks);
+	if (err)
+		goto out_b;
+
+	err = vhdi_bat_write(name->bat, &b.bat);
+	if (err)
+		goto out_b;
+
+	err = vhd_index_save_gen(name);
+
+out_b:
+	vhd_index_close_builder(&b);
+out:
+	if (err)
+		unlink(name->bat);
+	free(pbat);
+	return err;
+}
+
+/*
+ * mark the blocks whose bat entry changed since the last generation;
+ * returns 0 with b->todo NULL when everything has to be rescanned
+ */
+static int
+vhd_index_changed_blocks(vhdi_builder_t *b, uint32_t *changed)
+{
+	int err;
+	struct stat st;
+	vhd_context_t vhd;
+	uint32_t i, *gen, entries, timestamp;
+
+	*changed = 0;
+
+	if (vhd_index_full)
+		return 0;
+
+	err = vhd_index_load_gen(b->name, &gen, &entries, &timestamp);
+	if (err)
+		return (err == -ENOMEM ? err : 0);
+
+	err = vhd_open(&vhd, b->name->vhd, VHD_OPEN_RDONLY);
+	if (err)
+		goto out;
+
+	err = vhd_get_bat(&vhd);
+	if (err)
+		goto out_vhd;
+
+	if (vhd.bat.entries != entries || stat(b->name->vhd, &st))
+		goto out_bat;
+
+	b->todo = calloc(entries ? : 1, sizeof(char));
+	if (!b->todo) {
+		err = -ENOMEM;
+		goto out_bat;
+	}
+
+	if (vhd_time(st.st_mtime) == timestamp)
+		goto out_bat;
+
+	for (i = 0; i < entries; i++)
+		if (vhd.bat.bat[i] != gen[i]) {
+			b->todo[i] = 1;
+			(*changed)++;
+		}
+
+out_bat:
+	vhd_put_bat(&vhd);
+out_vhd:
+	vhd_close(&vhd);
+out:
+	free(gen);
+	return err;
+}
+
+static int
+vhd_index_update_bat(vhdi_name_t *name)
+{
+	int err;
+	uint32_t changed;
+	vhdi_builder_t b;
+
+	err = access(name->bat, R_OK);
+	if (err == -1)
+		return -errno;
+
+	err = vhd_index_open_builder(&b, name, VHD_INDEX_UPDATE);
+	if (err)
+		return err;
+
+	err = vhdi_bat_load(name->bat, &b.bat);
+	if (err)
+		goto out;
+
+	err = vhd_index_changed_blocks(&b, &changed);
+	if (err)
+		goto out;
+
+	if (b.todo && !changed)
+		goto out;
+
+	err = vhd_index_run_jobs(&b, b.bat.vhd_blocks);
+	if (err)
+		goto out;
+
+	err = vhdi_bat_write(name->bat, &b.bat);
+	if (err)
+		goto out;
+
+	err = vhd_index_save_gen(name);
+
+out:
+	vhd_index_close_builder(&b);
+	return err;
+}
+
+static int
+vhd_index_create(vhdi_name_t *name)
+{
+	int err;
+	vhd_context_t ctx;
+	uint32_t block_size;
+
+	if (!access(name->index, F_OK) || !access(name->files, F_OK))
+		return -EEXIST;
+
+	err = vhd_open(&ctx, name->vhd, VHD_OPEN_RDONLY);
+	if (err)
+		return err;
+
+	err = vhd_get_header(&ctx);
+	if (err) {
+		vhd_close(&ctx);
+		return err;
+	}
+
+	block_size = ctx.header.block_size;
+	vhd_close(&ctx);
+
+	err = vhdi_create(name->index, block_size);
+	if (err)
+		goto out;
+
+	err = vhdi_file_table_create(name->files);
+	if (err)
+		goto out;
+
+	err = 0;
+
+out:
+	if (err) {
+		unlink(name->index);
+		unlink(name->files);
+	}
+
+	return err;
+}
+
+static int
+vhd_index_use_parent(vhdi_name_t *name)
+{
+	int err;
+	char *parent;
+	vhd_context_t ctx;
+
+	parent = NULL;
+
+	/* find vhd's parent -- we only index read-only vhds */
+	err = vhd_open(&ctx, name->vhd, VHD_OPEN_RDONLY);
+	if (err)
+		return err;
+
+	err = vhd_parent_locator_get(&ctx, &parent);
+	vhd_close(&ctx);
+
+	if (err)
+		return err;
+
+	/* update name to point to parent */
+	free(name->vhd);
+	name->vhd = parent;
+
+	free(name->bat);
+	name->bat = NULL;
+	err = asprintf(&name->bat, "%s.bat", name->vhd);
+	if (err == -1) {
+		free(name->bat);
+		name->bat = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int
+vhd_index(vhdi_name_t *name)
+{
+	char *parent;
+	vhd_context_t ctx;
+	uint64_t vhd_blocks;
+	uint32_t vhd_block_size;
+	int err, new_index, new_bat;
+
+	parent    = NULL;
+	new_bat   = 0;
+	new_index = 0;
+
+	err = vhd_index_use_parent(name);
+	if (err)
+		return err;
+
+	/* create index if it doesn't already exist */
+	err = access(name->index, R_OK | W_OK);
+	if (err == -1 && errno == ENOENT) {
+		new_index = 1;
+		err = vhd_index_create(name);
+	}
+
+	if (err)
+		return err;
+
+	/* get basic vhd info */
+	err = vhd_open(&ctx, name->vhd, VHD_OPEN_RDONLY);
+	if (err)
+		goto out;
+
+	err = vhd_get_header(&ctx);
+	if (err) {
+		vhd_close(&ctx);
+		goto out;
+	}
+
+	vhd_blocks     = ctx.header.max_bat_size;
+	vhd_block_size = ctx.header.block_size;
+
+	if (vhd_parent_locator_get(&ctx, &parent))
+		parent = NULL;
+
+	vhd_close(&ctx);
+
+	/* update existing bat if it exists */
+	err = vhd_index_update_bat(name);
+	if (err != -ENOENT)
+		goto out;
+
+	new_bat = 1;
+
+	if (parent) {
+		/* clone parent bat if it exists */
+		err = vhd_index_clone_bat(name, parent);
+		if (err != -ENOENT)
+			goto out;
+	}
+
+	/* create new bat from scratch */
+	err = vhd_index_add_bat(name, vhd_blocks, vhd_block_size);
+	if (err)
+		goto out;
+
+	err = 0;
+
+out:
+	if (err) {
+		if (new_bat) {
+			unlink(name->bat);
+			vhd_index_remove_gen(name);
+		}
+		if (new_index) {
+			unlink(name->index);
+			unlink(name->files);
+		}
+	}
+	free(parent);
+	return err;
+}
+
+/*
+ * dedup: rather than pointing the bat at the blocks of the vhd chain,
+ * copy each distinct block once into a store vhd owned by the index and
+ * point every identical block at the same vhdi block.  block hashes are
+ * kept in <index>.hashes so later parents indexed into the same index
+ * share blocks with earlier ones.  each run writes a new store, since
+ * the file table pins the timestamp of every file it references.
+ */
+typedef struct vhdi_dedup_record      vhdi_dedup_record_t;
+typedef struct vhdi_dedup_entry       vhdi_dedup_entry_t;
+typedef struct vhdi_dedup             vhdi_dedup_t;
+
+struct vhdi_dedup_record {
+	uint64_t                      hash;
+	uint32_t                      location;
+	uint32_t                      reserved;
+};
+
+struct vhdi_dedup_entry {
+	uint64_t                      hash;
+	uint32_t                      location;  /* vhdi block, 0 if new */
+	uint32_t                      block;     /* store block, if new */
+	uint32_t                      offset;    /* store sector, if new */
+};
+
+struct vhdi_dedup {
+	vhd_context_t                 vhd;
+	vhd_context_t                 store;
+	vhdi_context_t                vhdi;
+	vhdi_file_table_t             files;
+	char                         *store_path;
+	char                         *hashes_path;
+
+	uint32_t                      spb;
+	uint64_t                      vhd_blocks;
+	uint32_t                      vhd_block_size;
+
+	vhdi_dedup_entry_t           *entries;
+	uint32_t                      n_entries;
+	uint32_t                      n_loaded;
+	uint32_t                      max_entries;
+	uint32_t                      n_stored;
+
+	uint32_t                     *slots;     /* entry + 1, 0 if free */
+	uint32_t                      mask;
+	uint32_t                     *refs;      /* entry + 1, 0 if zero */
+
+	char                         *buf;
+	char                         *cmp;
+
+	uint64_t                      shared;
+	uint64_t                      zero;
+};
+
+static uint64_t
+vhd_index_dedup_hash(const char *buf, size_t size)
+{
+	const uint64_t *w = (const uint64_t *)buf;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(uint64_t); i++) {
+		h ^= w[i];
+		h *= 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+
+	return h;
+}
+
+static int
+vhd_index_dedup_zero(const char *buf, size_t size)
+{
+	const uint64_t *w = (const uint64_t *)buf;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(uint64_t); i++)
+		if (w[i])
+			return 0;
+
+	return 1;
+}
+
+static void
+vhd_index_dedup_insert(vhdi_dedup_t *d, uint32_t idx)
+{
+	uint32_t slot;
+
+	slot = d->entries[idx].hash & d->mask;
+	while (d->slots[slot])
+		slot = (slot + 1) & d->mask;
+
+	d->slots[slot] = idx + 1;
+}
+
+static int
+vhd_index_dedup_read_indexed(vhdi_dedup_t *d, uint32_t location)
+{
+	int i, fd, err;
+	ssize_t ret;
+	size_t size;
+	const char *path;
+	vhdi_block_t block;
+
+	err = vhdi_read_block(&d->vhdi, &block, location);
+	if (err)
+		return err;
+
+	path = NULL;
+	for (i = 0; i < d->files.entries; i++)
+		if (d->files.table[i].file_id == block.table[0].file_id) {
+			path = d->files.table[i].path;
+			break;
+		}
+
+	if (!path) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	fd = open(path, O_RDONLY | O_LARGEFILE);
+	if (fd == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	size = vhd_sectors_to_bytes(d->spb);
+	ret  = pread(fd, d->cmp, size,
+		     vhd_sectors_to_bytes(block.table[0].offset));
+	err  = (ret == size ? 0 : (ret == -1 ? -errno : -EIO));
+	close(fd);
+
+out:
+	free(block.table);
+	return err;
+}
+
+/*
+ * returns the entry holding a copy of d->buf, or -ENOENT
+ */
+static int
+vhd_index_dedup_lookup(vhdi_dedup_t *d, uint64_t hash, uint32_t *_idx)
+{
+	int err;
+	size_t size;
+	uint32_t slot, idx;
+	vhdi_dedup_entry_t *entry;
+
+	size = vhd_sectors_to_bytes(d->spb);
+
+	for (slot = hash & d->mask; d->slots[slot];
+	     slot = (slot + 1) & d->mask) {
+		idx   = d->slots[slot] - 1;
+		entry = d->entries + idx;
+
+		if (entry->hash != hash)
+			continue;
+
+		if (entry->location)
+			err = vhd_index_dedup_read_indexed(d, entry->location);
+		else
+			err = vhd_io_read(&d->store, d->cmp,
+					  (uint64_t)entry->block * d->spb,
+					  d->spb);
+		if (err)
+			return err;
+
+		if (!memcmp(d->buf, d->cmp, size)) {
+			*_idx = idx;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static int
+vhd_index_dedup_load_hashes(vhdi_dedup_t *d)
+{
+	int fd, err;
+	ssize_t ret;
+	vhdi_dedup_record_t rec;
+	vhdi_dedup_entry_t *entry;
+
+	fd = open(d->hashes_path, O_RDONLY | O_LARGEFILE);
+	if (fd == -1)
+		return (errno == ENOENT ? 0 : -errno);
+
+	err = 0;
+
+	for (;;) {
+		ret = read(fd, &rec, sizeof(rec));
+		if (!ret)
+			break;
+
+		if (ret != sizeof(rec)) {
+			err = (ret == -1 ? -errno : -EINVAL);
+			break;
+		}
+
+		BE64_IN(&rec.hash);
+		BE32_IN(&rec.location);
+
+		if (d->n_entries == d->max_entries) {
+			err = -EFBIG;
+			break;
+		}
+
+		entry = d->entries + d->n_entries;
+		entry->hash     = rec.hash;
+		entry->location = rec.location;
+		vhd_index_dedup_insert(d, d->n_entries++);
+	}
+
+	close(fd);
+	return err;
+}
+
+static int
+vhd_index_dedup_save_hashes(vhdi_dedup_t *d)
+{
+	int fd, err;
+	uint32_t i;
+	vhdi_dedup_record_t rec;
+
+	fd = open(d->hashes_path,
+		  O_WRONLY | O_CREAT | O_APPEND | O_LARGEFILE, 0644);
+	if (fd == -1)
+		return -errno;
+
+	err = 0;
+
+	for (i = d->n_loaded; i < d->n_entries; i++) {
+		memset(&rec, 0, sizeof(rec));
+		rec.hash     = d->entries[i].hash;
+		rec.location = d->entries[i].location;
+		BE64_OUT(&rec.hash);
+		BE32_OUT(&rec.location);
+
+		if (write(fd, &rec, sizeof(rec)) != sizeof(rec)) {
+			err = (errno ? -errno : -EIO);
+			break;
+		}
+	}
+
+	if (!err && fsync(fd))
+		err = -errno;
+
+	close(fd);
+	return err;
+}
+
+static int
+vhd_index_dedup_hashes_count(vhdi_dedup_t *d, uint32_t *count)
+{
+	struct stat st;
+
+	*count = 0;
+
+	if (stat(d->hashes_path, &st)) {
+		if (errno == ENOENT)
+			return 0;
+		return -errno;
+	}
+
+	if (st.st_size % sizeof(vhdi_dedup_record_t) ||
+	    st.st_size / sizeof(vhdi_dedup_record_t) >= UINT32_MAX / 4)
+		return -EINVAL;
+
+	*count = st.st_size / sizeof(vhdi_dedup_record_t);
+	return 0;
+}
+
+static int
+vhd_index_dedup_alloc(vhdi_dedup_t *d)
+{
+	int err;
+	void *buf;
+	uint32_t count, slots;
+
+	err = vhd_index_dedup_hashes_count(d, &count);
+	if (err)
+		return err;
+
+	if (d->vhd_blocks >= UINT32_MAX / 4 - count)
+		return -EFBIG;
+
+	d->max_entries = count + d->vhd_blocks;
+	d->entries     = calloc(d->max_entries, sizeof(vhdi_dedup_entry_t));
+	d->refs        = calloc(d->vhd_blocks, sizeof(uint32_t));
+	if (!d->entries || !d->refs)
+		return -ENOMEM;
+
+	for (slots = 1; slots < d->max_entries * 2; slots <<= 1)
+		;
+
+	d->mask  = slots - 1;
+	d->slots = calloc(slots, sizeof(uint32_t));
+	if (!d->slots)
+		return -ENOMEM;
+
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE, d->vhd_block_size);
+	if (err)
+		return -err;
+	d->buf = buf;
+
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE, d->vhd_block_size);
+	if (err)
+		return -err;
+	d->cmp = buf;
+
+	err = vhd_index_dedup_load_hashes(d);
+	d->n_loaded = d->n_entries;
 
 	return err;
 }
 
 static int
-vhd_index_clone_bat(vhdi_name_t *name, const char *parent)
+vhd_index_dedup_store_name(vhdi_name_t *name, vhdi_dedup_t *d)
 {
-	int err;
-	char *pbat = NULL;
-	uint32_t block;
-	vhdi_bat_t bat;
-	vhd_context_t vhd;
-	vhdi_context_t vhdi;
-	vhdi_file_table_t files;
+	int i, err;
+	vhdi_file_id_t max;
 
-	memset(&bat, 0, sizeof(vhdi_bat_t));
-	memset(&files, 0, sizeof(vhdi_file_table_t));
+	max = 0;
+	for (i = 0; i < d->files.entries; i++)
+		max = MAX(max, d->files.table[i].file_id);
 
-	err = asprintf(&pbat, "%s.bat", parent);
+	err = asprintf(&d->store_path, "%s.dedup.%u", name->base, max + 1);
 	if (err == -1) {
-		free(pbat);
+		d->store_path = NULL;
 		return -ENOMEM;
 	}
 
-	err = access(pbat, R_OK);
-	if (err == -1) {
-		free(pbat);
-		return -errno;
-	}
+	if (!access(d->store_path, F_OK))
+		return -EEXIST;
 
-	err = vhdi_open(&vhdi, name->index, O_RDWR);
-	if (err)
-		goto out;
+	return 0;
+}
 
-	err = vhdi_bat_load(pbat, &bat);
-	if (err)
-		goto out_vhdi;
+static int
+vhd_index_dedup_scan(vhdi_dedup_t *d)
+{
+	int err;
+	uint64_t hash;
+	uint32_t block, idx;
+	vhdi_dedup_entry_t *entry;
 
-	err = vhdi_file_table_load(name->files, &files);
-	if (err)
-		goto out_vhdi;
+	for (block = 0; block < d->vhd_blocks; block++) {
+		err = vhd_io_read(&d->vhd, d->buf,
+				  (uint64_t)block * d->spb, d->spb);
+		if (err)
+			return err;
 
-	err = vhdi_bat_create(name->bat, name->vhd, name->index, name->files);
-	if (err)
-		goto out_ft;
+		if (vhd_index_dedup_zero(d->buf, d->vhd_block_size)) {
+			d->zero++;
+			continue;
+		}
 
-	err = vhdi_bat_write(name->bat, &bat);
-	if (err)
-		goto out_ft;
+		hash = vhd_index_dedup_hash(d->buf, d->vhd_block_size);
 
-	err = vhd_open(&vhd, name->vhd, VHD_OPEN_RDONLY);
-	if (err)
-		goto out_ft;
+		err = vhd_index_dedup_lookup(d, hash, &idx);
+		if (!err) {
+			d->refs[block] = idx + 1;
+			d->shared++;
+			continue;
+		}
 
-	err = vhd_get_bat(&vhd);
-	if (err)
-		goto out_vhd;
+		if (err != -ENOENT)
+			return err;
+
+		idx   = d->n_entries++;
+		entry = d->entries + idx;
+		entry->hash  = hash;
+		entry->block = d->n_stored++;
 
-	for (block = 0; block < vhd.bat.entries; block++) {
-		err = vhd_index_clone_bat_entry(name, &vhdi, &bat,
-						&files, &vhd, block);
+		err = vhd_io_write(&d->store, d->buf,
+				   (uint64_t)entry->block * d->spb, d->spb);
 		if (err)
-			goto out_bat;
-	}
+			return err;
 
-	err = vhdi_bat_write(name->bat, &bat);
-	if (err)
-		goto out_bat;
+		err = vhd_offset(&d->store,
+				 (uint64_t)entry->block * d->spb,
+				 &entry->offset);
+		if (err)
+			return err;
 
-	err = 0;
+		vhd_index_dedup_insert(d, idx);
+		d->refs[block] = idx + 1;
+	}
 
-out_bat:
-	vhd_put_bat(&vhd);
-out_vhd:
-	vhd_close(&vhd);
-out_ft:
-	vhdi_file_table_free(&files);
-out_vhdi:
-	vhdi_close(&vhdi);
-out:
-	if (err)
-		unlink(name->bat);
-	free(bat.table);
-	free(pbat);
-	return err;
+	return 0;
 }
 
 static int
-vhd_index_update_bat(vhdi_name_t *name)
+vhd_index_dedup_add_blocks(vhdi_dedup_t *d, vhdi_file_id_t fid)
 {
 	int err;
-	uint32_t block;
-	vhdi_bat_t bat;
-	vhd_context_t vhd;
-	vhdi_context_t vhdi;
-	vhdi_file_table_t files;
-
-	memset(&bat, 0, sizeof(vhdi_bat_t));
-	memset(&files, 0, sizeof(vhdi_file_table_t));
-
-	err = access(name->bat, R_OK);
-	if (err == -1)
-		return -errno;
-
-	err = vhdi_open(&vhdi, name->index, O_RDWR);
-	if (err)
-		goto out;
+	uint32_t i, j;
+	vhdi_block_t block;
+	vhdi_dedup_entry_t *entry;
 
-	err = vhdi_bat_load(name->bat, &bat);
-	if (err)
-		goto out_vhdi;
+	block.entries = d->spb;
+	block.table   = calloc(d->spb, sizeof(vhdi_entry_t));
+	if (!block.table)
+		return -ENOMEM;
 
-	err = vhdi_file_table_load(name->files, &files);
-	if (err)
-		goto out_vhdi;
+	err = 0;
 
-	err = vhd_open(&vhd, name->vhd, VHD_OPEN_RDONLY);
-	if (err)
-		goto out_ft;
+	for (i = d->n_loaded; i < d->n_entries; i++) {
+		entry = d->entries + i;
 
-	err = vhd_get_bat(&vhd);
-	if (err)
-		goto out_vhd;
+		for (j = 0; j < d->spb; j++) {
+			block.table[j].file_id = fid;
+			block.table[j].offset  = entry->offset + j;
+		}
 
-	for (block = 0; block < vhd.bat.entries; block++) {
-		err = vhd_index_update_bat_entry(name, &vhdi, &bat,
-						 &files, &vhd, block);
+		err = vhdi_append_block(&d->vhdi, &block, &entry->location);
 		if (err)
-			goto out_bat;
+			break;
 	}
 
-	err = vhdi_bat_write(name->bat, &bat);
-	if (err)
-		goto out_bat;
-
-	err = 0;
-
-out_bat:
-	vhd_put_bat(&vhd);
-out_vhd:
-	vhd_close(&vhd);
-out_ft:
-	vhdi_file_table_free(&files);
-out_vhdi:
-	vhdi_close(&vhdi);
-out:
-	free(bat.table);
+	free(block.table);
 	return err;
 }
 
 static int
-vhd_index_create(vhdi_name_t *name)
+vhd_index_dedup_write_bat(vhdi_name_t *name, vhdi_dedup_t *d)
 {
 	int err;
-	vhd_context_t ctx;
-	uint32_t block_size;
-
-	if (!access(name->index, F_OK) || !access(name->files, F_OK))
-		return -EEXIST;
+	uint32_t block;
+	vhdi_bat_t bat;
 
-	err = vhd_open(&ctx, name->vhd, VHD_OPEN_RDONLY);
-	if (err)
-		return err;
+	memset(&bat, 0, sizeof(vhdi_bat_t));
 
-	err = vhd_get_header(&ctx);
-	if (err) {
-		vhd_close(&ctx);
-		return err;
-	}
+	bat.vhd_blocks     = d->vhd_blocks;
+	bat.vhd_block_size = d->vhd_block_size;
 
-	block_size = ctx.header.block_size;
-	vhd_close(&ctx);
+	strcpy(bat.vhd_path, name->vhd);
+	strcpy(bat.index_path, name->index);
+	strcpy(bat.file_table_path, name->files);
 
-	err = vhdi_create(name->index, block_size);
-	if (err)
-		goto out;
+	bat.table = calloc(d->vhd_blocks, sizeof(uint32_t));
+	if (!bat.table)
+		return -ENOMEM;
 
-	err = vhdi_file_table_create(name->files);
-	if (err)
-		goto out;
+	for (block = 0; block < d->vhd_blocks; block++)
+		if (d->refs[block])
+			bat.table[block] =
+				d->entries[d->refs[block] - 1].location;
 
-	err = 0;
+	err = vhdi_bat_create(name->bat, name->vhd, name->index, name->files);
+	if (!err)
+		err = vhdi_bat_write(name->bat, &bat);
 
-out:
-	if (err) {
-		unlink(name->index);
-		unlink(name->files);
-	}
+	/* dedup bats don't track the vhd's own bat */
+	if (!err)
+		vhd_index_remove_gen(name);
 
+	free(bat.table);
 	return err;
 }
 
-static int
-vhd_index(vhdi_name_t *name)
+static void
+vhd_index_dedup_free(vhdi_dedup_t *d)
 {
-	char *parent;
-	vhd_context_t ctx;
-	uint64_t vhd_blocks;
-	uint32_t vhd_block_size;
-	int err, new_index, new_bat;
+	vhdi_file_table_free(&d->files);
+	free(d->store_path);
+	free(d->hashes_path);
+	free(d->entries);
+	free(d->slots);
+	free(d->refs);
+	free(d->buf);
+	free(d->cmp);
+}
 
-	parent    = NULL;
-	new_bat   = 0;
-	new_index = 0;
+static int
+vhd_index_dedup(vhdi_name_t *name)
+{
+	int err, new_index, new_bat, new_store, opened;
+	vhdi_file_id_t fid;
+	vhdi_dedup_t d;
 
-	/* find vhd's parent -- we only index read-only vhds */
-	err = vhd_open(&ctx, name->vhd, VHD_OPEN_RDONLY);
-	if (err)
-		return err;
+	memset(&d, 0, sizeof(vhdi_dedup_t));
 
-	err = vhd_parent_locator_get(&ctx, &parent);
-	vhd_close(&ctx);
+	new_bat    = 0;
+	new_store  = 0;
+	new_index  = 0;
+	opened     = 0;
 
+	err = vhd_index_use_parent(name);
 	if (err)
 		return err;
 
-	/* update name to point to parent */
-	free(name->vhd);
-	name->vhd = parent;
-	parent = NULL;
-
-	free(name->bat);
-	name->bat = NULL;
-	err = asprintf(&name->bat, "%s.bat", name->vhd);
-	if (err == -1) {
-		free(name->bat);
-		name->bat = NULL;
-		return -ENOMEM;
-	}
+	/* blocks already indexed in place would have to be rewritten */
+	if (!access(name->bat, F_OK))
+		return -EEXIST;
 
-	/* create index if it doesn't already exist */
 	err = access(name->index, R_OK | W_OK);
 	if (err == -1 && errno == ENOENT) {
 		new_index = 1;
@@ -747,56 +1721,113 @@ vhd_index(vhdi_name_t *name)
 	if (err)
 		return err;
 
-	/* get basic vhd info */
-	err = vhd_open(&ctx, name->vhd, VHD_OPEN_RDONLY);
-	if (err)
+	err = asprintf(&d.hashes_path, "%s.hashes", name->base);
+	if (err == -1) {
+		d.hashes_path = NULL;
+		err = -ENOMEM;
 		goto out;
+	}
 
-	err = vhd_get_header(&ctx);
-	if (err) {
-		vhd_close(&ctx);
+	/* hashes left over from a removed index refer to nothing */
+	if (new_index)
+		unlink(d.hashes_path);
+
+	err = vhd_open(&d.vhd, name->vhd, VHD_OPEN_RDONLY);
+	if (err)
 		goto out;
+
+	err = vhd_get_header(&d.vhd);
+	if (err)
+		goto out_vhd;
+
+	d.vhd_blocks     = d.vhd.header.max_bat_size;
+	d.vhd_block_size = d.vhd.header.block_size;
+	d.spb            = d.vhd.spb;
+
+	err = vhdi_open(&d.vhdi, name->index, O_RDWR);
+	if (err)
+		goto out_vhd;
+	opened = 1;
+
+	if (d.vhdi.vhd_block_size != d.vhd_block_size) {
+		err = -EINVAL;
+		goto out_vhd;
 	}
 
-	vhd_blocks     = ctx.header.max_bat_size;
-	vhd_block_size = ctx.header.block_size;
+	err = vhdi_file_table_load(name->files, &d.files);
+	if (err)
+		goto out_vhd;
 
-	if (vhd_parent_locator_get(&ctx, &parent))
-		parent = NULL;
+	err = vhd_index_dedup_alloc(&d);
+	if (err)
+		goto out_vhd;
 
-	vhd_close(&ctx);
+	err = vhd_index_dedup_store_name(name, &d);
+	if (err)
+		goto out_vhd;
 
-	/* update existing bat if it exists */
-	err = vhd_index_update_bat(name);
-	if (err != -ENOENT)
-		goto out;
+	err = vhd_create_ext(d.store_path,
+			     d.vhd_blocks * d.vhd_block_size,
+			     HD_TYPE_DYNAMIC, 0, d.vhd_block_size, 0);
+	if (err)
+		goto out_vhd;
+	new_store = 1;
 
-	new_bat = 1;
+	err = vhd_open(&d.store, d.store_path, VHD_OPEN_RDWR);
+	if (err)
+		goto out_vhd;
 
-	if (parent) {
-		/* clone parent bat if it exists */
-		err = vhd_index_clone_bat(name, parent);
-		if (err != -ENOENT)
-			goto out;
+	err = vhd_index_dedup_scan(&d);
+	vhd_close(&d.store);
+	if (err)
+		goto out_vhd;
+
+	if (d.n_stored) {
+		/* the store is only registered once it stops changing */
+		err = vhd_index_get_file_id(name, d.store_path,
+					    &d.files, &fid);
+		if (err)
+			goto out_vhd;
+		new_store = 0;
+
+		err = vhd_index_dedup_add_blocks(&d, fid);
+		if (err)
+			goto out_vhd;
 	}
 
-	/* create new bat from scratch */
-	err = vhd_index_add_bat(name, vhd_blocks, vhd_block_size);
+	new_bat = 1;
+	err = vhd_index_dedup_write_bat(name, &d);
 	if (err)
-		goto out;
+		goto out_vhd;
 
-	err = 0;
+	err = vhd_index_dedup_save_hashes(&d);
+	if (err)
+		goto out_vhd;
+
+	printf("%s: %"PRIu64" blocks, %u stored, %"PRIu64" shared, "
+	       "%"PRIu64" zero\n", name->vhd, d.vhd_blocks,
+	       d.n_stored, d.shared, d.zero);
 
+out_vhd:
+	vhd_close(&d.vhd);
 out:
+	if (opened)
+		vhdi_close(&d.vhdi);
 	if (err) {
-		if (new_bat)
+		if (new_bat) {
 			unlink(name->bat);
+			vhd_index_remove_gen(name);
+		}
 		if (new_index) {
 			unlink(name->index);
 			unlink(name->files);
+			if (d.hashes_path)
+				unlink(d.hashes_path);
 		}
 	}
-	free(parent);
+	if (new_store)
+		unlink(d.store_path);
+	vhd_index_dedup_free(&d);
 	return err;
 }
 
@@ -957,21 +1988,31 @@ main(int argc, char *argv[])
 	uint32_t block;
 	vhdi_name_t name;
 	char *vhd, *index;
-	int c, update, summary;
+	int c, update, summary, dedup;
 
 	vhd     = NULL;
 	index   = NULL;
 	block   = (uint32_t)-1;
+	dedup   = 0;
 	update  = 0;
 	summary = 0;
 
-	while ((c = getopt(argc, argv, "i:v:s:b:h")) != -1) {
+	vhd_index_jobs = MIN(sysconf(_SC_NPROCESSORS_ONLN),
+			     VHD_INDEX_MAX_JOBS);
+
+	while ((c = getopt(argc, argv, "i:D:v:s:b:j:fh")) != -1) {
 		switch (c) {
 		case 'i':
 			index   = optarg;
 			update  = 1;
 			break;
 
+		case 'D':
+			index   = optarg;
+			update  = 1;
+			dedup   = 1;
+			break;
+
 		case 'v':
 			vhd     = optarg;
 			break;
@@ -985,6 +2026,17 @@ main(int argc, char *argv[])
 			block   = strtoul(optarg, NULL, 10);
 			break;
 
+		case 'j':
+			vhd_index_jobs = strtol(optarg, NULL, 10);
+			if (vhd_index_jobs < 1 ||
+			    vhd_index_jobs > VHD_INDEX_MAX_JOBS)
+				usage();
+			break;
+
+		case 'f':
+			vhd_index_full = 1;
+			break;
+
 		default:
 			usage();
 		}
@@ -1009,7 +2061,7 @@ main(int argc, char *argv[])
 		if (!vhd)
 			usage();
 
-		err = vhd_index(&name);
+		err = (dedup ? vhd_index_dedup(&name) : vhd_index(&name));
 	}
 
 out:
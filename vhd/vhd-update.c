@@ -46,7 +46,9 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <endian.h>
+#include <libaio.h>
 #include <byteswap.h>
 
 #include "libvhd.h"
@@ -69,88 +71,223 @@ update_creator_version(vhd_journal_t *journal)
 	return vhd_write_footer(&journal->vhd, &journal->vhd.footer);
 }
 
+/*
+ * bitmaps are read and written UPDATE_BATCH at a time with libaio, in
+ * on-disk order, rather than with one synchronous O_DIRECT request each
+ */
+#define UPDATE_BATCH 256
+
+static io_context_t aio;
+
 static int
-journal_bitmaps(vhd_journal_t *journal)
+bitmap_offset_cmp(const void *a, const void *b, void *arg)
 {
-	int i, err;
+	const uint32_t *bat = arg;
+	uint32_t x = bat[*(const uint32_t *)a], y = bat[*(const uint32_t *)b];
 
-	for (i = 0; i < journal->vhd.bat.entries; i++) {
-		err = vhd_journal_add_block(journal, i, VHD_JOURNAL_METADATA);
-		if (err)
-			return err;
-	}
+	return (x > y) - (x < y);
+}
+
+static int
+allocated_blocks(vhd_context_t *vhd, uint32_t **_blocks, int *_n)
+{
+	int i, n, err;
+	uint32_t *blocks;
 
+	err = vhd_get_bat(vhd);
+	if (err)
+		return err;
+
+	blocks = malloc((vhd->bat.entries ? : 1) * sizeof(uint32_t));
+	if (!blocks)
+		return -ENOMEM;
+
+	for (i = 0, n = 0; i < vhd->bat.entries; i++)
+		if (vhd->bat.bat[i] != DD_BLK_UNUSED)
+			blocks[n++] = i;
+
+	qsort_r(blocks, n, sizeof(uint32_t), bitmap_offset_cmp, vhd->bat.bat);
+
+	*_blocks = blocks;
+	*_n      = n;
 	return 0;
 }
 
-/*
- * older VHD bitmaps were little endian
- * and bits within a word were set from right to left
- */
-static inline int
-old_test_bit(int nr, volatile void * addr)
+static int
+bitmap_io(vhd_context_t *vhd, int write,
+	  uint32_t *blocks, int n, char *buf)
 {
-        return (((unsigned long*)addr)[nr/(sizeof(unsigned long)*8)] >>
-                (nr % (sizeof(unsigned long)*8))) & 1;
+	int i, ret, done;
+	size_t size;
+	struct iocb iocbs[UPDATE_BATCH], *piocbs[UPDATE_BATCH];
+	struct io_event events[UPDATE_BATCH];
+
+	size = vhd_sectors_to_bytes(vhd->bm_secs);
+
+	for (i = 0; i < n; i++) {
+		off64_t off = vhd_sectors_to_bytes(vhd->bat.bat[blocks[i]]);
+
+		if (write)
+			io_prep_pwrite(iocbs + i, vhd->fd, buf + i * size,
+				       size, off);
+		else
+			io_prep_pread(iocbs + i, vhd->fd, buf + i * size,
+				      size, off);
+		piocbs[i] = iocbs + i;
+	}
+
+	for (i = 0; i < n; i += ret) {
+		ret = io_submit(aio, n - i, piocbs + i);
+		if (ret <= 0)
+			return (ret ? ret : -EIO);
+	}
+
+	for (done = 0; done < n; done += ret) {
+		ret = io_getevents(aio, 1, n - done, events, NULL);
+		if (ret < 0)
+			return ret;
+
+		for (i = 0; i < ret; i++)
+			if (events[i].res != size)
+				return ((long)events[i].res < 0 ?
+					(long)events[i].res : -EIO);
+	}
+
+	return 0;
 }
 
-/*
- * new VHD bitmaps are big endian
- * and bits within a word are set from left to right
- */
-#define BIT_MASK 0x80
-static inline void
-new_set_bit (int nr, volatile char *addr)
+static int
+journal_bitmaps(vhd_journal_t *journal)
 {
-        addr[nr >> 3] |= (BIT_MASK >> (nr & 7));
+	int i, j, n, err;
+	char *buf;
+	size_t size;
+	uint32_t *blocks;
+	vhd_context_t *vhd = &journal->vhd;
+
+	buf  = NULL;
+	size = vhd_sectors_to_bytes(vhd->bm_secs);
+
+	err = allocated_blocks(vhd, &blocks, &n);
+	if (err)
+		return err;
+
+	err = posix_memalign((void **)&buf, 4096, UPDATE_BATCH * size);
+	if (err) {
+		free(blocks);
+		return -err;
+	}
+
+	err = vhd_journal_begin(journal);
+	if (err)
+		goto out;
+
+	for (i = 0; i < n; i += UPDATE_BATCH) {
+		int batch = MIN(n - i, UPDATE_BATCH);
+
+		err = bitmap_io(vhd, 0, blocks + i, batch, buf);
+		if (err)
+			break;
+
+		for (j = 0; j < batch; j++) {
+			err = vhd_journal_add_bitmap(journal, blocks[i + j],
+						     buf + j * size);
+			if (err)
+				break;
+		}
+		if (err)
+			break;
+	}
+
+	if (err)
+		vhd_journal_end(journal);
+	else
+		err = vhd_journal_end(journal);
+
+out:
+	free(buf);
+	free(blocks);
+	return err;
 }
 
+/*
+ * older VHD bitmaps were written on little endian hosts, with bits set
+ * from right to left within each word, so sector n was bit n % 8 of
+ * byte n / 8 counting from the least significant bit.  new VHD bitmaps
+ * count from the most significant bit, so converting is a bit reversal
+ * of every byte, done here eight bytes to a word.
+ */
 static void
 convert_bitmap(char *in, char *out, int bytes)
 {
 	int i;
+	uint64_t x;
+
+	for (i = 0; i + sizeof(x) <= bytes; i += sizeof(x)) {
+		memcpy(&x, in + i, sizeof(x));
+		x = ((x >> 1) & 0x5555555555555555ULL) |
+			((x & 0x5555555555555555ULL) << 1);
+		x = ((x >> 2) & 0x3333333333333333ULL) |
+			((x & 0x3333333333333333ULL) << 2);
+		x = ((x >> 4) & 0x0f0f0f0f0f0f0f0fULL) |
+			((x & 0x0f0f0f0f0f0f0f0fULL) << 4);
+		memcpy(out + i, &x, sizeof(x));
+	}
 
-	memset(out, 0, bytes);
-
-	for (i = 0; i < bytes << 3; i++)
-		if (old_test_bit(i, (void *)in))
-			new_set_bit(i, out);
+	for (; i < bytes; i++) {
+		uint8_t c = in[i];
+		c = ((c >> 1) & 0x55) | ((c & 0x55) << 1);
+		c = ((c >> 2) & 0x33) | ((c & 0x33) << 2);
+		out[i] = (c >> 4) | (c << 4);
+	}
 }
 
 static int
 update_vhd(vhd_journal_t *journal, int rollback)
 {
-	int i, err;
+	int i, j, n, err;
 	size_t size;
-	char *buf;
-	void *converted;
+	char *buf, *converted;
+	uint32_t *blocks;
+	vhd_context_t *vhd = &journal->vhd;
 
 	buf       = NULL;
 	converted = NULL;
+	size      = vhd_sectors_to_bytes(vhd->bm_secs);
 
-	size = vhd_bytes_padded(journal->vhd.spb / 8);
-	err  = posix_memalign(&converted, 512, size);
+	err = allocated_blocks(vhd, &blocks, &n);
+	if (err)
+		return err;
+
+	err = posix_memalign((void **)&buf, 4096, UPDATE_BATCH * size);
+	if (err) {
+		buf = NULL;
+		err = -err;
+		goto out;
+	}
+
+	err = posix_memalign((void **)&converted, 4096, UPDATE_BATCH * size);
 	if (err) {
 		converted = NULL;
+		err = -err;
 		goto out;
 	}
 
-	for (i = 0; i < journal->vhd.bat.entries; i++) {
-		if (journal->vhd.bat.bat[i] == DD_BLK_UNUSED)
-			continue;
+	for (i = 0; i < n; i += UPDATE_BATCH) {
+		int batch = MIN(n - i, UPDATE_BATCH);
 
-		err = vhd_read_bitmap(&journal->vhd, i, &buf);
+		err = bitmap_io(vhd, 0, blocks + i, batch, buf);
 		if (err)
 			goto out;
 
 		if (rollback)
-			memcpy(converted, buf, size);
+			memcpy(converted, buf, batch * size);
 		else
-			convert_bitmap(buf, converted, size);
+			for (j = 0; j < batch; j++)
+				convert_bitmap(buf + j * size,
+					       converted + j * size, size);
 
-		free(buf);
-
-		err = vhd_write_bitmap(&journal->vhd, i, converted);
+		err = bitmap_io(vhd, 1, blocks + i, batch, converted);
 		if (err)
 			goto out;
 	}
@@ -158,6 +295,8 @@ update_vhd(vhd_journal_t *journal, int rollback)
 	err = 0;
  out:
 	free(converted);
+	free(buf);
+	free(blocks);
 	return err;
 }
 
@@ -165,8 +304,17 @@ static int
 open_journal(vhd_journal_t *journal, const char *file, const char *jfile)
 {
 	int err;
+	char *path = NULL;
+
+	/* vhd_journal_create() needs a name even for a new journal */
+	if (!jfile) {
+		if (asprintf(&path, "%s.journal", file) == -1)
+			return -ENOMEM;
+		jfile = path;
+	}
 
 	err = vhd_journal_create(journal, file, jfile);
+	free(path);
 	if (err) {
 		printf("error creating journal for %s: %d\n", file, err);
 		return err;
@@ -243,8 +391,15 @@ main(int argc, char **argv)
 		goto out;
 	}
 
+	err = io_setup(UPDATE_BATCH, &aio);
+	if (err) {
+		printf("failed to set up aio: %d\n", err);
+		goto out;
+	}
+
 	err = journal_bitmaps(&journal);
 	if (err) {
+		io_destroy(aio);
 		/* no changes to vhd file yet,
 		 * so close the journal and bail */
 		vhd_journal_close(&journal);
@@ -266,6 +421,8 @@ main(int argc, char **argv)
 	err = 0;
 
 out:
+	if (aio)
+		io_destroy(aio);
 	err = close_journal(&journal, err);
 	return err;
 }
@@ -69,6 +69,8 @@ struct command commands[] = {
 	{ .name = "revert",      .func = vhd_util_revert        },
 	{ .name = "key",         .func = vhd_util_key           },
 	{ .name = "copy",        .func = vhd_util_copy          },
+	{ .name = "compress",    .func = vhd_util_compress      },
+	{ .name = "clone",       .func = vhd_util_clone         },
 };
 
 #define print_commands()					\